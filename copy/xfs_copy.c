@@ -19,9 +19,13 @@
 #include "libxfs.h"
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <aio.h>
+#include <sys/time.h>
+#include "xfs_metadump.h"
 #include "xfs_copy.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
@@ -32,6 +36,7 @@ extern int	platform_check_ismounted(char *, char *, struct stat64 *, int);
 int		logfd;
 char 		*logfile_name;
 FILE		*logerr;
+FILE		*outf;		/* stderr if stdout is a target */
 char		LOGFILE_NAME[] = "/var/tmp/xfs_copy.log.XXXXXX";
 
 char		*source_name;
@@ -47,8 +52,18 @@ __uint64_t	barcount[11];
 unsigned int	num_targets;
 target_control	*target;
 
-wbuf		w_buf;
-wbuf		btree_buf;
+xfs_agnumber_t	num_ags;
+xfs_agnumber_t	next_agno;	/* next AG for a reader to copy */
+ag_scan_t	*ag_scans;	/* used space of each AG */
+pthread_cond_t	scan_cond = PTHREAD_COND_INITIALIZER;	/* AG scanned or taken */
+
+int		wblocks;	/* basic blocks per data buffer */
+int		wbuf_miniosize;
+int		wbuf_align;
+
+__uint64_t	numblocks;	/* progress so far */
+int		howfar;
+pthread_mutex_t	progress_lock = PTHREAD_MUTEX_INITIALIZER;
 
 pid_t		parent_pid;
 unsigned int	kids;
@@ -56,17 +71,47 @@ unsigned int	kids;
 thread_control	glob_masks;
 thread_args	*targ;
 
-pthread_mutex_t	mainwait;
+#define NUM_WBUFS	8	/* minimum data buffers in the ring */
+#define MAX_QUEUE_DEPTH	64
+
+int		queue_depth = 4;	/* writes in flight per target */
+
+#define MAX_READERS	64
+
+int		num_readers = 1;	/* threads reading the source */
+
+int		sparse_output;		/* leave zeroes as holes in files */
+size_t		sparse_unit;		/* granularity of the zero checks */
+
+char		*crc_name;		/* sidecar of incremental copies */
+int		crc_fd = -1;
+crc_header_t	*crc_hdr;
+__uint32_t	*crc_map;		/* crcs of the last copy */
+xfs_off_t	crc_units;
+int		incremental;		/* the targets hold the last copy */
+
+int		verify;			/* read the copies back */
+int		verify_size;		/* bytes per read */
+int		verify_align;
+xfs_off_t	log_start, log_end;	/* rewritten after the copy */
+xfs_off_t	ag_bytes;
+int		duplicate;		/* keep the source UUID (-d) */
+
+#define TAIL_LOG	3		/* log head, body and end */
+size_t		tail_unit;		/* alignment of the targets' own writes */
+char		*zero_buf;		/* for zeroing the logs */
+size_t		zero_len;
+#define MAX_MISMATCH_MSGS	10
 
 #define ACTIVE		1
 #define INACTIVE	2
 
-xfs_off_t write_log_trailer(int fd, wbuf *w, xfs_mount_t *mp);
-xfs_off_t write_log_header(int fd, wbuf *w, xfs_mount_t *mp);
+void tail_ag_header(xfs_mount_t *mp, xfs_agnumber_t agno, wbuf *buf,
+		ag_header_t *ag);
 
 /* general purpose message reporting routine */
 
-#define OUT	0x01		/* use stdout stream */
+#define OUT	0x01		/* use stdout stream, unless it's a target */
 #define ERR	0x02		/* use stderr stream */
 #define LOG	0x04		/* use logerr stream */
 #define PRE	0x08		/* append strerror string */
@@ -92,7 +137,7 @@ do_message(int flags, int code, const char *fmt, ...)
 		va_end(ap);
 	} else if (flags & OUT) {
 		va_start(ap, fmt);
-		vfprintf(stdout, fmt, ap);
+		vfprintf(outf, fmt, ap);
 		va_end(ap);
 	}
 
@@ -143,13 +188,15 @@ check_errors(void)
 			do_log("    %s -- ", target[i].name);
 			if (target[i].err_type == 0)
 				do_log(_("write error"));
-			else
+			else if (target[i].err_type == 1)
 				do_log(_("lseek64 error"));
+			else
+				do_log(_("verify error"));
 			do_log(_(" at offset %lld\n"), target[i].position);
 		}
 	}
 	if (first_error == 0)  {
-		fprintf(stdout, _("All copies completed.\n"));
+		fprintf(outf, _("All copies completed.\n"));
 		fflush(NULL);
 	} else  {
 		fprintf(stderr, _("See \"%s\" for more details.\n"),
@@ -158,60 +205,421 @@ check_errors(void)
 	}
 }
 
+static int
+is_zero(char *p, size_t len)
+{
+	static const char	zero[16];
+
+	if (len < sizeof(zero))
+		return memcmp(p, zero, len) == 0;
+	return memcmp(p, zero, sizeof(zero)) == 0 &&
+	       memcmp(p, p + sizeof(zero), len - sizeof(zero)) == 0;
+}
+
+/* a crc of 0 in the sidecar means the unit hasn't been copied */
+static __uint32_t
+unit_crc(char *p, size_t len)
+{
+	__uint32_t	crc = crc32c(~0U, p, len);
+
+	return crc ? crc : 1;
+}
+
 /*
- * don't have to worry about alignment and mins because those
- * are taken care of when the buffer's read in
+ * Work out which sparse_units of a freshly read buffer the targets can
+ * skip, and record the new crcs for the incremental copies.  The primary
+ * superblock is always written so that the copy is marked in progress.
  */
-int
-do_write(thread_args *args)
+static void
+scan_wbuf(wbuf *buf)
 {
-	int	res, error = 0;
+	__uint32_t	*cp = NULL;
+	__uint32_t	crc;
+	xfs_off_t	unit;
+	size_t		off, len;
+	int		u;
+
+	if (crc_map && buf->position % sparse_unit == 0)
+		cp = &crc_map[buf->position / sparse_unit];
+
+	for (u = 0, off = 0; off < buf->length; u++, off += sparse_unit)  {
+		len = MIN(sparse_unit, buf->length - off);
+		buf->skip[u] = 0;
+		if (sparse_output && is_zero(buf->data + off, len))
+			buf->skip[u] |= SKIP_ZERO;
+
+		unit = (buf->position + off) / sparse_unit;
+		if (!cp || len != sparse_unit || unit >= crc_units)
+			continue;
+		crc = unit_crc(buf->data + off, len);
+		if (cp[u] == crc && unit != 0)
+			buf->skip[u] |= SKIP_SAME;
+		else
+			cp[u] = crc;
+	}
+}
 
-	if (target[args->id].position != w_buf.position)  {
-		if (lseek64(args->fd, w_buf.position, SEEK_SET) < 0)  {
-			error = target[args->id].err_type = 1;
-		} else  {
-			target[args->id].position = w_buf.position;
+/*
+ * Find the runs of sparse_units in a buffer that a target has to write.
+ * Returns the number of runs, but stops counting at two, and the extent
+ * of the first one.
+ */
+static int
+wbuf_runs(wbuf *buf, int mask, size_t *start, size_t *end)
+{
+	size_t		off;
+	int		u, runs = 0, in_run = 0;
+
+	for (u = 0, off = 0; off < buf->length; u++, off += sparse_unit)  {
+		if (buf->skip[u] & mask)  {
+			in_run = 0;
+			continue;
+		}
+		if (in_run)  {
+			*end = MIN(off + sparse_unit, buf->length);
+			continue;
+		}
+		if (++runs > 1)
+			break;
+		in_run = 1;
+		*start = off;
+		*end = MIN(off + sparse_unit, buf->length);
+	}
+	return runs;
+}
+
+/*
+ * Write the runs of a buffer a target can't skip, preallocating them in
+ * sparse files.  Returns the length of the buffer or -1 with errno set.
+ */
+static ssize_t
+write_runs(target_control *tp, int fd, wbuf *buf, int mask)
+{
+	size_t		off, end;
+	ssize_t		res;
+	int		u, v;
+
+	for (u = 0, off = 0; off < buf->length; u = v, off = end)  {
+		for (v = u; off < buf->length && (buf->skip[v] & mask);
+		     v++, off += sparse_unit)
+			;
+		if (off >= buf->length)
+			break;
+		for (end = off; end < buf->length && !(buf->skip[v] & mask);
+		     v++, end += sparse_unit)
+			;
+		end = MIN(end, buf->length);
+
+		if (tp->sparse)
+			platform_preallocate(fd, buf->position + off,
+					end - off);
+		res = pwrite64(fd, buf->data + off, end - off,
+				buf->position + off);
+		if (res < 0)
+			return -1;
+		if (res != end - off)  {
+			errno = EIO;
+			return -1;
 		}
 	}
+	return buf->length;
+}
 
-	if ((res = write(target[args->id].fd, w_buf.data,
-				w_buf.length)) == w_buf.length)  {
-		target[args->id].position += res;
-	} else  {
-		error = 2;
+static int
+write_all(int fd, char *p, size_t len)
+{
+	ssize_t		res;
+
+	while (len > 0)  {
+		res = write(fd, p, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)  {
+			if (res == 0)
+				errno = EIO;
+			return -1;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/*
+ * A metablock shorter than the maximum ends the stream, so they only go
+ * out full until the copy is done.
+ */
+static int
+stream_flush(target_control *tp)
+{
+	stream_t	*st = tp->stream;
+	size_t		hdr_size = 1 << st->blocklog;
+
+	st->mb->mb_count = cpu_to_be16(st->count);
+	if (write_all(tp->fd, (char *)st->mb, hdr_size +
+			((size_t)st->count << st->blocklog)) < 0)
+		return -1;
+	st->count = 0;
+	memset(st->index, 0, hdr_size - sizeof(xfs_metablock_t));
+	return 0;
+}
+
+static int
+stream_write(target_control *tp, char *data, xfs_off_t pos, size_t len)
+{
+	stream_t	*st = tp->stream;
+	size_t		bsize = 1 << st->blocklog;
+
+	if ((pos | len) & (bsize - 1))  {
+		errno = EINVAL;
+		return -1;
+	}
+	for (; len > 0; pos += bsize, data += bsize, len -= bsize)  {
+		st->index[st->count] = cpu_to_be64(pos >> BBSHIFT);
+		memcpy(st->data + ((size_t)st->count << st->blocklog), data,
+				bsize);
+		if (++st->count == st->max_count && stream_flush(tp) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+void
+stream_init(target_control *tp, xfs_mount_t *mp)
+{
+	stream_t	*st;
+	size_t		bsize = mp->m_sb.sb_blocksize;
+
+	st = calloc(1, sizeof(stream_t));
+	if (st == NULL)  {
+		do_log(_("Couldn't allocate stream\n"));
+		die_perror();
+	}
+	st->blocklog = mp->m_sb.sb_blocklog;
+	st->max_count = (bsize - sizeof(xfs_metablock_t)) / sizeof(__be64);
+	st->mb = calloc(st->max_count + 1, bsize);
+	if (st->mb == NULL)  {
+		do_log(_("Couldn't allocate stream buffer\n"));
+		die_perror();
+	}
+	st->mb->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+	st->mb->mb_blocklog = st->blocklog;
+	st->index = (__be64 *)(st->mb + 1);
+	st->data = (char *)st->mb + bsize;
+	tp->stream = st;
+}
+
+/*
+ * Write out a target's own writes, once the ring has been.  The zeroes
+ * are skipped in sparse files, which are all holes to begin with.
+ */
+static int
+write_tail(thread_args *args)
+{
+	target_control	*tp = &target[args->id];
+	tail_write_t	*tw;
+	xfs_off_t	pos, end;
+	size_t		len;
+	ssize_t		res;
+	char		*data;
+
+	for (tw = args->tail; tw < args->tail + args->num_tail; tw++)  {
+		if (!tw->length || (!tw->data && tp->sparse))
+			continue;
+		end = tw->position + tw->length;
+		for (pos = tw->position; pos < end; pos += len)  {
+			if (tw->data)  {
+				data = tw->data;
+				len = tw->length;
+			} else  {
+				data = zero_buf;
+				len = MIN(end - pos, zero_len);
+			}
+			tp->position = pos;
+			if (tp->stream)
+				res = stream_write(tp, data, pos, len) < 0 ?
+					-1 : len;
+			else
+				res = pwrite64(args->fd, data, len, pos);
+			if (res < 0)
+				return -1;
+			if (res != len)  {
+				errno = EIO;
+				return -1;
+			}
+		}
+		tp->position = end;
+	}
+	return 0;
+}
+
+/* called with glob_masks.mutex held */
+static void
+release_wbuf(wbuf *buf)
+{
+	if (--buf->num_writers == 0)  {
+		buf->seq += glob_masks.num_bufs;
+		pthread_cond_broadcast(&glob_masks.written);
 	}
+}
+
+static wbuf *
+ring_wbuf(unsigned long seq)
+{
+	return &glob_masks.buffers[seq % glob_masks.num_bufs];
+}
 
+/*
+ * Wait for a queued write to finish.  Returns the number of bytes written
+ * or -1 with errno set.
+ */
+static ssize_t
+wait_write(struct aiocb *cb)
+{
+	const struct aiocb	*list[1] = { cb };
+	int			error;
+
+	while ((error = aio_error(cb)) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
 	if (error) {
-		target[args->id].error = errno;
-		target[args->id].position = w_buf.position;
+		aio_return(cb);
+		errno = error;
+		return -1;
 	}
-	return error;
+	return aio_return(cb);
 }
 
+/*
+ * Each target thread keeps up to queue_depth writes of consecutive ring
+ * buffers in flight, and hands a buffer back once its write has finished.
+ * Writes that can't be queued are done synchronously instead, and so are
+ * the writes of buffers with parts that the target skips in the middle.
+ * Once the last buffer is written the thread does the target's own writes
+ * and exits.
+ */
 void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	target_control	*tp = &target[args->id];
+	struct aiocb	*cbs;
+	ssize_t		*sync_res;
+	struct aiocb	*cb;
+	unsigned long	queued = args->next;	/* next wbuf to submit */
+	unsigned long	head;
+	wbuf		*buf;
+	ssize_t		res;
+	size_t		start, end;
+	int		mask = tp->sparse ? SKIP_ZERO | SKIP_SAME : SKIP_SAME;
+
+	cbs = calloc(queue_depth, sizeof(*cbs));
+	sync_res = calloc(queue_depth, sizeof(*sync_res));
+	if (!cbs || !sync_res) {
+		tp->error = ENOMEM;
+		goto handle_error;
+	}
 
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args))
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (args->next == glob_masks.head && !glob_masks.done)
+			pthread_cond_wait(&glob_masks.queued, &glob_masks.mutex);
+		head = glob_masks.head;
+		pthread_mutex_unlock(&glob_masks.mutex);
+		if (args->next == head)
+			break;		/* the ring is done */
+
+		for (; queued != head && queued - args->next < queue_depth;
+		     queued++) {
+			buf = ring_wbuf(queued);
+			cb = &cbs[queued % queue_depth];
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_fildes = args->fd;
+			cb->aio_buf = buf->data;
+			cb->aio_nbytes = buf->length;
+			cb->aio_offset = buf->position;
+			sync_res[queued % queue_depth] = 0;
+			if (tp->stream) {
+				cb->aio_fildes = -1;
+				res = stream_write(tp, buf->data,
+						buf->position, buf->length);
+				sync_res[queued % queue_depth] =
+					res < 0 ? -errno : buf->length;
+				continue;
+			}
+			if (buf->skip) {
+				if (wbuf_runs(buf, mask, &start, &end) != 1) {
+					cb->aio_fildes = -1;
+					res = write_runs(tp, args->fd, buf, mask);
+					sync_res[queued % queue_depth] =
+						res < 0 ? -errno : res;
+					continue;
+				}
+				cb->aio_buf = buf->data + start;
+				cb->aio_nbytes = end - start;
+				cb->aio_offset = buf->position + start;
+				if (tp->sparse)
+					platform_preallocate(args->fd,
+						cb->aio_offset, cb->aio_nbytes);
+			}
+			if (aio_write(cb) < 0) {
+				cb->aio_fildes = -1;
+				res = pwrite64(args->fd, buf->data,
+						buf->length, buf->position);
+				sync_res[queued % queue_depth] =
+					res < 0 ? -errno : res;
+			}
+		}
+
+		/* reap the oldest write */
+		buf = ring_wbuf(args->next);
+		cb = &cbs[args->next % queue_depth];
+		if (cb->aio_fildes >= 0) {
+			res = wait_write(cb);
+			if (res == cb->aio_nbytes)
+				res = buf->length;
+		} else {
+			res = sync_res[args->next % queue_depth];
+			if (res < 0) {
+				errno = -res;
+				res = -1;
+			}
+		}
+		if (res != buf->length) {
+			tp->error = res < 0 ? errno : EIO;
+			tp->position = buf->position;
 			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
+		}
+		tp->position = buf->position + res;
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		args->next++;
+		release_wbuf(buf);
 		pthread_mutex_unlock(&glob_masks.mutex);
 	}
-	/* NOTREACHED */
+
+	if (write_tail(args) == 0)  {
+		free(cbs);
+		free(sync_res);
+		return NULL;
+	}
+	tp->error = errno;
 
 handle_error:
 	/* error will be logged by primary thread */
 
+	/* the buffers can't be reused until the device is done with them */
+	while (queued > args->next + 1) {
+		cb = &cbs[--queued % queue_depth];
+		if (cb->aio_fildes >= 0)
+			wait_write(cb);
+	}
+	free(cbs);
+	free(sync_res);
+
 	pthread_mutex_lock(&glob_masks.mutex);
-	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
+	tp->state = INACTIVE;
+	for (; args->next != glob_masks.head; args->next++)
+		release_wbuf(ring_wbuf(args->next));
 	pthread_mutex_unlock(&glob_masks.mutex);
 	pthread_exit(NULL);
 	return NULL;
@@ -283,7 +691,8 @@ void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-bdV] [-L logfile] source target [target ...]\n"),
+		_("Usage: %s [-bcdSV] [-i crcfile] [-L logfile] [-q depth] "
+		  "[-r readers] [-s chunksize] source target [target ...]\n"),
 		progname);
 	exit(1);
 }
@@ -315,19 +724,27 @@ bump_bar(int tenths, __uint64_t numblocks)
 	};
 
 	if (tenths > 10)  {
-		printf("%s", bar[10]);
-		fflush(stdout);
+		fprintf(outf, "%s", bar[10]);
+		fflush(outf);
 	} else  {
 		while (tenths < 10 && numblocks > barcount[tenths])  {
-			printf("%s", bar[tenths]);
-			fflush(stdout);
+			fprintf(outf, "%s", bar[tenths]);
+			fflush(outf);
 			tenths++;
 		}
 	}
 	return tenths;
 }
 
-static xfs_off_t source_position = -1;
+/* called by the readers as they go, so serialise the bar */
+void
+add_progress(__uint64_t blocks)
+{
+	pthread_mutex_lock(&progress_lock);
+	numblocks += blocks;
+	howfar = bump_bar(howfar, numblocks);
+	pthread_mutex_unlock(&progress_lock);
+}
 
 wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
@@ -345,11 +762,14 @@ wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 	return buf;
 }
 
+/*
+ * Several threads read the source at once, so this reads at the buffer's
+ * position rather than wherever the file offset happens to be.
+ */
 void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
 	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
 
@@ -362,17 +782,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek64(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			do_warn(_("%s:  lseek64 failure at offset %lld\n"),
-				progname, source_position);
-			die_perror();
-		}
-		source_position = buf->position;
-	}
-
-	ASSERT(source_position % source_sectorsize == 0);
+	ASSERT(buf->position % source_sectorsize == 0);
 
 	/* round up length for direct I/O if necessary */
 
@@ -385,18 +795,17 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		exit(1);
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	if ((res = pread64(fd, buf->data, buf->length, buf->position)) < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
-				progname, source_position);
+				progname, buf->position);
 		die_perror();
 	}
 
 	if (res < buf->length &&
-	    source_position + res == mp->m_sb.sb_dblocks * source_blocksize)
+	    buf->position + res == mp->m_sb.sb_dblocks * source_blocksize)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -447,24 +856,660 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
+/*
+ * Take the next buffer in the ring to read into.  It may still be being
+ * written by the slowest target, so this waits for it.
+ */
+wbuf *
+get_wbuf(void)
+{
+	unsigned long	seq;
+	wbuf		*buf;
+
+	pthread_mutex_lock(&glob_masks.mutex);
+	seq = glob_masks.reserved++;
+	buf = ring_wbuf(seq);
+	while (buf->seq != seq)
+		pthread_cond_wait(&glob_masks.written, &glob_masks.mutex);
+	pthread_mutex_unlock(&glob_masks.mutex);
+	return buf;
+}
+
+/*
+ * Hand a buffer that has been read in over to the targets.  The readers
+ * fill their buffers in any order, but the targets only see them in ring
+ * order, so the head moves past every buffer that is ready in a row.
+ */
+void
+put_wbuf(wbuf *buf)
+{
+	wbuf		*next;
+	int		active = 0;
+	int		i;
+
+	if (buf->skip)
+		scan_wbuf(buf);
+
+	pthread_mutex_lock(&glob_masks.mutex);
+	for (i = 0; i < num_targets; i++)
+		if (target[i].state != INACTIVE)
+			active++;
+
+	buf->ready = 1;
+	while ((next = ring_wbuf(glob_masks.head))->ready)  {
+		next->ready = 0;
+		next->num_writers = active;
+		if (!active)
+			next->seq += glob_masks.num_bufs;
+		glob_masks.head++;
+	}
+	pthread_cond_broadcast(&glob_masks.queued);
+	pthread_cond_broadcast(&glob_masks.written);
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
+
+/*
+ * Copy size bytes (sizeb basic blocks before rounding) starting at daddr
+ * begin, one ring buffer at a time.
+ */
+static void
+copy_range(xfs_mount_t *mp, xfs_daddr_t begin, __uint64_t size,
+	__uint64_t sizeb)
+{
+	xfs_off_t	pos = (xfs_off_t) begin << BBSHIFT;
+	__uint64_t	blocks;
+	wbuf		*buf;
+
+	while (size > 0)  {
+		buf = get_wbuf();
+		buf->position = pos;
+
+		/*
+		 * let lower layer do alignment
+		 */
+		if (size > buf->size)  {
+			buf->length = buf->size;
+			size -= buf->size;
+			sizeb -= wblocks;
+			blocks = wblocks;
+		} else  {
+			buf->length = size;
+			blocks = sizeb;
+			size = 0;
+		}
+
+		read_wbuf(source_fd, buf, mp);
+		pos = buf->position + buf->length;
+		put_wbuf(buf);
+
+		add_progress(blocks);
+	}
+}
+
+static void
+scan_add(ag_scan_t *scan, xfs_daddr_t begin, __uint64_t sizeb)
+{
+	ag_range_t	*r;
+
+	if (scan->count == scan->max)  {
+		scan->max = scan->max ? scan->max * 2 : 64;
+		r = realloc(scan->ranges, scan->max * sizeof(ag_range_t));
+		if (r == NULL)  {
+			do_log(_("Couldn't allocate extent list\n"));
+			die_perror();
+		}
+		scan->ranges = r;
+	}
+	r = &scan->ranges[scan->count++];
+	r->begin = begin;
+	r->sizeb = sizeb;
+
+	/* round size up to ensure we copy a range bigger than required */
+	r->size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
+}
+
+/*
+ * Find the used space of one AG by walking the leaves of its by-block
+ * freespace btree.
+ */
+static void
+scan_ag(xfs_mount_t *mp, wbuf *btree_buf, xfs_agnumber_t agno,
+	ag_scan_t *scan)
+{
+	xfs_agf_t	*agf;
+	uint		btree_levels, current_level;
+	xfs_agblock_t	bno;
+	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
+	struct xfs_btree_block *block;
+	xfs_alloc_ptr_t	*ptr;
+	xfs_alloc_rec_t	*rec_ptr;
+	xfs_off_t	pos;
+	int		i;
+
+	/* the agf follows the superblock */
+
+	pos = (xfs_off_t)XFS_AG_DADDR(mp, agno, XFS_SB_DADDR) << BBSHIFT;
+	btree_buf->position = pos + source_sectorsize;
+	btree_buf->length = source_sectorsize;
+	read_wbuf(source_fd, btree_buf, mp);
+	agf = (xfs_agf_t *)(btree_buf->data + pos + source_sectorsize -
+			btree_buf->position);
+	if (be32_to_cpu(agf->agf_magicnum) != XFS_AGF_MAGIC)  {
+		do_log(_("Bad AGF magic 0x%x in AG %u\n"),
+			be32_to_cpu(agf->agf_magicnum), agno);
+		exit(1);
+	}
+
+	/* align first data copy but don't overwrite ag header */
+
+	next_begin = roundup(pos + first_agbno * source_blocksize,
+			(xfs_off_t)wbuf_miniosize) >> BBSHIFT;
+	ag_begin = next_begin;
+
+	/* traverse btree until we get to the leftmost leaf node */
+
+	bno = be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNOi]);
+	current_level = 0;
+	btree_levels = be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNOi]);
+
+	ag_end = XFS_AGB_TO_DADDR(mp, agno,
+			be32_to_cpu(agf->agf_length) - 1)
+			+ source_blocksize / BBSIZE;
+
+	for (;;) {
+		if (current_level >= btree_levels) {
+			do_log(
+		_("Error: current level %d >= btree levels %d\n"),
+				current_level, btree_levels);
+			exit(1);
+		}
+
+		current_level++;
+
+		btree_buf->position = pos = (xfs_off_t)
+			XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
+		btree_buf->length = source_blocksize;
+
+		read_wbuf(source_fd, btree_buf, mp);
+		block = (struct xfs_btree_block *)
+			 ((char *)btree_buf->data + pos - btree_buf->position);
+
+		if (be32_to_cpu(block->bb_magic) !=
+		    (xfs_sb_version_hascrc(&mp->m_sb) ?
+		     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
+			do_log(_("Bad btree magic 0x%x\n"),
+			        be32_to_cpu(block->bb_magic));
+			exit(1);
+		}
+
+		if (be16_to_cpu(block->bb_level) == 0)
+			break;
+
+		ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+		bno = be32_to_cpu(ptr[0]);
+	}
+
+	/* handle the rest of the ag */
+
+	for (;;) {
+		if (be16_to_cpu(block->bb_level) != 0)  {
+			do_log(
+		_("WARNING:  source filesystem inconsistent.\n"));
+			do_log(
+		_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
+			exit(1);
+		}
+
+		rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs);
+						i++, rec_ptr++)  {
+			/* calculate in daddr's */
+
+			begin = next_begin;
+
+			/*
+			 * protect against pathological case of a
+			 * hole right after the ag header in a
+			 * mis-aligned case
+			 */
+
+			if (begin < ag_begin)
+				begin = ag_begin;
+
+			new_begin = XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(rec_ptr->ar_startblock));
+			if (new_begin > begin)
+				scan_add(scan, begin, new_begin - begin);
+
+			/* round next starting point down */
+
+			new_begin = XFS_AGB_TO_DADDR(mp, agno,
+					be32_to_cpu(rec_ptr->ar_startblock) +
+				 	be32_to_cpu(rec_ptr->ar_blockcount));
+			next_begin = rounddown(new_begin,
+					wbuf_miniosize >> BBSHIFT);
+		}
+
+		if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
+			break;
+
+		/* read in next btree record block */
+
+		btree_buf->position = pos = (xfs_off_t)
+			XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
+					block->bb_u.s.bb_rightsib)) << BBSHIFT;
+		btree_buf->length = source_blocksize;
+
+		/* let read_wbuf handle alignment */
+
+		read_wbuf(source_fd, btree_buf, mp);
+
+		block = (struct xfs_btree_block *)
+			 ((char *) btree_buf->data + pos - btree_buf->position);
+
+		ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC);
+	}
+
+	/*
+	 * write out range of used blocks after last range
+	 * of free blocks in AG
+	 */
+	if (next_begin < ag_end)
+		scan_add(scan, next_begin, ag_end - next_begin);
+}
+
+/*
+ * The freespace btrees are walked on a thread of their own, so that the
+ * readers only ever wait on the data they copy, not on btree blocks.  It
+ * keeps up to num_readers AGs ahead of the readers, so the lists of
+ * ranges don't pile up.
+ */
+void *
+begin_ag_scanner(void *arg)
+{
+	scanner_args	*sc = arg;
+	xfs_agnumber_t	agno;
+	int		done;
+
+	for (agno = 0; agno < num_ags; agno++)  {
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (agno >= next_agno + num_readers && !sc->done)
+			pthread_cond_wait(&scan_cond, &glob_masks.mutex);
+		done = sc->done;
+		pthread_mutex_unlock(&glob_masks.mutex);
+		if (done)
+			break;
+
+		scan_ag(sc->mp, &sc->btree_buf, agno, &ag_scans[agno]);
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		ag_scans[agno].ready = 1;
+		pthread_cond_broadcast(&scan_cond);
+		pthread_mutex_unlock(&glob_masks.mutex);
+	}
+	return NULL;
+}
+
+/*
+ * Copy the header of one AG, and then its used space once the scanner
+ * has found it.
+ */
+static void
+copy_ag(xfs_mount_t *mp, xfs_agnumber_t agno)
+{
+	ag_scan_t	*scan = &ag_scans[agno];
+	ag_range_t	*r;
+	wbuf		*buf;
+	ag_header_t	ag_hdr;
+
+	/* read in first blocks of the ag */
+
+	buf = get_wbuf();
+	read_ag_header(source_fd, agno, buf, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+	tail_ag_header(mp, agno, buf, &ag_hdr);
+
+	/* set the in_progress bit for the first AG */
+
+	if (agno == 0)
+		ag_hdr.xfs_sb->sb_inprogress = 1;
+
+	ASSERT(buf->position % source_sectorsize == 0);
+
+	/* write the ag header out */
+
+	put_wbuf(buf);
+
+	pthread_mutex_lock(&glob_masks.mutex);
+	while (!scan->ready)
+		pthread_cond_wait(&scan_cond, &glob_masks.mutex);
+	pthread_mutex_unlock(&glob_masks.mutex);
+
+	for (r = scan->ranges; r < scan->ranges + scan->count; r++)
+		copy_range(mp, r->begin, r->size, r->sizeb);
+	free(scan->ranges);
+	scan->ranges = NULL;
+}
+
+/* source reader thread, copies AGs until there are none left */
+void *
+begin_ag_reader(void *arg)
+{
+	reader_args	*rd = arg;
+	xfs_mount_t	*mp = rd->mp;
+	xfs_agnumber_t	agno;
+
+	for (;;)  {
+		pthread_mutex_lock(&glob_masks.mutex);
+		agno = next_agno++;
+		pthread_cond_broadcast(&scan_cond);
+		pthread_mutex_unlock(&glob_masks.mutex);
+
+		if (agno >= num_ags || kids == 0)
+			break;
+		copy_ag(mp, agno);
+	}
+	return NULL;
+}
+
+/*
+ * Open the sidecar file of an incremental copy and see whether it
+ * describes a completed copy of this source.
+ */
+void
+crc_open(xfs_mount_t *mp)
+{
+	crc_header_t	hdr;
+
+	crc_fd = open(crc_name, O_RDWR|O_CREAT, 0600);
+	if (crc_fd < 0)  {
+		do_log(_("%s:  couldn't open crc file \"%s\"\n"),
+			progname, crc_name);
+		die_perror();
+	}
+	if (pread64(crc_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return;
+
+	if (hdr.magic != CRC_MAGIC || hdr.version != CRC_VERSION ||
+	    !uuid_equal(&hdr.uuid, &mp->m_sb.sb_uuid) ||
+	    hdr.dblocks != mp->m_sb.sb_dblocks ||
+	    hdr.blocksize != mp->m_sb.sb_blocksize ||
+	    hdr.num_targets != num_targets)  {
+		do_out(_("crc file \"%s\" is for a different copy, "
+			 "copying everything\n"), crc_name);
+		return;
+	}
+	if (!hdr.clean)  {
+		do_out(_("last copy with crc file \"%s\" did not complete, "
+			 "copying everything\n"), crc_name);
+		return;
+	}
+	incremental = 1;
+}
+
+/*
+ * Make sure a target still holds the copy the sidecar was made for, as far
+ * as its superblock can tell, and remember its UUID.  Copies with new UUIDs
+ * of filesystems without CRCs can't be told apart from other filesystems
+ * of the same geometry.
+ */
+int
+check_target(xfs_mount_t *mp, target_control *tp, int duplicate)
+{
+	xfs_dsb_t	*dsb;
+	uuid_t		*meta_uuid;
+	long long	size;
+	int		sectsize;
+	int		fd;
+	int		ok = 0;
+
+	dsb = malloc(source_sectorsize);
+	if (!dsb)  {
+		do_log(_("Couldn't allocate superblock buffer\n"));
+		die_perror();
+	}
+	fd = open(tp->name, O_RDONLY);
+	if (fd < 0)
+		goto out;
+	platform_findsizes(tp->name, fd, &size, &sectsize);
+	if (size < mp->m_sb.sb_dblocks * (source_blocksize / BBSIZE))
+		goto out;
+
+	if (pread64(fd, dsb, source_sectorsize, 0) != source_sectorsize ||
+	    be32_to_cpu(dsb->sb_magicnum) != XFS_SB_MAGIC ||
+	    be64_to_cpu(dsb->sb_dblocks) != mp->m_sb.sb_dblocks ||
+	    be32_to_cpu(dsb->sb_blocksize) != mp->m_sb.sb_blocksize)
+		goto out;
+
+	if (duplicate)  {
+		if (!uuid_equal(&dsb->sb_uuid, &mp->m_sb.sb_uuid))
+			goto out;
+	} else if (xfs_sb_version_hascrc(&mp->m_sb))  {
+		/* the metadata is still stamped with the source's UUID */
+		meta_uuid = (be32_to_cpu(dsb->sb_features_incompat) &
+			     XFS_SB_FEAT_INCOMPAT_META_UUID) ?
+			    &dsb->sb_meta_uuid : &dsb->sb_uuid;
+		if (!uuid_equal(meta_uuid, &mp->m_sb.sb_meta_uuid))
+			goto out;
+	}
+
+	platform_uuid_copy(&tp->uuid, &dsb->sb_uuid);
+	ok = 1;
+out:
+	if (fd >= 0)
+		close(fd);
+	free(dsb);
+	return ok;
+}
+
+/*
+ * Map the crcs now that the unit size is known, starting afresh unless the
+ * targets hold the last copy.  The sidecar is marked clean again once the
+ * copy has completed.
+ */
+void
+crc_map_init(xfs_mount_t *mp)
+{
+	size_t		len;
+	void		*p;
+
+	if (incremental)  {
+		crc_header_t	hdr;
+
+		if (pread64(crc_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    hdr.unit != sparse_unit)  {
+			do_out(_("crc file \"%s\" has a different unit size, "
+				 "copying everything\n"), crc_name);
+			incremental = 0;
+		}
+	}
+
+	crc_units = mp->m_sb.sb_dblocks * source_blocksize / sparse_unit;
+	len = sizeof(crc_header_t) + crc_units * sizeof(__uint32_t);
+	if ((!incremental && ftruncate64(crc_fd, 0) < 0) ||
+	    ftruncate64(crc_fd, len) < 0)  {
+		do_log(_("%s:  couldn't size crc file \"%s\"\n"),
+			progname, crc_name);
+		die_perror();
+	}
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, crc_fd, 0);
+	if (p == MAP_FAILED)  {
+		do_log(_("%s:  couldn't map crc file \"%s\"\n"),
+			progname, crc_name);
+		die_perror();
+	}
+	crc_hdr = p;
+	crc_map = (__uint32_t *)(crc_hdr + 1);
+
+	crc_hdr->magic = CRC_MAGIC;
+	crc_hdr->version = CRC_VERSION;
+	crc_hdr->unit = sparse_unit;
+	crc_hdr->clean = 0;
+	platform_uuid_copy(&crc_hdr->uuid, &mp->m_sb.sb_uuid);
+	crc_hdr->dblocks = mp->m_sb.sb_dblocks;
+	crc_hdr->blocksize = mp->m_sb.sb_blocksize;
+	crc_hdr->num_targets = num_targets;
+	if (msync(crc_hdr, sizeof(*crc_hdr), MS_SYNC) < 0)  {
+		do_log(_("%s:  couldn't write crc file \"%s\"\n"),
+			progname, crc_name);
+		die_perror();
+	}
+}
+
+/* all targets hold this copy now */
+void
+crc_map_done(void)
+{
+	size_t		len;
+
+	len = sizeof(crc_header_t) + crc_units * sizeof(__uint32_t);
+	if (msync(crc_hdr, len, MS_SYNC) == 0)  {
+		crc_hdr->clean = 1;
+		if (msync(crc_hdr, sizeof(*crc_hdr), MS_SYNC) < 0)
+			crc_hdr->clean = 0;
+	}
+	if (!crc_hdr->clean)
+		do_log(_("%s:  couldn't write crc file \"%s\", the next "
+			 "copy will copy everything.\n"), progname, crc_name);
+	munmap(crc_hdr, len);
+	close(crc_fd);
+}
+
+/*
+ * The AG headers and, with new UUIDs, the log are written again after the
+ * copy, so the crcs taken while copying don't describe them.
+ */
+static int
+unit_rewritten(xfs_off_t unit)
+{
+	xfs_off_t	pos = unit * sparse_unit;
+
+	if (pos % ag_bytes < (xfs_off_t)first_agbno * source_blocksize)
+		return 1;
+	return pos + sparse_unit > log_start && pos < log_end;
+}
+
+static void
+verify_run(thread_args *args, char *buf, xfs_off_t first, int count)
+{
+	target_control	*tp = &target[args->id];
+	xfs_off_t	pos = first * sparse_unit;
+	size_t		len = count * sparse_unit;
+	int		i;
+
+	if (pread64(args->fd, buf, len, pos) != len)  {
+		tp->error = errno ? errno : EIO;
+		tp->position = pos;
+		tp->err_type = 2;
+		tp->state = INACTIVE;
+		return;
+	}
+	for (i = 0; i < count; i++)  {
+		if (unit_crc(buf + i * sparse_unit, sparse_unit) ==
+		    crc_map[first + i])
+			continue;
+		if (tp->mismatches++ == 0)
+			tp->position = pos + i * sparse_unit;
+		if (tp->mismatches <= MAX_MISMATCH_MSGS)
+			do_warn(_("%s:  target \"%s\" differs at offset %lld\n"),
+				progname, tp->name,
+				(long long)(pos + i * sparse_unit));
+	}
+	tp->verified += len;
+}
+
+/* read back everything the copy wrote to a target, in big runs */
+void *
+begin_verify(void *arg)
+{
+	thread_args	*args = arg;
+	target_control	*tp = &target[args->id];
+	struct timeval	start, end;
+	xfs_off_t	unit, first = 0;
+	int		count = 0;
+	int		max_count = verify_size / sparse_unit;
+	char		*buf;
+
+	buf = memalign(verify_align, verify_size);
+	if (buf == NULL)  {
+		tp->error = ENOMEM;
+		tp->err_type = 2;
+		tp->state = INACTIVE;
+		return NULL;
+	}
+
+	/* the writes have to be on the device, not just in the cache */
+	fsync(args->fd);
+	posix_fadvise(args->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	gettimeofday(&start, NULL);
+	for (unit = 0; unit < crc_units && tp->state != INACTIVE; unit++)  {
+		if (crc_map[unit] && !unit_rewritten(unit))  {
+			if (count == 0)
+				first = unit;
+			if (++count < max_count)
+				continue;
+		} else if (count == 0)  {
+			continue;
+		}
+		verify_run(args, buf, first, count);
+		count = 0;
+	}
+	if (count && tp->state != INACTIVE)
+		verify_run(args, buf, first, count);
+	gettimeofday(&end, NULL);
+
+	tp->verify_secs = (end.tv_sec - start.tv_sec) +
+			  (end.tv_usec - start.tv_usec) / 1000000.0;
+	if (tp->mismatches && tp->state != INACTIVE)  {
+		tp->err_type = 2;
+		tp->state = INACTIVE;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* verify all the targets that can be read back at once */
 void
-write_wbuf(void)
+verify_targets(void)
 {
+	target_control	*tp;
+	pthread_t	*pids;
+	int		*started;
 	int		i;
 
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
-
-	/* release target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
+	pids = calloc(num_targets, sizeof(pthread_t));
+	started = calloc(num_targets, sizeof(int));
+	if (pids == NULL || started == NULL)  {
+		do_log(_("Couldn't allocate verify threads\n"));
+		die_perror();
+	}
 
-	sigrelse(SIGCHLD);
-	pthread_mutex_lock(&mainwait);
-	sighold(SIGCHLD);
+	for (i = 0; i < num_targets; i++)  {
+		tp = &target[i];
+		if (tp->stream || tp->state == INACTIVE)
+			continue;
+		if (pthread_create(&pids[i], NULL, begin_verify, &targ[i]))  {
+			do_log(_("Error creating verify thread for target %d\n"),
+				i);
+			die_perror();
+		}
+		started[i] = 1;
+	}
+	for (i = 0; i < num_targets; i++)  {
+		tp = &target[i];
+		if (!started[i])
+			continue;
+		pthread_join(pids[i], NULL);
+		do_out(_("Verified %s: %llu MiB in %.1f seconds (%.1f MiB/s), "
+			 "%llu blocks differ\n"), tp->name,
+			(unsigned long long)(tp->verified >> 20),
+			tp->verify_secs, tp->verify_secs ?
+				(tp->verified >> 20) / tp->verify_secs : 0.0,
+			(unsigned long long)tp->mismatches);
+	}
+	free(pids);
+	free(started);
 }
 
 void
@@ -498,38 +1543,200 @@ sb_update_uuid(
 							 XFS_SB_CRC_OFF);
 }
 
+/*
+ * xfs_mdrestore(8) wants the primary superblock first, and writes that
+ * copy of it again once it's done, so it has to be the final one.
+ */
+void
+stream_start(target_control *tp, thread_args *tcarg, xfs_sb_t *sb, int align)
+{
+	ag_header_t	ag_hdr = { NULL };
+	char		*p;
+
+	p = memalign(align, source_blocksize);
+	if (p == NULL)  {
+		do_log(_("Couldn't allocate superblock buffer\n"));
+		die_perror();
+	}
+	if (pread64(source_fd, p, source_blocksize, 0) != source_blocksize)  {
+		do_log(_("%s:  read failure at offset 0\n"), progname);
+		die_perror();
+	}
+	ag_hdr.xfs_sb = (xfs_dsb_t *)p;
+	sb_update_uuid(sb, &ag_hdr, tcarg);
+	if (stream_write(tp, p, 0, source_blocksize) < 0)  {
+		do_log(_("%s:  couldn't start stream\n"), progname);
+		die_perror();
+	}
+	free(p);
+}
+
+/*
+ * Besides the ring, which every target writes out the same, each target
+ * has writes of its own: its superblocks with its UUID and, unless the
+ * UUID is kept, a clean log made out to that UUID.  They are all made up
+ * front, the superblocks by the readers as they come across them, and each
+ * target's thread writes its own after the last ring buffer, so the copy
+ * never waits on them.  The superblocks go last and backwards, so that the
+ * primary one is only marked complete once everything else is in place.
+ */
+static void *
+tail_alloc(size_t len)
+{
+	void		*p;
+
+	p = memalign(wbuf_align, len);
+	if (p == NULL)  {
+		do_log(_("Couldn't allocate rewrite buffer\n"));
+		die_perror();
+	}
+	return p;
+}
+
+static void
+tail_read(char *p, size_t len, xfs_off_t pos)
+{
+	if (pread64(source_fd, p, len, pos) != len)  {
+		do_log(_("%s:  read failure at offset %lld\n"),
+			progname, (long long)pos);
+		die_perror();
+	}
+}
+
+static char *
+next_log_block(char *p, int offset, void *private)
+{
+	return p + offset;
+}
+
+void
+tail_init(xfs_mount_t *mp)
+{
+	thread_args	*tcarg;
+	tail_write_t	*tw;
+	xfs_off_t	logstart, logend, head_pos, trail_pos;
+	size_t		head_len, hdr_len;
+	char		*head, *trailer = NULL;
+	int		version;
+	int		i;
+
+	tail_unit = MAX(wbuf_miniosize, source_blocksize);
+	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
+		tcarg->num_tail = TAIL_LOG + num_ags;
+		tcarg->tail = calloc(tcarg->num_tail, sizeof(tail_write_t));
+		if (tcarg->tail == NULL)  {
+			do_log(_("Couldn't allocate rewrite list\n"));
+			die_perror();
+		}
+	}
+	if (duplicate)
+		return;
+
+	logstart = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart) << BBSHIFT;
+	logend = logstart + XFS_FSB_TO_B(mp, mp->m_sb.sb_logblocks);
+	version = xfs_sb_version_haslogv2(&mp->m_sb) ? 2 : 1;
+	hdr_len = BBTOB(MAX(2, (version == 2 && mp->m_sb.sb_logsunit) ?
+				BTOBB(mp->m_sb.sb_logsunit) : 1));
+
+	/* whatever shares the first and last units with the log is kept */
+	head_pos = rounddown(logstart, (xfs_off_t)tail_unit);
+	head_len = roundup(logstart - head_pos + hdr_len, tail_unit);
+	head = tail_alloc(head_len);
+	memset(head, 0, head_len);
+	if (logstart != head_pos)
+		tail_read(head, tail_unit, head_pos);
+
+	trail_pos = rounddown(logend, (xfs_off_t)tail_unit);
+	if (logend != trail_pos)  {
+		trailer = tail_alloc(tail_unit);
+		tail_read(trailer, tail_unit, trail_pos);
+		memset(trailer, 0, logend - trail_pos);
+	}
+
+	zero_len = roundup(1 << 20, tail_unit);
+	zero_buf = tail_alloc(zero_len);
+	memset(zero_buf, 0, zero_len);
+
+	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
+		tw = tcarg->tail;
+		tw[0].position = head_pos;
+		tw[0].length = head_len;
+		tw[0].data = tail_alloc(head_len);
+		memcpy(tw[0].data, head, head_len);
+		libxfs_log_header(tw[0].data + (logstart - head_pos),
+				&tcarg->uuid, version, mp->m_sb.sb_logsunit,
+				XLOG_FMT, next_log_block, NULL);
+
+		tw[1].position = head_pos + head_len;
+		if (trail_pos > tw[1].position)
+			tw[1].length = trail_pos - tw[1].position;
+
+		if (trailer)  {
+			tw[2].position = trail_pos;
+			tw[2].length = tail_unit;
+			tw[2].data = trailer;
+		}
+	}
+	free(head);
+}
+
+/*
+ * Make every target's copy of the block holding the superblock of an AG
+ * the readers have just read the header of.
+ */
+void
+tail_ag_header(xfs_mount_t *mp, xfs_agnumber_t agno, wbuf *buf,
+		ag_header_t *ag)
+{
+	ag_header_t	ag_hdr = { NULL };
+	tail_write_t	*tw;
+	xfs_off_t	sb_pos, pos;
+	size_t		len;
+	int		i;
+
+	/* the UUID stays, only the in-progress flag has to be cleared */
+	if (duplicate && agno != 0)
+		return;
+
+	sb_pos = buf->position + ((char *)ag->xfs_sb - buf->data);
+	pos = rounddown(sb_pos, (xfs_off_t)tail_unit);
+	len = roundup(sb_pos + source_sectorsize, tail_unit) - pos;
+	ASSERT(pos >= buf->position &&
+	       pos + len <= buf->position + buf->length);
+
+	for (i = 0; i < num_targets; i++)  {
+		tw = &targ[i].tail[TAIL_LOG + num_ags - 1 - agno];
+		tw->data = tail_alloc(len);
+		memcpy(tw->data, buf->data + (pos - buf->position), len);
+		ag_hdr.xfs_sb = (xfs_dsb_t *)(tw->data + (sb_pos - pos));
+		if (agno == 0)
+			ag_hdr.xfs_sb->sb_inprogress = 0;
+		sb_update_uuid(&mp->m_sb, &ag_hdr, &targ[i]);
+		tw->position = pos;
+		tw->length = len;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
 	int		i, j;
-	int		howfar = 0;
 	int		open_flags;
-	xfs_off_t	pos, end_pos;
-	size_t		length;
 	int		c;
-	__uint64_t	size, sizeb;
-	__uint64_t	numblocks = 0;
-	int		wblocks = 0;
 	int		num_threads = 0;
 	struct dioattr	d;
 	int		wbuf_size;
-	int		wbuf_align;
-	int		wbuf_miniosize;
 	int		source_is_file = 0;
 	int		buffered_output = 0;
-	int		duplicate = 0;
-	uint		btree_levels, current_level;
-	ag_header_t	ag_hdr;
+	long long	chunk_size = 0;
+	int		num_bufs;
+	char		*p;
 	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
 	xfs_buf_t	*sbp;
 	xfs_sb_t	*sb;
-	xfs_agnumber_t	num_ags, agno;
-	xfs_agblock_t	bno;
-	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
-	struct xfs_btree_block *block;
-	xfs_alloc_ptr_t	*ptr;
-	xfs_alloc_rec_t	*rec_ptr;
+	reader_args	*readers;
+	scanner_args	scanner = { 0 };
 	extern char	*optarg;
 	extern int	optind;
 	libxfs_init_t	xargs;
@@ -542,17 +1749,66 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "bdL:V")) != EOF)  {
+	while ((c = getopt(argc, argv, "bcdi:L:q:r:s:SV")) != EOF)  {
 		switch (c) {
 		case 'b':
 			buffered_output = 1;
 			break;
+		case 'c':
+			verify = 1;
+			break;
 		case 'd':
 			duplicate = 1;
 			break;
+		case 'i':
+			crc_name = optarg;
+			break;
 		case 'L':
 			logfile_name = optarg;
 			break;
+		case 'q':
+			queue_depth = strtol(optarg, &p, 0);
+			if (*p != '\0' || queue_depth < 1 ||
+			    queue_depth > MAX_QUEUE_DEPTH)  {
+				fprintf(stderr, _("%s: queue depth must be "
+					"between 1 and %d\n"),
+					progname, MAX_QUEUE_DEPTH);
+				usage();
+			}
+			break;
+		case 'r':
+			num_readers = strtol(optarg, &p, 0);
+			if (*p != '\0' || num_readers < 1 ||
+			    num_readers > MAX_READERS)  {
+				fprintf(stderr, _("%s: number of readers must "
+					"be between 1 and %d\n"),
+					progname, MAX_READERS);
+				usage();
+			}
+			break;
+		case 's':
+			chunk_size = strtoll(optarg, &p, 0);
+			switch (*p) {
+			case 'g': case 'G':
+				chunk_size <<= 10;
+				/* fall through */
+			case 'm': case 'M':
+				chunk_size <<= 10;
+				/* fall through */
+			case 'k': case 'K':
+				chunk_size <<= 10;
+				p++;
+			}
+			if (*p != '\0' || chunk_size < 64 * 1024 ||
+			    chunk_size > 64 * 1024 * 1024)  {
+				fprintf(stderr, _("%s: chunk size must be "
+					"between 64k and 64m\n"), progname);
+				usage();
+			}
+			break;
+		case 'S':
+			sparse_output = 1;
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -594,13 +1850,24 @@ main(int argc, char **argv)
 		do_log(_("Couldn't allocate target array\n"));
 		die_perror();
 	}
+	outf = stdout;
 	for (i = 0; optind < argc; i++, optind++)  {
+		if (strcmp(argv[optind], "-") == 0)  {
+			if (outf != stdout)  {
+				do_log(_("%s: only one target can be "
+					 "standard output\n"), progname);
+				exit(1);
+			}
+			outf = stderr;
+		}
 		target[i].name = argv[optind];
 		target[i].fd = -1;
 		target[i].position = -1;
 		target[i].state = INACTIVE;
 		target[i].error = 0;
 		target[i].err_type = 0;
+		target[i].sparse = 0;
+		target[i].stream = NULL;
 	}
 
 	parent_pid = getpid();
@@ -624,6 +1891,9 @@ main(int argc, char **argv)
 	if (S_ISREG(statbuf.st_mode))
 		source_is_file = 1;
 
+	if (!chunk_size)
+		chunk_size = 1 * 1024 * 1024;
+
 	if (source_is_file && platform_test_xfs_fd(source_fd))  {
 		if (fcntl(source_fd, F_SETFL, open_flags | O_DIRECT) < 0)  {
 			do_log(_("%s: Cannot set direct I/O flag on \"%s\".\n"),
@@ -637,13 +1907,13 @@ main(int argc, char **argv)
 		}
 
 		wbuf_align = d.d_mem;
-		wbuf_size = MIN(d.d_maxiosz, 1 * 1024 * 1024);
+		wbuf_size = MIN(d.d_maxiosz, chunk_size);
 		wbuf_miniosize = d.d_miniosz;
 	} else  {
 		/* set arbitrary I/O params, miniosize at least 1 disk block */
 
 		wbuf_align = getpagesize();
-		wbuf_size = 1 * 1024 * 1024;
+		wbuf_size = chunk_size;
 		wbuf_miniosize = -1;	/* set after mounting source fs */
 	}
 
@@ -733,6 +2003,25 @@ main(int argc, char **argv)
 	}
 
 	first_agbno = XFS_AGFL_BLOCK(mp) + 1;
+	ag_bytes = (xfs_off_t)mp->m_sb.sb_agblocks * source_blocksize;
+	if (!duplicate)  {
+		log_start = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart) << BBSHIFT;
+		log_end = log_start + XFS_FSB_TO_B(mp, mp->m_sb.sb_logblocks);
+	}
+
+	/* only copy what changed if the targets hold the last copy */
+
+	if (crc_name)  {
+		crc_open(mp);
+		for (i = 0; i < num_targets && incremental; i++)  {
+			if (!check_target(mp, &target[i], duplicate))  {
+				do_out(_("%s is not the last copy, "
+					 "copying everything\n"),
+					target[i].name);
+				incremental = 0;
+			}
+		}
+	}
 
 	/* now open targets */
 
@@ -741,6 +2030,18 @@ main(int argc, char **argv)
 	for (i = 0; i < num_targets; i++)  {
 		int	write_last_block = 0;
 
+		if (strcmp(target[i].name, "-") == 0)  {
+			if (isatty(STDOUT_FILENO))  {
+				do_log(_("%s:  cannot write a stream to a "
+					 "terminal\n"), progname);
+				exit(1);
+			}
+			target[i].fd = STDOUT_FILENO;
+			stream_init(&target[i], mp);
+			signal(SIGPIPE, SIG_IGN);
+			continue;
+		}
+
 		if (stat64(target[i].name, &statbuf) < 0)  {
 			/* ok, assume it's a file and create it */
 
@@ -751,7 +2052,8 @@ main(int argc, char **argv)
 				open_flags |= O_DIRECT;
 			write_last_block = 1;
 		} else if (S_ISREG(statbuf.st_mode))  {
-			open_flags |= O_TRUNC;
+			if (!incremental)
+				open_flags |= O_TRUNC;
 			if (!buffered_output)
 				open_flags |= O_DIRECT;
 			write_last_block = 1;
@@ -779,6 +2081,9 @@ main(int argc, char **argv)
 		}
 
 		if (write_last_block)  {
+			/* a freshly sized file reads back as zeroes */
+			target[i].sparse = sparse_output && !incremental;
+
 			/* ensure regular files are correctly sized */
 
 			if (ftruncate64(target[i].fd, mp->m_sb.sb_dblocks *
@@ -804,50 +2109,130 @@ main(int argc, char **argv)
 		} else  {
 			char	*lb[XFS_MAX_SECTORSIZE] = { NULL };
 			off64_t	off;
+			long long size;
+			int	sectsize;
 
-			/* ensure device files are sufficiently large */
+			/*
+			 * ensure device files are sufficiently large, the
+			 * size of the last copy has been checked already
+			 */
 
 			off = mp->m_sb.sb_dblocks * source_blocksize;
 			off -= sizeof(lb);
-			if (pwrite64(target[i].fd, lb, sizeof(lb), off) < 0)  {
+			if (!incremental &&
+			    pwrite64(target[i].fd, lb, sizeof(lb), off) < 0)  {
 				do_log(_("%s:  failed to write last block\n"),
 					progname);
 				do_log(_("\tIs target \"%s\" too small?\n"),
 					target[i].name);
 				die_perror();
 			}
+
+			/*
+			 * Keep the copy out of the page cache, it is
+			 * never going to be read back through it.
+			 */
+			if (!buffered_output &&
+			    fcntl(target[i].fd, F_SETFL, O_RDWR | O_DIRECT) == 0)  {
+				platform_findsizes(target[i].name,
+						target[i].fd, &size, &sectsize);
+				wbuf_miniosize = MAX(sectsize, wbuf_miniosize);
+			}
 		}
 	}
 
 	/* initialize locks and bufs */
 
-	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0)  {
+	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.queued, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.written, NULL) != 0)  {
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
+	glob_masks.head = 0;
+	glob_masks.reserved = 0;
+
+	/* a stream carries whole filesystem blocks, so I/O goes in those */
+	for (i = 0; i < num_targets; i++)
+		if (target[i].stream)
+			wbuf_miniosize = MAX(wbuf_miniosize, source_blocksize);
+
+	/* the I/O sizes must stay aligned for direct I/O */
+	wbuf_size = rounddown(wbuf_size, wbuf_miniosize);
+	sparse_unit = MAX(source_blocksize, wbuf_miniosize);
+
+	/* only look for zeroes if there's a file to leave holes in */
+	for (i = 0, sparse_output = 0; i < num_targets; i++)
+		sparse_output |= target[i].sparse;
+
+	if (crc_name)  {
+		crc_map_init(mp);
+	} else if (verify)  {
+		crc_units = mp->m_sb.sb_dblocks * source_blocksize / sparse_unit;
+		crc_map = calloc(crc_units, sizeof(__uint32_t));
+		if (crc_map == NULL)  {
+			do_log(_("Couldn't allocate verify crcs\n"));
+			die_perror();
+		}
+	}
 
-	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
+	/*
+	 * enough buffers to keep every target's queue full while reading,
+	 * on top of the one each reader is filling
+	 */
+	num_bufs = MAX(NUM_WBUFS, 2 * queue_depth) + num_readers - 1;
+	glob_masks.buffers = calloc(num_bufs, sizeof(wbuf));
+	if (glob_masks.buffers == NULL)  {
+		do_log(_("Couldn't allocate wbuf ring\n"));
+		die_perror();
+	}
+	if (wbuf_init(&glob_masks.buffers[0], wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
 		do_log(_("Error initializing wbuf 0\n"));
 		die_perror();
 	}
+	wbuf_size = glob_masks.buffers[0].size;
+	verify_size = wbuf_size;
+	verify_align = wbuf_align;
+
+	/* make do with a shorter ring if memory is tight */
+	for (i = 1; i < num_bufs; i++)  {
+		if (wbuf_init(&glob_masks.buffers[i], wbuf_size, wbuf_align,
+					wbuf_miniosize, i) == NULL)
+			break;
+		if (glob_masks.buffers[i].size != wbuf_size)  {
+			free(glob_masks.buffers[i].data);
+			break;
+		}
+	}
+	glob_masks.num_bufs = i;
+	for (i = 0; i < glob_masks.num_bufs; i++)  {
+		glob_masks.buffers[i].seq = i;
+		if (!sparse_output && !crc_map)
+			continue;
+		glob_masks.buffers[i].skip = malloc(wbuf_size / sparse_unit + 1);
+		if (glob_masks.buffers[i].skip == NULL)  {
+			do_log(_("Couldn't allocate skip map\n"));
+			die_perror();
+		}
+	}
 
 	wblocks = wbuf_size / BBSIZE;
 
-	if (wbuf_init(&btree_buf, MAX(source_blocksize, wbuf_miniosize),
-				wbuf_align, wbuf_miniosize, 1) == NULL)  {
-		do_log(_("Error initializing btree buf 1\n"));
+	if ((readers = calloc(num_readers, sizeof(reader_args))) == NULL)  {
+		do_log(_("Couldn't allocate reader array\n"));
 		die_perror();
 	}
-
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
+	for (i = 0; i < num_readers; i++)  {
+		readers[i].id = i;
+		readers[i].mp = mp;
+	}
+	scanner.mp = mp;
+	if (wbuf_init(&scanner.btree_buf, MAX(source_blocksize, wbuf_miniosize),
+			wbuf_align, wbuf_miniosize, 0) == NULL)  {
+		do_log(_("Error initializing btree buf\n"));
 		die_perror();
-		exit(1);
 	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
 
 	/* set up sigchild signal handler */
 
@@ -863,20 +2248,20 @@ main(int argc, char **argv)
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
-		if (!duplicate)
+		if (incremental)
+			platform_uuid_copy(&tcarg->uuid, &target[i].uuid);
+		else if (!duplicate)
 			platform_uuid_generate(&tcarg->uuid);
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
-
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
-			die_perror();
-			exit(1);
-		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
+		tcarg->next = 0;
+		if (target[i].stream)
+			stream_start(&target[i], tcarg, sb, wbuf_align);
 	}
 
+	num_ags = mp->m_sb.sb_agcount;
+	tail_init(mp);
+
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
 		tcarg->id = i;
 		tcarg->fd = target[i].fd;
@@ -895,352 +2280,74 @@ main(int argc, char **argv)
 
 	/* set up statistics */
 
-	num_ags = mp->m_sb.sb_agcount;
-
 	init_bar(mp->m_sb.sb_blocksize / BBSIZE
 			* ((__uint64_t)mp->m_sb.sb_dblocks
 			    - (__uint64_t)mp->m_sb.sb_fdblocks + 10 * num_ags));
 
 	kids = num_targets;
 
-	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
-		/* read in first blocks of the ag */
-
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
-			source_blocksize, source_sectorsize);
-
-		/* set the in_progress bit for the first AG */
-
-		if (agno == 0)
-			ag_hdr.xfs_sb->sb_inprogress = 1;
-
-		/* save what we need (agf) in the btree buffer */
-
-		memmove(btree_buf.data, ag_hdr.xfs_agf, source_sectorsize);
-		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
-		btree_buf.length = source_blocksize;
-
-		/* write the ag header out */
-
-		write_wbuf();
-
-		/* traverse btree until we get to the leftmost leaf node */
-
-		bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
-		current_level = 0;
-		btree_levels = be32_to_cpu(ag_hdr.xfs_agf->
-						agf_levels[XFS_BTNUM_BNOi]);
-
-		ag_end = XFS_AGB_TO_DADDR(mp, agno,
-				be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
-				+ source_blocksize / BBSIZE;
-
-		for (;;) {
-			/* none of this touches the w_buf buffer */
-
-			if (current_level >= btree_levels) {
-				do_log(
-			_("Error: current level %d >= btree levels %d\n"),
-					current_level, btree_levels);
-				exit(1);
-			}
-
-			current_level++;
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			read_wbuf(source_fd, &btree_buf, mp);
-			block = (struct xfs_btree_block *)
-				 ((char *)btree_buf.data +
-				  pos - btree_buf.position);
-
-			if (be32_to_cpu(block->bb_magic) !=
-			    (xfs_sb_version_hascrc(&mp->m_sb) ?
-			     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
-				do_log(_("Bad btree magic 0x%x\n"),
-				        be32_to_cpu(block->bb_magic));
-				exit(1);
-			}
-
-			if (be16_to_cpu(block->bb_level) == 0)
-				break;
-
-			ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
-							mp->m_alloc_mxr[1]);
-			bno = be32_to_cpu(ptr[0]);
-		}
-
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
-		/* handle the rest of the ag */
-
-		for (;;) {
-			if (be16_to_cpu(block->bb_level) != 0)  {
-				do_log(
-			_("WARNING:  source filesystem inconsistent.\n"));
-				do_log(
-			_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
-				exit(1);
-			}
-
-			rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
-			for (i = 0; i < be16_to_cpu(block->bb_numrecs);
-							i++, rec_ptr++)  {
-				/* calculate in daddr's */
-
-				begin = next_begin;
-
-				/*
-				 * protect against pathological case of a
-				 * hole right after the ag header in a
-				 * mis-aligned case
-				 */
-
-				if (begin < ag_begin)
-					begin = ag_begin;
-
-				/*
-				 * round size up to ensure we copy a
-				 * range bigger than required
-				 */
-
-				sizeb = XFS_AGB_TO_DADDR(mp, agno, 
-					be32_to_cpu(rec_ptr->ar_startblock)) - 
-						begin;
-				size = roundup(sizeb <<BBSHIFT, wbuf_miniosize);
-				if (size > 0)  {
-					/* copy extent */
-
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
-
-					while (size > 0)  {
-						/*
-						 * let lower layer do alignment
-						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
-							sizeb -= wblocks;
-							numblocks += wblocks;
-						} else  {
-							w_buf.length = size;
-							numblocks += sizeb;
-							size = 0;
-						}
-
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
-
-						w_buf.position += w_buf.length;
-
-						howfar = bump_bar(
-							howfar, numblocks);
-					}
-				}
-
-				/* round next starting point down */
-
-				new_begin = XFS_AGB_TO_DADDR(mp, agno,
-						be32_to_cpu(rec_ptr->ar_startblock) +
-					 	be32_to_cpu(rec_ptr->ar_blockcount));
-				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
-			}
-
-			if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
-				break;
-
-			/* read in next btree record block */
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
-						block->bb_u.s.bb_rightsib)) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			/* let read_wbuf handle alignment */
+	/* the readers copy one AG at a time, whichever is next */
 
-			read_wbuf(source_fd, &btree_buf, mp);
-
-			block = (struct xfs_btree_block *)
-				 ((char *) btree_buf.data +
-				  pos - btree_buf.position);
-
-			ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC);
+	next_agno = 0;
+	ag_scans = calloc(num_ags, sizeof(ag_scan_t));
+	if (ag_scans == NULL)  {
+		do_log(_("Couldn't allocate AG extent lists\n"));
+		die_perror();
+	}
+	if (pthread_create(&scanner.pid, NULL, begin_ag_scanner, &scanner))  {
+		do_log(_("Error creating scanner thread\n"));
+		die_perror();
+	}
+	for (i = 1; i < num_readers; i++)  {
+		if (pthread_create(&readers[i].pid, NULL,
+					begin_ag_reader, &readers[i]))  {
+			do_log(_("Error creating reader thread %d\n"), i);
+			die_perror();
 		}
+	}
+	begin_ag_reader(&readers[0]);
+	for (i = 1; i < num_readers; i++)
+		pthread_join(readers[i].pid, NULL);
 
-		/*
-		 * write out range of used blocks after last range
-		 * of free blocks in AG
-		 */
-		if (next_begin < ag_end)  {
-			begin = next_begin;
-
-			sizeb = ag_end - begin;
-			size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-			if (size > 0)  {
-				/* copy extent */
-
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
-
-				while (size > 0)  {
-					/*
-					 * let lower layer do alignment
-					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
-						sizeb -= wblocks;
-						numblocks += wblocks;
-					} else  {
-						w_buf.length = size;
-						numblocks += sizeb;
-						size = 0;
-					}
-
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
-
-					w_buf.position += w_buf.length;
+	pthread_mutex_lock(&glob_masks.mutex);
+	scanner.done = 1;
+	pthread_cond_broadcast(&scan_cond);
+	pthread_mutex_unlock(&glob_masks.mutex);
+	pthread_join(scanner.pid, NULL);
 
-					howfar = bump_bar(howfar, numblocks);
-				}
-			}
-		}
-	}
+	/* no more buffers, the targets finish with their own writes */
+	pthread_mutex_lock(&glob_masks.mutex);
+	glob_masks.done = 1;
+	pthread_cond_broadcast(&glob_masks.queued);
+	pthread_mutex_unlock(&glob_masks.mutex);
+	for (i = 0; i < num_targets; i++)
+		pthread_join(target[i].pid, NULL);
 
 	if (kids > 0)  {
-		if (!duplicate)  {
-
-			/* write a clean log using the specified UUID */
-			for (j = 0, tcarg = targ; j < num_targets; j++)  {
-				w_buf.owner = tcarg;
-				w_buf.length = rounddown(w_buf.size,
-							 w_buf.min_io_size);
-				pos = write_log_header(
-							source_fd, &w_buf, mp);
-				end_pos = write_log_trailer(
-							source_fd, &w_buf, mp);
-				w_buf.position = pos;
-				memset(w_buf.data, 0, w_buf.length);
-
-				while (w_buf.position < end_pos)  {
-					do_write(tcarg);
-					w_buf.position += w_buf.length;
-				}
-				tcarg++;
-			}
-		} else {
-			num_ags = 1;
+		if (verify)  {
+			bump_bar(100, 0);
+			verify_targets();
 		}
 
-		/* reread and rewrite superblocks (UUID and in-progress) */
-		/* [backwards, so inprogress bit only updated when done] */
-
-		for (i = num_ags - 1; i >= 0; i--)  {
-			read_ag_header(source_fd, i, &w_buf, &ag_hdr, mp,
-				source_blocksize, source_sectorsize);
-			if (i == 0)
-				ag_hdr.xfs_sb->sb_inprogress = 0;
+		/* end the streams */
 
-			/* do each thread in turn, each has its own UUID */
-
-			for (j = 0, tcarg = targ; j < num_targets; j++)  {
-				sb_update_uuid(sb, &ag_hdr, tcarg);
-				do_write(tcarg);
-				tcarg++;
+		for (j = 0; j < num_targets; j++)  {
+			if (!target[j].stream || target[j].state == INACTIVE)
+				continue;
+			if (stream_flush(&target[j]) < 0)  {
+				target[j].error = errno;
+				target[j].state = INACTIVE;
 			}
 		}
 
-		bump_bar(100, 0);
+		if (!verify)
+			bump_bar(100, 0);
 	}
 
 	check_errors();
+	if (crc_hdr)
+		crc_map_done();
 	libxfs_umount(mp);
 
 	return 0;
 }
-
-char *
-next_log_chunk(char *p, int offset, void *private)
-{
-	wbuf	*buf = (wbuf *)private;
-
-	if (buf->length < (int)(p - buf->data) + offset) {
-		/* need to flush this one, then start afresh */
-
-		do_write(buf->owner);
-		memset(buf->data, 0, buf->length);
-		return buf->data;
-	}
-	return p + offset;
-}
-
-/*
- * Writes a log header at the start of the log (with the real
- * filesystem UUID embedded into it), and writes to all targets.
- *
- * Returns the next buffer-length-aligned disk address.
- */
-xfs_off_t
-write_log_header(int fd, wbuf *buf, xfs_mount_t *mp)
-{
-	char		*p = buf->data;
-	xfs_off_t	logstart;
-	int		offset;
-
-	logstart = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart) << BBSHIFT;
-	buf->position = rounddown(logstart, (xfs_off_t)buf->length);
-
-	memset(p, 0, buf->size);
-	if (logstart % buf->length)  {	/* unaligned */
-		read_wbuf(fd, buf, mp);
-		offset = logstart - buf->position;
-		p += offset;
-		memset(p, 0, buf->length - offset);
-	}
-
-	offset = libxfs_log_header(p, &buf->owner->uuid,
-			xfs_sb_version_haslogv2(&mp->m_sb) ? 2 : 1,
-			mp->m_sb.sb_logsunit, XLOG_FMT,
-			next_log_chunk, buf);
-	do_write(buf->owner);
-
-	return roundup(logstart + offset, buf->length);
-}
-
-/*
- * May do an aligned read of the last buffer in the log (& zero
- * the start of that buffer).  Returns the disk address at the
- * end of last aligned buffer in the log.
- */
-xfs_off_t
-write_log_trailer(int fd, wbuf *buf, xfs_mount_t *mp)
-{
-	xfs_off_t	logend;
-	int		offset;
-
-	logend = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart) << BBSHIFT;
-	logend += XFS_FSB_TO_B(mp, mp->m_sb.sb_logblocks);
-
-	buf->position = rounddown(logend, (xfs_off_t)buf->length);
-
-	if (logend % buf->length)  {	/* unaligned */
-		read_wbuf(fd, buf, mp);
-		offset = (int)(logend - buf->position);
-		memset(buf->data, 0, offset);
-		do_write(buf->owner);
-	}
-
-	return buf->position;
-}
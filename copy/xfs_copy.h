@@ -57,22 +57,99 @@ typedef struct {
 	xfs_off_t	position;	/* requested position (bytes) */
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
-	struct t_args	*owner;		/* for non-parallel writes */
+	int		num_writers;	/* targets yet to write it out */
+	unsigned long	seq;		/* sequence number it is free for */
+	int		ready;		/* read in, waiting to be queued */
+	unsigned char	*skip;		/* SKIP_* flags of each sparse_unit */
 } wbuf;
 
+#define SKIP_ZERO	0x1		/* all zeroes, a hole in sparse files */
+#define SKIP_SAME	0x2		/* unchanged since the last copy */
+
+/*
+ * A write of a target's own, which it does after the last wbuf: a block
+ * of a superblock with its UUID, or of its clean log.
+ */
+typedef struct {
+	xfs_off_t	position;
+	size_t		length;		/* 0 if there's nothing to write */
+	char		*data;		/* NULL for zeroes */
+} tail_write_t;
+
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
 	int		fd;
+	unsigned long	next;		/* sequence number of next wbuf */
+	tail_write_t	*tail;		/* written once the ring is done */
+	int		num_tail;
 } thread_args;
 
+/*
+ * The data buffers form a ring.  Each reader thread reserves the next
+ * buffer in the ring, reads part of the source into it and marks it ready;
+ * the head then moves over the buffers that are ready in ring order and
+ * queues them for all active targets.  A buffer can be reserved again as
+ * soon as every target has written it out.  Each target thread works
+ * through the queued buffers in order, so a target can fall at most
+ * num_bufs buffers behind the source before the reads have to wait for it.
+ */
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
+	pthread_cond_t	queued;		/* a wbuf was queued for writing */
+	pthread_cond_t	written;	/* all targets wrote out a wbuf */
+	int		num_bufs;
+	unsigned long	head;		/* sequence number of next wbuf */
+	unsigned long	reserved;	/* next wbuf to hand to a reader */
+	int		done;		/* no more wbufs will be queued */
+	wbuf		*buffers;
 } thread_control;
 
+typedef struct {
+	int		id;
+	pthread_t	pid;
+	xfs_mount_t	*mp;
+} reader_args;
+
+/*
+ * The used space of an AG as the ranges the readers copy, found by the
+ * scanner thread walking the leaves of the by-block freespace btree ahead
+ * of them.
+ */
+typedef struct {
+	xfs_daddr_t	begin;
+	__uint64_t	size;		/* bytes, rounded up for direct I/O */
+	__uint64_t	sizeb;		/* basic blocks */
+} ag_range_t;
+
+typedef struct {
+	ag_range_t	*ranges;
+	int		count;
+	int		max;
+	int		ready;		/* the btree has been walked */
+} ag_scan_t;
+
+typedef struct {
+	pthread_t	pid;
+	xfs_mount_t	*mp;
+	wbuf		btree_buf;	/* freespace btree blocks */
+	int		done;		/* the readers have stopped */
+} scanner_args;
+
+/*
+ * Targets that can't seek, such as pipes and sockets, get a stream in the
+ * format of xfs_metadump(8) with every block copied in it, which
+ * xfs_mdrestore(8) writes out at the other end.
+ */
+typedef struct {
+	xfs_metablock_t	*mb;		/* header + index + blocks */
+	__be64		*index;
+	char		*data;
+	int		count;		/* blocks in the metablock so far */
+	int		max_count;
+	int		blocklog;
+} stream_t;
+
 typedef int thread_id;
 typedef int tm_index;			/* index into thread mask array */
 typedef __uint32_t thread_mask;		/* a thread mask */
@@ -85,5 +162,31 @@ typedef struct {
 	int		state;
 	int		error;
 	int		err_type;
+	int		sparse;		/* skip zeroes, the file is all holes */
+	uuid_t		uuid;		/* of the previous copy */
+	stream_t	*stream;	/* standard output */
+	__uint64_t	verified;	/* bytes read back */
+	__uint64_t	mismatches;	/* sparse_units that differ */
+	double		verify_secs;
 } target_control;
 
+/*
+ * The sidecar file of incremental copies is this header followed by the
+ * crc32c of every sparse_unit of the filesystem as it was last copied to
+ * the targets.  It stays on the machine doing the copies, so it's in host
+ * byte order.
+ */
+#define CRC_MAGIC	0x58435243	/* XCRC */
+#define CRC_VERSION	1
+
+typedef struct {
+	__uint32_t	magic;
+	__uint32_t	version;
+	__uint32_t	unit;		/* bytes covered by each crc */
+	__uint32_t	clean;		/* the copy it describes completed */
+	uuid_t		uuid;		/* of the source filesystem */
+	__uint64_t	dblocks;
+	__uint32_t	blocksize;
+	__uint32_t	num_targets;
+} crc_header_t;
+
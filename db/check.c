@@ -30,8 +30,10 @@
 #include "sb.h"
 #include "output.h"
 #include "init.h"
+#include "inode.h"
 #include "malloc.h"
 #include "dir2.h"
+#include "sig.h"
 
 typedef enum {
 	IS_USER_QUOTA, IS_PROJECT_QUOTA, IS_GROUP_QUOTA,
@@ -55,6 +57,7 @@ typedef struct inodata {
 	char		isdir;
 	char		security;
 	char		ilist;
+	__uint32_t	mapid;		/* its inomap entry, 0 if none yet */
 	xfs_ino_t	ino;
 	struct inodata	*parent;
 	char		*name;
@@ -63,6 +66,30 @@ typedef struct inodata {
 #define	MAX_INODATA_HASH_SIZE	65536
 #define	INODATA_AVG_HASH_LENGTH	8
 
+/*
+ * An ncheck -w file: the header, then for each inode with a name its
+ * record and the name.  In host byte order, like the rest of what
+ * xfs_db keeps for itself.
+ */
+#define	NCHECK_MAGIC		0x58444e49	/* XDNI */
+#define	NCHECK_VERSION		1
+
+typedef struct ncheck_hdr {
+	__u32		magic;
+	__u32		version;
+	uuid_t		uuid;		/* of the filesystem */
+	__u64		count;		/* records */
+} ncheck_hdr_t;
+
+typedef struct ncheck_rec {
+	__u64		ino;
+	__u64		parent;		/* 0 for none */
+	__u16		namelen;
+	__u8		isdir;
+	__u8		security;
+	__u32		pad;
+} ncheck_rec_t;
+
 typedef struct qinfo {
 	xfs_qcnt_t	bc;
 	xfs_qcnt_t	ic;
@@ -93,6 +120,30 @@ typedef	struct blkmap {
 #define	BLKMAP_SIZE(n)	\
 	(offsetof(blkmap_t, ents) + (sizeof(blkent_t *) * (n)))
 
+/*
+ * The block maps, dbmap (the type of each block) and inomap (the inode
+ * owning it), have an entry for every block of each AG and of the realtime
+ * device.  They are kept in pages of MAP_PAGE_SIZE blocks, and a page whose
+ * blocks all have the same entry is just that entry: its array is only
+ * allocated once one of its blocks is set to something else.  Free space
+ * and the data of files of a page or more fill whole pages, so most pages
+ * never need an array.  The inomap entries are indexes into inotab rather
+ * than pointers, so the arrays it does need are half the size.
+ */
+#define	MAP_PAGE_LOG	12
+#define	MAP_PAGE_SIZE	(1 << MAP_PAGE_LOG)
+
+typedef struct mappage {
+	__uint32_t	value;		/* of all the blocks, if no array */
+	void		*ents;		/* or an array of them */
+} mappage_t;
+
+typedef struct blockmap {
+	int		esize;		/* bytes per entry, 1 or 4 */
+	__uint64_t	nblocks;
+	mappage_t	*pages;
+} blockmap_t;
+
 typedef struct freetab {
 	int			naents;
 	int			nents;
@@ -110,17 +161,18 @@ typedef struct dirhash {
 #define	DIR_HASH_SIZE	1024
 #define	DIR_HASH_FUNC(h,a)	(((h) ^ (a)) % DIR_HASH_SIZE)
 
-static xfs_extlen_t	agffreeblks;
-static xfs_extlen_t	agflongest;
+/* counted for the AG being scanned, each -T thread has its own */
+static __thread xfs_extlen_t	agffreeblks;
+static __thread xfs_extlen_t	agflongest;
+static __thread __uint32_t	agfbtreeblks;
+static __thread xfs_agino_t	agicount;
+static __thread xfs_agino_t	agifreecount;
 static __uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
-static __uint32_t	agfbtreeblks;
 static int		lazycount;
-static xfs_agino_t	agicount;
-static xfs_agino_t	agifreecount;
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
-static dirhash_t	**dirhash;
+static blockmap_t	*dbmap;		/* of dbm_t */
+static __thread dirhash_t **dirhash;	/* of the directory being read */
 static int		error;
 static __uint64_t	fdblocks;
 static __uint64_t	frextents;
@@ -128,10 +180,14 @@ static __uint64_t	icount;
 static __uint64_t	ifree;
 static inodata_t	***inodata;
 static int		inodata_hash_size;
-static inodata_t	***inomap;
+static blockmap_t	*inomap;	/* of indexes into inotab */
+static inodata_t	**inotab;	/* by inomap entry, [0] is NULL */
+static __uint32_t	inotab_count;
+static __uint32_t	inotab_size;
 static int		nflag;
 static int		pflag;
 static int		tflag;
+static int		nthreads;
 static qdata_t		**qpdata;
 static int		qpdo;
 static qdata_t		**qudata;
@@ -174,6 +230,15 @@ static const char	*typename[] = {
 };
 static int		verbose;
 
+/*
+ * With blockget -T, the AGs are scanned by several threads with
+ * scan_ags(), which only lets one of them run at a time between reads, so
+ * all the state of the check is only ever changed by one thread at a time
+ * while the reads of all of them are in flight together.  Only the totals
+ * for the AG being scanned and the directory hash are per thread, being
+ * used across reads.
+ */
+
 #define	CHECK_BLIST(b)	(blist_size && check_blist(b))
 #define	CHECK_BLISTA(a,b)	\
 	(blist_size && check_blist(XFS_AGB_TO_FSB(mp, a, b)))
@@ -262,7 +327,31 @@ static inodata_t	*find_inode(xfs_ino_t ino, int add);
 static void		free_inodata(xfs_agnumber_t agno);
 static int		init(int argc, char **argv);
 static char		*inode_name(xfs_ino_t ino, inodata_t **ipp);
+static void		inodata_alloc(void);
+static __uint32_t	inotab_id(inodata_t *id);
+static void		map_alloc(blockmap_t *m, __uint64_t nblocks,
+				  int esize);
+static void		map_free(blockmap_t *m);
+static __uint32_t	map_get(blockmap_t *m, __uint64_t b);
+static __uint64_t	map_run(blockmap_t *m, __uint64_t b, __uint64_t end,
+				__uint32_t *vp);
+static void		map_set(blockmap_t *m, __uint64_t b, __uint64_t len,
+				__uint32_t v);
 static int		ncheck_f(int argc, char **argv);
+static void		ncheck_free(void);
+static int		ncheck_load(char *file);
+static void		ncheck_name(inodata_t *id, xfs_ino_t ino, char *name,
+				    int namelen);
+static void		ncheck_save(char *file);
+static void		ncheck_scan(void);
+static void		ncheck_scan_data(inodata_t *id,
+					 struct xfs_dir2_data_hdr *data);
+static void		ncheck_scan_dir(xfs_dinode_t *dip, inodata_t *id);
+static void		ncheck_scan_dirblock(inodata_t *id, xfs_fileoff_t dabno,
+					     bmap_ext_t *bmp, int nex);
+static int		ncheck_scan_inode(xfs_ino_t ino, xfs_dinode_t *dip,
+					  void *arg);
+static void		ncheck_scan_sf_dir(xfs_dinode_t *dip, inodata_t *id);
 static char		*prepend_path(char *oldpath, char *parent);
 static xfs_ino_t	process_block_dir_v2(blkmap_t *blkmap, int *dot,
 					     int *dotdot, inodata_t *id);
@@ -362,7 +451,7 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, N_("free block usage information"), NULL };
 static const cmdinfo_t	blockget_cmd =
 	{ "blockget", "check", blockget_f, 0, -1, 0,
-	  N_("[-s|-v] [-n] [-t] [-b bno]... [-i ino] ..."),
+	  N_("[-s|-v] [-n] [-t] [-T threads] [-b bno]... [-i ino] ..."),
 	  N_("get block usage and check consistency"), NULL };
 static const cmdinfo_t	blocktrash_cmd =
 	{ "blocktrash", NULL, blocktrash_f, 0, -1, 0,
@@ -374,7 +463,7 @@ static const cmdinfo_t	blockuse_cmd =
 	  N_("print usage for current block(s)"), NULL };
 static const cmdinfo_t	ncheck_cmd =
 	{ "ncheck", NULL, ncheck_f, 0, -1, 0,
-	  N_("[-s] [-i ino] ..."),
+	  N_("[-s] [-d | -r file] [-w file] [-i ino] ..."),
 	  N_("print inode-name pairs"), NULL };
 
 
@@ -747,18 +836,22 @@ blockfree_f(
 	int		rt;
 
 	if (!dbmap) {
+		if (inodata) {	/* just the names, from ncheck -d or -r */
+			ncheck_free();
+			return 0;
+		}
 		dbprintf(_("block usage information not allocated\n"));
 		return 0;
 	}
 	rt = mp->m_sb.sb_rextents != 0;
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		map_free(&dbmap[c]);
+		map_free(&inomap[c]);
 		free_inodata(c);
 	}
 	if (rt) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		map_free(&dbmap[c]);
+		map_free(&inomap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
@@ -766,9 +859,12 @@ blockfree_f(
 	xfree(dbmap);
 	xfree(inomap);
 	xfree(inodata);
+	xfree(inotab);
 	dbmap = NULL;
 	inomap = NULL;
 	inodata = NULL;
+	inotab = NULL;
+	inotab_count = inotab_size = 0;
 	return 0;
 }
 
@@ -802,6 +898,7 @@ blockget_f(
 	if (xfs_sb_version_hascrc(&mp->m_sb))
 		return 0;
 
+	init_perag_data();
 	if (!init(argc, argv)) {
 		if (serious_error)
 			exitcode = 3;
@@ -811,7 +908,12 @@ blockget_f(
 	}
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
-	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
+	if (nthreads > 1 && mp->m_sb.sb_agcount > 1) {
+		scan_ags(nthreads, scan_ag);
+		if (sbver_err > 4)
+			dbprintf(_("WARNING: this may be a newer XFS "
+				 "filesystem.\n"));
+	} else for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
 		scan_ag(agno);
 		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
 			sbyell = 1;
@@ -1009,12 +1111,14 @@ blocktrash_f(
 	int		max;
 	int		min;
 	int		mode;
+	xfs_agblock_t	n;
 	struct timeval	now;
 	char		*p;
 	xfs_rfsblock_t	randb;
 	uint		seed;
 	int		sopt;
 	int		tmask;
+	__uint32_t	type;
 
 	if (!dbmap) {
 		dbprintf(_("must run blockget first\n"));
@@ -1120,11 +1224,11 @@ blocktrash_f(
 			lentab[lentablen - 1].max = i;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
-		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
-				blocks++;
+		for (agbno = 0; agbno < mp->m_sb.sb_agblocks; agbno += n) {
+			n = map_run(&dbmap[agno], agbno, mp->m_sb.sb_agblocks,
+				    &type);
+			if ((1 << type) & tmask)
+				blocks += n;
 		}
 	}
 	if (blocks == 0) {
@@ -1140,14 +1244,18 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
-			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			for (agbno = 0; agbno < mp->m_sb.sb_agblocks;
+			     agbno += n) {
+				n = map_run(&dbmap[agno], agbno,
+					    mp->m_sb.sb_agblocks, &type);
+				if (!((1 << type) & tmask))
 					continue;
-				if (bi++ < randb)
+				if (bi + n <= randb) {
+					bi += n;
 					continue;
-				blocktrash_b(agno, agbno, (dbm_t)*p,
+				}
+				blocktrash_b(agno, agbno + (randb - bi),
+					(dbm_t)type,
 					&lentab[random() % lentablen], mode);
 				done = 1;
 				break;
@@ -1207,11 +1315,11 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
-		i = inomap[agno][agbno];
+		i = inotab[map_get(&inomap[agno], agbno)];
 		dbprintf(_("block %llu (%u/%u) type %s"),
 			(xfs_fsblock_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno,
+			typename[(dbm_t)map_get(&dbmap[agno], agbno)]);
 		if (i) {
 			dbprintf(_(" inode %lld"), i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1245,16 +1353,19 @@ check_dbmap(
 	xfs_extlen_t	len,
 	dbm_t		type)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, n;
+	__uint32_t	v;
 
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
+	for (i = 0; i < len; i += n) {
+		n = map_run(&dbmap[agno], agbno + i, agbno + len, &v);
+		if ((dbm_t)v == type)
+			continue;
+		for (; n; n--, i++) {
 			if (!sflag || CHECK_BLISTA(agno, agbno + i))
 				dbprintf(_("block %u/%u expected type %s got "
 					 "%s\n"),
 					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					typename[(dbm_t)v]);
 			error++;
 		}
 	}
@@ -1278,8 +1389,9 @@ check_inomap(
 	xfs_extlen_t	len,
 	xfs_ino_t	c_ino)
 {
-	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_extlen_t	i, n;
+	inodata_t	*idp;
+	__uint32_t	v;
 	int		rval;
 
 	if (!check_range(agno, agbno, len))  {
@@ -1287,13 +1399,17 @@ check_inomap(
 			agno, agbno, agbno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist ||
+	for (i = 0, rval = 1; i < len; i += n) {
+		n = map_run(&inomap[agno], agbno + i, agbno + len, &v);
+		if (!v)
+			continue;
+		idp = inotab[v];
+		for (; n; n--, i++) {
+			if (!sflag || idp->ilist ||
 			    CHECK_BLISTA(agno, agbno + i))
 				dbprintf(_("block %u/%u claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					agno, agbno + i, c_ino, (*idp)->ino);
+					agno, agbno + i, c_ino, idp->ino);
 			error++;
 			rval = 0;
 		}
@@ -1411,16 +1527,20 @@ check_rdbmap(
 	xfs_extlen_t	len,
 	dbm_t		type)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, n;
+	__uint32_t	v;
 
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
+	for (i = 0; i < len; i += n) {
+		n = map_run(&dbmap[mp->m_sb.sb_agcount], bno + i, bno + len,
+			    &v);
+		if ((dbm_t)v == type)
+			continue;
+		for (; n; n--, i++) {
 			if (!sflag || CHECK_BLIST(bno + i))
 				dbprintf(_("rtblock %llu expected type %s got "
 					 "%s\n"),
 					bno + i, typename[type],
-					typename[(dbm_t)*p]);
+					typename[(dbm_t)v]);
 			error++;
 		}
 	}
@@ -1432,8 +1552,9 @@ check_rinomap(
 	xfs_extlen_t	len,
 	xfs_ino_t	c_ino)
 {
-	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_extlen_t	i, n;
+	inodata_t	*idp;
+	__uint32_t	v;
 	int		rval;
 
 	if (!check_rrange(bno, len)) {
@@ -1441,14 +1562,17 @@ check_rinomap(
 			bno, bno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist || CHECK_BLIST(bno + i))
+	for (i = 0, rval = 1; i < len; i += n) {
+		n = map_run(&inomap[mp->m_sb.sb_agcount], bno + i, bno + len,
+			    &v);
+		if (!v)
+			continue;
+		idp = inotab[v];
+		for (; n; n--, i++) {
+			if (!sflag || idp->ilist || CHECK_BLIST(bno + i))
 				dbprintf(_("rtblock %llu claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					bno + i, c_ino, (*idp)->ino);
+					bno + i, c_ino, idp->ino);
 			error++;
 			rval = 0;
 		}
@@ -1506,7 +1630,6 @@ check_set_dbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf(_("blocks %u/%u..%u claimed by block %u/%u\n"), agno,
@@ -1514,10 +1637,10 @@ check_set_dbmap(
 		return;
 	}
 	check_dbmap(agno, agbno, len, type1);
+	map_set(&dbmap[agno], agbno, len, type2);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting block %u/%u to %s\n"), agno, agbno + i,
 				typename[type2]);
 	}
@@ -1532,15 +1655,14 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
 	check_rdbmap(bno, len, type1);
+	map_set(&dbmap[mp->m_sb.sb_agcount], bno, len, type2);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || CHECK_BLIST(bno + i))
 			dbprintf(_("setting rtblock %llu to %s\n"),
 				bno + i, typename[type2]);
 	}
@@ -1579,16 +1701,19 @@ checknot_dbmap(
 	xfs_extlen_t	len,
 	int		typemask)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, n;
+	__uint32_t	v;
 
 	if (!check_range(agno, agbno, len))
 		return;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
+	for (i = 0; i < len; i += n) {
+		n = map_run(&dbmap[agno], agbno + i, agbno + len, &v);
+		if (!((1 << v) & typemask))
+			continue;
+		for (; n; n--, i++) {
 			if (!sflag || CHECK_BLISTA(agno, agbno + i))
 				dbprintf(_("block %u/%u type %s not expected\n"),
-					agno, agbno + i, typename[(dbm_t)*p]);
+					agno, agbno + i, typename[(dbm_t)v]);
 			error++;
 		}
 	}
@@ -1600,16 +1725,20 @@ checknot_rdbmap(
 	xfs_extlen_t	len,
 	int		typemask)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, n;
+	__uint32_t	v;
 
 	if (!check_rrange(bno, len))
 		return;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
+	for (i = 0; i < len; i += n) {
+		n = map_run(&dbmap[mp->m_sb.sb_agcount], bno + i, bno + len,
+			    &v);
+		if (!((1 << v) & typemask))
+			continue;
+		for (; n; n--, i++) {
 			if (!sflag || CHECK_BLIST(bno + i))
 				dbprintf(_("rtblock %llu type %s not expected\n"),
-					bno + i, typename[(dbm_t)*p]);
+					bno + i, typename[(dbm_t)v]);
 			error++;
 		}
 	}
@@ -1774,25 +1903,24 @@ init(
 	rt = mp->m_sb.sb_rextents != 0;
 	dbmap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*dbmap));
 	inomap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*inomap));
-	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
-	inodata_hash_size =
-		(int)MAX(MIN(mp->m_sb.sb_icount /
-				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
-			     MAX_INODATA_HASH_SIZE),
-			 MIN_INODATA_HASH_SIZE);
+	ncheck_free();
+	inodata_alloc();
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
-		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
+		map_alloc(&dbmap[c], mp->m_sb.sb_agblocks, 1);
+		map_alloc(&inomap[c], mp->m_sb.sb_agblocks, 4);
 	}
+	inotab_size = 1024;
+	inotab = xcalloc(inotab_size, sizeof(*inotab));
+	inotab_count = 1;
 	if (rt) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
+		map_alloc(&dbmap[c], mp->m_sb.sb_rblocks, 1);
+		map_alloc(&inomap[c], mp->m_sb.sb_rblocks, 4);
 		sumfile = xcalloc(mp->m_rsumsize, 1);
 		sumcompute = xcalloc(mp->m_rsumsize, 1);
 	}
 	nflag = sflag = tflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npstv")) != EOF) {
+	nthreads = 1;
+	while ((c = getopt(argc, argv, "b:i:npstT:v")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = strtoll(optarg, NULL, 10);
@@ -1814,6 +1942,14 @@ init(
 		case 't':
 			tflag = 1;
 			break;
+		case 'T':
+			nthreads = strtol(optarg, NULL, 10);
+			if (nthreads < 1 || nthreads > MAX_SCAN_THREADS) {
+				dbprintf(_("bad number of threads %s for "
+					   "blockget command\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1869,6 +2005,168 @@ inode_name(
 	return path;
 }
 
+static void
+inodata_alloc(void)
+{
+	xfs_agnumber_t	c;
+
+	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
+	inodata_hash_size =
+		(int)MAX(MIN(mp->m_sb.sb_icount /
+				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
+			     MAX_INODATA_HASH_SIZE),
+			 MIN_INODATA_HASH_SIZE);
+	for (c = 0; c < mp->m_sb.sb_agcount; c++)
+		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
+}
+
+/* the inomap entry for an inode, given it one if it hasn't one yet */
+static __uint32_t
+inotab_id(
+	inodata_t	*id)
+{
+	if (id->mapid)
+		return id->mapid;
+	if (inotab_count == inotab_size) {
+		if (inotab_size == UINT32_MAX) {
+			dbprintf(_("too many inodes with blocks, not "
+				   "recording the owner of inode %lld's\n"),
+				id->ino);
+			return 0;
+		}
+		inotab_size = inotab_size > UINT32_MAX / 2 ? UINT32_MAX :
+			      inotab_size * 2;
+		inotab = xrealloc(inotab, inotab_size * sizeof(*inotab));
+	}
+	inotab[inotab_count] = id;
+	id->mapid = inotab_count++;
+	return id->mapid;
+}
+
+static void
+map_alloc(
+	blockmap_t	*m,
+	__uint64_t	nblocks,
+	int		esize)
+{
+	m->esize = esize;
+	m->nblocks = nblocks;
+	m->pages = xcalloc((nblocks + MAP_PAGE_SIZE - 1) >> MAP_PAGE_LOG,
+			   sizeof(*m->pages));
+}
+
+static void
+map_free(
+	blockmap_t	*m)
+{
+	__uint64_t	i;
+
+	for (i = 0; i < (m->nblocks + MAP_PAGE_SIZE - 1) >> MAP_PAGE_LOG; i++)
+		xfree(m->pages[i].ents);
+	xfree(m->pages);
+	m->pages = NULL;
+}
+
+static inline __uint32_t
+map_ent(
+	blockmap_t	*m,
+	void		*ents,
+	int		i)
+{
+	return m->esize == 1 ? ((__uint8_t *)ents)[i] :
+			       ((__uint32_t *)ents)[i];
+}
+
+static __uint32_t
+map_get(
+	blockmap_t	*m,
+	__uint64_t	b)
+{
+	mappage_t	*pg = &m->pages[b >> MAP_PAGE_LOG];
+
+	if (!pg->ents)
+		return pg->value;
+	return map_ent(m, pg->ents, b & (MAP_PAGE_SIZE - 1));
+}
+
+/*
+ * The entry of block b, in *vp, and how many blocks from b up to end have
+ * it too, so the callers can go through the map a run at a time.
+ */
+static __uint64_t
+map_run(
+	blockmap_t	*m,
+	__uint64_t	b,
+	__uint64_t	end,
+	__uint32_t	*vp)
+{
+	__uint64_t	start = b;
+	mappage_t	*pg;
+	__uint32_t	v = map_get(m, b);
+	int		i;
+
+	*vp = v;
+	while (b < end) {
+		pg = &m->pages[b >> MAP_PAGE_LOG];
+		i = b & (MAP_PAGE_SIZE - 1);
+		if (!pg->ents) {
+			if (pg->value != v)
+				break;
+			b += MAP_PAGE_SIZE - i;
+			continue;
+		}
+		for (; i < MAP_PAGE_SIZE && b < end; i++, b++)
+			if (map_ent(m, pg->ents, i) != v)
+				return b - start;
+	}
+	return min(b, end) - start;
+}
+
+/* set len blocks from b to v, keeping whole pages as single values */
+static void
+map_set(
+	blockmap_t	*m,
+	__uint64_t	b,
+	__uint64_t	len,
+	__uint32_t	v)
+{
+	mappage_t	*pg;
+	__uint64_t	end = b + len;
+	int		i, n;
+
+	while (b < end) {
+		pg = &m->pages[b >> MAP_PAGE_LOG];
+		i = b & (MAP_PAGE_SIZE - 1);
+		n = min(end - b, (__uint64_t)(MAP_PAGE_SIZE - i));
+		b += n;
+		if (n == MAP_PAGE_SIZE) {
+			xfree(pg->ents);
+			pg->ents = NULL;
+			pg->value = v;
+			continue;
+		}
+		if (!pg->ents) {
+			if (pg->value == v)
+				continue;
+			/* two different values in the page now */
+			pg->ents = xmalloc(MAP_PAGE_SIZE * m->esize);
+			if (m->esize == 1)
+				memset(pg->ents, pg->value, MAP_PAGE_SIZE);
+			else {
+				int	j;
+
+				for (j = 0; j < MAP_PAGE_SIZE; j++)
+					((__uint32_t *)pg->ents)[j] = pg->value;
+			}
+		}
+		if (m->esize == 1)
+			memset((__uint8_t *)pg->ents + i, v, n);
+		else
+			while (n--)
+				((__uint32_t *)pg->ents)[i++] = v;
+	}
+}
+
 static int
 ncheck_f(
 	int		argc,
@@ -1885,16 +2183,24 @@ ncheck_f(
 	xfs_ino_t	*ilp;
 	xfs_ino_t	ino;
 	char		*p;
+	char		*rfile = NULL;
+	char		*wfile = NULL;
+	int		dflag;
 	int		security;
 
-	if (!inodata || !nflag) {
-		dbprintf(_("must run blockget -n first\n"));
-		return 0;
-	}
-	security = optind = ilist_size = 0;
+	dflag = security = optind = ilist_size = 0;
 	ilist = NULL;
-	while ((c = getopt(argc, argv, "i:s")) != EOF) {
+	while ((c = getopt(argc, argv, "di:r:sw:")) != EOF) {
 		switch (c) {
+		case 'd':
+			dflag = 1;
+			break;
+		case 'r':
+			rfile = optarg;
+			break;
+		case 'w':
+			wfile = optarg;
+			break;
 		case 'i':
 			ino = strtoll(optarg, NULL, 10);
 			ilist = xrealloc(ilist, (ilist_size + 1) *
@@ -1910,6 +2216,31 @@ ncheck_f(
 			return 0;
 		}
 	}
+	if (dflag || rfile) {
+		if (dflag && rfile) {
+			dbprintf(_("ncheck -d and -r are mutually exclusive\n"));
+			xfree(ilist);
+			return 0;
+		}
+		if (dbmap) {
+			dbprintf(_("already have block usage information\n"));
+			xfree(ilist);
+			return 0;
+		}
+		if (dflag)
+			ncheck_scan();
+		else if (!ncheck_load(rfile)) {
+			xfree(ilist);
+			return 0;
+		}
+	}
+	if (!inodata || !nflag) {
+		dbprintf(_("must run blockget -n or ncheck -d first\n"));
+		xfree(ilist);
+		return 0;
+	}
+	if (wfile)
+		ncheck_save(wfile);
 	if (ilist) {
 		for (ilp = ilist; ilp < &ilist[ilist_size]; ilp++) {
 			ino = *ilp;
@@ -1946,6 +2277,357 @@ ncheck_f(
 	return 0;
 }
 
+/* forget the names from ncheck -d or -r, but not those of blockget -n */
+static void
+ncheck_free(void)
+{
+	xfs_agnumber_t	agno;
+
+	if (!inodata || dbmap)
+		return;
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		free_inodata(agno);
+	xfree(inodata);
+	inodata = NULL;
+	nflag = 0;
+}
+
+static int
+ncheck_load(
+	char		*file)
+{
+	ncheck_hdr_t	hdr;
+	ncheck_rec_t	rec;
+	FILE		*fp;
+	inodata_t	*id;
+	char		*name;
+	__u64		i;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		dbprintf(_("can't open %s: %s\n"), file, strerror(errno));
+		return 0;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != NCHECK_MAGIC || hdr.version != NCHECK_VERSION) {
+		dbprintf(_("%s is not an ncheck index\n"), file);
+		fclose(fp);
+		return 0;
+	}
+	if (platform_uuid_compare(&hdr.uuid, &mp->m_sb.sb_uuid)) {
+		dbprintf(_("%s is the index of another filesystem\n"), file);
+		fclose(fp);
+		return 0;
+	}
+	ncheck_free();
+	inodata_alloc();
+	nflag = 1;
+	for (i = 0; i < hdr.count; i++) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1)
+			break;
+		name = xmalloc(rec.namelen + 1);
+		if (fread(name, rec.namelen, 1, fp) != 1) {
+			xfree(name);
+			break;
+		}
+		name[rec.namelen] = '\0';
+		id = find_inode(rec.ino, 1);
+		if (!id || id->name) {
+			xfree(name);
+			continue;
+		}
+		id->name = name;
+		id->isdir = rec.isdir;
+		id->security = rec.security;
+		if (rec.parent)
+			id->parent = find_inode(rec.parent, 1);
+	}
+	fclose(fp);
+	if (i < hdr.count) {
+		dbprintf(_("%s is truncated\n"), file);
+		ncheck_free();
+		return 0;
+	}
+	return 1;
+}
+
+/* directory id has an entry name for inode ino */
+static void
+ncheck_name(
+	inodata_t	*id,
+	xfs_ino_t	ino,
+	char		*name,
+	int		namelen)
+{
+	inodata_t	*cid;
+
+	if (namelen <= 2 && name[0] == '.' &&
+	    (namelen == 1 || name[1] == '.'))
+		return;
+	cid = find_inode(ino, 1);
+	if (cid == NULL)
+		return;
+	if (!cid->parent)
+		cid->parent = id;
+	addname_inode(cid, name, namelen);
+}
+
+static void
+ncheck_save(
+	char		*file)
+{
+	ncheck_hdr_t	hdr;
+	ncheck_rec_t	rec;
+	xfs_agnumber_t	agno;
+	inodata_t	*hp;
+	FILE		*fp;
+	int		i;
+	int		pass;
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		dbprintf(_("can't create %s: %s\n"), file, strerror(errno));
+		return;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NCHECK_MAGIC;
+	hdr.version = NCHECK_VERSION;
+	platform_uuid_copy(&hdr.uuid, &mp->m_sb.sb_uuid);
+	/* count the records, then write them */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass)
+			fwrite(&hdr, sizeof(hdr), 1, fp);
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			for (i = 0; i < inodata_hash_size; i++) {
+				for (hp = inodata[agno][i]; hp; hp = hp->next) {
+					if (!hp->name)
+						continue;
+					if (!pass) {
+						hdr.count++;
+						continue;
+					}
+					memset(&rec, 0, sizeof(rec));
+					rec.ino = hp->ino;
+					rec.parent = hp->parent ?
+						     hp->parent->ino : 0;
+					rec.namelen = strlen(hp->name);
+					rec.isdir = hp->isdir;
+					rec.security = hp->security;
+					fwrite(&rec, sizeof(rec), 1, fp);
+					fwrite(hp->name, rec.namelen, 1, fp);
+				}
+			}
+		}
+	}
+	if (ferror(fp) | fclose(fp)) {
+		dbprintf(_("can't write %s\n"), file);
+		unlink(file);
+	}
+}
+
+/*
+ * ncheck -d finds the names of the inodes without blockget: it reads
+ * just the inode btrees, the inodes and the directory data blocks, and
+ * keeps only the names, parents and the flags ncheck needs.  The first
+ * name found for an inode with several links is the one kept, as with
+ * blockget -n.
+ */
+static void
+ncheck_scan(void)
+{
+	xfs_agnumber_t	agno;
+
+	ncheck_free();
+	inodata_alloc();
+	nflag = 1;
+	for (agno = 0; agno < mp->m_sb.sb_agcount && !seenint(); agno++)
+		scan_ag_inodes(agno, ncheck_scan_inode, NULL);
+}
+
+/* the entries of a directory data or single block directory block */
+static void
+ncheck_scan_data(
+	inodata_t		*id,
+	struct xfs_dir2_data_hdr *data)
+{
+	xfs_dir2_data_entry_t	*dep;
+	xfs_dir2_data_unused_t	*dup;
+	char			*endptr;
+	char			*ptr;
+
+	switch (be32_to_cpu(data->magic)) {
+	case XFS_DIR2_BLOCK_MAGIC:
+	case XFS_DIR3_BLOCK_MAGIC:
+		endptr = (char *)xfs_dir2_block_leaf_p(
+				xfs_dir2_block_tail_p(mp->m_dir_geo, data));
+		break;
+	case XFS_DIR2_DATA_MAGIC:
+	case XFS_DIR3_DATA_MAGIC:
+		endptr = (char *)data + mp->m_dir_geo->blksize;
+		break;
+	default:
+		return;
+	}
+	ptr = (char *)M_DIROPS(mp)->data_entry_p(data);
+	if (endptr <= ptr || endptr > (char *)data + mp->m_dir_geo->blksize)
+		return;
+	while (ptr < endptr) {
+		dup = (xfs_dir2_data_unused_t *)ptr;
+		if (be16_to_cpu(dup->freetag) == XFS_DIR2_DATA_FREE_TAG) {
+			if (be16_to_cpu(dup->length) == 0 ||
+			    (be16_to_cpu(dup->length) &
+			     (XFS_DIR2_DATA_ALIGN - 1)))
+				break;
+			ptr += be16_to_cpu(dup->length);
+			continue;
+		}
+		dep = (xfs_dir2_data_entry_t *)ptr;
+		if (dep->namelen == 0 ||
+		    (char *)M_DIROPS(mp)->data_entry_tag_p(dep) >= endptr)
+			break;
+		ncheck_name(id, be64_to_cpu(dep->inumber), (char *)dep->name,
+			    dep->namelen);
+		ptr += M_DIROPS(mp)->data_entsize(dep->namelen);
+	}
+}
+
+static void
+ncheck_scan_dir(
+	xfs_dinode_t	*dip,
+	inodata_t	*id)
+{
+	bmap_ext_t	*bmp;
+	xfs_fileoff_t	o;
+	int		fsbcount = mp->m_dir_geo->fsbcount;
+	int		i;
+	int		nex;
+
+	nex = XFS_DFORK_NEXTENTS(dip, XFS_DATA_FORK);
+	if (nex <= 0)
+		return;
+	bmp = xmalloc(nex * sizeof(*bmp));
+	push_cur();
+	set_cur_inode(id->ino);
+	bmap(0, mp->m_dir_geo->leafblk, XFS_DATA_FORK, &nex, bmp);
+	pop_cur();
+	for (i = 0; i < nex; i++) {
+		for (o = roundup(bmp[i].startoff, fsbcount);
+		     o < bmp[i].startoff + bmp[i].blockcount;
+		     o += fsbcount)
+			ncheck_scan_dirblock(id, o, &bmp[i], nex - i);
+	}
+	xfree(bmp);
+}
+
+/* the directory block at dabno, starting in the first of the extents */
+static void
+ncheck_scan_dirblock(
+	inodata_t	*id,
+	xfs_fileoff_t	dabno,
+	bmap_ext_t	*bmp,
+	int		nex)
+{
+	bbmap_t		bbmap;
+	bmap_ext_t	map[BBMAP_SIZE];
+	xfs_fileoff_t	end = dabno + mp->m_dir_geo->fsbcount;
+	xfs_fileoff_t	o;
+	int		n;
+
+	for (o = dabno, n = 0; o < end && n < nex; n++) {
+		if (bmp[n].startoff > o)
+			return;		/* a hole in the block */
+		map[n].startoff = o;
+		map[n].startblock = bmp[n].startblock + (o - bmp[n].startoff);
+		map[n].blockcount = min(end,
+				bmp[n].startoff + bmp[n].blockcount) - o;
+		o += map[n].blockcount;
+	}
+	if (o < end)
+		return;
+	push_cur();
+	if (n > 1)
+		make_bbmap(&bbmap, n, map);
+	set_cur(&typtab[TYP_DIR2], XFS_FSB_TO_DADDR(mp, map[0].startblock),
+		mp->m_dir_geo->fsbcount * blkbb, DB_RING_IGN,
+		n > 1 ? &bbmap : NULL);
+	if (iocur_top->data)
+		ncheck_scan_data(id, iocur_top->data);
+	else
+		dbprintf(_("can't read block %lld for directory inode %lld\n"),
+			(long long)dabno, id->ino);
+	pop_cur();
+}
+
+static int
+ncheck_scan_inode(
+	xfs_ino_t	ino,
+	xfs_dinode_t	*dip,
+	void		*arg)
+{
+	inodata_t	*id;
+	__uint16_t	mode;
+	int		security;
+
+	if (be16_to_cpu(dip->di_magic) != XFS_DINODE_MAGIC)
+		return 0;
+	mode = be16_to_cpu(dip->di_mode);
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+	case S_IFLNK:
+		security = 0;
+		break;
+	case S_IFREG:
+		security = (mode & (S_ISUID | S_ISGID)) != 0;
+		break;
+	default:
+		security = 1;
+		break;
+	}
+	/* other inodes only need to be known once they have a name */
+	if (!S_ISDIR(mode) && !security)
+		return 0;
+	id = find_inode(ino, 1);
+	if (id == NULL)
+		return 0;
+	id->security = security;
+	if (!S_ISDIR(mode))
+		return 0;
+	id->isdir = 1;
+	switch (dip->di_format) {
+	case XFS_DINODE_FMT_LOCAL:
+		ncheck_scan_sf_dir(dip, id);
+		break;
+	case XFS_DINODE_FMT_EXTENTS:
+	case XFS_DINODE_FMT_BTREE:
+		ncheck_scan_dir(dip, id);
+		break;
+	}
+	return 0;
+}
+
+static void
+ncheck_scan_sf_dir(
+	xfs_dinode_t		*dip,
+	inodata_t		*id)
+{
+	struct xfs_dir2_sf_hdr	*sf;
+	xfs_dir2_sf_entry_t	*sfe;
+	int			i;
+
+	sf = (struct xfs_dir2_sf_hdr *)XFS_DFORK_DPTR(dip);
+	if (be64_to_cpu(dip->di_size) > XFS_DFORK_DSIZE(dip, mp))
+		return;
+	sfe = xfs_dir2_sf_firstentry(sf);
+	for (i = 0; i < sf->count; i++) {
+		if ((intptr_t)sfe + M_DIROPS(mp)->sf_entsize(sf, sfe->namelen) -
+		    (intptr_t)sf > be64_to_cpu(dip->di_size))
+			break;
+		ncheck_name(id, M_DIROPS(mp)->sf_get_ino(sf, sfe),
+			    (char *)sfe->name, sfe->namelen);
+		sfe = M_DIROPS(mp)->sf_nextentry(sf, sfe);
+	}
+}
+
 static char *
 prepend_path(
 	char	*oldpath,
@@ -2211,7 +2893,11 @@ process_data_dir_v2(
 	int			stale = 0;
 	int			tag_err;
 	__be16			*tagp;
-	struct xfs_name		xname;
+	int			nents = 0;
+	/* the block's names, hashed together once they're all found */
+	static struct xfs_name	names[XFS_MAX_BLOCKSIZE / 16];
+	static xfs_dahash_t	hashes[XFS_MAX_BLOCKSIZE / 16];
+	static xfs_dir2_dataptr_t addrs[XFS_MAX_BLOCKSIZE / 16];
 
 	data = iocur_top->data;
 	block = iocur_top->data;
@@ -2322,9 +3008,9 @@ process_data_dir_v2(
 		tag_err += be16_to_cpu(*tagp) != (char *)dep - (char *)data;
 		addr = xfs_dir2_db_off_to_dataptr(mp->m_dir_geo, db,
 			(char *)dep - (char *)data);
-		xname.name = dep->name;
-		xname.len = dep->namelen;
-		dir_hash_add(mp->m_dirnameops->hashname(&xname), addr);
+		names[nents].name = dep->name;
+		names[nents].len = dep->namelen;
+		addrs[nents++] = addr;
 		ptr += M_DIROPS(mp)->data_entsize(dep->namelen);
 		count++;
 		lastfree = 0;
@@ -2373,6 +3059,9 @@ process_data_dir_v2(
 			(*dot)++;
 		}
 	}
+	libxfs_dir_hashnames(mp, names, hashes, nents);
+	for (i = 0; i < nents; i++)
+		dir_hash_add(hashes[i], addrs[i]);
 	if (be32_to_cpu(data->magic) == XFS_DIR2_BLOCK_MAGIC) {
 		endptr = (char *)data + mp->m_dir_geo->blksize;
 		for (i = stale = 0; lep && i < be32_to_cpu(btp->count); i++) {
@@ -4289,16 +4978,14 @@ set_inomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_inomap(agno, agbno, len, id->ino))
 		return;
+	map_set(&inomap[agno], agbno, len, inotab_id(id));
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		*idp = id;
-		if (mayprint &&
-		    (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting inode to %lld for block %u/%u\n"),
 				id->ino, agno, agbno + i);
 	}
@@ -4320,17 +5007,14 @@ set_rinomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_rinomap(bno, len, id->ino))
 		return;
+	map_set(&inomap[mp->m_sb.sb_agcount], bno, len, inotab_id(id));
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		*idp = id;
-		if (mayprint && (verbose || id->ilist || CHECK_BLIST(bno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLIST(bno + i))
 			dbprintf(_("setting inode to %lld for rtblock %llu\n"),
 				id->ino, bno + i);
 	}
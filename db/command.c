@@ -25,8 +25,10 @@
 #include "command.h"
 #include "convert.h"
 #include "debug.h"
+#include "dumpinodes.h"
 #include "type.h"
 #include "echo.h"
+#include "foreach.h"
 #include "faddr.h"
 #include "fprint.h"
 #include "field.h"
@@ -41,9 +43,11 @@
 #include "input.h"
 #include "io.h"
 #include "metadump.h"
+#include "namei.h"
 #include "output.h"
 #include "print.h"
 #include "quit.h"
+#include "quot.h"
 #include "sb.h"
 #include "write.h"
 #include "malloc.h"
@@ -68,8 +72,12 @@ add_command(
 	qsort(cmdtab, ncmds, sizeof(*cmdtab), cmd_compare);
 }
 
-int
-command(
+/*
+ * Look up the command argv[0] and check its argument count, returns NULL
+ * after saying what is wrong if it can't be run.
+ */
+const cmdinfo_t *
+check_command(
 	int		argc,
 	char		**argv)
 {
@@ -80,7 +88,7 @@ command(
 	ct = find_command(cmd);
 	if (ct == NULL) {
 		dbprintf(_("command %s not found\n"), cmd);
-		return 0;
+		return NULL;
 	}
 	if (argc-1 < ct->argmin || (ct->argmax != -1 && argc-1 > ct->argmax)) {
 		dbprintf(_("bad argument count %d to %s, expected "), argc-1, cmd);
@@ -91,8 +99,21 @@ command(
 		else
 			dbprintf(_("between %d and %d"), ct->argmin, ct->argmax);
 		dbprintf(_(" arguments\n"));
-		return 0;
+		return NULL;
 	}
+	return ct;
+}
+
+int
+command(
+	int		argc,
+	char		**argv)
+{
+	const cmdinfo_t	*ct;
+
+	ct = check_command(argc, argv);
+	if (ct == NULL)
+		return 0;
 	platform_getoptreset();
 	return ct->cfunc(argc, argv);
 }
@@ -124,7 +145,9 @@ init_commands(void)
 	check_init();
 	convert_init();
 	debug_init();
+	dumpinodes_init();
 	echo_init();
+	foreach_init();
 	frag_init();
 	freesp_init();
 	help_init();
@@ -133,9 +156,11 @@ init_commands(void)
 	input_init();
 	io_init();
 	metadump_init();
+	namei_init();
 	output_init();
 	print_init();
 	quit_init();
+	quot_init();
 	sb_init();
 	type_init();
 	write_init();
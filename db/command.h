@@ -36,6 +36,7 @@ extern cmdinfo_t	*cmdtab;
 extern int		ncmds;
 
 extern void		add_command(const cmdinfo_t *ci);
+extern const cmdinfo_t	*check_command(int argc, char **argv);
 extern int		command(int argc, char **argv);
 extern const cmdinfo_t	*find_command(const char *cmd);
 extern void		init_commands(void);
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "bmap.h"
+#include "command.h"
+#include "dumpinodes.h"
+#include "io.h"
+#include "type.h"
+#include "fprint.h"
+#include "faddr.h"
+#include "field.h"
+#include "output.h"
+#include "init.h"
+#include "inode.h"
+#include "malloc.h"
+#include "sig.h"
+
+/*
+ * Write the core of every allocated inode to a file in one pass over the
+ * inode btrees, without going through the field tables of "print".
+ *
+ * The binary format is a dumpino_hdr_t followed by a dumpino_rec_t for
+ * each inode, in host byte order, each followed by its nrecs data fork
+ * extents as dumpino_ext_t if the extents were asked for.  The csv format
+ * has a header line naming the columns, the json format is one object
+ * per line.
+ */
+#define DUMPINO_MAGIC	0x58444944	/* XDID */
+#define DUMPINO_VERSION	1
+
+#define DUMPINO_EXTENTS	(1 << 0)	/* records are followed by extents */
+
+typedef struct dumpino_hdr {
+	__uint32_t	magic;
+	__uint32_t	version;
+	uuid_t		uuid;
+	__uint32_t	blocksize;
+	__uint32_t	flags;		/* DUMPINO_* */
+} dumpino_hdr_t;
+
+typedef struct dumpino_rec {
+	__uint64_t	ino;
+	__uint64_t	size;
+	__uint64_t	nblocks;
+	__uint64_t	flags2;
+	__int32_t	atime;
+	__uint32_t	atime_nsec;
+	__int32_t	mtime;
+	__uint32_t	mtime_nsec;
+	__int32_t	ctime;
+	__uint32_t	ctime_nsec;
+	__int32_t	crtime;		/* 0 before version 3 inodes */
+	__uint32_t	crtime_nsec;
+	__uint32_t	uid;
+	__uint32_t	gid;
+	__uint32_t	nlink;
+	__uint32_t	projid;
+	__uint32_t	extsize;
+	__uint32_t	nextents;
+	__uint32_t	gen;
+	__uint32_t	nrecs;		/* dumpino_ext_t that follow */
+	__uint16_t	mode;
+	__uint16_t	flags;
+	__uint16_t	anextents;
+	__uint8_t	version;
+	__uint8_t	format;
+	__uint8_t	aformat;
+	__uint8_t	forkoff;
+	__uint8_t	pad[6];
+} dumpino_rec_t;
+
+typedef struct dumpino_ext {
+	__uint64_t	startoff;
+	__uint64_t	startblock;
+	__uint32_t	blockcount;
+	__uint32_t	unwritten;
+} dumpino_ext_t;
+
+#define	DUMP_BIN	0
+#define	DUMP_CSV	1
+#define	DUMP_JSON	2
+
+static int		dump_error;
+static int		dump_extents;
+static int		dump_format;
+static FILE		*dump_fp;
+static const char	*dump_name;
+static __uint64_t	dump_count;
+static bmap_ext_t	*dump_bmp;
+static int		dump_bmp_size;
+
+static int		dumpinodes_f(int argc, char **argv);
+static void		dumpinodes_help(void);
+static int		dump_bmap(xfs_ino_t ino, xfs_dinode_t *dip);
+static int		dump_inode(xfs_ino_t ino, xfs_dinode_t *dip,
+				   void *arg);
+static void		dump_write(const void *buf, size_t len);
+
+static const cmdinfo_t	dumpinodes_cmd =
+	{ "dumpinodes", NULL, dumpinodes_f, 1, -1, 0,
+	  N_("[-e] [-f bin|csv|json] [-a agno]... file"),
+	  N_("write the cores of all inodes to a file"), dumpinodes_help };
+
+static void
+dumpinodes_help(void)
+{
+	dbprintf(_(
+"\n"
+" Writes the core of every allocated inode to file, or to the standard\n"
+" output if file is \"-\", in a single pass over the inode btrees.  This is\n"
+" much faster than printing the inodes one at a time.\n"
+"\n"
+" Example:\n"
+" 'dumpinodes -e -f csv /tmp/inodes.csv' - all inodes and their data fork\n"
+"                                          extents, as comma separated values\n"
+"\n"
+" -a agno  only dump the inodes of AG agno, may be given more than once\n"
+" -e       also dump the extent list of each inode's data fork\n"
+" -f fmt   bin (the default) for fixed size records, csv for a header line\n"
+"          then a line per inode, or json for an object per line\n"
+"\n"
+		));
+}
+
+static int
+dumpinodes_f(
+	int		argc,
+	char		**argv)
+{
+	dumpino_hdr_t	hdr;
+	xfs_agnumber_t	agno;
+	char		*agmap = NULL;
+	char		*p;
+	int		c;
+
+	dump_extents = 0;
+	dump_format = DUMP_BIN;
+	optind = 0;
+	while ((c = getopt(argc, argv, "a:ef:")) != EOF) {
+		switch (c) {
+		case 'a':
+			agno = (xfs_agnumber_t)strtoul(optarg, &p, 0);
+			if (*p != '\0' || agno >= mp->m_sb.sb_agcount) {
+				dbprintf(_("bad allocation group number %s\n"),
+					optarg);
+				goto out;
+			}
+			if (!agmap)
+				agmap = xcalloc(mp->m_sb.sb_agcount, 1);
+			agmap[agno] = 1;
+			break;
+		case 'e':
+			dump_extents = 1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "bin") == 0)
+				dump_format = DUMP_BIN;
+			else if (strcmp(optarg, "csv") == 0)
+				dump_format = DUMP_CSV;
+			else if (strcmp(optarg, "json") == 0)
+				dump_format = DUMP_JSON;
+			else {
+				dbprintf(_("bad dump format %s\n"), optarg);
+				goto out;
+			}
+			break;
+		default:
+			dbprintf(_("bad option for dumpinodes command\n"));
+			goto out;
+		}
+	}
+	if (optind != argc - 1) {
+		dbprintf(_("dumpinodes needs one output file\n"));
+		goto out;
+	}
+
+	dump_name = argv[optind];
+	if (strcmp(dump_name, "-") == 0)
+		dump_fp = stdout;
+	else if ((dump_fp = fopen(dump_name, "w")) == NULL) {
+		dbprintf(_("can't open %s: %s\n"), dump_name, strerror(errno));
+		goto out;
+	}
+	/* large writes, the whole point is to keep up with the disk */
+	if (dump_fp != stdout)
+		setvbuf(dump_fp, NULL, _IOFBF, 1 << 20);
+	dump_error = 0;
+	dump_count = 0;
+
+	switch (dump_format) {
+	case DUMP_BIN:
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = DUMPINO_MAGIC;
+		hdr.version = DUMPINO_VERSION;
+		platform_uuid_copy(&hdr.uuid, &mp->m_sb.sb_uuid);
+		hdr.blocksize = mp->m_sb.sb_blocksize;
+		hdr.flags = dump_extents ? DUMPINO_EXTENTS : 0;
+		dump_write(&hdr, sizeof(hdr));
+		break;
+	case DUMP_CSV:
+		fprintf(dump_fp, "ino,mode,version,format,nlink,uid,gid,projid,"
+			"size,nblocks,extsize,nextents,anextents,forkoff,"
+			"aformat,flags,flags2,gen,atime,mtime,ctime,crtime%s\n",
+			dump_extents ? ",extents" : "");
+		break;
+	}
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount && !dump_error; agno++) {
+		if (seenint())
+			break;
+		if (agmap && !agmap[agno])
+			continue;
+		scan_ag_inodes(agno, dump_inode, NULL);
+	}
+
+	if (fflush(dump_fp) != 0)
+		dump_error = errno;
+	if (dump_fp != stdout && fclose(dump_fp) != 0 && !dump_error)
+		dump_error = errno;
+	if (dump_error)
+		dbprintf(_("error writing %s: %s\n"), dump_name,
+			strerror(dump_error));
+	else if (seenint())
+		dbprintf(_("interrupted after %llu inodes\n"),
+			(unsigned long long)dump_count);
+	else if (dump_fp != stdout)
+		dbprintf(_("dumped %llu inodes to %s\n"),
+			(unsigned long long)dump_count, dump_name);
+	dump_fp = NULL;
+	xfree(dump_bmp);
+	dump_bmp = NULL;
+	dump_bmp_size = 0;
+out:
+	xfree(agmap);
+	return 0;
+}
+
+void
+dumpinodes_init(void)
+{
+	add_command(&dumpinodes_cmd);
+}
+
+/*
+ * Get the data fork extents of a extents or btree format inode into
+ * dump_bmp, returns how many there are.
+ */
+static int
+dump_bmap(
+	xfs_ino_t	ino,
+	xfs_dinode_t	*dip)
+{
+	int		nex;
+
+	if (dip->di_format != XFS_DINODE_FMT_EXTENTS &&
+	    dip->di_format != XFS_DINODE_FMT_BTREE)
+		return 0;
+	nex = XFS_DFORK_NEXTENTS(dip, XFS_DATA_FORK);
+	if (nex <= 0)
+		return 0;
+	if (nex > dump_bmp_size) {
+		dump_bmp_size = nex;
+		dump_bmp = xrealloc(dump_bmp, nex * sizeof(*dump_bmp));
+	}
+	push_cur();
+	set_cur_inode(ino);
+	bmap(0, (xfs_filblks_t)-1, XFS_DATA_FORK, &nex, dump_bmp);
+	pop_cur();
+	return nex;
+}
+
+static int
+dump_inode(
+	xfs_ino_t	ino,
+	xfs_dinode_t	*dip,
+	void		*arg)
+{
+	dumpino_rec_t	rec;
+	dumpino_ext_t	ext;
+	int		i;
+	int		nex = 0;
+
+	if (be16_to_cpu(dip->di_magic) != XFS_DINODE_MAGIC) {
+		dbprintf(_("bad magic number %#x for inode %lld\n"),
+			be16_to_cpu(dip->di_magic), (long long)ino);
+		return 0;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ino = ino;
+	rec.mode = be16_to_cpu(dip->di_mode);
+	rec.version = dip->di_version;
+	rec.format = dip->di_format;
+	rec.uid = be32_to_cpu(dip->di_uid);
+	rec.gid = be32_to_cpu(dip->di_gid);
+	if (dip->di_version == 1)
+		rec.nlink = be16_to_cpu(dip->di_onlink);
+	else {
+		rec.nlink = be32_to_cpu(dip->di_nlink);
+		rec.projid = ((__uint32_t)be16_to_cpu(dip->di_projid_hi) << 16) |
+			     be16_to_cpu(dip->di_projid_lo);
+	}
+	rec.size = be64_to_cpu(dip->di_size);
+	rec.nblocks = be64_to_cpu(dip->di_nblocks);
+	rec.extsize = be32_to_cpu(dip->di_extsize);
+	rec.nextents = be32_to_cpu(dip->di_nextents);
+	rec.anextents = be16_to_cpu(dip->di_anextents);
+	rec.forkoff = dip->di_forkoff;
+	rec.aformat = dip->di_aformat;
+	rec.flags = be16_to_cpu(dip->di_flags);
+	rec.gen = be32_to_cpu(dip->di_gen);
+	rec.atime = be32_to_cpu(dip->di_atime.t_sec);
+	rec.atime_nsec = be32_to_cpu(dip->di_atime.t_nsec);
+	rec.mtime = be32_to_cpu(dip->di_mtime.t_sec);
+	rec.mtime_nsec = be32_to_cpu(dip->di_mtime.t_nsec);
+	rec.ctime = be32_to_cpu(dip->di_ctime.t_sec);
+	rec.ctime_nsec = be32_to_cpu(dip->di_ctime.t_nsec);
+	if (dip->di_version >= 3) {
+		rec.flags2 = be64_to_cpu(dip->di_flags2);
+		rec.crtime = be32_to_cpu(dip->di_crtime.t_sec);
+		rec.crtime_nsec = be32_to_cpu(dip->di_crtime.t_nsec);
+	}
+	if (dump_extents)
+		nex = dump_bmap(ino, dip);
+	rec.nrecs = nex;
+	dump_count++;
+
+	switch (dump_format) {
+	case DUMP_BIN:
+		dump_write(&rec, sizeof(rec));
+		for (i = 0; i < nex; i++) {
+			ext.startoff = dump_bmp[i].startoff;
+			ext.startblock = dump_bmp[i].startblock;
+			ext.blockcount = dump_bmp[i].blockcount;
+			ext.unwritten = dump_bmp[i].flag;
+			dump_write(&ext, sizeof(ext));
+		}
+		return dump_error;
+	case DUMP_CSV:
+		fprintf(dump_fp, "%llu,%#o,%u,%u,%u,%u,%u,%u,%llu,%llu,%u,%u,"
+			"%u,%u,%u,%#x,%#llx,%u,%d.%09u,%d.%09u,%d.%09u,"
+			"%d.%09u",
+			(unsigned long long)rec.ino, rec.mode, rec.version,
+			rec.format, rec.nlink, rec.uid, rec.gid, rec.projid,
+			(unsigned long long)rec.size,
+			(unsigned long long)rec.nblocks, rec.extsize,
+			rec.nextents, rec.anextents, rec.forkoff, rec.aformat,
+			rec.flags, (unsigned long long)rec.flags2, rec.gen,
+			rec.atime, rec.atime_nsec, rec.mtime, rec.mtime_nsec,
+			rec.ctime, rec.ctime_nsec, rec.crtime, rec.crtime_nsec);
+		if (dump_extents) {
+			/* startoff:startblock:blockcount[:u] separated by ; */
+			fputc(',', dump_fp);
+			for (i = 0; i < nex; i++)
+				fprintf(dump_fp, "%s%llu:%llu:%llu%s",
+					i ? ";" : "",
+					(unsigned long long)dump_bmp[i].startoff,
+					(unsigned long long)dump_bmp[i].startblock,
+					(unsigned long long)dump_bmp[i].blockcount,
+					dump_bmp[i].flag ? ":u" : "");
+		}
+		break;
+	case DUMP_JSON:
+		fprintf(dump_fp, "{\"ino\":%llu,\"mode\":%u,\"version\":%u,"
+			"\"format\":%u,\"nlink\":%u,\"uid\":%u,\"gid\":%u,"
+			"\"projid\":%u,\"size\":%llu,\"nblocks\":%llu,"
+			"\"extsize\":%u,\"nextents\":%u,\"anextents\":%u,"
+			"\"forkoff\":%u,\"aformat\":%u,\"flags\":%u,"
+			"\"flags2\":%llu,\"gen\":%u,\"atime\":%d.%09u,"
+			"\"mtime\":%d.%09u,\"ctime\":%d.%09u,\"crtime\":%d.%09u",
+			(unsigned long long)rec.ino, rec.mode, rec.version,
+			rec.format, rec.nlink, rec.uid, rec.gid, rec.projid,
+			(unsigned long long)rec.size,
+			(unsigned long long)rec.nblocks, rec.extsize,
+			rec.nextents, rec.anextents, rec.forkoff, rec.aformat,
+			rec.flags, (unsigned long long)rec.flags2, rec.gen,
+			rec.atime, rec.atime_nsec, rec.mtime, rec.mtime_nsec,
+			rec.ctime, rec.ctime_nsec, rec.crtime, rec.crtime_nsec);
+		if (dump_extents) {
+			/* [startoff, startblock, blockcount, unwritten] */
+			fputs(",\"extents\":[", dump_fp);
+			for (i = 0; i < nex; i++)
+				fprintf(dump_fp, "%s[%llu,%llu,%llu,%d]",
+					i ? "," : "",
+					(unsigned long long)dump_bmp[i].startoff,
+					(unsigned long long)dump_bmp[i].startblock,
+					(unsigned long long)dump_bmp[i].blockcount,
+					dump_bmp[i].flag);
+			fputc(']', dump_fp);
+		}
+		fputc('}', dump_fp);
+		break;
+	}
+	if (fputc('\n', dump_fp) == EOF)
+		dump_error = errno;
+	return dump_error;
+}
+
+static void
+dump_write(
+	const void	*buf,
+	size_t		len)
+{
+	if (!dump_error && fwrite(buf, len, 1, dump_fp) != 1)
+		dump_error = errno ? errno : EIO;
+}
@@ -29,6 +29,7 @@
 static void	flist_expand_arrays(flist_t *fl);
 static void	flist_expand_structs(flist_t *fl, void *obj);
 static flist_t	*flist_replicate(flist_t *fl);
+static flist_t	*flist_scan_name(char *name);
 static ftok_t	*flist_split(char *s);
 static void	ftok_free(ftok_t *ft);
 
@@ -258,9 +259,63 @@ flist_replicate(
 	return new;
 }
 
+/*
+ * While a foreach loop runs the same commands over and over, the field
+ * names they are given are scanned once and copies of the result handed
+ * out after that.  Where the fields are in the object is still worked out
+ * by flist_parse for each object, as it depends on the object's contents.
+ */
+#define	FLIST_CACHE_SIZE	32
+
+static struct {
+	char		*name;
+	flist_t		*fl;
+}		flist_cache[FLIST_CACHE_SIZE];
+static int	flist_ncache;
+static int	flist_caching;
+
+void
+flist_cache_start(void)
+{
+	flist_caching++;
+}
+
+void
+flist_cache_stop(void)
+{
+	if (--flist_caching)
+		return;
+	while (flist_ncache > 0) {
+		flist_ncache--;
+		xfree(flist_cache[flist_ncache].name);
+		flist_free(flist_cache[flist_ncache].fl);
+	}
+}
+
 flist_t *
 flist_scan(
 	char	*name)
+{
+	flist_t	*fl;
+	int	i;
+
+	if (!flist_caching)
+		return flist_scan_name(name);
+	for (i = 0; i < flist_ncache; i++)
+		if (strcmp(flist_cache[i].name, name) == 0)
+			return flist_replicate(flist_cache[i].fl);
+	fl = flist_scan_name(name);
+	if (fl && flist_ncache < FLIST_CACHE_SIZE) {
+		flist_cache[flist_ncache].name = xstrdup(name);
+		flist_cache[flist_ncache].fl = flist_replicate(fl);
+		flist_ncache++;
+	}
+	return fl;
+}
+
+static flist_t *
+flist_scan_name(
+	char	*name)
 {
 	flist_t	*fl;
 	flist_t	*lfl;
@@ -31,6 +31,8 @@ typedef struct ftok {
 	tokty_t	tokty;
 } ftok_t;
 
+extern void	flist_cache_start(void);
+extern void	flist_cache_stop(void);
 extern void	flist_free(flist_t *fl);
 extern flist_t	*flist_make(char *name);
 extern int	flist_parse(const struct field *fields, flist_t *fl, void *obj,
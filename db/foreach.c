@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "command.h"
+#include "foreach.h"
+#include "io.h"
+#include "type.h"
+#include "fprint.h"
+#include "faddr.h"
+#include "field.h"
+#include "flist.h"
+#include "output.h"
+#include "init.h"
+#include "inode.h"
+#include "malloc.h"
+#include "sig.h"
+
+/*
+ * Run a list of commands on every inode or every AG.  The commands are
+ * looked up and their arguments checked once, then called directly for
+ * each object, so a script doesn't have to run xfs_db once per object or
+ * feed it millions of command lines.
+ */
+typedef struct fecmd {
+	const cmdinfo_t	*ct;
+	int		argc;
+	char		**argv;		/* into the foreach arguments */
+} fecmd_t;
+
+typedef struct foreach {
+	fecmd_t		*cmds;
+	int		ncmds;
+	char		**args;		/* scratch copy, getopt permutes it */
+	xfs_ino_t	first;
+	xfs_ino_t	last;
+	int		done;		/* a command returned nonzero */
+	__uint64_t	count;
+} foreach_t;
+
+static int	foreach_f(int argc, char **argv);
+static void	foreach_help(void);
+
+static const cmdinfo_t	foreach_cmd =
+	{ "foreach", NULL, foreach_f, 2, -1, 0,
+	  N_("inode|ag [-a agno]... [-r first[-last]] command [; command]..."),
+	  N_("run commands on each inode or allocation group"), foreach_help };
+
+static void
+foreach_help(void)
+{
+	dbprintf(_(
+"\n"
+" Runs one or more commands, separated by ';' arguments, with the current\n"
+" position set to each allocated inode or each allocation group in turn.\n"
+" The commands are looked up once, and field names given to them are only\n"
+" parsed the first time, so this is much faster than running xfs_db with\n"
+" an 'inode' command for each object.\n"
+"\n"
+" Example:\n"
+" 'foreach inode print core.size ; print core.nextents'\n"
+"     - print the size and extent count of every inode\n"
+" 'foreach ag -r 4-7 agf ; print freeblks'\n"
+"     - print the free block count of AGs 4 to 7\n"
+"\n"
+" For 'inode' the position is set as with the inode command; for 'ag' the\n"
+" current AG is set, so that agf, agi, agfl and sb without an argument\n"
+" go to that AG's headers.  Each object starts from the same position, and\n"
+" commands after the first see the position the earlier ones moved to.\n"
+"\n"
+" -a agno         only the inodes of AG agno, may be given more than once\n"
+" -r first[-last] only the inode numbers or AGs from first to last\n"
+"\n"
+		));
+}
+
+/* run the commands once, at the position already set up */
+static void
+foreach_run(
+	foreach_t	*fe)
+{
+	fecmd_t		*c;
+
+	for (c = fe->cmds; c < &fe->cmds[fe->ncmds] && !seenint(); c++) {
+		memcpy(fe->args, c->argv, c->argc * sizeof(char *));
+		fe->args[c->argc] = NULL;
+		platform_getoptreset();
+		if (c->ct->cfunc(c->argc, fe->args)) {
+			fe->done = 1;
+			break;
+		}
+	}
+	fe->count++;
+}
+
+static int
+foreach_inode(
+	xfs_ino_t	ino,
+	xfs_dinode_t	*dip,
+	void		*arg)
+{
+	foreach_t	*fe = arg;
+
+	if (ino < fe->first)
+		return 0;
+	if (ino > fe->last)
+		return 1;
+	/* the inode chunk being walked is on top of the stack */
+	push_cur();
+	set_cur_inode(ino);
+	foreach_run(fe);
+	pop_cur();
+	return fe->done;
+}
+
+static int
+foreach_f(
+	int		argc,
+	char		**argv)
+{
+	foreach_t	fe;
+	xfs_agnumber_t	agno;
+	xfs_agnumber_t	saved_agno = cur_agno;
+	__uint64_t	first = 0;
+	__uint64_t	last = ~0ULL;
+	char		*agmap = NULL;
+	char		*p;
+	int		inodes;
+	int		c;
+	int		i;
+
+	memset(&fe, 0, sizeof(fe));
+	if (strcmp(argv[1], "inode") == 0)
+		inodes = 1;
+	else if (strcmp(argv[1], "ag") == 0)
+		inodes = 0;
+	else {
+		dbprintf(_("foreach works on \"inode\" or \"ag\", not %s\n"),
+			argv[1]);
+		return 0;
+	}
+
+	/* stop at the first command, its options are its own */
+	argc--;
+	argv++;
+	optind = 0;
+	while ((c = getopt(argc, argv, "+a:r:")) != EOF) {
+		switch (c) {
+		case 'a':
+			if (!inodes) {
+				dbprintf(_("-a only applies to foreach inode\n"));
+				goto out;
+			}
+			agno = (xfs_agnumber_t)strtoul(optarg, &p, 0);
+			if (*p != '\0' || agno >= mp->m_sb.sb_agcount) {
+				dbprintf(_("bad allocation group number %s\n"),
+					optarg);
+				goto out;
+			}
+			if (!agmap)
+				agmap = xcalloc(mp->m_sb.sb_agcount, 1);
+			agmap[agno] = 1;
+			break;
+		case 'r':
+			first = strtoull(optarg, &p, 0);
+			if (*p == '-')
+				last = strtoull(p + 1, &p, 0);
+			else
+				last = first;
+			if (*p != '\0' || last < first) {
+				dbprintf(_("bad range %s\n"), optarg);
+				goto out;
+			}
+			break;
+		default:
+			dbprintf(_("bad option for foreach command\n"));
+			goto out;
+		}
+	}
+	if (optind == argc) {
+		dbprintf(_("foreach needs a command to run\n"));
+		goto out;
+	}
+	if (!inodes && first >= mp->m_sb.sb_agcount) {
+		dbprintf(_("no allocation group %llu\n"),
+			(unsigned long long)first);
+		goto out;
+	}
+
+	/* split the rest at the ";" arguments, and check each command */
+	fe.cmds = xcalloc(argc - optind, sizeof(*fe.cmds));
+	fe.args = xcalloc(argc - optind + 1, sizeof(char *));
+	for (i = optind; i <= argc; i++) {
+		if (i < argc && strcmp(argv[i], ";") != 0)
+			continue;
+		if (i == optind) {
+			dbprintf(_("empty command in foreach\n"));
+			goto out_free;
+		}
+		fe.cmds[fe.ncmds].argc = i - optind;
+		fe.cmds[fe.ncmds].argv = &argv[optind];
+		fe.cmds[fe.ncmds].ct = check_command(i - optind, &argv[optind]);
+		if (fe.cmds[fe.ncmds].ct == NULL)
+			goto out_free;
+		fe.ncmds++;
+		optind = i + 1;
+	}
+	fe.first = first;
+	fe.last = last;
+
+	flist_cache_start();
+	if (inodes) {
+		for (agno = 0; agno < mp->m_sb.sb_agcount && !fe.done &&
+			       !seenint(); agno++) {
+			if (agmap && !agmap[agno])
+				continue;
+			if (XFS_AGINO_TO_INO(mp, agno, 0) > fe.last)
+				break;
+			if (agno + 1 < mp->m_sb.sb_agcount &&
+			    XFS_AGINO_TO_INO(mp, agno + 1, 0) <= fe.first)
+				continue;
+			scan_ag_inodes(agno, foreach_inode, &fe);
+		}
+	} else {
+		for (agno = first; agno < mp->m_sb.sb_agcount &&
+				   agno <= last && !fe.done && !seenint();
+		     agno++) {
+			cur_agno = agno;
+			push_cur();
+			foreach_run(&fe);
+			pop_cur();
+		}
+		cur_agno = saved_agno;
+	}
+	flist_cache_stop();
+	if (seenint())
+		dbprintf(_("interrupted after %llu %s\n"),
+			(unsigned long long)fe.count,
+			inodes ? _("inodes") : _("allocation groups"));
+
+out_free:
+	xfree(fe.cmds);
+	xfree(fe.args);
+out:
+	xfree(agmap);
+	return fe.done;
+}
+
+void
+foreach_init(void)
+{
+	add_command(&foreach_cmd);
+}
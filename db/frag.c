@@ -40,17 +40,47 @@ typedef	struct extmap {
 #define	EXTMAP_SIZE(n)	\
 	(offsetof(extmap_t, ents) + (sizeof(extent_t) * (n)))
 
+/*
+ * The extent counts of each AG's inodes are kept, summed by the kind of
+ * fork, until something is written, so running frag again with other
+ * options doesn't read the inodes again.  Regular files are summed by
+ * which of realtime, realtime control file and quota file they are, as
+ * each is counted with its own option; then directories, symlinks and
+ * attribute forks of any inode.
+ */
+#define	FRAG_REG	0
+#define	FRAG_RT		1		/* regular, or'ed together */
+#define	FRAG_RTMETA	2
+#define	FRAG_QUOTA	4
+#define	FRAG_DIR	8
+#define	FRAG_LNK	9
+#define	FRAG_ATTR	10
+#define	FRAG_NKINDS	11
+
+typedef struct agfrag {
+	int		valid;
+	int		bad;		/* a block couldn't be read */
+	__uint64_t	actual[FRAG_NKINDS];
+	__uint64_t	ideal[FRAG_NKINDS];
+} agfrag_t;
+
 static int		aflag;
 static int		dflag;
 static __uint64_t	extcount_actual;
 static __uint64_t	extcount_ideal;
 static int		fflag;
 static int		lflag;
+static int		nthreads;
 static int		qflag;
 static int		Rflag;
 static int		rflag;
 static int		vflag;
 
+static agfrag_t		*agfrag;
+static xfs_agnumber_t	agfrag_count;
+static unsigned int	agfrag_gen;
+static __thread agfrag_t *curag;	/* being scanned by this thread */
+
 typedef void	(*scan_lbtree_f_t)(struct xfs_btree_block *block,
 				   int			level,
 				   extmap_t		**extmapp,
@@ -60,10 +90,12 @@ typedef void	(*scan_sbtree_f_t)(struct xfs_btree_block *block,
 				   int			level,
 				   xfs_agf_t		*agf);
 
+static void		agfrag_check(void);
 static extmap_t		*extmap_alloc(xfs_extnum_t nex);
 static xfs_extnum_t	extmap_ideal(extmap_t *extmap);
 static void		extmap_set_ext(extmap_t **extmapp, xfs_fileoff_t o,
 				       xfs_extlen_t c);
+static int		frag_counted(int kind);
 static int		frag_f(int argc, char **argv);
 static int		init(int argc, char **argv);
 static void		process_bmbt_reclist(xfs_bmbt_rec_t *rp, int numrecs,
@@ -72,7 +104,8 @@ static void		process_btinode(xfs_dinode_t *dip, extmap_t **extmapp,
 					int whichfork);
 static void		process_exinode(xfs_dinode_t *dip, extmap_t **extmapp,
 					int whichfork);
-static void		process_fork(xfs_dinode_t *dip, int whichfork);
+static void		process_fork(xfs_dinode_t *dip, int whichfork,
+				     __uint64_t *actual, __uint64_t *ideal);
 static void		process_inode(xfs_agf_t *agf, xfs_agino_t agino,
 				      xfs_dinode_t *dip);
 static void		scan_ag(xfs_agnumber_t agno);
@@ -89,9 +122,22 @@ static void		scanfunc_ino(struct xfs_btree_block *block, int level,
 
 static const cmdinfo_t	frag_cmd =
 	{ "frag", NULL, frag_f, 0, -1, 0,
-	  "[-a] [-d] [-f] [-l] [-q] [-R] [-r] [-v]",
+	  "[-a] [-d] [-f] [-l] [-q] [-R] [-r] [-v] [-T threads]",
 	  "get file fragmentation data", NULL };
 
+/* forget the counts of the AGs if anything has been written since */
+static void
+agfrag_check(void)
+{
+	if (agfrag && agfrag_gen == io_write_gen &&
+	    agfrag_count == mp->m_sb.sb_agcount)
+		return;
+	xfree(agfrag);
+	agfrag = xcalloc(mp->m_sb.sb_agcount, sizeof(*agfrag));
+	agfrag_count = mp->m_sb.sb_agcount;
+	agfrag_gen = io_write_gen;
+}
+
 static extmap_t *
 extmap_alloc(
 	xfs_extnum_t	nex)
@@ -144,6 +190,24 @@ extmap_set_ext(
 	extmap->nents++;
 }
 
+/* whether the options ask for forks of this kind */
+static int
+frag_counted(
+	int		kind)
+{
+	switch (kind) {
+	case FRAG_DIR:
+		return dflag;
+	case FRAG_LNK:
+		return lflag;
+	case FRAG_ATTR:
+		return aflag;
+	}
+	return fflag && (rflag || !(kind & FRAG_RT)) &&
+	       (Rflag || !(kind & FRAG_RTMETA)) &&
+	       (qflag || !(kind & FRAG_QUOTA));
+}
+
 void
 frag_init(void)
 {
@@ -160,11 +224,24 @@ frag_f(
 {
 	xfs_agnumber_t	agno;
 	double		answer;
+	int		kind;
 
 	if (!init(argc, argv))
 		return 0;
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		scan_ag(agno);
+	agfrag_check();
+	scan_ags(nthreads, scan_ag);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (!agfrag[agno].valid)
+			continue;
+		for (kind = 0; kind < FRAG_NKINDS; kind++) {
+			if (!frag_counted(kind))
+				continue;
+			extcount_actual += agfrag[agno].actual[kind];
+			extcount_ideal += agfrag[agno].ideal[kind];
+		}
+		if (agfrag[agno].bad)
+			memset(&agfrag[agno], 0, sizeof(agfrag[agno]));
+	}
 	if (extcount_actual)
 		answer = (double)(extcount_actual - extcount_ideal) * 100.0 /
 			 (double)extcount_actual;
@@ -183,8 +260,9 @@ init(
 	int		c;
 
 	aflag = dflag = fflag = lflag = qflag = Rflag = rflag = vflag = 0;
+	nthreads = 1;
 	optind = 0;
-	while ((c = getopt(argc, argv, "adflqRrv")) != EOF) {
+	while ((c = getopt(argc, argv, "adflqRrT:v")) != EOF) {
 		switch (c) {
 		case 'a':
 			aflag = 1;
@@ -207,6 +285,14 @@ init(
 		case 'r':
 			rflag = 1;
 			break;
+		case 'T':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_SCAN_THREADS) {
+				dbprintf(_("bad number of threads %s for frag "
+					   "command\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'v':
 			vflag = 1;
 			break;
@@ -278,7 +364,9 @@ process_exinode(
 static void
 process_fork(
 	xfs_dinode_t	*dip,
-	int		whichfork)
+	int		whichfork,
+	__uint64_t	*actual,
+	__uint64_t	*ideal)
 {
 	extmap_t	*extmap;
 	int		nex;
@@ -295,62 +383,74 @@ process_fork(
 		process_btinode(dip, &extmap, whichfork);
 		break;
 	}
-	extcount_actual += extmap->nents;
-	extcount_ideal += extmap_ideal(extmap);
+	*actual += extmap->nents;
+	*ideal += extmap_ideal(extmap);
 	xfree(extmap);
 }
 
+/*
+ * Count the extents of both forks of the inode, whatever the options,
+ * for the AG's totals.
+ */
 static void
 process_inode(
 	xfs_agf_t		*agf,
 	xfs_agino_t		agino,
 	xfs_dinode_t		*dip)
 {
-	__uint64_t		actual;
-	__uint64_t		ideal;
+	__uint64_t		actual[2] = { 0, 0 };	/* by fork */
+	__uint64_t		ideal[2] = { 0, 0 };
 	xfs_ino_t		ino;
+	int			kind;
 	int			skipa;
 	int			skipd;
 
 	ino = XFS_AGINO_TO_INO(mp, be32_to_cpu(agf->agf_seqno), agino);
 	switch (be16_to_cpu(dip->di_mode) & S_IFMT) {
 	case S_IFDIR:
-		skipd = !dflag;
+		kind = FRAG_DIR;
 		break;
 	case S_IFREG:
-		if (!rflag && (be16_to_cpu(dip->di_flags) & XFS_DIFLAG_REALTIME))
-			skipd = 1;
-		else if (!Rflag &&
-			 (ino == mp->m_sb.sb_rbmino ||
-			  ino == mp->m_sb.sb_rsumino))
-			skipd = 1;
-		else if (!qflag &&
-			 (ino == mp->m_sb.sb_uquotino ||
-			  ino == mp->m_sb.sb_gquotino ||
-			  ino == mp->m_sb.sb_pquotino))
-			skipd = 1;
-		else
-			skipd = !fflag;
+		kind = FRAG_REG;
+		if (be16_to_cpu(dip->di_flags) & XFS_DIFLAG_REALTIME)
+			kind |= FRAG_RT;
+		if (ino == mp->m_sb.sb_rbmino || ino == mp->m_sb.sb_rsumino)
+			kind |= FRAG_RTMETA;
+		if (ino == mp->m_sb.sb_uquotino ||
+		    ino == mp->m_sb.sb_gquotino ||
+		    ino == mp->m_sb.sb_pquotino)
+			kind |= FRAG_QUOTA;
 		break;
 	case S_IFLNK:
-		skipd = !lflag;
+		kind = FRAG_LNK;
 		break;
 	default:
-		skipd = 1;
+		kind = -1;
 		break;
 	}
-	actual = extcount_actual;
-	ideal = extcount_ideal;
-	if (!skipd)
-		process_fork(dip, XFS_DATA_FORK);
+	skipd = kind < 0 || !frag_counted(kind);
 	skipa = !aflag || !XFS_DFORK_Q(dip);
-	if (!skipa)
-		process_fork(dip, XFS_ATTR_FORK);
+	if (kind >= 0) {
+		process_fork(dip, XFS_DATA_FORK, &actual[XFS_DATA_FORK],
+			     &ideal[XFS_DATA_FORK]);
+		curag->actual[kind] += actual[XFS_DATA_FORK];
+		curag->ideal[kind] += ideal[XFS_DATA_FORK];
+	}
+	if (XFS_DFORK_Q(dip)) {
+		process_fork(dip, XFS_ATTR_FORK, &actual[XFS_ATTR_FORK],
+			     &ideal[XFS_ATTR_FORK]);
+		curag->actual[FRAG_ATTR] += actual[XFS_ATTR_FORK];
+		curag->ideal[FRAG_ATTR] += ideal[XFS_ATTR_FORK];
+	}
 	if (vflag && (!skipd || !skipa))
-		dbprintf(_("inode %lld actual %lld ideal %lld\n"),
-			ino, extcount_actual - actual, extcount_ideal - ideal);
+		dbprintf(_("inode %lld actual %lld ideal %lld\n"), ino,
+			(skipd ? 0 : actual[XFS_DATA_FORK]) +
+			(skipa ? 0 : actual[XFS_ATTR_FORK]),
+			(skipd ? 0 : ideal[XFS_DATA_FORK]) +
+			(skipa ? 0 : ideal[XFS_ATTR_FORK]));
 }
 
+/* count the extents of the AG's inodes, unless they are known already */
 static void
 scan_ag(
 	xfs_agnumber_t	agno)
@@ -358,6 +458,10 @@ scan_ag(
 	xfs_agf_t	*agf;
 	xfs_agi_t	*agi;
 
+	curag = &agfrag[agno];
+	if (curag->valid && !vflag)
+		return;
+	memset(curag, 0, sizeof(*curag));
 	push_cur();
 	set_cur(&typtab[TYP_AGF],
 		XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
@@ -365,6 +469,7 @@ scan_ag(
 	if ((agf = iocur_top->data) == NULL) {
 		dbprintf(_("can't read agf block for ag %u\n"), agno);
 		pop_cur();
+		curag->bad = 1;
 		return;
 	}
 	push_cur();
@@ -375,12 +480,14 @@ scan_ag(
 		dbprintf(_("can't read agi block for ag %u\n"), agno);
 		pop_cur();
 		pop_cur();
+		curag->bad = 1;
 		return;
 	}
 	scan_sbtree(agf, be32_to_cpu(agi->agi_root), 
 			be32_to_cpu(agi->agi_level), scanfunc_ino, TYP_INOBT);
 	pop_cur();
 	pop_cur();
+	curag->valid = 1;
 }
 
 static void
@@ -398,6 +505,7 @@ scan_lbtree(
 		dbprintf(_("can't read btree block %u/%u\n"),
 			XFS_FSB_TO_AGNO(mp, root),
 			XFS_FSB_TO_AGBNO(mp, root));
+		curag->bad = 1;
 		return;
 	}
 	(*func)(iocur_top->data, nlevels - 1, extmapp, btype);
@@ -419,6 +527,7 @@ scan_sbtree(
 		blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		dbprintf(_("can't read btree block %u/%u\n"), seqno, root);
+		curag->bad = 1;
 		return;
 	}
 	(*func)(iocur_top->data, nlevels - 1, agf);
@@ -489,6 +598,7 @@ scanfunc_ino(
 			if (iocur_top->data == NULL) {
 				dbprintf(_("can't read inode block %u/%u\n"),
 					seqno, XFS_AGINO_TO_AGBNO(mp, agino));
+				curag->bad = 1;
 				continue;
 			}
 			for (j = 0; j < XFS_INODES_PER_CHUNK; j++) {
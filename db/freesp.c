@@ -33,9 +33,30 @@ typedef struct histent
 	long long	blocks;
 } histent_t;
 
+/*
+ * The free extents of each AG, in the order the scan found them.  They
+ * are kept until something is written, so running freesp again with
+ * other options doesn't read the AGs again.  The by-size btree (-c) has
+ * them in another order, so it has a cache of its own.
+ */
+typedef struct freeext {
+	xfs_agblock_t	agbno;
+	xfs_extlen_t	len;
+} freeext_t;
+
+typedef struct agfree {
+	int		valid;
+	int		bad;		/* a block couldn't be read */
+	int		nexts;
+	int		naexts;
+	freeext_t	*exts;
+} agfree_t;
+
 static void	addhistent(int h);
 static void	addtohist(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			  xfs_extlen_t len);
+static void	agfree_add(xfs_agblock_t agbno, xfs_extlen_t len);
+static void	agfree_check(void);
 static int	freesp_f(int argc, char **argv);
 static void	histinit(int maxlen);
 static int	init(int argc, char **argv);
@@ -64,10 +85,17 @@ static int		seen1;
 static int		summaryflag;
 static long long	totblocks;
 static long long	totexts;
+static int		nthreads;
+
+static agfree_t		*agfree[2];	/* per AG, by bno and by cnt */
+static xfs_agnumber_t	agfree_count;
+static unsigned int	agfree_gen;
+static __thread agfree_t *curag;	/* being scanned by this thread */
 
 static const cmdinfo_t	freesp_cmd =
 	{ "freesp", NULL, freesp_f, 0, -1, 0,
-	  "[-bcdfs] [-a agno]... [-e binsize] [-h h1]... [-m binmult]",
+	  "[-bcdfs] [-a agno]... [-e binsize] [-h h1]... [-m binmult] "
+	  "[-T threads]",
 	  "summarize free space for filesystem", NULL };
 
 static int
@@ -93,16 +121,28 @@ freesp_f(
 	char		**argv)
 {
 	xfs_agnumber_t	agno;
+	agfree_t	*ag;
+	int		i;
 
 	if (!init(argc, argv))
 		return 0;
 
+	agfree_check();
+	scan_ags(nthreads, scan_ag);
+
 	if (dumpflag)
 		dbprintf("%8s %8s %8s\n", "agno", "agbno", "len");
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
-		if (inaglist(agno))
-			scan_ag(agno);
+		ag = &agfree[countflag][agno];
+		if (!inaglist(agno) || !ag->valid)
+			continue;
+		for (i = 0; i < ag->nexts; i++)
+			addtohist(agno, ag->exts[i].agbno, ag->exts[i].len);
+		if (ag->bad) {
+			xfree(ag->exts);
+			memset(ag, 0, sizeof(*ag));
+		}
 	}
 	if (histcount)
 		printhist();
@@ -145,9 +185,10 @@ init(
 	agcount = countflag = dumpflag = equalsize = multsize = optind = 0;
 	histcount = seen1 = summaryflag = 0;
 	totblocks = totexts = 0;
+	nthreads = 1;
 	aglist = NULL;
 	hist = NULL;
-	while ((c = getopt(argc, argv, "a:bcde:h:m:s")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bcde:h:m:sT:")) != EOF) {
 		switch (c) {
 		case 'a':
 			aglistadd(optarg);
@@ -185,6 +226,11 @@ init(
 		case 's':
 			summaryflag = 1;
 			break;
+		case 'T':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_SCAN_THREADS)
+				return usage();
+			break;
 		case '?':
 			return usage();
 		}
@@ -201,16 +247,55 @@ static int
 usage(void)
 {
 	dbprintf(_("freesp arguments: [-bcds] [-a agno] [-e binsize] [-h h1]... "
-		 "[-m binmult]\n"));
+		 "[-m binmult] [-T threads]\n"));
 	return 0;
 }
 
+/* forget the extents of the AGs if anything has been written since */
+static void
+agfree_check(void)
+{
+	xfs_agnumber_t	agno;
+	int		c;
+
+	if (agfree[0] && agfree_gen == io_write_gen &&
+	    agfree_count == mp->m_sb.sb_agcount)
+		return;
+	for (c = 0; c < 2; c++) {
+		for (agno = 0; agfree[c] && agno < agfree_count; agno++)
+			xfree(agfree[c][agno].exts);
+		xfree(agfree[c]);
+		agfree[c] = xcalloc(mp->m_sb.sb_agcount, sizeof(*agfree[c]));
+	}
+	agfree_count = mp->m_sb.sb_agcount;
+	agfree_gen = io_write_gen;
+}
+
+static void
+agfree_add(
+	xfs_agblock_t	agbno,
+	xfs_extlen_t	len)
+{
+	if (curag->nexts == curag->naexts) {
+		curag->naexts = curag->naexts ? curag->naexts * 2 : 64;
+		curag->exts = xrealloc(curag->exts,
+				curag->naexts * sizeof(*curag->exts));
+	}
+	curag->exts[curag->nexts].agbno = agbno;
+	curag->exts[curag->nexts].len = len;
+	curag->nexts++;
+}
+
+/* read the free extents of the AG, unless they are known already */
 static void
 scan_ag(
 	xfs_agnumber_t	agno)
 {
 	xfs_agf_t	*agf;
 
+	curag = &agfree[countflag][agno];
+	if (!inaglist(agno) || curag->valid)
+		return;
 	push_cur();
 	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
 				XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
@@ -225,6 +310,7 @@ scan_ag(
 			TYP_BNOBT, be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNO]),
 			scanfunc_bno);
 	pop_cur();
+	curag->valid = 1;
 }
 
 static void
@@ -260,7 +346,7 @@ scan_freelist(
 
 	for (;;) {
 		bno = be32_to_cpu(agfl_bno[i]);
-		addtohist(seqno, bno, 1);
+		agfree_add(bno, 1);
 		if (i == be32_to_cpu(agf->agf_fllast))
 			break;
 		if (++i == XFS_AGFL_SIZE(mp))
@@ -287,6 +373,7 @@ scan_sbtree(
 		blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		dbprintf(_("can't read btree block %u/%u\n"), seqno, root);
+		curag->bad = 1;
 		return;
 	}
 	(*func)(iocur_top->data, typ, nlevels - 1, agf);
@@ -312,8 +399,7 @@ scanfunc_bno(
 	if (level == 0) {
 		rp = XFS_ALLOC_REC_ADDR(mp, block, 1);
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-			addtohist(be32_to_cpu(agf->agf_seqno),
-					be32_to_cpu(rp[i].ar_startblock),
+			agfree_add(be32_to_cpu(rp[i].ar_startblock),
 					be32_to_cpu(rp[i].ar_blockcount));
 		return;
 	}
@@ -340,8 +426,7 @@ scanfunc_cnt(
 	if (level == 0) {
 		rp = XFS_ALLOC_REC_ADDR(mp, block, 1);
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-			addtohist(be32_to_cpu(agf->agf_seqno),
-					be32_to_cpu(rp[i].ar_startblock),
+			agfree_add(be32_to_cpu(rp[i].ar_startblock),
 					be32_to_cpu(rp[i].ar_blockcount));
 		return;
 	}
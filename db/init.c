@@ -44,7 +44,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, _(
-		"Usage: %s [-ifFrxV] [-p prog] [-l logdev] [-c cmd]... device\n"
+		"Usage: %s [-difFrxV] [-p prog] [-l logdev] [-C nbufs] [-c cmd]... device\n"
 		), progname);
 	exit(1);
 }
@@ -57,18 +57,32 @@ init(
 	struct xfs_sb	*sbp;
 	struct xfs_buf	*bp;
 	int		c;
+	long		nbufs;
+	char		*p;
 
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "c:fFip:rxVl:")) != EOF) {
+	while ((c = getopt(argc, argv, "c:C:dfFip:rxVl:")) != EOF) {
 		switch (c) {
 		case 'c':
 			cmdline = xrealloc(cmdline, (ncmdline+1)*sizeof(char*));
 			cmdline[ncmdline++] = optarg;
 			break;
+		case 'C':
+			nbufs = strtol(optarg, &p, 0);
+			if (*p || nbufs <= 0) {
+				fprintf(stderr, _("%s: bad buffer count %s\n"),
+					progname, optarg);
+				exit(1);
+			}
+			libxfs_bhash_size = max(1, nbufs / HASH_CACHE_RATIO);
+			break;
+		case 'd':
+			x.isdirect = LIBXFS_DIRECT;
+			break;
 		case 'f':
 			x.disfile = 1;
 			break;
@@ -109,7 +123,12 @@ init(
 	else
 		x.dname = fsdevice;
 
-	x.bcache_flags = CACHE_MISCOMPARE_PURGE;
+	/*
+	 * Commands like blockget read every metadata block once, so keep the
+	 * buffers that are revisited while moving around the filesystem with
+	 * the scan resistant replacement policy.
+	 */
+	x.bcache_flags = CACHE_MISCOMPARE_PURGE | CACHE_POLICY_CLOCK;
 	if (!libxfs_init(&x)) {
 		fputs(_("\nfatal error -- couldn't initialize XFS library\n"),
 			stderr);
@@ -156,19 +175,6 @@ init(
 	}
 	blkbb = 1 << mp->m_blkbb_log;
 
-	/*
-	 * xfs_check needs corrected incore superblock values
-	 */
-	if (sbp->sb_rootino != NULLFSINO &&
-	    xfs_sb_version_haslazysbcount(&mp->m_sb)) {
-		int error = xfs_initialize_perag_data(mp, sbp->sb_agcount);
-		if (error) {
-			fprintf(stderr,
-	_("%s: cannot init perag data (%d). Continuing anyway.\n"),
-				progname, error);
-		}
-	}
-
 	if (xfs_sb_version_hassparseinodes(&mp->m_sb))
 		type_set_tab_spcrc();
 	else if (xfs_sb_version_hascrc(&mp->m_sb))
@@ -179,6 +185,32 @@ init(
 	init_sig();
 }
 
+/*
+ * xfs_check needs corrected incore superblock values.  Getting them means
+ * reading every AGF and AGI, which on a filesystem with a lot of AGs
+ * takes much longer than most commands, so the commands that use the
+ * counters ask for them when they start rather than it being done here.
+ */
+void
+init_perag_data(void)
+{
+	static int	done;
+	int		error;
+
+	if (done)
+		return;
+	done = 1;
+	if (mp->m_sb.sb_rootino == NULLFSINO ||
+	    !xfs_sb_version_haslazysbcount(&mp->m_sb))
+		return;
+	error = xfs_initialize_perag_data(mp, mp->m_sb.sb_agcount);
+	if (error) {
+		fprintf(stderr,
+	_("%s: cannot init perag data (%d). Continuing anyway.\n"),
+			progname, error);
+	}
+}
+
 int
 main(
 	int	argc,
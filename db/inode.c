@@ -29,6 +29,7 @@
 #include "bit.h"
 #include "output.h"
 #include "init.h"
+#include "sig.h"
 
 static int	inode_a_bmbt_count(void *obj, int startoff);
 static int	inode_a_bmx_count(void *obj, int startoff);
@@ -704,3 +705,117 @@ _("Metadata CRC error detected for ino %lld\n"),
 	/* track updated info in ring */
 	ring_add();
 }
+
+/*
+ * Walk the inode btree below bno, reading ahead the inode chunks of each
+ * leaf and then calling func for each allocated inode in them.  The chunk
+ * is the top of the stack while func runs, so func has to push the cursor
+ * before moving it.  Returns nonzero if func asked to stop.
+ */
+static int
+scan_inobt_inodes(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	int			level,
+	inode_scan_func_t	func,
+	void			*arg)
+{
+	struct xfs_btree_block	*block;
+	xfs_agino_t		agino;
+	xfs_agblock_t		agbno;
+	int			error = 0;
+	int			i;
+	int			j;
+	int			len;
+	int			off;
+	xfs_inobt_ptr_t		*pp;
+	xfs_inobt_rec_t		*rp;
+
+	push_cur();
+	set_cur(&typtab[TYP_INOBT], XFS_AGB_TO_DADDR(mp, agno, bno), blkbb,
+		DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (block == NULL) {
+		dbprintf(_("can't read inobt block %u/%u\n"), agno, bno);
+		pop_cur();
+		return 0;
+	}
+	if ((be32_to_cpu(block->bb_magic) != XFS_IBT_MAGIC &&
+	     be32_to_cpu(block->bb_magic) != XFS_IBT_CRC_MAGIC) ||
+	    be16_to_cpu(block->bb_level) != level ||
+	    be16_to_cpu(block->bb_numrecs) > mp->m_inobt_mxr[level != 0]) {
+		dbprintf(_("bad inobt block %u/%u\n"), agno, bno);
+		pop_cur();
+		return 0;
+	}
+	if (level) {
+		pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs) && !error &&
+			    !seenint(); i++)
+			error = scan_inobt_inodes(agno, be32_to_cpu(pp[i]),
+					level - 1, func, arg);
+		pop_cur();
+		return error;
+	}
+	rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+	len = (int)XFS_FSB_TO_BB(mp, mp->m_ialloc_blks);
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
+		agbno = XFS_AGINO_TO_AGBNO(mp, be32_to_cpu(rp[i].ir_startino));
+		libxfs_buf_readahead(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, agbno), len,
+			typtab[TYP_INODE].bops);
+	}
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs) && !error &&
+		    !seenint(); i++) {
+		agino = be32_to_cpu(rp[i].ir_startino);
+		agbno = XFS_AGINO_TO_AGBNO(mp, agino);
+		off = XFS_INO_TO_OFFSET(mp, agino);
+		push_cur();
+		set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+			len, DB_RING_IGN, NULL);
+		if (iocur_top->data == NULL) {
+			dbprintf(_("can't read inode block %u/%u\n"), agno,
+				agbno);
+			pop_cur();
+			continue;
+		}
+		for (j = 0; j < XFS_INODES_PER_CHUNK && !error; j++) {
+			if (XFS_INOBT_IS_FREE_DISK(&rp[i], j))
+				continue;
+			error = func(XFS_AGINO_TO_INO(mp, agno, agino + j),
+				(xfs_dinode_t *)((char *)iocur_top->data +
+					((off + j) << mp->m_sb.sb_inodelog)),
+				arg);
+		}
+		pop_cur();
+	}
+	pop_cur();
+	return error;
+}
+
+/*
+ * Call func for each allocated inode of an AG, in inode number order.
+ * Returns nonzero if func returned nonzero to stop the scan.
+ */
+int
+scan_ag_inodes(
+	xfs_agnumber_t		agno,
+	inode_scan_func_t	func,
+	void			*arg)
+{
+	xfs_agi_t		*agi;
+	int			error;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	if ((agi = iocur_top->data) == NULL) {
+		dbprintf(_("can't read agi block for ag %u\n"), agno);
+		pop_cur();
+		return 0;
+	}
+	error = scan_inobt_inodes(agno, be32_to_cpu(agi->agi_root),
+			be32_to_cpu(agi->agi_level) - 1, func, arg);
+	pop_cur();
+	return error;
+}
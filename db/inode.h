@@ -34,3 +34,8 @@ extern typnm_t	inode_next_type(void);
 extern int	inode_size(void *obj, int startoff, int idx);
 extern int	inode_u_size(void *obj, int startoff, int idx);
 extern void	set_cur_inode(xfs_ino_t ino);
+
+typedef int	(*inode_scan_func_t)(xfs_ino_t ino, struct xfs_dinode *dip,
+				     void *arg);
+extern int	scan_ag_inodes(xfs_agnumber_t agno, inode_scan_func_t func,
+			       void *arg);
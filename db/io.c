@@ -27,6 +27,7 @@
 #include "output.h"
 #include "init.h"
 #include "malloc.h"
+#include "sig.h"
 
 static int	pop_f(int argc, char **argv);
 static void     pop_help(void);
@@ -40,6 +41,8 @@ static int      back_f(int argc, char **argv);
 static void     back_help(void);
 static int      ring_f(int argc, char **argv);
 static void     ring_help(void);
+static int	cache_f(int argc, char **argv);
+static void	cache_help(void);
 
 static const cmdinfo_t	pop_cmd =
 	{ "pop", NULL, pop_f, 0, 0, 0, NULL,
@@ -56,14 +59,41 @@ static const cmdinfo_t  forward_cmd =
 static const cmdinfo_t  back_cmd =
 	{ "back", "b", back_f, 0, 0, 0, NULL,
 	  N_("move to the previous location in the position ring"), back_help };
+static const cmdinfo_t	cache_cmd =
+	{ "cache", NULL, cache_f, 0, -1, 0, "[-v] [-z]",
+	  N_("show buffer cache statistics"), cache_help };
 static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+/* the I/O stack is per thread, metadump walks several AGs at once */
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int	iocur_sp = -1;
+__thread int	iocur_len;
+
+/*
+ * Set while several threads take turns holding the lock it points to:
+ * set_cur() lets go of it while it waits for a read, so the others can
+ * get on in the meantime.  scan_ags() works this way.
+ */
+pthread_mutex_t	*io_wait_lock;
+
+/* bumped by every write, for commands that keep what they have read */
+unsigned int	io_write_gen;
+
+/*
+ * Writes held back between write_cur_batch_start and write_cur_batch_flush,
+ * to go out together in disk order rather than one synchronous write each.
+ */
+#define WRITE_BATCH_MAX	256
+static struct xfs_buf	*write_batch[WRITE_BATCH_MAX];
+static int		write_batch_count;
+static int		write_batching;
+
+static pthread_mutex_t	scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static xfs_agnumber_t	scan_next_agno;
+static void		(*scan_func)(xfs_agnumber_t agno);
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -71,6 +101,10 @@ static int     ring_head = -1;
 static int     ring_tail = -1;
 static int     ring_current = -1;
 
+/* cache counters at the last "cache -z" */
+static unsigned long long	cache_hits_base;
+static unsigned long long	cache_misses_base;
+
 void
 io_init(void)
 {
@@ -80,6 +114,7 @@ io_init(void)
 	add_command(&forward_cmd);
 	add_command(&back_cmd);
 	add_command(&ring_cmd);
+	add_command(&cache_cmd);
 }
 
 void
@@ -265,6 +300,24 @@ push_help(void)
 		));
 }
 
+/*
+ * Start reading the ring entry at index into the buffer cache, so that
+ * stepping on to it with forward, back or ring finds it already there.
+ */
+static void
+ring_readahead(
+	int		index)
+{
+	iocur_t		*ioc = &iocur_ring[index];
+	const struct xfs_buf_ops *ops = ioc->typ ? ioc->typ->bops : NULL;
+
+	if (ioc->bbmap)
+		libxfs_buf_readahead_map(mp->m_ddev_targp, ioc->bbmap->b,
+				ioc->bbmap->nmaps, ops);
+	else if (ioc->blen)
+		libxfs_buf_readahead(mp->m_ddev_targp, ioc->bb, ioc->blen, ops);
+}
+
 /* move forward through the ring */
 /* ARGSUSED */
 static int
@@ -289,6 +342,8 @@ forward_f(
 		DB_RING_IGN,
 		iocur_ring[ring_current].bbmap);
 
+	if (ring_current != ring_head)
+		ring_readahead((ring_current+1)%RING_ENTRIES);
 	return 0;
 }
 
@@ -329,6 +384,8 @@ back_f(
 		DB_RING_IGN,
 		iocur_ring[ring_current].bbmap);
 
+	if (ring_current != ring_tail)
+		ring_readahead((ring_current+(RING_ENTRIES-1))%RING_ENTRIES);
 	return 0;
 }
 
@@ -371,6 +428,11 @@ ring_f(
 		DB_RING_IGN,
 		iocur_ring[index].bbmap);
 
+	/* the neighbours are where forward and back go next */
+	if (index != ring_head)
+		ring_readahead((index+1)%RING_ENTRIES);
+	if (index != ring_tail)
+		ring_readahead((index+(RING_ENTRIES-1))%RING_ENTRIES);
 	return 0;
 }
 
@@ -396,10 +458,74 @@ ring_help(void)
 " Note: Unlike the 'stack', 'push' and 'pop' commands, the ring tracks your\n"
 " location implicitly.  Use the 'push' and 'pop' commands if you wish to\n"
 " store a specific location explicitly for later return.\n"
+"\n"
+" Moving through the ring starts reading the neighbouring entries into the\n"
+" buffer cache, so that moving on to them doesn't wait for the disk.\n"
 "\n"),
 		RING_ENTRIES);
 }
 
+static void
+cache_help(void)
+{
+	dbprintf(_(
+"\n"
+" Shows how many buffers the metadata buffer cache holds and how many\n"
+" lookups found the block already cached (hits) or had to read it (misses).\n"
+" Every command that moves to a location reads through this cache, so going\n"
+" back to a block that was visited recently doesn't read the disk again.\n"
+" The cache size is set with the -C option of xfs_db.\n"
+"\n"
+" -v  also show the hash chain lengths and the buffers in each priority\n"
+" -z  zero the hit and miss counts\n"
+"\n"
+		));
+}
+
+static int
+cache_f(
+	int			argc,
+	char			**argv)
+{
+	unsigned long long	hits, misses;
+	int			vflag = 0;
+	int			zflag = 0;
+	int			c;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "vz")) != EOF) {
+		switch (c) {
+		case 'v':
+			vflag = 1;
+			break;
+		case 'z':
+			zflag = 1;
+			break;
+		default:
+			dbprintf(_("bad option for cache command\n"));
+			return 0;
+		}
+	}
+
+	cache_stats(libxfs_bcache, &hits, &misses);
+	if (zflag) {
+		cache_hits_base = hits;
+		cache_misses_base = misses;
+		return 0;
+	}
+	hits -= cache_hits_base;
+	misses -= cache_misses_base;
+	dbprintf(_("buffer cache: %u of %u buffers, %llu hits, %llu misses"),
+		libxfs_bcache->c_count, libxfs_bcache->c_maxcount,
+		hits, misses);
+	if (hits + misses)
+		dbprintf(_(", %.1f%% hits"), 100.0 * hits / (hits + misses));
+	dbprintf("\n");
+	if (vflag)
+		cache_report(stdout, "libxfs_bcache", libxfs_bcache);
+	return 0;
+}
+
 
 void
 ring_add(void)
@@ -463,6 +589,81 @@ xfs_dummy_verify(
 	return;
 }
 
+static int
+write_batch_compare(
+	const void	*a,
+	const void	*b)
+{
+	const struct xfs_buf	*bpa = *(const struct xfs_buf **)a;
+	const struct xfs_buf	*bpb = *(const struct xfs_buf **)b;
+
+	if (bpa->b_bn < bpb->b_bn)
+		return -1;
+	return bpa->b_bn > bpb->b_bn;
+}
+
+/*
+ * From here until write_cur_batch_flush, write_cur on a plain buffer only
+ * queues it.  The buffer isn't re-read after the write as it is otherwise.
+ */
+void
+write_cur_batch_start(void)
+{
+	write_batching = 1;
+}
+
+static void
+write_cur_batch_write(void)
+{
+	int		ret;
+	int		i;
+
+	if (!write_batch_count)
+		return;
+	qsort(write_batch, write_batch_count, sizeof(struct xfs_buf *),
+		write_batch_compare);
+	ret = -libxfs_writebufr_list(mp->m_ddev_targp, write_batch,
+			write_batch_count);
+	if (ret != 0)
+		dbprintf(_("write error: %s\n"), strerror(ret));
+	for (i = 0; i < write_batch_count; i++)
+		libxfs_putbuf(write_batch[i]);
+	io_write_gen += write_batch_count;
+	write_batch_count = 0;
+}
+
+void
+write_cur_batch_flush(void)
+{
+	write_cur_batch_write();
+	write_batching = 0;
+}
+
+/* queue the current buffer, returns 0 if it has to be written now */
+static int
+write_cur_batch_add(void)
+{
+	struct xfs_buf	*bp;
+	int		i;
+
+	for (i = 0; i < write_batch_count; i++)
+		if (write_batch[i] == iocur_top->bp)
+			return 1;
+	if (write_batch_count == WRITE_BATCH_MAX)
+		write_cur_batch_write();
+
+	/* hold our own reference, the I/O stack may let go of its one */
+	bp = libxfs_getbuf(mp->m_ddev_targp, iocur_top->bb, iocur_top->blen);
+	if (!bp)
+		return 0;
+	if (bp != iocur_top->bp) {
+		libxfs_putbuf(bp);
+		return 0;
+	}
+	write_batch[write_batch_count++] = bp;
+	return 1;
+}
+
 void
 write_cur(void)
 {
@@ -480,8 +681,11 @@ write_cur(void)
 				 XFS_DQUOT_CRC_OFF);
 	if (iocur_top->bbmap)
 		write_cur_bbs();
+	else if (write_batching && iocur_top->bp && write_cur_batch_add())
+		return;
 	else
 		write_cur_buf();
+	io_write_gen++;
 }
 
 void
@@ -524,12 +728,18 @@ set_cur(
 		if (!iocur_top->bbmap)
 			return;
 		memcpy(iocur_top->bbmap, bbmap, sizeof(struct bbmap));
+		if (io_wait_lock)
+			pthread_mutex_unlock(io_wait_lock);
 		bp = libxfs_readbuf_map(mp->m_ddev_targp, bbmap->b,
 					bbmap->nmaps, 0, ops);
 	} else {
+		if (io_wait_lock)
+			pthread_mutex_unlock(io_wait_lock);
 		bp = libxfs_readbuf(mp->m_ddev_targp, d, c, 0, ops);
 		iocur_top->bbmap = NULL;
 	}
+	if (io_wait_lock)
+		pthread_mutex_lock(io_wait_lock);
 
 	/*
 	 * Keep the buffer even if the verifier says it is corrupted.
@@ -561,6 +771,60 @@ set_cur(
 		ring_add();
 }
 
+/* run scan_func on AGs until there are none left, see scan_ags() */
+static void
+scan_ags_run(void)
+{
+	xfs_agnumber_t	agno;
+
+	pthread_mutex_lock(&scan_lock);
+	while ((agno = scan_next_agno++) < mp->m_sb.sb_agcount &&
+	       !seenint())
+		scan_func(agno);
+	pthread_mutex_unlock(&scan_lock);
+}
+
+static void *
+scan_ags_thread(
+	void		*arg)
+{
+	scan_ags_run();
+	free(iocur_base);
+	return NULL;
+}
+
+/*
+ * Call func for each AG, with nthreads threads (this one included) taking
+ * the next AG in turn.  They take turns holding scan_lock, and let go of
+ * it only while they wait for a read (see io_wait_lock), so func needs no
+ * locking of its own while the reads of all the threads are in flight
+ * together.  Anything it keeps across a read must be per thread.
+ */
+void
+scan_ags(
+	int		nthreads,
+	void		(*func)(xfs_agnumber_t agno))
+{
+	pthread_t	threads[MAX_SCAN_THREADS];
+	int		n, i;
+
+	if (nthreads <= 1 || mp->m_sb.sb_agcount == 1) {
+		for (i = 0; i < mp->m_sb.sb_agcount; i++)
+			func(i);
+		return;
+	}
+	scan_func = func;
+	scan_next_agno = 0;
+	io_wait_lock = &scan_lock;
+	for (n = 0; n < nthreads - 1; n++)
+		if (pthread_create(&threads[n], NULL, scan_ags_thread, NULL))
+			break;
+	scan_ags_run();
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	io_wait_lock = NULL;
+}
+
 void
 set_iocur_type(
 	const typ_t	*t)
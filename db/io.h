@@ -47,10 +47,14 @@ typedef struct iocur {
 #define DB_RING_ADD 1                   /* add to ring on set_cur */
 #define DB_RING_IGN 0                   /* do not add to ring on set_cur */
 
-extern iocur_t	*iocur_base;		/* base of stack */
-extern iocur_t	*iocur_top;		/* top element of stack */
-extern int	iocur_sp;		/* current top of stack */
-extern int	iocur_len;		/* length of stack array */
+extern __thread iocur_t	*iocur_base;		/* base of stack */
+extern __thread iocur_t	*iocur_top;		/* top element of stack */
+extern __thread int	iocur_sp;		/* current top of stack */
+extern __thread int	iocur_len;		/* length of stack array */
+extern pthread_mutex_t	*io_wait_lock;		/* given up during reads */
+extern unsigned int	io_write_gen;		/* changes on every write */
+
+#define	MAX_SCAN_THREADS	64
 
 extern void	io_init(void);
 extern void	off_cur(int off, int len);
@@ -59,6 +63,9 @@ extern void	print_iocur(char *tag, iocur_t *ioc);
 extern void	push_cur(void);
 extern int	read_buf(__int64_t daddr, int count, void *bufp);
 extern void     write_cur(void);
+extern void	write_cur_batch_start(void);
+extern void	write_cur_batch_flush(void);
+extern void	scan_ags(int nthreads, void (*func)(xfs_agnumber_t agno));
 extern void	set_cur(const struct typ *t, __int64_t d, int c, int ring_add,
 			bbmap_t *bbmap);
 extern void     ring_add(void);
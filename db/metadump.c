@@ -31,6 +31,10 @@
 #include "faddr.h"
 #include "field.h"
 #include "dir2.h"
+#include <sys/resource.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define DEFAULT_MAX_EXT_SIZE	1000
 
@@ -57,19 +61,20 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-a] [-e] [-g] [-A agno[,agno]...] [-i inode]... [-m max_extent] [-r reference]... [-s] [-t threads] [-v version] [-w] [-o] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
 
-static xfs_metablock_t 	*metablock;	/* header + index + buffers */
-static __be64		*block_index;
-static char		*block_buffer;
+/* each worker thread fills its own metablock, see dump_ags() */
+static __thread xfs_metablock_t	*metablock;	/* header + index + buffers */
+static __thread __be64	*block_index;
+static __thread char	*block_buffer;
 
 static int		num_indicies;
-static int		cur_index;
+static __thread int	cur_index;
 
-static xfs_ino_t	cur_ino;
+static __thread xfs_ino_t cur_ino;
 
 static int		show_progress = 0;
 static int		stop_on_read_error = 0;
@@ -78,6 +83,169 @@ static int		obfuscate = 1;
 static int		zero_stale_data = 1;
 static int		show_warnings = 0;
 static int		progress_since_warning = 0;
+static int		num_threads = 1;
+static int		md_version = 1;
+static char		**md_refs;	/* dumps a delta is taken against */
+static int		md_nrefs;
+
+#define MAX_METADUMP_THREADS	64
+
+/*
+ * With -s, the dump counts what it copied and where its time went, and
+ * prints it all to stderr at the end for benchmarks to compare.  The time
+ * spent reading metadata, obfuscating names and writing the dump out is
+ * CPU time summed over the threads that did it.  Reads also get their
+ * wall clock time, most of which is usually spent waiting for the disk.
+ */
+enum {
+	MD_STAT_READ,
+	MD_STAT_OBFUSCATE,
+	MD_STAT_OUTPUT,
+	MD_NSTATS,
+};
+
+struct md_stat_clock {
+	__uint64_t		cpu;
+	__uint64_t		wall;
+};
+
+static int		show_stats;
+static __uint64_t	md_stat_cpu[MD_NSTATS];
+static __uint64_t	md_stat_wall[MD_NSTATS];
+static __uint64_t	md_stat_blocks;		/* metadata buffers dumped */
+static __uint64_t	md_stat_bytes;
+static __uint64_t	md_stat_out_bytes;
+
+static __uint64_t
+md_stat_now(
+	clockid_t		clock)
+{
+	struct timespec		ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+md_stat_start(
+	struct md_stat_clock	*c)
+{
+	if (!show_stats)
+		return;
+	c->cpu = md_stat_now(CLOCK_THREAD_CPUTIME_ID);
+	c->wall = md_stat_now(CLOCK_MONOTONIC);
+}
+
+static void
+md_stat_stop(
+	int			which,
+	struct md_stat_clock	*c)
+{
+	if (!show_stats)
+		return;
+	counter_add(&md_stat_cpu[which],
+			md_stat_now(CLOCK_THREAD_CPUTIME_ID) - c->cpu);
+	counter_add(&md_stat_wall[which],
+			md_stat_now(CLOCK_MONOTONIC) - c->wall);
+}
+
+/* set_cur() for the metadata being dumped, timed for -s */
+static void
+md_set_cur(
+	const typ_t		*t,
+	__int64_t		d,
+	int			c,
+	int			ring_flag,
+	bbmap_t			*bbmap)
+{
+	struct md_stat_clock	clock;
+
+	md_stat_start(&clock);
+	set_cur(t, d, c, ring_flag, bbmap);
+	md_stat_stop(MD_STAT_READ, &clock);
+}
+
+static void
+md_stat_report(
+	struct libxfs_iostats	*io_start,
+	__uint64_t		wall_start)
+{
+	struct libxfs_iostats	io;
+	struct rusage		ru;
+	double			elapsed;
+
+	libxfs_iostats_get(&io);
+	getrusage(RUSAGE_SELF, &ru);
+	elapsed = (md_stat_now(CLOCK_MONOTONIC) - wall_start) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	fprintf(stderr, "%-24s %.3f\n", "elapsed_seconds", elapsed);
+	fprintf(stderr, "%-24s %llu\n", "metadata_blocks",
+		(unsigned long long)counter_read(&md_stat_blocks));
+	fprintf(stderr, "%-24s %llu\n", "metadata_bytes",
+		(unsigned long long)counter_read(&md_stat_bytes));
+	fprintf(stderr, "%-24s %.1f\n", "blocks_per_second",
+		counter_read(&md_stat_blocks) / elapsed);
+	fprintf(stderr, "%-24s %.2f\n", "mb_per_second",
+		counter_read(&md_stat_bytes) / elapsed / (1 << 20));
+	fprintf(stderr, "%-24s %llu\n", "reads",
+		(unsigned long long)(io.reads - io_start->reads));
+	fprintf(stderr, "%-24s %llu\n", "read_bytes",
+		(unsigned long long)(io.read_bytes - io_start->read_bytes));
+	fprintf(stderr, "%-24s %llu\n", "output_bytes",
+		(unsigned long long)md_stat_out_bytes);
+	fprintf(stderr, "%-24s %.3f\n", "cpu_seconds",
+		ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+	fprintf(stderr, "%-24s %.3f\n", "read_cpu_seconds",
+		counter_read(&md_stat_cpu[MD_STAT_READ]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "read_wall_seconds",
+		counter_read(&md_stat_wall[MD_STAT_READ]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "obfuscate_cpu_seconds",
+		counter_read(&md_stat_cpu[MD_STAT_OBFUSCATE]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "output_cpu_seconds",
+		counter_read(&md_stat_cpu[MD_STAT_OUTPUT]) / 1e9);
+}
+
+/*
+ * With more than one thread, the AGs are handed out to worker threads
+ * which queue up the metablocks they fill on the AG instead of writing them
+ * out.  The main thread writes the queued metablocks out in AG order, so
+ * the dump comes out the same as a single threaded one.  A worker that gets
+ * too far ahead of the AG being written waits for it to catch up.
+ *
+ * If an internal log has to be copied, it is the first thing handed out, so
+ * the log is read while the AGs are scanned.  It still goes into the dump
+ * last, and gets a deeper queue to make up for the wait.
+ */
+#define MAX_QUEUED_CHUNKS	256	/* metablocks per AG, 32k each */
+#define MAX_QUEUED_LOG_CHUNKS	2048
+
+struct md_chunk {
+	struct md_chunk		*next;
+	xfs_metablock_t		*mb;
+};
+
+struct md_ag {
+	struct md_chunk		*head;
+	struct md_chunk		**tail;
+	int			queued;
+	int			max_queued;
+	int			done;
+	int			error;
+};
+
+static struct md_ag	*md_ags;	/* one per AG and one for the log */
+static xfs_agnumber_t	md_next_agno;	/* next AG to hand to a worker */
+static int		md_log_pending;	/* log not handed out yet */
+static int		md_abort;
+static pthread_t	*md_threads;
+static int		md_nthreads;
+static pthread_mutex_t	md_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	md_cond = PTHREAD_COND_INITIALIZER;
+
+static __thread struct md_ag *cur_ag;	/* AG this worker is dumping */
 
 void
 metadump_init(void)
@@ -94,11 +262,18 @@ metadump_help(void)
 " for compressing and sending to an XFS maintainer for corruption analysis \n"
 " or xfs_repair failures.\n\n"
 " Options:\n"
+"   -A -- Only dump the metadata of these AGs, plus any -i subtrees\n"
 "   -a -- Copy full metadata blocks without zeroing unused space\n"
 "   -e -- Ignore read errors and keep going\n"
 "   -g -- Display dump progress\n"
+"   -i -- Only dump the inodes below this directory, plus any -A AGs\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
+"   -r -- Only dump what changed since this dump, repeat for each delta\n"
+"         already taken against it; implies -v 2\n"
+"   -s -- Print statistics of what was dumped and where the time went\n"
+"   -t -- Dump this many AGs at once with worker threads (default = 1)\n"
+"   -v -- Dump format version, 2 is compressed and indexed (default = 1)\n"
 "   -w -- Show warnings of bad metadata information\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
@@ -152,23 +327,675 @@ print_progress(const char *fmt, ...)
  * Return 0 for success, -1 for failure.
  */
 
+static int
+new_metablock(void)
+{
+	metablock = (xfs_metablock_t *)calloc(BBSIZE + 1, BBSIZE);
+	if (metablock == NULL) {
+		print_warning("memory allocation failure");
+		return 0;
+	}
+	metablock->mb_blocklog = BBSHIFT;
+	metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+
+	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
+	block_buffer = (char *)metablock + BBSIZE;
+	cur_index = 0;
+	return 1;
+}
+
+/*
+ * Hand a worker's full metablock over to the main thread and start a new
+ * one.
+ */
+static int
+queue_chunk(void)
+{
+	struct md_chunk	*chunk;
+	int		error = 0;
+
+	chunk = malloc(sizeof(*chunk));
+	if (chunk == NULL) {
+		print_warning("memory allocation failure");
+		return -ENOMEM;
+	}
+	chunk->next = NULL;
+	chunk->mb = metablock;
+
+	pthread_mutex_lock(&md_lock);
+	while (cur_ag->queued >= cur_ag->max_queued && !md_abort)
+		pthread_cond_wait(&md_cond, &md_lock);
+	if (md_abort) {
+		error = -EINTR;
+	} else {
+		*cur_ag->tail = chunk;
+		cur_ag->tail = &chunk->next;
+		cur_ag->queued++;
+		pthread_cond_broadcast(&md_cond);
+	}
+	pthread_mutex_unlock(&md_lock);
+
+	if (error) {
+		free(chunk);
+		free(metablock);
+	}
+	metablock = NULL;
+	if (!error && !new_metablock())
+		error = -ENOMEM;
+	return error;
+}
+
 static int
 write_index(void)
 {
+	struct md_stat_clock	clock;
+
 	/*
 	 * write index block and following data blocks (streaming)
 	 */
 	metablock->mb_count = cpu_to_be16(cur_index);
+	if (cur_ag)
+		return queue_chunk();
+	md_stat_start(&clock);
 	if (fwrite(metablock, (cur_index + 1) << BBSHIFT, 1, outf) != 1) {
 		print_warning("error writing to file: %s", strerror(errno));
 		return -errno;
 	}
+	md_stat_stop(MD_STAT_OUTPUT, &clock);
+	md_stat_out_bytes += (cur_index + 1) << BBSHIFT;
 
 	memset(block_index, 0, num_indicies * sizeof(__be64));
 	cur_index = 0;
 	return 0;
 }
 
+/*
+ * Version 2 dumps are filled in a chunk at a time by the main thread.  Full
+ * chunks are compressed by a pool of threads, and whichever thread finds
+ * the oldest chunk compressed writes it out, so the chunks go out in the
+ * order they were filled in.  The chunks live in a ring of slots, and the
+ * main thread waits for the next slot to be written out before it refills
+ * it.
+ */
+#define MD2_CHUNK_SIZE		(1 << 20)	/* bytes of blocks per chunk */
+#define MD2_MAX_EXTENTS		(MD2_CHUNK_SIZE >> BBSHIFT)
+
+enum {
+	MD2_FREE,
+	MD2_FILLING,
+	MD2_QUEUED,
+	MD2_BUSY,
+	MD2_DONE,
+};
+
+struct md2_extent {
+	__uint64_t		daddr;
+	__uint32_t		len;
+};
+
+struct md2_chunk {
+	int			state;
+	int			zero;		/* extents to zero, no data */
+	int			nextents;
+	struct md2_extent	*extents;
+	char			*data;
+	int			len;
+	char			*out;		/* header, extents, payload */
+	size_t			out_len;
+	__uint64_t		first;
+	__uint64_t		last;
+};
+
+static struct md2_chunk	*md2_slots;
+static int		md2_nslots;
+static __uint64_t	md2_fill_seq;	/* slot being filled */
+static __uint64_t	md2_write_seq;	/* next slot to write out */
+static int		md2_writing;
+static int		md2_stop;
+static int		md2_error;
+static __uint64_t	md2_offset;	/* bytes written so far */
+static xfs_md2_index_t	*md2_index;
+static __uint64_t	md2_index_count;
+static __uint64_t	md2_index_max;
+static pthread_t	*md2_threads;
+static int		md2_nthreads;
+static pthread_mutex_t	md2_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	md2_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * A delta dump compares every block it is handed with what the reference
+ * chain restores that block to and leaves out the ones that are the same.
+ * Change detection is by content rather than by CRC or LSN stamps, as
+ * only v5 filesystems have those, not all metadata carries them, and the
+ * obfuscation and stale data zeroing done here change blocks that the
+ * filesystem never touched.  The ranges written are remembered, and at the
+ * end whatever the chain has that wasn't written again is zeroed, so that
+ * blocks which stopped being metadata don't come back from an older dump.
+ */
+static struct mdump	*md2_ref;
+static char		*md2_ref_buf;
+static struct md2_extent *md2_ranges;	/* blocks handed to the delta */
+static __uint64_t	md2_nranges;
+static __uint64_t	md2_max_ranges;
+
+static size_t
+md2_payload_max(void)
+{
+#ifdef HAVE_ZLIB
+	return MAX(compressBound(MD2_CHUNK_SIZE), MD2_CHUNK_SIZE);
+#else
+	return MD2_CHUNK_SIZE;
+#endif
+}
+
+static int
+md2_write(
+	void			*buf,
+	size_t			len)
+{
+	struct md_stat_clock	clock;
+
+	md_stat_start(&clock);
+	if (fwrite(buf, len, 1, outf) != 1) {
+		print_warning("error writing to file: %s", strerror(errno));
+		return errno ? errno : EIO;
+	}
+	md_stat_stop(MD_STAT_OUTPUT, &clock);
+	md2_offset += len;
+	md_stat_out_bytes += len;
+	return 0;
+}
+
+/* build the on-disk chunk in c->out, compressing the blocks if we can */
+static void
+md2_compress(
+	struct md2_chunk	*c)
+{
+	xfs_md2_chunk_t		*hdr = (xfs_md2_chunk_t *)c->out;
+	xfs_md2_extent_t	*ext = (xfs_md2_extent_t *)(hdr + 1);
+	char			*payload = (char *)(ext + c->nextents);
+	size_t			clen = c->len;
+	int			compression = XFS_MD2_COMP_NONE;
+	int			i;
+
+	for (i = 0; i < c->nextents; i++) {
+		ext[i].me_daddr = cpu_to_be64(c->extents[i].daddr);
+		ext[i].me_len = cpu_to_be32(c->extents[i].len);
+		ext[i].me_reserved = 0;
+	}
+
+	if (c->zero) {
+		clen = 0;
+		compression = XFS_MD2_COMP_ZERO;
+	}
+#ifdef HAVE_ZLIB
+	else {
+		uLongf	zlen = md2_payload_max();
+
+		if (compress2((Bytef *)payload, &zlen, (Bytef *)c->data,
+				c->len, Z_BEST_SPEED) == Z_OK && zlen < c->len) {
+			clen = zlen;
+			compression = XFS_MD2_COMP_ZLIB;
+		}
+	}
+#endif
+	if (compression == XFS_MD2_COMP_NONE)
+		memcpy(payload, c->data, c->len);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->mc_magic = cpu_to_be32(XFS_MD2_CHUNK_MAGIC);
+	hdr->mc_nextents = cpu_to_be32(c->nextents);
+	hdr->mc_dlen = cpu_to_be32(c->len);
+	hdr->mc_clen = cpu_to_be32(clen);
+	hdr->mc_compression = compression;
+	c->out_len = payload + clen - c->out;
+}
+
+static int
+md2_write_chunk(
+	struct md2_chunk	*c)
+{
+	xfs_md2_index_t		*mi;
+
+	if (md2_index_count == md2_index_max) {
+		md2_index_max = md2_index_max ? md2_index_max * 2 : 1024;
+		mi = realloc(md2_index, md2_index_max * sizeof(*mi));
+		if (mi == NULL) {
+			print_warning("memory allocation failure");
+			return ENOMEM;
+		}
+		md2_index = mi;
+	}
+	mi = &md2_index[md2_index_count++];
+	mi->mi_offset = cpu_to_be64(md2_offset);
+	mi->mi_first = cpu_to_be64(c->first);
+	mi->mi_last = cpu_to_be64(c->last);
+
+	return md2_write(c->out, c->out_len);
+}
+
+/* compression thread, also writes out chunks in order; md2_lock held */
+static void
+md2_write_done(void)
+{
+	struct md2_chunk	*c;
+	int			error;
+
+	if (md2_writing)
+		return;
+	md2_writing = 1;
+	for (;;) {
+		c = &md2_slots[md2_write_seq % md2_nslots];
+		if (md2_write_seq == md2_fill_seq || c->state != MD2_DONE)
+			break;
+		pthread_mutex_unlock(&md2_lock);
+		error = md2_error ? 0 : md2_write_chunk(c);
+		pthread_mutex_lock(&md2_lock);
+		if (error)
+			md2_error = error;
+		c->state = MD2_FREE;
+		md2_write_seq++;
+		pthread_cond_broadcast(&md2_cond);
+	}
+	md2_writing = 0;
+}
+
+static void *
+md2_compressor(
+	void			*arg)
+{
+	struct md2_chunk	*c;
+	struct md_stat_clock	clock;
+	__uint64_t		seq;
+
+	pthread_mutex_lock(&md2_lock);
+	for (;;) {
+		c = NULL;
+		for (seq = md2_write_seq; seq < md2_fill_seq; seq++) {
+			if (md2_slots[seq % md2_nslots].state == MD2_QUEUED) {
+				c = &md2_slots[seq % md2_nslots];
+				break;
+			}
+		}
+		if (c == NULL) {
+			if (md2_stop && md2_write_seq == md2_fill_seq)
+				break;
+			pthread_cond_wait(&md2_cond, &md2_lock);
+			continue;
+		}
+		c->state = MD2_BUSY;
+		pthread_mutex_unlock(&md2_lock);
+		md_stat_start(&clock);
+		md2_compress(c);
+		md_stat_stop(MD_STAT_OUTPUT, &clock);
+		pthread_mutex_lock(&md2_lock);
+		c->state = MD2_DONE;
+		md2_write_done();
+	}
+	pthread_mutex_unlock(&md2_lock);
+	return NULL;
+}
+
+/* queue the chunk being filled and wait for the next slot to come free */
+static int
+md2_submit(void)
+{
+	struct md2_chunk	*c = &md2_slots[md2_fill_seq % md2_nslots];
+	int			error;
+
+	if (!c->nextents)
+		return 0;
+
+	pthread_mutex_lock(&md2_lock);
+	c->state = MD2_QUEUED;
+	md2_fill_seq++;
+	pthread_cond_broadcast(&md2_cond);
+	c = &md2_slots[md2_fill_seq % md2_nslots];
+	while (c->state != MD2_FREE)
+		pthread_cond_wait(&md2_cond, &md2_lock);
+	c->state = MD2_FILLING;
+	error = md2_error;
+	pthread_mutex_unlock(&md2_lock);
+
+	c->nextents = 0;
+	c->len = 0;
+	return error ? -error : 0;
+}
+
+/* add blocks to the chunk being filled, or blocks to zero if data is NULL */
+static int
+md2_add_extent(
+	char			*data,
+	__int64_t		off,
+	int			len)
+{
+	struct md2_chunk	*c;
+	struct md2_extent	*ext;
+	int			zero = data == NULL;
+	int			n;
+	int			error;
+
+	while (len > 0) {
+		c = &md2_slots[md2_fill_seq % md2_nslots];
+		if (c->len == MD2_CHUNK_SIZE || c->nextents == MD2_MAX_EXTENTS ||
+		    (c->nextents && c->zero != zero)) {
+			error = md2_submit();
+			if (error)
+				return error;
+			continue;
+		}
+		c->zero = zero;
+
+		n = MIN(len, (MD2_CHUNK_SIZE - c->len) >> BBSHIFT);
+		ext = c->nextents ? &c->extents[c->nextents - 1] : NULL;
+		if (!ext || ext->daddr + ext->len != off) {
+			ext = &c->extents[c->nextents++];
+			ext->daddr = off;
+			ext->len = 0;
+			if (c->nextents == 1 || off < c->first)
+				c->first = off;
+		}
+		ext->len += n;
+		if (c->nextents == 1 || off + n > c->last)
+			c->last = off + n;
+		if (!zero) {
+			memcpy(c->data + c->len, data, n << BBSHIFT);
+			data += n << BBSHIFT;
+		}
+		c->len += n << BBSHIFT;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+md2_add_range(
+	__int64_t		off,
+	int			len)
+{
+	struct md2_extent	*r;
+
+	r = md2_nranges ? &md2_ranges[md2_nranges - 1] : NULL;
+	if (r && r->daddr + r->len == off && r->len + len > r->len) {
+		r->len += len;
+		return 0;
+	}
+	if (md2_nranges == md2_max_ranges) {
+		md2_max_ranges = md2_max_ranges ? md2_max_ranges * 2 : 1024;
+		r = realloc(md2_ranges, md2_max_ranges * sizeof(*r));
+		if (r == NULL) {
+			print_warning("memory allocation failure");
+			return -ENOMEM;
+		}
+		md2_ranges = r;
+	}
+	r = &md2_ranges[md2_nranges++];
+	r->daddr = off;
+	r->len = len;
+	return 0;
+}
+
+/* add the blocks of a delta that differ from the reference chain */
+static int
+md2_add_delta(
+	char			*data,
+	__int64_t		off,
+	int			len)
+{
+	ssize_t			got;
+	int			n;
+	int			i, j;
+	int			error;
+
+	while (len > 0) {
+		n = MIN(len, MD2_CHUNK_SIZE >> BBSHIFT);
+		error = md2_add_range(off, n);
+		if (error)
+			return error;
+
+		got = mdump_pread(md2_ref, md2_ref_buf, n << BBSHIFT,
+				  off << BBSHIFT);
+		if (got < 0) {
+			print_warning("error reading reference dump: %s",
+					strerror(errno));
+			return -EIO;
+		}
+		memset(md2_ref_buf + got, 0, (n << BBSHIFT) - got);
+
+		for (i = 0; i < n; i = j) {
+			if (!memcmp(data + (i << BBSHIFT),
+				    md2_ref_buf + (i << BBSHIFT), BBSIZE)) {
+				j = i + 1;
+				continue;
+			}
+			for (j = i + 1; j < n; j++)
+				if (!memcmp(data + (j << BBSHIFT),
+					    md2_ref_buf + (j << BBSHIFT), BBSIZE))
+					break;
+			error = md2_add_extent(data + (i << BBSHIFT), off + i,
+					       j - i);
+			if (error)
+				return error;
+		}
+
+		data += n << BBSHIFT;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+md2_add(
+	char			*data,
+	__int64_t		off,
+	int			len)
+{
+	if (md2_ref)
+		return md2_add_delta(data, off, len);
+	return md2_add_extent(data, off, len);
+}
+
+static int
+md2_range_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct md2_extent	*ra = a;
+	const struct md2_extent	*rb = b;
+
+	if (ra->daddr != rb->daddr)
+		return ra->daddr < rb->daddr ? -1 : 1;
+	return 0;
+}
+
+/* zero whatever the reference chain has that the delta didn't write */
+static int
+md2_zero_stale(void)
+{
+	struct md2_extent	*r = md2_ranges;
+	__uint64_t		nranges = 0;
+	__uint64_t		i, k;
+	__uint64_t		daddr, start, end;
+	__uint32_t		len;
+	int			error;
+
+	qsort(md2_ranges, md2_nranges, sizeof(*r), md2_range_cmp);
+	for (i = 0; i < md2_nranges; i++) {
+		if (nranges && r[nranges - 1].daddr + r[nranges - 1].len >=
+				r[i].daddr) {
+			end = MAX(r[nranges - 1].daddr + r[nranges - 1].len,
+				  r[i].daddr + r[i].len);
+			r[nranges - 1].len = end - r[nranges - 1].daddr;
+		} else
+			r[nranges++] = r[i];
+	}
+
+	for (i = 0, k = 0; ; i++) {
+		error = mdump_extent(md2_ref, i, &daddr, &len);
+		if (error < 0)
+			break;
+		if (!error)
+			continue;
+		for (start = daddr, end = daddr + len; start < end; ) {
+			while (k < nranges && r[k].daddr + r[k].len <= start)
+				k++;
+			if (k == nranges || r[k].daddr >= end) {
+				error = md2_add_extent(NULL, start, end - start);
+				break;
+			}
+			error = 0;
+			if (r[k].daddr > start)
+				error = md2_add_extent(NULL, start,
+						       r[k].daddr - start);
+			start = r[k].daddr + r[k].len;
+			if (error)
+				break;
+		}
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+static int
+md2_init(void)
+{
+	xfs_md2_hdr_t		hdr;
+	struct md2_chunk	*c;
+	int			i;
+
+	md2_nthreads = 0;
+	md2_nslots = 2 * num_threads + 1;
+	md2_slots = calloc(md2_nslots, sizeof(*md2_slots));
+	md2_threads = calloc(num_threads, sizeof(*md2_threads));
+	if (md2_slots == NULL || md2_threads == NULL)
+		goto out_nomem;
+	for (i = 0; i < md2_nslots; i++) {
+		c = &md2_slots[i];
+		c->extents = malloc(MD2_MAX_EXTENTS * sizeof(*c->extents));
+		c->data = malloc(MD2_CHUNK_SIZE);
+		c->out = malloc(sizeof(xfs_md2_chunk_t) +
+				MD2_MAX_EXTENTS * sizeof(xfs_md2_extent_t) +
+				md2_payload_max());
+		if (!c->extents || !c->data || !c->out)
+			goto out_nomem;
+	}
+	md2_slots[0].state = MD2_FILLING;
+	md2_fill_seq = md2_write_seq = 0;
+	md2_writing = md2_stop = md2_error = 0;
+	md2_offset = 0;
+	md2_index_count = 0;
+
+	md2_nranges = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_magic = cpu_to_be32(XFS_MD2_MAGIC);
+	hdr.mh_version = cpu_to_be32(XFS_MD2_VERSION);
+	hdr.mh_blocklog = BBSHIFT;
+	if (md2_ref)
+		hdr.mh_flags = cpu_to_be32(XFS_MD2_FLAG_DELTA);
+	if (md2_write(&hdr, sizeof(hdr)))
+		return 0;
+
+	if (md2_ref) {
+		xfs_md2_delta_t	delta;
+		__be32		id;
+
+		md2_ref_buf = malloc(MD2_CHUNK_SIZE);
+		if (md2_ref_buf == NULL)
+			goto out_nomem;
+		delta.md_magic = cpu_to_be32(XFS_MD2_DELTA_MAGIC);
+		delta.md_count = cpu_to_be32(mdump_nfiles(md2_ref));
+		if (md2_write(&delta, sizeof(delta)))
+			return 0;
+		for (i = 0; i < mdump_nfiles(md2_ref); i++) {
+			id = cpu_to_be32(mdump_file_id(md2_ref, i));
+			if (md2_write(&id, sizeof(id)))
+				return 0;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&md2_threads[i], NULL, md2_compressor,
+				NULL)) {
+			print_warning("cannot create compression threads: %s",
+					strerror(errno));
+			return 0;
+		}
+		md2_nthreads++;
+	}
+	return 1;
+
+out_nomem:
+	print_warning("memory allocation failure");
+	return 0;
+}
+
+/*
+ * Write out the rest of a version 2 dump.  The index is only written if the
+ * dump is complete.  Returns 0 for success, 1 for failure.
+ */
+static int
+md2_finish(
+	int			complete)
+{
+	xfs_md2_index_hdr_t	ihdr;
+	xfs_md2_tail_t		tail;
+	__uint64_t		index_offset;
+	int			error = !complete;
+	int			i;
+
+	if (complete && md2_ref && md2_zero_stale())
+		error = 1;
+	if (complete && !error && md2_submit())
+		error = 1;
+
+	pthread_mutex_lock(&md2_lock);
+	md2_stop = 1;
+	pthread_cond_broadcast(&md2_cond);
+	pthread_mutex_unlock(&md2_lock);
+	for (i = 0; i < md2_nthreads; i++)
+		pthread_join(md2_threads[i], NULL);
+	if (md2_error)
+		error = 1;
+
+	if (!error) {
+		index_offset = md2_offset;
+		memset(&ihdr, 0, sizeof(ihdr));
+		ihdr.mi_magic = cpu_to_be32(XFS_MD2_INDEX_MAGIC);
+		ihdr.mi_count = cpu_to_be64(md2_index_count);
+		memset(&tail, 0, sizeof(tail));
+		tail.mt_index = cpu_to_be64(index_offset);
+		tail.mt_magic = cpu_to_be32(XFS_MD2_TAIL_MAGIC);
+		if (md2_write(&ihdr, sizeof(ihdr)) ||
+		    (md2_index_count && md2_write(md2_index,
+				md2_index_count * sizeof(*md2_index))) ||
+		    md2_write(&tail, sizeof(tail)))
+			error = 1;
+	}
+
+	for (i = 0; md2_slots && i < md2_nslots; i++) {
+		free(md2_slots[i].extents);
+		free(md2_slots[i].data);
+		free(md2_slots[i].out);
+	}
+	free(md2_slots);
+	md2_slots = NULL;
+	free(md2_threads);
+	md2_threads = NULL;
+	free(md2_index);
+	md2_index = NULL;
+	md2_index_max = 0;
+	free(md2_ranges);
+	md2_ranges = NULL;
+	md2_max_ranges = 0;
+	free(md2_ref_buf);
+	md2_ref_buf = NULL;
+	return error;
+}
+
 /*
  * Return 0 for success, -errno for failure.
  */
@@ -181,6 +1008,9 @@ write_buf_segment(
 	int		i;
 	int		ret;
 
+	if (md_version == 2 && !cur_ag)
+		return md2_add(data, off, len);
+
 	for (i = 0; i < len; i++, off++, data += BBSIZE) {
 		block_index[cur_index] = cpu_to_be64(off);
 		memcpy(&block_buffer[cur_index << BBSHIFT], data, BBSIZE);
@@ -226,6 +1056,11 @@ write_buf(
 		}
 	}
 
+	if (show_stats) {
+		counter_add(&md_stat_blocks, 1);
+		counter_add(&md_stat_bytes, BBTOB(buf->blen));
+	}
+
 	/* handle discontiguous buffers */
 	if (!buf->bbmap) {
 		ret = write_buf_segment(buf->data, buf->bb, buf->blen);
@@ -381,7 +1216,7 @@ scan_btree(
 	int		rval = 0;
 
 	push_cur();
-	set_cur(&typtab[btype], XFS_AGB_TO_DADDR(mp, agno, agbno), blkbb,
+	md_set_cur(&typtab[btype], XFS_AGB_TO_DADDR(mp, agno, agbno), blkbb,
 			DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		print_warning("cannot read %s block %u/%u", typtab[btype].name,
@@ -425,6 +1260,23 @@ valid_bno(
 	return 0;
 }
 
+/* get the reads of the child blocks going before the first one is scanned */
+static void
+readahead_btree_ptrs(
+	xfs_agnumber_t		agno,
+	__be32			*pp,
+	int			numrecs)
+{
+	int			i;
+
+	for (i = 0; i < numrecs; i++) {
+		if (!valid_bno(agno, be32_to_cpu(pp[i])))
+			continue;
+		libxfs_buf_readahead(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(pp[i])),
+			blkbb, NULL);
+	}
+}
 
 static int
 scanfunc_freesp(
@@ -451,6 +1303,7 @@ scanfunc_freesp(
 	}
 
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	readahead_btree_ptrs(agno, pp, numrecs);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -523,31 +1376,221 @@ copy_free_cnt_btree(
 	return scan_btree(agno, root, levels, TYP_CNTBT, agf, scanfunc_freesp);
 }
 
+/*
+ * A dump can be restricted to some AGs and to the inodes below some
+ * directories.  The superblocks, AG headers and log are always dumped.
+ * The inodes of the subtrees are found by walking down from their roots
+ * after the AGs are done: the directories being walked record the inodes
+ * their entries point to as they are copied, and those go on a queue to
+ * have their inode chunks copied in turn.  Chunks are copied whole, so
+ * the other inodes in them come along, but only the inodes of the
+ * subtrees are descended into.
+ */
+struct subtree_ino {
+	xfs_ino_t		ino;
+	int			done;
+};
+
+static char		*ags_wanted;	/* NULL for all AGs */
+static xfs_ino_t	*subtree_roots;
+static int		nsubtree_roots;
+
+static struct subtree_ino *subtree_set;
+static __uint64_t	subtree_set_size;
+static __uint64_t	subtree_set_count;
+static xfs_ino_t	*subtree_queue;
+static __uint64_t	subtree_queue_len;
+static __uint64_t	subtree_queue_max;
+static int		subtree_walking;
+static int		subtree_nomem;
+static __thread int	subtree_collect;	/* inode being copied is wanted */
+
+static inline int
+ag_wanted(
+	xfs_agnumber_t		agno)
+{
+	return !ags_wanted || ags_wanted[agno];
+}
+
+static struct subtree_ino *
+subtree_find(
+	xfs_ino_t		ino)
+{
+	__uint64_t		i;
+
+	if (!subtree_set_size)
+		return NULL;
+	i = (ino * 0x9e3779b97f4a7c15ULL) & (subtree_set_size - 1);
+	while (subtree_set[i].ino) {
+		if (subtree_set[i].ino == ino)
+			return &subtree_set[i];
+		i = (i + 1) & (subtree_set_size - 1);
+	}
+	return NULL;
+}
+
+static int
+subtree_grow(void)
+{
+	struct subtree_ino	*old = subtree_set;
+	__uint64_t		old_size = subtree_set_size;
+	__uint64_t		i, j;
+
+	subtree_set_size = old_size ? old_size * 2 : 1024;
+	subtree_set = calloc(subtree_set_size, sizeof(*subtree_set));
+	if (!subtree_set) {
+		subtree_set = old;
+		subtree_set_size = old_size;
+		return 0;
+	}
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].ino)
+			continue;
+		j = (old[i].ino * 0x9e3779b97f4a7c15ULL) &
+				(subtree_set_size - 1);
+		while (subtree_set[j].ino)
+			j = (j + 1) & (subtree_set_size - 1);
+		subtree_set[j] = old[i];
+	}
+	free(old);
+	return 1;
+}
+
+/* queue an inode of a subtree to be copied, unless it was seen already */
+static void
+subtree_add(
+	xfs_ino_t		ino)
+{
+	struct subtree_ino	*e;
+	xfs_ino_t		*q;
+	__uint64_t		i;
+
+	if (XFS_INO_TO_AGNO(mp, ino) >= mp->m_sb.sb_agcount ||
+	    XFS_AGINO_TO_AGBNO(mp, XFS_INO_TO_AGINO(mp, ino)) >=
+			mp->m_sb.sb_agblocks ||
+	    !ino || subtree_find(ino))
+		return;
+
+	if ((subtree_set_count + 1) * 4 > subtree_set_size * 3 &&
+	    !subtree_grow())
+		goto out_nomem;
+	if (subtree_queue_len == subtree_queue_max) {
+		subtree_queue_max = subtree_queue_max ?
+					subtree_queue_max * 2 : 1024;
+		q = realloc(subtree_queue,
+			    subtree_queue_max * sizeof(*subtree_queue));
+		if (!q)
+			goto out_nomem;
+		subtree_queue = q;
+	}
+
+	i = (ino * 0x9e3779b97f4a7c15ULL) & (subtree_set_size - 1);
+	while (subtree_set[i].ino)
+		i = (i + 1) & (subtree_set_size - 1);
+	e = &subtree_set[i];
+	e->ino = ino;
+	e->done = 0;
+	subtree_set_count++;
+	subtree_queue[subtree_queue_len++] = ino;
+	return;
+
+out_nomem:
+	subtree_nomem = 1;
+}
+
+/* called for the entries of the directory being copied */
+static inline void
+note_child(
+	xfs_ino_t		ino,
+	int			namelen,
+	unsigned char		*name)
+{
+	if (!subtree_collect)
+		return;
+	if (name[0] == '.' &&
+	    (namelen == 1 || (namelen == 2 && name[1] == '.')))
+		return;
+	subtree_add(ino);
+}
+
 /* filename and extended attribute obfuscation routines */
 
+/*
+ * The names seen so far in a directory or attribute fork, in an open
+ * addressing hash table that doubles when it gets three quarters full, so
+ * that huge directories don't degrade into long chains.  Entries are also
+ * kept on a list so that clearing the table, which happens for every
+ * inode, only costs as much as the names that were added.
+ */
 struct name_ent {
-	struct name_ent		*next;
+	struct name_ent		*next;		/* all entries, for clearing */
 	xfs_dahash_t		hash;
+	__uint32_t		slot_hash;
+	__uint32_t		next_seq;	/* next alternate to try */
 	int			namelen;
 	unsigned char		name[1];
 };
 
-#define NAME_TABLE_SIZE		4096
+#define NAME_TABLE_MIN_SIZE	256		/* power of two */
+
+static __thread struct name_ent **nametable;
+static __thread unsigned int	nametable_size;
+static __thread unsigned int	nametable_count;
+static __thread struct name_ent	*nametable_list;
+
+/* FNV-1a, the da hash of names being obfuscated is anything but unique */
+static __uint32_t
+nametable_hash(int namelen, unsigned char *name)
+{
+	__uint32_t	h = 2166136261U;
+	int		i;
+
+	for (i = 0; i < namelen; i++)
+		h = (h ^ name[i]) * 16777619U;
+	return h;
+}
 
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
+static int
+nametable_alloc(unsigned int size)
+{
+	struct name_ent	**table;
+	struct name_ent	*ent;
+	unsigned int	i;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return 0;
+	free(nametable);
+	nametable = table;
+	nametable_size = size;
+
+	for (ent = nametable_list; ent; ent = ent->next) {
+		for (i = ent->slot_hash & (size - 1); table[i];
+		     i = (i + 1) & (size - 1))
+			;
+		table[i] = ent;
+	}
+	return 1;
+}
 
 static void
 nametable_clear(void)
 {
-	int		i;
 	struct name_ent	*ent;
 
-	for (i = 0; i < NAME_TABLE_SIZE; i++) {
-		while ((ent = nametable[i])) {
-			nametable[i] = ent->next;
-			free(ent);
-		}
+	if (!nametable_count)
+		return;
+	while ((ent = nametable_list)) {
+		nametable_list = ent->next;
+		free(ent);
 	}
+	nametable_count = 0;
+
+	/* don't keep a table sized for a huge directory around */
+	if (nametable_size > NAME_TABLE_MIN_SIZE &&
+	    nametable_alloc(NAME_TABLE_MIN_SIZE))
+		return;
+	memset(nametable, 0, nametable_size * sizeof(*nametable));
 }
 
 /*
@@ -558,8 +1601,13 @@ static struct name_ent *
 nametable_find(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
 	struct name_ent	*ent;
+	unsigned int	i;
 
-	for (ent = nametable[hash % NAME_TABLE_SIZE]; ent; ent = ent->next) {
+	if (!nametable_count)
+		return NULL;
+
+	for (i = nametable_hash(namelen, name) & (nametable_size - 1);
+	     (ent = nametable[i]); i = (i + 1) & (nametable_size - 1)) {
 		if (ent->hash == hash && ent->namelen == namelen &&
 				!memcmp(ent->name, name, namelen))
 			return ent;
@@ -575,6 +1623,13 @@ static struct name_ent *
 nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
 	struct name_ent	*ent;
+	unsigned int	i;
+
+	if (!nametable_size && !nametable_alloc(NAME_TABLE_MIN_SIZE))
+		return NULL;
+	if ((nametable_count + 1) * 4 > nametable_size * 3 &&
+	    !nametable_alloc(nametable_size * 2))
+		return NULL;
 
 	ent = malloc(sizeof *ent + namelen);
 	if (!ent)
@@ -583,9 +1638,16 @@ nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 	ent->namelen = namelen;
 	memcpy(ent->name, name, namelen);
 	ent->hash = hash;
-	ent->next = nametable[hash % NAME_TABLE_SIZE];
+	ent->slot_hash = nametable_hash(namelen, name);
+	ent->next_seq = 1;
+	ent->next = nametable_list;
+	nametable_list = ent;
 
-	nametable[hash % NAME_TABLE_SIZE] = ent;
+	for (i = ent->slot_hash & (nametable_size - 1); nametable[i];
+	     i = (i + 1) & (nametable_size - 1))
+		;
+	nametable[i] = ent;
+	nametable_count++;
 
 	return ent;
 }
@@ -593,19 +1655,62 @@ nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 #define is_invalid_char(c)	((c) == '/' || (c) == '\0')
 #define rol32(x,y)		(((x) << (y)) | ((x) >> (32 - (y))))
 
+/*
+ * Random name characters come from a per thread xorshift generator
+ * rather than random(), which takes a lock on every call.  The alphabet
+ * has exactly 64 characters, so each 64 bit draw gives ten of them
+ * without any bias.  The generator is reseeded from name_seed and the AG
+ * number as each AG is started, so the names an AG gets don't depend on
+ * which thread dumps it or what that thread did before.
+ */
+static const unsigned char filename_alphabet[64] =
+					"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+					"abcdefghijklmnopqrstuvwxyz"
+					"0123456789-_";
+
+static __uint64_t		name_seed;
+static __thread __uint64_t	name_rand_state;
+static __thread __uint64_t	name_rand_bits;
+static __thread int		name_rand_left;
+
+static void
+name_rand_init(
+	xfs_agnumber_t	agno)
+{
+	name_rand_state = name_seed ^
+			((__uint64_t)(agno + 1) * 0x9e3779b97f4a7c15ULL);
+	if (!name_rand_state)
+		name_rand_state = 0x9e3779b97f4a7c15ULL;
+	name_rand_left = 0;
+}
+
 static inline unsigned char
 random_filename_char(void)
 {
-	static unsigned char filename_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-						"abcdefghijklmnopqrstuvwxyz"
-						"0123456789-_";
-
-	return filename_alphabet[random() % (sizeof filename_alphabet - 1)];
+	__uint64_t	x = name_rand_state;
+	unsigned char	c;
+
+	if (!name_rand_left) {
+		if (!x)
+			x = name_seed ^ 0x9e3779b97f4a7c15ULL;
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		name_rand_state = x;
+		name_rand_bits = x * 0x2545f4914f6cdd1dULL;
+		name_rand_left = 10;
+	}
+	c = filename_alphabet[name_rand_bits & 63];
+	name_rand_bits >>= 6;
+	name_rand_left--;
+	return c;
 }
 
 #define	ORPHANAGE	"lost+found"
 #define	ORPHANAGE_LEN	(sizeof (ORPHANAGE) - 1)
 
+static xfs_ino_t	orphanage_ino;
+
 static inline int
 is_orphanage_dir(
 	struct xfs_mount	*mp,
@@ -632,7 +1737,6 @@ in_lost_found(
 	int			namelen,
 	unsigned char		*name)
 {
-	static xfs_ino_t	orphanage_ino = 0;
 	char			s[24];	/* 21 is enough (64 bits in decimal) */
 	int			slen;
 
@@ -693,9 +1797,18 @@ obfuscate_name(
 	/*
 	 * The beginning of the obfuscated name can be pretty much
 	 * anything, so fill it in with random characters.
-	 * Accumulate its new hash value as we go.
+	 * Accumulate its new hash value as we go, four characters at a
+	 * time the way xfs_da_hashname() does it.
 	 */
-	for (i = 0; i < name_len - 5; i++) {
+	for (i = 0; i + 4 <= name_len - 5; i += 4, newp += 4) {
+		newp[0] = random_filename_char();
+		newp[1] = random_filename_char();
+		newp[2] = random_filename_char();
+		newp[3] = random_filename_char();
+		new_hash = (newp[0] << 21) ^ (newp[1] << 14) ^
+			   (newp[2] << 7) ^ newp[3] ^ rol32(new_hash, 7 * 4);
+	}
+	for (; i < name_len - 5; i++) {
 		*newp = random_filename_char();
 		new_hash = *newp ^ rol32(new_hash, 7);
 		newp++;
@@ -1004,13 +2117,20 @@ static int
 handle_duplicate_name(xfs_dahash_t hash, size_t name_len, unsigned char *name)
 {
 	unsigned char	new_name[name_len + 1];
-	uint32_t	seq = 1;
+	struct name_ent	*ent;
+	uint32_t	seq;
 
-	if (!nametable_find(hash, name_len, name))
+	ent = nametable_find(hash, name_len, name);
+	if (!ent)
 		return 1;	/* No duplicate */
 
-	/* Name is already in use.  Need to find an alternate. */
-
+	/*
+	 * Name is already in use.  Need to find an alternate.  The
+	 * alternates tried for this name before are all taken by now,
+	 * so pick up the sequence where the last duplicate left it
+	 * rather than walking it from the start again.
+	 */
+	seq = ent->next_seq;
 	do {
 		int	found;
 
@@ -1018,10 +2138,13 @@ handle_duplicate_name(xfs_dahash_t hash, size_t name_len, unsigned char *name)
 		do {
 			memcpy(new_name, name, name_len);
 			found = find_alternate(name_len, new_name, seq++);
-			if (found < 0)
+			if (found < 0) {
+				ent->next_seq = seq - 1;
 				return 0;	/* No more to check */
+			}
 		} while (!found);
 	} while (nametable_find(hash, name_len, new_name));
+	ent->next_seq = seq;
 
 	/*
 	 * The alternate wasn't in the table already.  Pass it back
@@ -1038,6 +2161,7 @@ generate_obfuscated_name(
 	int			namelen,
 	unsigned char		*name)
 {
+	struct md_stat_clock	clock;
 	xfs_dahash_t		hash;
 
 	/*
@@ -1060,6 +2184,7 @@ generate_obfuscated_name(
 
 	/* Obfuscate the name (if possible) */
 
+	md_stat_start(&clock);
 	hash = libxfs_da_hashname(name, namelen);
 	obfuscate_name(hash, namelen, name);
 
@@ -1074,7 +2199,7 @@ generate_obfuscated_name(
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
 			(unsigned long long) cur_ino);
-		return;
+		goto out;
 	}
 
 	/* Create an entry for the new name in the name table. */
@@ -1084,6 +2209,8 @@ generate_obfuscated_name(
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
 			(unsigned long long) cur_ino);
+out:
+	md_stat_stop(MD_STAT_OBFUSCATE, &clock);
 }
 
 static void
@@ -1134,6 +2261,8 @@ process_sf_dir(
 					 (char *)sfp);
 		}
 
+		note_child(M_DIROPS(mp)->sf_get_ino(sfp, sfep), namelen,
+			   &sfep->name[0]);
 		if (obfuscate)
 			generate_obfuscated_name(
 					 M_DIROPS(mp)->sf_get_ino(sfp, sfep),
@@ -1162,8 +2291,10 @@ obfuscate_path_components(
 {
 	unsigned char		*comp = (unsigned char *)buf;
 	unsigned char		*end = comp + len;
+	struct md_stat_clock	clock;
 	xfs_dahash_t		hash;
 
+	md_stat_start(&clock);
 	while (comp < end) {
 		char	*slash;
 		int	namelen;
@@ -1189,6 +2320,7 @@ obfuscate_path_components(
 		comp += namelen + 1;
 		len -= namelen + 1;
 	}
+	md_stat_stop(MD_STAT_OBFUSCATE, &clock);
 }
 
 static void
@@ -1386,6 +2518,8 @@ process_dir_data_block(
 				dir_offset)
 			return;
 
+		note_child(be64_to_cpu(dep->inumber), dep->namelen,
+			   &dep->name[0]);
 		if (obfuscate)
 			generate_obfuscated_name(be64_to_cpu(dep->inumber),
 					 dep->namelen, &dep->name[0]);
@@ -1431,7 +2565,7 @@ process_symlink_block(
 
 #define MAX_REMOTE_VALS		4095
 
-static struct attr_data_s {
+static __thread struct attr_data_s {
 	int			remote_val_count;
 	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
 } attr_data;
@@ -1589,7 +2723,7 @@ process_single_fsb_objects(
 
 	for (i = 0; i < c; i++) {
 		push_cur();
-		set_cur(&typtab[btype], XFS_FSB_TO_DADDR(mp, s), blkbb,
+		md_set_cur(&typtab[btype], XFS_FSB_TO_DADDR(mp, s), blkbb,
 				DB_RING_IGN, NULL);
 
 		if (!iocur_top->data) {
@@ -1668,10 +2802,10 @@ out_pop:
 }
 
 /*
- * Static map to aggregate multiple extents into a single directory block.
+ * Per thread map to aggregate multiple extents into a single directory block.
  */
-static struct bbmap mfsb_map;
-static int mfsb_length;
+static __thread struct bbmap mfsb_map;
+static __thread int mfsb_length;
 
 static int
 process_multi_fsb_objects(
@@ -1708,7 +2842,7 @@ process_multi_fsb_objects(
 
 		if (mfsb_length == 0) {
 			push_cur();
-			set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &mfsb_map);
+			md_set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &mfsb_map);
 			if (!iocur_top->data) {
 				xfs_agnumber_t	agno = XFS_FSB_TO_AGNO(mp, s);
 				xfs_agblock_t	agbno = XFS_FSB_TO_AGBNO(mp, s);
@@ -1872,6 +3006,18 @@ scanfunc_bmap(
 		xfs_agnumber_t	ag;
 		xfs_agblock_t	bno;
 
+		ag = XFS_FSB_TO_AGNO(mp, be64_to_cpu(pp[i]));
+		bno = XFS_FSB_TO_AGBNO(mp, be64_to_cpu(pp[i]));
+		if (bno == 0 || bno > mp->m_sb.sb_agblocks ||
+				ag > mp->m_sb.sb_agcount)
+			continue;
+		libxfs_buf_readahead(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, ag, bno), blkbb, NULL);
+	}
+	for (i = 0; i < nrecs; i++) {
+		xfs_agnumber_t	ag;
+		xfs_agblock_t	bno;
+
 		ag = XFS_FSB_TO_AGNO(mp, be64_to_cpu(pp[i]));
 		bno = XFS_FSB_TO_AGBNO(mp, be64_to_cpu(pp[i]));
 
@@ -2022,27 +3168,33 @@ process_inode_data(
  * attribute fork if they are in short form and we are obfuscating names.
  * In this case we need to recalculate the CRC of the inode, but we should
  * only do that if the CRC in the inode is good to begin with. If the crc
- * is not ok, we just leave it alone.
+ * is not ok, we just leave it alone.  The caller checks the CRCs of a whole
+ * inode buffer at once, and recalculates them at once too: *new_crc is set
+ * if this inode needs it.
  */
 static int
 process_inode(
 	xfs_agnumber_t		agno,
 	xfs_agino_t 		agino,
 	xfs_dinode_t 		*dip,
-	bool			free_inode)
+	bool			free_inode,
+	bool			crc_was_ok,
+	bool			*new_crc)
 {
 	int			success;
-	bool			crc_was_ok = false; /* no recalc by default */
 	bool			need_new_crc = false;
 
 	success = 1;
 	cur_ino = XFS_AGINO_TO_INO(mp, agno, agino);
 
-	/* we only care about crc recalculation if we will modify the inode. */
-	if (obfuscate || zero_stale_data) {
-		crc_was_ok = xfs_verify_cksum((char *)dip,
-					mp->m_sb.sb_inodesize,
-					offsetof(struct xfs_dinode, di_crc));
+	subtree_collect = 0;
+	if (subtree_walking) {
+		struct subtree_ino	*e = subtree_find(cur_ino);
+
+		if (e && !e->done) {
+			e->done = 1;
+			subtree_collect = !free_inode;
+		}
 	}
 
 	if (free_inode) {
@@ -2096,17 +3248,64 @@ process_inode(
 	}
 
 done:
+	subtree_collect = 0;
+
 	/* Heavy handed but low cost; just do it as a catch-all. */
 	if (zero_stale_data)
 		need_new_crc = 1;
 
-	if (crc_was_ok && need_new_crc)
-		libxfs_dinode_calc_crc(mp, dip);
-	return success;
+	*new_crc = crc_was_ok && need_new_crc && dip->di_version >= 3;
+	return success;
+}
+
+static __uint32_t	inodes_copied = 0;
+
+/*
+ * Inode chunks of the inobt records ahead of the one being copied to have
+ * reads in flight for; copying a chunk means processing all its inodes, so
+ * a few chunks are plenty to cover the read latency.
+ */
+#define INODE_READAHEAD_CHUNKS	16
+
+static int
+inode_buf_blocks(void)
+{
+	/* see copy_inode_chunk() */
+	if (xfs_sb_version_hassparseinodes(&mp->m_sb))
+		return xfs_icluster_size_fsb(mp);
+	return mp->m_ialloc_blks;
+}
+
+/* get the reads of the buffers copy_inode_chunk() will want going */
+static void
+readahead_inode_chunk(
+	xfs_agnumber_t 		agno,
+	xfs_inobt_rec_t 	*rp)
+{
+	xfs_agino_t 		agino = be32_to_cpu(rp->ir_startino);
+	xfs_agblock_t		agbno = XFS_AGINO_TO_AGBNO(mp, agino);
+	xfs_agblock_t		end_agbno = agbno + mp->m_ialloc_blks;
+	int			blks_per_buf = inode_buf_blocks();
+	int			inodes_per_buf;
+	int			ioff;
+
+	if (agino == 0 || agino == NULLAGINO || !valid_bno(agno, agbno) ||
+			!valid_bno(agno, XFS_AGINO_TO_AGBNO(mp,
+					agino + XFS_INODES_PER_CHUNK - 1)))
+		return;
+
+	inodes_per_buf = min(blks_per_buf << mp->m_sb.sb_inopblog,
+			     XFS_INODES_PER_CHUNK);
+	for (ioff = 0; agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+	     agbno += blks_per_buf, ioff += inodes_per_buf) {
+		if (xfs_inobt_is_sparse_disk(rp, ioff))
+			continue;
+		libxfs_buf_readahead(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, agbno),
+			XFS_FSB_TO_BB(mp, blks_per_buf), NULL);
+	}
 }
 
-static __uint32_t	inodes_copied = 0;
-
 static int
 copy_inode_chunk(
 	xfs_agnumber_t 		agno,
@@ -2121,6 +3320,10 @@ copy_inode_chunk(
 	int			blks_per_buf;
 	int			inodes_per_buf;
 	int			ioff;
+	char			*ibuf;
+	int			crc_ok[XFS_INODES_PER_CHUNK];
+	char			*new_crc_dips[XFS_INODES_PER_CHUNK];
+	int			nr_new_crc;
 
 	agino = be32_to_cpu(rp->ir_startino);
 	agbno = XFS_AGINO_TO_AGBNO(mp, agino);
@@ -2135,10 +3338,7 @@ copy_inode_chunk(
 	 * Also make sure that that we don't process more than the single record
 	 * we've been passed (large block sizes can hold multiple inode chunks).
 	 */
-	if (xfs_sb_version_hassparseinodes(&mp->m_sb))
-		blks_per_buf = xfs_icluster_size_fsb(mp);
-	else
-		blks_per_buf = mp->m_ialloc_blks;
+	blks_per_buf = inode_buf_blocks();
 	inodes_per_buf = min(blks_per_buf << mp->m_sb.sb_inopblog,
 			     XFS_INODES_PER_CHUNK);
 
@@ -2183,7 +3383,7 @@ copy_inode_chunk(
 		if (xfs_inobt_is_sparse_disk(rp, ioff))
 			goto next_bp;
 
-		set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+		md_set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
 			XFS_FSB_TO_BB(mp, blks_per_buf), DB_RING_IGN, NULL);
 		if (iocur_top->data == NULL) {
 			print_warning("cannot read inode block %u/%u",
@@ -2192,19 +3392,37 @@ copy_inode_chunk(
 			goto pop_out;
 		}
 
+		/*
+		 * we only care about crc recalculation if we will modify the
+		 * inodes.
+		 */
+		ibuf = (char *)iocur_top->data + (off << mp->m_sb.sb_inodelog);
+		if (obfuscate || zero_stale_data)
+			libxfs_dinode_verify_cksums(mp, ibuf, inodes_per_buf,
+						    crc_ok);
+		else
+			memset(crc_ok, 0, sizeof(crc_ok));
+
+		nr_new_crc = 0;
 		for (i = 0; i < inodes_per_buf; i++) {
 			xfs_dinode_t	*dip;
+			bool		new_crc;
 
-			dip = (xfs_dinode_t *)((char *)iocur_top->data +
-					((off + i) << mp->m_sb.sb_inodelog));
+			dip = (xfs_dinode_t *)(ibuf +
+					(i << mp->m_sb.sb_inodelog));
 
 			/* process_inode handles free inodes, too */
 			if (!process_inode(agno, agino + ioff + i, dip,
-			    XFS_INOBT_IS_FREE_DISK(rp, i)))
+			    XFS_INOBT_IS_FREE_DISK(rp, i), crc_ok[i], &new_crc))
 				goto pop_out;
+			if (new_crc)
+				new_crc_dips[nr_new_crc++] = (char *)dip;
 
-			inodes_copied++;
+			__sync_fetch_and_add(&inodes_copied, 1);
 		}
+		xfs_update_cksum_multi(new_crc_dips, nr_new_crc,
+				       mp->m_sb.sb_inodesize,
+				       offsetof(struct xfs_dinode, di_crc));
 
 		if (write_buf(iocur_top))
 			goto pop_out;
@@ -2258,7 +3476,12 @@ scanfunc_ino(
 			return 1;
 
 		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		for (i = 0; i < min(numrecs, INODE_READAHEAD_CHUNKS); i++)
+			readahead_inode_chunk(agno, &rp[i]);
 		for (i = 0; i < numrecs; i++, rp++) {
+			if (i + INODE_READAHEAD_CHUNKS < numrecs)
+				readahead_inode_chunk(agno,
+						rp + INODE_READAHEAD_CHUNKS);
 			if (!copy_inode_chunk(agno, rp))
 				return 0;
 		}
@@ -2273,6 +3496,7 @@ scanfunc_ino(
 	}
 
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+	readahead_btree_ptrs(agno, pp, numrecs);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -2343,7 +3567,7 @@ scan_ag(
 	/* copy the superblock of the AG */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_SB], XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+	md_set_cur(&typtab[TYP_SB], XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	if (!iocur_top->data) {
 		print_warning("cannot read superblock for ag %u", agno);
@@ -2364,7 +3588,7 @@ scan_ag(
 	/* copy the AG free space btree root */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+	md_set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	agf = iocur_top->data;
 	if (iocur_top->data == NULL) {
@@ -2379,7 +3603,7 @@ scan_ag(
 	/* copy the AG inode btree root */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+	md_set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	agi = iocur_top->data;
 	if (iocur_top->data == NULL) {
@@ -2394,7 +3618,7 @@ scan_ag(
 	/* copy the AG free list header */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_AGFL], XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
+	md_set_cur(&typtab[TYP_AGFL], XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		print_warning("cannot read agfl block for ag %u", agno);
@@ -2422,6 +3646,12 @@ scan_ag(
 			goto pop_out;
 	}
 
+	/* the rest of the AG is only dumped if it was asked for */
+	if (!ag_wanted(agno)) {
+		rval = 1;
+		goto pop_out;
+	}
+
 	/* copy AG free space btrees */
 	if (agf) {
 		if (show_progress)
@@ -2473,7 +3703,7 @@ copy_ino(
 	}
 
 	push_cur();
-	set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+	md_set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
 			blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		print_warning("cannot read %s inode %lld",
@@ -2509,51 +3739,486 @@ copy_sb_inodes(void)
 	return copy_ino(mp->m_sb.sb_pquotino, TYP_DQBLK);
 }
 
-static int
-copy_log(void)
+static void
+find_orphanage(void)
 {
-	int dirty;
+	struct xfs_inode	*ip;
+	struct xfs_name		xname;
+	xfs_ino_t		ino;
 
-	if (show_progress)
-		print_progress("Copying log");
+	if (libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &ip, 0))
+		return;
+	xname.name = (unsigned char *)ORPHANAGE;
+	xname.len = ORPHANAGE_LEN;
+	xname.type = 0;
+	if (!libxfs_dir_lookup(NULL, ip, &xname, &ino, NULL))
+		orphanage_ino = ino;
+	IRELE(ip);
+}
+
+/* look up the inobt record of the chunk holding an inode */
+static int
+find_inobt_rec(
+	xfs_agnumber_t		agno,
+	xfs_agino_t		agino,
+	xfs_inobt_rec_t		*rec)
+{
+	struct xfs_btree_block	*block;
+	xfs_inobt_rec_t		*rp;
+	xfs_inobt_key_t		*kp;
+	xfs_inobt_ptr_t		*pp;
+	xfs_agblock_t		bno;
+	int			level;
+	int			numrecs;
+	int			found = 0;
+	int			i;
 
 	push_cur();
-	set_cur(&typtab[TYP_LOG], XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
-			mp->m_sb.sb_logblocks * blkbb, DB_RING_IGN, NULL);
+	md_set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
+		print_warning("cannot read agi block for ag %u", agno);
+		goto pop_out;
+	}
+	bno = be32_to_cpu(((xfs_agi_t *)iocur_top->data)->agi_root);
+	level = be32_to_cpu(((xfs_agi_t *)iocur_top->data)->agi_level) - 1;
+	if (level < 0 || level >= XFS_BTREE_MAXLEVELS)
+		goto pop_out;
+
+	for (; level >= 0; level--) {
+		if (!valid_bno(agno, bno))
+			goto pop_out;
+		md_set_cur(&typtab[TYP_INOBT], XFS_AGB_TO_DADDR(mp, agno, bno),
+				blkbb, DB_RING_IGN, NULL);
+		block = iocur_top->data;
+		if (block == NULL) {
+			print_warning("cannot read inobt block %u/%u",
+					agno, bno);
+			goto pop_out;
+		}
+		numrecs = be16_to_cpu(block->bb_numrecs);
+		if (be16_to_cpu(block->bb_level) != level ||
+		    numrecs > mp->m_inobt_mxr[level != 0])
+			goto pop_out;
+
+		if (level == 0) {
+			rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+			for (i = 0; i < numrecs; i++) {
+				if (agino >= be32_to_cpu(rp[i].ir_startino) &&
+				    agino < be32_to_cpu(rp[i].ir_startino) +
+						XFS_INODES_PER_CHUNK) {
+					*rec = rp[i];
+					found = 1;
+					break;
+				}
+			}
+			break;
+		}
+
+		/* follow the last key at or below the inode */
+		kp = XFS_INOBT_KEY_ADDR(mp, block, 1);
+		pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+		for (i = 0; i < numrecs &&
+			    be32_to_cpu(kp[i].ir_startino) <= agino; i++)
+			;
+		if (i == 0)
+			break;
+		bno = be32_to_cpu(pp[i - 1]);
+	}
+pop_out:
+	pop_cur();
+	return found;
+}
+
+/* copy the inodes below the subtree roots that the AGs didn't cover */
+static int
+copy_subtrees(void)
+{
+	xfs_inobt_rec_t		rec;
+	xfs_agnumber_t		agno;
+	xfs_ino_t		ino;
+	__uint64_t		i;
+	int			rval = 1;
+
+	if (obfuscate && !orphanage_ino)
+		find_orphanage();
+
+	for (i = 0; i < nsubtree_roots; i++)
+		subtree_add(subtree_roots[i]);
+
+	subtree_walking = 1;
+	for (i = 0; i < subtree_queue_len && !subtree_nomem; i++) {
+		ino = subtree_queue[i];
+		if (subtree_find(ino)->done)
+			continue;
+
+		agno = XFS_INO_TO_AGNO(mp, ino);
+		if (!find_inobt_rec(agno, XFS_INO_TO_AGINO(mp, ino), &rec)) {
+			if (show_warnings)
+				print_warning("inode %llu is not allocated",
+						(unsigned long long)ino);
+			continue;
+		}
+		if (!copy_inode_chunk(agno, &rec)) {
+			rval = 0;
+			break;
+		}
+	}
+	subtree_walking = 0;
+	if (subtree_nomem) {
+		print_warning("memory allocation failure");
+		rval = 0;
+	}
+
+	free(subtree_set);
+	subtree_set = NULL;
+	subtree_set_size = subtree_set_count = 0;
+	free(subtree_queue);
+	subtree_queue = NULL;
+	subtree_queue_len = subtree_queue_max = 0;
+	subtree_nomem = 0;
+	return rval;
+}
+
+/*
+ * The log is copied in segments, with the reads of the next few segments
+ * already going while one is written out.
+ */
+#define LOG_SEGMENT_BB		2048	/* 1MB */
+#define LOG_READAHEAD		4	/* segments */
+
+static void
+readahead_log(
+	xfs_daddr_t	start,
+	xfs_daddr_t	end)
+{
+	for (; start < end; start += LOG_SEGMENT_BB)
+		libxfs_buf_readahead(mp->m_ddev_targp, start,
+				MIN(LOG_SEGMENT_BB, end - start), NULL);
+}
+
+static int
+copy_log(void)
+{
+	xfs_daddr_t	start = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart);
+	xfs_daddr_t	end = start + mp->m_sb.sb_logblocks * blkbb;
+	xfs_daddr_t	ra = MIN(end, start + LOG_READAHEAD * LOG_SEGMENT_BB);
+	xfs_daddr_t	daddr;
+	int		len;
+	int		error;
+
+	readahead_log(start, ra);
+	for (daddr = start; daddr < end; daddr += len) {
+		len = MIN(LOG_SEGMENT_BB, end - daddr);
+		if (ra < end) {
+			readahead_log(ra, ra + len);
+			ra += len;
+		}
+
+		push_cur();
+		md_set_cur(&typtab[TYP_LOG], daddr, len, DB_RING_IGN, NULL);
+		if (iocur_top->data == NULL) {
+			pop_cur();
+			print_warning("cannot read log block 0x%llx",
+					(long long)daddr);
+			if (stop_on_read_error)
+				return 0;
+			continue;
+		}
+		error = write_buf(iocur_top);
 		pop_cur();
-		print_warning("cannot read log");
-		return !stop_on_read_error;
+		if (error)
+			return 0;
 	}
+	return 1;
+}
 
-	/* If not obfuscating or zeroing, just copy the log as it is */
-	if (!obfuscate && !zero_stale_data)
-		goto done;
+/*
+ * A clean log is replaced by zeroes without reading it.  Version 2 dumps
+ * just record the log as zeroed extents, unless it is a delta, which has to
+ * compare the zeroes against what the reference chain holds.
+ */
+static int
+zero_log(void)
+{
+	xfs_daddr_t	daddr = XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart);
+	xfs_daddr_t	end = daddr + mp->m_sb.sb_logblocks * blkbb;
+	static char	*zeroes;
+	int		len;
+
+	if (md_version == 2 && !md2_ref)
+		return !md2_add_extent(NULL, daddr, end - daddr);
+
+	if (zeroes == NULL) {
+		zeroes = calloc(LOG_SEGMENT_BB, BBSIZE);
+		if (zeroes == NULL) {
+			print_warning("memory allocation failure");
+			return 0;
+		}
+	}
+	for (; daddr < end; daddr += len) {
+		len = MIN(LOG_SEGMENT_BB, end - daddr);
+		if (write_buf_segment(zeroes, daddr, len))
+			return 0;
+	}
+	return 1;
+}
 
-	dirty = xlog_is_dirty(mp, &x, 0);
+/*
+ * Work out up front whether the log has to be copied at all: a clean log is
+ * of no use to anybody once the metadata is obfuscated or its stale parts
+ * zeroed, so it is zeroed instead.  Returns 1 if the log is to be copied.
+ */
+static int
+check_log(void)
+{
+	if (!obfuscate && !zero_stale_data)
+		return 1;
 
-	switch (dirty) {
+	switch (xlog_is_dirty(mp, &x, 0)) {
 	case 0:
-		/* clear out a clean log */
-		if (show_progress)
-			print_progress("Zeroing clean log");
-		memset(iocur_top->data, 0,
-			mp->m_sb.sb_logblocks * mp->m_sb.sb_blocksize);
-		break;
+		return 0;
 	case 1:
-		/* keep the dirty log */
 		print_warning(
 _("Filesystem log is dirty; image will contain unobfuscated metadata in log."));
 		break;
 	case -1:
-		/* log detection error */
 		print_warning(
 _("Could not discern log; image will contain unobfuscated metadata in log."));
 		break;
 	}
+	return 1;
+}
 
-done:
-	return !write_buf(iocur_top);
+/*
+ * Worker thread, dumps the log and AGs until there are none left.
+ * Different AGs don't share any metadata blocks, so the workers don't lock
+ * the buffers they obfuscate.
+ */
+static void *
+dump_ags(
+	void		*arg)
+{
+	xfs_agnumber_t	agno;
+	int		log;
+	int		ok;
+
+	for (;;) {
+		pthread_mutex_lock(&md_lock);
+		log = md_log_pending;
+		md_log_pending = 0;
+		agno = log ? 0 : md_next_agno++;
+		pthread_mutex_unlock(&md_lock);
+		if (agno >= mp->m_sb.sb_agcount || md_abort)
+			break;
+
+		cur_ag = &md_ags[log ? mp->m_sb.sb_agcount : agno];
+		name_rand_init(log ? mp->m_sb.sb_agcount : agno);
+		ok = metablock || new_metablock();
+		if (ok)
+			ok = log ? copy_log() : scan_ag(agno);
+		if (ok && cur_index)
+			ok = !write_index();
+
+		pthread_mutex_lock(&md_lock);
+		cur_ag->done = 1;
+		cur_ag->error = !ok;
+		pthread_cond_broadcast(&md_cond);
+		pthread_mutex_unlock(&md_lock);
+	}
+
+	free(metablock);
+	free(iocur_base);
+	free(nametable);
+	return NULL;
+}
+
+/* copy a worker's metablock into the output stream */
+static int
+write_chunk(
+	xfs_metablock_t	*mb)
+{
+	__be64		*index = (__be64 *)((char *)mb + sizeof(*mb));
+	char		*data = (char *)mb + BBSIZE;
+	int		count = be16_to_cpu(mb->mb_count);
+	int		i;
+
+	for (i = 0; i < count; i++, data += BBSIZE) {
+		if (write_buf_segment(data, be64_to_cpu(index[i]), 1))
+			return 0;
+	}
+	return 1;
+}
+
+/* write out what a worker queued up for an AG or the log */
+static int
+write_queued(
+	struct md_ag	*ag)
+{
+	struct md_chunk	*chunk;
+	int		ok;
+
+	for (;;) {
+		pthread_mutex_lock(&md_lock);
+		while (!ag->head && !ag->done)
+			pthread_cond_wait(&md_cond, &md_lock);
+		chunk = ag->head;
+		if (chunk) {
+			ag->head = chunk->next;
+			if (!ag->head)
+				ag->tail = &ag->head;
+			ag->queued--;
+			pthread_cond_broadcast(&md_cond);
+		}
+		pthread_mutex_unlock(&md_lock);
+
+		if (!chunk)
+			return !ag->error;
+		ok = write_chunk(chunk->mb);
+		free(chunk->mb);
+		free(chunk);
+		if (!ok)
+			return 0;
+	}
+}
+
+/*
+ * Start the workers and write out the AGs.  The log, if a worker is copying
+ * it, is written by write_log_queued() once the inodes that follow the AGs
+ * are done.
+ */
+static int
+write_ags(
+	int		copy_log)
+{
+	xfs_agnumber_t	agno;
+	int		ok = 1;
+
+	md_threads = calloc(num_threads, sizeof(*md_threads));
+	md_ags = calloc(mp->m_sb.sb_agcount + 1, sizeof(*md_ags));
+	if (md_threads == NULL || md_ags == NULL) {
+		print_warning("memory allocation failure");
+		free(md_threads);
+		free(md_ags);
+		md_threads = NULL;
+		md_ags = NULL;
+		return 0;
+	}
+	for (agno = 0; agno <= mp->m_sb.sb_agcount; agno++) {
+		md_ags[agno].tail = &md_ags[agno].head;
+		md_ags[agno].max_queued = MAX_QUEUED_CHUNKS;
+	}
+	md_ags[mp->m_sb.sb_agcount].max_queued = MAX_QUEUED_LOG_CHUNKS;
+	md_next_agno = 0;
+	md_log_pending = copy_log;
+	md_abort = 0;
+
+	if (obfuscate) {
+		find_orphanage();
+		name_seed = ((__uint64_t)random() << 32) ^ random();
+	}
+
+	for (md_nthreads = 0; md_nthreads < num_threads; md_nthreads++) {
+		if (pthread_create(&md_threads[md_nthreads], NULL, dump_ags,
+				   NULL))
+			break;
+	}
+	if (!md_nthreads) {
+		print_warning("cannot create worker threads: %s",
+				strerror(errno));
+		ok = 0;
+	}
+
+	for (agno = 0; ok && agno < mp->m_sb.sb_agcount; agno++)
+		ok = write_queued(&md_ags[agno]);
+	return ok;
+}
+
+static int
+write_log_queued(void)
+{
+	return write_queued(&md_ags[mp->m_sb.sb_agcount]);
+}
+
+/* wait for the workers to finish, or stop them early if we failed */
+static void
+stop_workers(
+	int		ok)
+{
+	struct md_chunk	*chunk;
+	xfs_agnumber_t	agno;
+
+	pthread_mutex_lock(&md_lock);
+	md_abort = !ok;
+	pthread_cond_broadcast(&md_cond);
+	pthread_mutex_unlock(&md_lock);
+	while (md_nthreads--)
+		pthread_join(md_threads[md_nthreads], NULL);
+
+	for (agno = 0; agno <= mp->m_sb.sb_agcount; agno++) {
+		while ((chunk = md_ags[agno].head) != NULL) {
+			md_ags[agno].head = chunk->next;
+			free(chunk->mb);
+			free(chunk);
+		}
+	}
+	free(md_ags);
+	md_ags = NULL;
+	free(md_threads);
+	md_threads = NULL;
+	md_nthreads = 0;
+}
+
+/* parse a comma separated list of AG numbers for -A */
+static int
+parse_ag_list(
+	char			*list)
+{
+	xfs_agnumber_t		agno;
+	char			*p = list;
+	char			*end;
+
+	if (!ags_wanted) {
+		ags_wanted = calloc(mp->m_sb.sb_agcount, 1);
+		if (ags_wanted == NULL) {
+			print_warning("memory allocation failure");
+			return 0;
+		}
+	}
+	do {
+		agno = strtoul(p, &end, 0);
+		if (end == p || (*end != ',' && *end != '\0') ||
+		    agno >= mp->m_sb.sb_agcount) {
+			print_warning("bad AG list %s", list);
+			return 0;
+		}
+		ags_wanted[agno] = 1;
+		p = end;
+	} while (*p++ == ',');
+	return 1;
+}
+
+/*
+ * Open the chain of dumps a delta is taken against and make sure it is of
+ * this filesystem.
+ */
+static int
+open_reference(void)
+{
+	char			buf[BBSIZE];
+	xfs_dsb_t		*sb = (xfs_dsb_t *)buf;
+
+	md2_ref = mdump_open_chain(md_nrefs, md_refs);
+	if (mdump_pread(md2_ref, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    be32_to_cpu(sb->sb_magicnum) != XFS_SB_MAGIC ||
+	    platform_uuid_compare(&sb->sb_uuid, &mp->m_sb.sb_uuid)) {
+		print_warning("reference dump %s is not of this filesystem",
+				md_refs[0]);
+		mdump_close(md2_ref);
+		md2_ref = NULL;
+		return 0;
+	}
+	return 1;
 }
 
 static int
@@ -2564,12 +4229,31 @@ metadump_f(
 	xfs_agnumber_t	agno;
 	int		c;
 	int		start_iocur_sp;
+	int		internal_log = mp->m_sb.sb_logstart != 0;
+	int		log_copied;
 	char		*p;
+	struct libxfs_iostats io_start;
+	__uint64_t	wall_start;
 
 	exitcode = 1;
 	show_progress = 0;
+	show_stats = 0;
 	show_warnings = 0;
 	stop_on_read_error = 0;
+	num_threads = 1;
+	md_version = 0;
+	md_nrefs = 0;
+	free(md_refs);
+	md_refs = calloc(argc, sizeof(*md_refs));
+	nsubtree_roots = 0;
+	free(subtree_roots);
+	subtree_roots = calloc(argc, sizeof(*subtree_roots));
+	free(ags_wanted);
+	ags_wanted = NULL;
+	if (md_refs == NULL || subtree_roots == NULL) {
+		print_warning("memory allocation failure");
+		return 0;
+	}
 
 	if (mp->m_sb.sb_magicnum != XFS_SB_MAGIC) {
 		print_warning("bad superblock magic number %x, giving up",
@@ -2577,8 +4261,12 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ow")) != EOF) {
+	while ((c = getopt(argc, argv, "A:aegi:m:or:st:v:w")) != EOF) {
 		switch (c) {
+			case 'A':
+				if (!parse_ag_list(optarg))
+					return 0;
+				break;
 			case 'a':
 				zero_stale_data = 0;
 				break;
@@ -2588,6 +4276,20 @@ metadump_f(
 			case 'g':
 				show_progress = 1;
 				break;
+			case 'i': {
+				xfs_ino_t	ino;
+
+				ino = strtoull(optarg, &p, 0);
+				if (*p != '\0' || !ino ||
+				    XFS_INO_TO_AGNO(mp, ino) >=
+						mp->m_sb.sb_agcount) {
+					print_warning("bad inode number %s",
+							optarg);
+					return 0;
+				}
+				subtree_roots[nsubtree_roots++] = ino;
+				break;
+			}
 			case 'm':
 				max_extent_size = (int)strtol(optarg, &p, 0);
 				if (*p != '\0' || max_extent_size <= 0) {
@@ -2599,6 +4301,34 @@ metadump_f(
 			case 'o':
 				obfuscate = 0;
 				break;
+			case 'r':
+				if (md_nrefs == XFS_MD2_MAX_CHAIN) {
+					print_warning("too many reference dumps");
+					return 0;
+				}
+				md_refs[md_nrefs++] = optarg;
+				break;
+			case 's':
+				show_stats = 1;
+				break;
+			case 't':
+				num_threads = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || num_threads <= 0 ||
+				    num_threads > MAX_METADUMP_THREADS) {
+					print_warning("bad number of threads %s",
+							optarg);
+					return 0;
+				}
+				break;
+			case 'v':
+				md_version = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' ||
+				    (md_version != 1 && md_version != 2)) {
+					print_warning("bad metadump version %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
@@ -2613,25 +4343,38 @@ metadump_f(
 		return 0;
 	}
 
-	metablock = (xfs_metablock_t *)calloc(BBSIZE + 1, BBSIZE);
-	if (metablock == NULL) {
-		print_warning("memory allocation failure");
+	/* the progress report counts against sb_icount */
+	if (show_progress)
+		init_perag_data();
+
+	/* with only subtrees asked for, no AG is dumped whole */
+	if (nsubtree_roots && !ags_wanted) {
+		ags_wanted = calloc(mp->m_sb.sb_agcount, 1);
+		if (ags_wanted == NULL) {
+			print_warning("memory allocation failure");
+			return 0;
+		}
+	}
+
+	if (md_nrefs && md_version == 1) {
+		print_warning("deltas can only be taken in version 2 dumps");
 		return 0;
 	}
-	metablock->mb_blocklog = BBSHIFT;
-	metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+	if (!md_version)
+		md_version = md_nrefs ? 2 : 1;
+	if (md_nrefs && !open_reference())
+		return 0;
 
-	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
-	block_buffer = (char *)metablock + BBSIZE;
+	if (!new_metablock())
+		goto out_close_ref;
 	num_indicies = (BBSIZE - sizeof(xfs_metablock_t)) / sizeof(__be64);
-	cur_index = 0;
 	start_iocur_sp = iocur_sp;
 
 	if (strcmp(argv[optind], "-") == 0) {
 		if (isatty(fileno(stdout))) {
 			print_warning("cannot write to a terminal");
 			free(metablock);
-			return 0;
+			goto out_close_ref;
 		}
 		outf = stdout;
 	} else {
@@ -2639,29 +4382,59 @@ metadump_f(
 		if (outf == NULL) {
 			print_warning("cannot create dump file");
 			free(metablock);
-			return 0;
+			goto out_close_ref;
 		}
 	}
 
+	memset(md_stat_cpu, 0, sizeof(md_stat_cpu));
+	memset(md_stat_wall, 0, sizeof(md_stat_wall));
+	md_stat_blocks = md_stat_bytes = md_stat_out_bytes = 0;
+	libxfs_iostats_get(&io_start);
+	wall_start = md_stat_now(CLOCK_MONOTONIC);
+
 	exitcode = 0;
+	log_copied = internal_log && check_log();
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
+	if (md_version == 2 && !md2_init())
+		exitcode = 1;
+	else if (num_threads > 1 && mp->m_sb.sb_agcount > 1) {
+		num_threads = MIN(num_threads, mp->m_sb.sb_agcount);
+		exitcode = !write_ags(log_copied);
+	} else {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			if (!scan_ag(agno)) {
+				exitcode = 1;
+				break;
+			}
 		}
 	}
 
+	if (!exitcode && nsubtree_roots)
+		exitcode = !copy_subtrees();
+
 	/* copy realtime and quota inode contents */
 	if (!exitcode)
 		exitcode = !copy_sb_inodes();
 
 	/* copy log if it's internal */
-	if ((mp->m_sb.sb_logstart != 0) && !exitcode)
-		exitcode = !copy_log();
+	if (internal_log && !exitcode) {
+		if (show_progress)
+			print_progress(log_copied ? "Copying log" :
+						    "Zeroing clean log");
+		if (!log_copied)
+			exitcode = !zero_log();
+		else if (md_ags)
+			exitcode = !write_log_queued();
+		else
+			exitcode = !copy_log();
+	}
+	if (md_ags)
+		stop_workers(!exitcode);
 
 	/* write the remaining index */
-	if (!exitcode)
+	if (md_version == 2)
+		exitcode = md2_finish(!exitcode);
+	else if (!exitcode)
 		exitcode = write_index() < 0;
 
 	if (progress_since_warning)
@@ -2669,12 +4442,21 @@ metadump_f(
 
 	if (outf != stdout)
 		fclose(outf);
+	else
+		fflush(outf);
+
+	if (show_stats)
+		md_stat_report(&io_start, wall_start);
 
 	/* cleanup iocur stack */
 	while (iocur_sp > start_iocur_sp)
 		pop_cur();
 
 	free(metablock);
-
+out_close_ref:
+	if (md2_ref) {
+		mdump_close(md2_ref);
+		md2_ref = NULL;
+	}
 	return 0;
 }
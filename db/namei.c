@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "command.h"
+#include "type.h"
+#include "fprint.h"
+#include "faddr.h"
+#include "field.h"
+#include "io.h"
+#include "inode.h"
+#include "output.h"
+#include "init.h"
+#include "namei.h"
+
+static int path_f(int argc, char **argv);
+static void path_help(void);
+
+static const cmdinfo_t path_cmd =
+	{ "path", NULL, path_f, 1, 2, 0, N_("[-n] pathname"),
+	  N_("set current inode to the one a path leads to"), path_help };
+
+static void
+path_help(void)
+{
+	dbprintf(_(
+"\n"
+" 'path' looks up a pathname one component at a time, using the hashed\n"
+" lookups of the directory code, and makes the inode it leads to current.\n"
+" Each component only costs the reads of the directory blocks its name\n"
+" hashes to, rather than the scan of the whole filesystem that blockget -n\n"
+" and ncheck need.  An absolute pathname starts at the root directory, a\n"
+" relative one at the current inode if it is a directory.  Symbolic links\n"
+" are not followed.\n"
+"\n"
+" Options:\n"
+"   -n -- just print the inode number, leave the current inode alone\n"
+"\n"
+" Example:\n"
+"   path /usr/lib/libc.so.6\n"
+"\n"
+));
+}
+
+/*
+ * Look up name in the directory dino.  Returns 0 with the inode number of
+ * the entry in *ino, or prints why not and returns -1.
+ */
+static int
+path_lookup(
+	xfs_ino_t		dino,
+	const char		*name,
+	int			len,
+	xfs_ino_t		*ino)
+{
+	struct xfs_inode	*dp;
+	struct xfs_name		xname;
+	int			error;
+
+	error = -libxfs_iget(mp, NULL, dino, 0, &dp, 0);
+	if (error) {
+		dbprintf(_("can't read directory inode %llu: %s\n"),
+			(unsigned long long)dino, strerror(error));
+		return -1;
+	}
+	if (!S_ISDIR(dp->i_d.di_mode)) {
+		dbprintf(_("inode %llu is not a directory, can't look up "
+			   "\"%.*s\" in it\n"),
+			(unsigned long long)dino, len, name);
+		IRELE(dp);
+		return -1;
+	}
+
+	xname.name = (const unsigned char *)name;
+	xname.len = len;
+	xname.type = 0;
+	error = -libxfs_dir_lookup(NULL, dp, &xname, ino, NULL);
+	IRELE(dp);
+	if (error) {
+		if (error == ENOENT)
+			dbprintf(_("\"%.*s\" not found in directory inode "
+				   "%llu\n"),
+				len, name, (unsigned long long)dino);
+		else
+			dbprintf(_("can't look up \"%.*s\" in directory "
+				   "inode %llu: %s\n"),
+				len, name, (unsigned long long)dino,
+				strerror(error));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+path_f(
+	int		argc,
+	char		**argv)
+{
+	xfs_ino_t	ino;
+	const char	*path, *name;
+	int		nflag = 0;
+	int		len;
+	int		c;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n")) != EOF) {
+		switch (c) {
+		case 'n':
+			nflag = 1;
+			break;
+		default:
+			path_help();
+			return 0;
+		}
+	}
+	if (optind != argc - 1) {
+		path_help();
+		return 0;
+	}
+	path = argv[optind];
+
+	if (*path != '/' && iocur_top->typ == &typtab[TYP_INODE] &&
+	    iocur_top->ino != NULLFSINO && S_ISDIR(iocur_top->mode))
+		ino = iocur_top->ino;
+	else
+		ino = mp->m_sb.sb_rootino;
+
+	for (name = path; *name; name += len) {
+		while (*name == '/')
+			name++;
+		len = strcspn(name, "/");
+		if (!len || (len == 1 && *name == '.'))
+			continue;
+		if (len >= MAXNAMELEN) {
+			dbprintf(_("name too long in path %s\n"), path);
+			return 0;
+		}
+		if (path_lookup(ino, name, len, &ino) < 0)
+			return 0;
+	}
+
+	if (nflag)
+		dbprintf("%llu\n", (unsigned long long)ino);
+	else
+		set_cur_inode(ino);
+	return 0;
+}
+
+void
+namei_init(void)
+{
+	add_command(&path_cmd);
+}
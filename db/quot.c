@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include <pwd.h>
+#include <grp.h>
+#include "command.h"
+#include "quot.h"
+#include "io.h"
+#include "type.h"
+#include "output.h"
+#include "init.h"
+#include "malloc.h"
+
+/*
+ * quot: add up the blocks and inodes used by each user, group and
+ * project by reading the inode chunks of each AG straight off the disk,
+ * so that usage can be worked out for a filesystem that isn't mounted,
+ * and printed the way xfs_quota's report command prints it.  The blocks
+ * of each inode are taken from di_nblocks, without walking its forks,
+ * so a realtime file's attribute and bmap btree blocks are counted as
+ * realtime blocks.
+ */
+#define QUOT_USR	0
+#define QUOT_GRP	1
+#define QUOT_PRJ	2
+#define QUOT_NTYPES	3
+#define QUOT_HASH	1024
+
+typedef struct quot_ent {
+	struct quot_ent	*next;
+	__uint32_t	id;
+	__uint64_t	blocks;
+	__uint64_t	inodes;
+	__uint64_t	rtblocks;
+} quot_ent_t;
+
+static quot_ent_t	*quot_hash[QUOT_NTYPES][QUOT_HASH];
+static int		quot_count[QUOT_NTYPES];
+static int		quot_types;		/* 1 << QUOT_xxx */
+static int		nflag;
+static int		nthreads;
+static int		quot_bad;	/* an AG couldn't all be read */
+
+static const char	*quot_type_names[QUOT_NTYPES] = {
+	"User", "Group", "Project",
+};
+
+static int		quot_f(int argc, char **argv);
+static void		scan_ag(xfs_agnumber_t agno);
+
+static const cmdinfo_t	quot_cmd =
+	{ "quot", NULL, quot_f, 0, -1, 0,
+	  "[-gnpu] [-T threads]",
+	  "summarize block and inode usage by owner", NULL };
+
+void
+quot_init(void)
+{
+	add_command(&quot_cmd);
+}
+
+/*
+ * scan_ags() runs only one AG's code at a time, so the tables need no
+ * locking.
+ */
+static void
+quot_add(
+	int			type,
+	__uint32_t		id,
+	__uint64_t		blocks,
+	__uint64_t		rtblocks)
+{
+	quot_ent_t		**hp = &quot_hash[type][id % QUOT_HASH];
+	quot_ent_t		*qe;
+
+	for (qe = *hp; qe; qe = qe->next)
+		if (qe->id == id)
+			break;
+	if (!qe) {
+		qe = xcalloc(1, sizeof(*qe));
+		qe->id = id;
+		qe->next = *hp;
+		*hp = qe;
+		quot_count[type]++;
+	}
+	qe->blocks += blocks;
+	qe->rtblocks += rtblocks;
+	qe->inodes++;
+}
+
+static void
+quot_free(void)
+{
+	quot_ent_t		*qe, *next;
+	int			i, h;
+
+	for (i = 0; i < QUOT_NTYPES; i++) {
+		for (h = 0; h < QUOT_HASH; h++) {
+			for (qe = quot_hash[i][h]; qe; qe = next) {
+				next = qe->next;
+				xfree(qe);
+			}
+			quot_hash[i][h] = NULL;
+		}
+		quot_count[i] = 0;
+	}
+}
+
+static void
+process_inode(
+	xfs_agnumber_t		agno,
+	xfs_agino_t		agino,
+	xfs_dinode_t		*dip)
+{
+	xfs_ino_t		ino = XFS_AGINO_TO_INO(mp, agno, agino);
+	__uint64_t		blocks = 0;
+	__uint64_t		rtblocks = 0;
+
+	if (!dip->di_mode)
+		return;
+	/* the quota files themselves aren't charged to anybody */
+	if (ino == mp->m_sb.sb_uquotino || ino == mp->m_sb.sb_gquotino ||
+	    ino == mp->m_sb.sb_pquotino)
+		return;
+
+	if (be16_to_cpu(dip->di_flags) & XFS_DIFLAG_REALTIME)
+		rtblocks = be64_to_cpu(dip->di_nblocks);
+	else
+		blocks = be64_to_cpu(dip->di_nblocks);
+
+	if (quot_types & (1 << QUOT_USR))
+		quot_add(QUOT_USR, be32_to_cpu(dip->di_uid), blocks, rtblocks);
+	if (quot_types & (1 << QUOT_GRP))
+		quot_add(QUOT_GRP, be32_to_cpu(dip->di_gid), blocks, rtblocks);
+	if (quot_types & (1 << QUOT_PRJ))
+		quot_add(QUOT_PRJ, (__uint32_t)be16_to_cpu(dip->di_projid_hi) <<
+				16 | be16_to_cpu(dip->di_projid_lo),
+			 blocks, rtblocks);
+}
+
+static void
+scanfunc_ino(
+	struct xfs_btree_block	*block,
+	int			level,
+	xfs_agnumber_t		agno);
+
+static void
+scan_sbtree(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		root,
+	int			nlevels)
+{
+	push_cur();
+	set_cur(&typtab[TYP_INOBT], XFS_AGB_TO_DADDR(mp, agno, root),
+		blkbb, DB_RING_IGN, NULL);
+	if (iocur_top->data == NULL) {
+		dbprintf(_("can't read btree block %u/%u\n"), agno, root);
+		pop_cur();
+		quot_bad = 1;
+		return;
+	}
+	scanfunc_ino(iocur_top->data, nlevels - 1, agno);
+	pop_cur();
+}
+
+static void
+scanfunc_ino(
+	struct xfs_btree_block	*block,
+	int			level,
+	xfs_agnumber_t		agno)
+{
+	xfs_agino_t		agino;
+	int			i;
+	int			j;
+	int			off;
+	xfs_inobt_ptr_t		*pp;
+	xfs_inobt_rec_t		*rp;
+
+	if (level == 0) {
+		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
+			agino = be32_to_cpu(rp[i].ir_startino);
+			off = XFS_INO_TO_OFFSET(mp, agino);
+			push_cur();
+			set_cur(&typtab[TYP_INODE],
+				XFS_AGB_TO_DADDR(mp, agno,
+						 XFS_AGINO_TO_AGBNO(mp, agino)),
+				XFS_FSB_TO_BB(mp, mp->m_ialloc_blks),
+				DB_RING_IGN, NULL);
+			if (iocur_top->data == NULL) {
+				dbprintf(_("can't read inode block %u/%u\n"),
+					agno, XFS_AGINO_TO_AGBNO(mp, agino));
+				pop_cur();
+				quot_bad = 1;
+				continue;
+			}
+			for (j = 0; j < XFS_INODES_PER_CHUNK; j++) {
+				if (XFS_INOBT_IS_FREE_DISK(&rp[i], j))
+					continue;
+				process_inode(agno, agino + j, (xfs_dinode_t *)
+					((char *)iocur_top->data +
+					((off + j) << mp->m_sb.sb_inodelog)));
+			}
+			pop_cur();
+		}
+		return;
+	}
+	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mp->m_inobt_mxr[1]);
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
+		scan_sbtree(agno, be32_to_cpu(pp[i]), level);
+}
+
+static void
+scan_ag(
+	xfs_agnumber_t		agno)
+{
+	xfs_agi_t		*agi;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGI],
+		XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	if ((agi = iocur_top->data) == NULL) {
+		dbprintf(_("can't read agi block for ag %u\n"), agno);
+		pop_cur();
+		quot_bad = 1;
+		return;
+	}
+	scan_sbtree(agno, be32_to_cpu(agi->agi_root),
+		    be32_to_cpu(agi->agi_level));
+	pop_cur();
+}
+
+static int
+quot_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const quot_ent_t	*qa = *(const quot_ent_t **)a;
+	const quot_ent_t	*qb = *(const quot_ent_t **)b;
+
+	if (qa->id != qb->id)
+		return qa->id < qb->id ? -1 : 1;
+	return 0;
+}
+
+static const char *
+quot_name(
+	int			type,
+	__uint32_t		id,
+	char			*buf,
+	size_t			len)
+{
+	struct passwd		*pw;
+	struct group		*gr;
+
+	if (!nflag && type == QUOT_USR && (pw = getpwuid(id)))
+		return pw->pw_name;
+	if (!nflag && type == QUOT_GRP && (gr = getgrgid(id)))
+		return gr->gr_name;
+	snprintf(buf, len, "#%u", id);
+	return buf;
+}
+
+/*
+ * Print one type's usage like "xfs_quota -c 'report -bir'" does, in
+ * kilobytes.  There are no limits to show, the filesystem isn't mounted.
+ */
+static void
+quot_report(
+	int			type)
+{
+	quot_ent_t		**ents;
+	quot_ent_t		*qe;
+	char			buf[16];
+	int			n = 0;
+	int			h;
+
+	if (!quot_count[type])
+		return;
+	ents = xmalloc(quot_count[type] * sizeof(*ents));
+	for (h = 0; h < QUOT_HASH; h++)
+		for (qe = quot_hash[type][h]; qe; qe = qe->next)
+			ents[n++] = qe;
+	qsort(ents, n, sizeof(*ents), quot_cmp);
+
+	dbprintf(_("%s quota on %s (%s)\n"), quot_type_names[type],
+		fsdevice, _("offline"));
+	dbprintf(_("%-10s %12s %12s %12s\n"), "", _("Blocks"), _("Inodes"),
+		_("Realtime"));
+	dbprintf(_("%-10s %12s %12s %12s\n"), _("ID"), _("Used"), _("Used"),
+		_("Used"));
+	dbprintf("---------- ------------ ------------ ------------\n");
+	for (h = 0; h < n; h++)
+		dbprintf("%-10s %12llu %12llu %12llu\n",
+			quot_name(type, ents[h]->id, buf, sizeof(buf)),
+			(unsigned long long)XFS_FSB_TO_B(mp, ents[h]->blocks)
+				>> 10,
+			(unsigned long long)ents[h]->inodes,
+			(unsigned long long)XFS_FSB_TO_B(mp, ents[h]->rtblocks)
+				>> 10);
+	dbprintf("\n");
+	xfree(ents);
+}
+
+static int
+quot_f(
+	int			argc,
+	char			**argv)
+{
+	int			c;
+	int			i;
+
+	quot_types = 0;
+	nflag = 0;
+	nthreads = 1;
+	optind = 0;
+	while ((c = getopt(argc, argv, "gnpuT:")) != EOF) {
+		switch (c) {
+		case 'g':
+			quot_types |= 1 << QUOT_GRP;
+			break;
+		case 'n':
+			nflag = 1;
+			break;
+		case 'p':
+			quot_types |= 1 << QUOT_PRJ;
+			break;
+		case 'u':
+			quot_types |= 1 << QUOT_USR;
+			break;
+		case 'T':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_SCAN_THREADS) {
+				dbprintf(_("bad number of threads %s for quot "
+					   "command\n"), optarg);
+				return 0;
+			}
+			break;
+		default:
+			dbprintf(_("bad option for quot command\n"));
+			return 0;
+		}
+	}
+	if (!quot_types)
+		quot_types = (1 << QUOT_NTYPES) - 1;
+
+	quot_bad = 0;
+	scan_ags(nthreads, scan_ag);
+	for (i = 0; i < QUOT_NTYPES; i++)
+		if (quot_types & (1 << i))
+			quot_report(i);
+	if (quot_bad)
+		dbprintf(_("some inodes couldn't be read, usage is incomplete\n"));
+	quot_free();
+	return 0;
+}
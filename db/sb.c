@@ -187,6 +187,36 @@ sb_size(
 	return bitize(mp->m_sb.sb_sectsize);
 }
 
+/*
+ * Commands that visit every AG's superblock in turn keep this many of the
+ * ones ahead being read, so they aren't read one at a time.
+ */
+#define SB_RA_WINDOW	64
+
+static void
+sb_readahead(
+	xfs_agnumber_t	agno,
+	xfs_agnumber_t	count)
+{
+	xfs_agnumber_t	end = min(agno + count, mp->m_sb.sb_agcount);
+
+	for (; agno < end; agno++)
+		libxfs_buf_readahead(mp->m_ddev_targp,
+				XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+				XFS_FSS_TO_BB(mp, 1), &xfs_sb_buf_ops);
+}
+
+/* start reading the superblock SB_RA_WINDOW AGs on from agno */
+static void
+sb_readahead_next(
+	xfs_agnumber_t	agno)
+{
+	if (!agno)
+		sb_readahead(0, SB_RA_WINDOW + 1);
+	else
+		sb_readahead(agno + SB_RA_WINDOW, 1);
+}
+
 static int
 get_sb(xfs_agnumber_t agno, xfs_sb_t *sb)
 {
@@ -416,11 +446,15 @@ uuid_f(
 			return 0;
 
 		dbprintf(_("writing all SBs\n"));
-		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		write_cur_batch_start();
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			sb_readahead_next(agno);
 			if (!do_uuid(agno, &uu)) {
 				dbprintf(_("failed to set UUID in AG %d\n"), agno);
 				break;
 			}
+		}
+		write_cur_batch_flush();
 
 		platform_uuid_unparse(&uu, bp);
 		dbprintf(_("new UUID = %s\n"), bp);
@@ -429,6 +463,7 @@ uuid_f(
 	} else {	/* READ+CHECK UUID */
 
 		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			sb_readahead_next(agno);
 			uup = do_uuid(agno, NULL);
 			if (!uup) {
 				dbprintf(_("failed to read UUID from AG %d\n"),
@@ -544,16 +579,21 @@ label_f(
 		}
 
 		dbprintf(_("writing all SBs\n"));
-		for (ag = 0; ag < mp->m_sb.sb_agcount; ag++)
+		write_cur_batch_start();
+		for (ag = 0; ag < mp->m_sb.sb_agcount; ag++) {
+			sb_readahead_next(ag);
 			if ((p = do_label(ag, argv[1])) == NULL) {
 				dbprintf(_("failed to set label in AG %d\n"), ag);
 				break;
 			}
+		}
+		write_cur_batch_flush();
 		dbprintf(_("new label = \"%s\"\n"), p);
 
 	} else {	/* READ LABEL */
 
 		for (ag = 0; ag < mp->m_sb.sb_agcount; ag++) {
+			sb_readahead_next(ag);
 			p = do_label(ag, NULL);
 			if (!p) {
 				dbprintf(_("failed to read label in AG %d\n"), ag);
@@ -790,12 +830,16 @@ version_f(
 
 		if (version) {
 			dbprintf(_("writing all SBs\n"));
-			for (ag = 0; ag < mp->m_sb.sb_agcount; ag++)
+			write_cur_batch_start();
+			for (ag = 0; ag < mp->m_sb.sb_agcount; ag++) {
+				sb_readahead_next(ag);
 				if (!do_version(ag, version, features)) {
 					dbprintf(_("failed to set versionnum "
 						 "in AG %d\n"), ag);
 					break;
 				}
+			}
+			write_cur_batch_flush();
 			mp->m_sb.sb_versionnum = version;
 			mp->m_sb.sb_features2 = features;
 		}
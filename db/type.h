@@ -44,7 +44,8 @@ typedef struct typ
 	const struct field	*fields;
 	const struct xfs_buf_ops *bops;
 } typ_t;
-extern const typ_t	*typtab, *cur_typ;
+extern const typ_t	*typtab;
+extern __thread const typ_t *cur_typ;
 
 extern void	type_init(void);
 extern void	type_set_tab_crc(void);
@@ -5,17 +5,24 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] source target"
+USAGE="Usage: xfs_metadump [-adefFogswV] [-A agno[,agno]...] [-i inode]... [-m max_extents] [-r reference]... [-t threads] [-v version] [-l logdev] source target"
 
-while getopts "aefgl:m:owFV" c
+while getopts "adefgi:l:m:or:st:v:wA:FV" c
 do
 	case $c in
 	a)	OPTS=$OPTS"-a ";;
 	e)	OPTS=$OPTS"-e ";;
 	g)	OPTS=$OPTS"-g ";;
+	i)	OPTS=$OPTS"-i "$OPTARG" ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
+	r)	OPTS=$OPTS"-r "$OPTARG" ";;
+	s)	OPTS=$OPTS"-s ";;
+	t)	OPTS=$OPTS"-t "$OPTARG" ";;
+	v)	OPTS=$OPTS"-v "$OPTARG" ";;
 	w)	OPTS=$OPTS"-w ";;
+	A)	OPTS=$OPTS"-A "$OPTARG" ";;
+	d)	DBOPTS=$DBOPTS" -d";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
 	F)	DBOPTS=$DBOPTS" -F";;
@@ -5,10 +5,11 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="usage: xfs_ncheck [-sfV] [-l logdev] [-i ino]... special"
+INDEX=""
+USAGE="usage: xfs_ncheck [-sfV] [-l logdev] [-x index] [-i ino]... special"
 
 
-while getopts "b:fi:l:svV" c
+while getopts "b:fi:l:svVx:" c
 do
 	case $c in
 	s)	OPTS=$OPTS"-s ";;
@@ -16,6 +17,7 @@ do
 	v)	OPTS=$OPTS"-v ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
+	x)	INDEX=$OPTARG;;
 	V)	xfs_db -p xfs_ncheck -V
 		status=$?
 		exit $status
@@ -28,7 +30,14 @@ done
 set -- extra $@
 shift $OPTIND
 case $# in
-	1)	xfs_db$DBOPTS -r -p xfs_ncheck -c "blockget -ns" -c "ncheck$OPTS" $1
+	1)	if [ -z "$INDEX" ]; then
+			NCHECK="ncheck -d$OPTS"
+		elif [ -f "$INDEX" ]; then
+			NCHECK="ncheck -r $INDEX$OPTS"
+		else
+			NCHECK="ncheck -d -w $INDEX$OPTS"
+		fi
+		xfs_db$DBOPTS -r -p xfs_ncheck -c "$NCHECK" $1
 		status=$?
 		;;
 	*)	echo $USAGE 1>&2
@@ -23,7 +23,8 @@
  */
 #include "libxfs.h"
 #include <sys/stat.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <pthread.h>
 
 unsigned long long
 cvtnum(char *s)
@@ -45,27 +46,35 @@ cvtnum(char *s)
 	return 0LL;
 }
 
-int ffn(const char *, const struct stat64 *, int, struct FTW *);
+struct counts;
+void ffn(struct counts *, const char *, const struct stat64 *);
+void walk(char *, int);
 
 #define BLOCKSIZE	4096
 #define INODESIZE	256
 #define PERDIRENTRY	\
 	(sizeof(xfs_dir2_leaf_entry_t) + sizeof(xfs_dir2_data_entry_t))
 #define LOGSIZE		1000
+#define MAX_THREADS	256
 
 #define FBLOCKS(n)	((n)/blocksize)
 #define RFBYTES(n)	((n) - (FBLOCKS(n) * blocksize))
 
-unsigned long long dirsize=0;		/* bytes */
+struct counts {
+	unsigned long long dirsize;	/* bytes */
+	unsigned long long fullblocks;	/* FS blocks */
+	unsigned long long isize;	/* inodes bytes */
+	unsigned long long nslinks;	/* number of symbolic links */
+	unsigned long long nfiles;	/* number of regular files */
+	unsigned long long ndirs;	/* number of directories */
+	unsigned long long nspecial;	/* number of special files */
+};
+
+struct counts total;			/* of the directory being walked */
 unsigned long long logsize=LOGSIZE*BLOCKSIZE;	/* bytes */
-unsigned long long fullblocks=0;	/* FS blocks */
-unsigned long long isize=0;		/* inodes bytes */
 unsigned long long blocksize=BLOCKSIZE;
-unsigned long long nslinks=0;		/* number of symbolic links */
-unsigned long long nfiles=0;		/* number of regular files */
-unsigned long long ndirs=0;		/* number of directories */
-unsigned long long nspecial=0;		/* number of special files */
 unsigned long long verbose=0;		/* verbose mode TRUE/FALSE */
+int nthreads=16;			/* directory walkers */
 
 int __debug = 0;
 int ilog = 0;
@@ -79,6 +88,7 @@ usage(char *progname)
 		"\t-b blocksize (fundamental filesystem blocksize)\n"
 		"\t-i logsize (internal log size)\n"
 		"\t-e logsize (external log size)\n"
+		"\t-t threads (number of directories read at once)\n"
 		"\t-v prints more verbose messages\n"
 		"\t-V prints version and exits\n"
 		"\t-h prints this usage message\n\n"
@@ -101,7 +111,7 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt (argc, argv, "b:hdve:i:V")) != EOF) {
+	while ((c = getopt (argc, argv, "b:hdve:i:t:V")) != EOF) {
 		switch (c) {
 		case 'b':
 			blocksize=cvtnum(optarg);
@@ -134,6 +144,14 @@ main(int argc, char **argv)
 			logsize=cvtnum(optarg);
 			elog++;
 			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads <= 0 || nthreads > MAX_THREADS) {
+				fprintf(stderr, _("threads must be 1 to %d\n"),
+					MAX_THREADS);
+				usage(argv[0]);
+			}
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -160,32 +178,26 @@ main(int argc, char **argv)
 		printf(_("directory                               bsize   blocks    megabytes    logsize\n"));
 
 	for ( ; optind < argc; optind++) {
-		dirsize=0LL;		/* bytes */
-		fullblocks=0LL;		/* FS blocks */
-		isize=0LL;		/* inodes bytes */
-		nslinks=0LL;		/* number of symbolic links */
-		nfiles=0LL;		/* number of regular files */
-		ndirs=0LL;		/* number of directories */
-		nspecial=0LL;		/* number of special files */
+		memset(&total, 0, sizeof(total));
 
-		nftw64(argv[optind], ffn, 40, FTW_PHYS | FTW_MOUNT);
+		walk(argv[optind], nthreads);
 
 		if (__debug) {
-			printf(_("dirsize=%llu\n"), dirsize);
-			printf(_("fullblocks=%llu\n"), fullblocks);
-			printf(_("isize=%llu\n"), isize);
-
-			printf(_("%llu regular files\n"), nfiles);
-			printf(_("%llu symbolic links\n"), nslinks);
-			printf(_("%llu directories\n"), ndirs);
-			printf(_("%llu special files\n"), nspecial);
+			printf(_("dirsize=%llu\n"), total.dirsize);
+			printf(_("fullblocks=%llu\n"), total.fullblocks);
+			printf(_("isize=%llu\n"), total.isize);
+
+			printf(_("%llu regular files\n"), total.nfiles);
+			printf(_("%llu symbolic links\n"), total.nslinks);
+			printf(_("%llu directories\n"), total.ndirs);
+			printf(_("%llu special files\n"), total.nspecial);
 		}
 
-		est = FBLOCKS(isize) + 8	/* blocks for inodes */
-			+ FBLOCKS(dirsize) + 1	/* blocks for directories */
-			+ fullblocks  		/* blocks for file contents */
+		est = FBLOCKS(total.isize) + 8	/* blocks for inodes */
+			+ FBLOCKS(total.dirsize) + 1	/* blocks for directories */
+			+ total.fullblocks	/* blocks for file contents */
 			+ (8 * 16)	/* fudge for overhead blks (per ag) */
-			+ FBLOCKS(isize / INODESIZE); /* 1 byte/inode for map */
+			+ FBLOCKS(total.isize / INODESIZE); /* 1 byte/inode for map */
 
 		if (ilog)
 			est += (logsize / blocksize);
@@ -213,36 +225,204 @@ main(int argc, char **argv)
 	return 0;
 }
 
-int
-ffn(const char *path, const struct stat64 *stb, int flags, struct FTW *f)
+void
+ffn(struct counts *c, const char *path, const struct stat64 *stb)
 {
 	/* cases are in most-encountered to least-encountered order */
-	dirsize+=PERDIRENTRY+strlen(path);
-	isize+=INODESIZE;
+	c->dirsize+=PERDIRENTRY+strlen(path);
+	c->isize+=INODESIZE;
 	switch (S_IFMT & stb->st_mode) {
 	case S_IFREG:			/* regular files */
-		fullblocks+=FBLOCKS(stb->st_blocks * 512 + blocksize-1);
+		c->fullblocks+=FBLOCKS(stb->st_blocks * 512 + blocksize-1);
 		if (stb->st_blocks * 512 < stb->st_size)
-			fullblocks++;	/* add one bmap block here */
-		nfiles++;
+			c->fullblocks++;	/* add one bmap block here */
+		c->nfiles++;
 		break;
 	case S_IFLNK:			/* symbolic links */
 		if (stb->st_size >= (INODESIZE - (sizeof(xfs_dinode_t)+4)))
-			fullblocks+=FBLOCKS(stb->st_size + blocksize-1);
-		nslinks++;
+			c->fullblocks+=FBLOCKS(stb->st_size + blocksize-1);
+		c->nslinks++;
 		break;
 	case S_IFDIR:			/* directories */
-		dirsize+=blocksize;	/* fudge upwards */
+		c->dirsize+=blocksize;	/* fudge upwards */
 		if (stb->st_size >= blocksize)
-			dirsize+=blocksize;
-		ndirs++;
+			c->dirsize+=blocksize;
+		c->ndirs++;
 		break;
 	case S_IFIFO:			/* named pipes */
 	case S_IFCHR:			/* Character Special device */
 	case S_IFBLK:			/* Block Special device */
 	case S_IFSOCK:			/* socket */
-		nspecial++;
+		c->nspecial++;
 		break;
 	}
-	return 0;
+}
+
+/*
+ * The tree is walked by several threads, each taking a directory off a
+ * shared stack, counting its entries into its own totals and pushing the
+ * subdirectories it finds.  Like nftw with FTW_PHYS | FTW_MOUNT, symbolic
+ * links aren't followed and other filesystems aren't entered.  The type
+ * readdir returns saves the stat of special files, which only need to be
+ * counted, and the rest are stat'ed relative to the open directory.
+ */
+struct dirwork {
+	struct dirwork	*next;
+	char		path[];
+};
+
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct dirwork	*stack;
+	int		busy;		/* threads reading a directory */
+	dev_t		dev;		/* of the top directory */
+} walkq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+push_dir(const char *parent, const char *name)
+{
+	struct dirwork	*w;
+	size_t		len = strlen(parent);
+
+	w = malloc(sizeof(*w) + len + strlen(name) + 2);
+	if (!w) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(w->path, parent);
+	if (*name) {
+		w->path[len] = '/';
+		strcpy(w->path + len + 1, name);
+	}
+	pthread_mutex_lock(&walkq.lock);
+	w->next = walkq.stack;
+	walkq.stack = w;
+	pthread_cond_signal(&walkq.cond);
+	pthread_mutex_unlock(&walkq.lock);
+}
+
+static void
+read_dir(struct counts *c, const char *path)
+{
+	DIR		*dir;
+	struct dirent64	*d;
+	struct stat64	stb;
+	char		*p;
+	size_t		len = strlen(path);
+	size_t		max = len + 256;
+
+	if ((dir = opendir(path)) == NULL)
+		return;
+	p = malloc(max);
+	if (!p) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(p, path, len);
+	p[len] = '/';
+	while ((d = readdir64(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		if (len + strlen(d->d_name) + 2 > max) {
+			max = len + strlen(d->d_name) + 2;
+			p = realloc(p, max);
+			if (!p) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		strcpy(p + len + 1, d->d_name);
+		switch (d->d_type) {
+		case DT_FIFO:
+		case DT_CHR:
+		case DT_BLK:
+		case DT_SOCK:
+			memset(&stb, 0, sizeof(stb));
+			stb.st_mode = DTTOIF(d->d_type);
+			break;
+		default:
+			if (fstatat64(dirfd(dir), d->d_name, &stb,
+				      AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+			if (stb.st_dev != walkq.dev)
+				continue;
+			break;
+		}
+		ffn(c, p, &stb);
+		if (S_ISDIR(stb.st_mode))
+			push_dir(path, d->d_name);
+	}
+	free(p);
+	closedir(dir);
+}
+
+static void *
+walk_thread(void *arg)
+{
+	struct counts	*c = arg;
+	struct dirwork	*w;
+
+	pthread_mutex_lock(&walkq.lock);
+	for (;;) {
+		while (!walkq.stack && walkq.busy)
+			pthread_cond_wait(&walkq.cond, &walkq.lock);
+		w = walkq.stack;
+		if (!w) {
+			/* nothing queued and nobody left to queue more */
+			pthread_cond_broadcast(&walkq.cond);
+			break;
+		}
+		walkq.stack = w->next;
+		walkq.busy++;
+		pthread_mutex_unlock(&walkq.lock);
+
+		read_dir(c, w->path);
+		free(w);
+
+		pthread_mutex_lock(&walkq.lock);
+		walkq.busy--;
+	}
+	pthread_mutex_unlock(&walkq.lock);
+	return NULL;
+}
+
+/* add up the tree at path into total, reading nthreads directories at once */
+void
+walk(char *path, int nthreads)
+{
+	pthread_t	tids[MAX_THREADS];
+	struct counts	counts[MAX_THREADS];
+	struct stat64	stb;
+	int		i;
+
+	if (lstat64(path, &stb) < 0)
+		return;
+	ffn(&total, path, &stb);
+	if (!S_ISDIR(stb.st_mode))
+		return;
+	walkq.dev = stb.st_dev;
+	push_dir(path, "");
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, walk_thread, &counts[i]))
+			break;
+	nthreads = i;
+	if (!nthreads)
+		walk_thread(&counts[0]);
+	for (i = 0; i < MAX(nthreads, 1); i++) {
+		if (nthreads)
+			pthread_join(tids[i], NULL);
+		total.dirsize += counts[i].dirsize;
+		total.fullblocks += counts[i].fullblocks;
+		total.isize += counts[i].isize;
+		total.nslinks += counts[i].nslinks;
+		total.nfiles += counts[i].nfiles;
+		total.ndirs += counts[i].ndirs;
+		total.nspecial += counts[i].nspecial;
+	}
 }
@@ -23,11 +23,15 @@
 #include "xfs_bmap_btree.h"
 #include "xfs_attr_sf.h"
 
+#include <aio.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/statvfs.h>
 #include <sys/xattr.h>
@@ -40,7 +44,36 @@
 #define XFS_XFLAG_NODEFRAG 0x00002000 /* src dependancy, remove later */
 #endif
 
+/* older kernel headers don't have the space map ioctl */
+#ifndef FS_IOC_GETFSMAP
+struct fsmap {
+	__u32		fmr_device;	/* device id */
+	__u32		fmr_flags;	/* mapping flags */
+	__u64		fmr_physical;	/* device offset of segment */
+	__u64		fmr_owner;	/* owner id */
+	__u64		fmr_offset;	/* file offset of segment */
+	__u64		fmr_length;	/* length of segment */
+	__u64		fmr_reserved[3];
+};
+
+struct fsmap_head {
+	__u32		fmh_iflags;	/* control flags */
+	__u32		fmh_oflags;	/* output flags */
+	__u32		fmh_count;	/* # of entries in array incl. input */
+	__u32		fmh_entries;	/* # of entries filled in (output). */
+	__u64		fmh_reserved[6];
+	struct fsmap	fmh_keys[2];	/* low and high keys */
+	struct fsmap	fmh_recs[];	/* returned records */
+};
+
+#define FMR_OF_LAST		0x20
+#define FMR_OWN_FREE		(((__u64)0 << 32) | 1)
+#define FS_IOC_GETFSMAP		_IOWR('X', 59, struct fsmap_head)
+#endif
+
 #define _PATH_FSRLAST		"/var/tmp/.fsrlast_xfs"
+#define _PATH_FSRCAND		"/var/tmp/.fsrcand_xfs"
+#define _PATH_FSRSTATE		"/var/tmp/.fsrstate_xfs"
 #define _PATH_PROC_MOUNTS	"/proc/mounts"
 
 
@@ -69,6 +102,7 @@ static __int64_t	minimumfree = 2048;
 #define ROOT		0
 #define NULLFD		-1
 #define GRABSZ		64
+#define GRABSZ_MAX	65536
 #define TARGETRANGE	10
 #define	V_NONE		0
 #define	V_OVERVIEW	1
@@ -83,6 +117,138 @@ static time_t starttime;
 static xfs_ino_t	leftoffino = 0;
 static int	pagesize;
 
+/*
+ * Filesystems are reorganized by njobs processes at once, each in its own
+ * allocation groups.  All their copying together is held to iorate bytes
+ * a second, and with maxlat, slowed down further while the device's
+ * average I/O latency is above maxlat milliseconds.  What the jobs share
+ * lives in memory mapped before the fork.
+ */
+#define FSR_MAX_JOBS	64
+#define PACE_INTERVAL	100000000ULL	/* nsec between looks at the device */
+#define PACE_MIN_RATE	(1024 * 1024)
+
+struct fsr_shared {
+	__u64		next_ns;	/* when the I/O budget is next free */
+	__u64		rate;		/* bytes/sec for all jobs, 0 for any */
+	__u64		bytes;		/* copied by all jobs */
+	__u64		sample_ns;	/* when the device was last looked at */
+	__u64		sample_bytes;	/* and the counts then */
+	__u64		sample_ios;
+	__u64		sample_ticks;
+	xfs_ino_t	leftoff[FSR_MAX_JOBS];	/* where each job got to */
+};
+
+/*
+ * What the run did, added up over all the processes doing it, for the
+ * summary at the end (-S) and the JSON copy of it (-J).
+ */
+struct fsr_stats {
+	__u64		files;		/* looked at */
+	__u64		defragged;
+	__u64		extents_before;	/* of the files defragmented */
+	__u64		extents_after;
+	__u64		bytes;		/* copied */
+	__u64		scan_ns;	/* in bulkstat and reading extent maps */
+	__u64		copy_ns;
+	__u64		swap_ns;	/* in XFS_IOC_SWAPEXT */
+};
+
+#define fsr_stat_add(field, n)	\
+	__sync_fetch_and_add(&stats->field, (n))
+
+static struct fsr_stats	stats_private;
+static struct fsr_stats	*stats = &stats_private;
+static int	Sflag;
+static char	*jsonfile;
+static pid_t	stats_pid;		/* the process that reports them */
+static __u64	stats_start;
+
+static int	njobs = 1;
+static int	iodepth = 1;		/* copies in flight in packfile() */
+static int	grabsz = GRABSZ;	/* inodes per bulkstat call */
+static __u64	iorate;
+static double	maxlat;			/* msec */
+static char	devstat[64];		/* sysfs I/O statistics of the device */
+static struct fsr_shared *fsr_shared;
+static int	tmp_agfirst, tmp_agend;	/* the AGs a job's tmp files go in */
+
+/*
+ * With -P, a scan of the filesystem first picks the files most worth
+ * defragmenting, and those are done best first.  What is left of the list
+ * when the time runs out is kept for the next run.  The list is shared
+ * with the jobs, which mark off the files they have done.
+ */
+struct fsr_cand {
+	xfs_ino_t	ino;
+	double		score;
+	int		done;
+};
+
+/*
+ * The largest free extents of the filesystem, largest first, from a scan
+ * of the space map.  Used to skip files the free space can't hold in
+ * fewer extents than they have now, before copying them.
+ */
+#define FREESP_MAX	4096
+#define FSMAP_NR	1024
+
+static __u64	*freesp;
+static int	nfreesp;
+static int	freesp_valid;
+
+/*
+ * When reorganizing all the filesystems, each one's progress is kept in a
+ * state file of its own: how far the pass has got in each AG, and the
+ * inode ranges recently walked in full, whose files are known to have been
+ * looked at already.  The file is written out every FSR_STATE_SYNC seconds
+ * as well as at the end, so a run that dies carries on where it was.  The
+ * state is mapped shared, the jobs each update the cursors of their AGs.
+ *
+ * On disk: struct fsr_state_hdr, agcount cursors, then nranges ranges.
+ */
+#define FSR_STATE_MAGIC		0x46535253	/* FSRS */
+#define FSR_STATE_VERSION	1
+#define FSR_STATE_RANGES	1024		/* ranges kept on disk */
+#define FSR_STATE_SYNC		30		/* seconds between saves */
+#define FSR_RANGE_AGE		(7 * 86400)	/* seconds ranges are kept */
+#define FSR_AG_DONE		(~0ULL)		/* AG done this pass */
+
+struct fsr_state_hdr {
+	__u32		magic;
+	__u32		version;
+	__u32		agcount;
+	__u32		nranges;
+};
+
+struct fsr_range {
+	__u64		lo;		/* inodes lo to hi were all examined */
+	__u64		hi;
+	__s64		time;		/* at this time */
+};
+
+struct fsr_state {
+	long		saved;		/* when it was last written out */
+	int		nranges;	/* of 2 * FSR_STATE_RANGES */
+	__u64		*cursor;	/* last inode done in each AG */
+	struct fsr_range *ranges;
+};
+
+static struct fsr_state *state;
+static size_t	state_size;
+static int	allfs;			/* reorganizing all filesystems */
+static int	agino_log;		/* bits of an inode number in an AG */
+
+/*
+ * Defragmenting a directory, its files are also moved next to it: the AG
+ * of the directory inode, or -1 when not doing that.
+ */
+static xfs_agnumber_t	dir_agno = NULLAGNUMBER;
+
+static int	maxcands;
+static int	ncands;
+static struct fsr_cand *cands;
+
 void usage(int ret);
 static int  fsrfile(char *fname, xfs_ino_t ino);
 static int  fsrfile_common( char *fname, char *tname, char *mnt,
@@ -91,6 +257,32 @@ static int  packfile(char *fname, char *tname, int fd,
                      xfs_bstat_t *statp, struct fsxattr *fsxp);
 static void fsrdir(char *dirname);
 static int  fsrfs(char *mntdir, xfs_ino_t ino, int targetrange);
+static int  fsrfs_range(int fsfd, jdm_fshandle_t *fshandlep, char *mntdir,
+			xfs_ino_t startino, xfs_ino_t endino, int targetrange);
+static int  fsrfs_jobs(int fsfd, jdm_fshandle_t *fshandlep, char *mntdir,
+			xfs_ino_t startino, int targetrange);
+static int  fsrfs_job(int fsfd, jdm_fshandle_t *fshandlep, char *mntdir,
+			xfs_ino_t startino, xfs_ino_t endino, int targetrange);
+static int  fsr_cands_init(int fsfd, char *mntdir);
+static void fsr_cands_save(char *mntdir);
+static void fsr_throttle(size_t bytes);
+static __u64 fsr_now(void);
+static void fsr_agino_log(void);
+static xfs_agnumber_t fsr_file_agno(int fd);
+static void fsr_stats_report(void);
+static void fsr_pace_init(char *path);
+static void fsr_freesp_scan(int fsfd);
+static int  fsr_state_init(char *mntdir);
+static void fsr_state_done(char *mntdir);
+static int  fsr_state_start(int agfirst, int agend, xfs_ino_t *startp);
+static void fsr_state_batch(char *mntdir, int *curagp, xfs_ino_t lastino,
+			xfs_ino_t endino, xfs_ino_t lo, xfs_ino_t hi, int full);
+static void fsr_state_finish(int curag, int agend);
+static int  fsr_range_recent(xfs_bstat_t *p);
+static int  fsr_freesp_extents(__u64 bytes);
+static int  packfile_copy_aio(char *fname, char *tname, int fd, int tfd,
+			int nextents, unsigned blksz_dio, unsigned dio_min,
+			unsigned dio_mem);
 static void initallfs(char *mtab);
 static void fsrallfs(char *mtab, int howlong, char *leftofffile);
 static void fsrall_cleanup(int timeout);
@@ -249,7 +441,7 @@ main(int argc, char **argv)
 
 	gflag = ! isatty(0);
 
-	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FV")) != -1) {
+	while ((c = getopt(argc, argv, "C:p:e:MgsSdnvTt:f:m:b:B:N:FVj:r:P:Q:L:J:")) != -1) {
 		switch (c) {
 		case 'M':
 			Mflag = 1;
@@ -288,6 +480,44 @@ main(int argc, char **argv)
 		case 'p':
 			npasses = atoi(optarg);
 			break;
+		case 'j':
+			njobs = atoi(optarg);
+			if (njobs < 1 || njobs > FSR_MAX_JOBS) {
+				fprintf(stderr,
+					_("%s: jobs must be between 1 and %d\n"),
+					progname, FSR_MAX_JOBS);
+				usage(1);
+			}
+			break;
+		case 'r':
+			iorate = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'L':
+			maxlat = atof(optarg);
+			if (maxlat <= 0)
+				usage(1);
+			break;
+		case 'Q':
+			iodepth = atoi(optarg);
+			if (iodepth < 1)
+				usage(1);
+			break;
+		case 'S':
+			Sflag = 1;
+			break;
+		case 'J':
+			jsonfile = optarg;
+			break;
+		case 'B':
+			grabsz = atoi(optarg);
+			if (grabsz < 1 || grabsz > GRABSZ_MAX)
+				usage(1);
+			break;
+		case 'P':
+			maxcands = atoi(optarg);
+			if (maxcands < 0)
+				usage(1);
+			break;
 		case 'C':
 			/* Testing opt: coerses frag count in result */
 			if (getenv("FSRXFSTEST") != NULL) {
@@ -327,6 +557,27 @@ main(int argc, char **argv)
 
 	pagesize = getpagesize();
 
+	/* the jobs and the per-filesystem processes all add to the stats */
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED)
+		stats = &stats_private;
+	stats_pid = getpid();
+	stats_start = fsr_now();
+	atexit(fsr_stats_report);
+
+	if (njobs > 1 || iorate || maxlat) {
+		fsr_shared = mmap(NULL, sizeof(*fsr_shared),
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (fsr_shared == MAP_FAILED) {
+			fprintf(stderr, _("%s: cannot map shared memory: %s\n"),
+				progname, strerror(errno));
+			exit(1);
+		}
+		fsr_shared->rate = iorate;
+	}
+
 	if (optind < argc) {
 		for (; optind < argc; optind++) {
 			argname = argv[optind];
@@ -384,7 +635,9 @@ usage(int ret)
 {
 	fprintf(stderr, _(
 "Usage: %s [-d] [-v] [-g] [-t time] [-p passes] [-f leftf] [-m mtab]\n"
-"       %s [-d] [-v] [-g] xfsdev | dir | file ...\n"
+"          [-j jobs] [-r rate] [-L msec] [-P count] [-b bufsize] [-Q depth]\n"
+"          [-B inodes] [-S] [-J file]\n"
+"       %s [-d] [-v] [-g] [-j jobs] [-r rate] [-P count] xfsdev | dir | file ...\n"
 "       %s -V\n\n"
 "Options:\n"
 "       -g              Print to syslog (default if stdout not a tty).\n"
@@ -392,6 +645,15 @@ usage(int ret)
 "       -p passes       Number of passes before terminating global re-org.\n"
 "       -f leftoff      Use this instead of %s.\n"
 "       -m mtab         Use something other than /etc/mtab.\n"
+"       -j jobs         Defragment this many files at once.\n"
+"       -r rate         Copy no more than rate MiB/s over all jobs.\n"
+"       -L msec         Slow down while device I/O latency is over msec.\n"
+"       -P count        Defragment the count files most worth it first.\n"
+"       -b bufsize      Copy in direct I/Os of up to bufsize bytes.\n"
+"       -Q depth        Keep up to depth copy I/Os in flight per file.\n"
+"       -B inodes       Scan the filesystem this many inodes at a time.\n"
+"       -S              Print a summary of what was done at the end.\n"
+"       -J file         Write the summary as JSON to file (- for stdout).\n"
 "       -d              Debug, print even more.\n"
 "       -v              Verbose, more -v's more verbose.\n"
 "       -V              Print version number and exit.\n"
@@ -511,6 +773,7 @@ fsrallfs(char *mtab, int howlong, char *leftofffile)
 
 	endtime = starttime + howlong;
 	fs = fsbase;
+	allfs = 1;
 
 	/* where'd we leave off last time? */
 	if (lstat64(leftofffile, &sb) == 0) {
@@ -678,15 +941,9 @@ static int
 fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 {
 
-	int	fsfd, fd;
-	int	count = 0;
-	int	ret;
-	__s32	buflenout;
-	xfs_bstat_t buf[GRABSZ];
-	char	fname[64];
-	char	*tname;
+	int	fsfd;
+	int	timedout;
 	jdm_fshandle_t	*fshandlep;
-	xfs_ino_t	lastino = startino;
 
 	fsrprintf(_("%s start inode=%llu\n"), mntdir,
 		(unsigned long long)startino);
@@ -713,15 +970,156 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 		return -1;
 	}
 
+	fsr_agino_log();
 	tmp_init(mntdir);
+	fsr_pace_init(mntdir);
+	fsr_freesp_scan(fsfd);
+
+	/* the state file has its own record of where we got to */
+	if (allfs && !maxcands && fsr_state_init(mntdir) == 0 &&
+	    (njobs <= 1 || fsgeom.agcount <= 1)) {
+		fsr_state_start(0, fsgeom.agcount, &startino);
+	}
+
+	/* the candidate list has its own record of where we got to */
+	if (maxcands) {
+		if (fsr_cands_init(fsfd, mntdir) < 0) {
+			tmp_close(mntdir);
+			close(fsfd);
+			free(fshandlep);
+			return -1;
+		}
+		startino = 0;
+	}
+
+	if (njobs > 1 && fsgeom.agcount > 1)
+		timedout = fsrfs_jobs(fsfd, fshandlep, mntdir, startino,
+				targetrange);
+	else
+		timedout = fsrfs_job(fsfd, fshandlep, mntdir, startino, 0,
+				targetrange);
+	if (maxcands)
+		fsr_cands_save(mntdir);
+	if (state)
+		fsr_state_done(mntdir);
+	if (timedout) {
+		tmp_close(mntdir);
+		close(fsfd);
+		fsrall_cleanup(1);
+		exit(1);
+	}
+	tmp_close(mntdir);
+	close(fsfd);
+	free(fshandlep);
+	return 0;
+}
+
+/*
+ * Defragment the files with inode numbers after startino and before
+ * endino (0 for the end of the filesystem).  Returns 1 if the time ran
+ * out first.
+ */
+/*
+ * One batch of a filesystem scan.  While fsrfs_range() defragments the
+ * files of one batch, a thread fetches the next, so the bulkstat calls are
+ * not in the way of the copies.
+ */
+struct fsr_scan {
+	int		fd;
+	xfs_ino_t	lastino;	/* scan from, then to */
+	xfs_bstat_t	*buf;		/* grabsz of them */
+	__s32		count;
+	int		ret;
+	int		error;
+	pthread_t	thread;
+	int		ahead;		/* being fetched by the thread */
+};
+
+static void *
+fsr_scan_batch(void *arg)
+{
+	struct fsr_scan	*s = arg;
+	__u64		start = fsr_now();
+
+	s->ret = xfs_bulkstat(s->fd, &s->lastino, grabsz, s->buf, &s->count);
+	s->error = errno;
+	fsr_stat_add(scan_ns, fsr_now() - start);
+	if (s->ret < 0)
+		s->count = 0;
+	return NULL;
+}
+
+/* start fetching the batch after lastino, in a thread if we can */
+static void
+fsr_scan_start(struct fsr_scan *s, xfs_ino_t lastino)
+{
+	s->lastino = lastino;
+	s->ahead = pthread_create(&s->thread, NULL, fsr_scan_batch, s) == 0;
+	if (!s->ahead)
+		fsr_scan_batch(s);
+}
+
+static void
+fsr_scan_wait(struct fsr_scan *s)
+{
+	if (s->ahead)
+		pthread_join(s->thread, NULL);
+	s->ahead = 0;
+}
+
+static int
+fsrfs_range(
+	int		fsfd,
+	jdm_fshandle_t	*fshandlep,
+	char		*mntdir,
+	xfs_ino_t	startino,
+	xfs_ino_t	endino,
+	int		targetrange)
+{
+	int	fd;
+	int	count = 0;
+	int	ret;
+	__s32	buflenout;
+	xfs_bstat_t *buf;
+	char	fname[64];
+	char	*tname;
+	xfs_ino_t	lastino = startino;
+	xfs_ino_t	lo, hi;
+	int	curag = startino >> agino_log;
+	int	full;
+	int	timedout = 0;
+	struct fsr_scan	scan[2], *cur;
+
+	memset(scan, 0, sizeof(scan));
+	scan[0].buf = malloc(2 * grabsz * sizeof(xfs_bstat_t));
+	if (!scan[0].buf) {
+		fsrprintf(_("malloc failed: %s\n"), strerror(errno));
+		return 0;
+	}
+	scan[1].buf = scan[0].buf + grabsz;
+	scan[0].fd = scan[1].fd = fsfd;
+	cur = &scan[0];
+	cur->lastino = startino;
+	fsr_scan_batch(cur);
 
-	while ((ret = xfs_bulkstat(fsfd,
-				&lastino, GRABSZ, &buf[0], &buflenout)) == 0) {
+	while ((ret = cur->ret) == 0) {
 		xfs_bstat_t *p;
 		xfs_bstat_t *endp;
 
+		buf = cur->buf;
+		buflenout = cur->count;
+		lastino = cur->lastino;
 		if (buflenout == 0)
-			goto out0;
+			break;
+		/* fetch the next batch while this one is done */
+		cur = (cur == &scan[0]) ? &scan[1] : &scan[0];
+		if (!endino || lastino < endino)
+			fsr_scan_start(cur, lastino);
+		else
+			cur->count = cur->ret = 0;
+		lo = buf[0].bs_ino;
+		hi = buf[buflenout - 1].bs_ino;
+		full = 1;
 
 		/* Each loop through, defrag targetrange percent of the files */
 		count = (buflenout * targetrange) / 100;
@@ -733,6 +1131,12 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
 			     (p->bs_extents < 2))
 				continue;
+			/* the end of a batch can be in the next job's AGs */
+			if (endino && p->bs_ino >= endino)
+				continue;
+			/* looked at lately, and not written since */
+			if (state && fsr_range_recent(p))
+				continue;
 
 			fd = jdm_open(fshandlep, p, O_RDWR|O_DIRECT);
 			if (fd < 0) {
@@ -759,24 +1163,116 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 			close(fd);
 
 			if (ret == 0) {
-				if (--count <= 0)
+				if (--count <= 0) {
+					full = (p + 1 == endp);
 					break;
+				}
 			}
 		}
+		if (state)
+			fsr_state_batch(mntdir, &curag, lastino, endino,
+					lo, hi, full);
+		fsr_scan_wait(cur);
 		if (endtime && endtime < time(0)) {
-			tmp_close(mntdir);
-			close(fsfd);
-			fsrall_cleanup(1);
-			exit(1);
+			timedout = 1;
+			goto out;
 		}
+		if (endino && lastino >= endino)
+			goto out;
 	}
-	if (ret < 0)
-		fsrprintf(_("%s: xfs_bulkstat: %s\n"), progname, strerror(errno));
-out0:
-	tmp_close(mntdir);
-	close(fsfd);
-	free(fshandlep);
-	return 0;
+	if (ret < 0) {
+		fsrprintf(_("%s: xfs_bulkstat: %s\n"), progname,
+			strerror(cur->error));
+		goto out;
+	}
+	if (state)
+		fsr_state_finish(curag, fsgeom.agcount);
+out:
+	free(scan[0].buf);
+	return timedout;
+}
+
+/*
+ * Split the allocation groups between the jobs, each defragmenting the
+ * files of its own groups in a process of its own, so the copies run side
+ * by side without contending for the same AG's allocator.  Returns 1 if
+ * the time ran out, with leftoffino set to where the job furthest behind
+ * got to; the next run starts all the jobs whose groups come after that
+ * from the beginning of their groups again.
+ */
+static int
+fsrfs_jobs(
+	int		fsfd,
+	jdm_fshandle_t	*fshandlep,
+	char		*mntdir,
+	xfs_ino_t	startino,
+	int		targetrange)
+{
+	pid_t		pids[FSR_MAX_JOBS];
+	xfs_ino_t	start, end;
+	int		jobs = min(njobs, fsgeom.agcount);
+	int		timedout = 0;
+	int		i, status;
+
+	for (i = 0; i < jobs; i++) {
+		pids[i] = 0;
+		fsr_shared->leftoff[i] = 0;
+		start = (xfs_ino_t)(fsgeom.agcount * i / jobs) << agino_log;
+		end = (i == jobs - 1) ? 0 :
+		      (xfs_ino_t)(fsgeom.agcount * (i + 1) / jobs) << agino_log;
+		if (state) {
+			/* carry on from each job's own AG cursors */
+			if (!fsr_state_start(fsgeom.agcount * i / jobs,
+					     fsgeom.agcount * (i + 1) / jobs,
+					     &start))
+				continue;
+		} else {
+			/* a job whose groups are all before startino did them */
+			if (end && end <= startino)
+				continue;
+			start = max(start, startino);
+		}
+		fsr_shared->leftoff[i] = start;
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			fsrprintf(_("couldn't fork sub process: %s\n"),
+				strerror(errno));
+			pids[i] = 0;
+			break;
+		}
+		if (pids[i] == 0) {
+			/* the parent records where we got to */
+			signal(SIGABRT, SIG_DFL);
+			signal(SIGHUP, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			tmp_agfirst = fsgeom.agcount * i / jobs;
+			tmp_agend = fsgeom.agcount * (i + 1) / jobs;
+			tmp_agi = tmp_agfirst;
+			leftoffino = 0;
+			timedout = fsrfs_job(fsfd, fshandlep, mntdir, start,
+					end, targetrange);
+			fsr_shared->leftoff[i] = !timedout ? 0 :
+						 max(leftoffino, start);
+			exit(timedout);
+		}
+	}
+
+	leftoffino = 0;
+	for (i = 0; i < jobs; i++) {
+		if (!pids[i])
+			continue;
+		if (waitpid(pids[i], &status, 0) < 0)
+			continue;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 1)
+			timedout = 1;
+		if (fsr_shared->leftoff[i] &&
+		    (!leftoffino || fsr_shared->leftoff[i] < leftoffino))
+			leftoffino = fsr_shared->leftoff[i];
+	}
+	return timedout;
 }
 
 /*
@@ -790,15 +1286,722 @@ cmp(const void *s1, const void *s2)
 
 }
 
+/*
+ * How much defragmenting a file is worth: its extents per MiB times its
+ * size in MiB, which is the extents it has to lose, counting for up to
+ * twice as much the more recently the file was read.
+ */
+static double
+fsr_score(xfs_bstat_t *p, time_t now)
+{
+	double	days = (now - p->bs_atime.tv_sec) / 86400.0;
+
+	if (days < 0)
+		days = 0;
+	return (p->bs_extents - 1) * (1.0 + 1.0 / (1.0 + days));
+}
+
+/* keep the best maxcands files, the worst of them at the root of a heap */
+static void
+fsr_cands_add(xfs_ino_t ino, double score)
+{
+	struct fsr_cand	c;
+	int		i, child;
+
+	if (ncands == maxcands) {
+		if (score <= cands[0].score)
+			return;
+		i = 0;		/* replace the root and sift it down */
+		for (;;) {
+			child = 2 * i + 1;
+			if (child >= ncands)
+				break;
+			if (child + 1 < ncands &&
+			    cands[child + 1].score < cands[child].score)
+				child++;
+			if (cands[child].score >= score)
+				break;
+			cands[i] = cands[child];
+			i = child;
+		}
+	} else {
+		i = ncands++;	/* add a leaf and sift it up */
+		while (i && cands[(i - 1) / 2].score > score) {
+			cands[i] = cands[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+	}
+	c.ino = ino;
+	c.score = score;
+	c.done = 0;
+	cands[i] = c;
+}
+
+static int
+cmp_cand(const void *s1, const void *s2)
+{
+	double	d = ((struct fsr_cand *)s2)->score -
+		    ((struct fsr_cand *)s1)->score;
+
+	return d < 0 ? -1 : d > 0;
+}
+
+/* the file something about a filesystem is kept in, prefix + mount */
+static char *
+fsr_mnt_file(const char *prefix, char *mntdir)
+{
+	static char	buf[PATH_MAX+1];
+	char		*p;
+
+	snprintf(buf, sizeof(buf), "%s%s", prefix, mntdir);
+	for (p = buf + strlen(prefix); *p; p++)
+		if (*p == '/')
+			*p = '_';
+	return buf;
+}
+
+/* open a file of ours, if it is a plain file only root could have made */
+static int
+fsr_open_own(char *name)
+{
+	struct stat64	sb;
+	int		fd;
+
+	fd = open(name, O_RDONLY|O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+	/* same checks as for the leftoff file */
+	if (fstat64(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_uid != ROOT || sb.st_nlink != 1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* read back what was left of the list last time; returns how many */
+static int
+fsr_cands_load(char *mntdir)
+{
+	char		line[PATH_MAX+64];
+	unsigned long long ino;
+	double		score;
+	FILE		*fp;
+	int		fd;
+
+	fd = fsr_open_own(fsr_mnt_file(_PATH_FSRCAND, mntdir));
+	if (fd < 0)
+		return 0;
+	if (!(fp = fdopen(fd, "r"))) {
+		close(fd);
+		return 0;
+	}
+	if (!fgets(line, sizeof(line), fp) ||
+	    strncmp(line, mntdir, strlen(mntdir)) != 0 ||
+	    line[strlen(mntdir)] != '\n') {
+		fclose(fp);
+		return 0;
+	}
+	while (ncands < maxcands &&
+	       fscanf(fp, "%llu %lf\n", &ino, &score) == 2) {
+		cands[ncands].ino = ino;
+		cands[ncands].score = score;
+		cands[ncands].done = 0;
+		ncands++;
+	}
+	fclose(fp);
+	return ncands;
+}
+
+/*
+ * Set up the list of files to defragment: what was left of it last time,
+ * or else the best maxcands files of a scan of the whole filesystem.
+ */
+struct fsr_cands_scan {
+	int		fd;
+	xfs_ino_t	start;		/* inodes start up to end */
+	xfs_ino_t	end;		/* 0 for the end of the filesystem */
+	time_t		now;
+	int		error;
+	pthread_t	thread;
+};
+
+static pthread_mutex_t	cands_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* score the files of a range of AGs and add them to the list */
+static void *
+fsr_cands_scan(void *arg)
+{
+	struct fsr_cands_scan *s = arg;
+	xfs_bstat_t	*buf;
+	xfs_ino_t	lastino = s->start;
+	__u64		start = fsr_now();
+	__s32		buflenout;
+	int		i, ret;
+
+	buf = malloc(grabsz * sizeof(*buf));
+	if (!buf) {
+		s->error = errno;
+		return NULL;
+	}
+	while ((ret = xfs_bulkstat(s->fd, &lastino, grabsz, buf,
+				   &buflenout)) == 0 && buflenout) {
+		pthread_mutex_lock(&cands_lock);
+		for (i = 0; i < buflenout; i++) {
+			if (s->end && buf[i].bs_ino >= s->end)
+				break;
+			if ((buf[i].bs_mode & S_IFMT) != S_IFREG ||
+			    buf[i].bs_extents < 2 || buf[i].bs_size == 0)
+				continue;
+			fsr_cands_add(buf[i].bs_ino, fsr_score(&buf[i], s->now));
+		}
+		pthread_mutex_unlock(&cands_lock);
+		if (i < buflenout || (s->end && lastino >= s->end))
+			goto out;
+	}
+	if (ret < 0)
+		s->error = errno;
+out:
+	free(buf);
+	fsr_stat_add(scan_ns, fsr_now() - start);
+	return NULL;
+}
+
+static int
+fsr_cands_init(int fsfd, char *mntdir)
+{
+	struct fsr_cands_scan scans[FSR_MAX_JOBS];
+	time_t		now = time(0);
+	int		nscans = min(njobs, fsgeom.agcount);
+	int		i;
+
+	cands = mmap(NULL, maxcands * sizeof(*cands), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (cands == MAP_FAILED) {
+		fsrprintf(_("cannot map candidate list: %s\n"),
+			strerror(errno));
+		cands = NULL;
+		return -1;
+	}
+	ncands = 0;
+	if (fsr_cands_load(mntdir)) {
+		if (vflag)
+			fsrprintf(_("%s: %d candidates left from last time\n"),
+				mntdir, ncands);
+		return 0;
+	}
+
+	/* the AGs are scanned side by side, as many at once as jobs */
+	for (i = 0; i < nscans; i++) {
+		scans[i].fd = fsfd;
+		scans[i].start = (xfs_ino_t)(fsgeom.agcount * i / nscans) <<
+				 agino_log;
+		scans[i].end = (i == nscans - 1) ? 0 :
+			(xfs_ino_t)(fsgeom.agcount * (i + 1) / nscans) <<
+			agino_log;
+		scans[i].now = now;
+		scans[i].error = 0;
+		if (i == nscans - 1 || pthread_create(&scans[i].thread, NULL,
+					fsr_cands_scan, &scans[i]) != 0) {
+			/* this one, or the rest if we're out of threads */
+			scans[i].end = 0;
+			fsr_cands_scan(&scans[i]);
+			nscans = i;
+			break;
+		}
+	}
+	for (i = 0; i < nscans; i++)
+		pthread_join(scans[i].thread, NULL);
+	for (i = 0; i < min(njobs, fsgeom.agcount); i++) {
+		if (scans[i].error)
+			fsrprintf(_("%s: xfs_bulkstat: %s\n"), progname,
+				strerror(scans[i].error));
+		if (!scans[i].end)
+			break;
+	}
+	qsort(cands, ncands, sizeof(*cands), cmp_cand);
+	if (vflag)
+		fsrprintf(_("%s: %d candidates, scores %.1f to %.1f\n"),
+			mntdir, ncands, ncands ? cands[0].score : 0.0,
+			ncands ? cands[ncands - 1].score : 0.0);
+	return 0;
+}
+
+/* keep the files not done yet for next time, if there are any */
+static void
+fsr_cands_save(char *mntdir)
+{
+	char		*name = fsr_mnt_file(_PATH_FSRCAND, mntdir);
+	FILE		*fp;
+	int		fd, i, left = 0;
+
+	unlink(name);
+	for (i = 0; i < ncands; i++)
+		if (!cands[i].done)
+			left++;
+	if (left) {
+		fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0644);
+		if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+			fsrprintf(_("open(%s) failed: %s\n"),
+				  name, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+		} else {
+			fprintf(fp, "%s\n", mntdir);
+			for (i = 0; i < ncands; i++)
+				if (!cands[i].done)
+					fprintf(fp, "%llu %.3f\n",
+						(unsigned long long)cands[i].ino,
+						cands[i].score);
+			if (fclose(fp) != 0)
+				fsrprintf(_("write(%s) failed: %s\n"),
+					  name, strerror(errno));
+		}
+	}
+	munmap(cands, maxcands * sizeof(*cands));
+	cands = NULL;
+	ncands = 0;
+}
+
+/*
+ * Defragment the candidates with inode numbers from startino up to endino
+ * (0 for the end of the filesystem), best first.  Returns 1 if the time
+ * ran out first.
+ */
+static int
+fsrfs_cands(
+	int		fsfd,
+	jdm_fshandle_t	*fshandlep,
+	char		*mntdir,
+	xfs_ino_t	startino,
+	xfs_ino_t	endino)
+{
+	struct fsr_cand	*c;
+	xfs_bstat_t	bstat;
+	xfs_ino_t	ino;
+	char		fname[64];
+	char		*tname;
+	int		fd, i;
+
+	for (i = 0; i < ncands; i++) {
+		c = &cands[i];
+		if (c->done || c->ino < startino || (endino && c->ino >= endino))
+			continue;
+
+		/* it may have changed or gone since the scan */
+		ino = c->ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &bstat) < 0 ||
+		    (bstat.bs_mode & S_IFMT) != S_IFREG ||
+		    bstat.bs_extents < 2) {
+			c->done = 1;
+			continue;
+		}
+		fd = jdm_open(fshandlep, &bstat, O_RDWR|O_DIRECT);
+		if (fd < 0) {
+			if (dflag)
+				fsrprintf(_("could not open: inode %llu\n"),
+					(unsigned long long)c->ino);
+			c->done = 1;
+			continue;
+		}
+		if (dflag)
+			fsrprintf(_("inode %llu score %.1f\n"),
+				(unsigned long long)c->ino, c->score);
+		sprintf(fname, "ino=%lld", (long long)c->ino);
+		tname = tmp_next(mntdir);
+		fsrfile_common(fname, tname, mntdir, fd, &bstat);
+		leftoffino = c->ino;
+		close(fd);
+		c->done = 1;
+
+		if (endtime && endtime < time(0))
+			return 1;
+	}
+	return 0;
+}
+
+/* one job's share of a filesystem: its candidates, or all its files */
+static int
+fsrfs_job(
+	int		fsfd,
+	jdm_fshandle_t	*fshandlep,
+	char		*mntdir,
+	xfs_ino_t	startino,
+	xfs_ino_t	endino,
+	int		targetrange)
+{
+	if (maxcands)
+		return fsrfs_cands(fsfd, fshandlep, mntdir, startino, endino);
+	return fsrfs_range(fsfd, fshandlep, mntdir, startino, endino,
+			targetrange);
+}
+
+/* drop ranges too old to trust, and those inside later ones */
+static int
+cmp_range(const void *s1, const void *s2)
+{
+	const struct fsr_range *a = s1, *b = s2;
+
+	if (a->lo != b->lo)
+		return a->lo < b->lo ? -1 : 1;
+	return a->time < b->time ? 1 : a->time > b->time ? -1 : 0;
+}
+
+static int
+cmp_range_time(const void *s1, const void *s2)
+{
+	const struct fsr_range *a = s1, *b = s2;
+
+	return a->time < b->time ? 1 : a->time > b->time ? -1 : 0;
+}
+
+static void
+fsr_ranges_trim(time_t now)
+{
+	struct fsr_range *r = state->ranges;
+	int		i, n = 0;
+
+	qsort(r, state->nranges, sizeof(*r), cmp_range);
+	for (i = 0; i < state->nranges; i++) {
+		if (r[i].time + FSR_RANGE_AGE < now)
+			continue;
+		if (n && r[i].hi <= r[n - 1].hi && r[i].time <= r[n - 1].time)
+			continue;
+		r[n++] = r[i];
+	}
+	state->nranges = n;
+}
+
+/*
+ * Map the state of a filesystem and read back its state file, if there
+ * is one from a filesystem with as many AGs.  A pass that had finished
+ * every AG starts again at the beginning.
+ */
+static int
+fsr_state_init(char *mntdir)
+{
+	struct fsr_state_hdr hdr;
+	int		fd, i, done;
+	size_t		len;
+
+	state_size = sizeof(*state) + fsgeom.agcount * sizeof(__u64) +
+		     2 * FSR_STATE_RANGES * sizeof(struct fsr_range);
+	state = mmap(NULL, state_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED) {
+		fsrprintf(_("cannot map fsr state: %s\n"), strerror(errno));
+		state = NULL;
+		return -1;
+	}
+	state->cursor = (__u64 *)(state + 1);
+	state->ranges = (struct fsr_range *)(state->cursor + fsgeom.agcount);
+	state->saved = time(0);
+
+	fd = fsr_open_own(fsr_mnt_file(_PATH_FSRSTATE, mntdir));
+	if (fd < 0)
+		return 0;
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != FSR_STATE_MAGIC || hdr.version != FSR_STATE_VERSION ||
+	    hdr.agcount != fsgeom.agcount ||
+	    hdr.nranges > FSR_STATE_RANGES) {
+		close(fd);
+		return 0;
+	}
+	len = fsgeom.agcount * sizeof(__u64);
+	if (read(fd, state->cursor, len) != len)
+		goto bad;
+	len = hdr.nranges * sizeof(struct fsr_range);
+	if (read(fd, state->ranges, len) != len)
+		goto bad;
+	state->nranges = hdr.nranges;
+	close(fd);
+
+	fsr_ranges_trim(time(0));
+	for (i = done = 0; i < fsgeom.agcount; i++)
+		if (state->cursor[i] == FSR_AG_DONE)
+			done++;
+	if (done == fsgeom.agcount) {
+		memset(state->cursor, 0, fsgeom.agcount * sizeof(__u64));
+		done = 0;
+	}
+	if (vflag)
+		fsrprintf(_("%s: resuming, %d of %d AGs done, "
+			    "%d recent ranges\n"),
+			mntdir, done, fsgeom.agcount, state->nranges);
+	return 0;
+bad:
+	close(fd);
+	memset(state->cursor, 0, fsgeom.agcount * sizeof(__u64));
+	return 0;
+}
+
+/* write the state file out, now or if it's been a while */
+static void
+fsr_state_save(char *mntdir, int force)
+{
+	struct fsr_state_hdr hdr;
+	char		name[PATH_MAX+16];
+	long		saved = state->saved;
+	long		now = time(0);
+	size_t		len;
+	int		fd, n;
+
+	if (!force && (now < saved + FSR_STATE_SYNC ||
+	    __sync_val_compare_and_swap(&state->saved, saved, now) != saved))
+		return;
+	state->saved = now;
+
+	/* the jobs may still be adding ranges, write out those we see */
+	n = min(state->nranges, FSR_STATE_RANGES);
+	hdr.magic = FSR_STATE_MAGIC;
+	hdr.version = FSR_STATE_VERSION;
+	hdr.agcount = fsgeom.agcount;
+	hdr.nranges = n;
+
+	/* write a new file and rename it over, so there's always one */
+	snprintf(name, sizeof(name), "%s.%d",
+		fsr_mnt_file(_PATH_FSRSTATE, mntdir), getpid());
+	unlink(name);
+	fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd < 0) {
+		fsrprintf(_("open(%s) failed: %s\n"), name, strerror(errno));
+		return;
+	}
+	len = fsgeom.agcount * sizeof(__u64);
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, state->cursor, len) != len ||
+	    write(fd, state->ranges, n * sizeof(struct fsr_range)) !=
+			n * sizeof(struct fsr_range) ||
+	    fsync(fd) < 0) {
+		fsrprintf(_("write(%s) failed: %s\n"), name, strerror(errno));
+		close(fd);
+		unlink(name);
+		return;
+	}
+	close(fd);
+	if (rename(name, fsr_mnt_file(_PATH_FSRSTATE, mntdir)) < 0) {
+		fsrprintf(_("rename(%s) failed: %s\n"), name, strerror(errno));
+		unlink(name);
+	}
+}
+
+/* the end of a run over the filesystem: save the state and drop it */
+static void
+fsr_state_done(char *mntdir)
+{
+	int		i;
+
+	/* a finished pass starts again at the beginning */
+	for (i = 0; i < fsgeom.agcount; i++)
+		if (state->cursor[i] != FSR_AG_DONE)
+			break;
+	if (i == fsgeom.agcount)
+		memset(state->cursor, 0, fsgeom.agcount * sizeof(__u64));
+	fsr_ranges_trim(time(0));
+	if (state->nranges > FSR_STATE_RANGES) {
+		/* keep the newest */
+		qsort(state->ranges, state->nranges, sizeof(struct fsr_range),
+			cmp_range_time);
+		state->nranges = FSR_STATE_RANGES;
+	}
+	fsr_state_save(mntdir, 1);
+	munmap(state, state_size);
+	state = NULL;
+}
+
+/*
+ * Where to start in AGs agfirst up to agend: after the cursor of the first
+ * AG not done yet.  Returns 0 if they are all done this pass.
+ */
+static int
+fsr_state_start(int agfirst, int agend, xfs_ino_t *startp)
+{
+	int		i;
+
+	for (i = agfirst; i < agend; i++) {
+		if (state->cursor[i] == FSR_AG_DONE)
+			continue;
+		*startp = state->cursor[i] ? state->cursor[i] :
+			  (xfs_ino_t)i << agino_log;
+		return 1;
+	}
+	return 0;
+}
+
+/* mark the AGs from curag up to agend done */
+static void
+fsr_state_finish(int curag, int agend)
+{
+	for (; curag < agend && curag < fsgeom.agcount; curag++)
+		state->cursor[curag] = FSR_AG_DONE;
+}
+
+/*
+ * A batch of bulkstat is done, up to lastino: move the cursors on, and
+ * remember the range of inodes lo to hi if all its files were looked at.
+ */
+static void
+fsr_state_batch(
+	char		*mntdir,
+	int		*curagp,
+	xfs_ino_t	lastino,
+	xfs_ino_t	endino,
+	xfs_ino_t	lo,
+	xfs_ino_t	hi,
+	int		full)
+{
+	struct fsr_range *r;
+	int		agno = lastino >> agino_log;
+	int		n;
+
+	if (endino && lastino >= endino) {
+		/* went into the next job's AGs, so ours are done */
+		fsr_state_finish(*curagp, endino >> agino_log);
+		hi = min(hi, endino - 1);
+	} else {
+		fsr_state_finish(*curagp, agno);
+		if (agno < fsgeom.agcount)
+			state->cursor[agno] = lastino;
+		*curagp = agno;
+	}
+
+	if (full && lo <= hi) {
+		n = __sync_fetch_and_add(&state->nranges, 1);
+		if (n < 2 * FSR_STATE_RANGES) {
+			r = &state->ranges[n];
+			r->lo = lo;
+			r->hi = hi;
+			r->time = time(0);
+		} else
+			__sync_fetch_and_sub(&state->nranges, 1);
+	}
+	fsr_state_save(mntdir, 0);
+}
+
+/* was the file looked at in a range walked since it was last written? */
+static int
+fsr_range_recent(xfs_bstat_t *p)
+{
+	struct fsr_range *r;
+	int		i, n = min(state->nranges, 2 * FSR_STATE_RANGES);
+
+	for (i = 0; i < n; i++) {
+		r = &state->ranges[i];
+		if (p->bs_ino >= r->lo && p->bs_ino <= r->hi &&
+		    p->bs_mtime.tv_sec < r->time &&
+		    p->bs_ctime.tv_sec < r->time)
+			return 1;
+	}
+	return 0;
+}
+
 /*
  * reorganize by directory hierarchy.
  * Stay in dev (a restriction based on structure of this program -- either
  * call efs_{n,u}mount() around each file, something smarter or this)
  */
+/* the bits of an inode number that are its number within its AG */
+static void
+fsr_agino_log(void)
+{
+	int	i;
+
+	agino_log = 0;
+	while ((1ULL << agino_log) < fsgeom.agblocks)
+		agino_log++;
+	for (i = fsgeom.blocksize / fsgeom.inodesize; i > 1; i >>= 1)
+		agino_log++;
+}
+
+/*
+ * Defragment the regular files of a directory, and move them to the AG of
+ * the directory while at it.  The temporary files are made in the
+ * directory itself, so the allocator puts their inodes and data near the
+ * directory's, and the files are done in readdir order, so their data is
+ * laid out one after the other in the order a scan of the directory reads
+ * them in.  Files already in one extent are moved too if they are in
+ * another AG.
+ */
 static void
 fsrdir(char *dirname)
 {
-	fsrprintf(_("%s: Directory defragmentation not supported\n"), dirname);
+	jdm_fshandle_t	*fshandlep;
+	struct dirent	*de;
+	struct stat64	sb;
+	xfs_bstat_t	statbuf;
+	xfs_ino_t	ino;
+	DIR		*dir;
+	char		fname[PATH_MAX+1];
+	char		*tname;
+	int		fsfd, fd;
+	int		files = 0;
+	__u64		done = stats->defragged;
+
+	fshandlep = jdm_getfshandle(dirname);
+	if (!fshandlep) {
+		fsrprintf(_("unable to construct sys handle for %s: %s\n"),
+			dirname, strerror(errno));
+		return;
+	}
+	fsfd = open(dirname, O_RDONLY);
+	if (fsfd < 0) {
+		fsrprintf(_("unable to open %s: %s\n"), dirname,
+			strerror(errno));
+		free(fshandlep);
+		return;
+	}
+	if (fstat64(fsfd, &sb) < 0 || xfs_getgeom(fsfd, &fsgeom) < 0) {
+		fsrprintf(_("Unable to get geom on fs for: %s\n"), dirname);
+		goto out;
+	}
+	dir = fdopendir(dup(fsfd));
+	if (!dir) {
+		fsrprintf(_("unable to read directory %s: %s\n"), dirname,
+			strerror(errno));
+		goto out;
+	}
+
+	fsr_agino_log();
+	fsr_pace_init(dirname);
+	fsr_freesp_scan(fsfd);
+	dir_agno = sb.st_ino >> agino_log;
+	if (vflag)
+		fsrprintf(_("%s: moving files to AG %u\n"), dirname, dir_agno);
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+			continue;
+		if (snprintf(fname, sizeof(fname), "%s/%s", dirname,
+			     de->d_name) >= sizeof(fname))
+			continue;
+		ino = de->d_ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &statbuf) < 0 ||
+		    (statbuf.bs_mode & S_IFMT) != S_IFREG)
+			continue;
+		fd = jdm_open(fshandlep, &statbuf, O_RDWR|O_DIRECT);
+		if (fd < 0) {
+			if (dflag)
+				fsrprintf(_("could not open: %s\n"), fname);
+			continue;
+		}
+		tname = gettmpname(fname);
+		if (tname) {
+			files++;
+			fsrfile_common(fname, tname, NULL, fd, &statbuf);
+		}
+		close(fd);
+		if (endtime && endtime < time(0))
+			break;
+	}
+	if (vflag)
+		fsrprintf(_("%s: %llu of %d files moved or defragmented\n"),
+			dirname, (unsigned long long)(stats->defragged - done),
+			files);
+	closedir(dir);
+	dir_agno = NULLAGNUMBER;
+out:
+	close(fsfd);
+	free(fshandlep);
 }
 
 /*
@@ -853,6 +2056,8 @@ fsrfile(char *fname, xfs_ino_t ino)
 	}
 
 	tname = gettmpname(fname);
+	fsr_pace_init(fname);
+	fsr_freesp_scan(fsfd);
 
 	if (tname)
 		error = fsrfile_common(fname, tname, NULL, fd, &statbuf);
@@ -897,6 +2102,7 @@ fsrfile_common(
 
 	if (vflag)
 		fsrprintf("%s\n", fname);
+	fsr_stat_add(files, 1);
 
 	if (fsync(fd) < 0) {
 		fsrprintf(_("sync failed: %s: %s\n"), fname, strerror(errno));
@@ -1202,6 +2408,174 @@ out:
 	return 0;
 }
 
+/*
+ * Copy the data extents of the file to the tmp file with up to iodepth
+ * direct I/Os in flight.  Each chunk is read into a buffer of its own and
+ * written out from it as soon as the read completes, so the reads of one
+ * chunk overlap the writes of others.  Holes are skipped; the tmp file
+ * already has them.  glibc runs the requests for a file descriptor one at
+ * a time, so every buffer gets its own dups of the two files.
+ */
+struct copy_slot {
+	struct aiocb	cb;
+	int		fd;		/* dups of the file and the tmp file */
+	int		tfd;
+	int		busy;		/* LIO_READ or LIO_WRITE in flight */
+};
+
+static int
+packfile_copy_aio(
+	char		*fname,
+	char		*tname,
+	int		fd,
+	int		tfd,
+	int		nextents,
+	unsigned	blksz_dio,
+	unsigned	dio_min,
+	unsigned	dio_mem)
+{
+	struct copy_slot *slots, *s;
+	const struct aiocb **list;
+	off64_t		pos = 0, end = 0;
+	ssize_t		ret;
+	size_t		ct;
+	int		extent = 0, inflight = 0;
+	int		error = 0, eof = 0;
+	int		i, err;
+
+	slots = calloc(iodepth, sizeof(*slots));
+	list = calloc(iodepth, sizeof(*list));
+	if (!slots || !list) {
+		fsrprintf(_("could not allocate buf: %s\n"), tname);
+		error = -1;
+		goto out;
+	}
+	for (i = 0; i < iodepth; i++)
+		slots[i].fd = slots[i].tfd = -1;
+	for (i = 0; i < iodepth; i++) {
+		s = &slots[i];
+		s->cb.aio_buf = memalign(dio_mem, blksz_dio);
+		s->fd = dup(fd);
+		s->tfd = dup(tfd);
+		if (!s->cb.aio_buf || s->fd < 0 || s->tfd < 0) {
+			fsrprintf(_("could not allocate buf: %s\n"), tname);
+			error = -1;
+			goto out;
+		}
+	}
+#ifdef __GLIBC__
+	{
+		struct aioinit	init = { 0 };
+
+		init.aio_threads = iodepth;
+		init.aio_num = iodepth;
+		aio_init(&init);
+	}
+#endif
+
+	for (;;) {
+		/* start reads into the free buffers */
+		for (i = 0; i < iodepth && !error && !eof; i++) {
+			s = &slots[i];
+			if (s->busy)
+				continue;
+			while (pos >= end && extent < nextents) {
+				if (outmap[extent].bmv_block != -1 &&
+				    outmap[extent].bmv_length) {
+					pos = outmap[extent].bmv_offset;
+					end = pos + outmap[extent].bmv_length;
+				}
+				extent++;
+			}
+			if (pos >= end)
+				break;
+			/* whole direct I/O blocks, as for the plain copy */
+			ct = min(roundup(end - pos, dio_min), blksz_dio);
+			fsr_throttle(ct);
+			s->cb.aio_fildes = s->fd;
+			s->cb.aio_offset = pos;
+			s->cb.aio_nbytes = ct;
+			if (aio_read(&s->cb) < 0) {
+				fsrprintf(_("bad read of %d bytes from %s: %s\n"),
+					(int)ct, fname, strerror(errno));
+				error = -1;
+				break;
+			}
+			s->busy = LIO_READ;
+			inflight++;
+			pos += ct;
+		}
+		if (!inflight)
+			break;
+
+		for (i = 0; i < iodepth; i++)
+			list[i] = slots[i].busy ? &slots[i].cb : NULL;
+		if (aio_suspend(list, iodepth, NULL) < 0 && errno != EINTR) {
+			fsrprintf(_("aio_suspend failed: %s\n"), strerror(errno));
+			error = -1;
+		}
+
+		for (i = 0; i < iodepth; i++) {
+			s = &slots[i];
+			if (!s->busy)
+				continue;
+			err = aio_error(&s->cb);
+			if (err == EINPROGRESS)
+				continue;
+			ret = aio_return(&s->cb);
+			inflight--;
+			if (s->busy == LIO_READ) {
+				if (ret < 0) {
+					fsrprintf(_("bad read of %d bytes "
+						"from %s: %s\n"),
+						(int)s->cb.aio_nbytes, fname,
+						strerror(err));
+					error = -1;
+				} else if (ret == 0) {
+					/* EOF, stop trying to read */
+					eof = 1;
+				} else if (!error) {
+					/* ensure we write whole blocks */
+					s->cb.aio_fildes = s->tfd;
+					s->cb.aio_nbytes = roundup(ret, dio_min);
+					if (aio_write(&s->cb) == 0) {
+						s->busy = LIO_WRITE;
+						inflight++;
+						continue;
+					}
+					fsrprintf(_("bad write of %d bytes "
+						"to %s: %s\n"),
+						(int)s->cb.aio_nbytes, tname,
+						strerror(errno));
+					error = -1;
+				}
+			} else if (ret != s->cb.aio_nbytes) {
+				if (ret < 0)
+					fsrprintf(_("bad write of %d bytes "
+						"to %s: %s\n"),
+						(int)s->cb.aio_nbytes, tname,
+						strerror(err));
+				else
+					fsrprintf(_("bad copy to %s\n"), tname);
+				error = -1;
+			}
+			s->busy = 0;
+		}
+	}
+
+out:
+	for (i = 0; slots && i < iodepth; i++) {
+		free((void *)slots[i].cb.aio_buf);
+		if (slots[i].fd >= 0)
+			close(slots[i].fd);
+		if (slots[i].tfd >= 0)
+			close(slots[i].tfd);
+	}
+	free(slots);
+	free(list);
+	return error;
+}
+
 /*
  * Do the defragmentation of a single file.
  * We already are pretty sure we can and want to
@@ -1230,8 +2604,11 @@ packfile(char *fname, char *tname, int fd,
 	off64_t 	cnt, pos;
 	void 		*fbuf = NULL;
 	int 		ct, wc, wc_b4;
+	int		use_aio = iodepth > 1 && !nfrags;
 	char		ffname[SMBUFSZ];
 	int		ffd = -1;
+	int		relocate = 0;
+	__u64		start;
 
 	/*
 	 * Work out the extent map - nextents will be set to the
@@ -1239,15 +2616,44 @@ packfile(char *fname, char *tname, int fd,
 	 * into account holes), cur_nextents is the current number
 	 * of extents.
 	 */
+	start = fsr_now();
 	nextents = read_fd_bmap(fd, statp, &cur_nextents);
+	fsr_stat_add(scan_ns, fsr_now() - start);
+
+	/* with a directory, files elsewhere are moved to it anyway */
+	if (dir_agno != NULLAGNUMBER &&
+	    !(fsxp->fsx_xflags & XFS_XFLAG_REALTIME)) {
+		xfs_agnumber_t	agno = fsr_file_agno(fd);
+
+		relocate = agno != NULLAGNUMBER && agno != dir_agno;
+		if (relocate && dflag)
+			fsrprintf(_("%s: in AG %u, moving to AG %u\n"),
+				fname, agno, dir_agno);
+	}
 
-	if (cur_nextents == 1 || cur_nextents <= nextents) {
+	if (!relocate && (cur_nextents == 1 || cur_nextents <= nextents)) {
 		if (vflag)
 			fsrprintf(_("%s already fully defragmented.\n"), fname);
 		retval = 1; /* indicates no change/no error */
 		goto out;
 	}
 
+	/* Don't copy the file if the free space can't do any better */
+	if (freesp_valid && !relocate &&
+	    !(fsxp->fsx_xflags & XFS_XFLAG_REALTIME)) {
+		int	need;
+
+		need = fsr_freesp_extents(statp->bs_blocks * statp->bs_blksize);
+		if (need >= cur_nextents) {
+			if (vflag)
+				fsrprintf(_("%s: free space too fragmented "
+					"to improve on %d extents (skipping)\n"),
+					fname, cur_nextents);
+			retval = 1;
+			goto out;
+		}
+	}
+
 	if (dflag)
 		fsrprintf(_("%s extents=%d can_save=%d tmp=%s\n"),
 		          fname, cur_nextents, (cur_nextents - nextents),
@@ -1298,7 +2704,7 @@ packfile(char *fname, char *tname, int fd,
 			dio.d_maxiosz, pagesize);
 	}
 
-	if (!(fbuf = (char *)memalign(dio.d_mem, blksz_dio))) {
+	if (!use_aio && !(fbuf = (char *)memalign(dio.d_mem, blksz_dio))) {
 		fsrprintf(_("could not allocate buf: %s\n"), tname);
 		goto out;
 	}
@@ -1364,13 +2770,31 @@ packfile(char *fname, char *tname, int fd,
 	new_nextents = getnextents(tfd);
 	if (dflag)
 		fsrprintf(_("Temporary file has %d extents (%d in original)\n"), new_nextents, cur_nextents);
-	if (cur_nextents <= new_nextents) {
+	if (relocate) {
+		/* worth it if it's where we want it, and no worse */
+		if (cur_nextents < new_nextents ||
+		    fsr_file_agno(tfd) != dir_agno) {
+			if (vflag)
+				fsrprintf(_("Could not move next to its "
+					"directory (skipping): %s\n"), fname);
+			retval = 1;
+			goto out;
+		}
+	} else if (cur_nextents <= new_nextents) {
 		if (vflag)
 			fsrprintf(_("No improvement will be made (skipping): %s\n"), fname);
 		retval = 1; /* no change/no error */
 		goto out;
 	}
 
+	start = fsr_now();
+	if (use_aio) {
+		if (packfile_copy_aio(fname, tname, fd, tfd, nextents,
+				blksz_dio, dio_min, dio.d_mem) < 0)
+			goto out;
+		goto copied;
+	}
+
 	/* Loop through block map copying the file. */
 	for (extent = 0; extent < nextents; extent++) {
 		pos = outmap[extent].bmv_offset;
@@ -1400,6 +2824,7 @@ packfile(char *fname, char *tname, int fd,
 				ct = min(cnt + dio_min - (cnt % dio_min),
 					blksz_dio);
 			}
+			fsr_throttle(ct);
 			ct = read(fd, fbuf, ct);
 			if (ct == 0) {
 				/* EOF, stop trying to read */
@@ -1460,6 +2885,7 @@ packfile(char *fname, char *tname, int fd,
 			}
 		}
 	}
+copied:
 	if (ftruncate64(tfd, statp->bs_size) < 0) {
 		fsrprintf(_("could not truncate tmpfile: %s : %s\n"),
 				fname, strerror(errno));
@@ -1470,6 +2896,10 @@ packfile(char *fname, char *tname, int fd,
 				fname, strerror(errno));
 		goto out;
 	}
+	fsr_stat_add(copy_ns, fsr_now() - start);
+	for (extent = 0; extent < nextents; extent++)
+		if (outmap[extent].bmv_block != -1)
+			fsr_stat_add(bytes, outmap[extent].bmv_length);
 
 	sx.sx_stat     = *statp; /* struct copy */
 	sx.sx_version  = XFS_SX_VERSION;
@@ -1487,7 +2917,9 @@ packfile(char *fname, char *tname, int fd,
         }
 
 	/* Swap the extents */
+	start = fsr_now();
 	srval = xfs_swapext(fd, &sx);
+	fsr_stat_add(swap_ns, fsr_now() - start);
 	if (srval < 0) {
 		if (errno == ENOTSUP) {
 			if (vflag || dflag)
@@ -1514,6 +2946,9 @@ packfile(char *fname, char *tname, int fd,
 			  cur_nextents, new_nextents,
 			  (new_nextents <= nextents ? "DONE" : "    " ),
 		          fname);
+	fsr_stat_add(defragged, 1);
+	fsr_stat_add(extents_before, cur_nextents);
+	fsr_stat_add(extents_after, new_nextents);
 	retval = 0;
 
 out:
@@ -1697,6 +3132,144 @@ getnextents(int fd)
 	return(nextents);
 }
 
+/* the AG the data of a file starts in, or NULLAGNUMBER if it has none */
+static xfs_agnumber_t
+fsr_file_agno(int fd)
+{
+	struct getbmap	map[MAPSIZE];
+	__u64		bbperag;
+	int		i;
+
+	bbperag = (__u64)fsgeom.agblocks * (fsgeom.blocksize >> BBSHIFT);
+	map[0].bmv_offset = 0;
+	map[0].bmv_block = 0;
+	map[0].bmv_entries = 0;
+	map[0].bmv_count = MAPSIZE;
+	map[0].bmv_length = -1;
+	do {
+		if (ioctl(fd, XFS_IOC_GETBMAP, map) < 0)
+			return NULLAGNUMBER;
+		for (i = 0; i < map[0].bmv_entries; i++)
+			if (map[i + 1].bmv_block >= 0)
+				return map[i + 1].bmv_block / bbperag;
+	} while (map[0].bmv_entries == (MAPSIZE-1));
+	return NULLAGNUMBER;
+}
+
+/* keep the FREESP_MAX largest free extents, the smallest at the root */
+static void
+fsr_freesp_add(__u64 len)
+{
+	int		i, child;
+
+	/* no extent can be longer than this anyway */
+	len = min(len, (__u64)MAXEXTLEN * fsgeom.blocksize);
+	if (nfreesp == FREESP_MAX) {
+		if (len <= freesp[0])
+			return;
+		i = 0;
+		for (;;) {
+			child = 2 * i + 1;
+			if (child >= nfreesp)
+				break;
+			if (child + 1 < nfreesp &&
+			    freesp[child + 1] < freesp[child])
+				child++;
+			if (freesp[child] >= len)
+				break;
+			freesp[i] = freesp[child];
+			i = child;
+		}
+	} else {
+		i = nfreesp++;
+		while (i && freesp[(i - 1) / 2] > len) {
+			freesp[i] = freesp[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+	}
+	freesp[i] = len;
+}
+
+static int
+cmp_freesp(const void *s1, const void *s2)
+{
+	__u64	a = *(__u64 *)s1, b = *(__u64 *)s2;
+
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+/*
+ * Walk the space map for the free extents.  Kernels without GETFSMAP
+ * just leave the planning off.
+ */
+static void
+fsr_freesp_scan(int fsfd)
+{
+	struct fsmap_head *head;
+	struct fsmap	*rec;
+	int		i;
+
+	freesp_valid = 0;
+	nfreesp = 0;
+	if (!freesp && !(freesp = malloc(FREESP_MAX * sizeof(*freesp))))
+		return;
+	head = calloc(1, sizeof(*head) + FSMAP_NR * sizeof(struct fsmap));
+	if (!head)
+		return;
+	head->fmh_count = FSMAP_NR;
+	head->fmh_keys[1].fmr_device = UINT_MAX;
+	head->fmh_keys[1].fmr_flags = UINT_MAX;
+	head->fmh_keys[1].fmr_physical = ULLONG_MAX;
+	head->fmh_keys[1].fmr_owner = ULLONG_MAX;
+	head->fmh_keys[1].fmr_offset = ULLONG_MAX;
+
+	for (;;) {
+		if (ioctl(fsfd, FS_IOC_GETFSMAP, head) < 0) {
+			if (dflag)
+				fsrprintf(_("no space map, not planning "
+					"copies: %s\n"), strerror(errno));
+			goto out;
+		}
+		if (!head->fmh_entries)
+			break;
+		for (i = 0; i < head->fmh_entries; i++) {
+			rec = &head->fmh_recs[i];
+			if (rec->fmr_owner == FMR_OWN_FREE)
+				fsr_freesp_add(rec->fmr_length);
+		}
+		rec = &head->fmh_recs[head->fmh_entries - 1];
+		if (rec->fmr_flags & FMR_OF_LAST)
+			break;
+		head->fmh_keys[0] = *rec;
+	}
+	qsort(freesp, nfreesp, sizeof(*freesp), cmp_freesp);
+	freesp_valid = 1;
+	if (dflag)
+		fsrprintf(_("largest free extent %llu bytes\n"),
+			nfreesp ? (unsigned long long)freesp[0] : 0ULL);
+out:
+	free(head);
+}
+
+/*
+ * The fewest extents bytes could be allocated in, taking the largest
+ * free extents first.  If even the FREESP_MAX largest don't add up to
+ * it, at least one more than that.
+ */
+static int
+fsr_freesp_extents(__u64 bytes)
+{
+	__u64		sum = 0;
+	int		i;
+
+	for (i = 0; i < nfreesp; i++) {
+		sum += freesp[i];
+		if (sum >= bytes)
+			return i + 1;
+	}
+	return nfreesp + 1;
+}
+
 /*
  * Get the fs geometry
  */
@@ -1732,6 +3305,201 @@ xfs_getrt(int fd, struct statvfs64 *sfbp)
 	return 0;
 }
 
+static __u64
+fsr_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* find the sysfs statistics of the device the file or filesystem is on */
+static void
+fsr_pace_init(char *path)
+{
+	struct stat64	sb;
+
+	if (!maxlat)
+		return;
+	devstat[0] = '\0';
+	fsr_shared->sample_ns = 0;
+	fsr_shared->rate = iorate;
+	if (stat64(path, &sb) < 0)
+		return;
+	snprintf(devstat, sizeof(devstat), "/sys/dev/block/%u:%u/stat",
+		major(sb.st_dev), minor(sb.st_dev));
+	if (access(devstat, R_OK) < 0) {
+		fsrprintf(_("%s: no I/O statistics for the device, "
+			    "not pacing by latency\n"), path);
+		devstat[0] = '\0';
+	}
+}
+
+/* the I/Os the device has done, and the msecs they took between them */
+static int
+fsr_devstat(__u64 *ios, __u64 *ticks)
+{
+	unsigned long long v[8];
+	FILE		*fp;
+	int		n;
+
+	if (!devstat[0] || !(fp = fopen(devstat, "r")))
+		return -1;
+	n = fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu %llu",
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(fp);
+	if (n != 8)
+		return -1;
+	*ios = v[0] + v[4];
+	*ticks = v[3] + v[7];
+	return 0;
+}
+
+/*
+ * Every PACE_INTERVAL, one of the jobs looks at the average latency of
+ * the device's I/O, ours and everyone else's, since the last look.  Over
+ * maxlat, the rate drops to half of what we copied at; under it, the rate
+ * creeps back up, but not beyond twice what we copy at or iorate.
+ */
+static void
+fsr_pace(__u64 now)
+{
+	struct fsr_shared *sh = fsr_shared;
+	__u64		last = sh->sample_ns;
+	__u64		ios, ticks, bytes, rate;
+	double		lat, ours;
+
+	if (now < last + PACE_INTERVAL)
+		return;
+	if (__sync_val_compare_and_swap(&sh->sample_ns, last, now) != last)
+		return;		/* another job is looking */
+	if (fsr_devstat(&ios, &ticks) < 0)
+		return;
+	bytes = sh->bytes;
+	if (last && ios > sh->sample_ios) {
+		lat = (double)(ticks - sh->sample_ticks) /
+		      (ios - sh->sample_ios);
+		ours = (bytes - sh->sample_bytes) * 1e9 / (now - last);
+		rate = sh->rate;
+		if (lat > maxlat && ours > 0)
+			rate = max(ours / 2, PACE_MIN_RATE);
+		else if (lat <= maxlat && rate && rate < 2 * ours)
+			rate += max(rate / 8, PACE_MIN_RATE);
+		if (iorate && (!rate || rate > iorate))
+			rate = iorate;
+		if (dflag && rate != sh->rate)
+			fsrprintf(_("latency %.1fms, copy rate %llu KiB/s\n"),
+				lat, (unsigned long long)rate / 1024);
+		sh->rate = rate;
+	}
+	sh->sample_ios = ios;
+	sh->sample_ticks = ticks;
+	sh->sample_bytes = bytes;
+}
+
+/*
+ * Hold the copying of all the jobs together to the current rate.  The
+ * jobs share the time at which the budget is next free; each copy books
+ * the time its bytes take at that rate and sleeps until its turn.
+ */
+static void
+fsr_throttle(size_t bytes)
+{
+	struct timespec	ts;
+	__u64		now, old, start;
+	__u64		cost, rate;
+
+	if (!fsr_shared)
+		return;
+	now = fsr_now();
+	if (maxlat) {
+		__sync_fetch_and_add(&fsr_shared->bytes, bytes);
+		fsr_pace(now);
+	}
+	rate = fsr_shared->rate;
+	if (!rate)
+		return;
+	cost = bytes * 1000000000ULL / rate;
+	do {
+		old = fsr_shared->next_ns;
+		start = max(old, now);
+	} while (__sync_val_compare_and_swap(&fsr_shared->next_ns, old,
+					     start + cost) != old);
+	if (start <= now)
+		return;
+	ts.tv_sec = (start - now) / 1000000000ULL;
+	ts.tv_nsec = (start - now) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * At the end of the run, say what it did: how many extents went for how
+ * much copying, and where the time went.
+ */
+static void
+fsr_stats_report(void)
+{
+	struct fsr_stats *st = stats;
+	double		secs, gib, per_gib;
+	__u64		gone;
+	FILE		*fp;
+
+	if (getpid() != stats_pid || (!Sflag && !jsonfile))
+		return;
+	secs = (fsr_now() - stats_start) / 1e9;
+	gib = st->bytes / (1024.0 * 1024 * 1024);
+	gone = st->extents_before - st->extents_after;
+	per_gib = gib > 0 ? gone / gib : 0;
+
+	if (Sflag) {
+		fsrprintf(_("%llu files examined, %llu defragmented, "
+			    "extents %llu before, %llu after\n"),
+			(unsigned long long)st->files,
+			(unsigned long long)st->defragged,
+			(unsigned long long)st->extents_before,
+			(unsigned long long)st->extents_after);
+		fsrprintf(_("%.1f MiB copied, %.1f extents removed per GiB, "
+			    "%.1f MiB/s\n"),
+			st->bytes / (1024.0 * 1024), per_gib,
+			secs > 0 ? st->bytes / (1024.0 * 1024) / secs : 0);
+		fsrprintf(_("%.1fs elapsed: %.1fs scanning, %.1fs copying, "
+			    "%.1fs swapping extents\n"),
+			secs, st->scan_ns / 1e9, st->copy_ns / 1e9,
+			st->swap_ns / 1e9);
+	}
+	if (!jsonfile)
+		return;
+	if (strcmp(jsonfile, "-") == 0)
+		fp = stdout;
+	else if (!(fp = fopen(jsonfile, "w"))) {
+		fsrprintf(_("cannot open %s: %s\n"), jsonfile, strerror(errno));
+		return;
+	}
+	fprintf(fp, "{\n"
+		"  \"files_examined\": %llu,\n"
+		"  \"files_defragmented\": %llu,\n"
+		"  \"extents_before\": %llu,\n"
+		"  \"extents_after\": %llu,\n"
+		"  \"bytes_copied\": %llu,\n"
+		"  \"extents_removed_per_gib\": %.3f,\n"
+		"  \"elapsed_seconds\": %.3f,\n"
+		"  \"scan_seconds\": %.3f,\n"
+		"  \"copy_seconds\": %.3f,\n"
+		"  \"swapext_seconds\": %.3f\n"
+		"}\n",
+		(unsigned long long)st->files,
+		(unsigned long long)st->defragged,
+		(unsigned long long)st->extents_before,
+		(unsigned long long)st->extents_after,
+		(unsigned long long)st->bytes, per_gib, secs,
+		st->scan_ns / 1e9, st->copy_ns / 1e9, st->swap_ns / 1e9);
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+}
+
 int
 fsrprintf(const char *fmt, ...)
 {
@@ -1768,7 +3536,8 @@ tmp_init(char *mnt)
 	static char	buf[SMBUFSZ];
 	mode_t	mask;
 
-	tmp_agi = 0;
+	tmp_agi = tmp_agfirst = 0;
+	tmp_agend = fsgeom.agcount;
 	sprintf(buf, "%s/.fsr", mnt);
 
 	mask = umask(0);
@@ -1811,8 +3580,8 @@ tmp_next(char *mnt)
 	        tmp_agi,
 	        getpid());
 
-	if (++tmp_agi == fsgeom.agcount)
-		tmp_agi = 0;
+	if (++tmp_agi == tmp_agend)
+		tmp_agi = tmp_agfirst;
 
 	return(buf);
 }
@@ -19,19 +19,134 @@
 #define __ATOMIC_H__
 
 /*
- * Warning: These are not really atomic at all. They are wrappers around the
- * kernel atomic variable interface. If we do need these variables to be atomic
- * (due to multithreading of the code that uses them) we need to add some
- * pthreads magic here.
+ * The kernel atomic variable interface, done with the compiler's atomic
+ * builtins so that code shared between threads can use it.  atomic_t and
+ * atomic64_t stay plain integers, so they can be initialised and printed
+ * as before, but must only be changed through these.  Everything is
+ * sequentially consistent, like the kernel's value returning operations.
  */
 typedef	int32_t	atomic_t;
 typedef	int64_t	atomic64_t;
 
-#define atomic_inc_return(x)	(++(*(x)))
-#define atomic_dec_return(x)	(--(*(x)))
+#define ATOMIC_ORDER		__ATOMIC_SEQ_CST
 
-#define atomic64_read(x)	*(x)
-#define atomic64_set(x, v)	(*(x) = v)
+#define atomic_read(x)		__atomic_load_n((x), ATOMIC_ORDER)
+#define atomic_set(x, v)	__atomic_store_n((x), (v), ATOMIC_ORDER)
+#define atomic_add(i, x)	((void)__atomic_add_fetch((x), (i), ATOMIC_ORDER))
+#define atomic_sub(i, x)	((void)__atomic_sub_fetch((x), (i), ATOMIC_ORDER))
+#define atomic_inc(x)		atomic_add(1, (x))
+#define atomic_dec(x)		atomic_sub(1, (x))
+#define atomic_add_return(i, x)	__atomic_add_fetch((x), (i), ATOMIC_ORDER)
+#define atomic_sub_return(i, x)	__atomic_sub_fetch((x), (i), ATOMIC_ORDER)
+#define atomic_inc_return(x)	atomic_add_return(1, (x))
+#define atomic_dec_return(x)	atomic_sub_return(1, (x))
+#define atomic_dec_and_test(x)	(atomic_dec_return(x) == 0)
+
+static inline int
+atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	__atomic_compare_exchange_n(v, &old, new, 0, ATOMIC_ORDER,
+				    ATOMIC_ORDER);
+	return old;
+}
+
+#define atomic64_read(x)	atomic_read(x)
+#define atomic64_set(x, v)	atomic_set((x), (v))
+#define atomic64_add(i, x)	atomic_add((i), (x))
+#define atomic64_sub(i, x)	atomic_sub((i), (x))
+#define atomic64_inc(x)		atomic_inc(x)
+#define atomic64_dec(x)		atomic_dec(x)
+#define atomic64_add_return(i, x) atomic_add_return((i), (x))
+#define atomic64_sub_return(i, x) atomic_sub_return((i), (x))
+
+static inline int64_t
+atomic64_cmpxchg(atomic64_t *v, int64_t old, int64_t new)
+{
+	__atomic_compare_exchange_n(v, &old, new, 0, ATOMIC_ORDER,
+				    ATOMIC_ORDER);
+	return old;
+}
+
+/*
+ * Add one to *v unless that would take it to limit or beyond.  Returns the
+ * new value, or 0 if *v was left alone.  For counts with a ceiling, such
+ * as the number of nodes a cache may hold.
+ */
+static inline int
+atomic_inc_below(atomic_t *v, int limit)
+{
+	int	old = atomic_read(v);
+
+	do {
+		if (old >= limit)
+			return 0;
+	} while (!__atomic_compare_exchange_n(v, &old, old + 1, 0,
+					      ATOMIC_ORDER, ATOMIC_ORDER));
+	return old + 1;
+}
+
+/* raise *v to val if it's lower, for high water marks */
+static inline void
+atomic_max(atomic_t *v, int val)
+{
+	int	old = atomic_read(v);
+
+	while (old < val &&
+	       !__atomic_compare_exchange_n(v, &old, val, 0, ATOMIC_ORDER,
+					    ATOMIC_ORDER))
+		;
+}
+
+/* lower *v to val if it's higher, for the first of something to happen */
+static inline void
+atomic_min(atomic_t *v, int val)
+{
+	int	old = atomic_read(v);
+
+	while (old > val &&
+	       !__atomic_compare_exchange_n(v, &old, val, 0, ATOMIC_ORDER,
+					    ATOMIC_ORDER))
+		;
+}
+
+/* atomic_max for 64 bit high water marks */
+static inline void
+atomic64_max(atomic64_t *v, int64_t val)
+{
+	int64_t	old = atomic64_read(v);
+
+	while (old < val &&
+	       !__atomic_compare_exchange_n(v, &old, val, 0, ATOMIC_ORDER,
+					    ATOMIC_ORDER))
+		;
+}
+
+/*
+ * Statistics and progress counters of any integer type that several
+ * threads bump and others only read now and then need no ordering, just
+ * not to lose updates.
+ */
+#define counter_add(x, n)	((void)__atomic_add_fetch((x), (n), __ATOMIC_RELAXED))
+#define counter_read(x)		__atomic_load_n((x), __ATOMIC_RELAXED)
+
+/*
+ * Add delta to an unsigned 64 bit counter unless that would take it below
+ * zero, as with free space that several threads take from.  Returns 1 if
+ * it was added, 0 if *v was left alone.
+ */
+static inline int
+counter64_add_unless_negative(uint64_t *v, int64_t delta)
+{
+	uint64_t	old = counter_read(v);
+
+	do {
+		if ((int64_t)old + delta < 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(v, &old, old + delta, 0,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	return 1;
+}
 
 #endif /* __ATOMIC_H__ */
 
@@ -8,6 +8,9 @@
 #ifndef HAVE_FLS
 static inline int fls(int x)
 {
+#ifdef __GNUC__
+	return x ? 32 - __builtin_clz((unsigned int)x) : 0;
+#else
 	int r = 32;
 
 	if (!x)
@@ -32,15 +35,20 @@ static inline int fls(int x)
 		r -= 1;
 	}
 	return r;
+#endif
 }
 #endif /* HAVE_FLS */
 
 static inline int fls64(__u64 x)
 {
+#ifdef __GNUC__
+	return x ? 64 - __builtin_clzll(x) : 0;
+#else
 	__u32 h = x >> 32;
 	if (h)
 		return fls(h) + 32;
 	return fls(x);
+#endif
 }
 
 static inline unsigned fls_long(unsigned long l)
@@ -50,6 +58,21 @@ static inline unsigned fls_long(unsigned long l)
         return fls64(l);
 }
 
+/*
+ * hweight32: number of bits set.
+ */
+static inline unsigned int hweight32(__u32 w)
+{
+#ifdef __GNUC__
+	return __builtin_popcount(w);
+#else
+	w = w - ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+	w = (w + (w >> 4)) & 0x0f0f0f0f;
+	return (w * 0x01010101) >> 24;
+#endif
+}
+
 /*
  * ffz: find first zero bit.
  * Result is undefined if no zero bit exists.
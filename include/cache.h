@@ -18,6 +18,8 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include "atomic.h"
+
 /*
  * initialisation flags
  */
@@ -28,6 +30,16 @@
  */
 #define CACHE_MISCOMPARE_PURGE	(1 << 0)
 
+/*
+ * Use a scan resistant generalised CLOCK replacement policy instead of the
+ * priority MRUs.  Nodes gain reference weight each time they are looked up
+ * again and the reclaim hand only frees nodes whose weight has decayed to
+ * zero, so a single pass over many blocks that are read once doesn't push
+ * frequently revisited blocks out of the cache.  Priorities are still kept
+ * on the nodes, but do not affect reclaim.
+ */
+#define CACHE_POLICY_CLOCK	(1 << 1)
+
 /*
  * cache object campare return values
  */
@@ -52,6 +64,12 @@ enum {
 #define CACHE_PREFETCH_PRIORITY	8
 #define CACHE_MAX_PRIORITY	15
 
+/*
+ * Maximum reference weight of a node under the CLOCK policy, i.e. the number
+ * of reclaim passes an otherwise untouched hot node survives.
+ */
+#define CACHE_CLOCK_MAX_WEIGHT	3
+
 /*
  * Simple, generic implementation of a cache (arbitrary data).
  * Provides a hash table with a capped number of cache entries.
@@ -70,6 +88,10 @@ typedef unsigned int (*cache_node_hash_t)(cache_key_t, unsigned int,
 					  unsigned int);
 typedef int (*cache_node_compare_t)(struct cache_node *, cache_key_t);
 typedef unsigned int (*cache_bulk_relse_t)(struct cache *, struct list_head *);
+typedef int (*cache_node_dirty_t)(struct cache_node *);
+typedef void (*cache_flush_list_t)(struct cache *, struct cache_node **,
+				   unsigned int);
+typedef void (*cache_report_t)(FILE *, struct cache *);
 
 struct cache_operations {
 	cache_node_hash_t	hash;
@@ -78,14 +100,32 @@ struct cache_operations {
 	cache_node_relse_t	relse;
 	cache_node_compare_t	compare;
 	cache_bulk_relse_t	bulkrelse;	/* optional */
+	cache_report_t		report;		/* optional */
+	cache_node_dirty_t	dirty;		/* optional, with flush_list */
+	cache_flush_list_t	flush_list;	/* optional */
 };
 
+/*
+ * Lookup statistics are kept per hash chain and updated under the chain
+ * mutex that the lookup already holds, so cache hits never touch a lock
+ * shared by the whole cache.
+ */
 struct cache_hash {
 	struct list_head	ch_list;	/* hash chain head */
 	unsigned int		ch_count;	/* hash chain length */
+	unsigned long long	ch_hits;	/* lookup hits on this chain */
+	unsigned long long	ch_misses;	/* lookup misses on this chain */
 	pthread_mutex_t		ch_mutex;	/* hash chain mutex */
 };
 
+/*
+ * Each priority's MRU is split into independently locked stripes, selected
+ * by the node's hash chain index, so that threads releasing and looking up
+ * unrelated nodes don't serialise on a single MRU lock.  The shaker walks
+ * the stripes of a priority in turn.
+ */
+#define CACHE_MRU_STRIPES	16
+
 struct cache_mru {
 	struct list_head	cm_list;	/* MRU head */
 	unsigned int		cm_count;	/* MRU length */
@@ -98,27 +138,30 @@ struct cache_node {
 	unsigned int		cn_count;	/* reference count */
 	unsigned int		cn_hashidx;	/* hash chain index */
 	int			cn_priority;	/* priority, -1 = free list */
+	unsigned int		cn_weight;	/* CLOCK reference weight */
 	pthread_mutex_t		cn_mutex;	/* node mutex */
 };
 
 struct cache {
 	int			c_flags;	/* behavioural flags */
 	unsigned int		c_maxcount;	/* max cache nodes */
-	unsigned int		c_count;	/* count of nodes */
-	pthread_mutex_t		c_mutex;	/* node count mutex */
+	atomic_t		c_count;	/* count of nodes */
+	pthread_mutex_t		c_mutex;	/* c_maxcount mutex */
 	cache_node_hash_t	hash;		/* node hash function */
 	cache_node_alloc_t	alloc;		/* allocation function */
 	cache_node_flush_t	flush;		/* flush dirty data function */
 	cache_node_relse_t	relse;		/* memory free function */
 	cache_node_compare_t	compare;	/* comparison routine */
 	cache_bulk_relse_t	bulkrelse;	/* bulk release routine */
+	cache_report_t		report;		/* extra report routine */
+	cache_node_dirty_t	dirty;		/* node needs flushing? */
+	cache_flush_list_t	flush_list;	/* flush many nodes at once */
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
-	struct cache_mru	c_mrus[CACHE_MAX_PRIORITY + 1];
-	unsigned long long	c_misses;	/* cache misses */
-	unsigned long long	c_hits;		/* cache hits */
-	unsigned int 		c_max;		/* max nodes ever used */
+	struct cache_mru	c_mrus[CACHE_MAX_PRIORITY + 1][CACHE_MRU_STRIPES];
+	unsigned int		c_shake_stripe;	/* next MRU stripe to shake */
+	atomic_t		c_max;		/* max nodes ever used */
 };
 
 struct cache *cache_init(int, unsigned int, struct cache_operations *);
@@ -126,6 +169,7 @@ void cache_destroy(struct cache *);
 void cache_walk(struct cache *, cache_walk_t);
 void cache_purge(struct cache *);
 void cache_flush(struct cache *);
+void cache_set_maxcount(struct cache *, unsigned int);
 
 int cache_node_get(struct cache *, cache_key_t, struct cache_node **);
 void cache_node_put(struct cache *, struct cache_node *);
@@ -133,6 +177,7 @@ void cache_node_set_priority(struct cache *, struct cache_node *, int);
 int cache_node_get_priority(struct cache_node *);
 int cache_node_purge(struct cache *, cache_key_t, struct cache_node *);
 void cache_report(FILE *fp, const char *, struct cache *);
+void cache_stats(struct cache *, unsigned long long *, unsigned long long *);
 int cache_overflowed(struct cache *);
 
 #endif	/* __CACHE_H__ */
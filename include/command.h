@@ -49,6 +49,7 @@ extern void		add_command(const cmdinfo_t *ci);
 extern void		add_user_command(char *optarg);
 extern void		add_args_command(argsfunc_t af);
 extern void		add_check_command(checkfunc_t cf);
+extern void		add_batch_mode(void);
 
 extern const cmdinfo_t	*find_command(const char *cmd);
 
@@ -147,4 +147,10 @@ platform_discard_blocks(int fd, uint64_t start, uint64_t len)
 	return 0;
 }
 
+static __inline__ int
+platform_discard_zeroes(int fd)
+{
+	return 0;
+}
+
 #endif	/* __XFS_FREEBSD_H__ */
@@ -21,6 +21,7 @@
 typedef int	intgen_t;
 typedef void	jdm_fshandle_t;		/* filesystem handle */
 typedef void	jdm_filehandle_t;	/* filehandle */
+typedef struct jdm_batch jdm_batch_t;	/* handles for the batch calls */
 
 struct xfs_bstat;
 struct attrlist_cursor;
@@ -55,6 +56,67 @@ jdm_attr_multi(	jdm_fshandle_t *fshp,
 		xfs_bstat_t *statp,
 		char *bufp, int rtrvcnt, int flags);
 
+/*
+ * Batched jdm_open, jdm_readlink and jdm_attr_multi for a bulkstat buffer
+ * of count inodes.  Each stores one result per inode (the fd, link length
+ * or 0, or negative errno) and returns how many inodes succeeded.
+ */
+extern jdm_batch_t *
+jdm_batch_alloc( jdm_fshandle_t *fshandlep,
+		 int size);			/* inodes per batch */
+
+extern void
+jdm_batch_free( jdm_batch_t *bp);
+
+extern int
+jdm_open_batch( jdm_batch_t *bp,
+		struct xfs_bstat *sp, int count,
+		intgen_t oflags, intgen_t *fdp);
+
+extern int
+jdm_readlink_batch( jdm_batch_t *bp,
+		    struct xfs_bstat *sp, int count,
+		    char *bufp, size_t bufsz,	/* count buffers of bufsz */
+		    intgen_t *lenp);
+
+extern int
+jdm_attr_multi_batch( jdm_batch_t *bp,
+		      struct xfs_bstat *sp, int count,
+		      char **bufp, int rtrvcnt, int flags,
+		      int *rvalp);
+
+/*
+ * All the attributes of a batch of inodes, fetched by nthreads threads.
+ * nsflags says which namespaces to fetch.  xap has one entry per inode,
+ * with its error (0 or an errno) and its attributes, and is released with
+ * jdm_xattrs_free.  Returns how many inodes were fetched without error.
+ */
+#define JDM_XATTR_USER		0x1
+#define JDM_XATTR_ROOT		0x2
+#define JDM_XATTR_SECURE	0x4
+
+typedef struct jdm_xattr {
+	char	*name;
+	char	*value;
+	int	valuelen;
+	int	flags;			/* namespace, as ATTR_ROOT/ATTR_SECURE */
+} jdm_xattr_t;
+
+typedef struct jdm_xattrs {
+	int		error;
+	int		count;
+	jdm_xattr_t	*attrs;
+} jdm_xattrs_t;
+
+extern int
+jdm_attr_get_batch( jdm_batch_t *bp,
+		    struct xfs_bstat *sp, int count,
+		    int nsflags, int nthreads,
+		    jdm_xattrs_t *xap);
+
+extern void
+jdm_xattrs_free( jdm_xattrs_t *xap, int count);
+
 extern intgen_t
 jdm_attr_list(	jdm_fshandle_t *fshp,
 		xfs_bstat_t *statp,
@@ -24,22 +24,30 @@
 #define KM_MAYFAIL	0x0008u
 #define KM_LARGE	0x0010u
 
+struct kmem_magazine;
+
 typedef struct kmem_zone {
 	int	zone_unitsize;	/* Size in bytes of zone unit           */
 	char	*zone_name;	/* tag name                             */
 	int	allocated;	/* debug: How many currently allocated  */
+	int	zone_index;	/* slot in the table of zones		*/
+	unsigned long zone_gen;	/* tells reused slots apart		*/
+	pthread_mutex_t zone_lock;	/* protects the depot		*/
+	struct kmem_magazine *zone_full;  /* depot: magazines with objects */
+	struct kmem_magazine *zone_empty; /* depot: empty magazines	*/
+	int	zone_nfull;
+	__uint64_t zone_allocs;	/* stats, folded in from the threads	*/
+	__uint64_t zone_frees;
+	__uint64_t zone_mallocs;	/* objects that missed the caches */
+	__uint64_t zone_exchanges;	/* trips to the depot		*/
 } kmem_zone_t;
 
 extern kmem_zone_t *kmem_zone_init(int, char *);
+extern void	kmem_zone_destroy(kmem_zone_t *);
 extern void	*kmem_zone_alloc(kmem_zone_t *, int);
 extern void	*kmem_zone_zalloc(kmem_zone_t *, int);
-
-static inline void
-kmem_zone_free(kmem_zone_t *zone, void *ptr)
-{
-	zone->allocated--;
-	free(ptr);
-}
+extern void	kmem_zone_free(kmem_zone_t *, void *);
+extern void	kmem_zone_report(FILE *);
 
 extern void	*kmem_alloc(size_t, int);
 extern void	*kmem_zalloc(size_t, int);
@@ -26,6 +26,7 @@
 #include "list.h"
 #include "hlist.h"
 #include "cache.h"
+#include "mdump.h"
 #include "bitops.h"
 #include "kmem.h"
 #include "radix-tree.h"
@@ -45,9 +46,13 @@
 /* CRC stuff, buffer API dependent on it */
 extern uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len);
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
+extern void crc32c_le_multi(uint32_t *crc, unsigned char const * const *bufs,
+			    unsigned int nr, size_t offset, size_t len);
 
 #define crc32(c,p,l)	crc32_le((c),(unsigned char const *)(p),(l))
 #define crc32c(c,p,l)	crc32c_le((c),(unsigned char const *)(p),(l))
+#define crc32c_multi(c,b,n,o,l) \
+	crc32c_le_multi((c),(unsigned char const * const *)(b),(n),(o),(l))
 
 #include "xfs_cksum.h"
 
@@ -138,12 +143,20 @@ extern int	libxfs_init (libxfs_init_t *);
 extern void	libxfs_destroy (void);
 extern int	libxfs_device_to_fd (dev_t);
 extern dev_t	libxfs_device_open (char *, int, int, int);
+extern dev_t	libxfs_device_open_mem (const char *, off64_t);
 extern void	libxfs_device_zero(struct xfs_buftarg *, xfs_daddr_t, uint);
 extern void	libxfs_device_close (dev_t);
 extern int	libxfs_device_alignment (void);
+extern int	libxfs_device_is_metadump (dev_t);
+extern ssize_t	libxfs_device_pread (int, void *, size_t, off64_t);
 extern void	libxfs_report(FILE *);
 extern void	platform_findsizes(char *path, int fd, long long *sz, int *bsz);
+extern int	platform_preallocate(int fd, long long start, long long len);
 extern int	platform_nproc(void);
+extern int	platform_numa_nodes(void);
+extern int	platform_numa_node(void);
+extern int	platform_numa_bind(int node);
+extern int	platform_device_topology(int fd, int *rotational, int *ndevs);
 
 /* check or write log footer: specify device, log size in blocks & uuid */
 typedef char	*(libxfs_get_block_t)(char *, int, void *);
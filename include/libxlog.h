@@ -79,6 +79,7 @@ extern void xlog_panic(char *fmt,...);
 extern int	print_exit;
 extern int	print_skip_uuid;
 extern int	print_record_header;
+extern FILE	*print_output;
 
 /* libxfs parameters */
 extern libxfs_init_t	x;
@@ -130,6 +130,21 @@ platform_discard_blocks(int fd, uint64_t start, uint64_t len)
 	return 0;
 }
 
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES	_IO(0x12,124)
+#endif
+
+/* Do discarded blocks read back as zeroes? */
+static __inline__ int
+platform_discard_zeroes(int fd)
+{
+	unsigned int	zeroes = 0;
+
+	if (ioctl(fd, BLKDISCARDZEROES, &zeroes) < 0)
+		return 0;
+	return zeroes;
+}
+
 #if (__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ <= 1))
 # define constpp	const char * const *
 #else
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef __MDUMP_H__
+#define __MDUMP_H__
+
+/*
+ * Read only access to a version 2 metadump, or a full dump and a chain of
+ * deltas taken against it, as if it was the filesystem it was taken from.
+ * Blocks that aren't in the dump read back as zeroes.
+ */
+struct mdump;
+
+extern struct mdump	*mdump_open(int fd, char *path);
+extern struct mdump	*mdump_open_chain(int nfiles, char **paths);
+extern void		mdump_close(struct mdump *md);
+extern ssize_t		mdump_pread(struct mdump *md, void *buf, size_t len,
+				    off64_t offset);
+extern long long	mdump_size(struct mdump *md);
+extern int		mdump_nfiles(struct mdump *md);
+extern __uint32_t	mdump_file_id(struct mdump *md, int file);
+extern int		mdump_extent(struct mdump *md, __uint32_t i,
+				     __uint64_t *daddr, __uint32_t *len);
+
+#endif	/* __MDUMP_H__ */
@@ -49,6 +49,7 @@ extern char *mtab_file;
 
 extern void fs_table_initialise(int, char *[], int, char *[]);
 extern void fs_table_destroy(void);
+extern void fs_table_load_projects(void);
 
 extern void fs_table_insert_project_path(char *__dir, uint __projid);
 
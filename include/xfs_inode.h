@@ -41,12 +41,18 @@ typedef struct xfs_inode {
 	struct xfs_ifork	i_df;		/* data fork */
 	struct xfs_trans	*i_transp;	/* ptr to owning transaction */
 	struct xfs_inode_log_item *i_itemp;	/* logging information */
+	unsigned int		i_flags;	/* XFS_I* flags below */
 	unsigned int		i_delayed_blks;	/* count of delay alloc blks */
 	struct xfs_icdinode	i_d;		/* most of ondisk inode */
 	xfs_fsize_t		i_size;		/* in-memory size */
 	const struct xfs_dir_ops *d_ops;	/* directory ops vector */
 } xfs_inode_t;
 
+/*
+ * In-core inode flags.
+ */
+#define XFS_ISTALE	(1 << 1)	/* in-core copy no longer valid */
+
 /*
  * For regular files we only update the on-disk filesize when actually
  * writing data back to disk.  Until then only the copy in the VFS inode
@@ -97,9 +103,16 @@ extern void	libxfs_trans_ichgtime(struct xfs_trans *,
 extern int	libxfs_iflush_int (struct xfs_inode *, struct xfs_buf *);
 
 /* Inode Cache Interfaces */
+extern struct cache	*libxfs_icache;
+extern struct cache_operations	libxfs_icache_operations;
+extern int	libxfs_ihash_size;	/* 0 disables the inode cache */
+
 extern int	libxfs_iget(struct xfs_mount *, struct xfs_trans *, xfs_ino_t,
 				uint, struct xfs_inode **, xfs_daddr_t);
+extern int	libxfs_iget_batch(struct xfs_mount *, struct xfs_trans *,
+				xfs_ino_t *, int, struct xfs_inode **);
 extern void	libxfs_iput(struct xfs_inode *);
+extern void	libxfs_icache_purge(void);
 
 #define IRELE(ip) libxfs_iput(ip)
 
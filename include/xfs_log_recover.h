@@ -28,6 +28,18 @@
 #define XLOG_RHASH(tid)	\
 	((((__uint32_t)tid)>>XLOG_RHASH_SHIFT) & (XLOG_RHASH_SIZE-1))
 
+/*
+ * Transactions being recovered, hashed by tid.  The table starts out with
+ * XLOG_RHASH_SIZE buckets and doubles whenever there are more than two
+ * open transactions a bucket, so a log with thousands of interleaved
+ * transactions doesn't make every op header walk a long chain.
+ */
+struct xlog_rhash {
+	struct hlist_head	*heads;
+	unsigned int		bits;
+	unsigned int		count;		/* transactions in the table */
+};
+
 #define XLOG_MAX_REGIONS_IN_ITEM   (XFS_MAX_BLOCKSIZE / XFS_BLF_CHUNK / 2 + 1)
 
 
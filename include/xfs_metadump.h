@@ -29,4 +29,88 @@ typedef struct xfs_metablock {
 	/* followed by an array of xfs_daddr_t */
 } xfs_metablock_t;
 
+/*
+ * Version 2 dumps start with an xfs_md2_hdr_t followed by chunks, each an
+ * xfs_md2_chunk_t, mc_nextents extents and mc_clen bytes of the blocks in
+ * those extents, compressed as given by mc_compression.  After the last
+ * chunk comes an xfs_md2_index_hdr_t and one xfs_md2_index_t for every
+ * chunk, and the dump ends in an xfs_md2_tail_t pointing back at the index
+ * header, so a reader can find the chunk holding any block without reading
+ * the whole dump.  A dump without the index is incomplete.
+ *
+ * A delta dump has XFS_MD2_FLAG_DELTA set and an xfs_md2_delta_t right
+ * after the header, naming the chain of dumps it was taken against: a full
+ * dump followed by the deltas already taken against it, oldest first.  A
+ * dump is named by the crc32c of its index header and entries.  The delta
+ * only holds the blocks that differ from what the chain restores to, and
+ * XFS_MD2_COMP_ZERO chunks for the blocks of the chain that are no longer
+ * in the filesystem's metadata; those chunks have no payload and their
+ * extents restore as zeroes.  Full dumps use them for a zeroed clean log.
+ *
+ * Disk addresses and lengths are in 512 byte basic blocks.
+ */
+#define	XFS_MD2_MAGIC		0x584d4432	/* 'XMD2' */
+#define	XFS_MD2_CHUNK_MAGIC	0x584d4443	/* 'XMDC' */
+#define	XFS_MD2_INDEX_MAGIC	0x584d4449	/* 'XMDI' */
+#define	XFS_MD2_TAIL_MAGIC	0x584d4454	/* 'XMDT' */
+#define	XFS_MD2_DELTA_MAGIC	0x584d4444	/* 'XMDD' */
+
+#define	XFS_MD2_VERSION		2
+#define	XFS_MD2_MAX_CHUNK	(1 << 24)	/* max uncompressed chunk */
+
+#define	XFS_MD2_MAX_CHAIN	1024		/* max dumps a delta is against */
+
+#define	XFS_MD2_FLAG_DELTA	0x1
+
+#define	XFS_MD2_COMP_NONE	0
+#define	XFS_MD2_COMP_ZLIB	1
+#define	XFS_MD2_COMP_ZERO	2
+
+typedef struct xfs_md2_hdr {
+	__be32		mh_magic;
+	__be32		mh_version;
+	__be32		mh_flags;
+	__uint8_t	mh_blocklog;		/* always BBSHIFT */
+	__uint8_t	mh_reserved[3];
+} xfs_md2_hdr_t;
+
+typedef struct xfs_md2_delta {
+	__be32		md_magic;
+	__be32		md_count;		/* dumps in the chain */
+	/* followed by md_count __be32 dump ids, oldest first */
+} xfs_md2_delta_t;
+
+typedef struct xfs_md2_chunk {
+	__be32		mc_magic;
+	__be32		mc_nextents;
+	__be32		mc_dlen;		/* bytes of blocks */
+	__be32		mc_clen;		/* bytes stored for them */
+	__uint8_t	mc_compression;
+	__uint8_t	mc_reserved[7];
+} xfs_md2_chunk_t;
+
+typedef struct xfs_md2_extent {
+	__be64		me_daddr;
+	__be32		me_len;
+	__be32		me_reserved;
+} xfs_md2_extent_t;
+
+typedef struct xfs_md2_index_hdr {
+	__be32		mi_magic;
+	__be32		mi_reserved;
+	__be64		mi_count;		/* index entries that follow */
+} xfs_md2_index_hdr_t;
+
+typedef struct xfs_md2_index {
+	__be64		mi_offset;		/* of the chunk in the dump */
+	__be64		mi_first;		/* lowest daddr in the chunk */
+	__be64		mi_last;		/* one past the highest */
+} xfs_md2_index_t;
+
+typedef struct xfs_md2_tail {
+	__be64		mt_index;		/* offset of the index header */
+	__be32		mt_magic;
+	__be32		mt_reserved;
+} xfs_md2_tail_t;
+
 #endif /* _XFS_METADUMP_H_ */
@@ -23,6 +23,7 @@ struct xfs_inode;
 struct xfs_buftarg;
 struct xfs_dir_ops;
 struct xfs_da_geometry;
+struct xfs_alloc_index;
 
 /*
  * Define a user-level mount structure with all we need
@@ -38,6 +39,8 @@ typedef struct xfs_mount {
 	xfs_agnumber_t		m_agfrotor;	/* last ag where space found */
 	xfs_agnumber_t		m_agirotor;	/* last ag dir inode alloced */
 	xfs_agnumber_t		m_maxagi;	/* highest inode alloc group */
+	xfs_agnumber_t		m_maxaginodeok;	/* AGs with 32 bit inode numbers */
+	xfs_agnumber_t		m_maxagmeta;	/* AGs preferred for metadata */
 	uint			m_rsumlevels;	/* rt summary levels */
 	uint			m_rsumsize;	/* size of rt summary, bytes */
 	struct xfs_inode	*m_rbmip;	/* pointer to bitmap inode */
@@ -130,6 +133,7 @@ typedef struct xfs_perag {
 	xfs_agino_t	pagl_leftrec;
 	xfs_agino_t	pagl_rightrec;
 	int		pagb_count;	/* pagb slots in use */
+	struct xfs_alloc_index *pagf_index;	/* free space summary */
 } xfs_perag_t;
 
 #define LIBXFS_MOUNT_DEBUGGER		0x0001
@@ -139,10 +143,12 @@ typedef struct xfs_perag {
 #define LIBXFS_MOUNT_ATTR2		0x0010
 
 #define LIBXFS_BHASHSIZE(sbp) 		(1<<10)
+#define LIBXFS_IHASHSIZE(sbp) 		(1<<9)
 
 extern xfs_mount_t	*libxfs_mount (xfs_mount_t *, xfs_sb_t *,
 				dev_t, dev_t, dev_t, int);
 extern void	libxfs_umount (xfs_mount_t *);
+extern struct xfs_perag	*libxfs_perag_alloc(xfs_mount_t *, xfs_agnumber_t);
 extern void	libxfs_rtmount_destroy (xfs_mount_t *);
 
 #endif	/* __XFS_MOUNT_H__ */
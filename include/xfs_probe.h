@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef __XFS_PROBE_H__
+#define __XFS_PROBE_H__
+
+/*
+ * Static user space probes, in the "xfsprogs" provider, for bpftrace,
+ * perf and systemtap to attach to, e.g.:
+ *
+ *	bpftrace -e 'usdt:/sbin/xfs_repair:xfsprogs:buf_read { ... }'
+ *
+ * With <sys/sdt.h> each probe is a single nop plus an ELF note describing
+ * where its arguments live, so they cost nothing until something attaches
+ * to them; without it they compile away.  Arguments must not have side
+ * effects, as they are only evaluated when probes are built in.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define xfs_probe0(name)			\
+	DTRACE_PROBE(xfsprogs, name)
+#define xfs_probe1(name, a)			\
+	DTRACE_PROBE1(xfsprogs, name, a)
+#define xfs_probe2(name, a, b)			\
+	DTRACE_PROBE2(xfsprogs, name, a, b)
+#define xfs_probe3(name, a, b, c)		\
+	DTRACE_PROBE3(xfsprogs, name, a, b, c)
+#define xfs_probe4(name, a, b, c, d)		\
+	DTRACE_PROBE4(xfsprogs, name, a, b, c, d)
+#else
+#define xfs_probe0(name)			((void) 0)
+#define xfs_probe1(name, a)			((void) 0)
+#define xfs_probe2(name, a, b)			((void) 0)
+#define xfs_probe3(name, a, b, c)		((void) 0)
+#define xfs_probe4(name, a, b, c, d)		((void) 0)
+#endif
+
+#endif	/* __XFS_PROBE_H__ */
@@ -32,9 +32,13 @@ typedef struct xfs_log_item {
 	struct xfs_log_item_desc	*li_desc;	/* ptr to current desc*/
 	struct xfs_mount		*li_mountp;	/* ptr to fs mount */
 	uint				li_type;	/* item type */
+	uint				li_flags;	/* misc flags */
 	xfs_lsn_t			li_lsn;
+	struct list_head		li_ail;		/* batched items */
 } xfs_log_item_t;
 
+#define XFS_LI_IN_AIL	0x1	/* committed, waiting for the batch flush */
+
 typedef struct xfs_inode_log_item {
 	xfs_log_item_t		ili_item;		/* common portion */
 	struct xfs_inode	*ili_inode;		/* inode pointer */
@@ -86,6 +90,9 @@ typedef struct xfs_trans {
 void	xfs_trans_init(struct xfs_mount *);
 int	xfs_trans_roll(struct xfs_trans **, struct xfs_inode *);
 
+extern int	libxfs_trans_batch;
+void	libxfs_trans_batch_flush(void);
+
 xfs_trans_t	*libxfs_trans_alloc(struct xfs_mount *, int);
 int	libxfs_trans_reserve(struct xfs_trans *, struct xfs_trans_res *,
 				     uint, uint);
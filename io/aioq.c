@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <aio.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/*
+ * Queue depth I/O for pread -A and pwrite -A: keeps up to aio_depth POSIX
+ * AIO requests in flight, each with its own buffer.  A request is charged
+ * the time from its submission until it is seen to have completed.
+ *
+ * glibc runs the requests for one file descriptor one after the other, so
+ * every slot gets a dup of the file descriptor to let them run in parallel.
+ */
+int		aio_depth;
+
+struct aio_slot {
+	struct aiocb	cb;
+	struct timeval	start;
+	int		fd;		/* dup of the file being used */
+	int		busy;
+};
+
+static struct aio_slot	*slots;
+static int		nslots;
+static int		inflight;
+static int		done;		/* a request came up short */
+static struct aio_stats	stats;
+
+int
+aioq_init(
+	int		fd,
+	size_t		bsize,
+	int		uflag,
+	unsigned int	seed)
+{
+	slots = calloc(aio_depth, sizeof(*slots));
+	if (!slots) {
+		perror("calloc");
+		return -1;
+	}
+	for (nslots = 0; nslots < aio_depth; nslots++) {
+		struct aio_slot	*s = &slots[nslots];
+
+		s->cb.aio_buf = memalign(pagesize, bsize);
+		if (!s->cb.aio_buf) {
+			perror("memalign");
+			goto out_free;
+		}
+		s->fd = dup(fd);
+		if (s->fd < 0) {
+			perror("dup");
+			free((void *)s->cb.aio_buf);
+			goto out_free;
+		}
+		if (!uflag)
+			memset((void *)s->cb.aio_buf, seed, bsize);
+	}
+
+#ifdef __GLIBC__
+	{
+		struct aioinit	init = { 0 };
+
+		init.aio_threads = aio_depth;
+		init.aio_num = aio_depth;
+		aio_init(&init);
+	}
+#endif
+
+	inflight = 0;
+	done = 0;
+	memset(&stats, 0, sizeof(stats));
+	return 0;
+
+out_free:
+	aioq_free();
+	return -1;
+}
+
+void
+aioq_free(void)
+{
+	for (; nslots > 0; nslots--) {
+		close(slots[nslots - 1].fd);
+		free((void *)slots[nslots - 1].cb.aio_buf);
+	}
+	free(slots);
+	slots = NULL;
+}
+
+static int
+aioq_complete(
+	struct aio_slot	*s)
+{
+	struct timeval	t;
+	double		usec;
+	ssize_t		bytes;
+	int		error;
+
+	error = aio_error(&s->cb);
+	bytes = aio_return(&s->cb);
+	s->busy = 0;
+	inflight--;
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	if (bytes < s->cb.aio_nbytes)
+		done = 1;
+	if (bytes <= 0)
+		return 0;
+
+	gettimeofday(&t, NULL);
+	t = tsub(t, s->start);
+	usec = t.tv_sec * 1000000.0 + t.tv_usec;
+	if (!stats.ops || usec < stats.min_usec)
+		stats.min_usec = usec;
+	if (usec > stats.max_usec)
+		stats.max_usec = usec;
+	stats.sum_usec += usec;
+	if (io_hist)
+		hist_add(io_hist, s->cb.aio_offset,
+			(unsigned long long)(usec * 1000));
+	stats.ops++;
+	stats.total += bytes;
+	return 0;
+}
+
+/* wait for at least one request to complete, or all of them */
+static int
+aioq_reap(
+	int		all)
+{
+	const struct aiocb **list;
+	int		error = 0;
+	int		n;
+	int		i;
+
+	list = alloca(nslots * sizeof(*list));
+	while (inflight) {
+		for (i = n = 0; i < nslots; i++)
+			if (slots[i].busy)
+				list[n++] = &slots[i].cb;
+		if (aio_suspend(list, n, NULL) < 0 && errno != EINTR) {
+			perror("aio_suspend");
+			return -1;
+		}
+		for (i = n = 0; i < nslots; i++) {
+			if (!slots[i].busy ||
+			    aio_error(&slots[i].cb) == EINPROGRESS)
+				continue;
+			if (aioq_complete(&slots[i]) < 0 && !error)
+				error = errno;
+			n++;
+		}
+		if (n && !all)
+			break;
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queue a read or write of len bytes at offset.  Returns len, or 0 once an
+ * earlier request came up short so the caller stops, or -1 with errno set
+ * if one failed.  The bytes and ops actually done are counted separately,
+ * see aioq_finish().
+ */
+ssize_t
+aioq_rw(
+	off64_t		offset,
+	size_t		len,
+	int		write)
+{
+	struct aio_slot	*s;
+	int		i;
+
+	if (inflight == nslots && aioq_reap(0) < 0)
+		return -1;
+	if (done)
+		return 0;
+
+	for (i = 0; slots[i].busy; i++)
+		;
+	s = &slots[i];
+	s->cb.aio_fildes = s->fd;
+	s->cb.aio_offset = offset;
+	s->cb.aio_nbytes = len;
+	gettimeofday(&s->start, NULL);
+	if ((write ? aio_write(&s->cb) : aio_read(&s->cb)) < 0)
+		return -1;
+	s->busy = 1;
+	inflight++;
+	return len;
+}
+
+/* wait for everything queued so far, before an fsync in the middle of a run */
+int
+aioq_drain(void)
+{
+	return aioq_reap(1);
+}
+
+/*
+ * Wait for everything queued and tear the queue down.  Returns the number
+ * of ops done and the bytes in *total instead of what the caller counted
+ * while queueing, or -1 if anything failed.
+ */
+int
+aioq_finish(
+	int		ops,
+	long long	*total,
+	struct aio_stats *sp)
+{
+	if (aioq_reap(1) < 0) {
+		perror(_("aio"));
+		ops = -1;
+	} else if (ops >= 0) {
+		ops = stats.ops;
+		*total = stats.total;
+	}
+	*sp = stats;
+	aioq_free();
+	return ops;
+}
+
+void
+aioq_report(
+	struct aio_stats *sp,
+	int		Cflag)
+{
+	double		avg = sp->ops ? sp->sum_usec / sp->ops : 0;
+
+	if (Cflag)
+		printf("%d,%.1f,%.1f,%.1f\n",
+			aio_depth, sp->min_usec, avg, sp->max_usec);
+	else
+		printf(_("queue depth %d, completion min/avg/max "
+			 "%.1f/%.1f/%.1f usec\n"),
+			aio_depth, sp->min_usec, avg, sp->max_usec);
+}
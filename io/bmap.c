@@ -21,6 +21,9 @@
 #include "init.h"
 #include "io.h"
 
+#define BMAP_MIN_BATCH	32
+#define BMAP_MAX_BATCH	(64 * 1024)
+
 static cmdinfo_t bmap_cmd;
 
 static void
@@ -42,9 +45,12 @@ bmap_help(void)
 " All the file offsets and disk blocks are in units of 512-byte blocks.\n"
 " -a -- prints the attribute fork map instead of the data fork.\n"
 " -d -- suppresses a DMAPI read event, offline portions shown as holes.\n"
+" -e -- shows delayed allocations as such instead of flushing them first.\n"
 " -l -- also displays the length of each extent in 512-byte blocks.\n"
 " -n -- query n extents.\n"
 " -p -- obtain all unwritten extents as well (w/ -v show which are unwritten.)\n"
+" -s -- only prints the number of extents and holes and a histogram of the\n"
+"       extent lengths, for files with too many extents to list.\n"
 " -v -- Verbose information, specify ag info.  Show flags legend on 2nd -v\n"
 " Note: the bmap for non-regular files can be obtained provided the file\n"
 " was opened appropriately (in particular, must be opened read-only).\n"
@@ -63,21 +69,126 @@ numlen(
 	return (len == 0 ? 1 : len);
 }
 
+/*
+ * Print one extent, the n'th, in the plain format.  Holes have a block of
+ * -1 and delayed allocations -2.
+ */
+static void
+bmap_print_plain(
+	struct getbmapx		*bmv,
+	int			n,
+	int			lflag)
+{
+	printf("\t%d: [%lld..%lld]: ", n,
+		(long long) bmv->bmv_offset,
+		(long long)(bmv->bmv_offset + bmv->bmv_length - 1LL));
+	if (bmv->bmv_block == -1)
+		printf(_("hole"));
+	else if (bmv->bmv_block == -2)
+		printf(_("delalloc"));
+	else
+		printf("%lld..%lld",
+			(long long) bmv->bmv_block,
+			(long long)(bmv->bmv_block + bmv->bmv_length - 1LL));
+	if (lflag)
+		printf(_(" %lld blocks\n"), (long long)bmv->bmv_length);
+	else
+		printf("\n");
+}
+
+void
+map_summary_init(
+	struct map_summary	*ms)
+{
+	memset(ms, 0, sizeof(*ms));
+	ms->next_block = -1;
+}
+
+/* an extent of len 512-byte blocks at block, or at -1 if not allocated */
+void
+map_summary_extent(
+	struct map_summary	*ms,
+	long long		block,
+	long long		len)
+{
+	long long		l;
+	int			b = 0;
+
+	for (l = len; l > 1 && b < MAP_SUMMARY_BUCKETS - 1; l >>= 1)
+		b++;
+	ms->extents++;
+	ms->blocks += len;
+	ms->hist[b]++;
+	ms->hist_blocks[b] += len;
+	if (block < 0) {
+		ms->next_block = -1;
+		return;
+	}
+	if (block == ms->next_block)
+		ms->contig++;
+	ms->next_block = block + len;
+}
+
+void
+map_summary_hole(
+	struct map_summary	*ms)
+{
+	ms->holes++;
+	ms->next_block = -1;
+}
+
+void
+map_summary_print(
+	struct map_summary	*ms)
+{
+	char			lbuf[48];
+	int			b;
+
+	printf(_(" extents: %lld  holes: %lld  blocks: %lld\n"),
+		ms->extents, ms->holes, ms->blocks);
+	if (!ms->extents)
+		return;
+	printf(_(" extents following on from the one before: %lld (%.1f%%)\n"),
+		ms->contig, 100.0 * ms->contig / ms->extents);
+	printf(_(" %-20s %12s %14s\n"), _("length (blocks)"), _("extents"),
+		_("blocks"));
+	for (b = 0; b < MAP_SUMMARY_BUCKETS; b++) {
+		if (!ms->hist[b])
+			continue;
+		if (b == MAP_SUMMARY_BUCKETS - 1)
+			snprintf(lbuf, sizeof(lbuf), "%lld+", 1LL << b);
+		else if (b == 0)
+			snprintf(lbuf, sizeof(lbuf), "1");
+		else
+			snprintf(lbuf, sizeof(lbuf), "%lld-%lld", 1LL << b,
+				 (2LL << b) - 1);
+		printf(" %-20s %12lld %14lld\n", lbuf, ms->hist[b],
+			ms->hist_blocks[b]);
+	}
+}
+
 int
 bmap_f(
 	int			argc,
 	char			**argv)
 {
 	struct fsxattr		fsx;
-	struct getbmapx		*map;
+	struct getbmapx		*map = NULL;
+	struct getbmapx		*batch;
+	struct getbmapx		*newmap;
 	struct xfs_fsop_geom	fsgeo;
-	int			map_size;
-	int			loop = 0;
+	struct map_summary	ms;
+	long long		offset = 0;
+	int			map_size = 0;
+	int			batch_size;
+	int			nent = 0;	/* extents seen so far */
+	int			n;
 	int			flg = 0;
 	int			aflag = 0;
 	int			lflag = 0;
 	int			nflag = 0;
 	int			pflag = 0;
+	int			sflag = 0;
 	int			vflag = 0;
 	int			is_rt = 0;
 	int			bmv_iflags = 0;	/* flags for XFS_IOC_GETBMAPX */
@@ -85,7 +196,7 @@ bmap_f(
 	int			c;
 	int			egcnt;
 
-	while ((c = getopt(argc, argv, "adln:pv")) != EOF) {
+	while ((c = getopt(argc, argv, "adeln:psv")) != EOF) {
 		switch (c) {
 		case 'a':	/* Attribute fork. */
 			bmv_iflags |= BMV_IF_ATTRFORK;
@@ -101,11 +212,18 @@ bmap_f(
 		/* do not recall possibly offline DMAPI files */
 			bmv_iflags |= BMV_IF_NO_DMAPI_READ;
 			break;
+		case 'e':
+		/* report delayed allocations instead of flushing them */
+			bmv_iflags |= BMV_IF_DELALLOC;
+			break;
 		case 'p':
 		/* report unwritten preallocated blocks */
 			pflag = 1;
 			bmv_iflags |= BMV_IF_PREALLOC;
 			break;
+		case 's':	/* Summary only */
+			sflag = 1;
+			break;
 		case 'v':	/* Verbose output */
 			vflag++;
 			break;
@@ -114,9 +232,10 @@ bmap_f(
 		}
 	}
 	if (aflag)
-		bmv_iflags &= ~(BMV_IF_PREALLOC|BMV_IF_NO_DMAPI_READ);
+		bmv_iflags &= ~(BMV_IF_PREALLOC|BMV_IF_NO_DMAPI_READ|
+				BMV_IF_DELALLOC);
 
-	if (vflag) {
+	if (vflag && !sflag) {
 		c = xfsctl(file->name, file->fd, XFS_IOC_FSGEOMETRY_V1, &fsgeo);
 		if (c < 0) {
 			fprintf(stderr,
@@ -143,126 +262,130 @@ bmap_f(
 		}
 	}
 
-	map_size = nflag ? nflag+2 : 32;	/* initial guess - 32 */
-	map = malloc(map_size*sizeof(*map));
-	if (map == NULL) {
+	batch_size = nflag ? min(nflag, BMAP_MAX_BATCH) : BMAP_MIN_BATCH;
+	batch = malloc((batch_size + 1) * sizeof(*batch));
+	if (batch == NULL) {
 		fprintf(stderr, _("%s: malloc of %d bytes failed.\n"),
-			progname, (int)(map_size * sizeof(*map)));
+			progname, (int)((batch_size + 1) * sizeof(*batch)));
 		exitcode = 1;
 		return 0;
 	}
+	if (sflag)
+		map_summary_init(&ms);
 
-
-/*	Try the xfsctl(XFS_IOC_GETBMAPX) for the number of extents specified
- *	by nflag, or the initial guess number of extents (32).
- *
- *	If there are more extents than we guessed, use xfsctl
- *	(XFS_IOC_FSGETXATTR[A]) to get the extent count, realloc some more
- *	space based on this count, and try again.
- *
- *	If the initial FGETBMAPX attempt returns EINVAL, this may mean
- *	that we tried the FGETBMAPX on a zero length file.  If we get
- *	EINVAL, check the length with fstat() and return "no extents"
- *	if the length == 0.
+/*	Walk the file with xfsctl(XFS_IOC_GETBMAPX), each call picking up
+ *	where the last one stopped, starting with room for the number of
+ *	extents specified by nflag, or 32.  The batches double in size up to
+ *	BMAP_MAX_BATCH, so that a file with a handful of extents costs one
+ *	small call and one with millions doesn't cost millions of calls or a
+ *	buffer big enough for all of them.  Only -v keeps the whole map, as
+ *	it needs all of it to size the columns before printing anything;
+ *	otherwise each batch is printed or summarised and thrown away.
  *
- *	Why not do the xfsctl(XFS_IOC_FSGETXATTR[A]) first?  Two reasons:
- *	(1)	The extent count may be wrong for a file with delayed
- *		allocation blocks.  The XFS_IOC_GETBMAPX forces the real
- *		allocation and fixes up the extent count.
- *	(2)	For XFS_IOC_GETBMAP[X] on a DMAPI file that has been moved
- *		offline by a DMAPI application (e.g., DMF) the
- *		XFS_IOC_FSGETXATTR only reflects the extents actually online.
- *		Doing XFS_IOC_GETBMAPX call first forces that data blocks online
- *		and then everything proceeds normally (see PV #545725).
+ *	If the first XFS_IOC_GETBMAPX returns EINVAL, this may mean that we
+ *	tried it on a zero length file.  If we get EINVAL, check the length
+ *	with fstat() and return "no extents" if the length == 0.
  *
- *		If you don't want this behavior on a DMAPI offline file,
- *		try the "-d" option which sets the BMV_IF_NO_DMAPI_READ
- *		iflag for XFS_IOC_GETBMAPX.
+ *	For XFS_IOC_GETBMAP[X] on a DMAPI file that has been moved offline
+ *	by a DMAPI application (e.g., DMF), the call forces the data blocks
+ *	online and then everything proceeds normally (see PV #545725).  If
+ *	you don't want this behavior on a DMAPI offline file, try the "-d"
+ *	option which sets the BMV_IF_NO_DMAPI_READ iflag.
  */
 
-	do {	/* loop a miximum of two times */
+	for (;;) {
+		memset(batch, 0, sizeof(*batch));	/* zero header */
 
-		memset(map, 0, sizeof(*map));	/* zero header */
+		batch->bmv_offset = offset;
+		batch->bmv_length = -1;
+		batch->bmv_count = batch_size + 1;
+		batch->bmv_iflags = bmv_iflags;
 
-		map->bmv_length = -1;
-		map->bmv_count = map_size;
-		map->bmv_iflags = bmv_iflags;
-
-		i = xfsctl(file->name, file->fd, XFS_IOC_GETBMAPX, map);
+		i = xfsctl(file->name, file->fd, XFS_IOC_GETBMAPX, batch);
 		if (i < 0) {
-			if (   errno == EINVAL
+			if (   errno == EINVAL && nent == 0
 			    && !aflag && filesize() == 0) {
 				break;
 			} else	{
 				fprintf(stderr, _("%s: xfsctl(XFS_IOC_GETBMAPX)"
 					" iflags=0x%x [\"%s\"]: %s\n"),
-					progname, map->bmv_iflags, file->name,
+					progname, batch->bmv_iflags, file->name,
 					strerror(errno));
-				free(map);
-				exitcode = 1;
-				return 0;
+				goto out_error;
 			}
 		}
+		n = batch->bmv_entries;
 		if (nflag)
-			break;
-		if (map->bmv_entries < map->bmv_count-1)
-			break;
-		/* Get number of extents from xfsctl XFS_IOC_FSGETXATTR[A]
-		 * syscall.
-		 */
-		i = xfsctl(file->name, file->fd, aflag ?
-				XFS_IOC_FSGETXATTRA : XFS_IOC_FSGETXATTR, &fsx);
-		if (i < 0) {
-			fprintf(stderr, "%s: xfsctl(XFS_IOC_FSGETXATTR%s) "
-				"[\"%s\"]: %s\n", progname, aflag ? "A" : "",
-				file->name, strerror(errno));
-			free(map);
-			exitcode = 1;
-			return 0;
-		}
-		if (2 * fsx.fsx_nextents > map_size) {
-			map_size = 2 * fsx.fsx_nextents + 1;
-			map = realloc(map, map_size*sizeof(*map));
-			if (map == NULL) {
-				fprintf(stderr,
-					_("%s: cannot realloc %d bytes\n"),
-					progname, (int)(map_size*sizeof(*map)));
-				exitcode = 1;
-				return 0;
+			n = min(n, nflag - nent);
+
+		if (vflag && !sflag) {
+			if (nent + n + 1 > map_size) {
+				map_size = max(2 * map_size, nent + n + 1);
+				newmap = realloc(map, map_size * sizeof(*map));
+				if (newmap == NULL) {
+					fprintf(stderr,
+						_("%s: cannot realloc %d bytes\n"),
+						progname,
+						(int)(map_size * sizeof(*map)));
+					goto out_error;
+				}
+				map = newmap;
+			}
+			memcpy(&map[nent + 1], &batch[1], n * sizeof(*map));
+		} else {
+			for (i = 1; i <= n; i++) {
+				if (sflag) {
+					if (batch[i].bmv_block == -1)
+						map_summary_hole(&ms);
+					else
+						map_summary_extent(&ms,
+							batch[i].bmv_block,
+							batch[i].bmv_length);
+					continue;
+				}
+				if (nent == 0 && i == 1)
+					printf("%s:\n", file->name);
+				bmap_print_plain(&batch[i], nent + i - 1,
+						 lflag);
 			}
 		}
-	} while (++loop < 2);
-	if (!nflag) {
-		if (map->bmv_entries <= 0) {
-			printf(_("%s: no extents\n"), file->name);
-			free(map);
-			return 0;
-		}
-	}
-	egcnt = nflag ? min(nflag, map->bmv_entries) : map->bmv_entries;
-	printf("%s:\n", file->name);
-	if (!vflag) {
-		for (i = 0; i < egcnt; i++) {
-			printf("\t%d: [%lld..%lld]: ", i,
-				(long long) map[i + 1].bmv_offset,
-				(long long)(map[i + 1].bmv_offset +
-				map[i + 1].bmv_length - 1LL));
-			if (map[i + 1].bmv_block == -1)
-				printf(_("hole"));
-			else {
-				printf("%lld..%lld",
-					(long long) map[i + 1].bmv_block,
-					(long long)(map[i + 1].bmv_block +
-						map[i + 1].bmv_length - 1LL));
+		nent += n;
 
+		if (n == 0 || batch->bmv_entries < batch->bmv_count - 1 ||
+		    (batch[n].bmv_oflags & BMV_OF_LAST) ||
+		    (nflag && nent >= nflag))
+			break;
+		offset = batch[n].bmv_offset + batch[n].bmv_length;
+		if (batch_size < BMAP_MAX_BATCH && !nflag) {
+			batch_size *= 2;
+			newmap = realloc(batch, (batch_size + 1) * sizeof(*batch));
+			if (newmap == NULL) {
+				fprintf(stderr, _("%s: cannot realloc %d bytes\n"),
+					progname,
+					(int)((batch_size + 1) * sizeof(*batch)));
+				goto out_error;
 			}
-			if (lflag)
-				printf(_(" %lld blocks\n"),
-					(long long)map[i+1].bmv_length);
-			else
-				printf("\n");
+			batch = newmap;
 		}
-	} else {
+	}
+	free(batch);
+	batch = NULL;
+
+	if (nent == 0 && !nflag) {
+		printf(_("%s: no extents\n"), file->name);
+		goto out;
+	}
+	if (sflag) {
+		printf("%s:\n", file->name);
+		map_summary_print(&ms);
+		goto out;
+	}
+	if (!vflag && nent == 0)
+		printf("%s:\n", file->name);
+	if (vflag) {
+		egcnt = nent;
+		printf("%s:\n", file->name);
+
 		/*
 		 * Verbose mode displays:
 		 *   extent: [startoffset..endoffset]: startblock..endblock \
@@ -281,7 +404,8 @@ bmap_f(
 		int	agno;
 		off64_t agoff, bbperag;
 		int	foff_w, boff_w, aoff_w, tot_w, agno_w;
-		char	rbuf[32], bbuf[32], abuf[32];
+		/* two 20 digit numbers and "[..]:" */
+		char	rbuf[48], bbuf[48], abuf[48];
 		int	sunit, swidth;
 
 		foff_w = boff_w = aoff_w = MINRANGE_WIDTH;
@@ -307,7 +431,7 @@ bmap_f(
 				map[i + 1].bmv_length - 1LL));
 			if (map[i + 1].bmv_oflags & BMV_OF_PREALLOC)
 				flg = 1;
-			if (map[i + 1].bmv_block == -1) {
+			if (map[i + 1].bmv_block < 0) {
 				foff_w = max(foff_w, strlen(rbuf));
 				tot_w = max(tot_w,
 					numlen(map[i+1].bmv_length));
@@ -372,11 +496,12 @@ bmap_f(
 				(long long) map[i + 1].bmv_offset,
 				(long long)(map[i + 1].bmv_offset +
 				map[i + 1].bmv_length - 1LL));
-			if (map[i + 1].bmv_block == -1) {
+			if (map[i + 1].bmv_block < 0) {
 				printf("%4d: %-*s %-*s %*s %-*s %*lld\n",
 					i,
 					foff_w, rbuf,
-					boff_w, _("hole"),
+					boff_w, map[i + 1].bmv_block == -1 ?
+						_("hole") : _("delalloc"),
 					agno_w, "",
 					aoff_w, "",
 					tot_w, (long long)map[i+1].bmv_length);
@@ -423,7 +548,14 @@ bmap_f(
 				NFLG+1, NFLG+1, FLG_ESW);
 		}
 	}
+out:
+	free(map);
+	return 0;
+
+out_error:
+	free(batch);
 	free(map);
+	exitcode = 1;
 	return 0;
 }
 
@@ -435,7 +567,7 @@ bmap_init(void)
 	bmap_cmd.argmin = 0;
 	bmap_cmd.argmax = -1;
 	bmap_cmd.flags = CMD_NOMAP_OK;
-	bmap_cmd.args = _("[-adlpv] [-n nx]");
+	bmap_cmd.args = _("[-adelpsv] [-n nx]");
 	bmap_cmd.oneline = _("print block mapping for an XFS file");
 	bmap_cmd.help = bmap_help;
 
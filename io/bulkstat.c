@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+static cmdinfo_t bulkstat_cmd;
+
+static void
+bulkstat_help(void)
+{
+	printf(_(
+"\n"
+" scans the inodes of the filesystem of the current file with bulkstat\n"
+" and reports how fast that went\n"
+"\n"
+" Example:\n"
+" 'bulkstat -b 8192 -T 4' - scan with 8192 inodes per call, the allocation\n"
+"                           groups split between 4 threads\n"
+"\n"
+" -b N -- ask for N entries per call (default 4096)\n"
+" -s ino -- start the scan at inode number ino\n"
+" -i   -- use XFS_IOC_FSINUMBERS instead, which returns inode chunks\n"
+" -T N -- split the allocation groups between N threads, each scanning\n"
+"         its own groups at the same time\n"
+"\n"));
+}
+
+struct bulkstat_args {
+	int		nent;
+	int		inumbers;
+	int		agino_log;	/* bits of an inode number in an AG */
+};
+
+/*
+ * Scan the inodes from start up to, but not including, end (0 for all of
+ * them).  Returns the number of calls made, and the inodes seen in *total.
+ */
+static int
+bulkstat_range(
+	__u64		start,
+	__u64		end,
+	int		nent,
+	int		inumbers,
+	long long	*total)
+{
+	xfs_fsop_bulkreq_t bulkreq;
+	xfs_bstat_t	*bstat = NULL;
+	xfs_inogrp_t	*igrp = NULL;
+	__u64		last = start ? start - 1 : 0;
+	__u64		ino;
+	int		count;
+	int		ops = 0;
+	int		i;
+
+	if (inumbers)
+		bulkreq.ubuffer = igrp = calloc(nent, sizeof(*igrp));
+	else
+		bulkreq.ubuffer = bstat = calloc(nent, sizeof(*bstat));
+	if (!bulkreq.ubuffer) {
+		perror("calloc");
+		return -1;
+	}
+	bulkreq.lastip = &last;
+	bulkreq.icount = nent;
+	bulkreq.ocount = &count;
+
+	*total = 0;
+	for (;;) {
+		if (xfsctl(file->name, file->fd, inumbers ?
+				XFS_IOC_FSINUMBERS : XFS_IOC_FSBULKSTAT,
+				&bulkreq) < 0) {
+			perror(inumbers ? "xfsctl(XFS_IOC_FSINUMBERS)" :
+					  "xfsctl(XFS_IOC_FSBULKSTAT)");
+			ops = -1;
+			break;
+		}
+		ops++;
+		if (count == 0)
+			break;
+		/* the last call can run into the next thread's groups */
+		for (i = 0; i < count; i++) {
+			ino = inumbers ? igrp[i].xi_startino : bstat[i].bs_ino;
+			if (end && ino >= end)
+				goto out;
+			*total += inumbers ? igrp[i].xi_alloccount : 1;
+		}
+	}
+out:
+	free(bulkreq.ubuffer);
+	return ops;
+}
+
+static int
+bulkstat_thread(
+	struct io_thread	*t)
+{
+	struct bulkstat_args	*args = t->arg;
+	__u64			start, end;
+
+	if (!t->count)
+		return 0;
+	/* each thread's offset and count are a range of AGs */
+	start = (__u64)t->offset << args->agino_log;
+	end = (__u64)(t->offset + t->count) << args->agino_log;
+	return bulkstat_range(start, end, args->nent, args->inumbers,
+			&t->total);
+}
+
+static void
+bulkstat_report(
+	const char	*what,
+	long long	total,
+	int		ops,
+	struct timeval	*tv,
+	int		Cflag)
+{
+	char		ts[64];
+
+	timestr(tv, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+	if (!Cflag)
+		printf(_("%s%lld inodes, %d calls; %s "
+			 "(%.1f inodes/sec and %.4f calls/sec)\n"),
+			what, total, ops, ts, tdiv((double)total, *tv),
+			tdiv((double)ops, *tv));
+	else	/* inodes,calls,time,inodes/sec,calls/sec */
+		printf("%s%lld,%d,%s,%.3f,%.3f\n",
+			what, total, ops, ts, tdiv((double)total, *tv),
+			tdiv((double)ops, *tv));
+}
+
+static int
+bulkstat_f(
+	int		argc,
+	char		**argv)
+{
+	struct io_thread *threads = NULL;
+	struct bulkstat_args args;
+	struct timeval	t1, t2;
+	long long	total;
+	__u64		start = 0;
+	char		*sp;
+	char		what[64];
+	int		Cflag = 0, qflag = 0, iflag = 0;
+	int		nent = 4096;
+	int		nthreads = 0;
+	int		c, i;
+
+	while ((c = getopt(argc, argv, "b:Ciqs:T:")) != EOF) {
+		switch (c) {
+		case 'b':
+			nent = strtol(optarg, &sp, 0);
+			if (!sp || sp == optarg || *sp || nent <= 0) {
+				printf(_("bad number of entries -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'i':
+			iflag = 1;
+			break;
+		case 'q':
+			qflag = 1;
+			break;
+		case 's':
+			start = strtoull(optarg, &sp, 0);
+			if (!sp || sp == optarg || *sp) {
+				printf(_("non-numeric inode -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
+		default:
+			return command_usage(&bulkstat_cmd);
+		}
+	}
+	if (optind != argc || (nthreads && start))
+		return command_usage(&bulkstat_cmd);
+
+	if (nthreads) {
+		xfs_fsop_geom_t	*geo = &file->geom;
+
+		threads = io_threads_alloc(nthreads, 0, 0, geo->agcount, 1);
+		if (!threads)
+			return 0;
+		args.nent = nent;
+		args.inumbers = iflag;
+		args.agino_log = 0;
+		while ((1ULL << args.agino_log) < geo->agblocks)
+			args.agino_log++;
+		for (i = geo->blocksize / geo->inodesize; i > 1; i >>= 1)
+			args.agino_log++;
+	}
+
+	gettimeofday(&t1, NULL);
+	if (nthreads) {
+		c = io_threads_run(threads, nthreads, bulkstat_thread, &args);
+		if (c == 0)
+			c = io_threads_sum(threads, nthreads, &total);
+	} else
+		c = bulkstat_range(start, 0, nent, iflag, &total);
+	if (c < 0) {
+		exitcode = 1;
+		goto done;
+	}
+	if (qflag)
+		goto done;
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+
+	/* Finally, report back -- -C gives a parsable format */
+	bulkstat_report("", total, c, &t2, Cflag);
+	for (i = 0; i < nthreads; i++) {
+		struct io_thread *t = &threads[i];
+
+		if (Cflag)	/* thread,first AG,AGs,... */
+			snprintf(what, sizeof(what), "%d,%lld,%lld,",
+				i, (long long)t->offset, t->count);
+		else
+			snprintf(what, sizeof(what),
+				_("thread %d: AGs %lld-%lld, "), i,
+				(long long)t->offset,
+				(long long)t->offset + t->count - 1);
+		bulkstat_report(what, t->total, t->ops, &t->time, Cflag);
+	}
+done:
+	free(threads);
+	return 0;
+}
+
+void
+bulkstat_init(void)
+{
+	bulkstat_cmd.name = "bulkstat";
+	bulkstat_cmd.cfunc = bulkstat_f;
+	bulkstat_cmd.argmin = 0;
+	bulkstat_cmd.argmax = -1;
+	bulkstat_cmd.flags = CMD_NOMAP_OK;
+	bulkstat_cmd.args = _("[-i] [-b nent] [-s ino | -T N]");
+	bulkstat_cmd.oneline =
+		_("time a bulkstat scan of the filesystem of the current file");
+	bulkstat_cmd.help = bulkstat_help;
+
+	if (expert)
+		add_command(&bulkstat_cmd);
+}
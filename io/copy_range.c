@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/* older kernel headers don't have the clone range ioctl */
+#ifndef FICLONERANGE
+struct file_clone_range {
+	__s64		src_fd;
+	__u64		src_offset;
+	__u64		src_length;
+	__u64		dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+static cmdinfo_t copy_range_cmd;
+
+static void
+copy_range_help(void)
+{
+	printf(_(
+"\n"
+" copies a range of bytes from another file into the current file in the\n"
+" kernel, without passing the data through user space\n"
+"\n"
+" Example:\n"
+" 'copy_range -i src -s 1m -d 0 -l 64m' - copies 64MiB from 1MiB into the\n"
+"                                        file src to the start of this one\n"
+"\n"
+" Copies with copy_file_range(2), or shares the blocks of the source file\n"
+" with the FICLONERANGE ioctl when -c is given.\n"
+" -f N -- copy from open file N (see the \"file\" command)\n"
+" -i file -- copy from the named file\n"
+" -s off -- offset in the source file (default 0)\n"
+" -d off -- offset in the current file (default 0)\n"
+" -l len -- number of bytes to copy (default to the end of the source file)\n"
+" -b N -- copy N bytes per call instead of the whole range at once\n"
+" -c   -- clone (reflink) the range instead of copying it\n"
+" -T N -- split the range between N threads copying at the same time\n"
+"\n"));
+}
+
+static ssize_t
+do_copy(
+	int		infd,
+	off64_t		src,
+	int		outfd,
+	off64_t		dst,
+	size_t		len,
+	int		clone)
+{
+	struct file_clone_range	fcr;
+	loff_t		soff = src, doff = dst;
+
+	if (!clone)
+		return syscall(__NR_copy_file_range, infd, &soff, outfd, &doff,
+				len, 0);
+
+	fcr.src_fd = infd;
+	fcr.src_offset = src;
+	fcr.src_length = len;
+	fcr.dest_offset = dst;
+	if (ioctl(outfd, FICLONERANGE, &fcr) < 0)
+		return -1;
+	return len;
+}
+
+static int
+copy_buffer(
+	int		infd,
+	off64_t		src,
+	int		outfd,
+	off64_t		dst,
+	long long	count,
+	size_t		chunk,
+	int		clone,
+	long long	*total)
+{
+	ssize_t		bytes;
+	size_t		len;
+	int		ops = 0;
+
+	*total = 0;
+	while (count > 0) {
+		len = chunk ? min(count, chunk) : count;
+		bytes = do_copy(infd, src, outfd, dst, len, clone);
+		if (bytes == 0)
+			break;
+		if (bytes < 0) {
+			perror(clone ? "FICLONERANGE" : "copy_file_range");
+			return -1;
+		}
+		ops++;
+		*total += bytes;
+		src += bytes;
+		dst += bytes;
+		count -= bytes;
+	}
+	return ops;
+}
+
+struct copy_range_args {
+	int		infd;
+	off64_t		src;
+	off64_t		dst;
+	size_t		chunk;
+	int		clone;
+};
+
+static int
+copy_range_thread(
+	struct io_thread	*t)
+{
+	struct copy_range_args	*args = t->arg;
+
+	if (!t->count)
+		return 0;
+	return copy_buffer(args->infd, args->src + (t->offset - args->dst),
+			t->file->fd, t->offset, t->count, args->chunk,
+			args->clone, &t->total);
+}
+
+static int
+copy_range_f(
+	int		argc,
+	char		**argv)
+{
+	off64_t		src = 0, dst = 0;
+	long long	count = -1, total, tmp;
+	size_t		chunk = 0;
+	size_t		blocksize, sectsize;
+	struct timeval	t1, t2;
+	struct io_thread *threads = NULL;
+	struct copy_range_args args;
+	char		s1[64], s2[64], ts[64];
+	char		*infile = NULL;
+	int		Cflag, qflag, cflag;
+	int		nthreads = 0;
+	int		c, fd = -1;
+
+	Cflag = qflag = cflag = 0;
+	init_cvtnum(&blocksize, &sectsize);
+	while ((c = getopt(argc, argv, "b:cCd:f:i:l:qs:T:")) != EOF) {
+		switch (c) {
+		case 'b':
+			tmp = cvtnum(blocksize, sectsize, optarg);
+			if (tmp <= 0) {
+				printf(_("non-numeric bsize -- %s\n"), optarg);
+				return 0;
+			}
+			chunk = tmp;
+			break;
+		case 'c':
+			cflag = 1;
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'd':
+			dst = cvtnum(blocksize, sectsize, optarg);
+			if (dst < 0) {
+				printf(_("non-numeric offset argument -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
+		case 'f':
+			fd = atoi(optarg);
+			if (fd < 0 || fd >= filecount) {
+				printf(_("value %d is out of range (0-%d)\n"),
+					fd, filecount-1);
+				return 0;
+			}
+			break;
+		case 'i':
+			infile = optarg;
+			break;
+		case 'l':
+			count = cvtnum(blocksize, sectsize, optarg);
+			if (count < 0) {
+				printf(_("non-numeric length argument -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
+		case 'q':
+			qflag = 1;
+			break;
+		case 's':
+			src = cvtnum(blocksize, sectsize, optarg);
+			if (src < 0) {
+				printf(_("non-numeric offset argument -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
+		default:
+			return command_usage(&copy_range_cmd);
+		}
+	}
+	if (optind != argc || (infile && fd != -1) || (!infile && fd == -1))
+		return command_usage(&copy_range_cmd);
+
+	if (!infile)
+		fd = filetable[fd].fd;
+	else if ((fd = openfile(infile, NULL, IO_READONLY, 0)) < 0)
+		return 0;
+
+	if (count < 0) {
+		struct stat64	stat;
+
+		if (fstat64(fd, &stat) < 0) {
+			perror("fstat64");
+			goto done;
+		}
+		count = max(0, stat.st_size - src);
+	}
+
+	if (nthreads) {
+		/* keep the slices aligned for clones */
+		threads = io_threads_alloc(nthreads, 0, dst, count,
+				chunk ? chunk : blocksize);
+		if (!threads)
+			goto done;
+		args.infd = fd;
+		args.src = src;
+		args.dst = dst;
+		args.chunk = chunk;
+		args.clone = cflag;
+	}
+
+	gettimeofday(&t1, NULL);
+	if (nthreads) {
+		c = io_threads_run(threads, nthreads, copy_range_thread, &args);
+		if (c == 0)
+			c = io_threads_sum(threads, nthreads, &total);
+	} else
+		c = copy_buffer(fd, src, file->fd, dst, count, chunk, cflag,
+				&total);
+	if (c < 0 || qflag)
+		goto done;
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+
+	/* Finally, report back -- -C gives a parsable format */
+	timestr(&t2, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+	if (!Cflag) {
+		cvtstr((double)total, s1, sizeof(s1));
+		cvtstr(tdiv((double)total, t2), s2, sizeof(s2));
+		printf(_("%s %lld/%lld bytes from offset %lld to offset %lld\n"),
+			cflag ? _("cloned") : _("copied"),
+			total, count, (long long)src, (long long)dst);
+		printf(_("%s, %d ops; %s (%s/sec and %.4f ops/sec)\n"),
+			s1, c, ts, s2, tdiv((double)c, t2));
+	} else {/* bytes,ops,time,bytes/sec,ops/sec */
+		printf("%lld,%d,%s,%.3f,%.3f\n",
+			total, c, ts,
+			tdiv((double)total, t2), tdiv((double)c, t2));
+	}
+	if (nthreads)
+		io_threads_report(threads, nthreads, Cflag);
+done:
+	if (infile)
+		close(fd);
+	free(threads);
+	return 0;
+}
+
+void
+copy_range_init(void)
+{
+	copy_range_cmd.name = "copy_range";
+	copy_range_cmd.altname = "cr";
+	copy_range_cmd.cfunc = copy_range_f;
+	copy_range_cmd.argmin = 2;
+	copy_range_cmd.argmax = -1;
+	copy_range_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	copy_range_cmd.args =
+_("[-c] [-b bs] [-s off] [-d off] [-l len] [-T N] -i infile | -f N");
+	copy_range_cmd.oneline =
+		_("copy or clone a range of another file in the kernel");
+	copy_range_cmd.help = copy_range_help;
+
+	add_command(&copy_range_cmd);
+}
@@ -23,6 +23,13 @@
 
 static cmdinfo_t fadvise_cmd;
 
+struct fadvise_args {
+	int		advise;
+	off64_t		offset;
+	off64_t		length;		/* 0: to the end of each file */
+	long long	bytes;
+};
+
 static void
 fadvise_help(void)
 {
@@ -38,6 +45,13 @@ fadvise_help(void)
 " -r -- expect random page references (POSIX_FADV_RANDOM)\n"
 " -s -- expect sequential page references (POSIX_FADV_SEQUENTIAL)\n"
 " -w -- will need these pages (POSIX_FADV_WILLNEED) [*]\n"
+" -f -- advise on the files named in this file, one per line, not the\n"
+"       current file\n"
+" -R -- advise on every regular file under this directory\n"
+" -T -- with -f or -R, advise on this many files at once (default 1)\n"
+" With -f or -R, -d, -n and -w apply to the whole of each file if no range\n"
+" is given, so 'fadvise -w -T 16 -R /data' starts reading everything under\n"
+" /data into the page cache.\n"
 " Notes: these interfaces are not supported in Linux kernels before 2.6.\n"
 "   NORMAL sets the default readahead setting on the file.\n"
 "   RANDOM sets the readahead setting on the file to zero.\n"
@@ -46,6 +60,63 @@ fadvise_help(void)
 "\n"));
 }
 
+static int
+fadvise_file(
+	const char		*path,
+	void			*arg)
+{
+	struct fadvise_args	*fa = arg;
+	struct stat64		st;
+	off64_t			end;
+	int			error;
+	int			fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat64(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	error = posix_fadvise64(fd, fa->offset, fa->length, fa->advise);
+	close(fd);
+	if (error) {
+		errno = error;
+		perror(path);
+		return -1;
+	}
+	end = fa->length ? min(st.st_size, fa->offset + fa->length) :
+			   st.st_size;
+	if (end > fa->offset)
+		counter_add(&fa->bytes, end - fa->offset);
+	return 0;
+}
+
+static int
+fadvise_files(
+	struct fileset		*fs,
+	int			nthreads,
+	struct fadvise_args	*fa)
+{
+	struct timeval		t1, t2;
+	char			s1[64], s2[64], ts[64];
+	int			done;
+
+	gettimeofday(&t1, NULL);
+	done = fileset_run(fs, nthreads, fadvise_file, fa);
+	gettimeofday(&t2, NULL);
+	if (done < 0)
+		return -1;
+
+	t2 = tsub(t2, t1);
+	timestr(&t2, ts, sizeof(ts), 0);
+	cvtstr(fa->bytes, s1, sizeof(s1));
+	cvtstr(tdiv(fa->bytes, t2), s2, sizeof(s2));
+	printf(_("advised %d of %lld files, %s in %s (%s/sec)\n"),
+		done, fs->count, s1, ts, s2);
+	return done == fs->count ? 0 : -1;
+}
+
 static int
 fadvise_f(
 	int		argc,
@@ -53,9 +124,28 @@ fadvise_f(
 {
 	off64_t		offset = 0, length = 0;
 	int		c, range = 0, advise = POSIX_FADV_NORMAL;
+	struct fadvise_args fa;
+	struct fileset	fs = { NULL };
+	int		nthreads = 1;
+	int		files = 0;
 
-	while ((c = getopt(argc, argv, "dnrsw")) != EOF) {
+	while ((c = getopt(argc, argv, "df:nR:rsT:w")) != EOF) {
 		switch (c) {
+		case 'f':
+			files = 1;
+			if (fileset_add_list(&fs, optarg) < 0)
+				goto out_files;
+			break;
+		case 'R':
+			files = 1;
+			if (fileset_add_tree(&fs, optarg) < 0)
+				goto out_files;
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				goto out_files;
+			break;
 		case 'd':	/* Don't need these pages */
 			advise = POSIX_FADV_DONTNEED;
 			range = 1;
@@ -77,37 +167,65 @@ fadvise_f(
 			range = 1;
 			break;
 		default:
+			fileset_free(&fs);
 			return command_usage(&fadvise_cmd);
 		}
 	}
-	if (range) {
+	if (files && !range) {
+		/* readahead settings go with an open file, not a path */
+		fileset_free(&fs);
+		return command_usage(&fadvise_cmd);
+	}
+	if (range && !(files && optind == argc)) {
 		size_t	blocksize, sectsize;
 
-		if (optind != argc - 2)
+		if (optind != argc - 2) {
+			fileset_free(&fs);
 			return command_usage(&fadvise_cmd);
+		}
 		init_cvtnum(&blocksize, &sectsize);
 		offset = cvtnum(blocksize, sectsize, argv[optind]);
 		if (offset < 0) {
 			printf(_("non-numeric offset argument -- %s\n"),
 				argv[optind]);
-			return 0;
+			goto out_files;
 		}
 		optind++;
 		length = cvtnum(blocksize, sectsize, argv[optind]);
 		if (length < 0) {
 			printf(_("non-numeric length argument -- %s\n"),
 				argv[optind]);
-			return 0;
+			goto out_files;
 		}
 	} else if (optind != argc) {
 		return command_usage(&fadvise_cmd);
 	}
 
+	if (files) {
+		fa.advise = advise;
+		fa.offset = offset;
+		fa.length = length;
+		fa.bytes = 0;
+		if (fadvise_files(&fs, nthreads, &fa) < 0)
+			exitcode = 1;
+		fileset_free(&fs);
+		return 0;
+	}
+	if (!file) {
+		fprintf(stderr, _("no files are open, try 'help open'\n"));
+		return 0;
+	}
+
 	if (posix_fadvise64(file->fd, offset, length, advise) < 0) {
 		perror("fadvise");
 		return 0;
 	}
 	return 0;
+
+out_files:
+	fileset_free(&fs);
+	exitcode = 1;
+	return 0;
 }
 
 void
@@ -117,8 +235,9 @@ fadvise_init(void)
 	fadvise_cmd.cfunc = fadvise_f;
 	fadvise_cmd.argmin = 0;
 	fadvise_cmd.argmax = -1;
-	fadvise_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	fadvise_cmd.args = _("[-dnrsw] [off len]");
+	fadvise_cmd.flags = CMD_NOFILE_OK | CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fadvise_cmd.args =
+		_("[-dnrsw] [-T threads] [-f listfile | -R dir ...] [off len]");
 	fadvise_cmd.oneline = _("advisory commands for sections of a file");
 	fadvise_cmd.help = fadvise_help;
 
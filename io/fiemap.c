@@ -23,6 +23,9 @@
 #include "init.h"
 #include "io.h"
 
+#define FIEMAP_MIN_BATCH	32
+#define FIEMAP_MAX_BATCH	(64 * 1024)
+
 static cmdinfo_t fiemap_cmd;
 
 static void
@@ -45,6 +48,9 @@ fiemap_help(void)
 " -a -- prints the attribute fork map instead of the data fork.\n"
 " -l -- also displays the length of each extent in 512-byte blocks.\n"
 " -n -- query n extents.\n"
+" -N -- doesn't sync the file first, so delayed allocations show as such.\n"
+" -s -- only prints the number of extents and holes and a histogram of the\n"
+"       extent lengths, for files with too many extents to list.\n"
 " -v -- Verbose information\n"
 "\n"));
 }
@@ -165,6 +171,30 @@ print_plain(
 	*last_logical = extent->fe_logical + extent->fe_length;
 }
 
+static void
+summarize(
+	struct map_summary	*ms,
+	struct fiemap_extent	*extent,
+	int			blocksize,
+	int			max_extents,
+	int			*cur_extent,
+	__u64			*last_logical)
+{
+	if (extent->fe_logical != *last_logical) {
+		map_summary_hole(ms);
+		(*cur_extent)++;
+	}
+
+	if ((*cur_extent + 1) == max_extents)
+		return;
+
+	map_summary_extent(ms, (extent->fe_flags & FIEMAP_EXTENT_UNKNOWN) ?
+				-1 : extent->fe_physical / blocksize,
+			   extent->fe_length / blocksize);
+	(*cur_extent)++;
+	*last_logical = extent->fe_logical + extent->fe_length;
+}
+
 /*
  * Calculate the proper extent table format based on first
  * set of extents
@@ -212,10 +242,13 @@ fiemap_f(
 	char		**argv)
 {
 	struct fiemap	*fiemap;
+	struct fiemap	*newmap;
+	struct map_summary ms;
 	int		max_extents = 0;
-	int		num_extents = 32;
+	int		num_extents = FIEMAP_MIN_BATCH;
 	int		last = 0;
 	int		lflag = 0;
+	int		sflag = 0;
 	int		vflag = 0;
 	int		fiemap_flags = FIEMAP_FLAG_SYNC;
 	int		c;
@@ -231,7 +264,7 @@ fiemap_f(
 	__u64		last_logical = 0;
 	struct stat	st;
 
-	while ((c = getopt(argc, argv, "aln:v")) != EOF) {
+	while ((c = getopt(argc, argv, "alNn:sv")) != EOF) {
 		switch (c) {
 		case 'a':
 			fiemap_flags |= FIEMAP_FLAG_XATTR;
@@ -242,6 +275,12 @@ fiemap_f(
 		case 'n':
 			max_extents = atoi(optarg);
 			break;
+		case 'N':
+			fiemap_flags &= ~FIEMAP_FLAG_SYNC;
+			break;
+		case 's':
+			sflag = 1;
+			break;
 		case 'v':
 			vflag++;
 			break;
@@ -263,8 +302,30 @@ fiemap_f(
 	}
 
 	printf("%s:\n", file->name);
-
+	if (sflag)
+		map_summary_init(&ms);
+
+	/*
+	 * Start small, so that a file with a few extents gets them in one
+	 * small call, and double the batch each time around, so that one
+	 * with millions doesn't take millions of calls.
+	 */
 	while (!last && ((cur_extent + 1) != max_extents)) {
+		if (cur_extent && num_extents < FIEMAP_MAX_BATCH) {
+			num_extents *= 2;
+			map_size = sizeof(struct fiemap) +
+				(num_extents * sizeof(struct fiemap_extent));
+			newmap = realloc(fiemap, map_size);
+			if (!newmap) {
+				fprintf(stderr,
+					_("%s: malloc of %d bytes failed.\n"),
+					progname, map_size);
+				free(fiemap);
+				exitcode = 1;
+				return 0;
+			}
+			fiemap = newmap;
+		}
 		if (max_extents)
 			num_extents = min(num_extents,
 					  max_extents - (cur_extent + 1));
@@ -292,7 +353,10 @@ fiemap_f(
 			struct fiemap_extent	*extent;
 
 			extent = &fiemap->fm_extents[i];
-			if (vflag) {
+			if (sflag) {
+				summarize(&ms, extent, blocksize, max_extents,
+					  &cur_extent, &last_logical);
+			} else if (vflag) {
 				if (cur_extent == 0) {
 					calc_print_format(fiemap, blocksize,
 							  &foff_w, &boff_w,
@@ -318,8 +382,11 @@ fiemap_f(
 		}
 	}
 
-	if ((cur_extent + 1) == max_extents)
+	if ((cur_extent + 1) == max_extents) {
+		if (sflag)
+			map_summary_print(&ms);
 		goto out;
+	}
 
 	memset(&st, 0, sizeof(st));
 	if (fstat(file->fd, &st)) {
@@ -330,6 +397,13 @@ fiemap_f(
 		return 0;
 	}
 
+	if (sflag) {
+		if (cur_extent && last_logical < st.st_size)
+			map_summary_hole(&ms);
+		map_summary_print(&ms);
+		goto out;
+	}
+
 	if (cur_extent && last_logical < st.st_size) {
 		char	lbuf[32];
 
@@ -363,7 +437,7 @@ fiemap_init(void)
 	fiemap_cmd.argmin = 0;
 	fiemap_cmd.argmax = -1;
 	fiemap_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	fiemap_cmd.args = _("[-alv] [-n nx]");
+	fiemap_cmd.args = _("[-alNsv] [-n nx]");
 	fiemap_cmd.oneline = _("print block mapping for a file");
 	fiemap_cmd.help = fiemap_help;
 
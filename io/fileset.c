@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "command.h"
+#include "input.h"
+#include <ftw.h>
+#include "init.h"
+#include "io.h"
+
+/*
+ * Sets of files for the commands that can work on many files at once
+ * rather than the current one (mincore -f/-R, fadvise -f/-R), to warm or
+ * check the page cache over a whole tree.  The names come from a list
+ * file, one per line, or from walking directory trees, and the command's
+ * function is then called on each of them from a number of threads.  The
+ * threads take the next file as they finish the last one, so one huge
+ * file doesn't hold up the rest.
+ */
+
+static struct fileset	*fileset_walking;	/* for the nftw callback */
+
+static int
+fileset_add(
+	struct fileset	*fs,
+	const char	*path)
+{
+	char		**paths;
+
+	if (fs->count == fs->max) {
+		fs->max = fs->max ? fs->max * 2 : 256;
+		paths = realloc(fs->paths, fs->max * sizeof(char *));
+		if (!paths) {
+			perror("realloc");
+			return -1;
+		}
+		fs->paths = paths;
+	}
+	fs->paths[fs->count] = strdup(path);
+	if (!fs->paths[fs->count]) {
+		perror("strdup");
+		return -1;
+	}
+	fs->count++;
+	return 0;
+}
+
+/* add the names in listfile, one per line */
+int
+fileset_add_list(
+	struct fileset	*fs,
+	const char	*listfile)
+{
+	FILE		*fp;
+	char		*line = NULL;
+	size_t		size = 0;
+	ssize_t		len;
+	int		error = 0;
+
+	fp = fopen(listfile, "r");
+	if (!fp) {
+		perror(listfile);
+		return -1;
+	}
+	while (!error && (len = getline(&line, &size, fp)) >= 0) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len)
+			error = fileset_add(fs, line);
+	}
+	free(line);
+	fclose(fp);
+	return error;
+}
+
+static int
+fileset_walk(
+	const char		*path,
+	const struct stat	*stat,
+	int			status,
+	struct FTW		*data)
+{
+	if (status == FTW_F && S_ISREG(stat->st_mode))
+		return fileset_add(fileset_walking, path);
+	return 0;
+}
+
+/* add every regular file under dir, without crossing mount points */
+int
+fileset_add_tree(
+	struct fileset	*fs,
+	const char	*dir)
+{
+	int		error;
+
+	fileset_walking = fs;
+	error = nftw(dir, fileset_walk, 100, FTW_PHYS | FTW_MOUNT);
+	fileset_walking = NULL;
+	if (error < 0)
+		perror(dir);
+	return error ? -1 : 0;
+}
+
+void
+fileset_free(
+	struct fileset	*fs)
+{
+	long long	i;
+
+	for (i = 0; i < fs->count; i++)
+		free(fs->paths[i]);
+	free(fs->paths);
+	memset(fs, 0, sizeof(*fs));
+}
+
+static int
+fileset_thread(
+	struct io_thread	*t)
+{
+	struct fileset		*fs = t->arg;
+	long long		i;
+	int			ops = 0;
+
+	while ((i = atomic64_add_return(1, &fs->next) - 1) < fs->count) {
+		if (fs->fn(fs->paths[i], fs->arg) == 0)
+			ops++;
+	}
+	return ops;
+}
+
+/*
+ * Call fn(path, arg) on every file in the set from up to nthreads threads
+ * at once.  Returns the number of files fn returned 0 for, or -1 if the
+ * threads couldn't be started.
+ */
+int
+fileset_run(
+	struct fileset	*fs,
+	int		nthreads,
+	int		(*fn)(const char *, void *),
+	void		*arg)
+{
+	struct io_thread *threads;
+	long long	total;
+	int		ops;
+
+	if (!fs->count)
+		return 0;
+	nthreads = min(nthreads, fs->count);
+	threads = io_threads_alloc(nthreads, 0, 0, fs->count, 1);
+	if (!threads)
+		return -1;
+	fs->fn = fn;
+	fs->arg = arg;
+	atomic64_set(&fs->next, 0);
+	if (io_threads_run(threads, nthreads, fileset_thread, fs) < 0) {
+		free(threads);
+		return -1;
+	}
+	ops = io_threads_sum(threads, nthreads, &total);
+	free(threads);
+	return ops;
+}
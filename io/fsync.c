@@ -24,15 +24,60 @@
 static cmdinfo_t fsync_cmd;
 static cmdinfo_t fdatasync_cmd;
 
+static int
+fsync_thread(
+	struct io_thread	*t)
+{
+	trace_io(TRACE_FSYNC, 0, 0);
+	if (fsync(t->file->fd) < 0) {
+		perror("fsync");
+		return -1;
+	}
+	return 1;
+}
+
 static int
 fsync_f(
 	int			argc,
 	char			**argv)
 {
-	if (fsync(file->fd) < 0) {
-		perror("fsync");
+	struct io_thread	*threads;
+	int			nthreads = 0;
+	int			Pflag = 0;
+	int			c;
+
+	while ((c = getopt(argc, argv, "PT:")) != EOF) {
+		switch (c) {
+		case 'P':
+			Pflag = 1;
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
+		default:
+			return command_usage(&fsync_cmd);
+		}
+	}
+	if (optind != argc || (Pflag && !nthreads))
+		return command_usage(&fsync_cmd);
+
+	if (!nthreads) {
+		trace_io(TRACE_FSYNC, 0, 0);
+		if (fsync(file->fd) < 0) {
+			perror("fsync");
+			return 0;
+		}
 		return 0;
 	}
+
+	/* several threads fsyncing the same file, or one file each */
+	threads = io_threads_alloc(nthreads, Pflag, 0, 0, 0);
+	if (!threads)
+		return 0;
+	io_threads_run(threads, nthreads, fsync_thread, NULL);
+	free(threads);
 	return 0;
 }
 
@@ -41,6 +86,7 @@ fdatasync_f(
 	int			argc,
 	char			**argv)
 {
+	trace_io(TRACE_FDATASYNC, 0, 0);
 	if (fdatasync(file->fd) < 0) {
 		perror("fdatasync");
 		return 0;
@@ -54,7 +100,9 @@ fsync_init(void)
 	fsync_cmd.name = "fsync";
 	fsync_cmd.altname = "s";
 	fsync_cmd.cfunc = fsync_f;
+	fsync_cmd.argmax = -1;
 	fsync_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fsync_cmd.args = _("[-T threads [-P]]");
 	fsync_cmd.oneline =
 		_("calls fsync(2) to flush all in-core file state to disk");
 
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <time.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/*
+ * Per-I/O latency histograms for pread -L and pwrite -L.
+ *
+ * The histogram is log-linear: values below HIST_SUB nsec get a bucket of
+ * their own, above that every power of two is split into HIST_SUB linear
+ * buckets, so a bucket is never wider than 1/HIST_SUB of its value.
+ * Recording a sample is a couple of shifts and an increment, and each
+ * thread records into its own histogram, so the I/O isn't slowed down.
+ * Raw samples are only kept when they are to be dumped to a file.
+ */
+__thread struct io_hist	*io_hist;
+
+unsigned long long
+hist_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+hist_bucket(
+	unsigned long long	nsec)
+{
+	int			shift;
+
+	if (nsec < HIST_SUB)
+		return nsec;
+	shift = 63 - __builtin_clzll(nsec) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (nsec >> shift) - HIST_SUB;
+}
+
+/* highest value that lands in bucket i */
+static unsigned long long
+hist_bucket_max(
+	int			i)
+{
+	int			shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return (((unsigned long long)(i % HIST_SUB + HIST_SUB + 1)) << shift)
+		- 1;
+}
+
+struct io_hist *
+hist_alloc(
+	int			keep)
+{
+	struct io_hist		*h;
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		perror("calloc");
+		return NULL;
+	}
+	h->keep = keep;
+	return h;
+}
+
+void
+hist_free(
+	struct io_hist		*h)
+{
+	if (!h)
+		return;
+	free(h->samples);
+	free(h);
+}
+
+static void
+hist_keep(
+	struct io_hist		*h,
+	off64_t			offset,
+	unsigned long long	nsec)
+{
+	struct io_sample	*s;
+	size_t			n;
+
+	if (h->nsamples == h->maxsamples) {
+		n = h->maxsamples ? h->maxsamples * 2 : 4096;
+		s = realloc(h->samples, n * sizeof(*s));
+		if (!s) {
+			h->lost++;
+			return;
+		}
+		h->samples = s;
+		h->maxsamples = n;
+	}
+	h->samples[h->nsamples].offset = offset;
+	h->samples[h->nsamples].nsec = nsec;
+	h->nsamples++;
+}
+
+void
+hist_add(
+	struct io_hist		*h,
+	off64_t			offset,
+	unsigned long long	nsec)
+{
+	if (!h->count || nsec < h->min)
+		h->min = nsec;
+	if (nsec > h->max)
+		h->max = nsec;
+	h->count++;
+	h->buckets[hist_bucket(nsec)]++;
+	if (h->keep)
+		hist_keep(h, offset, nsec);
+}
+
+/* fold src into dst, raw samples included */
+void
+hist_merge(
+	struct io_hist		*dst,
+	struct io_hist		*src)
+{
+	size_t			i;
+	int			b;
+
+	if (!src->count)
+		return;
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	for (b = 0; b < HIST_BUCKETS; b++)
+		dst->buckets[b] += src->buckets[b];
+	dst->lost += src->lost;
+	if (!dst->keep)
+		return;
+	for (i = 0; i < src->nsamples; i++)
+		hist_keep(dst, src->samples[i].offset, src->samples[i].nsec);
+}
+
+/* smallest bucket bound with at least pct percent of the samples below it */
+static unsigned long long
+hist_percentile(
+	struct io_hist		*h,
+	double			pct)
+{
+	unsigned long long	want, seen = 0;
+	int			b;
+
+	want = (unsigned long long)(h->count * pct / 100.0 + 0.999999);
+	if (!want)
+		want = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= want)
+			return min(hist_bucket_max(b), h->max);
+	}
+	return h->max;
+}
+
+void
+hist_report(
+	struct io_hist		*h,
+	int			Cflag)
+{
+	double			p50, p99, p999;
+
+	if (!h->count)
+		return;
+	p50 = hist_percentile(h, 50.0) / 1000.0;
+	p99 = hist_percentile(h, 99.0) / 1000.0;
+	p999 = hist_percentile(h, 99.9) / 1000.0;
+	if (Cflag)	/* ops,min,p50,p99,p99.9,max */
+		printf("%llu,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+			h->count, h->min / 1000.0, p50, p99, p999,
+			h->max / 1000.0);
+	else
+		printf(_("latency min/p50/p99/p99.9/max "
+			 "%.1f/%.1f/%.1f/%.1f/%.1f usec\n"),
+			h->min / 1000.0, p50, p99, p999, h->max / 1000.0);
+}
+
+/* write out the raw samples, one "offset nsec" line each */
+int
+hist_dump(
+	struct io_hist		*h,
+	const char		*name)
+{
+	FILE			*fp;
+	size_t			i;
+
+	fp = fopen(name, "w");
+	if (!fp) {
+		perror(name);
+		return -1;
+	}
+	for (i = 0; i < h->nsamples; i++)
+		fprintf(fp, "%lld %llu\n", (long long)h->samples[i].offset,
+			h->samples[i].nsec);
+	if (fclose(fp) != 0) {
+		perror(name);
+		return -1;
+	}
+	if (h->lost)
+		fprintf(stderr, _("%llu latency samples not kept, "
+			"out of memory\n"), h->lost);
+	return 0;
+}
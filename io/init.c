@@ -32,7 +32,7 @@ void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-adfmnrRstVx] [-p prog] [-c cmd]... file\n"),
+		_("Usage: %s [-abdfmnrRstVx] [-p prog] [-c cmd]... file\n"),
 		progname);
 	exit(1);
 }
@@ -56,6 +56,8 @@ init_commands(void)
 {
 	attr_init();
 	bmap_init();
+	bulkstat_init();
+	copy_range_init();
 	fadvise_init();
 	file_init();
 	flink_init();
@@ -82,6 +84,7 @@ init_commands(void)
 	shutdown_init();
 	sync_init();
 	sync_range_init();
+	trace_init();
 	truncate_init();
 }
 
@@ -138,11 +141,14 @@ init(
 	pagesize = getpagesize();
 	gettimeofday(&stopwatch, NULL);
 
-	while ((c = getopt(argc, argv, "ac:dFfmp:nrRstTVx")) != EOF) {
+	while ((c = getopt(argc, argv, "abc:dFfmp:nrRstTVx")) != EOF) {
 		switch (c) {
 		case 'a':
 			flags |= IO_APPEND;
 			break;
+		case 'b':
+			add_batch_mode();
+			break;
 		case 'c':
 			add_user_command(optarg);
 			break;
@@ -17,6 +17,8 @@
  */
 
 #include "xfs.h"
+#include "atomic.h"
+#include <pthread.h>
 
 /*
  * Read/write patterns (default is always "forward")
@@ -83,17 +85,181 @@ extern void		printxattr(uint, int, int, const char *, int, int);
 extern unsigned int	recurse_all;
 extern unsigned int	recurse_dir;
 
-extern void		*buffer;
-extern size_t		buffersize;
-extern int		vectors;
-extern struct iovec	*iov;
+/* each thread of a -T command has its own buffers */
+extern __thread void	*buffer;
+extern __thread size_t	buffersize;
+extern __thread int	vectors;
+extern __thread struct iovec *iov;
 extern int		alloc_buffer(size_t, int, unsigned int);
+extern void		free_buffer(void);
 extern int		read_buffer(int, off64_t, long long, long long *,
 					int, int);
 extern void		dump_buffer(off64_t, ssize_t);
 
+/* preadv2/pwritev2 flags for pread and pwrite */
+#ifndef RWF_HIPRI
+#define RWF_HIPRI	0x00000001
+#endif
+#ifndef RWF_DSYNC
+#define RWF_DSYNC	0x00000002
+#endif
+#ifndef RWF_SYNC
+#define RWF_SYNC	0x00000004
+#endif
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT	0x00000008
+#endif
+
+extern int		rwf_flags;
+extern long long	rwf_blocked;	/* RWF_NOWAIT calls that got EAGAIN */
+extern void		rwf_report(const char *, int);
+
+/* verifiable data, pwrite -p and pread -p */
+extern int		pattern;
+extern void		pattern_init(unsigned int);
+extern void		pattern_fill_buffer(off64_t, ssize_t);
+extern int		pattern_check_buffer(off64_t, ssize_t);
+extern void		pattern_report(int);
+
+struct aio_stats {
+	long long	total;		/* bytes done */
+	int		ops;
+	double		min_usec;	/* completion times */
+	double		max_usec;
+	double		sum_usec;
+};
+
+extern int		aio_depth;
+extern int		aioq_init(int, size_t, int, unsigned int);
+extern void		aioq_free(void);
+extern ssize_t		aioq_rw(off64_t, size_t, int);
+extern int		aioq_drain(void);
+extern int		aioq_finish(int, long long *, struct aio_stats *);
+extern void		aioq_report(struct aio_stats *, int);
+
+/* one read or write of pread or pwrite, at queue depth if aio_depth is set */
+extern int		do_pread(int, off64_t, ssize_t, ssize_t);
+extern int		do_pwrite(int, off64_t, ssize_t, ssize_t);
+
+/*
+ * I/O traces, recorded with "trace" and played back with "replay"
+ */
+#define TRACE_READ	0
+#define TRACE_WRITE	1
+#define TRACE_FSYNC	2
+#define TRACE_FDATASYNC	3
+
+extern FILE		*trace_fp;	/* trace being recorded, if any */
+extern __thread int	trace_skip;
+extern void		trace_record(int, off64_t, size_t);
+#define trace_io(op, off, len)	\
+	do { if (trace_fp) trace_record(op, off, len); } while (0)
+
+/*
+ * Per-I/O latency histograms (-L)
+ */
+#define HIST_SUB_BITS	6
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct io_sample {
+	off64_t			offset;
+	unsigned long long	nsec;
+};
+
+struct io_hist {
+	unsigned long long	count;
+	unsigned long long	min;		/* nsec */
+	unsigned long long	max;
+	unsigned long long	buckets[HIST_BUCKETS];
+	int			keep;		/* keep the raw samples too */
+	struct io_sample	*samples;
+	size_t			nsamples;
+	size_t			maxsamples;
+	unsigned long long	lost;		/* samples not kept, no memory */
+};
+
+extern __thread struct io_hist *io_hist;	/* this thread's, if any */
+extern unsigned long long hist_now(void);
+extern struct io_hist	*hist_alloc(int);
+extern void		hist_free(struct io_hist *);
+extern void		hist_add(struct io_hist *, off64_t, unsigned long long);
+extern void		hist_merge(struct io_hist *, struct io_hist *);
+extern void		hist_report(struct io_hist *, int);
+extern int		hist_dump(struct io_hist *, const char *);
+
+/*
+ * Commands run on several threads with -T
+ */
+#define IO_MAX_THREADS	1024
+
+struct io_thread {
+	pthread_t	tid;
+	int		index;
+	fileio_t	*file;
+	off64_t		offset;
+	long long	count;
+	long long	total;		/* bytes done */
+	int		ops;		/* ops done, or -1 on failure */
+	struct timeval	time;
+	struct io_hist	*hist;		/* latencies, with -L */
+	int		(*fn)(struct io_thread *);
+	void		*arg;		/* command's options */
+};
+
+extern int		io_threads_parse(char *);
+extern struct io_thread	*io_threads_alloc(int, int, off64_t, long long, size_t);
+extern int		io_threads_run(struct io_thread *, int,
+				int (*)(struct io_thread *), void *);
+extern int		io_threads_sum(struct io_thread *, int, long long *);
+extern int		io_threads_hist_alloc(struct io_thread *, int, int);
+extern void		io_threads_hist_merge(struct io_thread *, int,
+					struct io_hist *);
+extern void		io_threads_report(struct io_thread *, int, int);
+
+/*
+ * Sets of files to work on, from mincore and fadvise -f/-R
+ */
+struct fileset {
+	char		**paths;
+	long long	count;
+	long long	max;
+	atomic64_t	next;		/* next one for a thread to take */
+	int		(*fn)(const char *, void *);
+	void		*arg;
+};
+
+extern int		fileset_add_list(struct fileset *, const char *);
+extern int		fileset_add_tree(struct fileset *, const char *);
+extern void		fileset_free(struct fileset *);
+extern int		fileset_run(struct fileset *, int,
+				int (*)(const char *, void *), void *);
+
+/*
+ * What bmap -s and fiemap -s print instead of the extents themselves: how
+ * many there are, and how long, in 512-byte blocks, by powers of two.
+ */
+#define MAP_SUMMARY_BUCKETS	40
+
+struct map_summary {
+	long long	extents;
+	long long	holes;
+	long long	blocks;
+	long long	contig;		/* extents that carry on the last one */
+	long long	next_block;	/* just past the last extent, or -1 */
+	long long	hist[MAP_SUMMARY_BUCKETS];
+	long long	hist_blocks[MAP_SUMMARY_BUCKETS];
+};
+
+extern void		map_summary_init(struct map_summary *);
+extern void		map_summary_extent(struct map_summary *, long long,
+					long long);
+extern void		map_summary_hole(struct map_summary *);
+extern void		map_summary_print(struct map_summary *);
+
 extern void		attr_init(void);
 extern void		bmap_init(void);
+extern void		bulkstat_init(void);
 extern void		file_init(void);
 extern void		flink_init(void);
 extern void		freeze_init(void);
@@ -112,6 +278,7 @@ extern void		quit_init(void);
 extern void		seek_init(void);
 extern void		shutdown_init(void);
 extern void		sync_init(void);
+extern void		trace_init(void);
 extern void		truncate_init(void);
 
 #ifdef HAVE_FADVISE
@@ -156,6 +323,12 @@ extern void		sync_range_init(void);
 #define sync_range_init()	do { } while (0)
 #endif
 
+#ifdef HAVE_COPY_FILE_RANGE
+extern void		copy_range_init(void);
+#else
+#define copy_range_init()	do { } while (0)
+#endif
+
 #ifdef HAVE_READDIR
 extern void		readdir_init(void);
 #else
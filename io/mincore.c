@@ -22,8 +22,119 @@
 #include "init.h"
 #include "io.h"
 
+#define MINCORE_CHUNK	(1024 * 1024 * 1024LL)	/* mapped at a time */
+
 static cmdinfo_t mincore_cmd;
 
+struct mincore_totals {
+	int		verbose;
+	long long	pages;
+	long long	resident;
+};
+
+static void
+mincore_help(void)
+{
+	printf(_(
+"\n"
+" shows which pages of the current mapping, or of a set of files, are in\n"
+" memory\n"
+"\n"
+" With no options, lists the resident ranges of the current mapping, or of\n"
+" the given range of it.  With -f or -R, counts the resident pages of every\n"
+" file named instead, and prints the totals.\n"
+" -f -- the files named in this file, one per line\n"
+" -R -- every regular file under this directory\n"
+" -T -- look at this many files at once (default 1)\n"
+" -v -- with -f or -R, also print the count for each file\n"
+"\n"));
+}
+
+/* count the pages of path in memory, a window of it at a time */
+static int
+mincore_file(
+	const char		*path,
+	void			*arg)
+{
+	struct mincore_totals	*mt = arg;
+	struct stat64		st;
+	unsigned char		*vec;
+	long long		pages = 0;
+	long long		resident = 0;
+	off64_t			off;
+	size_t			len;
+	size_t			n, i;
+	void			*p;
+	int			fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat64(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	vec = malloc(MINCORE_CHUNK / pagesize);
+	if (!vec) {
+		perror("malloc");
+		close(fd);
+		return -1;
+	}
+	for (off = 0; off < st.st_size; off += len) {
+		len = min(st.st_size - off, MINCORE_CHUNK);
+		p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+		if (p == MAP_FAILED) {
+			perror(path);
+			break;
+		}
+		n = (len + pagesize - 1) / pagesize;
+		if (mincore(p, len, vec) < 0) {
+			perror(path);
+			munmap(p, len);
+			break;
+		}
+		munmap(p, len);
+		for (i = 0; i < n; i++)
+			resident += vec[i] & 1;
+		pages += n;
+	}
+	free(vec);
+	close(fd);
+
+	if (mt->verbose)
+		printf(_("%s: %lld of %lld pages resident\n"), path,
+			resident, pages);
+	counter_add(&mt->pages, pages);
+	counter_add(&mt->resident, resident);
+	return off < st.st_size ? -1 : 0;
+}
+
+static int
+mincore_files(
+	struct fileset		*fs,
+	int			nthreads,
+	int			verbose)
+{
+	struct mincore_totals	mt = { verbose, 0, 0 };
+	struct timeval		t1, t2;
+	char			ts[64];
+	int			done;
+
+	gettimeofday(&t1, NULL);
+	done = fileset_run(fs, nthreads, mincore_file, &mt);
+	gettimeofday(&t2, NULL);
+	if (done < 0)
+		return -1;
+
+	t2 = tsub(t2, t1);
+	timestr(&t2, ts, sizeof(ts), 0);
+	printf(_("%d of %lld files, %lld of %lld pages resident (%.1f%%), "
+		 "checked in %s\n"),
+		done, fs->count, mt.resident, mt.pages,
+		mt.pages ? 100.0 * mt.resident / mt.pages : 0.0, ts);
+	return done == fs->count ? 0 : -1;
+}
+
 int
 mincore_f(
 	int		argc,
@@ -35,23 +146,68 @@ mincore_f(
 	void		*start;
 	void		*current, *previous;
 	unsigned char	*vec;
+	struct fileset	fs = { NULL };
+	int		nthreads = 1;
+	int		verbose = 0;
+	int		files = 0;
+	int		c;
 	int		i;
 
-	if (argc == 1) {
+	while ((c = getopt(argc, argv, "f:R:T:v")) != EOF) {
+		switch (c) {
+		case 'f':
+			files = 1;
+			if (fileset_add_list(&fs, optarg) < 0)
+				goto out_files;
+			break;
+		case 'R':
+			files = 1;
+			if (fileset_add_tree(&fs, optarg) < 0)
+				goto out_files;
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				goto out_files;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fileset_free(&fs);
+			return command_usage(&mincore_cmd);
+		}
+	}
+	if (files) {
+		if (optind != argc) {
+			fileset_free(&fs);
+			return command_usage(&mincore_cmd);
+		}
+		if (mincore_files(&fs, nthreads, verbose) < 0)
+			exitcode = 1;
+		fileset_free(&fs);
+		return 0;
+	}
+	if (!mapping) {
+		fprintf(stderr, _("no mapped regions, try 'help mmap'\n"));
+		return 0;
+	}
+
+	if (optind == argc) {
 		offset = mapping->offset;
 		length = mapping->length;
-	} else if (argc == 3) {
+	} else if (optind == argc - 2) {
 		init_cvtnum(&blocksize, &sectsize);
-		offset = cvtnum(blocksize, sectsize, argv[1]);
+		offset = cvtnum(blocksize, sectsize, argv[optind]);
 		if (offset < 0) {
 			printf(_("non-numeric offset argument -- %s\n"),
-				argv[1]);
+				argv[optind]);
 			return 0;
 		}
-		llength = cvtnum(blocksize, sectsize, argv[2]);
+		llength = cvtnum(blocksize, sectsize, argv[optind + 1]);
 		if (llength < 0) {
 			printf(_("non-numeric length argument -- %s\n"),
-				argv[2]);
+				argv[optind + 1]);
 			return 0;
 		} else if (llength > (size_t)llength) {
 			printf(_("length argument too large -- %lld\n"),
@@ -107,6 +263,11 @@ mincore_f(
 
 	free(vec);
 	return 0;
+
+out_files:
+	fileset_free(&fs);
+	exitcode = 1;
+	return 0;
 }
 
 void
@@ -116,10 +277,12 @@ mincore_init(void)
 	mincore_cmd.altname = "mi";
 	mincore_cmd.cfunc = mincore_f;
 	mincore_cmd.argmin = 0;
-	mincore_cmd.argmax = 2;
-	mincore_cmd.flags = CMD_NOFILE_OK | CMD_FOREIGN_OK;
-	mincore_cmd.args = _("[off len]");
+	mincore_cmd.argmax = -1;
+	mincore_cmd.flags = CMD_NOFILE_OK | CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	mincore_cmd.args =
+		_("[off len] | [-v] [-T threads] -f listfile | -R dir ...");
 	mincore_cmd.oneline = _("find mapping pages that are memory resident");
+	mincore_cmd.help = mincore_help;
 
 	add_command(&mincore_cmd);
 }
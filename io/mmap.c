@@ -126,6 +126,60 @@ mapset_f(
 	return 0;
 }
 
+/* the PMD size, which transparent huge pages and DAX map in */
+static size_t
+hugepage_size(void)
+{
+	FILE		*fp;
+	unsigned long	size = 0;
+
+	fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (fp) {
+		if (fscanf(fp, "%lu", &size) != 1)
+			size = 0;
+		fclose(fp);
+	}
+	return size ? size : 2 * 1024 * 1024;
+}
+
+/*
+ * Map the file so that the address and the file offset are the same
+ * modulo align, which is what it takes for the kernel to map a whole huge
+ * page or a large folio of the file with one page table entry.  Reserve a
+ * range big enough to slide the mapping into place, map over it, and
+ * give back what's left either side.
+ */
+static void *
+mmap_aligned(
+	size_t		length,
+	int		prot,
+	int		flags,
+	int		fd,
+	off64_t		offset,
+	size_t		align)
+{
+	char		*base, *addr;
+	size_t		len = roundup(length, pagesize);
+	size_t		head, tail;
+
+	base = mmap(NULL, len + align, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return MAP_FAILED;
+	head = (offset - (unsigned long)base) & (align - 1);
+	addr = mmap(base + head, length, prot, flags | MAP_FIXED, fd, offset);
+	if (addr == MAP_FAILED) {
+		munmap(base, len + align);
+		return MAP_FAILED;
+	}
+	tail = align - head;
+	if (head)
+		munmap(base, head);
+	if (tail)
+		munmap(addr + len, tail);
+	return addr;
+}
+
 static void
 mmap_help(void)
 {
@@ -145,6 +199,11 @@ mmap_help(void)
 " -w -- map with PROT_WRITE protection\n"
 " -x -- map with PROT_EXEC protection\n"
 " If no protection mode is specified, all are used by default.\n"
+" -p -- prefault the whole range (MAP_POPULATE)\n"
+" -H -- map with huge pages (MAP_HUGETLB), for files on hugetlbfs\n"
+" -a -- align the mapping so file offsets that are a multiple of the huge\n"
+"       page size get huge page aligned addresses, for DAX and large folios\n"
+" -h -- ask for transparent huge pages (madvise MADV_HUGEPAGE)\n"
 "\n"));
 }
 
@@ -159,6 +218,8 @@ mmap_f(
 	char		*filename;
 	size_t		blocksize, sectsize;
 	int		c, prot = 0;
+	int		flags = MAP_SHARED;
+	int		aflag = 0, hflag = 0;
 
 	if (argc == 1) {
 		if (mapping)
@@ -179,8 +240,35 @@ mmap_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "rwx")) != EOF) {
+	while ((c = getopt(argc, argv, "ahHprwx")) != EOF) {
 		switch (c) {
+		case 'a':
+			aflag = 1;
+			break;
+		case 'h':
+#ifdef MADV_HUGEPAGE
+			hflag = 1;
+			break;
+#else
+			printf(_("MADV_HUGEPAGE is not supported\n"));
+			return 0;
+#endif
+		case 'H':
+#ifdef MAP_HUGETLB
+			flags |= MAP_HUGETLB;
+			break;
+#else
+			printf(_("MAP_HUGETLB is not supported\n"));
+			return 0;
+#endif
+		case 'p':
+#ifdef MAP_POPULATE
+			flags |= MAP_POPULATE;
+			break;
+#else
+			printf(_("MAP_POPULATE is not supported\n"));
+			return 0;
+#endif
 		case 'r':
 			prot |= PROT_READ;
 			break;
@@ -219,12 +307,21 @@ mmap_f(
 		return 0;
 	}
 
-	address = mmap(NULL, length, prot, MAP_SHARED, file->fd, offset);
+	if (aflag)
+		address = mmap_aligned(length, prot, flags, file->fd, offset,
+				hugepage_size());
+	else
+		address = mmap(NULL, length, prot, flags, file->fd, offset);
 	if (address == MAP_FAILED) {
 		perror("mmap");
 		free(filename);
 		return 0;
 	}
+#ifdef MADV_HUGEPAGE
+	/* too late for pages MAP_POPULATE already faulted in, but it's a hint */
+	if (hflag && madvise(address, length, MADV_HUGEPAGE) < 0)
+		perror("madvise(MADV_HUGEPAGE)");
+#endif
 
 	/* Extend the control array of mmap'd regions */
 	maptable = (mmap_region_t *)realloc(maptable,		/* growing */
@@ -323,6 +420,35 @@ msync_f(
 	return 0;
 }
 
+/*
+ * mread -t and mwrite -t time the first access to each page, which is
+ * the one that takes the page fault if the page isn't mapped yet.  Going
+ * backwards that's the last byte of the page.
+ */
+static struct io_hist	*fault_hist;
+
+static inline int
+page_first(
+	char		*p,
+	int		first,
+	int		reverse)
+{
+	if (first)
+		return 1;
+	if (reverse)
+		return ((unsigned long)(p + 1) & (pagesize - 1)) == 0;
+	return ((unsigned long)p & (pagesize - 1)) == 0;
+}
+
+static void
+fault_report(void)
+{
+	if (!fault_hist->count)
+		return;
+	printf(_("%llu pages, "), fault_hist->count);
+	hist_report(fault_hist, 0);
+}
+
 static void
 mread_help(void)
 {
@@ -337,6 +463,8 @@ mread_help(void)
 " the standard output stream (with -v option) for subsequent inspection.\n"
 " -f -- verbose mode, dump bytes with offsets relative to start of file.\n"
 " -r -- reverse order; start accessing from the end of range, moving backward\n"
+" -t -- time the first access to each page, and report the page fault\n"
+"       latencies\n"
 " -v -- verbose mode, dump bytes with offsets relative to start of mapping.\n"
 " The accesses are performed sequentially from the start offset by default.\n"
 " Notes:\n"
@@ -356,12 +484,13 @@ mread_f(
 	off64_t		offset, tmp, dumpoffset, printoffset;
 	ssize_t		length;
 	size_t		dumplen, cnt = 0;
-	char		*bp;
+	char		*bp, *p;
 	void		*start;
-	int		dump = 0, rflag = 0, c;
+	unsigned long long t;
+	int		dump = 0, rflag = 0, tflag = 0, c;
 	size_t		blocksize, sectsize;
 
-	while ((c = getopt(argc, argv, "frv")) != EOF) {
+	while ((c = getopt(argc, argv, "frtv")) != EOF) {
 		switch (c) {
 		case 'f':
 			dump = 2;	/* file offset dump */
@@ -369,6 +498,9 @@ mread_f(
 		case 'r':
 			rflag = 1;	/* read in reverse */
 			break;
+		case 't':
+			tflag = 1;	/* time page faults */
+			break;
 		case 'v':
 			dump = 1;	/* mapping offset dump */
 			break;
@@ -411,6 +543,8 @@ mread_f(
 	if (alloc_buffer(pagesize, 0, 0) < 0)
 		return 0;
 	bp = (char *)buffer;
+	if (tflag && !(fault_hist = hist_alloc(0)))
+		return 0;
 
 	dumplen = length % pagesize;
 	if (!dumplen)
@@ -418,7 +552,14 @@ mread_f(
 
 	if (rflag) {
 		for (tmp = length - 1, c = 0; tmp >= 0; tmp--, c = 1) {
-			*bp = *(((char *)mapping->addr) + dumpoffset + tmp);
+			p = (char *)mapping->addr + dumpoffset + tmp;
+			if (fault_hist && page_first(p, !c, 1)) {
+				t = hist_now();
+				*bp = *p;
+				hist_add(fault_hist, offset + tmp,
+						hist_now() - t);
+			} else
+				*bp = *p;
 			cnt++;
 			if (c && cnt == dumplen) {
 				if (dump) {
@@ -434,7 +575,14 @@ mread_f(
 		}
 	} else {
 		for (tmp = 0, c = 0; tmp < length; tmp++, c = 1) {
-			*bp = *(((char *)mapping->addr) + dumpoffset + tmp);
+			p = (char *)mapping->addr + dumpoffset + tmp;
+			if (fault_hist && page_first(p, !c, 0)) {
+				t = hist_now();
+				*bp = *p;
+				hist_add(fault_hist, offset + tmp,
+						hist_now() - t);
+			} else
+				*bp = *p;
 			cnt++;
 			if (c && cnt == dumplen) {
 				if (dump)
@@ -448,6 +596,11 @@ mread_f(
 			}
 		}
 	}
+	if (fault_hist) {
+		fault_report();
+		hist_free(fault_hist);
+		fault_hist = NULL;
+	}
 	return 0;
 }
 
@@ -501,6 +654,8 @@ mwrite_help(void)
 " The default stored value is 'X', repeated to fill the range specified.\n"
 " -S -- use an alternate seed character\n"
 " -r -- reverse order; start storing from the end of range, moving backward\n"
+" -t -- time the first store to each page, and report the page fault\n"
+"       latencies\n"
 " The stores are performed sequentially from the start offset by default.\n"
 "\n"));
 }
@@ -513,17 +668,21 @@ mwrite_f(
 	off64_t		offset, tmp;
 	ssize_t		length;
 	void		*start;
-	char		*sp;
+	char		*sp, *p;
+	unsigned long long t;
 	int		seed = 'X';
-	int		rflag = 0;
+	int		rflag = 0, tflag = 0;
 	int		c;
 	size_t		blocksize, sectsize;
 
-	while ((c = getopt(argc, argv, "rS:")) != EOF) {
+	while ((c = getopt(argc, argv, "rS:t")) != EOF) {
 		switch (c) {
 		case 'r':
 			rflag = 1;
 			break;
+		case 't':
+			tflag = 1;
+			break;
 		case 'S':
 			seed = (int)strtol(optarg, &sp, 0);
 			if (!sp || sp == optarg) {
@@ -562,13 +721,38 @@ mwrite_f(
 	if (!start)
 		return 0;
 
+	if (tflag && !(fault_hist = hist_alloc(0)))
+		return 0;
+
 	offset -= mapping->offset;
 	if (rflag) {
-		for (tmp = offset + length -1; tmp >= offset; tmp--)
-			((char *)mapping->addr)[tmp] = seed;
+		for (tmp = offset + length -1; tmp >= offset; tmp--) {
+			p = (char *)mapping->addr + tmp;
+			if (fault_hist &&
+			    page_first(p, tmp == offset + length - 1, 1)) {
+				t = hist_now();
+				*p = seed;
+				hist_add(fault_hist, mapping->offset + tmp,
+						hist_now() - t);
+			} else
+				*p = seed;
+		}
 	} else {
-		for (tmp = offset; tmp < offset + length; tmp++)
-			((char *)mapping->addr)[tmp] = seed;
+		for (tmp = offset; tmp < offset + length; tmp++) {
+			p = (char *)mapping->addr + tmp;
+			if (fault_hist && page_first(p, tmp == offset, 0)) {
+				t = hist_now();
+				*p = seed;
+				hist_add(fault_hist, mapping->offset + tmp,
+						hist_now() - t);
+			} else
+				*p = seed;
+		}
+	}
+	if (fault_hist) {
+		fault_report();
+		hist_free(fault_hist);
+		fault_hist = NULL;
 	}
 
 	return 0;
@@ -643,7 +827,7 @@ mmap_init(void)
 	mmap_cmd.argmin = 0;
 	mmap_cmd.argmax = -1;
 	mmap_cmd.flags = CMD_NOMAP_OK | CMD_NOFILE_OK | CMD_FOREIGN_OK;
-	mmap_cmd.args = _("[N] | [-rwx] [off len]");
+	mmap_cmd.args = _("[N] | [-rwx] [-p] [-H] [-a] [-h] [off len]");
 	mmap_cmd.oneline =
 		_("mmap a range in the current file, show mappings");
 	mmap_cmd.help = mmap_help;
@@ -654,7 +838,7 @@ mmap_init(void)
 	mread_cmd.argmin = 0;
 	mread_cmd.argmax = -1;
 	mread_cmd.flags = CMD_NOFILE_OK | CMD_FOREIGN_OK;
-	mread_cmd.args = _("[-r] [off len]");
+	mread_cmd.args = _("[-r] [-t] [off len]");
 	mread_cmd.oneline =
 		_("reads data from a region in the current memory mapping");
 	mread_cmd.help = mread_help;
@@ -683,7 +867,7 @@ mmap_init(void)
 	mwrite_cmd.argmin = 0;
 	mwrite_cmd.argmax = -1;
 	mwrite_cmd.flags = CMD_NOFILE_OK | CMD_FOREIGN_OK;
-	mwrite_cmd.args = _("[-r] [-S seed] [off len]");
+	mwrite_cmd.args = _("[-r] [-t] [-S seed] [off len]");
 	mwrite_cmd.oneline =
 		_("writes data into a region in the current memory mapping");
 	mwrite_cmd.help = mwrite_help;
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/*
+ * Verifiable data for pwrite -p and pread -p.
+ *
+ * Every 8 byte word of the file holds a value made from its own file
+ * offset and the seed, stored little endian.  So any range read back can
+ * be checked by itself, whatever order or block size it was written in,
+ * and data that ended up at the wrong offset doesn't match either.  The
+ * value is a multiply and two shifts of the offset, and the loops over
+ * whole words have no branches, so the compiler vectorises them and the
+ * data is made and checked at about memory speed.
+ */
+int		pattern;
+unsigned int	pattern_seed;
+
+static pthread_mutex_t	pattern_lock = PTHREAD_MUTEX_INITIALIZER;
+static off64_t		bad_offset;	/* lowest mismatch seen, or -1 */
+static int		bad_got, bad_want;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define pattern_le64(x)	(x)
+#else
+#define pattern_le64(x)	__builtin_bswap64(x)
+#endif
+
+/* the word at 8 byte aligned file offset off */
+static inline __uint64_t
+pattern_word(
+	__uint64_t	off,
+	__uint64_t	seed)
+{
+	__uint64_t	x = (off ^ seed) * 0x9e3779b97f4a7c15ULL;
+
+	return x ^ (x >> 29);
+}
+
+static inline unsigned char
+pattern_byte(
+	__uint64_t	off,
+	__uint64_t	seed)
+{
+	return pattern_word(off & ~7ULL, seed) >> ((off & 7) * 8);
+}
+
+static __uint64_t
+pattern_seed64(void)
+{
+	return ((__uint64_t)pattern_seed << 32) | pattern_seed;
+}
+
+static void
+pattern_fill(
+	unsigned char	*p,
+	size_t		len,
+	__uint64_t	off)
+{
+	__uint64_t	seed = pattern_seed64();
+	__uint64_t	w;
+	size_t		i, words;
+
+	for (; len && (off & 7); len--)
+		*p++ = pattern_byte(off++, seed);
+	words = len / 8;
+	for (i = 0; i < words; i++) {
+		w = pattern_le64(pattern_word(off + i * 8, seed));
+		memcpy(p + i * 8, &w, 8);
+	}
+	p += words * 8;
+	off += words * 8;
+	for (len -= words * 8; len; len--)
+		*p++ = pattern_byte(off++, seed);
+}
+
+/* returns the offset of the first byte that doesn't match, or -1 */
+static off64_t
+pattern_check(
+	const unsigned char *p,
+	size_t		len,
+	__uint64_t	off)
+{
+	__uint64_t	seed = pattern_seed64();
+	__uint64_t	w, diff;
+	size_t		i, n, chunk;
+
+	for (; len && (off & 7); len--, p++, off++)
+		if (*p != pattern_byte(off, seed))
+			return off;
+	while (len) {
+		/* or the differences over a chunk, then look closer */
+		chunk = min(len, 4096);
+		diff = 0;
+		n = chunk / 8;
+		for (i = 0; i < n; i++) {
+			memcpy(&w, p + i * 8, 8);
+			diff |= w ^ pattern_le64(pattern_word(off + i * 8, seed));
+		}
+		if (diff || n * 8 != chunk) {
+			for (i = diff ? 0 : n * 8; i < chunk; i++)
+				if (p[i] != pattern_byte(off + i, seed))
+					return off + i;
+		}
+		p += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+	return -1;
+}
+
+void
+pattern_init(
+	unsigned int	seed)
+{
+	pattern_seed = seed;
+	bad_offset = -1;
+}
+
+/* fill the I/O buffer with the data for len bytes at offset */
+void
+pattern_fill_buffer(
+	off64_t		offset,
+	ssize_t		len)
+{
+	int		i, l;
+
+	if (!vectors) {
+		pattern_fill(buffer, min(len, buffersize), offset);
+		return;
+	}
+	for (i = 0; len > 0 && i < vectors; i++) {
+		l = min(len, iov[i].iov_len);
+		pattern_fill(iov[i].iov_base, l, offset);
+		len -= l;
+		offset += l;
+	}
+}
+
+static int
+pattern_check_one(
+	const unsigned char *p,
+	size_t		len,
+	off64_t		offset)
+{
+	off64_t		bad;
+
+	bad = pattern_check(p, len, offset);
+	if (bad < 0)
+		return 0;
+	pthread_mutex_lock(&pattern_lock);
+	if (bad_offset < 0 || bad < bad_offset) {
+		bad_offset = bad;
+		bad_got = p[bad - offset];
+		bad_want = pattern_byte(bad, pattern_seed64());
+	}
+	pthread_mutex_unlock(&pattern_lock);
+	return -1;
+}
+
+/*
+ * Check len bytes read into the I/O buffer at offset.  Returns -1 if they
+ * don't match, the mismatch is reported by pattern_report().
+ */
+int
+pattern_check_buffer(
+	off64_t		offset,
+	ssize_t		len)
+{
+	int		i, l;
+
+	if (!vectors)
+		return pattern_check_one(buffer, len, offset);
+	for (i = 0; len > 0 && i < vectors; i++) {
+		l = min(len, iov[i].iov_len);
+		if (pattern_check_one(iov[i].iov_base, l, offset) < 0)
+			return -1;
+		len -= l;
+		offset += l;
+	}
+	return 0;
+}
+
+void
+pattern_report(
+	int		Cflag)
+{
+	if (bad_offset < 0) {
+		if (Cflag)
+			printf("-1\n");
+		else
+			printf(_("pattern verified\n"));
+		return;
+	}
+	exitcode = 1;
+	if (Cflag)	/* offset,read,expected */
+		printf("%lld,%d,%d\n", (long long)bad_offset, bad_got,
+			bad_want);
+	else
+		printf(_("pattern mismatch at offset %lld: "
+			 "read 0x%02x, expected 0x%02x\n"),
+			(long long)bad_offset, bad_got, bad_want);
+}
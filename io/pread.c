@@ -46,9 +46,24 @@ pread_help(void)
 " -R   -- read at random offsets in the range of bytes\n"
 " -Z N -- zeed the random number generator (used when reading randomly)\n"
 "         (heh, zorry, the -s/-S arguments were already in use in pwrite)\n"
+" -p   -- check that the data read is the pattern written by pwrite -p, and\n"
+"         report the offset of the first byte that isn't\n"
+" -S N -- the seed the pattern was written with (default 0xcdcdcdcd)\n"
+" -A N -- keep N reads in flight at once and report their completion times\n"
+" -L   -- time every read and report the latency percentiles\n"
+" -O file -- with -L, also write the offset and latency (nsec) of every read\n"
+"         to file\n"
+" -T N -- split the range between N threads reading at the same time\n"
+" -P   -- give each thread (-T) the whole range on a file of its own, the\n"
+"         current file and the ones opened after it\n"
 #ifdef HAVE_PREADV
 " -V N -- use vectored IO with N iovecs of blocksize each (preadv)\n"
 #endif
+#ifdef HAVE_PREADV2
+" -H   -- poll for completion of each read (RWF_HIPRI, needs direct IO)\n"
+" -N   -- don't block on each read (RWF_NOWAIT); a read that would block is\n"
+"         done again without the flag and counted\n"
+#endif
 "\n"
 " When in \"random\" mode, the number of read operations will equal the\n"
 " number required to do a complete forward/backward scan of the range.\n"
@@ -57,11 +72,14 @@ pread_help(void)
 "\n"));
 }
 
-void	*buffer;
-size_t	highwater;
-size_t	buffersize;
-int	vectors;
-struct iovec *iov;
+__thread void	*buffer;
+__thread size_t	highwater;
+__thread size_t	buffersize;
+__thread int	vectors;
+__thread struct iovec *iov;
+
+int		rwf_flags;
+long long	rwf_blocked;
 
 static int
 alloc_iovec(
@@ -122,6 +140,22 @@ alloc_buffer(
 	return 0;
 }
 
+void
+free_buffer(void)
+{
+	int		i;
+
+	if (iov) {
+		for (i = 0; i < vectors; i++)
+			free(iov[i].iov_base);
+		free(iov);
+		iov = NULL;
+	}
+	free(buffer);
+	buffer = NULL;
+	highwater = buffersize = 0;
+}
+
 void
 __dump_buffer(
 	void		*buf,
@@ -169,6 +203,45 @@ dump_buffer(
 	}
 }
 
+/* report how many RWF_NOWAIT reads or writes would have blocked */
+void
+rwf_report(
+	const char	*what,
+	int		Cflag)
+{
+	if (Cflag)
+		printf("%lld\n", rwf_blocked);
+	else
+		printf(_("%lld %s would have blocked (RWF_NOWAIT)\n"),
+			rwf_blocked, what);
+}
+
+#ifdef HAVE_PREADV2
+/*
+ * With RWF_NOWAIT a read that would block fails with EAGAIN instead, and
+ * is done again without the flag.
+ */
+static ssize_t
+rwf_preadv(
+	int		fd,
+	const struct iovec *vec,
+	int		nvecs,
+	off64_t		offset)
+{
+	ssize_t		bytes;
+
+	bytes = preadv2(fd, vec, nvecs, offset, rwf_flags);
+	if (bytes < 0 && errno == EAGAIN && (rwf_flags & RWF_NOWAIT)) {
+		__sync_fetch_and_add(&rwf_blocked, 1);
+		bytes = preadv2(fd, vec, nvecs, offset,
+				rwf_flags & ~RWF_NOWAIT);
+	}
+	return bytes;
+}
+#else
+#define rwf_preadv(fd, vec, nvecs, offset)	preadv(fd, vec, nvecs, offset)
+#endif
+
 #ifdef HAVE_PREADV
 static int
 do_preadv(
@@ -177,10 +250,18 @@ do_preadv(
 	ssize_t		count,
 	ssize_t		buffer_size)
 {
+	struct iovec	one;
 	int		vecs = 0;
 	ssize_t		oldlen = 0;
 	ssize_t		bytes = 0;
 
+	/* plain reads only come here for the preadv2 flags */
+	if (!vectors) {
+		one.iov_base = buffer;
+		one.iov_len = min(count, buffer_size);
+		return rwf_preadv(fd, &one, 1, offset);
+	}
+
 	/* trim the iovec if necessary */
 	if (count < buffersize) {
 		size_t	len = 0;
@@ -194,7 +275,7 @@ do_preadv(
 	} else {
 		vecs = vectors;
 	}
-	bytes = preadv(fd, iov, vectors, offset);
+	bytes = rwf_preadv(fd, iov, vectors, offset);
 
 	/* restore trimmed iov */
 	if (oldlen)
@@ -206,17 +287,31 @@ do_preadv(
 #define do_preadv(fd, offset, count, buffer_size) (0)
 #endif
 
-static int
+int
 do_pread(
 	int		fd,
 	off64_t		offset,
 	ssize_t		count,
 	ssize_t		buffer_size)
 {
-	if (!vectors)
-		return pread64(fd, buffer, min(count, buffer_size), offset);
+	unsigned long long start = 0;
+	ssize_t		bytes;
 
-	return do_preadv(fd, offset, count, buffer_size);
+	trace_io(TRACE_READ, offset, min(count, buffer_size));
+	if (aio_depth)
+		return aioq_rw(offset, min(count, buffer_size), 0);
+	if (io_hist)
+		start = hist_now();
+	if (!vectors && !rwf_flags)
+		bytes = pread64(fd, buffer, min(count, buffer_size), offset);
+	else
+		bytes = do_preadv(fd, offset, count, buffer_size);
+	if (io_hist && bytes > 0)
+		hist_add(io_hist, offset, hist_now() - start);
+	/* stop at the first mismatch */
+	if (pattern && bytes > 0 && pattern_check_buffer(offset, bytes) < 0)
+		return 0;
+	return bytes;
 }
 
 static int
@@ -303,7 +398,7 @@ read_backward(
 	}
 
 	/* Iterate backward through the rest of the range */
-	while (cnt > end) {
+	while (cnt > 0) {
 		bytes_requested = min(cnt, buffersize);
 		off -= bytes_requested;
 		bytes = do_pread(fd, off, cnt, buffersize);
@@ -356,6 +451,61 @@ read_forward(
 	return ops;
 }
 
+static int
+read_pattern(
+	int		fd,
+	int		direction,
+	off64_t		*offset,
+	long long	*count,
+	long long	*total,
+	unsigned int	zeed,
+	int		verbose,
+	int		eof)
+{
+	switch (direction) {
+	case IO_RANDOM:
+		return read_random(fd, *offset, *count, total, zeed, eof);
+	case IO_FORWARD:
+		return read_forward(fd, *offset, *count, total, verbose, 0, eof);
+	case IO_BACKWARD:
+		return read_backward(fd, offset, count, total, eof);
+	default:
+		ASSERT(0);
+	}
+	return -1;
+}
+
+struct pread_args {
+	size_t		bsize;
+	int		uflag;
+	int		vectors;
+	int		direction;
+	unsigned int	zeed;
+};
+
+static int
+pread_thread(
+	struct io_thread	*t)
+{
+	struct pread_args	*args = t->arg;
+	off64_t			offset = t->offset;
+	long long		count = t->count;
+	int			ops;
+
+	if (!count)
+		return 0;
+	vectors = args->vectors;
+	if (alloc_buffer(args->bsize, args->uflag, 0xabababab) < 0)
+		return -1;
+	/* backwards reads start at the end of the thread's slice */
+	if (args->direction == IO_BACKWARD)
+		offset += count;
+	ops = read_pattern(t->file->fd, args->direction, &offset, &count,
+			&t->total, args->zeed + t->index, 0, 0);
+	free_buffer();
+	return ops;
+}
+
 int
 read_buffer(
 	int		fd,
@@ -365,7 +515,13 @@ read_buffer(
 	int		verbose,
 	int		onlyone)
 {
-	return read_forward(fd, offset, count, total, verbose, onlyone, 0);
+	int		ops;
+
+	/* reads of an input file aren't part of a trace */
+	trace_skip++;
+	ops = read_forward(fd, offset, count, total, verbose, onlyone, 0);
+	trace_skip--;
+	return ops;
 }
 
 static int
@@ -375,22 +531,39 @@ pread_f(
 {
 	size_t		bsize;
 	off64_t		offset;
-	unsigned int	zeed = 0;
+	unsigned int	zeed = 0, seed = 0xcdcdcdcd;
 	long long	count, total, tmp;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct aio_stats astats;
+	struct io_thread *threads = NULL;
+	struct io_hist	*hist = NULL;
+	struct pread_args args;
 	char		s1[64], s2[64], ts[64];
-	char		*sp;
-	int		Cflag, qflag, uflag, vflag;
+	char		*sp, *histfile = NULL;
+	int		Cflag, qflag, uflag, vflag, Pflag, Lflag;
 	int		eof = 0, direction = IO_FORWARD;
+	int		nthreads = 0;
 	int		c;
 
-	Cflag = qflag = uflag = vflag = 0;
+	Cflag = qflag = uflag = vflag = Pflag = Lflag = 0;
+	aio_depth = 0;
+	rwf_flags = 0;
+	rwf_blocked = 0;
+	pattern = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCFRquvV:Z:")) != EOF) {
+	while ((c = getopt(argc, argv, "A:b:BCFHLNO:pPqRS:T:uvV:Z:")) != EOF) {
 		switch (c) {
+		case 'A':
+			aio_depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || *sp || aio_depth <= 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				aio_depth = 0;
+				return 0;
+			}
+			break;
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
 			if (tmp < 0) {
@@ -411,9 +584,41 @@ pread_f(
 		case 'R':
 			direction = IO_RANDOM;
 			break;
+#ifdef HAVE_PREADV2
+		case 'H':
+			rwf_flags |= RWF_HIPRI;
+			break;
+		case 'N':
+			rwf_flags |= RWF_NOWAIT;
+			break;
+#endif
+		case 'L':
+			Lflag = 1;
+			break;
+		case 'O':
+			histfile = optarg;
+			break;
+		case 'p':
+			pattern = 1;
+			break;
+		case 'P':
+			Pflag = 1;
+			break;
 		case 'q':
 			qflag = 1;
 			break;
+		case 'S':
+			seed = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg) {
+				printf(_("non-numeric seed -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
 		case 'u':
 			uflag = 1;
 			break;
@@ -443,6 +648,18 @@ pread_f(
 	}
 	if (optind != argc - 2)
 		return command_usage(&pread_cmd);
+	if (aio_depth && (vflag || vectors || nthreads || rwf_flags || pattern)) {
+		aio_depth = 0;
+		return command_usage(&pread_cmd);
+	}
+	if ((Pflag && !nthreads) || (nthreads && vflag))
+		return command_usage(&pread_cmd);
+	if (histfile && !Lflag) {
+		aio_depth = 0;
+		return command_usage(&pread_cmd);
+	}
+	if (pattern)
+		pattern_init(seed);
 
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0 && (direction & (IO_RANDOM|IO_BACKWARD))) {
@@ -459,32 +676,57 @@ pread_f(
 		printf(_("non-numeric length argument -- %s\n"), argv[optind]);
 		return 0;
 	}
+	if (nthreads && eof) {
+		printf(_("threads need an offset and length to split\n"));
+		return 0;
+	}
 
-	if (alloc_buffer(bsize, uflag, 0xabababab) < 0)
+	if (nthreads) {
+		threads = io_threads_alloc(nthreads, Pflag, offset, count,
+				vectors ? bsize * vectors : bsize);
+		if (!threads)
+			return 0;
+		args.bsize = bsize;
+		args.uflag = uflag;
+		args.vectors = vectors;
+		args.direction = direction;
+	} else if (alloc_buffer(bsize, uflag, 0xabababab) < 0)
 		return 0;
+	c = -1;
+	if (Lflag) {
+		hist = hist_alloc(histfile != NULL);
+		if (!hist)
+			goto done;
+		if (nthreads &&
+		    io_threads_hist_alloc(threads, nthreads, hist->keep) < 0)
+			goto done;
+		if (!nthreads)
+			io_hist = hist;
+	}
+	if (aio_depth && aioq_init(file->fd, bsize, uflag, 0xabababab) < 0)
+		goto done;
 
+	if (direction == IO_RANDOM && !zeed)	/* srandom seed */
+		zeed = time(NULL);
 	gettimeofday(&t1, NULL);
-	switch (direction) {
-	case IO_RANDOM:
-		if (!zeed)	/* srandom seed */
-			zeed = time(NULL);
-		c = read_random(file->fd, offset, count, &total, zeed, eof);
-		break;
-	case IO_FORWARD:
-		c = read_forward(file->fd, offset, count, &total, vflag, 0, eof);
-		if (eof)
-			count = total;
-		break;
-	case IO_BACKWARD:
-		c = read_backward(file->fd, &offset, &count, &total, eof);
-		break;
-	default:
-		ASSERT(0);
-	}
-	if (c < 0)
-		return 0;
-	if (qflag)
-		return 0;
+	if (nthreads) {
+		args.zeed = zeed;
+		c = io_threads_run(threads, nthreads, pread_thread, &args);
+		if (hist)
+			io_threads_hist_merge(threads, nthreads, hist);
+		if (c == 0)
+			c = io_threads_sum(threads, nthreads, &total);
+		if (Pflag)
+			count *= nthreads;
+	} else
+		c = read_pattern(file->fd, direction, &offset, &count, &total,
+				zeed, vflag, eof);
+	if (aio_depth)
+		c = aioq_finish(c, &total, &astats);
+	if (direction == IO_FORWARD && eof)
+		count = total;
+	if (c < 0 || qflag)
+		goto done;
 	gettimeofday(&t2, NULL);
 	t2 = tsub(t2, t1);
 
@@ -502,6 +744,23 @@ pread_f(
 			total, c, ts,
 			tdiv((double)total, t2), tdiv((double)c, t2));
 	}
+	if (aio_depth)
+		aioq_report(&astats, Cflag);
+	if (hist)
+		hist_report(hist, Cflag);
+	if (rwf_flags & RWF_NOWAIT)
+		rwf_report(_("reads"), Cflag);
+	if (nthreads)
+		io_threads_report(threads, nthreads, Cflag);
+done:
+	if (pattern && c >= 0)
+		pattern_report(Cflag);
+	pattern = 0;
+	if (hist && c >= 0 && histfile)
+		hist_dump(hist, histfile);
+	io_hist = NULL;
+	hist_free(hist);
+	free(threads);
 	return 0;
 }
 
@@ -514,7 +773,8 @@ pread_init(void)
 	pread_cmd.argmin = 2;
 	pread_cmd.argmax = -1;
 	pread_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	pread_cmd.args = _("[-b bs] [-v] [-i N] [-FBR [-Z N]] off len");
+	pread_cmd.args =
+_("[-b bs] [-v] [-p [-S seed]] [-i N] [-FBR [-Z N]] [-HN] [-A N] [-T N [-P]] [-L [-O file]] off len");
 	pread_cmd.oneline = _("reads a number of bytes at a specified offset");
 	pread_cmd.help = pread_help;
 
@@ -19,6 +19,10 @@
 #if defined(HAVE_FALLOCATE)
 #include <linux/falloc.h>
 #endif
+#if defined(HAVE_FIEMAP)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
 #include "command.h"
 #include "input.h"
 #include "init.h"
@@ -286,6 +290,335 @@ fzero_f(
 	}
 	return 0;
 }
+
+/*
+ * Preallocation benchmark: fallocate calls in a given pattern, on files of
+ * their own from each of a number of threads, to see how the allocator
+ * holds up and how fragmented the files come out.  The patterns are
+ *
+ * interleave:	each thread grows its files a block at a time in turn, so
+ *		their allocations are interleaved as a set of logs or
+ *		streams appended to at once would be;
+ * punch:	a hole is punched at a random block of a preallocated file
+ *		and allocated again;
+ * collapse:	a block is allocated at the end of a preallocated file and
+ *		collapsed away at the start, as for a log trimmed from the
+ *		head while it is appended to.
+ *
+ * Every fallocate call counts as an op.
+ */
+enum {
+	FBENCH_INTERLEAVE,
+	FBENCH_PUNCH,
+	FBENCH_COLLAPSE,
+	FBENCH_NPATTERNS
+};
+
+static const char *fbench_patterns[] = {
+	[FBENCH_INTERLEAVE]	= "interleave",
+	[FBENCH_PUNCH]		= "punch",
+	[FBENCH_COLLAPSE]	= "collapse",
+};
+
+struct fbench_args {
+	int		pattern;
+	int		nfiles;		/* per thread */
+	long long	bsize;
+	long long	size;		/* of the files to start with */
+	long long	count;		/* ops per thread */
+	int		*fds;		/* nfiles for each thread */
+};
+
+static cmdinfo_t fbench_cmd;
+
+static void
+fbench_help(void)
+{
+	printf(_(
+"\n"
+" times fallocate calls in a given pattern on new files in a directory\n"
+"\n"
+" Each thread gets files of its own, made in the directory given and\n"
+" removed again at the end, and runs count fallocate calls on them.  The\n"
+" ops per second are reported, and the number of extents the files ended\n"
+" up with.\n"
+" -b bsize -- size of each allocation (default 64k)\n"
+" -c count -- fallocate calls per thread (default 4096)\n"
+" -C -- print the results in a condensed format\n"
+" -k -- keep the files\n"
+" -n files -- files per thread (default 8)\n"
+" -p pattern -- interleave (the default), punch or collapse:\n"
+"    interleave -- each file grows a block at a time, in turn\n"
+"    punch -- punch out a random block and allocate it again\n"
+"    collapse -- allocate a block at the end and collapse one at the start\n"
+" -s size -- size the files are preallocated to for punch and collapse\n"
+"    (default 16m)\n"
+" -T threads -- number of threads (default 1)\n"
+"\n"));
+}
+
+static int
+fbench_falloc(
+	int		fd,
+	int		mode,
+	off64_t		offset,
+	long long	len)
+{
+	if (fallocate(fd, mode, offset, len) < 0) {
+		perror("fallocate");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fbench_thread(
+	struct io_thread	*t)
+{
+	struct fbench_args	*args = t->arg;
+	int			*fds = &args->fds[t->index * args->nfiles];
+	long long		nblocks = args->size / args->bsize;
+	unsigned int		seed = t->index + 1;
+	off64_t			offset;
+	long long		i;
+	int			fd;
+	int			ops = 0;
+
+	for (i = 0; i < args->count; i++) {
+		fd = fds[i % args->nfiles];
+		switch (args->pattern) {
+		case FBENCH_INTERLEAVE:
+			offset = i / args->nfiles * args->bsize;
+			if (fbench_falloc(fd, 0, offset, args->bsize) < 0)
+				return -1;
+			break;
+		case FBENCH_PUNCH:
+			offset = rand_r(&seed) % nblocks * args->bsize;
+			if (fbench_falloc(fd, FALLOC_FL_PUNCH_HOLE |
+						FALLOC_FL_KEEP_SIZE,
+					offset, args->bsize) < 0)
+				return -1;
+			if (++i < args->count) {
+				if (fbench_falloc(fd, 0, offset,
+						args->bsize) < 0)
+					return -1;
+				ops++;
+			}
+			break;
+		case FBENCH_COLLAPSE:
+			if (fbench_falloc(fd, 0, args->size,
+					args->bsize) < 0)
+				return -1;
+			if (++i < args->count) {
+				if (fbench_falloc(fd, FALLOC_FL_COLLAPSE_RANGE,
+						0, args->bsize) < 0)
+					return -1;
+				ops++;
+			}
+			break;
+		}
+		ops++;
+	}
+	return ops;
+}
+
+#if defined(HAVE_FIEMAP)
+/* a fiemap call with no room for extents just counts them */
+static long long
+fbench_extents(
+	int		fd)
+{
+	struct fiemap	fiemap;
+
+	memset(&fiemap, 0, sizeof(fiemap));
+	fiemap.fm_length = FIEMAP_MAX_OFFSET;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fiemap) < 0) {
+		perror("FS_IOC_FIEMAP");
+		return -1;
+	}
+	return fiemap.fm_mapped_extents;
+}
+#else
+static long long
+fbench_extents(
+	int		fd)
+{
+	return -1;
+}
+#endif
+
+static void
+fbench_name(
+	char		*path,
+	size_t		size,
+	const char	*dir,
+	int		n)
+{
+	snprintf(path, size, "%s/fbench.%d.%d", dir, (int)getpid(), n);
+}
+
+static int
+fbench_f(
+	int			argc,
+	char			**argv)
+{
+	struct fbench_args	args;
+	struct io_thread	*threads = NULL;
+	struct timeval		t1, t2;
+	char			path[PATH_MAX];
+	char			ts[64];
+	size_t			blocksize, sectsize;
+	long long		extents = 0, max_extents = 0, n;
+	char			*dir;
+	int			nthreads = 1;
+	int			Cflag = 0, kflag = 0;
+	int			nopened = 0;
+	int			c, i, ops;
+
+	memset(&args, 0, sizeof(args));
+	args.pattern = FBENCH_INTERLEAVE;
+	args.nfiles = 8;
+	args.bsize = 65536;
+	args.size = 16 * 1024 * 1024;
+	args.count = 4096;
+
+	init_cvtnum(&blocksize, &sectsize);
+	while ((c = getopt(argc, argv, "b:c:Ckn:p:s:T:")) != EOF) {
+		switch (c) {
+		case 'b':
+			args.bsize = cvtnum(blocksize, sectsize, optarg);
+			if (args.bsize <= 0) {
+				printf(_("non-positive bsize -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'c':
+			args.count = cvtnum(blocksize, sectsize, optarg);
+			if (args.count <= 0 || args.count > INT_MAX) {
+				printf(_("bad count -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'k':
+			kflag = 1;
+			break;
+		case 'n':
+			args.nfiles = cvtnum(blocksize, sectsize, optarg);
+			if (args.nfiles <= 0) {
+				printf(_("bad number of files -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
+		case 'p':
+			for (i = 0; i < FBENCH_NPATTERNS; i++)
+				if (!strcmp(optarg, fbench_patterns[i]))
+					break;
+			if (i == FBENCH_NPATTERNS) {
+				printf(_("unknown pattern -- %s\n"), optarg);
+				return 0;
+			}
+			args.pattern = i;
+			break;
+		case 's':
+			args.size = cvtnum(blocksize, sectsize, optarg);
+			if (args.size <= 0) {
+				printf(_("non-positive size -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
+		default:
+			return command_usage(&fbench_cmd);
+		}
+	}
+	if (optind != argc - 1)
+		return command_usage(&fbench_cmd);
+	dir = argv[optind];
+	if (args.pattern != FBENCH_INTERLEAVE && args.size < args.bsize) {
+		printf(_("size %lld is less than bsize %lld\n"),
+			args.size, args.bsize);
+		return 0;
+	}
+
+	args.fds = calloc(nthreads * args.nfiles, sizeof(int));
+	if (!args.fds) {
+		perror("calloc");
+		return 0;
+	}
+	for (nopened = 0; nopened < nthreads * args.nfiles; nopened++) {
+		fbench_name(path, sizeof(path), dir, nopened);
+		args.fds[nopened] = open(path, O_RDWR | O_CREAT | O_TRUNC,
+					0600);
+		if (args.fds[nopened] < 0) {
+			perror(path);
+			goto done;
+		}
+		if (args.pattern != FBENCH_INTERLEAVE &&
+		    fbench_falloc(args.fds[nopened], 0, 0, args.size) < 0) {
+			nopened++;
+			goto done;
+		}
+	}
+
+	threads = io_threads_alloc(nthreads, 0, 0, 0, 0);
+	if (!threads)
+		goto done;
+	gettimeofday(&t1, NULL);
+	if (io_threads_run(threads, nthreads, fbench_thread, &args) < 0)
+		goto done;
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+	ops = io_threads_sum(threads, nthreads, &n);
+
+	for (i = 0; i < nopened; i++) {
+		n = fbench_extents(args.fds[i]);
+		if (n < 0) {
+			extents = -1;
+			break;
+		}
+		extents += n;
+		max_extents = max(max_extents, n);
+	}
+
+	timestr(&t2, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+	if (!Cflag) {
+		printf(_("%s: %d ops on %d files; %s (%.4f ops/sec)\n"),
+			fbench_patterns[args.pattern], ops, nopened, ts,
+			tdiv((double)ops, t2));
+		if (extents >= 0)
+			printf(_("%lld extents, %.1f per file, %lld at most\n"),
+				extents, (double)extents / nopened,
+				max_extents);
+		for (i = 0; nthreads > 1 && i < nthreads; i++)
+			printf(_("thread %d: %d ops; %.4f ops/sec\n"),
+				i, threads[i].ops,
+				tdiv((double)threads[i].ops, threads[i].time));
+	} else {/* pattern,ops,files,time,ops/sec,extents,max_extents */
+		printf("%s,%d,%d,%s,%.3f,%lld,%lld\n",
+			fbench_patterns[args.pattern], ops, nopened, ts,
+			tdiv((double)ops, t2), extents, max_extents);
+	}
+
+done:
+	for (i = 0; i < nopened; i++) {
+		close(args.fds[i]);
+		if (!kflag) {
+			fbench_name(path, sizeof(path), dir, i);
+			unlink(path);
+		}
+	}
+	free(args.fds);
+	free(threads);
+	return 0;
+}
 #endif	/* HAVE_FALLOCATE */
 
 void
@@ -390,5 +723,17 @@ prealloc_init(void)
 	fzero_cmd.oneline =
 	_("zeroes space and eliminates holes by preallocating");
 	add_command(&fzero_cmd);
+
+	fbench_cmd.name = "fbench";
+	fbench_cmd.cfunc = fbench_f;
+	fbench_cmd.argmin = 1;
+	fbench_cmd.argmax = -1;
+	fbench_cmd.flags = CMD_NOFILE_OK | CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fbench_cmd.args =
+_("[-Ck] [-p pattern] [-T threads] [-n files] [-b bsize] [-c count] [-s size] dir");
+	fbench_cmd.oneline =
+	_("times fallocate patterns on sets of files from several threads");
+	fbench_cmd.help = fbench_help;
+	add_command(&fbench_cmd);
 #endif	/* HAVE_FALLOCATE */
 }
@@ -40,6 +40,8 @@ pwrite_help(void)
 " blocksize tunable using the -b option (default blocksize is 4096 bytes),\n"
 " unless a different write pattern is requested.\n"
 " -S   -- use an alternate seed number for filling the write buffer\n"
+" -p   -- write a pattern made from each word's file offset and the seed,\n"
+"         which pread -p can check\n"
 " -i   -- input file, source of data to write (used when writing forward)\n"
 " -d   -- open the input file for direct IO\n"
 " -s   -- skip a number of bytes at the start of the input file\n"
@@ -50,12 +52,176 @@ pwrite_help(void)
 " -R   -- write at random offsets in the specified range of bytes\n"
 " -Z N -- zeed the random number generator (used when writing randomly)\n"
 "         (heh, zorry, the -s/-S arguments were already in use in pwrite)\n"
+" -A N -- keep N writes in flight at once and report their completion times\n"
+" -L   -- time every write and report the latency percentiles\n"
+" -O file -- with -L, also write the offset and latency (nsec) of every write\n"
+"         to file\n"
+" -T N -- split the range between N threads writing at the same time\n"
+" -P   -- give each thread (-T) the whole range on a file of its own, the\n"
+"         current file and the ones opened after it\n"
 #ifdef HAVE_PWRITEV
 " -V N -- use vectored IO with N iovecs of blocksize each (pwritev)\n"
 #endif
+#ifdef HAVE_PWRITEV2
+" -D   -- make each write synchronous for its data (RWF_DSYNC)\n"
+" -Y   -- make each write synchronous (RWF_SYNC)\n"
+" -H   -- poll for completion of each write (RWF_HIPRI, needs direct IO)\n"
+" -N   -- don't block on each write (RWF_NOWAIT); a write that would block\n"
+"         is done again without the flag and counted\n"
+#endif
+#ifdef HAVE_SYNC_FILE_RANGE
+" -K N -- start writeback (sync_file_range) on every N bytes written, and\n"
+"         wait for it a number of windows behind the writer (forwards only)\n"
+" -l N -- with -K, wait for writeback N windows behind the writer\n"
+"         (default 1); the end waits for all of it, so the time reported\n"
+"         is for the data being on disk\n"
+#endif
 "\n"));
 }
 
+#ifdef HAVE_SYNC_FILE_RANGE
+/*
+ * Streaming writeback (-K): rather than letting a large buffered write
+ * dirty memory until the kernel gets around to flushing it in bursts,
+ * start writeback on each window of the range as soon as it is written,
+ * and wait for the window lag behind it before going on.  The amount of
+ * dirty and in flight data is then bounded by the window and lag, and
+ * the throughput is what the storage can sustain.
+ */
+static long long	wb_window;
+static int		wb_lag;
+static long long	wb_waits;
+static unsigned long long wb_wait_ns;
+
+static int
+writeback_range(
+	int		fd,
+	off64_t		offset,
+	long long	len,
+	unsigned int	flags)
+{
+	unsigned long long start = 0;
+
+	if (flags & SYNC_FILE_RANGE_WAIT_AFTER)
+		start = hist_now();
+	if (sync_file_range(fd, offset, len, flags) < 0) {
+		perror("sync_file_range");
+		return -1;
+	}
+	if (flags & SYNC_FILE_RANGE_WAIT_AFTER) {
+		counter_add(&wb_waits, 1);
+		counter_add(&wb_wait_ns, hist_now() - start);
+	}
+	return 0;
+}
+
+/* start writeback on the windows written up to end since *next */
+static int
+writeback_behind(
+	int		fd,
+	off64_t		base,
+	off64_t		*next,
+	off64_t		end)
+{
+	off64_t		behind;
+
+	while (end - *next >= wb_window) {
+		if (writeback_range(fd, *next, wb_window,
+				SYNC_FILE_RANGE_WRITE) < 0)
+			return -1;
+		behind = *next - wb_lag * wb_window;
+		if (behind >= base &&
+		    writeback_range(fd, behind, wb_window,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+			return -1;
+		*next += wb_window;
+	}
+	return 0;
+}
+
+/* write back whatever is left, and wait for all of it */
+static int
+writeback_finish(
+	int		fd,
+	off64_t		base,
+	long long	len)
+{
+	if (!len)
+		return 0;
+	return writeback_range(fd, base, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+}
+
+static void
+writeback_report(
+	int		Cflag)
+{
+	struct timeval	tv;
+	char		s1[64], ts[64];
+
+	tv.tv_sec = wb_wait_ns / 1000000000ULL;
+	tv.tv_usec = wb_wait_ns % 1000000000ULL / 1000;
+	timestr(&tv, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+	if (Cflag) {	/* waits,wait time */
+		printf("%lld,%s\n", wb_waits, ts);
+	} else {
+		cvtstr((double)wb_window, s1, sizeof(s1));
+		printf(_("writeback in %s windows, %d behind: "
+			 "%lld waits, %s waiting\n"),
+			s1, wb_lag, wb_waits, ts);
+	}
+}
+#else
+#define wb_window	(0LL)
+
+static int
+writeback_behind(
+	int		fd,
+	off64_t		base,
+	off64_t		*next,
+	off64_t		end)
+{
+	return 0;
+}
+
+static int
+writeback_finish(
+	int		fd,
+	off64_t		base,
+	long long	len)
+{
+	return 0;
+}
+#endif
+
+#ifdef HAVE_PWRITEV2
+/*
+ * With RWF_NOWAIT a write that would block fails with EAGAIN instead, and
+ * is done again without the flag.
+ */
+static ssize_t
+rwf_pwritev(
+	int		fd,
+	const struct iovec *vec,
+	int		nvecs,
+	off64_t		offset)
+{
+	ssize_t		bytes;
+
+	bytes = pwritev2(fd, vec, nvecs, offset, rwf_flags);
+	if (bytes < 0 && errno == EAGAIN && (rwf_flags & RWF_NOWAIT)) {
+		__sync_fetch_and_add(&rwf_blocked, 1);
+		bytes = pwritev2(fd, vec, nvecs, offset,
+				rwf_flags & ~RWF_NOWAIT);
+	}
+	return bytes;
+}
+#else
+#define rwf_pwritev(fd, vec, nvecs, offset)	pwritev(fd, vec, nvecs, offset)
+#endif
+
 #ifdef HAVE_PWRITEV
 static int
 do_pwritev(
@@ -64,10 +230,18 @@ do_pwritev(
 	ssize_t		count,
 	ssize_t		buffer_size)
 {
+	struct iovec one;
 	int vecs = 0;
 	ssize_t oldlen = 0;
 	ssize_t bytes = 0;
 
+	/* plain writes only come here for the pwritev2 flags */
+	if (!vectors) {
+		one.iov_base = buffer;
+		one.iov_len = min(count, buffer_size);
+		return rwf_pwritev(fd, &one, 1, offset);
+	}
+
 	/* trim the iovec if necessary */
 	if (count < buffersize) {
 		size_t	len = 0;
@@ -81,7 +255,7 @@ do_pwritev(
 	} else {
 		vecs = vectors;
 	}
-	bytes = pwritev(fd, iov, vectors, offset);
+	bytes = rwf_pwritev(fd, iov, vectors, offset);
 
 	/* restore trimmed iov */
 	if (oldlen)
@@ -93,21 +267,35 @@ do_pwritev(
 #define do_pwritev(fd, offset, count, buffer_size) (0)
 #endif
 
-static int
+int
 do_pwrite(
 	int		fd,
 	off64_t		offset,
 	ssize_t		count,
 	ssize_t		buffer_size)
 {
-	if (!vectors)
-		return pwrite64(fd, buffer, min(count, buffer_size), offset);
+	unsigned long long start = 0;
+	ssize_t		bytes;
 
-	return do_pwritev(fd, offset, count, buffer_size);
+	trace_io(TRACE_WRITE, offset, min(count, buffer_size));
+	if (aio_depth)
+		return aioq_rw(offset, min(count, buffer_size), 1);
+	if (pattern)
+		pattern_fill_buffer(offset, min(count, buffer_size));
+	if (io_hist)
+		start = hist_now();
+	if (!vectors && !rwf_flags)
+		bytes = pwrite64(fd, buffer, min(count, buffer_size), offset);
+	else
+		bytes = do_pwritev(fd, offset, count, buffer_size);
+	if (io_hist && bytes > 0)
+		hist_add(io_hist, offset, hist_now() - start);
+	return bytes;
 }
 
 static int
 write_random(
+	int		fd,
 	off64_t		offset,
 	long long	count,
 	unsigned int	seed,
@@ -129,7 +317,7 @@ write_random(
 	*total = 0;
 	while (count > 0) {
 		off = ((offset + (random() % range)) / buffersize) * buffersize;
-		bytes = do_pwrite(file->fd, off, buffersize, buffersize);
+		bytes = do_pwrite(fd, off, buffersize, buffersize);
 		if (bytes == 0)
 			break;
 		if (bytes < 0) {
@@ -147,6 +335,7 @@ write_random(
 
 static int
 write_backward(
+	int		fd,
 	off64_t		offset,
 	long long	*count,
 	long long	*total)
@@ -167,7 +356,7 @@ write_backward(
 	if ((bytes_requested = (off % buffersize))) {
 		bytes_requested = min(cnt, bytes_requested);
 		off -= bytes_requested;
-		bytes = do_pwrite(file->fd, off, bytes_requested, buffersize);
+		bytes = do_pwrite(fd, off, bytes_requested, buffersize);
 		if (bytes == 0)
 			return ops;
 		if (bytes < 0) {
@@ -182,10 +371,10 @@ write_backward(
 	}
 
 	/* Iterate backward through the rest of the range */
-	while (cnt > end) {
+	while (cnt > 0) {
 		bytes_requested = min(cnt, buffersize);
 		off -= bytes_requested;
-		bytes = do_pwrite(file->fd, off, cnt, buffersize);
+		bytes = do_pwrite(fd, off, cnt, buffersize);
 		if (bytes == 0)
 			break;
 		if (bytes < 0) {
@@ -203,24 +392,26 @@ write_backward(
 
 static int
 write_buffer(
+	int		fd,
 	off64_t		offset,
 	long long	count,
 	size_t		bs,
-	int		fd,
+	int		infd,
 	off64_t		skip,
 	long long	*total)
 {
 	ssize_t		bytes;
 	long long	bar = min(bs, count);
+	off64_t		base = offset, next = offset;
 	int		ops = 0;
 
 	*total = 0;
 	while (count >= 0) {
-		if (fd > 0) {	/* input file given, read buffer first */
-			if (read_buffer(fd, skip + *total, bs, &bar, 0, 1) < 0)
+		if (infd > 0) {	/* input file given, read buffer first */
+			if (read_buffer(infd, skip + *total, bs, &bar, 0, 1) < 0)
 				break;
 		}
-		bytes = do_pwrite(file->fd, offset, count, bar);
+		bytes = do_pwrite(fd, offset, count, bar);
 		if (bytes == 0)
 			break;
 		if (bytes < 0) {
@@ -229,6 +420,9 @@ write_buffer(
 		}
 		ops++;
 		*total += bytes;
+		if (wb_window &&
+		    writeback_behind(fd, base, &next, offset + bytes) < 0)
+			return -1;
 		if (bytes <  min(count, bar))
 			break;
 		offset += bytes;
@@ -236,6 +430,61 @@ write_buffer(
 		if (count == 0)
 			break;
 	}
+	if (wb_window && writeback_finish(fd, base, *total) < 0)
+		return -1;
+	return ops;
+}
+
+struct pwrite_args {
+	size_t		bsize;
+	int		uflag;
+	int		vectors;
+	int		direction;
+	unsigned int	seed;
+	unsigned int	zeed;
+	int		wflag;
+	int		Wflag;
+};
+
+static int
+pwrite_thread(
+	struct io_thread	*t)
+{
+	struct pwrite_args	*args = t->arg;
+	int			fd = t->file->fd;
+	long long		count = t->count;
+	int			ops = 0;
+
+	if (!count)
+		return 0;
+	vectors = args->vectors;
+	if (alloc_buffer(args->bsize, args->uflag, args->seed) < 0)
+		return -1;
+	switch (args->direction) {
+	case IO_RANDOM:
+		ops = write_random(fd, t->offset, count, args->zeed + t->index,
+				&t->total);
+		break;
+	case IO_FORWARD:
+		ops = write_buffer(fd, t->offset, count, args->bsize, -1, 0,
+				&t->total);
+		break;
+	case IO_BACKWARD:
+		/* backwards writes start at the end of the thread's slice */
+		ops = write_backward(fd, t->offset + count, &count, &t->total);
+		break;
+	default:
+		ASSERT(0);
+	}
+	free_buffer();
+	if (ops >= 0 && args->Wflag) {
+		trace_io(TRACE_FSYNC, 0, 0);
+		fsync(fd);
+	}
+	if (ops >= 0 && args->wflag) {
+		trace_io(TRACE_FDATASYNC, 0, 0);
+		fdatasync(fd);
+	}
 	return ops;
 }
 
@@ -250,18 +499,39 @@ pwrite_f(
 	unsigned int	zeed = 0, seed = 0xcdcdcdcd;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct aio_stats astats;
+	struct io_thread *threads = NULL;
+	struct io_hist	*hist = NULL;
+	struct pwrite_args args;
 	char		s1[64], s2[64], ts[64];
-	char		*sp, *infile = NULL;
-	int		Cflag, qflag, uflag, dflag, wflag, Wflag;
+	char		*sp, *infile = NULL, *histfile = NULL;
+	int		Cflag, qflag, uflag, dflag, wflag, Wflag, Pflag, Lflag;
 	int		direction = IO_FORWARD;
+	int		nthreads = 0;
 	int		c, fd = -1;
+#ifdef HAVE_SYNC_FILE_RANGE
+	long long	window = 0;
+	int		lag = 1;
+#endif
 
-	Cflag = qflag = uflag = dflag = wflag = Wflag = 0;
+	Cflag = qflag = uflag = dflag = wflag = Wflag = Pflag = Lflag = 0;
+	aio_depth = 0;
+	rwf_flags = 0;
+	rwf_blocked = 0;
+	pattern = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:Cdf:i:qs:S:uV:wWZ:")) != EOF) {
+	while ((c = getopt(argc, argv, "A:b:BCdDf:FHi:K:l:LNO:pPqRs:S:T:uV:wWYZ:")) != EOF) {
 		switch (c) {
+		case 'A':
+			aio_depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || *sp || aio_depth <= 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				aio_depth = 0;
+				return 0;
+			}
+			break;
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
 			if (tmp < 0) {
@@ -303,9 +573,57 @@ pwrite_f(
 				return 0;
 			}
 			break;
+#ifdef HAVE_PWRITEV2
+		case 'D':
+			rwf_flags |= RWF_DSYNC;
+			break;
+		case 'Y':
+			rwf_flags |= RWF_SYNC;
+			break;
+		case 'H':
+			rwf_flags |= RWF_HIPRI;
+			break;
+		case 'N':
+			rwf_flags |= RWF_NOWAIT;
+			break;
+#endif
+#ifdef HAVE_SYNC_FILE_RANGE
+		case 'K':
+			window = cvtnum(fsblocksize, fssectsize, optarg);
+			if (window <= 0) {
+				printf(_("bad writeback window -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
+		case 'l':
+			lag = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || *sp || lag <= 0) {
+				printf(_("bad writeback lag -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+#endif
+		case 'L':
+			Lflag = 1;
+			break;
+		case 'O':
+			histfile = optarg;
+			break;
+		case 'p':
+			pattern = 1;
+			break;
+		case 'P':
+			Pflag = 1;
+			break;
 		case 'q':
 			qflag = 1;
 			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
 		case 'u':
 			uflag = 1;
 			break;
@@ -338,6 +656,30 @@ pwrite_f(
 		return command_usage(&pwrite_cmd);
 	if (infile && direction != IO_FORWARD)
 		return command_usage(&pwrite_cmd);
+	if (aio_depth && (infile || vectors || nthreads || rwf_flags || pattern)) {
+		aio_depth = 0;
+		return command_usage(&pwrite_cmd);
+	}
+	if (infile && (rwf_flags || pattern))
+		return command_usage(&pwrite_cmd);
+	if (pattern)
+		pattern_init(seed);
+	if ((Pflag && !nthreads) || (nthreads && infile))
+		return command_usage(&pwrite_cmd);
+	if (histfile && !Lflag) {
+		aio_depth = 0;
+		return command_usage(&pwrite_cmd);
+	}
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (window && (aio_depth || direction != IO_FORWARD)) {
+		aio_depth = 0;
+		return command_usage(&pwrite_cmd);
+	}
+	wb_window = window;
+	wb_lag = lag;
+	wb_waits = 0;
+	wb_wait_ns = 0;
+#endif
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0) {
 		printf(_("non-numeric offset argument -- %s\n"), argv[optind]);
@@ -350,37 +692,83 @@ pwrite_f(
 		return 0;
 	}
 
-	if (alloc_buffer(bsize, uflag, seed) < 0)
+	if (nthreads) {
+		threads = io_threads_alloc(nthreads, Pflag, offset, count,
+				vectors ? bsize * vectors : bsize);
+		if (!threads)
+			return 0;
+		args.bsize = bsize;
+		args.uflag = uflag;
+		args.vectors = vectors;
+		args.direction = direction;
+		args.seed = seed;
+		args.wflag = wflag;
+		args.Wflag = Wflag;
+	} else if (alloc_buffer(bsize, uflag, seed) < 0)
 		return 0;
+	c = -1;
+	if (Lflag) {
+		hist = hist_alloc(histfile != NULL);
+		if (!hist)
+			goto done;
+		if (nthreads &&
+		    io_threads_hist_alloc(threads, nthreads, hist->keep) < 0)
+			goto done;
+		if (!nthreads)
+			io_hist = hist;
+	}
+	if (aio_depth && aioq_init(file->fd, bsize, uflag, seed) < 0)
+		goto done;
 
 	c = IO_READONLY | (dflag ? IO_DIRECT : 0);
-	if (infile && ((fd = openfile(infile, NULL, c, 0)) < 0))
-		return 0;
+	if (infile && ((fd = openfile(infile, NULL, c, 0)) < 0)) {
+		c = -1;
+		goto done;
+	}
 
+	if (direction == IO_RANDOM && !zeed)	/* srandom seed */
+		zeed = time(NULL);
 	gettimeofday(&t1, NULL);
+	if (nthreads) {
+		args.zeed = zeed;
+		c = io_threads_run(threads, nthreads, pwrite_thread, &args);
+		if (hist)
+			io_threads_hist_merge(threads, nthreads, hist);
+		if (c == 0)
+			c = io_threads_sum(threads, nthreads, &total);
+		if (Pflag)
+			count *= nthreads;
+		goto report;
+	}
 	switch (direction) {
 	case IO_RANDOM:
-		if (!zeed)	/* srandom seed */
-			zeed = time(NULL);
-		c = write_random(offset, count, zeed, &total);
+		c = write_random(file->fd, offset, count, zeed, &total);
 		break;
 	case IO_FORWARD:
-		c = write_buffer(offset, count, bsize, fd, skip, &total);
+		c = write_buffer(file->fd, offset, count, bsize, fd, skip,
+				&total);
 		break;
 	case IO_BACKWARD:
-		c = write_backward(offset, &count, &total);
+		c = write_backward(file->fd, offset, &count, &total);
 		break;
 	default:
 		total = 0;
 		ASSERT(0);
 	}
+	if (aio_depth)
+		c = aioq_finish(c, &total, &astats);
 	if (c < 0)
 		goto done;
-	if (Wflag)
+	if (Wflag) {
+		trace_io(TRACE_FSYNC, 0, 0);
 		fsync(file->fd);
-	if (wflag)
+	}
+	if (wflag) {
+		trace_io(TRACE_FDATASYNC, 0, 0);
 		fdatasync(file->fd);
-	if (qflag)
+	}
+report:
+	if (c < 0 || qflag)
 		goto done;
 	gettimeofday(&t2, NULL);
 	t2 = tsub(t2, t1);
@@ -399,9 +787,27 @@ pwrite_f(
 			total, c, ts,
 			tdiv((double)total, t2), tdiv((double)c, t2));
 	}
+	if (aio_depth)
+		aioq_report(&astats, Cflag);
+	if (hist)
+		hist_report(hist, Cflag);
+	if (rwf_flags & RWF_NOWAIT)
+		rwf_report(_("writes"), Cflag);
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (wb_window)
+		writeback_report(Cflag);
+#endif
+	if (nthreads)
+		io_threads_report(threads, nthreads, Cflag);
 done:
+	pattern = 0;
+	if (hist && c >= 0 && histfile)
+		hist_dump(hist, histfile);
+	io_hist = NULL;
+	hist_free(hist);
 	if (infile)
 		close(fd);
+	free(threads);
 	return 0;
 }
 
@@ -415,7 +821,7 @@ pwrite_init(void)
 	pwrite_cmd.argmax = -1;
 	pwrite_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
 	pwrite_cmd.args =
-_("[-i infile [-d] [-s skip]] [-b bs] [-S seed] [-wW] [-FBR [-Z N]] [-V N] off len");
+_("[-i infile [-d] [-s skip]] [-b bs] [-S seed] [-p] [-wW] [-FBR [-Z N]] [-V N] [-DYHN] [-A N] [-K N [-l N]] [-T N [-P]] [-L [-O file]] off len");
 	pwrite_cmd.oneline =
 		_("writes a number of bytes at a specified offset");
 	pwrite_cmd.help = pwrite_help;
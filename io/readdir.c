@@ -22,10 +22,89 @@
 #include "io.h"
 
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 
 static struct cmdinfo readdir_cmd;
 
+/*
+ * With -g the directory is read with getdents64 straight into a buffer of
+ * the given size, rather than through readdir(3) and whatever buffer size
+ * libc picked, to see how the filesystem's directory iteration copes with
+ * different sizes.  With -s the names read are then looked up with
+ * fstatat, on several threads with -T, as ls -l or a backup would.
+ */
+struct linux_dirent64 {
+	__u64		d_ino;
+	__s64		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+struct dirent_names {
+	char		**names;
+	long long	count;
+	long long	max;
+};
+
+struct readdir_stat_args {
+	int		dfd;
+	char		**names;
+};
+
+static void
+readdir_help(void)
+{
+	printf(_(
+"\n"
+" reads directory entries from the current file, which must be a directory\n"
+"\n"
+" Example:\n"
+" 'readdir -g 64k -s -T 8' - read the directory 64KiB at a time, then stat\n"
+"                            every entry on 8 threads\n"
+"\n"
+" -v -- dump each entry read\n"
+" -o -- start at this directory offset\n"
+" -l -- stop after this many bytes of entries\n"
+" -g -- call getdents64 directly with a buffer of this size\n"
+" -s -- fstatat every entry read, and report the rate of that too\n"
+" -T -- with -s, split the entries between this many threads\n"
+"\n"));
+}
+
+static int
+names_add(
+	struct dirent_names	*dn,
+	const char		*name)
+{
+	char			**names;
+
+	if (dn->count == dn->max) {
+		dn->max = dn->max ? dn->max * 2 : 1024;
+		names = realloc(dn->names, dn->max * sizeof(char *));
+		if (!names)
+			return -1;
+		dn->names = names;
+	}
+	dn->names[dn->count] = strdup(name);
+	if (!dn->names[dn->count])
+		return -1;
+	dn->count++;
+	return 0;
+}
+
+static void
+names_free(
+	struct dirent_names	*dn)
+{
+	long long		i;
+
+	for (i = 0; i < dn->count; i++)
+		free(dn->names[i]);
+	free(dn->names);
+}
+
 const char *d_type_str(unsigned int type)
 {
 	const char *str;
@@ -90,6 +169,7 @@ read_directory(
 	long long offset,
 	unsigned long long length,
 	int dump,
+	struct dirent_names *dn,
 	unsigned long long *total)
 {
 	struct dirent *dirent;
@@ -109,6 +189,10 @@ read_directory(
 		*total += dirent->d_namlen + sizeof(*dirent);
 #endif
 		count++;
+		if (dn && names_add(dn, dirent->d_name) < 0) {
+			perror("malloc");
+			return -1;
+		}
 
 		if (dump) {
 			dump_dirent(offset, dirent);
@@ -127,6 +211,134 @@ read_directory(
 	return count;
 }
 
+#ifdef SYS_getdents64
+static int
+read_directory_getdents(
+	int			dfd,
+	long long		offset,
+	unsigned long long	length,
+	size_t			bufsize,
+	int			dump,
+	struct dirent_names	*dn,
+	unsigned long long	*total,
+	int			*calls)
+{
+	struct linux_dirent64	*de;
+	char			*buf;
+	long			n;
+	long			pos;
+	int			count = 0;
+
+	buf = malloc(bufsize);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+	if (lseek(dfd, offset, SEEK_SET) < 0) {
+		perror("lseek");
+		free(buf);
+		return -1;
+	}
+
+	*total = 0;
+	*calls = 0;
+	while (*total < length) {
+		n = syscall(SYS_getdents64, dfd, buf, bufsize);
+		(*calls)++;
+		if (n < 0) {
+			perror("getdents64");
+			count = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		for (pos = 0; pos < n && *total < length; pos += de->d_reclen) {
+			de = (struct linux_dirent64 *)(buf + pos);
+			*total += de->d_reclen;
+			count++;
+			if (dn && names_add(dn, de->d_name) < 0) {
+				perror("malloc");
+				free(buf);
+				return -1;
+			}
+			if (dump) {
+				printf("%08llx: d_ino: 0x%08llx d_off: 0x%08llx"
+					" d_reclen: 0x%x d_type: %s d_name: %s\n",
+					offset, (unsigned long long)de->d_ino,
+					(unsigned long long)de->d_off,
+					de->d_reclen, d_type_str(de->d_type),
+					de->d_name);
+				offset = de->d_off;
+			}
+		}
+	}
+	free(buf);
+	return count;
+}
+#endif
+
+static int
+readdir_stat_thread(
+	struct io_thread	*t)
+{
+	struct readdir_stat_args *args = t->arg;
+	struct stat		st;
+	long long		i;
+	int			ops = 0;
+
+	for (i = t->offset; i < t->offset + t->count; i++) {
+		if (fstatat(args->dfd, args->names[i], &st,
+			    AT_SYMLINK_NOFOLLOW) < 0) {
+			/* gone since we read the directory */
+			if (errno == ENOENT)
+				continue;
+			perror(args->names[i]);
+			return -1;
+		}
+		ops++;
+	}
+	return ops;
+}
+
+/*
+ * fstatat every name in dn from nthreads threads, and report how long it
+ * took.
+ */
+static int
+readdir_stat(
+	int			dfd,
+	struct dirent_names	*dn,
+	int			nthreads)
+{
+	struct readdir_stat_args args = { dfd, dn->names };
+	struct io_thread	*threads;
+	struct timeval		t1, t2;
+	long long		total;
+	char			ts[64];
+	int			ops;
+
+	if (!dn->count)
+		return 0;
+	nthreads = min(nthreads, dn->count);
+	threads = io_threads_alloc(nthreads, 0, 0, dn->count, 1);
+	if (!threads)
+		return -1;
+	gettimeofday(&t1, NULL);
+	if (io_threads_run(threads, nthreads, readdir_stat_thread, &args)) {
+		free(threads);
+		return -1;
+	}
+	gettimeofday(&t2, NULL);
+	ops = io_threads_sum(threads, nthreads, &total);
+	free(threads);
+
+	t2 = tsub(t2, t1);
+	timestr(&t2, ts, sizeof(ts), 0);
+	printf(_("stat %d entries, %s (%.4f entries/sec) on %d thread(s)\n"),
+		ops, ts, tdiv(ops, t2), nthreads);
+	return 0;
+}
+
 static int
 readdir_f(
 	int argc,
@@ -140,14 +352,40 @@ readdir_f(
 	char s1[64], s2[64], ts[64];
 	long long offset = -1;
 	unsigned long long length = -1;		/* max length limit */
+	long long bufsize = 0;			/* getdents64 buffer */
+	struct dirent_names dn = { NULL, 0, 0 };
+	int calls = 0;
+	int nthreads = 1;
+	int sflag = 0;
 	int verbose = 0;
-	DIR *dir;
+	DIR *dir = NULL;
 	int dfd;
 
 	init_cvtnum(&fsblocksize, &fssectsize);
 
-	while ((c = getopt(argc, argv, "l:o:v")) != EOF) {
+	while ((c = getopt(argc, argv, "g:l:o:sT:v")) != EOF) {
 		switch (c) {
+		case 'g':
+#ifdef SYS_getdents64
+			bufsize = cvtnum(fsblocksize, fssectsize, optarg);
+			if (bufsize < (long long)sizeof(struct linux_dirent64) +
+				      NAME_MAX + 1 || bufsize > INT_MAX) {
+				printf(_("bad buffer size %s\n"), optarg);
+				return 0;
+			}
+			break;
+#else
+			printf(_("getdents64 is not supported here\n"));
+			return 0;
+#endif
+		case 's':
+			sflag = 1;
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
 		case 'l':
 			length = cvtnum(fsblocksize, fssectsize, optarg);
 			break;
@@ -166,23 +404,35 @@ readdir_f(
 	if (dfd < 0)
 		return -1;
 
-	dir = fdopendir(dfd);
-	if (!dir) {
-		close(dfd);
-		return -1;
-	}
-
-	if (offset == -1) {
-		rewinddir(dir);
-		offset = telldir(dir);
+	if (bufsize) {
+		if (offset == -1)
+			offset = 0;
+	} else {
+		dir = fdopendir(dfd);
+		if (!dir) {
+			close(dfd);
+			return -1;
+		}
+		if (offset == -1) {
+			rewinddir(dir);
+			offset = telldir(dir);
+		}
 	}
 
 	gettimeofday(&t1, NULL);
-	cnt = read_directory(dir, offset, length, verbose, &total);
+#ifdef SYS_getdents64
+	if (bufsize)
+		cnt = read_directory_getdents(dfd, offset, length, bufsize,
+				verbose, sflag ? &dn : NULL, &total, &calls);
+	else
+#endif
+		cnt = read_directory(dir, offset, length, verbose,
+				sflag ? &dn : NULL, &total);
 	gettimeofday(&t2, NULL);
-
-	closedir(dir);
-	close(dfd);
+	if (cnt < 0) {
+		exitcode = 1;
+		goto out;
+	}
 
 	t2 = tsub(t2, t1);
 	timestr(&t2, ts, sizeof(ts), 0);
@@ -193,7 +443,19 @@ readdir_f(
 	printf(_("read %llu bytes from offset %lld\n"), total, offset);
 	printf(_("%s, %d ops, %s (%s/sec and %.4f ops/sec)\n"),
 		s1, cnt, ts, s2, tdiv(cnt, t2));
+	if (bufsize)
+		printf(_("%d getdents64 calls with a %lld byte buffer, "
+			 "%.1f entries per call\n"),
+			calls, bufsize, calls ? (double)cnt / calls : 0.0);
 
+	if (sflag && readdir_stat(dfd, &dn, nthreads) < 0)
+		exitcode = 1;
+out:
+	names_free(&dn);
+	if (dir)
+		closedir(dir);
+	else
+		close(dfd);
 	return 0;
 }
 
@@ -202,10 +464,12 @@ readdir_init(void)
 {
 	readdir_cmd.name = "readdir";
 	readdir_cmd.cfunc = readdir_f;
-	readdir_cmd.argmax = 5;
+	readdir_cmd.argmax = -1;
 	readdir_cmd.flags = CMD_NOMAP_OK|CMD_FOREIGN_OK;
-	readdir_cmd.args = _("[-v][-o offset][-l length]");
+	readdir_cmd.args =
+		_("[-sv][-g bufsize][-T threads][-o offset][-l length]");
 	readdir_cmd.oneline = _("read directory entries");
+	readdir_cmd.help = readdir_help;
 
 	add_command(&readdir_cmd);
 }
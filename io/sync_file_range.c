@@ -34,19 +34,47 @@ sync_range_help(void)
 " -a -- wait for IO to finish after writing (SYNC_FILE_RANGE_WAIT_AFTER).\n"
 " -b -- wait for IO to finish before writing (SYNC_FILE_RANGE_WAIT_BEFORE).\n"
 " -w -- write dirty data in range (SYNC_FILE_RANGE_WRITE).\n"
+" -T N -- split the range between N threads\n"
+" -P -- give each thread (-T) the whole range on a file of its own, the\n"
+"       current file and the ones opened after it\n"
 "\n"));
 }
 
+struct sync_range_args {
+	int		sync_mode;
+	int		perfile;
+};
+
+static int
+sync_range_thread(
+	struct io_thread	*t)
+{
+	struct sync_range_args	*args = t->arg;
+
+	/* a length of zero means to the end of file, don't do that here */
+	if (!t->count && !args->perfile)
+		return 0;
+	if (sync_file_range(t->file->fd, t->offset, t->count,
+			    args->sync_mode) < 0) {
+		perror("sync_file_range");
+		return -1;
+	}
+	return 1;
+}
+
 static int
 sync_range_f(
 	int		argc,
 	char		**argv)
 {
+	struct io_thread *threads;
+	struct sync_range_args args;
 	off64_t		offset = 0, length = 0;
 	int		c, sync_mode = 0;
+	int		nthreads = 0, Pflag = 0;
 	size_t		blocksize, sectsize;
 
-	while ((c = getopt(argc, argv, "abw")) != EOF) {
+	while ((c = getopt(argc, argv, "abPT:w")) != EOF) {
 		switch (c) {
 		case 'a':
 			sync_mode = SYNC_FILE_RANGE_WAIT_AFTER;
@@ -57,6 +85,14 @@ sync_range_f(
 		case 'w':
 			sync_mode = SYNC_FILE_RANGE_WRITE;
 			break;
+		case 'P':
+			Pflag = 1;
+			break;
+		case 'T':
+			nthreads = io_threads_parse(optarg);
+			if (nthreads < 0)
+				return 0;
+			break;
 		default:
 			return command_usage(&sync_range_cmd);
 		}
@@ -66,7 +102,7 @@ sync_range_f(
 	if (!sync_mode)
 		sync_mode = SYNC_FILE_RANGE_WRITE;
 
-	if (optind != argc - 2)
+	if (optind != argc - 2 || (Pflag && !nthreads))
 		return command_usage(&sync_range_cmd);
 	init_cvtnum(&blocksize, &sectsize);
 	offset = cvtnum(blocksize, sectsize, argv[optind]);
@@ -83,6 +119,22 @@ sync_range_f(
 		return 0;
 	}
 
+	if (nthreads) {
+		if (!length && !Pflag) {
+			printf(_("threads need a length to split\n"));
+			return 0;
+		}
+		threads = io_threads_alloc(nthreads, Pflag, offset, length,
+				blocksize);
+		if (!threads)
+			return 0;
+		args.sync_mode = sync_mode;
+		args.perfile = Pflag;
+		io_threads_run(threads, nthreads, sync_range_thread, &args);
+		free(threads);
+		return 0;
+	}
+
 	if (sync_file_range(file->fd, offset, length, sync_mode) < 0) {
 		perror("sync_file_range");
 		return 0;
@@ -98,7 +150,7 @@ sync_range_init(void)
 	sync_range_cmd.argmin = 2;
 	sync_range_cmd.argmax = -1;
 	sync_range_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	sync_range_cmd.args = _("[-abw] off len");
+	sync_range_cmd.args = _("[-abw] [-T N [-P]] off len");
 	sync_range_cmd.oneline = _("Control writeback on a range of a file");
 	sync_range_cmd.help = sync_range_help;
 
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/*
+ * Support for running a command on several threads at once (-T).  Each
+ * thread either gets a slice of the range on the current file, or with -P
+ * the whole range on a file of its own: the current file and the ones
+ * opened after it in the file table, wrapping around at the end.
+ */
+
+int
+io_threads_parse(
+	char		*arg)
+{
+	char		*sp;
+	long		n;
+
+	n = strtol(arg, &sp, 0);
+	if (sp == arg || *sp || n <= 0 || n > IO_MAX_THREADS) {
+		printf(_("bad number of threads -- %s\n"), arg);
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * Set up the threads' files and ranges.  The slices of a shared file are
+ * multiples of align bytes, so the I/O pattern within each slice is the
+ * same as for one a single thread would do.
+ */
+struct io_thread *
+io_threads_alloc(
+	int			nthreads,
+	int			perfile,
+	off64_t			offset,
+	long long		count,
+	size_t			align)
+{
+	struct io_thread	*threads;
+	long long		slice;
+	int			cur = file - filetable;
+	int			i;
+
+	if (perfile && nthreads > filecount) {
+		printf(_("%d threads need %d open files, only %d are open\n"),
+			nthreads, nthreads, filecount);
+		return NULL;
+	}
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return NULL;
+	}
+
+	slice = (count + nthreads - 1) / nthreads;
+	if (align)
+		slice = (slice + align - 1) / align * align;
+	for (i = 0; i < nthreads; i++) {
+		struct io_thread	*t = &threads[i];
+
+		t->index = i;
+		if (perfile) {
+			t->file = &filetable[(cur + i) % filecount];
+			t->offset = offset;
+			t->count = count;
+		} else {
+			t->file = file;
+			t->offset = offset + min(count, i * slice);
+			t->count = min(slice, count - min(count, i * slice));
+		}
+	}
+	return threads;
+}
+
+static void *
+io_thread_start(
+	void			*arg)
+{
+	struct io_thread	*t = arg;
+	struct timeval		t1;
+
+	io_hist = t->hist;
+	gettimeofday(&t1, NULL);
+	t->ops = t->fn(t);
+	gettimeofday(&t->time, NULL);
+	t->time = tsub(t->time, t1);
+	return NULL;
+}
+
+/*
+ * Run fn on every thread and wait for them all.  Returns 0, or -1 if any
+ * of the threads failed.
+ */
+int
+io_threads_run(
+	struct io_thread	*threads,
+	int			nthreads,
+	int			(*fn)(struct io_thread *),
+	void			*arg)
+{
+	int			started;
+	int			error = 0;
+	int			i;
+
+	for (started = 0; started < nthreads; started++) {
+		threads[started].fn = fn;
+		threads[started].arg = arg;
+		error = pthread_create(&threads[started].tid, NULL,
+				io_thread_start, &threads[started]);
+		if (error) {
+			errno = error;
+			perror("pthread_create");
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].tid, NULL);
+	if (error)
+		return -1;
+	for (i = 0; i < nthreads; i++)
+		if (threads[i].ops < 0)
+			return -1;
+	return 0;
+}
+
+/* add up what the threads did */
+int
+io_threads_sum(
+	struct io_thread	*threads,
+	int			nthreads,
+	long long		*total)
+{
+	int			ops = 0;
+	int			i;
+
+	*total = 0;
+	for (i = 0; i < nthreads; i++) {
+		ops += threads[i].ops;
+		*total += threads[i].total;
+	}
+	return ops;
+}
+
+/* give every thread a latency histogram of its own */
+int
+io_threads_hist_alloc(
+	struct io_thread	*threads,
+	int			nthreads,
+	int			keep)
+{
+	int			i;
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].hist = hist_alloc(keep);
+		if (!threads[i].hist) {
+			io_threads_hist_merge(threads, i, NULL);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* fold the threads' latencies into hist, if given, and free them */
+void
+io_threads_hist_merge(
+	struct io_thread	*threads,
+	int			nthreads,
+	struct io_hist		*hist)
+{
+	int			i;
+
+	for (i = 0; i < nthreads; i++) {
+		if (hist && threads[i].hist)
+			hist_merge(hist, threads[i].hist);
+		hist_free(threads[i].hist);
+		threads[i].hist = NULL;
+	}
+}
+
+/* per thread throughput, in the same format as the command's summary */
+void
+io_threads_report(
+	struct io_thread	*threads,
+	int			nthreads,
+	int			Cflag)
+{
+	struct io_thread	*t;
+	char			s1[64], s2[64], ts[64];
+	int			i;
+
+	for (i = 0, t = threads; i < nthreads; i++, t++) {
+		timestr(&t->time, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+		if (!Cflag) {
+			cvtstr((double)t->total, s1, sizeof(s1));
+			cvtstr(tdiv((double)t->total, t->time), s2, sizeof(s2));
+			printf(_("thread %d: %s at offset %lld of %s, %d ops; "
+				 "%s (%s/sec and %.4f ops/sec)\n"),
+				i, s1, (long long)t->offset, t->file->name,
+				t->ops, ts, s2, tdiv((double)t->ops, t->time));
+		} else {/* thread,bytes,ops,time,bytes/sec,ops/sec */
+			printf("%d,%lld,%d,%s,%.3f,%.3f\n",
+				i, t->total, t->ops, ts,
+				tdiv((double)t->total, t->time),
+				tdiv((double)t->ops, t->time));
+		}
+	}
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <time.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/*
+ * Recording and replaying I/O traces.
+ *
+ * While "trace file" is on, every read and write pread and pwrite do, and
+ * every fsync and fdatasync, is appended to the file as a fixed size
+ * record: the time since the trace started, the offset, the length and
+ * the kind of operation.  "replay file" issues them again on the current
+ * file through the same read and write routines pread and pwrite use,
+ * optionally with the original timing scaled and with queue depth.
+ *
+ * The records are in host byte order, so a trace made on a host of the
+ * other byte order fails the magic number check.
+ */
+#define TRACE_MAGIC	0x58494f54	/* XIOT */
+#define TRACE_VERSION	1
+
+struct trace_header {
+	__u32		magic;
+	__u32		version;
+};
+
+struct trace_rec {
+	__u64		nsec;		/* since the trace started */
+	__u64		offset;
+	__u32		length;
+	__u8		op;		/* TRACE_* */
+	__u8		pad[3];
+};
+
+FILE			*trace_fp;
+__thread int		trace_skip;	/* I/O that isn't to be recorded */
+static char		*trace_name;
+static unsigned long long trace_start;
+static long long	trace_count;
+
+static cmdinfo_t trace_cmd;
+static cmdinfo_t replay_cmd;
+
+void
+trace_record(
+	int			op,
+	off64_t			offset,
+	size_t			len)
+{
+	struct trace_rec	r;
+
+	if (trace_skip)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.nsec = hist_now() - trace_start;
+	r.offset = offset;
+	r.length = len;
+	r.op = op;
+	/* stdio locks the stream, so threads can all record */
+	if (fwrite(&r, sizeof(r), 1, trace_fp) == 1)
+		__sync_fetch_and_add(&trace_count, 1);
+}
+
+static void
+trace_stop(void)
+{
+	if (fclose(trace_fp) != 0)
+		perror(trace_name);
+	printf(_("recorded %lld operations to %s\n"), trace_count, trace_name);
+	trace_fp = NULL;
+	free(trace_name);
+	trace_name = NULL;
+}
+
+static void
+trace_help(void)
+{
+	printf(_(
+"\n"
+" records the I/O done by the following commands to a trace file\n"
+"\n"
+" Example:\n"
+" 'trace /tmp/t' - start recording to /tmp/t\n"
+" 'trace -s'     - stop recording\n"
+"\n"
+" The reads and writes of pread and pwrite, and the fsync and fdatasync\n"
+" commands (or pwrite -w/-W), are recorded with their offset, length and\n"
+" time.  The trace can be played back with the replay command.  Without\n"
+" arguments, shows whether a trace is being recorded.\n"
+"\n"));
+}
+
+static int
+trace_f(
+	int			argc,
+	char			**argv)
+{
+	struct trace_header	hdr;
+	int			sflag = 0;
+	int			c;
+
+	while ((c = getopt(argc, argv, "s")) != EOF) {
+		switch (c) {
+		case 's':
+			sflag = 1;
+			break;
+		default:
+			return command_usage(&trace_cmd);
+		}
+	}
+	if (optind < argc - 1 || (sflag && optind != argc))
+		return command_usage(&trace_cmd);
+
+	if (sflag) {
+		if (trace_fp)
+			trace_stop();
+		return 0;
+	}
+	if (optind == argc) {
+		if (trace_fp)
+			printf(_("recording to %s, %lld operations so far\n"),
+				trace_name, trace_count);
+		else
+			printf(_("not recording\n"));
+		return 0;
+	}
+
+	if (trace_fp)
+		trace_stop();
+	trace_fp = fopen(argv[optind], "w");
+	if (!trace_fp) {
+		perror(argv[optind]);
+		return 0;
+	}
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_fp) != 1) {
+		perror(argv[optind]);
+		fclose(trace_fp);
+		trace_fp = NULL;
+		return 0;
+	}
+	trace_name = strdup(argv[optind]);
+	trace_count = 0;
+	trace_start = hist_now();
+	return 0;
+}
+
+static void
+replay_help(void)
+{
+	printf(_(
+"\n"
+" plays back a trace recorded with the trace command on the current file\n"
+"\n"
+" Example:\n"
+" 'replay -s 2 -A 8 /tmp/t' - replay at twice the recorded speed, with up to\n"
+"                            8 reads or writes in flight\n"
+"\n"
+" Each operation is issued at its recorded time, scaled by the speed.\n"
+" Writes use a buffer filled with 0xcdcdcdcd, like pwrite.\n"
+" -s N -- replay N times as fast as recorded, 0 for as fast as possible\n"
+"         (default 1, the recorded timing)\n"
+" -A N -- keep up to N reads and writes in flight at once; fsyncs wait for\n"
+"         them all.  Stops at the first I/O that comes up short.\n"
+"\n"));
+}
+
+/* sleep until nsec after start */
+static void
+replay_wait(
+	unsigned long long	start,
+	unsigned long long	nsec)
+{
+	unsigned long long	now = hist_now() - start;
+	struct timespec		ts;
+
+	if (nsec <= now)
+		return;
+	nsec -= now;
+	ts.tv_sec = nsec / 1000000000ULL;
+	ts.tv_nsec = nsec % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static int
+replay_f(
+	int			argc,
+	char			**argv)
+{
+	struct trace_header	hdr;
+	struct trace_rec	r;
+	struct aio_stats	astats;
+	struct timeval		t1, t2;
+	unsigned long long	start;
+	long long		total = 0;
+	size_t			maxlen = 0;
+	double			speed = 1.0;
+	ssize_t			bytes;
+	FILE			*fp;
+	char			s1[64], s2[64], ts[64];
+	char			*sp;
+	int			Cflag = 0, qflag = 0;
+	int			syncs = 0;
+	int			c, ops = 0;
+
+	aio_depth = 0;
+	rwf_flags = 0;
+	pattern = 0;
+	vectors = 0;
+	while ((c = getopt(argc, argv, "A:Cqs:")) != EOF) {
+		switch (c) {
+		case 'A':
+			aio_depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || *sp || aio_depth <= 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				aio_depth = 0;
+				return 0;
+			}
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'q':
+			qflag = 1;
+			break;
+		case 's':
+			speed = strtod(optarg, &sp);
+			if (!sp || sp == optarg || *sp || speed < 0) {
+				printf(_("bad speed -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		default:
+			aio_depth = 0;
+			return command_usage(&replay_cmd);
+		}
+	}
+	if (optind != argc - 1) {
+		aio_depth = 0;
+		return command_usage(&replay_cmd);
+	}
+	if (trace_fp) {
+		printf(_("stop recording the trace first\n"));
+		aio_depth = 0;
+		return 0;
+	}
+
+	fp = fopen(argv[optind], "r");
+	if (!fp) {
+		perror(argv[optind]);
+		aio_depth = 0;
+		return 0;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+		printf(_("%s is not a trace file\n"), argv[optind]);
+		aio_depth = 0;
+		goto out_close;
+	}
+	/* size the buffers for the longest I/O */
+	while (fread(&r, sizeof(r), 1, fp) == 1)
+		maxlen = max(maxlen, r.length);
+	if (fseek(fp, sizeof(hdr), SEEK_SET) < 0) {
+		perror(argv[optind]);
+		aio_depth = 0;
+		goto out_close;
+	}
+	if (alloc_buffer(max(maxlen, 1), 0, 0xcdcdcdcd) < 0) {
+		aio_depth = 0;
+		goto out_close;
+	}
+	if (aio_depth &&
+	    aioq_init(file->fd, max(maxlen, 1), 0, 0xcdcdcdcd) < 0) {
+		aio_depth = 0;
+		goto out_free;
+	}
+
+	gettimeofday(&t1, NULL);
+	start = hist_now();
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		if (speed > 0)
+			replay_wait(start, r.nsec / speed);
+		switch (r.op) {
+		case TRACE_READ:
+		case TRACE_WRITE:
+			if (r.op == TRACE_READ)
+				bytes = do_pread(file->fd, r.offset, r.length,
+						r.length);
+			else
+				bytes = do_pwrite(file->fd, r.offset, r.length,
+						r.length);
+			if (bytes < 0) {
+				perror(r.op == TRACE_READ ? "pread64" :
+							    "pwrite64");
+				ops = -1;
+				break;
+			}
+			if (bytes == 0 && aio_depth)
+				break;
+			ops++;
+			total += bytes;
+			continue;
+		case TRACE_FSYNC:
+		case TRACE_FDATASYNC:
+			if (aio_depth && aioq_drain() < 0) {
+				perror(_("aio"));
+				ops = -1;
+				break;
+			}
+			if ((r.op == TRACE_FSYNC ? fsync(file->fd) :
+						   fdatasync(file->fd)) < 0) {
+				perror(r.op == TRACE_FSYNC ? "fsync" :
+							     "fdatasync");
+				ops = -1;
+				break;
+			}
+			syncs++;
+			continue;
+		default:
+			printf(_("bad operation %d in trace\n"), r.op);
+			ops = -1;
+			break;
+		}
+		break;
+	}
+	if (aio_depth)
+		ops = aioq_finish(ops, &total, &astats);
+	if (ops < 0 || qflag)
+		goto out_free;
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+
+	/* Finally, report back -- -C gives a parsable format */
+	timestr(&t2, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+	if (!Cflag) {
+		cvtstr((double)total, s1, sizeof(s1));
+		cvtstr(tdiv((double)total, t2), s2, sizeof(s2));
+		printf(_("replayed %lld bytes in %d reads and writes and "
+			 "%d syncs\n"), total, ops, syncs);
+		printf(_("%s, %d ops; %s (%s/sec and %.4f ops/sec)\n"),
+			s1, ops, ts, s2, tdiv((double)ops, t2));
+	} else {/* bytes,ops,time,bytes/sec,ops/sec */
+		printf("%lld,%d,%s,%.3f,%.3f\n",
+			total, ops, ts,
+			tdiv((double)total, t2), tdiv((double)ops, t2));
+	}
+	if (aio_depth)
+		aioq_report(&astats, Cflag);
+out_free:
+	aio_depth = 0;
+	free_buffer();
+out_close:
+	fclose(fp);
+	return 0;
+}
+
+void
+trace_init(void)
+{
+	trace_cmd.name = "trace";
+	trace_cmd.cfunc = trace_f;
+	trace_cmd.argmin = 0;
+	trace_cmd.argmax = 1;
+	trace_cmd.flags = CMD_NOMAP_OK | CMD_NOFILE_OK | CMD_FOREIGN_OK;
+	trace_cmd.args = _("[-s | file]");
+	trace_cmd.oneline = _("record the I/O of the following commands");
+	trace_cmd.help = trace_help;
+
+	replay_cmd.name = "replay";
+	replay_cmd.cfunc = replay_f;
+	replay_cmd.argmin = 1;
+	replay_cmd.argmax = -1;
+	replay_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	replay_cmd.args = _("[-s speed] [-A N] file");
+	replay_cmd.oneline = _("replay a recorded I/O trace on the current file");
+	replay_cmd.help = replay_help;
+
+	add_command(&trace_cmd);
+	add_command(&replay_cmd);
+}
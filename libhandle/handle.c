@@ -17,6 +17,7 @@
  */
 
 #include <libgen.h>
+#include <pthread.h>
 #include "platform_defs.h"
 #include "xfs.h"
 #include "handle.h"
@@ -41,8 +42,8 @@ typedef union {
 } comarg_t;
 
 static int obj_to_handle(char *, int, unsigned int, comarg_t, void**, size_t*);
-static int handle_to_fsfd(void *, char **);
-static char *path_to_fspath(char *path);
+int handle_to_fsfd(void *, char **);		/* jdm.c uses it too */
+static char *path_to_fspath(char *path, char *dirpath);
 
 
 /*
@@ -51,8 +52,18 @@ static char *path_to_fspath(char *path);
  * Maps filesystem handles to a corresponding open file descriptor for that
  * filesystem. We need this because we're doing handle operations via xfsctl
  * and we need to remember the open file descriptor for each filesystem.
+ *
+ * The cache is hashed on the filesystem ID and may be used from several
+ * threads at once.  Entries are only ever added, never changed or freed,
+ * so lookups walk a bucket without any locking: a new entry is filled in
+ * completely before a barrier and the store that links it in at the head
+ * of its bucket.  Adding entries is serialized by fdhash_lock, and the
+ * bucket is searched again under the lock so that two threads finding
+ * the same new filesystem don't both add it.
  */
 
+#define	FDHASH_SIZE	64
+
 struct fdhash {
 	int	fsfd;
 	char	fsh[FSIDSIZE];
@@ -60,7 +71,70 @@ struct fdhash {
 	char	fspath[MAXPATHLEN];
 };
 
-static struct fdhash *fdhash_head = NULL;
+static struct fdhash *fdhash_table[FDHASH_SIZE];
+static pthread_mutex_t fdhash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+fdhash_bucket(
+	void		*fsh)
+{
+	__uint64_t	fsid;
+
+	memcpy(&fsid, fsh, FSIDSIZE);
+	return (fsid * 0x9e37fffffffc0001ULL) >> 58;	/* top 6 bits */
+}
+
+static struct fdhash *
+fdhash_find(
+	struct fdhash	*fdhp,
+	void		*fsh)
+{
+	for (; fdhp != NULL; fdhp = fdhp->fnxt) {
+		if (memcmp(fdhp->fsh, fsh, FSIDSIZE) == 0)
+			return fdhp;
+	}
+	return NULL;
+}
+
+/*
+ * Add fd, open on fspath, to the cache for filesystem handle fsh.  If
+ * another thread got there first, fd isn't needed and is closed.
+ */
+static int
+fdhash_add(
+	void		*fsh,
+	int		fd,
+	char		*fspath)
+{
+	struct fdhash	**head = &fdhash_table[fdhash_bucket(fsh)];
+	struct fdhash	*fdhp;
+
+	pthread_mutex_lock(&fdhash_lock);
+	if (fdhash_find(*head, fsh) != NULL) {
+		pthread_mutex_unlock(&fdhash_lock);
+		close(fd);
+		return 0;
+	}
+	fdhp = malloc(sizeof(struct fdhash));
+	if (fdhp == NULL) {
+		pthread_mutex_unlock(&fdhash_lock);
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	fdhp->fsfd = fd;
+	strncpy(fdhp->fspath, fspath, sizeof(fdhp->fspath));
+	fdhp->fspath[sizeof(fdhp->fspath) - 1] = '\0';
+	memcpy(fdhp->fsh, fsh, FSIDSIZE);
+	fdhp->fnxt = *head;
+
+	/* lockless readers must see the whole entry once it's linked in */
+	__sync_synchronize();
+	*(struct fdhash * volatile *)head = fdhp;
+	pthread_mutex_unlock(&fdhash_lock);
+	return 0;
+}
 
 int
 path_to_fshandle(
@@ -71,11 +145,11 @@ path_to_fshandle(
 	int		result;
 	int		fd;
 	comarg_t	obj;
-	struct fdhash	*fdhp;
 	char		*tmppath;
 	char		*fspath;
+	char		dirpath[MAXPATHLEN];
 
-	fspath = path_to_fspath(path);
+	fspath = path_to_fspath(path, dirpath);
 	if (fspath == NULL)
 		return -1;
 
@@ -94,22 +168,10 @@ path_to_fshandle(
 	if (handle_to_fsfd(*fshanp, &tmppath) >= 0) {
 		/* this filesystem is already in the cache */
 		close(fd);
-	} else {
-		/* new filesystem. add it to the cache */
-		fdhp = malloc(sizeof(struct fdhash));
-		if (fdhp == NULL) {
-			free(*fshanp);
-			close(fd);
-			errno = ENOMEM;
-			return -1;
-		}
-
-		fdhp->fsfd = fd;
-		strncpy(fdhp->fspath, fspath, sizeof(fdhp->fspath));
-		memcpy(fdhp->fsh, *fshanp, FSIDSIZE);
-
-		fdhp->fnxt = fdhash_head;
-		fdhash_head = fdhp;
+	} else if (fdhash_add(*fshanp, fd, fspath) < 0) {
+		/* new filesystem, but we couldn't add it to the cache */
+		free(*fshanp);
+		return -1;
 	}
 
 	return result;
@@ -125,8 +187,9 @@ path_to_handle(
 	int		result;
 	comarg_t	obj;
 	char		*fspath;
+	char		dirpath[MAXPATHLEN];
 
-	fspath = path_to_fspath(path);
+	fspath = path_to_fspath(path, dirpath);
 	if (fspath == NULL)
 		return -1;
 
@@ -148,11 +211,11 @@ path_to_handle(
  * potentially blocking in an open on a named pipe. Also
  * symlinks to files on other filesystems would be a problem,
  * since an fd would be obtained for the wrong fs.
+ * dirpath is a MAXPATHLEN buffer for the parent directory's path.
  */
 static char *
-path_to_fspath(char *path)
+path_to_fspath(char *path, char *dirpath)
 {
-	static char dirpath[MAXPATHLEN];
 	struct stat statbuf;
 
 	if (lstat(path, &statbuf) != 0)
@@ -200,7 +263,7 @@ handle_to_fshandle(
 	return 0;
 }
 
-static int
+int
 handle_to_fsfd(void *hanp, char **path)
 {
 	struct fdhash	*fdhp;
@@ -209,13 +272,14 @@ handle_to_fsfd(void *hanp, char **path)
 	 * Look in cache for matching fsid field in the handle
 	 * (which is at the start of the handle).
 	 * When found return the file descriptor and path that
-	 * we have in the cache.
+	 * we have in the cache.  See fdhash_add for why this needs
+	 * no lock.
 	 */
-	for (fdhp = fdhash_head; fdhp != NULL; fdhp = fdhp->fnxt) {
-		if (memcmp(fdhp->fsh, hanp, FSIDSIZE) == 0) {
-			*path = fdhp->fspath;
-			return fdhp->fsfd;
-		}
+	fdhp = *(struct fdhash * volatile *)&fdhash_table[fdhash_bucket(hanp)];
+	fdhp = fdhash_find(fdhp, hanp);
+	if (fdhp != NULL) {
+		*path = fdhp->fspath;
+		return fdhp->fsfd;
 	}
 	errno = EBADF;
 	return -1;
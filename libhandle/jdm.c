@@ -17,6 +17,7 @@
  */
 
 #include "platform_defs.h"
+#include <pthread.h>
 #include "xfs.h"
 #include "handle.h"
 #include "jdm.h"
@@ -40,6 +41,20 @@ typedef struct filehandle {
 	xfs_ino_t fh_ino;		/* 64 bit ino */
 } filehandle_t;
 
+/*
+ * Batch context for the jdm_*_batch calls: the filesystem's fd is looked
+ * up once, and the handles are built in a buffer that is reused for every
+ * batch, with only the inode number and generation changing per inode.
+ */
+struct jdm_batch {
+	int		fsfd;
+	char		*path;
+	int		size;		/* handles allocated */
+	filehandle_t	*handles;
+};
+
+/* in handle.c */
+extern int handle_to_fsfd(void *hanp, char **path);
 
 static void
 jdm_fill_filehandle( filehandle_t *handlep,
@@ -157,6 +172,500 @@ jdm_attr_multi(	jdm_fshandle_t *fshp,
 	return rval;
 }
 
+jdm_batch_t *
+jdm_batch_alloc( jdm_fshandle_t *fshp, int size )
+{
+	fshandle_t *fshandlep = ( fshandle_t * )fshp;
+	xfs_bstat_t bstat;
+	jdm_batch_t *bp;
+	char *path;
+	int fsfd;
+	int i;
+
+	if (size <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	fsfd = handle_to_fsfd(fshp, &path);
+	if (fsfd < 0)
+		return NULL;
+	bp = malloc(sizeof(*bp));
+	if (!bp)
+		return NULL;
+	bp->handles = calloc(size, sizeof(filehandle_t));
+	if (!bp->handles) {
+		free(bp);
+		return NULL;
+	}
+	bp->fsfd = fsfd;
+	bp->path = path;
+	bp->size = size;
+
+	memset(&bstat, 0, sizeof(bstat));
+	for (i = 0; i < size; i++)
+		jdm_fill_filehandle(&bp->handles[i], fshandlep, &bstat);
+	return bp;
+}
+
+void
+jdm_batch_free( jdm_batch_t *bp )
+{
+	if (!bp)
+		return;
+	free(bp->handles);
+	free(bp);
+}
+
+/* point the first count handles of the batch at statp[0..count-1] */
+static void
+jdm_batch_fill( jdm_batch_t *bp, xfs_bstat_t *statp, int count )
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		bp->handles[i].fh_gen = statp[i].bs_gen;
+		bp->handles[i].fh_ino = statp[i].bs_ino;
+	}
+}
+
+static void
+jdm_batch_hreq( xfs_fsop_handlereq_t *hreqp, filehandle_t *handlep )
+{
+	hreqp->fd       = 0;
+	hreqp->path     = NULL;
+	hreqp->oflags   = O_LARGEFILE;
+	hreqp->ihandle  = handlep;
+	hreqp->ihandlen = sizeof(*handlep);
+	hreqp->ohandle  = NULL;
+	hreqp->ohandlen = NULL;
+}
+
+/*
+ * The batch calls work on count inodes from a bulkstat buffer, a batch
+ * size at a time.  Each fills in one result per inode, which is negative
+ * errno if that inode failed, and returns how many succeeded.
+ */
+int
+jdm_open_batch( jdm_batch_t *bp,
+		xfs_bstat_t *statp, int count,
+		intgen_t oflags, intgen_t *fdp )
+{
+	xfs_fsop_handlereq_t hreq;
+	int done = 0;
+	int n;
+	int i;
+
+	for (; count > 0; count -= n, statp += n, fdp += n) {
+		n = min(count, bp->size);
+		jdm_batch_fill(bp, statp, n);
+		for (i = 0; i < n; i++) {
+			jdm_batch_hreq(&hreq, &bp->handles[i]);
+			hreq.oflags |= oflags;
+			fdp[i] = xfsctl(bp->path, bp->fsfd,
+					XFS_IOC_OPEN_BY_HANDLE, &hreq);
+			if (fdp[i] < 0)
+				fdp[i] = -errno;
+			else
+				done++;
+		}
+	}
+	return done;
+}
+
+/*
+ * Link i goes in bufp + i * bufsz, and isn't NUL terminated; lenp[i] is
+ * its length.
+ */
+int
+jdm_readlink_batch( jdm_batch_t *bp,
+		    xfs_bstat_t *statp, int count,
+		    char *bufp, size_t bufsz, intgen_t *lenp )
+{
+	xfs_fsop_handlereq_t hreq;
+	__u32 buflen;
+	int done = 0;
+	int n;
+	int i;
+
+	for (; count > 0; count -= n, statp += n, lenp += n) {
+		n = min(count, bp->size);
+		jdm_batch_fill(bp, statp, n);
+		for (i = 0; i < n; i++, bufp += bufsz) {
+			jdm_batch_hreq(&hreq, &bp->handles[i]);
+			buflen = (__u32)bufsz;
+			hreq.ohandle = bufp;
+			hreq.ohandlen = &buflen;
+			lenp[i] = xfsctl(bp->path, bp->fsfd,
+					 XFS_IOC_READLINK_BY_HANDLE, &hreq);
+			if (lenp[i] < 0)
+				lenp[i] = -errno;
+			else
+				done++;
+		}
+	}
+	return done;
+}
+
+/* bufp[i] is the array of rtrvcnt attr_multiop_t for inode i */
+int
+jdm_attr_multi_batch( jdm_batch_t *bp,
+		      xfs_bstat_t *statp, int count,
+		      char **bufp, int rtrvcnt, int flags, int *rvalp )
+{
+	xfs_fsop_attrmulti_handlereq_t amhreq;
+	int done = 0;
+	int n;
+	int i;
+
+	for (; count > 0; count -= n, statp += n, bufp += n, rvalp += n) {
+		n = min(count, bp->size);
+		jdm_batch_fill(bp, statp, n);
+		for (i = 0; i < n; i++) {
+			jdm_batch_hreq(&amhreq.hreq, &bp->handles[i]);
+			amhreq.opcount = rtrvcnt;
+			amhreq.ops = (void *)bufp[i];
+			rvalp[i] = xfsctl(bp->path, bp->fsfd,
+					  XFS_IOC_ATTRMULTI_BY_HANDLE, &amhreq);
+			if (rvalp[i] < 0)
+				rvalp[i] = -errno;
+			else
+				done++;
+		}
+	}
+	return done;
+}
+
+/*
+ * Fetch every attribute of a batch of inodes, names and values, from a
+ * few threads at once.  Each thread takes the next inode, lists each
+ * namespace asked for with XFS_IOC_ATTRLIST_BY_HANDLE, then gets all the
+ * values with XFS_IOC_ATTRMULTI_BY_HANDLE, JDM_ATTR_MULTI_OPS at a time.
+ * The listing gives each value's length, so the result for an inode is
+ * one exactly sized allocation; if an attribute changes between the list
+ * and the get, the inode is simply listed again.
+ */
+
+#define JDM_ATTR_NS_ROOT	0x0002	/* kernel ATTR_ROOT */
+#define JDM_ATTR_NS_SECURE	0x0008	/* kernel ATTR_SECURE */
+#define JDM_ATTR_MULTI_OPS	64
+#define JDM_ATTR_RETRIES	4
+#define JDM_ATTR_MAX_THREADS	64
+
+/* the buffer layout XFS_IOC_ATTRLIST_BY_HANDLE fills in */
+typedef struct jdm_attrlist {
+	__s32	al_count;
+	__s32	al_more;
+	__s32	al_offset[1];
+} jdm_attrlist_t;
+
+typedef struct jdm_attrlist_ent {
+	__u32	a_valuelen;
+	char	a_name[1];
+} jdm_attrlist_ent_t;
+
+/* an attribute found by the listing, before its value is fetched */
+typedef struct jdm_attr_name {
+	size_t	nameoff;		/* into the names buffer */
+	int	namelen;
+	int	valuelen;
+	int	flags;
+} jdm_attr_name_t;
+
+typedef struct jdm_attr_job {
+	jdm_batch_t	*bp;
+	xfs_bstat_t	*statp;
+	jdm_xattrs_t	*xap;
+	int		count;
+	int		nsflags;
+	int		next;		/* next inode to take */
+} jdm_attr_job_t;
+
+/* per thread scratch space, grown as needed and kept between inodes */
+typedef struct jdm_attr_worker {
+	pthread_t	tid;
+	jdm_attr_job_t	*job;
+	char		*listbuf;
+	jdm_attr_name_t	*ents;
+	int		maxents;
+	char		*names;
+	size_t		namesz;
+	int		done;		/* inodes fetched without error */
+} jdm_attr_worker_t;
+
+static int
+jdm_attr_grow(
+	void		**ptrp,
+	size_t		*sizep,
+	size_t		want,
+	size_t		unit)
+{
+	size_t		size = *sizep ? *sizep : 64;
+	void		*p;
+
+	if (want <= *sizep)
+		return 0;
+	while (size < want)
+		size *= 2;
+	p = realloc(*ptrp, size * unit);
+	if (!p)
+		return ENOMEM;
+	*ptrp = p;
+	*sizep = size;
+	return 0;
+}
+
+/* list the attributes of one namespace, appending to the worker's list */
+static int
+jdm_attr_list_ns(
+	jdm_attr_worker_t	*w,
+	filehandle_t		*handlep,
+	int			flags,
+	int			*nentsp,
+	size_t			*namesp)
+{
+	jdm_batch_t		*bp = w->job->bp;
+	xfs_fsop_attrlist_handlereq_t alhreq;
+	jdm_attrlist_t		*alist = (jdm_attrlist_t *)w->listbuf;
+	jdm_attrlist_ent_t	*ent;
+	jdm_attr_name_t		*np;
+	size_t			maxents = w->maxents;
+	int			len;
+	int			i;
+
+	memset(&alhreq, 0, sizeof(alhreq));
+	jdm_batch_hreq(&alhreq.hreq, handlep);
+	alhreq.flags = flags;
+	alhreq.buflen = XATTR_LIST_MAX;
+	alhreq.buffer = w->listbuf;
+	do {
+		if (xfsctl(bp->path, bp->fsfd, XFS_IOC_ATTRLIST_BY_HANDLE,
+			   &alhreq) < 0)
+			return errno;
+		for (i = 0; i < alist->al_count; i++) {
+			ent = (jdm_attrlist_ent_t *)
+				(w->listbuf + alist->al_offset[i]);
+			len = strlen(ent->a_name);
+			if (jdm_attr_grow((void **)&w->ents, &maxents,
+					  *nentsp + 1, sizeof(*w->ents)))
+				return ENOMEM;
+			w->maxents = maxents;
+			if (jdm_attr_grow((void **)&w->names, &w->namesz,
+					  *namesp + len + 1, 1))
+				return ENOMEM;
+			np = &w->ents[(*nentsp)++];
+			np->nameoff = *namesp;
+			np->namelen = len;
+			np->valuelen = ent->a_valuelen;
+			np->flags = flags;
+			memcpy(w->names + *namesp, ent->a_name, len + 1);
+			*namesp += len + 1;
+		}
+	} while (alist->al_more);
+	return 0;
+}
+
+/*
+ * Get the values for the nents attributes listed into xa, which has room
+ * for the lengths the listing gave.  Returns EAGAIN if any of them
+ * changed or went away since.
+ */
+static int
+jdm_attr_get_values(
+	jdm_attr_worker_t	*w,
+	filehandle_t		*handlep,
+	jdm_xattrs_t		*xa)
+{
+	jdm_batch_t		*bp = w->job->bp;
+	xfs_fsop_attrmulti_handlereq_t amhreq;
+	xfs_attr_multiop_t	ops[JDM_ATTR_MULTI_OPS];
+	jdm_xattr_t		*xp;
+	int			error;
+	int			n;
+	int			i;
+	int			j;
+
+	for (i = 0; i < xa->count; i += n) {
+		n = min(xa->count - i, JDM_ATTR_MULTI_OPS);
+		for (j = 0; j < n; j++) {
+			xp = &xa->attrs[i + j];
+			ops[j].am_opcode = ATTR_OP_GET;
+			ops[j].am_error = 0;
+			ops[j].am_attrname = xp->name;
+			ops[j].am_attrvalue = xp->value;
+			ops[j].am_length = xp->valuelen;
+			ops[j].am_flags = xp->flags;
+		}
+		jdm_batch_hreq(&amhreq.hreq, handlep);
+		amhreq.opcount = n;
+		amhreq.ops = ops;
+		if (xfsctl(bp->path, bp->fsfd, XFS_IOC_ATTRMULTI_BY_HANDLE,
+			   &amhreq) < 0)
+			return errno;
+		for (j = 0; j < n; j++) {
+			/* older kernels hand back positive errors */
+			error = abs(ops[j].am_error);
+			if (error == ERANGE || error == E2BIG ||
+			    error == ENOATTR)
+				return EAGAIN;
+			if (error)
+				return error;
+			xa->attrs[i + j].valuelen = ops[j].am_length;
+		}
+	}
+	return 0;
+}
+
+static int
+jdm_attr_get_one(
+	jdm_attr_worker_t	*w,
+	xfs_bstat_t		*statp,
+	jdm_xattrs_t		*xa)
+{
+	static const int	ns[] = { 0, JDM_ATTR_NS_ROOT, JDM_ATTR_NS_SECURE };
+	static const int	nsbits[] = {
+		JDM_XATTR_USER, JDM_XATTR_ROOT, JDM_XATTR_SECURE };
+	filehandle_t		handle = w->job->bp->handles[0];
+	jdm_attr_name_t		*np;
+	jdm_xattr_t		*xp;
+	size_t			names;
+	size_t			size;
+	char			*p;
+	int			nents;
+	int			error;
+	int			tries;
+	int			i;
+
+	handle.fh_gen = statp->bs_gen;
+	handle.fh_ino = statp->bs_ino;
+	for (tries = 0; tries < JDM_ATTR_RETRIES; tries++) {
+		nents = 0;
+		names = 0;
+		for (i = 0; i < 3; i++) {
+			if (!(w->job->nsflags & nsbits[i]))
+				continue;
+			error = jdm_attr_list_ns(w, &handle, ns[i], &nents,
+						 &names);
+			if (error)
+				return error;
+		}
+		if (!nents)
+			return 0;
+
+		size = nents * sizeof(jdm_xattr_t) + names;
+		for (i = 0; i < nents; i++)
+			size += w->ents[i].valuelen;
+		xa->attrs = malloc(size);
+		if (!xa->attrs)
+			return ENOMEM;
+		xa->count = nents;
+		p = (char *)&xa->attrs[nents];
+		memcpy(p, w->names, names);
+		for (i = 0; i < nents; i++) {
+			np = &w->ents[i];
+			xp = &xa->attrs[i];
+			xp->name = p + np->nameoff;
+			xp->valuelen = np->valuelen;
+			xp->flags = np->flags;
+		}
+		p += names;
+		for (i = 0; i < nents; i++) {
+			xa->attrs[i].value = p;
+			p += xa->attrs[i].valuelen;
+		}
+
+		error = jdm_attr_get_values(w, &handle, xa);
+		if (!error)
+			return 0;
+		free(xa->attrs);
+		xa->attrs = NULL;
+		xa->count = 0;
+		if (error != EAGAIN)
+			return error;
+	}
+	return EAGAIN;
+}
+
+static void *
+jdm_attr_worker(
+	void			*arg)
+{
+	jdm_attr_worker_t	*w = arg;
+	jdm_attr_job_t		*job = w->job;
+	jdm_xattrs_t		*xa;
+	int			i;
+
+	w->listbuf = malloc(XATTR_LIST_MAX);
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+		xa = &job->xap[i];
+		xa->error = w->listbuf ?
+				jdm_attr_get_one(w, &job->statp[i], xa) : ENOMEM;
+		if (!xa->error)
+			w->done++;
+	}
+	free(w->listbuf);
+	free(w->ents);
+	free(w->names);
+	return NULL;
+}
+
+int
+jdm_attr_get_batch( jdm_batch_t *bp,
+		    xfs_bstat_t *statp, int count,
+		    int nsflags, int nthreads,
+		    jdm_xattrs_t *xap )
+{
+	jdm_attr_job_t job;
+	jdm_attr_worker_t *workers;
+	int done = 0;
+	int i;
+
+	memset(xap, 0, count * sizeof(*xap));
+	job.bp = bp;
+	job.statp = statp;
+	job.xap = xap;
+	job.count = count;
+	job.nsflags = nsflags;
+	job.next = 0;
+
+	nthreads = min(nthreads, count);
+	nthreads = min(nthreads, JDM_ATTR_MAX_THREADS);
+	if (nthreads < 1)
+		nthreads = 1;
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	/* the caller is worker 0 */
+	for (i = 1; i < nthreads; i++) {
+		workers[i].job = &job;
+		if (pthread_create(&workers[i].tid, NULL, jdm_attr_worker,
+				   &workers[i]))
+			break;
+	}
+	nthreads = i;
+	workers[0].job = &job;
+	jdm_attr_worker(&workers[0]);
+	for (i = 0; i < nthreads; i++) {
+		if (i)
+			pthread_join(workers[i].tid, NULL);
+		done += workers[i].done;
+	}
+	free(workers);
+	return done;
+}
+
+void
+jdm_xattrs_free( jdm_xattrs_t *xap, int count )
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		free(xap[i].attrs);
+		xap[i].attrs = NULL;
+		xap[i].count = 0;
+	}
+}
+
 int
 jdm_attr_list(	jdm_fshandle_t *fshp,
 		xfs_bstat_t *statp,
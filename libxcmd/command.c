@@ -27,6 +27,7 @@ static argsfunc_t	args_func;
 static checkfunc_t	check_func;
 static int		ncmdline;
 static char		**cmdline;
+static int		batch;
 
 static int
 compare(const void *a, const void *b)
@@ -140,6 +141,134 @@ add_args_command(
 	args_func = af;
 }
 
+void
+add_batch_mode(void)
+{
+	batch = 1;
+}
+
+/*
+ * Batch mode, for scripts piping in large numbers of commands: read
+ * standard input in big chunks rather than a line at a time, split each
+ * line into words in place with one argument vector reused for every
+ * line, and leave stdout fully buffered, flushing it only when we are
+ * about to wait for more input and at the end.  There's no prompt.
+ */
+#define BATCH_CHUNK	(1024 * 1024)
+
+static int
+batch_line(
+	char		*line,
+	char		***argvp,
+	int		*argmaxp)
+{
+	static const cmdinfo_t *last;
+	const cmdinfo_t	*ct;
+	char		**v;
+	char		*p;
+	int		c = 0;
+
+	while ((p = strsep(&line, " ")) != NULL) {
+		if (!*p)
+			continue;
+		if (c + 1 >= *argmaxp) {
+			v = realloc(*argvp, sizeof(char *) * *argmaxp * 2);
+			if (!v) {
+				fprintf(stderr, _("cannot allocate arguments: %s\n"),
+					strerror(errno));
+				return 0;
+			}
+			*argvp = v;
+			*argmaxp *= 2;
+		}
+		(*argvp)[c++] = p;
+	}
+	if (!c)
+		return 0;
+	v = *argvp;
+	v[c] = NULL;
+
+	/* scripts tend to repeat the same command over and over */
+	if (last && (strcmp(last->name, v[0]) == 0 ||
+		     (last->altname && strcmp(last->altname, v[0]) == 0)))
+		ct = last;
+	else
+		ct = last = find_command(v[0]);
+	if (!ct) {
+		fprintf(stderr, _("command \"%s\" not found\n"), v[0]);
+		return 0;
+	}
+	return command(ct, c, v);
+}
+
+static void
+batch_loop(void)
+{
+	char		*buf;
+	char		*line;
+	char		*end;
+	char		**v;
+	size_t		size = BATCH_CHUNK;
+	size_t		len = 0;
+	ssize_t		n;
+	int		argmax = 16;
+	int		done = 0;
+	int		eof = 0;
+
+	buf = malloc(size + 1);
+	v = malloc(sizeof(char *) * argmax);
+	if (!buf || !v) {
+		fprintf(stderr, _("cannot allocate input buffer: %s\n"),
+			strerror(errno));
+		exit(1);
+	}
+	setvbuf(stdout, NULL, _IOFBF, BATCH_CHUNK);
+
+	while (!done && !eof) {
+		/* make room for a line longer than what's left */
+		if (len == size) {
+			size *= 2;
+			line = realloc(buf, size + 1);
+			if (!line) {
+				fprintf(stderr,
+					_("cannot allocate input buffer: %s\n"),
+					strerror(errno));
+				exit(1);
+			}
+			buf = line;
+		}
+		fflush(stdout);
+		n = read(STDIN_FILENO, buf + len, size - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, _("cannot read commands: %s\n"),
+				strerror(errno));
+			break;
+		}
+		if (n == 0) {
+			/* run a last line without a newline too */
+			eof = 1;
+			if (len)
+				buf[len++] = '\n';
+		}
+		len += n;
+
+		for (line = buf; !done && line < buf + len; line = end + 1) {
+			end = memchr(line, '\n', buf + len - line);
+			if (!end)
+				break;
+			*end = '\0';
+			done = batch_line(line, &v, &argmax);
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+	fflush(stdout);
+	free(v);
+	free(buf);
+}
+
 void
 command_loop(void)
 {
@@ -177,6 +306,10 @@ command_loop(void)
 		free(cmdline);
 		return;
 	}
+	if (batch) {
+		batch_loop();
+		return;
+	}
 	while (!done) {
 		if ((input = fetchline()) == NULL)
 			break;
@@ -38,6 +38,34 @@ struct fs_path *fs_path;
 char *mtab_file;
 #define PROC_MOUNTS	"/proc/self/mounts"
 
+/*
+ * fs_table is indexed by data device and by directory name, so lookups
+ * don't have to scan a table holding thousands of mounts and project
+ * paths.  Each entry type has its own device chains, as bind mounts all
+ * share one device.  The chains hold table indices, in table order, so
+ * a lookup still finds the first matching entry as a scan would.  If
+ * the indexes can't be allocated we fall back to scanning.
+ */
+#define FS_HASH_MIN	64
+
+struct fs_index {
+	int		*heads;
+	int		*tails;
+	int		*next;		/* per table entry */
+};
+
+static struct fs_index	fs_devidx;
+static struct fs_index	fs_diridx;
+static uint		fs_hash_size;	/* 0: not indexed, scan */
+
+/*
+ * Project paths are only read from the projects file when something
+ * asks for them; most commands only want the mount points.
+ */
+static int	fs_projects_pending;
+static int	fs_project_count;
+static char	**fs_projects;
+
 static int
 fs_device_number(
 	const char	*name,
@@ -60,6 +88,128 @@ fs_device_number(
 	return 0;
 }
 
+static uint
+fs_hash_dev(
+	dev_t		dev,
+	uint		flags)
+{
+	__uint64_t	key = ((__uint64_t)dev << 2) | flags;
+
+	return (key * 0x9e37fffffffc0001ULL) >> 32 & (fs_hash_size - 1);
+}
+
+static uint
+fs_hash_dir(
+	const char	*dir)
+{
+	uint		hash = 2166136261U;		/* FNV-1a */
+
+	while (*dir)
+		hash = (hash ^ (unsigned char)*dir++) * 16777619U;
+	return hash & (fs_hash_size - 1);
+}
+
+static void
+fs_index_add(
+	struct fs_index	*ix,
+	uint		bucket,
+	int		i)
+{
+	ix->next[i] = -1;
+	if (ix->heads[bucket] < 0)
+		ix->heads[bucket] = i;
+	else
+		ix->next[ix->tails[bucket]] = i;
+	ix->tails[bucket] = i;
+}
+
+static void
+fs_index_insert(
+	int		i)
+{
+	fs_index_add(&fs_devidx, fs_hash_dev(fs_table[i].fs_datadev,
+				fs_table[i].fs_flags), i);
+	fs_index_add(&fs_diridx, fs_hash_dir(fs_table[i].fs_dir), i);
+}
+
+static int
+fs_index_alloc(
+	struct fs_index	*ix,
+	uint		size)
+{
+	int		*p;
+
+	if (!(p = realloc(ix->heads, size * sizeof(int))))
+		return ENOMEM;
+	ix->heads = p;
+	if (!(p = realloc(ix->tails, size * sizeof(int))))
+		return ENOMEM;
+	ix->tails = p;
+	if (!(p = realloc(ix->next, size * sizeof(int))))
+		return ENOMEM;
+	ix->next = p;
+	memset(ix->heads, 0xff, size * sizeof(int));
+	return 0;
+}
+
+/* index a newly added entry, growing the hash tables as it fills up */
+static void
+fs_index_update(void)
+{
+	uint		size;
+	int		i;
+
+	if (fs_hash_size && fs_count <= fs_hash_size / 2) {
+		fs_index_insert(fs_count - 1);
+		return;
+	}
+	for (size = FS_HASH_MIN; size < fs_count * 4; size *= 2)
+		;
+	if (fs_index_alloc(&fs_devidx, size) ||
+	    fs_index_alloc(&fs_diridx, size)) {
+		fs_hash_size = 0;
+		return;
+	}
+	fs_hash_size = size;
+	for (i = 0; i < fs_count; i++)
+		fs_index_insert(i);
+}
+
+static struct fs_path *
+fs_table_lookup_dev(
+	dev_t		dev,
+	uint		flags)
+{
+	struct fs_path	*found = NULL;
+	uint		type;
+	int		i;
+
+	if (!fs_hash_size) {
+		for (i = 0; i < fs_count; i++) {
+			if (flags && !(flags & fs_table[i].fs_flags))
+				continue;
+			if (fs_table[i].fs_datadev == dev)
+				return &fs_table[i];
+		}
+		return NULL;
+	}
+
+	/* with both types wanted, the earlier entry of the two wins */
+	for (type = FS_MOUNT_POINT; type <= FS_PROJECT_PATH; type <<= 1) {
+		if (flags && !(flags & type))
+			continue;
+		for (i = fs_devidx.heads[fs_hash_dev(dev, type)]; i >= 0;
+		     i = fs_devidx.next[i]) {
+			if (fs_table[i].fs_datadev == dev &&
+			    fs_table[i].fs_flags == type)
+				break;
+		}
+		if (i >= 0 && (!found || &fs_table[i] < found))
+			found = &fs_table[i];
+	}
+	return found;
+}
+
 /*
  * Find the FS table entry for the given path.  The "flags" argument
  * is a mask containing FS_MOUNT_POINT or FS_PROJECT_PATH (or both)
@@ -70,19 +220,28 @@ fs_table_lookup(
 	const char	*dir,
 	uint		flags)
 {
-	uint		i;
+	int		i;
 	dev_t		dev = 0;
 
-	if (fs_device_number(dir, &dev))
-		return NULL;
+	/*
+	 * A project path is on a filesystem that's in the table already,
+	 * so only a lookup for project paths alone needs them loaded.
+	 */
+	if (flags == FS_PROJECT_PATH)
+		fs_table_load_projects();
 
-	for (i = 0; i < fs_count; i++) {
-		if (flags && !(flags & fs_table[i].fs_flags))
-			continue;
-		if (fs_table[i].fs_datadev == dev)
-			return &fs_table[i];
+	/* a directory that's in the table already needs no stat */
+	i = fs_hash_size ? fs_diridx.heads[fs_hash_dir(dir)] : -1;
+	for (; i >= 0; i = fs_diridx.next[i]) {
+		if (strcmp(fs_table[i].fs_dir, dir) == 0)
+			break;
 	}
-	return NULL;
+	if (i >= 0)
+		dev = fs_table[i].fs_datadev;
+	else if (fs_device_number(dir, &dev))
+		return NULL;
+
+	return fs_table_lookup_dev(dev, flags);
 }
 
 static int
@@ -146,6 +305,7 @@ fs_table_insert(
 	fs_path->fs_logdev = logdev;
 	fs_path->fs_rtdev = rtdev;
 	fs_count++;
+	fs_index_update();
 
 	return 0;
 
@@ -184,6 +344,8 @@ fs_cursor_initialise(
 	fs_path_t	*path;
 
 	memset(cur, 0, sizeof(*cur));
+	if (!dir && (flags & FS_PROJECT_PATH || !flags))
+		fs_table_load_projects();
 	if (dir) {
 		if ((path = fs_table_lookup(dir, flags)) == NULL)
 			return;
@@ -397,19 +559,11 @@ static struct fs_path *
 fs_mount_point_from_path(
 	const char	*dir)
 {
-	fs_cursor_t	cursor;
-	fs_path_t	*fs;
 	dev_t		dev = 0;
 
 	if (fs_device_number(dir, &dev))
 		return NULL;
-
-	fs_cursor_initialise(NULL, FS_MOUNT_POINT, &cursor);
-	while ((fs = fs_cursor_next_entry(&cursor))) {
-		if (fs->fs_datadev == dev)
-			break;
-	}
-	return fs;
+	return fs_table_lookup_dev(dev, FS_MOUNT_POINT);
 }
 
 static void
@@ -474,12 +628,46 @@ fs_table_insert_project(
 			progname, project, strerror(error));
 }
 
+/*
+ * Add the project paths fs_table_initialise was asked for, the first time
+ * they're needed.  Lookups and cursors do this themselves; callers that
+ * walk fs_table directly call it first.  Inserting moves fs_path, so put
+ * it back afterwards.
+ */
+void
+fs_table_load_projects(void)
+{
+	int	current = fs_path ? fs_path - fs_table : -1;
+	int	error;
+	int	i;
+
+	if (!fs_projects_pending)
+		return;
+	fs_projects_pending = 0;
+
+	if (fs_project_count) {
+		for (i = 0; i < fs_project_count; i++)
+			fs_table_insert_project(fs_projects[i]);
+		free(fs_projects);
+		fs_projects = NULL;
+		fs_project_count = 0;
+	} else {
+		error = fs_table_initialise_projects(NULL);
+		if (error)
+			fprintf(stderr,
+				_("%s: cannot initialise path table: %s\n"),
+				progname, strerror(error));
+	}
+	fs_path = current < 0 ? NULL : &fs_table[current];
+}
+
 /*
  * Initialize fs_table to contain the given set of mount points and
  * projects.  If mount_count is zero, mounts is ignored and the
  * table is populated with mounted filesystems.  If project_count is
  * zero, projects is ignored and the table is populated with all
- * projects defined in the projects file.
+ * projects defined in the projects file.  The projects are only
+ * added once something looks for them.
  */
 void
 fs_table_initialise(
@@ -499,15 +687,18 @@ fs_table_initialise(
 		if (error)
 			goto out_error;
 	}
+	/* the caller may free its array, but not the names in it */
 	if (project_count) {
-		for (i = 0; i < project_count; i++)
-			fs_table_insert_project(projects[i]);
-	} else {
-		error = fs_table_initialise_projects(NULL);
-		if (error)
-			goto out_error;
+		fs_projects = malloc(project_count * sizeof(char *));
+		if (!fs_projects) {
+			for (i = 0; i < project_count; i++)
+				fs_table_insert_project(projects[i]);
+			return;
+		}
+		memcpy(fs_projects, projects, project_count * sizeof(char *));
+		fs_project_count = project_count;
 	}
-
+	fs_projects_pending = 1;
 	return;
 
 out_error:
@@ -523,6 +714,8 @@ fs_table_insert_project_path(
 	fs_path_t	*fs;
 	int		error = 0;
 
+	/* keep the projects file's paths ahead of this one, as before */
+	fs_table_load_projects();
 	fs = fs_mount_point_from_path(dir);
 	if (fs)
 		error = fs_table_insert(dir, prid, FS_PROJECT_PATH,
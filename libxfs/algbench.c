@@ -0,0 +1,694 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Benchmark of the libxfs data structure code, without the I/O the tools
+ * normally wrap around it.
+ *
+ * For each size asked for, n keys are inserted in random order, looked up
+ * in a different random order and then removed, and the time and number
+ * of memory allocations per operation are reported for each phase:
+ *
+ *  iext	the incore extent list of an inode fork (xfs_iext_*)
+ *  btree	a by-block free space btree (xfs_btree_*) built in an AG of
+ *		a memory buftarg, so every block stays in the buffer cache
+ *  dir		a directory in the filesystem (xfs_dir_*), which goes
+ *		through the da btree once it has more than a leaf block
+ *
+ * The filesystem given supplies the geometry for all of them and holds
+ * the directories, which are left behind, empty, in its root.  It should
+ * be a scratch image, best kept on tmpfs so that writing back the cache
+ * at the end is cheap.  Allocations are counted by wrapping the glibc
+ * allocator.
+ *
+ * Build it with "make -C libxfs algbench".
+ */
+
+#include "libxfs.h"
+
+#define BENCH_BATCH	256	/* operations per transaction */
+
+enum {
+	TEST_IEXT,
+	TEST_BTREE,
+	TEST_DIR,
+	NTESTS
+};
+
+static const char	*test_names[NTESTS] = { "iext", "btree", "dir" };
+
+static struct xfs_mount	*mp;
+static unsigned int	*keys;		/* insertion order */
+static unsigned int	*lkeys;		/* lookup and removal order */
+static __uint64_t	rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long nallocs;
+
+extern void	*__libc_malloc(size_t);
+extern void	*__libc_calloc(size_t, size_t);
+extern void	*__libc_realloc(void *, size_t);
+extern void	*__libc_memalign(size_t, size_t);
+
+void *
+malloc(
+	size_t		size)
+{
+	counter_add(&nallocs, 1);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(
+	size_t		nmemb,
+	size_t		size)
+{
+	counter_add(&nallocs, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(
+	void		*ptr,
+	size_t		size)
+{
+	counter_add(&nallocs, 1);
+	return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(
+	size_t		align,
+	size_t		size)
+{
+	counter_add(&nallocs, 1);
+	return __libc_memalign(align, size);
+}
+
+static void
+fail(
+	const char	*what,
+	int		error)
+{
+	fprintf(stderr, "%s: %s: %s\n", progname, what, strerror(error));
+	exit(1);
+}
+
+static __uint64_t
+rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static void
+shuffle(
+	unsigned int	*a,
+	unsigned long	n)
+{
+	unsigned long	i, j;
+	unsigned int	t;
+
+	for (i = 0; i < n; i++)
+		a[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = rnd() % (i + 1);
+		t = a[i];
+		a[i] = a[j];
+		a[j] = t;
+	}
+}
+
+struct bench_phase {
+	struct timespec		start;
+	unsigned long long	allocs;
+};
+
+static void
+phase_start(
+	struct bench_phase	*ph)
+{
+	ph->allocs = counter_read(&nallocs);
+	clock_gettime(CLOCK_MONOTONIC, &ph->start);
+}
+
+static void
+phase_end(
+	struct bench_phase	*ph,
+	int			test,
+	const char		*op,
+	unsigned long		n)
+{
+	struct timespec		end;
+	double			nsecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	nsecs = (end.tv_sec - ph->start.tv_sec) * 1e9 +
+		(end.tv_nsec - ph->start.tv_nsec);
+	printf("%-6s %-7s %10lu %12.1f %10.2f\n", test_names[test], op, n,
+		nsecs / n, (double)(counter_read(&nallocs) - ph->allocs) / n);
+}
+
+/*
+ * Incore extent list: one block extents two blocks apart, so that they
+ * never touch.
+ */
+static void
+bench_iext(
+	unsigned long		n)
+{
+	struct xfs_inode	*ip;
+	struct xfs_ifork	*ifp;
+	struct xfs_bmbt_irec	rec;
+	struct bench_phase	ph;
+	xfs_bmbt_rec_host_t	*ep;
+	xfs_extnum_t		idx;
+	unsigned long		i;
+	unsigned long		bad = 0;
+
+	ip = calloc(1, sizeof(*ip));
+	if (!ip)
+		fail("calloc", errno);
+	ip->i_mount = mp;
+	ifp = &ip->i_df;
+	ifp->if_flags = XFS_IFEXTENTS;
+
+	phase_start(&ph);
+	for (i = 0; i < n; i++) {
+		rec.br_startoff = (xfs_fileoff_t)keys[i] * 2;
+		rec.br_startblock = (xfs_fsblock_t)keys[i] * 2;
+		rec.br_blockcount = 1;
+		rec.br_state = XFS_EXT_NORM;
+		xfs_iext_bno_to_ext(ifp, rec.br_startoff, &idx);
+		xfs_iext_insert(ip, idx, 1, &rec, 0);
+	}
+	phase_end(&ph, TEST_IEXT, "insert", n);
+
+	phase_start(&ph);
+	for (i = 0; i < n; i++) {
+		ep = xfs_iext_bno_to_ext(ifp, (xfs_fileoff_t)lkeys[i] * 2,
+				&idx);
+		if (!ep || xfs_bmbt_get_startoff(ep) != lkeys[i] * 2ULL)
+			bad++;
+	}
+	phase_end(&ph, TEST_IEXT, "lookup", n);
+
+	phase_start(&ph);
+	for (i = 0; i < n; i++) {
+		xfs_iext_bno_to_ext(ifp, (xfs_fileoff_t)lkeys[i] * 2, &idx);
+		xfs_iext_remove(ip, idx, 1, 0);
+	}
+	phase_end(&ph, TEST_IEXT, "remove", n);
+
+	if (bad || ifp->if_bytes)
+		fprintf(stderr, _("%s: iext: %lu lookups failed, %d bytes "
+			"left\n"), progname, bad, ifp->if_bytes);
+	xfs_idestroy_fork(ip, XFS_DATA_FORK);
+	free(ip);
+}
+
+/*
+ * Free space btree.  A copy of the mount whose data device is a memory
+ * buftarg gets an AG 0 with empty btree roots and a free list, which is
+ * topped up from the blocks above the roots, and drained, as the btree
+ * takes and gives back blocks.  The records are made up and don't have
+ * to agree with anything.
+ */
+struct bench_ag {
+	struct xfs_mount	*mp;
+	xfs_agblock_t		next;		/* next unused block */
+};
+
+static void
+bt_init_ag(
+	struct bench_ag		*ag)
+{
+	struct xfs_mount	*smp = ag->mp;
+	struct xfs_buf		*bp;
+	struct xfs_agf		*agf;
+	struct xfs_agfl		*agfl;
+	int			crc = xfs_sb_version_hascrc(&smp->m_sb);
+	int			i;
+
+	bp = libxfs_getbuf(smp->m_ddev_targp,
+			XFS_AG_DADDR(smp, 0, XFS_AGF_DADDR(smp)),
+			XFS_FSS_TO_BB(smp, 1));
+	bp->b_ops = &xfs_agf_buf_ops;
+	agf = XFS_BUF_TO_AGF(bp);
+	memset(agf, 0, smp->m_sb.sb_sectsize);
+	agf->agf_magicnum = cpu_to_be32(XFS_AGF_MAGIC);
+	agf->agf_versionnum = cpu_to_be32(XFS_AGF_VERSION);
+	agf->agf_length = cpu_to_be32(smp->m_sb.sb_agblocks);
+	agf->agf_roots[XFS_BTNUM_BNOi] = cpu_to_be32(XFS_BNO_BLOCK(smp));
+	agf->agf_roots[XFS_BTNUM_CNTi] = cpu_to_be32(XFS_CNT_BLOCK(smp));
+	agf->agf_levels[XFS_BTNUM_BNOi] = cpu_to_be32(1);
+	agf->agf_levels[XFS_BTNUM_CNTi] = cpu_to_be32(1);
+	agf->agf_fllast = cpu_to_be32(XFS_AGFL_SIZE(smp) - 1);
+	if (crc)
+		platform_uuid_copy(&agf->agf_uuid, &smp->m_sb.sb_meta_uuid);
+	libxfs_writebuf(bp, 0);
+
+	bp = libxfs_getbuf(smp->m_ddev_targp,
+			XFS_AG_DADDR(smp, 0, XFS_AGFL_DADDR(smp)),
+			XFS_FSS_TO_BB(smp, 1));
+	bp->b_ops = &xfs_agfl_buf_ops;
+	agfl = XFS_BUF_TO_AGFL(bp);
+	memset(agfl, 0xff, smp->m_sb.sb_sectsize);
+	if (crc) {
+		agfl->agfl_magicnum = cpu_to_be32(XFS_AGFL_MAGIC);
+		agfl->agfl_seqno = 0;
+		platform_uuid_copy(&agfl->agfl_uuid, &smp->m_sb.sb_meta_uuid);
+		for (i = 0; i < XFS_AGFL_SIZE(smp); i++)
+			agfl->agfl_bno[i] = cpu_to_be32(NULLAGBLOCK);
+	}
+	libxfs_writebuf(bp, 0);
+
+	for (i = 0; i < 2; i++) {
+		bp = libxfs_getbuf(smp->m_ddev_targp,
+				XFS_AGB_TO_DADDR(smp, 0, i ? XFS_CNT_BLOCK(smp) :
+							     XFS_BNO_BLOCK(smp)),
+				BTOBB(smp->m_sb.sb_blocksize));
+		bp->b_ops = &xfs_allocbt_buf_ops;
+		if (crc)
+			xfs_btree_init_block(smp, bp, i ? XFS_ABTC_CRC_MAGIC :
+						XFS_ABTB_CRC_MAGIC, 0, 0, 0,
+					XFS_BTREE_CRC_BLOCKS);
+		else
+			xfs_btree_init_block(smp, bp, i ? XFS_ABTC_MAGIC :
+						XFS_ABTB_MAGIC, 0, 0, 0, 0);
+		libxfs_writebuf(bp, 0);
+	}
+	ag->next = XFS_PREALLOC_BLOCKS(smp);
+}
+
+/* keep enough on the free list for a split, and room for a join */
+static void
+bt_fix_freelist(
+	struct bench_ag		*ag,
+	struct xfs_trans	*tp,
+	struct xfs_buf		*agbp)
+{
+	struct xfs_agf		*agf = XFS_BUF_TO_AGF(agbp);
+	xfs_agblock_t		bno;
+	int			error;
+
+	while (be32_to_cpu(agf->agf_flcount) < XFS_BTREE_MAXLEVELS) {
+		if (ag->next >= ag->mp->m_sb.sb_agblocks)
+			fail(_("AG too small for the btree"), ENOSPC);
+		error = -xfs_alloc_put_freelist(tp, agbp, NULL, ag->next++, 0);
+		if (error)
+			fail(_("put freelist"), error);
+	}
+	while (be32_to_cpu(agf->agf_flcount) >
+			XFS_AGFL_SIZE(ag->mp) - XFS_BTREE_MAXLEVELS) {
+		error = -xfs_alloc_get_freelist(tp, agbp, &bno, 0);
+		if (error)
+			fail(_("get freelist"), error);
+	}
+}
+
+enum { BT_INSERT, BT_LOOKUP, BT_DELETE };
+
+static unsigned long
+bt_run(
+	struct bench_ag		*ag,
+	int			op,
+	unsigned int		*order,
+	unsigned long		n)
+{
+	struct xfs_btree_cur	*cur;
+	struct xfs_trans	*tp;
+	struct xfs_buf		*agbp;
+	unsigned long		i, j;
+	unsigned long		bad = 0;
+	int			stat;
+	int			error;
+
+	for (i = 0; i < n; i += BENCH_BATCH) {
+		tp = libxfs_trans_alloc(ag->mp, 0);
+		error = -xfs_alloc_read_agf(ag->mp, tp, 0, 0, &agbp);
+		if (error)
+			fail(_("read agf"), error);
+		cur = xfs_allocbt_init_cursor(ag->mp, tp, agbp, 0,
+				XFS_BTNUM_BNO);
+		for (j = i; j < n && j < i + BENCH_BATCH; j++) {
+			if (op != BT_LOOKUP)
+				bt_fix_freelist(ag, tp, agbp);
+			cur->bc_rec.a.ar_startblock = order[j] * 2;
+			cur->bc_rec.a.ar_blockcount = 1;
+			error = -xfs_btree_lookup(cur, XFS_LOOKUP_EQ, &stat);
+			if (error)
+				fail(_("btree lookup"), error);
+			if (op == BT_INSERT) {
+				if (stat) {
+					bad++;
+					continue;
+				}
+				cur->bc_rec.a.ar_startblock = order[j] * 2;
+				cur->bc_rec.a.ar_blockcount = 1;
+				error = -xfs_btree_insert(cur, &stat);
+			} else if (op == BT_DELETE && stat) {
+				error = -xfs_btree_delete(cur, &stat);
+			}
+			if (error)
+				fail(_("btree update"), error);
+			if (!stat)
+				bad++;
+		}
+		xfs_btree_del_cursor(cur, XFS_BTREE_NOERROR);
+		error = -libxfs_trans_commit(tp);
+		if (error)
+			fail(_("commit"), error);
+	}
+	return bad;
+}
+
+static void
+bench_btree(
+	unsigned long		n)
+{
+	struct bench_ag		ag;
+	struct xfs_perag	*pag;
+	struct bench_phase	ph;
+	unsigned long		bad;
+
+	ag.mp = malloc(sizeof(struct xfs_mount));
+	if (!ag.mp)
+		fail("malloc", errno);
+	*ag.mp = *mp;
+	INIT_RADIX_TREE(&ag.mp->m_perag_tree, GFP_KERNEL);
+	ag.mp->m_ddev_targp = libxfs_buftarg_alloc_mem(ag.mp, "algbench",
+			XFS_FSB_TO_BB(mp, mp->m_sb.sb_agblocks));
+	ag.mp->m_logdev_targp = ag.mp->m_ddev_targp;
+	bt_init_ag(&ag);
+
+	phase_start(&ph);
+	bad = bt_run(&ag, BT_INSERT, keys, n);
+	phase_end(&ph, TEST_BTREE, "insert", n);
+	phase_start(&ph);
+	bad += bt_run(&ag, BT_LOOKUP, lkeys, n);
+	phase_end(&ph, TEST_BTREE, "lookup", n);
+	phase_start(&ph);
+	bad += bt_run(&ag, BT_DELETE, lkeys, n);
+	phase_end(&ph, TEST_BTREE, "delete", n);
+	if (bad)
+		fprintf(stderr, _("%s: btree: %lu operations failed\n"),
+			progname, bad);
+
+	libxfs_buftarg_free_mem(ag.mp->m_ddev_targp);
+	pag = radix_tree_delete(&ag.mp->m_perag_tree, 0);
+	if (pag)
+		kmem_free(pag->pagf_index);
+	kmem_free(pag);
+	free(ag.mp);
+}
+
+/*
+ * Directory: a new directory in the root, with n entries that all point
+ * at the root inode.
+ */
+static void
+dir_name(
+	struct xfs_name		*xname,
+	char			*buf,
+	unsigned int		key)
+{
+	sprintf(buf, "f%08x", key);
+	xname->name = (unsigned char *)buf;
+	xname->len = strlen(buf);
+	xname->type = XFS_DIR3_FT_REG_FILE;
+}
+
+static struct xfs_trans *
+dir_trans(
+	uint			blocks)
+{
+	struct xfs_trans_res	tres = {0};
+	struct xfs_trans	*tp;
+	int			error;
+
+	tp = libxfs_trans_alloc(mp, 0);
+	error = -libxfs_trans_reserve(tp, &tres, blocks, 0);
+	if (error)
+		fail(_("cannot reserve space"), error);
+	return tp;
+}
+
+static void
+dir_commit(
+	struct xfs_trans	*tp,
+	xfs_bmap_free_t		*flist)
+{
+	int			committed;
+	int			error;
+
+	error = -libxfs_bmap_finish(&tp, flist, &committed);
+	if (error)
+		fail(_("bmap finish"), error);
+	libxfs_trans_commit(tp);
+}
+
+static struct xfs_inode *
+dir_create(
+	struct xfs_inode	*rootip)
+{
+	static int		seq;
+	struct xfs_inode	*dp;
+	struct xfs_trans	*tp;
+	struct xfs_name		xname;
+	struct cred		creds = {0};
+	struct fsxattr		fsx = {0};
+	xfs_bmap_free_t		flist;
+	xfs_fsblock_t		first;
+	char			name[64];
+	int			error;
+
+	snprintf(name, sizeof(name), "algbench.%d.%d", (int)getpid(), seq++);
+	xname.name = (unsigned char *)name;
+	xname.len = strlen(name);
+	xname.type = XFS_DIR3_FT_DIR;
+
+	tp = dir_trans(XFS_MKDIR_SPACE_RES(mp, xname.len));
+	xfs_bmap_init(&flist, &first);
+	error = -libxfs_inode_alloc(&tp, rootip, S_IFDIR | 0755, 1, 0,
+			&creds, &fsx, &dp);
+	if (error)
+		fail(_("inode allocation"), error);
+	dp->i_d.di_nlink++;		/* account for . */
+	libxfs_trans_ijoin(tp, rootip, 0);
+	error = -libxfs_dir_createname(tp, rootip, &xname, dp->i_ino,
+			&first, &flist, XFS_DIRENTER_SPACE_RES(mp, xname.len));
+	if (error)
+		fail(_("directory createname"), error);
+	rootip->i_d.di_nlink++;
+	libxfs_trans_log_inode(tp, rootip, XFS_ILOG_CORE);
+	error = -libxfs_dir_init(tp, dp, rootip);
+	if (error)
+		fail(_("directory init"), error);
+	libxfs_trans_log_inode(tp, dp, XFS_ILOG_CORE);
+	dir_commit(tp, &flist);
+	return dp;
+}
+
+static void
+bench_dir(
+	unsigned long		n)
+{
+	struct xfs_inode	*rootip;
+	struct xfs_inode	*dp;
+	struct xfs_trans	*tp = NULL;
+	struct xfs_name		xname;
+	struct bench_phase	ph;
+	xfs_bmap_free_t		flist;
+	xfs_fsblock_t		first;
+	xfs_ino_t		ino;
+	char			name[16];
+	unsigned long		i;
+	unsigned long		bad = 0;
+	uint			rsv;
+	int			error;
+
+	error = -libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &rootip, 0);
+	if (error)
+		fail(_("cannot read root inode"), error);
+	dp = dir_create(rootip);
+	rsv = XFS_DIRENTER_SPACE_RES(mp, 9);
+
+	phase_start(&ph);
+	for (i = 0; i < n; i++) {
+		if (i % BENCH_BATCH == 0) {
+			tp = dir_trans(rsv * BENCH_BATCH);
+			xfs_bmap_init(&flist, &first);
+			libxfs_trans_ijoin(tp, dp, 0);
+		}
+		dir_name(&xname, name, keys[i]);
+		error = -libxfs_dir_createname(tp, dp, &xname,
+				mp->m_sb.sb_rootino, &first, &flist, rsv);
+		if (error)
+			fail(_("directory createname"), error);
+		if ((i + 1) % BENCH_BATCH == 0 || i + 1 == n)
+			dir_commit(tp, &flist);
+	}
+	phase_end(&ph, TEST_DIR, "insert", n);
+
+	phase_start(&ph);
+	for (i = 0; i < n; i++) {
+		dir_name(&xname, name, lkeys[i]);
+		if (libxfs_dir_lookup(NULL, dp, &xname, &ino, NULL) ||
+		    ino != mp->m_sb.sb_rootino)
+			bad++;
+	}
+	phase_end(&ph, TEST_DIR, "lookup", n);
+
+	phase_start(&ph);
+	for (i = 0; i < n; i++) {
+		if (i % BENCH_BATCH == 0) {
+			tp = dir_trans(rsv * BENCH_BATCH);
+			xfs_bmap_init(&flist, &first);
+			libxfs_trans_ijoin(tp, dp, 0);
+		}
+		dir_name(&xname, name, lkeys[i]);
+		error = -xfs_dir_removename(tp, dp, &xname,
+				mp->m_sb.sb_rootino, &first, &flist, rsv);
+		if (error)
+			bad++;
+		if ((i + 1) % BENCH_BATCH == 0 || i + 1 == n)
+			dir_commit(tp, &flist);
+	}
+	phase_end(&ph, TEST_DIR, "remove", n);
+
+	if (bad)
+		fprintf(stderr, _("%s: dir: %lu operations failed\n"),
+			progname, bad);
+	IRELE(dp);
+	IRELE(rootip);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: algbench [-n count]... [-t iext|btree|dir]... [-s seed] image\n"
+"\n"
+"	-n	number of keys, can be given more than once (1000 10000 100000)\n"
+"	-t	test to run, can be given more than once (all of them)\n"
+"	-s	random seed\n"
+"\n"
+"image is a scratch XFS filesystem image, which the dir test adds to.\n");
+	exit(1);
+}
+
+#define MAX_SIZES	16
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	static unsigned long	dflt_sizes[] = { 1000, 10000, 100000 };
+	unsigned long		sizes[MAX_SIZES];
+	unsigned long		maxn = 0;
+	libxfs_init_t		x = {0};
+	struct xfs_mount	xmount;
+	struct xfs_buf		*bp;
+	int			tests = 0;
+	int			nsizes = 0;
+	int			c, i, t;
+
+	progname = basename(argv[0]);
+	while ((c = getopt(argc, argv, "n:s:t:")) != EOF) {
+		switch (c) {
+		case 'n':
+			if (nsizes == MAX_SIZES)
+				usage();
+			sizes[nsizes] = strtoul(optarg, NULL, 0);
+			if (!sizes[nsizes])
+				usage();
+			nsizes++;
+			break;
+		case 's':
+			rnd_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 't':
+			for (t = 0; t < NTESTS; t++)
+				if (!strcmp(optarg, test_names[t]))
+					break;
+			if (t == NTESTS)
+				usage();
+			tests |= 1 << t;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if (!tests)
+		tests = (1 << NTESTS) - 1;
+	if (!nsizes) {
+		memcpy(sizes, dflt_sizes, sizeof(dflt_sizes));
+		nsizes = ARRAY_SIZE(dflt_sizes);
+	}
+	for (i = 0; i < nsizes; i++)
+		maxn = max(maxn, sizes[i]);
+
+	x.disfile = 1;
+	x.dname = argv[optind];
+	if (!libxfs_init(&x))
+		fail(_("couldn't initialize XFS library"), EINVAL);
+
+	memset(&xmount, 0, sizeof(xmount));
+	libxfs_buftarg_init(&xmount, x.ddev, x.logdev, x.rtdev);
+	bp = libxfs_readbuf(xmount.m_ddev_targp, XFS_SB_DADDR,
+			1 << (XFS_MAX_SECTORSIZE_LOG - BBSHIFT), 0, NULL);
+	if (!bp || bp->b_error)
+		fail(_("cannot read superblock"), EIO);
+	libxfs_sb_from_disk(&xmount.m_sb, XFS_BUF_TO_SBP(bp));
+	libxfs_putbuf(bp);
+	libxfs_purgebuf(bp);
+	if (xmount.m_sb.sb_magicnum != XFS_SB_MAGIC)
+		fail(_("not an XFS filesystem"), EINVAL);
+	mp = libxfs_mount(&xmount, &xmount.m_sb, x.ddev, x.logdev, x.rtdev, 0);
+	if (!mp)
+		fail(_("cannot mount"), EINVAL);
+
+	keys = malloc(maxn * sizeof(*keys));
+	lkeys = malloc(maxn * sizeof(*lkeys));
+	if (!keys || !lkeys)
+		fail("malloc", errno);
+
+	printf("%-6s %-7s %10s %12s %10s\n", "test", "op", "n", "ns/op",
+		"allocs/op");
+	for (i = 0; i < nsizes; i++) {
+		shuffle(keys, sizes[i]);
+		shuffle(lkeys, sizes[i]);
+		if (tests & (1 << TEST_IEXT))
+			bench_iext(sizes[i]);
+		if (tests & (1 << TEST_BTREE))
+			bench_btree(sizes[i]);
+		if (tests & (1 << TEST_DIR))
+			bench_dir(sizes[i]);
+	}
+
+	free(keys);
+	free(lkeys);
+	libxfs_umount(mp);
+	libxfs_destroy();
+	return 0;
+}
@@ -40,6 +40,22 @@
 
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
 
+/*
+ * The MRU stripe an unreferenced node lives on.  The CLOCK policy ignores
+ * priorities and keeps a single ring per stripe in the base priority slot.
+ */
+static inline struct cache_mru *
+cache_node_mru(
+	struct cache		*cache,
+	struct cache_node	*node)
+{
+	int			priority = node->cn_priority;
+
+	if (cache->c_flags & CACHE_POLICY_CLOCK)
+		priority = CACHE_BASE_PRIORITY;
+	return &cache->c_mrus[priority][node->cn_hashidx % CACHE_MRU_STRIPES];
+}
+
 struct cache *
 cache_init(
 	int			flags,
@@ -47,7 +63,7 @@ cache_init(
 	struct cache_operations	*cache_operations)
 {
 	struct cache *		cache;
-	unsigned int		i, maxcount;
+	unsigned int		i, j, maxcount;
 
 	maxcount = hashsize * HASH_CACHE_RATIO;
 
@@ -61,8 +77,7 @@ cache_init(
 	cache->c_flags = flags;
 	cache->c_count = 0;
 	cache->c_max = 0;
-	cache->c_hits = 0;
-	cache->c_misses = 0;
+	cache->c_shake_stripe = 0;
 	cache->c_maxcount = maxcount;
 	cache->c_hashsize = hashsize;
 	cache->c_hashshift = libxfs_highbit32(hashsize);
@@ -73,6 +88,11 @@ cache_init(
 	cache->compare = cache_operations->compare;
 	cache->bulkrelse = cache_operations->bulkrelse ?
 		cache_operations->bulkrelse : cache_generic_bulkrelse;
+	cache->report = cache_operations->report;
+	if (cache_operations->dirty && cache_operations->flush_list) {
+		cache->dirty = cache_operations->dirty;
+		cache->flush_list = cache_operations->flush_list;
+	}
 	pthread_mutex_init(&cache->c_mutex, NULL);
 
 	for (i = 0; i < hashsize; i++) {
@@ -82,9 +102,13 @@ cache_init(
 	}
 
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++) {
-		list_head_init(&cache->c_mrus[i].cm_list);
-		cache->c_mrus[i].cm_count = 0;
-		pthread_mutex_init(&cache->c_mrus[i].cm_mutex, NULL);
+		for (j = 0; j < CACHE_MRU_STRIPES; j++) {
+			struct cache_mru	*mru = &cache->c_mrus[i][j];
+
+			list_head_init(&mru->cm_list);
+			mru->cm_count = 0;
+			pthread_mutex_init(&mru->cm_mutex, NULL);
+		}
 	}
 	return cache;
 }
@@ -101,6 +125,21 @@ cache_expand(
 	pthread_mutex_unlock(&cache->c_mutex);
 }
 
+/*
+ * Change the most nodes the cache may hold.  Lowering it frees nothing
+ * straight away; new nodes are refused and the shaker reclaims old ones
+ * until the count is back under it.
+ */
+void
+cache_set_maxcount(
+	struct cache *		cache,
+	unsigned int		maxcount)
+{
+	pthread_mutex_lock(&cache->c_mutex);
+	cache->c_maxcount = maxcount;
+	pthread_mutex_unlock(&cache->c_mutex);
+}
+
 void
 cache_walk(
 	struct cache *		cache,
@@ -147,7 +186,7 @@ void
 cache_destroy(
 	struct cache *		cache)
 {
-	unsigned int		i;
+	unsigned int		i, j;
 
 	cache_destroy_check(cache);
 	for (i = 0; i < cache->c_hashsize; i++) {
@@ -155,8 +194,10 @@ cache_destroy(
 		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
 	}
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++) {
-		list_head_destroy(&cache->c_mrus[i].cm_list);
-		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
+		for (j = 0; j < CACHE_MRU_STRIPES; j++) {
+			list_head_destroy(&cache->c_mrus[i][j].cm_list);
+			pthread_mutex_destroy(&cache->c_mrus[i][j].cm_mutex);
+		}
 	}
 	pthread_mutex_destroy(&cache->c_mutex);
 	free(cache->c_hash);
@@ -182,9 +223,59 @@ cache_generic_bulkrelse(
 	return count;
 }
 
+/*
+ * Take an unreferenced node off its MRU and hash chain and queue it on
+ * @temp for release.  Called with the MRU and node locks held; the node
+ * lock is dropped.  Returns one if the node was removed, zero if its hash
+ * chain was busy.
+ */
+static int
+cache_node_unhash(
+	struct cache		*cache,
+	struct cache_mru	*mru,
+	struct cache_node	*node,
+	struct list_head	*temp)
+{
+	struct cache_hash	*hash;
+
+	hash = cache->c_hash + node->cn_hashidx;
+	if (pthread_mutex_trylock(&hash->ch_mutex) != 0) {
+		pthread_mutex_unlock(&node->cn_mutex);
+		return 0;
+	}
+	ASSERT(node->cn_count == 0);
+	node->cn_priority = -1;
+
+	list_move(&node->cn_mru, temp);
+	list_del_init(&node->cn_hash);
+	hash->ch_count--;
+	mru->cm_count--;
+	pthread_mutex_unlock(&hash->ch_mutex);
+	pthread_mutex_unlock(&node->cn_mutex);
+	return 1;
+}
+
+/*
+ * Release the nodes reclaimed by a shake.
+ */
+static void
+cache_shake_release(
+	struct cache		*cache,
+	struct list_head	*temp,
+	unsigned int		count)
+{
+	if (count == 0)
+		return;
+
+	cache->bulkrelse(cache, temp);
+	atomic_sub(count, &cache->c_count);
+}
+
 /*
  * We've hit the limit on cache size, so we need to start reclaiming
- * nodes we've used. The MRU specified by the priority is shaken.
+ * nodes we've used. The MRU stripes of the specified priority are shaken,
+ * starting from a different stripe each time so that reclaim is spread
+ * evenly across them.
  * Returns new priority at end of the call (in case we call again).
  */
 static unsigned int
@@ -194,98 +285,159 @@ cache_shake(
 	int			all)
 {
 	struct cache_mru	*mru;
-	struct cache_hash *	hash;
 	struct list_head	temp;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	struct cache_node *	node;
 	unsigned int		count;
+	unsigned int		start;
+	unsigned int		i;
 
 	ASSERT(priority <= CACHE_MAX_PRIORITY);
 	if (priority > CACHE_MAX_PRIORITY)
 		priority = 0;
 
-	mru = &cache->c_mrus[priority];
 	count = 0;
 	list_head_init(&temp);
-	head = &mru->cm_list;
 
-	pthread_mutex_lock(&mru->cm_mutex);
-	for (pos = head->prev, n = pos->prev; pos != head;
-						pos = n, n = pos->prev) {
-		node = list_entry(pos, struct cache_node, cn_mru);
+	/* unlocked, this is only a hint of where to start */
+	start = cache->c_shake_stripe++;
+	for (i = 0; i < CACHE_MRU_STRIPES; i++) {
+		mru = &cache->c_mrus[priority][(start + i) % CACHE_MRU_STRIPES];
+		head = &mru->cm_list;
 
-		if (pthread_mutex_trylock(&node->cn_mutex) != 0)
-			continue;
+		pthread_mutex_lock(&mru->cm_mutex);
+		for (pos = head->prev, n = pos->prev; pos != head;
+							pos = n, n = pos->prev) {
+			node = list_entry(pos, struct cache_node, cn_mru);
 
-		hash = cache->c_hash + node->cn_hashidx;
-		if (pthread_mutex_trylock(&hash->ch_mutex) != 0) {
-			pthread_mutex_unlock(&node->cn_mutex);
-			continue;
+			if (pthread_mutex_trylock(&node->cn_mutex) != 0)
+				continue;
+			ASSERT(node->cn_priority == priority);
+
+			if (!cache_node_unhash(cache, mru, node, &temp))
+				continue;
+
+			count++;
+			if (!all && count == CACHE_SHAKE_COUNT)
+				break;
 		}
-		ASSERT(node->cn_count == 0);
-		ASSERT(node->cn_priority == priority);
-		node->cn_priority = -1;
-
-		list_move(&node->cn_mru, &temp);
-		list_del_init(&node->cn_hash);
-		hash->ch_count--;
-		mru->cm_count--;
-		pthread_mutex_unlock(&hash->ch_mutex);
-		pthread_mutex_unlock(&node->cn_mutex);
+		pthread_mutex_unlock(&mru->cm_mutex);
 
-		count++;
 		if (!all && count == CACHE_SHAKE_COUNT)
 			break;
 	}
-	pthread_mutex_unlock(&mru->cm_mutex);
 
-	if (count > 0) {
-		cache->bulkrelse(cache, &temp);
+	cache_shake_release(cache, &temp, count);
+
+	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
+}
+
+/*
+ * Advance the CLOCK hand over each stripe.  Nodes that still carry
+ * reference weight lose some of it and are moved back to the head of their
+ * ring; nodes without any are reclaimed.  Unless @force is set, nodes that
+ * have been read ahead but not yet used (i.e. still at prefetch priority)
+ * are passed over as well.  A stripe is visited at most once per node on
+ * it, so a ring full of hot nodes doesn't spin the hand.
+ * Returns the number of nodes reclaimed.
+ */
+static unsigned int
+cache_clock_shake(
+	struct cache *		cache,
+	int			all,
+	int			force)
+{
+	struct cache_mru	*mru;
+	struct list_head	temp;
+	struct list_head *	head;
+	struct cache_node *	node;
+	unsigned int		count;
+	unsigned int		scan;
+	unsigned int		start;
+	unsigned int		i;
+
+	count = 0;
+	list_head_init(&temp);
+
+	/* unlocked, this is only a hint of where to start */
+	start = cache->c_shake_stripe++;
+	for (i = 0; i < CACHE_MRU_STRIPES; i++) {
+		mru = &cache->c_mrus[CACHE_BASE_PRIORITY]
+				    [(start + i) % CACHE_MRU_STRIPES];
+		head = &mru->cm_list;
+
+		pthread_mutex_lock(&mru->cm_mutex);
+		for (scan = mru->cm_count; scan > 0 && !list_empty(head);
+								scan--) {
+			node = list_entry(head->prev, struct cache_node, cn_mru);
+
+			if (pthread_mutex_trylock(&node->cn_mutex) != 0) {
+				list_move(&node->cn_mru, head);
+				continue;
+			}
+			if (!all && node->cn_weight > 0) {
+				node->cn_weight--;
+				list_move(&node->cn_mru, head);
+				pthread_mutex_unlock(&node->cn_mutex);
+				continue;
+			}
+			if (!all && !force &&
+			    node->cn_priority >= CACHE_PREFETCH_PRIORITY) {
+				list_move(&node->cn_mru, head);
+				pthread_mutex_unlock(&node->cn_mutex);
+				continue;
+			}
+			if (!cache_node_unhash(cache, mru, node, &temp)) {
+				list_move(&node->cn_mru, head);
+				continue;
+			}
 
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= count;
-		pthread_mutex_unlock(&cache->c_mutex);
+			count++;
+			if (!all && count == CACHE_SHAKE_COUNT)
+				break;
+		}
+		pthread_mutex_unlock(&mru->cm_mutex);
+
+		if (!all && count == CACHE_SHAKE_COUNT)
+			break;
 	}
 
-	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
+	cache_shake_release(cache, &temp, count);
+
+	return count;
 }
 
 /*
  * Allocate a new hash node (updating atomic counter in the process),
- * unless doing so will push us over the maximum cache size.
+ * unless doing so will push us over the maximum cache size.  The count
+ * is kept without a lock; a stale view of c_maxcount just sends us to the
+ * shaker a little early, or lets one node in after it has been lowered.
  */
 static struct cache_node *
 cache_node_allocate(
 	struct cache *		cache,
 	cache_key_t		key)
 {
-	unsigned int		nodesfree;
 	struct cache_node *	node;
+	int			count;
 
-	pthread_mutex_lock(&cache->c_mutex);
-	nodesfree = (cache->c_count < cache->c_maxcount);
-	if (nodesfree) {
-		cache->c_count++;
-		if (cache->c_count > cache->c_max)
-			cache->c_max = cache->c_count;
-	}
-	cache->c_misses++;
-	pthread_mutex_unlock(&cache->c_mutex);
-	if (!nodesfree)
+	count = atomic_inc_below(&cache->c_count,
+				 *(volatile unsigned int *)&cache->c_maxcount);
+	if (!count)
 		return NULL;
+	atomic_max(&cache->c_max, count);
 	node = cache->alloc(key);
 	if (node == NULL) {	/* uh-oh */
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
+		atomic_dec(&cache->c_count);
 		return NULL;
 	}
 	pthread_mutex_init(&node->cn_mutex, NULL);
 	list_head_init(&node->cn_mru);
 	node->cn_count = 1;
 	node->cn_priority = 0;
+	node->cn_weight = 0;
 	return node;
 }
 
@@ -293,7 +445,7 @@ int
 cache_overflowed(
 	struct cache *		cache)
 {
-	return cache->c_maxcount == cache->c_max;
+	return cache->c_maxcount <= atomic_read(&cache->c_max);
 }
 
 
@@ -311,7 +463,7 @@ __cache_node_purge(
 		pthread_mutex_unlock(&node->cn_mutex);
 		return count;
 	}
-	mru = &cache->c_mrus[node->cn_priority];
+	mru = cache_node_mru(cache, node);
 	pthread_mutex_lock(&mru->cm_mutex);
 	list_del_init(&node->cn_mru);
 	mru->cm_count--;
@@ -346,6 +498,7 @@ cache_node_get(
 	struct list_head *	n;
 	unsigned int		hashidx;
 	int			priority = 0;
+	int			passes = 0;
 	int			purged = 0;
 
 	hashidx = cache->hash(key, cache->c_hashsize, cache->c_hashshift);
@@ -383,7 +536,7 @@ cache_node_get(
 			if (node->cn_count == 0) {
 				ASSERT(node->cn_priority >= 0);
 				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
+				mru = cache_node_mru(cache, node);
 				pthread_mutex_lock(&mru->cm_mutex);
 				mru->cm_count--;
 				list_del_init(&node->cn_mru);
@@ -391,13 +544,23 @@ cache_node_get(
 			}
 			node->cn_count++;
 
+			/*
+			 * The first lookup of a prefetched buffer is the
+			 * one it was read ahead for, so it doesn't count
+			 * as a reuse, but the prefetch priority tells us
+			 * how likely the buffer is to be revisited.
+			 */
+			if (node->cn_priority >= CACHE_PREFETCH_PRIORITY)
+				node->cn_weight = min(CACHE_CLOCK_MAX_WEIGHT,
+					node->cn_priority -
+						CACHE_PREFETCH_PRIORITY);
+			else if (node->cn_weight < CACHE_CLOCK_MAX_WEIGHT)
+				node->cn_weight++;
+
 			pthread_mutex_unlock(&node->cn_mutex);
+			hash->ch_hits++;
 			pthread_mutex_unlock(&hash->ch_mutex);
 
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
-
 			*nodep = node;
 			return 0;
 next_object:
@@ -410,6 +573,23 @@ next_object:
 		node = cache_node_allocate(cache, key);
 		if (node)
 			break;
+		if (cache->c_flags & CACHE_POLICY_CLOCK) {
+			/*
+			 * Every pass decays the weight of the nodes it finds,
+			 * so if nothing has been reclaimed after enough
+			 * passes to decay the hottest node, only read ahead
+			 * buffers are left; reclaim those, and if that fails
+			 * too all nodes are in use, so grow the cache.
+			 */
+			if (cache_clock_shake(cache, 0,
+					passes > CACHE_CLOCK_MAX_WEIGHT))
+				passes = 0;
+			else if (++passes > CACHE_CLOCK_MAX_WEIGHT + 1) {
+				passes = 0;
+				cache_expand(cache);
+			}
+			continue;
+		}
 		priority = cache_shake(cache, priority, 0);
 		/*
 		 * We start at 0; if we free CACHE_SHAKE_COUNT we get
@@ -427,14 +607,12 @@ next_object:
 	/* add new node to appropriate hash */
 	pthread_mutex_lock(&hash->ch_mutex);
 	hash->ch_count++;
+	hash->ch_misses++;
 	list_add(&node->cn_hash, &hash->ch_list);
 	pthread_mutex_unlock(&hash->ch_mutex);
 
-	if (purged) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= purged;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	if (purged)
+		atomic_sub(purged, &cache->c_count);
 
 	*nodep = node;
 	return 1;
@@ -464,7 +642,7 @@ cache_node_put(
 
 	if (node->cn_count == 0) {
 		/* add unreferenced node to appropriate MRU for shaker */
-		mru = &cache->c_mrus[node->cn_priority];
+		mru = cache_node_mru(cache, node);
 		pthread_mutex_lock(&mru->cm_mutex);
 		mru->cm_count++;
 		list_add(&node->cn_mru, &mru->cm_list);
@@ -536,11 +714,8 @@ cache_node_purge(
 	}
 	pthread_mutex_unlock(&hash->ch_mutex);
 
-	if (count == 0) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	if (count == 0)
+		atomic_dec(&cache->c_count);
 #ifdef CACHE_DEBUG
 	if (count >= 1) {
 		fprintf(stderr, "%s: refcount was %u, not zero (node=%p)\n",
@@ -565,8 +740,12 @@ cache_purge(
 {
 	int			i;
 
-	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
-		cache_shake(cache, i, 1);
+	if (cache->c_flags & CACHE_POLICY_CLOCK) {
+		cache_clock_shake(cache, 1, 1);
+	} else {
+		for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
+			cache_shake(cache, i, 1);
+	}
 
 #ifdef CACHE_DEBUG
 	if (cache->c_count != 0) {
@@ -579,6 +758,70 @@ cache_purge(
 #endif
 }
 
+/*
+ * Collect all the dirty nodes and hand them to the flush_list routine at
+ * once, so that it can write them in disk order and merge neighbours.  The
+ * nodes are referenced while on the list so that they can't be reclaimed
+ * from under it.  If the list can't grow any more the rest of the nodes
+ * are flushed one at a time.
+ */
+static void
+cache_flush_dirty(
+	struct cache *		cache)
+{
+	struct cache_hash *	hash;
+	struct cache_mru *	mru;
+	struct list_head *	head;
+	struct list_head *	pos;
+	struct cache_node *	node;
+	struct cache_node **	nodes = NULL;
+	struct cache_node **	n;
+	unsigned int		nr = 0;
+	unsigned int		size = 0;
+	int			i;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_mutex_lock(&hash->ch_mutex);
+		head = &hash->ch_list;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			node = (struct cache_node *)pos;
+			pthread_mutex_lock(&node->cn_mutex);
+			if (!cache->dirty(node))
+				goto next;
+			if (nr == size) {
+				n = realloc(nodes, (size ? size * 2 : 256) *
+						   sizeof(*nodes));
+				if (!n) {
+					cache->flush(node);
+					goto next;
+				}
+				nodes = n;
+				size = size ? size * 2 : 256;
+			}
+			if (node->cn_count == 0) {
+				mru = cache_node_mru(cache, node);
+				pthread_mutex_lock(&mru->cm_mutex);
+				mru->cm_count--;
+				list_del_init(&node->cn_mru);
+				pthread_mutex_unlock(&mru->cm_mutex);
+			}
+			node->cn_count++;
+			nodes[nr++] = node;
+next:
+			pthread_mutex_unlock(&node->cn_mutex);
+		}
+		pthread_mutex_unlock(&hash->ch_mutex);
+	}
+
+	if (nr)
+		cache->flush_list(cache, nodes, nr);
+	for (i = 0; i < nr; i++)
+		cache_node_put(cache, nodes[i]);
+	free(nodes);
+}
+
 /*
  * Flush all nodes in the cache to disk.
  */
@@ -595,6 +838,11 @@ cache_flush(
 	if (!cache->flush)
 		return;
 
+	if (cache->flush_list) {
+		cache_flush_dirty(cache);
+		return;
+	}
+
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 
@@ -610,6 +858,25 @@ cache_flush(
 	}
 }
 
+/*
+ * Sum up the per-chain lookup statistics.  This doesn't take the chain
+ * locks, so the result is only approximate while the cache is in use.
+ */
+void
+cache_stats(
+	struct cache		*cache,
+	unsigned long long	*hits,
+	unsigned long long	*misses)
+{
+	unsigned int		i;
+
+	*hits = *misses = 0;
+	for (i = 0; i < cache->c_hashsize; i++) {
+		*hits += cache->c_hash[i].ch_hits;
+		*misses += cache->c_hash[i].ch_misses;
+	}
+}
+
 #define	HASH_REPORT	(3 * HASH_CACHE_RATIO)
 void
 cache_report(
@@ -617,11 +884,13 @@ cache_report(
 	const char 		*name,
 	struct cache 		*cache)
 {
-	int 			i;
+	int 			i, j;
 	unsigned long 		count, index, total;
 	unsigned long 		hash_bucket_lengths[HASH_REPORT + 2];
+	unsigned long long	hits, misses;
 
-	if ((cache->c_hits + cache->c_misses) == 0)
+	cache_stats(cache, &hits, &misses);
+	if ((hits + misses) == 0)
 		return;
 
 	/* report cache summary */
@@ -638,16 +907,18 @@ cache_report(
 			cache->c_max,
 			cache->c_count,
 			cache->c_hashsize,
-			cache->c_hits,
-			cache->c_misses,
-			(double)cache->c_hits * 100 /
-				(cache->c_hits + cache->c_misses)
+			hits,
+			misses,
+			(double)hits * 100 / (hits + misses)
 	);
 
-	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
-		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
-			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+	for (i = 0; i <= CACHE_MAX_PRIORITY; i++) {
+		count = 0;
+		for (j = 0; j < CACHE_MRU_STRIPES; j++)
+			count += cache->c_mrus[i][j].cm_count;
+		fprintf(fp, "MRU %d entries = %6lu (%3lu%%)\n",
+			i, count, count * 100 / cache->c_count);
+	}
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
@@ -674,4 +945,7 @@ cache_report(
 		fprintf(fp, "Hash buckets with >%2d entries %6ld (%3ld%%)\n",
 			i - 1, hash_bucket_lengths[i],
 			((cache->c_count - total) * 100) / cache->c_count);
+
+	if (cache->report)
+		cache->report(fp, cache);
 }
@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Benchmark and stress test for the generic cache in cache.c.
+ *
+ * A number of threads look up keys drawn from a sequential, uniform random
+ * or zipf distribution, hold on to a few of the nodes like the tools hold
+ * on to buffers, optionally change their priorities and release them again.
+ * Every node found is checked against the key it was looked up with, and
+ * at the end the cache is purged and every node allocated must have been
+ * released.  cache.c is built for this program with pthread_mutex_lock()
+ * redirected to cachebench_mutex_lock(), which counts how many of the lock
+ * acquisitions found the lock already taken.
+ *
+ * Build it with "make -C libxfs cachebench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "libxfs_priv.h"
+
+#define BENCH_MAGIC	0x43424e44	/* CBND */
+
+enum {
+	DIST_SEQ,
+	DIST_RANDOM,
+	DIST_ZIPF,
+};
+
+struct bench_node {
+	struct cache_node	node;
+	unsigned long		key;
+	unsigned int		magic;
+};
+
+struct bench_thread {
+	pthread_t		tid;
+	int			index;
+	unsigned long long	ops;
+	unsigned long long	bad;		/* wrong node returned */
+	unsigned long long	locks;
+	unsigned long long	contended;
+};
+
+static int		nthreads = 4;
+static unsigned int	hashsize = 1024;
+static unsigned long	nkeys;
+static unsigned long long nops = 1000000;
+static int		dist = DIST_RANDOM;
+static double		zipf_skew = 0.99;
+static int		maxprio = -1;
+static int		nholds = 1;
+static int		cflags;
+
+static struct cache	*cache;
+static double		*zipf_cdf;
+
+static unsigned long long nallocs;
+static unsigned long long nfrees;
+
+static __thread unsigned long long lock_calls;
+static __thread unsigned long long lock_contended;
+
+int
+cachebench_mutex_lock(
+	pthread_mutex_t		*mutex)
+{
+	int			error;
+
+	lock_calls++;
+	error = pthread_mutex_trylock(mutex);
+	if (error == EBUSY) {
+		lock_contended++;
+		error = pthread_mutex_lock(mutex);
+	}
+	return error;
+}
+
+static unsigned int
+bench_hash(
+	cache_key_t		key,
+	unsigned int		hashsize,
+	unsigned int		hashshift)
+{
+	__uint64_t		k = *(unsigned long *)key;
+
+	return ((k * 0x9e3779b97f4a7c15ULL) >> 32) % hashsize;
+}
+
+static struct cache_node *
+bench_alloc(
+	cache_key_t		key)
+{
+	struct bench_node	*bn;
+
+	bn = malloc(sizeof(*bn));
+	if (!bn)
+		return NULL;
+	bn->key = *(unsigned long *)key;
+	bn->magic = BENCH_MAGIC;
+	__sync_fetch_and_add(&nallocs, 1);
+	return &bn->node;
+}
+
+static void
+bench_flush(
+	struct cache_node	*node)
+{
+}
+
+static void
+bench_relse(
+	struct cache_node	*node)
+{
+	struct bench_node	*bn = (struct bench_node *)node;
+
+	bn->magic = 0;
+	free(bn);
+	__sync_fetch_and_add(&nfrees, 1);
+}
+
+static int
+bench_compare(
+	struct cache_node	*node,
+	cache_key_t		key)
+{
+	struct bench_node	*bn = (struct bench_node *)node;
+
+	if (bn->key == *(unsigned long *)key)
+		return CACHE_HIT;
+	return CACHE_MISS;
+}
+
+static struct cache_operations bench_operations = {
+	.hash		= bench_hash,
+	.alloc		= bench_alloc,
+	.flush		= bench_flush,
+	.relse		= bench_relse,
+	.compare	= bench_compare,
+};
+
+/* xorshift64*, good enough for picking keys */
+static inline __uint64_t
+bench_random(
+	__uint64_t		*state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+zipf_init(void)
+{
+	unsigned long		i;
+	double			sum = 0;
+
+	zipf_cdf = malloc(nkeys * sizeof(double));
+	if (!zipf_cdf) {
+		fprintf(stderr, "cachebench: can't allocate zipf table\n");
+		exit(1);
+	}
+	for (i = 0; i < nkeys; i++) {
+		sum += 1.0 / pow(i + 1, zipf_skew);
+		zipf_cdf[i] = sum;
+	}
+	for (i = 0; i < nkeys; i++)
+		zipf_cdf[i] /= sum;
+}
+
+static unsigned long
+zipf_key(
+	__uint64_t		*state)
+{
+	double			u;
+	unsigned long		lo = 0;
+	unsigned long		hi = nkeys - 1;
+	unsigned long		mid;
+
+	u = (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* spread the hot keys out rather than having them all adjacent */
+	return (lo * 0x9e3779b97f4a7c15ULL) % nkeys;
+}
+
+static void *
+bench_thread(
+	void			*arg)
+{
+	struct bench_thread	*bt = arg;
+	struct cache_node	**held;
+	struct bench_node	*bn;
+	unsigned long long	i;
+	unsigned long		key;
+	__uint64_t		state;
+	int			slot = 0;
+
+	held = calloc(nholds, sizeof(*held));
+	if (!held) {
+		fprintf(stderr, "cachebench: can't allocate hold list\n");
+		exit(1);
+	}
+	state = 0x853c49e6748fea9bULL * (bt->index + 1);
+	key = (nkeys / nthreads) * bt->index;
+
+	for (i = 0; i < nops; i++) {
+		switch (dist) {
+		case DIST_SEQ:
+			key = (key + 1) % nkeys;
+			break;
+		case DIST_RANDOM:
+			key = bench_random(&state) % nkeys;
+			break;
+		case DIST_ZIPF:
+			key = zipf_key(&state);
+			break;
+		}
+
+		if (held[slot])
+			cache_node_put(cache, held[slot]);
+		cache_node_get(cache, &key, &held[slot]);
+		bn = (struct bench_node *)held[slot];
+		if (!bn || bn->magic != BENCH_MAGIC || bn->key != key) {
+			bt->bad++;
+			held[slot] = NULL;
+			continue;
+		}
+		if (maxprio >= 0)
+			cache_node_set_priority(cache, held[slot],
+					bench_random(&state) % (maxprio + 1));
+		slot = (slot + 1) % nholds;
+	}
+
+	for (slot = 0; slot < nholds; slot++)
+		if (held[slot])
+			cache_node_put(cache, held[slot]);
+	free(held);
+
+	bt->ops = nops;
+	bt->locks = lock_calls;
+	bt->contended = lock_contended;
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: cachebench [-c] [-t threads] [-H hashsize] [-k keys] [-n ops]\n"
+"                  [-d seq|random|zipf] [-z skew] [-p maxprio] [-r holds]\n"
+"\n"
+"	-c	use the CLOCK replacement policy\n"
+"	-t	number of threads (4)\n"
+"	-H	hash table size, the cache holds %d nodes per bucket (1024)\n"
+"	-k	number of distinct keys (4 times the cache size)\n"
+"	-n	lookups per thread (1000000)\n"
+"	-d	key distribution (random)\n"
+"	-z	zipf exponent (0.99)\n"
+"	-p	set a random priority up to maxprio on every lookup\n"
+"	-r	nodes each thread keeps referenced (1)\n",
+		HASH_CACHE_RATIO);
+	exit(1);
+}
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	struct bench_thread	*threads;
+	struct timeval		start;
+	struct timeval		end;
+	unsigned long long	ops = 0;
+	unsigned long long	bad = 0;
+	unsigned long long	locks = 0;
+	unsigned long long	contended = 0;
+	unsigned long long	hits;
+	unsigned long long	misses;
+	unsigned int		maxnodes;
+	double			secs;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "cd:H:k:n:p:r:t:z:")) != EOF) {
+		switch (c) {
+		case 'c':
+			cflags |= CACHE_POLICY_CLOCK;
+			break;
+		case 'd':
+			if (!strcmp(optarg, "seq"))
+				dist = DIST_SEQ;
+			else if (!strcmp(optarg, "random"))
+				dist = DIST_RANDOM;
+			else if (!strcmp(optarg, "zipf"))
+				dist = DIST_ZIPF;
+			else
+				usage();
+			break;
+		case 'H':
+			hashsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			nkeys = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nops = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			maxprio = atoi(optarg);
+			break;
+		case 'r':
+			nholds = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'z':
+			zipf_skew = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || nthreads <= 0 || nholds <= 0 || hashsize == 0 ||
+	    maxprio > CACHE_MAX_PRIORITY)
+		usage();
+	if (!nkeys)
+		nkeys = 4UL * hashsize * HASH_CACHE_RATIO;
+	if (dist == DIST_ZIPF)
+		zipf_init();
+
+	cache = cache_init(cflags, hashsize, &bench_operations);
+	if (!cache) {
+		fprintf(stderr, "cachebench: can't create cache\n");
+		return 1;
+	}
+	maxnodes = cache->c_maxcount;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "cachebench: can't allocate threads\n");
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++) {
+		threads[i].index = i;
+		if (pthread_create(&threads[i].tid, NULL, bench_thread,
+				   &threads[i])) {
+			fprintf(stderr, "cachebench: can't create thread: %s\n",
+				strerror(errno));
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+		bad += threads[i].bad;
+		locks += threads[i].locks;
+		contended += threads[i].contended;
+	}
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	cache_stats(cache, &hits, &misses);
+	printf("threads %d, keys %lu, cache %u nodes (%u max used), %s policy\n",
+		nthreads, nkeys, maxnodes, cache->c_max,
+		(cflags & CACHE_POLICY_CLOCK) ? "clock" : "mru");
+	printf("lookups %llu in %.3f s, %.0f ops/s, %.0f ops/s/thread\n",
+		ops, secs, ops / secs, ops / secs / nthreads);
+	printf("hits %llu, misses %llu, hit rate %.2f%%\n",
+		hits, misses, hits + misses ? hits * 100.0 / (hits + misses) : 0);
+	printf("locks %llu, contended %llu (%.2f%%)\n",
+		locks, contended, locks ? contended * 100.0 / locks : 0);
+
+	cache_purge(cache);
+	if (bad || nallocs != nfrees) {
+		printf("FAILED: %llu bad lookups, %llu nodes allocated, "
+			"%llu released\n", bad, nallocs, nfrees);
+		return 1;
+	}
+	cache_destroy(cache);
+	return 0;
+}
@@ -30,7 +30,9 @@
  * lifted from the 3.8-rc2 kernel source for xfsprogs. Killed CONFIG_X86
  * specific bits for just the generic algorithm. Also removed the big endian
  * version of the algorithm as XFS only uses the little endian CRC version to
- * match the hardware acceleration available on Intel CPUs.
+ * match the hardware acceleration available on Intel CPUs.  crc32c uses
+ * that acceleration (and the ARMv8 equivalent) when the CPU has it, see
+ * crc32c_select().
  */
 
 #include "platform_defs.h"
@@ -180,7 +182,7 @@ u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, NULL, CRCPOLY_LE);
 }
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+static u32 __pure crc32c_le_sw(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, NULL, CRC32C_POLY_LE);
 }
@@ -190,13 +192,375 @@ u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
 	return crc32_le_generic(crc, p, len,
 			(const u32 (*)[256])crc32table_le, CRCPOLY_LE);
 }
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+static u32 __pure crc32c_le_sw(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len,
 			(const u32 (*)[256])crc32ctable_le, CRC32C_POLY_LE);
 }
 #endif
 
+/*
+ * Hardware crc32c.  Both x86 (SSE4.2) and ARMv8 have an instruction that
+ * folds 8 bytes at a time into a crc32c, which is all XFS needs.  The
+ * instruction has a latency of three cycles but can issue every cycle, so
+ * large buffers are split into three streams that are crc'd in parallel,
+ * and the three crcs are then combined by shifting the first two over the
+ * length of the streams that follow them.
+ *
+ * Shifting a crc over n bytes is a multiplication by x^(8n) modulo the crc
+ * polynomial.  With PCLMULQDQ that's a carryless multiply by a precomputed
+ * x^(8n - 33), followed by a crc32 of the 64 bit product, which reduces it
+ * and supplies the remaining x^33.  Without a carryless multiply we just
+ * use a single stream.
+ *
+ * The implementation is picked on the first call, based on what the CPU we
+ * are running on supports, falling back to the table driven code above.
+ */
+#define CRC32C_LONG	1024	/* bytes per stream for large buffers */
+#define CRC32C_SHORT	128	/* and for medium ones */
+
+typedef u32 (*crc32c_fn)(u32 crc, unsigned char const *p, size_t len);
+typedef void (*crc32c_multi_fn)(u32 *crc, unsigned char const * const *bufs,
+		unsigned int nr, size_t offset, size_t len);
+
+/* x^n modulo the crc32c polynomial, bit reflected */
+static u32
+crc32c_xpow(
+	unsigned int	n)
+{
+	u32		v = 0x80000000;		/* x^0 */
+
+	while (n--)
+		v = (v >> 1) ^ ((v & 1) ? CRC32C_POLY_LE : 0);
+	return v;
+}
+
+static inline uint64_t
+crc32c_load64(
+	unsigned char const *p)
+{
+	uint64_t	v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+#define CRC32C_HW_X86		1
+
+/* shift constants for the two preceding streams, indexed by stream */
+static u32 crc32c_long_k[2];
+static u32 crc32c_short_k[2];
+
+static __attribute__((target("sse4.2"))) u32
+crc32c_sse42(
+	u32		crc,
+	unsigned char const *p,
+	size_t		len)
+{
+	uint64_t	c = crc;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		c = _mm_crc32_u8(c, *p++);
+	for (; len >= 8; len -= 8, p += 8)
+		c = _mm_crc32_u64(c, crc32c_load64(p));
+	for (; len; len--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+
+static inline __attribute__((target("sse4.2,pclmul"))) uint64_t
+crc32c_shift_clmul(
+	uint64_t	crc,
+	u32		k)
+{
+	__m128i		v;
+
+	v = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				 _mm_cvtsi32_si128(k), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(v));
+}
+
+static __attribute__((target("sse4.2,pclmul"))) u32
+crc32c_pclmul(
+	u32		crc,
+	unsigned char const *p,
+	size_t		len)
+{
+	uint64_t	c0 = crc, c1, c2;
+	unsigned char const *end;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		c0 = _mm_crc32_u8(c0, *p++);
+
+	for (; len >= 3 * CRC32C_LONG; len -= 3 * CRC32C_LONG) {
+		c1 = c2 = 0;
+		for (end = p + CRC32C_LONG; p < end; p += 8) {
+			c0 = _mm_crc32_u64(c0, crc32c_load64(p));
+			c1 = _mm_crc32_u64(c1, crc32c_load64(p + CRC32C_LONG));
+			c2 = _mm_crc32_u64(c2,
+					crc32c_load64(p + 2 * CRC32C_LONG));
+		}
+		c0 = crc32c_shift_clmul(c0, crc32c_long_k[0]) ^
+		     crc32c_shift_clmul(c1, crc32c_long_k[1]) ^ c2;
+		p += 2 * CRC32C_LONG;
+	}
+
+	for (; len >= 3 * CRC32C_SHORT; len -= 3 * CRC32C_SHORT) {
+		c1 = c2 = 0;
+		for (end = p + CRC32C_SHORT; p < end; p += 8) {
+			c0 = _mm_crc32_u64(c0, crc32c_load64(p));
+			c1 = _mm_crc32_u64(c1, crc32c_load64(p + CRC32C_SHORT));
+			c2 = _mm_crc32_u64(c2,
+					crc32c_load64(p + 2 * CRC32C_SHORT));
+		}
+		c0 = crc32c_shift_clmul(c0, crc32c_short_k[0]) ^
+		     crc32c_shift_clmul(c1, crc32c_short_k[1]) ^ c2;
+		p += 2 * CRC32C_SHORT;
+	}
+
+	for (; len >= 8; len -= 8, p += 8)
+		c0 = _mm_crc32_u64(c0, crc32c_load64(p));
+	for (; len; len--)
+		c0 = _mm_crc32_u8(c0, *p++);
+	return c0;
+}
+
+/*
+ * Independent buffers don't need combining, so feed three of them through
+ * the crc32 unit side by side.
+ */
+static __attribute__((target("sse4.2"))) void
+crc32c_multi_sse42(
+	u32		*crc,
+	unsigned char const * const *bufs,
+	unsigned int	nr,
+	size_t		offset,
+	size_t		len)
+{
+	unsigned char const *p0, *p1, *p2;
+	uint64_t	c0, c1, c2;
+	unsigned int	i;
+	size_t		n;
+
+	for (i = 0; i + 3 <= nr; i += 3) {
+		p0 = bufs[i] + offset;
+		p1 = bufs[i + 1] + offset;
+		p2 = bufs[i + 2] + offset;
+		c0 = crc[i];
+		c1 = crc[i + 1];
+		c2 = crc[i + 2];
+		for (n = len; n >= 8; n -= 8) {
+			c0 = _mm_crc32_u64(c0, crc32c_load64(p0));
+			c1 = _mm_crc32_u64(c1, crc32c_load64(p1));
+			c2 = _mm_crc32_u64(c2, crc32c_load64(p2));
+			p0 += 8;
+			p1 += 8;
+			p2 += 8;
+		}
+		for (; n; n--) {
+			c0 = _mm_crc32_u8(c0, *p0++);
+			c1 = _mm_crc32_u8(c1, *p1++);
+			c2 = _mm_crc32_u8(c2, *p2++);
+		}
+		crc[i] = c0;
+		crc[i + 1] = c1;
+		crc[i + 2] = c2;
+	}
+	for (; i < nr; i++)
+		crc[i] = crc32c_sse42(crc[i], bufs[i] + offset, len);
+}
+
+static int
+crc32c_have_sse42(void)
+{
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_SSE4_2) != 0;
+}
+
+static int
+crc32c_have_pclmul(void)
+{
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_SSE4_2) && (ecx & bit_PCLMUL);
+}
+
+static void
+crc32c_pclmul_init(void)
+{
+	crc32c_long_k[0] = crc32c_xpow(2 * 8 * CRC32C_LONG - 33);
+	crc32c_long_k[1] = crc32c_xpow(8 * CRC32C_LONG - 33);
+	crc32c_short_k[0] = crc32c_xpow(2 * 8 * CRC32C_SHORT - 33);
+	crc32c_short_k[1] = crc32c_xpow(8 * CRC32C_SHORT - 33);
+}
+#endif /* __x86_64__ */
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#include <sys/auxv.h>
+
+#define CRC32C_HW_ARM64		1
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32		(1 << 7)
+#endif
+
+/* use inline asm so that we don't need -march=armv8-a+crc for the file */
+static inline u32
+crc32c_arm64_u64(
+	u32		crc,
+	uint64_t	v)
+{
+	__asm__(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1"
+		: "+r" (crc) : "r" (v));
+	return crc;
+}
+
+static inline u32
+crc32c_arm64_u8(
+	u32		crc,
+	u8		v)
+{
+	__asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1"
+		: "+r" (crc) : "r" (v));
+	return crc;
+}
+
+static u32
+crc32c_arm64(
+	u32		crc,
+	unsigned char const *p,
+	size_t		len)
+{
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = crc32c_arm64_u8(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8)
+		crc = crc32c_arm64_u64(crc, crc32c_load64(p));
+	for (; len; len--)
+		crc = crc32c_arm64_u8(crc, *p++);
+	return crc;
+}
+
+static int
+crc32c_have_arm64(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif /* __aarch64__ */
+
+static void crc32c_multi_generic(u32 *crc, unsigned char const * const *bufs,
+		unsigned int nr, size_t offset, size_t len);
+
+static void
+crc32c_select(
+	crc32c_fn	*fn,
+	crc32c_multi_fn	*multi)
+{
+	*multi = crc32c_multi_generic;
+#ifdef CRC32C_HW_X86
+	if (crc32c_have_pclmul()) {
+		crc32c_pclmul_init();
+		*fn = crc32c_pclmul;
+		*multi = crc32c_multi_sse42;
+		return;
+	}
+	if (crc32c_have_sse42()) {
+		*fn = crc32c_sse42;
+		*multi = crc32c_multi_sse42;
+		return;
+	}
+#endif
+#ifdef CRC32C_HW_ARM64
+	if (crc32c_have_arm64()) {
+		*fn = crc32c_arm64;
+		return;
+	}
+#endif
+	*fn = crc32c_le_sw;
+}
+
+static u32 crc32c_le_init(u32 crc, unsigned char const *p, size_t len);
+static void crc32c_multi_init(u32 *crc, unsigned char const * const *bufs,
+		unsigned int nr, size_t offset, size_t len);
+static crc32c_fn crc32c_le_impl = crc32c_le_init;
+static crc32c_multi_fn crc32c_multi_impl = crc32c_multi_init;
+
+/*
+ * Racing threads all pick the same implementation, so it doesn't matter who
+ * gets to set the pointers, as long as the shift constants are visible first.
+ */
+static void
+crc32c_init(void)
+{
+	crc32c_fn	fn;
+	crc32c_multi_fn	multi;
+
+	crc32c_select(&fn, &multi);
+	__sync_synchronize();
+	crc32c_le_impl = fn;
+	crc32c_multi_impl = multi;
+}
+
+static u32
+crc32c_le_init(
+	u32		crc,
+	unsigned char const *p,
+	size_t		len)
+{
+	crc32c_init();
+	return crc32c_le_impl(crc, p, len);
+}
+
+static void
+crc32c_multi_init(
+	u32		*crc,
+	unsigned char const * const *bufs,
+	unsigned int	nr,
+	size_t		offset,
+	size_t		len)
+{
+	crc32c_init();
+	crc32c_multi_impl(crc, bufs, nr, offset, len);
+}
+
+static void
+crc32c_multi_generic(
+	u32		*crc,
+	unsigned char const * const *bufs,
+	unsigned int	nr,
+	size_t		offset,
+	size_t		len)
+{
+	unsigned int	i;
+
+	for (i = 0; i < nr; i++)
+		crc[i] = crc32c_le_impl(crc[i], bufs[i] + offset, len);
+}
+
+u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32c_le_impl(crc, p, len);
+}
+
+/*
+ * crc[i] = crc32c_le(crc[i], bufs[i] + offset, len) for nr independent
+ * buffers, interleaved where the hardware can overlap them.
+ */
+void crc32c_le_multi(u32 *crc, unsigned char const * const *bufs,
+		unsigned int nr, size_t offset, size_t len)
+{
+	crc32c_multi_impl(crc, bufs, nr, offset, len);
+}
+
 
 #ifdef CRC32_SELFTEST
 
@@ -929,13 +1293,33 @@ static struct crc_test {
 	 0x9dc0bb48},
 };
 
-static int crc32c_test(void)
+/* all the crc32c implementations this machine can run */
+static struct crc32c_impl {
+	const char	*name;
+	crc32c_fn	fn;
+	int		(*usable)(void);
+	void		(*init)(void);
+} crc32c_impls[] = {
+	{ "table", crc32c_le_sw, NULL, NULL },
+#ifdef CRC32C_HW_X86
+	{ "sse4.2", crc32c_sse42, crc32c_have_sse42, NULL },
+	{ "pclmul", crc32c_pclmul, crc32c_have_pclmul, crc32c_pclmul_init },
+#endif
+#ifdef CRC32C_HW_ARM64
+	{ "arm64", crc32c_arm64, crc32c_have_arm64, NULL },
+#endif
+};
+#define NR_CRC32C_IMPLS	(sizeof(crc32c_impls) / sizeof(crc32c_impls[0]))
+
+static int crc32c_test_one(struct crc32c_impl *impl)
 {
 	int i;
 	int errors = 0;
 	int bytes = 0;
 	struct timeval start, stop;
 	uint64_t usec;
+	static u8 buf[3 * CRC32C_LONG + 3 * CRC32C_SHORT + 64];
+	size_t len, off;
 
 	/* keep static to prevent cache warming code from
 	 * getting eliminated by the compiler */
@@ -945,13 +1329,13 @@ static int crc32c_test(void)
 	for (i = 0; i < 100; i++) {
 		bytes += 2*test[i].length;
 
-		crc ^= crc32c_le(test[i].crc, test_buf +
+		crc ^= impl->fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length);
 	}
 
 	gettimeofday(&start, NULL);
 	for (i = 0; i < 100; i++) {
-		if (test[i].crc32c_le != crc32c_le(test[i].crc, test_buf +
+		if (test[i].crc32c_le != impl->fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length))
 			errors++;
 	}
@@ -960,16 +1344,142 @@ static int crc32c_test(void)
 	usec = stop.tv_usec - start.tv_usec +
 		1000000 * (stop.tv_sec - start.tv_sec);
 
+	/*
+	 * The test vectors are all shorter than the three way split for large
+	 * buffers, so also compare against the table code for every length
+	 * and alignment that goes down a different path.
+	 */
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = test_buf[i % sizeof(test_buf)] ^ (i >> 8);
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len <= sizeof(buf) - 8; len++) {
+			if (impl->fn(~0U, buf + off, len) !=
+			    crc32c_le_sw(~0U, buf + off, len))
+				errors++;
+		}
+	}
+
 	if (errors)
-		printf("crc32c: %d self tests failed\n", errors);
+		printf("crc32c %s: %d self tests failed\n", impl->name, errors);
 	else {
-		printf("crc32c: tests passed, %d bytes in %" PRIu64 " usec\n",
-			bytes, usec);
+		printf("crc32c %s: tests passed, %d bytes in %" PRIu64 " usec\n",
+			impl->name, bytes, usec);
 	}
 
 	return errors;
 }
 
+/* the batch interface, for every count that leaves a different remainder */
+static int crc32c_multi_test(void)
+{
+	unsigned char const *bufs[7];
+	u32 crc[7];
+	int i, n, j;
+	int errors = 0;
+
+	for (j = 0; j < 100; j += 7) {
+		for (n = 1; n <= 7; n++) {
+			for (i = 0; i < n; i++) {
+				bufs[i] = test_buf + test[(j + i) % 100].start;
+				crc[i] = test[(j + i) % 100].crc;
+			}
+			crc32c_le_multi(crc, bufs, n, 3, test[j].length - 3);
+			for (i = 0; i < n; i++) {
+				if (crc[i] != crc32c_le_sw(
+						test[(j + i) % 100].crc,
+						bufs[i] + 3, test[j].length - 3))
+					errors++;
+			}
+		}
+	}
+	if (errors)
+		printf("crc32c multi: %d self tests failed\n", errors);
+	else
+		printf("crc32c multi: tests passed\n");
+	return errors;
+}
+
+static int crc32c_test(void)
+{
+	int i;
+	int errors = 0;
+
+	for (i = 0; i < NR_CRC32C_IMPLS; i++) {
+		if (crc32c_impls[i].usable && !crc32c_impls[i].usable())
+			continue;
+		if (crc32c_impls[i].init)
+			crc32c_impls[i].init();
+		errors += crc32c_test_one(&crc32c_impls[i]);
+	}
+
+	/* and whatever the dispatcher picks */
+	for (i = 0; i < 100; i++) {
+		if (test[i].crc32c_le != crc32c_le(test[i].crc, test_buf +
+		    test[i].start, test[i].length))
+			errors++;
+	}
+	errors += crc32c_multi_test();
+	if (errors)
+		printf("crc32c: %d self tests failed\n", errors);
+
+	return errors;
+}
+
+/*
+ * Throughput of each crc32c implementation over the buffer sizes XFS
+ * checksums most: inodes, directory and btree blocks, and large blocks.
+ */
+static void crc32c_bench(void)
+{
+	static const size_t sizes[] = { 512, 4096, 65536 };
+	const size_t total = 256 << 20;
+	struct timeval start, stop;
+	uint64_t usec;
+	static u32 crc;
+	static u32 crcs[8];
+	unsigned char const *bufs[8];
+	u8 *buf;
+	size_t i, j, n;
+
+	buf = malloc(sizes[2]);
+	if (!buf)
+		return;
+	for (i = 0; i < sizes[2]; i++)
+		buf[i] = test_buf[i % sizeof(test_buf)] ^ (i >> 12);
+
+	for (i = 0; i < NR_CRC32C_IMPLS; i++) {
+		if (crc32c_impls[i].usable && !crc32c_impls[i].usable())
+			continue;
+		if (crc32c_impls[i].init)
+			crc32c_impls[i].init();
+		printf("crc32c %-8s", crc32c_impls[i].name);
+		for (j = 0; j < 3; j++) {
+			gettimeofday(&start, NULL);
+			for (n = 0; n < total / sizes[j]; n++)
+				crc ^= crc32c_impls[i].fn(crc, buf, sizes[j]);
+			gettimeofday(&stop, NULL);
+			usec = stop.tv_usec - start.tv_usec +
+				1000000 * (stop.tv_sec - start.tv_sec);
+			printf("  %6zu: %7.1f MB/s", sizes[j],
+				usec ? (double)total / usec : 0.0);
+		}
+		printf("\n");
+	}
+
+	/* eight independent inodes at a time */
+	for (j = 0; j < 8; j++)
+		bufs[j] = buf + j * 512;
+	gettimeofday(&start, NULL);
+	for (n = 0; n < total / (8 * 512); n++)
+		crc32c_le_multi(crcs, bufs, 8, 0, 512);
+	gettimeofday(&stop, NULL);
+	usec = stop.tv_usec - start.tv_usec +
+		1000000 * (stop.tv_sec - start.tv_sec);
+	printf("crc32c multi    8x512: %7.1f MB/s\n",
+		usec ? (double)total / usec : 0.0);
+	free(buf);
+}
+
 static int crc32_test(void)
 {
 	int i;
@@ -1035,6 +1545,10 @@ int main(int argc, char **argv)
 	errors = crc32_test();
 	errors += crc32c_test();
 
+	/* "crc32selftest -b" also measures the crc32c throughput */
+	if (!errors && argc > 1 && !strcmp(argv[1], "-b"))
+		crc32c_bench();
+
 	return errors != 0;
 }
 #endif /* CRC32_SELFTEST */
@@ -105,6 +105,18 @@ platform_flush_device(int fd, dev_t device)
 	return;
 }
 
+int
+platform_zero_range(int fd, long long start, long long len)
+{
+	return EOPNOTSUPP;
+}
+
+int
+platform_preallocate(int fd, long long start, long long len)
+{
+	return EOPNOTSUPP;
+}
+
 void
 platform_findsizes(char *path, int fd, long long *sz, int *bsz)
 {
@@ -199,3 +211,31 @@ platform_physmem(void)
 	}
 	return physmem >> 10;
 }
+
+int
+platform_numa_nodes(void)
+{
+	return 1;
+}
+
+int
+platform_numa_node(void)
+{
+	return 0;
+}
+
+int
+platform_numa_bind(
+	int		node)
+{
+	return 0;
+}
+
+int
+platform_device_topology(
+	int		fd,
+	int		*rotational,
+	int		*ndevs)
+{
+	return -1;
+}
@@ -17,9 +17,11 @@
  */
 
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include "init.h"
 
 #include "libxfs_priv.h"
+#include "mdump.h"
 #include "xfs_fs.h"
 #include "xfs_shared.h"
 #include "xfs_format.h"
@@ -37,6 +39,8 @@ char *progname = "libxfs";	/* default, changed by each tool */
 
 struct cache *libxfs_bcache;	/* global buffer cache */
 int libxfs_bhash_size;		/* #buckets in bcache */
+struct cache *libxfs_icache;	/* global inode cache */
+int libxfs_ihash_size;		/* #buckets in icache */
 
 int	use_xfs_buf_lock;	/* global flag: use xfs_buf_t locks for MT */
 
@@ -45,13 +49,15 @@ static void manage_zones(int);	/* setup global zones */
 kmem_zone_t	*xfs_inode_zone;
 
 /*
- * dev_map - map open devices to fd.
+ * dev_map - map open devices to fd, and to the metadump behind it if the
+ * "device" is really a version 2 metadump.
  */
 #define MAX_DEVS 10	/* arbitary maximum */
 int nextfakedev = -1;	/* device number to give to next fake device */
 static struct dev_to_fd {
-	dev_t	dev;
-	int	fd;
+	dev_t		dev;
+	int		fd;
+	struct mdump	*md;
 } dev_map[MAX_DEVS]={{0}};
 
 /*
@@ -95,6 +101,66 @@ libxfs_device_to_fd(dev_t device)
 	/* NOTREACHED */
 }
 
+static struct mdump *
+fd_to_mdump(int fd)
+{
+	int	d;
+
+	for (d = 0; d < MAX_DEVS; d++)
+		if (dev_map[d].dev && dev_map[d].fd == fd)
+			return dev_map[d].md;
+	return NULL;
+}
+
+/* libxfs_device_is_metadump:
+ *     is the device a metadump opened in place of the filesystem?
+ */
+int
+libxfs_device_is_metadump(dev_t device)
+{
+	return fd_to_mdump(libxfs_device_to_fd(device)) != NULL;
+}
+
+/* libxfs_device_pread:
+ *     pread64 from an open device, which reads the blocks out of the
+ *     metadump if there is one behind it
+ */
+ssize_t
+libxfs_device_pread(int fd, void *buf, size_t len, off64_t offset)
+{
+	struct mdump	*md = fd_to_mdump(fd);
+
+	if (md)
+		return mdump_pread(md, buf, len, offset);
+	return pread64(fd, buf, len, offset);
+}
+
+static void
+dev_map_add(dev_t dev, int fd, struct mdump *md)
+{
+	int	d;
+
+	for (d = 0; d < MAX_DEVS; d++)
+		if (dev_map[d].dev == dev) {
+			fprintf(stderr, _("%s: device %lld is already open\n"),
+			    progname, (long long)dev);
+			exit(1);
+		}
+
+	for (d = 0; d < MAX_DEVS; d++)
+		if (!dev_map[d].dev) {
+			dev_map[d].dev = dev;
+			dev_map[d].fd = fd;
+			dev_map[d].md = md;
+			return;
+		}
+
+	fprintf(stderr, _("%s: %s: too many open devices\n"),
+		progname, __FUNCTION__);
+	exit(1);
+	/* NOTREACHED */
+}
+
 /* libxfs_device_open:
  *     open a device and return its device number
  */
@@ -102,9 +168,10 @@ dev_t
 libxfs_device_open(char *path, int creat, int xflags, int setblksize)
 {
 	dev_t		dev;
-	int		fd, d, flags;
+	int		fd, flags;
 	int		readonly, dio, excl;
 	struct stat64	statb;
+	struct mdump	*md = NULL;
 
 	readonly = (xflags & LIBXFS_ISREADONLY);
 	excl = (xflags & LIBXFS_EXCLUSIVELY) && !creat;
@@ -130,6 +197,16 @@ retry:
 		exit(1);
 	}
 
+	if (!creat && (statb.st_mode & S_IFMT) == S_IFREG) {
+		md = mdump_open(fd, path);
+		if (md && !readonly) {
+			fprintf(stderr,
+		_("%s: %s is a metadump, it can only be opened read-only\n"),
+				progname, path);
+			exit(1);
+		}
+	}
+
 	if (!readonly && setblksize && (statb.st_mode & S_IFMT) == S_IFBLK) {
 		if (setblksize == 1)
 			/* use the default blocksize */
@@ -147,26 +224,40 @@ retry:
 	 * choose a new fake device number.
 	 */
 	dev = (statb.st_rdev) ? (statb.st_rdev) : (nextfakedev--);
+	dev_map_add(dev, fd, md);
+	return dev;
+}
 
-	for (d = 0; d < MAX_DEVS; d++)
-		if (dev_map[d].dev == dev) {
-			fprintf(stderr, _("%s: device %lld is already open\n"),
-			    progname, (long long)dev);
-			exit(1);
-		}
-
-	for (d = 0; d < MAX_DEVS; d++)
-		if (!dev_map[d].dev) {
-			dev_map[d].dev = dev;
-			dev_map[d].fd = fd;
-
-			return dev;
-		}
+/* libxfs_device_open_mem:
+ *     make a device of size bytes that lives in memory and return its
+ *     device number, for scratch structures built with the libxfs code.
+ *     It reads as zeroes until written.
+ */
+dev_t
+libxfs_device_open_mem(const char *name, off64_t size)
+{
+	char		path[] = "/dev/shm/libxfs.XXXXXX";
+	dev_t		dev;
+	int		fd = -1;
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, name, 0);
+#endif
+	if (fd < 0) {
+		/* no memfd, make do with an unlinked file in tmpfs */
+		fd = mkstemp(path);
+		if (fd >= 0)
+			unlink(path);
+	}
+	if (fd < 0 || ftruncate64(fd, size) < 0) {
+		fprintf(stderr, _("%s: cannot create memory device %s: %s\n"),
+			progname, name, strerror(errno));
+		exit(1);
+	}
 
-	fprintf(stderr, _("%s: %s: too many open devices\n"),
-		progname, __FUNCTION__);
-	exit(1);
-	/* NOTREACHED */
+	dev = nextfakedev--;
+	dev_map_add(dev, fd, NULL);
+	return dev;
 }
 
 void
@@ -179,7 +270,10 @@ libxfs_device_close(dev_t dev)
 			int	fd;
 
 			fd = dev_map[d].fd;
+			if (dev_map[d].md)
+				mdump_close(dev_map[d].md);
 			dev_map[d].dev = dev_map[d].fd = 0;
+			dev_map[d].md = NULL;
 
 			fsync(fd);
 			platform_flush_device(fd, dev);
@@ -262,6 +356,7 @@ libxfs_init(libxfs_init_t *a)
 	flags = (a->isreadonly | a->isdirect);
 
 	radix_tree_init();
+	libxfs_iostats_init();
 
 	if (a->volname) {
 		if(!check_open(a->volname,flags,&rawfile,&blockfile))
@@ -286,6 +381,9 @@ libxfs_init(libxfs_init_t *a)
 			a->dfd = libxfs_device_to_fd(a->ddev);
 			platform_findsizes(rawfile, a->dfd,
 						&a->dsize, &a->dbsize);
+			if (fd_to_mdump(a->dfd))
+				a->dsize = mdump_size(fd_to_mdump(a->dfd)) >>
+						BBSHIFT;
 		}
 		needcd = 1;
 	} else
@@ -349,7 +447,12 @@ libxfs_init(libxfs_init_t *a)
 		libxfs_bhash_size = LIBXFS_BHASHSIZE(sbp);
 	libxfs_bcache = cache_init(a->bcache_flags, libxfs_bhash_size,
 				   &libxfs_bcache_operations);
+	if (libxfs_ihash_size)
+		libxfs_icache = cache_init(a->icache_flags, libxfs_ihash_size,
+					   &libxfs_icache_operations);
 	use_xfs_buf_lock = a->usebuflock;
+	if (flags & LIBXFS_ISREADONLY)
+		libxfs_vcache_init(a->ddev, a->dsize);
 	manage_zones(0);
 	rval = 1;
 done:
@@ -388,14 +491,15 @@ manage_zones(int release)
 	extern void		xfs_dir_startup();
 
 	if (release) {	/* free zone allocation */
-		kmem_free(xfs_buf_zone);
-		kmem_free(xfs_inode_zone);
-		kmem_free(xfs_ifork_zone);
-		kmem_free(xfs_buf_item_zone);
-		kmem_free(xfs_da_state_zone);
-		kmem_free(xfs_btree_cur_zone);
-		kmem_free(xfs_bmap_free_item_zone);
-		kmem_free(xfs_log_item_desc_zone);
+		kmem_zone_destroy(xfs_buf_zone);
+		kmem_zone_destroy(xfs_inode_zone);
+		kmem_zone_destroy(xfs_ifork_zone);
+		kmem_zone_destroy(xfs_ili_zone);
+		kmem_zone_destroy(xfs_buf_item_zone);
+		kmem_zone_destroy(xfs_da_state_zone);
+		kmem_zone_destroy(xfs_btree_cur_zone);
+		kmem_zone_destroy(xfs_bmap_free_item_zone);
+		kmem_zone_destroy(xfs_log_item_desc_zone);
 		return;
 	}
 	/* otherwise initialise zone allocation */
@@ -471,45 +575,63 @@ rtmount_init(
 	return 0;
 }
 
+/*
+ * Per-AG structures are set up the first time xfs_perag_get asks for one,
+ * so that opening a filesystem with tens of thousands of AGs to look at
+ * one thing doesn't first allocate and initialise all of them.  Only the
+ * first and last AGs' are made at mount time; the last one sets the
+ * height of the perag tree, so that later insertions only ever fill in
+ * empty slots and lookups done without perag_lock see either nothing or a
+ * complete entry.
+ */
+static pthread_mutex_t	perag_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct xfs_perag *
+libxfs_perag_alloc(
+	xfs_mount_t	*mp,
+	xfs_agnumber_t	agno)
+{
+	xfs_perag_t	*pag;
+
+	if (agno >= mp->m_sb.sb_agcount)
+		return NULL;
+
+	pthread_mutex_lock(&perag_lock);
+	pag = radix_tree_lookup(&mp->m_perag_tree, agno);
+	if (pag)
+		goto out;
+
+	pag = kmem_zalloc(sizeof(*pag), KM_MAYFAIL);
+	if (!pag)
+		goto out;
+	pag->pag_agno = agno;
+	pag->pag_mount = mp;
+	if (agno < mp->m_maxaginodeok)
+		pag->pagi_inodeok = 1;
+	if (agno < mp->m_maxagmeta)
+		pag->pagf_metadata = 1;
+
+	/* everything above has to be visible before the tree entry is */
+	__sync_synchronize();
+	if (radix_tree_insert(&mp->m_perag_tree, agno, pag)) {
+		kmem_free(pag);
+		pag = NULL;
+	}
+out:
+	pthread_mutex_unlock(&perag_lock);
+	return pag;
+}
+
 static int
 libxfs_initialize_perag(
 	xfs_mount_t	*mp,
 	xfs_agnumber_t	agcount,
 	xfs_agnumber_t	*maxagi)
 {
-	xfs_agnumber_t	index, max_metadata;
-	xfs_agnumber_t	first_initialised = 0;
-	xfs_perag_t	*pag;
+	xfs_agnumber_t	index, inodeok, max_metadata = 0;
 	xfs_agino_t	agino;
 	xfs_ino_t	ino;
 	xfs_sb_t	*sbp = &mp->m_sb;
-	int		error = -ENOMEM;
-
-	/*
-	 * Walk the current per-ag tree so we don't try to initialise AGs
-	 * that already exist (growfs case). Allocate and insert all the
-	 * AGs we don't find ready for initialisation.
-	 */
-	for (index = 0; index < agcount; index++) {
-		pag = xfs_perag_get(mp, index);
-		if (pag) {
-			xfs_perag_put(pag);
-			continue;
-		}
-		if (!first_initialised)
-			first_initialised = index;
-
-		pag = kmem_zalloc(sizeof(*pag), KM_MAYFAIL);
-		if (!pag)
-			goto out_unwind;
-		pag->pag_agno = index;
-		pag->pag_mount = mp;
-
-		if (radix_tree_insert(&mp->m_perag_tree, index, pag)) {
-			error = -EEXIST;
-			goto out_unwind;
-		}
-	}
 
 	/*
 	 * If we mount with the inode64 option, or no inode overflows
@@ -542,36 +664,26 @@ libxfs_initialize_perag(
 
 		for (index = 0; index < agcount; index++) {
 			ino = XFS_AGINO_TO_INO(mp, index, agino);
-			if (ino > XFS_MAXINUMBER_32) {
-				index++;
+			if (ino > XFS_MAXINUMBER_32)
 				break;
-			}
-
-			pag = xfs_perag_get(mp, index);
-			pag->pagi_inodeok = 1;
-			if (index < max_metadata)
-				pag->pagf_metadata = 1;
-			xfs_perag_put(pag);
 		}
+		inodeok = index;
+		if (index < agcount)
+			index++;
 	} else {
-		for (index = 0; index < agcount; index++) {
-			pag = xfs_perag_get(mp, index);
-			pag->pagi_inodeok = 1;
-			xfs_perag_put(pag);
-		}
+		index = inodeok = agcount;
 	}
 
+	/* these decide what libxfs_perag_alloc sets up for each AG */
+	mp->m_maxagi = index;
+	mp->m_maxaginodeok = inodeok;
+	mp->m_maxagmeta = min(max_metadata, inodeok);
 	if (maxagi)
 		*maxagi = index;
-	return 0;
 
-out_unwind:
-	kmem_free(pag);
-	for (; index > first_initialised; index--) {
-		pag = radix_tree_delete(&mp->m_perag_tree, index);
-		kmem_free(pag);
-	}
-	return error;
+	if (!libxfs_perag_alloc(mp, agcount - 1) || !libxfs_perag_alloc(mp, 0))
+		return -ENOMEM;
+	return 0;
 }
 
 static struct xfs_buftarg *
@@ -589,9 +701,96 @@ libxfs_buftarg_alloc(
 	}
 	btp->bt_mount = mp;
 	btp->dev = dev;
+	btp->bt_ioengine = NULL;
+	btp->bt_flags = 0;
+	btp->bt_size = 0;
+	libxfs_buftarg_setup_mmap(btp);
+	return btp;
+}
+
+/*
+ * A buftarg whose blocks live in memory, for scratch btrees and other
+ * structures built out of libxfs buffers that never go to disk.  The
+ * buffers go through the buffer cache like any others, and the I/O is to
+ * a memfd, so nothing above the buftarg has to know.  A mount whose
+ * m_ddev_targp points here gets btree cursors that work entirely in
+ * memory.
+ */
+struct xfs_buftarg *
+libxfs_buftarg_alloc_mem(
+	struct xfs_mount	*mp,
+	const char		*name,
+	xfs_daddr_t		bblen)
+{
+	struct xfs_buftarg	*btp;
+
+	btp = libxfs_buftarg_alloc(mp,
+			libxfs_device_open_mem(name, BBTOB(bblen)));
+	btp->bt_flags |= LIBXFS_BT_MEM;
 	return btp;
 }
 
+static struct xfs_buftarg	*buftarg_freeing;
+static struct xfs_buf		**buftarg_bufs;
+static int			buftarg_nbufs;
+static int			buftarg_maxbufs;
+
+static void
+libxfs_buftarg_collect(
+	struct cache_node	*node)
+{
+	struct xfs_buf		*bp = (struct xfs_buf *)node;
+	struct xfs_buf		**bufs;
+
+	if (bp->b_target != buftarg_freeing)
+		return;
+	if (buftarg_nbufs == buftarg_maxbufs) {
+		buftarg_maxbufs = buftarg_maxbufs ? buftarg_maxbufs * 2 : 256;
+		bufs = realloc(buftarg_bufs,
+				buftarg_maxbufs * sizeof(struct xfs_buf *));
+		if (!bufs) {
+			fprintf(stderr, _("%s: buftarg free failed\n"),
+				progname);
+			exit(1);
+		}
+		buftarg_bufs = bufs;
+	}
+	buftarg_bufs[buftarg_nbufs++] = bp;
+}
+
+/*
+ * Drop a memory buftarg's buffers from the cache without writing them
+ * back, and let its memory go.  All of its buffers must have been
+ * released.
+ */
+void
+libxfs_buftarg_free_mem(
+	struct xfs_buftarg	*btp)
+{
+	static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+	int			i;
+
+	ASSERT(btp->bt_flags & LIBXFS_BT_MEM);
+
+	pthread_mutex_lock(&lock);
+	buftarg_freeing = btp;
+	buftarg_nbufs = 0;
+	cache_walk(libxfs_bcache, libxfs_buftarg_collect);
+	for (i = 0; i < buftarg_nbufs; i++) {
+		buftarg_bufs[i]->b_flags &= ~LIBXFS_B_DIRTY;
+		libxfs_purgebuf(buftarg_bufs[i]);
+	}
+	free(buftarg_bufs);
+	buftarg_bufs = NULL;
+	buftarg_maxbufs = 0;
+	buftarg_freeing = NULL;
+	pthread_mutex_unlock(&lock);
+
+	libxfs_buftarg_free_ioengine(btp);
+	libxfs_device_close(btp->dev);
+	free(btp);
+}
+
 void
 libxfs_buftarg_init(
 	struct xfs_mount	*mp,
@@ -825,20 +1024,28 @@ libxfs_umount(xfs_mount_t *mp)
 	struct xfs_perag	*pag;
 	int			agno;
 
+	libxfs_trans_batch_flush();
 	libxfs_rtmount_destroy(mp);
+	libxfs_icache_purge();
 	libxfs_bcache_purge();
 
-	for (agno = 0; agno < mp->m_maxagi; agno++) {
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
 		pag = radix_tree_delete(&mp->m_perag_tree, agno);
+		if (pag)
+			kmem_free(pag->pagf_index);
 		kmem_free(pag);
 	}
 
 	kmem_free(mp->m_attr_geo);
 	kmem_free(mp->m_dir_geo);
 
+	libxfs_buftarg_free_ioengine(mp->m_rtdev_targp);
 	kmem_free(mp->m_rtdev_targp);
-	if (mp->m_logdev_targp != mp->m_ddev_targp)
+	if (mp->m_logdev_targp != mp->m_ddev_targp) {
+		libxfs_buftarg_free_ioengine(mp->m_logdev_targp);
 		kmem_free(mp->m_logdev_targp);
+	}
+	libxfs_buftarg_free_ioengine(mp->m_ddev_targp);
 	kmem_free(mp->m_ddev_targp);
 	
 }
@@ -849,6 +1056,11 @@ libxfs_umount(xfs_mount_t *mp)
 void
 libxfs_destroy(void)
 {
+	if (libxfs_icache) {
+		libxfs_icache_purge();
+		cache_destroy(libxfs_icache);
+		libxfs_icache = NULL;
+	}
 	manage_zones(1);
 	cache_destroy(libxfs_bcache);
 }
@@ -866,6 +1078,10 @@ libxfs_report(FILE *fp)
 	char *c;
 
 	cache_report(fp, "libxfs_bcache", libxfs_bcache);
+	if (libxfs_icache)
+		cache_report(fp, "libxfs_icache", libxfs_icache);
+	libxfs_iostats_report(fp);
+	kmem_zone_report(fp);
 
 	t = time(NULL);
 	c = asctime(localtime(&t));
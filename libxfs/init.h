@@ -26,6 +26,7 @@ extern int platform_check_iswritable (char *path, char *block,
 					struct stat64 *sptr, int fatal);
 extern int platform_set_blocksize (int fd, char *path, dev_t device, int bsz, int fatal);
 extern void platform_flush_device (int fd, dev_t device);
+extern int platform_zero_range (int fd, long long start, long long len);
 extern char *platform_findrawpath(char *path);
 extern char *platform_findrawpath (char *path);
 extern char *platform_findblockpath (char *path);
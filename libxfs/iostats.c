@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <signal.h>
+#include "libxfs_priv.h"
+#include "init.h"
+
+/*
+ * Count the I/O we issue to the devices, for tools that want to report it.
+ *
+ * Each I/O is counted by class (reads done for a caller waiting on them,
+ * reads done by readahead or prefetch, and writes), with its size and, if
+ * the caller timed it, its latency in a log2 histogram.  Buffers are also
+ * counted by type, from the name of their verifier, when they are
+ * verified after a read or before a write, along with the CPU time spent
+ * in the verifier.  The buffer cache counts its hits, misses and
+ * evictions by the same types, for libxfs_iostats_cache_report to show
+ * which kinds of metadata the cache is short of room for.
+ *
+ * Any tool can print all this with libxfs_iostats_report.  Setting
+ * LIBXFS_IOSTATS in the environment makes libxfs_init arrange for it to
+ * go to stderr at exit and whenever the process gets SIGUSR2.
+ */
+#define IOSTATS_BUCKETS		24	/* up to 2^23 usecs, ~8s, and more */
+#define IOSTATS_TYPES		48
+
+struct iostats_class {
+	__uint64_t		ios;
+	__uint64_t		bytes;
+	__uint64_t		timed;		/* ios with a latency */
+	__uint64_t		nsecs;
+	__uint64_t		hist[IOSTATS_BUCKETS];
+};
+
+struct iostats_type {
+	const struct xfs_buf_ops *ops;		/* NULL: no verifier */
+	__uint64_t		reads;
+	__uint64_t		read_bytes;
+	__uint64_t		writes;
+	__uint64_t		write_bytes;
+	__uint64_t		verify_nsecs;
+	__uint64_t		hits;		/* atomic, no lock */
+	__uint64_t		misses;
+	__uint64_t		miss_bytes;
+	__uint64_t		evicts;
+};
+
+static struct libxfs_iostats	iostats;
+static struct iostats_class	iostats_classes[LIBXFS_IO_NCLASSES];
+static struct iostats_type	iostats_types[IOSTATS_TYPES];
+static int			iostats_ntypes;
+static pthread_mutex_t		iostats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *iostats_class_names[LIBXFS_IO_NCLASSES] = {
+	"read", "prefetch", "write",
+};
+
+__uint64_t
+libxfs_iostats_start(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Count an I/O of len bytes in the given class.  start is what
+ * libxfs_iostats_start returned before it was issued, or 0 if it wasn't
+ * timed.
+ */
+void
+libxfs_iostats_io(
+	int			class,
+	size_t			len,
+	__uint64_t		start)
+{
+	struct iostats_class	*ic = &iostats_classes[class];
+	__uint64_t		nsecs = 0;
+	__uint64_t		usecs;
+	int			bucket = 0;
+
+	if (start) {
+		nsecs = libxfs_iostats_start() - start;
+		for (usecs = nsecs / 1000; usecs > 1 &&
+		     bucket < IOSTATS_BUCKETS - 1; usecs >>= 1)
+			bucket++;
+	}
+
+	pthread_mutex_lock(&iostats_lock);
+	if (class == LIBXFS_IO_WRITE) {
+		iostats.writes++;
+		iostats.write_bytes += len;
+	} else {
+		iostats.reads++;
+		iostats.read_bytes += len;
+	}
+	ic->ios++;
+	ic->bytes += len;
+	if (start) {
+		ic->timed++;
+		ic->nsecs += nsecs;
+		ic->hist[bucket]++;
+	}
+	pthread_mutex_unlock(&iostats_lock);
+}
+
+void
+libxfs_iostats_add(
+	int			write,
+	size_t			len)
+{
+	libxfs_iostats_io(write ? LIBXFS_IO_WRITE : LIBXFS_IO_READ, len, 0);
+}
+
+/*
+ * Find the entry for these ops, adding it if there's room.  Entries are
+ * only ever added, and ops is set before the count covers it, so the
+ * search for an existing type, which is done on every cache lookup,
+ * doesn't need the lock.
+ */
+static struct iostats_type *
+iostats_type(
+	const struct xfs_buf_ops *ops)
+{
+	struct iostats_type	*it;
+	int			n = *(volatile int *)&iostats_ntypes;
+
+	for (it = iostats_types; it < &iostats_types[n]; it++)
+		if (it->ops == ops)
+			return it;
+
+	pthread_mutex_lock(&iostats_lock);
+	for (; it < &iostats_types[iostats_ntypes]; it++)
+		if (it->ops == ops)
+			goto out;
+	if (iostats_ntypes == IOSTATS_TYPES) {
+		it = NULL;
+		goto out;
+	}
+	it->ops = ops;
+	__sync_synchronize();
+	iostats_ntypes++;
+out:
+	pthread_mutex_unlock(&iostats_lock);
+	return it;
+}
+
+/*
+ * A buffer with these ops was verified after being read, or before being
+ * written, and the verifier took nsecs.
+ */
+void
+libxfs_iostats_buf(
+	const struct xfs_buf_ops *ops,
+	int			write,
+	size_t			len,
+	__uint64_t		nsecs)
+{
+	struct iostats_type	*it = iostats_type(ops);
+
+	if (!it)
+		return;
+	pthread_mutex_lock(&iostats_lock);
+	if (write) {
+		it->writes++;
+		it->write_bytes += len;
+	} else {
+		it->reads++;
+		it->read_bytes += len;
+	}
+	it->verify_nsecs += nsecs;
+	pthread_mutex_unlock(&iostats_lock);
+}
+
+/* a buffer of len bytes with these ops was found, read into or let go */
+void
+libxfs_iostats_cache(
+	const struct xfs_buf_ops *ops,
+	int			event,
+	size_t			len)
+{
+	struct iostats_type	*it = iostats_type(ops);
+
+	if (!it)
+		return;
+	switch (event) {
+	case LIBXFS_CACHE_HIT:
+		__sync_fetch_and_add(&it->hits, 1);
+		break;
+	case LIBXFS_CACHE_MISS:
+		__sync_fetch_and_add(&it->misses, 1);
+		__sync_fetch_and_add(&it->miss_bytes, len);
+		break;
+	case LIBXFS_CACHE_EVICT:
+		__sync_fetch_and_add(&it->evicts, 1);
+		break;
+	}
+}
+
+void
+libxfs_iostats_get(
+	struct libxfs_iostats	*stats)
+{
+	pthread_mutex_lock(&iostats_lock);
+	*stats = iostats;
+	pthread_mutex_unlock(&iostats_lock);
+}
+
+void
+libxfs_iostats_report(
+	FILE			*fp)
+{
+	struct iostats_class	ic[LIBXFS_IO_NCLASSES];
+	struct iostats_type	it[IOSTATS_TYPES];
+	int			ntypes;
+	int			first, last;
+	int			b, c, i;
+
+	pthread_mutex_lock(&iostats_lock);
+	memcpy(ic, iostats_classes, sizeof(ic));
+	memcpy(it, iostats_types, sizeof(it));
+	ntypes = iostats_ntypes;
+	pthread_mutex_unlock(&iostats_lock);
+
+	fprintf(fp, "%-10s %12s %16s %12s\n", "I/O", "count", "bytes",
+		"avg usecs");
+	for (c = 0; c < LIBXFS_IO_NCLASSES; c++)
+		fprintf(fp, "%-10s %12llu %16llu %12.1f\n",
+			iostats_class_names[c],
+			(unsigned long long)ic[c].ios,
+			(unsigned long long)ic[c].bytes,
+			ic[c].timed ? ic[c].nsecs / 1000.0 / ic[c].timed : 0.0);
+
+	/* only the part of the histograms that has anything in it */
+	first = IOSTATS_BUCKETS;
+	last = -1;
+	for (c = 0; c < LIBXFS_IO_NCLASSES; c++) {
+		for (b = 0; b < IOSTATS_BUCKETS; b++) {
+			if (!ic[c].hist[b])
+				continue;
+			first = min(first, b);
+			last = max(last, b);
+		}
+	}
+	if (last >= 0) {
+		fprintf(fp, "\n%-10s", "usecs <");
+		for (c = 0; c < LIBXFS_IO_NCLASSES; c++)
+			fprintf(fp, " %12s", iostats_class_names[c]);
+		fprintf(fp, "\n");
+		for (b = first; b <= last; b++) {
+			if (b == IOSTATS_BUCKETS - 1)
+				fprintf(fp, "%-10s", "more");
+			else
+				fprintf(fp, "%-10llu", 2ULL << b);
+			for (c = 0; c < LIBXFS_IO_NCLASSES; c++)
+				fprintf(fp, " %12llu",
+					(unsigned long long)ic[c].hist[b]);
+			fprintf(fp, "\n");
+		}
+	}
+
+	if (!ntypes)
+		return;
+	fprintf(fp, "\n%-20s %10s %14s %10s %14s %10s\n", "buffer type",
+		"reads", "read bytes", "writes", "write bytes", "verify ms");
+	for (i = 0; i < ntypes; i++)
+		fprintf(fp, "%-20s %10llu %14llu %10llu %14llu %10.1f\n",
+			it[i].ops ? it[i].ops->name : "(none)",
+			(unsigned long long)it[i].reads,
+			(unsigned long long)it[i].read_bytes,
+			(unsigned long long)it[i].writes,
+			(unsigned long long)it[i].write_bytes,
+			it[i].verify_nsecs / 1000000.0);
+}
+
+void
+libxfs_iostats_cache_report(
+	FILE			*fp)
+{
+	struct iostats_type	it[IOSTATS_TYPES];
+	__uint64_t		total;
+	int			ntypes;
+	int			i;
+
+	pthread_mutex_lock(&iostats_lock);
+	memcpy(it, iostats_types, sizeof(it));
+	ntypes = iostats_ntypes;
+	pthread_mutex_unlock(&iostats_lock);
+
+	for (i = 0, total = 0; i < ntypes; i++)
+		total += it[i].hits + it[i].misses + it[i].evicts;
+	if (!total)
+		return;
+	fprintf(fp, "%-20s %12s %12s %6s %14s %12s\n", "buffer type",
+		"hits", "misses", "hit%", "miss bytes", "evictions");
+	for (i = 0; i < ntypes; i++) {
+		total = it[i].hits + it[i].misses;
+		if (!total && !it[i].evicts)
+			continue;
+		fprintf(fp, "%-20s %12llu %12llu %6.1f %14llu %12llu\n",
+			it[i].ops ? it[i].ops->name : "(none)",
+			(unsigned long long)it[i].hits,
+			(unsigned long long)it[i].misses,
+			total ? 100.0 * it[i].hits / total : 0.0,
+			(unsigned long long)it[i].miss_bytes,
+			(unsigned long long)it[i].evicts);
+	}
+}
+
+static void
+iostats_atexit(void)
+{
+	libxfs_iostats_report(stderr);
+}
+
+/*
+ * SIGUSR2 is blocked in the thread calling libxfs_init, and so in every
+ * thread it starts afterwards, and taken here with sigwait so that the
+ * report isn't printed from a signal handler.
+ */
+static void *
+iostats_signal_thread(
+	void			*arg)
+{
+	sigset_t		*set = arg;
+	int			sig;
+
+	for (;;) {
+		if (sigwait(set, &sig) == 0)
+			libxfs_iostats_report(stderr);
+	}
+	return NULL;
+}
+
+void
+libxfs_iostats_init(void)
+{
+	static sigset_t		set;
+	static int		done;
+	pthread_t		tid;
+
+	if (done || !getenv("LIBXFS_IOSTATS"))
+		return;
+	done = 1;
+	atexit(iostats_atexit);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL))
+		return;
+	if (pthread_create(&tid, NULL, iostats_signal_thread, &set)) {
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		return;
+	}
+	pthread_detach(tid);
+}
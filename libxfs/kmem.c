@@ -6,10 +6,172 @@
  * Simple memory interface
  */
 
+/*
+ * Zones cache freed objects the way the kernel's slab magazines do.  Each
+ * thread has two magazines of up to KMEM_MAG_ROUNDS objects per zone, so
+ * allocating and freeing is a push or pop on a thread private array.  When
+ * both of a thread's magazines are empty (or full) it swaps one with the
+ * zone's depot, a locked list of full and empty magazines, and only when
+ * the depot has nothing to give does an allocation go to malloc.  The
+ * depot keeps at most KMEM_DEPOT_MAX full magazines, beyond that the
+ * objects go back to free().
+ *
+ * The objects themselves are still allocated one by one with malloc, as
+ * some of the shared code frees zone objects with plain free() and that
+ * has to keep working.  Such objects just never come back to the zone.
+ *
+ * Allocation and free counts are kept per thread and folded into the zone
+ * on each trip to the depot and when the thread exits, so the figures
+ * kmem_zone_report() prints lag a little behind.
+ */
+#define KMEM_MAX_ZONES		32
+#define KMEM_MAG_ROUNDS		32
+#define KMEM_DEPOT_MAX		64
+
+struct kmem_magazine {
+	struct kmem_magazine	*next;
+	int			rounds;
+	void			*objs[KMEM_MAG_ROUNDS];
+};
+
+struct kmem_thread_cache {
+	unsigned long		gen;		/* zone_gen of its zone */
+	struct kmem_magazine	*loaded;
+	struct kmem_magazine	*prev;
+	__uint64_t		allocs;
+	__uint64_t		frees;
+};
+
+static kmem_zone_t		*kmem_zones[KMEM_MAX_ZONES];
+static unsigned long		kmem_zone_gen;
+static pthread_mutex_t		kmem_zones_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t		kmem_thread_key;
+static pthread_once_t		kmem_thread_once = PTHREAD_ONCE_INIT;
+
+static void
+kmem_magazine_empty(
+	struct kmem_magazine	*mag)
+{
+	while (mag->rounds)
+		free(mag->objs[--mag->rounds]);
+}
+
+static struct kmem_magazine *
+kmem_magazine_alloc(void)
+{
+	return calloc(1, sizeof(struct kmem_magazine));
+}
+
+/* hand a thread's magazine back to the depot, called with zone_lock held */
+static void
+kmem_depot_put(
+	kmem_zone_t		*zone,
+	struct kmem_magazine	*mag)
+{
+	if (!mag)
+		return;
+	if (mag->rounds && zone->zone_nfull < KMEM_DEPOT_MAX) {
+		mag->next = zone->zone_full;
+		zone->zone_full = mag;
+		zone->zone_nfull++;
+		return;
+	}
+	kmem_magazine_empty(mag);
+	mag->next = zone->zone_empty;
+	zone->zone_empty = mag;
+}
+
+static void
+kmem_fold_stats(
+	kmem_zone_t		*zone,
+	struct kmem_thread_cache *tc)
+{
+	__sync_fetch_and_add(&zone->zone_allocs, tc->allocs);
+	__sync_fetch_and_add(&zone->zone_frees, tc->frees);
+	tc->allocs = tc->frees = 0;
+}
+
+/* drop the magazines of a cache whose zone has gone away */
+static void
+kmem_thread_cache_drop(
+	struct kmem_thread_cache *tc)
+{
+	if (tc->loaded) {
+		kmem_magazine_empty(tc->loaded);
+		free(tc->loaded);
+	}
+	if (tc->prev) {
+		kmem_magazine_empty(tc->prev);
+		free(tc->prev);
+	}
+	memset(tc, 0, sizeof(*tc));
+}
+
+static void
+kmem_thread_destroy(
+	void			*arg)
+{
+	struct kmem_thread_cache *caches = arg;
+	struct kmem_thread_cache *tc;
+	kmem_zone_t		*zone;
+	int			i;
+
+	pthread_mutex_lock(&kmem_zones_lock);
+	for (i = 0; i < KMEM_MAX_ZONES; i++) {
+		tc = &caches[i];
+		zone = kmem_zones[i];
+		if (!zone || zone->zone_gen != tc->gen) {
+			kmem_thread_cache_drop(tc);
+			continue;
+		}
+		pthread_mutex_lock(&zone->zone_lock);
+		kmem_depot_put(zone, tc->loaded);
+		kmem_depot_put(zone, tc->prev);
+		kmem_fold_stats(zone, tc);
+		pthread_mutex_unlock(&zone->zone_lock);
+	}
+	pthread_mutex_unlock(&kmem_zones_lock);
+	free(caches);
+}
+
+static void
+kmem_thread_init(void)
+{
+	pthread_key_create(&kmem_thread_key, kmem_thread_destroy);
+}
+
+/* this thread's cache for zone, or NULL if it can't have one */
+static struct kmem_thread_cache *
+kmem_thread_cache(
+	kmem_zone_t		*zone)
+{
+	struct kmem_thread_cache *caches;
+	struct kmem_thread_cache *tc;
+
+	pthread_once(&kmem_thread_once, kmem_thread_init);
+	caches = pthread_getspecific(kmem_thread_key);
+	if (!caches) {
+		caches = calloc(KMEM_MAX_ZONES, sizeof(*caches));
+		if (!caches)
+			return NULL;
+		if (pthread_setspecific(kmem_thread_key, caches)) {
+			free(caches);
+			return NULL;
+		}
+	}
+	tc = &caches[zone->zone_index];
+	if (tc->gen != zone->zone_gen) {
+		kmem_thread_cache_drop(tc);
+		tc->gen = zone->zone_gen;
+	}
+	return tc;
+}
+
 kmem_zone_t *
 kmem_zone_init(int size, char *name)
 {
-	kmem_zone_t	*ptr = malloc(sizeof(kmem_zone_t));
+	kmem_zone_t	*ptr = calloc(1, sizeof(kmem_zone_t));
+	int		i;
 
 	if (ptr == NULL) {
 		fprintf(stderr, _("%s: zone init failed (%s, %d bytes): %s\n"),
@@ -20,23 +182,107 @@ kmem_zone_init(int size, char *name)
 	ptr->zone_unitsize = size;
 	ptr->zone_name = name;
 	ptr->allocated = 0;
+	pthread_mutex_init(&ptr->zone_lock, NULL);
+
+	/* without a slot the zone works, just without any caching */
+	ptr->zone_index = -1;
+	pthread_mutex_lock(&kmem_zones_lock);
+	for (i = 0; i < KMEM_MAX_ZONES; i++) {
+		if (!kmem_zones[i]) {
+			kmem_zones[i] = ptr;
+			ptr->zone_index = i;
+			ptr->zone_gen = ++kmem_zone_gen;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&kmem_zones_lock);
 	return ptr;
 }
 
+void
+kmem_zone_destroy(kmem_zone_t *zone)
+{
+	struct kmem_magazine	*mag;
+
+	if (!zone)
+		return;
+	pthread_mutex_lock(&kmem_zones_lock);
+	if (zone->zone_index >= 0)
+		kmem_zones[zone->zone_index] = NULL;
+	pthread_mutex_unlock(&kmem_zones_lock);
+
+	while ((mag = zone->zone_full) != NULL) {
+		zone->zone_full = mag->next;
+		kmem_magazine_empty(mag);
+		free(mag);
+	}
+	while ((mag = zone->zone_empty) != NULL) {
+		zone->zone_empty = mag->next;
+		free(mag);
+	}
+	pthread_mutex_destroy(&zone->zone_lock);
+	free(zone);
+}
+
 void *
 kmem_zone_alloc(kmem_zone_t *zone, int flags)
 {
-	void	*ptr = malloc(zone->zone_unitsize);
+	struct kmem_thread_cache *tc = NULL;
+	struct kmem_magazine	*mag;
+	void	*ptr;
 
+	if (zone->zone_index >= 0)
+		tc = kmem_thread_cache(zone);
+	if (!tc)
+		goto slow;
+
+	if (tc->loaded && tc->loaded->rounds)
+		goto hit;
+	if (tc->prev && tc->prev->rounds) {
+		mag = tc->prev;
+		tc->prev = tc->loaded;
+		tc->loaded = mag;
+		goto hit;
+	}
+
+	/* both empty, trade the older one for a full one if there is one */
+	pthread_mutex_lock(&zone->zone_lock);
+	kmem_fold_stats(zone, tc);
+	mag = zone->zone_full;
+	if (mag) {
+		zone->zone_full = mag->next;
+		zone->zone_nfull--;
+		zone->zone_exchanges++;
+		kmem_depot_put(zone, tc->prev);
+		tc->prev = tc->loaded;
+		tc->loaded = mag;
+	}
+	pthread_mutex_unlock(&zone->zone_lock);
+	if (mag)
+		goto hit;
+
+slow:
+	ptr = malloc(zone->zone_unitsize);
 	if (ptr == NULL) {
 		fprintf(stderr, _("%s: zone alloc failed (%s, %d bytes): %s\n"),
 			progname, zone->zone_name, zone->zone_unitsize,
 			strerror(errno));
 		exit(1);
 	}
+	__sync_fetch_and_add(&zone->zone_mallocs, 1);
+	if (tc)
+		tc->allocs++;
+	else
+		__sync_fetch_and_add(&zone->zone_allocs, 1);
 	zone->allocated++;
 	return ptr;
+
+hit:
+	tc->allocs++;
+	zone->allocated++;
+	return tc->loaded->objs[--tc->loaded->rounds];
 }
+
 void *
 kmem_zone_zalloc(kmem_zone_t *zone, int flags)
 {
@@ -46,6 +292,79 @@ kmem_zone_zalloc(kmem_zone_t *zone, int flags)
 	return ptr;
 }
 
+void
+kmem_zone_free(kmem_zone_t *zone, void *ptr)
+{
+	struct kmem_thread_cache *tc = NULL;
+	struct kmem_magazine	*mag;
+
+	zone->allocated--;
+	if (zone->zone_index >= 0)
+		tc = kmem_thread_cache(zone);
+	if (!tc) {
+		__sync_fetch_and_add(&zone->zone_frees, 1);
+		free(ptr);
+		return;
+	}
+	tc->frees++;
+
+	if (tc->loaded && tc->loaded->rounds < KMEM_MAG_ROUNDS)
+		goto put;
+	if (tc->prev && tc->prev->rounds < KMEM_MAG_ROUNDS) {
+		mag = tc->prev;
+		tc->prev = tc->loaded;
+		tc->loaded = mag;
+		goto put;
+	}
+
+	/* both full (or missing), trade the older one for an empty one */
+	pthread_mutex_lock(&zone->zone_lock);
+	kmem_fold_stats(zone, tc);
+	mag = zone->zone_empty;
+	if (mag)
+		zone->zone_empty = mag->next;
+	if (tc->prev)
+		zone->zone_exchanges++;
+	kmem_depot_put(zone, tc->prev);
+	pthread_mutex_unlock(&zone->zone_lock);
+	if (!mag)
+		mag = kmem_magazine_alloc();
+	tc->prev = tc->loaded;
+	tc->loaded = mag;
+	if (!mag) {
+		free(ptr);
+		return;
+	}
+
+put:
+	tc->loaded->objs[tc->loaded->rounds++] = ptr;
+}
+
+void
+kmem_zone_report(FILE *fp)
+{
+	kmem_zone_t	*zone;
+	int		i;
+
+	fprintf(fp, "%-20s %6s %12s %12s %12s %10s\n", "zone", "size",
+		"allocs", "frees", "mallocs", "depot");
+	pthread_mutex_lock(&kmem_zones_lock);
+	for (i = 0; i < KMEM_MAX_ZONES; i++) {
+		zone = kmem_zones[i];
+		if (!zone)
+			continue;
+		pthread_mutex_lock(&zone->zone_lock);
+		fprintf(fp, "%-20s %6d %12llu %12llu %12llu %10llu\n",
+			zone->zone_name, zone->zone_unitsize,
+			(unsigned long long)zone->zone_allocs,
+			(unsigned long long)zone->zone_frees,
+			(unsigned long long)zone->zone_mallocs,
+			(unsigned long long)zone->zone_exchanges);
+		pthread_mutex_unlock(&zone->zone_lock);
+	}
+	pthread_mutex_unlock(&kmem_zones_lock);
+}
+
 
 void *
 kmem_alloc(size_t size, int flags)
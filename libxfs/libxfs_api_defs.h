@@ -27,6 +27,8 @@
  */
 #define xfs_highbit32			libxfs_highbit32
 #define xfs_highbit64			libxfs_highbit64
+#define xfs_next_bit			libxfs_next_bit
+#define xfs_contig_bits			libxfs_contig_bits
 
 #define xfs_fs_repair_cmn_err		libxfs_fs_repair_cmn_err
 #define xfs_fs_cmn_err			libxfs_fs_cmn_err
@@ -72,18 +74,24 @@
 #define xfs_bmapi_read			libxfs_bmapi_read
 #define xfs_bunmapi			libxfs_bunmapi
 #define xfs_bmbt_get_all		libxfs_bmbt_get_all
+#define xfs_bmbt_to_bmdr		libxfs_bmbt_to_bmdr
 #define xfs_rtfree_extent		libxfs_rtfree_extent
+#define xfs_btree_bload			libxfs_btree_bload
+#define xfs_btree_bload_compute_geometry libxfs_btree_bload_compute_geometry
 
 #define xfs_da_brelse			libxfs_da_brelse
 #define xfs_da_hashname			libxfs_da_hashname
+#define xfs_da_hashname_batch		libxfs_da_hashname_batch
 #define xfs_da_shrink_inode		libxfs_da_shrink_inode
 #define xfs_da_read_buf			libxfs_da_read_buf
 #define xfs_dir_createname		libxfs_dir_createname
+#define xfs_dir_hashnames		libxfs_dir_hashnames
 #define xfs_dir_init			libxfs_dir_init
 #define xfs_dir_lookup			libxfs_dir_lookup
 #define xfs_dir_replace			libxfs_dir_replace
 #define xfs_dir2_isblock		libxfs_dir2_isblock
 #define xfs_dir2_isleaf			libxfs_dir2_isleaf
+#define xfs_dir2_node_bulkload		libxfs_dir2_node_bulkload
 #define __xfs_dir2_data_freescan	libxfs_dir2_data_freescan
 #define xfs_dir2_data_log_entry		libxfs_dir2_data_log_entry
 #define xfs_dir2_data_log_header	libxfs_dir2_data_log_header
@@ -94,6 +102,7 @@
 #define xfs_dinode_from_disk		libxfs_dinode_from_disk
 #define xfs_dinode_to_disk		libxfs_dinode_to_disk
 #define xfs_dinode_calc_crc		libxfs_dinode_calc_crc
+#define xfs_dinode_verify_cksums	libxfs_dinode_verify_cksums
 #define xfs_idata_realloc		libxfs_idata_realloc
 #define xfs_idestroy_fork		libxfs_idestroy_fork
 
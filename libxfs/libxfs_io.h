@@ -35,10 +35,61 @@ struct xfs_perag;
 struct xfs_buftarg {
 	struct xfs_mount	*bt_mount;
 	dev_t			dev;
+	struct xfs_ioengine	*bt_ioengine;	/* read submission backend */
+	int			bt_flags;
+	xfs_off_t		bt_size;	/* mappable bytes, LIBXFS_BT_MMAP */
 };
 
+/* bt_flags */
+#define LIBXFS_BT_MMAP		0x0001	/* map buffers rather than read them */
+#define LIBXFS_BT_MEM		0x0002	/* blocks are in memory, not a device */
+
 extern void	libxfs_buftarg_init(struct xfs_mount *mp, dev_t ddev,
 				    dev_t logdev, dev_t rtdev);
+extern struct xfs_buftarg *libxfs_buftarg_alloc_mem(struct xfs_mount *mp,
+				    const char *name, xfs_daddr_t bblen);
+extern void	libxfs_buftarg_free_mem(struct xfs_buftarg *btp);
+
+/*
+ * Buffer read submission backends.
+ *
+ * By default every buffer read is issued as one synchronous pread64 per
+ * buffer map.  A buftarg can instead be switched to a queued backend, which
+ * takes a whole list of buffers, keeps up to ie_depth reads in flight and
+ * reaps the completions in bulk.  Backends that cannot be set up fall back
+ * to the synchronous engine so callers never have to care which one is in
+ * use.
+ */
+enum {
+	LIBXFS_IOENGINE_SYNC = 0,	/* one pread64 per buffer map */
+	LIBXFS_IOENGINE_AIO,		/* POSIX AIO, lio_listio batches */
+};
+
+#define LIBXFS_IOENGINE_DEFAULT_DEPTH	32
+#define LIBXFS_IOENGINE_MAX_DEPTH	1024
+
+struct xfs_ioengine;
+
+struct xfs_ioengine_ops {
+	const char	*name;
+	int		(*read_list)(struct xfs_ioengine *, struct xfs_buftarg *,
+				     struct xfs_buf **, int, int);
+	int		(*write_list)(struct xfs_ioengine *, struct xfs_buftarg *,
+				      struct xfs_buf **, int);
+	void		(*destroy)(struct xfs_ioengine *);
+};
+
+struct xfs_ioengine {
+	int				ie_type;
+	int				ie_depth;	/* max reads in flight */
+	const struct xfs_ioengine_ops	*ie_ops;
+};
+
+extern int	libxfs_buftarg_set_ioengine(struct xfs_buftarg *, int, int);
+extern void	libxfs_buftarg_free_ioengine(struct xfs_buftarg *);
+extern int	libxfs_buftarg_queued_io(struct xfs_buftarg *);
+extern const char *libxfs_ioengine_name(struct xfs_buftarg *);
+extern void	libxfs_buftarg_setup_mmap(struct xfs_buftarg *);
 
 #define LIBXFS_BBTOOFF64(bbs)	(((xfs_off_t)(bbs)) << BBSHIFT)
 
@@ -52,6 +103,7 @@ struct xfs_buf_map {
 	struct xfs_buf_map (map) = { .bm_bn = (blkno), .bm_len = (numblk) };
 
 struct xfs_buf_ops {
+	const char *name;
 	void (*verify_read)(struct xfs_buf *);
 	void (*verify_write)(struct xfs_buf *);
 };
@@ -76,6 +128,7 @@ typedef struct xfs_buf {
 	struct xfs_perag	*b_pag;
 	struct xfs_buf_map	*b_map;
 	int			b_nmaps;
+	unsigned int		b_crc_off;	/* crc known good, or 0 */
 #ifdef XFS_BUF_TRACING
 	struct list_head	b_lock_list;
 	const char		*b_func;
@@ -91,6 +144,8 @@ enum xfs_buf_flags_t {	/* b_flags bits */
 	LIBXFS_B_UPTODATE	= 0x0008,	/* buffer is sync'd to disk */
 	LIBXFS_B_DISCONTIG	= 0x0010,	/* discontiguous buffer */
 	LIBXFS_B_UNCHECKED	= 0x0020,	/* needs verification */
+	LIBXFS_B_MAPPED		= 0x0040,	/* b_addr points into a mapping */
+	LIBXFS_B_PENDING	= 0x0080,	/* readahead in progress */
 };
 
 #define XFS_BUF_DADDR_NULL		((xfs_daddr_t) (-1LL))
@@ -122,7 +177,7 @@ enum xfs_buf_flags_t {	/* b_flags bits */
 						(pri))
 #define XFS_BUF_PRIORITY(bp)		(cache_node_get_priority( \
 						(struct cache_node *)(bp)))
-#define xfs_buf_set_ref(bp,ref)		((void) 0)
+#define xfs_buf_set_ref(bp,ref)		libxfs_buf_set_ref(bp, ref)
 #define xfs_buf_ioerror(bp,err)		((bp)->b_error = (err))
 
 #define xfs_daddr_to_agno(mp,d) \
@@ -195,23 +250,72 @@ extern void	libxfs_putbuf (xfs_buf_t *);
 
 extern void	libxfs_readbuf_verify(struct xfs_buf *bp,
 			const struct xfs_buf_ops *ops);
+extern void	libxfs_buf_readahead(struct xfs_buftarg *, xfs_daddr_t, int,
+			const struct xfs_buf_ops *);
+extern void	libxfs_buf_readahead_map(struct xfs_buftarg *,
+			struct xfs_buf_map *, int, const struct xfs_buf_ops *);
 extern xfs_buf_t *libxfs_getsb(struct xfs_mount *, int);
 extern void	libxfs_bcache_purge(void);
 extern void	libxfs_bcache_flush(void);
 extern void	libxfs_purgebuf(xfs_buf_t *);
+extern void	libxfs_buf_set_ref(struct xfs_buf *, int);
 extern int	libxfs_bcache_overflowed(void);
 extern int	libxfs_bcache_usage(void);
 
+/* I/O issued to the devices so far */
+struct libxfs_iostats {
+	__uint64_t	reads;
+	__uint64_t	read_bytes;
+	__uint64_t	writes;
+	__uint64_t	write_bytes;
+};
+
+/* classes of I/O counted by libxfs_iostats_io */
+enum {
+	LIBXFS_IO_READ,			/* somebody's waiting for it */
+	LIBXFS_IO_PREFETCH,		/* readahead, prefetch, read lists */
+	LIBXFS_IO_WRITE,
+	LIBXFS_IO_NCLASSES
+};
+
+/* buffer cache events counted by libxfs_iostats_cache */
+enum {
+	LIBXFS_CACHE_HIT,
+	LIBXFS_CACHE_MISS,
+	LIBXFS_CACHE_EVICT,
+};
+
+extern void	libxfs_iostats_init(void);
+extern __uint64_t libxfs_iostats_start(void);
+extern void	libxfs_iostats_io(int, size_t, __uint64_t);
+extern void	libxfs_iostats_add(int, size_t);
+extern void	libxfs_iostats_buf(const struct xfs_buf_ops *, int, size_t,
+				   __uint64_t);
+extern void	libxfs_iostats_cache(const struct xfs_buf_ops *, int, size_t);
+extern void	libxfs_iostats_get(struct libxfs_iostats *);
+extern void	libxfs_iostats_report(FILE *);
+extern void	libxfs_iostats_cache_report(FILE *);
+
+/* metadata verified by earlier read only runs, see vcache.c */
+extern void	libxfs_vcache_init(dev_t, __uint64_t);
+extern int	libxfs_vcache_lookup(struct xfs_buf *);
+extern void	libxfs_vcache_add(struct xfs_buf *);
+
 /* Buffer (Raw) Interfaces */
 extern xfs_buf_t *libxfs_getbufr(struct xfs_buftarg *, xfs_daddr_t, int);
 extern void	libxfs_putbufr(xfs_buf_t *);
 
 extern int	libxfs_writebuf_int(xfs_buf_t *, int);
 extern int	libxfs_writebufr(struct xfs_buf *);
+extern int	libxfs_writebufr_list(struct xfs_buftarg *, struct xfs_buf **,
+				      int);
 extern int	libxfs_readbufr(struct xfs_buftarg *, xfs_daddr_t, xfs_buf_t *, int, int);
 extern int	libxfs_readbufr_map(struct xfs_buftarg *, struct xfs_buf *, int);
+extern int	libxfs_readbufr_list(struct xfs_buftarg *, struct xfs_buf **,
+				     int, int);
 
 extern int libxfs_bhash_size;
+extern int libxfs_buf_hugepages;	/* buffer data from huge pages */
 
 #define LIBXFS_BREAD	0x1
 #define LIBXFS_BWRITE	0x2
@@ -222,6 +326,9 @@ extern void	libxfs_iomove (xfs_buf_t *, uint, int, void *, int);
 static inline int
 xfs_buf_verify_cksum(struct xfs_buf *bp, unsigned long cksum_offset)
 {
+	/* whoever read the buffer in may have checked it already */
+	if (bp->b_crc_off == cksum_offset)
+		return true;
 	return xfs_verify_cksum(bp->b_addr, BBTOB(bp->b_length),
 				cksum_offset);
 }
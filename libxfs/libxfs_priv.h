@@ -77,9 +77,13 @@
 /* CRC stuff, buffer API dependent on it */
 extern uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len);
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
+extern void crc32c_le_multi(uint32_t *crc, unsigned char const * const *bufs,
+			    unsigned int nr, size_t offset, size_t len);
 
 #define crc32(c,p,l)	crc32_le((c),(unsigned char const *)(p),(l))
 #define crc32c(c,p,l)	crc32c_le((c),(unsigned char const *)(p),(l))
+#define crc32c_multi(c,b,n,o,l) \
+	crc32c_le_multi((c),(unsigned char const * const *)(b),(n),(o),(l))
 
 #include "xfs_cksum.h"
 
@@ -360,12 +364,8 @@ roundup_64(__uint64_t x, __uint32_t y)
 
 #define xfs_trans_buf_copy_type(dbp, sbp)
 
-/* no readahead, need to avoid set-but-unused var warnings. */
-#define xfs_buf_readahead(a,d,c,ops)		({	\
-	xfs_daddr_t __d = d;				\
-	__d = __d; /* no set-but-unused warning */	\
-})
-#define xfs_buf_readahead_map(a,b,c,ops)	((void) 0)	/* no readahead */
+#define xfs_buf_readahead(a,d,c,ops)		libxfs_buf_readahead(a,d,c,ops)
+#define xfs_buf_readahead_map(a,b,c,ops)	libxfs_buf_readahead_map(a,b,c,ops)
 #define xfs_buftrace(x,y)			((void) 0)	/* debug only */
 
 #define xfs_cmn_err(tag,level,mp,fmt,args...)	cmn_err(level,fmt, ## args)
@@ -472,6 +472,14 @@ void xfs_mount_common(struct xfs_mount *, struct xfs_sb *);
 void xfs_trans_init(struct xfs_mount *);
 int xfs_trans_roll(struct xfs_trans **, struct xfs_inode *);
 
+/* per-thread free lists of transaction structures, see trans.c */
+#define XFS_TRANS_CACHE_TRANS		0
+#define XFS_TRANS_CACHE_DESC		1
+#define XFS_TRANS_CACHE_BUF_ITEM	2
+#define XFS_TRANS_CACHE_NR		3
+void *xfs_trans_cache_zalloc(int);
+int xfs_trans_cache_free(int, void *);
+
 /* xfs_trans_item.c */
 void xfs_trans_add_item(struct xfs_trans *, struct xfs_log_item *);
 void xfs_trans_del_item(struct xfs_log_item *);
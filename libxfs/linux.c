@@ -24,6 +24,9 @@
 #include <sys/mount.h>
 #include <sys/ioctl.h>
 #include <sys/sysinfo.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include "libxfs_priv.h"
 #include "xfs_fs.h"
@@ -42,6 +45,19 @@ static int max_block_alignment;
 # define BLKSSZGET	_IO(0x12,104)
 #endif
 
+#ifndef BLKZEROOUT
+# define BLKZEROOUT	_IO(0x12,127)
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+# define FALLOC_FL_KEEP_SIZE	0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+# define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+# define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
 #ifndef RAMDISK_MAJOR
 #define RAMDISK_MAJOR	1	/* ramdisk major number */
 #endif
@@ -129,6 +145,60 @@ platform_flush_device(int fd, dev_t device)
 		ioctl(fd, BLKFLSBUF, 0);
 }
 
+/*
+ * Zero a range without writing zeroes to it, if the device or the
+ * filesystem holding the image file can do that.  Returns 0 if the range
+ * now reads back as zeroes, otherwise an error and the caller has to write
+ * the zeroes itself.
+ */
+int
+platform_zero_range(int fd, long long start, long long len)
+{
+	struct stat64	st;
+
+	if (fstat64(fd, &st) < 0)
+		return errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		__uint64_t range[2] = { start, len };
+
+		if (ioctl(fd, BLKZEROOUT, &range) < 0)
+			return errno;
+		return 0;
+	}
+	if (!S_ISREG(st.st_mode))
+		return EOPNOTSUPP;
+
+#ifdef HAVE_FALLOCATE
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE, start, len) == 0)
+		return 0;
+	/* a hole reads back as zeroes too, but can't extend the file */
+	if (start + len <= st.st_size &&
+	    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      start, len) == 0)
+		return 0;
+	return errno;
+#else
+	return EOPNOTSUPP;
+#endif
+}
+
+/*
+ * Allocate the blocks backing a range of a regular file ahead of writing
+ * it, so that they can be laid out in one go.  Returns 0 or an error.
+ */
+int
+platform_preallocate(int fd, long long start, long long len)
+{
+#ifdef HAVE_FALLOCATE
+	if (fallocate(fd, 0, start, len) == 0)
+		return 0;
+	return errno;
+#else
+	return EOPNOTSUPP;
+#endif
+}
+
 void
 platform_findsizes(char *path, int fd, long long *sz, int *bsz)
 {
@@ -231,3 +301,177 @@ platform_physmem(void)
 	}
 	return (si.totalram >> 10) * si.mem_unit;	/* kilobytes */
 }
+
+/*
+ * NUMA topology, read from sysfs the first time it is asked for.  Nodes are
+ * numbered densely from zero here even if the online node ids are not.
+ */
+static pthread_once_t	numa_once = PTHREAD_ONCE_INIT;
+static int		numa_nr_nodes;
+static cpu_set_t	*numa_cpus;		/* cpus of each node */
+
+static int
+numa_read_list(
+	const char	*path,
+	cpu_set_t	*set)
+{
+	FILE		*fp;
+	char		buf[4096];
+	char		*p;
+	long		first;
+	long		last;
+
+	CPU_ZERO(set);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!p)
+		return -1;
+
+	/* lists look like "0-3,8,10-11" */
+	while (*p && *p != '\n') {
+		first = last = strtol(p, &p, 10);
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		if (first < 0 || last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return -1;
+	}
+	return 0;
+}
+
+static void
+numa_init(void)
+{
+	cpu_set_t	online;
+	char		path[64];
+	int		nodes;
+	int		i;
+
+	numa_nr_nodes = 1;
+	if (numa_read_list("/sys/devices/system/node/online", &online))
+		return;
+	nodes = CPU_COUNT(&online);
+	if (nodes < 2)
+		return;
+	numa_cpus = calloc(nodes, sizeof(cpu_set_t));
+	if (!numa_cpus)
+		return;
+
+	nodes = 0;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &online))
+			continue;
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/node/node%d/cpulist", i);
+		/* skip memory only nodes, there is nothing to run there */
+		if (numa_read_list(path, &numa_cpus[nodes]) ||
+		    CPU_COUNT(&numa_cpus[nodes]) == 0)
+			continue;
+		nodes++;
+	}
+	if (nodes < 2) {
+		free(numa_cpus);
+		numa_cpus = NULL;
+		return;
+	}
+	numa_nr_nodes = nodes;
+}
+
+int
+platform_numa_nodes(void)
+{
+	pthread_once(&numa_once, numa_init);
+	return numa_nr_nodes;
+}
+
+int
+platform_numa_node(void)
+{
+	int		cpu;
+	int		i;
+
+	if (platform_numa_nodes() < 2)
+		return 0;
+	cpu = sched_getcpu();
+	for (i = 0; cpu >= 0 && i < numa_nr_nodes; i++)
+		if (CPU_ISSET(cpu, &numa_cpus[i]))
+			return i;
+	return -1;
+}
+
+int
+platform_numa_bind(
+	int		node)
+{
+	if (platform_numa_nodes() < 2)
+		return 0;
+	if (node < 0 || node >= numa_nr_nodes)
+		return EINVAL;
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+			&numa_cpus[node]);
+}
+
+/*
+ * Whether the device fd is on spins, and how many devices it is spread
+ * over, from sysfs.  For a file, it's the device of the filesystem the
+ * file is on.  Only what a device mapper or md device is built from is
+ * counted, not what those are built from in turn.  Returns -1 if sysfs
+ * doesn't say.
+ */
+int
+platform_device_topology(
+	int		fd,
+	int		*rotational,
+	int		*ndevs)
+{
+	struct stat64	st;
+	char		path[PATH_MAX];
+	char		*base;
+	FILE		*fp;
+	DIR		*dir;
+	struct dirent	*de;
+	dev_t		dev;
+	int		n;
+
+	if (fstat64(fd, &st) < 0)
+		return -1;
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	n = snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/",
+		     major(dev), minor(dev));
+	base = path + n;
+
+	/* a partition has no queue of its own, it's in the whole disk's */
+	strcpy(base, "queue/rotational");
+	fp = fopen(path, "r");
+	if (!fp) {
+		strcpy(base, "../queue/rotational");
+		fp = fopen(path, "r");
+	}
+	if (!fp)
+		return -1;
+	n = fscanf(fp, "%d", rotational);
+	fclose(fp);
+	if (n != 1)
+		return -1;
+
+	*ndevs = 0;
+	strcpy(base, "slaves");
+	dir = opendir(path);
+	if (dir) {
+		while ((de = readdir(dir)) != NULL)
+			if (de->d_name[0] != '.')
+				(*ndevs)++;
+		closedir(dir);
+	}
+	if (*ndevs == 0)
+		*ndevs = 1;
+	return 0;
+}
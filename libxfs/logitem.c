@@ -111,8 +111,12 @@ xfs_buf_item_init(
 		}
 	}
 
-	bip = (xfs_buf_log_item_t *)kmem_zone_zalloc(xfs_buf_item_zone,
-						    KM_SLEEP);
+	bip = xfs_trans_cache_zalloc(XFS_TRANS_CACHE_BUF_ITEM);
+	if (bip)
+		xfs_buf_item_zone->allocated++;
+	else
+		bip = (xfs_buf_log_item_t *)kmem_zone_zalloc(xfs_buf_item_zone,
+							    KM_SLEEP);
 #ifdef LI_DEBUG
 	fprintf(stderr, "adding buf item %p for not-logged buffer %p\n",
 		bip, bp);
@@ -0,0 +1,755 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "libxfs_priv.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_metadump.h"
+#include "mdump.h"
+
+/*
+ * A version 2 metadump ends with an index of its chunks, so the extent
+ * lists of all chunks can be read up front without touching the data.
+ * The extents are sorted by disk address and trimmed so that none of them
+ * overlap, a block that was dumped more than once is served from the
+ * copy written last just like xfs_mdrestore would leave it.  A chain of
+ * a full dump and its deltas is handled the same way, with the extents of
+ * each delta coming after those of the dumps before it.  Reads look the
+ * extents up with a binary search and copy from a small cache of
+ * decompressed chunks.
+ */
+#define MDUMP_CACHE_SIZE	16
+
+struct mdump_extent {
+	__uint64_t		daddr;
+	__uint32_t		len;		/* basic blocks */
+	__uint32_t		chunk;
+	__uint32_t		offset;		/* bytes into the chunk data */
+	__uint32_t		seq;		/* order in the dump */
+};
+
+struct mdump_chunk {
+	off64_t			offset;		/* of the payload in the dump */
+	__uint32_t		dlen;
+	__uint32_t		clen;
+	__uint8_t		compression;
+	int			file;
+};
+
+struct mdump_file {
+	int			fd;
+	char			*path;
+	__uint32_t		id;		/* crc32c of the index */
+	__uint32_t		nrefs;		/* dumps a delta is against */
+	__uint32_t		*refs;
+};
+
+struct mdump_cache {
+	__uint32_t		chunk;
+	unsigned long		used;
+	char			*data;
+};
+
+struct mdump {
+	struct mdump_file	*files;
+	int			nfiles;
+	int			own_fds;
+	long long		size;
+	struct mdump_extent	*extents;
+	__uint32_t		nextents;
+	struct mdump_chunk	*chunks;
+	__uint32_t		nchunks;
+	__uint32_t		max_dlen;
+	__uint32_t		max_clen;
+	char			*cbuf;
+	struct mdump_cache	cache[MDUMP_CACHE_SIZE];
+	unsigned long		clock;
+	pthread_mutex_t		lock;
+};
+
+static void
+mdump_read(
+	struct mdump_file	*f,
+	void			*buf,
+	size_t			len,
+	off64_t			offset)
+{
+	ssize_t			sts;
+
+	sts = pread64(f->fd, buf, len, offset);
+	if (sts == len)
+		return;
+	if (sts < 0)
+		fprintf(stderr, _("%s: read of metadump %s failed: %s\n"),
+			progname, f->path, strerror(errno));
+	else
+		fprintf(stderr, _("%s: metadump %s is truncated\n"),
+			progname, f->path);
+	exit(1);
+}
+
+static void
+mdump_corrupt(
+	struct mdump_file	*f,
+	const char		*what)
+{
+	fprintf(stderr, _("%s: metadump %s is corrupt: %s\n"),
+		progname, f->path, what);
+	exit(1);
+}
+
+static void
+mdump_nomem(void)
+{
+	fprintf(stderr, _("%s: can't allocate metadump extent table\n"),
+		progname);
+	exit(1);
+}
+
+static int
+mdump_extent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct mdump_extent *ea = a;
+	const struct mdump_extent *eb = b;
+
+	if (ea->daddr != eb->daddr)
+		return ea->daddr < eb->daddr ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return ea->seq < eb->seq ? -1 : 1;
+	return 0;
+}
+
+static void
+mdump_extent_trim(
+	struct mdump_extent	*ext,
+	__uint64_t		start)
+{
+	__uint32_t		skip = start - ext->daddr;
+
+	ext->daddr = start;
+	ext->len -= skip;
+	ext->offset += skip << BBSHIFT;
+}
+
+/*
+ * Make the sorted extent list disjoint, keeping the newer copy where two
+ * extents overlap.  Trimming the start of an extent can put it out of
+ * order, and splitting one leaves a tail to be sorted back in, so go
+ * around until a pass finds nothing to do.  A sane dump has no overlaps
+ * at all and gets away with a single pass.
+ */
+static void
+mdump_resolve_overlaps(
+	struct mdump		*md)
+{
+	struct mdump_extent	*e;
+	struct mdump_extent	*tails;
+	__uint32_t		ntails;
+	__uint32_t		i, j;
+	int			changed;
+
+	do {
+		e = md->extents;
+		qsort(e, md->nextents, sizeof(*e), mdump_extent_cmp);
+
+		tails = NULL;
+		ntails = 0;
+		changed = 0;
+		for (i = 1, j = 0; i < md->nextents; i++) {
+			struct mdump_extent	*a = &e[j];
+			struct mdump_extent	b = e[i];
+			__uint64_t		a_end = a->daddr + a->len;
+			__uint64_t		b_end = b.daddr + b.len;
+
+			if (b.daddr >= a_end) {
+				e[++j] = b;
+				continue;
+			}
+			changed = 1;
+			if (b.daddr < a->daddr) {
+				/* a was trimmed out of order, next pass */
+				e[++j] = b;
+				continue;
+			}
+			if (a->seq > b.seq) {
+				/* the later copy is in a, keep b's tail */
+				if (b_end > a_end) {
+					mdump_extent_trim(&b, a_end);
+					e[++j] = b;
+				}
+				continue;
+			}
+			/* the later copy is in b, keep the ends of a */
+			if (a_end > b_end) {
+				tails = realloc(tails,
+						(ntails + 1) * sizeof(*tails));
+				if (!tails)
+					mdump_nomem();
+				tails[ntails] = *a;
+				mdump_extent_trim(&tails[ntails], b_end);
+				ntails++;
+			}
+			a->len = b.daddr - a->daddr;
+			if (a->len)
+				j++;
+			e[j] = b;
+		}
+		md->nextents = md->nextents ? j + 1 : 0;
+
+		if (ntails) {
+			e = realloc(md->extents,
+				    (md->nextents + ntails) * sizeof(*e));
+			if (!e)
+				mdump_nomem();
+			memcpy(&e[md->nextents], tails, ntails * sizeof(*e));
+			md->extents = e;
+			md->nextents += ntails;
+			free(tails);
+		}
+	} while (changed);
+}
+
+/*
+ * Read the index at the end of a dump and the chunk headers it points to,
+ * leaving the chunk payloads for later.  The chunks come after data_start.
+ */
+static void
+mdump_load_index(
+	struct mdump		*md,
+	int			file,
+	off64_t			data_start,
+	off64_t			dump_size)
+{
+	struct mdump_file	*f = &md->files[file];
+	xfs_md2_tail_t		tail;
+	xfs_md2_index_hdr_t	ihdr;
+	xfs_md2_index_t		*index;
+	xfs_md2_chunk_t		chdr;
+	xfs_md2_extent_t	*ext;
+	__uint64_t		count;
+	__uint32_t		i, k;
+	__uint32_t		nextents;
+	__uint32_t		off;
+	off64_t			ioff;
+
+	if (dump_size < data_start + sizeof(tail))
+		goto incomplete;
+	mdump_read(f, &tail, sizeof(tail), dump_size - sizeof(tail));
+	if (be32_to_cpu(tail.mt_magic) != XFS_MD2_TAIL_MAGIC)
+		goto incomplete;
+
+	ioff = be64_to_cpu(tail.mt_index);
+	if (ioff < data_start ||
+	    ioff + sizeof(ihdr) > dump_size - sizeof(tail))
+		mdump_corrupt(f, _("bad index offset"));
+	mdump_read(f, &ihdr, sizeof(ihdr), ioff);
+	if (be32_to_cpu(ihdr.mi_magic) != XFS_MD2_INDEX_MAGIC)
+		mdump_corrupt(f, _("bad index magic"));
+	count = be64_to_cpu(ihdr.mi_count);
+	if (count * sizeof(*index) !=
+	    dump_size - sizeof(tail) - ioff - sizeof(ihdr))
+		mdump_corrupt(f, _("bad index size"));
+
+	index = malloc(count * sizeof(*index));
+	md->chunks = realloc(md->chunks,
+			     (md->nchunks + count) * sizeof(*md->chunks));
+	ext = malloc((XFS_MD2_MAX_CHUNK >> BBSHIFT) * sizeof(*ext));
+	if ((count && (!index || !md->chunks)) || !ext)
+		mdump_nomem();
+	mdump_read(f, index, count * sizeof(*index), ioff + sizeof(ihdr));
+	f->id = crc32c(crc32c(~0U, &ihdr, sizeof(ihdr)), index,
+		       count * sizeof(*index));
+
+	for (i = 0; i < count; i++) {
+		struct mdump_chunk	*c = &md->chunks[md->nchunks];
+		off64_t			coff = be64_to_cpu(index[i].mi_offset);
+
+		if (coff < data_start || coff + sizeof(chdr) > ioff)
+			mdump_corrupt(f, _("bad chunk offset"));
+		mdump_read(f, &chdr, sizeof(chdr), coff);
+		nextents = be32_to_cpu(chdr.mc_nextents);
+		c->dlen = be32_to_cpu(chdr.mc_dlen);
+		c->clen = be32_to_cpu(chdr.mc_clen);
+		c->compression = chdr.mc_compression;
+		c->offset = coff + sizeof(chdr) + nextents * sizeof(*ext);
+		c->file = file;
+		if (be32_to_cpu(chdr.mc_magic) != XFS_MD2_CHUNK_MAGIC ||
+		    c->dlen > XFS_MD2_MAX_CHUNK || (c->dlen & (BBSIZE - 1)) ||
+		    nextents > (c->dlen >> BBSHIFT) ||
+		    c->offset + c->clen > ioff ||
+		    (c->compression == XFS_MD2_COMP_NONE &&
+		     c->clen != c->dlen) ||
+		    (c->compression == XFS_MD2_COMP_ZERO && c->clen != 0))
+			mdump_corrupt(f, _("bad chunk header"));
+		switch (c->compression) {
+		case XFS_MD2_COMP_NONE:
+		case XFS_MD2_COMP_ZERO:
+#ifdef HAVE_ZLIB
+		case XFS_MD2_COMP_ZLIB:
+#endif
+			break;
+		default:
+			fprintf(stderr,
+	_("%s: metadump %s uses unsupported compression type %u\n"),
+				progname, f->path, c->compression);
+			exit(1);
+		}
+		md->max_dlen = MAX(md->max_dlen, c->dlen);
+		md->max_clen = MAX(md->max_clen, c->clen);
+
+		mdump_read(f, ext, nextents * sizeof(*ext),
+			   coff + sizeof(chdr));
+		md->extents = realloc(md->extents, (md->nextents + nextents) *
+						   sizeof(*md->extents));
+		if (nextents && !md->extents)
+			mdump_nomem();
+		for (k = 0, off = 0; k < nextents; k++) {
+			struct mdump_extent *e = &md->extents[md->nextents];
+			__uint32_t	len = be32_to_cpu(ext[k].me_len);
+
+			if (len == 0 || off + (len << BBSHIFT) > c->dlen)
+				mdump_corrupt(f, _("bad extent length"));
+			e->daddr = be64_to_cpu(ext[k].me_daddr);
+			e->len = len;
+			e->chunk = md->nchunks;
+			e->offset = off;
+			e->seq = md->nextents++;
+			off += len << BBSHIFT;
+		}
+		md->nchunks++;
+	}
+	free(ext);
+	free(index);
+	return;
+
+incomplete:
+	fprintf(stderr,
+	_("%s: metadump %s is incomplete, it can only be restored with xfs_mdrestore\n"),
+		progname, f->path);
+	exit(1);
+}
+
+/*
+ * Returns the cached copy of the chunk, reading and decompressing it into
+ * the least recently used slot if it isn't there.  Called with the lock
+ * held.
+ */
+static char *
+mdump_get_chunk(
+	struct mdump		*md,
+	__uint32_t		chunk)
+{
+	struct mdump_chunk	*c = &md->chunks[chunk];
+	struct mdump_cache	*victim = &md->cache[0];
+	int			fd = md->files[c->file].fd;
+	ssize_t			sts;
+	int			i;
+
+	for (i = 0; i < MDUMP_CACHE_SIZE; i++) {
+		struct mdump_cache	*ce = &md->cache[i];
+
+		if (ce->data && ce->chunk == chunk) {
+			ce->used = ++md->clock;
+			return ce->data;
+		}
+		if (ce->used < victim->used)
+			victim = ce;
+	}
+
+	if (!victim->data) {
+		victim->data = malloc(md->max_dlen);
+		if (!victim->data) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	victim->used = 0;
+
+	if (c->compression == XFS_MD2_COMP_NONE) {
+		sts = pread64(fd, victim->data, c->dlen, c->offset);
+		if (sts != c->dlen)
+			goto eio;
+	}
+#ifdef HAVE_ZLIB
+	else {
+		uLongf		dlen = c->dlen;
+
+		sts = pread64(fd, md->cbuf, c->clen, c->offset);
+		if (sts != c->clen)
+			goto eio;
+		if (uncompress((Bytef *)victim->data, &dlen,
+			       (Bytef *)md->cbuf, c->clen) != Z_OK ||
+		    dlen != c->dlen) {
+			fprintf(stderr,
+			_("%s: metadump %s: chunk %u doesn't decompress\n"),
+				progname, md->files[c->file].path, chunk);
+			errno = EIO;
+			return NULL;
+		}
+	}
+#endif
+	victim->chunk = chunk;
+	victim->used = ++md->clock;
+	return victim->data;
+
+eio:
+	if (sts >= 0)
+		errno = EIO;
+	return NULL;
+}
+
+ssize_t
+mdump_pread(
+	struct mdump		*md,
+	void			*buf,
+	size_t			len,
+	off64_t			offset)
+{
+	char			*p = buf;
+	off64_t			pos = offset;
+	off64_t			end;
+	__uint32_t		lo, hi, mid;
+
+	if (offset >= md->size)
+		return 0;
+	end = MIN(offset + (off64_t)len, md->size);
+
+	pthread_mutex_lock(&md->lock);
+	while (pos < end) {
+		struct mdump_extent	*e = NULL;
+		__uint64_t		daddr = pos >> BBSHIFT;
+		off64_t			e_start, e_end;
+		size_t			n;
+		char			*data;
+
+		/* first extent ending after daddr */
+		lo = 0;
+		hi = md->nextents;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (md->extents[mid].daddr + md->extents[mid].len <= daddr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < md->nextents)
+			e = &md->extents[lo];
+
+		if (!e || (off64_t)(e->daddr << BBSHIFT) >= end) {
+			memset(p, 0, end - pos);
+			p += end - pos;
+			break;
+		}
+		e_start = e->daddr << BBSHIFT;
+		e_end = e_start + ((off64_t)e->len << BBSHIFT);
+		if (pos < e_start) {
+			memset(p, 0, e_start - pos);
+			p += e_start - pos;
+			pos = e_start;
+		}
+
+		n = MIN(end, e_end) - pos;
+		if (md->chunks[e->chunk].compression == XFS_MD2_COMP_ZERO) {
+			memset(p, 0, n);
+		} else {
+			data = mdump_get_chunk(md, e->chunk);
+			if (!data) {
+				pthread_mutex_unlock(&md->lock);
+				return -1;
+			}
+			memcpy(p, data + e->offset + (pos - e_start), n);
+		}
+		p += n;
+		pos += n;
+	}
+	pthread_mutex_unlock(&md->lock);
+	return p - (char *)buf;
+}
+
+long long
+mdump_size(
+	struct mdump		*md)
+{
+	return md->size;
+}
+
+int
+mdump_nfiles(
+	struct mdump		*md)
+{
+	return md->nfiles;
+}
+
+__uint32_t
+mdump_file_id(
+	struct mdump		*md,
+	int			file)
+{
+	return md->files[file].id;
+}
+
+/*
+ * The i'th extent of the disk address sorted, disjoint extent list.
+ * Returns 1 for blocks with data in the dump, 0 for blocks a delta has
+ * zeroed and -1 past the last extent.
+ */
+int
+mdump_extent(
+	struct mdump		*md,
+	__uint32_t		i,
+	__uint64_t		*daddr,
+	__uint32_t		*len)
+{
+	if (i >= md->nextents)
+		return -1;
+	*daddr = md->extents[i].daddr;
+	*len = md->extents[i].len;
+	return md->chunks[md->extents[i].chunk].compression !=
+			XFS_MD2_COMP_ZERO;
+}
+
+/*
+ * Check the header of a dump and load its index.  Returns 0 if the file
+ * isn't a version 2 metadump, anything else wrong with it is fatal.
+ */
+static int
+mdump_add_file(
+	struct mdump		*md,
+	int			fd,
+	char			*path)
+{
+	struct mdump_file	*f;
+	struct stat64		st;
+	xfs_md2_hdr_t		hdr;
+	xfs_md2_delta_t		delta;
+	off64_t			data_start = sizeof(hdr);
+	__uint32_t		i;
+	int			flags;
+
+	if (fstat64(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	/* the header and index reads are nowhere near sector aligned */
+	flags = fcntl(fd, F_GETFL);
+	if (flags >= 0 && (flags & O_DIRECT))
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+	if (pread64(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto not_mdump;
+	if (be32_to_cpu(hdr.mh_magic) == XFS_MD_MAGIC) {
+		fprintf(stderr,
+	_("%s: %s is a version 1 metadump, restore it with xfs_mdrestore first\n"),
+			progname, path);
+		exit(1);
+	}
+	if (be32_to_cpu(hdr.mh_magic) != XFS_MD2_MAGIC)
+		goto not_mdump;
+	if (be32_to_cpu(hdr.mh_version) != XFS_MD2_VERSION ||
+	    hdr.mh_blocklog != BBSHIFT) {
+		fprintf(stderr, _("%s: metadump %s has unsupported version %u\n"),
+			progname, path, be32_to_cpu(hdr.mh_version));
+		exit(1);
+	}
+
+	f = realloc(md->files, (md->nfiles + 1) * sizeof(*f));
+	if (!f)
+		mdump_nomem();
+	md->files = f;
+	f = &md->files[md->nfiles];
+	memset(f, 0, sizeof(*f));
+	f->fd = fd;
+	f->path = path;
+
+	if (be32_to_cpu(hdr.mh_flags) & XFS_MD2_FLAG_DELTA) {
+		mdump_read(f, &delta, sizeof(delta), data_start);
+		f->nrefs = be32_to_cpu(delta.md_count);
+		if (be32_to_cpu(delta.md_magic) != XFS_MD2_DELTA_MAGIC ||
+		    f->nrefs == 0 || f->nrefs > XFS_MD2_MAX_CHAIN)
+			mdump_corrupt(f, _("bad delta header"));
+		f->refs = malloc(f->nrefs * sizeof(*f->refs));
+		if (!f->refs)
+			mdump_nomem();
+		mdump_read(f, f->refs, f->nrefs * sizeof(*f->refs),
+			   data_start + sizeof(delta));
+		for (i = 0; i < f->nrefs; i++)
+			f->refs[i] = be32_to_cpu(f->refs[i]);
+		data_start += sizeof(delta) + f->nrefs * sizeof(*f->refs);
+	}
+
+	mdump_load_index(md, md->nfiles++, data_start, st.st_size);
+	return 1;
+
+not_mdump:
+	if (flags >= 0 && (flags & O_DIRECT))
+		fcntl(fd, F_SETFL, flags);
+	return 0;
+}
+
+static struct mdump *
+mdump_alloc(void)
+{
+	struct mdump		*md;
+
+	md = calloc(1, sizeof(*md));
+	if (!md) {
+		fprintf(stderr, _("%s: can't allocate metadump state\n"),
+			progname);
+		exit(1);
+	}
+	pthread_mutex_init(&md->lock, NULL);
+	return md;
+}
+
+/* all extents are loaded, get them and everything else ready for reads */
+static void
+mdump_setup(
+	struct mdump		*md)
+{
+	xfs_dsb_t		*sb;
+	char			sbuf[BBSIZE];
+
+	mdump_resolve_overlaps(md);
+	if (md->max_clen) {
+		md->cbuf = malloc(md->max_clen);
+		if (!md->cbuf) {
+			fprintf(stderr,
+				_("%s: can't allocate metadump buffer\n"),
+				progname);
+			exit(1);
+		}
+	}
+
+	/*
+	 * The device is as big as the filesystem in it, or failing a
+	 * superblock to tell, as far as the last block dumped.
+	 */
+	if (md->nextents) {
+		struct mdump_extent *last = &md->extents[md->nextents - 1];
+
+		md->size = (last->daddr + last->len) << BBSHIFT;
+	}
+	if (mdump_pread(md, sbuf, sizeof(sbuf), 0) == sizeof(sbuf)) {
+		sb = (xfs_dsb_t *)sbuf;
+		if (be32_to_cpu(sb->sb_magicnum) == XFS_SB_MAGIC)
+			md->size = MAX(md->size,
+				(long long)be64_to_cpu(sb->sb_dblocks) *
+					be32_to_cpu(sb->sb_blocksize));
+	}
+}
+
+/*
+ * Returns NULL if the file isn't a version 2 metadump.  A dump that is
+ * unusable for some other reason is fatal, like any other open failure.
+ */
+struct mdump *
+mdump_open(
+	int			fd,
+	char			*path)
+{
+	struct mdump		*md = mdump_alloc();
+
+	if (!mdump_add_file(md, fd, path)) {
+		mdump_close(md);
+		return NULL;
+	}
+	if (md->files[0].nrefs) {
+		fprintf(stderr,
+	_("%s: %s is a delta metadump, it can only be restored with xfs_mdrestore\n"),
+			progname, path);
+		exit(1);
+	}
+	mdump_setup(md);
+	return md;
+}
+
+/*
+ * Open a full dump and the deltas taken against it, in the order they were
+ * taken.  Each delta has to be against exactly the dumps before it.
+ */
+struct mdump *
+mdump_open_chain(
+	int			nfiles,
+	char			**paths)
+{
+	struct mdump		*md = mdump_alloc();
+	struct mdump_file	*f;
+	int			fd;
+	int			i, j;
+
+	md->own_fds = 1;
+	for (i = 0; i < nfiles; i++) {
+		fd = open(paths[i], O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, _("%s: cannot open %s: %s\n"),
+				progname, paths[i], strerror(errno));
+			exit(1);
+		}
+		if (!mdump_add_file(md, fd, paths[i])) {
+			fprintf(stderr,
+				_("%s: %s is not a version 2 metadump\n"),
+				progname, paths[i]);
+			exit(1);
+		}
+
+		f = &md->files[i];
+		if (i == 0 && f->nrefs) {
+			fprintf(stderr,
+		_("%s: %s is a delta metadump, the chain has to start with a full dump\n"),
+				progname, f->path);
+			exit(1);
+		}
+		for (j = 0; i && j < i; j++)
+			if (f->nrefs != i || f->refs[j] != md->files[j].id)
+				break;
+		if (i && j < i) {
+			fprintf(stderr,
+		_("%s: %s was not taken against the dumps given before it\n"),
+				progname, f->path);
+			exit(1);
+		}
+	}
+	mdump_setup(md);
+	return md;
+}
+
+void
+mdump_close(
+	struct mdump		*md)
+{
+	int			i;
+
+	for (i = 0; i < MDUMP_CACHE_SIZE; i++)
+		free(md->cache[i].data);
+	for (i = 0; i < md->nfiles; i++) {
+		if (md->own_fds)
+			close(md->files[i].fd);
+		free(md->files[i].refs);
+	}
+	pthread_mutex_destroy(&md->lock);
+	free(md->files);
+	free(md->cbuf);
+	free(md->chunks);
+	free(md->extents);
+	free(md);
+}
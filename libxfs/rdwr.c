@@ -16,6 +16,9 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <aio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "libxfs_priv.h"
 #include "init.h"
@@ -31,6 +34,7 @@
 #include "xfs_trans.h"
 
 #include "libxfs.h"		/* for LIBXFS_EXIT_ON_FAILURE */
+#include "xfs_probe.h"
 
 /*
  * Important design/architecture note:
@@ -75,6 +79,19 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 	char		*z;
 	int		fd;
 
+	if (!len)
+		return;
+	fd = libxfs_device_to_fd(btp->dev);
+	start_offset = LIBXFS_BBTOOFF64(start);
+	end_offset = LIBXFS_BBTOOFF64(start + len) - start_offset;
+
+	/*
+	 * Let the device or the filesystem under the image file zero the
+	 * range if it can, that saves writing out all the zeroes.
+	 */
+	if (!platform_zero_range(fd, start_offset, end_offset))
+		return;
+
 	zsize = min(BDSTRAT_SIZE, BBTOB(len));
 	if ((z = memalign(libxfs_device_alignment(), zsize)) == NULL) {
 		fprintf(stderr,
@@ -84,9 +101,6 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 	}
 	memset(z, 0, zsize);
 
-	fd = libxfs_device_to_fd(btp->dev);
-	start_offset = LIBXFS_BBTOOFF64(start);
-
 	if ((lseek64(fd, start_offset, SEEK_SET)) < 0) {
 		fprintf(stderr, _("%s: %s seek to offset %llu failed: %s\n"),
 			progname, __FUNCTION__,
@@ -94,7 +108,6 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 		exit(1);
 	}
 
-	end_offset = LIBXFS_BBTOOFF64(start + len) - start_offset;
 	for (offset = 0; offset < end_offset; ) {
 		bytes = min((ssize_t)(end_offset - offset), zsize);
 		if ((bytes = write(fd, z, bytes)) < 0) {
@@ -337,9 +350,304 @@ libxfs_getsb(xfs_mount_t *mp, int flags)
 
 kmem_zone_t			*xfs_buf_zone;
 
-static struct cache_mru		xfs_buf_freelist =
-	{{&xfs_buf_freelist.cm_list, &xfs_buf_freelist.cm_list},
-	 0, PTHREAD_MUTEX_INITIALIZER };
+/*
+ * Image files that are only read can be mapped instead of copied into a
+ * private buffer.  Each buffer gets its own MAP_PRIVATE mapping of the
+ * blocks it covers, so the data comes straight from the page cache, and
+ * anything that modifies the buffer in memory only copies the pages it
+ * touches.  Those changes go away with the mapping when the buffer is
+ * released, so a buffer read again later sees what is on disk just as it
+ * would with pread.  Discontiguous buffers, buffers beyond the end of the
+ * file and mappings that fail are read the normal way.
+ */
+void
+libxfs_buftarg_setup_mmap(
+	struct xfs_buftarg	*btp)
+{
+	int			fd = libxfs_device_to_fd(btp->dev);
+	struct stat64		st;
+	int			flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || (flags & O_ACCMODE) != O_RDONLY || (flags & O_DIRECT))
+		return;
+	if (libxfs_device_is_metadump(btp->dev))
+		return;
+	if (fstat64(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+	btp->bt_size = st.st_size;
+	btp->bt_flags |= LIBXFS_BT_MMAP;
+}
+
+static void xfs_buf_data_free(void *p, unsigned int bytes);
+
+static int
+__map_buf(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		*bp)
+{
+	off64_t			offset = LIBXFS_BBTOOFF64(bp->b_bn);
+	off64_t			delta;
+	char			*addr;
+
+	if (!(btp->bt_flags & LIBXFS_BT_MMAP) ||
+	    (bp->b_flags & LIBXFS_B_DISCONTIG) ||
+	    bp->b_target != btp ||
+	    offset + bp->b_bcount > btp->bt_size)
+		return -1;
+
+	delta = offset & (getpagesize() - 1);
+	addr = mmap(NULL, delta + bp->b_bcount, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, libxfs_device_to_fd(btp->dev), offset - delta);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	if (bp->b_flags & LIBXFS_B_MAPPED)
+		munmap((char *)bp->b_addr - delta, delta + bp->b_bcount);
+	else
+		xfs_buf_data_free(bp->b_addr, bp->b_bcount);
+	bp->b_addr = addr + delta;
+	bp->b_flags |= LIBXFS_B_MAPPED | LIBXFS_B_UPTODATE;
+	libxfs_iostats_add(0, bp->b_bcount);
+	return 0;
+}
+
+static void
+__unmap_buf(
+	struct xfs_buf		*bp)
+{
+	size_t			delta;
+
+	delta = (unsigned long)bp->b_addr & (getpagesize() - 1);
+	munmap((char *)bp->b_addr - delta, delta + bp->b_bcount);
+	bp->b_addr = NULL;
+	bp->b_flags &= ~LIBXFS_B_MAPPED;
+}
+
+/*
+ * Buffers released by the cache are kept for reuse rather than freed.  They
+ * are sorted into free lists by size in basic blocks so that a buffer of the
+ * size we want can be found without searching, and its data can be reused
+ * as is.  Buffers larger than the largest class, and discontiguous buffers
+ * whose maps can't be reused, go on the catch-all list at class zero.
+ */
+#define XFS_BUF_FREE_CLASSES	(BTOBB(XFS_MAX_BLOCKSIZE) + 1)
+
+/*
+ * Buffer headers are never freed, so allocate them in chunks rather than
+ * one at a time.
+ */
+#define XFS_BUF_SLAB_COUNT	64
+
+static struct xfs_buf_freelist {
+	pthread_mutex_t		bf_mutex;
+	pthread_once_t		bf_once;
+	struct list_head	bf_lists[XFS_BUF_FREE_CLASSES];
+	unsigned int		bf_count;	/* buffers on the free lists */
+	xfs_buf_t		*bf_slab;	/* unused headers */
+	unsigned int		bf_slab_count;	/* headers left in slab */
+	unsigned long long	bf_allocs;	/* headers allocated */
+	unsigned long long	bf_reused;	/* reused with data as is */
+	unsigned long long	bf_recycled;	/* reused with new data */
+} xfs_buf_freelist = {
+	.bf_mutex	= PTHREAD_MUTEX_INITIALIZER,
+	.bf_once	= PTHREAD_ONCE_INIT,
+};
+
+/*
+ * Buffer data can be allocated from 2MB arenas backed by huge pages rather
+ * than with memalign, to cut down on TLB misses when the cache holds a lot
+ * of blocks.  Each arena is carved into slots for one buffer size class,
+ * freed data goes back on the free slots of its class, and just like the
+ * buffer headers the arenas are never freed.  If no arena can be had, the
+ * data is allocated with memalign and kept on the free slots when freed,
+ * so a class never mixes the two ways of freeing.  Whether the arenas are
+ * used is decided at the first allocation.
+ */
+int	libxfs_buf_hugepages;
+
+#define XFS_BUF_ARENA_SIZE	(2 * 1024 * 1024)
+
+static struct xfs_buf_pool {
+	pthread_mutex_t		bp_mutex;
+	void			*bp_free;	/* free slots, linked through
+						   their first word */
+	char			*bp_next;	/* unused part of the arena */
+	char			*bp_end;
+	unsigned int		bp_slotsize;
+} xfs_buf_pools[XFS_BUF_FREE_CLASSES];
+
+static pthread_once_t		xfs_buf_pool_once = PTHREAD_ONCE_INIT;
+static int			xfs_buf_pool_enabled;
+
+static void
+xfs_buf_pool_init(void)
+{
+	unsigned int		align = libxfs_device_alignment();
+	int			i;
+
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+	xfs_buf_pool_enabled = libxfs_buf_hugepages;
+#endif
+	for (i = 1; i < XFS_BUF_FREE_CLASSES; i++) {
+		pthread_mutex_init(&xfs_buf_pools[i].bp_mutex, NULL);
+		xfs_buf_pools[i].bp_slotsize = roundup(BBTOB(i), align);
+	}
+}
+
+/*
+ * Get an arena from the reserved huge pages, or failing that a 2MB aligned
+ * chunk of memory that transparent huge pages can back.
+ */
+static char *
+xfs_buf_arena_alloc(void)
+{
+	char			*p;
+	char			*arena;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, XFS_BUF_ARENA_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+#endif
+#ifdef MADV_HUGEPAGE
+	p = mmap(NULL, 2 * XFS_BUF_ARENA_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	arena = (char *)roundup((unsigned long)p, XFS_BUF_ARENA_SIZE);
+	if (arena > p)
+		munmap(p, arena - p);
+	munmap(arena + XFS_BUF_ARENA_SIZE,
+	       p + XFS_BUF_ARENA_SIZE - arena);
+	madvise(arena, XFS_BUF_ARENA_SIZE, MADV_HUGEPAGE);
+	return arena;
+#else
+	return NULL;
+#endif
+}
+
+/* the pool a buffer data size comes from, or NULL for memalign */
+static inline struct xfs_buf_pool *
+xfs_buf_pool(
+	unsigned int		bytes)
+{
+	pthread_once(&xfs_buf_pool_once, xfs_buf_pool_init);
+	if (!xfs_buf_pool_enabled || !bytes || bytes > XFS_MAX_BLOCKSIZE ||
+	    BBTOB(BTOBB(bytes)) != bytes)
+		return NULL;
+	return &xfs_buf_pools[BTOBB(bytes)];
+}
+
+static void *
+xfs_buf_data_alloc(
+	unsigned int		bytes)
+{
+	struct xfs_buf_pool	*pool = xfs_buf_pool(bytes);
+	char			*arena;
+	void			*p;
+
+	if (!pool)
+		return memalign(libxfs_device_alignment(), bytes);
+
+	pthread_mutex_lock(&pool->bp_mutex);
+	p = pool->bp_free;
+	if (p) {
+		pool->bp_free = *(void **)p;
+		goto out;
+	}
+	if (pool->bp_next + pool->bp_slotsize > pool->bp_end) {
+		arena = xfs_buf_arena_alloc();
+		if (!arena) {
+			p = memalign(libxfs_device_alignment(), bytes);
+			goto out;
+		}
+		pool->bp_next = arena;
+		pool->bp_end = arena + XFS_BUF_ARENA_SIZE;
+	}
+	p = pool->bp_next;
+	pool->bp_next += pool->bp_slotsize;
+out:
+	pthread_mutex_unlock(&pool->bp_mutex);
+	return p;
+}
+
+static void
+xfs_buf_data_free(
+	void			*p,
+	unsigned int		bytes)
+{
+	struct xfs_buf_pool	*pool;
+
+	if (!p)
+		return;
+	pool = xfs_buf_pool(bytes);
+	if (!pool) {
+		free(p);
+		return;
+	}
+	pthread_mutex_lock(&pool->bp_mutex);
+	*(void **)p = pool->bp_free;
+	pool->bp_free = p;
+	pthread_mutex_unlock(&pool->bp_mutex);
+}
+
+static void
+xfs_buf_freelist_init(void)
+{
+	int			i;
+
+	for (i = 0; i < XFS_BUF_FREE_CLASSES; i++)
+		list_head_init(&xfs_buf_freelist.bf_lists[i]);
+}
+
+static inline int
+xfs_buf_free_class(
+	xfs_buf_t		*bp)
+{
+	if (bp->b_map || bp->b_bcount > XFS_MAX_BLOCKSIZE)
+		return 0;
+	return BTOBB(bp->b_bcount);
+}
+
+/*
+ * Put a buffer on its free list.  Caller holds the free list lock.
+ */
+static void
+xfs_buf_free_add(
+	xfs_buf_t		*bp)
+{
+	if (bp->b_flags & LIBXFS_B_MAPPED)
+		__unmap_buf(bp);
+	list_add(&bp->b_node.cn_mru,
+		 &xfs_buf_freelist.bf_lists[xfs_buf_free_class(bp)]);
+	xfs_buf_freelist.bf_count++;
+}
+
+/*
+ * Carve a new buffer header out of the current slab.  Caller holds the free
+ * list lock.
+ */
+static xfs_buf_t *
+xfs_buf_slab_alloc(void)
+{
+	if (!xfs_buf_freelist.bf_slab_count) {
+		xfs_buf_freelist.bf_slab = calloc(XFS_BUF_SLAB_COUNT,
+						  xfs_buf_zone->zone_unitsize);
+		if (!xfs_buf_freelist.bf_slab) {
+			fprintf(stderr,
+				_("%s: %s can't allocate buffer headers: %s\n"),
+				progname, __FUNCTION__, strerror(errno));
+			exit(1);
+		}
+		xfs_buf_freelist.bf_slab_count = XFS_BUF_SLAB_COUNT;
+	}
+	xfs_buf_freelist.bf_slab_count--;
+	xfs_buf_freelist.bf_allocs++;
+	xfs_buf_zone->allocated++;
+	return xfs_buf_freelist.bf_slab++;
+}
 
 /*
  * The bufkey is used to pass the new buffer information to the cache object
@@ -355,6 +663,7 @@ struct xfs_bufkey {
 	unsigned int		bblen;
 	struct xfs_buf_map	*map;
 	int			nmaps;
+	int			readahead;	/* new buffer is read ahead */
 };
 
 /*  2^63 + 2^61 - 2^57 + 2^54 - 2^51 - 2^18 + 1 */
@@ -416,7 +725,7 @@ __initbuf(xfs_buf_t *bp, struct xfs_buftarg *btp, xfs_daddr_t bno,
 	bp->b_target = btp;
 	bp->b_error = 0;
 	if (!bp->b_addr)
-		bp->b_addr = memalign(libxfs_device_alignment(), bytes);
+		bp->b_addr = xfs_buf_data_alloc(bytes);
 	if (!bp->b_addr) {
 		fprintf(stderr,
 			_("%s: %s can't memalign %u bytes: %s\n"),
@@ -432,6 +741,7 @@ __initbuf(xfs_buf_t *bp, struct xfs_buftarg *btp, xfs_daddr_t bno,
 	bp->b_holder = 0;
 	bp->b_recur = 0;
 	bp->b_ops = NULL;
+	bp->b_crc_off = 0;
 }
 
 static void
@@ -473,7 +783,14 @@ libxfs_initbuf_map(xfs_buf_t *bp, struct xfs_buftarg *btp,
 xfs_buf_t *
 __libxfs_getbufr(int blen)
 {
-	xfs_buf_t	*bp;
+	struct list_head	*head;
+	xfs_buf_t		*bp;
+	int			class = 0;
+	int			i;
+
+	pthread_once(&xfs_buf_freelist.bf_once, xfs_buf_freelist_init);
+	if (blen <= XFS_MAX_BLOCKSIZE)
+		class = BTOBB(blen);
 
 	/*
 	 * first look for a buffer that can be used as-is,
@@ -481,28 +798,42 @@ __libxfs_getbufr(int blen)
 	 * and if so, free its buffer and set b_addr to NULL
 	 * before calling libxfs_initbuf.
 	 */
-	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-	if (!list_empty(&xfs_buf_freelist.cm_list)) {
-		list_for_each_entry(bp, &xfs_buf_freelist.cm_list, b_node.cn_mru) {
-			if (bp->b_bcount == blen) {
-				list_del_init(&bp->b_node.cn_mru);
-				break;
-			}
-		}
-		if (&bp->b_node.cn_mru == &xfs_buf_freelist.cm_list) {
-			bp = list_entry(xfs_buf_freelist.cm_list.next,
-					xfs_buf_t, b_node.cn_mru);
-			list_del_init(&bp->b_node.cn_mru);
-			free(bp->b_addr);
-			bp->b_addr = NULL;
-			free(bp->b_map);
-			bp->b_map = NULL;
-		}
-	} else
-		bp = kmem_zone_zalloc(xfs_buf_zone, 0);
-	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
-	bp->b_ops = NULL;
+	pthread_mutex_lock(&xfs_buf_freelist.bf_mutex);
+	if (!xfs_buf_freelist.bf_count) {
+		bp = xfs_buf_slab_alloc();
+		goto out;
+	}
+
+	head = &xfs_buf_freelist.bf_lists[class];
+	if (class && !list_empty(head)) {
+		bp = list_entry(head->next, xfs_buf_t, b_node.cn_mru);
+		list_del_init(&bp->b_node.cn_mru);
+		xfs_buf_freelist.bf_count--;
+		xfs_buf_freelist.bf_reused++;
+		goto out;
+	}
 
+	for (i = 0; i < XFS_BUF_FREE_CLASSES; i++) {
+		head = &xfs_buf_freelist.bf_lists[i];
+		if (!list_empty(head))
+			break;
+	}
+	ASSERT(i < XFS_BUF_FREE_CLASSES);
+	bp = list_entry(head->next, xfs_buf_t, b_node.cn_mru);
+	list_del_init(&bp->b_node.cn_mru);
+	xfs_buf_freelist.bf_count--;
+	xfs_buf_freelist.bf_recycled++;
+	pthread_mutex_unlock(&xfs_buf_freelist.bf_mutex);
+
+	xfs_buf_data_free(bp->b_addr, bp->b_bcount);
+	bp->b_addr = NULL;
+	free(bp->b_map);
+	bp->b_map = NULL;
+	bp->b_ops = NULL;
+	return bp;
+out:
+	pthread_mutex_unlock(&xfs_buf_freelist.bf_mutex);
+	bp->b_ops = NULL;
 	return bp;
 }
 
@@ -565,14 +896,63 @@ int			lock_buf_count = 0;
 
 extern int     use_xfs_buf_lock;
 
+/*
+ * Readahead.  libxfs_buf_readahead() inserts a new buffer into the cache
+ * marked pending and queues it for the readahead threads, which read the
+ * queued buffers in batches through the buftarg's ioengine.  Until the read
+ * has finished, anybody looking the buffer up waits for it, so nobody ever
+ * sees a buffer half read.  Buffers that are cached already are left alone.
+ * Read ahead buffers are marked unchecked, so the verifier runs when the
+ * buffer is read for real.
+ */
+#define LIBXFS_RA_THREADS	4
+#define LIBXFS_RA_BATCH		32
+
+static struct xfs_readahead {
+	pthread_mutex_t		ra_mutex;
+	pthread_cond_t		ra_work;	/* buffers were queued */
+	pthread_cond_t		ra_done;	/* reads have finished */
+	struct list_head	ra_queue;
+	unsigned int		ra_pending;	/* queued or being read */
+	int			ra_active;	/* readahead has been used */
+	int			ra_threads;
+} xfs_readahead = {
+	.ra_mutex	= PTHREAD_MUTEX_INITIALIZER,
+	.ra_work	= PTHREAD_COND_INITIALIZER,
+	.ra_done	= PTHREAD_COND_INITIALIZER,
+	.ra_queue	= { &xfs_readahead.ra_queue, &xfs_readahead.ra_queue },
+};
+
+static void
+libxfs_buf_wait_pending(
+	struct xfs_buf		*bp)
+{
+	struct xfs_readahead	*ra = &xfs_readahead;
+
+	/* set before the first pending buffer went into the cache */
+	if (!ra->ra_active)
+		return;
+
+	pthread_mutex_lock(&ra->ra_mutex);
+	while (bp->b_flags & LIBXFS_B_PENDING)
+		pthread_cond_wait(&ra->ra_done, &ra->ra_mutex);
+	pthread_mutex_unlock(&ra->ra_mutex);
+}
+
 static struct xfs_buf *
 __cache_lookup(struct xfs_bufkey *key, unsigned int flags)
 {
 	struct xfs_buf	*bp;
+	int		miss;
 
-	cache_node_get(libxfs_bcache, key, (struct cache_node **)&bp);
+	miss = cache_node_get(libxfs_bcache, key, (struct cache_node **)&bp);
 	if (!bp)
 		return NULL;
+	if (miss)
+		xfs_probe2(buf_miss, key->blkno, key->bblen);
+	else
+		xfs_probe2(buf_hit, key->blkno, key->bblen);
+	libxfs_buf_wait_pending(bp);
 
 	if (use_xfs_buf_lock) {
 		int ret;
@@ -646,9 +1026,11 @@ static void
 reset_buf_state(
 	struct xfs_buf	*bp)
 {
-	if (bp && !(bp->b_flags & LIBXFS_B_DIRTY))
+	if (bp && !(bp->b_flags & LIBXFS_B_DIRTY)) {
 		bp->b_flags &= ~(LIBXFS_B_UNCHECKED | LIBXFS_B_STALE |
 				LIBXFS_B_UPTODATE);
+		bp->b_crc_off = 0;
+	}
 }
 
 struct xfs_buf *
@@ -734,27 +1116,70 @@ libxfs_purgebuf(xfs_buf_t *bp)
 	cache_node_purge(libxfs_bcache, &key, (struct cache_node *)bp);
 }
 
+/*
+ * The kernel code gives the buffers it wants kept around longer, such as
+ * AG headers and inode clusters, a reference count for the LRU to go by.
+ * Here that becomes the buffer's cache priority, so a directory walk
+ * reading inode after inode out of the same clusters finds them still
+ * cached.  Buffers only ever go up, and those at prefetch priorities are
+ * left alone, as the readahead and repair's prefetch own those.  Lookups
+ * drop the priority again, so a buffer keeps its place only while the
+ * code keeps asking for it.
+ */
+void
+libxfs_buf_set_ref(
+	struct xfs_buf		*bp,
+	int			ref)
+{
+	int			priority;
+
+	priority = cache_node_get_priority(&bp->b_node);
+	if (priority >= ref || priority >= CACHE_PREFETCH_PRIORITY)
+		return;
+	cache_node_set_priority(libxfs_bcache, &bp->b_node,
+				min(ref, CACHE_PREFETCH_PRIORITY - 1));
+}
+
 static struct cache_node *
 libxfs_balloc(cache_key_t key)
 {
 	struct xfs_bufkey *bufkey = (struct xfs_bufkey *)key;
+	struct xfs_buf	*bp;
 
 	if (bufkey->map)
-		return (struct cache_node *)
-		       libxfs_getbufr_map(bufkey->buftarg,
-					  bufkey->blkno, bufkey->bblen,
-					  bufkey->map, bufkey->nmaps);
-	return (struct cache_node *)libxfs_getbufr(bufkey->buftarg,
-					  bufkey->blkno, bufkey->bblen);
+		bp = libxfs_getbufr_map(bufkey->buftarg,
+					bufkey->blkno, bufkey->bblen,
+					bufkey->map, bufkey->nmaps);
+	else
+		bp = libxfs_getbufr(bufkey->buftarg,
+				    bufkey->blkno, bufkey->bblen);
+	/* must be pending before anybody else can find it in the cache */
+	if (bp && bufkey->readahead)
+		bp->b_flags |= LIBXFS_B_PENDING;
+	return (struct cache_node *)bp;
 }
 
 
+/*
+ * Internal read flag, for the I/O statistics: reads issued through
+ * libxfs_readbufr_list are for readahead or prefetch.
+ */
+#define LIBXFS_READ_PREFETCH	0x4000
+
+#define IOSTATS_READ_CLASS(flags)	\
+	(((flags) & LIBXFS_READ_PREFETCH) ? LIBXFS_IO_PREFETCH : LIBXFS_IO_READ)
+
+static int __readbufr_list(struct xfs_buftarg *, struct xfs_buf **, int, int);
+
 static int
 __read_buf(int fd, void *buf, int len, off64_t offset, int flags)
 {
+	__uint64_t start = libxfs_iostats_start();
 	int	sts;
 
-	sts = pread64(fd, buf, len, offset);
+	sts = libxfs_device_pread(fd, buf, len, offset);
+	if (sts > 0)
+		libxfs_iostats_io(IOSTATS_READ_CLASS(flags), sts, start);
 	if (sts < 0) {
 		int error = -errno;
 		fprintf(stderr, _("%s: read failed: %s\n"),
@@ -782,12 +1207,14 @@ libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, xfs_buf_t *bp,
 
 	ASSERT(BBTOB(len) <= bp->b_bcount);
 
+	bp->b_crc_off = 0;
 	error = __read_buf(fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
 	if (!error &&
 	    bp->b_target->dev == btp->dev &&
 	    bp->b_bn == blkno &&
 	    bp->b_bcount == bytes)
 		bp->b_flags |= LIBXFS_B_UPTODATE;
+	xfs_probe3(buf_read, blkno, bytes, error);
 #ifdef IO_DEBUG
 	printf("%lx: %s: read %u bytes, error %d, blkno=0x%llx(0x%llx), %p\n",
 		pthread_self(), __FUNCTION__, bytes, error,
@@ -799,11 +1226,22 @@ libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, xfs_buf_t *bp,
 void
 libxfs_readbuf_verify(struct xfs_buf *bp, const struct xfs_buf_ops *ops)
 {
-	if (!ops)
+	__uint64_t	start;
+
+	if (!ops) {
+		libxfs_iostats_buf(NULL, 0, bp->b_bcount, 0);
 		return;
+	}
+	start = libxfs_iostats_start();
 	bp->b_ops = ops;
-	bp->b_ops->verify_read(bp);
+	if (!libxfs_vcache_lookup(bp)) {
+		bp->b_ops->verify_read(bp);
+		if (!bp->b_error)
+			libxfs_vcache_add(bp);
+	}
 	bp->b_flags &= ~LIBXFS_B_UNCHECKED;
+	libxfs_iostats_buf(ops, 0, bp->b_bcount,
+			   libxfs_iostats_start() - start);
 }
 
 
@@ -834,6 +1272,8 @@ libxfs_readbuf(struct xfs_buftarg *btp, xfs_daddr_t blkno, int len, int flags,
 	if ((bp->b_flags & (LIBXFS_B_UPTODATE|LIBXFS_B_DIRTY))) {
 		if (bp->b_flags & LIBXFS_B_UNCHECKED)
 			libxfs_readbuf_verify(bp, ops);
+		libxfs_iostats_cache(bp->b_ops ? bp->b_ops : ops,
+				     LIBXFS_CACHE_HIT, bp->b_bcount);
 		return bp;
 	}
 
@@ -844,23 +1284,28 @@ libxfs_readbuf(struct xfs_buftarg *btp, xfs_daddr_t blkno, int len, int flags,
 	 * it again, but it won't get called again and set to match the buffer
 	 * contents. *cough* xfs_da_node_buf_ops *cough*.
 	 */
-	error = libxfs_readbufr(btp, blkno, bp, len, flags);
+	bp->b_crc_off = 0;
+	if (bp->b_bn == blkno && bp->b_bcount == BBTOB(len) &&
+	    !__map_buf(btp, bp))
+		error = 0;
+	else
+		error = libxfs_readbufr(btp, blkno, bp, len, flags);
 	if (error)
 		bp->b_error = error;
 	else
 		libxfs_readbuf_verify(bp, ops);
+	libxfs_iostats_cache(bp->b_ops ? bp->b_ops : ops, LIBXFS_CACHE_MISS,
+			     bp->b_bcount);
 	return bp;
 }
 
-int
-libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
+static int
+__read_buf_maps(int fd, struct xfs_buf *bp, int flags)
 {
-	int	fd;
 	int	error = 0;
 	char	*buf;
 	int	i;
 
-	fd = libxfs_device_to_fd(btp->dev);
 	buf = bp->b_addr;
 	for (i = 0; i < bp->b_nmaps; i++) {
 		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_map[i].bm_bn);
@@ -876,6 +1321,26 @@ libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 
 	if (!error)
 		bp->b_flags |= LIBXFS_B_UPTODATE;
+	return error;
+}
+
+int
+libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
+{
+	int	error;
+
+	bp->b_crc_off = 0;
+
+	/*
+	 * If the device can queue reads, issue all the maps at once rather
+	 * than one extent after another.
+	 */
+	if (libxfs_buftarg_queued_io(btp))
+		error = __readbufr_list(btp, &bp, 1, flags);
+	else
+		error = __read_buf_maps(libxfs_device_to_fd(btp->dev), bp,
+					flags);
+	xfs_probe3(buf_read, bp->b_bn, bp->b_bcount, error);
 #ifdef IO_DEBUG
 	printf("%lx: %s: read %u bytes, error %d, blkno=0x%llx(0x%llx), %p\n",
 		pthread_self(), __FUNCTION__, , error,
@@ -903,11 +1368,15 @@ libxfs_readbuf_map(struct xfs_buftarg *btp, struct xfs_buf_map *map, int nmaps,
 	if ((bp->b_flags & (LIBXFS_B_UPTODATE|LIBXFS_B_DIRTY))) {
 		if (bp->b_flags & LIBXFS_B_UNCHECKED)
 			libxfs_readbuf_verify(bp, ops);
+		libxfs_iostats_cache(bp->b_ops ? bp->b_ops : ops,
+				     LIBXFS_CACHE_HIT, bp->b_bcount);
 		return bp;
 	}
 	error = libxfs_readbufr_map(btp, bp, flags);
 	if (!error)
 		libxfs_readbuf_verify(bp, ops);
+	libxfs_iostats_cache(bp->b_ops ? bp->b_ops : ops, LIBXFS_CACHE_MISS,
+			     bp->b_bcount);
 
 #ifdef IO_DEBUG
 	printf("%lx: %s: read %lu bytes, error %d, blkno=%llu(%llu), %p\n",
@@ -917,96 +1386,757 @@ libxfs_readbuf_map(struct xfs_buftarg *btp, struct xfs_buf_map *map, int nmaps,
 	return bp;
 }
 
-static int
-__write_buf(int fd, void *buf, int len, off64_t offset, int flags)
+/*
+ * Finish the reads of a batch of read ahead buffers and drop the references
+ * the readahead held.  The pending flags go first, as a buffer nobody holds
+ * can be reclaimed.
+ */
+static void
+libxfs_readahead_done(
+	struct xfs_buf		**bplist,
+	int			nbufs)
 {
-	int	sts;
-
-	sts = pwrite64(fd, buf, len, offset);
-	if (sts < 0) {
-		int error = -errno;
-		fprintf(stderr, _("%s: pwrite64 failed: %s\n"),
-			progname, strerror(error));
-		if (flags & LIBXFS_B_EXIT)
-			exit(1);
-		return error;
-	} else if (sts != len) {
-		fprintf(stderr, _("%s: error - pwrite64 only %d of %d bytes\n"),
-			progname, sts, len);
-		if (flags & LIBXFS_B_EXIT)
-			exit(1);
-		return -EIO;
+	struct xfs_readahead	*ra = &xfs_readahead;
+	struct xfs_buf		*bp;
+	int			i;
+
+	pthread_mutex_lock(&ra->ra_mutex);
+	for (i = 0; i < nbufs; i++) {
+		bp = bplist[i];
+		if (bp->b_flags & LIBXFS_B_UPTODATE)
+			bp->b_flags |= LIBXFS_B_UNCHECKED;
+		bp->b_error = 0;
+		bp->b_flags &= ~LIBXFS_B_PENDING;
 	}
-	return 0;
+	pthread_cond_broadcast(&ra->ra_done);
+	pthread_mutex_unlock(&ra->ra_mutex);
+
+	for (i = 0; i < nbufs; i++)
+		cache_node_put(libxfs_bcache, &bplist[i]->b_node);
+
+	pthread_mutex_lock(&ra->ra_mutex);
+	ra->ra_pending -= nbufs;
+	if (!ra->ra_pending)
+		pthread_cond_broadcast(&ra->ra_done);
+	pthread_mutex_unlock(&ra->ra_mutex);
 }
 
-int
-libxfs_writebufr(xfs_buf_t *bp)
+static void *
+libxfs_readahead_thread(
+	void			*arg)
 {
-	int	fd = libxfs_device_to_fd(bp->b_target->dev);
-	int	error = 0;
+	struct xfs_readahead	*ra = arg;
+	struct xfs_buf		*bplist[LIBXFS_RA_BATCH];
+	struct xfs_buftarg	*btp;
+	struct xfs_buf		*bp;
+	struct xfs_buf		*n;
+	int			nbufs;
+
+	pthread_mutex_lock(&ra->ra_mutex);
+	for (;;) {
+		while (list_empty(&ra->ra_queue))
+			pthread_cond_wait(&ra->ra_work, &ra->ra_mutex);
+
+		/* take a batch of buffers on the same device */
+		btp = NULL;
+		nbufs = 0;
+		list_for_each_entry_safe(bp, n, &ra->ra_queue, b_node.cn_mru) {
+			if (nbufs == LIBXFS_RA_BATCH)
+				break;
+			if (btp && bp->b_target != btp)
+				continue;
+			btp = bp->b_target;
+			list_del_init(&bp->b_node.cn_mru);
+			bplist[nbufs++] = bp;
+		}
+		pthread_mutex_unlock(&ra->ra_mutex);
 
-	/*
-	 * we never write buffers that are marked stale. This indicates they
-	 * contain data that has been invalidated, and even if the buffer is
-	 * dirty it must *never* be written. Verifiers are wonderful for finding
-	 * bugs like this. Make sure the error is obvious as to the cause.
-	 */
-	if (bp->b_flags & LIBXFS_B_STALE) {
-		bp->b_error = -ESTALE;
-		return bp->b_error;
+		libxfs_readbufr_list(btp, bplist, nbufs, 0);
+		libxfs_readahead_done(bplist, nbufs);
+
+		pthread_mutex_lock(&ra->ra_mutex);
 	}
+	return NULL;
+}
 
-	/*
-	 * clear any pre-existing error status on the buffer. This can occur if
-	 * the buffer is corrupt on disk and the repair process doesn't clear
-	 * the error before fixing and writing it back.
-	 */
-	bp->b_error = 0;
-	if (bp->b_ops) {
-		bp->b_ops->verify_write(bp);
-		if (bp->b_error) {
-			fprintf(stderr,
-	_("%s: write verifer failed on bno 0x%llx/0x%x\n"),
-				__func__, (long long)bp->b_bn, bp->b_bcount);
-			return bp->b_error;
-		}
+/*
+ * Start reading a buffer in the background.  ops is accepted to match the
+ * kernel interface; the verifier is run by the libxfs_readbuf() that finds
+ * the buffer in the cache.
+ */
+void
+libxfs_buf_readahead_map(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf_map	*map,
+	int			nmaps,
+	const struct xfs_buf_ops *ops)
+{
+	struct xfs_readahead	*ra = &xfs_readahead;
+	struct xfs_bufkey	key = {0};
+	struct xfs_buf		*bp;
+	pthread_t		tid;
+	int			i;
+
+	if (!ra->ra_active) {
+		pthread_mutex_lock(&ra->ra_mutex);
+		ra->ra_active = 1;
+		pthread_mutex_unlock(&ra->ra_mutex);
 	}
 
-	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
-		error = __write_buf(fd, bp->b_addr, bp->b_bcount,
-				    LIBXFS_BBTOOFF64(bp->b_bn), bp->b_flags);
-	} else {
-		int	i;
-		char	*buf = bp->b_addr;
+	key.buftarg = btp;
+	key.blkno = map[0].bm_bn;
+	for (i = 0; i < nmaps; i++)
+		key.bblen += map[i].bm_len;
+	if (nmaps > 1) {
+		key.map = map;
+		key.nmaps = nmaps;
+	}
+	key.readahead = 1;
 
-		for (i = 0; i < bp->b_nmaps; i++) {
-			off64_t	offset = LIBXFS_BBTOOFF64(bp->b_map[i].bm_bn);
-			int len = BBTOB(bp->b_map[i].bm_len);
+	if (!cache_node_get(libxfs_bcache, &key, (struct cache_node **)&bp)) {
+		/* it's been read already, or somebody else is reading it */
+		xfs_probe2(buf_readahead_hit, key.blkno, key.bblen);
+		cache_node_put(libxfs_bcache, &bp->b_node);
+		return;
+	}
+	xfs_probe2(buf_readahead, key.blkno, key.bblen);
+	cache_node_set_priority(libxfs_bcache, &bp->b_node,
+				CACHE_PREFETCH_PRIORITY);
 
-			error = __write_buf(fd, buf, len, offset, bp->b_flags);
-			if (error) {
-				bp->b_error = error;
-				break;
-			}
-			buf += len;
-		}
+	pthread_mutex_lock(&ra->ra_mutex);
+	while (ra->ra_threads < LIBXFS_RA_THREADS) {
+		if (pthread_create(&tid, NULL, libxfs_readahead_thread, ra))
+			break;
+		pthread_detach(tid);
+		ra->ra_threads++;
 	}
+	if (!ra->ra_threads) {
+		/* no threads to do it for us */
+		ra->ra_pending++;
+		pthread_mutex_unlock(&ra->ra_mutex);
+		libxfs_readbufr_list(btp, &bp, 1, 0);
+		libxfs_readahead_done(&bp, 1);
+		return;
+	}
+	list_add_tail(&bp->b_node.cn_mru, &ra->ra_queue);
+	ra->ra_pending++;
+	pthread_cond_signal(&ra->ra_work);
+	pthread_mutex_unlock(&ra->ra_mutex);
+}
 
-#ifdef IO_DEBUG
-	printf("%lx: %s: wrote %u bytes, blkno=%llu(%llu), %p, error %d\n",
-			pthread_self(), __FUNCTION__, bp->b_bcount,
-			(long long)LIBXFS_BBTOOFF64(bp->b_bn),
-			(long long)bp->b_bn, bp, error);
+void
+libxfs_buf_readahead(
+	struct xfs_buftarg	*btp,
+	xfs_daddr_t		blkno,
+	int			len,
+	const struct xfs_buf_ops *ops)
+{
+	DEFINE_SINGLE_BUF_MAP(map, blkno, len);
+
+	libxfs_buf_readahead_map(btp, &map, 1, ops);
+}
+
+/* wait for all readahead to finish and the buffers to be released */
+static void
+libxfs_readahead_drain(void)
+{
+	struct xfs_readahead	*ra = &xfs_readahead;
+
+	pthread_mutex_lock(&ra->ra_mutex);
+	while (ra->ra_pending)
+		pthread_cond_wait(&ra->ra_done, &ra->ra_mutex);
+	pthread_mutex_unlock(&ra->ra_mutex);
+}
+
+/*
+ * Buffer I/O submission backends.
+ *
+ * All backends read a list of buffers (contiguous or not) and mark each buffer
+ * that was fully read as up to date.  Failed buffers get b_error set, and the
+ * first error seen is returned.  No verification is done here; that is left to
+ * the caller just like it is for libxfs_readbufr().
+ *
+ * They also write a list of buffers sorted by disk address, skipping those
+ * that already have b_error set, and set b_error on those that failed.  The
+ * caller does the verification and the buffer state changes.
+ */
+static int __write_buf(int fd, void *buf, int len, off64_t offset, int flags);
+static int __write_buf_maps(int fd, xfs_buf_t *bp);
+
+/* the most buffers merged into one vectored write */
+#define LIBXFS_WRITEV_MAX	64
+static int
+sync_read_list(
+	struct xfs_ioengine	*ie,
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs,
+	int			flags)
+{
+	int			fd = libxfs_device_to_fd(btp->dev);
+	struct xfs_buf		*bp;
+	int			error;
+	int			ret = 0;
+	int			i;
+
+	for (i = 0; i < nbufs; i++) {
+		bp = bplist[i];
+		bp->b_error = 0;
+		if (!__map_buf(btp, bp)) {
+			error = 0;
+		} else if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+			error = __read_buf_maps(fd, bp, flags);
+		} else {
+			error = __read_buf(fd, bp->b_addr, bp->b_bcount,
+					   LIBXFS_BBTOOFF64(bp->b_bn), flags);
+			if (error)
+				bp->b_error = error;
+			else
+				bp->b_flags |= LIBXFS_B_UPTODATE;
+		}
+		if (error && !ret)
+			ret = error;
+	}
+	return ret;
+}
+
+/*
+ * Buffers that follow each other on disk are written with a single
+ * pwritev.  If that doesn't write them all, they are rewritten one by one
+ * so that the errors are reported as they would have been otherwise.
+ */
+static int
+sync_write_list(
+	struct xfs_ioengine	*ie,
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs)
+{
+	int			fd = libxfs_device_to_fd(btp->dev);
+	struct xfs_buf		*bp;
+	int			ret = 0;
+	int			b, i, next;
+#ifdef HAVE_PWRITEV
+	struct iovec		iov[LIBXFS_WRITEV_MAX];
+	off64_t			start, end;
+	ssize_t			sts;
+#endif
+
+	for (b = 0; b < nbufs; b = next) {
+		bp = bplist[b];
+		next = b + 1;
+		if (bp->b_error)
+			continue;
+		if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+			bp->b_error = __write_buf_maps(fd, bp);
+			if (bp->b_error && !ret)
+				ret = bp->b_error;
+			continue;
+		}
+
+#ifdef HAVE_PWRITEV
+		start = LIBXFS_BBTOOFF64(bp->b_bn);
+		end = start + bp->b_bcount;
+		iov[0].iov_base = bp->b_addr;
+		iov[0].iov_len = bp->b_bcount;
+		while (next < nbufs && next - b < LIBXFS_WRITEV_MAX) {
+			struct xfs_buf	*nbp = bplist[next];
+
+			if (nbp->b_error || (nbp->b_flags & LIBXFS_B_DISCONTIG) ||
+			    LIBXFS_BBTOOFF64(nbp->b_bn) != end)
+				break;
+			iov[next - b].iov_base = nbp->b_addr;
+			iov[next - b].iov_len = nbp->b_bcount;
+			end += nbp->b_bcount;
+			next++;
+		}
+		if (next - b > 1) {
+			__uint64_t	iostart = libxfs_iostats_start();
+
+			sts = pwritev(fd, iov, next - b, start);
+			if (sts == end - start) {
+				libxfs_iostats_io(LIBXFS_IO_WRITE, sts,
+						  iostart);
+				continue;
+			}
+		}
 #endif
+		for (i = b; i < next; i++) {
+			bp = bplist[i];
+			bp->b_error = __write_buf(fd, bp->b_addr, bp->b_bcount,
+						  LIBXFS_BBTOOFF64(bp->b_bn),
+						  bp->b_flags);
+			if (bp->b_error && !ret)
+				ret = bp->b_error;
+		}
+	}
+	return ret;
+}
+
+static const struct xfs_ioengine_ops sync_ioengine_ops = {
+	.name		= "sync",
+	.read_list	= sync_read_list,
+	.write_list	= sync_write_list,
+};
+
+/*
+ * Wait for a single queued request.  lio_listio(LIO_WAIT) can return early if
+ * interrupted by a signal, so don't rely on everything having completed.
+ */
+static int
+aio_wait_one(
+	struct aiocb		*cb)
+{
+	const struct aiocb	*list[1] = { cb };
+	int			error;
+
+	while ((error = aio_error(cb)) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
+	return error;
+}
+
+/*
+ * Queue the I/O for a list of buffers with lio_listio(), up to ie_depth
+ * requests per batch.  Discontiguous buffers contribute one request per map,
+ * and a buffer's maps may straddle batches.  Writes skip the buffers that
+ * already have an error.
+ *
+ * Any request that does not complete cleanly - short reads or writes,
+ * errors, or requests the AIO implementation refused to queue - is reissued
+ * through the synchronous path so errors are reported exactly as they would
+ * have been without the queued engine.
+ */
+static int
+aio_rw_list(
+	struct xfs_ioengine	*ie,
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs,
+	int			flags,
+	int			write)
+{
+	int			fd = libxfs_device_to_fd(btp->dev);
+	struct aiocb		*cbs;
+	struct aiocb		**list;
+	struct xfs_buf		**owner;
+	struct xfs_buf		*bp;
+	__uint64_t		start;
+	int			nreqs;
+	int			queued;
+	int			boff = 0;
+	int			map = 0;
+	int			error;
+	int			ret = 0;
+	int			b, i;
+
+	cbs = calloc(ie->ie_depth, sizeof(struct aiocb));
+	list = calloc(ie->ie_depth, sizeof(struct aiocb *));
+	owner = calloc(ie->ie_depth, sizeof(struct xfs_buf *));
+	if (!cbs || !list || !owner) {
+		free(cbs);
+		free(list);
+		free(owner);
+		if (write)
+			return sync_write_list(ie, btp, bplist, nbufs);
+		return sync_read_list(ie, btp, bplist, nbufs, flags);
+	}
+
+	if (!write) {
+		for (b = 0; b < nbufs; b++)
+			bplist[b]->b_error = 0;
+	}
+
+	b = 0;
+	while (b < nbufs) {
+		for (nreqs = 0; b < nbufs && nreqs < ie->ie_depth; nreqs++) {
+			struct aiocb	*cb = &cbs[nreqs];
+
+			bp = bplist[b];
+			if (write && bp->b_error) {
+				b++;
+				nreqs--;
+				continue;
+			}
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_fildes = fd;
+			cb->aio_lio_opcode = write ? LIO_WRITE : LIO_READ;
+			cb->aio_buf = (char *)bp->b_addr + boff;
+			if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+				cb->aio_offset =
+					LIBXFS_BBTOOFF64(bp->b_map[map].bm_bn);
+				cb->aio_nbytes = BBTOB(bp->b_map[map].bm_len);
+			} else {
+				cb->aio_offset = LIBXFS_BBTOOFF64(bp->b_bn);
+				cb->aio_nbytes = bp->b_bcount;
+			}
+			list[nreqs] = cb;
+			owner[nreqs] = bp;
+
+			if ((bp->b_flags & LIBXFS_B_DISCONTIG) &&
+			    ++map < bp->b_nmaps) {
+				boff += cb->aio_nbytes;
+				continue;
+			}
+			map = 0;
+			boff = 0;
+			b++;
+		}
+
+		/*
+		 * EIO, EAGAIN and EINTR mean (some of) the requests were
+		 * queued and the individual status tells us what happened.
+		 * Anything else means nothing was queued at all.
+		 */
+		queued = 1;
+		start = libxfs_iostats_start();
+		if (lio_listio(LIO_WAIT, list, nreqs, NULL) < 0 &&
+		    errno != EIO && errno != EAGAIN && errno != EINTR)
+			queued = 0;
+
+		for (i = 0; i < nreqs; i++) {
+			struct aiocb	*cb = list[i];
+
+			if (queued) {
+				ssize_t		done;
+
+				error = aio_wait_one(cb);
+				done = aio_return(cb);
+				if (done > 0)
+					libxfs_iostats_io(write ?
+						LIBXFS_IO_WRITE :
+						IOSTATS_READ_CLASS(flags),
+						done, start);
+				if (!error && done == (ssize_t)cb->aio_nbytes)
+					continue;
+			}
+			if (write)
+				error = __write_buf(fd, (void *)cb->aio_buf,
+						    cb->aio_nbytes,
+						    cb->aio_offset,
+						    owner[i]->b_flags);
+			else
+				error = __read_buf(fd, (void *)cb->aio_buf,
+						   cb->aio_nbytes,
+						   cb->aio_offset, flags);
+			if (error && !owner[i]->b_error)
+				owner[i]->b_error = error;
+		}
+	}
+
+	for (b = 0; b < nbufs; b++) {
+		bp = bplist[b];
+		if (!bp->b_error) {
+			if (!write)
+				bp->b_flags |= LIBXFS_B_UPTODATE;
+		} else if (!ret)
+			ret = bp->b_error;
+	}
+
+	free(cbs);
+	free(list);
+	free(owner);
+	return ret;
+}
+
+static int
+aio_read_list(
+	struct xfs_ioengine	*ie,
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs,
+	int			flags)
+{
+	return aio_rw_list(ie, btp, bplist, nbufs, flags, 0);
+}
+
+static int
+aio_write_list(
+	struct xfs_ioengine	*ie,
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs)
+{
+	return aio_rw_list(ie, btp, bplist, nbufs, 0, 1);
+}
+
+static const struct xfs_ioengine_ops aio_ioengine_ops = {
+	.name		= "aio",
+	.read_list	= aio_read_list,
+	.write_list	= aio_write_list,
+};
+
+/*
+ * Select the read submission backend for a buftarg.  The synchronous engine
+ * is the default and needs no state, so it is represented by a NULL
+ * bt_ioengine.
+ */
+int
+libxfs_buftarg_set_ioengine(
+	struct xfs_buftarg	*btp,
+	int			type,
+	int			depth)
+{
+	struct xfs_ioengine	*ie;
+
+	libxfs_buftarg_free_ioengine(btp);
+	if (type == LIBXFS_IOENGINE_SYNC)
+		return 0;
+	/* metadump reads are served from memory, there is nothing to queue */
+	if (libxfs_device_is_metadump(btp->dev))
+		return 0;
+	if (type != LIBXFS_IOENGINE_AIO)
+		return -EINVAL;
+
+	if (depth <= 0)
+		depth = LIBXFS_IOENGINE_DEFAULT_DEPTH;
+	else if (depth > LIBXFS_IOENGINE_MAX_DEPTH)
+		depth = LIBXFS_IOENGINE_MAX_DEPTH;
+
+	ie = calloc(1, sizeof(*ie));
+	if (!ie)
+		return -ENOMEM;
+	ie->ie_type = type;
+	ie->ie_depth = depth;
+	ie->ie_ops = &aio_ioengine_ops;
+
+#ifdef __GLIBC__
+	{
+		/*
+		 * glibc services POSIX AIO with a small pool of helper
+		 * threads; size it so the whole queue depth can be in flight.
+		 */
+		struct aioinit	init = { 0 };
+
+		init.aio_threads = depth;
+		init.aio_num = depth;
+		aio_init(&init);
+	}
+#endif
+	btp->bt_ioengine = ie;
+	return 0;
+}
+
+void
+libxfs_buftarg_free_ioengine(
+	struct xfs_buftarg	*btp)
+{
+	free(btp->bt_ioengine);
+	btp->bt_ioengine = NULL;
+}
+
+int
+libxfs_buftarg_queued_io(
+	struct xfs_buftarg	*btp)
+{
+	return btp->bt_ioengine != NULL;
+}
+
+const char *
+libxfs_ioengine_name(
+	struct xfs_buftarg	*btp)
+{
+	if (!btp->bt_ioengine)
+		return sync_ioengine_ops.name;
+	return btp->bt_ioengine->ie_ops->name;
+}
+
+static int
+__readbufr_list(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs,
+	int			flags)
+{
+	struct xfs_ioengine	*ie = btp->bt_ioengine;
+	int			i;
+
+	if (nbufs <= 0)
+		return 0;
+	for (i = 0; i < nbufs; i++)
+		bplist[i]->b_crc_off = 0;
+	xfs_probe2(buf_read_list, bplist[0]->b_bn, nbufs);
+	if (!ie)
+		return sync_ioengine_ops.read_list(NULL, btp, bplist, nbufs,
+						   flags);
+	return ie->ie_ops->read_list(ie, btp, bplist, nbufs, flags);
+}
+
+/*
+ * Read a list of buffers through the buftarg's submission backend.
+ */
+int
+libxfs_readbufr_list(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs,
+	int			flags)
+{
+	return __readbufr_list(btp, bplist, nbufs,
+			       flags | LIBXFS_READ_PREFETCH);
+}
+
+static int
+__write_buf(int fd, void *buf, int len, off64_t offset, int flags)
+{
+	__uint64_t start = libxfs_iostats_start();
+	int	sts;
+
+	sts = pwrite64(fd, buf, len, offset);
+	if (sts > 0)
+		libxfs_iostats_io(LIBXFS_IO_WRITE, sts, start);
+	if (sts < 0) {
+		int error = -errno;
+		fprintf(stderr, _("%s: pwrite64 failed: %s\n"),
+			progname, strerror(error));
+		if (flags & LIBXFS_B_EXIT)
+			exit(1);
+		return error;
+	} else if (sts != len) {
+		fprintf(stderr, _("%s: error - pwrite64 only %d of %d bytes\n"),
+			progname, sts, len);
+		if (flags & LIBXFS_B_EXIT)
+			exit(1);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Get a dirty buffer ready to be written: stale buffers are never written,
+ * and the write verifier must pass.  Leaves any reason not to write the
+ * buffer in b_error.
+ */
+static int
+libxfs_writebufr_prep(xfs_buf_t *bp)
+{
+	/*
+	 * we never write buffers that are marked stale. This indicates they
+	 * contain data that has been invalidated, and even if the buffer is
+	 * dirty it must *never* be written. Verifiers are wonderful for finding
+	 * bugs like this. Make sure the error is obvious as to the cause.
+	 */
+	if (bp->b_flags & LIBXFS_B_STALE) {
+		bp->b_error = -ESTALE;
+		return bp->b_error;
+	}
+
+	/*
+	 * clear any pre-existing error status on the buffer. This can occur if
+	 * the buffer is corrupt on disk and the repair process doesn't clear
+	 * the error before fixing and writing it back.
+	 */
+	bp->b_error = 0;
+	if (!bp->b_ops)
+		libxfs_iostats_buf(NULL, 1, bp->b_bcount, 0);
+	else {
+		__uint64_t	start = libxfs_iostats_start();
+
+		bp->b_ops->verify_write(bp);
+		libxfs_iostats_buf(bp->b_ops, 1, bp->b_bcount,
+				   libxfs_iostats_start() - start);
+		if (bp->b_error) {
+			fprintf(stderr,
+	_("%s: write verifer failed on bno 0x%llx/0x%x\n"),
+				__func__, (long long)bp->b_bn, bp->b_bcount);
+			return bp->b_error;
+		}
+	}
+	return 0;
+}
+
+static int
+__write_buf_maps(int fd, xfs_buf_t *bp)
+{
+	char	*buf = bp->b_addr;
+	int	error = 0;
+	int	i;
+
+	for (i = 0; i < bp->b_nmaps; i++) {
+		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_map[i].bm_bn);
+		int len = BBTOB(bp->b_map[i].bm_len);
+
+		error = __write_buf(fd, buf, len, offset, bp->b_flags);
+		if (error)
+			break;
+		buf += len;
+	}
+	return error;
+}
+
+static void
+libxfs_writebufr_done(xfs_buf_t *bp, int error)
+{
 	if (!error) {
 		bp->b_flags |= LIBXFS_B_UPTODATE;
 		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_EXIT |
 				 LIBXFS_B_UNCHECKED);
 	}
+}
+
+int
+libxfs_writebufr(xfs_buf_t *bp)
+{
+	int	fd = libxfs_device_to_fd(bp->b_target->dev);
+	int	error;
+
+	error = libxfs_writebufr_prep(bp);
+	if (error)
+		return error;
+
+	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
+		error = __write_buf(fd, bp->b_addr, bp->b_bcount,
+				    LIBXFS_BBTOOFF64(bp->b_bn), bp->b_flags);
+	} else {
+		error = __write_buf_maps(fd, bp);
+		if (error)
+			bp->b_error = error;
+	}
+	xfs_probe3(buf_write, bp->b_bn, bp->b_bcount, error);
+
+#ifdef IO_DEBUG
+	printf("%lx: %s: wrote %u bytes, blkno=%llu(%llu), %p, error %d\n",
+			pthread_self(), __FUNCTION__, bp->b_bcount,
+			(long long)LIBXFS_BBTOOFF64(bp->b_bn),
+			(long long)bp->b_bn, bp, error);
+#endif
+	libxfs_writebufr_done(bp, error);
 	return error;
 }
 
+/*
+ * Write a list of dirty buffers, sorted by disk address, through the
+ * buftarg's submission backend.  Buffers that can't be written are left
+ * dirty with the reason in b_error, as libxfs_writebufr does.  Returns the
+ * first error.
+ */
+int
+libxfs_writebufr_list(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bplist,
+	int			nbufs)
+{
+	struct xfs_ioengine	*ie = btp->bt_ioengine;
+	int			ret = 0;
+	int			i;
+
+	for (i = 0; i < nbufs; i++)
+		libxfs_writebufr_prep(bplist[i]);
+
+	if (nbufs > 0)
+		xfs_probe2(buf_write_list, bplist[0]->b_bn, nbufs);
+	if (!ie)
+		sync_ioengine_ops.write_list(NULL, btp, bplist, nbufs);
+	else
+		ie->ie_ops->write_list(ie, btp, bplist, nbufs);
+
+	for (i = 0; i < nbufs; i++) {
+		libxfs_writebufr_done(bplist[i], bplist[i]->b_error);
+		if (bplist[i]->b_error && !ret)
+			ret = bplist[i]->b_error;
+	}
+	return ret;
+}
+
 int
 libxfs_writebuf_int(xfs_buf_t *bp, int flags)
 {
@@ -1017,6 +2147,7 @@ libxfs_writebuf_int(xfs_buf_t *bp, int flags)
 	bp->b_error = 0;
 	bp->b_flags &= ~LIBXFS_B_STALE;
 	bp->b_flags |= (LIBXFS_B_DIRTY | flags);
+	bp->b_crc_off = 0;
 	return 0;
 }
 
@@ -1036,6 +2167,7 @@ libxfs_writebuf(xfs_buf_t *bp, int flags)
 	bp->b_error = 0;
 	bp->b_flags &= ~LIBXFS_B_STALE;
 	bp->b_flags |= (LIBXFS_B_DIRTY | flags);
+	bp->b_crc_off = 0;
 	libxfs_putbuf(bp);
 	return 0;
 }
@@ -1070,11 +2202,15 @@ libxfs_brelse(struct cache_node *node)
 	xfs_buf_t		*bp = (xfs_buf_t *)node;
 
 	if (bp != NULL) {
+		xfs_probe3(buf_evict, bp->b_bn, bp->b_bcount,
+			   bp->b_flags & LIBXFS_B_DIRTY);
+		libxfs_iostats_cache(bp->b_ops, LIBXFS_CACHE_EVICT,
+				     bp->b_bcount);
 		if (bp->b_flags & LIBXFS_B_DIRTY)
 			libxfs_writebufr(bp);
-		pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-		list_add(&bp->b_node.cn_mru, &xfs_buf_freelist.cm_list);
-		pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+		pthread_mutex_lock(&xfs_buf_freelist.bf_mutex);
+		xfs_buf_free_add(bp);
+		pthread_mutex_unlock(&xfs_buf_freelist.bf_mutex);
 	}
 }
 
@@ -1084,20 +2220,26 @@ libxfs_bulkrelse(
 	struct list_head 	*list)
 {
 	xfs_buf_t		*bp;
+	xfs_buf_t		*n;
 	int			count = 0;
 
 	if (list_empty(list))
 		return 0 ;
 
 	list_for_each_entry(bp, list, b_node.cn_mru) {
+		xfs_probe3(buf_evict, bp->b_bn, bp->b_bcount,
+			   bp->b_flags & LIBXFS_B_DIRTY);
+		libxfs_iostats_cache(bp->b_ops, LIBXFS_CACHE_EVICT,
+				     bp->b_bcount);
 		if (bp->b_flags & LIBXFS_B_DIRTY)
 			libxfs_writebufr(bp);
 		count++;
 	}
 
-	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-	__list_splice(list, &xfs_buf_freelist.cm_list);
-	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+	pthread_mutex_lock(&xfs_buf_freelist.bf_mutex);
+	list_for_each_entry_safe(bp, n, list, b_node.cn_mru)
+		xfs_buf_free_add(bp);
+	pthread_mutex_unlock(&xfs_buf_freelist.bf_mutex);
 
 	return count;
 }
@@ -1111,6 +2253,54 @@ libxfs_bflush(struct cache_node *node)
 		libxfs_writebufr(bp);
 }
 
+static int
+libxfs_bdirty(struct cache_node *node)
+{
+	return (((xfs_buf_t *)node)->b_flags & LIBXFS_B_DIRTY) != 0;
+}
+
+static int
+libxfs_bcompare_daddr(const void *a, const void *b)
+{
+	const xfs_buf_t		*ba = *(const xfs_buf_t **)a;
+	const xfs_buf_t		*bb = *(const xfs_buf_t **)b;
+
+	if (ba->b_target->dev != bb->b_target->dev)
+		return ba->b_target->dev < bb->b_target->dev ? -1 : 1;
+	if (ba->b_bn != bb->b_bn)
+		return ba->b_bn < bb->b_bn ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write back all the dirty buffers of a cache flush in disk order, so that
+ * neighbouring buffers can be merged into single writes.  The buffers are
+ * locked like libxfs_bflush is called with them locked; they are locked in
+ * disk order, so concurrent flushes can't deadlock.
+ */
+static void
+libxfs_bflush_list(
+	struct cache		*cache,
+	struct cache_node	**nodes,
+	unsigned int		nr)
+{
+	xfs_buf_t		**bplist = (xfs_buf_t **)nodes;
+	unsigned int		i, n;
+
+	qsort(bplist, nr, sizeof(*bplist), libxfs_bcompare_daddr);
+	for (i = 0; i < nr; i += n) {
+		for (n = 0; i + n < nr &&
+			    bplist[i + n]->b_target == bplist[i]->b_target; n++)
+			pthread_mutex_lock(&bplist[i + n]->b_node.cn_mutex);
+
+		libxfs_writebufr_list(bplist[i]->b_target, bplist + i, n);
+
+		for (n = 0; i + n < nr &&
+			    bplist[i + n]->b_target == bplist[i]->b_target; n++)
+			pthread_mutex_unlock(&bplist[i + n]->b_node.cn_mutex);
+	}
+}
+
 void
 libxfs_putbufr(xfs_buf_t *bp)
 {
@@ -1118,15 +2308,22 @@ libxfs_putbufr(xfs_buf_t *bp)
 }
 
 
+/*
+ * Buffers still dirty at purge time were written one by one as they were
+ * released, so flush them in disk order first.
+ */
 void
 libxfs_bcache_purge(void)
 {
+	libxfs_readahead_drain();
+	cache_flush(libxfs_bcache);
 	cache_purge(libxfs_bcache);
 }
 
 void
 libxfs_bcache_flush(void)
 {
+	libxfs_trans_batch_flush();
 	cache_flush(libxfs_bcache);
 }
 
@@ -1136,53 +2333,96 @@ libxfs_bcache_overflowed(void)
 	return cache_overflowed(libxfs_bcache);
 }
 
+static void
+libxfs_breport(
+	FILE			*fp,
+	struct cache		*cache)
+{
+	unsigned long long	allocs, reused, recycled;
+	unsigned int		count;
+
+	pthread_mutex_lock(&xfs_buf_freelist.bf_mutex);
+	count = xfs_buf_freelist.bf_count;
+	allocs = xfs_buf_freelist.bf_allocs;
+	reused = xfs_buf_freelist.bf_reused;
+	recycled = xfs_buf_freelist.bf_recycled;
+	pthread_mutex_unlock(&xfs_buf_freelist.bf_mutex);
+
+	fprintf(fp, "Free buffers = %u\n"
+			"Buffer headers allocated = %llu\n"
+			"Buffers reused = %llu\n"
+			"Buffers reused with new data = %llu\n",
+			count, allocs, reused, recycled);
+	libxfs_iostats_cache_report(fp);
+}
+
 struct cache_operations libxfs_bcache_operations = {
 	.hash		= libxfs_bhash,
 	.alloc		= libxfs_balloc,
 	.flush		= libxfs_bflush,
 	.relse		= libxfs_brelse,
 	.compare	= libxfs_bcompare,
-	.bulkrelse	= libxfs_bulkrelse
+	.bulkrelse	= libxfs_bulkrelse,
+	.report		= libxfs_breport,
+	.dirty		= libxfs_bdirty,
+	.flush_list	= libxfs_bflush_list,
 };
 
 
 /*
- * Inode cache stubs.
+ * Inode cache.
+ *
+ * Inodes are hashed by inode number and reference counted, so that repeated
+ * lookups of the same inode (e.g. the directories walked by repair phase 6)
+ * don't have to read the inode buffer and decode the forks again.  The cache
+ * is only set up if libxfs_ihash_size is set before libxfs_init(); without
+ * it every libxfs_iget() reads a private copy of the inode as before.
+ *
+ * There is no inode locking in libxfs, so callers must not look up the same
+ * inode from several threads at once.  In-core inodes are only written back
+ * by transaction commit, anyone modifying inodes through their buffers must
+ * purge the cache before going back through libxfs_iget().
  */
 
 extern kmem_zone_t	*xfs_ili_zone;
 extern kmem_zone_t	*xfs_inode_zone;
 
-int
-libxfs_iget(xfs_mount_t *mp, xfs_trans_t *tp, xfs_ino_t ino, uint lock_flags,
-		xfs_inode_t **ipp, xfs_daddr_t bno)
+struct xfs_inokey {
+	struct xfs_mount	*mp;
+	xfs_ino_t		ino;
+};
+
+static unsigned int
+libxfs_ihash(cache_key_t key, unsigned int hashsize, unsigned int hashshift)
 {
-	xfs_inode_t	*ip;
-	int		error = 0;
+	uint64_t	hashval = ((struct xfs_inokey *)key)->ino;
+	uint64_t	tmp;
 
-	ip = kmem_zone_zalloc(xfs_inode_zone, 0);
-	if (!ip)
-		return -ENOMEM;
+	tmp = hashval ^ (GOLDEN_RATIO_PRIME + hashval) / CACHE_LINE_SIZE;
+	tmp = tmp ^ ((tmp ^ GOLDEN_RATIO_PRIME) >> hashshift);
+	return tmp % hashsize;
+}
 
-	ip->i_ino = ino;
-	ip->i_mount = mp;
-	error = xfs_iread(mp, tp, ip, bno);
-	if (error) {
-		kmem_zone_free(xfs_inode_zone, ip);
-		*ipp = NULL;
-		return error;
-	}
+static int
+libxfs_icompare(struct cache_node *node, cache_key_t key)
+{
+	struct xfs_inode	*ip = (struct xfs_inode *)node;
+	struct xfs_inokey	*ikey = (struct xfs_inokey *)key;
 
 	/*
-	 * set up the inode ops structure that the libxfs code relies on
+	 * Stale inodes no longer match the disk and are left for the
+	 * shaker to reclaim once the last reference has been dropped.
 	 */
-	if (S_ISDIR(ip->i_d.di_mode))
-		ip->d_ops = mp->m_dir_inode_ops;
-	else
-		ip->d_ops = mp->m_nondir_inode_ops;
+	if (ip->i_ino == ikey->ino && ip->i_mount == ikey->mp &&
+	    !(ip->i_flags & XFS_ISTALE))
+		return CACHE_HIT;
+	return CACHE_MISS;
+}
 
-	*ipp = ip;
-	return 0;
+static struct cache_node *
+libxfs_icache_alloc(cache_key_t key)
+{
+	return kmem_zone_zalloc(xfs_inode_zone, 0);
 }
 
 static void
@@ -1199,8 +2439,8 @@ libxfs_idestroy(xfs_inode_t *ip)
 		libxfs_idestroy_fork(ip, XFS_ATTR_FORK);
 }
 
-void
-libxfs_iput(xfs_inode_t *ip)
+static void
+libxfs_ifree_incore(xfs_inode_t *ip)
 {
 	if (ip->i_itemp)
 		kmem_zone_free(xfs_ili_zone, ip->i_itemp);
@@ -1208,3 +2448,181 @@ libxfs_iput(xfs_inode_t *ip)
 	libxfs_idestroy(ip);
 	kmem_zone_free(xfs_inode_zone, ip);
 }
+
+static void
+libxfs_icache_relse(struct cache_node *node)
+{
+	libxfs_ifree_incore((xfs_inode_t *)node);
+}
+
+struct cache_operations libxfs_icache_operations = {
+	.hash		= libxfs_ihash,
+	.alloc		= libxfs_icache_alloc,
+	.relse		= libxfs_icache_relse,
+	.compare	= libxfs_icompare,
+};
+
+void
+libxfs_icache_purge(void)
+{
+	if (libxfs_icache)
+		cache_purge(libxfs_icache);
+}
+
+/*
+ * Find ino in the inode cache, returning 1, or set up a new in-core inode
+ * for the caller to read in and return 0.
+ */
+static int
+libxfs_iget_lookup(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino,
+	struct xfs_inode	**ipp)
+{
+	struct xfs_inode	*ip;
+	struct xfs_inokey	key;
+
+	if (libxfs_icache) {
+		key.mp = mp;
+		key.ino = ino;
+		if (cache_node_get(libxfs_icache, &key,
+				   (struct cache_node **)&ip) == 0) {
+			*ipp = ip;
+			return 1;
+		}
+	} else {
+		ip = kmem_zone_zalloc(xfs_inode_zone, 0);
+		if (!ip)
+			return -ENOMEM;
+	}
+
+	ip->i_ino = ino;
+	ip->i_mount = mp;
+	*ipp = ip;
+	return 0;
+}
+
+/* the new inode couldn't be read in */
+static void
+libxfs_iget_fail(
+	struct xfs_inode	*ip)
+{
+	if (libxfs_icache) {
+		ip->i_flags |= XFS_ISTALE;
+		cache_node_put(libxfs_icache, (struct cache_node *)ip);
+	} else
+		kmem_zone_free(xfs_inode_zone, ip);
+}
+
+static void
+libxfs_iget_done(
+	struct xfs_mount	*mp,
+	struct xfs_inode	*ip)
+{
+	/*
+	 * set up the inode ops structure that the libxfs code relies on
+	 */
+	if (S_ISDIR(ip->i_d.di_mode))
+		ip->d_ops = mp->m_dir_inode_ops;
+	else
+		ip->d_ops = mp->m_nondir_inode_ops;
+}
+
+int
+libxfs_iget(xfs_mount_t *mp, xfs_trans_t *tp, xfs_ino_t ino, uint lock_flags,
+		xfs_inode_t **ipp, xfs_daddr_t bno)
+{
+	xfs_inode_t	*ip;
+	int		error = 0;
+
+	error = libxfs_iget_lookup(mp, ino, &ip);
+	if (error < 0)
+		return error;
+	if (error) {
+		*ipp = ip;
+		return 0;
+	}
+
+	error = xfs_iread(mp, tp, ip, bno);
+	if (error) {
+		*ipp = NULL;
+		libxfs_iget_fail(ip);
+		return error;
+	}
+
+	libxfs_iget_done(mp, ip);
+	*ipp = ip;
+	return 0;
+}
+
+/*
+ * Get count inodes, such as the inodes of a chunk, into ipps.  Those not
+ * cached already are decoded straight out of their cluster buffer, which
+ * is kept while the following inodes are in it rather than looked up
+ * again for each of them.  Inodes that couldn't be read come back NULL,
+ * and the first error met is returned.
+ */
+int
+libxfs_iget_batch(
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
+	xfs_ino_t		*inos,
+	int			count,
+	struct xfs_inode	**ipps)
+{
+	struct xfs_buf		*bp = NULL;
+	struct xfs_dinode	*dip;
+	struct xfs_inode	*ip;
+	int			error = 0;
+	int			err;
+	int			i;
+
+	for (i = 0; i < count; i++) {
+		ipps[i] = NULL;
+		err = libxfs_iget_lookup(mp, inos[i], &ip);
+		if (err > 0) {
+			ipps[i] = ip;
+			continue;
+		}
+		if (err < 0)
+			goto next;
+
+		err = xfs_imap(mp, tp, ip->i_ino, &ip->i_imap, 0);
+		if (!err && bp && (bp->b_bn != ip->i_imap.im_blkno ||
+				   bp->b_length != ip->i_imap.im_len)) {
+			xfs_buf_set_ref(bp, XFS_INO_REF);
+			xfs_trans_brelse(tp, bp);
+			bp = NULL;
+		}
+		if (!err && !bp)
+			err = xfs_imap_to_bp(mp, tp, &ip->i_imap, &dip, &bp,
+					0, 0);
+		if (!err) {
+			dip = xfs_buf_offset(bp, ip->i_imap.im_boffset);
+			err = xfs_iread_dinode(mp, ip, dip);
+		}
+		if (err) {
+			libxfs_iget_fail(ip);
+			goto next;
+		}
+		libxfs_iget_done(mp, ip);
+		ipps[i] = ip;
+next:
+		if (err && !error)
+			error = err;
+	}
+	if (bp) {
+		xfs_buf_set_ref(bp, XFS_INO_REF);
+		xfs_trans_brelse(tp, bp);
+	}
+	return error;
+}
+
+void
+libxfs_iput(xfs_inode_t *ip)
+{
+	if (libxfs_icache)
+		cache_node_put(libxfs_icache, (struct cache_node *)ip);
+	else
+		libxfs_ifree_incore(ip);
+}
@@ -29,6 +29,7 @@
 #include "xfs_inode.h"
 #include "xfs_trans.h"
 #include "xfs_sb.h"
+#include "xfs_probe.h"
 
 static void xfs_trans_free_items(struct xfs_trans *tp);
 
@@ -38,6 +39,117 @@ static void xfs_trans_free_items(struct xfs_trans *tp);
 
 kmem_zone_t	*xfs_log_item_desc_zone;
 
+/*
+ * Every transaction allocates a transaction structure, a descriptor for
+ * each item it joins and a buffer log item for each buffer it logs, and
+ * frees them all again when it commits.  The offline tools run millions of
+ * tiny transactions, so keep a few of each on per-thread free lists rather
+ * than going back to malloc for every one.  The lists are released when
+ * the thread exits.
+ */
+#define XFS_TRANS_CACHE_MAX	32
+
+struct xfs_trans_cache {
+	void			*tc_head[XFS_TRANS_CACHE_NR];
+	int			tc_count[XFS_TRANS_CACHE_NR];
+};
+
+static const size_t xfs_trans_cache_size[XFS_TRANS_CACHE_NR] = {
+	[XFS_TRANS_CACHE_TRANS]		= sizeof(struct xfs_trans),
+	[XFS_TRANS_CACHE_DESC]		= sizeof(struct xfs_log_item_desc),
+	[XFS_TRANS_CACHE_BUF_ITEM]	= sizeof(struct xfs_buf_log_item),
+};
+
+static pthread_key_t	xfs_trans_cache_key;
+static pthread_once_t	xfs_trans_cache_once = PTHREAD_ONCE_INIT;
+
+static void
+xfs_trans_cache_destroy(
+	void			*arg)
+{
+	struct xfs_trans_cache	*tc = arg;
+	void			*ptr;
+	int			type;
+
+	for (type = 0; type < XFS_TRANS_CACHE_NR; type++) {
+		while ((ptr = tc->tc_head[type]) != NULL) {
+			tc->tc_head[type] = *(void **)ptr;
+			free(ptr);
+		}
+	}
+	free(tc);
+}
+
+static void
+xfs_trans_cache_init(void)
+{
+	pthread_key_create(&xfs_trans_cache_key, xfs_trans_cache_destroy);
+}
+
+static struct xfs_trans_cache *
+xfs_trans_cache(void)
+{
+	struct xfs_trans_cache	*tc;
+
+	pthread_once(&xfs_trans_cache_once, xfs_trans_cache_init);
+	tc = pthread_getspecific(xfs_trans_cache_key);
+	if (!tc) {
+		tc = calloc(1, sizeof(*tc));
+		if (tc && pthread_setspecific(xfs_trans_cache_key, tc)) {
+			free(tc);
+			tc = NULL;
+		}
+	}
+	return tc;
+}
+
+/*
+ * Take a zeroed object of the given type off this thread's free list.
+ * Returns NULL if the list is empty, the caller allocates one then.
+ */
+void *
+xfs_trans_cache_zalloc(
+	int			type)
+{
+	struct xfs_trans_cache	*tc = xfs_trans_cache();
+	void			*ptr;
+
+	if (!tc || !tc->tc_head[type])
+		return NULL;
+	ptr = tc->tc_head[type];
+	tc->tc_head[type] = *(void **)ptr;
+	tc->tc_count[type]--;
+	memset(ptr, 0, xfs_trans_cache_size[type]);
+	return ptr;
+}
+
+/*
+ * Put an object back on this thread's free list.  Returns 0 if the list
+ * is full and the caller has to free the object itself.
+ */
+int
+xfs_trans_cache_free(
+	int			type,
+	void			*ptr)
+{
+	struct xfs_trans_cache	*tc = xfs_trans_cache();
+
+	if (!tc || tc->tc_count[type] >= XFS_TRANS_CACHE_MAX)
+		return 0;
+	*(void **)ptr = tc->tc_head[type];
+	tc->tc_head[type] = ptr;
+	tc->tc_count[type]++;
+	return 1;
+}
+
+static void
+xfs_trans_free(
+	struct xfs_trans	*tp)
+{
+	if (!xfs_trans_cache_free(XFS_TRANS_CACHE_TRANS, tp))
+		free(tp);
+}
+
 /*
  * Initialize the precomputed transaction reservation values
  * in the mount structure.
@@ -64,7 +176,9 @@ libxfs_trans_add_item(
 	ASSERT(lip->li_mountp == tp->t_mountp);
 	ASSERT(lip->li_ailp == tp->t_mountp->m_ail);
 
-	lidp = calloc(sizeof(struct xfs_log_item_desc), 1);
+	lidp = xfs_trans_cache_zalloc(XFS_TRANS_CACHE_DESC);
+	if (!lidp)
+		lidp = calloc(sizeof(struct xfs_log_item_desc), 1);
 	if (!lidp) {
 		fprintf(stderr, _("%s: lidp calloc failed (%d bytes): %s\n"),
 			progname, (int)sizeof(struct xfs_log_item_desc),
@@ -87,7 +201,8 @@ libxfs_trans_del_item(
 	struct xfs_log_item	*lip)
 {
 	list_del_init(&lip->li_desc->lid_trans);
-	free(lip->li_desc);
+	if (!xfs_trans_cache_free(XFS_TRANS_CACHE_DESC, lip->li_desc))
+		free(lip->li_desc);
 	lip->li_desc = NULL;
 }
 
@@ -162,7 +277,8 @@ libxfs_trans_alloc(
 {
 	xfs_trans_t	*ptr;
 
-	if ((ptr = calloc(sizeof(xfs_trans_t), 1)) == NULL) {
+	ptr = xfs_trans_cache_zalloc(XFS_TRANS_CACHE_TRANS);
+	if (!ptr && (ptr = calloc(sizeof(xfs_trans_t), 1)) == NULL) {
 		fprintf(stderr, _("%s: xact calloc failed (%d bytes): %s\n"),
 			progname, (int)sizeof(xfs_trans_t), strerror(errno));
 		exit(1);
@@ -191,7 +307,7 @@ libxfs_trans_reserve(
 	 * fail if the count would go below zero.
 	 */
 	if (blocks > 0) {
-		if (mpsb->sb_fdblocks < blocks)
+		if (counter_read(&mpsb->sb_fdblocks) < blocks)
 			return -ENOSPC;
 	}
 	/* user space, don't need log/RT stuff (preserve the API though) */
@@ -207,7 +323,7 @@ libxfs_trans_cancel(
 #endif
 	if (tp != NULL) {
 		xfs_trans_free_items(tp);
-		free(tp);
+		xfs_trans_free(tp);
 		tp = NULL;
 	}
 #ifdef XACT_DEBUG
@@ -236,6 +352,12 @@ libxfs_trans_iget(
 		return error;
 	ASSERT(ip != NULL);
 
+	/* a cached inode may already have been joined to this transaction */
+	if (ip->i_transp == tp) {
+		*ipp = ip;
+		return 0;
+	}
+
 	if (ip->i_itemp == NULL)
 		xfs_inode_item_init(ip, mp);
 	iip = ip->i_itemp;
@@ -647,8 +769,40 @@ libxfs_trans_mod_sb(
  * Transaction commital code follows (i.e. write to disk in libxfs)
  */
 
+/*
+ * Batched commits.  Committing a transaction normally copies every inode it
+ * logged back into its cluster buffer straight away.  With
+ * libxfs_trans_batch set, committed inodes are instead parked on a list
+ * (our stand-in for the AIL) with an inode cache reference held, and only
+ * written back every libxfs_trans_batch commits or when
+ * libxfs_trans_batch_flush() is called.  An inode that is logged by a run of
+ * transactions, like a directory being populated, then goes to its buffer
+ * once per batch instead of once per transaction.  The incore inode stays
+ * authoritative in between, so this needs the inode cache.  Cancelling a
+ * transaction that dirtied a parked inode can't separate the cancelled
+ * changes from the batched ones and throws both away, so only turn this on
+ * in tools that treat that as fatal.
+ */
+int			libxfs_trans_batch;
+static pthread_mutex_t	xfs_trans_ail_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(xfs_trans_ail);
+static int		xfs_trans_batched;	/* commits since last flush */
+
+/*
+ * Transactions may run from several threads at once as long as they stay
+ * out of each other's AGs.  Within an AG they serialise on the AGF and AGI
+ * buffers, as in the kernel, which needs the buffer locks turned on
+ * (usebuflock in libxfs_init_t).  The superblock counters are shared by
+ * all of them, so each transaction only adds up its own changes to them in
+ * libxfs_trans_mod_sb and folds them into the incore superblock at commit.
+ * The fold is atomic, since libxfs_mod_incore_sb changes sb_fdblocks
+ * without a transaction, and this lock keeps the copies written into the
+ * superblock buffer in the order the changes were made.
+ */
+static pthread_mutex_t	xfs_trans_sb_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
-inode_item_done(
+inode_item_flush(
 	xfs_inode_log_item_t	*iip)
 {
 	xfs_dinode_t		*dip;
@@ -659,13 +813,6 @@ inode_item_done(
 
 	ip = iip->ili_inode;
 	mp = iip->ili_item.li_mountp;
-	ASSERT(ip != NULL);
-
-	if (!(iip->ili_fields & XFS_ILOG_ALL)) {
-		ip->i_transp = NULL;	/* disassociate from transaction */
-		iip->ili_flags = 0;	/* reset all flags */
-		return;
-	}
 
 	/*
 	 * Get the buffer containing the on-disk inode.
@@ -686,6 +833,7 @@ inode_item_done(
 	}
 
 	ip->i_transp = NULL;	/* disassociate from transaction */
+	iip->ili_fields = 0;	/* in-core inode is clean again */
 	XFS_BUF_SET_FSPRIVATE(bp, NULL);	/* remove log item */
 	XFS_BUF_SET_FSPRIVATE2(bp, NULL);	/* remove xact ptr */
 	libxfs_writebuf(bp, 0);
@@ -695,6 +843,102 @@ inode_item_done(
 #endif
 }
 
+/*
+ * Park a committed inode on the AIL until the batch is flushed.  Returns 0
+ * if it has to be flushed right away instead.
+ */
+static int
+inode_item_defer(
+	xfs_inode_log_item_t	*iip)
+{
+	xfs_inode_t		*ip = iip->ili_inode;
+	xfs_inode_t		*rip;
+
+	if (!libxfs_icache || (ip->i_flags & XFS_ISTALE))
+		return 0;
+	if (libxfs_iget(ip->i_mount, NULL, ip->i_ino, 0, &rip, 0))
+		return 0;
+	if (rip != ip) {
+		libxfs_iput(rip);
+		return 0;
+	}
+
+	pthread_mutex_lock(&xfs_trans_ail_lock);
+	iip->ili_item.li_flags |= XFS_LI_IN_AIL;
+	list_add_tail(&iip->ili_item.li_ail, &xfs_trans_ail);
+	pthread_mutex_unlock(&xfs_trans_ail_lock);
+	return 1;
+}
+
+static void
+inode_item_done(
+	xfs_inode_log_item_t	*iip)
+{
+	xfs_inode_t		*ip;
+
+	ip = iip->ili_inode;
+	ASSERT(ip != NULL);
+
+	/* parked inodes are written by the batch flush, whatever is logged */
+	if (!(iip->ili_fields & XFS_ILOG_ALL) ||
+	    (iip->ili_item.li_flags & XFS_LI_IN_AIL) ||
+	    (libxfs_trans_batch && inode_item_defer(iip))) {
+		ip->i_transp = NULL;	/* disassociate from transaction */
+		iip->ili_flags = 0;	/* reset all flags */
+		return;
+	}
+
+	inode_item_flush(iip);
+}
+
+/*
+ * Write all the inodes parked by batched commits back to their buffers.
+ */
+void
+libxfs_trans_batch_flush(void)
+{
+	struct xfs_log_item	*lip, *next;
+	xfs_inode_log_item_t	*iip;
+	xfs_inode_t		*ip;
+	LIST_HEAD(list);
+
+	pthread_mutex_lock(&xfs_trans_ail_lock);
+	list_splice_init(&xfs_trans_ail, &list);
+	xfs_trans_batched = 0;
+	pthread_mutex_unlock(&xfs_trans_ail_lock);
+
+	list_for_each_entry_safe(lip, next, &list, li_ail) {
+		iip = (xfs_inode_log_item_t *)lip;
+		ip = iip->ili_inode;
+
+		/* joined to a transaction again, leave it for the next batch */
+		if (ip->i_transp) {
+			pthread_mutex_lock(&xfs_trans_ail_lock);
+			list_move_tail(&lip->li_ail, &xfs_trans_ail);
+			pthread_mutex_unlock(&xfs_trans_ail_lock);
+			continue;
+		}
+
+		list_del_init(&lip->li_ail);
+		lip->li_flags &= ~XFS_LI_IN_AIL;
+		if (iip->ili_fields & XFS_ILOG_ALL)
+			inode_item_flush(iip);
+		libxfs_iput(ip);
+	}
+}
+
+static void
+xfs_trans_batch_commit(void)
+{
+	int			flush;
+
+	pthread_mutex_lock(&xfs_trans_ail_lock);
+	flush = ++xfs_trans_batched >= libxfs_trans_batch;
+	pthread_mutex_unlock(&xfs_trans_ail_lock);
+	if (flush)
+		libxfs_trans_batch_flush();
+}
+
 static void
 buf_item_done(
 	xfs_buf_log_item_t	*bip)
@@ -721,7 +965,9 @@ buf_item_done(
 	else
 		libxfs_putbuf(bp);
 	/* release the buf item */
-	kmem_zone_free(xfs_buf_item_zone, bip);
+	xfs_buf_item_zone->allocated--;
+	if (!xfs_trans_cache_free(XFS_TRANS_CACHE_BUF_ITEM, bip))
+		free(bip);
 }
 
 static void
@@ -765,13 +1011,36 @@ buf_item_unlock(
 
 static void
 inode_item_unlock(
-	xfs_inode_log_item_t	*iip)
+	xfs_inode_log_item_t	*iip,
+	int			dirty)
 {
 	xfs_inode_t		*ip = iip->ili_inode;
 
 	/* Clear the transaction pointer in the inode. */
 	ip->i_transp = NULL;
 
+	/*
+	 * A parked inode still has the fields of the batched commits set;
+	 * it only loses anything if this transaction logged it too.
+	 */
+	if (iip->ili_item.li_flags & XFS_LI_IN_AIL) {
+		if (!dirty) {
+			iip->ili_flags = 0;
+			return;
+		}
+		fprintf(stderr, _("%s: warning - cancelled transaction "
+			"discards batched changes to inode %llu\n"),
+			progname, (unsigned long long)ip->i_ino);
+	}
+
+	/*
+	 * Changes to a dirty inode are thrown away with the transaction, so
+	 * the in-core copy no longer matches the disk; don't let the inode
+	 * cache hand it out again.
+	 */
+	if (iip->ili_fields & XFS_ILOG_ALL)
+		ip->i_flags |= XFS_ISTALE;
+	iip->ili_fields = 0;
 	iip->ili_flags = 0;
 }
 
@@ -787,12 +1056,13 @@ xfs_trans_free_items(
 
 	list_for_each_entry_safe(lidp, next, &tp->t_items, lid_trans) {
 		struct xfs_log_item	*lip = lidp->lid_item;
+		int			dirty = lidp->lid_flags & XFS_LID_DIRTY;
 
                 xfs_trans_del_item(lip);
 		if (lip->li_type == XFS_LI_BUF)
 			buf_item_unlock((xfs_buf_log_item_t *)lip);
 		else if (lip->li_type == XFS_LI_INODE)
-			inode_item_unlock((xfs_inode_log_item_t *)lip);
+			inode_item_unlock((xfs_inode_log_item_t *)lip, dirty);
 		else {
 			fprintf(stderr, _("%s: unrecognised log item type\n"),
 				progname);
@@ -809,6 +1079,7 @@ libxfs_trans_commit(
 	xfs_trans_t	*tp)
 {
 	xfs_sb_t	*sbp;
+	xfs_buf_t	*bp;
 
 	if (tp == NULL)
 		return 0;
@@ -817,32 +1088,47 @@ libxfs_trans_commit(
 #ifdef XACT_DEBUG
 		fprintf(stderr, "committed clean transaction %p\n", tp);
 #endif
+		xfs_probe2(trans_commit, tp->t_type, 0);
 		xfs_trans_free_items(tp);
-		free(tp);
+		xfs_trans_free(tp);
 		tp = NULL;
 		return 0;
 	}
 
 	if (tp->t_flags & XFS_TRANS_SB_DIRTY) {
+		/*
+		 * This is xfs_log_sb, with the sb buffer taken before the
+		 * lock so that a transaction already holding it can't
+		 * deadlock against one waiting for it with the lock held.
+		 */
 		sbp = &(tp->t_mountp->m_sb);
+		bp = xfs_trans_getsb(tp, tp->t_mountp, 0);
+		pthread_mutex_lock(&xfs_trans_sb_lock);
 		if (tp->t_icount_delta)
-			sbp->sb_icount += tp->t_icount_delta;
+			counter_add(&sbp->sb_icount, tp->t_icount_delta);
 		if (tp->t_ifree_delta)
-			sbp->sb_ifree += tp->t_ifree_delta;
+			counter_add(&sbp->sb_ifree, tp->t_ifree_delta);
 		if (tp->t_fdblocks_delta)
-			sbp->sb_fdblocks += tp->t_fdblocks_delta;
+			counter_add(&sbp->sb_fdblocks, tp->t_fdblocks_delta);
 		if (tp->t_frextents_delta)
-			sbp->sb_frextents += tp->t_frextents_delta;
-		xfs_log_sb(tp);
+			counter_add(&sbp->sb_frextents,
+				    tp->t_frextents_delta);
+		xfs_sb_to_disk(XFS_BUF_TO_SBP(bp), sbp);
+		pthread_mutex_unlock(&xfs_trans_sb_lock);
+		xfs_trans_buf_set_type(tp, bp, XFS_BLFT_SB_BUF);
+		xfs_trans_log_buf(tp, bp, 0, sizeof(struct xfs_dsb));
 	}
 
 #ifdef XACT_DEBUG
 	fprintf(stderr, "committing dirty transaction %p\n", tp);
 #endif
+	xfs_probe2(trans_commit, tp->t_type, 1);
 	trans_committed(tp);
+	if (libxfs_trans_batch)
+		xfs_trans_batch_commit();
 
 	/* That's it for the transaction structure.  Free it. */
-	free(tp);
+	xfs_trans_free(tp);
 	tp = NULL;
 	return 0;
 }
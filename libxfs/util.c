@@ -359,10 +359,10 @@ libxfs_iprint(
 		(unsigned long)ip->i_df.if_u1.if_extents);
 	if (ip->i_df.if_flags & XFS_IFEXTENTS) {
 		nextents = ip->i_df.if_bytes / (uint)sizeof(*ep);
-		for (ep = ip->i_df.if_u1.if_extents, i = 0; i < nextents; 
-								i++, ep++) {
+		for (i = 0; i < nextents; i++) {
 			xfs_bmbt_irec_t rec;
 
+			ep = xfs_iext_get_ext(&ip->i_df, i);
 			xfs_bmbt_get_all(ep, &rec);
 			printf("\t%d: startoff %llu, startblock 0x%llx,"
 				" blockcount %llu, state %d\n",
@@ -473,15 +473,12 @@ libxfs_mod_incore_sb(
 	int64_t		delta,
 	int		rsvd)
 {
-	long long	lcounter;	/* long counter for 64 bit fields */
-
 	switch (field) {
 	case XFS_TRANS_SB_FDBLOCKS:
-		lcounter = (long long)mp->m_sb.sb_fdblocks;
-		lcounter += delta;
-		if (lcounter < 0)
+		/* transactions in other threads may be changing it too */
+		if (!counter64_add_unless_negative(&mp->m_sb.sb_fdblocks,
+						   delta))
 			return -ENOSPC;
-		mp->m_sb.sb_fdblocks = lcounter;
 		return 0;
 	default:
 		ASSERT(0);
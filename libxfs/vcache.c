@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs_priv.h"
+#include "init.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_log_format.h"
+#include "xfs_trans_resv.h"
+#include "xfs_mount.h"
+#include "xfs_da_format.h"
+#include "xfs_da_btree.h"
+#include "xfs_dir2.h"
+#include "libxfs.h"		/* for ARRAY_SIZE */
+
+/*
+ * Verified metadata cache.
+ *
+ * When LIBXFS_VERIFY_CACHE names a file and the data device is opened
+ * read only, every v5 metadata buffer that passes its read verifier is
+ * remembered by its disk address, length, stored CRC and LSN, and the
+ * lot is saved to the file at exit.  The next read only run against the
+ * same device loads the file, and a buffer whose stored CRC and LSN are
+ * still the ones remembered is taken as verified without running the
+ * verifier again.  That saves the CRC and structure checks for the runs
+ * of xfs_repair -n and xfs_db that tend to follow each other when
+ * looking into a problem.
+ *
+ * Only the CRC field is compared, not the data it covers, so the cache
+ * must only be used while nothing but these tools touches the device.
+ * Only buffer types with a single CRC at a fixed offset are cached;
+ * inode, dquot and remote attr or symlink buffers have one per record
+ * or per block and are always verified.
+ */
+#define VCACHE_MAGIC		0x5846535643414348ULL	/* XFSVCACH */
+#define VCACHE_VERSION		1
+
+struct vcache_hdr {
+	__uint64_t		magic;
+	__uint32_t		version;
+	__uint32_t		pad;
+	__uint64_t		dsize;		/* data device BBs */
+	__uint64_t		count;
+};
+
+struct vcache_entry {
+	__uint64_t		daddr;
+	__uint64_t		lsn;
+	__uint32_t		len;		/* BBs */
+	__uint32_t		crc;
+};
+
+struct vcache_type {
+	const struct xfs_buf_ops *ops;
+	unsigned int		crc_off;
+	unsigned int		lsn_off;
+};
+
+#define DA3_CRC_OFF	offsetof(struct xfs_da3_blkinfo, crc)
+#define DA3_LSN_OFF	offsetof(struct xfs_da3_blkinfo, lsn)
+#define DIR3_CRC_OFF	offsetof(struct xfs_dir3_blk_hdr, crc)
+#define DIR3_LSN_OFF	offsetof(struct xfs_dir3_blk_hdr, lsn)
+#define SBLOCK_LSN_OFF	offsetof(struct xfs_btree_block, bb_u.s.bb_lsn)
+#define LBLOCK_LSN_OFF	offsetof(struct xfs_btree_block, bb_u.l.bb_lsn)
+
+static const struct vcache_type vcache_types[] = {
+	{ &xfs_sb_buf_ops, offsetof(struct xfs_dsb, sb_crc),
+	  offsetof(struct xfs_dsb, sb_lsn) },
+	{ &xfs_agf_buf_ops, XFS_AGF_CRC_OFF, offsetof(struct xfs_agf, agf_lsn) },
+	{ &xfs_agi_buf_ops, XFS_AGI_CRC_OFF, offsetof(struct xfs_agi, agi_lsn) },
+	{ &xfs_agfl_buf_ops, XFS_AGFL_CRC_OFF,
+	  offsetof(struct xfs_agfl, agfl_lsn) },
+	{ &xfs_allocbt_buf_ops, XFS_BTREE_SBLOCK_CRC_OFF, SBLOCK_LSN_OFF },
+	{ &xfs_inobt_buf_ops, XFS_BTREE_SBLOCK_CRC_OFF, SBLOCK_LSN_OFF },
+	{ &xfs_bmbt_buf_ops, XFS_BTREE_LBLOCK_CRC_OFF, LBLOCK_LSN_OFF },
+	{ &xfs_da3_node_buf_ops, DA3_CRC_OFF, DA3_LSN_OFF },
+	{ &xfs_attr3_leaf_buf_ops, DA3_CRC_OFF, DA3_LSN_OFF },
+	{ &xfs_dir3_leaf1_buf_ops, DA3_CRC_OFF, DA3_LSN_OFF },
+	{ &xfs_dir3_leafn_buf_ops, DA3_CRC_OFF, DA3_LSN_OFF },
+	{ &xfs_dir3_block_buf_ops, DIR3_CRC_OFF, DIR3_LSN_OFF },
+	{ &xfs_dir3_data_buf_ops, DIR3_CRC_OFF, DIR3_LSN_OFF },
+	{ &xfs_dir3_free_buf_ops, DIR3_CRC_OFF, DIR3_LSN_OFF },
+};
+
+static struct {
+	const char		*path;
+	dev_t			dev;
+	__uint64_t		dsize;
+	struct vcache_entry	*loaded;	/* sorted, read only */
+	char			*stale;		/* per loaded entry */
+	__uint64_t		nloaded;
+	struct vcache_entry	*added;
+	__uint64_t		nadded;
+	__uint64_t		maxadded;
+	pthread_mutex_t		lock;
+} vcache = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int
+vcache_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct vcache_entry *ea = a;
+	const struct vcache_entry *eb = b;
+
+	if (ea->daddr != eb->daddr)
+		return ea->daddr < eb->daddr ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Fill in the entry for a buffer, if it is of a type we cache.  Returns 0
+ * if it isn't.
+ */
+static int
+vcache_entry(
+	struct xfs_buf		*bp,
+	struct vcache_entry	*ent)
+{
+	const struct vcache_type *vt;
+	struct xfs_mount	*mp = bp->b_target->bt_mount;
+	char			*p = bp->b_addr;
+
+	if (!vcache.path || bp->b_target->dev != vcache.dev || !mp ||
+	    !xfs_sb_version_hascrc(&mp->m_sb))
+		return 0;
+	for (vt = vcache_types; vt < &vcache_types[ARRAY_SIZE(vcache_types)];
+	     vt++)
+		if (vt->ops == bp->b_ops)
+			break;
+	if (vt == &vcache_types[ARRAY_SIZE(vcache_types)] ||
+	    BBTOB(bp->b_length) < vt->lsn_off + sizeof(__be64))
+		return 0;
+	ent->daddr = bp->b_bn;
+	ent->len = bp->b_length;
+	ent->crc = *(__uint32_t *)(p + vt->crc_off);
+	ent->lsn = get_unaligned_be64(p + vt->lsn_off);
+	return 1;
+}
+
+/*
+ * Has this buffer been verified by an earlier run?  Only entries loaded
+ * from the file are looked at, they aren't changed until exit.
+ */
+int
+libxfs_vcache_lookup(
+	struct xfs_buf		*bp)
+{
+	struct vcache_entry	ent;
+	struct vcache_entry	*found;
+
+	if (!vcache.nloaded || !vcache_entry(bp, &ent))
+		return 0;
+	found = bsearch(&ent, vcache.loaded, vcache.nloaded,
+			sizeof(ent), vcache_cmp);
+	if (!found)
+		return 0;
+	if (found->len != ent.len || found->crc != ent.crc ||
+	    found->lsn != ent.lsn) {
+		vcache.stale[found - vcache.loaded] = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* this buffer just passed its read verifier */
+void
+libxfs_vcache_add(
+	struct xfs_buf		*bp)
+{
+	struct vcache_entry	ent;
+	struct vcache_entry	*added;
+	__uint64_t		max;
+
+	if (!vcache_entry(bp, &ent))
+		return;
+	pthread_mutex_lock(&vcache.lock);
+	if (vcache.nadded == vcache.maxadded) {
+		max = vcache.maxadded ? vcache.maxadded * 2 : 4096;
+		added = realloc(vcache.added, max * sizeof(ent));
+		if (!added) {
+			pthread_mutex_unlock(&vcache.lock);
+			return;
+		}
+		vcache.added = added;
+		vcache.maxadded = max;
+	}
+	vcache.added[vcache.nadded++] = ent;
+	pthread_mutex_unlock(&vcache.lock);
+}
+
+static int
+vcache_load(
+	FILE			*fp)
+{
+	struct vcache_hdr	hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != VCACHE_MAGIC || hdr.version != VCACHE_VERSION ||
+	    hdr.dsize != vcache.dsize || !hdr.count)
+		return 0;
+	vcache.loaded = malloc(hdr.count * sizeof(struct vcache_entry));
+	vcache.stale = calloc(hdr.count, 1);
+	if (!vcache.loaded || !vcache.stale)
+		return -1;
+	if (fread(vcache.loaded, sizeof(struct vcache_entry), hdr.count,
+		  fp) != hdr.count)
+		return -1;
+	vcache.nloaded = hdr.count;
+	return 0;
+}
+
+/*
+ * Write the loaded entries that weren't found to be stale along with the
+ * ones added by this run, sorted, to a new file and rename it over the
+ * old one.  A block is only verified, and so added, if it wasn't loaded
+ * or its entry was stale, and nothing changes it during a read only run,
+ * so any duplicates left are the same block verified twice.
+ */
+static void
+vcache_save(void)
+{
+	struct vcache_hdr	hdr;
+	struct vcache_entry	*all;
+	__uint64_t		n = 0;
+	__uint64_t		i, j;
+	char			*tmp;
+	FILE			*fp;
+
+	if (!vcache.nadded)
+		return;
+	all = malloc((vcache.nloaded + vcache.nadded) * sizeof(*all));
+	tmp = malloc(strlen(vcache.path) + 5);
+	if (!all || !tmp)
+		goto out;
+	for (i = 0; i < vcache.nloaded; i++)
+		if (!vcache.stale[i])
+			all[n++] = vcache.loaded[i];
+	memcpy(&all[n], vcache.added, vcache.nadded * sizeof(*all));
+	n += vcache.nadded;
+	qsort(all, n, sizeof(*all), vcache_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && all[j - 1].daddr == all[i].daddr)
+			j--;
+		all[j++] = all[i];
+	}
+
+	sprintf(tmp, "%s.new", vcache.path);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		goto out_warn;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = VCACHE_MAGIC;
+	hdr.version = VCACHE_VERSION;
+	hdr.dsize = vcache.dsize;
+	hdr.count = j;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(all, sizeof(*all), j, fp) != j) {
+		fclose(fp);
+		unlink(tmp);
+		goto out_warn;
+	}
+	if (fclose(fp) || rename(tmp, vcache.path) < 0) {
+		unlink(tmp);
+		goto out_warn;
+	}
+	goto out;
+out_warn:
+	fprintf(stderr, _("%s: couldn't save verify cache %s: %s\n"),
+		progname, vcache.path, strerror(errno));
+out:
+	free(tmp);
+	free(all);
+}
+
+static void
+vcache_atexit(void)
+{
+	vcache_save();
+	free(vcache.loaded);
+	free(vcache.stale);
+	free(vcache.added);
+}
+
+/*
+ * Called by libxfs_init once the data device is open, and only when it is
+ * opened read only.  dsize is its size in BBs, a file saved for a device
+ * of a different size is ignored.
+ */
+void
+libxfs_vcache_init(
+	dev_t			dev,
+	__uint64_t		dsize)
+{
+	const char		*path = getenv("LIBXFS_VERIFY_CACHE");
+	FILE			*fp;
+
+	if (vcache.path || !path || !*path || !dev)
+		return;
+	vcache.dev = dev;
+	vcache.dsize = dsize;
+	fp = fopen(path, "r");
+	if (fp) {
+		if (vcache_load(fp) < 0) {
+			fprintf(stderr, _("%s: couldn't load verify cache %s\n"),
+				progname, path);
+			free(vcache.loaded);
+			free(vcache.stale);
+			vcache.loaded = NULL;
+			vcache.stale = NULL;
+			vcache.nloaded = 0;
+		}
+		fclose(fp);
+	}
+	vcache.path = path;
+	atexit(vcache_atexit);
+}
@@ -304,6 +304,181 @@ xfs_alloc_fix_minleft(
 	return 0;
 }
 
+/*
+ * In-memory summary of an AG's free space, for the near allocator.  The
+ * AG is cut into at most XFS_ALLOC_INDEX_MAX regions of a power of two
+ * blocks each, and for each region we keep the length of the longest
+ * free extent starting in it, or XFS_ALLOC_INDEX_UNKNOWN once that extent
+ * has been allocated and we can't tell what the next longest is.  The
+ * near allocator uses it to step over whole stretches of the by-bno btree
+ * in which nothing is long enough, rather than reading every record on
+ * the way.  In a badly fragmented AG that walk is where the offline tools
+ * spend their allocation time.
+ *
+ * The summary is built from the by-bno btree the first time it's needed
+ * in an AG, and kept up to date by the functions changing that btree.  It
+ * follows the AG's free block count through those changes, and if that
+ * no longer matches the AGF's, something changed the btree behind our
+ * back and it's built again, as it is once too many regions have become
+ * unknown.
+ */
+#define XFS_ALLOC_INDEX_MAX	16384
+#define XFS_ALLOC_INDEX_UNKNOWN	((xfs_extlen_t)-1)
+
+struct xfs_alloc_index {
+	int		ai_shift;	/* log2 of blocks per region */
+	int		ai_nregions;
+	int		ai_nunknown;	/* regions with an unknown longest */
+	xfs_extlen_t	ai_freeblks;	/* pagf_freeblks, as far as we know */
+	xfs_extlen_t	ai_longest[];
+};
+
+/* a free extent was added to the by-bno btree */
+STATIC void
+xfs_alloc_index_add(
+	struct xfs_perag	*pag,
+	xfs_agblock_t		bno,
+	xfs_extlen_t		len)
+{
+	struct xfs_alloc_index	*ai = pag->pagf_index;
+	int			r;
+
+	if (!ai)
+		return;
+	r = bno >> ai->ai_shift;
+	if (r < ai->ai_nregions && len > ai->ai_longest[r])
+		ai->ai_longest[r] = len;
+	ai->ai_freeblks += len;
+}
+
+/* a free extent was removed from the by-bno btree */
+STATIC void
+xfs_alloc_index_del(
+	struct xfs_perag	*pag,
+	xfs_agblock_t		bno,
+	xfs_extlen_t		len)
+{
+	struct xfs_alloc_index	*ai = pag->pagf_index;
+	int			r;
+
+	if (!ai)
+		return;
+	r = bno >> ai->ai_shift;
+	if (r < ai->ai_nregions && len >= ai->ai_longest[r] &&
+	    ai->ai_longest[r] != XFS_ALLOC_INDEX_UNKNOWN) {
+		ai->ai_longest[r] = XFS_ALLOC_INDEX_UNKNOWN;
+		ai->ai_nunknown++;
+	}
+	ai->ai_freeblks -= len;
+}
+
+/*
+ * Return the AG's summary, building it if it doesn't exist or can't be
+ * trusted, or NULL if there isn't the memory for one.
+ */
+STATIC int
+xfs_alloc_index_get(
+	struct xfs_alloc_arg	*args,
+	struct xfs_alloc_index	**aip)
+{
+	struct xfs_perag	*pag = args->pag;
+	struct xfs_alloc_index	*ai = pag->pagf_index;
+	struct xfs_btree_cur	*cur;
+	xfs_agblock_t		agblocks = args->mp->m_sb.sb_agblocks;
+	xfs_agblock_t		bno;
+	xfs_extlen_t		len;
+	int			shift;
+	int			error;
+	int			i;
+	int			r;
+
+	*aip = NULL;
+	if (ai && ai->ai_freeblks == pag->pagf_freeblks &&
+	    ai->ai_nunknown <= ai->ai_nregions / 4) {
+		*aip = ai;
+		return 0;
+	}
+	if (!ai) {
+		for (shift = 0; ((agblocks - 1) >> shift) >= XFS_ALLOC_INDEX_MAX;
+		     shift++)
+			;
+		r = ((agblocks - 1) >> shift) + 1;
+		ai = kmem_alloc(sizeof(*ai) + r * sizeof(xfs_extlen_t),
+				KM_MAYFAIL);
+		if (!ai)
+			return 0;
+		ai->ai_shift = shift;
+		ai->ai_nregions = r;
+	}
+	pag->pagf_index = NULL;
+	memset(ai->ai_longest, 0, ai->ai_nregions * sizeof(xfs_extlen_t));
+	ai->ai_nunknown = 0;
+
+	cur = xfs_allocbt_init_cursor(args->mp, args->tp, args->agbp,
+			args->agno, XFS_BTNUM_BNO);
+	error = xfs_alloc_lookup_ge(cur, 0, 0, &i);
+	while (!error && i) {
+		error = xfs_alloc_get_rec(cur, &bno, &len, &i);
+		if (error || !i)
+			break;
+		r = bno >> ai->ai_shift;
+		if (r >= ai->ai_nregions) {
+			error = -EFSCORRUPTED;
+			break;
+		}
+		ai->ai_longest[r] = max(ai->ai_longest[r], len);
+		error = xfs_btree_increment(cur, 0, &i);
+	}
+	xfs_btree_del_cursor(cur, error ? XFS_BTREE_ERROR : XFS_BTREE_NOERROR);
+	if (error) {
+		kmem_free(ai);
+		return error;
+	}
+	ai->ai_freeblks = pag->pagf_freeblks;
+	pag->pagf_index = ai;
+	*aip = ai;
+	return 0;
+}
+
+/*
+ * The by-bno cursor points at a record starting at bno that isn't long
+ * enough.  Move it to the next record in the direction of the search that
+ * could be, skipping the regions with nothing of at least minlen in them.
+ * *stat is set to 0 if there's no such record.
+ */
+STATIC int
+xfs_alloc_index_step(
+	struct xfs_alloc_index	*ai,
+	struct xfs_btree_cur	*cur,
+	xfs_agblock_t		bno,
+	xfs_extlen_t		minlen,
+	int			left,
+	int			*stat)
+{
+	int			r = bno >> ai->ai_shift;
+	int			n;
+
+	if (ai->ai_longest[r] >= minlen) {
+		if (left)
+			return xfs_btree_decrement(cur, 0, stat);
+		return xfs_btree_increment(cur, 0, stat);
+	}
+	n = r;
+	do {
+		n += left ? -1 : 1;
+	} while (n >= 0 && n < ai->ai_nregions && ai->ai_longest[n] < minlen);
+	if (n < 0 || n >= ai->ai_nregions) {
+		*stat = 0;
+		return 0;
+	}
+	if (left)
+		return xfs_alloc_lookup_le(cur,
+				((xfs_agblock_t)(n + 1) << ai->ai_shift) - 1,
+				XFS_ALLOC_INDEX_UNKNOWN, stat);
+	return xfs_alloc_lookup_ge(cur, (xfs_agblock_t)n << ai->ai_shift, 0,
+			stat);
+}
+
 /*
  * Update the two btrees, logically removing from freespace the extent
  * starting at rbno, rlen blocks.  The extent is contained within the
@@ -328,6 +503,7 @@ xfs_alloc_fixup_trees(
 	xfs_extlen_t	nflen1=0;	/* first new free length */
 	xfs_extlen_t	nflen2=0;	/* second new free length */
 	struct xfs_mount *mp;
+	struct xfs_perag *pag;
 
 	mp = cnt_cur->bc_mp;
 
@@ -449,6 +625,14 @@ xfs_alloc_fixup_trees(
 			return error;
 		XFS_WANT_CORRUPTED_RETURN(mp, i == 1);
 	}
+
+	pag = xfs_perag_get(mp, bno_cur->bc_private.a.agno);
+	xfs_alloc_index_del(pag, fbno, flen);
+	if (nfbno1 != NULLAGBLOCK)
+		xfs_alloc_index_add(pag, nfbno1, nflen1);
+	if (nfbno2 != NULLAGBLOCK)
+		xfs_alloc_index_add(pag, nfbno2, nflen2);
+	xfs_perag_put(pag);
 	return 0;
 }
 
@@ -529,6 +713,7 @@ xfs_agfl_write_verify(
 }
 
 const struct xfs_buf_ops xfs_agfl_buf_ops = {
+	.name = "xfs_agfl",
 	.verify_read = xfs_agfl_read_verify,
 	.verify_write = xfs_agfl_write_verify,
 };
@@ -888,6 +1073,7 @@ xfs_alloc_ag_vextent_near(
 	xfs_extlen_t	ltlena;		/* aligned ... */
 	xfs_agblock_t	ltnew;		/* useful start bno of left side */
 	xfs_extlen_t	rlen;		/* length of returned extent */
+	struct xfs_alloc_index *ai;	/* free space summary, if any */
 	int		forced = 0;
 #ifdef DEBUG
 	/*
@@ -1074,7 +1260,11 @@ restart:
 	 * With alignment, it's possible for both to fail; the upper
 	 * level algorithm that picks allocation groups for allocations
 	 * is not supposed to do this.
+	 * The AG's free space summary, if we have one, lets both searches
+	 * skip the stretches with nothing big enough in them.
 	 */
+	if ((error = xfs_alloc_index_get(args, &ai)))
+		goto error0;
 	/*
 	 * Allocate and initialize the cursor for the leftward search.
 	 */
@@ -1125,7 +1315,12 @@ restart:
 						  &ltbnoa, &ltlena);
 			if (ltlena >= args->minlen && ltbnoa >= args->min_agbno)
 				break;
-			if ((error = xfs_btree_decrement(bno_cur_lt, 0, &i)))
+			if (ai)
+				error = xfs_alloc_index_step(ai, bno_cur_lt,
+						ltbno, args->minlen, 1, &i);
+			else
+				error = xfs_btree_decrement(bno_cur_lt, 0, &i);
+			if (error)
 				goto error0;
 			if (!i || ltbnoa < args->min_agbno) {
 				xfs_btree_del_cursor(bno_cur_lt,
@@ -1141,7 +1336,12 @@ restart:
 						  &gtbnoa, &gtlena);
 			if (gtlena >= args->minlen && gtbnoa <= args->max_agbno)
 				break;
-			if ((error = xfs_btree_increment(bno_cur_gt, 0, &i)))
+			if (ai)
+				error = xfs_alloc_index_step(ai, bno_cur_gt,
+						gtbno, args->minlen, 0, &i);
+			else
+				error = xfs_btree_increment(bno_cur_gt, 0, &i);
+			if (error)
 				goto error0;
 			if (!i || gtbnoa > args->max_agbno) {
 				xfs_btree_del_cursor(bno_cur_gt,
@@ -1797,6 +1997,11 @@ xfs_free_ag_extent(
 	 * Update the freespace totals in the ag and superblock.
 	 */
 	pag = xfs_perag_get(mp, agno);
+	if (haveleft)
+		xfs_alloc_index_del(pag, ltbno, ltlen);
+	if (haveright)
+		xfs_alloc_index_del(pag, gtbno, gtlen);
+	xfs_alloc_index_add(pag, nbno, nlen);
 	error = xfs_alloc_update_counters(tp, pag, agbp, len);
 	xfs_perag_put(pag);
 	if (error)
@@ -2329,6 +2534,7 @@ xfs_agf_write_verify(
 }
 
 const struct xfs_buf_ops xfs_agf_buf_ops = {
+	.name = "xfs_agf",
 	.verify_read = xfs_agf_read_verify,
 	.verify_write = xfs_agf_write_verify,
 };
@@ -1688,6 +1688,44 @@ xfs_lookup_get_search_key(
 	return xfs_btree_key_addr(cur, keyno, block);
 }
 
+/*
+ * Find the lowest level of the path the cursor holds whose block has keys
+ * on both sides of (or equal to) the one being looked up.  A lookup from
+ * the root would come down through that block anyway, so it can start
+ * there, and callers looking up keys close to the last one don't redo
+ * the search in the blocks above it.  Returns -1 if the search has to
+ * start at the root.
+ */
+STATIC int
+xfs_btree_lookup_warm_level(
+	struct xfs_btree_cur	*cur)
+{
+	struct xfs_btree_block	*block;
+	union xfs_btree_key	key;
+	union xfs_btree_key	*kp;
+	int			level;
+	int			numrecs;
+
+	/* the root is where we'd start anyway */
+	for (level = 0; level < cur->bc_nlevels - 1; level++) {
+		if (!cur->bc_bufs[level])
+			return -1;
+		block = XFS_BUF_TO_BLOCK(cur->bc_bufs[level]);
+		numrecs = xfs_btree_get_numrecs(block);
+		if (!numrecs)
+			return -1;
+
+		kp = xfs_lookup_get_search_key(cur, level, 1, block, &key);
+		if (cur->bc_ops->key_diff(cur, kp) > 0)
+			continue;
+		kp = xfs_lookup_get_search_key(cur, level, numrecs, block,
+				&key);
+		if (cur->bc_ops->key_diff(cur, kp) >= 0)
+			return level;
+	}
+	return -1;
+}
+
 /*
  * Lookup the record.  The cursor is made to point to it, based on dir.
  * stat is set to 0 if can't find any such record, 1 for success.
@@ -1714,8 +1752,19 @@ xfs_btree_lookup(
 	block = NULL;
 	keyno = 0;
 
-	/* initialise start pointer from cursor */
-	cur->bc_ops->init_ptr_from_cur(cur, &ptr);
+	/*
+	 * Start from the root, or if the cursor's path already leads to
+	 * the key, from the block it was found in.
+	 */
+	level = -1;
+	if (cur->bc_flags & XFS_BTREE_WARM_LOOKUP)
+		level = xfs_btree_lookup_warm_level(cur);
+	if (level >= 0) {
+		xfs_btree_buf_to_ptr(cur, cur->bc_bufs[level], &ptr);
+	} else {
+		level = cur->bc_nlevels - 1;
+		cur->bc_ops->init_ptr_from_cur(cur, &ptr);
+	}
 	pp = &ptr;
 
 	/*
@@ -1724,7 +1773,7 @@ xfs_btree_lookup(
 	 * on the lookup record, then follow the corresponding block
 	 * pointer down to the next level.
 	 */
-	for (level = cur->bc_nlevels - 1, diff = 1; level >= 0; level--) {
+	for (diff = 1; level >= 0; level--) {
 		/* Get the block we need to do the lookup on. */
 		error = xfs_btree_lookup_get_block(cur, level, pp, &block);
 		if (error)
@@ -4068,3 +4117,335 @@ xfs_btree_change_owner(
 
 	return 0;
 }
+
+/*
+ * Bulk loading.
+ *
+ * Build a new btree bottom up from records supplied in key order, rather
+ * than inserting them one at a time.  Each level is written left to right
+ * with its blocks filled to fill_pct of maxrecs and the entries spread
+ * evenly between them, then the first key and address of each of those
+ * blocks become the entries of the level above, until they fit in one
+ * block, or in the inode fork for btrees rooted in the inode.
+ *
+ * The caller sets get_record, alloc_block, nr_records and fill_pct, and
+ * calls xfs_btree_bload_compute_geometry to find out how many blocks the
+ * new btree needs, so that they can be reserved before any are handed out
+ * by alloc_block.  xfs_btree_bload then builds the btree and returns its
+ * root, which the caller links into the AG header; a root in the inode is
+ * built in the fork's if_broot, and the caller sets the fork format and
+ * logs the inode.
+ *
+ * Without a transaction the finished blocks are written in batches sorted
+ * by disk address, so that blocks handed out contiguously go out in a few
+ * large writes; with one they are logged in it instead.
+ */
+#define XFS_BTREE_BLOAD_BATCH	64		/* blocks per write */
+
+/*
+ * Return the number of entries to put in each block of level, which isn't
+ * the root.
+ */
+STATIC int
+xfs_btree_bload_perblock(
+	struct xfs_btree_cur	*cur,
+	struct xfs_btree_bload	*bbl,
+	int			level)
+{
+	int			fill = bbl->fill_pct;
+	int			maxrecs;
+
+	if (fill <= 0 || fill > 100)
+		fill = 100;
+	else if (fill < 50)
+		fill = 50;
+	cur->bc_nlevels = XFS_BTREE_MAXLEVELS;
+	maxrecs = cur->bc_ops->get_maxrecs(cur, level);
+	return max(2, maxrecs * fill / 100);
+}
+
+/*
+ * Return whether nr entries at level fit in a root in the inode.
+ */
+STATIC int
+xfs_btree_bload_fits_iroot(
+	struct xfs_btree_cur	*cur,
+	int			level,
+	__uint64_t		nr)
+{
+	if (!(cur->bc_flags & XFS_BTREE_ROOT_IN_INODE) || level == 0)
+		return 0;
+	cur->bc_nlevels = level + 1;
+	return nr <= cur->bc_ops->get_dmaxrecs(cur, level);
+}
+
+/*
+ * Work out the height of the btree for nr_records, and the number of
+ * blocks it will take, not counting a root in the inode.
+ */
+int
+xfs_btree_bload_compute_geometry(
+	struct xfs_btree_cur	*cur,
+	struct xfs_btree_bload	*bbl)
+{
+	__uint64_t		nr = bbl->nr_records;
+	__uint64_t		blocks;
+	int			perblock;
+	int			level;
+
+	if (nr == 0 && (cur->bc_flags & XFS_BTREE_ROOT_IN_INODE))
+		return -EINVAL;
+
+	bbl->nr_blocks = 0;
+	for (level = 0; level < XFS_BTREE_MAXLEVELS; level++) {
+		if (xfs_btree_bload_fits_iroot(cur, level, nr)) {
+			bbl->height = level + 1;
+			cur->bc_nlevels = bbl->height;
+			return 0;
+		}
+		perblock = xfs_btree_bload_perblock(cur, bbl, level);
+		blocks = max_t(__uint64_t, 1, (nr + perblock - 1) / perblock);
+		bbl->nr_blocks += blocks;
+		if (blocks == 1 && !(cur->bc_flags & XFS_BTREE_ROOT_IN_INODE)) {
+			bbl->height = level + 1;
+			cur->bc_nlevels = bbl->height;
+			return 0;
+		}
+		nr = blocks;
+	}
+	return -EOVERFLOW;
+}
+
+static int
+xfs_btree_bload_buf_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_buf	*ba = *(const struct xfs_buf **)a;
+	const struct xfs_buf	*bb = *(const struct xfs_buf **)b;
+
+	if (ba->b_bn != bb->b_bn)
+		return ba->b_bn < bb->b_bn ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write out or log a batch of finished blocks, and let go of them.
+ */
+STATIC int
+xfs_btree_bload_flush(
+	struct xfs_btree_cur	*cur,
+	struct xfs_buf		**bufs,
+	int			*nbufs)
+{
+	int			error = 0;
+	int			i;
+
+	if (cur->bc_tp) {
+		for (i = 0; i < *nbufs; i++)
+			xfs_trans_log_buf(cur->bc_tp, bufs[i], 0,
+					  BBTOB(bufs[i]->b_length) - 1);
+	} else if (*nbufs) {
+		qsort(bufs, *nbufs, sizeof(*bufs), xfs_btree_bload_buf_cmp);
+		error = libxfs_writebufr_list(cur->bc_mp->m_ddev_targp, bufs,
+					      *nbufs);
+		for (i = 0; i < *nbufs; i++)
+			xfs_buf_relse(bufs[i]);
+	}
+	*nbufs = 0;
+	return error;
+}
+
+/*
+ * Copy n keys and pointers into a node from the arrays of unions they are
+ * collected in, which are spaced further apart than in a block.
+ */
+STATIC void
+xfs_btree_bload_copy(
+	struct xfs_btree_cur	*cur,
+	struct xfs_btree_block	*block,
+	int			index,
+	union xfs_btree_key	*keys,
+	union xfs_btree_ptr	*ptrs,
+	int			n)
+{
+	int			i;
+
+	for (i = 0; i < n; i++) {
+		xfs_btree_copy_keys(cur, xfs_btree_key_addr(cur, index + i,
+				    block), &keys[i], 1);
+		xfs_btree_copy_ptrs(cur, xfs_btree_ptr_addr(cur, index + i,
+				    block), &ptrs[i], 1);
+	}
+}
+
+/*
+ * Build the root of the btree in the inode fork from the nr entries in
+ * keys and ptrs.
+ */
+STATIC void
+xfs_btree_bload_iroot(
+	struct xfs_btree_cur	*cur,
+	int			level,
+	__uint64_t		nr,
+	union xfs_btree_key	*keys,
+	union xfs_btree_ptr	*ptrs)
+{
+	struct xfs_inode	*ip = cur->bc_private.b.ip;
+	int			whichfork = cur->bc_private.b.whichfork;
+	struct xfs_btree_block	*block;
+
+	ASSERT(XFS_IFORK_PTR(ip, whichfork)->if_broot == NULL);
+	xfs_iroot_realloc(ip, nr, whichfork);
+	block = xfs_btree_get_iroot(cur);
+	xfs_btree_init_block_int(cur->bc_mp, block, XFS_BUF_DADDR_NULL,
+				 xfs_btree_magic(cur), level, nr, ip->i_ino,
+				 cur->bc_flags);
+	xfs_btree_bload_copy(cur, block, 1, keys, ptrs, nr);
+}
+
+/*
+ * Build one level of the btree from nr entries.  At level 0 these are the
+ * records from get_record; above it they are the first key and address of
+ * each block of the level below, in keys and ptrs, which are replaced by
+ * those of the blocks built here.  The number of blocks built is returned
+ * in *nblocks.
+ */
+STATIC int
+xfs_btree_bload_level(
+	struct xfs_btree_cur	*cur,
+	struct xfs_btree_bload	*bbl,
+	void			*priv,
+	int			level,
+	__uint64_t		nr,
+	union xfs_btree_key	*keys,
+	union xfs_btree_ptr	*ptrs,
+	__uint64_t		*nblocks)
+{
+	struct xfs_buf		*bufs[XFS_BTREE_BLOAD_BATCH];
+	struct xfs_btree_block	*block;
+	struct xfs_buf		*bp;
+	union xfs_btree_ptr	left;
+	union xfs_btree_ptr	ptr;
+	union xfs_btree_ptr	next;
+	__uint64_t		blocks;
+	__uint64_t		first = 0;	/* first entry of this block */
+	__uint64_t		j;
+	int			nbufs = 0;
+	int			perblock;
+	int			n;
+	int			i;
+	int			error;
+
+	perblock = xfs_btree_bload_perblock(cur, bbl, level);
+	cur->bc_nlevels = bbl->height;
+	blocks = max_t(__uint64_t, 1, (nr + perblock - 1) / perblock);
+
+	xfs_btree_set_ptr_null(cur, &left);
+	error = bbl->alloc_block(cur, &ptr, priv);
+	if (error)
+		return error;
+	for (j = 0; j < blocks; j++) {
+		n = nr / blocks + (j < nr % blocks);
+		if (j < blocks - 1) {
+			error = bbl->alloc_block(cur, &next, priv);
+			if (error)
+				goto out;
+		} else {
+			xfs_btree_set_ptr_null(cur, &next);
+		}
+
+		error = xfs_btree_get_buf_block(cur, &ptr, 0, &block, &bp);
+		if (error)
+			goto out;
+		memset(block, 0, BBTOB(bp->b_length));
+		xfs_btree_init_block_cur(cur, bp, level, n);
+		xfs_btree_set_sibling(cur, block, &left, XFS_BB_LEFTSIB);
+		xfs_btree_set_sibling(cur, block, &next, XFS_BB_RIGHTSIB);
+		bufs[nbufs++] = bp;
+
+		if (level == 0) {
+			for (i = 1; i <= n; i++) {
+				error = bbl->get_record(cur, priv);
+				if (error)
+					goto out;
+				cur->bc_ops->init_rec_from_cur(cur,
+						xfs_btree_rec_addr(cur, i, block));
+			}
+			if (n)
+				cur->bc_ops->init_key_from_rec(&keys[j],
+						xfs_btree_rec_addr(cur, 1, block));
+		} else {
+			xfs_btree_bload_copy(cur, block, 1, &keys[first],
+					     &ptrs[first], n);
+			/* first >= j, so this doesn't overwrite unread entries */
+			keys[j] = keys[first];
+		}
+		ptrs[j] = ptr;
+		first += n;
+		left = ptr;
+		ptr = next;
+
+		if (nbufs == XFS_BTREE_BLOAD_BATCH) {
+			error = xfs_btree_bload_flush(cur, bufs, &nbufs);
+			if (error)
+				goto out;
+		}
+	}
+	*nblocks = blocks;
+	return xfs_btree_bload_flush(cur, bufs, &nbufs);
+out:
+	if (!cur->bc_tp) {
+		for (i = 0; i < nbufs; i++)
+			xfs_buf_relse(bufs[i]);
+	}
+	return error;
+}
+
+/*
+ * Build a new btree from bbl->nr_records records, after
+ * xfs_btree_bload_compute_geometry has set up bbl.  The root is returned in
+ * bbl->root, unless it is in the inode.
+ */
+int
+xfs_btree_bload(
+	struct xfs_btree_cur	*cur,
+	struct xfs_btree_bload	*bbl,
+	void			*priv)
+{
+	union xfs_btree_key	*keys;
+	union xfs_btree_ptr	*ptrs;
+	__uint64_t		nr = bbl->nr_records;
+	__uint64_t		nleaves;
+	int			perblock;
+	int			level;
+	int			error = 0;
+
+	ASSERT(bbl->height > 0 && bbl->height <= XFS_BTREE_MAXLEVELS);
+
+	/* the leaf level has the most blocks, and so the most keys */
+	perblock = xfs_btree_bload_perblock(cur, bbl, 0);
+	nleaves = max_t(__uint64_t, 1, (nr + perblock - 1) / perblock);
+	keys = kmem_alloc(nleaves * sizeof(*keys), KM_NOFS);
+	ptrs = kmem_alloc(nleaves * sizeof(*ptrs), KM_NOFS);
+
+	for (level = 0; level < bbl->height; level++) {
+		if (level == bbl->height - 1 &&
+		    (cur->bc_flags & XFS_BTREE_ROOT_IN_INODE)) {
+			cur->bc_nlevels = bbl->height;
+			xfs_btree_bload_iroot(cur, level, nr, keys, ptrs);
+			break;
+		}
+		error = xfs_btree_bload_level(cur, bbl, priv, level, nr, keys,
+					      ptrs, &nr);
+		if (error)
+			goto out;
+	}
+	if (!(cur->bc_flags & XFS_BTREE_ROOT_IN_INODE))
+		bbl->root = ptrs[0];
+	cur->bc_nlevels = bbl->height;
+out:
+	kmem_free(keys);
+	kmem_free(ptrs);
+	return error;
+}
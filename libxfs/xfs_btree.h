@@ -231,6 +231,7 @@ typedef struct xfs_btree_cur
 #define XFS_BTREE_ROOT_IN_INODE		(1<<1)	/* root may be variable size */
 #define XFS_BTREE_LASTREC_UPDATE	(1<<2)	/* track last rec externally */
 #define XFS_BTREE_CRC_BLOCKS		(1<<3)	/* uses extended btree blocks */
+#define XFS_BTREE_WARM_LOOKUP		(1<<4)	/* lookups may reuse the path */
 
 
 #define	XFS_BTREE_NOERROR	0
@@ -396,6 +397,32 @@ int xfs_btree_get_rec(struct xfs_btree_cur *, union xfs_btree_rec **, int *);
 int xfs_btree_change_owner(struct xfs_btree_cur *cur, __uint64_t new_owner,
 			   struct list_head *buffer_list);
 
+/*
+ * Bulk loading of a new btree from records in key order, see xfs_btree.c.
+ */
+struct xfs_btree_bload {
+	/* set by the caller */
+	int		(*get_record)(struct xfs_btree_cur *cur, void *priv);
+					/* next record into cur->bc_rec */
+	int		(*alloc_block)(struct xfs_btree_cur *cur,
+				       union xfs_btree_ptr *ptr, void *priv);
+					/* next block for the new btree */
+	__uint64_t	nr_records;
+	int		fill_pct;	/* of maxrecs, 50-100, 0 for 100 */
+
+	/* set by xfs_btree_bload_compute_geometry */
+	int		height;
+	__uint64_t	nr_blocks;	/* not counting a root in the inode */
+
+	/* set by xfs_btree_bload */
+	union xfs_btree_ptr root;	/* unless the root is in the inode */
+};
+
+int xfs_btree_bload_compute_geometry(struct xfs_btree_cur *cur,
+				     struct xfs_btree_bload *bbl);
+int xfs_btree_bload(struct xfs_btree_cur *cur, struct xfs_btree_bload *bbl,
+		    void *priv);
+
 /*
  * btree block CRC helpers
  */
@@ -60,4 +60,70 @@ xfs_verify_cksum(char *buffer, size_t length, unsigned long cksum_offset)
 	return *(__le32 *)(buffer + cksum_offset) == xfs_end_cksum(crc);
 }
 
+/*
+ * Batch versions of the above for nr buffers of the same length and layout,
+ * such as the inodes of an inode cluster.  The CRCs of independent buffers
+ * can be calculated side by side, which keeps the CRC unit busy on buffers
+ * too small to be split up.
+ */
+#define XFS_CKSUM_BATCH	16
+
+static inline void
+xfs_start_cksum_multi(char * const *buffers, __uint32_t *crcs,
+		      unsigned int nr, size_t length, unsigned long cksum_offset)
+{
+	__uint32_t zero = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		crcs[i] = XFS_CRC_SEED;
+	crc32c_multi(crcs, buffers, nr, 0, cksum_offset);
+	for (i = 0; i < nr; i++)
+		crcs[i] = crc32c(crcs[i], &zero, sizeof(__u32));
+	crc32c_multi(crcs, buffers, nr, cksum_offset + sizeof(__be32),
+		     length - (cksum_offset + sizeof(__be32)));
+}
+
+static inline void
+xfs_update_cksum_multi(char * const *buffers, unsigned int nr,
+		       size_t length, unsigned long cksum_offset)
+{
+	__uint32_t crcs[XFS_CKSUM_BATCH];
+	unsigned int i, n;
+
+	for (; nr; nr -= n, buffers += n) {
+		n = nr < XFS_CKSUM_BATCH ? nr : XFS_CKSUM_BATCH;
+		xfs_start_cksum_multi(buffers, crcs, n, length, cksum_offset);
+		for (i = 0; i < n; i++)
+			*(__le32 *)(buffers[i] + cksum_offset) =
+				xfs_end_cksum(crcs[i]);
+	}
+}
+
+/*
+ * Returns the number of buffers with a good checksum, and if ok isn't NULL
+ * sets ok[i] to whether buffer i is one of them.
+ */
+static inline unsigned int
+xfs_verify_cksum_multi(char * const *buffers, unsigned int nr,
+		       size_t length, unsigned long cksum_offset, int *ok)
+{
+	__uint32_t crcs[XFS_CKSUM_BATCH];
+	unsigned int i, n, good = 0;
+	int match;
+
+	for (; nr; nr -= n, buffers += n) {
+		n = nr < XFS_CKSUM_BATCH ? nr : XFS_CKSUM_BATCH;
+		xfs_start_cksum_multi(buffers, crcs, n, length, cksum_offset);
+		for (i = 0; i < n; i++) {
+			match = *(__le32 *)(buffers[i] + cksum_offset) ==
+				xfs_end_cksum(crcs[i]);
+			good += match;
+			if (ok)
+				*ok++ = match;
+		}
+	}
+	return good;
+}
+
 #endif /* _XFS_CKSUM_H */
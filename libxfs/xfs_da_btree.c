@@ -238,6 +238,7 @@ xfs_da3_node_read_verify(
 }
 
 const struct xfs_buf_ops xfs_da3_node_buf_ops = {
+	.name = "xfs_da3_node",
 	.verify_read = xfs_da3_node_read_verify,
 	.verify_write = xfs_da3_node_write_verify,
 };
@@ -1553,6 +1554,18 @@ xfs_da3_node_lookup_int(
 		} else {
 			blk->index = probe;
 			blkno = be32_to_cpu(btree[probe].before);
+
+			/*
+			 * If the child we're going down to ends in the hash
+			 * we want, the search will probably carry on into
+			 * its right sibling, so start reading that now.
+			 */
+			if (probe + 1 < max &&
+			    be32_to_cpu(btree[probe].hashval) == hashval)
+				xfs_da_reada_buf(dp,
+					be32_to_cpu(btree[probe + 1].before),
+					-1, args->whichfork,
+					&xfs_da3_node_buf_ops);
 		}
 	}
 
@@ -1938,15 +1951,13 @@ xfs_da3_path_shift(
  * Rotate the hash value by 7 bits, then XOR each character in.
  * This is implemented with some source-level loop unrolling.
  */
-xfs_dahash_t
-xfs_da_hashname(const __uint8_t *name, int namelen)
+static inline xfs_dahash_t
+xfs_da_hashname_cont(xfs_dahash_t hash, const __uint8_t *name, int namelen)
 {
-	xfs_dahash_t hash;
-
 	/*
 	 * Do four characters at a time as long as we can.
 	 */
-	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
+	for (; namelen >= 4; namelen -= 4, name += 4)
 		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
 		       (name[3] << 0) ^ rol32(hash, 7 * 4);
 
@@ -1966,6 +1977,56 @@ xfs_da_hashname(const __uint8_t *name, int namelen)
 	}
 }
 
+xfs_dahash_t
+xfs_da_hashname(const __uint8_t *name, int namelen)
+{
+	return xfs_da_hashname_cont(0, name, namelen);
+}
+
+/*
+ * Hash n names at once, for callers that have a whole directory block of
+ * them.  Each name's hash depends on the one before it four characters at
+ * a time, so hashing names one after the other leaves the CPU waiting on
+ * that chain; here XFS_DA_HASH_LANES names go through their common length
+ * together, as independent chains the CPU (or the compiler's vectoriser)
+ * can run side by side, and each name's tail is finished on its own.
+ */
+#define XFS_DA_HASH_LANES	4
+
+void
+xfs_da_hashname_batch(
+	struct xfs_name		*names,
+	xfs_dahash_t		*hashes,
+	int			n)
+{
+	const __uint8_t		*p[XFS_DA_HASH_LANES];
+	xfs_dahash_t		h[XFS_DA_HASH_LANES];
+	int			len;
+	int			i, l;
+
+	for (; n >= XFS_DA_HASH_LANES;
+	     n -= XFS_DA_HASH_LANES, names += XFS_DA_HASH_LANES,
+	     hashes += XFS_DA_HASH_LANES) {
+		len = names[0].len;
+		for (l = 0; l < XFS_DA_HASH_LANES; l++) {
+			p[l] = names[l].name;
+			h[l] = 0;
+			len = min(len, names[l].len);
+		}
+		for (i = 0; i + 4 <= len; i += 4) {
+			for (l = 0; l < XFS_DA_HASH_LANES; l++)
+				h[l] = (p[l][i] << 21) ^ (p[l][i + 1] << 14) ^
+				       (p[l][i + 2] << 7) ^ (p[l][i + 3] << 0) ^
+				       rol32(h[l], 7 * 4);
+		}
+		for (l = 0; l < XFS_DA_HASH_LANES; l++)
+			hashes[l] = xfs_da_hashname_cont(h[l], p[l] + i,
+							 names[l].len - i);
+	}
+	for (i = 0; i < n; i++)
+		hashes[i] = xfs_da_hashname(names[i].name, names[i].len);
+}
+
 enum xfs_dacmp
 xfs_da_compname(
 	struct xfs_da_args *args,
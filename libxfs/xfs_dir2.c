@@ -165,6 +165,27 @@ xfs_da_unmount(
 	kmem_free(mp->m_attr_geo);
 }
 
+/*
+ * Hash n directory entry names into hashes[], with the batched hash when
+ * the filesystem uses the default name hash.
+ */
+void
+xfs_dir_hashnames(
+	struct xfs_mount	*mp,
+	struct xfs_name		*names,
+	xfs_dahash_t		*hashes,
+	int			n)
+{
+	int			i;
+
+	if (mp->m_dirnameops == &xfs_default_nameops) {
+		xfs_da_hashname_batch(names, hashes, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		hashes[i] = mp->m_dirnameops->hashname(&names[i]);
+}
+
 /*
  * Return 1 if directory contains only "." and "..".
  */
@@ -123,6 +123,8 @@ extern void xfs_dir_startup(void);
 extern int xfs_da_mount(struct xfs_mount *mp);
 extern void xfs_da_unmount(struct xfs_mount *mp);
 
+extern void xfs_dir_hashnames(struct xfs_mount *mp, struct xfs_name *names,
+				xfs_dahash_t *hashes, int n);
 extern int xfs_dir_isempty(struct xfs_inode *dp);
 extern int xfs_dir_init(struct xfs_trans *tp, struct xfs_inode *dp,
 				struct xfs_inode *pdp);
@@ -174,6 +176,18 @@ extern void xfs_dir2_data_use_free(struct xfs_da_args *args,
 		xfs_dir2_data_aoff_t offset, xfs_dir2_data_aoff_t len,
 		int *needlogp, int *needscanp);
 
+/*
+ * Building a whole node form directory at once from a list of names.
+ */
+struct xfs_dir2_bulk_ent {
+	struct xfs_name		name;
+	xfs_ino_t		inumber;
+	xfs_dahash_t		hashval;
+};
+
+extern int xfs_dir2_node_bulkload(struct xfs_da_args *args,
+		struct xfs_dir2_bulk_ent *ents, int nents);
+
 extern struct xfs_dir2_data_free *xfs_dir2_data_freefind(
 		struct xfs_dir2_data_hdr *hdr, struct xfs_dir2_data_free *bf,
 		struct xfs_dir2_data_unused *dup);
@@ -145,6 +145,7 @@ xfs_dir3_free_write_verify(
 }
 
 const struct xfs_buf_ops xfs_dir3_free_buf_ops = {
+	.name = "xfs_dir3_free",
 	.verify_read = xfs_dir3_free_read_verify,
 	.verify_write = xfs_dir3_free_write_verify,
 };
@@ -2271,3 +2272,395 @@ xfs_dir2_node_trim_free(
 	*rvalp = 1;
 	return 0;
 }
+
+/*
+ * Bulk loading.  Repair rebuilds a damaged directory from the names it
+ * salvaged, and adding them one at a time with xfs_dir_createname searches
+ * the free index and splits leaves for every name, which takes hours for a
+ * directory with millions of entries.  xfs_dir2_node_bulkload instead
+ * builds a node form directory into an empty directory inode in one pass:
+ * it packs the names into data blocks in the order given, sorts the leaf
+ * entries by hash, then writes the leaf blocks, the da btree above them
+ * and the free index blocks.  Each block is written in a transaction of
+ * its own, rolled from args->trans, so nothing is held for long.
+ */
+struct xfs_dir2_bulk_leaf {
+	xfs_dahash_t		hashval;
+	xfs_dir2_dataptr_t	address;
+};
+
+struct xfs_dir2_bulk_child {
+	xfs_dablk_t		bno;
+	xfs_dahash_t		hashval;	/* last hash in the block */
+};
+
+static int
+xfs_dir2_bulk_leaf_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_dir2_bulk_leaf *la = a;
+	const struct xfs_dir2_bulk_leaf *lb = b;
+
+	if (la->hashval != lb->hashval)
+		return la->hashval < lb->hashval ? -1 : 1;
+	if (la->address != lb->address)
+		return la->address < lb->address ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Finish the transaction the last block was written in and start the next.
+ */
+STATIC int
+xfs_dir2_bulk_roll(
+	struct xfs_da_args	*args)
+{
+	int			committed;
+	int			error;
+
+	error = xfs_bmap_finish(&args->trans, args->flist, &committed);
+	if (error)
+		return error;
+	if (committed)
+		xfs_trans_ijoin(args->trans, args->dp, 0);
+	error = xfs_trans_roll(&args->trans, args->dp);
+	if (error)
+		return error;
+	xfs_bmap_init(args->flist, args->firstblock);
+	return 0;
+}
+
+/*
+ * Put an entry at the start of the free space left in the data block being
+ * filled, and return its offset.  The caller has checked that it fits.
+ */
+STATIC xfs_dir2_data_aoff_t
+xfs_dir2_bulk_add_entry(
+	struct xfs_da_args	*args,
+	struct xfs_buf		*bp,
+	struct xfs_dir2_bulk_ent *ent)
+{
+	struct xfs_inode	*dp = args->dp;
+	struct xfs_dir2_data_hdr *hdr = bp->b_addr;
+	struct xfs_dir2_data_free *bf;
+	struct xfs_dir2_data_unused *dup;
+	struct xfs_dir2_data_entry *dep;
+	xfs_dir2_data_aoff_t	offset;
+	__be16			*tagp;
+	int			needlog = 0;
+	int			needscan = 0;
+
+	bf = dp->d_ops->data_bestfree_p(hdr);
+	offset = be16_to_cpu(bf[0].offset);
+	dup = (xfs_dir2_data_unused_t *)((char *)hdr + offset);
+	xfs_dir2_data_use_free(args, bp, dup, offset,
+			dp->d_ops->data_entsize(ent->name.len),
+			&needlog, &needscan);
+
+	dep = (xfs_dir2_data_entry_t *)dup;
+	dep->inumber = cpu_to_be64(ent->inumber);
+	dep->namelen = ent->name.len;
+	memcpy(dep->name, ent->name.name, dep->namelen);
+	dp->d_ops->data_put_ftype(dep, ent->name.type);
+	tagp = dp->d_ops->data_entry_tag_p(dep);
+	*tagp = cpu_to_be16(offset);
+	xfs_dir2_data_log_entry(args, bp, dep);
+
+	if (needscan)
+		xfs_dir2_data_freescan(dp, hdr, &needlog);
+	if (needlog)
+		xfs_dir2_data_log_header(args, bp);
+	return offset;
+}
+
+/*
+ * Write the leaf blocks, nleaves of them, with the sorted leaf entries
+ * spread evenly over them, and fill in kids with their block numbers and
+ * last hashes.
+ */
+STATIC int
+xfs_dir2_bulk_leaves(
+	struct xfs_da_args	*args,
+	struct xfs_dir2_bulk_leaf *leaves,
+	int			nents,
+	int			nleaves,
+	struct xfs_dir2_bulk_child *kids)
+{
+	struct xfs_inode	*dp = args->dp;
+	struct xfs_dir3_icleaf_hdr leafhdr;
+	struct xfs_dir2_leaf_entry *lents;
+	struct xfs_buf		*bp;
+	xfs_dablk_t		prev = 0;
+	xfs_dablk_t		bno;
+	xfs_dablk_t		next;
+	int			error;
+	int			i = 0;
+	int			j;
+	int			l;
+	int			n;
+
+	/* allocate each block's right sibling first, for its forw pointer */
+	error = xfs_da_grow_inode(args, &next);
+	if (error)
+		return error;
+	for (l = 0; l < nleaves; l++) {
+		bno = next;
+		next = 0;
+		if (l + 1 < nleaves) {
+			error = xfs_da_grow_inode(args, &next);
+			if (error)
+				return error;
+		}
+		n = (nents - i + nleaves - l - 1) / (nleaves - l);
+
+		error = xfs_dir3_leaf_get_buf(args,
+				xfs_dir2_da_to_db(args->geo, bno), &bp,
+				XFS_DIR2_LEAFN_MAGIC);
+		if (error)
+			return error;
+		dp->d_ops->leaf_hdr_from_disk(&leafhdr, bp->b_addr);
+		lents = dp->d_ops->leaf_ents_p(bp->b_addr);
+		for (j = 0; j < n; j++) {
+			lents[j].hashval = cpu_to_be32(leaves[i + j].hashval);
+			lents[j].address = cpu_to_be32(leaves[i + j].address);
+		}
+		leafhdr.count = n;
+		leafhdr.forw = next;
+		leafhdr.back = prev;
+		dp->d_ops->leaf_hdr_to_disk(bp->b_addr, &leafhdr);
+		xfs_dir3_leaf_log_header(args, bp);
+		xfs_dir3_leaf_log_ents(args, bp, 0, n - 1);
+
+		kids[l].bno = bno;
+		kids[l].hashval = leaves[i + n - 1].hashval;
+		i += n;
+		prev = bno;
+		error = xfs_dir2_bulk_roll(args);
+		if (error)
+			return error;
+	}
+	ASSERT(i == nents);
+	return 0;
+}
+
+/*
+ * Write the node blocks of one level above the nkids blocks in kids, and
+ * replace kids with the new blocks.  If they all fit in one node, that's
+ * the root, which goes in the block at root.  Returns the number of
+ * blocks written.
+ */
+STATIC int
+xfs_dir2_bulk_nodes(
+	struct xfs_da_args	*args,
+	struct xfs_dir2_bulk_child *kids,
+	int			*nkidsp,
+	int			level,
+	xfs_dablk_t		root)
+{
+	struct xfs_inode	*dp = args->dp;
+	struct xfs_da3_icnode_hdr nodehdr;
+	struct xfs_da_node_entry *btree;
+	struct xfs_da_intnode	*node;
+	struct xfs_buf		*bp;
+	xfs_dablk_t		prev = 0;
+	xfs_dablk_t		bno;
+	xfs_dablk_t		next = root;
+	int			nkids = *nkidsp;
+	int			nnodes;
+	int			error;
+	int			i = 0;
+	int			j;
+	int			k;
+	int			n;
+
+	nnodes = (nkids + args->geo->node_ents - 1) / args->geo->node_ents;
+	if (nnodes > 1) {
+		error = xfs_da_grow_inode(args, &next);
+		if (error)
+			return error;
+	}
+	for (k = 0; k < nnodes; k++) {
+		bno = next;
+		next = 0;
+		if (k + 1 < nnodes) {
+			error = xfs_da_grow_inode(args, &next);
+			if (error)
+				return error;
+		}
+		n = (nkids - i + nnodes - k - 1) / (nnodes - k);
+
+		error = xfs_da3_node_create(args, bno, level, &bp,
+				XFS_DATA_FORK);
+		if (error)
+			return error;
+		node = bp->b_addr;
+		dp->d_ops->node_hdr_from_disk(&nodehdr, node);
+		btree = dp->d_ops->node_tree_p(node);
+		for (j = 0; j < n; j++) {
+			btree[j].hashval = cpu_to_be32(kids[i + j].hashval);
+			btree[j].before = cpu_to_be32(kids[i + j].bno);
+		}
+		nodehdr.count = n;
+		nodehdr.forw = next;
+		nodehdr.back = prev;
+		dp->d_ops->node_hdr_to_disk(node, &nodehdr);
+		xfs_trans_log_buf(args->trans, bp,
+			XFS_DA_LOGRANGE(node, &node->hdr,
+				dp->d_ops->node_hdr_size));
+		xfs_trans_log_buf(args->trans, bp,
+			XFS_DA_LOGRANGE(node, btree, n * sizeof(*btree)));
+
+		/* the entries before i have been used up already */
+		kids[k].bno = bno;
+		kids[k].hashval = kids[i + n - 1].hashval;
+		i += n;
+		prev = bno;
+		error = xfs_dir2_bulk_roll(args);
+		if (error)
+			return error;
+	}
+	*nkidsp = nnodes;
+	return 0;
+}
+
+/*
+ * Build a node form directory in the directory args->dp, which must have
+ * no blocks, from the nents entries in ents.  ents must start with the
+ * "." and ".." entries; the rest can be in any order, and are put in the
+ * data blocks in the order given.  args->trans is rolled as the blocks are
+ * written, and the caller commits the last one.
+ */
+int
+xfs_dir2_node_bulkload(
+	struct xfs_da_args	*args,
+	struct xfs_dir2_bulk_ent *ents,
+	int			nents)
+{
+	struct xfs_inode	*dp = args->dp;
+	struct xfs_da_geometry	*geo = args->geo;
+	struct xfs_dir2_bulk_leaf *leaves;
+	struct xfs_dir2_bulk_child *kids = NULL;
+	struct xfs_dir2_data_free *bf;
+	struct xfs_dir3_icfree_hdr freehdr;
+	struct xfs_buf		*bp;
+	xfs_dir2_data_aoff_t	offset;
+	xfs_dir2_db_t		ndata;
+	xfs_dir2_db_t		dbno;
+	xfs_dir2_db_t		db;
+	xfs_dablk_t		root = 0;
+	__be16			*fbests;
+	__uint16_t		*bests;
+	int			maxbests;
+	int			nleaves;
+	int			nkids;
+	int			level;
+	int			avail;
+	int			len;
+	int			error = 0;
+	int			i;
+	int			j;
+	int			n;
+
+	ASSERT(nents >= 2 && ents[0].name.len == 1 && ents[1].name.len == 2);
+	ASSERT(dp->i_d.di_nextents == 0);
+
+	/* how many data blocks will the names take? */
+	avail = geo->blksize - dp->d_ops->data_entry_offset;
+	for (i = 0, ndata = 1, len = avail; i < nents; i++) {
+		n = dp->d_ops->data_entsize(ents[i].name.len);
+		if (n > len) {
+			ndata++;
+			len = avail;
+		}
+		len -= n;
+	}
+	bests = kmem_alloc(ndata * sizeof(*bests), KM_SLEEP);
+	leaves = kmem_alloc(nents * sizeof(*leaves), KM_SLEEP);
+
+	/* the data blocks, filled in order */
+	for (db = 0, i = 0; db < ndata; db++) {
+		error = xfs_dir2_grow_inode(args, XFS_DIR2_DATA_SPACE, &dbno);
+		if (error)
+			goto out_free;
+		ASSERT(dbno == db);
+		error = xfs_dir3_data_init(args, dbno, &bp);
+		if (error)
+			goto out_free;
+		bf = dp->d_ops->data_bestfree_p(bp->b_addr);
+		for (; i < nents; i++) {
+			if (dp->d_ops->data_entsize(ents[i].name.len) >
+			    be16_to_cpu(bf[0].length))
+				break;
+			offset = xfs_dir2_bulk_add_entry(args, bp, &ents[i]);
+			leaves[i].hashval = ents[i].hashval;
+			leaves[i].address = xfs_dir2_db_off_to_dataptr(geo,
+					dbno, offset);
+		}
+		bests[db] = be16_to_cpu(bf[0].length);
+		error = xfs_dir2_bulk_roll(args);
+		if (error)
+			goto out_free;
+	}
+	ASSERT(i == nents);
+
+	/*
+	 * The leaves, and the da btree over them.  The root has to be the
+	 * first block of the leaf space, so if there's more than one leaf,
+	 * take that block for the root before writing them.
+	 */
+	qsort(leaves, nents, sizeof(*leaves), xfs_dir2_bulk_leaf_cmp);
+	n = dp->d_ops->leaf_max_ents(geo);
+	nleaves = (nents + n - 1) / n;
+	if (nleaves > 1) {
+		error = xfs_da_grow_inode(args, &root);
+		if (error)
+			goto out_free;
+		ASSERT(root == geo->leafblk);
+	}
+	kids = kmem_alloc(nleaves * sizeof(*kids), KM_SLEEP);
+	error = xfs_dir2_bulk_leaves(args, leaves, nents, nleaves, kids);
+	if (error)
+		goto out_free;
+	for (nkids = nleaves, level = 1; nkids > 1; level++) {
+		if (level >= XFS_DA_NODE_MAXDEPTH) {
+			error = -EFSCORRUPTED;
+			goto out_free;
+		}
+		error = xfs_dir2_bulk_nodes(args, kids, &nkids, level, root);
+		if (error)
+			goto out_free;
+	}
+
+	/* and the free index blocks, which are all full but the last */
+	maxbests = dp->d_ops->free_max_bests(geo);
+	for (db = 0; db < ndata; db += maxbests) {
+		error = xfs_dir2_grow_inode(args, XFS_DIR2_FREE_SPACE, &dbno);
+		if (error)
+			goto out_free;
+		ASSERT(dbno == dp->d_ops->db_to_fdb(geo, db));
+		error = xfs_dir3_free_get_buf(args, dbno, &bp);
+		if (error)
+			goto out_free;
+		dp->d_ops->free_hdr_from_disk(&freehdr, bp->b_addr);
+		fbests = dp->d_ops->free_bests_p(bp->b_addr);
+		n = min_t(int, ndata - db, maxbests);
+		for (j = 0; j < n; j++)
+			fbests[j] = cpu_to_be16(bests[db + j]);
+		freehdr.firstdb = db;
+		freehdr.nvalid = n;
+		freehdr.nused = n;
+		dp->d_ops->free_hdr_to_disk(bp->b_addr, &freehdr);
+		xfs_dir2_free_log_bests(args, bp, 0, n - 1);
+		xfs_dir2_free_log_header(args, bp);
+		error = xfs_dir2_bulk_roll(args);
+		if (error)
+			goto out_free;
+	}
+
+out_free:
+	kmem_free(kids);
+	kmem_free(leaves);
+	kmem_free(bests);
+	return error;
+}
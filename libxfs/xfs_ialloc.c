@@ -1093,6 +1093,72 @@ xfs_inobt_first_free_inode(
 	return xfs_lowbit64(realfree);
 }
 
+/*
+ * The tools that populate a filesystem (mkfs -p, repair rebuilding the
+ * lost+found and realtime inodes) allocate inode after inode, and once the
+ * chunks near the parent are full the searches below walk further and
+ * further through the inobt for each one.  So each thread remembers, for
+ * each of the AGs it has allocated from lately, the chunk it last took an
+ * inode from while that chunk still has free ones, and tries it before
+ * searching.  The hint is only ever a place to look: the record is read
+ * from the btree and its free count checked like any other.
+ */
+#define XFS_DIALLOC_HINTS	16
+
+struct xfs_dialloc_hint {
+	struct xfs_mount	*mp;
+	xfs_agnumber_t		agno;
+	xfs_agino_t		startino;
+};
+
+static __thread struct xfs_dialloc_hint xfs_dialloc_hints[XFS_DIALLOC_HINTS];
+
+/* note which chunk we just allocated from, if it has any inodes left */
+STATIC void
+xfs_dialloc_hint_set(
+	struct xfs_mount		*mp,
+	xfs_agnumber_t			agno,
+	struct xfs_inobt_rec_incore	*rec)
+{
+	struct xfs_dialloc_hint		*hint;
+
+	hint = &xfs_dialloc_hints[agno % XFS_DIALLOC_HINTS];
+	hint->mp = mp;
+	hint->agno = agno;
+	hint->startino = rec->ir_freecount ? rec->ir_startino : NULLAGINO;
+}
+
+/*
+ * Point cur at this thread's last chunk in the AG and return it in rec if
+ * it still has a free inode, setting *stat to 1.
+ */
+STATIC int
+xfs_dialloc_hint_lookup(
+	struct xfs_btree_cur		*cur,
+	xfs_agnumber_t			agno,
+	struct xfs_inobt_rec_incore	*rec,
+	int				*stat)
+{
+	struct xfs_dialloc_hint		*hint;
+	int				error;
+	int				i;
+
+	*stat = 0;
+	hint = &xfs_dialloc_hints[agno % XFS_DIALLOC_HINTS];
+	if (hint->mp != cur->bc_mp || hint->agno != agno ||
+	    hint->startino == NULLAGINO)
+		return 0;
+
+	error = xfs_inobt_lookup(cur, hint->startino, XFS_LOOKUP_EQ, &i);
+	if (error || !i)
+		return error;
+	error = xfs_inobt_get_rec(cur, rec, &i);
+	if (error || !i)
+		return error;
+	*stat = rec->ir_freecount > 0;
+	return 0;
+}
+
 /*
  * Allocate an inode using the inobt-only algorithm.
  */
@@ -1164,7 +1230,21 @@ xfs_dialloc_ag_inobt(
 
 		/*
 		 * In the same AG as parent, but parent's chunk is full.
+		 * Try the last chunk we allocated from before searching.
 		 */
+		error = xfs_dialloc_hint_lookup(cur, agno, &rec, &i);
+		if (error)
+			goto error0;
+		if (i)
+			goto alloc_inode;
+		error = xfs_inobt_lookup(cur, pagino, XFS_LOOKUP_LE, &i);
+		if (error)
+			goto error0;
+		XFS_WANT_CORRUPTED_GOTO(mp, i == 1, error0);
+		error = xfs_inobt_get_rec(cur, &rec, &j);
+		if (error)
+			goto error0;
+		XFS_WANT_CORRUPTED_GOTO(mp, j == 1, error0);
 
 		/* duplicate the cursor, search left & right simultaneously */
 		error = xfs_btree_dup_cursor(cur, &tcur);
@@ -1302,8 +1382,13 @@ newino:
 	}
 
 	/*
-	 * None left in the last group, search the whole AG
+	 * Nor in the last chunk we allocated from?  Search the whole AG.
 	 */
+	error = xfs_dialloc_hint_lookup(cur, agno, &rec, &i);
+	if (error)
+		goto error0;
+	if (i)
+		goto alloc_inode;
 	error = xfs_inobt_lookup(cur, 0, XFS_LOOKUP_GE, &i);
 	if (error)
 		goto error0;
@@ -1334,6 +1419,7 @@ alloc_inode:
 	error = xfs_inobt_update(cur, &rec);
 	if (error)
 		goto error0;
+	xfs_dialloc_hint_set(mp, agno, &rec);
 	be32_add_cpu(&agi->agi_freecount, -1);
 	xfs_ialloc_log_agi(tp, agbp, XFS_AGI_FREECOUNT);
 	pag->pagi_freecount--;
@@ -1563,12 +1649,16 @@ xfs_dialloc_ag(
 	/*
 	 * The search algorithm depends on whether we're in the same AG as the
 	 * parent. If so, find the closest available inode to the parent. If
-	 * not, consider the agi hint or find the first free inode in the AG.
+	 * not, consider our last chunk in the AG, the agi hint, or find the
+	 * first free inode in the AG.
 	 */
-	if (agno == pagno)
+	if (agno == pagno) {
 		error = xfs_dialloc_ag_finobt_near(pagino, &cur, &rec);
-	else
-		error = xfs_dialloc_ag_finobt_newino(agi, cur, &rec);
+	} else {
+		error = xfs_dialloc_hint_lookup(cur, agno, &rec, &i);
+		if (!error && !i)
+			error = xfs_dialloc_ag_finobt_newino(agi, cur, &rec);
+	}
 	if (error)
 		goto error_cur;
 
@@ -1590,6 +1680,7 @@ xfs_dialloc_ag(
 		error = xfs_btree_delete(cur, &i);
 	if (error)
 		goto error_cur;
+	xfs_dialloc_hint_set(mp, agno, &rec);
 
 	/*
 	 * The finobt has now been updated appropriately. We haven't updated the
@@ -2561,6 +2652,7 @@ xfs_agi_write_verify(
 }
 
 const struct xfs_buf_ops xfs_agi_buf_ops = {
+	.name = "xfs_agi",
 	.verify_read = xfs_agi_read_verify,
 	.verify_write = xfs_agi_write_verify,
 };
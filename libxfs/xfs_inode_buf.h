@@ -37,7 +37,11 @@ int	xfs_imap_to_bp(struct xfs_mount *, struct xfs_trans *,
 		       struct xfs_buf **, uint, uint);
 int	xfs_iread(struct xfs_mount *, struct xfs_trans *,
 		  struct xfs_inode *, uint);
+int	xfs_iread_dinode(struct xfs_mount *, struct xfs_inode *,
+			 struct xfs_dinode *);
 void	xfs_dinode_calc_crc(struct xfs_mount *, struct xfs_dinode *);
+unsigned int xfs_dinode_verify_cksums(struct xfs_mount *mp, char *buf,
+			       unsigned int nr, int *ok);
 void	xfs_dinode_to_disk(struct xfs_dinode *to, struct xfs_icdinode *from);
 void	xfs_dinode_from_disk(struct xfs_icdinode *to, struct xfs_dinode *from);
 bool	xfs_dinode_verify(struct xfs_mount *mp, xfs_ino_t ino,
@@ -871,6 +871,585 @@ xfs_iflush_fork(
 	}
 }
 
+/*
+ * Once a fork has more extents than fit in one XFS_IEXT_BUFSZ buffer they
+ * are kept in a b+tree of XFS_IEXT_BUFSZ blocks, so that adding or removing
+ * an extent only moves the records of one leaf and the counts on the path
+ * down to it, however many extents the file has.  The interior nodes keep
+ * the number of records under each child rather than keys, which finds a
+ * record by its index in O(log n) without any offsets to fix up, and a
+ * record by file offset is found by looking at the first record under
+ * each child; callers change records in place, so a key copied into the
+ * node could go stale.  The leaves are linked in order, and the leaf the
+ * last record was found in is remembered, so walking the extents one
+ * index at a time only searches the tree when it moves to another leaf.
+ *
+ * No child of a node with more than one child is ever left empty, so
+ * every leaf on the list has records in it.
+ */
+#define XFS_IEXT_LEAF_RECS \
+	((XFS_IEXT_BUFSZ - 2 * sizeof(void *) - sizeof(__uint64_t)) / \
+	 sizeof(xfs_bmbt_rec_host_t))
+#define XFS_IEXT_NODE_PTRS \
+	((XFS_IEXT_BUFSZ - sizeof(__uint64_t)) / \
+	 (sizeof(void *) + sizeof(xfs_extnum_t)))
+
+struct xfs_iext_leaf {
+	struct xfs_iext_leaf	*prev;
+	struct xfs_iext_leaf	*next;
+	int			nrecs;
+	xfs_bmbt_rec_host_t	recs[XFS_IEXT_LEAF_RECS];
+};
+
+struct xfs_iext_node {
+	int			nchildren;
+	xfs_extnum_t		counts[XFS_IEXT_NODE_PTRS];	/* recs under */
+	void			*ptrs[XFS_IEXT_NODE_PTRS];
+};
+
+struct xfs_iext_tree {
+	void			*root;
+	int			height;		/* 1: the root is a leaf */
+	struct xfs_iext_leaf	*cur;		/* last leaf found by index */
+	xfs_extnum_t		curoff;		/* index of its first record */
+};
+
+/*
+ * Tree blocks are counted in if_real_bytes, so that it is still the memory
+ * the extent list takes up.
+ */
+STATIC void *
+xfs_iext_tree_alloc(
+	xfs_ifork_t	*ifp)		/* inode fork pointer */
+{
+	ifp->if_real_bytes += XFS_IEXT_BUFSZ;
+	return kmem_zalloc(XFS_IEXT_BUFSZ, KM_NOFS);
+}
+
+STATIC void
+xfs_iext_tree_free(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	void		*block)		/* leaf or node */
+{
+	ifp->if_real_bytes -= XFS_IEXT_BUFSZ;
+	kmem_free(block);
+}
+
+/*
+ * Free the subtree at ptr, level levels above the leaves.
+ */
+STATIC void
+xfs_iext_tree_destroy(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	void		*ptr,		/* subtree root */
+	int		level)		/* 0: ptr is a leaf */
+{
+	struct xfs_iext_node *node = ptr;
+	int		i;
+
+	if (level > 0) {
+		for (i = 0; i < node->nchildren; i++)
+			xfs_iext_tree_destroy(ifp, node->ptrs[i], level - 1);
+	}
+	xfs_iext_tree_free(ifp, ptr);
+}
+
+/*
+ * Return the first or last leaf of the subtree at ptr.
+ */
+STATIC struct xfs_iext_leaf *
+xfs_iext_tree_edge(
+	void		*ptr,		/* subtree root */
+	int		level,		/* 0: ptr is a leaf */
+	int		last)		/* rightmost rather than leftmost */
+{
+	struct xfs_iext_node *node;
+
+	for (; level > 0; level--) {
+		node = ptr;
+		ptr = node->ptrs[last ? node->nchildren - 1 : 0];
+	}
+	return ptr;
+}
+
+/*
+ * Return the child of node holding record index *idxp, and make *idxp
+ * relative to that child.  An index at the end of the node's records is
+ * in its last child.
+ */
+STATIC int
+xfs_iext_node_child(
+	struct xfs_iext_node *node,	/* interior node */
+	xfs_extnum_t	*idxp)		/* record index (node -> child) */
+{
+	int		i;
+
+	for (i = 0; i < node->nchildren - 1 && *idxp >= node->counts[i]; i++)
+		*idxp -= node->counts[i];
+	return i;
+}
+
+/*
+ * Remove child i from node, without freeing it.
+ */
+STATIC void
+xfs_iext_node_delete(
+	struct xfs_iext_node *node,	/* interior node */
+	int		i)		/* child to remove */
+{
+	node->nchildren--;
+	memmove(&node->ptrs[i], &node->ptrs[i + 1],
+		(node->nchildren - i) * sizeof(void *));
+	memmove(&node->counts[i], &node->counts[i + 1],
+		(node->nchildren - i) * sizeof(xfs_extnum_t));
+}
+
+/*
+ * Return the record at index idx of the tree.
+ */
+STATIC xfs_bmbt_rec_host_t *
+xfs_iext_tree_get(
+	struct xfs_iext_tree *tree,	/* extent b+tree */
+	xfs_extnum_t	idx)		/* index of target extent */
+{
+	struct xfs_iext_leaf *leaf = tree->cur;
+	struct xfs_iext_node *node;
+	int		level;
+
+	/* walking off either end of the last leaf looked at */
+	if (leaf && idx == tree->curoff + leaf->nrecs && leaf->next) {
+		tree->curoff += leaf->nrecs;
+		leaf = tree->cur = leaf->next;
+	} else if (leaf && idx == tree->curoff - 1 && leaf->prev) {
+		leaf = tree->cur = leaf->prev;
+		tree->curoff -= leaf->nrecs;
+	}
+	if (leaf && idx >= tree->curoff && idx < tree->curoff + leaf->nrecs)
+		return &leaf->recs[idx - tree->curoff];
+
+	tree->curoff = idx;
+	leaf = tree->root;
+	for (level = tree->height - 1; level > 0; level--) {
+		node = (struct xfs_iext_node *)leaf;
+		leaf = node->ptrs[xfs_iext_node_child(node, &idx)];
+	}
+	tree->curoff -= idx;
+	tree->cur = leaf;
+	return &leaf->recs[idx];
+}
+
+/*
+ * Insert up to count zeroed records at index idx of a leaf, splitting it
+ * if it is full, and return how many were inserted.
+ */
+STATIC int
+xfs_iext_leaf_insert(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	struct xfs_iext_leaf *leaf,	/* target leaf */
+	xfs_extnum_t	idx,		/* index in leaf */
+	int		count,		/* records to insert */
+	void		**newp,		/* new right sibling, if split */
+	xfs_extnum_t	*newcount)	/* number of records in it */
+{
+	struct xfs_iext_leaf *new = NULL;
+	int		split;
+
+	if (leaf->nrecs == XFS_IEXT_LEAF_RECS) {
+		new = xfs_iext_tree_alloc(ifp);
+		new->prev = leaf;
+		new->next = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = new;
+		leaf->next = new;
+		/*
+		 * Appending to a full leaf starts an empty one rather than
+		 * splitting it, so that extents added in order fill whole
+		 * leaves.
+		 */
+		split = idx == leaf->nrecs ? leaf->nrecs : leaf->nrecs / 2;
+		new->nrecs = leaf->nrecs - split;
+		memcpy(new->recs, &leaf->recs[split],
+			new->nrecs * sizeof(xfs_bmbt_rec_t));
+		memset(&leaf->recs[split], 0,
+			new->nrecs * sizeof(xfs_bmbt_rec_t));
+		leaf->nrecs = split;
+		if (idx >= split) {
+			idx -= split;
+			leaf = new;
+		}
+	}
+	count = MIN(count, (int)XFS_IEXT_LEAF_RECS - leaf->nrecs);
+	memmove(&leaf->recs[idx + count], &leaf->recs[idx],
+		(leaf->nrecs - idx) * sizeof(xfs_bmbt_rec_t));
+	memset(&leaf->recs[idx], 0, count * sizeof(xfs_bmbt_rec_t));
+	leaf->nrecs += count;
+
+	*newp = new;
+	if (new)
+		*newcount = new->nrecs;
+	return count;
+}
+
+/*
+ * Insert up to count zeroed records at index idx of the subtree at ptr,
+ * and return how many were inserted.  If the subtree root had to be split,
+ * its new right sibling is returned in *newp, with the number of records
+ * under it in *newcount, for the caller to add to the level above.
+ */
+STATIC int
+xfs_iext_tree_insert(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	void		*ptr,		/* subtree root */
+	int		level,		/* 0: ptr is a leaf */
+	xfs_extnum_t	idx,		/* index in subtree */
+	int		count,		/* records to insert */
+	void		**newp,		/* new right sibling, if split */
+	xfs_extnum_t	*newcount)	/* number of records under it */
+{
+	struct xfs_iext_node *node = ptr;
+	struct xfs_iext_node *new = NULL;
+	void		*child;		/* new child, if one was split */
+	xfs_extnum_t	childcount;	/* number of records under it */
+	int		inserted;
+	int		split;
+	int		i;
+
+	if (level == 0)
+		return xfs_iext_leaf_insert(ifp, ptr, idx, count, newp,
+					    newcount);
+
+	*newp = NULL;
+	i = xfs_iext_node_child(node, &idx);
+	inserted = xfs_iext_tree_insert(ifp, node->ptrs[i], level - 1, idx,
+					count, &child, &childcount);
+	node->counts[i] += inserted;
+	if (!child)
+		return inserted;
+	node->counts[i] -= childcount;
+	i++;
+
+	/* no room for the new child, move the top half to a new node */
+	if (node->nchildren == XFS_IEXT_NODE_PTRS) {
+		new = xfs_iext_tree_alloc(ifp);
+		split = node->nchildren / 2;
+		new->nchildren = node->nchildren - split;
+		memcpy(new->ptrs, &node->ptrs[split],
+			new->nchildren * sizeof(void *));
+		memcpy(new->counts, &node->counts[split],
+			new->nchildren * sizeof(xfs_extnum_t));
+		node->nchildren = split;
+		*newp = new;
+		if (i > split) {
+			i -= split;
+			node = new;
+		}
+	}
+	memmove(&node->ptrs[i + 1], &node->ptrs[i],
+		(node->nchildren - i) * sizeof(void *));
+	memmove(&node->counts[i + 1], &node->counts[i],
+		(node->nchildren - i) * sizeof(xfs_extnum_t));
+	node->ptrs[i] = child;
+	node->counts[i] = childcount;
+	node->nchildren++;
+
+	if (new) {
+		*newcount = 0;
+		for (i = 0; i < new->nchildren; i++)
+			*newcount += new->counts[i];
+	}
+	return inserted;
+}
+
+/*
+ * Merge child i + 1 of node into child i if both fit in one block, and
+ * return whether they did.
+ */
+STATIC int
+xfs_iext_node_merge(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	struct xfs_iext_node *node,	/* parent of the two */
+	int		i,		/* left child */
+	int		level)		/* level of the children */
+{
+	struct xfs_iext_leaf *lleaf = node->ptrs[i];
+	struct xfs_iext_leaf *rleaf = node->ptrs[i + 1];
+	struct xfs_iext_node *lnode = node->ptrs[i];
+	struct xfs_iext_node *rnode = node->ptrs[i + 1];
+
+	if (level == 0) {
+		if (lleaf->nrecs + rleaf->nrecs > XFS_IEXT_LEAF_RECS)
+			return 0;
+		memcpy(&lleaf->recs[lleaf->nrecs], rleaf->recs,
+			rleaf->nrecs * sizeof(xfs_bmbt_rec_t));
+		lleaf->nrecs += rleaf->nrecs;
+		lleaf->next = rleaf->next;
+		if (rleaf->next)
+			rleaf->next->prev = lleaf;
+	} else {
+		if (lnode->nchildren + rnode->nchildren > XFS_IEXT_NODE_PTRS)
+			return 0;
+		memcpy(&lnode->ptrs[lnode->nchildren], rnode->ptrs,
+			rnode->nchildren * sizeof(void *));
+		memcpy(&lnode->counts[lnode->nchildren], rnode->counts,
+			rnode->nchildren * sizeof(xfs_extnum_t));
+		lnode->nchildren += rnode->nchildren;
+	}
+	node->counts[i] += node->counts[i + 1];
+	xfs_iext_tree_free(ifp, node->ptrs[i + 1]);
+	xfs_iext_node_delete(node, i + 1);
+	return 1;
+}
+
+/*
+ * Remove up to count records from index idx of the subtree at ptr, and
+ * return how many were removed.  A child left with no records is freed,
+ * and one left less than a quarter full is merged with a neighbour if
+ * the two fit in one block.
+ */
+STATIC int
+xfs_iext_tree_remove(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	void		*ptr,		/* subtree root */
+	int		level,		/* 0: ptr is a leaf */
+	xfs_extnum_t	idx,		/* index in subtree */
+	int		count)		/* records to remove */
+{
+	struct xfs_iext_node *node = ptr;
+	struct xfs_iext_leaf *leaf = ptr;
+	struct xfs_iext_leaf *first;
+	struct xfs_iext_leaf *last;
+	void		*child;
+	int		removed;
+	int		underfull;
+	int		i;
+
+	if (level == 0) {
+		count = MIN(count, leaf->nrecs - idx);
+		memmove(&leaf->recs[idx], &leaf->recs[idx + count],
+			(leaf->nrecs - idx - count) * sizeof(xfs_bmbt_rec_t));
+		leaf->nrecs -= count;
+		memset(&leaf->recs[leaf->nrecs], 0,
+			count * sizeof(xfs_bmbt_rec_t));
+		return count;
+	}
+
+	i = xfs_iext_node_child(node, &idx);
+	child = node->ptrs[i];
+	removed = xfs_iext_tree_remove(ifp, child, level - 1, idx, count);
+	node->counts[i] -= removed;
+	if (node->nchildren == 1)
+		return removed;
+
+	if (node->counts[i] == 0) {
+		first = xfs_iext_tree_edge(child, level - 1, 0);
+		last = xfs_iext_tree_edge(child, level - 1, 1);
+		if (first->prev)
+			first->prev->next = last->next;
+		if (last->next)
+			last->next->prev = first->prev;
+		xfs_iext_tree_destroy(ifp, child, level - 1);
+		xfs_iext_node_delete(node, i);
+		return removed;
+	}
+
+	if (level == 1)
+		underfull = ((struct xfs_iext_leaf *)child)->nrecs * 4 <=
+			XFS_IEXT_LEAF_RECS;
+	else
+		underfull = ((struct xfs_iext_node *)child)->nchildren * 4 <=
+			XFS_IEXT_NODE_PTRS;
+	if (!underfull)
+		return removed;
+	if (i > 0 && xfs_iext_node_merge(ifp, node, i - 1, level - 1))
+		return removed;
+	if (i < node->nchildren - 1)
+		xfs_iext_node_merge(ifp, node, i, level - 1);
+	return removed;
+}
+
+/*
+ * Add count zeroed records at index idx of a b+tree extent list.
+ */
+STATIC void
+xfs_iext_add_tree(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	xfs_extnum_t	idx,		/* index to begin adding exts */
+	int		count)		/* number of extents to add */
+{
+	struct xfs_iext_tree *tree = ifp->if_u1.if_ext_tree;
+	struct xfs_iext_node *root;
+	xfs_extnum_t	nextents;	/* number of extents in file */
+	void		*new;		/* new right sibling of the root */
+	xfs_extnum_t	newcount;	/* number of records under it */
+	int		inserted;
+
+	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
+	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+	tree->cur = NULL;
+	while (count > 0) {
+		inserted = xfs_iext_tree_insert(ifp, tree->root,
+				tree->height - 1, idx, count, &new, &newcount);
+		nextents += inserted;
+		if (new) {
+			root = xfs_iext_tree_alloc(ifp);
+			root->nchildren = 2;
+			root->ptrs[0] = tree->root;
+			root->counts[0] = nextents - newcount;
+			root->ptrs[1] = new;
+			root->counts[1] = newcount;
+			tree->root = root;
+			tree->height++;
+		}
+		idx += inserted;
+		count -= inserted;
+	}
+}
+
+/*
+ * Switch from a linear (direct) or inline extent list to a b+tree, once
+ * the extents no longer fit in XFS_IEXT_BUFSZ.
+ */
+STATIC void
+xfs_iext_direct_to_tree(
+	xfs_ifork_t	*ifp)		/* inode fork pointer */
+{
+	xfs_bmbt_rec_host_t *ep = ifp->if_u1.if_extents;
+	struct xfs_iext_leaf *leaf;
+	struct xfs_iext_tree *tree;
+	xfs_extnum_t	nextents;	/* number of extents in file */
+	int		real_bytes = ifp->if_real_bytes;
+	xfs_extnum_t	i;
+
+	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+	tree = kmem_zalloc(sizeof(*tree), KM_NOFS);
+	ifp->if_real_bytes = 0;
+	tree->root = xfs_iext_tree_alloc(ifp);
+	tree->height = 1;
+	ifp->if_u1.if_ext_tree = tree;
+	ifp->if_flags |= XFS_IFEXTIREC;
+	ifp->if_bytes = 0;
+	xfs_iext_add_tree(ifp, 0, nextents);
+	ifp->if_bytes = nextents * sizeof(xfs_bmbt_rec_t);
+
+	for (leaf = xfs_iext_tree_edge(tree->root, tree->height - 1, 0), i = 0;
+	     leaf; i += leaf->nrecs, leaf = leaf->next)
+		memcpy(leaf->recs, &ep[i], leaf->nrecs * sizeof(xfs_bmbt_rec_t));
+	if (real_bytes)
+		kmem_free(ep);
+	else if (nextents)
+		memset(ifp->if_u2.if_inline_ext, 0, XFS_INLINE_EXTS *
+			sizeof(xfs_bmbt_rec_t));
+}
+
+/*
+ * Switch from a b+tree back to a linear (direct) extent list.
+ */
+STATIC void
+xfs_iext_tree_to_direct(
+	xfs_ifork_t	*ifp)		/* inode fork pointer */
+{
+	struct xfs_iext_tree *tree = ifp->if_u1.if_ext_tree;
+	struct xfs_iext_leaf *leaf;
+	xfs_bmbt_rec_host_t *ep;	/* extent record pointer */
+	xfs_extnum_t	nextents;	/* number of extents in file */
+	int		size;		/* size of file extents */
+	xfs_extnum_t	i;
+
+	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
+	ASSERT(nextents <= XFS_LINEAR_EXTS);
+	size = nextents * sizeof(xfs_bmbt_rec_t);
+
+	ep = kmem_zalloc(XFS_IEXT_BUFSZ, KM_NOFS);
+	for (leaf = xfs_iext_tree_edge(tree->root, tree->height - 1, 0), i = 0;
+	     leaf; i += leaf->nrecs, leaf = leaf->next)
+		memcpy(&ep[i], leaf->recs, leaf->nrecs * sizeof(xfs_bmbt_rec_t));
+	xfs_iext_tree_destroy(ifp, tree->root, tree->height - 1);
+	kmem_free(tree);
+
+	ifp->if_flags &= ~XFS_IFEXTIREC;
+	ifp->if_u1.if_extents = ep;
+	ifp->if_real_bytes = XFS_IEXT_BUFSZ;
+	ifp->if_bytes = size;
+	if (nextents < XFS_LINEAR_EXTS) {
+		xfs_iext_realloc_direct(ifp, size);
+	}
+}
+
+/*
+ * Remove count records from index idx of a b+tree extent list, going back
+ * to a linear list once the extents fit in half of XFS_IEXT_BUFSZ; leaving
+ * some room stops a fork that hovers around the limit from rebuilding the
+ * tree on every other change.
+ */
+STATIC void
+xfs_iext_remove_tree(
+	xfs_ifork_t	*ifp,		/* inode fork pointer */
+	xfs_extnum_t	idx,		/* index to begin removing exts */
+	int		count)		/* number of extents to remove */
+{
+	struct xfs_iext_tree *tree = ifp->if_u1.if_ext_tree;
+	struct xfs_iext_node *root;
+	int		removed;
+
+	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
+	tree->cur = NULL;
+	while (count > 0) {
+		removed = xfs_iext_tree_remove(ifp, tree->root,
+				tree->height - 1, idx, count);
+		ASSERT(removed > 0);
+		ifp->if_bytes -= removed * sizeof(xfs_bmbt_rec_t);
+		count -= removed;
+	}
+	while (tree->height > 1 &&
+	       ((struct xfs_iext_node *)tree->root)->nchildren == 1) {
+		root = tree->root;
+		tree->root = root->ptrs[0];
+		tree->height--;
+		xfs_iext_tree_free(ifp, root);
+	}
+	if (ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t) <= XFS_LINEAR_EXTS / 2)
+		xfs_iext_tree_to_direct(ifp);
+}
+
+/*
+ * Return the leaf holding the extent for file block bno, or the one after
+ * which it would be inserted, and the index of the leaf's first record in
+ * *offp.
+ */
+STATIC struct xfs_iext_leaf *
+xfs_iext_bno_to_leaf(
+	struct xfs_iext_tree *tree,	/* extent b+tree */
+	xfs_fileoff_t	bno,		/* block number to search for */
+	xfs_extnum_t	*offp)		/* index of the leaf's first record */
+{
+	struct xfs_iext_node *node;
+	void		*ptr = tree->root;
+	int		level;
+	int		high;		/* binary search upper limit */
+	int		low;		/* binary search lower limit */
+	int		mid;
+	int		i;
+
+	*offp = 0;
+	for (level = tree->height - 1; level > 0; level--) {
+		node = ptr;
+		low = 0;
+		high = node->nchildren - 1;
+		while (low < high) {
+			mid = (low + high + 1) >> 1;
+			if (bno < xfs_bmbt_get_startoff(xfs_iext_tree_edge(
+					node->ptrs[mid], level - 1, 0)->recs))
+				high = mid - 1;
+			else
+				low = mid;
+		}
+		for (i = 0; i < low; i++)
+			*offp += node->counts[i];
+		ptr = node->ptrs[low];
+	}
+	return ptr;
+}
+
 /*
  * Return a pointer to the extent record at file index idx.
  */
@@ -882,15 +1461,8 @@ xfs_iext_get_ext(
 	ASSERT(idx >= 0);
 	ASSERT(idx < ifp->if_bytes / sizeof(xfs_bmbt_rec_t));
 
-	if ((ifp->if_flags & XFS_IFEXTIREC) && (idx == 0)) {
-		return ifp->if_u1.if_ext_irec->er_extbuf;
-	} else if (ifp->if_flags & XFS_IFEXTIREC) {
-		xfs_ext_irec_t	*erp;		/* irec pointer */
-		int		erp_idx = 0;	/* irec index */
-		xfs_extnum_t	page_idx = idx;	/* ext index in target list */
-
-		erp = xfs_iext_idx_to_irec(ifp, &page_idx, &erp_idx, 0);
-		return &erp->er_extbuf[page_idx];
+	if (ifp->if_flags & XFS_IFEXTIREC) {
+		return xfs_iext_tree_get(ifp->if_u1.if_ext_tree, idx);
 	} else if (ifp->if_bytes) {
 		return &ifp->if_u1.if_extents[idx];
 	} else {
@@ -968,7 +1540,8 @@ xfs_iext_add(
 	 * xfs_iext_realloc_direct will switch us from
 	 * inline to direct extent allocation mode.
 	 */
-	else if (nextents + ext_diff <= XFS_LINEAR_EXTS) {
+	else if (!(ifp->if_flags & XFS_IFEXTIREC) &&
+		 nextents + ext_diff <= XFS_LINEAR_EXTS) {
 		xfs_iext_realloc_direct(ifp, new_size);
 		if (idx < nextents) {
 			memmove(&ifp->if_u1.if_extents[idx + ext_diff],
@@ -977,169 +1550,16 @@ xfs_iext_add(
 			memset(&ifp->if_u1.if_extents[idx], 0, byte_diff);
 		}
 	}
-	/* Indirection array */
-	else {
-		xfs_ext_irec_t	*erp;
-		int		erp_idx = 0;
-		int		page_idx = idx;
-
-		ASSERT(nextents + ext_diff > XFS_LINEAR_EXTS);
-		if (ifp->if_flags & XFS_IFEXTIREC) {
-			erp = xfs_iext_idx_to_irec(ifp, &page_idx, &erp_idx, 1);
-		} else {
-			xfs_iext_irec_init(ifp);
-			ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-			erp = ifp->if_u1.if_ext_irec;
-		}
-		/* Extents fit in target extent page */
-		if (erp && erp->er_extcount + ext_diff <= XFS_LINEAR_EXTS) {
-			if (page_idx < erp->er_extcount) {
-				memmove(&erp->er_extbuf[page_idx + ext_diff],
-					&erp->er_extbuf[page_idx],
-					(erp->er_extcount - page_idx) *
-					sizeof(xfs_bmbt_rec_t));
-				memset(&erp->er_extbuf[page_idx], 0, byte_diff);
-			}
-			erp->er_extcount += ext_diff;
-			xfs_iext_irec_update_extoffs(ifp, erp_idx + 1, ext_diff);
-		}
-		/* Insert a new extent page */
-		else if (erp) {
-			xfs_iext_add_indirect_multi(ifp,
-				erp_idx, page_idx, ext_diff);
-		}
-		/*
-		 * If extent(s) are being appended to the last page in
-		 * the indirection array and the new extent(s) don't fit
-		 * in the page, then erp is NULL and erp_idx is set to
-		 * the next index needed in the indirection array.
-		 */
-		else {
-			uint	count = ext_diff;
-
-			while (count) {
-				erp = xfs_iext_irec_new(ifp, erp_idx);
-				erp->er_extcount = min(count, XFS_LINEAR_EXTS);
-				count -= erp->er_extcount;
-				if (count)
-					erp_idx++;
-			}
-		}
-	}
-	ifp->if_bytes = new_size;
-}
-
-/*
- * This is called when incore extents are being added to the indirection
- * array and the new extents do not fit in the target extent list. The
- * erp_idx parameter contains the irec index for the target extent list
- * in the indirection array, and the idx parameter contains the extent
- * index within the list. The number of extents being added is stored
- * in the count parameter.
- *
- *    |-------|   |-------|
- *    |       |   |       |    idx - number of extents before idx
- *    |  idx  |   | count |
- *    |       |   |       |    count - number of extents being inserted at idx
- *    |-------|   |-------|
- *    | count |   | nex2  |    nex2 - number of extents after idx + count
- *    |-------|   |-------|
- */
-void
-xfs_iext_add_indirect_multi(
-	xfs_ifork_t	*ifp,			/* inode fork pointer */
-	int		erp_idx,		/* target extent irec index */
-	xfs_extnum_t	idx,			/* index within target list */
-	int		count)			/* new extents being added */
-{
-	int		byte_diff;		/* new bytes being added */
-	xfs_ext_irec_t	*erp;			/* pointer to irec entry */
-	xfs_extnum_t	ext_diff;		/* number of extents to add */
-	xfs_extnum_t	ext_cnt;		/* new extents still needed */
-	xfs_extnum_t	nex2;			/* extents after idx + count */
-	xfs_bmbt_rec_t	*nex2_ep = NULL;	/* temp list for nex2 extents */
-	int		nlists;			/* number of irec's (lists) */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	erp = &ifp->if_u1.if_ext_irec[erp_idx];
-	nex2 = erp->er_extcount - idx;
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-
-	/*
-	 * Save second part of target extent list
-	 * (all extents past */
-	if (nex2) {
-		byte_diff = nex2 * sizeof(xfs_bmbt_rec_t);
-		nex2_ep = (xfs_bmbt_rec_t *) kmem_alloc(byte_diff, KM_NOFS);
-		memmove(nex2_ep, &erp->er_extbuf[idx], byte_diff);
-		erp->er_extcount -= nex2;
-		xfs_iext_irec_update_extoffs(ifp, erp_idx + 1, -nex2);
-		memset(&erp->er_extbuf[idx], 0, byte_diff);
-	}
-
 	/*
-	 * Add the new extents to the end of the target
-	 * list, then allocate new irec record(s) and
-	 * extent buffer(s) as needed to store the rest
-	 * of the new extents.
+	 * Otherwise use a b+tree of extent blocks, switching to one
+	 * if the extents are currently inline or direct.
 	 */
-	ext_cnt = count;
-	ext_diff = MIN(ext_cnt, (int)XFS_LINEAR_EXTS - erp->er_extcount);
-	if (ext_diff) {
-		erp->er_extcount += ext_diff;
-		xfs_iext_irec_update_extoffs(ifp, erp_idx + 1, ext_diff);
-		ext_cnt -= ext_diff;
-	}
-	while (ext_cnt) {
-		erp_idx++;
-		erp = xfs_iext_irec_new(ifp, erp_idx);
-		ext_diff = MIN(ext_cnt, (int)XFS_LINEAR_EXTS);
-		erp->er_extcount = ext_diff;
-		xfs_iext_irec_update_extoffs(ifp, erp_idx + 1, ext_diff);
-		ext_cnt -= ext_diff;
-	}
-
-	/* Add nex2 extents back to indirection array */
-	if (nex2) {
-		xfs_extnum_t	ext_avail;
-		int		i;
-
-		byte_diff = nex2 * sizeof(xfs_bmbt_rec_t);
-		ext_avail = XFS_LINEAR_EXTS - erp->er_extcount;
-		i = 0;
-		/*
-		 * If nex2 extents fit in the current page, append
-		 * nex2_ep after the new extents.
-		 */
-		if (nex2 <= ext_avail) {
-			i = erp->er_extcount;
-		}
-		/*
-		 * Otherwise, check if space is available in the
-		 * next page.
-		 */
-		else if ((erp_idx < nlists - 1) &&
-			 (nex2 <= (ext_avail = XFS_LINEAR_EXTS -
-			  ifp->if_u1.if_ext_irec[erp_idx+1].er_extcount))) {
-			erp_idx++;
-			erp++;
-			/* Create a hole for nex2 extents */
-			memmove(&erp->er_extbuf[nex2], erp->er_extbuf,
-				erp->er_extcount * sizeof(xfs_bmbt_rec_t));
-		}
-		/*
-		 * Final choice, create a new extent page for
-		 * nex2 extents.
-		 */
-		else {
-			erp_idx++;
-			erp = xfs_iext_irec_new(ifp, erp_idx);
-		}
-		memmove(&erp->er_extbuf[i], nex2_ep, byte_diff);
-		kmem_free(nex2_ep);
-		erp->er_extcount += nex2;
-		xfs_iext_irec_update_extoffs(ifp, erp_idx + 1, nex2);
+	else {
+		if (!(ifp->if_flags & XFS_IFEXTIREC))
+			xfs_iext_direct_to_tree(ifp);
+		xfs_iext_add_tree(ifp, idx, ext_diff);
 	}
+	ifp->if_bytes = new_size;
 }
 
 /*
@@ -1148,10 +1568,10 @@ xfs_iext_add_indirect_multi(
  * number of extents to be removed and the idx parameter contains
  * the extent index where the extents will be removed from.
  *
- * If the amount of space needed has decreased below the linear
- * limit, XFS_IEXT_BUFSZ, then switch to using the contiguous
- * extent array.  Otherwise, use kmem_realloc() to adjust the
- * size to what is needed.
+ * If the amount of space needed has decreased well below the
+ * linear limit, XFS_IEXT_BUFSZ, then switch from the b+tree to
+ * the contiguous extent array.  Otherwise, use kmem_realloc() to
+ * adjust the size to what is needed.
  */
 void
 xfs_iext_remove(
@@ -1173,7 +1593,7 @@ xfs_iext_remove(
 	if (new_size == 0) {
 		xfs_iext_destroy(ifp);
 	} else if (ifp->if_flags & XFS_IFEXTIREC) {
-		xfs_iext_remove_indirect(ifp, idx, ext_diff);
+		xfs_iext_remove_tree(ifp, idx, ext_diff);
 	} else if (ifp->if_real_bytes) {
 		xfs_iext_remove_direct(ifp, idx, ext_diff);
 	} else {
@@ -1260,82 +1680,6 @@ xfs_iext_remove_direct(
 	ifp->if_bytes = new_size;
 }
 
-/*
- * This is called when incore extents are being removed from the
- * indirection array and the extents being removed span multiple extent
- * buffers. The idx parameter contains the file extent index where we
- * want to begin removing extents, and the count parameter contains
- * how many extents need to be removed.
- *
- *    |-------|   |-------|
- *    | nex1  |   |       |    nex1 - number of extents before idx
- *    |-------|   | count |
- *    |       |   |       |    count - number of extents being removed at idx
- *    | count |   |-------|
- *    |       |   | nex2  |    nex2 - number of extents after idx + count
- *    |-------|   |-------|
- */
-void
-xfs_iext_remove_indirect(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	xfs_extnum_t	idx,		/* index to begin removing extents */
-	int		count)		/* number of extents to remove */
-{
-	xfs_ext_irec_t	*erp;		/* indirection array pointer */
-	int		erp_idx = 0;	/* indirection array index */
-	xfs_extnum_t	ext_cnt;	/* extents left to remove */
-	xfs_extnum_t	ext_diff;	/* extents to remove in current list */
-	xfs_extnum_t	nex1;		/* number of extents before idx */
-	xfs_extnum_t	nex2;		/* extents after idx + count */
-	int		page_idx = idx;	/* index in target extent list */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	erp = xfs_iext_idx_to_irec(ifp,  &page_idx, &erp_idx, 0);
-	ASSERT(erp != NULL);
-	nex1 = page_idx;
-	ext_cnt = count;
-	while (ext_cnt) {
-		nex2 = MAX((erp->er_extcount - (nex1 + ext_cnt)), 0);
-		ext_diff = MIN(ext_cnt, (erp->er_extcount - nex1));
-		/*
-		 * Check for deletion of entire list;
-		 * xfs_iext_irec_remove() updates extent offsets.
-		 */
-		if (ext_diff == erp->er_extcount) {
-			xfs_iext_irec_remove(ifp, erp_idx);
-			ext_cnt -= ext_diff;
-			nex1 = 0;
-			if (ext_cnt) {
-				ASSERT(erp_idx < ifp->if_real_bytes /
-					XFS_IEXT_BUFSZ);
-				erp = &ifp->if_u1.if_ext_irec[erp_idx];
-				nex1 = 0;
-				continue;
-			} else {
-				break;
-			}
-		}
-		/* Move extents up (if needed) */
-		if (nex2) {
-			memmove(&erp->er_extbuf[nex1],
-				&erp->er_extbuf[nex1 + ext_diff],
-				nex2 * sizeof(xfs_bmbt_rec_t));
-		}
-		/* Zero out rest of page */
-		memset(&erp->er_extbuf[nex1 + nex2], 0, (XFS_IEXT_BUFSZ -
-			((nex1 + nex2) * sizeof(xfs_bmbt_rec_t))));
-		/* Update remaining counters */
-		erp->er_extcount -= ext_diff;
-		xfs_iext_irec_update_extoffs(ifp, erp_idx + 1, -ext_diff);
-		ext_cnt -= ext_diff;
-		nex1 = 0;
-		erp_idx++;
-		erp++;
-	}
-	ifp->if_bytes -= count * sizeof(xfs_bmbt_rec_t);
-	xfs_iext_irec_compact(ifp);
-}
-
 /*
  * Create, destroy, or resize a linear (direct) block of extents.
  */
@@ -1348,9 +1692,7 @@ xfs_iext_realloc_direct(
 
 	rnew_size = new_size;
 
-	ASSERT(!(ifp->if_flags & XFS_IFEXTIREC) ||
-		((new_size >= 0) && (new_size <= XFS_IEXT_BUFSZ) &&
-		 (new_size != ifp->if_real_bytes)));
+	ASSERT(!(ifp->if_flags & XFS_IFEXTIREC));
 
 	/* Free extent records */
 	if (new_size == 0) {
@@ -1437,60 +1779,6 @@ xfs_iext_inline_to_direct(
 	ifp->if_real_bytes = new_size;
 }
 
-/*
- * Resize an extent indirection array to new_size bytes.
- */
-STATIC void
-xfs_iext_realloc_indirect(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	int		new_size)	/* new indirection array size */
-{
-	int		nlists;		/* number of irec's (ex lists) */
-	int		size;		/* current indirection array size */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	size = nlists * sizeof(xfs_ext_irec_t);
-	ASSERT(ifp->if_real_bytes);
-	ASSERT((new_size >= 0) && (new_size != size));
-	if (new_size == 0) {
-		xfs_iext_destroy(ifp);
-	} else {
-		ifp->if_u1.if_ext_irec = (xfs_ext_irec_t *)
-			kmem_realloc(ifp->if_u1.if_ext_irec,
-				new_size, size, KM_NOFS);
-	}
-}
-
-/*
- * Switch from indirection array to linear (direct) extent allocations.
- */
-STATIC void
-xfs_iext_indirect_to_direct(
-	 xfs_ifork_t	*ifp)		/* inode fork pointer */
-{
-	xfs_bmbt_rec_host_t *ep;	/* extent record pointer */
-	xfs_extnum_t	nextents;	/* number of extents in file */
-	int		size;		/* size of file extents */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
-	ASSERT(nextents <= XFS_LINEAR_EXTS);
-	size = nextents * sizeof(xfs_bmbt_rec_t);
-
-	xfs_iext_irec_compact_pages(ifp);
-	ASSERT(ifp->if_real_bytes == XFS_IEXT_BUFSZ);
-
-	ep = ifp->if_u1.if_ext_irec->er_extbuf;
-	kmem_free(ifp->if_u1.if_ext_irec);
-	ifp->if_flags &= ~XFS_IFEXTIREC;
-	ifp->if_u1.if_extents = ep;
-	ifp->if_bytes = size;
-	if (nextents < XFS_LINEAR_EXTS) {
-		xfs_iext_realloc_direct(ifp, size);
-	}
-}
-
 /*
  * Free incore file extents.
  */
@@ -1499,13 +1787,10 @@ xfs_iext_destroy(
 	xfs_ifork_t	*ifp)		/* inode fork pointer */
 {
 	if (ifp->if_flags & XFS_IFEXTIREC) {
-		int	erp_idx;
-		int	nlists;
+		struct xfs_iext_tree *tree = ifp->if_u1.if_ext_tree;
 
-		nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-		for (erp_idx = nlists - 1; erp_idx >= 0 ; erp_idx--) {
-			xfs_iext_irec_remove(ifp, erp_idx);
-		}
+		xfs_iext_tree_destroy(ifp, tree->root, tree->height - 1);
+		kmem_free(tree);
 		ifp->if_flags &= ~XFS_IFEXTIREC;
 	} else if (ifp->if_real_bytes) {
 		kmem_free(ifp->if_u1.if_extents);
@@ -1530,7 +1815,8 @@ xfs_iext_bno_to_ext(
 	xfs_bmbt_rec_host_t *base;	/* pointer to first extent */
 	xfs_filblks_t	blockcount = 0;	/* number of blocks in extent */
 	xfs_bmbt_rec_host_t *ep = NULL;	/* pointer to target extent */
-	xfs_ext_irec_t	*erp = NULL;	/* indirection array pointer */
+	struct xfs_iext_leaf *leaf = NULL; /* b+tree leaf holding bno */
+	xfs_extnum_t	leafoff = 0;	/* index of its first extent */
 	int		high;		/* upper boundary in search */
 	xfs_extnum_t	idx = 0;	/* index of target extent */
 	int		low;		/* lower boundary in search */
@@ -1544,11 +1830,13 @@ xfs_iext_bno_to_ext(
 	}
 	low = 0;
 	if (ifp->if_flags & XFS_IFEXTIREC) {
-		/* Find target extent list */
-		int	erp_idx = 0;
-		erp = xfs_iext_bno_to_irec(ifp, bno, &erp_idx);
-		base = erp->er_extbuf;
-		high = erp->er_extcount - 1;
+		/* Find target leaf, and remember it for the caller's walk */
+		leaf = xfs_iext_bno_to_leaf(ifp->if_u1.if_ext_tree, bno,
+					    &leafoff);
+		ifp->if_u1.if_ext_tree->cur = leaf;
+		ifp->if_u1.if_ext_tree->curoff = leafoff;
+		base = leaf->recs;
+		high = leaf->nrecs - 1;
 	} else {
 		base = ifp->if_u1.if_extents;
 		high = nextents - 1;
@@ -1565,17 +1853,13 @@ xfs_iext_bno_to_ext(
 			low = idx + 1;
 		} else {
 			/* Convert back to file-based extent index */
-			if (ifp->if_flags & XFS_IFEXTIREC) {
-				idx += erp->er_extoff;
-			}
+			idx += leafoff;
 			*idxp = idx;
 			return ep;
 		}
 	}
 	/* Convert back to file-based extent index */
-	if (ifp->if_flags & XFS_IFEXTIREC) {
-		idx += erp->er_extoff;
-	}
+	idx += leafoff;
 	if (bno >= startoff + blockcount) {
 		if (++idx == nextents) {
 			ep = NULL;
@@ -1586,313 +1870,3 @@ xfs_iext_bno_to_ext(
 	*idxp = idx;
 	return ep;
 }
-
-/*
- * Return a pointer to the indirection array entry containing the
- * extent record for filesystem block bno. Store the index of the
- * target irec in *erp_idxp.
- */
-xfs_ext_irec_t *			/* pointer to found extent record */
-xfs_iext_bno_to_irec(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	xfs_fileoff_t	bno,		/* block number to search for */
-	int		*erp_idxp)	/* irec index of target ext list */
-{
-	xfs_ext_irec_t	*erp = NULL;	/* indirection array pointer */
-	xfs_ext_irec_t	*erp_next;	/* next indirection array entry */
-	int		erp_idx;	/* indirection array index */
-	int		nlists;		/* number of extent irec's (lists) */
-	int		high;		/* binary search upper limit */
-	int		low;		/* binary search lower limit */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	erp_idx = 0;
-	low = 0;
-	high = nlists - 1;
-	while (low <= high) {
-		erp_idx = (low + high) >> 1;
-		erp = &ifp->if_u1.if_ext_irec[erp_idx];
-		erp_next = erp_idx < nlists - 1 ? erp + 1 : NULL;
-		if (bno < xfs_bmbt_get_startoff(erp->er_extbuf)) {
-			high = erp_idx - 1;
-		} else if (erp_next && bno >=
-			   xfs_bmbt_get_startoff(erp_next->er_extbuf)) {
-			low = erp_idx + 1;
-		} else {
-			break;
-		}
-	}
-	*erp_idxp = erp_idx;
-	return erp;
-}
-
-/*
- * Return a pointer to the indirection array entry containing the
- * extent record at file extent index *idxp. Store the index of the
- * target irec in *erp_idxp and store the page index of the target
- * extent record in *idxp.
- */
-xfs_ext_irec_t *
-xfs_iext_idx_to_irec(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	xfs_extnum_t	*idxp,		/* extent index (file -> page) */
-	int		*erp_idxp,	/* pointer to target irec */
-	int		realloc)	/* new bytes were just added */
-{
-	xfs_ext_irec_t	*prev;		/* pointer to previous irec */
-	xfs_ext_irec_t	*erp = NULL;	/* pointer to current irec */
-	int		erp_idx;	/* indirection array index */
-	int		nlists;		/* number of irec's (ex lists) */
-	int		high;		/* binary search upper limit */
-	int		low;		/* binary search lower limit */
-	xfs_extnum_t	page_idx = *idxp; /* extent index in target list */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	ASSERT(page_idx >= 0);
-	ASSERT(page_idx <= ifp->if_bytes / sizeof(xfs_bmbt_rec_t));
-	ASSERT(page_idx < ifp->if_bytes / sizeof(xfs_bmbt_rec_t) || realloc);
-
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	erp_idx = 0;
-	low = 0;
-	high = nlists - 1;
-
-	/* Binary search extent irec's */
-	while (low <= high) {
-		erp_idx = (low + high) >> 1;
-		erp = &ifp->if_u1.if_ext_irec[erp_idx];
-		prev = erp_idx > 0 ? erp - 1 : NULL;
-		if (page_idx < erp->er_extoff || (page_idx == erp->er_extoff &&
-		     realloc && prev && prev->er_extcount < XFS_LINEAR_EXTS)) {
-			high = erp_idx - 1;
-		} else if (page_idx > erp->er_extoff + erp->er_extcount ||
-			   (page_idx == erp->er_extoff + erp->er_extcount &&
-			    !realloc)) {
-			low = erp_idx + 1;
-		} else if (page_idx == erp->er_extoff + erp->er_extcount &&
-			   erp->er_extcount == XFS_LINEAR_EXTS) {
-			ASSERT(realloc);
-			page_idx = 0;
-			erp_idx++;
-			erp = erp_idx < nlists ? erp + 1 : NULL;
-			break;
-		} else {
-			page_idx -= erp->er_extoff;
-			break;
-		}
-	}
-	*idxp = page_idx;
-	*erp_idxp = erp_idx;
-	return erp;
-}
-
-/*
- * Allocate and initialize an indirection array once the space needed
- * for incore extents increases above XFS_IEXT_BUFSZ.
- */
-void
-xfs_iext_irec_init(
-	xfs_ifork_t	*ifp)		/* inode fork pointer */
-{
-	xfs_ext_irec_t	*erp;		/* indirection array pointer */
-	xfs_extnum_t	nextents;	/* number of extents in file */
-
-	ASSERT(!(ifp->if_flags & XFS_IFEXTIREC));
-	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
-	ASSERT(nextents <= XFS_LINEAR_EXTS);
-
-	erp = kmem_alloc(sizeof(xfs_ext_irec_t), KM_NOFS);
-
-	if (nextents == 0) {
-		ifp->if_u1.if_extents = kmem_alloc(XFS_IEXT_BUFSZ, KM_NOFS);
-	} else if (!ifp->if_real_bytes) {
-		xfs_iext_inline_to_direct(ifp, XFS_IEXT_BUFSZ);
-	} else if (ifp->if_real_bytes < XFS_IEXT_BUFSZ) {
-		xfs_iext_realloc_direct(ifp, XFS_IEXT_BUFSZ);
-	}
-	erp->er_extbuf = ifp->if_u1.if_extents;
-	erp->er_extcount = nextents;
-	erp->er_extoff = 0;
-
-	ifp->if_flags |= XFS_IFEXTIREC;
-	ifp->if_real_bytes = XFS_IEXT_BUFSZ;
-	ifp->if_bytes = nextents * sizeof(xfs_bmbt_rec_t);
-	ifp->if_u1.if_ext_irec = erp;
-
-	return;
-}
-
-/*
- * Allocate and initialize a new entry in the indirection array.
- */
-xfs_ext_irec_t *
-xfs_iext_irec_new(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	int		erp_idx)	/* index for new irec */
-{
-	xfs_ext_irec_t	*erp;		/* indirection array pointer */
-	int		i;		/* loop counter */
-	int		nlists;		/* number of irec's (ex lists) */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-
-	/* Resize indirection array */
-	xfs_iext_realloc_indirect(ifp, ++nlists *
-				  sizeof(xfs_ext_irec_t));
-	/*
-	 * Move records down in the array so the
-	 * new page can use erp_idx.
-	 */
-	erp = ifp->if_u1.if_ext_irec;
-	for (i = nlists - 1; i > erp_idx; i--) {
-		memmove(&erp[i], &erp[i-1], sizeof(xfs_ext_irec_t));
-	}
-	ASSERT(i == erp_idx);
-
-	/* Initialize new extent record */
-	erp = ifp->if_u1.if_ext_irec;
-	erp[erp_idx].er_extbuf = kmem_alloc(XFS_IEXT_BUFSZ, KM_NOFS);
-	ifp->if_real_bytes = nlists * XFS_IEXT_BUFSZ;
-	memset(erp[erp_idx].er_extbuf, 0, XFS_IEXT_BUFSZ);
-	erp[erp_idx].er_extcount = 0;
-	erp[erp_idx].er_extoff = erp_idx > 0 ?
-		erp[erp_idx-1].er_extoff + erp[erp_idx-1].er_extcount : 0;
-	return (&erp[erp_idx]);
-}
-
-/*
- * Remove a record from the indirection array.
- */
-void
-xfs_iext_irec_remove(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	int		erp_idx)	/* irec index to remove */
-{
-	xfs_ext_irec_t	*erp;		/* indirection array pointer */
-	int		i;		/* loop counter */
-	int		nlists;		/* number of irec's (ex lists) */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	erp = &ifp->if_u1.if_ext_irec[erp_idx];
-	if (erp->er_extbuf) {
-		xfs_iext_irec_update_extoffs(ifp, erp_idx + 1,
-			-erp->er_extcount);
-		kmem_free(erp->er_extbuf);
-	}
-	/* Compact extent records */
-	erp = ifp->if_u1.if_ext_irec;
-	for (i = erp_idx; i < nlists - 1; i++) {
-		memmove(&erp[i], &erp[i+1], sizeof(xfs_ext_irec_t));
-	}
-	/*
-	 * Manually free the last extent record from the indirection
-	 * array.  A call to xfs_iext_realloc_indirect() with a size
-	 * of zero would result in a call to xfs_iext_destroy() which
-	 * would in turn call this function again, creating a nasty
-	 * infinite loop.
-	 */
-	if (--nlists) {
-		xfs_iext_realloc_indirect(ifp,
-			nlists * sizeof(xfs_ext_irec_t));
-	} else {
-		kmem_free(ifp->if_u1.if_ext_irec);
-	}
-	ifp->if_real_bytes = nlists * XFS_IEXT_BUFSZ;
-}
-
-/*
- * This is called to clean up large amounts of unused memory allocated
- * by the indirection array.  Before compacting anything though, verify
- * that the indirection array is still needed and switch back to the
- * linear extent list (or even the inline buffer) if possible.  The
- * compaction policy is as follows:
- *
- *    Full Compaction: Extents fit into a single page (or inline buffer)
- * Partial Compaction: Extents occupy less than 50% of allocated space
- *      No Compaction: Extents occupy at least 50% of allocated space
- */
-void
-xfs_iext_irec_compact(
-	xfs_ifork_t	*ifp)		/* inode fork pointer */
-{
-	xfs_extnum_t	nextents;	/* number of extents in file */
-	int		nlists;		/* number of irec's (ex lists) */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	nextents = ifp->if_bytes / (uint)sizeof(xfs_bmbt_rec_t);
-
-	if (nextents == 0) {
-		xfs_iext_destroy(ifp);
-	} else if (nextents <= XFS_INLINE_EXTS) {
-		xfs_iext_indirect_to_direct(ifp);
-		xfs_iext_direct_to_inline(ifp, nextents);
-	} else if (nextents <= XFS_LINEAR_EXTS) {
-		xfs_iext_indirect_to_direct(ifp);
-	} else if (nextents < (nlists * XFS_LINEAR_EXTS) >> 1) {
-		xfs_iext_irec_compact_pages(ifp);
-	}
-}
-
-/*
- * Combine extents from neighboring extent pages.
- */
-void
-xfs_iext_irec_compact_pages(
-	xfs_ifork_t	*ifp)		/* inode fork pointer */
-{
-	xfs_ext_irec_t	*erp, *erp_next;/* pointers to irec entries */
-	int		erp_idx = 0;	/* indirection array index */
-	int		nlists;		/* number of irec's (ex lists) */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	while (erp_idx < nlists - 1) {
-		erp = &ifp->if_u1.if_ext_irec[erp_idx];
-		erp_next = erp + 1;
-		if (erp_next->er_extcount <=
-		    (XFS_LINEAR_EXTS - erp->er_extcount)) {
-			memcpy(&erp->er_extbuf[erp->er_extcount],
-				erp_next->er_extbuf, erp_next->er_extcount *
-				sizeof(xfs_bmbt_rec_t));
-			erp->er_extcount += erp_next->er_extcount;
-			/*
-			 * Free page before removing extent record
-			 * so er_extoffs don't get modified in
-			 * xfs_iext_irec_remove.
-			 */
-			kmem_free(erp_next->er_extbuf);
-			erp_next->er_extbuf = NULL;
-			xfs_iext_irec_remove(ifp, erp_idx + 1);
-			nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-		} else {
-			erp_idx++;
-		}
-	}
-}
-
-/*
- * This is called to update the er_extoff field in the indirection
- * array when extents have been added or removed from one of the
- * extent lists. erp_idx contains the irec index to begin updating
- * at and ext_diff contains the number of extents that were added
- * or removed.
- */
-void
-xfs_iext_irec_update_extoffs(
-	xfs_ifork_t	*ifp,		/* inode fork pointer */
-	int		erp_idx,	/* irec index to update */
-	int		ext_diff)	/* number of new extents */
-{
-	int		i;		/* loop counter */
-	int		nlists;		/* number of irec's (ex lists */
-
-	ASSERT(ifp->if_flags & XFS_IFEXTIREC);
-	nlists = ifp->if_real_bytes / XFS_IEXT_BUFSZ;
-	for (i = erp_idx; i < nlists; i++) {
-		ifp->if_u1.if_ext_irec[i].er_extoff += ext_diff;
-	}
-}
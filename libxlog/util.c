@@ -22,6 +22,7 @@
 int print_exit;
 int print_skip_uuid;
 int print_record_header;
+FILE *print_output;	/* record headers and errors go here, if not stdout */
 libxfs_init_t x;
 
 /*
@@ -93,7 +94,8 @@ header_check_uuid(xfs_mount_t *mp, xlog_rec_header_t *head)
     platform_uuid_unparse(&mp->m_sb.sb_uuid, uu_sb);
     platform_uuid_unparse(&head->h_fs_uuid, uu_log);
 
-    printf(_("* ERROR: mismatched uuid in log\n"
+    fprintf(print_output ? print_output : stdout,
+	    _("* ERROR: mismatched uuid in log\n"
 	     "*            SB : %s\n*            log: %s\n"),
 	    uu_sb, uu_log);
 
@@ -105,8 +107,10 @@ header_check_uuid(xfs_mount_t *mp, xlog_rec_header_t *head)
 int
 xlog_header_check_recover(xfs_mount_t *mp, xlog_rec_header_t *head)
 {
+    FILE *out = print_output ? print_output : stdout;
+
     if (print_record_header)
-	printf(_("\nLOG REC AT LSN cycle %d block %d (0x%x, 0x%x)\n"),
+	fprintf(out, _("\nLOG REC AT LSN cycle %d block %d (0x%x, 0x%x)\n"),
 	       CYCLE_LSN(be64_to_cpu(head->h_lsn)),
 	       BLOCK_LSN(be64_to_cpu(head->h_lsn)),
 	       CYCLE_LSN(be64_to_cpu(head->h_lsn)),
@@ -114,7 +118,7 @@ xlog_header_check_recover(xfs_mount_t *mp, xlog_rec_header_t *head)
 
     if (be32_to_cpu(head->h_magicno) != XLOG_HEADER_MAGIC_NUM) {
 
-	printf(_("* ERROR: bad magic number in log header: 0x%x\n"),
+	fprintf(out, _("* ERROR: bad magic number in log header: 0x%x\n"),
 		be32_to_cpu(head->h_magicno));
 
     } else if (header_check_uuid(mp, head)) {
@@ -123,7 +127,7 @@ xlog_header_check_recover(xfs_mount_t *mp, xlog_rec_header_t *head)
 
     } else if (be32_to_cpu(head->h_fmt) != XLOG_FMT) {
 
-	printf(_("* ERROR: log format incompatible (log=%d, ours=%d)\n"),
+	fprintf(out, _("* ERROR: log format incompatible (log=%d, ours=%d)\n"),
 		be32_to_cpu(head->h_fmt), XLOG_FMT);
 
     } else {
@@ -17,6 +17,7 @@
  */
 #include "libxfs.h"
 #include "libxlog.h"
+#include <pthread.h>
 
 #define xfs_readonly_buftarg(buftarg)			(0)
 
@@ -184,6 +185,96 @@ xlog_bread_offset(
 	return error2;
 }
 
+/*
+ * Finding the head and tail probes scattered single blocks, then scans
+ * runs of blocks around the head several times over.  Do all of that
+ * through one buffer of up to XLOG_SEARCH_BBS blocks, so that the scans
+ * read each region once in large I/Os, and nothing is allocated per step.
+ */
+#define XLOG_SEARCH_BBS		4096	/* 2MiB, all the iclogs' worth */
+
+struct xlog_search {
+	struct xfs_buf	*bp;
+	int		bufblks;	/* most blocks bp holds */
+	xfs_daddr_t	blk;		/* first block held */
+	int		nblks;		/* blocks held, 0 if none */
+	char		*base;		/* data of blk */
+};
+
+STATIC int
+xlog_search_init(
+	struct xlog		*log,
+	struct xlog_search	*s)
+{
+	s->bufblks = min(XLOG_SEARCH_BBS, log->l_logBBsize);
+	s->nblks = 0;
+	while (!(s->bp = xlog_get_bp(log, s->bufblks))) {
+		s->bufblks >>= 1;
+		if (s->bufblks < log->l_sectBBsize)
+			return ENOMEM;
+	}
+	return 0;
+}
+
+STATIC void
+xlog_search_free(
+	struct xlog_search	*s)
+{
+	xlog_put_bp(s->bp);
+}
+
+/*
+ * Point *offset at blocks blk_no to blk_no + nbblks - 1, reading them if
+ * they aren't held already.  With dir 0 just those blocks are read;
+ * otherwise a whole buffer is, going forward from blk_no for a forward
+ * scan (dir > 0) or back from the last block for a backward one.
+ */
+STATIC int
+xlog_search_read(
+	struct xlog		*log,
+	struct xlog_search	*s,
+	xfs_daddr_t		blk_no,
+	int			nbblks,
+	int			dir,
+	char			**offset)
+{
+	xfs_daddr_t		start = blk_no;
+	int			len = nbblks;
+	int			error;
+
+	ASSERT(nbblks <= s->bufblks);
+	if (s->nblks && blk_no >= s->blk &&
+	    blk_no + nbblks <= s->blk + s->nblks) {
+		*offset = s->base + BBTOB(blk_no - s->blk);
+		return 0;
+	}
+
+	if (dir) {
+		len = s->bufblks;
+		if (dir < 0)
+			start = max(blk_no + nbblks - len, (xfs_daddr_t)0);
+		else
+			start = min(blk_no,
+				    (xfs_daddr_t)(log->l_logBBsize - len));
+	}
+	/* keep whole sectors, so what's held starts at s->base */
+	len = round_up(start + len, (xfs_daddr_t)log->l_sectBBsize);
+	start = round_down(start, (xfs_daddr_t)log->l_sectBBsize);
+	len -= start;
+
+	s->nblks = 0;
+	error = xlog_bread(log, start, len, s->bp, &s->base);
+	if (error)
+		return error;
+	s->blk = start;
+	s->nblks = len;
+	*offset = s->base + BBTOB(blk_no - start);
+	return 0;
+}
+
+STATIC int	xlog_search_zeroed(struct xlog *, struct xlog_search *,
+				   xfs_daddr_t *);
+
 /*
  * This routine finds (to an approximation) the first block in the physical
  * log which contains the given cycle.  It uses a binary search algorithm.
@@ -225,6 +316,51 @@ xlog_find_cycle_start(
 	return 0;
 }
 
+/*
+ * xlog_find_cycle_start() through the search buffer: once the rest of the
+ * range fits in it, read it in one go and finish the search in memory.
+ */
+STATIC int
+xlog_search_cycle_start(
+	struct xlog		*log,
+	struct xlog_search	*s,
+	xfs_daddr_t		first_blk,
+	xfs_daddr_t		*last_blk,
+	uint			cycle)
+{
+	char			*offset;
+	xfs_daddr_t		mid_blk;
+	xfs_daddr_t		end_blk;
+	uint			mid_cycle;
+	int			error;
+
+	end_blk = *last_blk;
+	mid_blk = BLK_AVG(first_blk, end_blk);
+	while (mid_blk != first_blk && mid_blk != end_blk) {
+		if (end_blk - first_blk < s->bufblks) {
+			error = xlog_search_read(log, s, first_blk,
+					end_blk - first_blk + 1, 0, &offset);
+			if (error)
+				return error;
+		}
+		error = xlog_search_read(log, s, mid_blk, 1, 0, &offset);
+		if (error)
+			return error;
+		mid_cycle = xlog_get_cycle(offset);
+		if (mid_cycle == cycle)
+			end_blk = mid_blk;   /* last_half_cycle == mid_cycle */
+		else
+			first_blk = mid_blk; /* first_half_cycle == mid_cycle */
+		mid_blk = BLK_AVG(first_blk, end_blk);
+	}
+	ASSERT((mid_blk == first_blk && mid_blk+1 == end_blk) ||
+	       (mid_blk == end_blk && mid_blk-1 == first_blk));
+
+	*last_blk = end_blk;
+
+	return 0;
+}
+
 /*
  * Check that a range of blocks does not contain stop_on_cycle_no.
  * Fill in *new_blk with the block offset where such a block is
@@ -235,48 +371,32 @@ xlog_find_cycle_start(
  */
 STATIC int
 xlog_find_verify_cycle(
-	struct xlog	*log,
-	xfs_daddr_t	start_blk,
-	int		nbblks,
-	uint		stop_on_cycle_no,
-	xfs_daddr_t	*new_blk)
+	struct xlog		*log,
+	struct xlog_search	*s,
+	xfs_daddr_t		start_blk,
+	int			nbblks,
+	uint			stop_on_cycle_no,
+	xfs_daddr_t		*new_blk)
 {
-	xfs_daddr_t	i, j;
-	uint		cycle;
-	xfs_buf_t	*bp;
-	xfs_daddr_t	bufblks;
-	char		*buf = NULL;
-	int		error = 0;
-
-	/*
-	 * Greedily allocate a buffer big enough to handle the full
-	 * range of basic blocks we'll be examining.  If that fails,
-	 * try a smaller size.  We need to be able to read at least
-	 * a log sector, or we're out of luck.
-	 */
-	bufblks = 1 << ffs(nbblks);
-	while (bufblks > log->l_logBBsize)
-		bufblks >>= 1;
-	while (!(bp = xlog_get_bp(log, bufblks))) {
-		bufblks >>= 1;
-		if (bufblks < log->l_sectBBsize)
-			return ENOMEM;
-	}
+	xfs_daddr_t		i, j;
+	uint			cycle;
+	char			*buf = NULL;
+	int			error;
 
-	for (i = start_blk; i < start_blk + nbblks; i += bufblks) {
+	for (i = start_blk; i < start_blk + nbblks; i += s->bufblks) {
 		int	bcount;
 
-		bcount = min(bufblks, (start_blk + nbblks - i));
+		bcount = min((xfs_daddr_t)s->bufblks, start_blk + nbblks - i);
 
-		error = xlog_bread(log, i, bcount, bp, &buf);
+		error = xlog_search_read(log, s, i, bcount, 1, &buf);
 		if (error)
-			goto out;
+			return error;
 
 		for (j = 0; j < bcount; j++) {
 			cycle = xlog_get_cycle(buf);
 			if (cycle == stop_on_cycle_no) {
 				*new_blk = i+j;
-				goto out;
+				return 0;
 			}
 
 			buf += BBSIZE;
@@ -284,10 +404,7 @@ xlog_find_verify_cycle(
 	}
 
 	*new_blk = -1;
-
-out:
-	xlog_put_bp(bp);
-	return error;
+	return 0;
 }
 
 /*
@@ -305,55 +422,36 @@ out:
 STATIC int
 xlog_find_verify_log_record(
 	struct xlog		*log,
+	struct xlog_search	*s,
 	xfs_daddr_t		start_blk,
 	xfs_daddr_t		*last_blk,
 	int			extra_bblks)
 {
 	xfs_daddr_t		i;
-	xfs_buf_t		*bp;
 	char			*offset = NULL;
 	xlog_rec_header_t	*head = NULL;
-	int			error = 0;
-	int			smallmem = 0;
-	int			num_blks = *last_blk - start_blk;
+	int			error;
 	int			xhdrs;
 
 	ASSERT(start_blk != 0 || *last_blk != start_blk);
 
-	if (!(bp = xlog_get_bp(log, num_blks))) {
-		if (!(bp = xlog_get_bp(log, 1)))
-			return ENOMEM;
-		smallmem = 1;
-	} else {
-		error = xlog_bread(log, start_blk, num_blks, bp, &offset);
-		if (error)
-			goto out;
-		offset += ((num_blks - 1) << BBSHIFT);
-	}
-
 	for (i = (*last_blk) - 1; i >= 0; i--) {
 		if (i < start_blk) {
 			/* valid log record not found */
 			xfs_warn(log->l_mp,
 		"Log inconsistent (didn't find previous header)");
 			ASSERT(0);
-			error = XFS_ERROR(EIO);
-			goto out;
+			return XFS_ERROR(EIO);
 		}
 
-		if (smallmem) {
-			error = xlog_bread(log, i, 1, bp, &offset);
-			if (error)
-				goto out;
-		}
+		error = xlog_search_read(log, s, i, 1, -1, &offset);
+		if (error)
+			return error;
 
 		head = (xlog_rec_header_t *)offset;
 
 		if (head->h_magicno == cpu_to_be32(XLOG_HEADER_MAGIC_NUM))
 			break;
-
-		if (!smallmem)
-			offset -= BBSIZE;
 	}
 
 	/*
@@ -361,17 +459,15 @@ xlog_find_verify_log_record(
 	 * to caller.  If caller can handle a return of -1, then this routine
 	 * will be called again for the end of the physical log.
 	 */
-	if (i == -1) {
-		error = -1;
-		goto out;
-	}
+	if (i == -1)
+		return -1;
 
 	/*
 	 * We have the final block of the good log (the first block
 	 * of the log record _before_ the head. So we check the uuid.
 	 */
 	if ((error = xlog_header_check_mount(log->l_mp, head)))
-		goto out;
+		return error;
 
 	/*
 	 * We may have found a log record header before we expected one.
@@ -394,9 +490,7 @@ xlog_find_verify_log_record(
 	    BTOBB(be32_to_cpu(head->h_len)) + xhdrs)
 		*last_blk = i;
 
-out:
-	xlog_put_bp(bp);
-	return error;
+	return 0;
 }
 
 /*
@@ -414,19 +508,19 @@ out:
  */
 STATIC int
 xlog_find_head(
-	struct xlog	*log,
-	xfs_daddr_t	*return_head_blk)
+	struct xlog		*log,
+	struct xlog_search	*s,
+	xfs_daddr_t		*return_head_blk)
 {
-	xfs_buf_t	*bp;
-	char		*offset;
-	xfs_daddr_t	new_blk, first_blk, start_blk, last_blk, head_blk;
-	int		num_scan_bblks;
-	uint		first_half_cycle, last_half_cycle;
-	uint		stop_on_cycle;
-	int		error, log_bbnum = log->l_logBBsize;
+	char			*offset;
+	xfs_daddr_t		new_blk, first_blk, start_blk, last_blk, head_blk;
+	int			num_scan_bblks;
+	uint			first_half_cycle, last_half_cycle;
+	uint			stop_on_cycle;
+	int			error, log_bbnum = log->l_logBBsize;
 
 	/* Is the end of the log device zeroed? */
-	if ((error = xlog_find_zeroed(log, &first_blk)) == -1) {
+	if ((error = xlog_search_zeroed(log, s, &first_blk)) == -1) {
 		*return_head_blk = first_blk;
 
 		/* Is the whole lot zeroed? */
@@ -445,18 +539,14 @@ xlog_find_head(
 	}
 
 	first_blk = 0;			/* get cycle # of 1st block */
-	bp = xlog_get_bp(log, 1);
-	if (!bp)
-		return ENOMEM;
-
-	error = xlog_bread(log, 0, 1, bp, &offset);
+	error = xlog_search_read(log, s, 0, 1, 0, &offset);
 	if (error)
 		goto bp_err;
 
 	first_half_cycle = xlog_get_cycle(offset);
 
 	last_blk = head_blk = log_bbnum - 1;	/* get cycle # of last block */
-	error = xlog_bread(log, last_blk, 1, bp, &offset);
+	error = xlog_search_read(log, s, last_blk, 1, 0, &offset);
 	if (error)
 		goto bp_err;
 
@@ -526,7 +616,7 @@ xlog_find_head(
 		 *                           ^ we want to locate this spot
 		 */
 		stop_on_cycle = last_half_cycle;
-		if ((error = xlog_find_cycle_start(log, bp, first_blk,
+		if ((error = xlog_search_cycle_start(log, s, first_blk,
 						&head_blk, last_half_cycle)))
 			goto bp_err;
 	}
@@ -545,7 +635,7 @@ xlog_find_head(
 		 * in one buffer.
 		 */
 		start_blk = head_blk - num_scan_bblks;
-		if ((error = xlog_find_verify_cycle(log,
+		if ((error = xlog_find_verify_cycle(log, s,
 						start_blk, num_scan_bblks,
 						stop_on_cycle, &new_blk)))
 			goto bp_err;
@@ -582,7 +672,7 @@ xlog_find_head(
 		ASSERT(head_blk <= INT_MAX &&
 			(xfs_daddr_t) num_scan_bblks >= head_blk);
 		start_blk = log_bbnum - (num_scan_bblks - head_blk);
-		if ((error = xlog_find_verify_cycle(log, start_blk,
+		if ((error = xlog_find_verify_cycle(log, s, start_blk,
 					num_scan_bblks - (int)head_blk,
 					(stop_on_cycle - 1), &new_blk)))
 			goto bp_err;
@@ -598,7 +688,7 @@ xlog_find_head(
 		 */
 		start_blk = 0;
 		ASSERT(head_blk <= INT_MAX);
-		if ((error = xlog_find_verify_cycle(log,
+		if ((error = xlog_find_verify_cycle(log, s,
 					start_blk, (int)head_blk,
 					stop_on_cycle, &new_blk)))
 			goto bp_err;
@@ -616,7 +706,7 @@ validate_head:
 		start_blk = head_blk - num_scan_bblks; /* don't read head_blk */
 
 		/* start ptr at last block ptr before head_blk */
-		if ((error = xlog_find_verify_log_record(log, start_blk,
+		if ((error = xlog_find_verify_log_record(log, s, start_blk,
 							&head_blk, 0)) == -1) {
 			error = XFS_ERROR(EIO);
 			goto bp_err;
@@ -625,7 +715,7 @@ validate_head:
 	} else {
 		start_blk = 0;
 		ASSERT(head_blk <= INT_MAX);
-		if ((error = xlog_find_verify_log_record(log, start_blk,
+		if ((error = xlog_find_verify_log_record(log, s, start_blk,
 							&head_blk, 0)) == -1) {
 			/* We hit the beginning of the log during our search */
 			start_blk = log_bbnum - (num_scan_bblks - head_blk);
@@ -633,7 +723,7 @@ validate_head:
 			ASSERT(start_blk <= INT_MAX &&
 				(xfs_daddr_t) log_bbnum-start_blk >= 0);
 			ASSERT(head_blk <= INT_MAX);
-			if ((error = xlog_find_verify_log_record(log,
+			if ((error = xlog_find_verify_log_record(log, s,
 							start_blk, &new_blk,
 							(int)head_blk)) == -1) {
 				error = XFS_ERROR(EIO);
@@ -646,7 +736,6 @@ validate_head:
 			goto bp_err;
 	}
 
-	xlog_put_bp(bp);
 	if (head_blk == log_bbnum)
 		*return_head_blk = 0;
 	else
@@ -660,8 +749,6 @@ validate_head:
 	return 0;
 
  bp_err:
-	xlog_put_bp(bp);
-
 	if (error)
 		xfs_warn(log->l_mp, "failed to find log head");
 	return error;
@@ -680,8 +767,8 @@ validate_head:
  * lsn.  The entire log record does not need to be valid.  We only care
  * that the header is valid.
  *
- * We could speed up search by using current head_blk buffer, but it is not
- * available.
+ * The search goes through xlog_find_head()'s buffer, which usually still
+ * holds the blocks just before the head.
  */
 int
 xlog_find_tail(
@@ -692,7 +779,7 @@ xlog_find_tail(
 	xlog_rec_header_t	*rhead;
 	xlog_op_header_t	*op_head;
 	char			*offset = NULL;
-	xfs_buf_t		*bp;
+	struct xlog_search	s;
 	int			error, i, found;
 	xfs_daddr_t		umount_data_blk;
 	xfs_daddr_t		after_umount_blk;
@@ -704,14 +791,15 @@ xlog_find_tail(
 	/*
 	 * Find previous log record
 	 */
-	if ((error = xlog_find_head(log, head_blk)))
+	if ((error = xlog_search_init(log, &s)))
+		return error;
+	if ((error = xlog_find_head(log, &s, head_blk))) {
+		xlog_search_free(&s);
 		return error;
+	}
 
-	bp = xlog_get_bp(log, 1);
-	if (!bp)
-		return ENOMEM;
 	if (*head_blk == 0) {				/* special case */
-		error = xlog_bread(log, 0, 1, bp, &offset);
+		error = xlog_search_read(log, &s, 0, 1, 0, &offset);
 		if (error)
 			goto done;
 
@@ -727,7 +815,7 @@ xlog_find_tail(
 	 */
 	ASSERT(*head_blk < INT_MAX);
 	for (i = (int)(*head_blk) - 1; i >= 0; i--) {
-		error = xlog_bread(log, i, 1, bp, &offset);
+		error = xlog_search_read(log, &s, i, 1, -1, &offset);
 		if (error)
 			goto done;
 
@@ -744,7 +832,7 @@ xlog_find_tail(
 	 */
 	if (!found) {
 		for (i = log->l_logBBsize - 1; i >= (int)(*head_blk); i--) {
-			error = xlog_bread(log, i, 1, bp, &offset);
+			error = xlog_search_read(log, &s, i, 1, -1, &offset);
 			if (error)
 				goto done;
 
@@ -757,7 +845,7 @@ xlog_find_tail(
 	}
 	if (!found) {
 		xfs_warn(log->l_mp, "%s: couldn't find sync record", __func__);
-		xlog_put_bp(bp);
+		xlog_search_free(&s);
 		ASSERT(0);
 		return XFS_ERROR(EIO);
 	}
@@ -820,7 +908,8 @@ xlog_find_tail(
 	if (*head_blk == after_umount_blk &&
 	    be32_to_cpu(rhead->h_num_logops) == 1) {
 		umount_data_blk = (i + hblks) % log->l_logBBsize;
-		error = xlog_bread(log, umount_data_blk, 1, bp, &offset);
+		error = xlog_search_read(log, &s, umount_data_blk, 1, 0,
+					 &offset);
 		if (error)
 			goto done;
 
@@ -870,7 +959,7 @@ xlog_find_tail(
 		error = xlog_clear_stale_blocks(log, tail_lsn);
 
 done:
-	xlog_put_bp(bp);
+	xlog_search_free(&s);
 
 	if (error)
 		xfs_warn(log->l_mp, "failed to locate log tail");
@@ -880,9 +969,8 @@ done:
 /*
  * Is the log zeroed at all?
  *
- * The last binary search should be changed to perform an X block read
- * once X becomes small enough.  You can then search linearly through
- * the X blocks.  This will cut down on the number of reads we need to do.
+ * Once the binary search is down to a range that fits in the search
+ * buffer, it is read in one go and the rest is done in memory.
  *
  * If the log is partially zeroed, this routine will pass back the blkno
  * of the first block with cycle number 0.  It won't have a complete LR
@@ -893,43 +981,38 @@ done:
  *	-1 => use *blk_no as the first block of the log
  *	>0 => error has occurred
  */
-int
-xlog_find_zeroed(
-	struct xlog	*log,
-	xfs_daddr_t	*blk_no)
+STATIC int
+xlog_search_zeroed(
+	struct xlog		*log,
+	struct xlog_search	*s,
+	xfs_daddr_t		*blk_no)
 {
-	xfs_buf_t	*bp;
-	char		*offset;
-	uint	        first_cycle, last_cycle;
-	xfs_daddr_t	new_blk, last_blk, start_blk;
-	xfs_daddr_t     num_scan_bblks;
-	int	        error, log_bbnum = log->l_logBBsize;
+	char			*offset;
+	uint			first_cycle, last_cycle;
+	xfs_daddr_t		new_blk, last_blk, start_blk;
+	xfs_daddr_t		num_scan_bblks;
+	int			error, log_bbnum = log->l_logBBsize;
 
 	*blk_no = 0;
 
 	/* check totally zeroed log */
-	bp = xlog_get_bp(log, 1);
-	if (!bp)
-		return ENOMEM;
-	error = xlog_bread(log, 0, 1, bp, &offset);
+	error = xlog_search_read(log, s, 0, 1, 0, &offset);
 	if (error)
-		goto bp_err;
+		return error;
 
 	first_cycle = xlog_get_cycle(offset);
 	if (first_cycle == 0) {		/* completely zeroed log */
 		*blk_no = 0;
-		xlog_put_bp(bp);
 		return -1;
 	}
 
 	/* check partially zeroed log */
-	error = xlog_bread(log, log_bbnum-1, 1, bp, &offset);
+	error = xlog_search_read(log, s, log_bbnum-1, 1, 0, &offset);
 	if (error)
-		goto bp_err;
+		return error;
 
 	last_cycle = xlog_get_cycle(offset);
 	if (last_cycle != 0) {		/* log completely written to */
-		xlog_put_bp(bp);
 		return 0;
 	} else if (first_cycle != 1) {
 		/*
@@ -939,14 +1022,13 @@ xlog_find_zeroed(
 		 */
 		xfs_warn(log->l_mp,
 			"Log inconsistent or not a log (last==0, first!=1)");
-		error = XFS_ERROR(EINVAL);
-		goto bp_err;
+		return XFS_ERROR(EINVAL);
 	}
 
 	/* we have a partially zeroed log */
 	last_blk = log_bbnum-1;
-	if ((error = xlog_find_cycle_start(log, bp, 0, &last_blk, 0)))
-		goto bp_err;
+	if ((error = xlog_search_cycle_start(log, s, 0, &last_blk, 0)))
+		return error;
 
 	/*
 	 * Validate the answer.  Because there is no way to guarantee that
@@ -967,9 +1049,9 @@ xlog_find_zeroed(
 	 *        1 ... | 0 | 1 | 0...
 	 *                       ^ binary search ends here
 	 */
-	if ((error = xlog_find_verify_cycle(log, start_blk,
+	if ((error = xlog_find_verify_cycle(log, s, start_blk,
 					 (int)num_scan_bblks, 0, &new_blk)))
-		goto bp_err;
+		return error;
 	if (new_blk != -1)
 		last_blk = new_blk;
 
@@ -977,30 +1059,90 @@ xlog_find_zeroed(
 	 * Potentially backup over partial log record write.  We don't need
 	 * to search the end of the log because we know it is zero.
 	 */
-	if ((error = xlog_find_verify_log_record(log, start_blk,
-				&last_blk, 0)) == -1) {
-	    error = XFS_ERROR(EIO);
-	    goto bp_err;
-	} else if (error)
-	    goto bp_err;
+	if ((error = xlog_find_verify_log_record(log, s, start_blk,
+				&last_blk, 0)) == -1)
+		return XFS_ERROR(EIO);
+	else if (error)
+		return error;
 
 	*blk_no = last_blk;
-bp_err:
-	xlog_put_bp(bp);
-	if (error)
-		return error;
 	return -1;
 }
 
+int
+xlog_find_zeroed(
+	struct xlog		*log,
+	xfs_daddr_t		*blk_no)
+{
+	struct xlog_search	s;
+	int			error;
+
+	*blk_no = 0;
+	if ((error = xlog_search_init(log, &s)))
+		return error;
+	error = xlog_search_zeroed(log, &s, blk_no);
+	xlog_search_free(&s);
+	return error;
+}
+
+/* tids are random, multiply so that all their bits pick the bucket */
+static inline struct hlist_head *
+xlog_rhash_head(
+	struct xlog_rhash	*rh,
+	xlog_tid_t		tid)
+{
+	return &rh->heads[((__uint32_t)tid * 0x9e370001U) >> (32 - rh->bits)];
+}
+
+STATIC void
+xlog_rhash_init(
+	struct xlog_rhash	*rh)
+{
+	rh->bits = XLOG_RHASH_BITS;
+	rh->count = 0;
+	rh->heads = kmem_zalloc(sizeof(struct hlist_head) << rh->bits,
+				KM_SLEEP);
+}
+
+STATIC void
+xlog_rhash_free(
+	struct xlog_rhash	*rh)
+{
+	kmem_free(rh->heads);
+	rh->heads = NULL;
+}
+
+STATIC void
+xlog_rhash_grow(
+	struct xlog_rhash	*rh)
+{
+	struct hlist_head	*old = rh->heads;
+	struct hlist_node	*n;
+	xlog_recover_t		*trans;
+	unsigned int		i;
+
+	rh->heads = kmem_zalloc(sizeof(struct hlist_head) << (rh->bits + 1),
+				KM_SLEEP);
+	rh->bits++;
+	for (i = 0; i < (1U << (rh->bits - 1)); i++) {
+		while ((n = old[i].first) != NULL) {
+			hlist_del(n);
+			trans = hlist_entry(n, xlog_recover_t, r_list);
+			hlist_add_head(n, xlog_rhash_head(rh, trans->r_log_tid));
+		}
+	}
+	kmem_free(old);
+}
+
 STATIC xlog_recover_t *
 xlog_recover_find_tid(
-	struct hlist_head	*head,
+	struct xlog_rhash	*rh,
 	xlog_tid_t		tid)
 {
 	xlog_recover_t		*trans;
 	struct hlist_node	*n;
 
-	hlist_for_each_entry(trans, n, head, r_list) {
+	hlist_for_each_entry(trans, n, xlog_rhash_head(rh, tid), r_list) {
 		if (trans->r_log_tid == tid)
 			return trans;
 	}
@@ -1009,7 +1151,7 @@ xlog_recover_find_tid(
 
 STATIC void
 xlog_recover_new_tid(
-	struct hlist_head	*head,
+	struct xlog_rhash	*rh,
 	xlog_tid_t		tid,
 	xfs_lsn_t		lsn)
 {
@@ -1020,8 +1162,11 @@ xlog_recover_new_tid(
 	trans->r_lsn	   = lsn;
 	INIT_LIST_HEAD(&trans->r_itemq);
 
+	if (rh->count >= (2U << rh->bits) && rh->bits < 24)
+		xlog_rhash_grow(rh);
 	INIT_HLIST_NODE(&trans->r_list);
-	hlist_add_head(&trans->r_list, head);
+	hlist_add_head(&trans->r_list, xlog_rhash_head(rh, tid));
+	rh->count++;
 }
 
 STATIC void
@@ -1183,12 +1328,14 @@ xlog_recover_free_trans(
 STATIC int
 xlog_recover_commit_trans(
 	struct xlog		*log,
+	struct xlog_rhash	*rh,
 	struct xlog_recover	*trans,
 	int			pass)
 {
 	int			error = 0;
 
 	hlist_del(&trans->r_list);
+	rh->count--;
 	if ((error = xlog_recover_do_trans(log, trans, pass)))
 		return error;
 
@@ -1217,7 +1364,7 @@ xlog_recover_unmount_trans(
 STATIC int
 xlog_recover_process_data(
 	struct xlog		*log,
-	struct hlist_head	rhash[],
+	struct xlog_rhash	*rhash,
 	struct xlog_rec_header	*rhead,
 	char			*dp,
 	int			pass)
@@ -1228,7 +1375,6 @@ xlog_recover_process_data(
 	xlog_recover_t		*trans;
 	xlog_tid_t		tid;
 	int			error;
-	unsigned long		hash;
 	uint			flags;
 
 	lp = dp + be32_to_cpu(rhead->h_len);
@@ -1250,11 +1396,10 @@ xlog_recover_process_data(
 			return (XFS_ERROR(EIO));
 		}
 		tid = be32_to_cpu(ohead->oh_tid);
-		hash = XLOG_RHASH(tid);
-		trans = xlog_recover_find_tid(&rhash[hash], tid);
+		trans = xlog_recover_find_tid(rhash, tid);
 		if (trans == NULL) {		   /* not found; add new tid */
 			if (ohead->oh_flags & XLOG_START_TRANS)
-				xlog_recover_new_tid(&rhash[hash], tid,
+				xlog_recover_new_tid(rhash, tid,
 					be64_to_cpu(rhead->h_lsn));
 		} else {
 			if (dp + be32_to_cpu(ohead->oh_len) > lp) {
@@ -1267,7 +1412,7 @@ xlog_recover_process_data(
 				flags &= ~XLOG_CONTINUE_TRANS;
 			switch (flags) {
 			case XLOG_COMMIT_TRANS:
-				error = xlog_recover_commit_trans(log,
+				error = xlog_recover_commit_trans(log, rhash,
 								trans, pass);
 				break;
 			case XLOG_UNMOUNT_TRANS:
@@ -1305,6 +1450,48 @@ xlog_recover_process_data(
 	return 0;
 }
 
+/* how many blocks the header of the record at rhead takes */
+STATIC int
+xlog_rec_hblks(
+	struct xlog		*log,
+	struct xlog_rec_header	*rhead)
+{
+	int			h_size = be32_to_cpu(rhead->h_size);
+
+	if (xfs_sb_version_haslogv2(&log->l_mp->m_sb) &&
+	    (be32_to_cpu(rhead->h_version) & XLOG_VERSION_2) &&
+	    h_size > XLOG_HEADER_CYCLE_SIZE)
+		return (h_size + XLOG_HEADER_CYCLE_SIZE - 1) /
+			XLOG_HEADER_CYCLE_SIZE;
+	return 1;
+}
+
+/*
+ * The CRC of a log record covers the header, the extended headers of a
+ * v2 log, and then the data, all as they were written: before the cycle
+ * numbers are put back into the data.
+ */
+STATIC __le32
+xlog_cksum(
+	struct xlog		*log,
+	struct xlog_rec_header	*rhead,
+	char			*dp,
+	int			size)
+{
+	xlog_in_core_2_t	*xhdr = (xlog_in_core_2_t *)rhead;
+	__uint32_t		crc;
+	int			hblks = xlog_rec_hblks(log, rhead);
+	int			i;
+
+	crc = xfs_start_cksum((char *)rhead, sizeof(struct xlog_rec_header),
+			      offsetof(struct xlog_rec_header, h_crc));
+	for (i = 1; i < hblks; i++)
+		crc = crc32c(crc, &xhdr[i].hic_xheader,
+			     sizeof(struct xlog_rec_ext_header));
+	crc = crc32c(crc, dp, size);
+	return xfs_end_cksum(crc);
+}
+
 /*
  * Upack the log buffer data and crc check it. If the check fails, issue a
  * warning if and only if the CRC in the header is non-zero. This makes the
@@ -1315,18 +1502,20 @@ xlog_recover_process_data(
  * When filesystems are CRC enabled, this CRC mismatch becomes a fatal log
  * corruption failure
  *
- * XXX: we do not calculate the CRC here yet. It's not clear what we should do
- * with CRC errors here in userspace, so we'll address that problem later on.
+ * checked is set when xlog_crc_prepass() has already found this record good.
  */
-#define xlog_cksum(l,r,dp,len)	((r)->h_crc)
 STATIC int
 xlog_unpack_data_crc(
 	struct xlog_rec_header	*rhead,
 	char			*dp,
-	struct xlog		*log)
+	struct xlog		*log,
+	int			checked)
 {
 	__le32			crc;
 
+	if (checked)
+		return 0;
+
 	crc = xlog_cksum(log, rhead, dp, be32_to_cpu(rhead->h_len));
 	if (crc != rhead->h_crc) {
 		if (rhead->h_crc || xfs_sb_version_hascrc(&log->l_mp->m_sb)) {
@@ -1353,12 +1542,13 @@ STATIC int
 xlog_unpack_data(
 	struct xlog_rec_header	*rhead,
 	char			*dp,
-	struct xlog		*log)
+	struct xlog		*log,
+	int			crc_checked)
 {
 	int			i, j, k;
 	int			error;
 
-	error = xlog_unpack_data_crc(rhead, dp, log);
+	error = xlog_unpack_data_crc(rhead, dp, log, crc_checked);
 	if (error)
 		return error;
 
@@ -1417,6 +1607,256 @@ xlog_valid_rec_header(
 	return 0;
 }
 
+/*
+ * Before a CRC enabled log is recovered, check the CRCs of all the records
+ * between the tail and the head on worker threads: the log is read in
+ * large chunks, split into records, and a chunk's records are checked
+ * while the next chunk is read.  A bad record is reported up front rather
+ * than after everything before it has been replayed, and the pass itself
+ * needn't compute the CRCs again.
+ */
+#define XLOG_CRC_CHUNK_BBS	16384	/* 8MiB reads */
+#define XLOG_CRC_MAX_RECS	4096	/* records a chunk is checked in */
+#define XLOG_CRC_THREADS	8
+
+struct xlog_crc_chunk {
+	struct xlog		*log;
+	struct xfs_buf		*bp;
+	char			*recs[XLOG_CRC_MAX_RECS];
+	int			bad[XLOG_CRC_MAX_RECS];
+	int			nrecs;
+	int			first;		/* number of recs[0] in the pass */
+	int			next;		/* next to check */
+	pthread_mutex_t		lock;
+	pthread_t		threads[XLOG_CRC_THREADS];
+	int			nthreads;
+	int			busy;
+};
+
+STATIC int
+xlog_crc_bad(
+	struct xlog		*log,
+	char			*rec)
+{
+	struct xlog_rec_header	*rhead = (struct xlog_rec_header *)rec;
+	char			*dp = rec + BBTOB(xlog_rec_hblks(log, rhead));
+
+	return xlog_cksum(log, rhead, dp, be32_to_cpu(rhead->h_len)) !=
+		rhead->h_crc;
+}
+
+STATIC void *
+xlog_crc_thread(
+	void			*arg)
+{
+	struct xlog_crc_chunk	*c = arg;
+	int			i;
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		i = c->next++;
+		pthread_mutex_unlock(&c->lock);
+		if (i >= c->nrecs)
+			break;
+		c->bad[i] = xlog_crc_bad(c->log, c->recs[i]);
+	}
+	return NULL;
+}
+
+STATIC void
+xlog_crc_start(
+	struct xlog_crc_chunk	*c,
+	int			nthreads)
+{
+	int			i;
+
+	c->next = 0;
+	c->busy = 1;
+	for (i = 0; i < min(nthreads, c->nrecs); i++)
+		if (pthread_create(&c->threads[i], NULL, xlog_crc_thread, c))
+			break;
+	c->nthreads = i;
+	if (!i)
+		xlog_crc_thread(c);
+}
+
+/* wait for a chunk's checks, and note the first bad record in it */
+STATIC void
+xlog_crc_finish(
+	struct xlog_crc_chunk	*c,
+	int			*first_bad)
+{
+	int			i;
+
+	if (!c->busy)
+		return;
+	for (i = 0; i < c->nthreads; i++)
+		pthread_join(c->threads[i], NULL);
+	c->busy = 0;
+	for (i = 0; i < c->nrecs; i++) {
+		if (c->bad[i]) {
+			*first_bad = min(*first_bad, c->first + i);
+			break;
+		}
+	}
+}
+
+/* a record that wraps around the end of the log, put back together */
+STATIC int
+xlog_crc_wrapped(
+	struct xlog		*log,
+	xfs_daddr_t		blk_no,
+	int			hblks,
+	int			*nblks,
+	int			*bad)
+{
+	struct xfs_buf		*bp;
+	xfs_daddr_t		b;
+	char			*rec;
+	char			*offset;
+	int			maxblks = hblks + BTOBB(XLOG_MAX_RECORD_BSIZE);
+	int			len;
+	int			i;
+	int			error = 0;
+
+	bp = xlog_get_bp(log, 1);
+	rec = malloc(BBTOB(maxblks));
+	if (!bp || !rec) {
+		error = ENOMEM;
+		goto out;
+	}
+	/* the header first, to find out how long the record is */
+	*nblks = hblks;
+	for (i = 0; i < *nblks; i++) {
+		b = (blk_no + i) % log->l_logBBsize;
+		error = xlog_bread(log, b, 1, bp, &offset);
+		if (error)
+			goto out;
+		memcpy(rec + BBTOB(i), offset, BBSIZE);
+		if (i == hblks - 1) {
+			error = xlog_valid_rec_header(log,
+					(struct xlog_rec_header *)rec, blk_no);
+			if (error)
+				goto out;
+			len = BTOBB(be32_to_cpu(
+				((struct xlog_rec_header *)rec)->h_len));
+			if (hblks + len > maxblks) {
+				error = XFS_ERROR(EFSCORRUPTED);
+				goto out;
+			}
+			*nblks = hblks + len;
+		}
+	}
+	*bad = xlog_crc_bad(log, rec);
+out:
+	free(rec);
+	if (bp)
+		xlog_put_bp(bp);
+	return error;
+}
+
+/*
+ * Returns how many records from the tail are known to have good CRCs.
+ * Anything that stops the check early just leaves the rest to the pass.
+ */
+STATIC int
+xlog_crc_prepass(
+	struct xlog		*log,
+	xfs_daddr_t		head_blk,
+	xfs_daddr_t		tail_blk,
+	int			hblks)
+{
+	struct xlog_crc_chunk	*chunks;
+	struct xlog_crc_chunk	*c;
+	struct xlog_rec_header	*rhead;
+	xfs_daddr_t		blk_no = tail_blk;
+	xfs_daddr_t		left;
+	char			*base;
+	int			first_bad = INT_MAX;
+	int			nrecs = 0;
+	int			nthreads;
+	int			chunkblks;
+	int			cur = 0;
+	int			len, off, rlen, bad;
+	int			i;
+
+	nthreads = min(sysconf(_SC_NPROCESSORS_ONLN), (long)XLOG_CRC_THREADS);
+	chunkblks = min(XLOG_CRC_CHUNK_BBS, log->l_logBBsize);
+	chunks = calloc(2, sizeof(*chunks));
+	if (!chunks)
+		return 0;
+	for (i = 0; i < 2; i++) {
+		chunks[i].log = log;
+		pthread_mutex_init(&chunks[i].lock, NULL);
+		chunks[i].bp = xlog_get_bp(log, chunkblks);
+		if (!chunks[i].bp)
+			goto out;
+	}
+
+	left = head_blk - tail_blk;
+	if (left < 0)
+		left += log->l_logBBsize;
+	while (left > 0 && first_bad == INT_MAX) {
+		c = &chunks[cur];
+		xlog_crc_finish(c, &first_bad);
+
+		len = min(min((xfs_daddr_t)chunkblks, left),
+			  log->l_logBBsize - blk_no);
+		if (xlog_bread(log, blk_no, len, c->bp, &base))
+			break;
+
+		c->first = nrecs;
+		c->nrecs = 0;
+		for (off = 0; off + hblks <= len &&
+			      c->nrecs < XLOG_CRC_MAX_RECS; off += rlen) {
+			rhead = (struct xlog_rec_header *)(base + BBTOB(off));
+			if (xlog_valid_rec_header(log, rhead, blk_no + off))
+				goto out_stop;
+			rlen = hblks + BTOBB(be32_to_cpu(rhead->h_len));
+			if (off + rlen > len)
+				break;
+			c->recs[c->nrecs++] = (char *)rhead;
+		}
+		if (c->nrecs) {
+			nrecs += c->nrecs;
+			xlog_crc_start(c, nthreads);
+			blk_no = (blk_no + off) % log->l_logBBsize;
+			left -= off;
+			cur ^= 1;
+			continue;
+		}
+
+		/* not even one record fit: it must wrap around the end */
+		if (blk_no + len != log->l_logBBsize)
+			break;
+		if (xlog_crc_wrapped(log, blk_no, hblks, &rlen, &bad) ||
+		    rlen > left)
+			break;
+		if (bad)
+			first_bad = nrecs;
+		nrecs++;
+		blk_no = (blk_no + rlen) % log->l_logBBsize;
+		left -= rlen;
+	}
+out_stop:
+	xlog_crc_finish(&chunks[cur ^ 1], &first_bad);
+	xlog_crc_finish(&chunks[cur], &first_bad);
+	if (first_bad != INT_MAX) {
+		xfs_warn(log->l_mp,
+	"log record %d from the tail has a bad CRC, recovery will stop there",
+			first_bad);
+		nrecs = first_bad;
+	}
+out:
+	for (i = 0; i < 2; i++) {
+		if (chunks[i].bp)
+			xlog_put_bp(chunks[i].bp);
+		pthread_mutex_destroy(&chunks[i].lock);
+	}
+	free(chunks);
+	return nrecs;
+}
+
 /*
  * Read the log from tail to head and process the log records found.
  * Handle the two cases where the tail and head are in the same cycle
@@ -1439,7 +1879,9 @@ xlog_do_recovery_pass(
 	int			error = 0, h_size;
 	int			bblks, split_bblks;
 	int			hblks, split_hblks, wrapped_hblks;
-	struct hlist_head	rhash[XLOG_RHASH_SIZE];
+	int			crc_good = 0;	/* records already checked */
+	int			nrecs = 0;
+	struct xlog_rhash	rhash;
 
 	ASSERT(head_blk != tail_blk);
 
@@ -1491,7 +1933,9 @@ xlog_do_recovery_pass(
 		return ENOMEM;
 	}
 
-	memset(rhash, 0, sizeof(rhash));
+	xlog_rhash_init(&rhash);
+	if (xfs_sb_version_hascrc(&log->l_mp->m_sb))
+		crc_good = xlog_crc_prepass(log, head_blk, tail_blk, hblks);
 	if (tail_blk <= head_blk) {
 		for (blk_no = tail_blk; blk_no < head_blk; ) {
 			error = xlog_bread(log, blk_no, hblks, hbp, &offset);
@@ -1510,12 +1954,13 @@ xlog_do_recovery_pass(
 			if (error)
 				goto bread_err2;
 
-			error = xlog_unpack_data(rhead, offset, log);
+			error = xlog_unpack_data(rhead, offset, log,
+						nrecs++ < crc_good);
 			if (error)
 				goto bread_err2;
 
 			error = xlog_recover_process_data(log,
-						rhash, rhead, offset, pass);
+						&rhash, rhead, offset, pass);
 			if (error)
 				goto bread_err2;
 			blk_no += bblks + hblks;
@@ -1627,11 +2072,12 @@ xlog_do_recovery_pass(
 					goto bread_err2;
 			}
 
-			error = xlog_unpack_data(rhead, offset, log);
+			error = xlog_unpack_data(rhead, offset, log,
+						nrecs++ < crc_good);
 			if (error)
 				goto bread_err2;
 
-			error = xlog_recover_process_data(log, rhash,
+			error = xlog_recover_process_data(log, &rhash,
 							rhead, offset, pass);
 			if (error)
 				goto bread_err2;
@@ -1658,11 +2104,12 @@ xlog_do_recovery_pass(
 			if (error)
 				goto bread_err2;
 
-			error = xlog_unpack_data(rhead, offset, log);
+			error = xlog_unpack_data(rhead, offset, log,
+						nrecs++ < crc_good);
 			if (error)
 				goto bread_err2;
 
-			error = xlog_recover_process_data(log, rhash,
+			error = xlog_recover_process_data(log, &rhash,
 							rhead, offset, pass);
 			if (error)
 				goto bread_err2;
@@ -1671,6 +2118,7 @@ xlog_do_recovery_pass(
 	}
 
  bread_err2:
+	xlog_rhash_free(&rhash);
 	xlog_put_bp(dbp);
  bread_err1:
 	xlog_put_bp(hbp);
@@ -21,54 +21,87 @@
 #include "logprint.h"
 
 /*
- * Extract a log and write it out to a file
+ * Extract a log and write it out to a file.  The log is read in large
+ * chunks, on print_threads threads at once (-T), and runs of zeroed
+ * blocks aren't written, so that a mostly empty log makes a sparse file.
+ * Each chunk goes to its own place in the file, so the threads can write
+ * in whatever order they finish.
  */
 
+struct log_copy {
+	int		ofd;
+	int		error;
+};
+
+static int
+is_zero_bb(
+	char		*p)
+{
+	return !p[0] && !memcmp(p, p + 1, BBSIZE - 1);
+}
+
+static void
+log_copy_run(
+	xfs_daddr_t	blkno,
+	char		*buf,
+	int		nbbs,
+	void		*arg)
+{
+	struct log_copy	*lcp = arg;
+	int		i, j;
+	ssize_t		r;
+
+	for (i = 0; i < nbbs; i = j) {
+		if (is_zero_bb(buf + BBTOB(i))) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < nbbs && !is_zero_bb(buf + BBTOB(j)); j++)
+			;
+		r = pwrite64(lcp->ofd, buf + BBTOB(i), BBTOB(j - i),
+			     BBTOB(blkno + i));
+		if (r < 0) {
+			fprintf(stderr, _("%s: write error (%lld): %s\n"),
+				__FUNCTION__, (long long)(blkno + i),
+				strerror(errno));
+			lcp->error = 1;
+			return;
+		} else if (r != BBTOB(j - i)) {
+			fprintf(stderr, _("%s: short write? (%lld)\n"),
+				__FUNCTION__, (long long)(blkno + i));
+			lcp->error = 1;
+			return;
+		}
+	}
+}
+
 void
 xfs_log_copy(
 	struct xlog	*log,
 	int		fd,
 	char		*filename)
 {
-	int		ofd, r;
-	xfs_daddr_t	blkno;
-	char		buf[XLOG_HEADER_SIZE];
+	struct log_copy	lc;
+	xfs_daddr_t	end;
 
-	if ((ofd = open(filename, O_CREAT|O_EXCL|O_RDWR|O_TRUNC, 0666)) == -1) {
+	if ((lc.ofd = open(filename, O_CREAT|O_EXCL|O_RDWR|O_TRUNC, 0666)) == -1) {
 		perror("open");
 		exit(1);
 	}
+	lc.error = 0;
 
-	xlog_print_lseek(log, fd, 0, SEEK_SET);
-	for (blkno = 0; blkno < log->l_logBBsize; blkno++) {
-		r = read(fd, buf, sizeof(buf));
-		if (r < 0) {
-			fprintf(stderr, _("%s: read error (%lld): %s\n"),
-				__FUNCTION__, (long long)blkno,
-				strerror(errno));
-			continue;
-		} else if (r == 0) {
-			printf(_("%s: physical end of log at %lld\n"),
-				__FUNCTION__, (long long)blkno);
-			break;
-		} else if (r != sizeof(buf)) {
-			fprintf(stderr, _("%s: short read? (%lld)\n"),
-					__FUNCTION__, (long long)blkno);
-			continue;
-		}
+	end = xlog_read_chunks(log, fd, xlog_print_path(), print_threads, 0,
+			       log_copy_run, &lc);
+	if (end < log->l_logBBsize)
+		printf(_("%s: physical end of log at %lld\n"),
+			__FUNCTION__, (long long)end);
 
-		r = write(ofd, buf, sizeof(buf));
-		if (r < 0) {
-			fprintf(stderr, _("%s: write error (%lld): %s\n"),
-				__FUNCTION__, (long long)blkno,
-				strerror(errno));
-			break;
-		} else if (r != sizeof(buf)) {
-			fprintf(stderr, _("%s: short write? (%lld)\n"),
-				__FUNCTION__, (long long)blkno);
-			continue;
-		}
+	/* the zeroes at the end weren't written either */
+	if (ftruncate64(lc.ofd, BBTOB(end)) < 0) {
+		fprintf(stderr, _("%s: cannot set size of %s: %s\n"),
+			__FUNCTION__, filename, strerror(errno));
+		lc.error = 1;
 	}
-
-	close(ofd);
+	if (close(lc.ofd) < 0 || lc.error)
+		exit(1);
 }
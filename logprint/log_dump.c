@@ -21,37 +21,27 @@
 #include "logprint.h"
 
 /*
- * Dump log blocks, not data
+ * Dump log blocks, not data.  The log is read in large chunks, with up to
+ * print_threads (-T) of them read ahead while one is dumped.
  */
 
-void
-xfs_log_dump(
-	struct xlog		*log,
-	int			fd,
-	int			print_block_start)
+struct log_dump {
+	uint		last_cycle;
+	xfs_daddr_t	dupblkno;
+};
+
+static void
+log_dump_run(
+	xfs_daddr_t		blkno,
+	char			*buf,
+	int			nbbs,
+	void			*arg)
 {
-	int			r;
-	uint			last_cycle = -1;
-	xfs_daddr_t		blkno, dupblkno;
+	struct log_dump		*ld = arg;
 	xlog_rec_header_t	*hdr;
-	char			buf[XLOG_HEADER_SIZE];
-
-	dupblkno = 0;
-	hdr = (xlog_rec_header_t *)buf;
-	xlog_print_lseek(log, fd, 0, SEEK_SET);
-	for (blkno = 0; blkno < log->l_logBBsize; blkno++) {
-		r = read(fd, buf, sizeof(buf));
-		if (r < 0) {
-			fprintf(stderr, _("%s: read error (%lld): %s\n"),
-				__FUNCTION__, (long long)blkno,
-				strerror(errno));
-			continue;
-		} else if (r == 0) {
-			printf(_("%s: physical end of log at %lld\n"),
-				__FUNCTION__, (long long)blkno);
-			break;
-		}
 
+	for (; nbbs > 0; nbbs--, blkno++, buf += BBSIZE) {
+		hdr = (xlog_rec_header_t *)buf;
 		if (CYCLE_LSN(be64_to_cpu(*(__be64 *)buf)) ==
 				XLOG_HEADER_MAGIC_NUM && !print_no_data) {
 			printf(_(
@@ -64,13 +54,31 @@ xfs_log_dump(
 				be32_to_cpu(hdr->h_num_logops));
 		}
 
-		if (xlog_get_cycle(buf) != last_cycle) {
+		if (xlog_get_cycle(buf) != ld->last_cycle) {
 			printf(_(
 		"[%05lld - %05lld] Cycle 0x%08x New Cycle 0x%08x\n"),
-				(long long)dupblkno, (long long)blkno,
-				last_cycle, xlog_get_cycle(buf));
-			last_cycle = xlog_get_cycle(buf);
-			dupblkno = blkno;
+				(long long)ld->dupblkno, (long long)blkno,
+				ld->last_cycle, xlog_get_cycle(buf));
+			ld->last_cycle = xlog_get_cycle(buf);
+			ld->dupblkno = blkno;
 		}
 	}
 }
+
+void
+xfs_log_dump(
+	struct xlog		*log,
+	int			fd,
+	int			print_block_start)
+{
+	struct log_dump		ld;
+	xfs_daddr_t		end;
+
+	ld.last_cycle = -1;
+	ld.dupblkno = 0;
+	end = xlog_read_chunks(log, fd, xlog_print_path(), print_threads, 1,
+			       log_dump_run, &ld);
+	if (end < log->l_logBBsize)
+		printf(_("%s: physical end of log at %lld\n"),
+			__FUNCTION__, (long long)end);
+}
@@ -77,12 +77,57 @@ char *trans_type[] = {
 
 typedef struct xlog_split_item {
 	struct xlog_split_item	*si_next;
-	struct xlog_split_item	*si_prev;
 	xlog_tid_t		si_xtid;
 	int			si_skip;
 } xlog_split_item_t;
 
-xlog_split_item_t *split_list = NULL;
+/*
+ * Transactions with ops split across log records, hashed by tid.  The
+ * table doubles once it averages two transactions a bucket, so busy logs
+ * don't turn every op header into a walk of all the open transactions.
+ */
+#define SPLIT_HASH_BITS		4
+
+static xlog_split_item_t	**split_hash;
+static unsigned int		split_bits;
+static unsigned int		split_count;
+
+static inline unsigned int
+split_bucket(
+	xlog_tid_t		tid,
+	unsigned int		bits)
+{
+	return ((__uint32_t)tid * 0x9e370001U) >> (32 - bits);
+}
+
+static void
+split_grow(void)
+{
+	xlog_split_item_t	**old = split_hash;
+	xlog_split_item_t	**new;
+	xlog_split_item_t	*item;
+	unsigned int		bits = split_bits ? split_bits + 1 :
+						    SPLIT_HASH_BITS;
+	unsigned int		i;
+
+	new = calloc(1U << bits, sizeof(xlog_split_item_t *));
+	if (!new) {
+		if (old)
+			return;		/* keep going with longer chains */
+		fprintf(stderr, _("%s: out of memory\n"), progname);
+		exit(1);
+	}
+	for (i = 0; old && i < (1U << split_bits); i++) {
+		while ((item = old[i]) != NULL) {
+			old[i] = item->si_next;
+			item->si_next = new[split_bucket(item->si_xtid, bits)];
+			new[split_bucket(item->si_xtid, bits)] = item;
+		}
+	}
+	free(old);
+	split_hash = new;
+	split_bits = bits;
+}
 
 void
 print_xlog_op_line(void)
@@ -101,7 +146,7 @@ print_xlog_xhdr_line(void)
 void
 print_xlog_record_line(void)
 {
-    printf("======================================"
+    fprintf(logout, "======================================"
 	   "======================================\n");
 }	/* print_xlog_record_line */
 
@@ -161,47 +206,44 @@ xlog_print_add_to_trans(xlog_tid_t	tid,
 			int		skip)
 {
     xlog_split_item_t *item;
+    xlog_split_item_t **head;
 
+    if (!split_hash || split_count >= (2U << split_bits))
+	split_grow();
     item	  = (xlog_split_item_t *)calloc(sizeof(xlog_split_item_t), 1);
     item->si_xtid  = tid;
     item->si_skip = skip;
-    item->si_next = split_list;
-    item->si_prev = NULL;
-    if (split_list)
-	split_list->si_prev = item;
-    split_list	  = item;
+    head	  = &split_hash[split_bucket(tid, split_bits)];
+    item->si_next = *head;
+    *head	  = item;
+    split_count++;
 }	/* xlog_print_add_to_trans */
 
 
 int
 xlog_print_find_tid(xlog_tid_t tid, uint was_cont)
 {
-    xlog_split_item_t *listp = split_list;
+    xlog_split_item_t **prevp;
+    xlog_split_item_t *listp;
 
-    if (!split_list) {
+    if (!split_count) {
 	if (was_cont != 0)	/* Not first time we have used this tid */
 	    return 1;
 	else
 	    return 0;
     }
-    while (listp) {
+    prevp = &split_hash[split_bucket(tid, split_bits)];
+    while ((listp = *prevp) != NULL) {
 	if (listp->si_xtid == tid)
 	    break;
-	listp = listp->si_next;
+	prevp = &listp->si_next;
     }
     if (!listp)  {
 	return 0;
     }
     if (--listp->si_skip == 0) {
-	if (listp == split_list) {		/* delete at head */
-	    split_list = listp->si_next;
-	    if (split_list)
-		split_list->si_prev = NULL;
-	} else {
-	    if (listp->si_next)
-		listp->si_next->si_prev = listp->si_prev;
-	    listp->si_prev->si_next = listp->si_next;
-	}
+	*prevp = listp->si_next;
+	split_count--;
 	free(listp);
     }
     return 1;
@@ -867,23 +909,279 @@ xlog_print_trans_icreate(
  ******************************************************************************
  */
 
+/*
+ * The log is read through a large window rather than with a read() per
+ * 512 byte header and another per record, so that printing a big log
+ * runs at the device's streaming rate.  xlog_print_lseek() sets where
+ * xlog_print_read() reads from next.
+ */
+#define LOG_READ_SIZE	(4 * 1024 * 1024)
+
+static struct {
+	int		fd;
+	char		*buf;
+	xfs_off_t	start;		/* offset of buf[0] */
+	ssize_t		len;		/* valid bytes in buf */
+	xfs_off_t	pos;		/* where the next read starts */
+} logrd = { .fd = -1 };
+
+ssize_t
+xlog_print_read(int fd, void *buf, size_t len)
+{
+	char		*p = buf;
+	size_t		done = 0;
+	ssize_t		n;
+
+	if (fd != logrd.fd) {
+		logrd.fd = fd;
+		logrd.len = 0;
+		logrd.pos = lseek64(fd, 0, SEEK_CUR);
+	}
+	if (!logrd.buf && (logrd.buf = malloc(LOG_READ_SIZE)) == NULL) {
+		fprintf(stderr, _("%s: cannot allocate log read buffer\n"),
+			progname);
+		exit(1);
+	}
+	while (done < len) {
+		if (logrd.pos < logrd.start ||
+		    logrd.pos >= logrd.start + logrd.len) {
+			logrd.start = logrd.pos;
+			logrd.len = pread64(fd, logrd.buf, LOG_READ_SIZE,
+					    logrd.start);
+			if (logrd.len < 0) {
+				/* don't fail the whole window for one bad spot */
+				logrd.len = 0;
+				n = pread64(fd, p + done, len - done,
+					    logrd.pos);
+				if (n <= 0)
+					return done ? done : n;
+				logrd.pos += n;
+				done += n;
+				continue;
+			}
+			if (logrd.len == 0)
+				break;
+		}
+		n = min((xfs_off_t)(len - done),
+			logrd.start + logrd.len - logrd.pos);
+		memcpy(p + done, logrd.buf + (logrd.pos - logrd.start), n);
+		logrd.pos += n;
+		done += n;
+	}
+	return done;
+}
+
+#define BBTOOFF64(bbs)	(((xfs_off_t)(bbs)) << BBSHIFT)
+
 void
 xlog_print_lseek(struct xlog *log, int fd, xfs_daddr_t blkno, int whence)
 {
-#define BBTOOFF64(bbs)	(((xfs_off_t)(bbs)) << BBSHIFT)
-	xfs_off_t offset;
+	xfs_off_t offset, pos;
 
 	if (whence == SEEK_SET)
 		offset = BBTOOFF64(blkno+log->l_logBBstart);
 	else
 		offset = BBTOOFF64(blkno);
-	if (lseek64(fd, offset, whence) < 0) {
+	if ((pos = lseek64(fd, offset, whence)) < 0) {
 		fprintf(stderr, _("%s: lseek64 to %lld failed: %s\n"),
 			progname, (long long)offset, strerror(errno));
 		exit(1);
 	}
+	if (fd != logrd.fd) {
+		logrd.fd = fd;
+		logrd.len = 0;
+	}
+	logrd.pos = pos;
 }	/* xlog_print_lseek */
 
+/*
+ * Copying or dumping the whole log goes through xlog_read_chunks(), which
+ * reads it in large chunks, with direct I/O when the device takes it, on
+ * up to nthreads threads at once.  Each chunk is handed to fn as runs of
+ * blocks that could be read: a chunk that fails to read as a whole is
+ * read again a sector at a time, and the sectors that still fail are
+ * reported and left out.  With ordered set, fn sees the runs in log
+ * order and the other threads only read ahead; without it, fn is called
+ * from several threads at once, in any order.  Returns the block the log
+ * ends at, which is short of its size if the device or file is.
+ */
+#define LOG_CHUNK_SIZE	(16 * 1024 * 1024)
+#define LOG_CHUNK_BBS	(LOG_CHUNK_SIZE >> BBSHIFT)
+
+struct log_chunks {
+	struct xlog	*log;
+	int		fd;
+	int		dfd;		/* O_DIRECT, or -1 */
+	int		ordered;
+	xlog_chunk_fn_t	fn;
+	void		*arg;
+	xfs_daddr_t	next;		/* next chunk to read */
+	xfs_daddr_t	turn;		/* next chunk for fn, if ordered */
+	xfs_daddr_t	end;		/* physical end of the log */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+};
+
+/* read len bytes at off, stopping early only at the end of the file */
+static ssize_t
+log_chunk_pread(
+	struct log_chunks	*lc,
+	char			*buf,
+	size_t			len,
+	xfs_off_t		off)
+{
+	size_t			done = 0;
+	ssize_t			n;
+	int			dfd;
+
+	while (done < len) {
+		dfd = lc->dfd;
+		if (dfd >= 0) {
+			n = pread64(dfd, buf + done, len - done, off + done);
+			/* direct I/O refuses unaligned ends, go buffered */
+			if (n < 0 && errno == EINVAL) {
+				lc->dfd = -1;
+				continue;
+			}
+		} else {
+			n = pread64(lc->fd, buf + done, len - done,
+				    off + done);
+		}
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static void *
+log_chunk_thread(
+	void			*arg)
+{
+	struct log_chunks	*lc = arg;
+	xfs_daddr_t		chunk, start, end, blkno, run;
+	xfs_off_t		off;
+	ssize_t			n;
+	char			*buf;
+	char			*bad;	/* sectors that couldn't be read */
+	int			i;
+
+	buf = memalign(getpagesize(), LOG_CHUNK_SIZE);
+	bad = malloc(LOG_CHUNK_BBS);
+	if (!buf || !bad) {
+		fprintf(stderr, _("%s: cannot allocate log read buffer\n"),
+			progname);
+		exit(1);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&lc->lock);
+		chunk = lc->next++;
+		end = lc->end;
+		pthread_mutex_unlock(&lc->lock);
+		start = chunk * LOG_CHUNK_BBS;
+		if (start >= end)
+			break;
+		end = min(end, start + LOG_CHUNK_BBS);
+
+		off = BBTOOFF64(start + lc->log->l_logBBstart);
+		n = log_chunk_pread(lc, buf, BBTOB(end - start), off);
+		if (n >= 0) {
+			end = start + (n >> BBSHIFT);
+			memset(bad, 0, end - start);
+		} else {
+			for (blkno = start; blkno < end; blkno++) {
+				i = blkno - start;
+				n = pread64(lc->fd, buf + BBTOB(i), BBSIZE,
+					    off + BBTOB(i));
+				if (n == 0)
+					break;
+				bad[i] = n != BBSIZE;
+				if (bad[i])
+					fprintf(stderr,
+				_("%s: read error (%lld): %s\n"),
+						progname, (long long)blkno,
+						n < 0 ? strerror(errno) :
+							_("short read"));
+			}
+			end = blkno;
+		}
+
+		pthread_mutex_lock(&lc->lock);
+		while (lc->ordered && lc->turn != chunk)
+			pthread_cond_wait(&lc->cond, &lc->lock);
+		pthread_mutex_unlock(&lc->lock);
+
+		for (blkno = start; blkno < end; blkno = run) {
+			run = blkno + 1;
+			if (bad[blkno - start])
+				continue;
+			while (run < end && !bad[run - start])
+				run++;
+			lc->fn(blkno, buf + BBTOB(blkno - start), run - blkno,
+				lc->arg);
+		}
+
+		pthread_mutex_lock(&lc->lock);
+		if (end < start + LOG_CHUNK_BBS && end < lc->end)
+			lc->end = end;
+		lc->turn++;
+		pthread_cond_broadcast(&lc->cond);
+		pthread_mutex_unlock(&lc->lock);
+	}
+
+	free(bad);
+	free(buf);
+	return NULL;
+}
+
+xfs_daddr_t
+xlog_read_chunks(
+	struct xlog		*log,
+	int			fd,
+	char			*path,
+	int			nthreads,
+	int			ordered,
+	xlog_chunk_fn_t		fn,
+	void			*arg)
+{
+	struct log_chunks	lc;
+	pthread_t		*tids;
+	int			i;
+
+	memset(&lc, 0, sizeof(lc));
+	lc.log = log;
+	lc.fd = fd;
+	lc.dfd = path ? open(path, O_RDONLY | O_DIRECT) : -1;
+	lc.ordered = ordered;
+	lc.fn = fn;
+	lc.arg = arg;
+	lc.end = log->l_logBBsize;
+	pthread_mutex_init(&lc.lock, NULL);
+	pthread_cond_init(&lc.cond, NULL);
+
+	nthreads = min(nthreads, (int)((log->l_logBBsize + LOG_CHUNK_BBS - 1) /
+					LOG_CHUNK_BBS));
+	nthreads = max(nthreads, 1);
+	tids = calloc(nthreads, sizeof(*tids));
+	for (i = 0; tids && i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, log_chunk_thread, &lc))
+			break;
+	if (!i)
+		log_chunk_thread(&lc);
+	while (i-- > 0)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	if (lc.dfd >= 0)
+		close(lc.dfd);
+	pthread_mutex_destroy(&lc.lock);
+	pthread_cond_destroy(&lc.cond);
+	return lc.end;
+}
+
 
 void
 print_lsn(char		*string,
@@ -932,7 +1230,7 @@ xlog_print_record(
 	buf = (char *)((intptr_t)(*partial_buf) + (intptr_t)(*read_type));
 	ptr = *partial_buf;
     }
-    if ((ret = (int) read(fd, buf, read_len)) == -1) {
+    if ((ret = (int) xlog_print_read(fd, buf, read_len)) == -1) {
 	fprintf(stderr, _("%s: xlog_print_record: read error\n"), progname);
 	exit(1);
     }
@@ -1306,7 +1604,7 @@ xlog_print_extended_headers(
 	/* don't include 1st header */
 	for (i = 1, x = *ret_xhdrs; i < num_hdrs; i++, (*blkno)++, x++) {
 	    /* read one extra header blk */
-	    if (read(fd, xhbuf, 512) == 0) {
+	    if (xlog_print_read(fd, xhbuf, 512) == 0) {
 		printf(_("%s: physical end of log\n"), progname);
 		print_xlog_record_line();
 		/* reached the end so return 1 */
@@ -1382,7 +1680,7 @@ void xfs_log_print(struct xlog  *log,
     blkno = block_start;
 
     for (;;) {
-	if (read(fd, hbuf, 512) == 0) {
+	if (xlog_print_read(fd, hbuf, 512) == 0) {
 	    printf(_("%s: physical end of log\n"), progname);
 	    print_xlog_record_line();
 	    break;
@@ -1502,7 +1800,7 @@ loop:
 	blkno = 0;
 	xlog_print_lseek(log, fd, 0, SEEK_SET);
 	for (;;) {
-	    if (read(fd, hbuf, 512) == 0) {
+	    if (xlog_print_read(fd, hbuf, 512) == 0) {
 		xlog_panic(_("xlog_find_head: bad read"));
 	    }
 	    if (print_only_data) {
@@ -67,14 +67,14 @@ xlog_recover_print_data(
 
 		while (j < nums) {
 			if ((j % 8) == 0)
-				printf("%2x ", j);
-			printf("%8x ", *dp);
+				fprintf(logout, "%2x ", j);
+			fprintf(logout, "%8x ", *dp);
 			dp++;
 			j++;
 			if ((j % 8) == 0)
-				printf("\n");
+				fprintf(logout, "\n");
 		}
-		printf("\n");
+		fprintf(logout, "\n");
 	}
 }
 
@@ -91,9 +91,9 @@ xlog_recover_print_buffer(
 	xfs_disk_dquot_t	*ddq;
 
 	f = (xfs_buf_log_format_t *)item->ri_buf[0].i_addr;
-	printf("	");
+	fprintf(logout, "	");
 	ASSERT(f->blf_type == XFS_LI_BUF);
-	printf(_("BUF:  #regs:%d   start blkno:0x%llx   len:%d   bmap size:%d   flags:0x%x\n"),
+	fprintf(logout, _("BUF:  #regs:%d   start blkno:0x%llx   len:%d   bmap size:%d   flags:0x%x\n"),
 		f->blf_size, (long long)f->blf_blkno, f->blf_len, f->blf_map_size, f->blf_flags);
 	blkno = (xfs_daddr_t)f->blf_blkno;
 	num = f->blf_size-1;
@@ -103,36 +103,36 @@ xlog_recover_print_buffer(
 		len = item->ri_buf[i].i_len;
 		i++;
 		if (blkno == 0) { /* super block */
-			printf(_("	SUPER Block Buffer:\n"));
+			fprintf(logout, _("	SUPER Block Buffer:\n"));
 			if (!print_buffer) 
 				continue;
-		       printf(_("              icount:%llu ifree:%llu  "),
+		       fprintf(logout, _("              icount:%llu ifree:%llu  "),
 			       (unsigned long long)
 				       be64_to_cpu(*(__be64 *)(p)),
 			       (unsigned long long)
 				       be64_to_cpu(*(__be64 *)(p+8)));
-		       printf(_("fdblks:%llu  frext:%llu\n"),
+		       fprintf(logout, _("fdblks:%llu  frext:%llu\n"),
 			       (unsigned long long)
 				       be64_to_cpu(*(__be64 *)(p+16)),
 			       (unsigned long long)
 				       be64_to_cpu(*(__be64 *)(p+24)));
-			printf(_("		sunit:%u  swidth:%u\n"),
+			fprintf(logout, _("		sunit:%u  swidth:%u\n"),
 			       be32_to_cpu(*(__be32 *)(p+56)),
 			       be32_to_cpu(*(__be32 *)(p+60)));
 		} else if (be32_to_cpu(*(__be32 *)p) == XFS_AGI_MAGIC) {
 			int bucket, buckets;
 			agi = (xfs_agi_t *)p;
-			printf(_("	AGI Buffer: (XAGI)\n"));
+			fprintf(logout, _("	AGI Buffer: (XAGI)\n"));
 			if (!print_buffer) 
 				continue;
-			printf(_("		ver:%d  "),
+			fprintf(logout, _("		ver:%d  "),
 				be32_to_cpu(agi->agi_versionnum));
-			printf(_("seq#:%d  len:%d  cnt:%d  root:%d\n"),
+			fprintf(logout, _("seq#:%d  len:%d  cnt:%d  root:%d\n"),
 				be32_to_cpu(agi->agi_seqno),
 				be32_to_cpu(agi->agi_length),
 				be32_to_cpu(agi->agi_count),
 				be32_to_cpu(agi->agi_root));
-			printf(_("		level:%d  free#:0x%x  newino:0x%x\n"),
+			fprintf(logout, _("		level:%d  free#:0x%x  newino:0x%x\n"),
 				be32_to_cpu(agi->agi_level),
 				be32_to_cpu(agi->agi_freecount),
 				be32_to_cpu(agi->agi_newino));
@@ -145,31 +145,31 @@ xlog_recover_print_buffer(
 			}
 			for (bucket = 0; bucket < buckets;) {
 				int col;
-				printf(_("bucket[%d - %d]: "), bucket, bucket+3);
+				fprintf(logout, _("bucket[%d - %d]: "), bucket, bucket+3);
 				for (col = 0; col < 4; col++, bucket++) {
 					if (bucket < buckets) {
-						printf("0x%x ",
+						fprintf(logout, "0x%x ",
 			be32_to_cpu(agi->agi_unlinked[bucket]));
 					}
 				}
-				printf("\n");
+				fprintf(logout, "\n");
 			}
 		} else if (be32_to_cpu(*(__be32 *)p) == XFS_AGF_MAGIC) {
 			agf = (xfs_agf_t *)p;
-			printf(_("	AGF Buffer: (XAGF)\n"));
+			fprintf(logout, _("	AGF Buffer: (XAGF)\n"));
 			if (!print_buffer) 
 				continue;
-			printf(_("		ver:%d  seq#:%d  len:%d  \n"),
+			fprintf(logout, _("		ver:%d  seq#:%d  len:%d  \n"),
 				be32_to_cpu(agf->agf_versionnum),
 				be32_to_cpu(agf->agf_seqno),
 				be32_to_cpu(agf->agf_length));
-			printf(_("		root BNO:%d  CNT:%d\n"),
+			fprintf(logout, _("		root BNO:%d  CNT:%d\n"),
 				be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNOi]),
 				be32_to_cpu(agf->agf_roots[XFS_BTNUM_CNTi]));
-			printf(_("		level BNO:%d  CNT:%d\n"),
+			fprintf(logout, _("		level BNO:%d  CNT:%d\n"),
 				be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNOi]),
 				be32_to_cpu(agf->agf_levels[XFS_BTNUM_CNTi]));
-			printf(_("		1st:%d  last:%d  cnt:%d  "
+			fprintf(logout, _("		1st:%d  last:%d  cnt:%d  "
 				"freeblks:%d  longest:%d\n"),
 				be32_to_cpu(agf->agf_flfirst),
 				be32_to_cpu(agf->agf_fllast),
@@ -178,15 +178,15 @@ xlog_recover_print_buffer(
 				be32_to_cpu(agf->agf_longest));
 		} else if (*(uint *)p == XFS_DQUOT_MAGIC) {
 			ddq = (xfs_disk_dquot_t *)p;
-			printf(_("	DQUOT Buffer:\n"));
+			fprintf(logout, _("	DQUOT Buffer:\n"));
 			if (!print_buffer) 
 				continue;
-			printf(_("		UIDs 0x%lx-0x%lx\n"),
+			fprintf(logout, _("		UIDs 0x%lx-0x%lx\n"),
 			       (unsigned long)be32_to_cpu(ddq->d_id),
 			       (unsigned long)be32_to_cpu(ddq->d_id) +
 			       (BBTOB(f->blf_len) / sizeof(xfs_dqblk_t)) - 1);
 		} else {
-			printf(_("	BUF DATA\n"));
+			fprintf(logout, _("	BUF DATA\n"));
 			if (!print_buffer) continue;
 			xlog_recover_print_data(p, len);
 		}
@@ -208,7 +208,7 @@ xlog_recover_print_quotaoff(
 		strcat(str, "GROUP QUOTA");
 	if (qoff_f->qf_flags & XFS_PQUOTA_ACCT)
 		strcat(str, "PROJECT QUOTA");
-	printf(_("\tQUOTAOFF: #regs:%d   type:%s\n"),
+	fprintf(logout, _("\tQUOTAOFF: #regs:%d   type:%s\n"),
 	       qoff_f->qf_size, str);
 }
 
@@ -223,27 +223,27 @@ xlog_recover_print_dquot(
 	ASSERT(f);
 	ASSERT(f->qlf_len == 1);
 	d = (xfs_disk_dquot_t *)item->ri_buf[1].i_addr;
-	printf(_("\tDQUOT: #regs:%d  blkno:%lld  boffset:%u id: %d\n"),
+	fprintf(logout, _("\tDQUOT: #regs:%d  blkno:%lld  boffset:%u id: %d\n"),
 	       f->qlf_size, (long long)f->qlf_blkno, f->qlf_boffset, f->qlf_id);
 	if (!print_quota)
 		return;
-	printf(_("\t\tmagic 0x%x\tversion 0x%x\tID 0x%x (%d)\t\n"),
+	fprintf(logout, _("\t\tmagic 0x%x\tversion 0x%x\tID 0x%x (%d)\t\n"),
 	       be16_to_cpu(d->d_magic),
 	       d->d_version,
 	       be32_to_cpu(d->d_id),
 	       be32_to_cpu(d->d_id));
-	printf(_("\t\tblk_hard 0x%x\tblk_soft 0x%x\tino_hard 0x%x"
+	fprintf(logout, _("\t\tblk_hard 0x%x\tblk_soft 0x%x\tino_hard 0x%x"
 	       "\tino_soft 0x%x\n"),
 	       (int)be64_to_cpu(d->d_blk_hardlimit),
 	       (int)be64_to_cpu(d->d_blk_softlimit),
 	       (int)be64_to_cpu(d->d_ino_hardlimit),
 	       (int)be64_to_cpu(d->d_ino_softlimit));
-	printf(_("\t\tbcount 0x%x (%d) icount 0x%x (%d)\n"),
+	fprintf(logout, _("\t\tbcount 0x%x (%d) icount 0x%x (%d)\n"),
 	       (int)be64_to_cpu(d->d_bcount),
 	       (int)be64_to_cpu(d->d_bcount),
 	       (int)be64_to_cpu(d->d_icount),
 	       (int)be64_to_cpu(d->d_icount));
-	printf(_("\t\tbtimer 0x%x itimer 0x%x \n"),
+	fprintf(logout, _("\t\tbtimer 0x%x itimer 0x%x \n"),
 	       (int)be32_to_cpu(d->d_btimer),
 	       (int)be32_to_cpu(d->d_itimer));
 }
@@ -252,23 +252,23 @@ STATIC void
 xlog_recover_print_inode_core(
 	xfs_icdinode_t		*di)
 {
-	printf(_("	CORE inode:\n"));
+	fprintf(logout, _("	CORE inode:\n"));
 	if (!print_inode)
 		return;
-	printf(_("		magic:%c%c  mode:0x%x  ver:%d  format:%d  "
+	fprintf(logout, _("		magic:%c%c  mode:0x%x  ver:%d  format:%d  "
 	     "onlink:%d\n"),
 	       (di->di_magic>>8) & 0xff, di->di_magic & 0xff,
 	       di->di_mode, di->di_version, di->di_format, di->di_onlink);
-	printf(_("		uid:%d  gid:%d  nlink:%d projid:%u\n"),
+	fprintf(logout, _("		uid:%d  gid:%d  nlink:%d projid:%u\n"),
 	       di->di_uid, di->di_gid, di->di_nlink, xfs_get_projid(di));
-	printf(_("		atime:%d  mtime:%d  ctime:%d\n"),
+	fprintf(logout, _("		atime:%d  mtime:%d  ctime:%d\n"),
 	       di->di_atime.t_sec, di->di_mtime.t_sec, di->di_ctime.t_sec);
-	printf(_("		flushiter:%d\n"), di->di_flushiter);
-	printf(_("		size:0x%llx  nblks:0x%llx  exsize:%d  "
+	fprintf(logout, _("		flushiter:%d\n"), di->di_flushiter);
+	fprintf(logout, _("		size:0x%llx  nblks:0x%llx  exsize:%d  "
 	     "nextents:%d  anextents:%d\n"), (unsigned long long)
 	       di->di_size, (unsigned long long)di->di_nblocks,
 	       di->di_extsize, di->di_nextents, (int)di->di_anextents);
-	printf(_("		forkoff:%d  dmevmask:0x%x  dmstate:%d  flags:0x%x  "
+	fprintf(logout, _("		forkoff:%d  dmevmask:0x%x  dmstate:%d  flags:0x%x  "
 	     "gen:%d\n"),
 	       (int)di->di_forkoff, di->di_dmevmask, (int)di->di_dmstate,
 	       (int)di->di_flags, di->di_gen);
@@ -288,7 +288,7 @@ xlog_recover_print_inode(
 	       item->ri_buf[0].i_len == sizeof(xfs_inode_log_format_64_t));
 	f = xfs_inode_item_format_convert(item->ri_buf[0].i_addr, item->ri_buf[0].i_len, &f_buf);
 
-	printf(_("	INODE: #regs:%d   ino:0x%llx  flags:0x%x   dsize:%d\n"),
+	fprintf(logout, _("	INODE: #regs:%d   ino:0x%llx  flags:0x%x   dsize:%d\n"),
 	       f->ilf_size, (unsigned long long)f->ilf_ino, f->ilf_fields,
 	       f->ilf_dsize);
 
@@ -304,32 +304,32 @@ xlog_recover_print_inode(
 	switch (f->ilf_fields & (XFS_ILOG_DFORK|XFS_ILOG_DEV|XFS_ILOG_UUID)) {
 	case XFS_ILOG_DEXT:
 		ASSERT(f->ilf_size == 3 + hasattr);
-		printf(_("		DATA FORK EXTENTS inode data:\n"));
+		fprintf(logout, _("		DATA FORK EXTENTS inode data:\n"));
 		if (print_inode && print_data)
 			xlog_recover_print_data(item->ri_buf[2].i_addr,
 						item->ri_buf[2].i_len);
 		break;
 	case XFS_ILOG_DBROOT:
 		ASSERT(f->ilf_size == 3 + hasattr);
-		printf(_("		DATA FORK BTREE inode data:\n"));
+		fprintf(logout, _("		DATA FORK BTREE inode data:\n"));
 		if (print_inode && print_data)
 			xlog_recover_print_data(item->ri_buf[2].i_addr,
 						item->ri_buf[2].i_len);
 		break;
 	case XFS_ILOG_DDATA:
 		ASSERT(f->ilf_size == 3 + hasattr);
-		printf(_("		DATA FORK LOCAL inode data:\n"));
+		fprintf(logout, _("		DATA FORK LOCAL inode data:\n"));
 		if (print_inode && print_data)
 			xlog_recover_print_data(item->ri_buf[2].i_addr,
 						item->ri_buf[2].i_len);
 		break;
 	case XFS_ILOG_DEV:
 		ASSERT(f->ilf_size == 2 + hasattr);
-		printf(_("		DEV inode: no extra region\n"));
+		fprintf(logout, _("		DEV inode: no extra region\n"));
 		break;
 	case XFS_ILOG_UUID:
 		ASSERT(f->ilf_size == 2 + hasattr);
-		printf(_("		UUID inode: no extra region\n"));
+		fprintf(logout, _("		UUID inode: no extra region\n"));
 		break;
 
 	case 0:
@@ -344,7 +344,7 @@ xlog_recover_print_inode(
 		switch (f->ilf_fields & XFS_ILOG_AFORK) {
 		case XFS_ILOG_AEXT:
 			ASSERT(f->ilf_size == 3 + hasdata);
-			printf(_("		ATTR FORK EXTENTS inode data:\n"));
+			fprintf(logout, _("		ATTR FORK EXTENTS inode data:\n"));
 			if (print_inode && print_data)
 				xlog_recover_print_data(
 					item->ri_buf[attr_index].i_addr,
@@ -352,7 +352,7 @@ xlog_recover_print_inode(
 			break;
 		case XFS_ILOG_ABROOT:
 			ASSERT(f->ilf_size == 3 + hasdata);
-			printf(_("		ATTR FORK BTREE inode data:\n"));
+			fprintf(logout, _("		ATTR FORK BTREE inode data:\n"));
 			if (print_inode && print_data)
 				xlog_recover_print_data(
 					item->ri_buf[attr_index].i_addr,
@@ -360,7 +360,7 @@ xlog_recover_print_inode(
 			break;
 		case XFS_ILOG_ADATA:
 			ASSERT(f->ilf_size == 3 + hasdata);
-			printf(_("		ATTR FORK LOCAL inode data:\n"));
+			fprintf(logout, _("		ATTR FORK LOCAL inode data:\n"));
 			if (print_inode && print_data)
 				xlog_recover_print_data(
 					item->ri_buf[attr_index].i_addr,
@@ -385,7 +385,7 @@ xlog_recover_print_efd(
 	 * Each element is of size xfs_extent_32_t or xfs_extent_64_t.
 	 * However, the extents are never used and won't be printed.
 	 */
-	printf(_("	EFD:  #regs: %d    num_extents: %d  id: 0x%llx\n"),
+	fprintf(logout, _("	EFD:  #regs: %d    num_extents: %d  id: 0x%llx\n"),
 	       f->efd_size, f->efd_nextents, (unsigned long long)f->efd_efi_id);
 }
 
@@ -417,19 +417,19 @@ xlog_recover_print_efi(
 	    return;
 	}
 
-	printf(_("	EFI:  #regs:%d    num_extents:%d  id:0x%llx\n"),
+	fprintf(logout, _("	EFI:  #regs:%d    num_extents:%d  id:0x%llx\n"),
 	       f->efi_size, f->efi_nextents, (unsigned long long)f->efi_id);
 	ex = f->efi_extents;
-	printf("	");
+	fprintf(logout, "	");
 	for (i=0; i< f->efi_nextents; i++) {
-		printf("(s: 0x%llx, l: %d) ",
+		fprintf(logout, "(s: 0x%llx, l: %d) ",
 			(unsigned long long)ex->ext_start, ex->ext_len);
 		if (i % 4 == 3)
-			printf("\n");
+			fprintf(logout, "\n");
 		ex++;
 	}
 	if (i % 4 != 0)
-		printf("\n");
+		fprintf(logout, "\n");
 	free(f);
 }
 
@@ -441,7 +441,7 @@ xlog_recover_print_icreate(
 
 	icl = (struct xfs_icreate_log *)item->ri_buf[0].i_addr;
 
-	printf(_("	ICR:  #ag: %d  agbno: 0x%x  len: %d\n"
+	fprintf(logout, _("	ICR:  #ag: %d  agbno: 0x%x  len: %d\n"
 		 "	      cnt: %d  isize: %d    gen: 0x%x\n"),
 		be32_to_cpu(icl->icl_ag), be32_to_cpu(icl->icl_agbno),
 		be32_to_cpu(icl->icl_length), be32_to_cpu(icl->icl_count),
@@ -475,7 +475,7 @@ xlog_recover_print_logitem(
 		xlog_recover_print_quotaoff(item);
 		break;
 	default:
-		printf(_("xlog_recover_print_logitem: illegal type\n"));
+		fprintf(logout, _("xlog_recover_print_logitem: illegal type\n"));
 		break;
 	}
 }
@@ -488,25 +488,25 @@ xlog_recover_print_item(
 
 	switch (ITEM_TYPE(item)) {
 	case XFS_LI_BUF:
-		printf("BUF");
+		fprintf(logout, "BUF");
 		break;
 	case XFS_LI_ICREATE:
-		printf("ICR");
+		fprintf(logout, "ICR");
 		break;
 	case XFS_LI_INODE:
-		printf("INO");
+		fprintf(logout, "INO");
 		break;
 	case XFS_LI_EFD:
-		printf("EFD");
+		fprintf(logout, "EFD");
 		break;
 	case XFS_LI_EFI:
-		printf("EFI");
+		fprintf(logout, "EFI");
 		break;
 	case XFS_LI_DQUOT:
-		printf("DQ ");
+		fprintf(logout, "DQ ");
 		break;
 	case XFS_LI_QUOTAOFF:
-		printf("QOFF");
+		fprintf(logout, "QOFF");
 		break;
 	default:
 		cmn_err(CE_PANIC, _("%s: illegal type"), __FUNCTION__);
@@ -514,15 +514,15 @@ xlog_recover_print_item(
 	}
 
 /*	type isn't filled in yet
-	printf(_("ITEM: type: %d cnt: %d total: %d "),
+	fprintf(logout, _("ITEM: type: %d cnt: %d total: %d "),
 	       item->ri_type, item->ri_cnt, item->ri_total);
 */
-	printf(_(": cnt:%d total:%d "), item->ri_cnt, item->ri_total);
+	fprintf(logout, _(": cnt:%d total:%d "), item->ri_cnt, item->ri_total);
 	for (i=0; i<item->ri_cnt; i++) {
-		printf(_("a:0x%lx len:%d "),
+		fprintf(logout, _("a:0x%lx len:%d "),
 		       (long)item->ri_buf[i].i_addr, item->ri_buf[i].i_len);
 	}
-	printf("\n");
+	fprintf(logout, "\n");
 	xlog_recover_print_logitem(item);
 }
 
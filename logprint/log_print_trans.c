@@ -17,14 +17,276 @@
  */
 #include "libxfs.h"
 #include "libxlog.h"
+#include <pthread.h>
 
 #include "logprint.h"
 
+/*
+ * With several threads, committed transactions are formatted by worker
+ * threads, each into its own memory stream, and written out in the order
+ * they committed.  Whatever recovery prints between them (record headers,
+ * errors) is captured the same way, so the output matches printing it
+ * all in line.
+ */
+#define TRANS_QUEUED	1024		/* most transactions not written yet */
+
+struct trans_out {
+	struct trans_out	*next;
+	xlog_recover_t		*trans;		/* NULL for recovery's output */
+	FILE			*fp;
+	char			*buf;
+	size_t			len;
+	int			done;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* a transaction to format */
+	pthread_cond_t		done;		/* an entry has been finished */
+	struct trans_out	*head;		/* oldest not written out */
+	struct trans_out	*tail;
+	struct trans_out	*next;		/* next transaction to format */
+	struct trans_out	*seg;		/* recovery's output, now */
+	int			queued;
+	int			stop;
+	int			nthreads;
+	pthread_t		*threads;
+} transq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread int	trans_worker;
+
+static void
+trans_free(
+	xlog_recover_t		*trans)
+{
+	xlog_recover_item_t	*item, *n;
+	int			i;
+
+	list_for_each_entry_safe(item, n, &trans->r_itemq, ri_list) {
+		list_del(&item->ri_list);
+		for (i = 0; i < item->ri_cnt; i++)
+			kmem_free(item->ri_buf[i].i_addr);
+		kmem_free(item->ri_buf);
+		kmem_free(item);
+	}
+	kmem_free(trans);
+}
+
+static FILE *
+trans_open(
+	struct trans_out	*to)
+{
+	FILE			*fp;
+
+	fp = open_memstream(&to->buf, &to->len);
+	if (!fp) {
+		fprintf(stderr, _("%s: cannot buffer output: %s\n"),
+			progname, strerror(errno));
+		exit(1);
+	}
+	return fp;
+}
+
+/* the next transaction to format, at or after to */
+static struct trans_out *
+trans_next(
+	struct trans_out	*to)
+{
+	while (to && !to->trans)
+		to = to->next;
+	return to;
+}
+
+static void
+trans_append(
+	struct trans_out	*to)
+{
+	if (transq.tail)
+		transq.tail->next = to;
+	else
+		transq.head = to;
+	transq.tail = to;
+}
+
+static void *
+trans_thread(
+	void			*arg)
+{
+	struct trans_out	*to;
+
+	trans_worker = 1;
+	pthread_mutex_lock(&transq.lock);
+	for (;;) {
+		while (!transq.next && !transq.stop)
+			pthread_cond_wait(&transq.work, &transq.lock);
+		if (!transq.next)
+			break;
+		to = transq.next;
+		transq.next = trans_next(to->next);
+		pthread_mutex_unlock(&transq.lock);
+
+		logout = trans_open(to);
+		xlog_recover_print_trans(to->trans, &to->trans->r_itemq, 3);
+		fclose(logout);
+		logout = NULL;
+		trans_free(to->trans);
+
+		pthread_mutex_lock(&transq.lock);
+		to->done = 1;
+		pthread_cond_broadcast(&transq.done);
+	}
+	pthread_mutex_unlock(&transq.lock);
+	return NULL;
+}
+
+/* write out the finished entries at the head, waiting for them if asked */
+static void
+trans_write(
+	int			wait)
+{
+	struct trans_out	*to;
+
+	pthread_mutex_lock(&transq.lock);
+	while ((to = transq.head) != NULL) {
+		if (!to->done) {
+			if (!wait && transq.queued < TRANS_QUEUED)
+				break;
+			pthread_cond_wait(&transq.done, &transq.lock);
+			continue;
+		}
+		transq.head = to->next;
+		if (!transq.head)
+			transq.tail = NULL;
+		if (to->trans)
+			transq.queued--;
+		pthread_mutex_unlock(&transq.lock);
+		fwrite(to->buf, 1, to->len, stdout);
+		free(to->buf);
+		free(to);
+		pthread_mutex_lock(&transq.lock);
+	}
+	pthread_mutex_unlock(&transq.lock);
+}
+
+/* capture what recovery prints from here on */
+static void
+trans_seg_open(void)
+{
+	struct trans_out	*to = calloc(1, sizeof(*to));
+
+	if (!to) {
+		fprintf(stderr, _("%s: out of memory\n"), progname);
+		exit(1);
+	}
+	to->fp = trans_open(to);
+	pthread_mutex_lock(&transq.lock);
+	trans_append(to);
+	pthread_mutex_unlock(&transq.lock);
+	transq.seg = to;
+	print_output = logout = to->fp;
+}
+
+static void
+trans_seg_close(void)
+{
+	struct trans_out	*to = transq.seg;
+
+	if (!to)
+		return;
+	print_output = NULL;
+	logout = stdout;
+	transq.seg = NULL;
+	fclose(to->fp);
+	pthread_mutex_lock(&transq.lock);
+	to->done = 1;
+	pthread_mutex_unlock(&transq.lock);
+}
+
+/* hand a committed transaction to the workers */
+static void
+trans_queue(
+	xlog_recover_t		*trans)
+{
+	struct trans_out	*to = calloc(1, sizeof(*to));
+	xlog_recover_t		*copy = calloc(1, sizeof(*copy));
+
+	if (!to || !copy) {
+		fprintf(stderr, _("%s: out of memory\n"), progname);
+		exit(1);
+	}
+	/* recovery frees trans once we return, so take its items */
+	*copy = *trans;
+	INIT_LIST_HEAD(&copy->r_itemq);
+	list_splice_init(&trans->r_itemq, &copy->r_itemq);
+	to->trans = copy;
+
+	trans_seg_close();
+	pthread_mutex_lock(&transq.lock);
+	trans_append(to);
+	transq.queued++;
+	if (!transq.next)
+		transq.next = to;
+	pthread_cond_signal(&transq.work);
+	pthread_mutex_unlock(&transq.lock);
+	trans_seg_open();
+	trans_write(0);
+}
+
+static void
+trans_output_finish(void)
+{
+	int			i;
+
+	/* a worker exiting on a bad item can't wait for itself */
+	if (!transq.nthreads || trans_worker)
+		return;
+	trans_seg_close();
+	trans_write(1);
+	pthread_mutex_lock(&transq.lock);
+	transq.stop = 1;
+	pthread_cond_broadcast(&transq.work);
+	pthread_mutex_unlock(&transq.lock);
+	for (i = 0; i < transq.nthreads; i++)
+		pthread_join(transq.threads[i], NULL);
+	free(transq.threads);
+	transq.nthreads = 0;
+}
+
+static void
+trans_output_start(
+	int			nthreads)
+{
+	int			i;
+
+	if (nthreads <= 1)
+		return;
+	transq.threads = calloc(nthreads, sizeof(pthread_t));
+	if (!transq.threads)
+		return;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&transq.threads[i], NULL, trans_thread,
+				   NULL))
+			break;
+	}
+	transq.nthreads = i;
+	if (!i) {
+		free(transq.threads);
+		return;
+	}
+	/* xlog_exit on a bad record still gets out what came before it */
+	atexit(trans_output_finish);
+	trans_seg_open();
+}
+
 void
 xlog_recover_print_trans_head(
 	xlog_recover_t	*tr)
 {
-	printf(_("TRANS: tid:0x%x  type:%s  #items:%d  trans:0x%x  q:0x%lx\n"),
+	fprintf(logout, _("TRANS: tid:0x%x  type:%s  #items:%d  trans:0x%x  q:0x%lx\n"),
 	       tr->r_log_tid, trans_type[tr->r_theader.th_type],
 	       tr->r_theader.th_num_items,
 	       tr->r_theader.th_tid, (long)&tr->r_itemq);
@@ -36,7 +298,12 @@ xlog_recover_do_trans(
 	xlog_recover_t	*trans,
 	int		pass)
 {
-	xlog_recover_print_trans(trans, &trans->r_itemq, 3);
+	if (print_summary)
+		xlog_summary_add(trans);
+	else if (transq.nthreads)
+		trans_queue(trans);
+	else
+		xlog_recover_print_trans(trans, &trans->r_itemq, 3);
 	return 0;
 }
 
@@ -55,21 +322,32 @@ xfs_log_print_trans(
 		exit(1);
 	}
 
-	printf(_("    log tail: %lld head: %lld state: %s\n"),
-		(long long)tail_blk,
-		(long long)head_blk,
-		(tail_blk == head_blk)?"<CLEAN>":"<DIRTY>");
+	if (print_summary) {
+		if (print_block_start != -1)
+			tail_blk = print_block_start;
+		/* only the summary goes to stdout */
+		print_output = stderr;
+		xlog_summary_start(log);
+	} else {
+		printf(_("    log tail: %lld head: %lld state: %s\n"),
+			(long long)tail_blk,
+			(long long)head_blk,
+			(tail_blk == head_blk)?"<CLEAN>":"<DIRTY>");
 
-	if (print_block_start != -1) {
-		printf(_("    override tail: %d\n"), print_block_start);
-		tail_blk = print_block_start;
-	}
-	printf("\n");
+		if (print_block_start != -1) {
+			printf(_("    override tail: %d\n"), print_block_start);
+			tail_blk = print_block_start;
+		}
+		printf("\n");
 
-	print_record_header = 1;
+		print_record_header = 1;
+	}
 
-	if (head_blk == tail_blk)
+	if (head_blk == tail_blk) {
+		if (print_summary)
+			xlog_summary_print(tail_blk, head_blk);
 		return;
+	}
 
 	/*
 	 * Version 5 superblock log feature mask validation. We know the
@@ -80,7 +358,7 @@ xfs_log_print_trans(
 	if (XFS_SB_VERSION_NUM(&log->l_mp->m_sb) == XFS_SB_VERSION_5 &&
 	    xfs_sb_has_incompat_log_feature(&log->l_mp->m_sb,
 				XFS_SB_FEAT_INCOMPAT_LOG_UNKNOWN)) {
-		printf(_(
+		fprintf(print_summary ? stderr : stdout, _(
 "Superblock has unknown incompatible log features (0x%x) enabled.\n"
 "Output may be incomplete or inaccurate. It is recommended that you\n"
 "upgrade your xfsprogs installation to match the filesystem features.\n"),
@@ -88,9 +366,15 @@ xfs_log_print_trans(
 				XFS_SB_FEAT_INCOMPAT_LOG_UNKNOWN));
 	}
 
-	if ((error = xlog_do_recovery_pass(log, head_blk, tail_blk, XLOG_RECOVER_PASS1))) {
+	if (!print_summary)
+		trans_output_start(print_threads);
+	error = xlog_do_recovery_pass(log, head_blk, tail_blk, XLOG_RECOVER_PASS1);
+	trans_output_finish();
+	if (error) {
 		fprintf(stderr, _("%s: failed in xfs_do_recovery_pass, error: %d\n"),
 			progname, error);
 		exit(1);
 	}
+	if (print_summary)
+		xlog_summary_print(tail_blk, head_blk);
 }
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "libxlog.h"
+
+#include "logprint.h"
+
+/*
+ * -S: instead of printing the transactions between the tail and the head,
+ * count them and the bytes they log by item type, transaction type and
+ * allocation group, and print one table (or JSON object) at the end.
+ */
+
+enum {
+	SUM_BUF,
+	SUM_INODE,
+	SUM_DQUOT,
+	SUM_EFI,
+	SUM_EFD,
+	SUM_QUOTAOFF,
+	SUM_ICREATE,
+	SUM_OTHER,
+	SUM_NITEMS
+};
+
+static const char *sum_item_names[SUM_NITEMS] = {
+	"buffer", "inode", "dquot", "efi", "efd", "quotaoff", "icreate",
+	"other",
+};
+
+struct sum_count {
+	__uint64_t		count;
+	__uint64_t		bytes;
+};
+
+struct sum_ag {
+	struct sum_count	buf;
+	struct sum_count	inode;
+	xfs_ino_t		ino_min;
+	xfs_ino_t		ino_max;
+};
+
+static struct {
+	struct sum_count	trans;
+	struct sum_count	items[SUM_NITEMS];
+	struct sum_count	types[XFS_TRANS_TYPE_MAX + 1];	/* last: bad */
+	struct sum_ag		*ags;
+	xfs_agnumber_t		agcount;
+	xfs_mount_t		*mp;
+} sum;
+
+void
+xlog_summary_start(
+	struct xlog		*log)
+{
+	xfs_mount_t		*mp = log->l_mp;
+
+	sum.mp = mp;
+	/* without a superblock (-f) there's no AG geometry to go by */
+	if (!mp->m_sb.sb_agcount || !mp->m_sb.sb_agblocks)
+		return;
+	sum.ags = calloc(mp->m_sb.sb_agcount, sizeof(struct sum_ag));
+	if (!sum.ags) {
+		fprintf(stderr, _("%s: out of memory\n"), progname);
+		exit(1);
+	}
+	sum.agcount = mp->m_sb.sb_agcount;
+}
+
+static int
+xlog_summary_item_type(
+	xlog_recover_item_t	*item)
+{
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_BUF:	return SUM_BUF;
+	case XFS_LI_INODE:	return SUM_INODE;
+	case XFS_LI_DQUOT:	return SUM_DQUOT;
+	case XFS_LI_EFI:	return SUM_EFI;
+	case XFS_LI_EFD:	return SUM_EFD;
+	case XFS_LI_QUOTAOFF:	return SUM_QUOTAOFF;
+	case XFS_LI_ICREATE:	return SUM_ICREATE;
+	}
+	return SUM_OTHER;
+}
+
+static void
+xlog_summary_ag(
+	xlog_recover_item_t	*item,
+	int			type,
+	__uint64_t		bytes)
+{
+	xfs_sb_t		*sbp = &sum.mp->m_sb;
+	xfs_buf_log_format_t	*bf;
+	xfs_inode_log_format_t	f_buf;
+	xfs_inode_log_format_t	*f;
+	struct sum_ag		*ag;
+	__uint64_t		agno;
+	xfs_ino_t		ino;
+
+	if (type == SUM_BUF) {
+		bf = (xfs_buf_log_format_t *)item->ri_buf[0].i_addr;
+		agno = ((__uint64_t)bf->blf_blkno >> sum.mp->m_blkbb_log) /
+			sbp->sb_agblocks;
+		if (agno >= sum.agcount)
+			return;
+		ag = &sum.ags[agno];
+		ag->buf.count++;
+		ag->buf.bytes += bytes;
+	} else if (type == SUM_INODE) {
+		if (item->ri_buf[0].i_len != sizeof(xfs_inode_log_format_32_t) &&
+		    item->ri_buf[0].i_len != sizeof(xfs_inode_log_format_64_t))
+			return;
+		f = xfs_inode_item_format_convert(item->ri_buf[0].i_addr,
+				item->ri_buf[0].i_len, &f_buf);
+		ino = f->ilf_ino;
+		agno = ino >> (sbp->sb_agblklog + sbp->sb_inopblog);
+		if (agno >= sum.agcount)
+			return;
+		ag = &sum.ags[agno];
+		if (!ag->inode.count || ino < ag->ino_min)
+			ag->ino_min = ino;
+		if (ino > ag->ino_max)
+			ag->ino_max = ino;
+		ag->inode.count++;
+		ag->inode.bytes += bytes;
+	}
+}
+
+void
+xlog_summary_add(
+	xlog_recover_t		*trans)
+{
+	xlog_recover_item_t	*item;
+	__uint64_t		tbytes = 0;
+	__uint64_t		bytes;
+	uint			ttype = trans->r_theader.th_type;
+	int			type;
+	int			i;
+
+	list_for_each_entry(item, &trans->r_itemq, ri_list) {
+		if (!item->ri_cnt)
+			continue;
+		for (i = 0, bytes = 0; i < item->ri_cnt; i++)
+			bytes += item->ri_buf[i].i_len;
+		type = xlog_summary_item_type(item);
+		sum.items[type].count++;
+		sum.items[type].bytes += bytes;
+		if (sum.agcount)
+			xlog_summary_ag(item, type, bytes);
+		tbytes += bytes;
+	}
+	if (ttype >= XFS_TRANS_TYPE_MAX)
+		ttype = XFS_TRANS_TYPE_MAX;
+	sum.types[ttype].count++;
+	sum.types[ttype].bytes += tbytes;
+	sum.trans.count++;
+	sum.trans.bytes += tbytes;
+}
+
+static const char *
+xlog_summary_type_name(
+	uint			ttype)
+{
+	if (ttype >= XFS_TRANS_TYPE_MAX)
+		return "UNKNOWN";
+	return ttype ? trans_type[ttype] : "NONE";
+}
+
+static void
+xlog_summary_table(
+	xfs_daddr_t		tail_blk,
+	xfs_daddr_t		head_blk)
+{
+	xfs_agnumber_t		agno;
+	struct sum_ag		*ag;
+	int			i;
+
+	printf(_("log tail: %lld head: %lld\n"),
+		(long long)tail_blk, (long long)head_blk);
+	printf(_("transactions: %llu  bytes: %llu\n\n"),
+		(unsigned long long)sum.trans.count,
+		(unsigned long long)sum.trans.bytes);
+
+	printf(_("%-20s %12s %14s\n"), _("item"), _("count"), _("bytes"));
+	for (i = 0; i < SUM_NITEMS; i++) {
+		if (!sum.items[i].count)
+			continue;
+		printf("%-20s %12llu %14llu\n", sum_item_names[i],
+			(unsigned long long)sum.items[i].count,
+			(unsigned long long)sum.items[i].bytes);
+	}
+
+	printf(_("\n%-20s %12s %14s\n"), _("transaction"), _("count"),
+		_("bytes"));
+	for (i = 0; i <= XFS_TRANS_TYPE_MAX; i++) {
+		if (!sum.types[i].count)
+			continue;
+		printf("%-20s %12llu %14llu\n", xlog_summary_type_name(i),
+			(unsigned long long)sum.types[i].count,
+			(unsigned long long)sum.types[i].bytes);
+	}
+
+	if (!sum.agcount)
+		return;
+	printf(_("\n%-6s %10s %12s %10s %12s  %s\n"), _("ag"), _("buffers"),
+		_("bytes"), _("inodes"), _("bytes"), _("inode range"));
+	for (agno = 0; agno < sum.agcount; agno++) {
+		ag = &sum.ags[agno];
+		if (!ag->buf.count && !ag->inode.count)
+			continue;
+		printf("%-6u %10llu %12llu %10llu %12llu", agno,
+			(unsigned long long)ag->buf.count,
+			(unsigned long long)ag->buf.bytes,
+			(unsigned long long)ag->inode.count,
+			(unsigned long long)ag->inode.bytes);
+		if (ag->inode.count)
+			printf("  0x%llx-0x%llx",
+				(unsigned long long)ag->ino_min,
+				(unsigned long long)ag->ino_max);
+		printf("\n");
+	}
+}
+
+static void
+xlog_summary_json(
+	xfs_daddr_t		tail_blk,
+	xfs_daddr_t		head_blk)
+{
+	xfs_agnumber_t		agno;
+	struct sum_ag		*ag;
+	char			*sep;
+	int			i;
+
+	printf("{\n  \"tail\": %lld,\n  \"head\": %lld,\n",
+		(long long)tail_blk, (long long)head_blk);
+	printf("  \"transactions\": { \"count\": %llu, \"bytes\": %llu },\n",
+		(unsigned long long)sum.trans.count,
+		(unsigned long long)sum.trans.bytes);
+
+	printf("  \"items\": {");
+	for (i = 0, sep = ""; i < SUM_NITEMS; i++) {
+		if (!sum.items[i].count)
+			continue;
+		printf("%s\n    \"%s\": { \"count\": %llu, \"bytes\": %llu }",
+			sep, sum_item_names[i],
+			(unsigned long long)sum.items[i].count,
+			(unsigned long long)sum.items[i].bytes);
+		sep = ",";
+	}
+	printf("\n  },\n  \"types\": {");
+	for (i = 0, sep = ""; i <= XFS_TRANS_TYPE_MAX; i++) {
+		if (!sum.types[i].count)
+			continue;
+		printf("%s\n    \"%s\": { \"count\": %llu, \"bytes\": %llu }",
+			sep, xlog_summary_type_name(i),
+			(unsigned long long)sum.types[i].count,
+			(unsigned long long)sum.types[i].bytes);
+		sep = ",";
+	}
+	printf("\n  },\n  \"ags\": [");
+	for (agno = 0, sep = ""; agno < sum.agcount; agno++) {
+		ag = &sum.ags[agno];
+		if (!ag->buf.count && !ag->inode.count)
+			continue;
+		printf("%s\n    { \"ag\": %u, \"buffers\": %llu, "
+			"\"buffer_bytes\": %llu, \"inodes\": %llu, "
+			"\"inode_bytes\": %llu", sep, agno,
+			(unsigned long long)ag->buf.count,
+			(unsigned long long)ag->buf.bytes,
+			(unsigned long long)ag->inode.count,
+			(unsigned long long)ag->inode.bytes);
+		if (ag->inode.count)
+			printf(", \"ino_min\": %llu, \"ino_max\": %llu",
+				(unsigned long long)ag->ino_min,
+				(unsigned long long)ag->ino_max);
+		printf(" }");
+		sep = ",";
+	}
+	printf("\n  ]\n}\n");
+}
+
+void
+xlog_summary_print(
+	xfs_daddr_t		tail_blk,
+	xfs_daddr_t		head_blk)
+{
+	if (print_summary == SUMMARY_JSON)
+		xlog_summary_json(tail_blk, head_blk);
+	else
+		xlog_summary_table(tail_blk, head_blk);
+	free(sum.ags);
+	sum.ags = NULL;
+	sum.agcount = 0;
+}
@@ -38,6 +38,11 @@ int     print_no_data;
 int     print_no_print;
 int     print_exit = 1; /* -e is now default. specify -c to override */
 int	print_operation = OP_PRINT;
+int	print_threads;		/* 0 picks one per CPU */
+int	print_summary;
+__thread FILE	*logout;
+
+#define MAX_PRINT_THREADS	64
 
 void
 usage(void)
@@ -53,8 +58,11 @@ Options:\n\
     -n	            don't try and interpret log data\n\
     -o	            print buffer data in hex\n\
     -s <start blk>  block # to start printing\n\
+    -S table|json   summarize the transactions instead of printing them\n\
     -v              print \"overwrite\" data\n\
     -t	            print out transactional view\n\
+    -T <threads>    with -t, format on this many threads; with -C or -d,\n\
+                    read the log on this many threads\n\
 	-b          in transactional view, extract buffer info\n\
 	-i          in transactional view, extract inode info\n\
 	-q          in transactional view, extract quota info\n\
@@ -64,6 +72,15 @@ Options:\n\
 	exit(1);
 }
 
+/* the file or device the log is read from */
+char *
+xlog_print_path(void)
+{
+	if (x.logname && *x.logname)
+		return x.logname;
+	return x.dname;
+}
+
 int
 logstat(xfs_mount_t *mp)
 {
@@ -146,7 +163,8 @@ main(int argc, char **argv)
 	memset(&mount, 0, sizeof(mount));
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "bC:cdefl:iqnors:tDVv")) != EOF) {
+	logout = stdout;
+	while ((c = getopt(argc, argv, "bC:cdefl:iqnors:S:tT:DVv")) != EOF) {
 		switch (c) {
 			case 'D':
 				print_only_data++;
@@ -196,9 +214,28 @@ main(int argc, char **argv)
 			case 's':
 				print_start = atoi(optarg);
 				break;
+			case 'S':
+				print_operation = OP_PRINT_TRANS;
+				if (strcmp(optarg, "table") == 0)
+					print_summary = SUMMARY_TABLE;
+				else if (strcmp(optarg, "json") == 0)
+					print_summary = SUMMARY_JSON;
+				else
+					usage();
+				break;
 			case 't':
 				print_operation = OP_PRINT_TRANS;
 				break;
+			case 'T':
+				print_threads = atoi(optarg);
+				if (print_threads < 1 ||
+				    print_threads > MAX_PRINT_THREADS) {
+					fprintf(stderr,
+		_("%s: thread count must be between 1 and %d\n"),
+						progname, MAX_PRINT_THREADS);
+					exit(1);
+				}
+				break;
 			case 'v':
 				print_overwrite++;
 				break;
@@ -214,12 +251,22 @@ main(int argc, char **argv)
 		usage();
 
 	x.dname = argv[optind];
+	/* a copy only reads in parallel if asked, a dump reads one ahead */
+	if (!print_threads && print_operation == OP_COPY)
+		print_threads = 1;
+	if (!print_threads && print_operation == OP_DUMP)
+		print_threads = 2;
+	if (!print_threads) {
+		print_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		print_threads = MAX(1, MIN(print_threads, MAX_PRINT_THREADS));
+	}
 
 	if (x.dname == NULL)
 		usage();
 
 	x.isreadonly = LIBXFS_ISINACTIVE;
-	printf(_("xfs_logprint:\n"));
+	if (!print_summary)
+		printf(_("xfs_logprint:\n"));
 	if (!libxfs_init(&x))
 		exit(1);
 
@@ -228,16 +275,20 @@ main(int argc, char **argv)
 
 	logfd = (x.logfd < 0) ? x.dfd : x.logfd;
 
-	printf(_("    data device: 0x%llx\n"), (unsigned long long)x.ddev);
+	if (!print_summary) {
+		printf(_("    data device: 0x%llx\n"),
+			(unsigned long long)x.ddev);
 
-	if (x.logname) {
-		printf(_("    log file: \"%s\" "), x.logname);
-	} else {
-		printf(_("    log device: 0x%llx "), (unsigned long long)x.logdev);
-	}
+		if (x.logname) {
+			printf(_("    log file: \"%s\" "), x.logname);
+		} else {
+			printf(_("    log device: 0x%llx "),
+				(unsigned long long)x.logdev);
+		}
 
-	printf(_("daddr: %lld length: %lld\n\n"),
-		(long long)x.logBBstart, (long long)x.logBBsize);
+		printf(_("daddr: %lld length: %lld\n\n"),
+			(long long)x.logBBstart, (long long)x.logBBsize);
+	}
 
 	ASSERT(x.logBBsize <= INT_MAX);
 
@@ -28,17 +28,37 @@ extern int	print_transactions;
 extern int	print_overwrite;
 extern int	print_no_data;
 extern int	print_no_print;
+extern int	print_threads;
+extern int	print_summary;
+
+#define SUMMARY_TABLE	1
+#define SUMMARY_JSON	2
+
+/* where the transaction printing goes, set for each thread */
+extern __thread FILE	*logout;
 
 /* exports */
 extern char *trans_type[];
 
 extern void xlog_print_lseek(struct xlog *, int, xfs_daddr_t, int);
+extern ssize_t xlog_print_read(int, void *, size_t);
+
+/* called with runs of log blocks, see xlog_read_chunks() */
+typedef void (*xlog_chunk_fn_t)(xfs_daddr_t blkno, char *buf, int nbbs,
+				void *arg);
+extern xfs_daddr_t xlog_read_chunks(struct xlog *, int, char *, int, int,
+				    xlog_chunk_fn_t, void *);
+extern char *xlog_print_path(void);
 
 extern void xfs_log_copy(struct xlog *, int, char *);
 extern void xfs_log_dump(struct xlog *, int, int);
 extern void xfs_log_print(struct xlog *, int, int);
 extern void xfs_log_print_trans(struct xlog *, int);
 
+extern void xlog_summary_start(struct xlog *);
+extern void xlog_summary_add(xlog_recover_t *);
+extern void xlog_summary_print(xfs_daddr_t, xfs_daddr_t);
+
 extern void print_xlog_record_line(void);
 extern void print_xlog_op_line(void);
 extern void print_stars(void);
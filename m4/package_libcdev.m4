@@ -153,6 +153,40 @@ AC_DEFUN([AC_HAVE_PREADV],
     AC_SUBST(have_preadv)
   ])
 
+#
+# Check if we have a pwritev libc call (Linux)
+#
+AC_DEFUN([AC_HAVE_PWRITEV],
+  [ AC_MSG_CHECKING([for pwritev])
+    AC_TRY_LINK([
+#define _FILE_OFFSET_BITS 64
+#define _BSD_SOURCE
+#include <sys/uio.h>
+    ], [
+         pwritev(0, 0, 0, 0);
+    ], have_pwritev=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_pwritev)
+  ])
+
+#
+# Check if we have a preadv2 libc call (Linux)
+#
+AC_DEFUN([AC_HAVE_PREADV2],
+  [ AC_MSG_CHECKING([for preadv2])
+    AC_TRY_LINK([
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <sys/uio.h>
+    ], [
+         preadv2(0, 0, 0, 0, 0);
+    ], have_preadv2=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_preadv2)
+  ])
+
 #
 # Check if we have a sync_file_range libc call (Linux)
 #
@@ -170,6 +204,24 @@ AC_DEFUN([AC_HAVE_SYNC_FILE_RANGE],
     AC_SUBST(have_sync_file_range)
   ])
 
+#
+# Check if we have a copy_file_range system call (Linux)
+#
+AC_DEFUN([AC_HAVE_COPY_FILE_RANGE],
+  [ AC_MSG_CHECKING([for copy_file_range])
+    AC_TRY_LINK([
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <sys/syscall.h>
+    ], [
+         syscall(__NR_copy_file_range, 0, 0, 0, 0, 0, 0);
+    ], have_copy_file_range=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_copy_file_range)
+  ])
+
 #
 # Check if we have a syncfs libc call (Linux)
 #
@@ -214,6 +266,15 @@ AC_DEFUN([AC_HAVE_FLS],
     AC_SUBST(have_fls)
   ])
 
+#
+# Check if we can build in static probes with <sys/sdt.h>
+#
+AC_DEFUN([AC_HAVE_SDT],
+  [ AC_CHECK_HEADERS(sys/sdt.h,
+    have_sdt=yes)
+    AC_SUBST(have_sdt)
+  ])
+
 #
 # Check if there is mntent.h
 #
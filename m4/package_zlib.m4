@@ -0,0 +1,10 @@
+#
+# See if zlib is there to compress metadumps with
+#
+AC_DEFUN([AC_HAVE_ZLIB],
+[
+  AC_CHECK_HEADER([zlib.h],
+    [AC_CHECK_LIB([z], [compress2], [have_zlib=yes libz="-lz"])])
+  AC_SUBST(have_zlib)
+  AC_SUBST(libz)
+])
@@ -18,11 +18,78 @@
 
 #include "libxfs.h"
 #include "xfs_metadump.h"
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 char 		*progname;
 int		show_progress = 0;
 int		progress_since_warning = 0;
 
+/*
+ * With -s, what was restored and where the time went is printed to stderr
+ * at the end, for benchmarks to compare.  Reading the dump, decompressing
+ * it and writing the targets are timed in CPU time, summed over the
+ * threads doing them, and in wall clock time.
+ */
+enum {
+	STAT_READ,
+	STAT_DECOMPRESS,
+	STAT_WRITE,
+	NSTATS,
+};
+
+struct stat_clock {
+	__uint64_t		cpu;
+	__uint64_t		wall;
+};
+
+static int		show_stats;
+static __uint64_t	stat_cpu[NSTATS];
+static __uint64_t	stat_wall[NSTATS];
+static __uint64_t	stat_blocks;		/* basic blocks restored */
+static __uint64_t	stat_written;		/* bytes, over all targets */
+static __uint64_t	stat_punched;
+
+static __uint64_t
+stat_now(
+	clockid_t		clock)
+{
+	struct timespec		ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+stat_start(
+	struct stat_clock	*c)
+{
+	if (!show_stats)
+		return;
+	c->cpu = stat_now(CLOCK_THREAD_CPUTIME_ID);
+	c->wall = stat_now(CLOCK_MONOTONIC);
+}
+
+static void
+stat_stop(
+	int			which,
+	struct stat_clock	*c)
+{
+	if (!show_stats)
+		return;
+	counter_add(&stat_cpu[which],
+			stat_now(CLOCK_THREAD_CPUTIME_ID) - c->cpu);
+	counter_add(&stat_wall[which],
+			stat_now(CLOCK_MONOTONIC) - c->wall);
+}
+
 static void
 fatal(const char *msg, ...)
 {
@@ -50,164 +117,981 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * Every target has a writer thread of its own when there is more than one,
+ * see flush_runs().  Writes to a target are collected into runs of
+ * contiguous iovecs in pending.
+ */
+struct target {
+	char			*path;
+	int			fd;
+	int			direct_fd;	/* O_DIRECT target, if asked */
+	int			is_file;
+	int			punch_holes;	/* until the target refuses */
+	pthread_t		tid;
+	__uint64_t		gen;		/* last runs written */
+	struct iovec		pending[IOV_MAX];
+	int			npending;
+	__uint64_t		pending_off;
+	size_t			pending_len;
+};
+
+static struct target	*targets;
+static int		ntargets;
+
+/*
+ * Check the primary superblock at the start of the dump, mark it in
+ * progress until the restore is done and make sure the targets can hold the
+ * filesystem.
+ */
 static void
-perform_restore(
-	FILE			*src_f,
-	int			dst_fd,
-	int			is_target_file)
+setup_targets(
+	char			*sb_buf)
 {
-	xfs_metablock_t 	*metablock;	/* header + index + blocks */
-	__be64			*block_index;
-	char			*block_buffer;
-	int			block_size;
-	int			max_indicies;
-	int			cur_index;
-	int			mb_count;
-	xfs_metablock_t		tmb;
+	struct target		*t;
 	xfs_sb_t		sb;
-	__int64_t		bytes_read;
 
-	/*
-	 * read in first blocks (superblock 0), set "inprogress" flag for it,
-	 * read in the rest of the file, and if complete, clear SB 0's
-	 * "inprogress flag"
-	 */
+	libxfs_sb_from_disk(&sb, (xfs_dsb_t *)sb_buf);
 
-	if (fread(&tmb, sizeof(tmb), 1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+	if (sb.sb_magicnum != XFS_SB_MAGIC)
+		fatal("bad magic number for primary superblock\n");
 
-	if (be32_to_cpu(tmb.mb_magic) != XFS_MD_MAGIC)
-		fatal("specified file is not a metadata dump\n");
+	((xfs_dsb_t*)sb_buf)->sb_inprogress = 1;
+
+	for (t = targets; t < targets + ntargets; t++) {
+		if (t->is_file)  {
+			/* ensure regular files are correctly sized */
+
+			if (ftruncate64(t->fd, sb.sb_dblocks * sb.sb_blocksize))
+				fatal("cannot set filesystem image size: %s\n",
+					strerror(errno));
+		} else  {
+			/* ensure device is sufficiently large enough */
 
-	block_size = 1 << tmb.mb_blocklog;
-	max_indicies = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
+			char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
+			off64_t		off;
 
-	metablock = (xfs_metablock_t *)calloc(max_indicies + 1, block_size);
-	if (metablock == NULL)
+			off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
+			if (pwrite64(t->fd, lb, sizeof(lb), off) < 0)
+				fatal("failed to write last block of \"%s\", "
+					"is target too small? (error: %s)\n",
+					t->path, strerror(errno));
+		}
+	}
+}
+
+/*
+ * All dumps are restored, clear the in progress flag again.  The primary
+ * superblock is read back from the target as a delta may have changed it,
+ * and so may the size of the filesystem have.
+ */
+static void
+finish_target(
+	struct target		*t)
+{
+	char			*block_buffer;
+	xfs_sb_t		sb;
+	struct stat64		st;
+	off64_t			size;
+
+	block_buffer = calloc(1, XFS_MAX_SECTORSIZE);
+	if (block_buffer == NULL)
 		fatal("memory allocation failure\n");
 
-	mb_count = be16_to_cpu(tmb.mb_count);
-	if (mb_count == 0 || mb_count > max_indicies)
-		fatal("bad block count: %u\n", mb_count);
+	if (pread64(t->fd, block_buffer, BBSIZE, 0) != BBSIZE)
+		fatal("error reading primary superblock: %s\n", strerror(errno));
+	libxfs_sb_from_disk(&sb, (xfs_dsb_t *)block_buffer);
+	if (sb.sb_magicnum != XFS_SB_MAGIC ||
+	    sb.sb_sectsize < BBSIZE || sb.sb_sectsize > XFS_MAX_SECTORSIZE)
+		fatal("bad primary superblock in restored filesystem\n");
 
-	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
-	block_buffer = (char *)metablock + block_size;
+	memset(block_buffer, 0, XFS_MAX_SECTORSIZE);
+	sb.sb_inprogress = 0;
+	libxfs_sb_to_disk((xfs_dsb_t *)block_buffer, &sb);
+	if (xfs_sb_version_hascrc(&sb)) {
+		xfs_update_cksum(block_buffer, sb.sb_sectsize,
+				 offsetof(struct xfs_sb, sb_crc));
+	}
 
-	if (fread(block_index, block_size - sizeof(tmb), 1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+	if (pwrite(t->fd, block_buffer, sb.sb_sectsize, 0) < 0)
+		fatal("error writing primary superblock: %s\n", strerror(errno));
 
-	if (block_index[0] != 0)
-		fatal("first block is not the primary superblock\n");
+	size = sb.sb_dblocks * sb.sb_blocksize;
+	if (t->is_file && fstat64(t->fd, &st) == 0 &&
+	    st.st_size != size && ftruncate64(t->fd, size))
+		fatal("cannot set filesystem image size: %s\n",
+			strerror(errno));
 
+	free(block_buffer);
+}
 
-	if (fread(block_buffer, mb_count << tmb.mb_blocklog,
-			1, src_f) != 1)
-		fatal("error reading from file: %s\n", strerror(errno));
+/*
+ * The dump is read by a separate thread into a pair of batches of whole
+ * metablocks or chunks, so reading the next batch overlaps with writing
+ * out the previous one.  The blocks of a batch are collected as runs of
+ * contiguous disk addresses, sorted and written out with as few calls as
+ * possible.
+ */
+#define NUM_BATCHES	2
+#define BATCH_SIZE	(4 << 20)	/* bytes of dump read at a time */
 
-	libxfs_sb_from_disk(&sb, (xfs_dsb_t *)block_buffer);
+struct batch {
+	char			*buf;
+	size_t			size;
+	size_t			len;
+	int			full;		/* waiting for the writer */
+	int			last;		/* holds the end of the dump */
+};
 
-	if (sb.sb_magicnum != XFS_SB_MAGIC)
-		fatal("bad magic number for primary superblock\n");
+struct run {
+	__uint64_t		off;		/* byte offset in the target */
+	size_t			len;
+	char			*data;
+	int			seq;		/* order in the dump */
+};
 
-	((xfs_dsb_t*)block_buffer)->sb_inprogress = 1;
+static FILE		*src_f;
+static int		md_version;
+static int		full_dump;		/* not a delta */
+static xfs_metablock_t	first_mb;		/* v1 header read by main */
+static int		block_size;		/* v1 block size */
+static int		max_indicies;
+static size_t		cbuf_size;		/* v2 max stored chunk */
 
-	if (is_target_file)  {
-		/* ensure regular files are correctly sized */
+static struct batch	batches[NUM_BATCHES];
+static pthread_mutex_t	batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	batch_cond = PTHREAD_COND_INITIALIZER;
 
-		if (ftruncate64(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
-			fatal("cannot set filesystem image size: %s\n",
-				strerror(errno));
-	} else  {
-		/* ensure device is sufficiently large enough */
+static struct run	*runs;
+static int		nruns;
+static int		max_runs;
+
+static char		*arena;			/* uncompressed v2 chunks */
+static size_t		arena_len;
+static char		*zero_buf;		/* data of v2 zero chunks */
+static __int64_t	bytes_read;		/* of all dumps */
+
+static pthread_mutex_t	write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	write_cond = PTHREAD_COND_INITIALIZER;
+static __uint64_t	write_gen;		/* runs handed to the writers */
+static int		writes_left;		/* writers still at them */
+static int		writers_stop;
 
-		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
-		off64_t		off;
+static void
+read_dump(
+	void			*buf,
+	size_t			len)
+{
+	struct stat_clock	clock;
+	size_t			ret;
 
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
-		if (pwrite64(dst_fd, lb, sizeof(lb), off) < 0)
-			fatal("failed to write last block, is target too "
-				"small? (error: %s)\n", strerror(errno));
+	stat_start(&clock);
+	ret = fread(buf, len, 1, src_f);
+	stat_stop(STAT_READ, &clock);
+	if (ret == 1)
+		return;
+	if (feof(src_f))
+		fatal("metadata dump is incomplete\n");
+	fatal("error reading from file: %s\n", strerror(errno));
+}
+
+/*
+ * Read the header of the next metablock or chunk into hdr and return the
+ * size of the whole record, or 0 at the end of the dump.  *last is set if
+ * this is the last record.
+ */
+static size_t
+read_record_header(
+	char			*hdr,
+	size_t			*hdr_len,
+	int			first,
+	int			*last)
+{
+	xfs_metablock_t		*mb = (xfs_metablock_t *)hdr;
+	xfs_md2_chunk_t		*chunk = (xfs_md2_chunk_t *)hdr;
+	__uint32_t		nextents;
+	__uint32_t		dlen;
+	__uint32_t		clen;
+	int			mb_count;
+
+	*last = 0;
+	if (md_version == 1) {
+		*hdr_len = sizeof(*mb);
+		if (first)
+			*mb = first_mb;
+		else
+			read_dump(mb, sizeof(*mb));
+
+		mb_count = be16_to_cpu(mb->mb_count);
+		if (mb_count == 0 && !first)
+			return 0;
+		if (mb_count == 0 || mb_count > max_indicies)
+			fatal("bad block count: %u\n", mb_count);
+		*last = mb_count < max_indicies;
+		return block_size + (mb_count << mb->mb_blocklog);
 	}
 
-	bytes_read = 0;
+	*hdr_len = sizeof(*chunk);
+	read_dump(chunk, sizeof(*chunk));
+	if (be32_to_cpu(chunk->mc_magic) == XFS_MD2_INDEX_MAGIC) {
+		if (first && full_dump)
+			fatal("metadata dump contains no blocks\n");
+		return 0;
+	}
+	if (be32_to_cpu(chunk->mc_magic) != XFS_MD2_CHUNK_MAGIC)
+		fatal("bad chunk magic number\n");
 
-	for (;;) {
-		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
-			print_progress("%lld MB read\n", bytes_read >> 20);
-
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite64(dst_fd, &block_buffer[cur_index <<
-					tmb.mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
+	nextents = be32_to_cpu(chunk->mc_nextents);
+	dlen = be32_to_cpu(chunk->mc_dlen);
+	clen = be32_to_cpu(chunk->mc_clen);
+	if (dlen > XFS_MD2_MAX_CHUNK || (dlen & (BBSIZE - 1)) ||
+	    nextents == 0 || nextents > (dlen >> BBSHIFT) ||
+	    clen > cbuf_size ||
+	    (chunk->mc_compression == XFS_MD2_COMP_NONE && clen != dlen) ||
+	    (chunk->mc_compression == XFS_MD2_COMP_ZERO && clen != 0))
+		fatal("bad chunk header\n");
+	return sizeof(*chunk) + nextents * sizeof(xfs_md2_extent_t) + clen;
+}
+
+static struct batch *
+get_batch(
+	int			i,
+	int			full)
+{
+	struct batch		*b = &batches[i % NUM_BATCHES];
+
+	pthread_mutex_lock(&batch_lock);
+	while (b->full != full)
+		pthread_cond_wait(&batch_cond, &batch_lock);
+	pthread_mutex_unlock(&batch_lock);
+	return b;
+}
+
+static void
+put_batch(
+	struct batch		*b,
+	int			full)
+{
+	pthread_mutex_lock(&batch_lock);
+	b->full = full;
+	pthread_cond_broadcast(&batch_cond);
+	pthread_mutex_unlock(&batch_lock);
+}
+
+/* reader thread, fills the batches with whole records */
+static void *
+reader(
+	void			*arg)
+{
+	char			hdr[sizeof(xfs_md2_chunk_t)];
+	struct batch		*b;
+	size_t			hdr_len;
+	size_t			len;
+	int			i = 0;
+	int			first = 1;
+	int			last = 0;
+
+	b = get_batch(i, 0);
+	b->len = 0;
+	b->last = 0;
+	while (!last) {
+		len = read_record_header(hdr, &hdr_len, first, &last);
+		first = 0;
+		if (!len)
+			break;
+		if (b->len && b->len + len > b->size) {
+			put_batch(b, 1);
+			b = get_batch(++i, 0);
+			b->len = 0;
+			b->last = 0;
+		}
+		memcpy(b->buf + b->len, hdr, hdr_len);
+		read_dump(b->buf + b->len + hdr_len, len - hdr_len);
+		b->len += len;
+	}
+	b->last = 1;
+	put_batch(b, 1);
+	return NULL;
+}
+
+static void
+add_run(
+	__uint64_t		daddr,
+	char			*data,
+	size_t			len)
+{
+	struct run		*r = nruns ? &runs[nruns - 1] : NULL;
+
+	if (r && r->off + r->len == daddr << BBSHIFT &&
+	    r->data + r->len == data) {
+		r->len += len;
+		stat_blocks += len >> BBSHIFT;
+		return;
+	}
+	if (nruns == max_runs) {
+		max_runs = max_runs ? max_runs * 2 : 1024;
+		runs = realloc(runs, max_runs * sizeof(*runs));
+		if (runs == NULL)
+			fatal("memory allocation failure\n");
+	}
+	stat_blocks += len >> BBSHIFT;
+	r = &runs[nruns];
+	r->off = daddr << BBSHIFT;
+	r->len = len;
+	r->data = data;
+	r->seq = nruns++;
+}
+
+static int
+run_off_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct run	*ra = a;
+	const struct run	*rb = b;
+
+	if (ra->off != rb->off)
+		return ra->off < rb->off ? -1 : 1;
+	return ra->seq - rb->seq;
+}
+
+static int
+run_seq_cmp(
+	const void		*a,
+	const void		*b)
+{
+	return ((struct run *)a)->seq - ((struct run *)b)->seq;
+}
+
+static void
+write_iov(
+	struct target		*t,
+	struct iovec		*iov,
+	int			cnt,
+	__uint64_t		off,
+	size_t			len)
+{
+	ssize_t			ret;
+	int			fd = t->direct_fd >= 0 ? t->direct_fd : t->fd;
+
+again:
+#ifdef HAVE_PWRITEV
+	ret = pwritev(fd, iov, cnt, off);
+#else
+	{
+		__uint64_t	o = off;
+		int		i;
+
+		for (i = 0, ret = 0; i < cnt && ret >= 0; i++) {
+			ret = pwrite64(fd, iov[i].iov_base, iov[i].iov_len, o);
+			if (ret != iov[i].iov_len)
+				break;
+			o += ret;
+		}
+		if (i == cnt)
+			ret = len;
+	}
+#endif
+	/* direct I/O can refuse blocks smaller than the device sectors */
+	if (ret < 0 && errno == EINVAL && fd == t->direct_fd) {
+		fd = t->fd;
+		goto again;
+	}
+	if (ret != len)
+		fatal("error writing block %llu of \"%s\": %s\n",
+			(unsigned long long)off, t->path,
+			ret < 0 ? strerror(errno) : "short write");
+	if (show_stats)
+		counter_add(&stat_written, len);
+}
+
+/*
+ * Stretches of zeroes at least this long aren't written but punched out of
+ * the target, which leaves holes in files and lets thin provisioned
+ * devices unmap the space.  Zeroes are common in dumps: obfuscation and
+ * stale data zeroing clear whole blocks, large parts of the log are
+ * usually empty, and deltas zero the blocks that left the metadata.
+ */
+#define MIN_HOLE_SIZE	4096
+
+static char *
+get_zero_buf(void)
+{
+	if (zero_buf == NULL) {
+		zero_buf = memalign(BBSIZE, XFS_MD2_MAX_CHUNK);
+		if (zero_buf == NULL)
+			fatal("memory allocation failure\n");
+		memset(zero_buf, 0, XFS_MD2_MAX_CHUNK);
+	}
+	return zero_buf;
+}
+
+static void
+flush_pending(
+	struct target		*t)
+{
+	if (t->npending)
+		write_iov(t, t->pending, t->npending, t->pending_off,
+			  t->pending_len);
+	t->npending = 0;
+	t->pending_len = 0;
+}
+
+static void
+queue_write(
+	struct target		*t,
+	__uint64_t		off,
+	char			*data,
+	size_t			len)
+{
+	struct iovec		*iov;
+
+	if (t->npending && t->pending_off + t->pending_len == off) {
+		iov = &t->pending[t->npending - 1];
+		if ((char *)iov->iov_base + iov->iov_len == data) {
+			iov->iov_len += len;
+			t->pending_len += len;
+			return;
 		}
-		if (mb_count < max_indicies)
+	}
+	if (t->npending == IOV_MAX || t->pending_off + t->pending_len != off)
+		flush_pending(t);
+	if (!t->npending)
+		t->pending_off = off;
+	t->pending[t->npending].iov_base = data;
+	t->pending[t->npending].iov_len = len;
+	t->npending++;
+	t->pending_len += len;
+}
+
+static void
+zero_range(
+	struct target		*t,
+	__uint64_t		off,
+	size_t			len)
+{
+	size_t			n;
+
+#ifdef HAVE_FALLOCATE
+	if (t->punch_holes) {
+		if (fallocate(t->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      off, len) == 0) {
+			if (show_stats)
+				counter_add(&stat_punched, len);
+			return;
+		}
+		t->punch_holes = 0;
+	}
+#endif
+	for (; len; off += n, len -= n) {
+		n = MIN(len, XFS_MD2_MAX_CHUNK);
+		queue_write(t, off, get_zero_buf(), n);
+		flush_pending(t);
+	}
+}
+
+static inline int
+is_zero_block(
+	char			*p)
+{
+	return !p[0] && !memcmp(p, p + 1, BBSIZE - 1);
+}
+
+/* queue the data of a run and punch out its long stretches of zeroes */
+static void
+write_run(
+	struct target		*t,
+	struct run		*r)
+{
+	size_t			done = 0;
+	size_t			zstart;
+	size_t			z;
+
+	while (done < r->len) {
+		for (z = zstart = done; z < r->len; ) {
+			if (!is_zero_block(r->data + z)) {
+				z += BBSIZE;
+				zstart = z;
+				continue;
+			}
+			z += BBSIZE;
+			if (z - zstart >= MIN_HOLE_SIZE)
+				break;
+		}
+		if (z - zstart < MIN_HOLE_SIZE) {
+			queue_write(t, r->off + done, r->data + done,
+				    r->len - done);
 			break;
+		}
 
-		if (fread(metablock, block_size, 1, src_f) != 1)
-			fatal("error reading from file: %s\n", strerror(errno));
+		/* extend the zeroes as far as they go */
+		while (z < r->len && is_zero_block(r->data + z))
+			z += BBSIZE;
+		if (zstart > done)
+			queue_write(t, r->off + done, r->data + done,
+				    zstart - done);
+		flush_pending(t);
+		zero_range(t, r->off + zstart, z - zstart);
+		done = z;
+	}
+}
 
-		mb_count = be16_to_cpu(metablock->mb_count);
-		if (mb_count == 0)
+static void
+write_runs(
+	struct target		*t)
+{
+	struct stat_clock	clock;
+	int			i;
+
+	stat_start(&clock);
+	for (i = 0; i < nruns; i++)
+		write_run(t, &runs[i]);
+	flush_pending(t);
+	stat_stop(STAT_WRITE, &clock);
+}
+
+/* writer thread of a target, writes out every set of runs handed out */
+static void *
+writer(
+	void			*arg)
+{
+	struct target		*t = arg;
+
+	pthread_mutex_lock(&write_lock);
+	for (;;) {
+		while (t->gen == write_gen && !writers_stop)
+			pthread_cond_wait(&write_cond, &write_lock);
+		if (t->gen == write_gen)
 			break;
-		if (mb_count > max_indicies)
-			fatal("bad block count: %u\n", mb_count);
+		t->gen = write_gen;
+		pthread_mutex_unlock(&write_lock);
 
-		if (fread(block_buffer, mb_count << tmb.mb_blocklog, 
-								1, src_f) != 1)
-			fatal("error reading from file: %s\n", strerror(errno));
+		write_runs(t);
 
-		bytes_read += block_size;
+		pthread_mutex_lock(&write_lock);
+		if (--writes_left == 0)
+			pthread_cond_broadcast(&write_cond);
 	}
+	pthread_mutex_unlock(&write_lock);
+	return NULL;
+}
 
-	if (progress_since_warning)
-		putchar('\n');
+/*
+ * Write out all runs collected so far.  They go out in disk address order
+ * unless some of them overlap, in which case the dump order decides which
+ * copy of a block ends up on disk.  With several targets, all of their
+ * writers get the same runs and are waited for, as the runs point into
+ * buffers that are reused for the next batch.
+ */
+static void
+flush_runs(void)
+{
+	int			i;
 
-	memset(block_buffer, 0, sb.sb_sectsize);
-	sb.sb_inprogress = 0;
-	libxfs_sb_to_disk((xfs_dsb_t *)block_buffer, &sb);
-	if (xfs_sb_version_hascrc(&sb)) {
-		xfs_update_cksum(block_buffer, sb.sb_sectsize,
-				 offsetof(struct xfs_sb, sb_crc));
+	qsort(runs, nruns, sizeof(*runs), run_off_cmp);
+	for (i = 0; i + 1 < nruns; i++) {
+		if (runs[i].off + runs[i].len > runs[i + 1].off) {
+			qsort(runs, nruns, sizeof(*runs), run_seq_cmp);
+			break;
+		}
 	}
 
-	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
-		fatal("error writing primary superblock: %s\n", strerror(errno));
+	if (ntargets == 1) {
+		write_runs(&targets[0]);
+	} else {
+		pthread_mutex_lock(&write_lock);
+		writes_left = ntargets;
+		write_gen++;
+		pthread_cond_broadcast(&write_cond);
+		while (writes_left)
+			pthread_cond_wait(&write_cond, &write_lock);
+		pthread_mutex_unlock(&write_lock);
+	}
+	nruns = 0;
+	arena_len = 0;
+}
+
+/* collect the blocks of a version 1 metablock */
+static void
+add_metablock(
+	xfs_metablock_t		*mb)
+{
+	__be64			*block_index;
+	char			*block_buffer;
+	int			mb_count = be16_to_cpu(mb->mb_count);
+	int			i;
+
+	block_index = (__be64 *)((char *)mb + sizeof(xfs_metablock_t));
+	block_buffer = (char *)mb + block_size;
+	for (i = 0; i < mb_count; i++)
+		add_run(be64_to_cpu(block_index[i]),
+			block_buffer + (i << mb->mb_blocklog),
+			1 << mb->mb_blocklog);
+}
+
+/* uncompress a version 2 chunk into the arena and collect its extents */
+static char *
+add_chunk(
+	xfs_md2_chunk_t		*chunk)
+{
+	xfs_md2_extent_t	*extents = (xfs_md2_extent_t *)(chunk + 1);
+	__uint32_t		nextents = be32_to_cpu(chunk->mc_nextents);
+	__uint32_t		dlen = be32_to_cpu(chunk->mc_dlen);
+	__uint32_t		clen = be32_to_cpu(chunk->mc_clen);
+	char			*cbuf = (char *)(extents + nextents);
+	char			*data;
+	struct stat_clock	clock;
+	__uint32_t		len;
+	size_t			off;
+	int			i;
+
+	if (chunk->mc_compression == XFS_MD2_COMP_ZERO) {
+		data = get_zero_buf();
+		goto add_extents;
+	}
 
-	free(metablock);
+	if (arena_len + dlen > XFS_MD2_MAX_CHUNK * 2)
+		flush_runs();
+	data = arena + arena_len;
+
+	stat_start(&clock);
+	switch (chunk->mc_compression) {
+	case XFS_MD2_COMP_NONE:
+		memcpy(data, cbuf, dlen);
+		break;
+#ifdef HAVE_ZLIB
+	case XFS_MD2_COMP_ZLIB: {
+		uLongf	zlen = dlen;
+
+		if (uncompress((Bytef *)data, &zlen, (Bytef *)cbuf,
+				clen) != Z_OK || zlen != dlen)
+			fatal("corrupt metadata dump chunk\n");
+		break;
+	}
+#endif
+	default:
+		fatal("unsupported metadata dump compression %u\n",
+			chunk->mc_compression);
+	}
+	stat_stop(STAT_DECOMPRESS, &clock);
+	arena_len += dlen;
+
+add_extents:
+	for (i = 0, off = 0; i < nextents; i++) {
+		len = be32_to_cpu(extents[i].me_len);
+		if (len > ((dlen - off) >> BBSHIFT))
+			fatal("bad extent in metadata dump chunk\n");
+		add_run(be64_to_cpu(extents[i].me_daddr), data + off,
+			len << BBSHIFT);
+		off += len << BBSHIFT;
+	}
+	return data;
+}
+
+static void
+perform_restore(void)
+{
+	struct batch		*b;
+	pthread_t		tid;
+	char			*rec;
+	char			*sb_buf = NULL;
+	int			first = 1;
+	int			i;
+
+	if (md_version == 1) {
+		block_size = 1 << first_mb.mb_blocklog;
+		max_indicies = (block_size - sizeof(xfs_metablock_t)) /
+				sizeof(__be64);
+	} else {
+		cbuf_size = XFS_MD2_MAX_CHUNK;
+#ifdef HAVE_ZLIB
+		cbuf_size = MAX(cbuf_size, compressBound(XFS_MD2_MAX_CHUNK));
+#endif
+		arena = memalign(BBSIZE, XFS_MD2_MAX_CHUNK * 2);
+		if (arena == NULL)
+			fatal("memory allocation failure\n");
+	}
+
+	for (i = 0; i < NUM_BATCHES; i++) {
+		b = &batches[i];
+		b->full = 0;
+		b->size = BATCH_SIZE;
+		if (md_version == 2)
+			b->size += sizeof(xfs_md2_chunk_t) + cbuf_size +
+				(XFS_MD2_MAX_CHUNK >> BBSHIFT) *
+					sizeof(xfs_md2_extent_t);
+		b->buf = memalign(BBSIZE, b->size);
+		if (b->buf == NULL)
+			fatal("memory allocation failure\n");
+	}
+
+	if (pthread_create(&tid, NULL, reader, NULL))
+		fatal("cannot create reader thread: %s\n", strerror(errno));
+
+	for (i = 0; ; i++) {
+		b = get_batch(i, 1);
+
+		for (rec = b->buf; rec < b->buf + b->len; ) {
+			if (md_version == 1) {
+				xfs_metablock_t	*mb = (xfs_metablock_t *)rec;
+
+				if (first && full_dump && *(__be64 *)(mb + 1) != 0)
+					fatal("first block is not the primary superblock\n");
+				add_metablock(mb);
+				sb_buf = rec + block_size;
+				rec += block_size +
+					(be16_to_cpu(mb->mb_count) <<
+						mb->mb_blocklog);
+			} else {
+				xfs_md2_chunk_t	*chunk = (xfs_md2_chunk_t *)rec;
+				xfs_md2_extent_t *ext;
+
+				ext = (xfs_md2_extent_t *)(chunk + 1);
+				if (first && full_dump &&
+				    be64_to_cpu(ext->me_daddr) != 0)
+					fatal("first block is not the primary superblock\n");
+				sb_buf = add_chunk(chunk);
+
+				/* keep it in progress until the last dump */
+				if (!full_dump && be64_to_cpu(ext->me_daddr) == 0 &&
+				    chunk->mc_compression != XFS_MD2_COMP_ZERO)
+					((xfs_dsb_t *)sb_buf)->sb_inprogress = 1;
+				rec += sizeof(*chunk) +
+					be32_to_cpu(chunk->mc_nextents) *
+						sizeof(*ext) +
+					be32_to_cpu(chunk->mc_clen);
+			}
+
+			/*
+			 * read in first blocks (superblock 0), set "inprogress"
+			 * flag for it, read in the rest of the file, and if
+			 * complete, clear SB 0's "inprogress flag"
+			 */
+			if (first && full_dump)
+				setup_targets(sb_buf);
+			first = 0;
+		}
+		flush_runs();
+
+		bytes_read += b->len;
+		if (show_progress)
+			print_progress("%lld MB read", bytes_read >> 20);
+
+		if (b->last)
+			break;
+		put_batch(b, 0);
+	}
+	pthread_join(tid, NULL);
+
+	for (i = 0; i < NUM_BATCHES; i++)
+		free(batches[i].buf);
+	free(arena);
+	arena = NULL;
+}
+
+static void
+report_stats(
+	__uint64_t		wall_start)
+{
+	struct rusage		ru;
+	double			elapsed;
+
+	getrusage(RUSAGE_SELF, &ru);
+	elapsed = (stat_now(CLOCK_MONOTONIC) - wall_start) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	fprintf(stderr, "%-24s %.3f\n", "elapsed_seconds", elapsed);
+	fprintf(stderr, "%-24s %lld\n", "dump_bytes", (long long)bytes_read);
+	fprintf(stderr, "%-24s %llu\n", "blocks",
+		(unsigned long long)stat_blocks);
+	fprintf(stderr, "%-24s %.1f\n", "blocks_per_second",
+		stat_blocks / elapsed);
+	fprintf(stderr, "%-24s %.2f\n", "mb_per_second",
+		(double)(stat_blocks << BBSHIFT) / elapsed / (1 << 20));
+	fprintf(stderr, "%-24s %llu\n", "written_bytes",
+		(unsigned long long)counter_read(&stat_written));
+	fprintf(stderr, "%-24s %llu\n", "punched_bytes",
+		(unsigned long long)counter_read(&stat_punched));
+	fprintf(stderr, "%-24s %.3f\n", "cpu_seconds",
+		ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+	fprintf(stderr, "%-24s %.3f\n", "read_cpu_seconds",
+		counter_read(&stat_cpu[STAT_READ]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "read_wall_seconds",
+		counter_read(&stat_wall[STAT_READ]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "decompress_cpu_seconds",
+		counter_read(&stat_cpu[STAT_DECOMPRESS]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "write_cpu_seconds",
+		counter_read(&stat_cpu[STAT_WRITE]) / 1e9);
+	fprintf(stderr, "%-24s %.3f\n", "write_wall_seconds",
+		counter_read(&stat_wall[STAT_WRITE]) / 1e9);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] source target\n", progname);
+	fprintf(stderr, "Usage: %s [-V] [-d] [-g] [-s] [-t target]... "
+		"source [delta ...] target\n", progname);
 	exit(1);
 }
 
 extern int	platform_check_ismounted(char *, char *, struct stat64 *, int);
 
+/*
+ * Open a dump and read its header.  The first dump has to be a full one,
+ * the deltas after it have their record of the chain skipped, the chain
+ * has been checked before anything was restored.
+ */
+static void
+open_source(
+	char		*path,
+	int		full)
+{
+	union {
+		xfs_metablock_t	v1;
+		xfs_md2_hdr_t	v2;
+	} hdr;
+	xfs_md2_delta_t	delta;
+	__be32		*ids;
+	__uint32_t	count;
+
+	if (strcmp(path, "-") == 0) {
+		src_f = stdin;
+		if (isatty(fileno(stdin)))
+			fatal("cannot read from a terminal\n");
+	} else {
+		src_f = fopen(path, "rb");
+		if (src_f == NULL)
+			fatal("cannot open source dump file %s\n", path);
+	}
+
+	if (fread(&hdr.v1, sizeof(hdr.v1), 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	switch (be32_to_cpu(hdr.v1.mb_magic)) {
+	case XFS_MD_MAGIC:
+		md_version = 1;
+		first_mb = hdr.v1;
+		break;
+	case XFS_MD2_MAGIC:
+		if (fread((char *)&hdr.v2 + sizeof(hdr.v1),
+				sizeof(hdr.v2) - sizeof(hdr.v1), 1, src_f) != 1)
+			fatal("error reading from file: %s\n", strerror(errno));
+		if (be32_to_cpu(hdr.v2.mh_version) != XFS_MD2_VERSION ||
+		    hdr.v2.mh_blocklog != BBSHIFT)
+			fatal("unsupported metadata dump version %u\n",
+				be32_to_cpu(hdr.v2.mh_version));
+		md_version = 2;
+		break;
+	default:
+		fatal("specified file is not a metadata dump\n");
+	}
+
+	full_dump = md_version == 1 ||
+		    !(be32_to_cpu(hdr.v2.mh_flags) & XFS_MD2_FLAG_DELTA);
+	if (full && !full_dump)
+		fatal("%s is a delta metadump, restore it after the dumps "
+			"it was taken against\n", path);
+	if (!full && full_dump)
+		fatal("%s is not a delta metadump\n", path);
+	if (full_dump)
+		return;
+
+	read_dump(&delta, sizeof(delta));
+	count = be32_to_cpu(delta.md_count);
+	if (be32_to_cpu(delta.md_magic) != XFS_MD2_DELTA_MAGIC ||
+	    count == 0 || count > XFS_MD2_MAX_CHAIN)
+		fatal("bad delta header in %s\n", path);
+	ids = malloc(count * sizeof(*ids));
+	if (ids == NULL)
+		fatal("memory allocation failure\n");
+	read_dump(ids, count * sizeof(*ids));
+	free(ids);
+}
+
+static void
+open_target(
+	struct target	*t,
+	char		*path,
+	int		direct)
+{
+	int		open_flags;
+	struct stat64	statbuf;
+
+	t->path = path;
+	t->direct_fd = -1;
+	t->punch_holes = 1;
+
+	/* check and open target */
+	open_flags = O_RDWR;
+	t->is_file = 0;
+	if (stat64(path, &statbuf) < 0)  {
+		/* ok, assume it's a file and create it */
+		open_flags |= O_CREAT;
+		t->is_file = 1;
+	} else if (S_ISREG(statbuf.st_mode))  {
+		open_flags |= O_TRUNC;
+		t->is_file = 1;
+	} else  {
+		/*
+		 * check to make sure a filesystem isn't mounted on the device
+		 */
+		if (platform_check_ismounted(path, NULL, &statbuf, 0))
+			fatal("a filesystem is mounted on target device \"%s\","
+				" cannot restore to a mounted filesystem.\n",
+				path);
+	}
+
+	t->fd = open(path, open_flags, 0644);
+	if (t->fd < 0)
+		fatal("couldn't open target \"%s\"\n", path);
+
+	/*
+	 * Direct I/O goes through a second descriptor, so that anything it
+	 * refuses can still be written through the page cache.
+	 */
+	if (direct) {
+		t->direct_fd = open(path, O_RDWR | O_DIRECT);
+		if (t->direct_fd < 0)
+			fprintf(stderr, "%s: cannot use direct I/O on \"%s\": "
+				"%s\n", progname, path, strerror(errno));
+	}
+}
+
 int
 main(
 	int 		argc,
 	char 		**argv)
 {
-	FILE		*src_f;
-	int		dst_fd;
+	int		direct = 0;
 	int		c;
-	int		open_flags;
-	struct stat64	statbuf;
-	int		is_target_file;
+	__uint64_t	wall_start;
+	int		i;
+	int		nsources;
+	char		**paths;
+	struct target	*t;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "gV")) != EOF) {
+	/* the targets given with -t and the last argument */
+	paths = calloc(argc, sizeof(*paths));
+	if (paths == NULL)
+		fatal("memory allocation failure\n");
+
+	while ((c = getopt(argc, argv, "dgst:V")) != EOF) {
 		switch (c) {
+			case 'd':
+				direct = 1;
+				break;
 			case 'g':
 				show_progress = 1;
 				break;
+			case 's':
+				show_stats = 1;
+				break;
+			case 't':
+				paths[ntargets++] = optarg;
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -216,50 +1100,70 @@ main(
 		}
 	}
 
-	if (argc - optind != 2)
+	nsources = argc - optind - 1;
+	if (nsources < 1)
 		usage();
+	paths[ntargets++] = argv[argc - 1];
 
-	/* open source */
-	if (strcmp(argv[optind], "-") == 0) {
-		src_f = stdin;
-		if (isatty(fileno(stdin)))
-			fatal("cannot read from a terminal\n");
-	} else {
-		src_f = fopen(argv[optind], "rb");
-		if (src_f == NULL)
-			fatal("cannot open source dump file\n");
+	wall_start = stat_now(CLOCK_MONOTONIC);
+
+	/* make sure the chain fits together before touching the targets */
+	if (nsources > 1) {
+		for (i = 0; i < nsources; i++)
+			if (strcmp(argv[optind + i], "-") == 0)
+				fatal("can't read a chain of dumps from stdin\n");
+		mdump_close(mdump_open_chain(nsources, &argv[optind]));
 	}
-	optind++;
 
-	/* check and open target */
-	open_flags = O_RDWR;
-	is_target_file = 0;
-	if (stat64(argv[optind], &statbuf) < 0)  {
-		/* ok, assume it's a file and create it */
-		open_flags |= O_CREAT;
-		is_target_file = 1;
-	} else if (S_ISREG(statbuf.st_mode))  {
-		open_flags |= O_TRUNC;
-		is_target_file = 1;
-	} else  {
-		/*
-		 * check to make sure a filesystem isn't mounted on the device
-		 */
-		if (platform_check_ismounted(argv[optind], NULL, &statbuf, 0))
-			fatal("a filesystem is mounted on target device \"%s\","
-				" cannot restore to a mounted filesystem.\n",
-				argv[optind]);
+	/* open the first source before creating the targets */
+	open_source(argv[optind], 1);
+
+	targets = calloc(ntargets, sizeof(*targets));
+	if (targets == NULL)
+		fatal("memory allocation failure\n");
+	for (i = 0; i < ntargets; i++)
+		open_target(&targets[i], paths[i], direct);
+
+	if (ntargets > 1) {
+		for (t = targets; t < targets + ntargets; t++)
+			if (pthread_create(&t->tid, NULL, writer, t))
+				fatal("cannot create writer thread: %s\n",
+					strerror(errno));
 	}
 
-	dst_fd = open(argv[optind], open_flags, 0644);
-	if (dst_fd < 0)
-		fatal("couldn't open target \"%s\"\n", argv[optind]);
+	for (i = 0; i < nsources; i++) {
+		if (i)
+			open_source(argv[optind + i], 0);
+		perform_restore();
+		if (src_f != stdin)
+			fclose(src_f);
+	}
+
+	if (ntargets > 1) {
+		pthread_mutex_lock(&write_lock);
+		writers_stop = 1;
+		pthread_cond_broadcast(&write_cond);
+		pthread_mutex_unlock(&write_lock);
+		for (t = targets; t < targets + ntargets; t++)
+			pthread_join(t->tid, NULL);
+	}
 
-	perform_restore(src_f, dst_fd, is_target_file);
+	if (progress_since_warning)
+		putchar('\n');
+
+	for (t = targets; t < targets + ntargets; t++) {
+		finish_target(t);
+		if (t->direct_fd >= 0)
+			close(t->direct_fd);
+		close(t->fd);
+	}
+	free(targets);
+	free(paths);
+	free(runs);
+	free(zero_buf);
 
-	close(dst_fd);
-	if (src_f != stdin)
-		fclose(src_f);
+	if (show_stats)
+		report_stats(wall_start);
 
 	return 0;
 }
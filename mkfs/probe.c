@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * probe.c
+ *
+ * Measure how a data device behaves under load, for mkfs -P to pick the
+ * geometry from: how far small random reads scale with queue depth, and
+ * how bandwidth grows with the I/O size.  Only reads are issued, so the
+ * probe is safe to run with -N too.
+ */
+
+#include "libxfs.h"
+#include <pthread.h>
+#include "xfs_mkfs.h"
+
+#define PROBE_USEC		250000		/* per measurement */
+#define PROBE_MAX_DEPTH		64
+#define PROBE_MIN_IOSIZE	4096
+#define PROBE_MAX_IOSIZE	(1024 * 1024)
+#define PROBE_SCALING		1.3		/* at double the depth */
+
+struct probe_run {
+	int			fd;
+	__uint64_t		size;		/* bytes */
+	size_t			iosize;
+	int			sequential;
+	int			nthreads;
+	struct timeval		start;
+};
+
+struct probe_thread {
+	pthread_t		tid;
+	struct probe_run	*run;
+	int			index;
+	long long		ops;
+	int			error;
+};
+
+static long long
+probe_elapsed(
+	struct timeval		*start)
+{
+	struct timeval		now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000LL +
+		now.tv_usec - start->tv_usec;
+}
+
+static void *
+probe_thread(
+	void			*arg)
+{
+	struct probe_thread	*pt = arg;
+	struct probe_run	*run = pt->run;
+	__uint64_t		nios = run->size / run->iosize;
+	__uint64_t		next;
+	unsigned int		seed = pt->index + 1;
+	ssize_t			bytes;
+	void			*buf;
+
+	buf = memalign(libxfs_device_alignment(), run->iosize);
+	if (!buf) {
+		pt->error = ENOMEM;
+		return NULL;
+	}
+	/* sequential readers each start on their own part of the device */
+	next = nios / run->nthreads * pt->index;
+	while (probe_elapsed(&run->start) < PROBE_USEC) {
+		if (!run->sequential)
+			next = (((__uint64_t)rand_r(&seed) << 31) ^
+				rand_r(&seed)) % nios;
+		else if (next >= nios)
+			next = 0;
+		bytes = pread64(run->fd, buf, run->iosize, next * run->iosize);
+		if (bytes != run->iosize) {
+			pt->error = bytes < 0 ? errno : EIO;
+			break;
+		}
+		next++;
+		pt->ops++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Read iosize pieces of the device from nthreads threads for PROBE_USEC,
+ * and return the I/Os per second, or -1 if the reads failed.
+ */
+static double
+probe_measure(
+	int			fd,
+	__uint64_t		size,
+	size_t			iosize,
+	int			nthreads,
+	int			sequential)
+{
+	struct probe_run	run;
+	struct probe_thread	threads[PROBE_MAX_DEPTH];
+	long long		ops = 0;
+	long long		usec;
+	int			error = 0;
+	int			i;
+
+	run.fd = fd;
+	run.size = size;
+	run.iosize = iosize;
+	run.sequential = sequential;
+	run.nthreads = nthreads;
+	memset(threads, 0, sizeof(threads));
+	gettimeofday(&run.start, NULL);
+	for (i = 0; i < nthreads; i++) {
+		threads[i].run = &run;
+		threads[i].index = i;
+		if (pthread_create(&threads[i].tid, NULL, probe_thread,
+				   &threads[i])) {
+			nthreads = i;
+			error = 1;
+			break;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+		error |= threads[i].error;
+	}
+	usec = probe_elapsed(&run.start);
+	if (error || !ops || usec <= 0)
+		return -1;
+	return ops * 1000000.0 / usec;
+}
+
+/*
+ * Probe the block device open on fd, which is size bytes long.  Returns 0
+ * and fills in dp, or an error if the device can't be probed.
+ */
+int
+probe_device(
+	int			fd,
+	__uint64_t		size,
+	int			sectorsize,
+	struct dev_probe	*dp)
+{
+	struct stat64		st;
+	size_t			smallio = MAX(PROBE_MIN_IOSIZE, sectorsize);
+	double			bw[32];
+	double			prev;
+	double			cur;
+	size_t			iosize;
+	int			depth;
+	int			i;
+
+	memset(dp, 0, sizeof(*dp));
+	if (fstat64(fd, &st) < 0)
+		return errno;
+	if (!S_ISBLK(st.st_mode))
+		return ENOTBLK;
+	if (size < 16 * PROBE_MAX_IOSIZE)
+		return ENOSPC;
+
+	/* how far do small random reads scale with queue depth? */
+	dp->smallio = smallio;
+	prev = probe_measure(fd, size, smallio, 1, 0);
+	if (prev < 0)
+		return EIO;
+	dp->depth = 1;
+	dp->iops = prev;
+	for (depth = 2; depth <= PROBE_MAX_DEPTH; depth *= 2) {
+		cur = probe_measure(fd, size, smallio, depth, 0);
+		if (cur < 0)
+			return EIO;
+		if (cur < prev * PROBE_SCALING)
+			break;
+		dp->depth = depth;
+		dp->iops = cur;
+		prev = cur;
+	}
+
+	/*
+	 * Where does a single stream of sequential reads stop gaining much
+	 * from larger I/Os?  That's the smallest I/O getting half of the
+	 * best bandwidth seen.
+	 */
+	for (i = 0, iosize = smallio; iosize <= PROBE_MAX_IOSIZE;
+	     i++, iosize *= 2) {
+		bw[i] = probe_measure(fd, size, iosize, 1, 1);
+		if (bw[i] < 0)
+			return EIO;
+		bw[i] *= iosize;
+		dp->bandwidth = MAX(dp->bandwidth, bw[i]);
+	}
+	for (i = 0, iosize = smallio; bw[i] < dp->bandwidth / 2;
+	     i++, iosize *= 2)
+		;
+	dp->iosize = iosize;
+
+	/* and what large reads get with the queue depth the device likes */
+	if (dp->depth > 1) {
+		cur = probe_measure(fd, size, PROBE_MAX_IOSIZE, dp->depth, 0);
+		if (cur < 0)
+			return EIO;
+		dp->bandwidth = MAX(dp->bandwidth, cur * PROBE_MAX_IOSIZE);
+	}
+	return 0;
+}
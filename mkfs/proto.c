@@ -18,6 +18,7 @@
 
 #include "libxfs.h"
 #include <sys/stat.h>
+#include <pthread.h>
 #include "xfs_mkfs.h"
 
 /*
@@ -30,7 +31,10 @@ static void getres(xfs_trans_t *tp, uint blocks);
 static void rsvfile(xfs_mount_t *mp, xfs_inode_t *ip, long long len);
 static int newfile(xfs_trans_t *tp, xfs_inode_t *ip, xfs_bmap_free_t *flist,
 	xfs_fsblock_t *first, int dolocal, int logit, char *buf, int len);
-static char *newregfile(char **pp, int *len);
+static char *getregfile(char **pp, xfs_off_t *len);
+static void newregfile(xfs_trans_t *tp, xfs_inode_t *ip,
+	xfs_bmap_free_t *flist, xfs_fsblock_t *first, char *fname,
+	xfs_off_t len);
 static void rtinit(xfs_mount_t *mp);
 static long filesize(int fd);
 
@@ -278,12 +282,245 @@ newfile(
 	return flags;
 }
 
-static char *
+/*
+ * Regular file data is copied into the filesystem by a few threads while
+ * the main thread goes on creating inodes and directories.  The main
+ * thread allocates the blocks and queues the file with where its extents
+ * ended up; the copiers then only read the source file and write the
+ * device directly in large chunks, and never touch libxfs state, so they
+ * need no locking against the rest of mkfs.
+ */
+#define	COPY_THREADS	8
+#define	COPY_IOSIZE	(1024 * 1024)
+#define	COPY_QUEUED	1024		/* files waiting, at most */
+
+struct copy_extent {
+	xfs_off_t		offset;		/* in the file, bytes */
+	xfs_off_t		daddr;		/* on the device, bytes */
+	xfs_off_t		len;		/* bytes, whole blocks */
+};
+
+struct copy_job {
+	struct copy_job		*next;
+	char			*fname;		/* in the proto buffer */
+	int			devfd;
+	xfs_off_t		size;
+	int			nexts;
+	struct copy_extent	*exts;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* a job was queued */
+	pthread_cond_t		room;		/* a job was taken */
+	struct copy_job		*head;
+	struct copy_job		**tail;
+	int			queued;
+	int			done;		/* no more jobs coming */
+	int			nthreads;
+	pthread_t		threads[COPY_THREADS];
+} copyq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+	.tail = &copyq.head,
+};
+
+static void
+copy_file(
+	struct copy_job		*job,
+	char			*buf)
+{
+	struct copy_extent	*ext;
+	xfs_off_t		off;
+	ssize_t			want;
+	ssize_t			got;
+	ssize_t			n;
+	ssize_t			len;
+	int			fd;
+
+	if ((fd = open(job->fname, O_RDONLY)) < 0) {
+		fprintf(stderr, _("%s: cannot open %s: %s\n"),
+			progname, job->fname, strerror(errno));
+		exit(1);
+	}
+	for (ext = job->exts; ext < &job->exts[job->nexts]; ext++) {
+		for (off = 0; off < ext->len; off += len) {
+			len = MIN(COPY_IOSIZE, ext->len - off);
+			want = MAX(0, MIN(len, job->size - ext->offset - off));
+			for (got = 0; got < want; got += n) {
+				n = pread64(fd, buf + got, want - got,
+					    ext->offset + off + got);
+				if (n < 0) {
+					fprintf(stderr,
+					_("%s: read failed on %s: %s\n"),
+						progname, job->fname,
+						strerror(errno));
+					exit(1);
+				}
+				if (n == 0)	/* shrunk since we sized it */
+					break;
+			}
+			memset(buf + got, 0, len - got);
+			if (pwrite64(job->devfd, buf, len,
+				     ext->daddr + off) != len) {
+				fprintf(stderr,
+				_("%s: write failed copying %s: %s\n"),
+					progname, job->fname, strerror(errno));
+				exit(1);
+			}
+		}
+	}
+	close(fd);
+}
+
+static void *
+copy_thread(
+	void			*arg)
+{
+	struct copy_job		*job;
+	char			*buf;
+
+	buf = memalign(libxfs_device_alignment(), COPY_IOSIZE);
+	if (!buf)
+		fail(_("cannot allocate file copy buffer"), ENOMEM);
+	for (;;) {
+		pthread_mutex_lock(&copyq.lock);
+		while (!copyq.head && !copyq.done)
+			pthread_cond_wait(&copyq.work, &copyq.lock);
+		job = copyq.head;
+		if (job) {
+			copyq.head = job->next;
+			if (!copyq.head)
+				copyq.tail = &copyq.head;
+			copyq.queued--;
+			pthread_cond_signal(&copyq.room);
+		}
+		pthread_mutex_unlock(&copyq.lock);
+		if (!job)
+			break;
+		copy_file(job, buf);
+		free(job->exts);
+		free(job);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void
+copy_queue(
+	struct copy_job		*job)
+{
+	long			ncpus;
+
+	pthread_mutex_lock(&copyq.lock);
+	if (!copyq.nthreads) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		ncpus = MIN(MAX(ncpus, 1), COPY_THREADS);
+		for (; copyq.nthreads < ncpus; copyq.nthreads++)
+			if (pthread_create(&copyq.threads[copyq.nthreads],
+					   NULL, copy_thread, NULL))
+				break;
+		if (!copyq.nthreads)
+			fail(_("cannot start file copy threads"), EAGAIN);
+	}
+	while (copyq.queued >= COPY_QUEUED)
+		pthread_cond_wait(&copyq.room, &copyq.lock);
+	job->next = NULL;
+	*copyq.tail = job;
+	copyq.tail = &job->next;
+	copyq.queued++;
+	pthread_cond_signal(&copyq.work);
+	pthread_mutex_unlock(&copyq.lock);
+}
+
+/* wait for all the queued file data to be written */
+static void
+copy_finish(void)
+{
+	int			i;
+
+	pthread_mutex_lock(&copyq.lock);
+	copyq.done = 1;
+	pthread_cond_broadcast(&copyq.work);
+	pthread_mutex_unlock(&copyq.lock);
+	for (i = 0; i < copyq.nthreads; i++)
+		pthread_join(copyq.threads[i], NULL);
+	copyq.nthreads = 0;
+}
+
+/*
+ * Allocate the blocks for a regular file of len bytes, and queue its data
+ * to be copied in from fname.
+ */
+static void
 newregfile(
+	xfs_trans_t		*tp,
+	xfs_inode_t		*ip,
+	xfs_bmap_free_t		*flist,
+	xfs_fsblock_t		*first,
+	char			*fname,
+	xfs_off_t		len)
+{
+	xfs_mount_t		*mp = ip->i_mount;
+	xfs_bmbt_irec_t		map[XFS_BMAP_MAX_NMAP];
+	struct copy_job		*job;
+	xfs_fileoff_t		bno;
+	xfs_extlen_t		nb;
+	int			error;
+	int			nmap;
+	int			rt;
+	int			i;
+
+	ip->i_d.di_size = len;
+	if (len == 0)
+		return;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		fail(_("cannot allocate file copy job"), ENOMEM);
+	rt = XFS_IS_REALTIME_INODE(ip);
+	job->fname = fname;
+	job->size = len;
+	job->devfd = libxfs_device_to_fd(rt ? mp->m_rtdev_targp->dev :
+					      mp->m_ddev_targp->dev);
+
+	nb = XFS_B_TO_FSB(mp, len);
+	for (bno = 0; bno < nb; ) {
+		nmap = XFS_BMAP_MAX_NMAP;
+		error = -libxfs_bmapi_write(tp, ip, bno, nb - bno, 0, first,
+				nb - bno, map, &nmap, flist);
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		if (nmap == 0) {
+			fprintf(stderr,
+				_("%s: cannot allocate space for file\n"),
+				progname);
+			exit(1);
+		}
+		job->exts = realloc(job->exts,
+				(job->nexts + nmap) * sizeof(*job->exts));
+		if (!job->exts)
+			fail(_("cannot allocate file copy job"), ENOMEM);
+		for (i = 0; i < nmap; i++) {
+			struct copy_extent *ext = &job->exts[job->nexts++];
+
+			ext->offset = XFS_FSB_TO_B(mp, map[i].br_startoff);
+			ext->daddr = BBTOB(rt ?
+				XFS_FSB_TO_BB(mp, map[i].br_startblock) :
+				XFS_FSB_TO_DADDR(mp, map[i].br_startblock));
+			ext->len = XFS_FSB_TO_B(mp, map[i].br_blockcount);
+			bno += map[i].br_blockcount;
+		}
+	}
+	copy_queue(job);
+}
+
+/* open the next file named in the prototype, and return its size */
+static char *
+getregfile(
 	char		**pp,
-	int		*len)
+	xfs_off_t	*len)
 {
-	char		*buf;
 	int		fd;
 	char		*fname;
 	long		size;
@@ -294,17 +531,9 @@ newregfile(
 			progname, fname, strerror(errno));
 		exit(1);
 	}
-	if ((*len = (int)size)) {
-		buf = malloc(size);
-		if (read(fd, buf, size) < size) {
-			fprintf(stderr, _("%s: read failed on %s: %s\n"),
-				progname, fname, strerror(errno));
-			exit(1);
-		}
-	} else
-		buf = 0;
 	close(fd);
-	return buf;
+	*len = size;
+	return fname;
 }
 
 static void
@@ -358,6 +587,7 @@ parseproto(
 #define	IF_FIFO		6
 
 	char		*buf;
+	char		*fname;
 	int		committed;
 	int		error;
 	xfs_fsblock_t	first;
@@ -367,7 +597,7 @@ parseproto(
 	int		i;
 	xfs_inode_t	*ip;
 	int		len;
-	long long	llen;
+	xfs_off_t	llen;
 	int		majdev;
 	int		mindev;
 	int		mode;
@@ -451,15 +681,13 @@ parseproto(
 	xfs_bmap_init(&flist, &first);
 	switch (fmt) {
 	case IF_REGULAR:
-		buf = newregfile(pp, &len);
-		getres(tp, XFS_B_TO_FSB(mp, len));
+		fname = getregfile(pp, &llen);
+		getres(tp, XFS_B_TO_FSB(mp, llen));
 		error = -libxfs_inode_alloc(&tp, pip, mode|S_IFREG, 1, 0,
 					   &creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode allocation failed"), error);
-		flags |= newfile(tp, ip, &flist, &first, 0, 0, buf, len);
-		if (buf)
-			free(buf);
+		newregfile(tp, ip, &flist, &first, fname, llen);
 		libxfs_trans_ijoin(tp, pip, 0);
 		xname.type = XFS_DIR3_FT_REG_FILE;
 		newdirent(mp, tp, pip, &xname, ip->i_ino, &first, &flist);
@@ -605,6 +833,306 @@ parse_proto(
 	char		**pp)
 {
 	parseproto(mp, NULL, fsx, pp, NULL);
+	copy_finish();
+}
+
+/*
+ * Fill the filesystem with a synthetic tree for performance testing (-G).
+ * Directories are filled breadth first, with just enough subdirectories
+ * in each for the rest of the inodes to fit, so the tree stays as shallow
+ * as the fan-out allows.  File blocks are allocated but never written, so
+ * on a sparse image file this goes as fast as the metadata can be built.
+ * Every choice comes from rand_r on the seed, so the same options always
+ * make the same image.
+ */
+struct populate {
+	xfs_mount_t		*mp;
+	struct fsxattr		*fsxp;
+	struct populate_opts	*po;
+	unsigned int		seed;
+	cred_t			creds;
+	xfs_ino_t		*queue;		/* directories to fill */
+	__uint64_t		qsize;
+	__uint64_t		head;
+	__uint64_t		tail;
+	__uint64_t		created;	/* inodes, besides the root */
+	xfs_inode_t		**frag;		/* files to interleave */
+	unsigned char		*attrval;
+};
+
+static int
+pop_chance(
+	struct populate		*pop,
+	int			pct)
+{
+	return pct && rand_r(&pop->seed) % 100 < pct;
+}
+
+static void
+pop_queue(
+	struct populate		*pop,
+	xfs_ino_t		ino)
+{
+	if (pop->tail == pop->qsize) {
+		pop->qsize = pop->qsize ? pop->qsize * 2 : 1024;
+		pop->queue = realloc(pop->queue,
+				pop->qsize * sizeof(*pop->queue));
+		if (!pop->queue)
+			fail(_("cannot allocate directory queue"), ENOMEM);
+	}
+	pop->queue[pop->tail++] = ino;
+}
+
+/* make an inode and its entry in dp, in one transaction */
+static xfs_inode_t *
+pop_create(
+	struct populate		*pop,
+	xfs_inode_t		*dp,
+	int			mode,
+	char			*name)
+{
+	xfs_mount_t		*mp = pop->mp;
+	xfs_trans_t		*tp;
+	xfs_inode_t		*ip;
+	xfs_fsblock_t		first;
+	xfs_bmap_free_t		flist;
+	struct xfs_name		xname;
+	int			committed;
+	int			error;
+
+	xname.name = (unsigned char *)name;
+	xname.len = strlen(name);
+	xname.type = S_ISDIR(mode) ? XFS_DIR3_FT_DIR : XFS_DIR3_FT_REG_FILE;
+	tp = libxfs_trans_alloc(mp, 0);
+	xfs_bmap_init(&flist, &first);
+	getres(tp, 0);
+	error = -libxfs_inode_alloc(&tp, dp, mode, 1, 0, &pop->creds,
+				   pop->fsxp, &ip);
+	if (error)
+		fail(_("Inode allocation failed"), error);
+	libxfs_trans_ijoin(tp, dp, 0);
+	newdirent(mp, tp, dp, &xname, ip->i_ino, &first, &flist);
+	if (S_ISDIR(mode)) {
+		ip->i_d.di_nlink++;		/* account for . */
+		dp->i_d.di_nlink++;
+		libxfs_trans_log_inode(tp, dp, XFS_ILOG_CORE);
+		newdirectory(mp, tp, ip, dp);
+	} else
+		ip->i_d.di_size = pop->po->size;
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	error = -libxfs_bmap_finish(&tp, &flist, &committed);
+	if (error)
+		fail(_("Synthetic file creation failed"), error);
+	libxfs_trans_commit(tp);
+	pop->created++;
+	return ip;
+}
+
+/* give ip another name in dp */
+static void
+pop_link(
+	struct populate		*pop,
+	xfs_inode_t		*dp,
+	xfs_inode_t		*ip,
+	char			*name)
+{
+	xfs_mount_t		*mp = pop->mp;
+	xfs_trans_t		*tp;
+	xfs_fsblock_t		first;
+	xfs_bmap_free_t		flist;
+	struct xfs_name		xname;
+	int			committed;
+	int			error;
+
+	xname.name = (unsigned char *)name;
+	xname.len = strlen(name);
+	xname.type = XFS_DIR3_FT_REG_FILE;
+	tp = libxfs_trans_alloc(mp, 0);
+	xfs_bmap_init(&flist, &first);
+	getres(tp, 0);
+	libxfs_trans_ijoin(tp, ip, 0);
+	libxfs_trans_ijoin(tp, dp, 0);
+	newdirent(mp, tp, dp, &xname, ip->i_ino, &first, &flist);
+	ip->i_d.di_nlink++;
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	error = -libxfs_bmap_finish(&tp, &flist, &committed);
+	if (error)
+		fail(_("Synthetic link creation failed"), error);
+	libxfs_trans_commit(tp);
+	pop->po->made_links++;
+}
+
+/* allocate len blocks of ip from bno, without writing them */
+static void
+pop_alloc(
+	struct populate		*pop,
+	xfs_inode_t		*ip,
+	xfs_fileoff_t		bno,
+	xfs_extlen_t		len)
+{
+	xfs_mount_t		*mp = pop->mp;
+	xfs_bmbt_irec_t		map[XFS_BMAP_MAX_NMAP];
+	xfs_trans_t		*tp;
+	xfs_fsblock_t		first;
+	xfs_bmap_free_t		flist;
+	int			committed;
+	int			error;
+	int			nmap;
+	int			i;
+
+	while (len > 0) {
+		tp = libxfs_trans_alloc(mp, 0);
+		xfs_bmap_init(&flist, &first);
+		getres(tp, len);
+		libxfs_trans_ijoin(tp, ip, 0);
+		nmap = XFS_BMAP_MAX_NMAP;
+		error = -libxfs_bmapi_write(tp, ip, bno, len, 0, &first, len,
+				map, &nmap, &flist);
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		if (nmap == 0) {
+			fprintf(stderr,
+				_("%s: cannot allocate space for file\n"),
+				progname);
+			exit(1);
+		}
+		for (i = 0; i < nmap; i++) {
+			bno += map[i].br_blockcount;
+			len -= map[i].br_blockcount;
+		}
+		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+		error = -libxfs_bmap_finish(&tp, &flist, &committed);
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		libxfs_trans_commit(tp);
+	}
+}
+
+static void
+pop_xattrs(
+	struct populate		*pop,
+	xfs_inode_t		*ip)
+{
+	struct populate_opts	*po = pop->po;
+	char			name[16];
+	int			error;
+	int			i;
+
+	if (!pop_chance(pop, po->xattrs))
+		return;
+	for (i = 0; i < po->nattrs; i++) {
+		snprintf(name, sizeof(name), "a%d", i);
+		error = -libxfs_attr_set(ip, (unsigned char *)name,
+				pop->attrval, po->attrsize, 0);
+		if (error)
+			fail(_("error setting an attribute"), error);
+	}
+	po->made_attrs += po->nattrs;
+}
+
+static void
+pop_fill_dir(
+	struct populate		*pop,
+	xfs_ino_t		dino)
+{
+	struct populate_opts	*po = pop->po;
+	xfs_mount_t		*mp = pop->mp;
+	xfs_extlen_t		nb = XFS_B_TO_FSB(mp, po->size);
+	xfs_inode_t		*dp;
+	xfs_inode_t		*ip;
+	__uint64_t		left;
+	__uint64_t		room;
+	__uint64_t		nsub = 0;
+	xfs_fileoff_t		bno;
+	char			name[32];
+	int			nfrag = 0;
+	int			error;
+	int			i;
+
+	error = -libxfs_iget(mp, NULL, dino, 0, &dp, 0);
+	if (error)
+		fail(_("cannot read a synthetic directory"), error);
+
+	/*
+	 * Each directory still queued, and this one, has room for fanout
+	 * entries.  If that's not enough, put enough subdirectories at the
+	 * end of this one to take the rest, but no more than a quarter of
+	 * it, so that most of every directory is files.
+	 */
+	left = po->inodes - pop->created;
+	room = (pop->tail - pop->head + 1) * po->fanout;
+	if (left > room)
+		nsub = MIN(MAX(1, po->fanout / 4),
+			   (left - room + po->fanout - 2) / (po->fanout - 1));
+
+	for (i = 0; i < po->fanout && pop->created < po->inodes; i++) {
+		if (i >= po->fanout - nsub) {
+			snprintf(name, sizeof(name), "d%llu",
+				(unsigned long long)po->made_dirs);
+			ip = pop_create(pop, dp, S_IFDIR | 0755, name);
+			po->made_dirs++;
+			pop_queue(pop, ip->i_ino);
+			pop_xattrs(pop, ip);
+			IRELE(ip);
+			continue;
+		}
+		snprintf(name, sizeof(name), "f%llu",
+			(unsigned long long)po->made_files);
+		ip = pop_create(pop, dp, S_IFREG | 0644, name);
+		po->made_files++;
+		if (pop_chance(pop, po->links)) {
+			strcat(name, ".l");
+			pop_link(pop, dp, ip, name);
+		}
+		pop_xattrs(pop, ip);
+		if (nb > 1 && pop_chance(pop, po->frag)) {
+			pop->frag[nfrag++] = ip;
+			continue;
+		}
+		pop_alloc(pop, ip, 0, nb);
+		IRELE(ip);
+	}
+
+	/*
+	 * Allocate the fragmented files a block at a time, taking turns, so
+	 * that each one ends up with a separate extent for every block.
+	 */
+	for (bno = 0; bno < nb && nfrag; bno++)
+		for (i = 0; i < nfrag; i++)
+			pop_alloc(pop, pop->frag[i], bno, 1);
+	for (i = 0; i < nfrag; i++)
+		IRELE(pop->frag[i]);
+	IRELE(dp);
+}
+
+void
+populate_fs(
+	xfs_mount_t		*mp,
+	struct fsxattr		*fsx,
+	struct populate_opts	*po)
+{
+	struct populate		pop;
+
+	if (!po->inodes)
+		return;
+	memset(&pop, 0, sizeof(pop));
+	pop.mp = mp;
+	pop.fsxp = fsx;
+	pop.po = po;
+	pop.seed = po->seed;
+	pop.frag = calloc(po->fanout, sizeof(xfs_inode_t *));
+	pop.attrval = malloc(MAX(po->attrsize, 1));
+	if (!pop.frag || !pop.attrval)
+		fail(_("cannot allocate synthetic tree state"), ENOMEM);
+	memset(pop.attrval, 'v', MAX(po->attrsize, 1));
+
+	pop_queue(&pop, mp->m_sb.sb_rootino);
+	while (pop.head < pop.tail && pop.created < po->inodes)
+		pop_fill_dir(&pop, pop.queue[pop.head++]);
+
+	free(pop.queue);
+	free(pop.frag);
+	free(pop.attrval);
 }
 
 /*
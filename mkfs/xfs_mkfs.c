@@ -176,6 +176,40 @@ char	*sopts[] = {
 	NULL
 };
 
+char	*kopts[] = {
+#define	K_CHUNK		0
+	"chunk",
+#define	K_THREADS	1
+	"threads",
+#define	K_UNUSED	2
+	"unused",
+#define	K_PROGRESS	3
+	"progress",
+	NULL
+};
+
+char	*gopts[] = {
+#define	G_INODES	0
+	"inodes",
+#define	G_FANOUT	1
+	"fanout",
+#define	G_SIZE		2
+	"size",
+#define	G_FRAG		3
+	"frag",
+#define	G_LINKS		4
+	"links",
+#define	G_XATTRS	5
+	"xattrs",
+#define	G_NATTRS	6
+	"nattrs",
+#define	G_ATTRSIZE	7
+	"attrsize",
+#define	G_SEED		8
+	"seed",
+	NULL
+};
+
 char	*mopts[] = {
 #define	M_CRC		0
 	"crc",
@@ -828,18 +862,506 @@ done:
 	free(buf);
 }
 
-static void
-discard_blocks(dev_t dev, __uint64_t nsectors)
+/*
+ * Discards are issued in chunks from several threads, so that the device
+ * can work on more than one at a time and progress can be shown, instead
+ * of as one ioctl over the whole device that may run for many minutes.
+ */
+struct discard_opts {
+	__uint64_t		chunk;		/* bytes per discard */
+	int			threads;
+	int			unused;		/* skip what mkfs writes anyway */
+	int			progress;
+};
+
+#define	DISCARD_CHUNK		(1ULL << 30)
+#define	DISCARD_THREADS		4
+#define	MAX_DISCARD_THREADS	64
+
+struct discard_work {
+	int			fd;
+	__uint64_t		chunk;
+	__uint64_t		end;		/* bytes */
+	pthread_mutex_t		lock;		/* for the fields below */
+	__uint64_t		next;
+	__uint64_t		done;
+	__uint64_t		total;
+	int			percent;	/* last shown */
+	int			progress;
+	int			error;
+};
+
+static void *
+discard_thread(
+	void			*arg)
+{
+	struct discard_work	*dw = arg;
+	__uint64_t		start;
+	__uint64_t		len;
+	int			percent;
+	int			error;
+
+	for (;;) {
+		pthread_mutex_lock(&dw->lock);
+		if (dw->error || dw->next >= dw->end) {
+			pthread_mutex_unlock(&dw->lock);
+			break;
+		}
+		start = dw->next;
+		len = min(dw->chunk, dw->end - start);
+		dw->next += len;
+		pthread_mutex_unlock(&dw->lock);
+
+		error = platform_discard_blocks(dw->fd, start, len);
+
+		pthread_mutex_lock(&dw->lock);
+		if (error) {
+			/* not supported, most likely; don't try every chunk */
+			dw->error = error;
+		} else {
+			dw->done += len;
+			percent = dw->done * 100 / dw->total;
+			if (dw->progress && percent != dw->percent) {
+				dw->percent = percent;
+				printf(_("\rDiscarding blocks... %3d%%"), percent);
+				fflush(stdout);
+			}
+		}
+		pthread_mutex_unlock(&dw->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Discard the 512 byte sectors from start up to end of the device.
+ * Returns 1 if all of them were discarded and now read back as zeroes.
+ */
+static int
+discard_blocks(
+	dev_t			dev,
+	__uint64_t		start,
+	__uint64_t		end,
+	struct discard_opts	*opts)
 {
-	int fd;
+	struct discard_work	dw;
+	pthread_t		threads[MAX_DISCARD_THREADS];
+	__uint64_t		nchunks;
+	int			nthreads;
+	int			i;
 
 	/*
 	 * We intentionally ignore errors from the discard ioctl.  It is
 	 * not necessary for the mkfs functionality but just an optimization.
 	 */
-	fd = libxfs_device_to_fd(dev);
-	if (fd > 0)
-		platform_discard_blocks(fd, 0, nsectors << 9);
+	if (start >= end)
+		return 0;
+	memset(&dw, 0, sizeof(dw));
+	dw.fd = libxfs_device_to_fd(dev);
+	if (dw.fd <= 0)
+		return 0;
+	dw.chunk = opts->chunk;
+	dw.next = start << 9;
+	dw.end = end << 9;
+	dw.total = dw.end - dw.next;
+	dw.percent = -1;
+	dw.progress = opts->progress;
+	pthread_mutex_init(&dw.lock, NULL);
+
+	nchunks = (dw.total + dw.chunk - 1) / dw.chunk;
+	nthreads = min(opts->threads, nchunks);
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, discard_thread, &dw)) {
+			nthreads = i;
+			break;
+		}
+	}
+	discard_thread(&dw);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&dw.lock);
+	if (dw.progress)
+		printf(dw.error ? _("\rDiscarding blocks... not supported\n") :
+				  _("\rDiscarding blocks... done.     \n"));
+	return !dw.error && platform_discard_zeroes(dw.fd);
+}
+
+/*
+ * What the threads writing the AG headers need from mkfs.
+ */
+struct ag_init {
+	struct xfs_mount	*mp;
+	struct xfs_sb		*sbp;
+	__uint64_t		agsize;
+	xfs_agnumber_t		agcount;
+	xfs_rfsblock_t		dblocks;
+	int			loginternal;
+	xfs_agnumber_t		logagno;
+	xfs_fsblock_t		logstart;
+	xfs_rfsblock_t		logblocks;
+	int			lalign;
+	int			finobt;
+	pthread_mutex_t		lock;		/* for the fields below */
+	xfs_agnumber_t		next_agno;
+	int			worst_freelist;
+};
+
+#define	MAX_AG_INIT_THREADS	32
+
+static int
+ag_buf_compare(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_buf	*ba = *(const struct xfs_buf **)a;
+	const struct xfs_buf	*bb = *(const struct xfs_buf **)b;
+
+	if (ba->b_bn != bb->b_bn)
+		return ba->b_bn < bb->b_bn ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Build the superblock, AG headers and btree root blocks of an AG, and
+ * write them together.
+ *
+ * XXX: this code is effectively shared with the kernel growfs code.
+ * These initialisations should be pulled into libxfs to keep the
+ * kernel/userspace header initialisation code the same.
+ */
+static void
+initialise_ag(
+	struct ag_init		*ai,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_mount	*mp = ai->mp;
+	struct xfs_perag	*pag = xfs_perag_get(mp, agno);
+	struct xfs_buf		*bufs[8];
+	struct xfs_buf		*buf;
+	struct xfs_agfl		*agfl;
+	struct xfs_btree_block	*block;
+	xfs_agf_t		*agf;
+	xfs_agi_t		*agi;
+	xfs_alloc_rec_t		*arec;
+	xfs_alloc_rec_t		*nrec;
+	xfs_extlen_t		nbmblocks;
+	__uint64_t		agsize = ai->agsize;
+	unsigned int		sectorsize = ai->sbp->sb_sectsize;
+	unsigned int		blocksize = ai->sbp->sb_blocksize;
+	int			bsize = XFS_FSB_TO_BB(mp, 1);
+	int			freelist;
+	int			nbufs = 0;
+	int			bucket;
+	int			error;
+	int			c;
+	int			i;
+
+	/*
+	 * Superblock.
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+			XFS_FSS_TO_BB(mp, 1));
+	buf->b_ops = &xfs_sb_buf_ops;
+	memset(XFS_BUF_PTR(buf), 0, sectorsize);
+	libxfs_sb_to_disk((void *)XFS_BUF_PTR(buf), ai->sbp);
+	bufs[nbufs++] = buf;
+
+	/*
+	 * AG header block: freespace
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1));
+	buf->b_ops = &xfs_agf_buf_ops;
+	agf = XFS_BUF_TO_AGF(buf);
+	memset(agf, 0, sectorsize);
+	if (agno == ai->agcount - 1)
+		agsize = ai->dblocks - (xfs_rfsblock_t)(agno * agsize);
+	agf->agf_magicnum = cpu_to_be32(XFS_AGF_MAGIC);
+	agf->agf_versionnum = cpu_to_be32(XFS_AGF_VERSION);
+	agf->agf_seqno = cpu_to_be32(agno);
+	agf->agf_length = cpu_to_be32(agsize);
+	agf->agf_roots[XFS_BTNUM_BNOi] = cpu_to_be32(XFS_BNO_BLOCK(mp));
+	agf->agf_roots[XFS_BTNUM_CNTi] = cpu_to_be32(XFS_CNT_BLOCK(mp));
+	agf->agf_levels[XFS_BTNUM_BNOi] = cpu_to_be32(1);
+	agf->agf_levels[XFS_BTNUM_CNTi] = cpu_to_be32(1);
+	pag->pagf_levels[XFS_BTNUM_BNOi] = 1;
+	pag->pagf_levels[XFS_BTNUM_CNTi] = 1;
+	agf->agf_flfirst = 0;
+	agf->agf_fllast = cpu_to_be32(XFS_AGFL_SIZE(mp) - 1);
+	agf->agf_flcount = 0;
+	nbmblocks = (xfs_extlen_t)(agsize - XFS_PREALLOC_BLOCKS(mp));
+	agf->agf_freeblks = cpu_to_be32(nbmblocks);
+	agf->agf_longest = cpu_to_be32(nbmblocks);
+	if (xfs_sb_version_hascrc(&mp->m_sb))
+		platform_uuid_copy(&agf->agf_uuid, &mp->m_sb.sb_uuid);
+
+	if (ai->loginternal && agno == ai->logagno) {
+		be32_add_cpu(&agf->agf_freeblks, -ai->logblocks);
+		agf->agf_longest = cpu_to_be32(agsize -
+			XFS_FSB_TO_AGBNO(mp, ai->logstart) - ai->logblocks);
+	}
+	freelist = xfs_alloc_min_freelist(mp, pag);
+	bufs[nbufs++] = buf;
+
+	/*
+	 * AG freelist header block
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1));
+	buf->b_ops = &xfs_agfl_buf_ops;
+	agfl = XFS_BUF_TO_AGFL(buf);
+	/* setting to 0xff results in initialisation to NULLAGBLOCK */
+	memset(agfl, 0xff, sectorsize);
+	if (xfs_sb_version_hascrc(&mp->m_sb)) {
+		agfl->agfl_magicnum = cpu_to_be32(XFS_AGFL_MAGIC);
+		agfl->agfl_seqno = cpu_to_be32(agno);
+		platform_uuid_copy(&agfl->agfl_uuid, &mp->m_sb.sb_uuid);
+		for (bucket = 0; bucket < XFS_AGFL_SIZE(mp); bucket++)
+			agfl->agfl_bno[bucket] = cpu_to_be32(NULLAGBLOCK);
+	}
+
+	bufs[nbufs++] = buf;
+
+	/*
+	 * AG header block: inodes
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1));
+	agi = XFS_BUF_TO_AGI(buf);
+	buf->b_ops = &xfs_agi_buf_ops;
+	memset(agi, 0, sectorsize);
+	agi->agi_magicnum = cpu_to_be32(XFS_AGI_MAGIC);
+	agi->agi_versionnum = cpu_to_be32(XFS_AGI_VERSION);
+	agi->agi_seqno = cpu_to_be32(agno);
+	agi->agi_length = cpu_to_be32((xfs_agblock_t)agsize);
+	agi->agi_count = 0;
+	agi->agi_root = cpu_to_be32(XFS_IBT_BLOCK(mp));
+	agi->agi_level = cpu_to_be32(1);
+	if (ai->finobt) {
+		agi->agi_free_root = cpu_to_be32(XFS_FIBT_BLOCK(mp));
+		agi->agi_free_level = cpu_to_be32(1);
+	}
+	agi->agi_freecount = 0;
+	agi->agi_newino = cpu_to_be32(NULLAGINO);
+	agi->agi_dirino = cpu_to_be32(NULLAGINO);
+	if (xfs_sb_version_hascrc(&mp->m_sb))
+		platform_uuid_copy(&agi->agi_uuid, &mp->m_sb.sb_uuid);
+	for (c = 0; c < XFS_AGI_UNLINKED_BUCKETS; c++)
+		agi->agi_unlinked[c] = cpu_to_be32(NULLAGINO);
+	bufs[nbufs++] = buf;
+
+	/*
+	 * BNO btree root block
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, XFS_BNO_BLOCK(mp)),
+			bsize);
+	buf->b_ops = &xfs_allocbt_buf_ops;
+	block = XFS_BUF_TO_BLOCK(buf);
+	memset(block, 0, blocksize);
+	if (xfs_sb_version_hascrc(&mp->m_sb))
+		xfs_btree_init_block(mp, buf, XFS_ABTB_CRC_MAGIC, 0, 1,
+					agno, XFS_BTREE_CRC_BLOCKS);
+	else
+		xfs_btree_init_block(mp, buf, XFS_ABTB_MAGIC, 0, 1,
+					agno, 0);
+
+	arec = XFS_ALLOC_REC_ADDR(mp, block, 1);
+	arec->ar_startblock = cpu_to_be32(XFS_PREALLOC_BLOCKS(mp));
+	if (ai->loginternal && agno == ai->logagno) {
+		if (ai->lalign) {
+			/*
+			 * Have to insert two records
+			 * Insert pad record for stripe align of log
+			 */
+			arec->ar_blockcount = cpu_to_be32(
+				XFS_FSB_TO_AGBNO(mp, ai->logstart) -
+				be32_to_cpu(arec->ar_startblock));
+			nrec = arec + 1;
+			/*
+			 * Insert record at start of internal log
+			 */
+			nrec->ar_startblock = cpu_to_be32(
+				be32_to_cpu(arec->ar_startblock) +
+				be32_to_cpu(arec->ar_blockcount));
+			arec = nrec;
+			be16_add_cpu(&block->bb_numrecs, 1);
+		}
+		/*
+		 * Change record start to after the internal log
+		 */
+		be32_add_cpu(&arec->ar_startblock, ai->logblocks);
+	}
+	/*
+	 * Calculate the record block count and check for the case where
+	 * the log might have consumed all available space in the AG. If
+	 * so, reset the record count to 0 to avoid exposure of an invalid
+	 * record start block.
+	 */
+	arec->ar_blockcount = cpu_to_be32(agsize - 
+				be32_to_cpu(arec->ar_startblock));
+	if (!arec->ar_blockcount)
+		block->bb_numrecs = 0;
+
+	bufs[nbufs++] = buf;
+
+	/*
+	 * CNT btree root block
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, XFS_CNT_BLOCK(mp)),
+			bsize);
+	buf->b_ops = &xfs_allocbt_buf_ops;
+	block = XFS_BUF_TO_BLOCK(buf);
+	memset(block, 0, blocksize);
+	if (xfs_sb_version_hascrc(&mp->m_sb))
+		xfs_btree_init_block(mp, buf, XFS_ABTC_CRC_MAGIC, 0, 1,
+					agno, XFS_BTREE_CRC_BLOCKS);
+	else
+		xfs_btree_init_block(mp, buf, XFS_ABTC_MAGIC, 0, 1,
+					agno, 0);
+
+	arec = XFS_ALLOC_REC_ADDR(mp, block, 1);
+	arec->ar_startblock = cpu_to_be32(XFS_PREALLOC_BLOCKS(mp));
+	if (ai->loginternal && agno == ai->logagno) {
+		if (ai->lalign) {
+			arec->ar_blockcount = cpu_to_be32(
+				XFS_FSB_TO_AGBNO(mp, ai->logstart) -
+				be32_to_cpu(arec->ar_startblock));
+			nrec = arec + 1;
+			nrec->ar_startblock = cpu_to_be32(
+				be32_to_cpu(arec->ar_startblock) +
+				be32_to_cpu(arec->ar_blockcount));
+			arec = nrec;
+			be16_add_cpu(&block->bb_numrecs, 1);
+		}
+		be32_add_cpu(&arec->ar_startblock, ai->logblocks);
+	}
+	/*
+	 * Calculate the record block count and check for the case where
+	 * the log might have consumed all available space in the AG. If
+	 * so, reset the record count to 0 to avoid exposure of an invalid
+	 * record start block.
+	 */
+	arec->ar_blockcount = cpu_to_be32(agsize - 
+				be32_to_cpu(arec->ar_startblock));
+	if (!arec->ar_blockcount)
+		block->bb_numrecs = 0;
+
+	bufs[nbufs++] = buf;
+
+	/*
+	 * INO btree root block
+	 */
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, XFS_IBT_BLOCK(mp)),
+			bsize);
+	buf->b_ops = &xfs_inobt_buf_ops;
+	block = XFS_BUF_TO_BLOCK(buf);
+	memset(block, 0, blocksize);
+	if (xfs_sb_version_hascrc(&mp->m_sb))
+		xfs_btree_init_block(mp, buf, XFS_IBT_CRC_MAGIC, 0, 0,
+					agno, XFS_BTREE_CRC_BLOCKS);
+	else
+		xfs_btree_init_block(mp, buf, XFS_IBT_MAGIC, 0, 0,
+					agno, 0);
+	bufs[nbufs++] = buf;
+
+	/*
+	 * Free INO btree root block
+	 */
+	if (!ai->finobt)
+		goto write;
+
+	buf = libxfs_getbuf(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, XFS_FIBT_BLOCK(mp)),
+			bsize);
+	buf->b_ops = &xfs_inobt_buf_ops;
+	block = XFS_BUF_TO_BLOCK(buf);
+	memset(block, 0, blocksize);
+	if (xfs_sb_version_hascrc(&mp->m_sb))
+		xfs_btree_init_block(mp, buf, XFS_FIBT_CRC_MAGIC, 0, 0,
+					agno, XFS_BTREE_CRC_BLOCKS);
+	else
+		xfs_btree_init_block(mp, buf, XFS_FIBT_MAGIC, 0, 0,
+					agno, 0);
+	bufs[nbufs++] = buf;
+
+write:
+	/*
+	 * The headers and btree roots sit together at the start of the AG,
+	 * so in disk order they go out in a write or two.
+	 */
+	qsort(bufs, nbufs, sizeof(*bufs), ag_buf_compare);
+	error = libxfs_writebufr_list(mp->m_ddev_targp, bufs, nbufs);
+	if (error) {
+		fprintf(stderr,
+	_("%s: write of AG %u headers failed: %s\n"),
+			progname, agno, strerror(error));
+		exit(1);
+	}
+	for (i = 0; i < nbufs; i++)
+		libxfs_putbuf(bufs[i]);
+
+	pthread_mutex_lock(&ai->lock);
+	if (freelist > ai->worst_freelist)
+		ai->worst_freelist = freelist;
+	pthread_mutex_unlock(&ai->lock);
+	xfs_perag_put(pag);
+}
+
+static void *
+initialise_ags_thread(
+	void			*arg)
+{
+	struct ag_init		*ai = arg;
+	xfs_agnumber_t		agno;
+
+	for (;;) {
+		pthread_mutex_lock(&ai->lock);
+		agno = ai->next_agno++;
+		pthread_mutex_unlock(&ai->lock);
+		if (agno >= ai->agcount)
+			break;
+		initialise_ag(ai, agno);
+	}
+	return NULL;
+}
+
+/*
+ * Initialise the AGs on as many threads as there are CPUs, each taking the
+ * next AG not yet started.  With thousands of AGs this is most of the time
+ * mkfs spends.
+ */
+static void
+initialise_ags(
+	struct ag_init		*ai)
+{
+	pthread_t		threads[MAX_AG_INIT_THREADS];
+	long			nthreads;
+	int			i;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = min(nthreads, MAX_AG_INIT_THREADS);
+	nthreads = min(nthreads, (long)ai->agcount);
+	ai->next_agno = 0;
+	ai->worst_freelist = 0;
+	pthread_mutex_init(&ai->lock, NULL);
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, initialise_ags_thread,
+				   ai)) {
+			nthreads = i;
+			break;
+		}
+	}
+	initialise_ags_thread(ai);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&ai->lock);
 }
 
 int
@@ -848,14 +1370,11 @@ main(
 	char			**argv)
 {
 	__uint64_t		agcount;
-	xfs_agf_t		*agf;
-	xfs_agi_t		*agi;
+	struct ag_init		ai;
 	xfs_agnumber_t		agno;
 	__uint64_t		agsize;
-	xfs_alloc_rec_t		*arec;
 	int			attrversion;
 	int			projid16bit;
-	struct xfs_btree_block	*block;
 	int			blflag;
 	int			blocklog;
 	unsigned int		blocksize;
@@ -916,13 +1435,18 @@ main(
 	int			nlflag;
 	int			nodsflag;
 	int			norsflag;
-	xfs_alloc_rec_t		*nrec;
 	int			nftype;
 	int			nsflag;
 	int			nvflag;
 	int			nci;
 	int			Nflag;
+	int			Pflag;
+	struct dev_probe	probe;
 	int			discard = 1;
+	int			dzeroed = 0;	/* data device reads as zeroes */
+	int			lzeroed = 0;	/* and external log device */
+	struct discard_opts	discopts;
+	struct populate_opts	popopts;
 	char			*p;
 	char			*protofile;
 	char			*protostring;
@@ -974,6 +1498,7 @@ main(
 	dirblocklog = dirblocksize = 0;
 	dirversion = XFS_DFL_DIR_VERSION;
 	qflag = 0;
+	Pflag = 0;
 	imaxpct = inodelog = inopblock = isize = 0;
 	iaflag = XFS_IFLAG_ALIGN;
 	dfile = logfile = rtfile = NULL;
@@ -988,12 +1513,21 @@ main(
 	finobtflag = false;
 	spinodes = 0;
 	memset(&fsx, 0, sizeof(fsx));
+	memset(&discopts, 0, sizeof(discopts));
+	discopts.chunk = DISCARD_CHUNK;
+	discopts.threads = DISCARD_THREADS;
+	memset(&popopts, 0, sizeof(popopts));
+	popopts.fanout = 32;
+	popopts.size = 16384;
+	popopts.nattrs = 4;
+	popopts.attrsize = 64;
+	popopts.seed = 1;
 
 	memset(&xi, 0, sizeof(xi));
 	xi.isdirect = LIBXFS_DIRECT;
 	xi.isreadonly = LIBXFS_EXCLUSIVELY;
 
-	while ((c = getopt(argc, argv, "b:d:i:l:L:m:n:KNp:qr:s:CfV")) != EOF) {
+	while ((c = getopt(argc, argv, "b:d:D:G:i:l:L:m:n:KNPp:qr:s:CfV")) != EOF) {
 		switch (c) {
 		case 'C':
 		case 'f':
@@ -1567,12 +2101,140 @@ main(
 				}
 			}
 			break;
+		case 'D':
+			p = optarg;
+			while (*p != '\0') {
+				char	*value;
+
+				switch (getsubopt(&p, (constpp)kopts, &value)) {
+				case K_CHUNK:
+					if (!value || *value == '\0')
+						reqval('D', kopts, K_CHUNK);
+					discopts.chunk = cvtnum(
+						blocksize, sectorsize, value);
+					if ((__int64_t)discopts.chunk <= 0 ||
+					    discopts.chunk % BBSIZE)
+						illegal(value, "D chunk");
+					break;
+				case K_THREADS:
+					if (!value || *value == '\0')
+						reqval('D', kopts, K_THREADS);
+					discopts.threads = atoi(value);
+					if (discopts.threads < 1 ||
+					    discopts.threads > MAX_DISCARD_THREADS)
+						illegal(value, "D threads");
+					break;
+				case K_UNUSED:
+					if (!value || *value == '\0')
+						reqval('D', kopts, K_UNUSED);
+					c = atoi(value);
+					if (c < 0 || c > 1)
+						illegal(value, "D unused");
+					discopts.unused = c;
+					break;
+				case K_PROGRESS:
+					if (!value || *value == '\0')
+						reqval('D', kopts, K_PROGRESS);
+					c = atoi(value);
+					if (c < 0 || c > 1)
+						illegal(value, "D progress");
+					discopts.progress = c;
+					break;
+				default:
+					unknown('D', value);
+				}
+			}
+			break;
+		case 'G':
+			p = optarg;
+			while (*p != '\0') {
+				char	*value;
+
+				switch (getsubopt(&p, (constpp)gopts, &value)) {
+				case G_INODES:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_INODES);
+					if (!isdigits(value))
+						illegal(value, "G inodes");
+					popopts.inodes = strtoull(value,
+								  NULL, 10);
+					break;
+				case G_FANOUT:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_FANOUT);
+					popopts.fanout = atoi(value);
+					if (popopts.fanout < 2 ||
+					    popopts.fanout > 1000000)
+						illegal(value, "G fanout");
+					break;
+				case G_SIZE:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_SIZE);
+					popopts.size = cvtnum(
+						blocksize, sectorsize, value);
+					if ((__int64_t)popopts.size < 0)
+						illegal(value, "G size");
+					break;
+				case G_FRAG:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_FRAG);
+					popopts.frag = atoi(value);
+					if (popopts.frag < 0 ||
+					    popopts.frag > 100)
+						illegal(value, "G frag");
+					break;
+				case G_LINKS:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_LINKS);
+					popopts.links = atoi(value);
+					if (popopts.links < 0 ||
+					    popopts.links > 100)
+						illegal(value, "G links");
+					break;
+				case G_XATTRS:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_XATTRS);
+					popopts.xattrs = atoi(value);
+					if (popopts.xattrs < 0 ||
+					    popopts.xattrs > 100)
+						illegal(value, "G xattrs");
+					break;
+				case G_NATTRS:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_NATTRS);
+					popopts.nattrs = atoi(value);
+					if (popopts.nattrs < 1 ||
+					    popopts.nattrs > 10000)
+						illegal(value, "G nattrs");
+					break;
+				case G_ATTRSIZE:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_ATTRSIZE);
+					popopts.attrsize = cvtnum(
+						blocksize, sectorsize, value);
+					if (popopts.attrsize < 0 ||
+					    popopts.attrsize > XATTR_SIZE_MAX)
+						illegal(value, "G attrsize");
+					break;
+				case G_SEED:
+					if (!value || *value == '\0')
+						reqval('G', gopts, G_SEED);
+					popopts.seed = strtoul(value, NULL, 0);
+					break;
+				default:
+					unknown('G', value);
+				}
+			}
+			break;
 		case 'N':
 			Nflag = 1;
 			break;
 		case 'K':
 			discard = 0;
 			break;
+		case 'P':
+			Pflag = 1;
+			break;
 		case 'p':
 			if (protofile)
 				respec('p', NULL, 0);
@@ -2044,6 +2706,7 @@ _("warning: sparse inodes not supported without CRC support, disabled.\n"));
 				&dsunit, &dswidth, &lsunit);
 
 	xi.setblksize = sectorsize;
+	libxfs_ihash_size = LIBXFS_IHASHSIZE(NULL);
 
 	/*
 	 * Initialize.  This will open the log and rt devices as well.
@@ -2082,14 +2745,6 @@ _("warning: sparse inodes not supported without CRC support, disabled.\n"));
 		}
 	}
 
-	if (discard && !Nflag) {
-		discard_blocks(xi.ddev, xi.dsize);
-		if (xi.rtdev)
-			discard_blocks(xi.rtdev, xi.rtsize);
-		if (xi.logdev && xi.logdev != xi.ddev)
-			discard_blocks(xi.logdev, xi.logBBsize);
-	}
-
 	if (!liflag && !ldflag)
 		loginternal = xi.logdev == 0;
 	if (xi.logname)
@@ -2201,6 +2856,24 @@ reported by the device (%u).\n"),
 		}
 	} /* else dsunit & dswidth can't be set if nodsflag is set */
 
+	/*
+	 * Measure the data device, to size the AGs and the log for how it
+	 * actually performs rather than just its size and topology.
+	 */
+	if (Pflag) {
+		c = probe_device(xi.dfd, BBTOB(xi.dsize), sectorsize, &probe);
+		if (c) {
+			fprintf(stderr, _("%s: cannot probe %s: %s\n"),
+				progname, dfile, strerror(c));
+			Pflag = 0;
+		} else if (!qflag || Nflag)
+			printf(_(
+"probe: %d KiB random reads scale to %d at once (%.0f IOPS), %.0f MB/s peak\n"),
+				probe.smallio / 1024,
+				probe.depth, probe.iops,
+				probe.bandwidth / (1024 * 1024));
+	}
+
 	if (dasize) {		/* User-specified AG size */
 		/*
 		 * Check specified agsize is a multiple of blocksize.
@@ -2219,6 +2892,27 @@ reported by the device (%u).\n"),
 	} else {
 		calc_default_ag_geometry(blocklog, dblocks,
 				dsunit | dswidth, &agsize, &agcount);
+
+		/*
+		 * Give the allocator at least one AG for each I/O the
+		 * device can usefully have in flight.
+		 */
+		if (Pflag && probe.depth > agcount) {
+			__uint64_t	tmp_agsize;
+
+			tmp_agsize = dblocks / probe.depth +
+				     (dblocks % probe.depth != 0);
+			if (tmp_agsize >= XFS_AG_MIN_BLOCKS(blocklog)) {
+				agsize = tmp_agsize;
+				agcount = dblocks / agsize +
+					  (dblocks % agsize != 0);
+				if (!qflag || Nflag)
+					printf(_(
+"probe: using %lld allocation groups for a queue depth of %d\n"),
+						(long long)agcount,
+						probe.depth);
+			}
+		}
 	}
 
 	/*
@@ -2355,6 +3049,14 @@ an AG size that is one stripe unit smaller, for example %llu.\n"),
 	} else if (logversion == 2 && loginternal && dsunit) {
 		/* lsunit and dsunit now in fs blocks */
 		lsunit = dsunit;
+	} else if (logversion == 2 && Pflag && probe.iosize > blocksize) {
+		/* pad log writes up to where the device is efficient */
+		lsunit = MIN(probe.iosize, 256 * 1024) >> blocklog;
+		if (!qflag || Nflag)
+			printf(_(
+"probe: half of peak bandwidth at %d KiB reads, log stripe unit %d KiB\n"),
+				probe.iosize / 1024,
+				(lsunit << blocklog) / 1024);
 	}
 
 	if (logversion == 2 && (lsunit * blocksize) > 256 * 1024) {
@@ -2418,6 +3120,27 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 			logblocks = logblocks >> blocklog;
 		}
 
+		/*
+		 * A fast device can fill the log quickly; make it hold at
+		 * least a second of writes at the probed bandwidth, as long
+		 * as that still leaves most of an AG.
+		 */
+		if (Pflag) {
+			__uint64_t	tmp_logblocks;
+
+			tmp_logblocks = (__uint64_t)probe.bandwidth >> blocklog;
+			tmp_logblocks = MIN(tmp_logblocks, agsize / 2);
+			tmp_logblocks = MIN(tmp_logblocks,
+					    XFS_MAX_LOG_BYTES >> blocklog);
+			if (tmp_logblocks > logblocks) {
+				logblocks = tmp_logblocks;
+				if (!qflag || Nflag)
+					printf(_(
+"probe: log of %lld blocks, a second of writes at peak bandwidth\n"),
+						(long long)logblocks);
+			}
+		}
+
 		/* Ensure the chosen size meets minimum log size requirements */
 		logblocks = MAX(min_logblocks, logblocks);
 
@@ -2624,7 +3347,33 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 		sbp->sb_features_incompat |= XFS_SB_FEAT_INCOMPAT_SPINODES;
 	}
 
-	if (force_overwrite)
+	/*
+	 * With -D unused=1, leave out the log, which is written in full
+	 * straight afterwards anyway.
+	 */
+	if (discard) {
+		if (loginternal && discopts.unused) {
+			__uint64_t	lstart = XFS_FSB_TO_DADDR(mp, logstart);
+
+			discard_blocks(xi.ddev, 0, lstart, &discopts);
+			discard_blocks(xi.ddev,
+				lstart + XFS_FSB_TO_BB(mp, logblocks),
+				xi.dsize, &discopts);
+		} else
+			dzeroed = discard_blocks(xi.ddev, 0, xi.dsize,
+						 &discopts);
+		if (xi.rtdev)
+			discard_blocks(xi.rtdev, 0, xi.rtsize, &discopts);
+		if (xi.logdev && xi.logdev != xi.ddev && !discopts.unused)
+			lzeroed = discard_blocks(xi.logdev, 0, xi.logBBsize,
+						 &discopts);
+	}
+
+	/*
+	 * If the discard left the whole device reading back as zeroes, there
+	 * are no old secondary superblocks or signatures left to wipe out.
+	 */
+	if (force_overwrite && !dzeroed)
 		zero_old_xfs_structures(&xi, sbp);
 
 	/*
@@ -2634,10 +3383,8 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 	 * ext[2,3] and reiserfs (64k) - and hopefully all else.
 	 */
 	libxfs_buftarg_init(mp, xi.ddev, xi.logdev, xi.rtdev);
-	buf = libxfs_getbuf(mp->m_ddev_targp, 0, BTOBB(WHACK_SIZE));
-	memset(XFS_BUF_PTR(buf), 0, WHACK_SIZE);
-	libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-	libxfs_purgebuf(buf);
+	if (!dzeroed)
+		libxfs_device_zero(mp->m_ddev_targp, 0, BTOBB(WHACK_SIZE));
 
 	/* OK, now write the superblock */
 	buf = libxfs_getbuf(mp->m_ddev_targp, XFS_SB_DADDR, XFS_FSS_TO_BB(mp, 1));
@@ -2663,21 +3410,19 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 	 * old MD RAID (or other) metadata at the end of the device.
 	 * (MD sb is ~64k from the end, take out a wider swath to be sure)
 	 */
-	if (!xi.disfile) {
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				    (xi.dsize - BTOBB(WHACK_SIZE)),
-				    BTOBB(WHACK_SIZE));
-		memset(XFS_BUF_PTR(buf), 0, WHACK_SIZE);
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-		libxfs_purgebuf(buf);
-	}
+	if (!xi.disfile && !dzeroed)
+		libxfs_device_zero(mp->m_ddev_targp,
+				   xi.dsize - BTOBB(WHACK_SIZE),
+				   BTOBB(WHACK_SIZE));
 
 	/*
-	 * Zero the log....
+	 * Zero the log....  If it was discarded to zeroes already, only
+	 * the record header has to be written.
 	 */
 	libxfs_log_clear(mp->m_logdev_targp,
 		XFS_FSB_TO_DADDR(mp, logstart),
-		(xfs_extlen_t)XFS_FSB_TO_BB(mp, logblocks),
+		(loginternal ? dzeroed : lzeroed) ? 0 :
+			(xfs_extlen_t)XFS_FSB_TO_BB(mp, logblocks),
 		&sbp->sb_uuid, logversion, lsunit, XLOG_FMT);
 
 	mp = libxfs_mount(mp, sbp, xi.ddev, xi.logdev, xi.rtdev, 0);
@@ -2687,255 +3432,19 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 		exit(1);
 	}
 
-	/*
-	 * XXX: this code is effectively shared with the kernel growfs code.
-	 * These initialisations should be pulled into libxfs to keep the
-	 * kernel/userspace header initialisation code the same.
-	 */
-	for (agno = 0; agno < agcount; agno++) {
-		struct xfs_agfl	*agfl;
-		int		bucket;
-		struct xfs_perag *pag = xfs_perag_get(mp, agno);
-
-		/*
-		 * Superblock.
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
-				XFS_FSS_TO_BB(mp, 1));
-		buf->b_ops = &xfs_sb_buf_ops;
-		memset(XFS_BUF_PTR(buf), 0, sectorsize);
-		libxfs_sb_to_disk((void *)XFS_BUF_PTR(buf), sbp);
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * AG header block: freespace
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
-				XFS_FSS_TO_BB(mp, 1));
-		buf->b_ops = &xfs_agf_buf_ops;
-		agf = XFS_BUF_TO_AGF(buf);
-		memset(agf, 0, sectorsize);
-		if (agno == agcount - 1)
-			agsize = dblocks - (xfs_rfsblock_t)(agno * agsize);
-		agf->agf_magicnum = cpu_to_be32(XFS_AGF_MAGIC);
-		agf->agf_versionnum = cpu_to_be32(XFS_AGF_VERSION);
-		agf->agf_seqno = cpu_to_be32(agno);
-		agf->agf_length = cpu_to_be32(agsize);
-		agf->agf_roots[XFS_BTNUM_BNOi] = cpu_to_be32(XFS_BNO_BLOCK(mp));
-		agf->agf_roots[XFS_BTNUM_CNTi] = cpu_to_be32(XFS_CNT_BLOCK(mp));
-		agf->agf_levels[XFS_BTNUM_BNOi] = cpu_to_be32(1);
-		agf->agf_levels[XFS_BTNUM_CNTi] = cpu_to_be32(1);
-		pag->pagf_levels[XFS_BTNUM_BNOi] = 1;
-		pag->pagf_levels[XFS_BTNUM_CNTi] = 1;
-		agf->agf_flfirst = 0;
-		agf->agf_fllast = cpu_to_be32(XFS_AGFL_SIZE(mp) - 1);
-		agf->agf_flcount = 0;
-		nbmblocks = (xfs_extlen_t)(agsize - XFS_PREALLOC_BLOCKS(mp));
-		agf->agf_freeblks = cpu_to_be32(nbmblocks);
-		agf->agf_longest = cpu_to_be32(nbmblocks);
-		if (xfs_sb_version_hascrc(&mp->m_sb))
-			platform_uuid_copy(&agf->agf_uuid, &mp->m_sb.sb_uuid);
-
-		if (loginternal && agno == logagno) {
-			be32_add_cpu(&agf->agf_freeblks, -logblocks);
-			agf->agf_longest = cpu_to_be32(agsize -
-				XFS_FSB_TO_AGBNO(mp, logstart) - logblocks);
-		}
-		if (xfs_alloc_min_freelist(mp, pag) > worst_freelist)
-			worst_freelist = xfs_alloc_min_freelist(mp, pag);
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * AG freelist header block
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
-				XFS_FSS_TO_BB(mp, 1));
-		buf->b_ops = &xfs_agfl_buf_ops;
-		agfl = XFS_BUF_TO_AGFL(buf);
-		/* setting to 0xff results in initialisation to NULLAGBLOCK */
-		memset(agfl, 0xff, sectorsize);
-		if (xfs_sb_version_hascrc(&mp->m_sb)) {
-			agfl->agfl_magicnum = cpu_to_be32(XFS_AGFL_MAGIC);
-			agfl->agfl_seqno = cpu_to_be32(agno);
-			platform_uuid_copy(&agfl->agfl_uuid, &mp->m_sb.sb_uuid);
-			for (bucket = 0; bucket < XFS_AGFL_SIZE(mp); bucket++)
-				agfl->agfl_bno[bucket] = cpu_to_be32(NULLAGBLOCK);
-		}
-
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * AG header block: inodes
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
-				XFS_FSS_TO_BB(mp, 1));
-		agi = XFS_BUF_TO_AGI(buf);
-		buf->b_ops = &xfs_agi_buf_ops;
-		memset(agi, 0, sectorsize);
-		agi->agi_magicnum = cpu_to_be32(XFS_AGI_MAGIC);
-		agi->agi_versionnum = cpu_to_be32(XFS_AGI_VERSION);
-		agi->agi_seqno = cpu_to_be32(agno);
-		agi->agi_length = cpu_to_be32((xfs_agblock_t)agsize);
-		agi->agi_count = 0;
-		agi->agi_root = cpu_to_be32(XFS_IBT_BLOCK(mp));
-		agi->agi_level = cpu_to_be32(1);
-		if (finobt) {
-			agi->agi_free_root = cpu_to_be32(XFS_FIBT_BLOCK(mp));
-			agi->agi_free_level = cpu_to_be32(1);
-		}
-		agi->agi_freecount = 0;
-		agi->agi_newino = cpu_to_be32(NULLAGINO);
-		agi->agi_dirino = cpu_to_be32(NULLAGINO);
-		if (xfs_sb_version_hascrc(&mp->m_sb))
-			platform_uuid_copy(&agi->agi_uuid, &mp->m_sb.sb_uuid);
-		for (c = 0; c < XFS_AGI_UNLINKED_BUCKETS; c++)
-			agi->agi_unlinked[c] = cpu_to_be32(NULLAGINO);
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * BNO btree root block
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_BNO_BLOCK(mp)),
-				bsize);
-		buf->b_ops = &xfs_allocbt_buf_ops;
-		block = XFS_BUF_TO_BLOCK(buf);
-		memset(block, 0, blocksize);
-		if (xfs_sb_version_hascrc(&mp->m_sb))
-			xfs_btree_init_block(mp, buf, XFS_ABTB_CRC_MAGIC, 0, 1,
-						agno, XFS_BTREE_CRC_BLOCKS);
-		else
-			xfs_btree_init_block(mp, buf, XFS_ABTB_MAGIC, 0, 1,
-						agno, 0);
-
-		arec = XFS_ALLOC_REC_ADDR(mp, block, 1);
-		arec->ar_startblock = cpu_to_be32(XFS_PREALLOC_BLOCKS(mp));
-		if (loginternal && agno == logagno) {
-			if (lalign) {
-				/*
-				 * Have to insert two records
-				 * Insert pad record for stripe align of log
-				 */
-				arec->ar_blockcount = cpu_to_be32(
-					XFS_FSB_TO_AGBNO(mp, logstart) -
-					be32_to_cpu(arec->ar_startblock));
-				nrec = arec + 1;
-				/*
-				 * Insert record at start of internal log
-				 */
-				nrec->ar_startblock = cpu_to_be32(
-					be32_to_cpu(arec->ar_startblock) +
-					be32_to_cpu(arec->ar_blockcount));
-				arec = nrec;
-				be16_add_cpu(&block->bb_numrecs, 1);
-			}
-			/*
-			 * Change record start to after the internal log
-			 */
-			be32_add_cpu(&arec->ar_startblock, logblocks);
-		}
-		/*
-		 * Calculate the record block count and check for the case where
-		 * the log might have consumed all available space in the AG. If
-		 * so, reset the record count to 0 to avoid exposure of an invalid
-		 * record start block.
-		 */
-		arec->ar_blockcount = cpu_to_be32(agsize - 
-					be32_to_cpu(arec->ar_startblock));
-		if (!arec->ar_blockcount)
-			block->bb_numrecs = 0;
-
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * CNT btree root block
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_CNT_BLOCK(mp)),
-				bsize);
-		buf->b_ops = &xfs_allocbt_buf_ops;
-		block = XFS_BUF_TO_BLOCK(buf);
-		memset(block, 0, blocksize);
-		if (xfs_sb_version_hascrc(&mp->m_sb))
-			xfs_btree_init_block(mp, buf, XFS_ABTC_CRC_MAGIC, 0, 1,
-						agno, XFS_BTREE_CRC_BLOCKS);
-		else
-			xfs_btree_init_block(mp, buf, XFS_ABTC_MAGIC, 0, 1,
-						agno, 0);
-
-		arec = XFS_ALLOC_REC_ADDR(mp, block, 1);
-		arec->ar_startblock = cpu_to_be32(XFS_PREALLOC_BLOCKS(mp));
-		if (loginternal && agno == logagno) {
-			if (lalign) {
-				arec->ar_blockcount = cpu_to_be32(
-					XFS_FSB_TO_AGBNO(mp, logstart) -
-					be32_to_cpu(arec->ar_startblock));
-				nrec = arec + 1;
-				nrec->ar_startblock = cpu_to_be32(
-					be32_to_cpu(arec->ar_startblock) +
-					be32_to_cpu(arec->ar_blockcount));
-				arec = nrec;
-				be16_add_cpu(&block->bb_numrecs, 1);
-			}
-			be32_add_cpu(&arec->ar_startblock, logblocks);
-		}
-		/*
-		 * Calculate the record block count and check for the case where
-		 * the log might have consumed all available space in the AG. If
-		 * so, reset the record count to 0 to avoid exposure of an invalid
-		 * record start block.
-		 */
-		arec->ar_blockcount = cpu_to_be32(agsize - 
-					be32_to_cpu(arec->ar_startblock));
-		if (!arec->ar_blockcount)
-			block->bb_numrecs = 0;
-
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * INO btree root block
-		 */
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_IBT_BLOCK(mp)),
-				bsize);
-		buf->b_ops = &xfs_inobt_buf_ops;
-		block = XFS_BUF_TO_BLOCK(buf);
-		memset(block, 0, blocksize);
-		if (xfs_sb_version_hascrc(&mp->m_sb))
-			xfs_btree_init_block(mp, buf, XFS_IBT_CRC_MAGIC, 0, 0,
-						agno, XFS_BTREE_CRC_BLOCKS);
-		else
-			xfs_btree_init_block(mp, buf, XFS_IBT_MAGIC, 0, 0,
-						agno, 0);
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-
-		/*
-		 * Free INO btree root block
-		 */
-		if (!finobt) {
-			xfs_perag_put(pag);
-			continue;
-		}
-
-		buf = libxfs_getbuf(mp->m_ddev_targp,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_FIBT_BLOCK(mp)),
-				bsize);
-		buf->b_ops = &xfs_inobt_buf_ops;
-		block = XFS_BUF_TO_BLOCK(buf);
-		memset(block, 0, blocksize);
-		if (xfs_sb_version_hascrc(&mp->m_sb))
-			xfs_btree_init_block(mp, buf, XFS_FIBT_CRC_MAGIC, 0, 0,
-						agno, XFS_BTREE_CRC_BLOCKS);
-		else
-			xfs_btree_init_block(mp, buf, XFS_FIBT_MAGIC, 0, 0,
-						agno, 0);
-		libxfs_writebuf(buf, LIBXFS_EXIT_ON_FAILURE);
-		xfs_perag_put(pag);
-	}
+	ai.mp = mp;
+	ai.sbp = sbp;
+	ai.agsize = agsize;
+	ai.agcount = agcount;
+	ai.dblocks = dblocks;
+	ai.loginternal = loginternal;
+	ai.logagno = logagno;
+	ai.logstart = logstart;
+	ai.logblocks = logblocks;
+	ai.lalign = lalign;
+	ai.finobt = finobt;
+	initialise_ags(&ai);
+	worst_freelist = ai.worst_freelist;
 
 	/*
 	 * Touch last block, make fs the right size if it's a file.
@@ -2979,9 +3488,22 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 	}
 
 	/*
-	 * Allocate the root inode and anything else in the proto file.
+	 * Allocate the root inode and anything else in the proto file.  Nothing
+	 * in there cancels a dirty transaction, so let the commits write the
+	 * inodes back in batches.
 	 */
+	libxfs_trans_batch = 256;
 	parse_proto(mp, &fsx, &protostring);
+	populate_fs(mp, &fsx, &popopts);
+	libxfs_trans_batch = 0;
+	libxfs_trans_batch_flush();
+	if (popopts.inodes && !qflag)
+		printf(_("populated: %llu files, %llu directories, "
+			 "%llu links, %llu attributes\n"),
+			(unsigned long long)popopts.made_files,
+			(unsigned long long)popopts.made_dirs,
+			(unsigned long long)popopts.made_links,
+			(unsigned long long)popopts.made_attrs);
 
 	/*
 	 * Protect ourselves against possible stupidity
@@ -3028,6 +3550,7 @@ _("size %s specified for log subvolume is too large, maximum is %lld blocks\n"),
 	 * Need to drop references to inodes we still hold, first.
 	 */
 	libxfs_rtmount_destroy(mp);
+	libxfs_icache_purge();
 	libxfs_bcache_purge();
 
 	/*
@@ -3178,6 +3701,7 @@ usage( void )
 /* force overwrite */	[-f]\n\
 /* inode size */	[-i log=n|perblock=n|size=num,maxpct=n,attr=0|1|2,\n\
 			    projid32bit=0|1,sparse=0|1]\n\
+/* discard */		[-D chunk=num,threads=n,unused=0|1,progress=0|1]\n\
 /* no discard */	[-K]\n\
 /* log subvol */	[-l agnum=n,internal,size=num,logdev=xxx,version=n\n\
 			    sunit=value|su=num,sectlog=n|sectsize=num,\n\
@@ -3185,6 +3709,9 @@ usage( void )
 /* label */		[-L label (maximum 12 characters)]\n\
 /* naming */		[-n log=n|size=num,version=2|ci,ftype=0|1]\n\
 /* no-op info only */	[-N]\n\
+/* populate */		[-G inodes=n,fanout=n,size=num,frag=n,links=n,\n\
+			    xattrs=n,nattrs=n,attrsize=num,seed=n]\n\
+/* probe device */	[-P]\n\
 /* prototype file */	[-p fname]\n\
 /* quiet */		[-q]\n\
 /* realtime subvol */	[-r extsize=num,size=num,rtdev=xxx]\n\
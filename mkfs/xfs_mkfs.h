@@ -77,8 +77,26 @@ extern long long cvtnum (unsigned int blocksize,
 			 unsigned int sectorsize, char *s);
 
 /* proto.c */
+struct populate_opts {
+	__uint64_t	inodes;		/* to create, 0 for none */
+	int		fanout;		/* entries in each directory */
+	__uint64_t	size;		/* bytes, of each file */
+	int		frag;		/* percent of files fragmented */
+	int		links;		/* percent of files with a second link */
+	int		xattrs;		/* percent of inodes with attributes */
+	int		nattrs;		/* attributes on each of those */
+	int		attrsize;	/* bytes, of each attribute value */
+	unsigned int	seed;
+	__uint64_t	made_files;	/* what was created */
+	__uint64_t	made_dirs;
+	__uint64_t	made_links;
+	__uint64_t	made_attrs;
+};
+
 extern char *setup_proto (char *fname);
 extern void parse_proto (xfs_mount_t *mp, struct fsxattr *fsx, char **pp);
+extern void populate_fs (xfs_mount_t *mp, struct fsxattr *fsx,
+		struct populate_opts *po);
 extern void res_failed (int err);
 
 /* maxtrres.c */
@@ -86,4 +104,15 @@ extern int max_trans_res (int crcs_enabled, int dirversion,
 		int sectorlog, int blocklog, int inodelog, int dirblocklog,
 		int logversion, int log_sunit);
 
+/* probe.c */
+struct dev_probe {
+	int		smallio;	/* bytes, of the small reads */
+	int		depth;		/* queue depth small reads scale to */
+	double		iops;		/* small random reads at that depth */
+	int		iosize;		/* bytes, where bandwidth levels off */
+	double		bandwidth;	/* bytes per second, the most seen */
+};
+extern int probe_device (int fd, __uint64_t size, int sectorsize,
+		struct dev_probe *dp);
+
 #endif	/* __XFS_MKFS_H__ */
@@ -45,7 +45,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-V] [-x] [-p prog] [-c cmd]... [-d project]... [path]\n"),
+		_("Usage: %s [-V] [-x] [-b] [-p prog] [-c cmd]... [-d project]... [path]\n"),
 		progname);
 	exit(1);
 }
@@ -104,8 +104,11 @@ init(
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "c:d:D:P:p:t:xV")) != EOF) {
+	while ((c = getopt(argc, argv, "bc:d:D:P:p:t:xV")) != EOF) {
 		switch (c) {
+		case 'b':	/* batch commands on stdin */
+			add_batch_mode();
+			break;
 		case 'c':	/* commands */
 			add_user_command(optarg);
 			break;
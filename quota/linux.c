@@ -57,6 +57,8 @@ xcommand_to_qcommand(
 		return Q_XQUOTARM;
 	case XFS_QSYNC:
 		return Q_XQUOTASYNC;
+	case XFS_GETNEXTQUOTA:
+		return Q_XGETNEXTQUOTA;
 	}
 	return 0;
 }
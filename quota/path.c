@@ -75,6 +75,7 @@ pathlist_f(void)
 {
 	int		i;
 
+	fs_table_load_projects();
 	for (i = 0; i < fs_count; i++)
 		printpath(&fs_table[i], i, 1, &fs_table[i] == fs_path);
 	return 0;
@@ -87,6 +88,7 @@ print_f(
 {
 	int		i;
 
+	fs_table_load_projects();
 	for (i = 0; i < fs_count; i++)
 		printpath(&fs_table[i], i, 0, 0);
 	return 0;
@@ -99,6 +101,7 @@ path_f(
 {
 	int	i;
 
+	fs_table_load_projects();
 	if (fs_count == 0) {
 		printf(_("No paths are available\n"));
 		return 0;
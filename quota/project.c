@@ -16,6 +16,8 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <pthread.h>
+#include <dirent.h>
 #include "command.h"
 #include "input.h"
 #include "init.h"
@@ -85,148 +87,326 @@ project_help(void)
 " below the command line arguments. -d 0 means only apply the actions\n"
 " to the top level of the projects. -d -1 means no recursion limit (default).\n"
 "\n"
+" The -T <threads> option sets how many threads walk the trees, by default\n"
+" one per online CPU.\n"
+"\n"
 " The /etc/projid and /etc/projects file formats are simple, and described\n"
 " on the xfs_quota man page.\n"
 "\n"));
 }
 
-static int
-check_project(
-	const char		*path,
-	const struct stat	*stat,
-	int			flag,
-	struct FTW		*data)
-{
-	struct fsxattr		fsx;
-	int			fd;
+/*
+ * The trees are walked by several threads, each taking a directory at a
+ * time off a shared stack and working on its entries relative to the open
+ * directory, so no path has to be looked up again for the ioctls.  Each
+ * thread collects its messages and only writes them out in large pieces,
+ * so the output of different threads doesn't interleave mid-line.
+ */
+#define MAX_WALK_THREADS	64
+#define WALK_OUTBUF		65536
+
+typedef struct walk_dir {
+	struct walk_dir	*next;
+	char		*path;
+	int		level;
+} walk_dir_t;
+
+typedef struct walk {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wait;
+	walk_dir_t	*stack;
+	int		busy;		/* threads working on a directory */
+	int		type;
+	dev_t		dev;
+} walk_t;
+
+typedef struct walk_out {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+} walk_out_t;
+
+typedef struct walk_thread {
+	pthread_t	tid;
+	walk_t		*walk;
+	walk_out_t	out;		/* reports, for stdout */
+	walk_out_t	err;		/* errors, for stderr */
+	int		errors;
+} walk_thread_t;
+
+static int walk_threads;
+static pthread_mutex_t walk_output_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	if (recurse_depth >= 0 && data->level > recurse_depth)
-		return -1;
+static void
+walk_flush(
+	walk_out_t	*o,
+	FILE		*fp)
+{
+	if (!o->len)
+		return;
+	pthread_mutex_lock(&walk_output_lock);
+	fwrite(o->buf, 1, o->len, fp);
+	pthread_mutex_unlock(&walk_output_lock);
+	o->len = 0;
+}
 
-	if (flag == FTW_NS ){
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, path);
-		return 0;
+static void
+walk_printf(
+	walk_thread_t	*wt,
+	int		error,
+	const char	*fmt,
+	...)
+{
+	walk_out_t	*o = error ? &wt->err : &wt->out;
+	va_list		ap;
+	int		len;
+
+	if (error)
+		wt->errors++;
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (o->len + len < o->size)
+			break;
+		o->size = o->len + len + WALK_OUTBUF;
+		o->buf = realloc(o->buf, o->size);
+		if (!o->buf) {
+			perror("realloc");
+			exit(1);
+		}
 	}
-	if (EXCLUDED_FILE_TYPES(stat->st_mode)) {
-		fprintf(stderr, _("%s: skipping special file %s\n"), progname, path);
-		return 0;
+	o->len += len;
+	if (o->len >= WALK_OUTBUF)
+		walk_flush(o, error ? stderr : stdout);
+}
+
+static void
+walk_push(
+	walk_t		*w,
+	const char	*path,
+	int		level)
+{
+	walk_dir_t	*wd;
+
+	wd = malloc(sizeof(walk_dir_t));
+	if (!wd || !(wd->path = strdup(path))) {
+		perror("malloc");
+		exit(1);
 	}
+	wd->level = level;
+	pthread_mutex_lock(&w->lock);
+	wd->next = w->stack;
+	w->stack = wd;
+	pthread_cond_signal(&w->wait);
+	pthread_mutex_unlock(&w->lock);
+}
 
-	if ((fd = open(path, O_RDONLY|O_NOCTTY)) == -1) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot open %s: %s\n"),
-			progname, path, strerror(errno));
-	} else if ((xfsctl(path, fd, XFS_IOC_FSGETXATTR, &fsx)) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot get flags on %s: %s\n"),
-			progname, path, strerror(errno));
-	} else {
-		if (fsx.fsx_projid != prid)
-			printf(_("%s - project identifier is not set"
-				 " (inode=%u, tree=%u)\n"),
-				path, fsx.fsx_projid, (unsigned int)prid);
-		if (!(fsx.fsx_xflags & XFS_XFLAG_PROJINHERIT))
-			printf(_("%s - project inheritance flag is not set\n"),
-				path);
+/* next directory to read, or NULL once there's nothing left to do */
+static walk_dir_t *
+walk_pop(
+	walk_t		*w,
+	walk_dir_t	*done)
+{
+	walk_dir_t	*wd;
+
+	if (done) {
+		free(done->path);
+		free(done);
 	}
-	if (fd != -1)
-		close(fd);
-	return 0;
+	pthread_mutex_lock(&w->lock);
+	if (done)
+		w->busy--;
+	while (!w->stack && w->busy)
+		pthread_cond_wait(&w->wait, &w->lock);
+	wd = w->stack;
+	if (wd) {
+		w->stack = wd->next;
+		w->busy++;
+	} else
+		pthread_cond_broadcast(&w->wait);
+	pthread_mutex_unlock(&w->lock);
+	return wd;
 }
 
-static int
-clear_project(
+/* check, set up or clear one inode, name is relative to dirfd */
+static void
+project_inode(
+	walk_thread_t		*wt,
+	int			dirfd,
+	const char		*name,
 	const char		*path,
-	const struct stat	*stat,
-	int			flag,
-	struct FTW		*data)
+	struct stat		*st)
 {
 	struct fsxattr		fsx;
 	int			fd;
 
-	if (recurse_depth >= 0 && data->level > recurse_depth)
-		return -1;
-
-	if (flag == FTW_NS ){
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, path);
-		return 0;
-	}
-	if (EXCLUDED_FILE_TYPES(stat->st_mode)) {
-		fprintf(stderr, _("%s: skipping special file %s\n"), progname, path);
-		return 0;
+	if (EXCLUDED_FILE_TYPES(st->st_mode)) {
+		walk_printf(wt, 0, _("%s: skipping special file %s\n"),
+			progname, path);
+		return;
 	}
 
-	if ((fd = open(path, O_RDONLY|O_NOCTTY)) == -1) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot open %s: %s\n"),
+	if ((fd = openat(dirfd, name, O_RDONLY|O_NOCTTY|O_NOFOLLOW)) == -1) {
+		walk_printf(wt, 1, _("%s: cannot open %s: %s\n"),
 			progname, path, strerror(errno));
-		return 0;
-	} else if (xfsctl(path, fd, XFS_IOC_FSGETXATTR, &fsx) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot get flags on %s: %s\n"),
+		return;
+	}
+	if (xfsctl(path, fd, XFS_IOC_FSGETXATTR, &fsx) < 0) {
+		walk_printf(wt, 1, _("%s: cannot get flags on %s: %s\n"),
 			progname, path, strerror(errno));
 		close(fd);
-		return 0;
+		return;
 	}
 
-	fsx.fsx_projid = 0;
-	fsx.fsx_xflags &= ~XFS_XFLAG_PROJINHERIT;
-	if (xfsctl(path, fd, XFS_IOC_FSSETXATTR, &fsx) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot clear project on %s: %s\n"),
-			progname, path, strerror(errno));
+	switch (wt->walk->type) {
+	case CHECK_PROJECT:
+		if (fsx.fsx_projid != prid)
+			walk_printf(wt, 0, _("%s - project identifier is not set"
+				 " (inode=%u, tree=%u)\n"),
+				path, fsx.fsx_projid, (unsigned int)prid);
+		if (!(fsx.fsx_xflags & XFS_XFLAG_PROJINHERIT))
+			walk_printf(wt, 0,
+				_("%s - project inheritance flag is not set\n"),
+				path);
+		break;
+	case CLEAR_PROJECT:
+		fsx.fsx_projid = 0;
+		fsx.fsx_xflags &= ~XFS_XFLAG_PROJINHERIT;
+		if (xfsctl(path, fd, XFS_IOC_FSSETXATTR, &fsx) < 0)
+			walk_printf(wt, 1,
+				_("%s: cannot clear project on %s: %s\n"),
+				progname, path, strerror(errno));
+		break;
+	case SETUP_PROJECT:
+		fsx.fsx_projid = prid;
+		fsx.fsx_xflags |= XFS_XFLAG_PROJINHERIT;
+		if (xfsctl(path, fd, XFS_IOC_FSSETXATTR, &fsx) < 0)
+			walk_printf(wt, 1,
+				_("%s: cannot set project on %s: %s\n"),
+				progname, path, strerror(errno));
+		break;
 	}
 	close(fd);
-	return 0;
 }
 
-static int
-setup_project(
-	const char		*path,
-	const struct stat	*stat,
-	int			flag,
-	struct FTW		*data)
+static void
+project_walk_dir(
+	walk_thread_t		*wt,
+	walk_dir_t		*wd)
 {
-	struct fsxattr		fsx;
+	walk_t			*w = wt->walk;
+	char			path[PATH_MAX];
+	struct dirent		*dent;
+	struct stat		st;
+	DIR			*dir;
 	int			fd;
 
-	if (recurse_depth >= 0 && data->level > recurse_depth)
-		return -1;
-
-	if (flag == FTW_NS ){
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, path);
-		return 0;
+	fd = open(wd->path, O_RDONLY|O_NOCTTY|O_NOFOLLOW|O_DIRECTORY);
+	if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+		walk_printf(wt, 1, _("%s: cannot open %s: %s\n"),
+			progname, wd->path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
 	}
-	if (EXCLUDED_FILE_TYPES(stat->st_mode)) {
-		fprintf(stderr, _("%s: skipping special file %s\n"), progname, path);
-		return 0;
+	while ((dent = readdir(dir)) != NULL) {
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", wd->path,
+				dent->d_name) >= sizeof(path)) {
+			walk_printf(wt, 1, _("%s: cannot stat file %s\n"),
+				progname, path);
+			continue;
+		}
+		if (fstatat(fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			walk_printf(wt, 1, _("%s: cannot stat file %s\n"),
+				progname, path);
+			continue;
+		}
+		/* stay on the one filesystem, like FTW_MOUNT */
+		if (st.st_dev != w->dev)
+			continue;
+		project_inode(wt, fd, dent->d_name, path, &st);
+		if (S_ISDIR(st.st_mode) &&
+		    (recurse_depth < 0 || wd->level + 1 < recurse_depth))
+			walk_push(w, path, wd->level + 1);
 	}
+	closedir(dir);
+}
 
-	if ((fd = open(path, O_RDONLY|O_NOCTTY)) == -1) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot open %s: %s\n"),
-			progname, path, strerror(errno));
-		return 0;
-	} else if (xfsctl(path, fd, XFS_IOC_FSGETXATTR, &fsx) < 0) {
+static void *
+project_walk_thread(
+	void			*arg)
+{
+	walk_thread_t		*wt = arg;
+	walk_dir_t		*wd = NULL;
+
+	while ((wd = walk_pop(wt->walk, wd)) != NULL)
+		project_walk_dir(wt, wd);
+	return NULL;
+}
+
+static void
+project_walk(
+	char			*dir,
+	int			type)
+{
+	walk_thread_t		*threads;
+	walk_t			w;
+	struct stat		st;
+	int			nthreads = walk_threads;
+	int			i;
+
+	if (lstat(dir, &st) < 0) {
 		exitcode = 1;
-		fprintf(stderr, _("%s: cannot get flags on %s: %s\n"),
-			progname, path, strerror(errno));
-		close(fd);
-		return 0;
+		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, dir);
+		return;
 	}
 
-	fsx.fsx_projid = prid;
-	fsx.fsx_xflags |= XFS_XFLAG_PROJINHERIT;
-	if (xfsctl(path, fd, XFS_IOC_FSSETXATTR, &fsx) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot set project on %s: %s\n"),
-			progname, path, strerror(errno));
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.wait, NULL);
+	w.type = type;
+	w.dev = st.st_dev;
+
+	threads = calloc(nthreads, sizeof(walk_thread_t));
+	if (!threads) {
+		perror("calloc");
+		exit(1);
 	}
-	close(fd);
-	return 0;
+	for (i = 0; i < nthreads; i++)
+		threads[i].walk = &w;
+
+	/* the top of the tree first, then everything below it */
+	project_inode(&threads[0], AT_FDCWD, dir, dir, &st);
+	if (S_ISDIR(st.st_mode) && recurse_depth != 0)
+		walk_push(&w, dir, 0);
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, project_walk_thread,
+				   &threads[i])) {
+			nthreads = i;
+			break;
+		}
+	}
+	project_walk_thread(&threads[0]);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i].tid, NULL);
+
+	for (i = 0; i < walk_threads; i++) {
+		walk_flush(&threads[i].out, stdout);
+		walk_flush(&threads[i].err, stderr);
+		free(threads[i].out.buf);
+		free(threads[i].err.buf);
+		if (threads[i].errors)
+			exitcode = 1;
+	}
+	free(threads);
+	pthread_cond_destroy(&w.wait);
+	pthread_mutex_destroy(&w.lock);
 }
 
 static void
@@ -238,17 +418,16 @@ project_operations(
 	switch (type) {
 	case CHECK_PROJECT:
 		printf(_("Checking project %s (path %s)...\n"), project, dir);
-		nftw(dir, check_project, 100, FTW_PHYS|FTW_MOUNT);
 		break;
 	case SETUP_PROJECT:
 		printf(_("Setting up project %s (path %s)...\n"), project, dir);
-		nftw(dir, setup_project, 100, FTW_PHYS|FTW_MOUNT);
 		break;
 	case CLEAR_PROJECT:
 		printf(_("Clearing project %s (path %s)...\n"), project, dir);
-		nftw(dir, clear_project, 100, FTW_PHYS|FTW_MOUNT);
 		break;
 	}
+	fflush(stdout);
+	project_walk(dir, type);
 }
 
 static void
@@ -281,7 +460,8 @@ project_f(
 {
 	int		c, type = 0, ispath = 0;
 
-	while ((c = getopt(argc, argv, "cd:p:sC")) != EOF) {
+	walk_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "cd:p:sCT:")) != EOF) {
 		switch (c) {
 		case 'c':
 			type = CHECK_PROJECT;
@@ -301,6 +481,15 @@ project_f(
 		case 'C':
 			type = CLEAR_PROJECT;
 			break;
+		case 'T':
+			walk_threads = atoi(optarg);
+			if (walk_threads <= 0) {
+				exitcode = 1;
+				fprintf(stderr, _("%s: bad thread count %s\n"),
+					progname, optarg);
+				return 0;
+			}
+			break;
 		default:
 			return command_usage(&project_cmd);
 		}
@@ -308,6 +497,10 @@ project_f(
 
 	if (argc == optind)
 		return command_usage(&project_cmd);
+	if (walk_threads <= 0)
+		walk_threads = 1;
+	else if (walk_threads > MAX_WALK_THREADS)
+		walk_threads = MAX_WALK_THREADS;
 
 	/* no options - just check the given projects */
 	if (!type)
@@ -350,7 +543,8 @@ project_init(void)
 	project_cmd.name = "project";
 	project_cmd.altname = "tree";
 	project_cmd.cfunc = project_f;
-	project_cmd.args = _("[-c|-s|-C|-d <depth>|-p <path>] project ...");
+	project_cmd.args =
+		_("[-c|-s|-C|-d <depth>|-p <path>|-T <threads>] project ...");
 	project_cmd.argmin = 1;
 	project_cmd.argmax = -1;
 	project_cmd.oneline = _("check, setup or clear project quota trees");
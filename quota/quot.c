@@ -18,10 +18,12 @@
 
 #include "command.h"
 #include <ctype.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <grp.h>
 #include "init.h"
 #include "quota.h"
+#include "atomic.h"
 
 typedef struct du {
 	struct du	*next;
@@ -43,7 +45,8 @@ static du_t		du[3][NDU];
 static du_t		*duhash[3][DUHASH];
 static int		ndu[3];	/* #usr/grp/prj */
 
-#define NBSTAT 		4069
+#define NBSTAT		16384
+#define QUOT_MAX_THREADS	32
 
 static time_t now;
 static cmdinfo_t quot_cmd;
@@ -76,8 +79,20 @@ quot_help(void)
 "\n"));
 }
 
+/*
+ * Each bulkstat thread counts into its own accumulator, a hash of du_t
+ * per id type much like the global one, and they are all merged into
+ * the global tables once the threads are done.
+ */
+struct quot_acc {
+	du_t		*hash[3][DUHASH];
+	__uint64_t	sizes[TSIZE];
+	__uint64_t	overflow;
+};
+
 static void
 quot_bulkstat_add(
+	struct quot_acc	*acc,
 	xfs_bstat_t	*p,
 	uint		flags)
 {
@@ -94,31 +109,26 @@ quot_bulkstat_add(
 		if (!(S_ISDIR(p->bs_mode) || S_ISREG(p->bs_mode)))
 			return;
 		if (size >= TSIZE) {
-			overflow += size;
+			acc->overflow += size;
 			size = TSIZE - 1;
 		}
-		sizes[(int)size]++;
+		acc->sizes[(int)size]++;
 		return;
 	}
 	for (i = 0; i < 3; i++) {
 		id = (i == 0) ? p->bs_uid : ((i == 1) ?
 			p->bs_gid : bstat_get_projid(p));
-		hp = &duhash[i][id % DUHASH];
+		hp = &acc->hash[i][id % DUHASH];
 		for (dp = *hp; dp; dp = dp->next)
 			if (dp->id == id)
 				break;
 		if (dp == NULL) {
-			if (ndu[i] >= NDU)
+			dp = calloc(1, sizeof(du_t));
+			if (!dp)
 				return;
-			dp = &du[i][(ndu[i]++)];
 			dp->next = *hp;
 			*hp = dp;
 			dp->id = id;
-			dp->nfiles = 0;
-			dp->blocks = 0;
-			dp->blocks30 = 0;
-			dp->blocks60 = 0;
-			dp->blocks90 = 0;
 		}
 		dp->blocks += size;
 
@@ -132,16 +142,130 @@ quot_bulkstat_add(
 	}
 }
 
+/* add an accumulator's counts into the global tables, and free it */
 static void
-quot_bulkstat_mount(
-	char			*fsdir,
-	uint			flags)
+quot_acc_merge(
+	struct quot_acc	*acc)
+{
+	du_t		*ap, *next;
+	du_t		*dp;
+	du_t		**hp;
+	int		i, h;
+
+	for (i = 0; i < TSIZE; i++)
+		sizes[i] += acc->sizes[i];
+	overflow += acc->overflow;
+
+	for (i = 0; i < 3; i++) {
+		for (h = 0; h < DUHASH; h++) {
+			for (ap = acc->hash[i][h]; ap; ap = next) {
+				next = ap->next;
+				hp = &duhash[i][h];
+				for (dp = *hp; dp; dp = dp->next)
+					if (dp->id == ap->id)
+						break;
+				if (dp == NULL && ndu[i] < NDU) {
+					dp = &du[i][(ndu[i]++)];
+					dp->next = *hp;
+					*hp = dp;
+					dp->id = ap->id;
+					dp->nfiles = 0;
+					dp->blocks = 0;
+					dp->blocks30 = 0;
+					dp->blocks60 = 0;
+					dp->blocks90 = 0;
+				}
+				if (dp) {
+					dp->blocks += ap->blocks;
+					dp->blocks30 += ap->blocks30;
+					dp->blocks60 += ap->blocks60;
+					dp->blocks90 += ap->blocks90;
+					dp->nfiles += ap->nfiles;
+				}
+				free(ap);
+			}
+		}
+	}
+	free(acc);
+}
+
+struct quot_scan {
+	char		*fsdir;
+	int		fsfd;
+	uint		flags;
+	int		ino_shift;	/* log2 of the inode numbers per AG */
+	__u32		agcount;
+	atomic_t	next_ag;
+};
+
+/*
+ * Bulkstat one AG at a time, taking the next AG nobody has started on,
+ * and count the inodes in this thread's accumulator.
+ */
+static void *
+quot_bulkstat_thread(
+	void			*arg)
 {
+	struct quot_scan	*scan = arg;
+	struct quot_acc		*acc;
 	xfs_fsop_bulkreq_t	bulkreq;
 	xfs_bstat_t		*buf;
-	__u64			last = 0;
+	__u64			last, end;
+	__u32			agno;
 	__s32			count;
-	int			i, sts, fsfd;
+	int			i, sts;
+
+	acc = calloc(1, sizeof(*acc));
+	buf = (xfs_bstat_t *)calloc(NBSTAT, sizeof(xfs_bstat_t));
+	if (!acc || !buf) {
+		perror("calloc");
+		free(buf);
+		free(acc);
+		return NULL;
+	}
+
+	bulkreq.lastip = &last;
+	bulkreq.icount = NBSTAT;
+	bulkreq.ubuffer = buf;
+	bulkreq.ocount = &count;
+
+	while ((agno = atomic_inc_return(&scan->next_ag) - 1) <
+							scan->agcount) {
+		/* bulkstat returns the inodes after lastip */
+		last = agno ? ((__u64)agno << scan->ino_shift) - 1 : 0;
+		end = agno + 1 < scan->agcount ?
+			(__u64)(agno + 1) << scan->ino_shift : ~0ULL;
+		while ((sts = xfsctl(scan->fsdir, scan->fsfd,
+				     XFS_IOC_FSBULKSTAT, &bulkreq)) == 0) {
+			if (count == 0)
+				break;
+			for (i = 0; i < count && buf[i].bs_ino < end; i++)
+				quot_bulkstat_add(acc, &buf[i], scan->flags);
+			if (i < count)
+				break;
+		}
+		if (sts < 0) {
+			perror("XFS_IOC_FSBULKSTAT");
+			break;
+		}
+	}
+	free(buf);
+	return acc;
+}
+
+static void
+quot_bulkstat_mount(
+	char			*fsdir,
+	uint			flags)
+{
+	struct quot_scan	scan;
+	xfs_fsop_geom_v1_t	geo;
+	pthread_t		tids[QUOT_MAX_THREADS];
+	struct quot_acc		*acc;
+	long			ncpus;
+	int			nthreads;
+	int			agblklog;
+	int			i, sts;
 	du_t			**dp;
 
 	/*
@@ -156,34 +280,51 @@ quot_bulkstat_mount(
 			*dp = NULL;
 	ndu[0] = ndu[1] = ndu[2] = 0;
 
-	fsfd = open(fsdir, O_RDONLY);
-	if (fsfd < 0) {
+	memset(&scan, 0, sizeof(scan));
+	scan.fsdir = fsdir;
+	scan.flags = flags;
+	scan.fsfd = open(fsdir, O_RDONLY);
+	if (scan.fsfd < 0) {
 		perror(fsdir);
 		return;
 	}
 
-	buf = (xfs_bstat_t *)calloc(NBSTAT, sizeof(xfs_bstat_t));
-	if (!buf) {
-		perror("calloc");
-		close(fsfd);
-		return;
+	/*
+	 * Inode numbers are the AG number above the AG relative inode
+	 * number, so each AG's inodes can be bulkstat'd on their own.
+	 * Without the geometry, do the whole filesystem as one piece.
+	 */
+	scan.agcount = 1;
+	if (xfsctl(fsdir, scan.fsfd, XFS_IOC_FSGEOMETRY_V1, &geo) == 0 &&
+	    geo.agcount > 1 && geo.inodesize) {
+		for (agblklog = 0; (1ULL << agblklog) < geo.agblocks;
+		     agblklog++)
+			;
+		for (i = 0; (geo.inodesize << i) < geo.blocksize; i++)
+			;
+		scan.ino_shift = agblklog + i;
+		scan.agcount = geo.agcount;
 	}
 
-	bulkreq.lastip = &last;
-	bulkreq.icount = NBSTAT;
-	bulkreq.ubuffer = buf;
-	bulkreq.ocount = &count;
-
-	while ((sts = xfsctl(fsdir, fsfd, XFS_IOC_FSBULKSTAT, &bulkreq)) == 0) {
-		if (count == 0)
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = min(min(ncpus > 0 ? ncpus : 1, QUOT_MAX_THREADS),
+		       scan.agcount);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, quot_bulkstat_thread,
+				   &scan))
 			break;
-		for (i = 0; i < count; i++)
-			quot_bulkstat_add(&buf[i], flags);
+	nthreads = i;
+	if (!nthreads) {
+		acc = quot_bulkstat_thread(&scan);
+		if (acc)
+			quot_acc_merge(acc);
 	}
-	if (sts < 0)
-		perror("XFS_IOC_FSBULKSTAT"),
-	free(buf);
-	close(fsfd);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], (void **)&acc);
+		if (acc)
+			quot_acc_merge(acc);
+	}
+	close(scan.fsfd);
 }
 
 static int
@@ -43,6 +43,7 @@ enum {
 	XFS_GETQSTAT,	/* get quota subsystem status */
 	XFS_QUOTARM,	/* free disk space used by dquots */
 	XFS_QSYNC,	/* flush delayed allocate space */
+	XFS_GETNEXTQUOTA, /* get limits and usage of the next dquot */
 };
 
 /*
@@ -72,6 +72,81 @@ report_help(void)
 "\n"));
 }
 
+/*
+ * State for stepping through the dquots that exist with XFS_GETNEXTQUOTA,
+ * rather than asking for every ID in a range or in the password, group
+ * or projects database one at a time.
+ */
+typedef struct dquot_walk {
+	FILE		*fp;
+	uint		form;
+	uint		type;
+	fs_path_t	*mount;
+	uint		flags;
+	void		(*fn)(struct dquot_walk *, fs_disk_quota_t *);
+} dquot_walk_t;
+
+/*
+ * Call w->fn on each dquot with an ID from lower to upper.  Returns -1 if
+ * the kernel doesn't know XFS_GETNEXTQUOTA, so that the caller can fall
+ * back to looking up the IDs one by one.
+ */
+static int
+walk_dquots(
+	dquot_walk_t	*w,
+	uint		lower,
+	uint		upper)
+{
+	fs_disk_quota_t	d;
+	uint		id = lower;
+
+	for (;;) {
+		if (xfsquotactl(XFS_GETNEXTQUOTA, w->mount->fs_name, w->type,
+				id, (void *)&d) < 0) {
+			if (id == lower && (errno == EINVAL || errno == ENOSYS))
+				return -1;
+			if (errno != ENOENT && errno != ESRCH)
+				perror("XFS_GETNEXTQUOTA");
+			return 0;
+		}
+		if (d.d_id < id || d.d_id > upper)
+			return 0;
+		w->fn(w, &d);
+		if (d.d_id == UINT_MAX)
+			return 0;
+		id = d.d_id + 1;
+	}
+}
+
+static void
+dump_dquot(
+	FILE		*fp,
+	fs_disk_quota_t	*d,
+	uint		id,
+	char		*dev)
+{
+	if (!d->d_blk_softlimit && !d->d_blk_hardlimit &&
+	    !d->d_ino_softlimit && !d->d_ino_hardlimit &&
+	    !d->d_rtb_softlimit && !d->d_rtb_hardlimit)
+		return;
+	fprintf(fp, "fs = %s\n", dev);
+	/* this branch is for backward compatibility reasons */
+	if (d->d_rtb_softlimit || d->d_rtb_hardlimit)
+		fprintf(fp, "%-10d %7llu %7llu %7llu %7llu %7llu %7llu\n", id,
+			(unsigned long long)d->d_blk_softlimit,
+			(unsigned long long)d->d_blk_hardlimit,
+			(unsigned long long)d->d_ino_softlimit,
+			(unsigned long long)d->d_ino_hardlimit,
+			(unsigned long long)d->d_rtb_softlimit,
+			(unsigned long long)d->d_rtb_hardlimit);
+	else
+		fprintf(fp, "%-10d %7llu %7llu %7llu %7llu\n", id,
+			(unsigned long long)d->d_blk_softlimit,
+			(unsigned long long)d->d_blk_hardlimit,
+			(unsigned long long)d->d_ino_softlimit,
+			(unsigned long long)d->d_ino_hardlimit);
+}
+
 static void
 dump_file(
 	FILE		*fp,
@@ -86,26 +161,15 @@ dump_file(
 			perror("XFS_GETQUOTA");
 		return;
 	}
-	if (!d.d_blk_softlimit && !d.d_blk_hardlimit &&
-	    !d.d_ino_softlimit && !d.d_ino_hardlimit &&
-	    !d.d_rtb_softlimit && !d.d_rtb_hardlimit)
-		return;
-	fprintf(fp, "fs = %s\n", dev);
-	/* this branch is for backward compatibility reasons */
-	if (d.d_rtb_softlimit || d.d_rtb_hardlimit)
-		fprintf(fp, "%-10d %7llu %7llu %7llu %7llu %7llu %7llu\n", id,
-			(unsigned long long)d.d_blk_softlimit,
-			(unsigned long long)d.d_blk_hardlimit,
-			(unsigned long long)d.d_ino_softlimit,
-			(unsigned long long)d.d_ino_hardlimit,
-			(unsigned long long)d.d_rtb_softlimit,
-			(unsigned long long)d.d_rtb_hardlimit);
-	else
-		fprintf(fp, "%-10d %7llu %7llu %7llu %7llu\n", id,
-			(unsigned long long)d.d_blk_softlimit,
-			(unsigned long long)d.d_blk_hardlimit,
-			(unsigned long long)d.d_ino_softlimit,
-			(unsigned long long)d.d_ino_hardlimit);
+	dump_dquot(fp, &d, id, dev);
+}
+
+static void
+dump_walk(
+	dquot_walk_t	*w,
+	fs_disk_quota_t	*d)
+{
+	dump_dquot(w->fp, d, d->d_id, w->mount->fs_name);
 }
 
 static void
@@ -117,6 +181,7 @@ dump_limits_any_type(
 	uint		upper)
 {
 	fs_path_t	*mount;
+	dquot_walk_t	w = { fp, 0, type, NULL, 0, dump_walk };
 	uint		id;
 
 	if ((mount = fs_table_lookup(dir, FS_MOUNT_POINT)) == NULL) {
@@ -126,6 +191,10 @@ dump_limits_any_type(
 		return;
 	}
 
+	w.mount = mount;
+	if (walk_dquots(&w, lower, upper ? upper : UINT_MAX) == 0)
+		return;
+
 	if (upper) {
 		for (id = lower; id <= upper; id++)
 			dump_file(fp, id, type, mount->fs_name);
@@ -286,27 +355,20 @@ report_header(
 }
 
 static int
-report_mount(
+report_dquot(
 	FILE		*fp,
-	__uint32_t	id,
+	fs_disk_quota_t	*dq,
 	char		*name,
 	uint		form,
 	uint		type,
 	fs_path_t	*mount,
 	uint		flags)
 {
-	fs_disk_quota_t	d;
-	char		*dev = mount->fs_name;
+	fs_disk_quota_t	d = *dq;
 	char		c[8], h[8], s[8];
 	uint		qflags;
 	int		count;
 
-	if (xfsquotactl(XFS_GETQUOTA, dev, type, id, (void *)&d) < 0) {
-		if (errno != ENOENT && errno != ENOSYS && errno != ESRCH)
-			perror("XFS_GETQUOTA");
-		return 0;
-	}
-
 	if (flags & TERSE_FLAG) {
 		count = 0;
 		if ((form & XFS_BLOCK_QUOTA) && d.d_bcount)
@@ -390,6 +452,265 @@ report_mount(
 	return 1;
 }
 
+static int
+report_mount(
+	FILE		*fp,
+	__uint32_t	id,
+	char		*name,
+	uint		form,
+	uint		type,
+	fs_path_t	*mount,
+	uint		flags)
+{
+	fs_disk_quota_t	d;
+
+	if (xfsquotactl(XFS_GETQUOTA, mount->fs_name, type, id,
+			(void *)&d) < 0) {
+		if (errno != ENOENT && errno != ENOSYS && errno != ESRCH)
+			perror("XFS_GETQUOTA");
+		return 0;
+	}
+	return report_dquot(fp, &d, name, form, type, mount, flags);
+}
+
+/*
+ * Cache of ID to name mappings for the reports.  A lookup can go out to
+ * a directory server, so each ID is only looked up once, and once enough
+ * IDs have missed the cache the whole database is read in a single pass,
+ * which is much cheaper than as many separate lookups.  Projects come
+ * from a flat file, so that is always read whole, once.
+ */
+#define NAME_PREFETCH	256	/* misses before reading everything */
+
+typedef struct name_ent {
+	struct name_ent	*next;
+	uint		id;
+	char		*name;		/* NULL if the ID has no name */
+} name_ent_t;
+
+typedef struct name_cache {
+	name_ent_t	**hash;
+	uint		size;		/* buckets, a power of two */
+	uint		count;
+	uint		misses;
+	int		loaded;
+} name_cache_t;
+
+static name_cache_t	name_caches[3];
+
+static name_cache_t *
+name_cache_for(
+	uint		type)
+{
+	switch (type) {
+	case XFS_GROUP_QUOTA:
+		return &name_caches[1];
+	case XFS_PROJ_QUOTA:
+		return &name_caches[2];
+	}
+	return &name_caches[0];
+}
+
+static uint
+name_hash(
+	name_cache_t	*nc,
+	uint		id)
+{
+	return (id * 0x9e370001U) & (nc->size - 1);
+}
+
+static name_ent_t *
+name_cache_find(
+	name_cache_t	*nc,
+	uint		id)
+{
+	name_ent_t	*ne;
+
+	if (!nc->size)
+		return NULL;
+	for (ne = nc->hash[name_hash(nc, id)]; ne; ne = ne->next)
+		if (ne->id == id)
+			return ne;
+	return NULL;
+}
+
+static void
+name_cache_grow(
+	name_cache_t	*nc)
+{
+	name_ent_t	**old = nc->hash;
+	uint		oldsize = nc->size;
+	name_ent_t	*ne, *next;
+	uint		i;
+
+	nc->size = oldsize ? oldsize * 2 : 256;
+	nc->hash = calloc(nc->size, sizeof(name_ent_t *));
+	if (!nc->hash) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < oldsize; i++) {
+		for (ne = old[i]; ne; ne = next) {
+			next = ne->next;
+			ne->next = nc->hash[name_hash(nc, ne->id)];
+			nc->hash[name_hash(nc, ne->id)] = ne;
+		}
+	}
+	free(old);
+}
+
+static name_ent_t *
+name_cache_add(
+	name_cache_t	*nc,
+	uint		id,
+	const char	*name)
+{
+	name_ent_t	*ne;
+
+	if ((ne = name_cache_find(nc, id)) != NULL)
+		return ne;
+	if (nc->count >= nc->size)
+		name_cache_grow(nc);
+	ne = malloc(sizeof(name_ent_t));
+	if (!ne || (name && !(ne->name = strdup(name)))) {
+		perror("malloc");
+		exit(1);
+	}
+	if (!name)
+		ne->name = NULL;
+	ne->id = id;
+	ne->next = nc->hash[name_hash(nc, id)];
+	nc->hash[name_hash(nc, id)] = ne;
+	nc->count++;
+	return ne;
+}
+
+/* read the whole user, group or projects database into the cache */
+static void
+name_cache_load(
+	name_cache_t	*nc,
+	uint		type)
+{
+	struct passwd	*u;
+	struct group	*g;
+	fs_project_t	*p;
+
+	switch (type) {
+	case XFS_USER_QUOTA:
+		setpwent();
+		while ((u = getpwent()) != NULL)
+			name_cache_add(nc, u->pw_uid, u->pw_name);
+		endpwent();
+		break;
+	case XFS_GROUP_QUOTA:
+		setgrent();
+		while ((g = getgrent()) != NULL)
+			name_cache_add(nc, g->gr_gid, g->gr_name);
+		endgrent();
+		break;
+	case XFS_PROJ_QUOTA:
+		setprent();
+		while ((p = getprent()) != NULL)
+			name_cache_add(nc, p->pr_prid, p->pr_name);
+		endprent();
+		break;
+	}
+	nc->loaded = 1;
+}
+
+/* the name of a user, group or project ID, or NULL if it has none */
+static char *
+name_lookup(
+	uint		type,
+	uint		id)
+{
+	name_cache_t	*nc = name_cache_for(type);
+	name_ent_t	*ne;
+	struct passwd	*u;
+	struct group	*g;
+
+	if ((ne = name_cache_find(nc, id)) != NULL)
+		return ne->name;
+	if (!nc->loaded &&
+	    (type == XFS_PROJ_QUOTA || ++nc->misses > NAME_PREFETCH)) {
+		name_cache_load(nc, type);
+		if ((ne = name_cache_find(nc, id)) != NULL)
+			return ne->name;
+	}
+
+	/* directories may not list everything, so still ask for this one */
+	switch (type) {
+	case XFS_USER_QUOTA:
+		u = getpwuid(id);
+		return name_cache_add(nc, id, u ? u->pw_name : NULL)->name;
+	case XFS_GROUP_QUOTA:
+		g = getgrgid(id);
+		return name_cache_add(nc, id, g ? g->gr_name : NULL)->name;
+	}
+	return name_cache_add(nc, id, NULL)->name;
+}
+
+static void
+name_cache_free(void)
+{
+	name_cache_t	*nc;
+	name_ent_t	*ne, *next;
+	uint		i;
+
+	for (nc = name_caches; nc < &name_caches[3]; nc++) {
+		for (i = 0; i < nc->size; i++) {
+			for (ne = nc->hash[i]; ne; ne = next) {
+				next = ne->next;
+				free(ne->name);
+				free(ne);
+			}
+		}
+		free(nc->hash);
+		memset(nc, 0, sizeof(*nc));
+	}
+}
+
+static void
+report_walk(
+	dquot_walk_t	*w,
+	fs_disk_quota_t	*d)
+{
+	char		n[NMAX];
+	char		*name = NULL;
+
+	if (!(w->flags & NO_LOOKUP_FLAG))
+		name = name_lookup(w->type, d->d_id);
+	if (name)
+		strncpy(n, name, sizeof(n)-1);
+	else
+		snprintf(n, sizeof(n)-1, "#%u", d->d_id);
+	n[sizeof(n)-1] = '\0';
+	if (report_dquot(w->fp, d, n, w->form, w->type, w->mount, w->flags))
+		w->flags |= NO_HEADER_FLAG;
+}
+
+/*
+ * Report on the dquots that exist in the ID range, or all of them if no
+ * upper bound is given.  Returns -1 if the kernel can't find them for us.
+ */
+static int
+report_existing(
+	FILE		*fp,
+	uint		form,
+	uint		type,
+	fs_path_t	*mount,
+	uint		lower,
+	uint		upper,
+	uint		*flags)
+{
+	dquot_walk_t	w = { fp, form, type, mount, *flags, report_walk };
+
+	if (walk_dquots(&w, lower, upper ? upper : UINT_MAX) < 0)
+		return -1;
+	*flags = w.flags;
+	return 0;
+}
+
 static void
 report_user_mount(
 	FILE		*fp,
@@ -403,6 +724,10 @@ report_user_mount(
 	char		n[NMAX];
 	uint		id;
 
+	if (report_existing(fp, form, XFS_USER_QUOTA, mount,
+			lower, upper, &flags) == 0)
+		goto out;
+
 	if (upper) {	/* identifier range specified */
 		for (id = lower; id <= upper; id++) {
 			snprintf(n, sizeof(n)-1, "#%u", id);
@@ -424,6 +749,7 @@ report_user_mount(
 		endpwent();
 	}
 
+out:
 	if (flags & NO_HEADER_FLAG)
 		fputc('\n', fp);
 }
@@ -441,6 +767,10 @@ report_group_mount(
 	char		n[NMAX];
 	uint		id;
 
+	if (report_existing(fp, form, XFS_GROUP_QUOTA, mount,
+			lower, upper, &flags) == 0)
+		goto out;
+
 	if (upper) {	/* identifier range specified */
 		for (id = lower; id <= upper; id++) {
 			snprintf(n, sizeof(n)-1, "#%u", id);
@@ -460,6 +790,7 @@ report_group_mount(
 				flags |= NO_HEADER_FLAG;
 		}
 	}
+out:
 	if (flags & NO_HEADER_FLAG)
 		fputc('\n', fp);
 	endgrent();
@@ -478,6 +809,10 @@ report_project_mount(
 	char		n[NMAX];
 	uint		id;
 
+	if (report_existing(fp, form, XFS_PROJ_QUOTA, mount,
+			lower, upper, &flags) == 0)
+		goto out;
+
 	if (upper) {	/* identifier range specified */
 		for (id = lower; id <= upper; id++) {
 			snprintf(n, sizeof(n)-1, "#%u", id);
@@ -500,6 +835,7 @@ report_project_mount(
 		endprent();
 	}
 
+out:
 	if (flags & NO_HEADER_FLAG)
 		fputc('\n', fp);
 }
@@ -631,6 +967,7 @@ report_f(
 		report_any_type(fp, form, type, argv[optind++],
 				lower, upper, flags);
 	}
+	name_cache_free();
 
 	if (fname)
 		fclose(fp);
@@ -236,6 +236,12 @@ traverse_int_dablock(xfs_mount_t	*mp,
 		da_cursor->level[i].n = XFS_BUF_TO_DA_INTNODE(bp);
 #endif
 
+		/* the leaf level walk starts on this node's children */
+		if (i == 1)
+			da_readahead_children(mp, da_cursor->blkmap,
+					mp->m_attr_geo->fsbcount, bp, 0,
+					DA_RA_WINDOW, &xfs_attr3_leaf_buf_ops);
+
 		/*
 		 * set up new bno for next level down
 		 */
@@ -629,6 +635,11 @@ verify_da_path(xfs_mount_t	*mp,
 #endif
 		entry = cursor->level[this_level].index = 0;
 
+		if (this_level == 1)
+			da_readahead_children(mp, cursor->blkmap,
+					mp->m_attr_geo->fsbcount, bp, 0,
+					DA_RA_WINDOW, &xfs_attr3_leaf_buf_ops);
+
 		/*
 		 * We want to rewrite the buffer on a CRC error seeing as it
 		 * contains what appears to be a valid node block, but only if
@@ -1376,6 +1387,12 @@ process_leaf_attr_level(xfs_mount_t	*mp,
 		if (bp->b_error == -EFSBADCRC)
 			repair++;
 
+		/* keep the readahead DA_RA_WINDOW leaves in front of us */
+		da_readahead_children(mp, da_cursor->blkmap,
+				mp->m_attr_geo->fsbcount, da_cursor->level[1].bp,
+				da_cursor->level[1].index + DA_RA_WINDOW, 1,
+				&xfs_attr3_leaf_buf_ops);
+
 		leaf = bp->b_addr;
 		xfs_attr3_leaf_hdr_from_disk(mp->m_attr_geo, &leafhdr, leaf);
 
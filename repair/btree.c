@@ -28,6 +28,13 @@
 
 #define BTREE_PTR_MAX		(BTREE_KEY_MAX + 1)
 
+/*
+ * Freed nodes are kept on a list in the root for the tree's next splits,
+ * up to this many.  Repair's prefetch queues fill and drain continuously,
+ * and without the list each cycle costs a malloc and free per node.
+ */
+#define BTREE_POOL_MAX		256
+
 struct btree_node {
 	unsigned long		num_keys;
 	unsigned long		keys[BTREE_KEY_MAX];
@@ -43,6 +50,8 @@ struct btree_root {
 	struct btree_node	*root_node;
 	struct btree_cursor	*cursor;	/* track path to end leaf */
 	int			height;
+	struct btree_node	*free_nodes;	/* linked through ptrs[0] */
+	int			num_free;
 	/* lookup cache */
 	int			keys_valid;	/* set if the cache is valid */
 	unsigned long		cur_key;
@@ -78,16 +87,31 @@ struct btree_root {
 
 
 static struct btree_node *
-btree_node_alloc(void)
+btree_node_alloc(
+	struct btree_root	*root)
 {
-	return calloc(1, sizeof(struct btree_node));
+	struct btree_node	*node = root->free_nodes;
+
+	if (!node)
+		return calloc(1, sizeof(struct btree_node));
+	root->free_nodes = node->ptrs[0];
+	root->num_free--;
+	memset(node, 0, sizeof(struct btree_node));
+	return node;
 }
 
 static void
 btree_node_free(
+	struct btree_root	*root,
 	struct btree_node 	*node)
 {
-	free(node);
+	if (root->num_free >= BTREE_POOL_MAX) {
+		free(node);
+		return;
+	}
+	node->ptrs[0] = root->free_nodes;
+	root->free_nodes = node;
+	root->num_free++;
 }
 
 static void
@@ -100,7 +124,7 @@ btree_free_nodes(
 	if (level)
 		for (i = 0; i <= node->num_keys; i++)
 			btree_free_nodes(node->ptrs[i], level - 1);
-	btree_node_free(node);
+	free(node);
 }
 
 static void
@@ -110,7 +134,7 @@ __btree_init(
 	memset(root, 0, sizeof(struct btree_root));
 	root->height = 1;
 	root->cursor = calloc(1, sizeof(struct btree_cursor));
-	root->root_node = btree_node_alloc();
+	root->root_node = btree_node_alloc(root);
 	ASSERT(root->root_node);
 #ifdef BTREE_STATS
 	root->stats.max_items = 1;
@@ -122,7 +146,14 @@ static void
 __btree_free(
 	struct btree_root	*root)
 {
+	struct btree_node	*node;
+
 	btree_free_nodes(root->root_node, root->height - 1);
+	while ((node = root->free_nodes) != NULL) {
+		root->free_nodes = node->ptrs[0];
+		free(node);
+	}
+	root->num_free = 0;
 	free(root->cursor);
 	root->height = 0;
 	root->cursor = NULL;
@@ -318,6 +349,24 @@ btree_find(
 	return root->cursor->node->ptrs[root->cursor->index];
 }
 
+/*
+ * Find the item with the highest key in the tree.
+ */
+void *
+btree_find_last(
+	struct btree_root	*root,
+	unsigned long		*key)
+{
+	struct btree_node	*node = root->root_node;
+	int			height = root->height;
+
+	while (--height > 0)
+		node = node->ptrs[node->num_keys];
+	if (node->num_keys == 0)
+		return NULL;
+	return btree_find(root, node->keys[node->num_keys - 1], key);
+}
+
 void *
 btree_lookup(
 	struct btree_root	*root,
@@ -772,7 +821,7 @@ btree_increase_height(
 		return NULL;
 	root->cursor = new_cursor;
 
-	new_root = btree_node_alloc();
+	new_root = btree_node_alloc(root);
 	if (!new_root)
 		return NULL;
 
@@ -812,13 +861,13 @@ btree_split(
 	struct btree_node	*new_node;
 	int			i;
 
-	new_node = btree_node_alloc();
+	new_node = btree_node_alloc(root);
 	if (!new_node)
 		return NULL;
 
 	if (btree_insert_item(root, level + 1, node->keys[BTREE_KEY_MIN],
 							new_node) != 0) {
-		btree_node_free(new_node);
+		btree_node_free(root, new_node);
 		return NULL;
 	}
 
@@ -988,7 +1037,7 @@ btree_decrease_height(
 	root->stats.max_items /= BTREE_PTR_MAX;
 #endif
 	root->root_node = old_root->ptrs[0];
-	btree_node_free(old_root);
+	btree_node_free(root, old_root);
 	root->height--;
 }
 
@@ -1139,7 +1188,7 @@ btree_delete_node(
 #ifdef BTREE_STATS
 	root->stats.alloced -= 1;
 #endif
-	btree_node_free(root->cursor[level].node);
+	btree_node_free(root, root->cursor[level].node);
 
 	btree_delete_key(root, level + 1);
 }
@@ -1185,7 +1234,9 @@ btree_delete(
 	struct btree_root	*root,
 	unsigned long		key)
 {
+	struct btree_node	*leaf;
 	void			*value;
+	int			index;
 
 	value = btree_lookup(root, key);
 	if (!value)
@@ -1196,6 +1247,23 @@ btree_delete(
 	root->stats.num_items -= 1;
 #endif
 
+	/*
+	 * If the leaf neither underflows nor loses its last key, nothing
+	 * above it changes and the cursor is left on the next key, so keep
+	 * it: deleting keys in ascending order, as prefetch does with each
+	 * batch it reads, then finds every key after the first through the
+	 * lookup cache rather than searching down from the root.
+	 */
+	leaf = root->cursor[0].node;
+	index = root->cursor[0].index;
+	if (leaf->num_keys - 1 >= BTREE_KEY_MIN &&
+	    index < leaf->num_keys - 1) {
+		btree_delete_key(root, 0);
+		root->cur_key = leaf->keys[index];
+		root->next_value = NULL;
+		return value;
+	}
+
 	btree_delete_key(root, 0);
 
 	btree_invalidate_cursor(root);
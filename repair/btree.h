@@ -45,6 +45,11 @@ btree_find(
 	unsigned long		key,
 	unsigned long		*actual_key);
 
+void *
+btree_find_last(
+	struct btree_root	*root,
+	unsigned long		*key);
+
 void *
 btree_peek_prev(
 	struct btree_root	*root,
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "globals.h"
+#include "incore.h"
+#include "protos.h"
+#include "err_protos.h"
+#include "rt.h"
+#include "checkpoint.h"
+
+/*
+ * A checkpoint file is a header, the global repair state, the incore
+ * superblock, the block maps and the inode trees, followed by a crc32c of
+ * all of that.  It is written to a temporary file which is renamed over
+ * the old checkpoint once it is safely on disk, so there is always one
+ * complete checkpoint to go back to.
+ *
+ * Before the checkpoint is written all dirty buffers are flushed, so the
+ * device matches the incore state.  The header records a crc32c of the
+ * headers of all AGs as they are on disk at that point, and resuming
+ * refuses to go on if the device doesn't match it any more, e.g. because
+ * the filesystem was mounted in between.  Only phases 3, 4 and 5 write
+ * checkpoints; the duplicate extent and free space trees only live within
+ * phases 4 and 5 and are empty at the phase boundaries.
+ */
+#define CHECKPOINT_MAGIC	0x58524350	/* XRCP */
+#define CHECKPOINT_VERSION	1
+
+struct checkpoint {
+	FILE			*fp;
+	__uint32_t		crc;
+	int			error;
+};
+
+struct checkpoint_hdr {
+	__uint32_t		magic;
+	__uint32_t		version;
+	__uint32_t		phase;		/* last completed phase */
+	__uint32_t		no_modify;
+	uuid_t			uuid;
+	__uint64_t		dblocks;
+	__uint64_t		rextents;
+	__uint32_t		agcount;
+	__uint32_t		agblocks;
+	__uint32_t		devcrc;		/* crc32c of the AG headers */
+	__uint32_t		pad;
+};
+
+/* global repair state that later phases look at */
+static int *checkpoint_ints[] = {
+	&bad_ino_btree, &fs_is_dirty,
+	&need_root_inode, &need_root_dotdot, &need_rbmino, &need_rsumino,
+	&lost_quotas, &have_uquotino, &have_gquotino, &have_pquotino,
+	&lost_uquotino, &lost_gquotino, &lost_pquotino,
+};
+
+static __uint64_t *checkpoint_counts[] = {
+	&sb_icount, &sb_ifree, &sb_fdblocks, &sb_frextents,
+};
+
+static char		*checkpoint_path;
+
+void
+checkpoint_init(
+	char			*path)
+{
+	checkpoint_path = path;
+}
+
+void
+checkpoint_put(
+	struct checkpoint	*ck,
+	const void		*buf,
+	size_t			len)
+{
+	if (ck->error)
+		return;
+	if (fwrite(buf, len, 1, ck->fp) != 1)
+		ck->error = errno ? errno : EIO;
+	ck->crc = crc32c(ck->crc, buf, len);
+}
+
+void
+checkpoint_get(
+	struct checkpoint	*ck,
+	void			*buf,
+	size_t			len)
+{
+	if (fread(buf, len, 1, ck->fp) != 1)
+		do_error(_("checkpoint file %s is truncated\n"),
+			checkpoint_path);
+}
+
+/*
+ * crc32c of the superblock, AGF, AGI and AGFL sectors of every AG, read
+ * straight from the device.
+ */
+static __uint32_t
+checkpoint_devcrc(
+	struct xfs_mount	*mp)
+{
+	int			fd = libxfs_device_to_fd(mp->m_ddev_targp->dev);
+	size_t			len = NUM_AGH_SECTS * mp->m_sb.sb_sectsize;
+	__uint32_t		crc = 0;
+	xfs_agnumber_t		agno;
+	off64_t			off;
+	char			*buf;
+
+	buf = memalign(libxfs_device_alignment(), len);
+	if (!buf)
+		do_error(_("couldn't allocate checkpoint buffer\n"));
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		off = (off64_t)XFS_AG_DADDR(mp, agno, 0) << BBSHIFT;
+		if (libxfs_device_pread(fd, buf, len, off) != len)
+			do_error(_("couldn't read ag %u headers: %s\n"),
+				agno, strerror(errno));
+		crc = crc32c(crc, buf, len);
+	}
+	free(buf);
+	return crc;
+}
+
+static void
+checkpoint_fill_hdr(
+	struct xfs_mount	*mp,
+	struct checkpoint_hdr	*hdr,
+	int			phase)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = CHECKPOINT_MAGIC;
+	hdr->version = CHECKPOINT_VERSION;
+	hdr->phase = phase;
+	hdr->no_modify = no_modify;
+	platform_uuid_copy(&hdr->uuid, &mp->m_sb.sb_uuid);
+	hdr->dblocks = mp->m_sb.sb_dblocks;
+	hdr->rextents = mp->m_sb.sb_rextents;
+	hdr->agcount = mp->m_sb.sb_agcount;
+	hdr->agblocks = mp->m_sb.sb_agblocks;
+	hdr->devcrc = checkpoint_devcrc(mp);
+}
+
+void
+checkpoint_write(
+	struct xfs_mount	*mp,
+	int			phase)
+{
+	struct checkpoint	ck = { 0 };
+	struct checkpoint_hdr	hdr;
+	char			*tmp;
+	unsigned int		i;
+	__uint32_t		crc;
+	int			fd = libxfs_device_to_fd(mp->m_ddev_targp->dev);
+
+	if (!checkpoint_path)
+		return;
+
+	/* get the device in line with the incore state first */
+	if (!no_modify) {
+		libxfs_bcache_flush();
+		if (fsync(fd) < 0 && errno != EINVAL)
+			do_warn(_("couldn't flush device: %s\n"),
+				strerror(errno));
+	}
+
+	tmp = malloc(strlen(checkpoint_path) + sizeof(".new"));
+	if (!tmp)
+		do_error(_("couldn't allocate checkpoint file name\n"));
+	sprintf(tmp, "%s.new", checkpoint_path);
+
+	ck.fp = fopen(tmp, "w");
+	if (!ck.fp) {
+		do_warn(_("couldn't create checkpoint file %s: %s\n"),
+			tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	checkpoint_fill_hdr(mp, &hdr, phase);
+	checkpoint_put(&ck, &hdr, sizeof(hdr));
+	for (i = 0; i < ARRAY_SIZE(checkpoint_ints); i++)
+		checkpoint_put(&ck, checkpoint_ints[i], sizeof(int));
+	for (i = 0; i < ARRAY_SIZE(checkpoint_counts); i++)
+		checkpoint_put(&ck, checkpoint_counts[i], sizeof(__uint64_t));
+	checkpoint_put(&ck, &mp->m_sb, sizeof(mp->m_sb));
+
+	save_bmaps(&ck, mp);
+	if (save_inode_trees(&ck, mp)) {
+		do_warn(_("uncertain inodes left after phase %d, "
+			  "not writing checkpoint\n"), phase);
+		fclose(ck.fp);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+
+	i = btmcompute != NULL;
+	checkpoint_put(&ck, &i, sizeof(i));
+	if (btmcompute) {
+		checkpoint_put(&ck, btmcompute,
+			mp->m_sb.sb_rbmblocks * mp->m_sb.sb_blocksize);
+		checkpoint_put(&ck, sumcompute, mp->m_rsumsize);
+	}
+
+	crc = ck.crc;
+	checkpoint_put(&ck, &crc, sizeof(crc));
+
+	if (fflush(ck.fp) || fsync(fileno(ck.fp)))
+		ck.error = errno;
+	if (fclose(ck.fp) && !ck.error)
+		ck.error = errno;
+	if (!ck.error && rename(tmp, checkpoint_path) < 0)
+		ck.error = errno;
+	if (ck.error) {
+		do_warn(_("couldn't write checkpoint file %s: %s\n"),
+			tmp, strerror(ck.error));
+		unlink(tmp);
+	} else
+		do_log(_("        - checkpoint after phase %d written to %s\n"),
+			phase, checkpoint_path);
+	free(tmp);
+}
+
+/*
+ * Check the trailing crc before we touch any incore state with it.
+ */
+static void
+checkpoint_verify(
+	struct checkpoint	*ck)
+{
+	char			buf[65536];
+	struct stat64		st;
+	off64_t			left;
+	__uint32_t		crc = 0;
+	__uint32_t		disk_crc;
+	size_t			len;
+
+	if (fstat64(fileno(ck->fp), &st) < 0)
+		do_error(_("couldn't stat checkpoint file %s: %s\n"),
+			checkpoint_path, strerror(errno));
+	if (st.st_size < sizeof(struct checkpoint_hdr) + sizeof(disk_crc))
+		do_error(_("checkpoint file %s is truncated\n"),
+			checkpoint_path);
+
+	for (left = st.st_size - sizeof(disk_crc); left > 0; left -= len) {
+		len = MIN(left, sizeof(buf));
+		checkpoint_get(ck, buf, len);
+		crc = crc32c(crc, buf, len);
+	}
+	checkpoint_get(ck, &disk_crc, sizeof(disk_crc));
+	if (crc != disk_crc)
+		do_error(
+_("checkpoint file %s is corrupt, remove it to run a full repair\n"),
+			checkpoint_path);
+	rewind(ck->fp);
+}
+
+/*
+ * Load the state saved in the checkpoint file, if there is one.  Returns
+ * the phase the checkpoint was written after, or 0 to start from scratch.
+ */
+int
+checkpoint_resume(
+	struct xfs_mount	*mp)
+{
+	struct checkpoint	ck = { 0 };
+	struct checkpoint_hdr	hdr;
+	struct checkpoint_hdr	dev;
+	unsigned int		i;
+	char			*reason = NULL;
+
+	if (!checkpoint_path)
+		return 0;
+
+	ck.fp = fopen(checkpoint_path, "r");
+	if (!ck.fp) {
+		if (errno == ENOENT)
+			return 0;
+		do_error(_("couldn't open checkpoint file %s: %s\n"),
+			checkpoint_path, strerror(errno));
+	}
+	checkpoint_verify(&ck);
+
+	checkpoint_get(&ck, &hdr, sizeof(hdr));
+	checkpoint_fill_hdr(mp, &dev, hdr.phase);
+	if (hdr.magic != CHECKPOINT_MAGIC)
+		reason = _("bad magic number");
+	else if (hdr.version != CHECKPOINT_VERSION)
+		reason = _("unsupported version");
+	else if (hdr.no_modify != no_modify)
+		reason = no_modify ? _("it was written in modify mode")
+				   : _("it was written in no modify mode");
+	else if (platform_uuid_compare(&hdr.uuid, &dev.uuid) ||
+		 hdr.dblocks != dev.dblocks || hdr.rextents != dev.rextents ||
+		 hdr.agcount != dev.agcount || hdr.agblocks != dev.agblocks)
+		reason = _("it is for a different filesystem");
+	else if (hdr.devcrc != dev.devcrc)
+		reason = _("the filesystem has changed since it was written");
+	if (reason)
+		do_error(
+_("can't resume from checkpoint file %s: %s.  Remove it to run a full repair.\n"),
+			checkpoint_path, reason);
+
+	for (i = 0; i < ARRAY_SIZE(checkpoint_ints); i++)
+		checkpoint_get(&ck, checkpoint_ints[i], sizeof(int));
+	for (i = 0; i < ARRAY_SIZE(checkpoint_counts); i++)
+		checkpoint_get(&ck, checkpoint_counts[i], sizeof(__uint64_t));
+	checkpoint_get(&ck, &mp->m_sb, sizeof(mp->m_sb));
+
+	restore_bmaps(&ck, mp);
+	restore_inode_trees(&ck, mp);
+
+	checkpoint_get(&ck, &i, sizeof(i));
+	if (i) {
+		rtinit(mp);
+		checkpoint_get(&ck, btmcompute,
+			mp->m_sb.sb_rbmblocks * mp->m_sb.sb_blocksize);
+		checkpoint_get(&ck, sumcompute, mp->m_rsumsize);
+	}
+	fclose(ck.fp);
+
+	do_log(_("Resuming from checkpoint after phase %d in %s\n"),
+		hdr.phase, checkpoint_path);
+	return hdr.phase;
+}
+
+/* the repair has finished, nothing to resume any more */
+void
+checkpoint_remove(void)
+{
+	if (checkpoint_path)
+		unlink(checkpoint_path);
+}
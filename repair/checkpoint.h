@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+/*
+ * Checkpoints of the incore state at phase boundaries, so that an
+ * interrupted repair can pick up after the last phase it completed.  The
+ * file is only meant to be read back by the same xfs_repair binary on
+ * the same machine, so everything is stored in host format.
+ */
+struct checkpoint;
+
+void
+checkpoint_init(
+	char			*path);
+
+int
+checkpoint_resume(
+	struct xfs_mount	*mp);
+
+void
+checkpoint_write(
+	struct xfs_mount	*mp,
+	int			phase);
+
+void
+checkpoint_remove(void);
+
+/* used by the incore state owners to save and restore their parts */
+void
+checkpoint_put(
+	struct checkpoint	*ck,
+	const void		*buf,
+	size_t			len);
+
+void
+checkpoint_get(
+	struct checkpoint	*ck,
+	void			*buf,
+	size_t			len);
+
+#endif /* _CHECKPOINT_H */
@@ -27,6 +27,44 @@
 #include "versions.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "scratch.h"
+#include "mem.h"
+
+/*
+ * Check the CRC, magic number and version of the nr inodes laid out from
+ * buf, and set ok[i] to whether inode i passed.  These are the first
+ * things process_dinode_int looks at, so an inode failing them is bad
+ * whatever else it holds, and one passing them needn't have its CRC
+ * checked again.  The CRCs are done several at a time, and the rest is
+ * a pass over the buffer that touches nothing but the first few bytes of
+ * each inode.  Returns the number of inodes that passed.
+ */
+static int
+prescan_inode_cluster(
+	struct xfs_mount	*mp,
+	char			*buf,
+	int			nr,
+	int			*ok)
+{
+	struct xfs_dinode	*dip;
+	int			good = 0;
+	int			i;
+
+	if (xfs_sb_version_hascrc(&mp->m_sb)) {
+		libxfs_dinode_verify_cksums(mp, buf, nr, ok);
+	} else {
+		for (i = 0; i < nr; i++)
+			ok[i] = 1;
+	}
+	for (i = 0; i < nr; i++, buf += mp->m_sb.sb_inodesize) {
+		dip = (struct xfs_dinode *)buf;
+		ok[i] = ok[i] &&
+			dip->di_magic == cpu_to_be16(XFS_DINODE_MAGIC) &&
+			xfs_dinode_good_version(mp, dip->di_version);
+		good += ok[i];
+	}
+	return good;
+}
 
 /*
  * validates inode block or chunk, returns # of good inodes
@@ -42,6 +80,7 @@ check_aginode_block(xfs_mount_t	*mp,
 	xfs_dinode_t	*dino_p;
 	int		i;
 	int		cnt = 0;
+	int		ok[XFS_MAX_BLOCKSIZE / XFS_DINODE_MIN_SIZE];
 	xfs_buf_t	*bp;
 
 	/*
@@ -59,12 +98,22 @@ check_aginode_block(xfs_mount_t	*mp,
 		return(0);
 	}
 
+	/*
+	 * most blocks looked at here are either all inodes or none, so
+	 * weed out the ones that can't be before the full checks.
+	 */
+	if (!prescan_inode_cluster(mp, bp->b_addr, mp->m_sb.sb_inopblock, ok))
+		goto out;
+
 	for (i = 0; i < mp->m_sb.sb_inopblock; i++)  {
+		if (!ok[i])
+			continue;
 		dino_p = xfs_make_iptr(mp, bp, i);
 		if (!verify_uncertain_dinode(mp, dino_p, agno,
-				XFS_OFFBNO_TO_AGINO(mp, agbno, i)))
+				XFS_OFFBNO_TO_AGINO(mp, agbno, i), 1))
 			cnt++;
 	}
+out:
 	if (cnt)
 		bp->b_ops = &xfs_inode_buf_ops;
 
@@ -587,6 +636,149 @@ process_inode_agbno_state(
 	pthread_mutex_unlock(&ag_locks[agno].lock);
 }
 
+/*
+ * Phase 3 collects the extents the inodes of the chunk it is working on
+ * claim, through chunk_digest_add, and keeps them on the chunk if nothing
+ * was wrong with any of its inodes.  digest_nexts is -1 when the thread
+ * isn't collecting, or has given up on the chunk for having too many.
+ */
+static __thread struct chunk_digest_ext	digest_exts[CHUNK_DIGEST_MAX];
+static __thread int			digest_nexts = -1;
+
+void
+chunk_digest_add(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		len)
+{
+	struct chunk_digest_ext	*e;
+
+	if (digest_nexts < 0)
+		return;
+	if (digest_nexts > 0) {
+		e = &digest_exts[digest_nexts - 1];
+		if (e->agno == agno && e->agbno + e->len == agbno) {
+			e->len += len;
+			return;
+		}
+	}
+	if (digest_nexts == CHUNK_DIGEST_MAX) {
+		digest_nexts = -1;
+		return;
+	}
+	e = &digest_exts[digest_nexts++];
+	e->agno = agno;
+	e->agbno = agbno;
+	e->len = len;
+}
+
+/*
+ * Whether phase 4 would do nothing with this in-use inode beyond checking
+ * its blocks against the duplicate extents and claiming them again.
+ * Directories are left to phase 4 for their parents, and realtime files
+ * and the superblock's inodes for their special handling.
+ */
+static int
+chunk_digest_inode_ok(
+	struct xfs_mount	*mp,
+	struct xfs_dinode	*dino,
+	xfs_ino_t		ino)
+{
+	int			mode = be16_to_cpu(dino->di_mode) & S_IFMT;
+
+	if (mode == S_IFDIR)
+		return 0;
+	if (mode == S_IFREG &&
+	    (be16_to_cpu(dino->di_flags) & XFS_DIFLAG_REALTIME))
+		return 0;
+	if (ino == mp->m_sb.sb_rbmino || ino == mp->m_sb.sb_rsumino ||
+	    ino == mp->m_sb.sb_uquotino || ino == mp->m_sb.sb_gquotino ||
+	    ino == mp->m_sb.sb_pquotino)
+		return 0;
+	return be32_to_cpu(dino->di_next_unlinked) == NULLAGINO;
+}
+
+static void
+chunk_digest_finish(
+	struct ino_tree_node	*irec,
+	int			keep)
+{
+	struct chunk_digest	*cd;
+	size_t			size;
+
+	free_chunk_digest(irec);
+	if (keep && digest_nexts >= 0) {
+		size = sizeof(*cd) + digest_nexts * sizeof(cd->exts[0]);
+		cd = scratch_alloc_near(irec, size);
+		if (cd) {
+			mem_add_scratch(MEM_INODES, size);
+			cd->nexts = digest_nexts;
+			memcpy(cd->exts, digest_exts,
+			       digest_nexts * sizeof(cd->exts[0]));
+			irec->digest = cd;
+		}
+	}
+	digest_nexts = -1;
+}
+
+/*
+ * Do phase 4's work on a chunk from its digest: if none of the blocks its
+ * inodes claimed is a duplicate, and none has been claimed again already,
+ * claim them and the inode blocks.  Returns 0 if the chunk has to be read
+ * and checked inode by inode instead.
+ */
+static int
+chunk_digest_apply(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	struct ino_tree_node	*first_irec)
+{
+	struct chunk_digest	*cd = first_irec->digest;
+	struct chunk_digest_ext	*e;
+	struct ino_tree_node	*ino_rec;
+	xfs_agblock_t		agbno;
+	xfs_agblock_t		end;
+	xfs_extlen_t		blen;
+	int			irec_offset;
+	int			icnt;
+	int			ok;
+
+	for (e = cd->exts; e < &cd->exts[cd->nexts]; e++) {
+		end = e->agbno + e->len;
+		pthread_mutex_lock(&ag_locks[e->agno].lock);
+		wait_for_ag_scan_locked(e->agno);
+		ok = !search_dup_extent(e->agno, e->agbno, end);
+		for (agbno = e->agbno; ok && agbno < end; agbno += blen)
+			ok = get_bmap_ext(e->agno, agbno, end, &blen) ==
+					XR_E_UNKNOWN;
+		pthread_mutex_unlock(&ag_locks[e->agno].lock);
+		if (!ok)
+			return 0;
+	}
+
+	for (e = cd->exts; e < &cd->exts[cd->nexts]; e++) {
+		pthread_mutex_lock(&ag_locks[e->agno].lock);
+		set_bmap_ext(e->agno, e->agbno, e->len, XR_E_INUSE);
+		pthread_mutex_unlock(&ag_locks[e->agno].lock);
+	}
+
+	ino_rec = first_irec;
+	irec_offset = 0;
+	agbno = XFS_AGINO_TO_AGBNO(mp, first_irec->ino_startnum);
+	for (icnt = 0; icnt < mp->m_ialloc_inos;
+	     icnt += mp->m_sb.sb_inopblock, agbno++) {
+		if (!is_inode_sparse(ino_rec, irec_offset))
+			process_inode_agbno_state(mp, agno, agbno);
+		irec_offset += mp->m_sb.sb_inopblock;
+		if (irec_offset == XFS_INODES_PER_CHUNK &&
+		    icnt + mp->m_sb.sb_inopblock < mp->m_ialloc_inos) {
+			ino_rec = next_ino_rec(ino_rec);
+			irec_offset = 0;
+		}
+	}
+	return 1;
+}
+
 /*
  * processes an inode allocation chunk/block, returns 1 on I/O errors,
  * 0 otherwise
@@ -607,7 +799,9 @@ process_inode_chunk(
 	xfs_ino_t		parent;
 	ino_tree_node_t		*ino_rec;
 	xfs_buf_t		**bplist;
+	xfs_buf_t		*bp;
 	xfs_dinode_t		*dino;
+	unsigned int		n;
 	int			icnt;
 	int			status;
 	int			is_used;
@@ -623,6 +817,8 @@ process_inode_chunk(
 	int			cluster_count;
 	int			bp_index;
 	int			cluster_offset;
+	int			digest_ok = 0;
+	unsigned long		warns = 0;
 
 	ASSERT(first_irec != NULL);
 	ASSERT(XFS_AGINO_TO_OFFSET(mp, first_irec->ino_startnum) == 0);
@@ -630,6 +826,17 @@ process_inode_chunk(
 	*bogus = 0;
 	ASSERT(mp->m_ialloc_blks > 0);
 
+	/*
+	 * if phase 3 kept what this chunk's inodes claim, phase 4 may not
+	 * need to read it at all
+	 */
+	if (check_dups && first_irec->digest) {
+		status = chunk_digest_apply(mp, agno, first_irec);
+		free_chunk_digest(first_irec);
+		if (status)
+			return 0;
+	}
+
 	blks_per_cluster = mp->m_inode_cluster_size >> mp->m_sb.sb_blocklog;
 	if (blks_per_cluster == 0)
 		blks_per_cluster = 1;
@@ -693,6 +900,20 @@ process_inode_chunk(
 
 		bplist[bp_index]->b_ops = &xfs_inode_buf_ops;
 
+		/*
+		 * Check all the inode CRCs of the cluster in one batch, unless
+		 * prefetch already did.  If any is bad we leave it to
+		 * process_dinode to find and report the bad ones one by one.
+		 */
+		bp = bplist[bp_index];
+		if (xfs_sb_version_hascrc(&mp->m_sb) &&
+		    bp->b_crc_off != XFS_DINODE_CRC_OFF) {
+			n = XFS_BUF_COUNT(bp) >> mp->m_sb.sb_inodelog;
+			if (libxfs_dinode_verify_cksums(mp, bp->b_addr, n,
+							NULL) == n)
+				bp->b_crc_off = XFS_DINODE_CRC_OFF;
+		}
+
 next_readbuf:
 		irec_offset += mp->m_sb.sb_inopblock * blks_per_cluster;
 		agbno += blks_per_cluster;
@@ -728,12 +949,21 @@ next_readbuf:
 				 * to reset them later to keep from losing the
 				 * chunk that they're in
 				 */
-				if (verify_dinode(mp, dino, agno, agino) == 0 ||
+				if (verify_dinode(mp, dino, agno, agino,
+						bplist[bp_index]->b_crc_off ==
+							XFS_DINODE_CRC_OFF) == 0 ||
 						(agno == 0 &&
 						(mp->m_sb.sb_rootino == agino ||
 						 mp->m_sb.sb_rsumino == agino ||
-						 mp->m_sb.sb_rbmino == agino)))
+						 mp->m_sb.sb_rbmino == agino))) {
+					/*
+					 * one good inode is all it takes to
+					 * keep the chunk, and the pass below
+					 * checks every inode anyway
+					 */
 					status++;
+					break;
+				}
 			}
 
 			irec_offset++;
@@ -786,6 +1016,15 @@ next_readbuf:
 		status = 0;
 	}
 
+	/*
+	 * in phase 3, keep what the chunk's inodes claim if they're all fine
+	 */
+	if (ino_discovery && !check_dups) {
+		digest_nexts = 0;
+		digest_ok = 1;
+		warns = do_warn_count();
+	}
+
 	/*
 	 * mark block as an inode block in the incore bitmap
 	 */
@@ -810,13 +1049,18 @@ next_readbuf:
 		status = process_dinode(mp, dino, agno, agino,
 				is_inode_free(ino_rec, irec_offset),
 				&ino_dirty, &is_used,ino_discovery, check_dups,
-				extra_attr_check, &isa_dir, &parent);
+				extra_attr_check,
+				bplist[bp_index]->b_crc_off == XFS_DINODE_CRC_OFF,
+				&isa_dir, &parent);
 
 		ASSERT(is_used != 3);
 		if (ino_dirty) {
 			dirty = 1;
 			libxfs_dinode_calc_crc(mp, dino);
 		}
+		if (digest_ok && (status || ino_dirty ||
+		    (is_used && !chunk_digest_inode_ok(mp, dino, ino))))
+			digest_ok = 0;
 
 		/*
 		 * XXX - if we want to try and keep
@@ -877,7 +1121,7 @@ next_readbuf:
 			 * because the parent info will
 			 * be solid then.
 			 */
-			if (!ino_discovery)  {
+			if (!ino_discovery && !health_check)  {
 				ASSERT(parent != 0);
 				set_inode_parent(ino_rec, irec_offset, parent);
 				ASSERT(parent ==
@@ -944,6 +1188,9 @@ process_next:
 			/*
 			 * done! - finished up irec and block simultaneously
 			 */
+			if (ino_discovery && !check_dups)
+				chunk_digest_finish(first_irec, digest_ok &&
+					!dirty && do_warn_count() == warns);
 			for (bp_index = 0; bp_index < cluster_count; bp_index++) {
 				if (!bplist[bp_index])
 					continue;
@@ -1081,6 +1328,55 @@ process_aginodes(
 	}
 }
 
+/*
+ * Read ahead the inode clusters of the chunks the next batch of uncertain
+ * records would fall in, so that verifying them isn't one synchronous read
+ * after another.  The reads are cluster sized, as process_inode_chunk()
+ * reads them, and the records are kept in inode order, so they go out in
+ * disk order.  Returns the first inode not yet read ahead for; the caller
+ * comes back for the next batch when it gets there.
+ */
+#define UNCERTAIN_RA_BATCH	256		/* records */
+
+static xfs_agino_t
+uncertain_readahead(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	struct ino_tree_node	*irec)
+{
+	xfs_agblock_t		max_agbno;
+	xfs_agblock_t		agbno;
+	xfs_agblock_t		end;
+	int			blks_per_cluster;
+	int			n;
+
+	blks_per_cluster = mp->m_inode_cluster_size >> mp->m_sb.sb_blocklog;
+	if (blks_per_cluster == 0)
+		blks_per_cluster = 1;
+
+	if (agno == mp->m_sb.sb_agcount - 1)
+		max_agbno = mp->m_sb.sb_dblocks -
+			(xfs_rfsblock_t) mp->m_sb.sb_agblocks * agno;
+	else
+		max_agbno = mp->m_sb.sb_agblocks;
+
+	for (n = 0; irec != NULL && n < UNCERTAIN_RA_BATCH;
+	     n++, irec = next_ino_rec(irec)) {
+		if (find_inode_rec(mp, agno, irec->ino_startnum))
+			continue;
+		agbno = XFS_AGINO_TO_AGBNO(mp, irec->ino_startnum);
+		agbno -= agbno % mp->m_ialloc_blks;
+		end = min(agbno + mp->m_ialloc_blks, max_agbno);
+		for (; agbno + blks_per_cluster <= end;
+		     agbno += blks_per_cluster)
+			libxfs_buf_readahead(mp->m_dev,
+					XFS_AGB_TO_DADDR(mp, agno, agbno),
+					XFS_FSB_TO_BB(mp, blks_per_cluster),
+					NULL);
+	}
+	return irec ? irec->ino_startnum : NULLAGINO;
+}
+
 /*
  * verify the uncertain inode list for an ag.
  * Good inodes get moved into the good inode tree.
@@ -1096,6 +1392,7 @@ check_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 	xfs_agino_t		start;
 	xfs_agino_t		i;
 	xfs_agino_t		agino;
+	xfs_agino_t		ra_next = 0;
 	int			got_some;
 
 	nrec = NULL;
@@ -1121,6 +1418,9 @@ check_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 	do_warn(_("found inodes not in the inode allocation tree\n"));
 
 	do {
+		if (irec->ino_startnum >= ra_next)
+			ra_next = uncertain_readahead(mp, agno, irec);
+
 		/*
 		 * check every confirmed (which in this case means
 		 * inode that we really suspect to be an inode) inode
@@ -1186,6 +1486,7 @@ process_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 	ino_tree_node_t		*irec;
 	ino_tree_node_t		*nrec;
 	xfs_agino_t		agino;
+	xfs_agino_t		ra_next = 0;
 	int			i;
 	int			bogus;
 	int			cnt;
@@ -1205,6 +1506,9 @@ process_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 	nrec = NULL;
 
 	do  {
+		if (irec->ino_startnum >= ra_next)
+			ra_next = uncertain_readahead(mp, agno, irec);
+
 		/*
 		 * check every confirmed inode
 		 */
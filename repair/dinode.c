@@ -710,6 +710,7 @@ _("Fatal error: inode %" PRIu64 " - blkmap_set_ext(): %s\n"
 			if (locked_agno != -1)
 				pthread_mutex_unlock(&ag_locks[locked_agno].lock);
 			pthread_mutex_lock(&ag_locks[agno].lock);
+			wait_for_ag_scan_locked(agno);
 			locked_agno = agno;
 		}
 
@@ -773,6 +774,8 @@ _("illegal state %d in block map %" PRIu64 "\n"),
 					state, b);
 			}
 		}
+		chunk_digest_add(agno, ebno - irec.br_blockcount,
+				 irec.br_blockcount);
 		*tot += irec.br_blockcount;
 	}
 	error = 0;
@@ -2178,6 +2181,7 @@ process_dinode_int(xfs_mount_t *mp,
 		int check_dups,		/* 1 == check if inode claims
 					 * duplicate blocks		*/
 		int extra_attr_check, /* 1 == do attribute format and value checks */
+		int crc_checked,	/* 1 == CRC known to be good */
 		int *isa_dir,		/* out == 1 if inode is a directory */
 		xfs_ino_t *parent)	/* out -- parent if ino is a dir */
 {
@@ -2222,7 +2226,7 @@ process_dinode_int(xfs_mount_t *mp,
 	 * Of course if we make any modifications after this, the inode gets
 	 * rewritten, and the CRC is updated automagically.
 	 */
-	if (xfs_sb_version_hascrc(&mp->m_sb) &&
+	if (xfs_sb_version_hascrc(&mp->m_sb) && !crc_checked &&
 	    !xfs_verify_cksum((char *)dino, mp->m_sb.sb_inodesize,
 				XFS_DINODE_CRC_OFF)) {
 		retval = 1;
@@ -2670,6 +2674,7 @@ process_dinode(
 	int		ino_discovery,
 	int		check_dups,
 	int		extra_attr_check,
+	int		crc_checked,
 	int		*isa_dir,
 	xfs_ino_t	*parent)
 {
@@ -2681,7 +2686,8 @@ process_dinode(
 #endif
 	return process_dinode_int(mp, dino, agno, ino, was_free, dirty, used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, extra_attr_check, isa_dir, parent);
+				check_dups, extra_attr_check, crc_checked,
+				isa_dir, parent);
 }
 
 /*
@@ -2689,13 +2695,15 @@ process_dinode(
  * this basically just verifies whether the inode is an inode
  * and whether or not it has been totally trashed.  returns 0
  * if the inode passes the cursory sanity check, 1 otherwise.
+ * crc_checked says the caller already found the inode's CRC good.
  */
 int
 verify_dinode(
 	xfs_mount_t	*mp,
 	xfs_dinode_t	*dino,
 	xfs_agnumber_t	agno,
-	xfs_agino_t	ino)
+	xfs_agino_t	ino,
+	int		crc_checked)
 {
 	xfs_ino_t	parent;
 	int		used = 0;
@@ -2708,7 +2716,7 @@ verify_dinode(
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, 0, &isa_dir, &parent);
+				check_dups, 0, crc_checked, &isa_dir, &parent);
 }
 
 /*
@@ -2721,7 +2729,8 @@ verify_uncertain_dinode(
 	xfs_mount_t	*mp,
 	xfs_dinode_t	*dino,
 	xfs_agnumber_t	agno,
-	xfs_agino_t	ino)
+	xfs_agino_t	ino,
+	int		crc_checked)
 {
 	xfs_ino_t	parent;
 	int		used = 0;
@@ -2734,5 +2743,5 @@ verify_uncertain_dinode(
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, 0, &isa_dir, &parent);
+				check_dups, 0, crc_checked, &isa_dir, &parent);
 }
@@ -74,6 +74,7 @@ process_dinode(xfs_mount_t *mp,
 		int check_dirs,
 		int check_dups,
 		int extra_attr_check,
+		int crc_checked,
 		int *isa_dir,
 		xfs_ino_t *parent);
 
@@ -81,13 +82,15 @@ int
 verify_dinode(xfs_mount_t *mp,
 		xfs_dinode_t *dino,
 		xfs_agnumber_t agno,
-		xfs_agino_t ino);
+		xfs_agino_t ino,
+		int crc_checked);
 
 int
 verify_uncertain_dinode(xfs_mount_t *mp,
 		xfs_dinode_t *dino,
 		xfs_agnumber_t agno,
-		xfs_agino_t ino);
+		xfs_agino_t ino,
+		int crc_checked);
 
 int
 verify_inum(xfs_mount_t		*mp,
@@ -113,6 +116,11 @@ void
 check_uncertain_aginodes(xfs_mount_t	*mp,
 			xfs_agnumber_t	agno);
 
+void
+chunk_digest_add(xfs_agnumber_t		agno,
+		xfs_agblock_t		agbno,
+		xfs_extlen_t		len);
+
 xfs_buf_t *
 get_agino_buf(xfs_mount_t	*mp,
 		xfs_agnumber_t	agno,
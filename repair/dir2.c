@@ -26,6 +26,7 @@
 #include "bmap.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "threads.h"
 
 /*
  * Known bad inode list.  These are seen when the leaf and node
@@ -88,6 +89,21 @@ namecheck(char *name, int length)
 	return(0);
 }
 
+/*
+ * look up the inode record for a directory entry.  in phase 3 the entry
+ * may point into an AG that phase 2 is still scanning, so wait for that.
+ */
+static ino_tree_node_t *
+find_entry_inode_rec(
+	xfs_mount_t	*mp,
+	xfs_ino_t	ino)
+{
+	xfs_agnumber_t	agno = XFS_INO_TO_AGNO(mp, ino);
+
+	wait_for_ag_scan(agno);
+	return find_inode_rec(mp, agno, XFS_INO_TO_AGINO(mp, ino));
+}
+
 /*
  * Multibuffer handling.
  * V2 directory blocks can be noncontiguous, needing multiple buffers.
@@ -125,6 +141,63 @@ da_read_buf(
 	return bp;
 }
 
+/*
+ * Read ahead count children of the node block in bp, starting at entry
+ * first, so that the walk along the level below finds them in the cache.
+ * blkmap maps the fork the node is in, whose blocks are fsbcount
+ * filesystem blocks long.  Children that can't be mapped are left for
+ * the walk to complain about.
+ */
+void
+da_readahead_children(
+	xfs_mount_t		*mp,
+	blkmap_t		*blkmap,
+	int			fsbcount,
+	struct xfs_buf		*bp,
+	int			first,
+	int			count,
+	const struct xfs_buf_ops *ops)
+{
+	struct xfs_buf_map	map_array[MAP_ARRAY_SZ];
+	struct xfs_buf_map	*map;
+	struct xfs_da_node_entry *btree;
+	struct xfs_da3_icnode_hdr nodehdr;
+	bmap_ext_t		*bmp;
+	bmap_ext_t		lbmp;
+	int			nex;
+	int			i;
+	int			j;
+
+	M_DIROPS(mp)->node_hdr_from_disk(&nodehdr, bp->b_addr);
+	btree = M_DIROPS(mp)->node_tree_p(bp->b_addr);
+	if (first < 0 || first >= nodehdr.count)
+		return;
+	count = min(count, nodehdr.count - first);
+
+	for (i = first; i < first + count; i++) {
+		nex = blkmap_getn(blkmap, be32_to_cpu(btree[i].before),
+				fsbcount, &bmp, &lbmp);
+		if (nex == 0)
+			continue;
+		map = map_array;
+		if (nex > MAP_ARRAY_SZ) {
+			map = calloc(nex, sizeof(*map));
+			if (map == NULL)
+				goto next;
+		}
+		for (j = 0; j < nex; j++) {
+			map[j].bm_bn = XFS_FSB_TO_DADDR(mp, bmp[j].startblock);
+			map[j].bm_len = XFS_FSB_TO_BB(mp, bmp[j].blockcount);
+		}
+		libxfs_buf_readahead_map(mp->m_dev, map, nex, ops);
+		if (map != map_array)
+			free(map);
+next:
+		if (bmp != &lbmp)
+			free(bmp);
+	}
+}
+
 /*
  * walk tree from root to the left-most leaf block reading in
  * blocks and setting up cursor.  passes back file block number of the
@@ -246,6 +319,12 @@ _("bad directory btree for directory inode %" PRIu64 "\n"),
 		da_cursor->level[i].bno = bno;
 		da_cursor->level[i].index = 0;
 
+		/* the leaf level walk starts on this node's children */
+		if (i == 1)
+			da_readahead_children(mp, da_cursor->blkmap,
+					mp->m_dir_geo->fsbcount, bp, 0,
+					DA_RA_WINDOW, &xfs_dir3_leafn_buf_ops);
+
 		/*
 		 * set up new bno for next level down
 		 */
@@ -616,6 +695,11 @@ _("bad level %d in block %u for directory inode %" PRIu64 "\n"),
 			be32_to_cpu(btree[0].hashval);
 
 		entry = cursor->level[this_level].index = 0;
+
+		if (this_level == 1)
+			da_readahead_children(mp, cursor->blkmap,
+					mp->m_dir_geo->fsbcount, bp, 0,
+					DA_RA_WINDOW, &xfs_dir3_leafn_buf_ops);
 	}
 	/*
 	 * ditto for block numbers
@@ -828,9 +912,7 @@ process_sf_dir2(
 		} else if (lino == mp->m_sb.sb_pquotino)  {
 			junkit = 1;
 			junkreason = _("project quota");
-		} else if ((irec_p = find_inode_rec(mp,
-					XFS_INO_TO_AGNO(mp, lino),
-					XFS_INO_TO_AGINO(mp, lino))) != NULL) {
+		} else if ((irec_p = find_entry_inode_rec(mp, lino)) != NULL) {
 			/*
 			 * if inode is marked free and we're in inode
 			 * discovery mode, leave the entry alone for now.
@@ -1285,9 +1367,7 @@ process_dir2_data(
 		} else if (ent_ino == mp->m_sb.sb_pquotino) {
 			clearreason = _("project quota");
 		} else {
-			irec_p = find_inode_rec(mp,
-						XFS_INO_TO_AGNO(mp, ent_ino),
-						XFS_INO_TO_AGINO(mp, ent_ino));
+			irec_p = find_entry_inode_rec(mp, ent_ino);
 			if (irec_p == NULL) {
 				if (ino_discovery) {
 					add_inode_uncertain(mp, ent_ino, 0);
@@ -1699,6 +1779,16 @@ _("can't read file block %u for directory inode %" PRIu64 "\n"),
 				da_bno, ino);
 			goto error_out;
 		}
+		/*
+		 * Keep the readahead DA_RA_WINDOW leaves in front of us along
+		 * the parent node; verify_dir2_path starts each new parent
+		 * off with its first DA_RA_WINDOW children.
+		 */
+		da_readahead_children(mp, da_cursor->blkmap,
+				mp->m_dir_geo->fsbcount, da_cursor->level[1].bp,
+				da_cursor->level[1].index + DA_RA_WINDOW, 1,
+				&xfs_dir3_leafn_buf_ops);
+
 		leaf = bp->b_addr;
 		M_DIROPS(mp)->leaf_hdr_from_disk(&leafhdr, leaf);
 		/*
@@ -1838,8 +1928,12 @@ process_node_dir2(
  * Process the data blocks then, if it's a node directory, check
  * the consistency of those blocks.
  */
+/*
+ * Check one data block of a leaf or node directory.  Returns 1 if the
+ * block is good.
+ */
 static int
-process_leaf_node_dir2(
+process_leaf_node_dir2_data(
 	xfs_mount_t	*mp,
 	xfs_ino_t	ino,
 	xfs_dinode_t	*dip,
@@ -1850,66 +1944,296 @@ process_leaf_node_dir2(
 	int		*dot,		/* out - 1 if there is a dot, else 0 */
 	int		*dotdot,	/* out - 1 if there's a dotdot, else 0 */
 	int		*repair,	/* out - 1 if something was fixed */
-	int		isnode)		/* node directory not leaf */
+	xfs_fileoff_t	dbno)
 {
 	bmap_ext_t		*bmp;
 	struct xfs_buf		*bp;
 	struct xfs_dir2_data_hdr *data;
+	bmap_ext_t		lbmp;
+	int			nex;
+	int			good = 0;
+	int			dirty = 0;
+
+	nex = blkmap_getn(blkmap, dbno, mp->m_dir_geo->fsbcount, &bmp, &lbmp);
+	if (nex == 0) {
+		do_warn(
+_("block %" PRIu64 " for directory inode %" PRIu64 " is missing\n"),
+			dbno, ino);
+		return 0;
+	}
+	bp = da_read_buf(mp, nex, bmp, &xfs_dir3_data_buf_ops);
+	if (bmp != &lbmp)
+		free(bmp);
+	if (bp == NULL) {
+		do_warn(
+_("can't read block %" PRIu64 " for directory inode %" PRIu64 "\n"),
+			dbno, ino);
+		return 0;
+	}
+	data = bp->b_addr;
+	if (!(be32_to_cpu(data->magic) == XFS_DIR2_DATA_MAGIC ||
+	      be32_to_cpu(data->magic) == XFS_DIR3_DATA_MAGIC))
+		do_warn(
+_("bad directory block magic # %#x in block %" PRIu64 " for directory inode %" PRIu64 "\n"),
+			be32_to_cpu(data->magic), dbno, ino);
+	if (process_dir2_data(mp, ino, dip, ino_discovery, dirname, parent,
+			bp, dot, dotdot, (xfs_dablk_t)dbno,
+			(char *)data + mp->m_dir_geo->blksize, &dirty) == 0) {
+		good = 1;
+		/* Maybe just CRC is wrong. Make sure we correct it. */
+		if (bp->b_error == -EFSBADCRC)
+			dirty = 1;
+	}
+	if (dirty && !no_modify) {
+		*repair = 1;
+		libxfs_writebuf(bp, 0);
+	} else
+		libxfs_putbuf(bp);
+	return good;
+}
+
+/*
+ * The data blocks of a large directory are checked by a pool of threads
+ * shared by all directories, alongside the thread the directory belongs
+ * to, so that one huge directory doesn't hold up the rest of its AG for
+ * as long.  The . and .. entries are in the first block, which is always
+ * checked first on its own; once both are known, the blocks don't depend
+ * on each other, and only the good block count and whether anything was
+ * fixed need to be added up.
+ */
+#define DIR2_PAR_MIN_BLOCKS	256	/* data blocks to bother splitting */
+#define DIR2_PAR_CHUNK		16	/* blocks a thread takes at a time */
+
+struct dir2_data_job {
+	xfs_mount_t	*mp;
+	xfs_ino_t	ino;
+	xfs_dinode_t	*dip;
+	int		ino_discovery;
+	char		*dirname;
+	blkmap_t	*blkmap;
+	xfs_fileoff_t	*dbnos;
+	int		nblocks;
+	atomic_t	next;		/* next block to take */
+	int		done;		/* blocks finished */
+	int		good;
+	int		repair;
+	int		refs;		/* owner and queued helpers */
+	pthread_mutex_t	lock;
+	pthread_cond_t	finished;
+};
+
+static work_queue_t	dir2_data_wq;
+static int		dir2_data_wq_active;
+static pthread_mutex_t	dir2_data_wq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+dir2_data_job_put(
+	struct dir2_data_job	*job)
+{
+	int			refs;
+
+	pthread_mutex_lock(&job->lock);
+	refs = --job->refs;
+	pthread_mutex_unlock(&job->lock);
+	if (refs)
+		return;
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->finished);
+	free(job->dbnos);
+	free(job);
+}
+
+static void
+dir2_data_job_run(
+	struct dir2_data_job	*job)
+{
+	xfs_ino_t		parent;
+	int			dot;
+	int			dotdot;
+	int			good;
+	int			repair;
+	int			start;
+	int			end;
+	int			i;
+
+	while ((start = atomic_add_return(DIR2_PAR_CHUNK, &job->next) -
+			DIR2_PAR_CHUNK) < job->nblocks) {
+		end = min(start + DIR2_PAR_CHUNK, job->nblocks);
+		good = repair = 0;
+		for (i = start; i < end; i++) {
+			/* any more . or .. entries are extra ones */
+			dot = dotdot = 1;
+			parent = NULLFSINO;
+			good += process_leaf_node_dir2_data(job->mp, job->ino,
+					job->dip, job->ino_discovery,
+					job->dirname, &parent, job->blkmap,
+					&dot, &dotdot, &repair, job->dbnos[i]);
+		}
+		pthread_mutex_lock(&job->lock);
+		job->good += good;
+		job->repair |= repair;
+		job->done += end - start;
+		if (job->done == job->nblocks)
+			pthread_cond_signal(&job->finished);
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+static void
+dir2_data_worker(
+	work_queue_t		*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct dir2_data_job	*job = arg;
+
+	dir2_data_job_run(job);
+	dir2_data_job_put(job);
+}
+
+/* stop the shared threads, once no more directories are to be checked */
+void
+dir2_data_threads_stop(void)
+{
+	pthread_mutex_lock(&dir2_data_wq_lock);
+	if (dir2_data_wq_active) {
+		destroy_work_queue(&dir2_data_wq);
+		dir2_data_wq_active = 0;
+	}
+	pthread_mutex_unlock(&dir2_data_wq_lock);
+}
+
+/*
+ * Check data blocks dbnos[1...] of a directory whose first block has given
+ * us both . and .., on the shared threads and this one.
+ */
+static void
+process_leaf_node_dir2_parallel(
+	xfs_mount_t		*mp,
+	xfs_ino_t		ino,
+	xfs_dinode_t		*dip,
+	int			ino_discovery,
+	char			*dirname,
+	blkmap_t		*blkmap,
+	xfs_fileoff_t		*dbnos,
+	int			nblocks,
+	int			*good,
+	int			*repair)
+{
+	struct dir2_data_job	*job;
+	int			nthreads = libxfs_nproc();
+	int			helpers;
+	int			i;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		do_error(_("couldn't allocate directory block job\n"));
+	job->mp = mp;
+	job->ino = ino;
+	job->dip = dip;
+	job->ino_discovery = ino_discovery;
+	job->dirname = dirname;
+	job->blkmap = blkmap;
+	job->dbnos = dbnos;
+	job->nblocks = nblocks;
+	atomic_set(&job->next, 1);
+	job->done = 1;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->finished, NULL);
+
+	pthread_mutex_lock(&dir2_data_wq_lock);
+	if (!dir2_data_wq_active) {
+		create_work_queue(&dir2_data_wq, mp, nthreads);
+		dir2_data_wq_active = 1;
+	}
+	helpers = min(nthreads, nblocks / DIR2_PAR_MIN_BLOCKS + 1);
+	job->refs = helpers + 1;
+	for (i = 0; i < helpers; i++)
+		queue_work(&dir2_data_wq, dir2_data_worker, 0, job);
+	pthread_mutex_unlock(&dir2_data_wq_lock);
+
+	dir2_data_job_run(job);
+
+	/*
+	 * Helpers that only start once all the blocks are taken find nothing
+	 * to do, and the last reference frees the job, so only wait for the
+	 * blocks.  The blkmap and dirname aren't looked at once they're done.
+	 */
+	pthread_mutex_lock(&job->lock);
+	while (job->done < job->nblocks)
+		pthread_cond_wait(&job->finished, &job->lock);
+	*good += job->good;
+	*repair |= job->repair;
+	pthread_mutex_unlock(&job->lock);
+	dir2_data_job_put(job);
+}
+
+static int
+process_leaf_node_dir2(
+	xfs_mount_t	*mp,
+	xfs_ino_t	ino,
+	xfs_dinode_t	*dip,
+	int		ino_discovery,
+	char		*dirname,	/* directory pathname */
+	xfs_ino_t	*parent,	/* out - NULLFSINO if entry not exist */
+	blkmap_t	*blkmap,
+	int		*dot,		/* out - 1 if there is a dot, else 0 */
+	int		*dotdot,	/* out - 1 if there's a dotdot, else 0 */
+	int		*repair,	/* out - 1 if something was fixed */
+	int		isnode)		/* node directory not leaf */
+{
+	xfs_fileoff_t		*dbnos = NULL;
 	xfs_fileoff_t		dbno;
+	xfs_filblks_t		nblocks = 0;
 	int			good;
 	int			i;
+	int			n = 0;
 	xfs_fileoff_t		ndbno;
-	int			nex;
 	int			t;
-	bmap_ext_t		lbmp;
-	int			dirty = 0;
 
 	*repair = *dot = *dotdot = good = 0;
 	*parent = NULLFSINO;
+
+	/* a large directory is spotted by the size of its data extents */
+	for (i = 0; i < blkmap->nexts; i++)
+		if (blkmap->exts[i].startoff < mp->m_dir_geo->leafblk)
+			nblocks += blkmap->exts[i].blockcount;
+	nblocks /= mp->m_dir_geo->fsbcount;
+	if (nblocks >= DIR2_PAR_MIN_BLOCKS && libxfs_nproc() > 1) {
+		dbnos = malloc(nblocks * sizeof(xfs_fileoff_t));
+		if (!dbnos)
+			nblocks = 0;
+	}
+
 	ndbno = NULLFILEOFF;
 	while ((dbno = blkmap_next_off(blkmap, ndbno, &t)) < mp->m_dir_geo->leafblk) {
-		nex = blkmap_getn(blkmap, dbno, mp->m_dir_geo->fsbcount, &bmp, &lbmp);
 		/* Advance through map to last dfs block in this dir block */
 		ndbno = dbno;
 		while (ndbno < dbno + mp->m_dir_geo->fsbcount - 1) {
 			ndbno = blkmap_next_off(blkmap, ndbno, &t);
 		}
-		if (nex == 0) {
-			do_warn(
-_("block %" PRIu64 " for directory inode %" PRIu64 " is missing\n"),
-				dbno, ino);
-			continue;
-		}
-		bp = da_read_buf(mp, nex, bmp, &xfs_dir3_data_buf_ops);
-		if (bmp != &lbmp)
-			free(bmp);
-		if (bp == NULL) {
-			do_warn(
-_("can't read block %" PRIu64 " for directory inode %" PRIu64 "\n"),
-				dbno, ino);
-			continue;
+		if (dbnos && n < nblocks) {
+			dbnos[n++] = dbno;
+			if (n > 1)
+				continue;
 		}
-		data = bp->b_addr;
-		if (!(be32_to_cpu(data->magic) == XFS_DIR2_DATA_MAGIC ||
-		      be32_to_cpu(data->magic) == XFS_DIR3_DATA_MAGIC))
-			do_warn(
-_("bad directory block magic # %#x in block %" PRIu64 " for directory inode %" PRIu64 "\n"),
-				be32_to_cpu(data->magic), dbno, ino);
-		i = process_dir2_data(mp, ino, dip, ino_discovery, dirname,
-			parent, bp, dot, dotdot, (xfs_dablk_t)dbno,
-			(char *)data + mp->m_dir_geo->blksize, &dirty);
-		if (i == 0) {
-			good++;
-			/* Maybe just CRC is wrong. Make sure we correct it. */
-			if (bp->b_error == -EFSBADCRC)
-				dirty = 1;
-		}
-		if (dirty && !no_modify) {
-			*repair = 1;
-			libxfs_writebuf(bp, 0);
-		} else
-			libxfs_putbuf(bp);
+		good += process_leaf_node_dir2_data(mp, ino, dip,
+				ino_discovery, dirname, parent, blkmap,
+				dot, dotdot, repair, dbno);
+	}
+
+	if (dbnos && n > 1 && *dot && *dotdot) {
+		/* the job frees dbnos */
+		process_leaf_node_dir2_parallel(mp, ino, dip, ino_discovery,
+				dirname, blkmap, dbnos, n, &good, repair);
+	} else if (dbnos) {
+		for (i = 1; i < n; i++)
+			good += process_leaf_node_dir2_data(mp, ino, dip,
+					ino_discovery, dirname, parent, blkmap,
+					dot, dotdot, repair, dbnos[i]);
+		free(dbnos);
 	}
+
 	if (good == 0)
 		return 1;
 	if (!isnode)
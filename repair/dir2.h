@@ -85,4 +85,19 @@ namecheck(
 	char		*name,
 	int		length);
 
+#define DA_RA_WINDOW	16	/* child blocks read ahead of the walk */
+
+void
+da_readahead_children(
+	struct xfs_mount	*mp,
+	struct blkmap		*blkmap,
+	int			fsbcount,
+	struct xfs_buf		*bp,
+	int			first,
+	int			count,
+	const struct xfs_buf_ops *ops);
+
+void
+dir2_data_threads_stop(void);
+
 #endif	/* _XR_DIR2_H */
@@ -25,6 +25,8 @@ void  __attribute__((noreturn)) do_error(char const *, ...)
 /* issue warning */
 void do_warn(char const *, ...)
 	__attribute__((format(printf,1,2)));
+/* warnings issued so far by the calling thread */
+unsigned long do_warn_count(void);
 /* issue log message */
 void do_log(char const *, ...)
 	__attribute__((format(printf,1,2)));
@@ -173,13 +173,20 @@ EXTERN __uint32_t	sb_width;
 
 struct aglock {
 	pthread_mutex_t	lock __attribute__((__aligned__(64)));
+	pthread_cond_t	scanned;	/* phase 2 scan of AG is done */
+	int		scanning;
 };
 EXTERN struct aglock	*ag_locks;
 
 EXTERN int 		report_interval;
 EXTERN __uint64_t 	*prog_rpt_done;
+EXTERN int		progress_fd;	/* -o progress_fd, or -1 */
+EXTERN int		progress_rpt;	/* progress reports are on */
 
 EXTERN int		ag_stride;
+EXTERN int		scan_overlap;	/* phase 3 starts during phase 2 */
+EXTERN int		health_check;	/* -n without phases 6 and 7 */
 EXTERN int		thread_count;
+EXTERN int		bcache_flags;
 
 #endif /* _XFS_REPAIR_GLOBAL_H */
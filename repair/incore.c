@@ -18,121 +18,21 @@
 
 #include "libxfs.h"
 #include "avl.h"
-#include "btree.h"
+#include "runmap.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
 #include "protos.h"
 #include "err_protos.h"
 #include "threads.h"
+#include "checkpoint.h"
+#include "mem.h"
 
 /*
  * The following manages the in-core bitmap of the entire filesystem
- * using extents in a btree.
- *
- * The btree items will point to one of the state values below,
- * rather than storing the value itself in the pointer.
+ * using runs of blocks in the same state in a run map per AG.
  */
-static int states[16] =
-	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
-
-static struct btree_root	**ag_bmap;
-
-static void
-update_bmap(
-	struct btree_root	*bmap,
-	unsigned long		offset,
-	xfs_extlen_t		blen,
-	void			*new_state)
-{
-	unsigned long		end = offset + blen;
-	int			*cur_state;
-	unsigned long		cur_key;
-	int			*next_state;
-	unsigned long		next_key;
-	int			*prev_state;
-
-	cur_state = btree_find(bmap, offset, &cur_key);
-	if (!cur_state)
-		return;
-
-	if (offset == cur_key) {
-		/* if the start is the same as the "item" extent */
-		if (cur_state == new_state)
-			return;
-
-		/*
-		 * Note: this may be NULL if we are updating the map for
-		 * the superblock.
-		 */
-		prev_state = btree_peek_prev(bmap, NULL);
-
-		next_state = btree_peek_next(bmap, &next_key);
-		if (next_key > end) {
-			/* different end */
-			if (new_state == prev_state) {
-				/* #1: prev has same state, move offset up */
-				btree_update_key(bmap, offset, end);
-				return;
-			}
-
-			/* #4: insert new extent after, update current value */
-			btree_update_value(bmap, offset, new_state);
-			btree_insert(bmap, end, cur_state);
-			return;
-		}
-
-		/* same end (and same start) */
-		if (new_state == next_state) {
-			/* next has same state */
-			if (new_state == prev_state) {
-				/* #3: merge prev & next */
-				btree_delete(bmap, offset);
-				btree_delete(bmap, end);
-				return;
-			}
-
-			/* #8: merge next */
-			btree_update_value(bmap, offset, new_state);
-			btree_delete(bmap, end);
-			return;
-		}
-
-		/* same start, same end, next has different state */
-		if (new_state == prev_state) {
-			/* #5: prev has same state */
-			btree_delete(bmap, offset);
-			return;
-		}
-
-		/* #6: update value only */
-		btree_update_value(bmap, offset, new_state);
-		return;
-	}
-
-	/* different start, offset is in the middle of "cur" */
-	prev_state = btree_peek_prev(bmap, NULL);
-	ASSERT(prev_state != NULL);
-	if (prev_state == new_state)
-		return;
-
-	if (end == cur_key) {
-		/* end is at the same point as the current extent */
-		if (new_state == cur_state) {
-			/* #7: move next extent down */
-			btree_update_key(bmap, end, offset);
-			return;
-		}
-
-		/* #9: different start, same end, add new extent */
-		btree_insert(bmap, offset, new_state);
-		return;
-	}
-
-	/* #2: insert an extent into the middle of another extent */
-	btree_insert(bmap, offset, new_state);
-	btree_insert(bmap, end, prev_state);
-}
+static struct runmap	**ag_bmap;
 
 void
 set_bmap_ext(
@@ -141,7 +41,7 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
-	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
+	runmap_set(ag_bmap[agno], agbno, blen, state);
 }
 
 int
@@ -151,39 +51,82 @@ get_bmap_ext(
 	xfs_agblock_t		maxbno,
 	xfs_extlen_t		*blen)
 {
-	int			*statep;
-	unsigned long		key;
-
-	statep = btree_find(ag_bmap[agno], agbno, &key);
-	if (!statep)
-		return -1;
-
-	if (key == agbno) {
-		if (blen) {
-			if (!btree_peek_next(ag_bmap[agno], &key))
-				return -1;
-			*blen = MIN(maxbno, key) - agbno;
-		}
-		return *statep;
-	}
-
-	statep = btree_peek_prev(ag_bmap[agno], NULL);
-	if (!statep)
-		return -1;
-	if (blen)
-		*blen = MIN(maxbno, key) - agbno;
-
-	return *statep;
+	return runmap_get(ag_bmap[agno], agbno, maxbno, blen);
 }
 
-static uint64_t		*rt_bmap;
-static size_t		rt_bmap_size;
-
 /* block records fit into __uint64_t's units */
 #define XR_BB_UNIT	64			/* number of bits/unit */
 #define XR_BB		4			/* bits per block record */
 #define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
 #define XR_BB_MASK	0xF			/* block record mask */
+#define XR_BB_STATES	(XR_BB_MASK + 1)
+
+/*
+ * The realtime map is kept in chunks of RT_CHUNK_EXTENTS extents.  A chunk
+ * whose extents all have the same state is just that state; a chunk with
+ * mixed states gets a dense map of 4 bit records, and a count of the
+ * records in each state so that it can drop the map again as soon as they
+ * are all the same.  A mostly free or mostly full volume then needs
+ * little more than the chunk array.
+ *
+ * rt_bmap_lock serialises get_rtbmap and set_rtbmap, which phase 4 calls
+ * from many threads.  get_rtbmap_free_word doesn't take it, it is only
+ * used once nothing is changing the map.
+ */
+#define RT_CHUNK_SHIFT		16
+#define RT_CHUNK_EXTENTS	(1ULL << RT_CHUNK_SHIFT)
+#define RT_CHUNK_UNITS		(RT_CHUNK_EXTENTS / XR_BB_NUM)
+
+struct rt_chunk {
+	__uint64_t		*map;		/* NULL: all records are state */
+	__uint32_t		*counts;	/* records in each state */
+	int			state;
+};
+
+static struct rt_chunk	*rt_bmap;
+static __uint64_t	rt_bmap_chunks;
+static pthread_mutex_t	rt_bmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline __uint64_t
+rt_unit_fill(
+	int		state)
+{
+	return 0x1111111111111111ULL * state;
+}
+
+static void
+rt_chunk_expand(
+	struct rt_chunk	*rc)
+{
+	__uint64_t	fill = rt_unit_fill(rc->state);
+	int		i;
+
+	rc->map = memalign(sizeof(__uint64_t),
+			RT_CHUNK_UNITS * sizeof(__uint64_t));
+	rc->counts = calloc(XR_BB_STATES, sizeof(__uint32_t));
+	if (!rc->map || !rc->counts)
+		do_error(_("couldn't allocate realtime block map chunk\n"));
+	for (i = 0; i < RT_CHUNK_UNITS; i++)
+		rc->map[i] = fill;
+	rc->counts[rc->state] = RT_CHUNK_EXTENTS;
+	mem_add(MEM_BMAPS, RT_CHUNK_UNITS * sizeof(__uint64_t) +
+			XR_BB_STATES * sizeof(__uint32_t));
+}
+
+static void
+rt_chunk_collapse(
+	struct rt_chunk	*rc,
+	int		state)
+{
+	if (rc->map)
+		mem_add(MEM_BMAPS, -(long)(RT_CHUNK_UNITS * sizeof(__uint64_t) +
+				XR_BB_STATES * sizeof(__uint32_t)));
+	free(rc->map);
+	free(rc->counts);
+	rc->map = NULL;
+	rc->counts = NULL;
+	rc->state = state;
+}
 
 /*
  * these work in real-time extents (e.g. fsbno == rt extent number)
@@ -192,8 +135,18 @@ int
 get_rtbmap(
 	xfs_rtblock_t	bno)
 {
-	return (*(rt_bmap + bno /  XR_BB_NUM) >>
-		((bno % XR_BB_NUM) * XR_BB)) & XR_BB_MASK;
+	struct rt_chunk	*rc = &rt_bmap[bno >> RT_CHUNK_SHIFT];
+	__uint64_t	i = bno & (RT_CHUNK_EXTENTS - 1);
+	int		state;
+
+	pthread_mutex_lock(&rt_bmap_lock);
+	if (rc->map)
+		state = (rc->map[i / XR_BB_NUM] >>
+			 ((i % XR_BB_NUM) * XR_BB)) & XR_BB_MASK;
+	else
+		state = rc->state;
+	pthread_mutex_unlock(&rt_bmap_lock);
+	return state;
 }
 
 void
@@ -201,17 +154,81 @@ set_rtbmap(
 	xfs_rtblock_t	bno,
 	int		state)
 {
-	*(rt_bmap + bno / XR_BB_NUM) =
-	 ((*(rt_bmap + bno / XR_BB_NUM) &
-	  (~((__uint64_t) XR_BB_MASK << ((bno % XR_BB_NUM) * XR_BB)))) |
-	 (((__uint64_t) state) << ((bno % XR_BB_NUM) * XR_BB)));
+	struct rt_chunk	*rc = &rt_bmap[bno >> RT_CHUNK_SHIFT];
+	__uint64_t	i = bno & (RT_CHUNK_EXTENTS - 1);
+	__uint64_t	*p;
+	int		shift = (i % XR_BB_NUM) * XR_BB;
+	int		old;
+
+	pthread_mutex_lock(&rt_bmap_lock);
+	if (!rc->map) {
+		if (rc->state == state)
+			goto out;
+		rt_chunk_expand(rc);
+	}
+	p = &rc->map[i / XR_BB_NUM];
+	old = (*p >> shift) & XR_BB_MASK;
+	if (old == state)
+		goto out;
+	*p = (*p & ~((__uint64_t)XR_BB_MASK << shift)) |
+	     ((__uint64_t)state << shift);
+	rc->counts[old]--;
+	if (++rc->counts[state] == RT_CHUNK_EXTENTS)
+		rt_chunk_collapse(rc, state);
+out:
+	pthread_mutex_unlock(&rt_bmap_lock);
+}
+
+/*
+ * Mask of the records of one unit that are XR_E_FREE, one bit per record;
+ * all the records are compared at once.  x ^ 0x2222... turns the free
+ * records into zero nibbles, and the add sets the top bit of every nibble
+ * that is not zero without carrying into the next one.
+ */
+static inline __uint32_t
+rt_bmap_unit_free(
+	__uint64_t	x)
+{
+	const __uint64_t ones = 0x7777777777777777ULL;
+
+	x ^= 0x2222222222222222ULL;			/* XR_E_FREE */
+	x = ~(((x & ones) + ones) | x) & 0x8888888888888888ULL;
+
+	/* gather the top bit of each nibble into the low 16 bits */
+	x = (x >> 3) & 0x1111111111111111ULL;
+	x = (x | (x >> 3)) & 0x0303030303030303ULL;
+	x = (x | (x >> 6)) & 0x000f000f000f000fULL;
+	x = (x | (x >> 12)) & 0x000000ff000000ffULL;
+	x = (x | (x >> 24)) & 0xffffULL;
+	return x;
+}
+
+/*
+ * Free extents bno to bno + 31 as a realtime bitmap word; bno must be a
+ * multiple of 32.  The map is kept in whole chunks, but the records past
+ * sb_rextents are whatever the map was reset to, so the caller masks them.
+ */
+xfs_rtword_t
+get_rtbmap_free_word(
+	xfs_rtblock_t	bno)
+{
+	struct rt_chunk	*rc = &rt_bmap[bno >> RT_CHUNK_SHIFT];
+	__uint64_t	*p;
+
+	ASSERT(bno % (2 * XR_BB_NUM) == 0);
+	if (!rc->map)
+		return rc->state == XR_E_FREE ? ~(xfs_rtword_t)0 : 0;
+	p = &rc->map[(bno & (RT_CHUNK_EXTENTS - 1)) / XR_BB_NUM];
+	return rt_bmap_unit_free(p[0]) | (rt_bmap_unit_free(p[1]) << XR_BB_NUM);
 }
 
 static void
 reset_rt_bmap(void)
 {
-	if (rt_bmap)
-		memset(rt_bmap, 0x22, rt_bmap_size);	/* XR_E_FREE */
+	__uint64_t	c;
+
+	for (c = 0; c < rt_bmap_chunks; c++)
+		rt_chunk_collapse(&rt_bmap[c], XR_E_FREE);
 }
 
 static void
@@ -221,23 +238,27 @@ init_rt_bmap(
 	if (mp->m_sb.sb_rextents == 0)
 		return;
 
-	rt_bmap_size = roundup(mp->m_sb.sb_rextents / (NBBY / XR_BB),
-			       sizeof(__uint64_t));
-
-	rt_bmap = memalign(sizeof(__uint64_t), rt_bmap_size);
+	rt_bmap_chunks = howmany(mp->m_sb.sb_rextents, RT_CHUNK_EXTENTS);
+	rt_bmap = calloc(rt_bmap_chunks, sizeof(struct rt_chunk));
 	if (!rt_bmap) {
 		do_error(
 	_("couldn't allocate realtime block map, size = %" PRIu64 "\n"),
 			mp->m_sb.sb_rextents);
 		return;
 	}
+	mem_add(MEM_BMAPS, rt_bmap_chunks * sizeof(struct rt_chunk));
 }
 
 static void
 free_rt_bmap(xfs_mount_t *mp)
 {
+	reset_rt_bmap();
+	if (rt_bmap)
+		mem_add(MEM_BMAPS, -(long)(rt_bmap_chunks *
+				sizeof(struct rt_chunk)));
 	free(rt_bmap);
 	rt_bmap = NULL;
+	rt_bmap_chunks = 0;
 }
 
 
@@ -255,12 +276,6 @@ reset_bmaps(xfs_mount_t *mp)
 		if (agno == mp->m_sb.sb_agcount - 1)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
-#ifdef BTREE_STATS
-		if (btree_find(ag_bmap[agno], 0, NULL)) {
-			printf("ag_bmap[%d] btree stats:\n", i);
-			btree_print_stats(ag_bmap[agno], stdout);
-		}
-#endif
 		/*
 		 * We always insert an item for the first block having a
 		 * given state.  So the code below means:
@@ -269,11 +284,10 @@ reset_bmaps(xfs_mount_t *mp)
 		 *	ag_hdr_block..ag_size:		XR_E_UNKNOWN
 		 *	ag_size...			XR_E_BAD_STATE
 		 */
-		btree_clear(ag_bmap[agno]);
-		btree_insert(ag_bmap[agno], 0, &states[XR_E_INUSE_FS]);
-		btree_insert(ag_bmap[agno],
-				ag_hdr_block, &states[XR_E_UNKNOWN]);
-		btree_insert(ag_bmap[agno], ag_size, &states[XR_E_BAD_STATE]);
+		runmap_clear(ag_bmap[agno]);
+		runmap_append(ag_bmap[agno], 0, XR_E_INUSE_FS);
+		runmap_append(ag_bmap[agno], ag_hdr_block, XR_E_UNKNOWN);
+		runmap_append(ag_bmap[agno], ag_size, XR_E_BAD_STATE);
 	}
 
 	if (mp->m_sb.sb_logstart != 0) {
@@ -290,30 +304,165 @@ init_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct btree_root *));
+	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct runmap *));
 	if (!ag_bmap)
-		do_error(_("couldn't allocate block map btree roots\n"));
+		do_error(_("couldn't allocate block map roots\n"));
 
 	ag_locks = calloc(mp->m_sb.sb_agcount, sizeof(struct aglock));
 	if (!ag_locks)
 		do_error(_("couldn't allocate block map locks\n"));
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_init(&ag_bmap[i]);
+		runmap_init(&ag_bmap[i], i);
 		pthread_mutex_init(&ag_locks[i].lock, NULL);
+		pthread_cond_init(&ag_locks[i].scanned, NULL);
 	}
 
 	init_rt_bmap(mp);
 	reset_bmaps(mp);
 }
 
+/*
+ * Wait for the phase 2 scan of an AG to finish.  The _locked variant is
+ * called with the AG lock held.
+ */
+void
+wait_for_ag_scan_locked(xfs_agnumber_t agno)
+{
+	while (ag_locks[agno].scanning)
+		pthread_cond_wait(&ag_locks[agno].scanned,
+				  &ag_locks[agno].lock);
+}
+
+void
+wait_for_ag_scan(xfs_agnumber_t agno)
+{
+	if (!scan_overlap)
+		return;
+	pthread_mutex_lock(&ag_locks[agno].lock);
+	wait_for_ag_scan_locked(agno);
+	pthread_mutex_unlock(&ag_locks[agno].lock);
+}
+
+void
+ag_scan_done(xfs_agnumber_t agno)
+{
+	pthread_mutex_lock(&ag_locks[agno].lock);
+	ag_locks[agno].scanning = 0;
+	pthread_cond_broadcast(&ag_locks[agno].scanned);
+	pthread_mutex_unlock(&ag_locks[agno].lock);
+}
+
+/*
+ * Save the block maps as a count and list of (start, state) runs per AG,
+ * the last run being the open ended one past the end of the AG.
+ */
+struct bmap_run {
+	__uint32_t	start;
+	__uint32_t	state;
+};
+
+static __uint32_t
+walk_bmap_runs(
+	struct checkpoint	*ck,
+	struct runmap		*rm)
+{
+	struct bmap_run		run;
+	__uint32_t		len;
+	__uint32_t		n;
+	int			state;
+
+	for (n = 1, run.start = 0; ; n++, run.start += len) {
+		state = runmap_get(rm, run.start, NULLAGBLOCK, &len);
+		if (state < 0) {
+			run.state = runmap_get(rm, run.start, 0, NULL);
+			if (ck)
+				checkpoint_put(ck, &run, sizeof(run));
+			return n;
+		}
+		run.state = state;
+		if (ck)
+			checkpoint_put(ck, &run, sizeof(run));
+	}
+}
+
+void
+save_bmaps(
+	struct checkpoint	*ck,
+	xfs_mount_t		*mp)
+{
+	struct rt_chunk		*rc;
+	xfs_agnumber_t		agno;
+	__uint32_t		nruns;
+	__uint64_t		c;
+	__int32_t		state;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		nruns = walk_bmap_runs(NULL, ag_bmap[agno]);
+		checkpoint_put(ck, &nruns, sizeof(nruns));
+		walk_bmap_runs(ck, ag_bmap[agno]);
+	}
+	checkpoint_put(ck, &rt_bmap_chunks, sizeof(rt_bmap_chunks));
+	for (c = 0; c < rt_bmap_chunks; c++) {
+		rc = &rt_bmap[c];
+		state = rc->map ? -1 : rc->state;
+		checkpoint_put(ck, &state, sizeof(state));
+		if (rc->map)
+			checkpoint_put(ck, rc->map,
+					RT_CHUNK_UNITS * sizeof(__uint64_t));
+	}
+}
+
+void
+restore_bmaps(
+	struct checkpoint	*ck,
+	xfs_mount_t		*mp)
+{
+	struct bmap_run		run;
+	xfs_agnumber_t		agno;
+	struct rt_chunk		*rc;
+	__uint32_t		nruns;
+	__uint64_t		chunks;
+	__uint64_t		c;
+	__int32_t		state;
+	int			i;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		runmap_clear(ag_bmap[agno]);
+		checkpoint_get(ck, &nruns, sizeof(nruns));
+		while (nruns--) {
+			checkpoint_get(ck, &run, sizeof(run));
+			runmap_append(ag_bmap[agno], run.start, run.state);
+		}
+	}
+	checkpoint_get(ck, &chunks, sizeof(chunks));
+	if (chunks != rt_bmap_chunks)
+		do_error(_("checkpoint realtime block map size mismatch\n"));
+	reset_rt_bmap();
+	for (c = 0; c < rt_bmap_chunks; c++) {
+		rc = &rt_bmap[c];
+		checkpoint_get(ck, &state, sizeof(state));
+		if (state >= 0) {
+			rc->state = state;
+			continue;
+		}
+		rt_chunk_expand(rc);
+		checkpoint_get(ck, rc->map,
+				RT_CHUNK_UNITS * sizeof(__uint64_t));
+		rc->counts[rc->state] = 0;
+		for (i = 0; i < RT_CHUNK_EXTENTS; i++)
+			rc->counts[(rc->map[i / XR_BB_NUM] >>
+				    ((i % XR_BB_NUM) * XR_BB)) & XR_BB_MASK]++;
+	}
+}
+
 void
 free_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		btree_destroy(ag_bmap[i]);
+		runmap_destroy(ag_bmap[i]);
 	free(ag_bmap);
 	ag_bmap = NULL;
 
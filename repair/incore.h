@@ -35,13 +35,27 @@ void		init_bmaps(xfs_mount_t *mp);
 void		reset_bmaps(xfs_mount_t *mp);
 void		free_bmaps(xfs_mount_t *mp);
 
+struct checkpoint;
+void		save_bmaps(struct checkpoint *ck, xfs_mount_t *mp);
+void		restore_bmaps(struct checkpoint *ck, xfs_mount_t *mp);
+
 void		set_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			     xfs_extlen_t blen, int state);
 int		get_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			     xfs_agblock_t maxbno, xfs_extlen_t *blen);
 
+/*
+ * When phase 3 overlaps phase 2, the block map and inode trees of an AG
+ * are only complete once the AG has been scanned.  Anything in phase 3
+ * that looks at an AG other than the one being processed waits for it.
+ */
+void		wait_for_ag_scan(xfs_agnumber_t agno);
+void		wait_for_ag_scan_locked(xfs_agnumber_t agno);
+void		ag_scan_done(xfs_agnumber_t agno);
+
 void		set_rtbmap(xfs_rtblock_t bno, int state);
 int		get_rtbmap(xfs_rtblock_t bno);
+xfs_rtword_t	get_rtbmap_free_word(xfs_rtblock_t bno);
 
 static inline void
 set_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno, int state)
@@ -66,18 +80,14 @@ get_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno)
 
 typedef unsigned char extent_state_t;
 
+/*
+ * free extent as returned by the bno and bcnt tree lookup functions,
+ * valid until the next lookup in the same tree and AG
+ */
 typedef struct extent_tree_node  {
-	avlnode_t		avl_node;
 	xfs_agblock_t		ex_startblock;	/* starting block (agbno) */
 	xfs_extlen_t		ex_blockcount;	/* number of blocks in extent */
 	extent_state_t		ex_state;	/* see state flags below */
-
-	struct extent_tree_node		*next;	/* for bcnt extent lists */
-	struct extent_tree_node		*last;	/* for bcnt extent list anchors */
-#if 0
-	xfs_ino_t		ex_inode;	/* owner, NULL if free or  */
-						/*	multiply allocated */
-#endif
 } extent_tree_node_t;
 
 typedef struct rt_extent_tree_node  {
@@ -138,8 +148,8 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno);
 
-#define findnext_bno_extent(exent_ptr)	\
-		((extent_tree_node_t *) ((exent_ptr)->avl_node.avl_nextino))
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
@@ -185,11 +195,6 @@ int		search_rt_dup_extent(xfs_mount_t	*mp,
  * extent/tree recyling and deletion routines
  */
 
-/*
- * return an extent node to the extent node free list
- */
-void		release_extent_tree_node(extent_tree_node_t *node);
-
 /*
  * recycle all the nodes in the per-AG tree
  */
@@ -262,10 +267,10 @@ struct nlink_ops;
 
 typedef struct parent_list  {
 	__uint64_t		pmask;
-	parent_entry_t		*pentries;
 #ifdef DEBUG
 	short			cnt;
 #endif
+	parent_entry_t		pentries[];	/* one per bit in pmask */
 } parent_list_t;
 
 union ino_nlink {
@@ -279,6 +284,7 @@ typedef struct ino_ex_data  {
 	__uint64_t		ino_processed;	/* reference checked bit mask */
 	parent_list_t		*parents;
 	union ino_nlink		counted_nlinks;/* counted nlinks in P6 */
+	__uint8_t		nlinks8[XFS_INODES_PER_CHUNK]; /* 8 bit counts */
 } ino_ex_data_t;
 
 typedef struct ino_tree_node  {
@@ -295,8 +301,30 @@ typedef struct ino_tree_node  {
 		parent_list_t	*plist;		/* phases 2-5 */
 	} ino_un;
 	__uint8_t		*ftypes;	/* phases 3,6 */
+	struct chunk_digest	*digest;	/* phases 3,4 */
 } ino_tree_node_t;
 
+/*
+ * The blocks the inodes of a chunk claimed in phase 3, kept when phase 3
+ * found nothing wrong with any of them so that phase 4 can check the
+ * chunk against the duplicate extents without reading it again.  Kept on
+ * the chunk's first record.
+ */
+struct chunk_digest_ext {
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		agbno;
+	xfs_extlen_t		len;
+};
+
+struct chunk_digest {
+	int			nexts;
+	struct chunk_digest_ext	exts[];
+};
+
+#define CHUNK_DIGEST_MAX	64	/* extents, more and it isn't kept */
+
+void		free_chunk_digest(ino_tree_node_t *irec);
+
 #define INOS_PER_IREC	(sizeof(__uint64_t) * NBBY)
 #define	IREC_MASK(i)	((__uint64_t)1 << (i))
 
@@ -315,6 +343,20 @@ void		get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 
 extern avltree_desc_t     **inode_tree_ptrs;
 
+struct ino_index {
+	xfs_agino_t		*starts;	/* first inode of each record */
+	struct ino_tree_node	**recs;
+	int			nrecs;
+	int			maxrecs;
+	int			valid;		/* 0 = use the tree */
+};
+
+extern struct ino_index		*inode_index;
+
+void		build_inode_index(struct xfs_mount *mp);
+struct ino_tree_node *find_inode_index(struct ino_index *idx,
+				       xfs_agino_t ino);
+
 static inline int
 get_inode_offset(struct xfs_mount *mp, xfs_ino_t ino, ino_tree_node_t *irec)
 {
@@ -333,6 +375,8 @@ find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
 	 */
 	if (agno >= mp->m_sb.sb_agcount)
 		return NULL;
+	if (inode_index[agno].valid)
+		return find_inode_index(&inode_index[agno], ino);
 	return((ino_tree_node_t *)
 		avl_findrange(inode_tree_ptrs[agno], ino));
 }
@@ -351,6 +395,9 @@ ino_tree_node_t	*set_inode_free_alloc(struct xfs_mount *mp, xfs_agnumber_t agno,
 				      xfs_agino_t ino);
 
 void		print_inode_list(xfs_agnumber_t agno);
+int		save_inode_trees(struct checkpoint *ck, struct xfs_mount *mp);
+void		restore_inode_trees(struct checkpoint *ck,
+					struct xfs_mount *mp);
 void		print_uncertain_inode_list(xfs_agnumber_t agno);
 
 /*
@@ -26,11 +26,13 @@
 #include "err_protos.h"
 #include "avl64.h"
 #include "threads.h"
+#include "mem.h"
 
 /*
  * note:  there are 4 sets of incore things handled here:
  * block bitmaps, extent trees, uncertain inode list,
- * and inode tree.  The tree-based code uses the AVL
+ * and inode tree.  The per-AG extent trees use the btree
+ * code in btree.c, the realtime extent tree uses the AVL
  * tree package used by the IRIX kernel VM code
  * (sys/avl.h).  The inode list code uses the same records
  * as the inode tree code for convenience.  The bitmaps
@@ -47,20 +49,38 @@
 static avl64tree_desc_t	*rt_ext_tree_ptr;	/* dup extent tree for rt */
 static pthread_mutex_t	rt_ext_tree_lock;
 
-static struct btree_root **dup_extent_trees;	/* per ag dup extent trees */
-static pthread_mutex_t *dup_extent_tree_locks;
+/*
+ * The duplicate extents of an AG are found in one pass over its block map
+ * at the start of phase 4, so they're disjoint and nearly always come in
+ * ascending order.  They're kept in a sorted array, which is both smaller
+ * than a tree and quicker to search, and most AGs have none at all, which
+ * is checked without taking the lock.
+ */
+struct dup_extent {
+	xfs_agblock_t		start;
+	xfs_agblock_t		end;		/* one past the last block */
+};
+
+struct dup_extent_set {
+	pthread_mutex_t		lock;
+	struct dup_extent	*exts;
+	int			nr;
+	int			max;
+};
+
+static struct dup_extent_set *dup_extent_sets;	/* per ag dup extents */
 
-static avltree_desc_t	**extent_bno_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
+static struct btree_root **extent_bno_trees;	/*
+						 * per ag trees of free extents
 						 * sorted by starting block
 						 * number
 						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
+static struct btree_root **extent_bcnt_trees;	/*
+						 * per ag trees of free extents
 						 * sorted by size
 						 */
+static extent_tree_node_t *extent_bno_cursors;
+static extent_tree_node_t *extent_bcnt_cursors;
 
 /*
  * duplicate extent tree functions
@@ -70,9 +90,37 @@ void
 release_dup_extent_tree(
 	xfs_agnumber_t		agno)
 {
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	btree_clear(dup_extent_trees[agno]);
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
+	struct dup_extent_set	*ds = &dup_extent_sets[agno];
+
+	pthread_mutex_lock(&ds->lock);
+	mem_add(MEM_EXTENTS, -(long)(ds->max * sizeof(*ds->exts)));
+	free(ds->exts);
+	ds->exts = NULL;
+	ds->nr = ds->max = 0;
+	pthread_mutex_unlock(&ds->lock);
+}
+
+/*
+ * index of the first extent in the set ending after agbno, or ds->nr if
+ * there's none.  the ends are in order too as the extents are disjoint.
+ */
+static int
+dup_extent_lookup(
+	struct dup_extent_set	*ds,
+	xfs_agblock_t		agbno)
+{
+	int			lo = 0;
+	int			hi = ds->nr;
+	int			mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ds->exts[mid].end <= agbno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
 int
@@ -81,15 +129,37 @@ add_dup_extent(
 	xfs_agblock_t		startblock,
 	xfs_extlen_t		blockcount)
 {
-	int	ret;
+	struct dup_extent_set	*ds = &dup_extent_sets[agno];
+	int			i;
+	int			ret = 0;
 #ifdef XR_DUP_TRACE
 	fprintf(stderr, "Adding dup extent - %d/%d %d\n", agno, startblock,
 		blockcount);
 #endif
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	ret = btree_insert(dup_extent_trees[agno], startblock,
-				(void *)(uintptr_t)(startblock + blockcount));
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
+	pthread_mutex_lock(&ds->lock);
+	i = ds->nr;
+	if (i && ds->exts[i - 1].end > startblock) {
+		i = dup_extent_lookup(ds, startblock);
+		if (i < ds->nr &&
+		    ds->exts[i].start < startblock + blockcount) {
+			ret = EEXIST;
+			goto out;
+		}
+	}
+	if (ds->nr == ds->max) {
+		ds->max = ds->max ? ds->max * 2 : 16;
+		ds->exts = realloc(ds->exts, ds->max * sizeof(*ds->exts));
+		if (!ds->exts)
+			do_error(_("couldn't grow duplicate extent list\n"));
+		mem_add(MEM_EXTENTS, (ds->max - ds->nr) * sizeof(*ds->exts));
+	}
+	memmove(&ds->exts[i + 1], &ds->exts[i],
+		(ds->nr - i) * sizeof(*ds->exts));
+	ds->exts[i].start = startblock;
+	ds->exts[i].end = startblock + blockcount;
+	ds->nr++;
+out:
+	pthread_mutex_unlock(&ds->lock);
 	return ret;
 }
 
@@ -99,98 +169,108 @@ search_dup_extent(
 	xfs_agblock_t		start_agbno,
 	xfs_agblock_t		end_agbno)
 {
-	unsigned long	bno;
-	int		ret;
+	struct dup_extent_set	*ds = &dup_extent_sets[agno];
+	int			i;
+	int			ret = 0;
 
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	if (!btree_find(dup_extent_trees[agno], start_agbno, &bno)) {
-		ret = 0;
-		goto out;	/* this really shouldn't happen */
-	}
-	if (bno < end_agbno) {
+	/*
+	 * extents are all added before anyone searches, and after that the
+	 * set only ever empties, so an empty set needs no locking.
+	 */
+	if (!*(volatile int *)&ds->nr)
+		return 0;
+
+	pthread_mutex_lock(&ds->lock);
+	i = dup_extent_lookup(ds, start_agbno);
+	if (i < ds->nr && ds->exts[i].start < end_agbno)
 		ret = 1;
-		goto out;
-	}
-	ret = (uintptr_t)btree_peek_prev(dup_extent_trees[agno], NULL) >
-								start_agbno;
-out:
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
+	pthread_mutex_unlock(&ds->lock);
 	return ret;
 }
 
 
 /*
- * extent tree stuff is avl trees of duplicate extents,
- * sorted in order by block number.  there is one tree per ag.
+ * The free extent trees are btrees that store the extents directly rather
+ * than pointing to a separately allocated record per extent.  The bno tree
+ * is keyed by start block and the value is the extent length.  The bcnt
+ * tree is keyed by extent length and the value is a sorted array of the
+ * start blocks of all free extents of that length.
+ *
+ * The lookup routines return a per-AG cursor describing the extent found,
+ * which stays valid until the next lookup in the same tree of the same AG.
  */
+struct bcnt_list {
+	int		first;		/* first used entry */
+	int		nr;		/* end of used entries */
+	int		max;		/* size of the starts array */
+	xfs_agblock_t	starts[0];
+};
 
-static extent_tree_node_t *
-mk_extent_tree_nodes(xfs_agblock_t new_startblock,
-	xfs_extlen_t new_blockcount, extent_state_t new_state)
-{
-	extent_tree_node_t *new;
+#define BCNT_LIST_MIN	4
 
-	new = malloc(sizeof(*new));
-	if (!new)
-		do_error(_("couldn't allocate new extent descriptor.\n"));
+static size_t
+bcnt_list_size(
+	int			max)
+{
+	return sizeof(struct bcnt_list) + max * sizeof(xfs_agblock_t);
+}
 
-	new->avl_node.avl_nextino = NULL;
-	new->ex_startblock = new_startblock;
-	new->ex_blockcount = new_blockcount;
-	new->ex_state = new_state;
-	new->next = NULL;
-	new->last = NULL;
+static struct bcnt_list *
+bcnt_list_alloc(
+	struct bcnt_list	*list,
+	int			max)
+{
+	long			old = list ? bcnt_list_size(list->max) : 0;
 
-	return new;
+	list = realloc(list, bcnt_list_size(max));
+	if (!list)
+		do_error(_("couldn't allocate new extent descriptor.\n"));
+	list->max = max;
+	mem_add(MEM_EXTENTS, (long)bcnt_list_size(max) - old);
+	return list;
 }
 
-void
-release_extent_tree_node(extent_tree_node_t *node)
+static void
+bcnt_list_free(
+	struct bcnt_list	*list)
 {
-	free(node);
+	mem_add(MEM_EXTENTS, -(long)bcnt_list_size(list->max));
+	free(list);
 }
 
 /*
- * routines to recycle all nodes in a tree.  it walks the tree
- * and puts all nodes back on the free list so the nodes can be
- * reused.  the duplicate and bno/bcnt extent trees for each AG
- * are recycled after they're no longer needed to save memory
+ * Return the index of @startblock in @list, or where it would have to be
+ * inserted.
  */
-void
-release_extent_tree(avltree_desc_t *tree)
+static int
+bcnt_list_search(
+	struct bcnt_list	*list,
+	xfs_agblock_t		startblock)
 {
-	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
+	int			lo = list->first;
+	int			hi = list->nr;
 
-	if (tree->avl_firstino == NULL)
-		return;
+	while (lo < hi) {
+		int		mid = (lo + hi) / 2;
 
-	ext = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
-
-		/*
-		 * ext->next is guaranteed to be set only in bcnt trees
-		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
-		}
-
-		release_extent_tree_node(ext);
-		ext = tmp;
+		if (list->starts[mid] < startblock)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
 
-	tree->avl_root = tree->avl_firstino = NULL;
-
-	return;
+static extent_tree_node_t *
+set_extent_cursor(
+	extent_tree_node_t	*cursor,
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
+{
+	cursor->ex_startblock = startblock;
+	cursor->ex_blockcount = blockcount;
+	cursor->ex_state = XR_E_FREE;
+	return cursor;
 }
 
 /*
@@ -199,17 +279,20 @@ release_extent_tree(avltree_desc_t *tree)
 void
 release_agbno_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_bno_ptrs[agno]);
-
-	return;
+	btree_clear(extent_bno_trees[agno]);
 }
 
 void
 release_agbcnt_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_bcnt_ptrs[agno]);
+	struct bcnt_list	*list;
 
-	return;
+	list = btree_find(extent_bcnt_trees[agno], 0, NULL);
+	while (list != NULL) {
+		bcnt_list_free(list);
+		list = btree_lookup_next(extent_bcnt_trees[agno], NULL);
+	}
+	btree_clear(extent_bcnt_trees[agno]);
 }
 
 /*
@@ -221,200 +304,187 @@ void
 add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t *ext;
-
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	ASSERT(extent_bno_trees != NULL);
+	ASSERT(blockcount > 0);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
-
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (btree_insert(extent_bno_trees[agno], startblock,
+			(void *)(uintptr_t)blockcount) != 0)
 		do_error(_("duplicate bno extent range\n"));
-	}
 }
 
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	unsigned long		key;
+	void			*len;
 
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
+	ASSERT(extent_bno_trees != NULL);
+
+	len = btree_find(extent_bno_trees[agno], 0, &key);
+	if (!len)
+		return NULL;
+	return set_extent_cursor(&extent_bno_cursors[agno], key,
+				 (uintptr_t)len);
 }
 
 extent_tree_node_t *
 find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	void			*len;
+
+	ASSERT(extent_bno_trees != NULL);
+
+	len = btree_lookup(extent_bno_trees[agno], startblock);
+	if (!len)
+		return NULL;
+	return set_extent_cursor(&extent_bno_cursors[agno], startblock,
+				 (uintptr_t)len);
+}
+
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+{
+	unsigned long		key;
+	void			*len;
 
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
-						startblock));
+	if (!btree_lookup(extent_bno_trees[agno], ext->ex_startblock))
+		return NULL;
+	len = btree_lookup_next(extent_bno_trees[agno], &key);
+	if (!len)
+		return NULL;
+	return set_extent_cursor(&extent_bno_cursors[agno], key,
+				 (uintptr_t)len);
 }
 
 /*
- * delete a node that's in the tree (pointer obtained by a find routine)
+ * delete an extent that's in the tree (obtained by a find routine)
  */
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
-
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	ASSERT(extent_bno_trees != NULL);
 
-	return;
+	btree_delete(extent_bno_trees[agno], ext->ex_startblock);
 }
 
-/*
- * normalizing constant for bcnt size -> address conversion (see avl ops)
- * used by the AVL tree code to convert sizes and must be used when
- * doing an AVL search in the tree (e.g. avl_findrange(s))
- */
-#define MAXBCNT		0xFFFFFFFF
-#define BCNT_ADDR(cnt)	((unsigned int) MAXBCNT - (cnt))
-
 /*
  * the next 4 routines manage the trees of free extents -- 2 trees
  * per AG.  The first tree is sorted by block number.  The second
  * tree is sorted by extent size.  This is the bcnt tree.
+ *
+ * when called from mk_incore_fstree, startblock is in increasing
+ * order, so new extents are appended to the end of the list for
+ * their size without searching it.
  */
 void
 add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t *ext, *prev, *current, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
+	struct btree_root	*tree;
+	struct bcnt_list	*list;
+	struct bcnt_list	*new;
+	int			i;
 
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
-
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
-
-	ASSERT(ext->next == NULL);
+	ASSERT(extent_bcnt_trees != NULL);
+	ASSERT(blockcount > 0);
 
 #ifdef XR_BCNT_TRACE
 	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
 			agno, startblock, blockcount);
 #endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) != NULL)  {
-		/*
-		 * avl tree code doesn't handle dups so insert
-		 * onto linked list in increasing startblock order
-		 *
-		 * when called from mk_incore_fstree,
-		 * startblock is in increasing order.
-		 * current is an "anchor" node.
-		 * quick check if the new ext goes to the end.
-		 * if so, append at the end, using the last field
-		 * of the "anchor".
-		 */
-		ASSERT(current->last != NULL);
-		if (startblock > current->last->ex_startblock) {
-			current->last->next = ext;
-			current->last = ext;
-			return;
-		}
-
-		/*
-		 * scan, to find the proper location for new entry.
-		 * this scan is *very* expensive and gets worse with
-		 * with increasing entries.
-		 */
-		top = prev = current;
-		while (current != NULL &&
-				startblock > current->ex_startblock)  {
-			prev = current;
-			current = current->next;
-		}
-
-		if (top == current)  {
-			ASSERT(top == prev);
-			/*
-			 * new entry should be ahead of current.
-			 * to keep the avl tree intact,
-			 * swap the values of to-be-inserted element
-			 * and the values of the head of the list.
-			 * then insert as the 2nd element on the list.
-			 *
-			 * see the comment in get_bcnt_extent()
-			 * as to why we have to do this.
-			 */
-			tmp_startblock = top->ex_startblock;
-			tmp_blockcount = top->ex_blockcount;
-			tmp_state = top->ex_state;
-
-			top->ex_startblock = ext->ex_startblock;
-			top->ex_blockcount = ext->ex_blockcount;
-			top->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			current = top->next;
-			prev = top;
-		}
-
-		prev->next = ext;
-		ext->next = current;
-
+	tree = extent_bcnt_trees[agno];
+	list = btree_lookup(tree, blockcount);
+	if (!list) {
+		list = bcnt_list_alloc(NULL, BCNT_LIST_MIN);
+		list->first = 0;
+		list->nr = 1;
+		list->starts[0] = startblock;
+		btree_insert(tree, blockcount, list);
 		return;
 	}
 
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (startblock > list->starts[list->nr - 1])
+		i = list->nr;
+	else
+		i = bcnt_list_search(list, startblock);
+	if (i < list->nr && list->starts[i] == startblock)
 		do_error(_(":  duplicate bno extent range\n"));
-	}
 
-	ext->last = ext;	/* ext is an "anchor" node */
+	if (list->nr == list->max) {
+		if (list->first > list->nr / 2) {
+			/* reuse the space of entries removed from the front */
+			memmove(list->starts, &list->starts[list->first],
+				(list->nr - list->first) *
+					sizeof(xfs_agblock_t));
+			list->nr -= list->first;
+			i -= list->first;
+			list->first = 0;
+		} else {
+			new = bcnt_list_alloc(list, list->max * 2);
+			if (new != list)
+				btree_update_value(tree, blockcount, new);
+			list = new;
+		}
+	}
 
-	return;
+	memmove(&list->starts[i + 1], &list->starts[i],
+		(list->nr - i) * sizeof(xfs_agblock_t));
+	list->starts[i] = startblock;
+	list->nr++;
 }
 
 extent_tree_node_t *
 findfirst_bcnt_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct bcnt_list	*list;
+	unsigned long		key;
+
+	ASSERT(extent_bcnt_trees != NULL);
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
+	list = btree_find(extent_bcnt_trees[agno], 0, &key);
+	if (!list)
+		return NULL;
+	return set_extent_cursor(&extent_bcnt_cursors[agno],
+				 list->starts[list->first], key);
 }
 
 extent_tree_node_t *
 findbiggest_bcnt_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct bcnt_list	*list;
+	unsigned long		key;
+
+	ASSERT(extent_bcnt_trees != NULL);
 
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	list = btree_find_last(extent_bcnt_trees[agno], &key);
+	if (!list)
+		return NULL;
+	return set_extent_cursor(&extent_bcnt_cursors[agno],
+				 list->starts[list->first], key);
 }
 
 extent_tree_node_t *
 findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	avlnode_t *nextino;
+	struct bcnt_list	*list;
+	unsigned long		key;
+	int			i;
 
-	if (ext->next != NULL)  {
-		ASSERT(ext->ex_blockcount == ext->next->ex_blockcount);
-		ASSERT(ext->ex_startblock < ext->next->ex_startblock);
-		return(ext->next);
-	} else  {
-		/*
-		 * have to look at the top of the list to get the
-		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
-		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
-		ASSERT(nextino != NULL);
-		if (nextino->avl_nextino != NULL)  {
-			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
-					nextino->avl_nextino)->ex_blockcount);
-		}
-		return((extent_tree_node_t *) nextino->avl_nextino);
-	}
+	list = btree_lookup(extent_bcnt_trees[agno], ext->ex_blockcount);
+	ASSERT(list != NULL);
+
+	i = bcnt_list_search(list, ext->ex_startblock);
+	ASSERT(i < list->nr && list->starts[i] == ext->ex_startblock);
+	if (i + 1 < list->nr)
+		return set_extent_cursor(&extent_bcnt_cursors[agno],
+					 list->starts[i + 1], ext->ex_blockcount);
+
+	list = btree_lookup_next(extent_bcnt_trees[agno], &key);
+	if (!list)
+		return NULL;
+	ASSERT(ext->ex_blockcount < key);
+	return set_extent_cursor(&extent_bcnt_cursors[agno],
+				 list->starts[list->first], key);
 }
 
 /*
@@ -426,126 +496,34 @@ extent_tree_node_t *
 get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t	*ext, *prev, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
+	struct bcnt_list	*list;
+	int			i;
 
-	prev = NULL;
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	ASSERT(extent_bcnt_trees != NULL);
 
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) == NULL)
-		return(NULL);
+	list = btree_lookup(extent_bcnt_trees[agno], blockcount);
+	if (!list)
+		return NULL;
 
-	top = ext;
-
-	if (ext->next != NULL)  {
-		/*
-		 * pull it off the list
-		 */
-		while (ext != NULL && startblock != ext->ex_startblock)  {
-			prev = ext;
-			ext = ext->next;
-		}
-		ASSERT(ext != NULL);
-		if (ext == top)  {
-			/*
-			 * this node is linked into the tree so we
-			 * swap the core values so we can delete
-			 * the next item on the list instead of
-			 * the head of the list.  This is because
-			 * the rest of the tree undoubtedly has
-			 * pointers to the piece of memory that
-			 * is the head of the list so pulling
-			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
-			 *
-			 * (cheaper than the alternative, a tree
-			 * delete of this node followed by a tree
-			 * insert of the next node on the list).
-			 */
-			tmp_startblock = ext->next->ex_startblock;
-			tmp_blockcount = ext->next->ex_blockcount;
-			tmp_state = ext->next->ex_state;
-
-			ext->next->ex_startblock = ext->ex_startblock;
-			ext->next->ex_blockcount = ext->ex_blockcount;
-			ext->next->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			ext = ext->next;
-			prev = top;
-		}
-		/*
-		 * now, a simple list deletion
-		 */
-		prev->next = ext->next;
-		ext->next = NULL;
-	} else  {
-		/*
-		 * no list, just one node.  simply delete
-		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
+	i = bcnt_list_search(list, startblock);
+	ASSERT(i < list->nr && list->starts[i] == startblock);
+	if (i == list->first) {
+		list->first++;
+	} else {
+		memmove(&list->starts[i], &list->starts[i + 1],
+			(list->nr - i - 1) * sizeof(xfs_agblock_t));
+		list->nr--;
 	}
 
-	ASSERT(ext->ex_startblock == startblock);
-	ASSERT(ext->ex_blockcount == blockcount);
-	return(ext);
-}
-
-static uintptr_t
-avl_ext_start(avlnode_t *node)
-{
-	return((uintptr_t)
-		((extent_tree_node_t *) node)->ex_startblock);
-}
+	if (list->first == list->nr) {
+		btree_delete(extent_bcnt_trees[agno], blockcount);
+		bcnt_list_free(list);
+	}
 
-static uintptr_t
-avl_ext_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((extent_tree_node_t *) node)->ex_startblock +
-		((extent_tree_node_t *) node)->ex_blockcount));
+	return set_extent_cursor(&extent_bcnt_cursors[agno], startblock,
+				 blockcount);
 }
 
-/*
- * convert size to an address for the AVL tree code -- the bigger the size,
- * the lower the address so the biggest extent will be first in the tree
- */
-static uintptr_t
-avl_ext_bcnt_start(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-static uintptr_t
-avl_ext_bcnt_end(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-avlops_t avl_extent_bcnt_tree_ops = {
-	avl_ext_bcnt_start,
-	avl_ext_bcnt_end
-};
-
-avlops_t avl_extent_tree_ops = {
-	avl_ext_start,
-	avl_ext_end
-};
 
 /*
  * for real-time extents -- have to dup code since realtime extent
@@ -747,40 +725,29 @@ incore_ext_init(xfs_mount_t *mp)
 
 	pthread_mutex_init(&rt_ext_tree_lock, NULL);
 
-	dup_extent_trees = calloc(agcount, sizeof(struct btree_root *));
-	if (!dup_extent_trees)
+	dup_extent_sets = calloc(agcount, sizeof(struct dup_extent_set));
+	if (!dup_extent_sets)
 		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
 
-	dup_extent_tree_locks = calloc(agcount, sizeof(pthread_mutex_t));
-	if (!dup_extent_tree_locks)
-		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
-
-	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	if ((extent_bno_trees = calloc(agcount,
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 	_("couldn't malloc free by-bno extent tree descriptor table\n"));
 
-	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	if ((extent_bcnt_trees = calloc(agcount,
+					sizeof(struct btree_root *))) == NULL)
 		do_error(
 	_("couldn't malloc free by-bcnt extent tree descriptor table\n"));
 
-	for (i = 0; i < agcount; i++)  {
-		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bno extent tree descriptor\n"));
-		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bcnt extent tree descriptor\n"));
-	}
+	extent_bno_cursors = calloc(agcount, sizeof(extent_tree_node_t));
+	extent_bcnt_cursors = calloc(agcount, sizeof(extent_tree_node_t));
+	if (!extent_bno_cursors || !extent_bcnt_cursors)
+		do_error(_("couldn't malloc extent tree cursors\n"));
 
 	for (i = 0; i < agcount; i++)  {
-		btree_init(&dup_extent_trees[i]);
-		pthread_mutex_init(&dup_extent_tree_locks[i], NULL);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
+		pthread_mutex_init(&dup_extent_sets[i].lock, NULL);
+		btree_init(&extent_bno_trees[i]);
+		btree_init(&extent_bcnt_trees[i]);
 	}
 
 	if ((rt_ext_tree_ptr = malloc(sizeof(avl64tree_desc_t))) == NULL)
@@ -798,56 +765,42 @@ incore_ext_teardown(xfs_mount_t *mp)
 	xfs_agnumber_t i;
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_destroy(dup_extent_trees[i]);
-		free(extent_bno_ptrs[i]);
-		free(extent_bcnt_ptrs[i]);
+		release_dup_extent_tree(i);
+		release_agbcnt_extent_tree(i);
+		btree_destroy(extent_bno_trees[i]);
+		btree_destroy(extent_bcnt_trees[i]);
 	}
 
-	free(dup_extent_trees);
-	free(extent_bcnt_ptrs);
-	free(extent_bno_ptrs);
+	free(dup_extent_sets);
+	free(extent_bcnt_trees);
+	free(extent_bno_trees);
+	free(extent_bno_cursors);
+	free(extent_bcnt_cursors);
 
-	dup_extent_trees = NULL;
-	extent_bcnt_ptrs = NULL;
-	extent_bno_ptrs = NULL;
-}
-
-int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
-{
-	extent_tree_node_t *node;
-	int i = 0;
-
-	node = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (node != NULL)  {
-		i++;
-		if (whichtree)
-			node = findnext_bcnt_extent(agno, node);
-		else
-			node = findnext_bno_extent(node);
-	}
-
-	return(i);
+	dup_extent_sets = NULL;
+	extent_bcnt_trees = NULL;
+	extent_bno_trees = NULL;
+	extent_bno_cursors = NULL;
+	extent_bcnt_cursors = NULL;
 }
 
 int
 count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 {
 	__uint64_t nblocks;
-	extent_tree_node_t *node;
+	void *len;
 	int i = 0;
 
 	ASSERT(agno < glob_agcount);
 
 	nblocks = 0;
 
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
+	len = btree_find(extent_bno_trees[agno], 0, NULL);
 
-	while (node != NULL) {
-		nblocks += node->ex_blockcount;
+	while (len != NULL) {
+		nblocks += (uintptr_t)len;
 		i++;
-		node = findnext_bno_extent(node);
+		len = btree_lookup_next(extent_bno_trees[agno], NULL);
 	}
 
 	*numblocks = nblocks;
@@ -857,13 +810,25 @@ count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 int
 count_bno_extents(xfs_agnumber_t agno)
 {
-	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bno_ptrs[agno], 0));
+	uint	numblocks;
+
+	return(count_bno_extents_blocks(agno, &numblocks));
 }
 
 int
 count_bcnt_extents(xfs_agnumber_t agno)
 {
+	struct bcnt_list *list;
+	int i = 0;
+
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bcnt_ptrs[agno], 1));
+
+	list = btree_find(extent_bcnt_trees[agno], 0, NULL);
+
+	while (list != NULL) {
+		i += list->nr - list->first;
+		list = btree_lookup_next(extent_bcnt_trees[agno], NULL);
+	}
+
+	return(i);
 }
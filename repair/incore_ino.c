@@ -24,6 +24,9 @@
 #include "protos.h"
 #include "threads.h"
 #include "err_protos.h"
+#include "scratch.h"
+#include "checkpoint.h"
+#include "mem.h"
 
 /*
  * array of inode tree ptrs, one per ag
@@ -35,19 +38,71 @@ avltree_desc_t	**inode_tree_ptrs;
  */
 static avltree_desc_t	**inode_uncertain_tree_ptrs;
 
+/*
+ * sorted arrays of each ag's records for find_inode_rec, see
+ * build_inode_index
+ */
+struct ino_index	*inode_index;
+
+/*
+ * Each inode record is allocated together with the arrays every record
+ * gets, the 8 bit on-disk link counts followed by the file types, so that
+ * setting up a chunk is one allocation and the record and its arrays
+ * share cache lines.  ino_rec_size is the size of the lot, rounded up to a
+ * cache line so that records from the scratch arenas are aligned to one.
+ * Link count arrays that outgrow 8 bits are allocated on their own, and
+ * the counted link counts of phase 6 start out in the extra data the same
+ * way.
+ */
+#define INO_REC_ALIGN		64
+
+static size_t	ino_rec_size;
+
+static inline __uint8_t *
+ino_rec_arrays(ino_tree_node_t *irec)
+{
+	return (__uint8_t *)(irec + 1);
+}
+
+static int
+nlink_array_is_inline(ino_tree_node_t *irec, void *nlinks)
+{
+	if (nlinks == ino_rec_arrays(irec))
+		return 1;
+	return full_ino_ex_data && irec->ino_un.ex_data &&
+		nlinks == irec->ino_un.ex_data->nlinks8;
+}
+
 /* memory optimised nlink counting for all inodes */
 
 static void *
-alloc_nlink_array(__uint8_t nlink_size)
+alloc_nlink_array(ino_tree_node_t *irec, __uint8_t nlink_size)
 {
 	void *ptr;
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, nlink_size);
+	ptr = scratch_alloc_near(irec, XFS_INODES_PER_CHUNK * nlink_size);
 	if (!ptr)
 		do_error(_("could not allocate nlink array\n"));
+	mem_add_scratch(MEM_INODES, XFS_INODES_PER_CHUNK * nlink_size);
 	return ptr;
 }
 
+static void
+free_nlink_array(
+	ino_tree_node_t		*irec,
+	union ino_nlink		nlinks,
+	__uint8_t		nlink_size)
+{
+	ASSERT(nlink_size == sizeof(__uint8_t) ||
+	       nlink_size == sizeof(__uint16_t) ||
+	       nlink_size == sizeof(__uint32_t));
+	if (nlink_array_is_inline(irec, nlinks.un8))
+		return;
+	scratch_free(nlinks.un8, XFS_INODES_PER_CHUNK * nlink_size);
+	mem_add_scratch(MEM_INODES,
+			-(long)(XFS_INODES_PER_CHUNK * nlink_size));
+}
+
 static void
 nlink_grow_8_to_16(ino_tree_node_t *irec)
 {
@@ -56,19 +111,20 @@ nlink_grow_8_to_16(ino_tree_node_t *irec)
 
 	irec->nlink_size = sizeof(__uint16_t);
 
-	new_nlinks = alloc_nlink_array(irec->nlink_size);
+	new_nlinks = alloc_nlink_array(irec, irec->nlink_size);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks.un8[i];
-	free(irec->disk_nlinks.un8);
+	free_nlink_array(irec, irec->disk_nlinks, sizeof(__uint8_t));
 	irec->disk_nlinks.un16 = new_nlinks;
 
 	if (full_ino_ex_data) {
-		new_nlinks = alloc_nlink_array(irec->nlink_size);
+		new_nlinks = alloc_nlink_array(irec, irec->nlink_size);
 		for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
 			new_nlinks[i] =
 				irec->ino_un.ex_data->counted_nlinks.un8[i];
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un8);
+		free_nlink_array(irec, irec->ino_un.ex_data->counted_nlinks,
+				 sizeof(__uint8_t));
 		irec->ino_un.ex_data->counted_nlinks.un16 = new_nlinks;
 	}
 }
@@ -81,20 +137,21 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 
 	irec->nlink_size = sizeof(__uint32_t);
 
-	new_nlinks = alloc_nlink_array(irec->nlink_size);
+	new_nlinks = alloc_nlink_array(irec, irec->nlink_size);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks.un16[i];
-	free(irec->disk_nlinks.un16);
+	free_nlink_array(irec, irec->disk_nlinks, sizeof(__uint16_t));
 	irec->disk_nlinks.un32 = new_nlinks;
 
 	if (full_ino_ex_data) {
-		new_nlinks = alloc_nlink_array(irec->nlink_size);
+		new_nlinks = alloc_nlink_array(irec, irec->nlink_size);
 
 		for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
 			new_nlinks[i] =
 				irec->ino_un.ex_data->counted_nlinks.un16[i];
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un16);
+		free_nlink_array(irec, irec->ino_un.ex_data->counted_nlinks,
+				 sizeof(__uint16_t));
 		irec->ino_un.ex_data->counted_nlinks.un32 = new_nlinks;
 	}
 }
@@ -173,6 +230,10 @@ __uint32_t num_inode_references(struct ino_tree_node *irec, int ino_offset)
 void set_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset,
 		__uint32_t nlinks)
 {
+	/* not tracked in health check mode */
+	if (!irec->disk_nlinks.un8)
+		return;
+
 	switch (irec->nlink_size) {
 	case sizeof(__uint8_t):
 		if (nlinks < 0xff) {
@@ -198,6 +259,9 @@ void set_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset,
 
 __uint32_t get_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset)
 {
+	if (!irec->disk_nlinks.un8)
+		return 0;
+
 	switch (irec->nlink_size) {
 	case sizeof(__uint8_t):
 		return irec->disk_nlinks.un8[ino_offset];
@@ -211,21 +275,6 @@ __uint32_t get_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset)
 	return 0;
 }
 
-static __uint8_t *
-alloc_ftypes_array(
-	struct xfs_mount *mp)
-{
-	__uint8_t	*ptr;
-
-	if (!xfs_sb_version_hasftype(&mp->m_sb))
-		return NULL;
-
-	ptr = calloc(XFS_INODES_PER_CHUNK, sizeof(*ptr));
-	if (!ptr)
-		do_error(_("could not allocate ftypes array\n"));
-	return ptr;
-}
-
 /*
  * Next is the uncertain inode list -- a sorted (in ascending order)
  * list of inode records sorted on the starting inode number.  There
@@ -242,13 +291,15 @@ alloc_ftypes_array(
 static struct ino_tree_node *
 alloc_ino_node(
 	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
 	xfs_agino_t		starting_ino)
 {
 	struct ino_tree_node 	*irec;
 
-	irec = malloc(sizeof(*irec));
+	irec = scratch_alloc(agno, ino_rec_size);
 	if (!irec)
 		do_error(_("inode map malloc failed\n"));
+	mem_add_scratch(MEM_INODES, ino_rec_size);
 
 	irec->avl_node.avl_nextino = NULL;
 	irec->avl_node.avl_forw = NULL;
@@ -261,27 +312,33 @@ alloc_ino_node(
 	irec->ir_sparse = 0;
 	irec->ino_un.ex_data = NULL;
 	irec->nlink_size = sizeof(__uint8_t);
-	irec->disk_nlinks.un8 = alloc_nlink_array(irec->nlink_size);
-	irec->ftypes = alloc_ftypes_array(mp);
+	irec->disk_nlinks.un8 = NULL;
+	irec->ftypes = NULL;
+	irec->digest = NULL;
+
+	/* link counts and file types are only looked at in phases 6 and 7 */
+	if (!health_check) {
+		irec->disk_nlinks.un8 = ino_rec_arrays(irec);
+		if (xfs_sb_version_hasftype(&mp->m_sb))
+			irec->ftypes = ino_rec_arrays(irec) +
+						XFS_INODES_PER_CHUNK;
+	}
 	return irec;
 }
 
-static void
-free_nlink_array(union ino_nlink nlinks, __uint8_t nlink_size)
+void
+free_chunk_digest(
+	struct ino_tree_node	*irec)
 {
-	switch (nlink_size) {
-	case sizeof(__uint8_t):
-		free(nlinks.un8);
-		break;
-	case sizeof(__uint16_t):
-		free(nlinks.un16);
-		break;
-	case sizeof(__uint32_t):
-		free(nlinks.un32);
-		break;
-	default:
-		ASSERT(0);
-	}
+	size_t			size;
+
+	if (!irec->digest)
+		return;
+	size = sizeof(struct chunk_digest) +
+		irec->digest->nexts * sizeof(struct chunk_digest_ext);
+	scratch_free(irec->digest, size);
+	mem_add_scratch(MEM_INODES, -(long)size);
+	irec->digest = NULL;
 }
 
 static void
@@ -291,20 +348,22 @@ free_ino_tree_node(
 	irec->avl_node.avl_nextino = NULL;
 	irec->avl_node.avl_forw = NULL;
 	irec->avl_node.avl_back = NULL;
-
-	free_nlink_array(irec->disk_nlinks, irec->nlink_size);
-	if (irec->ino_un.ex_data != NULL)  {
-		if (full_ino_ex_data) {
-			free(irec->ino_un.ex_data->parents);
-			free_nlink_array(irec->ino_un.ex_data->counted_nlinks,
-					 irec->nlink_size);
-		}
-		free(irec->ino_un.ex_data);
-
+	free_chunk_digest(irec);
+
+	if (irec->disk_nlinks.un8)
+		free_nlink_array(irec, irec->disk_nlinks, irec->nlink_size);
+	if (!full_ino_ex_data) {
+		free(irec->ino_un.plist);
+	} else if (irec->ino_un.ex_data != NULL)  {
+		free(irec->ino_un.ex_data->parents);
+		free_nlink_array(irec, irec->ino_un.ex_data->counted_nlinks,
+				 irec->nlink_size);
+		scratch_free(irec->ino_un.ex_data, sizeof(ino_ex_data_t));
+		mem_add_scratch(MEM_INODES, -(long)sizeof(ino_ex_data_t));
 	}
 
-	free(irec->ftypes);
-	free(irec);
+	scratch_free(irec, ino_rec_size);
+	mem_add_scratch(MEM_INODES, -(long)ino_rec_size);
 }
 
 /*
@@ -312,6 +371,12 @@ free_ino_tree_node(
  */
 static ino_tree_node_t **last_rec;
 
+/*
+ * entries found in directories are added from any thread, including
+ * several working on the blocks of one large directory at once
+ */
+static pthread_mutex_t *uncertain_locks;
+
 /*
  * ok, the uncertain inodes are a set of trees just like the
  * good inodes but all starting inode records are (arbitrarily)
@@ -337,6 +402,8 @@ add_aginode_uncertain(
 
 	s_ino = rounddown(ino, XFS_INODES_PER_CHUNK);
 
+	pthread_mutex_lock(&uncertain_locks[agno]);
+
 	/*
 	 * check for a cache hit
 	 */
@@ -347,6 +414,7 @@ add_aginode_uncertain(
 		else
 			set_inode_used(last_rec[agno], offset);
 
+		pthread_mutex_unlock(&uncertain_locks[agno]);
 		return;
 	}
 
@@ -357,7 +425,7 @@ add_aginode_uncertain(
 	ino_rec = (ino_tree_node_t *)
 		avl_findrange(inode_uncertain_tree_ptrs[agno], s_ino);
 	if (!ino_rec) {
-		ino_rec = alloc_ino_node(mp, s_ino);
+		ino_rec = alloc_ino_node(mp, agno, s_ino);
 
 		if (!avl_insert(inode_uncertain_tree_ptrs[agno],
 				&ino_rec->avl_node))
@@ -374,6 +442,7 @@ add_aginode_uncertain(
 	 * set cache entry
 	 */
 	last_rec[agno] = ino_rec;
+	pthread_mutex_unlock(&uncertain_locks[agno]);
 }
 
 /*
@@ -455,7 +524,8 @@ add_inode(
 {
 	struct ino_tree_node	*irec;
 
-	irec = alloc_ino_node(mp, agino);
+	irec = alloc_ino_node(mp, agno, agino);
+	inode_index[agno].valid = 0;
 	if (!avl_insert(inode_tree_ptrs[agno],	&irec->avl_node))
 		do_warn(_("add_inode - duplicate inode range\n"));
 	return irec;
@@ -471,6 +541,7 @@ get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, ino_tree_node_t *ino_re
 	ASSERT(agno < mp->m_sb.sb_agcount);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
+	inode_index[agno].valid = 0;
 	avl_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
 
 	ino_rec->avl_node.avl_nextino = NULL;
@@ -488,6 +559,78 @@ free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 	free_ino_tree_node(ino_rec);
 }
 
+/*
+ * Once inode discovery is over the inode trees hardly change, but every
+ * phase after it looks records up all the time, and walking down the AVL
+ * tree touches a node scattered somewhere in memory at every level.  So
+ * each ag's records are listed in a sorted array, with their first inode
+ * numbers in an array of their own that a binary search goes through a
+ * few cache lines of.  Adding or removing a record marks the ag's index
+ * stale and find_inode_rec goes back to the tree for it until the index
+ * is rebuilt.  This is only to be called while nothing else is looking
+ * records up, between the phases.
+ */
+void
+build_inode_index(
+	struct xfs_mount	*mp)
+{
+	struct ino_index	*idx;
+	struct ino_tree_node	*irec;
+	xfs_agnumber_t		agno;
+	int			n;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		idx = &inode_index[agno];
+		if (idx->valid)
+			continue;
+
+		for (n = 0, irec = findfirst_inode_rec(agno); irec;
+		     irec = next_ino_rec(irec))
+			n++;
+		if (n > idx->maxrecs) {
+			mem_add(MEM_INODES, (long)(n - idx->maxrecs) *
+				(sizeof(xfs_agino_t) + sizeof(irec)));
+			idx->starts = realloc(idx->starts,
+					      n * sizeof(xfs_agino_t));
+			idx->recs = realloc(idx->recs, n * sizeof(irec));
+			if (!idx->starts || !idx->recs)
+				do_error(
+			_("couldn't malloc inode record index\n"));
+			idx->maxrecs = n;
+		}
+
+		for (n = 0, irec = findfirst_inode_rec(agno); irec;
+		     irec = next_ino_rec(irec), n++) {
+			idx->starts[n] = irec->ino_startnum;
+			idx->recs[n] = irec;
+		}
+		idx->nrecs = n;
+		idx->valid = 1;
+	}
+}
+
+struct ino_tree_node *
+find_inode_index(
+	struct ino_index	*idx,
+	xfs_agino_t		ino)
+{
+	int			lo = 0;
+	int			hi = idx->nrecs;
+	int			mid;
+
+	/* find the last record starting at or before ino */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (idx->starts[mid] <= ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || ino >= idx->starts[lo - 1] + XFS_INODES_PER_CHUNK)
+		return NULL;
+	return idx->recs[lo - 1];
+}
+
 void
 find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
@@ -590,46 +733,167 @@ print_uncertain_inode_list(xfs_agnumber_t agno)
 	print_inode_list_int(agno, 1);
 }
 
+/*
+ * Checkpointed form of an inode record.  It is followed by the file types
+ * if the record has them and one parent for each bit set in pmask.
+ */
+struct irec_ckpt {
+	xfs_agino_t	ino_startnum;
+	__uint32_t	has_ftypes;
+	__uint64_t	ir_free;
+	__uint64_t	ir_sparse;
+	__uint64_t	ino_confirmed;
+	__uint64_t	ino_isa_dir;
+	__uint64_t	pmask;
+	__uint32_t	disk_nlinks[XFS_INODES_PER_CHUNK];
+};
+
+/*
+ * Save the inode trees of all AGs.  This is only done between phases 3
+ * and 6, so the records have parent lists rather than extra data, and
+ * there must not be any uncertain inodes left.  Returns non-zero if there
+ * are.
+ */
+int
+save_inode_trees(
+	struct checkpoint	*ck,
+	struct xfs_mount	*mp)
+{
+	struct irec_ckpt	rc;
+	ino_tree_node_t		*irec;
+	xfs_agnumber_t		agno;
+	__uint64_t		nrecs;
+	int			i;
+
+	ASSERT(!full_ino_ex_data);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (findfirst_uncertain_inode_rec(agno))
+			return 1;
+
+		nrecs = 0;
+		for (irec = findfirst_inode_rec(agno); irec;
+		     irec = next_ino_rec(irec))
+			nrecs++;
+		checkpoint_put(ck, &nrecs, sizeof(nrecs));
+
+		for (irec = findfirst_inode_rec(agno); irec;
+		     irec = next_ino_rec(irec)) {
+			memset(&rc, 0, sizeof(rc));
+			rc.ino_startnum = irec->ino_startnum;
+			rc.has_ftypes = irec->ftypes != NULL;
+			rc.ir_free = irec->ir_free;
+			rc.ir_sparse = irec->ir_sparse;
+			rc.ino_confirmed = irec->ino_confirmed;
+			rc.ino_isa_dir = irec->ino_isa_dir;
+			if (irec->ino_un.plist)
+				rc.pmask = irec->ino_un.plist->pmask;
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
+				rc.disk_nlinks[i] =
+					get_inode_disk_nlinks(irec, i);
+			checkpoint_put(ck, &rc, sizeof(rc));
+
+			if (irec->ftypes)
+				checkpoint_put(ck, irec->ftypes,
+					       XFS_INODES_PER_CHUNK);
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				xfs_ino_t	parent;
+
+				if (!(rc.pmask & (1ULL << i)))
+					continue;
+				parent = get_inode_parent(irec, i);
+				checkpoint_put(ck, &parent, sizeof(parent));
+			}
+		}
+	}
+	return 0;
+}
+
+void
+restore_inode_trees(
+	struct checkpoint	*ck,
+	struct xfs_mount	*mp)
+{
+	struct irec_ckpt	rc;
+	ino_tree_node_t		*irec;
+	xfs_agnumber_t		agno;
+	__uint64_t		nrecs;
+	xfs_ino_t		parent;
+	int			i;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		checkpoint_get(ck, &nrecs, sizeof(nrecs));
+		while (nrecs--) {
+			checkpoint_get(ck, &rc, sizeof(rc));
+			irec = add_inode(mp, agno, rc.ino_startnum);
+			if (rc.has_ftypes != (irec->ftypes != NULL))
+				do_error(
+	_("checkpoint inode record doesn't match filesystem features\n"));
+
+			irec->ir_free = rc.ir_free;
+			irec->ir_sparse = rc.ir_sparse;
+			irec->ino_confirmed = rc.ino_confirmed;
+			irec->ino_isa_dir = rc.ino_isa_dir;
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
+				if (rc.disk_nlinks[i])
+					set_inode_disk_nlinks(irec, i,
+							rc.disk_nlinks[i]);
+
+			if (irec->ftypes)
+				checkpoint_get(ck, irec->ftypes,
+					       XFS_INODES_PER_CHUNK);
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				if (!(rc.pmask & (1ULL << i)))
+					continue;
+				checkpoint_get(ck, &parent, sizeof(parent));
+				set_inode_parent(irec, i, parent);
+			}
+		}
+	}
+}
+
 /*
  * set parent -- use a bitmask and a packed array.  The bitmask
  * indicate which inodes have an entry in the array.  An inode that
  * is the Nth bit set in the mask is stored in the Nth location in
- * the array where N starts at 0.
+ * the array where N starts at 0.  The array is allocated along with
+ * the mask and grown PLIST_CHUNK_SIZE entries at a time.
  */
 
+static inline size_t
+parent_list_size(
+	int			nentries)
+{
+	return sizeof(parent_list_t) + roundup(nentries, PLIST_CHUNK_SIZE) *
+						sizeof(parent_entry_t);
+}
+
 void
 set_inode_parent(
 	ino_tree_node_t		*irec,
 	int			offset,
 	xfs_ino_t		parent)
 {
+	parent_list_t		**ptblp;
 	parent_list_t		*ptbl;
 	int			i;
 	int			cnt;
 	int			target;
 	__uint64_t		bitmask;
-	parent_entry_t		*tmp;
 
 	if (full_ino_ex_data)
-		ptbl = irec->ino_un.ex_data->parents;
+		ptblp = &irec->ino_un.ex_data->parents;
 	else
-		ptbl = irec->ino_un.plist;
+		ptblp = &irec->ino_un.plist;
+	ptbl = *ptblp;
 
 	if (ptbl == NULL)  {
-		ptbl = (parent_list_t *)malloc(sizeof(parent_list_t));
+		ptbl = malloc(parent_list_size(1));
 		if (!ptbl)
 			do_error(_("couldn't malloc parent list table\n"));
-
-		if (full_ino_ex_data)
-			irec->ino_un.ex_data->parents = ptbl;
-		else
-			irec->ino_un.plist = ptbl;
+		*ptblp = ptbl;
 
 		ptbl->pmask = 1LL << offset;
-		ptbl->pentries = (xfs_ino_t*)memalign(sizeof(xfs_ino_t),
-							sizeof(xfs_ino_t));
-		if (!ptbl->pentries)
-			do_error(_("couldn't memalign pentries table\n"));
 #ifdef DEBUG
 		ptbl->cnt = 1;
 #endif
@@ -673,20 +937,17 @@ set_inode_parent(
 #endif
 	ASSERT(cnt >= target);
 
-	tmp = (xfs_ino_t*)memalign(sizeof(xfs_ino_t), (cnt + 1) * sizeof(xfs_ino_t));
-	if (!tmp)
-		do_error(_("couldn't memalign pentries table\n"));
-
-	memmove(tmp, ptbl->pentries, target * sizeof(parent_entry_t));
+	if (cnt % PLIST_CHUNK_SIZE == 0) {
+		ptbl = realloc(ptbl, parent_list_size(cnt + 1));
+		if (!ptbl)
+			do_error(_("couldn't grow parent list table\n"));
+		*ptblp = ptbl;
+	}
 
 	if (cnt > target)
-		memmove(tmp + target + 1, ptbl->pentries + target,
+		memmove(ptbl->pentries + target + 1, ptbl->pentries + target,
 				(cnt - target) * sizeof(parent_entry_t));
 
-	free(ptbl->pentries);
-
-	ptbl->pentries = tmp;
-
 #ifdef DEBUG
 	ptbl->cnt++;
 #endif
@@ -731,24 +992,25 @@ alloc_ex_data(ino_tree_node_t *irec)
 	parent_list_t 	*ptbl;
 
 	ptbl = irec->ino_un.plist;
-	irec->ino_un.ex_data  = (ino_ex_data_t *)calloc(1, sizeof(ino_ex_data_t));
+	irec->ino_un.ex_data = scratch_alloc_near(irec, sizeof(ino_ex_data_t));
 	if (irec->ino_un.ex_data == NULL)
 		do_error(_("could not malloc inode extra data\n"));
+	mem_add_scratch(MEM_INODES, sizeof(ino_ex_data_t));
 
 	irec->ino_un.ex_data->parents = ptbl;
 
 	switch (irec->nlink_size) {
 	case sizeof(__uint8_t):
 		irec->ino_un.ex_data->counted_nlinks.un8 =
-			alloc_nlink_array(irec->nlink_size);
+			irec->ino_un.ex_data->nlinks8;
 		break;
 	case sizeof(__uint16_t):
 		irec->ino_un.ex_data->counted_nlinks.un16 =
-			alloc_nlink_array(irec->nlink_size);
+			alloc_nlink_array(irec, irec->nlink_size);
 		break;
 	case sizeof(__uint32_t):
 		irec->ino_un.ex_data->counted_nlinks.un32 =
-			alloc_nlink_array(irec->nlink_size);
+			alloc_nlink_array(irec, irec->nlink_size);
 		break;
 	default:
 		ASSERT(0);
@@ -819,10 +1081,28 @@ incore_ino_init(xfs_mount_t *mp)
 		avl_init_tree(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
 	}
 
+	inode_index = calloc(agcount, sizeof(struct ino_index));
+	if (!inode_index)
+		do_error(_("couldn't malloc inode record index\n"));
+
 	if ((last_rec = malloc(sizeof(ino_tree_node_t *) * agcount)) == NULL)
 		do_error(_("couldn't malloc uncertain inode cache area\n"));
 
 	memset(last_rec, 0, sizeof(ino_tree_node_t *) * agcount);
 
+	uncertain_locks = malloc(sizeof(pthread_mutex_t) * agcount);
+	if (!uncertain_locks)
+		do_error(_("couldn't malloc uncertain inode locks\n"));
+	for (i = 0; i < agcount; i++)
+		pthread_mutex_init(&uncertain_locks[i], NULL);
+
+	ino_rec_size = sizeof(ino_tree_node_t);
+	if (!health_check) {
+		ino_rec_size += XFS_INODES_PER_CHUNK * sizeof(__uint8_t);
+		if (xfs_sb_version_hasftype(&mp->m_sb))
+			ino_rec_size += XFS_INODES_PER_CHUNK * sizeof(__uint8_t);
+	}
+	ino_rec_size = roundup(ino_rec_size, INO_REC_ALIGN);
+
 	full_ino_ex_data = 0;
 }
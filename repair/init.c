@@ -88,6 +88,7 @@ xfs_init(libxfs_init_t *args)
 	}
 
 	args->usebuflock = do_prefetch;
+	args->bcache_flags = bcache_flags;
 	args->setblksize = 0;
 	args->isdirect = LIBXFS_DIRECT;
 	if (no_modify)
@@ -0,0 +1,891 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "libxlog.h"
+#include "globals.h"
+#include "protos.h"
+#include "err_protos.h"
+
+/*
+ * Replay a dirty log from userspace, so that a filesystem doesn't have to
+ * be mounted and unmounted before it can be repaired.
+ *
+ * The log is read twice, like the kernel does.  The first pass finds the
+ * buffers that were freed (cancelled) and every buffer that the log
+ * changes; those are then read in disk order.  The second pass applies the
+ * committed changes to the buffers in memory, and at the end the changed
+ * buffers are written back sorted, with neighbours merged into one write.
+ * Nothing is written unless the whole log could be replayed, so if this
+ * fails the log is still there for the kernel.
+ *
+ * Extent free intents aren't replayed: whatever they would have freed is
+ * found to be unused, and freed, by the rest of repair.
+ */
+
+#define REPLAY_CANCEL_HASH	64
+
+struct replay_cancel {
+	struct list_head	rc_list;
+	xfs_daddr_t		rc_blkno;
+	uint			rc_len;
+	int			rc_refcount;
+};
+
+struct replay_buf {
+	xfs_daddr_t		rb_blkno;
+	uint			rb_len;
+	int			rb_dirty;
+	struct xfs_buf		*rb_bp;
+};
+
+static struct {
+	struct xfs_mount	*mp;
+	struct list_head	cancel[REPLAY_CANCEL_HASH];
+	struct replay_buf	*bufs;		/* sorted after pass 1 */
+	int			nbufs;
+	int			maxbufs;
+	int			qoff;		/* XFS_DQ_* types turned off */
+	__uint64_t		ntrans;
+	__uint64_t		nitems;
+} replay;
+
+static struct list_head *
+replay_cancel_head(
+	xfs_daddr_t		blkno)
+{
+	return &replay.cancel[blkno % REPLAY_CANCEL_HASH];
+}
+
+static void
+replay_add_cancel(
+	xfs_daddr_t		blkno,
+	uint			len)
+{
+	struct list_head	*head = replay_cancel_head(blkno);
+	struct replay_cancel	*rc;
+
+	list_for_each_entry(rc, head, rc_list) {
+		if (rc->rc_blkno == blkno && rc->rc_len == len) {
+			rc->rc_refcount++;
+			return;
+		}
+	}
+	rc = malloc(sizeof(*rc));
+	if (!rc)
+		do_error(_("couldn't allocate log replay cancel record\n"));
+	rc->rc_blkno = blkno;
+	rc->rc_len = len;
+	rc->rc_refcount = 1;
+	list_add_tail(&rc->rc_list, head);
+}
+
+/*
+ * Is the buffer freed later on in the log?  Changes to it up to and
+ * including the last cancel record aren't replayed, the blocks may have
+ * been reused for something else by then.
+ */
+static int
+replay_cancelled(
+	xfs_daddr_t		blkno,
+	uint			len,
+	ushort			flags)
+{
+	struct list_head	*head = replay_cancel_head(blkno);
+	struct replay_cancel	*rc;
+
+	list_for_each_entry(rc, head, rc_list) {
+		if (rc->rc_blkno != blkno || rc->rc_len != len)
+			continue;
+		if ((flags & XFS_BLF_CANCEL) && --rc->rc_refcount == 0) {
+			list_del(&rc->rc_list);
+			free(rc);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static void
+replay_free_cancels(void)
+{
+	struct replay_cancel	*rc, *n;
+	int			i;
+
+	for (i = 0; i < REPLAY_CANCEL_HASH; i++) {
+		list_for_each_entry_safe(rc, n, &replay.cancel[i], rc_list) {
+			list_del(&rc->rc_list);
+			free(rc);
+		}
+	}
+}
+
+static void
+replay_add_buf(
+	xfs_daddr_t		blkno,
+	uint			len)
+{
+	struct replay_buf	*rb;
+
+	/* most items follow one for the same buffer, skip the easy dups */
+	if (replay.nbufs) {
+		rb = &replay.bufs[replay.nbufs - 1];
+		if (rb->rb_blkno == blkno && rb->rb_len == len)
+			return;
+	}
+	if (replay.nbufs == replay.maxbufs) {
+		replay.maxbufs = replay.maxbufs ? replay.maxbufs * 2 : 1024;
+		replay.bufs = realloc(replay.bufs,
+				replay.maxbufs * sizeof(struct replay_buf));
+		if (!replay.bufs)
+			do_error(_("couldn't allocate log replay buffers\n"));
+	}
+	rb = &replay.bufs[replay.nbufs++];
+	memset(rb, 0, sizeof(*rb));
+	rb->rb_blkno = blkno;
+	rb->rb_len = len;
+}
+
+static int
+replay_buf_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct replay_buf	*ra = a;
+	const struct replay_buf	*rb = b;
+
+	if (ra->rb_blkno != rb->rb_blkno)
+		return ra->rb_blkno < rb->rb_blkno ? -1 : 1;
+	if (ra->rb_len != rb->rb_len)
+		return ra->rb_len < rb->rb_len ? -1 : 1;
+	return 0;
+}
+
+/* find a buffer noted in pass 1 */
+static struct xfs_buf *
+replay_get_buf(
+	xfs_daddr_t		blkno,
+	uint			len)
+{
+	struct replay_buf	key;
+	struct replay_buf	*rb;
+
+	key.rb_blkno = blkno;
+	key.rb_len = len;
+	rb = bsearch(&key, replay.bufs, replay.nbufs,
+			sizeof(struct replay_buf), replay_buf_cmp);
+	if (!rb)
+		return NULL;
+	rb->rb_dirty = 1;
+	return rb->rb_bp;
+}
+
+/*
+ * The inode log format structure is laid out differently by 32 and 64 bit
+ * kernels, convert whichever one this is.
+ */
+static xfs_inode_log_format_t *
+replay_inode_format(
+	xlog_recover_item_t	*item,
+	xfs_inode_log_format_t	*in_f)
+{
+	xfs_inode_log_format_32_t *in_f32;
+	xfs_inode_log_format_64_t *in_f64;
+	uint			len = item->ri_buf[0].i_len;
+
+	if (len == sizeof(xfs_inode_log_format_32_t)) {
+		in_f32 = item->ri_buf[0].i_addr;
+		in_f->ilf_type = in_f32->ilf_type;
+		in_f->ilf_size = in_f32->ilf_size;
+		in_f->ilf_fields = in_f32->ilf_fields;
+		in_f->ilf_asize = in_f32->ilf_asize;
+		in_f->ilf_dsize = in_f32->ilf_dsize;
+		in_f->ilf_ino = in_f32->ilf_ino;
+		memcpy(&in_f->ilf_u.ilfu_uuid, &in_f32->ilf_u.ilfu_uuid,
+			sizeof(uuid_t));
+		in_f->ilf_blkno = in_f32->ilf_blkno;
+		in_f->ilf_len = in_f32->ilf_len;
+		in_f->ilf_boffset = in_f32->ilf_boffset;
+	} else if (len == sizeof(xfs_inode_log_format_64_t)) {
+		in_f64 = item->ri_buf[0].i_addr;
+		in_f->ilf_type = in_f64->ilf_type;
+		in_f->ilf_size = in_f64->ilf_size;
+		in_f->ilf_fields = in_f64->ilf_fields;
+		in_f->ilf_asize = in_f64->ilf_asize;
+		in_f->ilf_dsize = in_f64->ilf_dsize;
+		in_f->ilf_ino = in_f64->ilf_ino;
+		memcpy(&in_f->ilf_u.ilfu_uuid, &in_f64->ilf_u.ilfu_uuid,
+			sizeof(uuid_t));
+		in_f->ilf_blkno = in_f64->ilf_blkno;
+		in_f->ilf_len = in_f64->ilf_len;
+		in_f->ilf_boffset = in_f64->ilf_boffset;
+	} else
+		return NULL;
+	return in_f;
+}
+
+/*
+ * The write verifier to recompute the CRC of a replayed buffer with.  Only
+ * v5 filesystems tag their buffers in the log with what they are.
+ */
+static const struct xfs_buf_ops *
+replay_buf_ops(
+	struct xfs_mount	*mp,
+	struct xfs_buf		*bp,
+	xfs_buf_log_format_t	*buf_f)
+{
+	__uint32_t		magic32;
+
+	if (!xfs_sb_version_hascrc(&mp->m_sb))
+		return NULL;
+
+	switch (xfs_blft_from_flags(buf_f)) {
+	case XFS_BLFT_BTREE_BUF:
+		magic32 = be32_to_cpu(*(__be32 *)bp->b_addr);
+		switch (magic32) {
+		case XFS_ABTB_CRC_MAGIC:
+		case XFS_ABTC_CRC_MAGIC:
+		case XFS_ABTB_MAGIC:
+		case XFS_ABTC_MAGIC:
+			return &xfs_allocbt_buf_ops;
+		case XFS_IBT_CRC_MAGIC:
+		case XFS_FIBT_CRC_MAGIC:
+		case XFS_IBT_MAGIC:
+		case XFS_FIBT_MAGIC:
+			return &xfs_inobt_buf_ops;
+		case XFS_BMAP_CRC_MAGIC:
+		case XFS_BMAP_MAGIC:
+			return &xfs_bmbt_buf_ops;
+		}
+		return NULL;
+	case XFS_BLFT_AGF_BUF:		return &xfs_agf_buf_ops;
+	case XFS_BLFT_AGFL_BUF:		return &xfs_agfl_buf_ops;
+	case XFS_BLFT_AGI_BUF:		return &xfs_agi_buf_ops;
+	case XFS_BLFT_DINO_BUF:		return &xfs_inode_buf_ops;
+	case XFS_BLFT_UDQUOT_BUF:
+	case XFS_BLFT_PDQUOT_BUF:
+	case XFS_BLFT_GDQUOT_BUF:	return &xfs_dquot_buf_ops;
+	case XFS_BLFT_SYMLINK_BUF:	return &xfs_symlink_buf_ops;
+	case XFS_BLFT_DIR_BLOCK_BUF:	return &xfs_dir3_block_buf_ops;
+	case XFS_BLFT_DIR_DATA_BUF:	return &xfs_dir3_data_buf_ops;
+	case XFS_BLFT_DIR_FREE_BUF:	return &xfs_dir3_free_buf_ops;
+	case XFS_BLFT_DIR_LEAF1_BUF:	return &xfs_dir3_leaf1_buf_ops;
+	case XFS_BLFT_DIR_LEAFN_BUF:	return &xfs_dir3_leafn_buf_ops;
+	case XFS_BLFT_DA_NODE_BUF:	return &xfs_da3_node_buf_ops;
+	case XFS_BLFT_ATTR_LEAF_BUF:	return &xfs_attr3_leaf_buf_ops;
+	case XFS_BLFT_ATTR_RMT_BUF:	return &xfs_attr3_rmt_buf_ops;
+	case XFS_BLFT_SB_BUF:		return &xfs_sb_buf_ops;
+	}
+	return NULL;
+}
+
+/* copy the logged regions of a buffer over it */
+static int
+replay_reg_buffer(
+	xlog_recover_item_t	*item,
+	xfs_buf_log_format_t	*buf_f,
+	struct xfs_buf		*bp)
+{
+	int			i = 1;		/* 0 is the format structure */
+	int			bit = 0;
+	int			nbits;
+
+	for (;;) {
+		bit = libxfs_next_bit(buf_f->blf_data_map,
+				buf_f->blf_map_size, bit);
+		if (bit == -1)
+			break;
+		nbits = libxfs_contig_bits(buf_f->blf_data_map,
+				buf_f->blf_map_size, bit);
+		if (i >= item->ri_cnt || !item->ri_buf[i].i_addr ||
+		    item->ri_buf[i].i_len % XFS_BLF_CHUNK)
+			return EFSCORRUPTED;
+		/* contiguous dirty chunks may still be logged separately */
+		if (item->ri_buf[i].i_len < (nbits << XFS_BLF_SHIFT))
+			nbits = item->ri_buf[i].i_len >> XFS_BLF_SHIFT;
+		if ((bit + nbits) << XFS_BLF_SHIFT > bp->b_bcount)
+			return EFSCORRUPTED;
+		memcpy(bp->b_addr + (bit << XFS_BLF_SHIFT),
+			item->ri_buf[i].i_addr, nbits << XFS_BLF_SHIFT);
+		i++;
+		bit += nbits;
+	}
+	return 0;
+}
+
+/*
+ * An inode buffer logged to change the unlinked lists only has the
+ * di_next_unlinked fields replayed, the rest of each inode comes from
+ * the inode items.
+ */
+static int
+replay_inode_buffer(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item,
+	xfs_buf_log_format_t	*buf_f,
+	struct xfs_buf		*bp)
+{
+	int			inodes = bp->b_bcount >> mp->m_sb.sb_inodelog;
+	int			item_index = 0;
+	int			bit = 0;
+	int			nbits = 0;
+	int			reg_offset = 0;
+	int			reg_bytes = 0;
+	int			next_offset;
+	xfs_agino_t		*logged_nextp;
+	int			i;
+
+	for (i = 0; i < inodes; i++) {
+		next_offset = i * mp->m_sb.sb_inodesize +
+				offsetof(xfs_dinode_t, di_next_unlinked);
+
+		/* find the logged region holding this di_next_unlinked */
+		while (next_offset >= reg_offset + reg_bytes) {
+			bit += nbits;
+			bit = libxfs_next_bit(buf_f->blf_data_map,
+					buf_f->blf_map_size, bit);
+			if (bit == -1)
+				return 0;
+			nbits = libxfs_contig_bits(buf_f->blf_data_map,
+					buf_f->blf_map_size, bit);
+			reg_offset = bit << XFS_BLF_SHIFT;
+			reg_bytes = nbits << XFS_BLF_SHIFT;
+			item_index++;
+		}
+		if (next_offset < reg_offset)
+			continue;
+
+		if (item_index >= item->ri_cnt ||
+		    !item->ri_buf[item_index].i_addr ||
+		    reg_offset + reg_bytes > bp->b_bcount)
+			return EFSCORRUPTED;
+		logged_nextp = item->ri_buf[item_index].i_addr +
+				next_offset - reg_offset;
+		if (*logged_nextp == 0)
+			return EFSCORRUPTED;
+		*(xfs_agino_t *)(bp->b_addr + next_offset) = *logged_nextp;
+		libxfs_dinode_calc_crc(mp,
+				bp->b_addr + i * mp->m_sb.sb_inodesize);
+	}
+	return 0;
+}
+
+static int
+replay_buffer(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item)
+{
+	xfs_buf_log_format_t	*buf_f = item->ri_buf[0].i_addr;
+	struct xfs_buf		*bp;
+	int			type = 0;
+	int			error;
+
+	if (replay_cancelled(buf_f->blf_blkno, buf_f->blf_len,
+			buf_f->blf_flags))
+		return 0;
+
+	if (buf_f->blf_flags & XFS_BLF_UDQUOT_BUF)
+		type |= XFS_DQ_USER;
+	if (buf_f->blf_flags & XFS_BLF_PDQUOT_BUF)
+		type |= XFS_DQ_PROJ;
+	if (buf_f->blf_flags & XFS_BLF_GDQUOT_BUF)
+		type |= XFS_DQ_GROUP;
+	if (replay.qoff & type)
+		return 0;
+	bp = replay_get_buf(buf_f->blf_blkno, buf_f->blf_len);
+	if (!bp)
+		return EFSCORRUPTED;
+
+	if (buf_f->blf_flags & XFS_BLF_INODE_BUF)
+		error = replay_inode_buffer(mp, item, buf_f, bp);
+	else
+		error = replay_reg_buffer(item, buf_f, bp);
+	if (error)
+		return error;
+	if (!bp->b_ops)
+		bp->b_ops = replay_buf_ops(mp, bp, buf_f);
+	return 0;
+}
+
+static int
+replay_inode(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item)
+{
+	xfs_inode_log_format_t	in_buf;
+	xfs_inode_log_format_t	*in_f;
+	xfs_icdinode_t		*dicp;
+	xfs_dinode_t		*dip;
+	struct xfs_buf		*bp;
+	int			attr_index;
+	int			fields;
+	int			isize;
+	void			*src;
+	int			len;
+
+	in_f = replay_inode_format(item, &in_buf);
+	if (!in_f || item->ri_cnt < 2 || in_f->ilf_size > item->ri_cnt)
+		return EFSCORRUPTED;
+	if (replay_cancelled(in_f->ilf_blkno, in_f->ilf_len, 0))
+		return 0;
+	bp = replay_get_buf(in_f->ilf_blkno, in_f->ilf_len);
+	if (!bp || in_f->ilf_boffset + mp->m_sb.sb_inodesize > bp->b_bcount)
+		return EFSCORRUPTED;
+
+	dip = bp->b_addr + in_f->ilf_boffset;
+	dicp = item->ri_buf[1].i_addr;
+	if (be16_to_cpu(dip->di_magic) != XFS_DINODE_MAGIC ||
+	    dicp->di_magic != XFS_DINODE_MAGIC)
+		return EFSCORRUPTED;
+
+	/* v4 inodes flushed after this was logged are newer than it */
+	if (!xfs_sb_version_hascrc(&mp->m_sb) &&
+	    dicp->di_flushiter < be16_to_cpu(dip->di_flushiter)) {
+		if (be16_to_cpu(dip->di_flushiter) != DI_MAX_FLUSH ||
+		    dicp->di_flushiter >= (DI_MAX_FLUSH >> 1))
+			return 0;
+	}
+	dicp->di_flushiter = 0;
+
+	isize = xfs_icdinode_size(dicp->di_version);
+	if (item->ri_buf[1].i_len > isize ||
+	    dicp->di_forkoff > mp->m_sb.sb_inodesize)
+		return EFSCORRUPTED;
+	libxfs_dinode_to_disk(dip, dicp);
+
+	fields = in_f->ilf_fields;
+	if (fields & XFS_ILOG_DEV)
+		xfs_dinode_put_rdev(dip, in_f->ilf_u.ilfu_rdev);
+	else if (fields & XFS_ILOG_UUID)
+		memcpy(XFS_DFORK_DPTR(dip), &in_f->ilf_u.ilfu_uuid,
+			sizeof(uuid_t));
+
+	if (in_f->ilf_size > 2) {
+		src = item->ri_buf[2].i_addr;
+		len = item->ri_buf[2].i_len;
+		switch (fields & XFS_ILOG_DFORK) {
+		case XFS_ILOG_DDATA:
+		case XFS_ILOG_DEXT:
+			if (len > XFS_DFORK_DSIZE(dip, mp))
+				return EFSCORRUPTED;
+			memcpy(XFS_DFORK_DPTR(dip), src, len);
+			break;
+		case XFS_ILOG_DBROOT:
+			libxfs_bmbt_to_bmdr(mp, src, len,
+				(xfs_bmdr_block_t *)XFS_DFORK_DPTR(dip),
+				XFS_DFORK_DSIZE(dip, mp));
+			break;
+		}
+
+		if (fields & XFS_ILOG_AFORK) {
+			attr_index = (fields & XFS_ILOG_DFORK) ? 3 : 2;
+			if (attr_index >= in_f->ilf_size || !dip->di_forkoff)
+				return EFSCORRUPTED;
+			src = item->ri_buf[attr_index].i_addr;
+			len = item->ri_buf[attr_index].i_len;
+			switch (fields & XFS_ILOG_AFORK) {
+			case XFS_ILOG_ADATA:
+			case XFS_ILOG_AEXT:
+				if (len > XFS_DFORK_ASIZE(dip, mp))
+					return EFSCORRUPTED;
+				memcpy(XFS_DFORK_APTR(dip), src, len);
+				break;
+			case XFS_ILOG_ABROOT:
+				libxfs_bmbt_to_bmdr(mp, src, len,
+					(xfs_bmdr_block_t *)XFS_DFORK_APTR(dip),
+					XFS_DFORK_ASIZE(dip, mp));
+				break;
+			}
+		}
+	}
+
+	libxfs_dinode_calc_crc(mp, dip);
+	if (!bp->b_ops && xfs_sb_version_hascrc(&mp->m_sb))
+		bp->b_ops = &xfs_inode_buf_ops;
+	return 0;
+}
+
+static int
+replay_dquot(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item)
+{
+	xfs_dq_logformat_t	*dq_f = item->ri_buf[0].i_addr;
+	xfs_disk_dquot_t	*recddq;
+	struct xfs_buf		*bp;
+	int			len;
+
+	if (item->ri_cnt < 2 || !item->ri_buf[1].i_addr ||
+	    item->ri_buf[1].i_len < sizeof(xfs_disk_dquot_t))
+		return EFSCORRUPTED;
+	recddq = item->ri_buf[1].i_addr;
+	if (replay.qoff & (recddq->d_flags &
+			   (XFS_DQ_USER | XFS_DQ_PROJ | XFS_DQ_GROUP)))
+		return 0;
+
+	len = XFS_FSB_TO_BB(mp, dq_f->qlf_len);
+	if (replay_cancelled(dq_f->qlf_blkno, len, 0))
+		return 0;
+	bp = replay_get_buf(dq_f->qlf_blkno, len);
+	if (!bp || dq_f->qlf_boffset + sizeof(struct xfs_dqblk) > bp->b_bcount)
+		return EFSCORRUPTED;
+
+	memcpy(bp->b_addr + dq_f->qlf_boffset, recddq,
+		min(item->ri_buf[1].i_len, (uint)sizeof(struct xfs_dqblk)));
+	if (xfs_sb_version_hascrc(&mp->m_sb)) {
+		xfs_update_cksum(bp->b_addr + dq_f->qlf_boffset,
+			sizeof(struct xfs_dqblk), XFS_DQUOT_CRC_OFF);
+		bp->b_ops = &xfs_dquot_buf_ops;
+	}
+	return 0;
+}
+
+/*
+ * Inode chunks allocated on v5 filesystems are logged as a range to be
+ * initialised rather than as the buffers.  In pass 1 note the cluster
+ * buffers, in pass 2 initialise them as xfs_ialloc_inode_init would.
+ */
+static int
+replay_icreate(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item,
+	int			pass)
+{
+	struct xfs_icreate_log	*icl = item->ri_buf[0].i_addr;
+	int			bpc = xfs_icluster_size_fsb(mp);
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		agbno;
+	xfs_daddr_t		daddr;
+	xfs_dinode_t		*dip;
+	struct xfs_buf		*bp;
+	int			ipc;
+	int			len;
+	int			nbufs;
+	int			i, j;
+
+	if (item->ri_buf[0].i_len != sizeof(struct xfs_icreate_log))
+		return EFSCORRUPTED;
+	agno = be32_to_cpu(icl->icl_ag);
+	agbno = be32_to_cpu(icl->icl_agbno);
+	len = be32_to_cpu(icl->icl_length);
+	if (agno >= mp->m_sb.sb_agcount || !agbno ||
+	    agbno + len > mp->m_sb.sb_agblocks ||
+	    be32_to_cpu(icl->icl_isize) != mp->m_sb.sb_inodesize ||
+	    be32_to_cpu(icl->icl_count) != mp->m_ialloc_inos ||
+	    len != mp->m_ialloc_blks)
+		return EFSCORRUPTED;
+
+	nbufs = len / bpc;
+	ipc = XFS_FSB_TO_B(mp, bpc) >> mp->m_sb.sb_inodelog;
+	for (i = 0; i < nbufs; i++) {
+		daddr = XFS_AGB_TO_DADDR(mp, agno, agbno + i * bpc);
+		if (pass == XLOG_RECOVER_PASS1) {
+			replay_add_buf(daddr, XFS_FSB_TO_BB(mp, bpc));
+			continue;
+		}
+		if (replay_cancelled(daddr, XFS_FSB_TO_BB(mp, bpc), 0))
+			continue;
+		bp = replay_get_buf(daddr, XFS_FSB_TO_BB(mp, bpc));
+		if (!bp)
+			return EFSCORRUPTED;
+		memset(bp->b_addr, 0, bp->b_bcount);
+		for (j = 0; j < ipc; j++) {
+			dip = bp->b_addr + (j << mp->m_sb.sb_inodelog);
+			dip->di_magic = cpu_to_be16(XFS_DINODE_MAGIC);
+			dip->di_version = 3;
+			dip->di_gen = icl->icl_gen;
+			dip->di_next_unlinked = cpu_to_be32(NULLAGINO);
+			dip->di_ino = cpu_to_be64(XFS_AGINO_TO_INO(mp, agno,
+				XFS_OFFBNO_TO_AGINO(mp, agbno + i * bpc, j)));
+			platform_uuid_copy(&dip->di_uuid, &mp->m_sb.sb_uuid);
+			libxfs_dinode_calc_crc(mp, dip);
+		}
+		bp->b_ops = &xfs_inode_buf_ops;
+	}
+	return 0;
+}
+
+static int
+replay_pass1(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item)
+{
+	xfs_buf_log_format_t	*buf_f;
+	xfs_inode_log_format_t	in_buf;
+	xfs_inode_log_format_t	*in_f;
+	xfs_dq_logformat_t	*dq_f;
+	xfs_qoff_logformat_t	*qoff_f;
+
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_BUF:
+		buf_f = item->ri_buf[0].i_addr;
+		if (buf_f->blf_flags & XFS_BLF_CANCEL)
+			replay_add_cancel(buf_f->blf_blkno, buf_f->blf_len);
+		else
+			replay_add_buf(buf_f->blf_blkno, buf_f->blf_len);
+		break;
+	case XFS_LI_INODE:
+		in_f = replay_inode_format(item, &in_buf);
+		if (!in_f)
+			return EFSCORRUPTED;
+		replay_add_buf(in_f->ilf_blkno, in_f->ilf_len);
+		break;
+	case XFS_LI_DQUOT:
+		dq_f = item->ri_buf[0].i_addr;
+		replay_add_buf(dq_f->qlf_blkno,
+			XFS_FSB_TO_BB(mp, dq_f->qlf_len));
+		break;
+	case XFS_LI_QUOTAOFF:
+		qoff_f = item->ri_buf[0].i_addr;
+		if (qoff_f->qf_flags & XFS_UQUOTA_ACCT)
+			replay.qoff |= XFS_DQ_USER;
+		if (qoff_f->qf_flags & XFS_PQUOTA_ACCT)
+			replay.qoff |= XFS_DQ_PROJ;
+		if (qoff_f->qf_flags & XFS_GQUOTA_ACCT)
+			replay.qoff |= XFS_DQ_GROUP;
+		break;
+	case XFS_LI_ICREATE:
+		return replay_icreate(mp, item, XLOG_RECOVER_PASS1);
+	case XFS_LI_EFI:
+	case XFS_LI_EFD:
+		break;
+	default:
+		return EFSCORRUPTED;
+	}
+	return 0;
+}
+
+static int
+replay_pass2(
+	struct xfs_mount	*mp,
+	xlog_recover_item_t	*item)
+{
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_BUF:
+		return replay_buffer(mp, item);
+	case XFS_LI_INODE:
+		return replay_inode(mp, item);
+	case XFS_LI_DQUOT:
+		return replay_dquot(mp, item);
+	case XFS_LI_ICREATE:
+		return replay_icreate(mp, item, XLOG_RECOVER_PASS2);
+	}
+	return 0;
+}
+
+/* called by libxlog for each committed transaction */
+int
+xlog_recover_do_trans(
+	struct xlog		*log,
+	xlog_recover_t		*trans,
+	int			pass)
+{
+	xlog_recover_item_t	*item;
+	int			error;
+
+	if (!replay.mp)
+		return 0;
+	list_for_each_entry(item, &trans->r_itemq, ri_list) {
+		if (!item->ri_cnt || !item->ri_buf[0].i_addr)
+			return EFSCORRUPTED;
+		if (pass == XLOG_RECOVER_PASS1)
+			error = replay_pass1(replay.mp, item);
+		else
+			error = replay_pass2(replay.mp, item);
+		if (error)
+			return error;
+		replay.nitems++;
+	}
+	replay.ntrans++;
+	return 0;
+}
+
+/* read the buffers noted in pass 1, in disk order */
+static int
+replay_read_bufs(
+	struct xfs_mount	*mp)
+{
+	struct xfs_buf		**bplist;
+	struct replay_buf	*rb;
+	int			n = 0;
+	int			error;
+	int			i;
+
+	if (!replay.nbufs)
+		return 0;
+	qsort(replay.bufs, replay.nbufs, sizeof(struct replay_buf),
+		replay_buf_cmp);
+	for (i = 0; i < replay.nbufs; i++) {
+		rb = &replay.bufs[i];
+		if (n && replay_buf_cmp(rb, &replay.bufs[n - 1]) == 0)
+			continue;
+		/*
+		 * The same blocks logged as differently sized buffers can't
+		 * be written back in the right order from here.
+		 */
+		if (n && rb->rb_blkno < replay.bufs[n - 1].rb_blkno +
+					replay.bufs[n - 1].rb_len) {
+			do_warn(
+_("log replay: buffers at daddr %" PRId64 " and %" PRId64 " overlap\n"),
+				replay.bufs[n - 1].rb_blkno, rb->rb_blkno);
+			return EFSCORRUPTED;
+		}
+		if (rb->rb_blkno < 0 || !rb->rb_len ||
+		    rb->rb_blkno + rb->rb_len >
+				XFS_FSB_TO_BB(mp, mp->m_sb.sb_dblocks))
+			return EFSCORRUPTED;
+		replay.bufs[n++] = *rb;
+	}
+	replay.nbufs = n;
+
+	bplist = malloc(n * sizeof(struct xfs_buf *));
+	if (!bplist)
+		do_error(_("couldn't allocate log replay buffers\n"));
+	for (i = 0; i < n; i++) {
+		rb = &replay.bufs[i];
+		rb->rb_bp = libxfs_getbufr(mp->m_ddev_targp, rb->rb_blkno,
+				rb->rb_len);
+		if (!rb->rb_bp)
+			do_error(_("couldn't allocate log replay buffers\n"));
+		bplist[i] = rb->rb_bp;
+	}
+	error = libxfs_readbufr_list(mp->m_ddev_targp, bplist, n, 0);
+	free(bplist);
+	return error;
+}
+
+/* write back the changed buffers, libxfs merges the contiguous ones */
+static int
+replay_write_bufs(
+	struct xfs_mount	*mp,
+	int			*nwritten)
+{
+	struct xfs_buf		**bplist;
+	int			n = 0;
+	int			error;
+	int			i;
+
+	bplist = malloc((replay.nbufs + 1) * sizeof(struct xfs_buf *));
+	if (!bplist)
+		do_error(_("couldn't allocate log replay buffers\n"));
+	for (i = 0; i < replay.nbufs; i++) {
+		if (replay.bufs[i].rb_dirty)
+			bplist[n++] = replay.bufs[i].rb_bp;
+	}
+	error = n ? libxfs_writebufr_list(mp->m_ddev_targp, bplist, n) : 0;
+	free(bplist);
+	*nwritten = n;
+	return error;
+}
+
+/*
+ * The primary superblock may have been changed by the log.  Repair has
+ * set everything up from the old geometry, so if that changed (growfs)
+ * it has to be restarted; otherwise just pick up the new superblock.
+ */
+static void
+replay_update_sb(
+	struct xfs_mount	*mp)
+{
+	struct xfs_buf		*bp;
+	xfs_sb_t		sb;
+
+	bp = replay_get_buf(XFS_SB_DADDR, XFS_FSS_TO_BB(mp, 1));
+	if (!bp)
+		return;
+	libxfs_sb_from_disk(&sb, XFS_BUF_TO_SBP(bp));
+	if (sb.sb_blocksize != mp->m_sb.sb_blocksize ||
+	    sb.sb_dblocks != mp->m_sb.sb_dblocks ||
+	    sb.sb_rblocks != mp->m_sb.sb_rblocks ||
+	    sb.sb_agblocks != mp->m_sb.sb_agblocks ||
+	    sb.sb_agcount != mp->m_sb.sb_agcount ||
+	    sb.sb_logblocks != mp->m_sb.sb_logblocks ||
+	    sb.sb_inodesize != mp->m_sb.sb_inodesize)
+		do_error(
+_("the log replay changed the filesystem geometry, re-run xfs_repair\n"));
+	mp->m_sb = sb;
+}
+
+static void
+replay_free(void)
+{
+	int			i;
+
+	for (i = 0; i < replay.nbufs; i++) {
+		if (replay.bufs[i].rb_bp)
+			libxfs_putbufr(replay.bufs[i].rb_bp);
+	}
+	free(replay.bufs);
+	replay_free_cancels();
+	memset(&replay, 0, sizeof(replay));
+}
+
+/*
+ * Replay the log between tail_blk and head_blk into the filesystem.
+ * Returns 0 if the log was replayed, or an error if it couldn't be and
+ * nothing was written.
+ */
+int
+replay_log(
+	struct xfs_mount	*mp,
+	struct xlog		*log,
+	xfs_daddr_t		head_blk,
+	xfs_daddr_t		tail_blk)
+{
+	int			nwritten = 0;
+	int			error;
+	int			i;
+
+	memset(&replay, 0, sizeof(replay));
+	for (i = 0; i < REPLAY_CANCEL_HASH; i++)
+		INIT_LIST_HEAD(&replay.cancel[i]);
+	replay.mp = mp;
+
+	/* nothing cached may be older than what is about to be written */
+	libxfs_bcache_purge();
+
+	error = xlog_do_recovery_pass(log, head_blk, tail_blk,
+			XLOG_RECOVER_PASS1);
+	if (error)
+		goto out;
+	error = replay_read_bufs(mp);
+	if (error)
+		goto out;
+
+	replay.ntrans = 0;
+	replay.nitems = 0;
+	error = xlog_do_recovery_pass(log, head_blk, tail_blk,
+			XLOG_RECOVER_PASS2);
+	if (error)
+		goto out;
+
+	error = replay_write_bufs(mp, &nwritten);
+	if (error) {
+		/* the log is kept, so the kernel can still replay it */
+		do_warn(_("log replay: writing the replayed buffers failed\n"));
+		goto out;
+	}
+	replay_update_sb(mp);
+	do_log(
+_("        - replayed %llu transactions, %llu log items, %d buffers written\n"),
+		(unsigned long long)replay.ntrans,
+		(unsigned long long)replay.nitems, nwritten);
+out:
+	replay_free();
+	return error;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "globals.h"
+#include "err_protos.h"
+#include "scratch.h"
+#include "mem.h"
+
+/*
+ * The cache size is worked out once at startup from the -m budget less a
+ * guess at what the incore structures will need.  The guess is rough, so
+ * the structures are counted as they grow and shrink, and every time the
+ * total moves by a step the cache's limit is set to whatever the budget
+ * has left.  The cache can only give way so far, down to the size repair
+ * needs to make progress at all; if the structures go past the budget
+ * there's nothing else to take from, so that is only warned about.
+ */
+static const char	*mem_names[MEM_NCLASSES] = {
+	"inodes", "extents", "bmaps", "prefetch", "dirhash",
+};
+
+static atomic64_t	mem_used[MEM_NCLASSES];
+static atomic64_t	mem_peak[MEM_NCLASSES];
+static atomic64_t	mem_total;
+static atomic64_t	mem_total_peak;
+static long		mem_last;		/* total at the last rebalance */
+static long		mem_step;
+static long		mem_budget;		/* bytes, 0 if not tracking */
+static size_t		mem_node_bytes;
+static unsigned int	mem_cache_max;		/* cache size at startup */
+static unsigned int	mem_cache_min;
+static int		mem_warned;
+static pthread_mutex_t	mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+mem_rebalance(
+	long			total)
+{
+	long			count;
+
+	count = (mem_budget - total) / (long)mem_node_bytes;
+	count = max(count, (long)mem_cache_min);
+	count = min(count, (long)mem_cache_max);
+	cache_set_maxcount(libxfs_bcache, count);
+
+	if (total > mem_budget && !mem_warned) {
+		mem_warned = 1;
+		do_warn(
+	_("incore structures need %ldMB, more than the %ldMB repair was given\n"),
+			total >> 20, mem_budget >> 20);
+	}
+	mem_last = total;
+}
+
+/*
+ * budget_kb is what the cache and the incore structures have between them,
+ * node_bytes roughly what each cache entry costs.
+ */
+void
+mem_init(
+	unsigned long		budget_kb,
+	size_t			node_bytes)
+{
+	mem_budget = (long)budget_kb << 10;
+	mem_node_bytes = node_bytes ? node_bytes : 1;
+	mem_step = max(mem_budget / 256, 1L << 20);
+	mem_cache_max = libxfs_bcache->c_maxcount;
+	mem_cache_min = min(mem_cache_max, 512U * HASH_CACHE_RATIO);
+	mem_last = atomic64_read(&mem_total);
+	if (mem_last)
+		mem_rebalance(mem_last);
+}
+
+/* bytes more (or less, if negative) are in use by class */
+void
+mem_add(
+	int			class,
+	long			bytes)
+{
+	long			total;
+
+	atomic64_max(&mem_peak[class],
+			atomic64_add_return(bytes, &mem_used[class]));
+	total = atomic64_add_return(bytes, &mem_total);
+	atomic64_max(&mem_total_peak, total);
+
+	if (!mem_budget || labs(total - mem_last) < mem_step)
+		return;
+	pthread_mutex_lock(&mem_lock);
+	total = atomic64_read(&mem_total);
+	if (labs(total - mem_last) >= mem_step)
+		mem_rebalance(total);
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/* as mem_add, for what only comes off the heap without -o scratch_dir */
+void
+mem_add_scratch(
+	int			class,
+	long			bytes)
+{
+	if (!scratch_active)
+		mem_add(class, bytes);
+}
+
+void
+mem_report(void)
+{
+	int			i;
+
+	if (!atomic64_read(&mem_total_peak))
+		return;
+	do_log(_("Incore memory peak by subsystem:\n"));
+	for (i = 0; i < MEM_NCLASSES; i++)
+		do_log("        %-10s %10ldKB\n", mem_names[i],
+			(long)(atomic64_read(&mem_peak[i]) >> 10));
+	do_log("        %-10s %10ldKB\n", _("total"),
+		(long)(atomic64_read(&mem_total_peak) >> 10));
+	if (mem_budget)
+		do_log(_("        cache limit %u entries, %u at startup\n"),
+			libxfs_bcache->c_maxcount, mem_cache_max);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _MEM_H
+#define _MEM_H
+
+/*
+ * Memory used by the incore structures, by the part of repair that uses
+ * it, so the buffer cache can give way as they grow within the -m budget.
+ */
+enum {
+	MEM_INODES,		/* inode records, link counts, parents */
+	MEM_EXTENTS,		/* free and duplicate extent lists */
+	MEM_BMAPS,		/* block usage map nodes */
+	MEM_PREFETCH,		/* prefetch read buffers */
+	MEM_DIRHASH,		/* phase 6 directory hash tables */
+	MEM_NCLASSES
+};
+
+void
+mem_init(
+	unsigned long		budget_kb,
+	size_t			node_bytes);
+
+void
+mem_add(
+	int			class,
+	long			bytes);
+
+void
+mem_add_scratch(
+	int			class,
+	long			bytes);
+
+void
+mem_report(void);
+
+#endif /* _MEM_H */
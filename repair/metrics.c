@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include <sys/resource.h>
+#include "globals.h"
+#include "err_protos.h"
+#include "metrics.h"
+
+/*
+ * Each phase record holds what happened between the end of the previous
+ * phase and the end of this one.  The last record covers flushing and
+ * unmounting the filesystem after phase 7.  The whole file is rewritten
+ * at the end of every phase, so it is useful even if repair doesn't get
+ * to the end.  If the file name ends in ".csv" it is written as CSV with
+ * one line per phase, otherwise as JSON.
+ */
+#define METRICS_WRITEBACK	8
+#define METRICS_NR		(METRICS_WRITEBACK + 1)
+
+struct metrics_snap {
+	double			wall;
+	double			user;
+	double			sys;
+	long			maxrss;		/* KiB, peak so far */
+	struct libxfs_iostats	io;
+	struct cache		*cache;
+	unsigned long long	hits;
+	unsigned long long	misses;
+};
+
+struct metrics_phase {
+	int			valid;
+	struct metrics_snap	delta;
+	__uint64_t		pf_samples;	/* prefetch queue depth */
+	__uint64_t		pf_depth_sum;
+	int			pf_depth_max;
+	int			nthreads;	/* worker busy times */
+	double			*busy;
+};
+
+int			metrics_active;
+
+static char		*metrics_path;
+static int		metrics_csv;
+static pthread_mutex_t	metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_snap metrics_last;
+static struct metrics_phase metrics_phases[METRICS_NR];
+static struct metrics_phase metrics_pending;	/* current phase so far */
+
+double
+metrics_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+metrics_snap(
+	struct metrics_snap	*snap)
+{
+	struct rusage		ru;
+
+	snap->wall = metrics_now();
+	getrusage(RUSAGE_SELF, &ru);
+	snap->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	snap->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	snap->maxrss = ru.ru_maxrss;
+	libxfs_iostats_get(&snap->io);
+	snap->cache = libxfs_bcache;
+	snap->hits = snap->misses = 0;
+	if (libxfs_bcache)
+		cache_stats(libxfs_bcache, &snap->hits, &snap->misses);
+}
+
+void
+metrics_init(
+	char			*path)
+{
+	size_t			len = strlen(path);
+
+	metrics_path = path;
+	metrics_csv = len > 4 && !strcmp(path + len - 4, ".csv");
+	metrics_active = 1;
+}
+
+void
+metrics_pf_sample(
+	int			depth)
+{
+	if (!metrics_active)
+		return;
+
+	pthread_mutex_lock(&metrics_lock);
+	metrics_pending.pf_samples++;
+	metrics_pending.pf_depth_sum += depth;
+	if (depth > metrics_pending.pf_depth_max)
+		metrics_pending.pf_depth_max = depth;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/* a worker thread has exited after being busy for this long */
+void
+metrics_thread_busy(
+	double			seconds)
+{
+	struct metrics_phase	*pm = &metrics_pending;
+	double			*busy;
+
+	if (!metrics_active)
+		return;
+
+	pthread_mutex_lock(&metrics_lock);
+	busy = realloc(pm->busy, (pm->nthreads + 1) * sizeof(double));
+	if (busy) {
+		busy[pm->nthreads++] = seconds;
+		pm->busy = busy;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static void
+metrics_write_csv(
+	FILE			*fp)
+{
+	struct metrics_phase	*pm;
+	struct metrics_snap	*d;
+	double			busy, busy_max;
+	int			i, j;
+
+	fprintf(fp, "phase,wall_seconds,user_seconds,sys_seconds,"
+		    "reads,read_bytes,writes,write_bytes,"
+		    "cache_hits,cache_misses,cache_hit_rate,"
+		    "prefetch_samples,prefetch_depth_avg,prefetch_depth_max,"
+		    "threads,thread_busy_seconds,thread_busy_max,"
+		    "max_rss_kb\n");
+
+	for (i = 1; i < METRICS_NR; i++) {
+		pm = &metrics_phases[i];
+		if (!pm->valid)
+			continue;
+		d = &pm->delta;
+		for (busy = busy_max = 0, j = 0; j < pm->nthreads; j++) {
+			busy += pm->busy[j];
+			busy_max = MAX(busy_max, pm->busy[j]);
+		}
+		if (i == METRICS_WRITEBACK)
+			fprintf(fp, "writeback");
+		else
+			fprintf(fp, "%d", i);
+		fprintf(fp, ",%.6f,%.6f,%.6f,%llu,%llu,%llu,%llu,%llu,%llu,%.4f"
+			    ",%llu,%.2f,%d,%d,%.6f,%.6f,%ld\n",
+			d->wall, d->user, d->sys,
+			(unsigned long long)d->io.reads,
+			(unsigned long long)d->io.read_bytes,
+			(unsigned long long)d->io.writes,
+			(unsigned long long)d->io.write_bytes,
+			d->hits, d->misses,
+			d->hits + d->misses ?
+				(double)d->hits / (d->hits + d->misses) : 0.0,
+			(unsigned long long)pm->pf_samples,
+			pm->pf_samples ?
+				(double)pm->pf_depth_sum / pm->pf_samples : 0.0,
+			pm->pf_depth_max, pm->nthreads, busy, busy_max,
+			d->maxrss);
+	}
+}
+
+static void
+metrics_write_json(
+	FILE			*fp)
+{
+	struct metrics_phase	*pm;
+	struct metrics_snap	*d;
+	char			*sep = "";
+	int			i, j;
+
+	fprintf(fp, "{\n  \"phases\": [");
+	for (i = 1; i < METRICS_NR; i++) {
+		pm = &metrics_phases[i];
+		if (!pm->valid)
+			continue;
+		d = &pm->delta;
+		fprintf(fp, "%s\n    {\n", sep);
+		sep = ",";
+		if (i == METRICS_WRITEBACK)
+			fprintf(fp, "      \"phase\": \"writeback\",\n");
+		else
+			fprintf(fp, "      \"phase\": \"%d\",\n", i);
+		fprintf(fp, "      \"wall_seconds\": %.6f,\n"
+			    "      \"user_seconds\": %.6f,\n"
+			    "      \"sys_seconds\": %.6f,\n"
+			    "      \"reads\": %llu,\n"
+			    "      \"read_bytes\": %llu,\n"
+			    "      \"writes\": %llu,\n"
+			    "      \"write_bytes\": %llu,\n"
+			    "      \"cache_hits\": %llu,\n"
+			    "      \"cache_misses\": %llu,\n"
+			    "      \"cache_hit_rate\": %.4f,\n"
+			    "      \"prefetch_samples\": %llu,\n"
+			    "      \"prefetch_depth_avg\": %.2f,\n"
+			    "      \"prefetch_depth_max\": %d,\n"
+			    "      \"max_rss_kb\": %ld,\n"
+			    "      \"thread_busy_seconds\": [",
+			d->wall, d->user, d->sys,
+			(unsigned long long)d->io.reads,
+			(unsigned long long)d->io.read_bytes,
+			(unsigned long long)d->io.writes,
+			(unsigned long long)d->io.write_bytes,
+			d->hits, d->misses,
+			d->hits + d->misses ?
+				(double)d->hits / (d->hits + d->misses) : 0.0,
+			(unsigned long long)pm->pf_samples,
+			pm->pf_samples ?
+				(double)pm->pf_depth_sum / pm->pf_samples : 0.0,
+			pm->pf_depth_max, d->maxrss);
+		for (j = 0; j < pm->nthreads; j++)
+			fprintf(fp, "%s%.6f", j ? ", " : "", pm->busy[j]);
+		fprintf(fp, "]\n    }");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+}
+
+static void
+metrics_write(void)
+{
+	FILE			*fp;
+
+	fp = fopen(metrics_path, "w");
+	if (!fp) {
+		do_warn(_("couldn't open metrics file %s: %s\n"),
+			metrics_path, strerror(errno));
+		return;
+	}
+	if (metrics_csv)
+		metrics_write_csv(fp);
+	else
+		metrics_write_json(fp);
+	if (fclose(fp))
+		do_warn(_("couldn't write metrics file %s: %s\n"),
+			metrics_path, strerror(errno));
+}
+
+/*
+ * Close the record for this phase with everything since the last one.
+ */
+static void
+metrics_end_phase(
+	int			phase)
+{
+	struct metrics_phase	*pm = &metrics_phases[phase];
+	struct metrics_snap	now;
+	struct metrics_snap	*d = &pm->delta;
+
+	metrics_snap(&now);
+
+	pthread_mutex_lock(&metrics_lock);
+	free(pm->busy);
+	*pm = metrics_pending;
+	memset(&metrics_pending, 0, sizeof(metrics_pending));
+	pthread_mutex_unlock(&metrics_lock);
+
+	d->wall = now.wall - metrics_last.wall;
+	d->user = now.user - metrics_last.user;
+	d->sys = now.sys - metrics_last.sys;
+	d->maxrss = now.maxrss;
+	d->io.reads = now.io.reads - metrics_last.io.reads;
+	d->io.read_bytes = now.io.read_bytes - metrics_last.io.read_bytes;
+	d->io.writes = now.io.writes - metrics_last.io.writes;
+	d->io.write_bytes = now.io.write_bytes - metrics_last.io.write_bytes;
+	/* the buffer cache is recreated after phase 1 */
+	d->hits = now.hits;
+	d->misses = now.misses;
+	if (now.cache == metrics_last.cache) {
+		d->hits -= metrics_last.hits;
+		d->misses -= metrics_last.misses;
+	}
+	pm->valid = 1;
+
+	metrics_last = now;
+	metrics_write();
+}
+
+void
+metrics_timestamp(
+	int			end,
+	int			phase)
+{
+	if (!metrics_active)
+		return;
+
+	/* slot zero is the start of the run */
+	if (phase == 0)
+		metrics_snap(&metrics_last);
+	else if (end && phase < METRICS_WRITEBACK)
+		metrics_end_phase(phase);
+}
+
+/* everything after phase 7, i.e. flushing the cache and unmounting */
+void
+metrics_finish(void)
+{
+	if (!metrics_active)
+		return;
+	metrics_end_phase(METRICS_WRITEBACK);
+}
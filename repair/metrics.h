@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+/*
+ * Per-phase performance metrics, written to a file for scripts to pick up.
+ */
+extern int	metrics_active;
+
+void
+metrics_init(
+	char			*path);
+
+void
+metrics_timestamp(
+	int			end,
+	int			phase);
+
+void
+metrics_finish(void);
+
+void
+metrics_pf_sample(
+	int			depth);
+
+void
+metrics_thread_busy(
+	double			seconds);
+
+double
+metrics_now(void);
+
+#endif /* _METRICS_H */
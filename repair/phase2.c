@@ -27,12 +27,43 @@
 #include "progress.h"
 #include "scan.h"
 
-void	set_mp(xfs_mount_t *mpp);
+/*
+ * Zeroing the log writes the whole of it.  When the log is on its own
+ * device that can go on while the AG scans read the data device, so it is
+ * done from a thread that phase 2 (or phase 3, with -o scan_overlap) waits
+ * for once the scans are done.  Finding the tail and any replay still
+ * happen first, as replay changes metadata the scans are about to read.
+ */
+static pthread_t	log_clear_thread;
+static int		log_clear_running;
 
-/* workaround craziness in the xlog routines */
-int xlog_recover_do_trans(struct xlog *log, xlog_recover_t *t, int p)
+static void
+clear_log(
+	struct xfs_mount	*mp)
 {
-	return 0;
+	libxfs_log_clear(mp->m_logdev_targp,
+		XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
+		(xfs_extlen_t)XFS_FSB_TO_BB(mp, mp->m_sb.sb_logblocks),
+		&mp->m_sb.sb_uuid,
+		xfs_sb_version_haslogv2(&mp->m_sb) ? 2 : 1,
+		mp->m_sb.sb_logsunit, XLOG_FMT);
+}
+
+static void *
+clear_log_thread(
+	void			*arg)
+{
+	clear_log(arg);
+	return NULL;
+}
+
+void
+zero_log_wait(void)
+{
+	if (!log_clear_running)
+		return;
+	pthread_join(log_clear_thread, NULL);
+	log_clear_running = 0;
 }
 
 static void
@@ -80,25 +111,28 @@ zero_log(xfs_mount_t *mp)
 				do_warn(_(
 "ALERT: The filesystem has valuable metadata changes in a log which is being\n"
 "destroyed because the -L option was used.\n"));
-			} else {
+			} else if ((error = replay_log(mp, &log, head_blk,
+						       tail_blk))) {
 				do_warn(_(
 "ERROR: The filesystem has valuable metadata changes in a log which needs to\n"
-"be replayed.  Mount the filesystem to replay the log, and unmount it before\n"
-"re-running xfs_repair.  If you are unable to mount the filesystem, then use\n"
-"the -L option to destroy the log and attempt a repair.\n"
+"be replayed, and xfs_repair couldn't replay it (error %d).  Mount the\n"
+"filesystem to replay the log, and unmount it before re-running xfs_repair.\n"
+"If you are unable to mount the filesystem, then use the -L option to\n"
+"destroy the log and attempt a repair.\n"
 "Note that destroying the log may cause corruption -- please attempt a mount\n"
-"of the filesystem before doing this.\n"));
+"of the filesystem before doing this.\n"), error);
 				exit(2);
 			}
 		}
 	}
 
-	libxfs_log_clear(log.l_dev,
-		XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
-		(xfs_extlen_t)XFS_FSB_TO_BB(mp, mp->m_sb.sb_logblocks),
-		&mp->m_sb.sb_uuid,
-		xfs_sb_version_haslogv2(&mp->m_sb) ? 2 : 1,
-		mp->m_sb.sb_logsunit, XLOG_FMT);
+	if (mp->m_sb.sb_logstart == 0 &&
+	    mp->m_logdev_targp->dev != mp->m_ddev_targp->dev &&
+	    pthread_create(&log_clear_thread, NULL, clear_log_thread, mp) == 0) {
+		log_clear_running = 1;
+		return;
+	}
+	clear_log(mp);
 }
 
 /*
@@ -110,46 +144,16 @@ zero_log(xfs_mount_t *mp)
  * being correct are verboten.
  */
 
-void
-phase2(
-	struct xfs_mount	*mp,
-	int			scan_threads)
+/*
+ * make sure we know about the root inode chunk
+ */
+static void
+check_root_chunk(
+	struct xfs_mount	*mp)
 {
 	int			j;
 	ino_tree_node_t		*ino_rec;
 
-	/* now we can start using the buffer cache routines */
-	set_mp(mp);
-
-	/* Check whether this fs has internal or external log */
-	if (mp->m_sb.sb_logstart == 0) {
-		if (!x.logname)
-			do_error(_("This filesystem has an external log.  "
-				   "Specify log device with the -l option.\n"));
-
-		do_log(_("Phase 2 - using external log on %s\n"), x.logname);
-	} else
-		do_log(_("Phase 2 - using internal log\n"));
-
-	/* Zero log if applicable */
-	if (!no_modify)  {
-		do_log(_("        - zero log...\n"));
-		zero_log(mp);
-	}
-
-	do_log(_("        - scan filesystem freespace and inode maps...\n"));
-
-	bad_ino_btree = 0;
-
-	set_progress_msg(PROG_FMT_SCAN_AG, (__uint64_t) glob_agcount);
-
-	scan_ags(mp, scan_threads);
-
-	print_final_rpt();
-
-	/*
-	 * make sure we know about the root inode chunk
-	 */
 	if ((ino_rec = find_inode_rec(mp, 0, mp->m_sb.sb_rootino)) == NULL)  {
 		ASSERT(mp->m_sb.sb_rbmino == mp->m_sb.sb_rootino + 1 &&
 			mp->m_sb.sb_rsumino == mp->m_sb.sb_rootino + 2);
@@ -205,3 +209,62 @@ phase2(
 		}
 	}
 }
+
+/*
+ * With -o scan_overlap, do the phase 3 setup for an AG right after its
+ * scan, so phase 3 can start on it while the other AGs are scanned.
+ */
+static void
+phase2_ag_done(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno)
+{
+	if (agno == 0)
+		check_root_chunk(mp);
+	phase3_setup_ag(mp, agno);
+}
+
+void
+phase2(
+	struct xfs_mount	*mp,
+	int			scan_threads)
+{
+	/* now we can start using the buffer cache routines */
+	set_mp(mp);
+
+	/* Check whether this fs has internal or external log */
+	if (mp->m_sb.sb_logstart == 0) {
+		if (!x.logname)
+			do_error(_("This filesystem has an external log.  "
+				   "Specify log device with the -l option.\n"));
+
+		do_log(_("Phase 2 - using external log on %s\n"), x.logname);
+	} else
+		do_log(_("Phase 2 - using internal log\n"));
+
+	/* Zero log if applicable */
+	if (!no_modify)  {
+		do_log(_("        - zero log...\n"));
+		zero_log(mp);
+	}
+
+	do_log(_("        - scan filesystem freespace and inode maps...\n"));
+
+	bad_ino_btree = 0;
+
+	set_progress_msg(PROG_FMT_SCAN_AG, (__uint64_t) glob_agcount);
+
+	if (scan_overlap) {
+		/* phase 3 finishes the scans and takes each AG as it is done */
+		scan_ags_start(mp, scan_threads, phase2_ag_done);
+		return;
+	}
+
+	scan_ags_start(mp, scan_threads, NULL);
+	scan_ags_finish(mp);
+	zero_log_wait();
+
+	print_final_rpt();
+
+	check_root_chunk(mp);
+}
@@ -28,6 +28,8 @@
 #include "dinode.h"
 #include "progress.h"
 #include "bmap.h"
+#include "scratch.h"
+#include "scan.h"
 
 static void
 process_agi_unlinked(
@@ -73,11 +75,13 @@ process_ag_func(
 	 * turn on directory processing (inode discovery) and
 	 * attribute processing (extra_attr_check)
 	 */
+	wait_for_ag_scan(agno);
 	wait_for_inode_prefetch(arg);
 	do_log(_("        - agno = %d\n"), agno);
 	process_aginodes(wq->mp, arg, agno, 1, 0, 1);
 	blkmap_free_final();
 	cleanup_inode_prefetch(arg);
+	scratch_release(agno);
 }
 
 static void
@@ -87,12 +91,42 @@ process_ags(
 	do_inode_prefetch(mp, ag_stride, process_ag_func, false, false);
 }
 
+/*
+ * Clear the unlinked lists and look at the uncertain inodes of an AG
+ * that phase 2 has just finished scanning, when the phases overlap.
+ */
 void
-phase3(xfs_mount_t *mp)
+phase3_setup_ag(
+	xfs_mount_t		*mp,
+	xfs_agnumber_t		agno)
 {
-	int 			i, j;
+	if (!no_modify)
+		process_agi_unlinked(mp, agno);
+	check_uncertain_aginodes(mp, agno);
+}
+
+/*
+ * Each AG's uncertain inodes only lead to its own chunks, so the AGs can
+ * be checked in parallel, as they are when phase 2 does it with
+ * -o scan_overlap.
+ */
+static void
+check_uncertain_func(
+	work_queue_t		*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	check_uncertain_aginodes(wq->mp, agno);
+	PROG_RPT_INC(prog_rpt_done[agno], 1);
+}
+
+static void
+setup_ags(
+	xfs_mount_t		*mp)
+{
+	work_queue_t		wq;
+	int			i;
 
-	do_log(_("Phase 3 - for each AG...\n"));
 	if (!no_modify)
 		do_log(_("        - scan and clear agi unlinked lists...\n"));
 	else
@@ -106,12 +140,29 @@ phase3(xfs_mount_t *mp)
 			process_agi_unlinked(mp, i);
 	}
 
-	/* now look at possibly bogus inodes */
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		check_uncertain_aginodes(mp, i);
-		PROG_RPT_INC(prog_rpt_done[i], 1);
-	}
+	/* now look at possibly bogus inodes, as many at once as phase 4 */
+	create_work_queue(&wq, mp, thread_count);
+	for (i = 0; i < mp->m_sb.sb_agcount; i++)
+		queue_work(&wq, check_uncertain_func, i, NULL);
+	destroy_work_queue(&wq);
 	print_final_rpt();
+}
+
+void
+phase3(xfs_mount_t *mp)
+{
+	int 			i, j;
+
+	do_log(_("Phase 3 - for each AG...\n"));
+	if (scan_overlap) {
+		/*
+		 * phase3_setup_ag() has been run from phase 2 as each AG was
+		 * scanned.  AG 0 has to be done before we start as its scan
+		 * may update the incore superblock.
+		 */
+		wait_for_ag_scan(0);
+	} else
+		setup_ags(mp);
 
 	/* ok, now that the tree's ok, let's take a good look */
 
@@ -122,6 +173,11 @@ phase3(xfs_mount_t *mp)
 
 	process_ags(mp);
 
+	if (scan_overlap) {
+		scan_ags_finish(mp);
+		zero_log_wait();
+	}
+
 	print_final_rpt();
 
 	/*
@@ -30,6 +30,7 @@
 #include "versions.h"
 #include "dir2.h"
 #include "progress.h"
+#include "scratch.h"
 
 
 /*
@@ -145,6 +146,7 @@ process_ag_func(
 	 * now recycle the per-AG duplicate extent records
 	 */
 	release_dup_extent_tree(agno);
+	scratch_release(agno);
 }
 
 static void
@@ -173,6 +175,10 @@ phase4(xfs_mount_t *mp)
 	ag_hdr_block = howmany(ag_hdr_len, mp->m_sb.sb_blocksize);
 
 	do_log(_("Phase 4 - check for duplicate blocks...\n"));
+
+	/* inode discovery is over, look records up in sorted arrays */
+	build_inode_index(mp);
+
 	do_log(_("        - setting up duplicate extent list...\n"));
 
 	set_progress_msg(PROG_FMT_DUP_EXTENT, (__uint64_t) glob_agcount);
@@ -303,6 +309,9 @@ phase4(xfs_mount_t *mp)
 	process_ags(mp);
 	print_final_rpt();
 
+	/* that's the last of the directories checked block by block */
+	dir2_data_threads_stop();
+
 	/*
 	 * free up memory used to track trealtime duplicate extents
 	 */
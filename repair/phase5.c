@@ -28,6 +28,7 @@
 #include "versions.h"
 #include "threads.h"
 #include "progress.h"
+#include "scratch.h"
 
 /*
  * we maintain the current slice (path from root to leaf)
@@ -55,8 +56,24 @@ typedef struct bt_stat_level  {
 	int			modulo;		/* num_recs_tot % num_blocks */
 } bt_stat_level_t;
 
+/*
+ * The blocks of the new trees and the AG headers are kept back as they're
+ * finished and written together, sorted by address, when enough have
+ * built up or the AG is done.  Each tree is built in blocks allocated in
+ * order from the AG's free space, so the sorted list mostly merges into a
+ * few large writes, rather than the blocks going out one at a time as the
+ * cache gets round to evicting them.
+ */
+#define BT_WRITEBACK_MAX	256
+
+typedef struct bt_writeback {
+	int			nr;
+	xfs_buf_t		*bufs[BT_WRITEBACK_MAX];
+} bt_writeback_t;
+
 typedef struct bt_status  {
 	int			init;		/* cursor set up once? */
+	bt_writeback_t		*wb;		/* where finished blocks go */
 	int			num_levels;	/* # of levels in btree */
 	xfs_extlen_t		num_tot_blocks;	/* # blocks alloc'ed for tree */
 	xfs_extlen_t		num_free_blocks;/* # blocks currently unused */
@@ -87,6 +104,13 @@ static __uint64_t	*sb_icount_ag;		/* allocated inodes per ag */
 static __uint64_t	*sb_ifree_ag;		/* free inodes per ag */
 static __uint64_t	*sb_fdblocks_ag;	/* free data blocks per ag */
 
+/*
+ * AGs are rebuilt in parallel.  Everything built here is private to the AG,
+ * except that committing a transaction can touch the in-core superblock, so
+ * the AGFL fixup transactions are serialised.
+ */
+static pthread_mutex_t	agfl_fix_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 {
@@ -262,11 +286,9 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 						ext_ptr->ex_startblock);
 			ASSERT(bno_ext_ptr != NULL);
 			get_bno_extent(agno, bno_ext_ptr);
-			release_extent_tree_node(bno_ext_ptr);
 
 			ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
 					ext_ptr->ex_blockcount);
-			release_extent_tree_node(ext_ptr);
 #ifdef XR_BLD_FREE_TRACE
 			fprintf(stderr, "releasing extent: %u [%u %u]\n",
 				agno, ext_ptr->ex_startblock,
@@ -291,12 +313,10 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 		bno_ext_ptr = find_bno_extent(agno, ext_ptr->ex_startblock);
 		ASSERT(bno_ext_ptr != NULL);
 		get_bno_extent(agno, bno_ext_ptr);
-		release_extent_tree_node(bno_ext_ptr);
 
 		ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
 				ext_ptr->ex_blockcount);
 		ASSERT(ext_ptr != NULL);
-		release_extent_tree_node(ext_ptr);
 
 		ext_ptr = findfirst_bcnt_extent(agno);
 	}
@@ -306,6 +326,65 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 #endif
 }
 
+static int
+bt_writeback_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const xfs_buf_t		*ba = *(const xfs_buf_t **)a;
+	const xfs_buf_t		*bb = *(const xfs_buf_t **)b;
+
+	if (ba->b_bn != bb->b_bn)
+		return ba->b_bn < bb->b_bn ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write out the blocks kept back and let them go.  A write that fails
+ * leaves the buffer dirty, so it's tried again, and reported, when the
+ * cache lets go of it.
+ */
+static void
+bt_writeback_flush(
+	bt_writeback_t		*wb)
+{
+	int			i;
+	int			n;
+
+	if (!wb->nr)
+		return;
+	qsort(wb->bufs, wb->nr, sizeof(xfs_buf_t *), bt_writeback_cmp);
+
+	/* a block written twice only needs to go out once */
+	for (i = 1, n = 1; i < wb->nr; i++) {
+		if (wb->bufs[i] == wb->bufs[n - 1])
+			libxfs_putbuf(wb->bufs[i]);
+		else
+			wb->bufs[n++] = wb->bufs[i];
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_mutex_lock(&wb->bufs[i]->b_node.cn_mutex);
+	libxfs_writebufr_list(wb->bufs[0]->b_target, wb->bufs, n);
+	for (i = 0; i < n; i++) {
+		pthread_mutex_unlock(&wb->bufs[i]->b_node.cn_mutex);
+		libxfs_putbuf(wb->bufs[i]);
+	}
+	wb->nr = 0;
+}
+
+/* as libxfs_writebuf, but the write waits for the rest of the batch */
+static void
+bt_write(
+	bt_writeback_t		*wb,
+	xfs_buf_t		*bp)
+{
+	libxfs_writebuf_int(bp, 0);
+	wb->bufs[wb->nr++] = bp;
+	if (wb->nr == BT_WRITEBACK_MAX)
+		bt_writeback_flush(wb);
+}
+
 static void
 write_cursor(bt_status_t *curs)
 {
@@ -321,9 +400,9 @@ write_cursor(bt_status_t *curs)
 			fprintf(stderr, "writing bt prev block %u\n",
 						curs->level[i].prev_agbno);
 #endif
-			libxfs_writebuf(curs->level[i].prev_buf_p, 0);
+			bt_write(curs->wb, curs->level[i].prev_buf_p);
 		}
-		libxfs_writebuf(curs->level[i].buf_p, 0);
+		bt_write(curs->wb, curs->level[i].buf_p);
 	}
 }
 
@@ -660,7 +739,7 @@ prop_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 #endif
 		if (lptr->prev_agbno != NULLAGBLOCK) {
 			ASSERT(lptr->prev_buf_p != NULL);
-			libxfs_writebuf(lptr->prev_buf_p, 0);
+			bt_write(btree_curs->wb, lptr->prev_buf_p);
 		}
 		lptr->prev_agbno = lptr->agbno;;
 		lptr->prev_buf_p = lptr->buf_p;
@@ -838,7 +917,7 @@ build_freespace_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 							ext_ptr->ex_blockcount);
 			freeblks += ext_ptr->ex_blockcount;
 			if (magic == XFS_ABTB_MAGIC)
-				ext_ptr = findnext_bno_extent(ext_ptr);
+				ext_ptr = findnext_bno_extent(agno, ext_ptr);
 			else
 				ext_ptr = findnext_bcnt_extent(agno, ext_ptr);
 #if 0
@@ -865,7 +944,7 @@ build_freespace_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 					lptr->prev_agbno);
 #endif
 				ASSERT(lptr->prev_agbno != NULLAGBLOCK);
-				libxfs_writebuf(lptr->prev_buf_p, 0);
+				bt_write(btree_curs->wb, lptr->prev_buf_p);
 			}
 			lptr->prev_buf_p = lptr->buf_p;
 			lptr->prev_agbno = lptr->agbno;
@@ -1039,7 +1118,7 @@ prop_ino_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *btree_curs,
 #endif
 		if (lptr->prev_agbno != NULLAGBLOCK)  {
 			ASSERT(lptr->prev_buf_p != NULL);
-			libxfs_writebuf(lptr->prev_buf_p, 0);
+			bt_write(btree_curs->wb, lptr->prev_buf_p);
 		}
 		lptr->prev_agbno = lptr->agbno;;
 		lptr->prev_buf_p = lptr->buf_p;
@@ -1135,7 +1214,7 @@ build_agi(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *btree_curs,
 		agi->agi_free_level = cpu_to_be32(finobt_curs->num_levels);
 	}
 
-	libxfs_writebuf(agi_buf, 0);
+	bt_write(btree_curs->wb, agi_buf);
 }
 
 /*
@@ -1306,7 +1385,7 @@ nextrec:
 					lptr->prev_agbno);
 #endif
 				ASSERT(lptr->prev_agbno != NULLAGBLOCK);
-				libxfs_writebuf(lptr->prev_buf_p, 0);
+				bt_write(btree_curs->wb, lptr->prev_buf_p);
 			}
 			lptr->prev_buf_p = lptr->buf_p;
 			lptr->prev_agbno = lptr->agbno;
@@ -1483,7 +1562,7 @@ build_agf_agfl(xfs_mount_t	*mp,
 		agf->agf_flcount = 0;
 	}
 
-	libxfs_writebuf(agfl_buf, 0);
+	bt_write(bno_bt->wb, agfl_buf);
 
 	ext_ptr = findbiggest_bcnt_extent(agno);
 	agf->agf_longest = cpu_to_be32((ext_ptr != NULL) ?
@@ -1492,7 +1571,10 @@ build_agf_agfl(xfs_mount_t	*mp,
 	ASSERT(be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNOi]) !=
 		be32_to_cpu(agf->agf_roots[XFS_BTNUM_CNTi]));
 
-	libxfs_writebuf(agf_buf, 0);
+	bt_write(bno_bt->wb, agf_buf);
+
+	/* the freelist fixup reads the AGF and AGFL back through the cache */
+	bt_writeback_flush(bno_bt->wb);
 
 	/*
 	 * now fix up the free list appropriately
@@ -1504,6 +1586,7 @@ build_agf_agfl(xfs_mount_t	*mp,
 		struct xfs_trans_res tres = {0};
 		int		error;
 
+		pthread_mutex_lock(&agfl_fix_lock);
 		memset(&args, 0, sizeof(args));
 		args.tp = tp = libxfs_trans_alloc(mp, 0);
 		args.mp = mp;
@@ -1519,6 +1602,7 @@ build_agf_agfl(xfs_mount_t	*mp,
 					agno, error);
 		}
 		libxfs_trans_commit(tp);
+		pthread_mutex_unlock(&agfl_fix_lock);
 	}
 
 #ifdef XR_BLD_FREE_TRACE
@@ -1570,9 +1654,11 @@ keep_fsinos(xfs_mount_t *mp)
 
 static void
 phase5_func(
-	xfs_mount_t	*mp,
-	xfs_agnumber_t	agno)
+	work_queue_t	*wq,
+	xfs_agnumber_t	agno,
+	void		*arg)
 {
+	xfs_mount_t	*mp = wq->mp;
 	__uint64_t	num_inos;
 	__uint64_t	num_free_inos;
 	__uint64_t	finobt_num_inos;
@@ -1590,10 +1676,12 @@ phase5_func(
 	xfs_agblock_t	num_extents;
 	__uint32_t	magic;
 	struct agi_stat	agi_stat = {0,};
+	bt_writeback_t	wb;
 
 	if (verbose)
 		do_log(_("        - agno = %d\n"), agno);
 
+	wb.nr = 0;
 	{
 		/*
 		 * build up incore bno and bcnt extent btrees
@@ -1627,11 +1715,13 @@ phase5_func(
 		 */
 		init_ino_cursor(mp, agno, &ino_btree_curs, &num_inos,
 				&num_free_inos, 0);
+		ino_btree_curs.wb = &wb;
 
 		if (xfs_sb_version_hasfinobt(&mp->m_sb))
 			init_ino_cursor(mp, agno, &fino_btree_curs,
 					&finobt_num_inos, &finobt_num_free_inos,
 					1);
+		fino_btree_curs.wb = &wb;
 
 		sb_icount_ag[agno] += num_inos;
 		sb_ifree_ag[agno] += num_free_inos;
@@ -1667,6 +1757,7 @@ phase5_func(
 		 */
 		extra_blocks = calculate_freespace_cursor(mp, agno,
 					&num_extents, &bno_btree_curs);
+		bno_btree_curs.wb = &wb;
 
 		/*
 		 * freespace btrees live in the "free space" but
@@ -1747,6 +1838,7 @@ phase5_func(
 		/* build the agi */
 		build_agi(mp, agno, &ino_btree_curs, &fino_btree_curs,
 			  &agi_stat);
+		bt_writeback_flush(&wb);
 
 		/*
 		 * tear down cursors
@@ -1763,6 +1855,7 @@ phase5_func(
 		release_agbno_extent_tree(agno);
 		release_agbcnt_extent_tree(agno);
 	}
+	scratch_release(agno);
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
@@ -1770,6 +1863,7 @@ void
 phase5(xfs_mount_t *mp)
 {
 	xfs_agnumber_t		agno;
+	work_queue_t		wq;
 
 	do_log(_("Phase 5 - rebuild AG headers and trees...\n"));
 	set_progress_msg(PROG_FMT_REBUILD_AG, (__uint64_t )glob_agcount);
@@ -1810,8 +1904,15 @@ phase5(xfs_mount_t *mp)
 	if (sb_fdblocks_ag == NULL)
 		do_error(_("cannot alloc sb_fdblocks_ag buffers\n"));
 
+	/*
+	 * each AG's headers and trees are independent of the others, only
+	 * the superblock counters are summed up once they are all done.
+	 * As many go at once as in phase 4.
+	 */
+	create_work_queue(&wq, mp, thread_count);
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		phase5_func(mp, agno);
+		queue_work(&wq, phase5_func, agno, NULL);
+	destroy_work_queue(&wq);
 
 	print_final_rpt();
 
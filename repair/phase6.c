@@ -29,10 +29,29 @@
 #include "dinode.h"
 #include "progress.h"
 #include "versions.h"
+#include "mem.h"
 
 static struct cred		zerocr;
 static struct fsxattr 		zerofsx;
 static xfs_ino_t		orphanage_ino;
+static int			orphanage_created;	/* empty, made by us */
+
+/*
+ * Disconnected inodes, gathered up as the AGs are checked and then moved
+ * to the orphanage together, see mv_orphans().
+ */
+struct orphan {
+	xfs_ino_t		ino;
+	xfs_dahash_t		hash;		/* of its name in lost+found */
+	int			incr;		/* suffix making the name unique */
+	int			isa_dir;
+};
+
+static struct orphan		*orphans;
+static int			norphans;
+static int			maxorphans;
+
+#define ORPHAN_BATCH		64	/* inodes moved per transaction */
 
 static struct xfs_name		xfs_name_dot = {(unsigned char *)".",
 						1,
@@ -51,6 +70,47 @@ typedef struct dotdot_update {
 
 static LIST_HEAD(dotdot_update_list);
 static int			dotdot_update;
+static pthread_mutex_t		dotdot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The AGs are traversed in parallel.  A directory is only ever processed by
+ * the thread walking its own AG, but its entries can point at inodes in any
+ * AG, so the link counts, reached flags and parent of an inode are only
+ * looked at and updated under the lock of the AG the inode lives in.
+ *
+ * Directory changes that allocate or free blocks go through the shared
+ * free space btrees and superblock counters and are serialised by
+ * alloc_lock.
+ */
+static pthread_mutex_t		alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void
+lock_inode_rec(
+	xfs_mount_t		*mp,
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&ag_locks[XFS_INO_TO_AGNO(mp, ino)].lock);
+}
+
+static inline void
+unlock_inode_rec(
+	xfs_mount_t		*mp,
+	xfs_ino_t		ino)
+{
+	pthread_mutex_unlock(&ag_locks[XFS_INO_TO_AGNO(mp, ino)].lock);
+}
+
+static void
+add_inode_ref_locked(
+	xfs_mount_t		*mp,
+	xfs_ino_t		ino,
+	ino_tree_node_t		*irec,
+	int			ino_offset)
+{
+	lock_inode_rec(mp, ino);
+	add_inode_ref(irec, ino_offset);
+	unlock_inode_rec(mp, ino);
+}
 
 static void
 add_dotdot_update(
@@ -69,18 +129,23 @@ add_dotdot_update(
 	dir->agno = agno;
 	dir->ino_offset = ino_offset;
 
+	pthread_mutex_lock(&dotdot_lock);
 	list_add(&dir->list, &dotdot_update_list);
+	pthread_mutex_unlock(&dotdot_lock);
 }
 
 /*
  * Data structures and routines to keep track of directory entries
  * and whether their leaf entry has been seen. Also used for name
  * duplicate checking and rebuilding step if required.
+ *
+ * The entries are kept in a flat array in the order they were added, and
+ * found by address and by name through two open addressing tables of
+ * indexes into that array.  Each thread keeps its table from one
+ * directory to the next, so after the first few directories checking
+ * one doesn't allocate anything at all.
  */
 typedef struct dir_hash_ent {
-	struct dir_hash_ent	*nextbyaddr;	/* next in addr bucket */
-	struct dir_hash_ent	*nextbyhash;	/* next in name bucket */
-	struct dir_hash_ent	*nextbyorder;	/* next in order added */
 	xfs_dahash_t		hashval;	/* hash value of name */
 	__uint32_t		address;	/* offset of data entry */
 	xfs_ino_t 		inum;		/* inode num of entry */
@@ -90,17 +155,32 @@ typedef struct dir_hash_ent {
 } dir_hash_ent_t;
 
 typedef struct dir_hash_tab {
-	int			size;		/* size of hash tables */
-	int			names_duped;	/* 1 = ent names malloced */
-	dir_hash_ent_t		*first;		/* ptr to first added entry */
-	dir_hash_ent_t		*last;		/* ptr to last added entry */
-	dir_hash_ent_t		**byhash;	/* ptr to name hash buckets */
-	dir_hash_ent_t		**byaddr;	/* ptr to addr hash buckets */
+	int			size;		/* slots in use, power of 2 */
+	int			shift;		/* 32 - log2(size) */
+	int			maxsize;	/* slots allocated */
+	__uint32_t		*byhash;	/* name slots, entry + 1 */
+	__uint32_t		*byaddr;	/* addr slots, entry + 1 */
+	int			nents;		/* entries added */
+	int			maxents;	/* entries allocated */
+	dir_hash_ent_t		*ents;		/* entries in order added */
+	int			names_duped;	/* 1 = ent names copied */
+	unsigned char		*names;		/* copied names */
+	size_t			names_size;
+	struct xfs_name		*blk_names;	/* one data block's names */
+	xfs_dahash_t		*blk_hashes;	/* and their hashes */
 } dir_hash_tab_t;
 
-#define	DIR_HASH_TAB_SIZE(n)	\
-	(sizeof(dir_hash_tab_t) + (sizeof(dir_hash_ent_t *) * (n) * 2))
-#define	DIR_HASH_FUNC(t,a)	((a) % (t)->size)
+#define	DIR_HASH_MIN_SIZE	64
+#define	DIR_HASH_SLOT(t,k)	(((__uint32_t)(k) * 0x9e3779b1U) >> (t)->shift)
+#define	DIR_HASH_ADDR(t,a)	DIR_HASH_SLOT(t,a)
+#define	DIR_HASH_NAME(t,h)	DIR_HASH_SLOT(t,h)
+#define	DIR_HASH_NEXT(t,i)	(((i) + 1) & ((t)->size - 1))
+
+/* the most entries a data block can hold, at 16 bytes for the smallest */
+#define	DIR_HASH_BLK_MAX	(XFS_MAX_BLOCKSIZE / 16)
+
+static pthread_key_t		dir_hash_key;
+static pthread_once_t		dir_hash_once = PTHREAD_ONCE_INIT;
 
 /*
  * Track the contents of the freespace table in a directory.
@@ -163,6 +243,50 @@ dir_read_buf(
 	return 0;
 }
 
+/*
+ * Size both slot tables for @size slots and index all the entries added so
+ * far.  Called with the table empty, or when it gets half full.
+ */
+static void
+dir_hash_resize(
+	dir_hash_tab_t		*hashtab,
+	int			size)
+{
+	dir_hash_ent_t		*p;
+	int			i;
+	int			j;
+
+	if (size > hashtab->maxsize) {
+		free(hashtab->byhash);
+		hashtab->byhash = malloc(2 * size * sizeof(__uint32_t));
+		if (!hashtab->byhash)
+			do_error(_("malloc failed in dir_hash_resize (%zu bytes)\n"),
+				2 * size * sizeof(__uint32_t));
+		mem_add(MEM_DIRHASH,
+			2 * (size - hashtab->maxsize) * sizeof(__uint32_t));
+		hashtab->maxsize = size;
+	}
+	hashtab->byaddr = hashtab->byhash + size;
+	hashtab->size = size;
+	hashtab->shift = 32 - libxfs_highbit32(size);
+	memset(hashtab->byhash, 0, 2 * size * sizeof(__uint32_t));
+
+	for (i = 0, p = hashtab->ents; i < hashtab->nents; i++, p++) {
+		for (j = DIR_HASH_ADDR(hashtab, p->address);
+		     hashtab->byaddr[j];
+		     j = DIR_HASH_NEXT(hashtab, j))
+			;
+		hashtab->byaddr[j] = i + 1;
+		if (p->junkit)
+			continue;
+		for (j = DIR_HASH_NAME(hashtab, p->hashval);
+		     hashtab->byhash[j];
+		     j = DIR_HASH_NEXT(hashtab, j))
+			;
+		hashtab->byhash[j] = i + 1;
+	}
+}
+
 /*
  * Returns 0 if the name already exists (ie. a duplicate)
  */
@@ -174,66 +298,73 @@ dir_hash_add(
 	xfs_ino_t		inum,
 	int			namelen,
 	unsigned char		*name,
-	__uint8_t		ftype)
+	__uint8_t		ftype,
+	xfs_dahash_t		hash)
 {
-	xfs_dahash_t		hash = 0;
-	int			byaddr;
 	int			byhash = 0;
+	int			byaddr;
 	dir_hash_ent_t		*p;
 	int			dup;
 	short			junk;
-	struct xfs_name		xname;
 
 	ASSERT(!hashtab->names_duped);
 
-	xname.name = name;
-	xname.len = namelen;
-	xname.type = ftype;
-
 	junk = name[0] == '/';
-	byaddr = DIR_HASH_FUNC(hashtab, addr);
 	dup = 0;
+	if (junk)
+		hash = 0;
 
-	if (!junk) {
-		hash = mp->m_dirnameops->hashname(&xname);
-		byhash = DIR_HASH_FUNC(hashtab, hash);
+	if (2 * (hashtab->nents + 1) > hashtab->size)
+		dir_hash_resize(hashtab, 2 * hashtab->size);
 
+	if (!junk) {
 		/*
-		 * search hash bucket for existing name.
+		 * search the name slots for an existing name, leaving
+		 * byhash at the free slot the new name goes in.
 		 */
-		for (p = hashtab->byhash[byhash]; p; p = p->nextbyhash) {
-			if (p->hashval == hash && p->name.len == namelen) {
-				if (memcmp(p->name.name, name, namelen) == 0) {
-					dup = 1;
-					junk = 1;
-					break;
-				}
+		for (byhash = DIR_HASH_NAME(hashtab, hash);
+		     hashtab->byhash[byhash];
+		     byhash = DIR_HASH_NEXT(hashtab, byhash)) {
+			p = &hashtab->ents[hashtab->byhash[byhash] - 1];
+			if (p->hashval == hash && p->name.len == namelen &&
+			    memcmp(p->name.name, name, namelen) == 0) {
+				dup = 1;
+				junk = 1;
+				break;
 			}
 		}
 	}
 
-	if ((p = malloc(sizeof(*p))) == NULL)
-		do_error(_("malloc failed in dir_hash_add (%zu bytes)\n"),
-			sizeof(*p));
+	if (hashtab->nents == hashtab->maxents) {
+		int		maxents = max(hashtab->maxents * 2,
+					      DIR_HASH_MIN_SIZE / 2);
 
-	p->nextbyaddr = hashtab->byaddr[byaddr];
-	hashtab->byaddr[byaddr] = p;
-	if (hashtab->last)
-		hashtab->last->nextbyorder = p;
-	else
-		hashtab->first = p;
-	p->nextbyorder = NULL;
-	hashtab->last = p;
+		p = realloc(hashtab->ents, maxents * sizeof(*p));
+		if (!p)
+			do_error(_("malloc failed in dir_hash_add (%zu bytes)\n"),
+				maxents * sizeof(*p));
+		mem_add(MEM_DIRHASH, (maxents - hashtab->maxents) * sizeof(*p));
+		hashtab->ents = p;
+		hashtab->maxents = maxents;
+	}
+	p = &hashtab->ents[hashtab->nents++];
+
+	for (byaddr = DIR_HASH_ADDR(hashtab, addr);
+	     hashtab->byaddr[byaddr];
+	     byaddr = DIR_HASH_NEXT(hashtab, byaddr))
+		;
+	hashtab->byaddr[byaddr] = hashtab->nents;
 
 	if (!(p->junkit = junk)) {
 		p->hashval = hash;
-		p->nextbyhash = hashtab->byhash[byhash];
-		hashtab->byhash[byhash] = p;
+		hashtab->byhash[byhash] = hashtab->nents;
 	}
 	p->address = addr;
 	p->inum = inum;
 	p->seen = 0;
-	p->name = xname;
+	p->name.name = name;
+	p->name.len = namelen;
+	p->name.type = ftype;
 
 	return !dup;
 }
@@ -246,13 +377,10 @@ dir_hash_unseen(
 	dir_hash_tab_t	*hashtab)
 {
 	int		i;
-	dir_hash_ent_t	*p;
 
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->byaddr[i]; p; p = p->nextbyaddr) {
-			if (p->seen == 0)
-				return 1;
-		}
+	for (i = 0; i < hashtab->nents; i++) {
+		if (hashtab->ents[i].seen == 0)
+			return 1;
 	}
 	return 0;
 }
@@ -289,23 +417,41 @@ dir_hash_check(
 	return 1;
 }
 
+static void
+dir_hash_free(
+	void		*arg)
+{
+	dir_hash_tab_t	*hashtab = arg;
+
+	mem_add(MEM_DIRHASH, -(long)(sizeof(*hashtab) + hashtab->names_size +
+		2 * hashtab->maxsize * sizeof(__uint32_t) +
+		hashtab->maxents * sizeof(dir_hash_ent_t) +
+		(hashtab->blk_names ? DIR_HASH_BLK_MAX *
+			(sizeof(struct xfs_name) + sizeof(xfs_dahash_t)) : 0)));
+	free(hashtab->byhash);
+	free(hashtab->ents);
+	free(hashtab->names);
+	free(hashtab->blk_names);
+	free(hashtab->blk_hashes);
+	free(hashtab);
+}
+
+static void
+dir_hash_key_init(void)
+{
+	pthread_key_create(&dir_hash_key, dir_hash_free);
+}
+
+/*
+ * The table stays with the thread for the next directory, the key
+ * destructor frees it when the thread exits.
+ */
 static void
 dir_hash_done(
 	dir_hash_tab_t	*hashtab)
 {
-	int		i;
-	dir_hash_ent_t	*n;
-	dir_hash_ent_t	*p;
-
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->byaddr[i]; p; p = n) {
-			n = p->nextbyaddr;
-			if (hashtab->names_duped)
-				free((void *)p->name.name);
-			free(p);
-		}
-	}
-	free(hashtab);
+	hashtab->nents = 0;
+	hashtab->names_duped = 0;
 }
 
 static dir_hash_tab_t *
@@ -315,18 +461,30 @@ dir_hash_init(
 	dir_hash_tab_t	*hashtab;
 	int		hsize;
 
-	hsize = size / (16 * 4);
-	if (hsize > 65536)
-		hsize = 63336;
-	else if (hsize < 16)
-		hsize = 16;
-	if ((hashtab = calloc(DIR_HASH_TAB_SIZE(hsize), 1)) == NULL)
-		do_error(_("calloc failed in dir_hash_init\n"));
-	hashtab->size = hsize;
-	hashtab->byhash = (dir_hash_ent_t**)((char *)hashtab +
-		sizeof(dir_hash_tab_t));
-	hashtab->byaddr = (dir_hash_ent_t**)((char *)hashtab +
-		sizeof(dir_hash_tab_t) + sizeof(dir_hash_ent_t*) * hsize);
+	pthread_once(&dir_hash_once, dir_hash_key_init);
+	hashtab = pthread_getspecific(dir_hash_key);
+	if (!hashtab) {
+		if ((hashtab = calloc(sizeof(*hashtab), 1)) == NULL)
+			do_error(_("calloc failed in dir_hash_init\n"));
+		mem_add(MEM_DIRHASH, sizeof(*hashtab));
+		pthread_setspecific(dir_hash_key, hashtab);
+
+		hashtab->blk_names = malloc(DIR_HASH_BLK_MAX *
+					    sizeof(struct xfs_name));
+		hashtab->blk_hashes = malloc(DIR_HASH_BLK_MAX *
+					     sizeof(xfs_dahash_t));
+		if (!hashtab->blk_names || !hashtab->blk_hashes)
+			do_error(_("malloc failed in dir_hash_init\n"));
+		mem_add(MEM_DIRHASH, DIR_HASH_BLK_MAX *
+			(sizeof(struct xfs_name) + sizeof(xfs_dahash_t)));
+	}
+
+	/* guess at one entry per 32 bytes, the table grows if needed */
+	for (hsize = DIR_HASH_MIN_SIZE;
+	     hsize < 65536 && hsize < size / 16;
+	     hsize <<= 1)
+		;
+	dir_hash_resize(hashtab, hsize);
 	return hashtab;
 }
 
@@ -339,8 +497,10 @@ dir_hash_see(
 	int			i;
 	dir_hash_ent_t		*p;
 
-	i = DIR_HASH_FUNC(hashtab, addr);
-	for (p = hashtab->byaddr[i]; p; p = p->nextbyaddr) {
+	for (i = DIR_HASH_ADDR(hashtab, addr);
+	     hashtab->byaddr[i];
+	     i = DIR_HASH_NEXT(hashtab, i)) {
+		p = &hashtab->ents[hashtab->byaddr[i] - 1];
 		if (p->address != addr)
 			continue;
 		if (p->seen)
@@ -362,8 +522,10 @@ dir_hash_update_ftype(
 	int			i;
 	dir_hash_ent_t		*p;
 
-	i = DIR_HASH_FUNC(hashtab, addr);
-	for (p = hashtab->byaddr[i]; p; p = p->nextbyaddr) {
+	for (i = DIR_HASH_ADDR(hashtab, addr);
+	     hashtab->byaddr[i];
+	     i = DIR_HASH_NEXT(hashtab, i)) {
+		p = &hashtab->ents[hashtab->byaddr[i] - 1];
 		if (p->address != addr)
 			continue;
 		p->name.type = ftype;
@@ -399,7 +561,7 @@ dir_hash_see_all(
 }
 
 /*
- * Convert name pointers into locally allocated memory.
+ * Copy the names out of the directory buffers into the table.
  * This must only be done after all the entries have been added.
  */
 static void
@@ -407,14 +569,29 @@ dir_hash_dup_names(dir_hash_tab_t *hashtab)
 {
 	unsigned char		*name;
 	dir_hash_ent_t		*p;
+	size_t			len;
+	int			i;
 
 	if (hashtab->names_duped)
 		return;
 
-	for (p = hashtab->first; p; p = p->nextbyorder) {
-		name = malloc(p->name.len);
+	for (len = 0, i = 0; i < hashtab->nents; i++)
+		len += hashtab->ents[i].name.len;
+	if (len > hashtab->names_size) {
+		free(hashtab->names);
+		hashtab->names = malloc(len);
+		if (!hashtab->names)
+			do_error(
+		_("malloc failed in dir_hash_dup_names (%zu bytes)\n"), len);
+		mem_add(MEM_DIRHASH, len - hashtab->names_size);
+		hashtab->names_size = len;
+	}
+
+	name = hashtab->names;
+	for (i = 0, p = hashtab->ents; i < hashtab->nents; i++, p++) {
 		memcpy(name, p->name.name, p->name.len);
 		p->name.name = name;
+		name += p->name.len;
 	}
 	hashtab->names_duped = 1;
 }
@@ -1070,189 +1247,249 @@ mk_orphanage(xfs_mount_t *mp)
 	IRELE(ip);
 	IRELE(pip);
 	add_inode_reached(irec,ino_offset);
+	orphanage_created = 1;
 
 	return(ino);
 }
 
 /*
- * move a file to the orphange.
+ * Name an orphan in lost+found after its inode number, with a suffix if
+ * that was already taken.
+ */
+static void
+orphan_name(
+	struct orphan		*o,
+	struct xfs_name		*xname,
+	unsigned char		*fname)
+{
+	xname->name = fname;
+	if (o->incr)
+		xname->len = snprintf((char *)fname, MAXPATHLEN + 1, "%llu.%d",
+					(unsigned long long)o->ino, o->incr);
+	else
+		xname->len = snprintf((char *)fname, MAXPATHLEN + 1, "%llu",
+					(unsigned long long)o->ino);
+}
+
+static int
+orphan_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct orphan	*oa = a;
+	const struct orphan	*ob = b;
+
+	if (oa->hash != ob->hash)
+		return oa->hash < ob->hash ? -1 : 1;
+	return oa->ino < ob->ino ? -1 : oa->ino > ob->ino;
+}
+
+static void
+queue_orphan(
+	xfs_ino_t		ino,
+	int			isa_dir)
+{
+	struct orphan		*o;
+
+	if (norphans == maxorphans) {
+		maxorphans = maxorphans ? maxorphans * 2 : 1024;
+		o = realloc(orphans, maxorphans * sizeof(*orphans));
+		if (!o)
+			do_error(
+		_("couldn't allocate list of disconnected inodes\n"));
+		orphans = o;
+	}
+	o = &orphans[norphans++];
+	o->ino = ino;
+	o->hash = 0;
+	o->incr = 0;
+	o->isa_dir = isa_dir;
+}
+
+/*
+ * move a file to the orphanage, in a transaction that the orphanage and
+ * the file have been joined to.
  */
 static void
 mv_orphanage(
 	xfs_mount_t		*mp,
-	xfs_ino_t		ino,		/* inode # to be moved */
-	int			isa_dir)	/* 1 if inode is a directory */
+	xfs_trans_t		*tp,
+	xfs_inode_t		*orphanage_ip,
+	ino_tree_node_t		*irec,		/* of the orphanage */
+	int			ino_offset,
+	struct orphan		*o,
+	xfs_inode_t		*ino_p,
+	xfs_fsblock_t		*first,
+	xfs_bmap_free_t		*flist,
+	int			nres)
 {
-	xfs_inode_t		*orphanage_ip;
 	xfs_ino_t		entry_ino_num;
-	xfs_inode_t		*ino_p;
-	xfs_trans_t		*tp;
-	xfs_fsblock_t		first;
-	xfs_bmap_free_t		flist;
 	int			err;
-	int			committed;
 	unsigned char		fname[MAXPATHLEN + 1];
-	int			nres;
-	int			incr;
-	ino_tree_node_t		*irec;
-	int			ino_offset = 0;
 	struct xfs_name		xname;
 
-	xname.name = fname;
-	xname.len = snprintf((char *)fname, sizeof(fname), "%llu",
-				(unsigned long long)ino);
-
-	err = -libxfs_iget(mp, NULL, orphanage_ino, 0, &orphanage_ip, 0);
-	if (err)
-		do_error(_("%d - couldn't iget orphanage inode\n"), err);
-	/*
-	 * Make sure the filename is unique in the lost+found
-	 */
-	incr = 0;
-	while (libxfs_dir_lookup(NULL, orphanage_ip, &xname, &entry_ino_num,
-								NULL) == 0)
-		xname.len = snprintf((char *)fname, sizeof(fname), "%llu.%d",
-					(unsigned long long)ino, ++incr);
-
-	tp = libxfs_trans_alloc(mp, 0);
-
-	if ((err = -libxfs_iget(mp, NULL, ino, 0, &ino_p, 0)))
-		do_error(_("%d - couldn't iget disconnected inode\n"), err);
-
+	orphan_name(o, &xname, fname);
 	xname.type = xfs_mode_to_ftype[(ino_p->i_d.di_mode & S_IFMT)>>S_SHIFT];
 
-	if (isa_dir)  {
-		irec = find_inode_rec(mp, XFS_INO_TO_AGNO(mp, orphanage_ino),
-				XFS_INO_TO_AGINO(mp, orphanage_ino));
-		if (irec)
-			ino_offset = XFS_INO_TO_AGINO(mp, orphanage_ino) -
-					irec->ino_startnum;
-		nres = XFS_DIRENTER_SPACE_RES(mp, fnamelen) +
-		       XFS_DIRENTER_SPACE_RES(mp, 2);
-		err = -libxfs_dir_lookup(tp, ino_p, &xfs_name_dotdot,
-					&entry_ino_num, NULL);
-		if (err) {
-			ASSERT(err == ENOENT);
-
-			err = -libxfs_trans_reserve(tp, &M_RES(mp)->tr_rename,
-						   nres, 0);
-			if (err)
-				do_error(
-	_("space reservation failed (%d), filesystem may be out of space\n"),
-					err);
-
-			libxfs_trans_ijoin(tp, orphanage_ip, 0);
-			libxfs_trans_ijoin(tp, ino_p, 0);
-
-			xfs_bmap_init(&flist, &first);
-			err = -libxfs_dir_createname(tp, orphanage_ip, &xname,
-						ino, &first, &flist, nres);
-			if (err)
-				do_error(
+	err = -libxfs_dir_createname(tp, orphanage_ip, &xname, o->ino,
+					first, flist, nres);
+	if (err)
+		do_error(
 	_("name create failed in %s (%d), filesystem may be out of space\n"),
-					ORPHANAGE, err);
+			ORPHANAGE, err);
 
-			if (irec)
-				add_inode_ref(irec, ino_offset);
-			else
-				orphanage_ip->i_d.di_nlink++;
-			libxfs_trans_log_inode(tp, orphanage_ip, XFS_ILOG_CORE);
-
-			err = -libxfs_dir_createname(tp, ino_p, &xfs_name_dotdot,
-					orphanage_ino, &first, &flist, nres);
-			if (err)
-				do_error(
-	_("creation of .. entry failed (%d), filesystem may be out of space\n"),
-					err);
+	if (!o->isa_dir)  {
+		ino_p->i_d.di_nlink = 1;
+		libxfs_trans_log_inode(tp, ino_p, XFS_ILOG_CORE);
+		return;
+	}
 
-			ino_p->i_d.di_nlink++;
-			libxfs_trans_log_inode(tp, ino_p, XFS_ILOG_CORE);
+	if (irec)
+		add_inode_ref(irec, ino_offset);
+	else
+		orphanage_ip->i_d.di_nlink++;
 
-			err = -libxfs_bmap_finish(&tp, &flist, &committed);
-			if (err)
-				do_error(
-	_("bmap finish failed (err - %d), filesystem may be out of space\n"),
-					err);
+	err = -libxfs_dir_lookup(tp, ino_p, &xfs_name_dotdot,
+				&entry_ino_num, NULL);
+	if (err) {
+		ASSERT(err == ENOENT);
 
-			libxfs_trans_commit(tp);
-		} else  {
-			err = -libxfs_trans_reserve(tp, &M_RES(mp)->tr_rename,
-						   nres, 0);
-			if (err)
-				do_error(
-	_("space reservation failed (%d), filesystem may be out of space\n"),
-					err);
+		err = -libxfs_dir_createname(tp, ino_p, &xfs_name_dotdot,
+				orphanage_ino, first, flist, nres);
+		if (err)
+			do_error(
+	_("creation of .. entry failed (%d), filesystem may be out of space\n"),
+				err);
 
-			libxfs_trans_ijoin(tp, orphanage_ip, 0);
-			libxfs_trans_ijoin(tp, ino_p, 0);
+		ino_p->i_d.di_nlink++;
+		libxfs_trans_log_inode(tp, ino_p, XFS_ILOG_CORE);
+	} else if (entry_ino_num != orphanage_ino)  {
+		/*
+		 * don't replace .. value if it already points
+		 * to us.  that'll pop a libxfs/kernel ASSERT.
+		 */
+		err = -libxfs_dir_replace(tp, ino_p, &xfs_name_dotdot,
+				orphanage_ino, first, flist, nres);
+		if (err)
+			do_error(
+	_("name replace op failed (%d), filesystem may be out of space\n"),
+				err);
+	}
+}
 
-			xfs_bmap_init(&flist, &first);
+/*
+ * Move everything queue_orphan() collected to the orphanage.  After a bad
+ * enough directory crash there can be millions of them, so rather than
+ * one transaction each they go in batches, in the hash order of their
+ * new names: each name then lands at the end of the lost+found leaf
+ * blocks instead of somewhere in the middle, and the orphanage inode is
+ * logged once a batch and written back once every few batches.
+ */
+static void
+mv_orphans(
+	xfs_mount_t		*mp)
+{
+	xfs_inode_t		*orphanage_ip;
+	xfs_inode_t		*ips[ORPHAN_BATCH];
+	xfs_ino_t		inos[ORPHAN_BATCH];
+	xfs_ino_t		entry_ino_num;
+	xfs_trans_t		*tp;
+	xfs_fsblock_t		first;
+	xfs_bmap_free_t		flist;
+	ino_tree_node_t		*irec;
+	unsigned char		fname[MAXPATHLEN + 1];
+	struct xfs_name		xname;
+	struct orphan		*o;
+	int			ino_offset = 0;
+	int			committed;
+	int			isa_dir;
+	int			nres;
+	int			err;
+	int			i, j, n;
 
-			err = -libxfs_dir_createname(tp, orphanage_ip, &xname,
-						ino, &first, &flist, nres);
-			if (err)
-				do_error(
-	_("name create failed in %s (%d), filesystem may be out of space\n"),
-					ORPHANAGE, err);
+	if (!norphans)
+		return;
 
-			if (irec)
-				add_inode_ref(irec, ino_offset);
-			else
-				orphanage_ip->i_d.di_nlink++;
-			libxfs_trans_log_inode(tp, orphanage_ip, XFS_ILOG_CORE);
+	err = -libxfs_iget(mp, NULL, orphanage_ino, 0, &orphanage_ip, 0);
+	if (err)
+		do_error(_("%d - couldn't iget orphanage inode\n"), err);
 
-			/*
-			 * don't replace .. value if it already points
-			 * to us.  that'll pop a libxfs/kernel ASSERT.
-			 */
-			if (entry_ino_num != orphanage_ino)  {
-				err = -libxfs_dir_replace(tp, ino_p,
-						&xfs_name_dotdot, orphanage_ino,
-						&first, &flist, nres);
-				if (err)
-					do_error(
-	_("name replace op failed (%d), filesystem may be out of space\n"),
-						err);
+	/*
+	 * Make sure the filenames are unique in the lost+found.  One we
+	 * have just made only holds the names we give it, all different.
+	 */
+	for (o = orphans; o < &orphans[norphans]; o++) {
+		orphan_name(o, &xname, fname);
+		while (!orphanage_created &&
+		       libxfs_dir_lookup(NULL, orphanage_ip, &xname,
+					&entry_ino_num, NULL) == 0) {
+			o->incr++;
+			orphan_name(o, &xname, fname);
+		}
+		o->hash = mp->m_dirnameops->hashname(&xname);
+	}
+	qsort(orphans, norphans, sizeof(*orphans), orphan_cmp);
+
+	irec = find_inode_rec(mp, XFS_INO_TO_AGNO(mp, orphanage_ino),
+			XFS_INO_TO_AGINO(mp, orphanage_ino));
+	if (irec)
+		ino_offset = XFS_INO_TO_AGINO(mp, orphanage_ino) -
+				irec->ino_startnum;
+
+	/* a failure here is fatal, so nothing cancels a dirty transaction */
+	libxfs_trans_batch = 4;
+	for (i = 0; i < norphans; i += n) {
+		n = min(ORPHAN_BATCH, norphans - i);
+retry:
+		isa_dir = 0;
+		nres = 0;
+		for (j = 0; j < n; j++) {
+			o = &orphans[i + j];
+			orphan_name(o, &xname, fname);
+			nres += XFS_DIRENTER_SPACE_RES(mp, xname.len);
+			if (o->isa_dir) {
+				nres += XFS_DIRENTER_SPACE_RES(mp, 2);
+				isa_dir = 1;
 			}
-
-			err = -libxfs_bmap_finish(&tp, &flist, &committed);
-			if (err)
-				do_error(
-	_("bmap finish failed (%d), filesystem may be out of space\n"),
-					err);
-
-			libxfs_trans_commit(tp);
 		}
 
-	} else  {
 		/*
-		 * use the remove log reservation as that's
-		 * more accurate.  we're only creating the
-		 * links, we're not doing the inode allocation
-		 * also accounted for in the create
+		 * use the remove log reservation when there are no
+		 * directories as that's more accurate.  we're only creating
+		 * the links, we're not doing the inode allocation also
+		 * accounted for in the create
 		 */
-		nres = XFS_DIRENTER_SPACE_RES(mp, xname.len);
-		err = -libxfs_trans_reserve(tp, &M_RES(mp)->tr_remove,
-					   nres, 0);
+		tp = libxfs_trans_alloc(mp, 0);
+		err = -libxfs_trans_reserve(tp, isa_dir ?
+				&M_RES(mp)->tr_rename : &M_RES(mp)->tr_remove,
+				nres, 0);
+		if (err && n > 1) {
+			/* no room for a whole batch, go one at a time */
+			libxfs_trans_cancel(tp);
+			n = 1;
+			goto retry;
+		}
 		if (err)
 			do_error(
 	_("space reservation failed (%d), filesystem may be out of space\n"),
 				err);
 
-		libxfs_trans_ijoin(tp, orphanage_ip, 0);
-		libxfs_trans_ijoin(tp, ino_p, 0);
-
-		xfs_bmap_init(&flist, &first);
-		err = -libxfs_dir_createname(tp, orphanage_ip, &xname, ino,
-						&first, &flist, nres);
+		for (j = 0; j < n; j++)
+			inos[j] = orphans[i + j].ino;
+		err = -libxfs_iget_batch(mp, NULL, inos, n, ips);
 		if (err)
-			do_error(
-	_("name create failed in %s (%d), filesystem may be out of space\n"),
-				ORPHANAGE, err);
-		ASSERT(err == 0);
+			do_error(_("%d - couldn't iget disconnected inode\n"),
+				err);
 
-		ino_p->i_d.di_nlink = 1;
-		libxfs_trans_log_inode(tp, ino_p, XFS_ILOG_CORE);
+		libxfs_trans_ijoin(tp, orphanage_ip, 0);
+		xfs_bmap_init(&flist, &first);
+		for (j = 0; j < n; j++) {
+			libxfs_trans_ijoin(tp, ips[j], 0);
+			mv_orphanage(mp, tp, orphanage_ip, irec, ino_offset,
+					&orphans[i + j], ips[j], &first, &flist,
+					nres);
+		}
+		libxfs_trans_log_inode(tp, orphanage_ip, XFS_ILOG_CORE);
 
 		err = -libxfs_bmap_finish(&tp, &flist, &committed);
 		if (err)
@@ -1261,9 +1498,16 @@ mv_orphanage(
 				err);
 
 		libxfs_trans_commit(tp);
+		for (j = 0; j < n; j++)
+			IRELE(ips[j]);
 	}
-	IRELE(ino_p);
+	libxfs_trans_batch = 0;
+	libxfs_trans_batch_flush();
+
 	IRELE(orphanage_ip);
+	free(orphans);
+	orphans = NULL;
+	norphans = maxorphans = 0;
 }
 
 static int
@@ -1284,6 +1528,87 @@ entry_junked(
 	return !no_modify;
 }
 
+/* is this hash table entry one to put back in the rebuilt directory? */
+static int
+dir_hash_ent_rebuild(
+	dir_hash_ent_t		*p)
+{
+	if (p->name.name[0] == '/')
+		return 0;
+	return !(p->name.name[0] == '.' &&
+		 (p->name.len == 1 ||
+		  (p->name.len == 2 && p->name.name[1] == '.')));
+}
+
+/*
+ * Build the directory ip, emptied in the transaction *tpp, from the nents
+ * usable names in the hash table in one pass, with
+ * libxfs_dir2_node_bulkload, rather than adding a name at a time.  The
+ * transaction is rolled as the blocks are written and the last one is
+ * passed back for the caller to commit.
+ */
+static int
+longform_dir2_bulk_rebuild(
+	xfs_mount_t		*mp,
+	xfs_inode_t		*ip,
+	xfs_ino_t		parent,
+	dir_hash_tab_t		*hashtab,
+	int			nents,
+	xfs_trans_t		**tpp,
+	xfs_fsblock_t		*firstblock,
+	xfs_bmap_free_t		*flist)
+{
+	struct xfs_dir2_bulk_ent *ents;
+	struct xfs_da_args	args;
+	dir_hash_ent_t		*p;
+	int			error;
+	int			i;
+	int			n;
+
+	ents = malloc((nents + 2) * sizeof(*ents));
+	if (!ents)
+		do_error(_("malloc failed in %s (%zu bytes)\n"), __func__,
+			(nents + 2) * sizeof(*ents));
+
+	ents[0].name.name = (unsigned char *)".";
+	ents[0].name.len = 1;
+	ents[0].name.type = XFS_DIR3_FT_DIR;
+	ents[0].inumber = ip->i_ino;
+	ents[0].hashval = libxfs_da_hashname(ents[0].name.name, 1);
+	ents[1].name.name = (unsigned char *)"..";
+	ents[1].name.len = 2;
+	ents[1].name.type = XFS_DIR3_FT_DIR;
+	ents[1].inumber = parent;
+	ents[1].hashval = libxfs_da_hashname(ents[1].name.name, 2);
+	for (i = 0, n = 2, p = hashtab->ents; i < hashtab->nents; i++, p++) {
+		/* duplicate names are junked too */
+		if (p->junkit || !dir_hash_ent_rebuild(p))
+			continue;
+		ents[n].name = p->name;
+		ents[n].inumber = p->inum;
+		ents[n].hashval = p->hashval;
+		n++;
+	}
+	ASSERT(n == nents + 2);
+
+	ip->i_d.di_size = 0;
+	libxfs_trans_log_inode(*tpp, ip, XFS_ILOG_CORE);
+
+	memset(&args, 0, sizeof(args));
+	args.geo = mp->m_dir_geo;
+	args.dp = ip;
+	args.trans = *tpp;
+	args.firstblock = firstblock;
+	args.flist = flist;
+	args.total = XFS_DAENTER_SPACE_RES(mp, XFS_DATA_FORK);
+	args.whichfork = XFS_DATA_FORK;
+	args.op_flags = XFS_DA_OP_ADDNAME | XFS_DA_OP_OKNOENT;
+	error = -libxfs_dir2_node_bulkload(&args, ents, n);
+	*tpp = args.trans;
+	free(ents);
+	return error;
+}
+
 /*
  * Unexpected failure during the rebuild will leave the entries in
  * lost+found on the next run
@@ -1308,6 +1633,8 @@ longform_dir2_rebuild(
 	dir_hash_ent_t		*p;
 	int			committed;
 	int			done;
+	int			nbulk;
+	int			i;
 
 	/*
 	 * trash directory completely and rebuild from scratch using the
@@ -1316,17 +1643,31 @@ longform_dir2_rebuild(
 
 	do_warn(_("rebuilding directory inode %" PRIu64 "\n"), ino);
 
+	/*
+	 * Directories that will need more than one leaf block are built
+	 * in one go; adding their names one at a time gets slower with
+	 * every block.
+	 */
+	for (i = 0, nbulk = 0, p = hashtab->ents; i < hashtab->nents; i++, p++)
+		if (!p->junkit && dir_hash_ent_rebuild(p))
+			nbulk++;
+	if (nbulk + 2 <= M_DIROPS(mp)->leaf_max_ents(mp->m_dir_geo))
+		nbulk = 0;
+
 	/*
 	 * first attempt to locate the parent inode, if it can't be
 	 * found, set it to the root inode and it'll be moved to the
 	 * orphanage later (the inode number here needs to be valid
 	 * for the libxfs_dir_init() call).
 	 */
+	lock_inode_rec(mp, ino);
 	pip.i_ino = get_inode_parent(irec, ino_offset);
+	unlock_inode_rec(mp, ino);
 	if (pip.i_ino == NULLFSINO ||
 	    xfs_dir_ino_validate(mp, pip.i_ino))
 		pip.i_ino = mp->m_sb.sb_rootino;
 
+	pthread_mutex_lock(&alloc_lock);
 	xfs_bmap_init(&flist, &firstblock);
 
 	tp = libxfs_trans_alloc(mp, 0);
@@ -1350,6 +1691,29 @@ longform_dir2_rebuild(
 
 	ASSERT(done);
 
+	if (nbulk) {
+		error = longform_dir2_bulk_rebuild(mp, ip, pip.i_ino, hashtab,
+				nbulk, &tp, &firstblock, &flist);
+		if (error) {
+			do_warn(
+_("directory rebuild failed in ino %" PRIu64 " (%d), filesystem may be out of space\n"),
+				ino, error);
+			goto out_bmap_cancel;
+		}
+		error = -libxfs_bmap_finish(&tp, &flist, &committed);
+		if (error) {
+			do_warn(
+	_("bmap finish failed (%d), filesystem may be out of space\n"),
+				error);
+			goto out_bmap_cancel;
+		}
+		libxfs_trans_commit(tp);
+		if (ino == mp->m_sb.sb_rootino)
+			need_root_dotdot = 0;
+		pthread_mutex_unlock(&alloc_lock);
+		return;
+	}
+
 	error = libxfs_dir_init(tp, ip, &pip);
 	if (error) {
 		do_warn(_("xfs_dir_init failed -- error - %d\n"), error);
@@ -1365,11 +1729,9 @@ longform_dir2_rebuild(
 
 	/* go through the hash list and re-add the inodes */
 
-	for (p = hashtab->first; p; p = p->nextbyorder) {
+	for (i = 0, p = hashtab->ents; i < hashtab->nents; i++, p++) {
 
-		if (p->name.name[0] == '/' || (p->name.name[0] == '.' &&
-				(p->name.len == 1 || (p->name.len == 2 &&
-						p->name.name[1] == '.'))))
+		if (!dir_hash_ent_rebuild(p))
 			continue;
 
 		tp = libxfs_trans_alloc(mp, 0);
@@ -1402,11 +1764,13 @@ _("name create failed in ino %" PRIu64 " (%d), filesystem may be out of space\n"
 		libxfs_trans_commit(tp);
 	}
 
+	pthread_mutex_unlock(&alloc_lock);
 	return;
 
 out_bmap_cancel:
 	libxfs_bmap_cancel(&flist);
 	libxfs_trans_cancel(tp);
+	pthread_mutex_unlock(&alloc_lock);
 	return;
 }
 
@@ -1430,6 +1794,7 @@ dir2_kill_block(
 	int		nres;
 	xfs_trans_t	*tp;
 
+	pthread_mutex_lock(&alloc_lock);
 	tp = libxfs_trans_alloc(mp, 0);
 	nres = XFS_REMOVE_SPACE_RES(mp);
 	error = -libxfs_trans_reserve(tp, &M_RES(mp)->tr_remove, nres, 0);
@@ -1455,6 +1820,7 @@ dir2_kill_block(
 			ip->i_ino, da_bno);
 	libxfs_bmap_finish(&tp, &flist, &committed);
 	libxfs_trans_commit(tp);
+	pthread_mutex_unlock(&alloc_lock);
 }
 
 /*
@@ -1498,9 +1864,12 @@ longform_dir2_entry_check_data(
 	int			junkit;
 	int			lastfree;
 	int			len;
+	int			linked;
 	int			nbad;
 	int			needlog;
 	int			needscan;
+	int			nents;
+	int			ent;
 	xfs_ino_t		parent;
 	char			*ptr;
 	xfs_trans_t		*tp;
@@ -1553,7 +1922,8 @@ longform_dir2_entry_check_data(
 		freetab->naents = db + 1;
 	}
 
-	/* check the data block */
+	/* check the data block, gathering the names to hash them together */
+	nents = 0;
 	while (ptr < endptr) {
 
 		/* check for freespace */
@@ -1593,6 +1963,9 @@ longform_dir2_entry_check_data(
 		if (be16_to_cpu(*M_DIROPS(mp)->data_entry_tag_p(dep)) !=
 						(char *)dep - (char *)d)
 			break;
+		hashtab->blk_names[nents].name = dep->name;
+		hashtab->blk_names[nents].len = dep->namelen;
+		nents++;
 		ptr += M_DIROPS(mp)->data_entsize(dep->namelen);
 	}
 
@@ -1623,6 +1996,8 @@ longform_dir2_entry_check_data(
 	if (freetab->nents < db + 1)
 		freetab->nents = db + 1;
 
+	libxfs_dir_hashnames(mp, hashtab->blk_names, hashtab->blk_hashes, nents);
+
 	tp = libxfs_trans_alloc(mp, 0);
 	error = -libxfs_trans_reserve(tp, &M_RES(mp)->tr_remove, 0, 0);
 	if (error)
@@ -1644,6 +2019,7 @@ longform_dir2_entry_check_data(
 			do_warn(_("would fix magic # to %#x\n"), wantmagic);
 	}
 	lastfree = 0;
+	ent = 0;
 	ptr = (char *)M_DIROPS(mp)->data_entry_p(d);
 	/*
 	 * look at each entry.  reference inode pointed to by each
@@ -1687,6 +2063,7 @@ longform_dir2_entry_check_data(
 		ptr += M_DIROPS(mp)->data_entsize(dep->namelen);
 		inum = be64_to_cpu(dep->inumber);
 		lastfree = 0;
+		ent++;
 		/*
 		 * skip bogus entries (leading '/').  they'll be deleted
 		 * later.  must still log it, else we leak references to
@@ -1762,7 +2139,8 @@ longform_dir2_entry_check_data(
 		 * check for duplicate names in directory.
 		 */
 		if (!dir_hash_add(mp, hashtab, addr, inum, dep->namelen,
-				dep->name, M_DIROPS(mp)->data_get_ftype(dep))) {
+				dep->name, M_DIROPS(mp)->data_get_ftype(dep),
+				hashtab->blk_hashes[ent - 1])) {
 			nbad++;
 			if (entry_junked(
 	_("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
@@ -1816,7 +2194,8 @@ longform_dir2_entry_check_data(
 		 */
 		if (ip->i_ino == inum)  {
 			ASSERT(dep->name[0] == '.' && dep->namelen == 1);
-			add_inode_ref(current_irec, current_ino_offset);
+			add_inode_ref_locked(mp, ip->i_ino, current_irec,
+					current_ino_offset);
 			if (da_bno != 0 ||
 			    dep != M_DIROPS(mp)->data_entry_p(d)) {
 				/* "." should be the first entry */
@@ -1870,12 +2249,16 @@ longform_dir2_entry_check_data(
 		 * the link count and continue
 		 */
 		if (!inode_isadir(irec, ino_offset))  {
+			lock_inode_rec(mp, inum);
 			add_inode_reached(irec, ino_offset);
+			unlock_inode_rec(mp, inum);
 			continue;
 		}
+		lock_inode_rec(mp, inum);
 		parent = get_inode_parent(irec, ino_offset);
 		ASSERT(parent != 0);
 		junkit = 0;
+		linked = 0;
 		/*
 		 * bump up the link counts in parent and child
 		 * directory but if the link doesn't agree with
@@ -1890,7 +2273,7 @@ _("entry \"%s\" in dir %" PRIu64" points to an already connected directory inode
 				fname, ip->i_ino, inum);
 		} else if (parent == ip->i_ino)  {
 			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			linked = 1;
 		} else if (parent == NULLFSINO) {
 			/* ".." was missing, but this entry refers to it,
 			   so, set it as the parent and mark for rebuild */
@@ -1899,7 +2282,7 @@ _("entry \"%s\" in dir %" PRIu64" points to an already connected directory inode
 				fname, ip->i_ino, inum);
 			set_inode_parent(irec, ino_offset, ip->i_ino);
 			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			linked = 1;
 			add_dotdot_update(XFS_INO_TO_AGNO(mp, inum), irec,
 								ino_offset);
 		} else  {
@@ -1908,6 +2291,10 @@ _("entry \"%s\" in dir %" PRIu64" points to an already connected directory inode
 _("entry \"%s\" in dir inode %" PRIu64 " inconsistent with .. value (%" PRIu64 ") in ino %" PRIu64 "\n"),
 				fname, ip->i_ino, parent, inum);
 		}
+		unlock_inode_rec(mp, inum);
+		if (linked)
+			add_inode_ref_locked(mp, ip->i_ino, current_irec,
+					current_ino_offset);
 		if (junkit)  {
 			if (inum == orphanage_ino)
 				orphanage_ino = 0;
@@ -2507,6 +2894,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	struct xfs_dir2_sf_entry *next_sfep;
 	struct xfs_ifork	*ifp;
 	struct ino_tree_node	*irec;
+	struct xfs_name		xname;
 	int			max_size;
 	int			ino_offset;
 	int			i;
@@ -2528,7 +2916,9 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 * if just rebuild a directory due to a "..", update and return
 	 */
 	if (dotdot_update) {
+		lock_inode_rec(mp, ino);
 		parent = get_inode_parent(current_irec, current_ino_offset);
+		unlock_inode_rec(mp, ino);
 		if (no_modify) {
 			do_warn(
 	_("would set .. in sf dir inode %" PRIu64 " to %" PRIu64 "\n"),
@@ -2549,7 +2939,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 * the directory is reached or will be taken care of when the
 	 * directory is moved to orphanage.
 	 */
-	add_inode_ref(current_irec, current_ino_offset);
+	add_inode_ref_locked(mp, ino, current_irec, current_ino_offset);
 
 	/*
 	 * Initialise i8 counter -- the parent inode number counts as well.
@@ -2685,10 +3075,13 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 		/*
 		 * check for duplicate names in directory.
 		 */
+		xname.name = sfep->name;
+		xname.len = sfep->namelen;
 		if (!dir_hash_add(mp, hashtab, (xfs_dir2_dataptr_t)
 				(sfep - xfs_dir2_sf_firstentry(sfp)),
 				lino, sfep->namelen, sfep->name,
-				M_DIROPS(mp)->sf_get_ftype(sfep))) {
+				M_DIROPS(mp)->sf_get_ftype(sfep),
+				mp->m_dirnameops->hashname(&xname))) {
 			do_warn(
 _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 				fname, lino, ino);
@@ -2703,8 +3096,11 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 			 * check easy case first, regular inode, just bump
 			 * the link count
 			 */
+			lock_inode_rec(mp, lino);
 			add_inode_reached(irec, ino_offset);
+			unlock_inode_rec(mp, lino);
 		} else  {
+			lock_inode_rec(mp, lino);
 			parent = get_inode_parent(irec, ino_offset);
 
 			/*
@@ -2713,6 +3109,7 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 			 * the .. in the child, blow out the entry
 			 */
 			if (is_inode_reached(irec, ino_offset))  {
+				unlock_inode_rec(mp, lino);
 				do_warn(
 	_("entry \"%s\" in directory inode %" PRIu64
 	  " references already connected inode %" PRIu64 ".\n"),
@@ -2723,7 +3120,9 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 				continue;
 			} else if (parent == ino)  {
 				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				unlock_inode_rec(mp, lino);
+				add_inode_ref_locked(mp, ino, current_irec,
+						current_ino_offset);
 			} else if (parent == NULLFSINO) {
 				/* ".." was missing, but this entry refers to it,
 				so, set it as the parent and mark for rebuild */
@@ -2732,10 +3131,13 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 					fname, ino, lino);
 				set_inode_parent(irec, ino_offset, ino);
 				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				unlock_inode_rec(mp, lino);
+				add_inode_ref_locked(mp, ino, current_irec,
+						current_ino_offset);
 				add_dotdot_update(XFS_INO_TO_AGNO(mp, lino),
 							irec, ino_offset);
 			} else  {
+				unlock_inode_rec(mp, lino);
 				do_warn(
 	_("entry \"%s\" in directory inode %" PRIu64
 	  " not consistent with .. value (%" PRIu64
@@ -2881,8 +3283,10 @@ process_dir_inode(
 			 * as being disconnected in the no_modify case.
 			 */
 			if (mp->m_sb.sb_rootino == ino)  {
+				lock_inode_rec(mp, ino);
 				add_inode_reached(irec, 0);
 				add_inode_ref(irec, 0);
+				unlock_inode_rec(mp, ino);
 			}
 		}
 
@@ -2901,7 +3305,9 @@ process_dir_inode(
 		 * that root's '..' is always good --
 		 * guaranteed by phase 3 and/or below.
 		 */
+		lock_inode_rec(mp, ino);
 		add_inode_reached(irec, ino_offset);
+		unlock_inode_rec(mp, ino);
 	}
 
 	add_inode_refchecked(irec, ino_offset);
@@ -2976,6 +3382,7 @@ process_dir_inode(
 
 		do_warn(_("recreating root directory .. entry\n"));
 
+		pthread_mutex_lock(&alloc_lock);
 		tp = libxfs_trans_alloc(mp, 0);
 		ASSERT(tp != NULL);
 
@@ -2999,6 +3406,7 @@ process_dir_inode(
 		error = -libxfs_bmap_finish(&tp, &flist, &committed);
 		ASSERT(error == 0);
 		libxfs_trans_commit(tp);
+		pthread_mutex_unlock(&alloc_lock);
 
 		need_root_dotdot = 0;
 	} else if (need_root_dotdot && ino == mp->m_sb.sb_rootino)  {
@@ -3022,7 +3430,7 @@ process_dir_inode(
 		 * it turns out to be wrong, we'll catch
 		 * that in phase 7.
 		 */
-		add_inode_ref(irec, ino_offset);
+		add_inode_ref_locked(mp, ino, irec, ino_offset);
 
 		if (no_modify)  {
 			do_warn(
@@ -3035,6 +3443,7 @@ process_dir_inode(
 			do_warn(
 	_("creating missing \".\" entry in dir ino %" PRIu64 "\n"), ino);
 
+			pthread_mutex_lock(&alloc_lock);
 			tp = libxfs_trans_alloc(mp, 0);
 			ASSERT(tp != NULL);
 
@@ -3060,6 +3469,7 @@ process_dir_inode(
 			error = -libxfs_bmap_finish(&tp, &flist, &committed);
 			ASSERT(error == 0);
 			libxfs_trans_commit(tp);
+			pthread_mutex_unlock(&alloc_lock);
 		}
 	}
 	IRELE(ip);
@@ -3155,7 +3565,7 @@ check_for_orphaned_inodes(
 			if (!orphanage_ino)
 				orphanage_ino = mk_orphanage(mp);
 			do_warn(_("moving to %s\n"), ORPHANAGE);
-			mv_orphanage(mp, ino, inode_isadir(irec, i));
+			queue_orphan(ino, inode_isadir(irec, i));
 		} else  {
 			do_warn(_("would move to %s\n"), ORPHANAGE);
 		}
@@ -3229,7 +3639,7 @@ static void
 traverse_ags(
 	struct xfs_mount	*mp)
 {
-	do_inode_prefetch(mp, 0, traverse_function, false, true);
+	do_inode_prefetch(mp, ag_stride, traverse_function, false, true);
 }
 
 void
@@ -3241,6 +3651,7 @@ phase6(xfs_mount_t *mp)
 	memset(&zerocr, 0, sizeof(struct cred));
 	memset(&zerofsx, 0, sizeof(struct fsxattr));
 	orphanage_ino = 0;
+	orphanage_created = 0;
 
 	do_log(_("Phase 6 - check inode connectivity...\n"));
 
@@ -3301,6 +3712,9 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 
 	mark_standalone_inodes(mp);
 
+	/* the root and realtime inodes may have brought new records */
+	build_inode_index(mp);
+
 	do_log(_("        - traversing filesystem ...\n"));
 
 	irec = find_inode_rec(mp, XFS_INO_TO_AGNO(mp, mp->m_sb.sb_rootino),
@@ -3338,4 +3752,5 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 			irec = next_ino_rec(irec);
 		}
 	}
+	mv_orphans(mp);
 }
@@ -25,6 +25,7 @@
 #include "err_protos.h"
 #include "dinode.h"
 #include "versions.h"
+#include "threads.h"
 #include "progress.h"
 
 /* dinoc is a pointer to the IN-CORE dinode core */
@@ -52,25 +53,76 @@ _("would have reset inode %" PRIu64 " nlinks from %u to %u\n"),
 	}
 }
 
+/*
+ * Inode link count fixes are batched per inode cluster, so all the
+ * mismatched inodes that live in the same cluster buffer are logged and
+ * committed in a single transaction.
+ */
+struct nlink_batch {
+	xfs_trans_t		*tp;
+	int			dirty;
+	int			nr;
+	xfs_inode_t		*ips[XFS_INODES_PER_CHUNK];
+};
+
+static void
+nlink_batch_start(
+	xfs_mount_t		*mp,
+	struct nlink_batch	*nb)
+{
+	int			error;
+	int			nres;
+
+	nb->tp = libxfs_trans_alloc(mp, XFS_TRANS_REMOVE);
+	nb->dirty = 0;
+	nb->nr = 0;
+
+	nres = no_modify ? 0 : 10;
+	error = -libxfs_trans_reserve(nb->tp, &M_RES(mp)->tr_remove, nres, 0);
+	ASSERT(error == 0);
+}
+
+static void
+nlink_batch_finish(
+	struct nlink_batch	*nb)
+{
+	int			error;
+	int			i;
+
+	if (nb->tp == NULL)
+		return;
+
+	if (!nb->dirty)  {
+		libxfs_trans_cancel(nb->tp);
+	} else  {
+		/*
+		 * no need to do a bmap finish since
+		 * we're not allocating anything
+		 */
+		error = -libxfs_trans_commit(nb->tp);
+
+		ASSERT(error == 0);
+	}
+	for (i = 0; i < nb->nr; i++)
+		IRELE(nb->ips[i]);
+	nb->tp = NULL;
+	nb->nr = 0;
+}
+
 static void
 update_inode_nlinks(
 	xfs_mount_t 		*mp,
+	struct nlink_batch	*nb,
 	xfs_ino_t		ino,
 	__uint32_t		nlinks)
 {
-	xfs_trans_t		*tp;
 	xfs_inode_t		*ip;
 	int			error;
 	int			dirty;
-	int			nres;
 
-	tp = libxfs_trans_alloc(mp, XFS_TRANS_REMOVE);
-
-	nres = no_modify ? 0 : 10;
-	error = -libxfs_trans_reserve(tp, &M_RES(mp)->tr_remove, nres, 0);
-	ASSERT(error == 0);
+	ASSERT(nb->nr < XFS_INODES_PER_CHUNK);
 
-	error = -libxfs_trans_iget(mp, tp, ino, 0, 0, &ip);
+	error = -libxfs_trans_iget(mp, nb->tp, ino, 0, 0, &ip);
 
 	if (error)  {
 		if (!no_modify)
@@ -84,6 +136,7 @@ update_inode_nlinks(
 			return;
 		}
 	}
+	nb->ips[nb->nr++] = ip;
 
 	dirty = 0;
 
@@ -92,61 +145,142 @@ update_inode_nlinks(
 	 */
 	set_nlinks(&ip->i_d, ino, nlinks, &dirty);
 
-	if (!dirty)  {
-		libxfs_trans_cancel(tp);
-	} else  {
-		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
-		/*
-		 * no need to do a bmap finish since
-		 * we're not allocating anything
-		 */
-		ASSERT(error == 0);
-		error = -libxfs_trans_commit(tp);
-
-		ASSERT(error == 0);
+	if (dirty)  {
+		libxfs_trans_log_inode(nb->tp, ip, XFS_ILOG_CORE);
+		nb->dirty = 1;
 	}
-	IRELE(ip);
 }
 
-void
-phase7(xfs_mount_t *mp)
+/*
+ * AGs with more inode records than this are split into ranges of this many
+ * records, so that a few large AGs don't leave the other workers idle.
+ */
+#define NLINK_RANGE_RECS	256
+
+struct nlink_range {
+	ino_tree_node_t		*first;
+	int			nr;
+};
+
+/*
+ * Each inode record is only touched by the worker checking the range it is
+ * in, so the ranges can be checked in parallel.
+ */
+static void
+check_nlink_range(
+	xfs_mount_t		*mp,
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		*irec,
+	int			nr)
 {
-	ino_tree_node_t		*irec;
-	int			i;
+	struct nlink_batch	nb;
+	int			inodes_per_cluster;
 	int			j;
 	__uint32_t		nrefs;
 
-	if (!no_modify)
-		do_log(_("Phase 7 - verify and correct link counts...\n"));
-	else
-		do_log(_("Phase 7 - verify link counts...\n"));
+	inodes_per_cluster = MAX(mp->m_inode_cluster_size >>
+				 mp->m_sb.sb_inodelog, 1);
+	inodes_per_cluster = MIN(inodes_per_cluster, XFS_INODES_PER_CHUNK);
 
-	/*
-	 * for each ag, look at each inode 1 at a time. If the number of
-	 * links is bad, reset it, log the inode core, commit the transaction
-	 */
-	for (i = 0; i < glob_agcount; i++)  {
-		irec = findfirst_inode_rec(i);
+	nb.tp = NULL;
+	nb.nr = 0;
+
+	for (; irec != NULL && nr > 0; irec = next_ino_rec(irec), nr--)  {
+		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
+			ASSERT(is_inode_confirmed(irec, j));
 
-		while (irec != NULL)  {
-			for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
-				ASSERT(is_inode_confirmed(irec, j));
+			/* a new cluster starts a new transaction */
+			if (j % inodes_per_cluster == 0)
+				nlink_batch_finish(&nb);
 
-				if (is_inode_free(irec, j))
-					continue;
+			if (is_inode_free(irec, j))
+				continue;
 
-				ASSERT(no_modify || is_inode_reached(irec, j));
+			ASSERT(no_modify || is_inode_reached(irec, j));
 
-				nrefs = num_inode_references(irec, j);
-				ASSERT(no_modify || nrefs > 0);
+			nrefs = num_inode_references(irec, j);
+			ASSERT(no_modify || nrefs > 0);
 
-				if (get_inode_disk_nlinks(irec, j) != nrefs)
-					update_inode_nlinks(mp,
-						XFS_AGINO_TO_INO(mp, i,
-							irec->ino_startnum + j),
-						nrefs);
+			if (get_inode_disk_nlinks(irec, j) != nrefs)  {
+				if (nb.tp == NULL)
+					nlink_batch_start(mp, &nb);
+				update_inode_nlinks(mp, &nb,
+					XFS_AGINO_TO_INO(mp, agno,
+						irec->ino_startnum + j),
+					nrefs);
 			}
-			irec = next_ino_rec(irec);
 		}
+		nlink_batch_finish(&nb);
+	}
+}
+
+static void
+phase7_range_func(
+	work_queue_t		*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct nlink_range	*range = arg;
+
+	check_nlink_range(wq->mp, agno, range->first, range->nr);
+	free(range);
+}
+
+static void
+phase7_func(
+	work_queue_t		*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	ino_tree_node_t		*first;
+	ino_tree_node_t		*irec;
+	struct nlink_range	*range;
+	int			nr;
+
+	/*
+	 * Check the first range ourselves and queue the rest, which
+	 * idle workers will steal from us.
+	 */
+	first = findfirst_inode_rec(agno);
+	for (irec = first, nr = 0; irec && nr < NLINK_RANGE_RECS; nr++)
+		irec = next_ino_rec(irec);
+
+	while (irec != NULL)  {
+		range = malloc(sizeof(struct nlink_range));
+		if (!range)
+			do_error(_("couldn't allocate link count range\n"));
+		range->first = irec;
+		for (range->nr = 0; irec && range->nr < NLINK_RANGE_RECS;
+		     range->nr++)
+			irec = next_ino_rec(irec);
+		queue_work(wq, phase7_range_func, agno, range);
 	}
+
+	check_nlink_range(wq->mp, agno, first, nr);
+}
+
+void
+phase7(xfs_mount_t *mp)
+{
+	work_queue_t		wq;
+	xfs_agnumber_t		agno;
+
+	if (!no_modify)
+		do_log(_("Phase 7 - verify and correct link counts...\n"));
+	else
+		do_log(_("Phase 7 - verify link counts...\n"));
+
+	/* lost+found may have brought a new record in phase 6 */
+	build_inode_index(mp);
+
+	/*
+	 * for each ag, look at each inode 1 at a time. If the number of
+	 * links is bad, reset it and log the inode core. Fixes to inodes
+	 * in the same cluster are committed in one transaction.  As many
+	 * AGs go at once as in phase 4.
+	 */
+	create_work_queue(&wq, mp, thread_count);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		queue_work(&wq, phase7_func, agno, NULL);
+	destroy_work_queue(&wq);
 }
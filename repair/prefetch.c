@@ -14,8 +14,14 @@
 #include "threads.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "metrics.h"
+#include "mem.h"
+#include "xfs_probe.h"
 
 int do_prefetch = 1;
+int pf_adaptive;
+int pf_verify;
+int pf_io_threads = PF_THREAD_COUNT;
 
 /*
  * Performs prefetching by priming the libxfs cache by using a dedicate thread
@@ -31,6 +37,7 @@ static int		pf_max_bbs;
 static int		pf_max_fsbs;
 static int		pf_batch_bytes;
 static int		pf_batch_fsbs;
+static int		pf_read_limit;
 
 static void		pf_read_inode_dirs(prefetch_args_t *, xfs_buf_t *);
 
@@ -49,7 +56,7 @@ static void		pf_read_inode_dirs(prefetch_args_t *, xfs_buf_t *);
 #define B_DIR_META_H	CACHE_PREFETCH_PRIORITY + 5
 /* single block of directory metadata (can't batch read) */
 #define B_DIR_META_S	CACHE_PREFETCH_PRIORITY + 4
-/* dir metadata with more than one block fetched in a single I/O */
+/* dir (and attr) metadata with more than one block fetched in a single I/O */
 #define B_DIR_META	CACHE_PREFETCH_PRIORITY + 3
 /* inode clusters with directory inodes */
 #define B_DIR_INODE	CACHE_PREFETCH_PRIORITY + 2
@@ -70,6 +77,55 @@ static void		pf_read_inode_dirs(prefetch_args_t *, xfs_buf_t *);
 
 #define IO_THRESHOLD	(MAX_BUFS * 2)
 
+/*
+ * Adaptive prefetch tuning.
+ *
+ * The latency of every prefetch read is sampled and fitted to a linear model
+ * of per-request overhead plus transfer time.  Reading a gap between two
+ * wanted buffers is worthwhile as long as transferring it is cheaper than the
+ * overhead of a separate request, so the merge gap is set to the number of
+ * bytes the device transfers in one request overhead: devices with no seek
+ * cost (SSDs) stop merging across gaps, devices with a high cost (rotational
+ * disks and RAID) merge across larger ones and issue bigger reads.  The
+ * number of I/O threads per AG is hill climbed on the bandwidth achieved
+ * while the device is busy, which is reevaluated each time an AG starts.
+ */
+#define PF_READ_LIMIT_SHIFT	3	/* reads up to 8x the default size */
+#define PF_TUNE_INTERVAL	64	/* reads between retuning */
+#define PF_TUNE_MIN_BUSY	100000000ULL	/* 100ms busy per depth trial */
+
+static struct pf_tune {
+	pthread_mutex_t	lock;
+	int		max_bytes;	/* largest single read */
+	int		batch_bytes;	/* largest gap merged into a read */
+	int		depth;		/* I/O threads per AG */
+	int		step;		/* current depth search direction */
+	__uint64_t	last_bw;	/* bandwidth at previous depth */
+
+	/* least squares fit of latency (ns) against read size (bytes) */
+	int		nr;
+	double		sx;
+	double		sy;
+	double		sxx;
+	double		sxy;
+
+	/* device busy time accounting */
+	int		inflight;
+	__uint64_t	busy_start;
+	__uint64_t	busy_ns;
+	__uint64_t	busy_bytes;
+
+	/* totals for the report */
+	__uint64_t	reads;
+	__uint64_t	bytes;
+	__uint64_t	lat_ns;
+	__uint64_t	lat_nr;
+	__uint64_t	total_busy_ns;
+} pf_tune = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.step		= 1,
+};
+
 typedef enum pf_which {
 	PF_PRIMARY,
 	PF_SECONDARY,
@@ -102,6 +158,199 @@ pf_start_io_workers(
 }
 
 
+static __uint64_t
+pf_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Return the current read size limit and merge gap.
+ */
+static void
+pf_get_tunables(
+	int			*max_bytes,
+	int			*batch_bytes)
+{
+	if (!pf_adaptive) {
+		*max_bytes = pf_max_bytes;
+		*batch_bytes = pf_batch_bytes;
+		return;
+	}
+	pthread_mutex_lock(&pf_tune.lock);
+	*max_bytes = pf_tune.max_bytes;
+	*batch_bytes = pf_tune.batch_bytes;
+	pthread_mutex_unlock(&pf_tune.lock);
+}
+
+/*
+ * Recalculate the merge gap and read size from the sampled latencies.
+ * Must be called with pf_tune.lock held.
+ */
+static void
+pf_retune(void)
+{
+	double			n = pf_tune.nr;
+	double			denom;
+	double			slope;
+	double			overhead;
+	__int64_t		gap;
+	__int64_t		max;
+
+	denom = n * pf_tune.sxx - pf_tune.sx * pf_tune.sx;
+	slope = 0;
+	if (denom > 0)
+		slope = (n * pf_tune.sxy - pf_tune.sx * pf_tune.sy) / denom;
+
+	pf_tune.nr = 0;
+	pf_tune.sx = pf_tune.sy = pf_tune.sxx = pf_tune.sxy = 0;
+
+	/* not enough spread in the read sizes to tell anything */
+	if (slope <= 0)
+		return;
+
+	overhead = (pf_tune.sy - slope * pf_tune.sx) / n;
+	gap = overhead > 0 ? overhead / slope : 0;
+	gap = MAX(gap, mp->m_sb.sb_blocksize);
+	gap = MIN(gap, pf_read_limit / 4);
+
+	max = MAX(gap * 8, pf_max_bytes);
+	max = MIN(max, pf_read_limit);
+
+	/* move half way to the new targets to damp oscillation */
+	pf_tune.batch_bytes = (pf_tune.batch_bytes + gap) / 2;
+	pf_tune.max_bytes = (pf_tune.max_bytes + max) / 2;
+	pf_tune.max_bytes = roundup(pf_tune.max_bytes, mp->m_sb.sb_blocksize);
+}
+
+static __uint64_t
+pf_io_start(void)
+{
+	__uint64_t		now;
+
+	if (!pf_adaptive)
+		return 0;
+
+	now = pf_now();
+	pthread_mutex_lock(&pf_tune.lock);
+	if (pf_tune.inflight++ == 0)
+		pf_tune.busy_start = now;
+	pthread_mutex_unlock(&pf_tune.lock);
+	return now;
+}
+
+/*
+ * Account a completed read of @bytes started at @start.  Only single reads
+ * are used as latency samples, reads issued as a queued list complete out of
+ * order and only count towards the bandwidth.
+ */
+static void
+pf_io_done(
+	__uint64_t		start,
+	int			bytes,
+	int			sample)
+{
+	__uint64_t		now;
+	double			lat;
+
+	if (!pf_adaptive)
+		return;
+
+	now = pf_now();
+	lat = now - start;
+
+	pthread_mutex_lock(&pf_tune.lock);
+	if (--pf_tune.inflight == 0) {
+		pf_tune.busy_ns += now - pf_tune.busy_start;
+		pf_tune.total_busy_ns += now - pf_tune.busy_start;
+	}
+	pf_tune.busy_bytes += bytes;
+	pf_tune.reads++;
+	pf_tune.bytes += bytes;
+
+	if (sample && bytes > 0) {
+		pf_tune.lat_ns += lat;
+		pf_tune.lat_nr++;
+		pf_tune.nr++;
+		pf_tune.sx += bytes;
+		pf_tune.sy += lat;
+		pf_tune.sxx += (double)bytes * bytes;
+		pf_tune.sxy += (double)bytes * lat;
+		if (pf_tune.nr >= PF_TUNE_INTERVAL)
+			pf_retune();
+	}
+	pthread_mutex_unlock(&pf_tune.lock);
+}
+
+/*
+ * Pick the number of I/O threads for the next AG.  Once enough busy time
+ * has been seen at the current depth, compare the bandwidth with the last
+ * depth tried and keep moving in the direction that improved it.
+ */
+static int
+pf_io_depth(void)
+{
+	__uint64_t		bw;
+	int			depth;
+
+	if (!pf_adaptive)
+		return pf_io_threads;
+
+	pthread_mutex_lock(&pf_tune.lock);
+	if (pf_tune.busy_ns >= PF_TUNE_MIN_BUSY) {
+		bw = pf_tune.busy_bytes * 1000000000ULL / pf_tune.busy_ns;
+		if (pf_tune.last_bw && bw < pf_tune.last_bw)
+			pf_tune.step = -pf_tune.step;
+		pf_tune.last_bw = bw;
+		pf_tune.depth += pf_tune.step;
+		if (pf_tune.depth < 1) {
+			pf_tune.depth = 1;
+			pf_tune.step = 1;
+		} else if (pf_tune.depth > PF_THREAD_MAX) {
+			pf_tune.depth = PF_THREAD_MAX;
+			pf_tune.step = -1;
+		}
+		pf_tune.busy_ns = 0;
+		pf_tune.busy_bytes = 0;
+	}
+	depth = pf_tune.depth;
+	pthread_mutex_unlock(&pf_tune.lock);
+	return depth;
+}
+
+/*
+ * Report what adaptive prefetch measured during this phase and settled on.
+ */
+static void
+pf_report(void)
+{
+	__uint64_t		samples;
+	__uint64_t		bw = 0;
+
+	pthread_mutex_lock(&pf_tune.lock);
+	samples = pf_tune.lat_nr ? pf_tune.lat_nr : 1;
+	if (pf_tune.total_busy_ns)
+		bw = (pf_tune.bytes >> 10) * 1000000000ULL /
+			pf_tune.total_busy_ns;
+	do_log(_("        - prefetch: %" PRIu64 " reads, %" PRIu64 " KiB, "
+		 "avg latency %" PRIu64 " us, %" PRIu64 " KiB/s\n"),
+		pf_tune.reads, pf_tune.bytes >> 10,
+		pf_tune.lat_ns / samples / 1000, bw);
+	do_log(_("        - prefetch: %d I/O threads, max read %d KiB, "
+		 "merge gap %d KiB\n"),
+		pf_tune.depth, pf_tune.max_bytes >> 10,
+		pf_tune.batch_bytes >> 10);
+
+	pf_tune.reads = pf_tune.bytes = 0;
+	pf_tune.lat_ns = pf_tune.lat_nr = 0;
+	pf_tune.total_busy_ns = 0;
+	pthread_mutex_unlock(&pf_tune.lock);
+}
+
+
 static void
 pf_queue_io(
 	prefetch_args_t		*args,
@@ -135,6 +384,8 @@ pf_queue_io(
 	pthread_mutex_lock(&args->lock);
 
 	btree_insert(args->io_queue, fsbno, bp);
+	xfs_probe4(prefetch_queue, args->agno, fsbno, B_IS_INODE(flag),
+		   args->inode_bufs_queued);
 
 	if (fsbno > args->last_bno_read) {
 		if (B_IS_INODE(flag)) {
@@ -389,6 +640,57 @@ pf_read_exinode(
 			be32_to_cpu(dino->di_nextents));
 }
 
+/*
+ * Queue the blocks of an attribute fork kept in extents: its leaf and node
+ * blocks, and the remote values, which phases 3 and 4 would otherwise read
+ * one block at a time while checking the inode.  Attribute blocks are
+ * single filesystem blocks, remote values included, so that's how they
+ * are queued, to match the reads.  Attribute forks in btree format are
+ * rare enough to be left to the processing threads.
+ */
+static void
+pf_read_attr_fork(
+	prefetch_args_t		*args,
+	xfs_dinode_t		*dino)
+{
+	xfs_bmbt_rec_t		*rp;
+	xfs_bmbt_irec_t		irec;
+	struct xfs_buf_map	map;
+	int			nextents;
+	int			i;
+
+	if (!XFS_DFORK_Q(dino) ||
+	    dino->di_aformat != XFS_DINODE_FMT_EXTENTS)
+		return;
+	if (be16_to_cpu(dino->di_magic) != XFS_DINODE_MAGIC ||
+	    !xfs_dinode_good_version(mp, dino->di_version))
+		return;
+	if (dino->di_forkoff >= XFS_LITINO(mp, dino->di_version) >> 3)
+		return;
+
+	nextents = be16_to_cpu(dino->di_anextents);
+	if (nextents > XFS_DFORK_ASIZE(dino, mp) / sizeof(xfs_bmbt_rec_t))
+		return;
+
+	rp = (xfs_bmbt_rec_t *)XFS_DFORK_APTR(dino);
+	for (i = 0; i < nextents; i++) {
+		libxfs_bmbt_disk_get_all(rp + i, &irec);
+		if (irec.br_blockcount == 0 ||
+		    !verify_dfsbno(mp, irec.br_startblock) ||
+		    !verify_dfsbno(mp, irec.br_startblock +
+					irec.br_blockcount - 1))
+			return;
+
+		pftrace("queuing attr extent in AG %d", args->agno);
+		for (; irec.br_blockcount; irec.br_blockcount--) {
+			map.bm_bn = XFS_FSB_TO_DADDR(mp, irec.br_startblock);
+			map.bm_len = XFS_FSB_TO_BB(mp, 1);
+			pf_queue_io(args, &map, 1, B_DIR_META);
+			irec.br_startblock++;
+		}
+	}
+}
+
 static void
 pf_read_inode_dirs(
 	prefetch_args_t		*args,
@@ -413,6 +715,10 @@ pf_read_inode_dirs(
 		isadir = (be16_to_cpu(dino->di_mode) & S_IFMT) == S_IFDIR;
 		hasdir |= isadir;
 
+		/* only phases 3 and 4 look at attributes */
+		if (!args->dirs_only)
+			pf_read_attr_fork(args, dino);
+
 		if (dino->di_format <= XFS_DINODE_FMT_LOCAL)
 			continue;
 
@@ -454,6 +760,81 @@ pf_read_inode_dirs(
 		XFS_BUF_SET_PRIORITY(bp, B_DIR_INODE);
 }
 
+/*
+ * With -o pf_verify the I/O threads check the CRCs of the buffers they
+ * read, while the processing threads are busy with earlier buffers.  Only
+ * a good CRC is recorded in the buffer, so the verifier run when the buffer
+ * is used doesn't have to check it again; a bad one is left for the
+ * verifier to find and report as usual.  For inode clusters the recorded
+ * CRC offset means the CRCs of all the inodes in the cluster are good.
+ */
+static void
+pf_check_crc(
+	xfs_buf_t		*bp)
+{
+	struct xfs_da_blkinfo	*info = bp->b_addr;
+	unsigned int		off;
+	unsigned int		n;
+
+	if (!pf_verify || !xfs_sb_version_hascrc(&mp->m_sb))
+		return;
+
+	if (B_IS_INODE(XFS_BUF_PRIORITY(bp))) {
+		n = XFS_BUF_COUNT(bp) >> mp->m_sb.sb_inodelog;
+		if (libxfs_dinode_verify_cksums(mp, bp->b_addr, n, NULL) == n)
+			bp->b_crc_off = XFS_DINODE_CRC_OFF;
+		return;
+	}
+
+	switch (be32_to_cpu(*(__be32 *)bp->b_addr)) {
+	case XFS_DIR3_BLOCK_MAGIC:
+	case XFS_DIR3_DATA_MAGIC:
+		off = XFS_DIR3_DATA_CRC_OFF;
+		break;
+	case XFS_DIR3_FREE_MAGIC:
+		off = XFS_DIR3_FREE_CRC_OFF;
+		break;
+	default:
+		switch (be16_to_cpu(info->magic)) {
+		case XFS_DA3_NODE_MAGIC:
+			off = XFS_DA3_NODE_CRC_OFF;
+			break;
+		case XFS_DIR3_LEAF1_MAGIC:
+		case XFS_DIR3_LEAFN_MAGIC:
+			off = XFS_DIR3_LEAF_CRC_OFF;
+			break;
+		case XFS_ATTR3_LEAF_MAGIC:
+			off = XFS_ATTR3_LEAF_CRC_OFF;
+			break;
+		default:
+			return;
+		}
+	}
+	if (xfs_verify_cksum(bp->b_addr, BBTOB(bp->b_length), off))
+		bp->b_crc_off = off;
+}
+
+/*
+ * Work out what a freshly read prefetch buffer means for the rest of
+ * the prefetch: inode clusters get their directory blocks queued, metadata
+ * gets its cache priority adjusted.
+ */
+static void
+pf_read_done(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	int			num,
+	xfs_buf_t		*bp)
+{
+	pf_check_crc(bp);
+	if (B_IS_INODE(XFS_BUF_PRIORITY(bp)))
+		pf_read_inode_dirs(args, bp);
+	else if (which == PF_META_ONLY)
+		XFS_BUF_SET_PRIORITY(bp, B_DIR_META_H);
+	else if (which == PF_PRIMARY && num == 1)
+		XFS_BUF_SET_PRIORITY(bp, B_DIR_META_S);
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -472,17 +853,25 @@ pf_batch_read(
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
 	char			*pbuf;
+	int			direct;
+	int			max_bytes;
+	int			batch_bytes;
+	int			max_fsbs;
+	__uint64_t		start;
+	__uint64_t		iostart;
 
 	for (;;) {
+		pf_get_tunables(&max_bytes, &batch_bytes);
+		max_fsbs = max_bytes >> mp->m_sb.sb_blocklog;
 		num = 0;
 		if (which == PF_SECONDARY) {
 			bplist[0] = btree_find(args->io_queue, 0, &fsbno);
-			max_fsbno = MIN(fsbno + pf_max_fsbs,
+			max_fsbno = MIN(fsbno + max_fsbs,
 							args->last_bno_read);
 		} else {
 			bplist[0] = btree_find(args->io_queue,
 						args->last_bno_read, &fsbno);
-			max_fsbno = fsbno + pf_max_fsbs;
+			max_fsbno = fsbno + max_fsbs;
 		}
 		while (bplist[num] && num < MAX_BUFS && fsbno < max_fsbno) {
 			/*
@@ -516,12 +905,22 @@ pf_batch_read(
 		first_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[0]));
 		last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
 			XFS_BUF_SIZE(bplist[num-1]);
-		while (num > 1 && last_off - first_off > pf_max_bytes) {
+		while (num > 1 && last_off - first_off > max_bytes) {
 			num--;
 			last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
 				XFS_BUF_SIZE(bplist[num-1]);
 		}
-		if (num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3))) {
+		direct = 0;
+		if (num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3)) &&
+		    libxfs_buftarg_queued_io(mp->m_ddev_targp)) {
+			/*
+			 * not enough blocks for one big read, but the device
+			 * can queue reads, so read every buffer directly and
+			 * keep them all in flight at once.
+			 */
+			direct = 1;
+		} else if (num < ((last_off - first_off) >>
+					(mp->m_sb.sb_blocklog + 3))) {
 			/*
 			 * not enough blocks for one big read, so determine
 			 * the number of blocks that are close enough.
@@ -530,7 +929,7 @@ pf_batch_read(
 			for (i = 1; i < num; i++) {
 				next_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) +
 						XFS_BUF_SIZE(bplist[i]);
-				if (next_off - last_off > pf_batch_bytes)
+				if (next_off - last_off > batch_bytes)
 					break;
 				last_off = next_off;
 			}
@@ -544,6 +943,7 @@ pf_batch_read(
 		}
 
 		if (which == PF_PRIMARY) {
+			metrics_pf_sample(args->inode_bufs_queued);
 			for (inode_bufs = 0, i = 0; i < num; i++) {
 				if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
 					inode_bufs++;
@@ -560,12 +960,34 @@ pf_batch_read(
 			(which != PF_SECONDARY) ? "pri" : "sec", args->agno,
 			args->last_bno_read, args->inode_bufs_queued);
 #endif
+		xfs_probe4(prefetch_batch, args->agno, which, num,
+			   last_off - first_off);
 		pthread_mutex_unlock(&args->lock);
 
+		if (direct) {
+			start = pf_io_start();
+			libxfs_readbufr_list(mp->m_ddev_targp, bplist, num, 0);
+			for (size = 0, i = 0; i < num; i++)
+				size += XFS_BUF_SIZE(bplist[i]);
+			pf_io_done(start, size, 0);
+			for (i = 0; i < num; i++) {
+				if (bplist[i]->b_error)
+					continue;
+				bplist[i]->b_flags |= LIBXFS_B_UNCHECKED;
+				pf_read_done(args, which, num, bplist[i]);
+			}
+			goto put_bufs;
+		}
+
 		/*
 		 * now read the data and put into the xfs_but_t's
 		 */
-		len = pread64(mp_fd, buf, (int)(last_off - first_off), first_off);
+		start = pf_io_start();
+		iostart = libxfs_iostats_start();
+		len = libxfs_device_pread(mp_fd, buf, (int)(last_off - first_off), first_off);
+		if (len > 0)
+			libxfs_iostats_io(LIBXFS_IO_PREFETCH, len, iostart);
+		pf_io_done(start, len > 0 ? len : 0, 1);
 
 		/*
 		 * Check the last buffer on the list to see if we need to
@@ -575,6 +997,7 @@ pf_batch_read(
 		 */
 		if ((bplist[num - 1]->b_flags & LIBXFS_B_DISCONTIG)) {
 			libxfs_readbufr_map(mp->m_ddev_targp, bplist[num - 1], 0);
+			pf_check_crc(bplist[num - 1]);
 			bplist[num - 1]->b_flags |= LIBXFS_B_UNCHECKED;
 			libxfs_putbuf(bplist[num - 1]);
 			num--;
@@ -595,16 +1018,10 @@ pf_batch_read(
 				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
 						       LIBXFS_B_UNCHECKED);
 				len -= size;
-				if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
-					pf_read_inode_dirs(args, bplist[i]);
-				else if (which == PF_META_ONLY)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_H);
-				else if (which == PF_PRIMARY && num == 1)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_S);
+				pf_read_done(args, which, num, bplist[i]);
 			}
 		}
+put_bufs:
 		for (i = 0; i < num; i++) {
 			pftrace("putbuf %c %p (%llu) in AG %d",
 				B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])) ? 'I' : 'M',
@@ -644,11 +1061,13 @@ pf_io_worker(
 {
 	prefetch_args_t		*args = param;
 	void			*buf = memalign(libxfs_device_alignment(),
-						pf_max_bytes);
+						pf_read_limit);
 
 	if (buf == NULL)
 		return NULL;
+	mem_add(MEM_PREFETCH, pf_read_limit);
 
+	numa_bind_ag(args->agno);
 	pthread_mutex_lock(&args->lock);
 	while (!args->queuing_done || !btree_is_empty(args->io_queue)) {
 		pftrace("waiting to start prefetch I/O for AG %d", args->agno);
@@ -669,6 +1088,7 @@ pf_io_worker(
 	pthread_mutex_unlock(&args->lock);
 
 	free(buf);
+	mem_add(MEM_PREFETCH, -pf_read_limit);
 
 	pftrace("finished prefetch I/O for AG %d", args->agno);
 
@@ -691,13 +1111,17 @@ pf_queuing_worker(
 	xfs_agblock_t		bno;
 	int			i;
 	int			err;
+	int			depth;
 	uint64_t		sparse;
 
+	numa_bind_ag(args->agno);
+	wait_for_ag_scan(args->agno);
 	blks_per_cluster = mp->m_inode_cluster_size >> mp->m_sb.sb_blocklog;
 	if (blks_per_cluster == 0)
 		blks_per_cluster = 1;
 
-	for (i = 0; i < PF_THREAD_COUNT; i++) {
+	depth = pf_io_depth();
+	for (i = 0; i < depth; i++) {
 		err = pthread_create(&args->io_threads[i], NULL,
 				pf_io_worker, args);
 		if (err != 0) {
@@ -747,6 +1171,10 @@ pf_queuing_worker(
 			sem_wait(&args->ra_count);
 		}
 
+		/* phase 4 will do this chunk from what phase 3 kept of it */
+		if (cur_irec->digest)
+			continue;
+
 		num_inos = 0;
 		bno = XFS_AGINO_TO_AGBNO(mp, cur_irec->ino_startnum);
 		sparse = cur_irec->ir_sparse;
@@ -784,7 +1212,7 @@ pf_queuing_worker(
 	pthread_mutex_unlock(&args->lock);
 
 	/* now wait for the readers to finish */
-	for (i = 0; i < PF_THREAD_COUNT; i++)
+	for (i = 0; i < PF_THREAD_MAX; i++)
 		if (args->io_threads[i])
 			pthread_join(args->io_threads[i], NULL);
 
@@ -833,6 +1261,14 @@ init_prefetch(
 	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
 	pf_batch_bytes = DEF_BATCH_BYTES;
 	pf_batch_fsbs = DEF_BATCH_BYTES >> (mp->m_sb.sb_blocklog + 1);
+
+	pf_read_limit = pf_max_bytes;
+	if (pf_adaptive) {
+		pf_read_limit = pf_max_bytes << PF_READ_LIMIT_SHIFT;
+		pf_tune.max_bytes = pf_max_bytes;
+		pf_tune.batch_bytes = pf_batch_bytes;
+		pf_tune.depth = pf_io_threads;
+	}
 }
 
 prefetch_args_t *
@@ -926,6 +1362,7 @@ prefetch_ag_range(
 		if (i + 1 < end_ag)
 			pf_args[(~i) & 1] = start_inode_prefetch(i + 1,
 						dirs_only, pf_args[i & 1]);
+		numa_bind_ag(i);
 		func(work, i, pf_args[i & 1]);
 	}
 }
@@ -991,7 +1428,7 @@ do_inode_prefetch(
 		queue.mp = mp;
 		prefetch_ag_range(&queue, 0, mp->m_sb.sb_agcount,
 				  dirs_only, func);
-		return;
+		goto out;
 	}
 
 	/*
@@ -1022,6 +1459,9 @@ do_inode_prefetch(
 	for (i = 0; i < queues_started; i++)
 		destroy_work_queue(&queues[i]);
 	free(queues);
+out:
+	if (pf_adaptive && verbose)
+		pf_report();
 }
 
 void
@@ -1033,12 +1473,14 @@ wait_for_inode_prefetch(
 
 	pthread_mutex_lock(&args->lock);
 
+	xfs_probe2(prefetch_wait, args->agno, args->can_start_processing);
 	while (!args->can_start_processing) {
 		pftrace("waiting to start processing AG %d", args->agno);
 
 		pthread_cond_wait(&args->start_processing, &args->lock);
 	}
 	pftrace("can start processing AG %d", args->agno);
+	xfs_probe1(prefetch_wait_done, args->agno);
 
 	pthread_mutex_unlock(&args->lock);
 }
@@ -7,13 +7,17 @@
 struct work_queue;
 
 extern int 	do_prefetch;
+extern int	pf_adaptive;
+extern int	pf_verify;
+extern int	pf_io_threads;	/* I/O workers per AG, or to start with */
 
 #define PF_THREAD_COUNT	4
+#define PF_THREAD_MAX	16
 
 typedef struct prefetch_args {
 	pthread_mutex_t		lock;
 	pthread_t		queuing_thread;
-	pthread_t		io_threads[PF_THREAD_COUNT];
+	pthread_t		io_threads[PF_THREAD_MAX];
 	struct btree_root	*io_queue;
 	pthread_cond_t		start_reading;
 	pthread_cond_t		start_processing;
@@ -1,7 +1,10 @@
 
 #include "libxfs.h"
+#include "avl.h"
 #include "globals.h"
+#include "incore.h"
 #include "progress.h"
+#include "metrics.h"
 #include "err_protos.h"
 #include <signal.h>
 
@@ -82,6 +85,16 @@ progress_rpt_t progress_rpt_reports[] = {
 
 pthread_t	report_thread;
 
+/*
+ * Rates are moving averages over the report intervals, each interval
+ * counting for this much of the new average, so that the estimate follows
+ * a phase slowing down or speeding up rather than averaging over all of
+ * it.  Each AG's rate is kept too: the AGs are worked on by different
+ * threads, and a large AG left to the last thread still going bounds the
+ * end of the phase however fast the rest went.
+ */
+#define RATE_WEIGHT	0.5
+
 typedef struct msg_block_s {
 	pthread_mutex_t	mutex;
 	progress_rpt_t	*format;
@@ -89,6 +102,15 @@ typedef struct msg_block_s {
 	__uint64_t	*total;
 	int		count;
 	int		interval;
+	__uint64_t	*weights;	/* work in each AG, if known */
+	__uint64_t	*ag_last;	/* done at the last report */
+	double		*ag_rate;	/* items per second */
+	__uint64_t	last_sum;
+	double		last_time;
+	double		rate;
+	struct libxfs_iostats last_io;
+	double		read_rate;	/* bytes per second */
+	double		write_rate;
 } msg_block_t;
 static msg_block_t 	global_msgs;
 
@@ -129,6 +151,12 @@ init_progress_rpt (void)
 	global_msgs.interval = report_interval;
 	global_msgs.done   = prog_rpt_done;
 	global_msgs.total  = &prog_rpt_total;
+	global_msgs.weights = calloc(glob_agcount, sizeof(__uint64_t));
+	global_msgs.ag_last = calloc(glob_agcount, sizeof(__uint64_t));
+	global_msgs.ag_rate = calloc(glob_agcount, sizeof(double));
+	if (!global_msgs.weights || !global_msgs.ag_last ||
+	    !global_msgs.ag_rate)
+		do_error(_("cannot malloc progress rates\n"));
 
 	if (pthread_create (&report_thread, NULL,
 		progress_rpt_thread, (void *)&global_msgs))
@@ -150,9 +178,113 @@ stop_progress_rpt(void)
 	pthread_kill (report_thread, SIGHUP);
 	pthread_join (report_thread, NULL);
 	free(prog_rpt_done);
+	free(global_msgs.weights);
+	free(global_msgs.ag_last);
+	free(global_msgs.ag_rate);
 	return;
 }
 
+static double
+progress_average(
+	double		avg,
+	double		sample,
+	int		first)
+{
+	if (first)
+		return sample;
+	return RATE_WEIGHT * sample + (1 - RATE_WEIGHT) * avg;
+}
+
+/*
+ * Update the rates with the work done since the last report, sum being
+ * the work done so far in the phase, and return the estimated seconds to
+ * go, or -1 if there's nothing to go by yet.
+ */
+static long
+progress_estimate(
+	msg_block_t	*msgp,
+	__uint64_t	sum)
+{
+	struct libxfs_iostats io;
+	double		now = metrics_now();
+	double		dt = now - msgp->last_time;
+	int		first = msgp->last_sum == 0;
+	__uint64_t	done;
+	__uint64_t	remaining = 0;
+	double		eta;
+	int		i;
+
+	libxfs_iostats_get(&io);
+	if (dt > 0) {
+		msgp->rate = progress_average(msgp->rate,
+				(sum - msgp->last_sum) / dt, first);
+		msgp->read_rate = progress_average(msgp->read_rate,
+				(io.read_bytes - msgp->last_io.read_bytes) / dt,
+				first);
+		msgp->write_rate = progress_average(msgp->write_rate,
+				(io.write_bytes - msgp->last_io.write_bytes) / dt,
+				first);
+	}
+
+	for (i = 0; i < msgp->count; i++) {
+		done = counter_read(&msgp->done[i]);
+		if (dt > 0 && done > msgp->ag_last[i])
+			msgp->ag_rate[i] = progress_average(msgp->ag_rate[i],
+					(done - msgp->ag_last[i]) / dt,
+					msgp->ag_rate[i] == 0);
+		msgp->ag_last[i] = done;
+		if (msgp->weights[i] > done)
+			remaining += msgp->weights[i] - done;
+	}
+	if (!remaining && *msgp->total > sum)
+		remaining = *msgp->total - sum;
+
+	msgp->last_sum = sum;
+	msgp->last_time = now;
+	msgp->last_io = io;
+
+	if (!sum || msgp->rate <= 0)
+		return -1;
+	eta = remaining / msgp->rate;
+	for (i = 0; i < msgp->count; i++) {
+		done = msgp->ag_last[i];
+		if (msgp->ag_rate[i] > 0 && msgp->weights[i] > done)
+			eta = max(eta, (msgp->weights[i] - done) /
+					msgp->ag_rate[i]);
+	}
+	return (long)eta;
+}
+
+/*
+ * With -o progress_fd, each report also goes to the descriptor as a line
+ * of JSON for whatever is driving the repair.
+ */
+static void
+progress_fd_report(
+	msg_block_t	*msgp,
+	__uint64_t	sum,
+	long		eta,
+	int		final)
+{
+	time_t		elapsed;
+
+	if (progress_fd < 0)
+		return;
+	elapsed = time(NULL) - phase_times[current_phase].start;
+	dprintf(progress_fd, "{ \"phase\": %d, \"stage\": \"%s\", "
+		"\"type\": \"%s\", \"done\": %llu, \"total\": %llu, "
+		"\"elapsed\": %ld, \"rate\": %.1f, "
+		"\"read_bytes_per_sec\": %.0f, "
+		"\"write_bytes_per_sec\": %.0f, \"eta\": %ld, "
+		"\"final\": %s }\n",
+		current_phase, msgp->format->msg, *msgp->format->type,
+		(unsigned long long)sum,
+		msgp->format->format == FMT1 ?
+			(unsigned long long)*msgp->total : 0ULL,
+		(long)elapsed, msgp->rate, msgp->read_rate, msgp->write_rate,
+		eta, final ? "true" : "false");
+}
+
 static void *
 progress_rpt_thread (void *p)
 {
@@ -169,6 +301,7 @@ progress_rpt_thread (void *p)
 	__uint64_t sum;
 	msg_block_t *msgp = (msg_block_t *)p;
 	__uint64_t percent;
+	long eta;
 
 	/* It's possible to get here very early w/ no progress msg set */
 	if (!msgp->format)
@@ -232,7 +365,8 @@ progress_rpt_thread (void *p)
 		sum = 0;
 		donep = msgp->done;
 		for (i = 0; i < msgp->count; i++) {
-			sum += *donep++;
+			sum += counter_read(donep);
+			donep++;
 		}
 
 		percent = 0;
@@ -254,6 +388,7 @@ progress_rpt_thread (void *p)
 		}
 
 		do_log(_("%s"), msgbuf);
+		eta = progress_estimate(msgp, sum);
 		elapsed = now - phase_times[current_phase].start;
 		if ((msgp->format->format == FMT1) && sum && elapsed &&
 			((current_phase == 3) ||
@@ -266,11 +401,19 @@ progress_rpt_thread (void *p)
 				current_phase, duration(elapsed, msgbuf),
 				(int) (60*sum/(elapsed)), *msgp->format->type);
 			do_log(
+	_("\t- %02d:%02d:%02d: Phase %d: now %.0f %s per second, reading %.1f MiB/s, writing %.1f MiB/s\n"),
+				tmp->tm_hour, tmp->tm_min, tmp->tm_sec,
+				current_phase, msgp->rate, *msgp->format->type,
+				msgp->read_rate / 1048576,
+				msgp->write_rate / 1048576);
+			if (eta >= 0)
+				do_log(
 	_("\t- %02d:%02d:%02d: Phase %d: %" PRIu64 "%% done - estimated remaining time %s\n"),
 				tmp->tm_hour, tmp->tm_min, tmp->tm_sec,
 				current_phase, percent,
-				duration((int) ((*msgp->total - sum) * (elapsed)/sum), msgbuf));
+				duration((int)eta, msgbuf));
 		}
+		progress_fd_report(msgp, sum, eta, 0);
 
 		if (pthread_mutex_unlock(&msgp->mutex) != 0) {
 			do_error(
@@ -286,11 +429,30 @@ progress_rpt_thread (void *p)
 	return (NULL);
 }
 
+/*
+ * The inode phases go through the inode chunks in the in-core tree, so
+ * that's the work there is in each AG.
+ */
+static void
+progress_weigh_inodes(
+	__uint64_t		*weights)
+{
+	ino_tree_node_t		*irec;
+	xfs_agnumber_t		agno;
+
+	for (agno = 0; agno < glob_agcount; agno++) {
+		weights[agno] = 0;
+		for (irec = findfirst_inode_rec(agno); irec;
+		     irec = next_ino_rec(irec))
+			weights[agno] += XFS_INODES_PER_CHUNK;
+	}
+}
+
 int
 set_progress_msg (int report, __uint64_t total)
 {
 
-	if (!ag_stride)
+	if (!progress_rpt)
 		return (0);
 
 	if (pthread_mutex_lock(&global_msgs.mutex))
@@ -303,6 +465,22 @@ set_progress_msg (int report, __uint64_t total)
 	if (prog_rpt_done)
 		bzero(prog_rpt_done, sizeof(__uint64_t)*glob_agcount);
 
+	/* and start the rates again for the new stage */
+	if (global_msgs.weights) {
+		memset(global_msgs.weights, 0, sizeof(__uint64_t)*glob_agcount);
+		memset(global_msgs.ag_last, 0, sizeof(__uint64_t)*glob_agcount);
+		memset(global_msgs.ag_rate, 0, sizeof(double)*glob_agcount);
+		if (report == PROG_FMT_PROCESS_INO ||
+		    report == PROG_FMT_DUP_BLOCKS)
+			progress_weigh_inodes(global_msgs.weights);
+		global_msgs.last_sum = 0;
+		global_msgs.last_time = metrics_now();
+		global_msgs.rate = 0;
+		global_msgs.read_rate = 0;
+		global_msgs.write_rate = 0;
+		libxfs_iostats_get(&global_msgs.last_io);
+	}
+
 	if (pthread_mutex_unlock(&global_msgs.mutex))
 		do_error(_("set_progress_msg: cannot unlock progress mutex\n"));
 
@@ -320,7 +498,7 @@ print_final_rpt(void)
 	msg_block_t 	*msgp = &global_msgs;
 	char		msgbuf[DURATION_BUF_SIZE];
 
-	if (!ag_stride)
+	if (!progress_rpt)
 		return 0;
 
 	if (pthread_mutex_lock(&global_msgs.mutex))
@@ -338,7 +516,8 @@ print_final_rpt(void)
 	sum = 0;
 	donep = msgp->done;
 	for (i = 0; i < msgp->count; i++) {
-		sum += *donep++;
+		sum += counter_read(donep);
+		donep++;
 	}
 
 	if (report_interval) {
@@ -357,6 +536,7 @@ print_final_rpt(void)
 			break;
 		}
 		do_log(_("%s"), msgbuf);
+		progress_fd_report(msgp, sum, 0, 1);
 	}
 
 	if (pthread_mutex_unlock(&global_msgs.mutex))
@@ -388,6 +568,7 @@ timestamp(int end, int phase, char *buf)
 		cache_report(stderr, "libxfs_bcache", libxfs_bcache);
 
 	now = time(NULL);
+	metrics_timestamp(end, phase);
 
 	if (end) {
 		phase_times[phase].end = now;
@@ -532,4 +713,6 @@ summary_report(void)
 		}
 	}
 	do_log(_("\nTotal run time: %s\n"), duration(phase_times[0].duration, msgbuf));
+	do_log("\n");
+	libxfs_iostats_cache_report(stderr);
 }
@@ -44,9 +44,15 @@ char	*err_string(int err_code);
 
 void	thread_init(void);
 
+struct xlog;
+int	replay_log(struct xfs_mount *, struct xlog *, xfs_daddr_t,
+		xfs_daddr_t);
+
 void	phase1(struct xfs_mount *);
 void	phase2(struct xfs_mount *, int);
+void	zero_log_wait(void);
 void	phase3(struct xfs_mount *);
+void	phase3_setup_ag(struct xfs_mount *, xfs_agnumber_t);
 void	phase4(struct xfs_mount *);
 void	phase5(struct xfs_mount *);
 void	phase6(struct xfs_mount *);
@@ -25,6 +25,7 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "rt.h"
+#include "threads.h"
 
 #define xfs_highbit64 libxfs_highbit64	/* for XFS_RTBLOCKLOG macro */
 
@@ -51,6 +52,116 @@ rtinit(xfs_mount_t *mp)
 	_("couldn't allocate memory for incore realtime summary info.\n"));
 }
 
+static void
+rtinfo_add_extent(
+	xfs_mount_t	*mp,
+	xfs_suminfo_t	*sumcompute,
+	xfs_rtblock_t	start_ext,
+	xfs_rtblock_t	end_ext,
+	int		bitsperblock)
+{
+	xfs_rtblock_t	len = end_ext - start_ext;
+	int		log = XFS_RTBLOCKLOG(len);
+
+	sumcompute[XFS_SUMOFFS(mp, log, start_ext / bitsperblock)]++;
+}
+
+/*
+ * The bitmap is generated in ranges of whole bitmap blocks, in parallel.
+ * A free extent is counted in the summary under the bitmap block it starts
+ * in, so each range only touches its own part of the summary; the only
+ * extents a range can't count itself are the ones that run into it from
+ * the range before or out of it into the next, and those are left for
+ * generate_rtinfo to join up afterwards.
+ */
+#define RTINFO_MIN_BLOCKS	64	/* bitmap blocks per range, at least */
+
+struct rtinfo_range {
+	xfs_rtblock_t	start;		/* first extent of the range */
+	xfs_rtblock_t	end;		/* and one past the last */
+	xfs_rtword_t	*words;		/* bitmap words for start */
+	xfs_suminfo_t	*sumcompute;
+	xfs_rtblock_t	head_end;	/* end of a free run from start */
+	xfs_rtblock_t	tail_start;	/* start of a free run to end */
+	__uint64_t	frextents;
+};
+
+/*
+ * The bitmap is built a word at a time from the incore map, and the free
+ * extents for the summary are found by looking for the edges in each word,
+ * so runs of all free or all used words cost next to nothing.
+ */
+static void
+generate_rtinfo_range(
+	xfs_mount_t		*mp,
+	struct rtinfo_range	*rr)
+{
+	xfs_rtblock_t		extno;
+	xfs_rtblock_t		start_ext = 0;
+	xfs_rtword_t		*words = rr->words;
+	xfs_rtword_t		bits;
+	xfs_rtword_t		x;
+	int			bitsperblock = mp->m_sb.sb_blocksize * NBBY;
+	int			wordbits = sizeof(xfs_rtword_t) * NBBY;
+	int			pos;
+	int			in_extent = 0;
+
+	rr->head_end = NULLRTBLOCK;
+	rr->tail_start = NULLRTBLOCK;
+	rr->frextents = 0;
+
+	for (extno = rr->start; extno < rr->end; extno += wordbits) {
+		bits = get_rtbmap_free_word(extno);
+		if (mp->m_sb.sb_rextents - extno < wordbits)
+			bits &= ((xfs_rtword_t)1 <<
+				 (mp->m_sb.sb_rextents - extno)) - 1;
+		*words++ = bits;
+		rr->frextents += hweight32(bits);
+
+		/* the current extent, or the lack of one, goes on */
+		if (bits == (in_extent ? ~(xfs_rtword_t)0 : 0))
+			continue;
+
+		pos = 0;
+		for (;;) {
+			if (!in_extent) {
+				x = bits & (~(xfs_rtword_t)0 << pos);
+				if (!x)
+					break;
+				pos = XFS_RTLOBIT(x);
+				start_ext = extno + pos;
+				in_extent = 1;
+			}
+			x = ~bits & (~(xfs_rtword_t)0 << pos);
+			if (!x)
+				break;
+			pos = XFS_RTLOBIT(x);
+			if (start_ext == rr->start)
+				rr->head_end = extno + pos;
+			else
+				rtinfo_add_extent(mp, rr->sumcompute,
+						  start_ext, extno + pos,
+						  bitsperblock);
+			in_extent = 0;
+		}
+	}
+	if (!in_extent)
+		return;
+	if (start_ext == rr->start)
+		rr->head_end = rr->end;
+	else
+		rr->tail_start = start_ext;
+}
+
+static void
+generate_rtinfo_work(
+	work_queue_t		*wq,
+	xfs_agnumber_t		unused,
+	void			*arg)
+{
+	generate_rtinfo_range(wq->mp, arg);
+}
+
 /*
  * generate the real-time bitmap and summary info based on the
  * incore realtime extent map.
@@ -60,69 +171,70 @@ generate_rtinfo(xfs_mount_t	*mp,
 		xfs_rtword_t	*words,
 		xfs_suminfo_t	*sumcompute)
 {
-	xfs_rtblock_t	extno;
-	xfs_rtblock_t	start_ext;
-	int		bitsperblock;
-	int		bmbno;
-	xfs_rtword_t	freebit;
-	xfs_rtword_t	bits;
-	int		start_bmbno;
-	int		i;
-	int		offs;
-	int		log;
-	int		len;
-	int		in_extent;
+	struct rtinfo_range	*ranges;
+	struct rtinfo_range	*rr;
+	work_queue_t		wq;
+	xfs_rtblock_t		carry = NULLRTBLOCK;
+	xfs_rtblock_t		range_exts;
+	xfs_extlen_t		range_blocks;
+	int			bitsperblock;
+	int			wordbits = sizeof(xfs_rtword_t) * NBBY;
+	int			nranges;
+	int			i;
 
 	ASSERT(mp->m_rbmip == NULL);
 
 	bitsperblock = mp->m_sb.sb_blocksize * NBBY;
-	extno = start_ext = 0;
-	bmbno = in_extent = start_bmbno = 0;
+	nranges = howmany(mp->m_sb.sb_rbmblocks, RTINFO_MIN_BLOCKS);
+	nranges = max(1, min(nranges, libxfs_nproc() * 4));
+	range_blocks = howmany(mp->m_sb.sb_rbmblocks, nranges);
+	range_exts = (xfs_rtblock_t)range_blocks * bitsperblock;
+	nranges = howmany(mp->m_sb.sb_rextents, range_exts);
 
-	/*
-	 * slower but simple, don't play around with trying to set
-	 * things one word at a time, just set bit as required.
-	 * Have to * track start and end (size) of each range of
-	 * free extents to set the summary info properly.
-	 */
-	while (extno < mp->m_sb.sb_rextents)  {
-		freebit = 1;
-		*words = 0;
-		bits = 0;
-		for (i = 0; i < sizeof(xfs_rtword_t) * NBBY &&
-				extno < mp->m_sb.sb_rextents; i++, extno++)  {
-			if (get_rtbmap(extno) == XR_E_FREE)  {
-				sb_frextents++;
-				bits |= freebit;
+	ranges = calloc(nranges, sizeof(struct rtinfo_range));
+	if (!ranges)
+		do_error(
+	_("couldn't allocate memory for realtime summary ranges.\n"));
+	for (i = 0; i < nranges; i++) {
+		rr = &ranges[i];
+		rr->start = i * range_exts;
+		rr->end = min(rr->start + range_exts, mp->m_sb.sb_rextents);
+		rr->words = words + rr->start / wordbits;
+		rr->sumcompute = sumcompute;
+	}
 
-				if (in_extent == 0) {
-					start_ext = extno;
-					start_bmbno = bmbno;
-					in_extent = 1;
-				}
-			} else if (in_extent == 1) {
-				len = (int) (extno - start_ext);
-				log = XFS_RTBLOCKLOG(len);
-				offs = XFS_SUMOFFS(mp, log, start_bmbno);
-				sumcompute[offs]++;
-				in_extent = 0;
-			}
+	if (nranges == 1) {
+		generate_rtinfo_range(mp, &ranges[0]);
+	} else {
+		create_work_queue(&wq, mp, min(nranges, libxfs_nproc()));
+		for (i = 0; i < nranges; i++)
+			queue_work(&wq, generate_rtinfo_work, 0, &ranges[i]);
+		destroy_work_queue(&wq);
+	}
 
-			freebit <<= 1;
+	/* count the free extents that start or end at range boundaries */
+	for (i = 0, rr = ranges; i < nranges; i++, rr++) {
+		sb_frextents += rr->frextents;
+		if (rr->head_end != NULLRTBLOCK) {
+			if (carry == NULLRTBLOCK)
+				carry = rr->start;
+			if (rr->head_end == rr->end)
+				continue;
+			rtinfo_add_extent(mp, sumcompute, carry, rr->head_end,
+					  bitsperblock);
+			carry = NULLRTBLOCK;
+		} else if (carry != NULLRTBLOCK) {
+			rtinfo_add_extent(mp, sumcompute, carry, rr->start,
+					  bitsperblock);
+			carry = NULLRTBLOCK;
 		}
-		*words = bits;
-		words++;
-
-		if (extno % bitsperblock == 0)
-			bmbno++;
-	}
-	if (in_extent == 1) {
-		len = (int) (extno - start_ext);
-		log = XFS_RTBLOCKLOG(len);
-		offs = XFS_SUMOFFS(mp, log, start_bmbno);
-		sumcompute[offs]++;
+		carry = rr->tail_start;
 	}
+	if (carry != NULLRTBLOCK)
+		rtinfo_add_extent(mp, sumcompute, carry, mp->m_sb.sb_rextents,
+				  bitsperblock);
 
+	free(ranges);
 	return(0);
 }
 
@@ -0,0 +1,630 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "runmap.h"
+#include "err_protos.h"
+#include "scratch.h"
+#include "mem.h"
+
+/*
+ * The run map is a B+tree keyed by the first block of each run.  Unlike the
+ * generic btree it stores 32 bit keys and an 8 bit state directly in the
+ * leaves instead of an unsigned long key and a value pointer per run, and
+ * every node is four cache lines in size, so a leaf holds 50 runs in 256
+ * bytes.  Interior nodes hold the lowest key of each child.
+ */
+#define RM_NODE_SIZE	256
+#define RM_LEAF_RECS	50
+#define RM_NODE_RECS	21
+#define RM_LEAF_MIN	(RM_LEAF_RECS / 2)
+#define RM_NODE_MIN	(RM_NODE_RECS / 2)
+
+/* enough for 2^32 runs with half full nodes */
+#define RM_MAX_LEVELS	12
+
+struct rm_leaf {
+	__uint16_t		nr;
+	__uint16_t		level;		/* always zero */
+	__uint32_t		keys[RM_LEAF_RECS];
+	__uint8_t		states[RM_LEAF_RECS];
+};
+
+struct rm_node {
+	__uint16_t		nr;
+	__uint16_t		level;
+	__uint32_t		keys[RM_NODE_RECS];
+	void			*ptrs[RM_NODE_RECS];
+};
+
+struct runmap {
+	void			*root;
+	int			levels;		/* interior levels above leaves */
+	unsigned long		nodes;
+	__uint32_t		agno;		/* scratch arena for nodes */
+};
+
+/*
+ * Path from the root to a leaf.  idx[l] is the index of the child taken in
+ * node[l], and for the leaf (level 0) the index of the run found.
+ */
+struct rm_path {
+	void			*node[RM_MAX_LEVELS];
+	int			idx[RM_MAX_LEVELS];
+};
+
+static void *
+rm_node_alloc(
+	struct runmap		*rm,
+	int			level)
+{
+	struct rm_node		*node;
+
+	if (scratch_active)
+		node = scratch_alloc(rm->agno, RM_NODE_SIZE);
+	else if (posix_memalign((void **)&node, 64, RM_NODE_SIZE))
+		node = NULL;
+	if (!node)
+		do_error(_("couldn't allocate block map node\n"));
+	node->nr = 0;
+	node->level = level;
+	rm->nodes++;
+	mem_add_scratch(MEM_BMAPS, RM_NODE_SIZE);
+	return node;
+}
+
+static void
+rm_node_free(
+	struct runmap		*rm,
+	void			*node)
+{
+	rm->nodes--;
+	scratch_free(node, RM_NODE_SIZE);
+	mem_add_scratch(MEM_BMAPS, -RM_NODE_SIZE);
+}
+
+static void
+rm_free_nodes(
+	struct runmap		*rm,
+	void			*ptr)
+{
+	struct rm_node		*node = ptr;
+	int			i;
+
+	if (node->level > 0) {
+		for (i = 0; i < node->nr; i++)
+			rm_free_nodes(rm, node->ptrs[i]);
+	}
+	rm_node_free(rm, node);
+}
+
+/*
+ * Return the index of the last key that is less than or equal to @key, or
+ * -1 if all keys are higher.
+ */
+static inline int
+rm_search(
+	__uint32_t		*keys,
+	int			nr,
+	__uint32_t		key)
+{
+	int			lo = 0;
+	int			hi = nr;
+
+	while (lo < hi) {
+		int		mid = (lo + hi) / 2;
+
+		if (keys[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/*
+ * Walk down to the leaf that covers @key and return the index of the run
+ * containing it, or -1 if @key is below the first run.
+ */
+static int
+rm_lookup(
+	struct runmap		*rm,
+	__uint32_t		key,
+	struct rm_path		*path)
+{
+	void			*ptr = rm->root;
+	int			level;
+	int			i;
+
+	for (level = rm->levels; level > 0; level--) {
+		struct rm_node	*node = ptr;
+
+		i = rm_search(node->keys, node->nr, key);
+		if (i < 0)
+			i = 0;
+		path->node[level] = node;
+		path->idx[level] = i;
+		ptr = node->ptrs[i];
+	}
+	path->node[0] = ptr;
+	path->idx[0] = rm_search(((struct rm_leaf *)ptr)->keys,
+				 ((struct rm_leaf *)ptr)->nr, key);
+	return path->idx[0];
+}
+
+/*
+ * Find the first key after run @path->idx[0] on the path. The keys in the
+ * interior nodes are the lowest key of each child, so the start of the next
+ * leaf is the key next to the lowest index on the path that has one.
+ */
+static int
+rm_next_key(
+	struct runmap		*rm,
+	struct rm_path		*path,
+	__uint32_t		*key)
+{
+	struct rm_leaf		*leaf = path->node[0];
+	int			level;
+
+	if (path->idx[0] + 1 < leaf->nr) {
+		*key = leaf->keys[path->idx[0] + 1];
+		return 1;
+	}
+	for (level = 1; level <= rm->levels; level++) {
+		struct rm_node	*node = path->node[level];
+
+		if (path->idx[level] + 1 < node->nr) {
+			*key = node->keys[path->idx[level] + 1];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The lowest key of the node at @level changed to @key, update the parents.
+ */
+static void
+rm_update_low_key(
+	struct runmap		*rm,
+	struct rm_path		*path,
+	int			level,
+	__uint32_t		key)
+{
+	for (level++; level <= rm->levels; level++) {
+		struct rm_node	*node = path->node[level];
+
+		node->keys[path->idx[level]] = key;
+		if (path->idx[level] != 0)
+			break;
+	}
+}
+
+/*
+ * Insert a pointer to @child with lowest key @key at @idx of the interior
+ * node at @level on the path, splitting nodes up to the root as required.
+ */
+static void
+rm_insert_child(
+	struct runmap		*rm,
+	struct rm_path		*path,
+	int			level,
+	int			idx,
+	__uint32_t		key,
+	void			*child)
+{
+	struct rm_node		*node;
+	struct rm_node		*new;
+	int			half;
+
+	if (level > rm->levels) {
+		/* the old root was split, grow a new root above it */
+		node = rm_node_alloc(rm, level);
+		node->keys[0] = ((struct rm_node *)rm->root)->keys[0];
+		node->ptrs[0] = rm->root;
+		node->keys[1] = key;
+		node->ptrs[1] = child;
+		node->nr = 2;
+		rm->root = node;
+		rm->levels = level;
+		return;
+	}
+
+	node = path->node[level];
+	new = NULL;
+	if (node->nr == RM_NODE_RECS) {
+		half = RM_NODE_RECS / 2;
+		new = rm_node_alloc(rm, level);
+		new->nr = node->nr - half;
+		memcpy(new->keys, &node->keys[half],
+				new->nr * sizeof(node->keys[0]));
+		memcpy(new->ptrs, &node->ptrs[half],
+				new->nr * sizeof(node->ptrs[0]));
+		node->nr = half;
+		if (idx > half) {
+			node = new;
+			idx -= half;
+		}
+	}
+
+	memmove(&node->keys[idx + 1], &node->keys[idx],
+			(node->nr - idx) * sizeof(node->keys[0]));
+	memmove(&node->ptrs[idx + 1], &node->ptrs[idx],
+			(node->nr - idx) * sizeof(node->ptrs[0]));
+	node->keys[idx] = key;
+	node->ptrs[idx] = child;
+	node->nr++;
+
+	if (new)
+		rm_insert_child(rm, path, level + 1,
+				level < rm->levels ? path->idx[level + 1] + 1 : 1,
+				new->keys[0], new);
+}
+
+static void
+rm_insert(
+	struct runmap		*rm,
+	__uint32_t		key,
+	int			state)
+{
+	struct rm_path		path;
+	struct rm_leaf		*leaf;
+	struct rm_leaf		*new;
+	int			idx;
+	int			half;
+
+	idx = rm_lookup(rm, key, &path);
+	leaf = path.node[0];
+	if (idx >= 0 && leaf->keys[idx] == key) {
+		leaf->states[idx] = state;
+		return;
+	}
+	idx++;
+
+	new = NULL;
+	if (leaf->nr == RM_LEAF_RECS) {
+		half = RM_LEAF_RECS / 2;
+		new = rm_node_alloc(rm, 0);
+		new->nr = leaf->nr - half;
+		memcpy(new->keys, &leaf->keys[half],
+				new->nr * sizeof(leaf->keys[0]));
+		memcpy(new->states, &leaf->states[half],
+				new->nr * sizeof(leaf->states[0]));
+		leaf->nr = half;
+		if (idx > half) {
+			leaf = new;
+			idx -= half;
+		}
+	}
+
+	memmove(&leaf->keys[idx + 1], &leaf->keys[idx],
+			(leaf->nr - idx) * sizeof(leaf->keys[0]));
+	memmove(&leaf->states[idx + 1], &leaf->states[idx],
+			(leaf->nr - idx) * sizeof(leaf->states[0]));
+	leaf->keys[idx] = key;
+	leaf->states[idx] = state;
+	leaf->nr++;
+
+	if (idx == 0 && leaf == path.node[0])
+		rm_update_low_key(rm, &path, 0, key);
+	if (new)
+		rm_insert_child(rm, &path, 1,
+				rm->levels ? path.idx[1] + 1 : 1,
+				new->keys[0], new);
+}
+
+/*
+ * Move @count entries from @src at @sidx to @dst at @didx.  Both nodes must
+ * be at the same level and @dst must have space at @didx.
+ */
+static void
+rm_move(
+	void			*dst,
+	int			didx,
+	void			*src,
+	int			sidx,
+	int			count)
+{
+	struct rm_node		*d = dst;
+	struct rm_node		*s = src;
+
+	if (d->level == 0) {
+		struct rm_leaf	*dl = dst;
+		struct rm_leaf	*sl = src;
+
+		memmove(&dl->keys[didx + count], &dl->keys[didx],
+				(dl->nr - didx) * sizeof(dl->keys[0]));
+		memmove(&dl->states[didx + count], &dl->states[didx],
+				(dl->nr - didx) * sizeof(dl->states[0]));
+		memcpy(&dl->keys[didx], &sl->keys[sidx],
+				count * sizeof(dl->keys[0]));
+		memcpy(&dl->states[didx], &sl->states[sidx],
+				count * sizeof(dl->states[0]));
+		memmove(&sl->keys[sidx], &sl->keys[sidx + count],
+				(sl->nr - sidx - count) * sizeof(sl->keys[0]));
+		memmove(&sl->states[sidx], &sl->states[sidx + count],
+				(sl->nr - sidx - count) * sizeof(sl->states[0]));
+	} else {
+		memmove(&d->keys[didx + count], &d->keys[didx],
+				(d->nr - didx) * sizeof(d->keys[0]));
+		memmove(&d->ptrs[didx + count], &d->ptrs[didx],
+				(d->nr - didx) * sizeof(d->ptrs[0]));
+		memcpy(&d->keys[didx], &s->keys[sidx],
+				count * sizeof(d->keys[0]));
+		memcpy(&d->ptrs[didx], &s->ptrs[sidx],
+				count * sizeof(d->ptrs[0]));
+		memmove(&s->keys[sidx], &s->keys[sidx + count],
+				(s->nr - sidx - count) * sizeof(s->keys[0]));
+		memmove(&s->ptrs[sidx], &s->ptrs[sidx + count],
+				(s->nr - sidx - count) * sizeof(s->ptrs[0]));
+	}
+	d->nr += count;
+	s->nr -= count;
+}
+
+static inline __uint32_t
+rm_low_key(
+	void			*ptr)
+{
+	/* the keys are at the same offset in leaves and interior nodes */
+	return ((struct rm_node *)ptr)->keys[0];
+}
+
+/*
+ * Remove the entry at @idx from the node at @level on the path, then merge
+ * the node with or refill it from a sibling if it became less than half
+ * full.  The caller must update the low keys if @idx is zero.
+ */
+static void
+rm_remove(
+	struct runmap		*rm,
+	struct rm_path		*path,
+	int			level,
+	int			idx)
+{
+	struct rm_node		*node = path->node[level];
+	struct rm_node		*parent;
+	struct rm_node		*left;
+	struct rm_node		*right;
+	int			pidx;
+	int			cap = level ? RM_NODE_RECS : RM_LEAF_RECS;
+	int			min = level ? RM_NODE_MIN : RM_LEAF_MIN;
+
+	if (level == 0) {
+		struct rm_leaf	*leaf = path->node[0];
+
+		memmove(&leaf->keys[idx], &leaf->keys[idx + 1],
+				(leaf->nr - idx - 1) * sizeof(leaf->keys[0]));
+		memmove(&leaf->states[idx], &leaf->states[idx + 1],
+				(leaf->nr - idx - 1) * sizeof(leaf->states[0]));
+	} else {
+		memmove(&node->keys[idx], &node->keys[idx + 1],
+				(node->nr - idx - 1) * sizeof(node->keys[0]));
+		memmove(&node->ptrs[idx], &node->ptrs[idx + 1],
+				(node->nr - idx - 1) * sizeof(node->ptrs[0]));
+	}
+	node->nr--;
+
+	if (level == rm->levels) {
+		/* shrink the tree if the root has a single child left */
+		if (level > 0 && node->nr == 1) {
+			rm->root = node->ptrs[0];
+			rm->levels--;
+			rm_node_free(rm, node);
+		}
+		return;
+	}
+	if (node->nr >= min)
+		return;
+
+	parent = path->node[level + 1];
+	pidx = path->idx[level + 1];
+
+	if (pidx > 0) {
+		left = parent->ptrs[pidx - 1];
+		if (left->nr + node->nr <= cap) {
+			rm_move(left, left->nr, node, 0, node->nr);
+			rm_node_free(rm, node);
+			rm_remove(rm, path, level + 1, pidx);
+			return;
+		}
+		rm_move(node, 0, left, left->nr - 1, 1);
+		parent->keys[pidx] = rm_low_key(node);
+		return;
+	}
+
+	right = parent->ptrs[pidx + 1];
+	if (node->nr + right->nr <= cap) {
+		rm_move(node, node->nr, right, 0, right->nr);
+		rm_node_free(rm, right);
+		rm_remove(rm, path, level + 1, pidx + 1);
+		return;
+	}
+	rm_move(node, node->nr, right, 0, 1);
+	parent->keys[pidx + 1] = rm_low_key(right);
+}
+
+static void
+rm_delete(
+	struct runmap		*rm,
+	__uint32_t		key)
+{
+	struct rm_path		path;
+	struct rm_leaf		*leaf;
+	int			idx;
+
+	idx = rm_lookup(rm, key, &path);
+	leaf = path.node[0];
+	ASSERT(idx >= 0 && leaf->keys[idx] == key);
+
+	/*
+	 * Fix up the low keys before rebalancing, which may free the leaf
+	 * and restructure the path above it.
+	 */
+	if (idx == 0 && leaf->nr > 1)
+		rm_update_low_key(rm, &path, 0, leaf->keys[1]);
+	rm_remove(rm, &path, 0, idx);
+}
+
+void
+runmap_init(
+	struct runmap		**rmp,
+	__uint32_t		agno)
+{
+	struct runmap		*rm;
+
+	rm = calloc(1, sizeof(struct runmap));
+	if (!rm)
+		do_error(_("couldn't allocate block map\n"));
+	rm->agno = agno;
+	rm->root = rm_node_alloc(rm, 0);
+	*rmp = rm;
+}
+
+void
+runmap_destroy(
+	struct runmap		*rm)
+{
+	rm_free_nodes(rm, rm->root);
+	free(rm);
+}
+
+void
+runmap_clear(
+	struct runmap		*rm)
+{
+	rm_free_nodes(rm, rm->root);
+	rm->root = rm_node_alloc(rm, 0);
+	rm->levels = 0;
+}
+
+/*
+ * Add a run starting at @start, which must be beyond all existing runs.
+ */
+void
+runmap_append(
+	struct runmap		*rm,
+	__uint32_t		start,
+	int			state)
+{
+	rm_insert(rm, start, state);
+}
+
+/*
+ * Return the state of @bno and in @len the number of blocks up to @maxbno
+ * that are in the same state.  Returns -1 if @bno is not covered by a run
+ * that has an end, or if no @len is asked for, is beyond the last run.
+ */
+int
+runmap_get(
+	struct runmap		*rm,
+	__uint32_t		bno,
+	__uint32_t		maxbno,
+	__uint32_t		*len)
+{
+	struct rm_path		path;
+	struct rm_leaf		*leaf;
+	__uint32_t		next;
+	int			idx;
+
+	idx = rm_lookup(rm, bno, &path);
+	if (idx < 0)
+		return -1;
+	leaf = path.node[0];
+
+	if (!rm_next_key(rm, &path, &next)) {
+		if (len || leaf->keys[idx] != bno)
+			return -1;
+		return leaf->states[idx];
+	}
+	if (len)
+		*len = MIN(maxbno, next) - bno;
+	return leaf->states[idx];
+}
+
+/*
+ * Set the state of @len blocks from @start.  Runs with the same state on
+ * either side are merged, so that adjacent runs always differ in state.
+ * Ranges that start in the last, open ended run are ignored.
+ */
+void
+runmap_set(
+	struct runmap		*rm,
+	__uint32_t		start,
+	__uint32_t		len,
+	int			state)
+{
+	struct rm_path		path;
+	struct rm_leaf		*leaf;
+	__uint32_t		end = start + len;
+	__uint32_t		next;
+	int			before;
+	int			after;
+	int			idx;
+
+	idx = rm_lookup(rm, start, &path);
+	if (idx < 0 || !rm_next_key(rm, &path, &next))
+		return;
+	leaf = path.node[0];
+
+	/* the whole range is already in the requested state */
+	if (leaf->states[idx] == state && next >= end)
+		return;
+
+	if (leaf->keys[idx] < start)
+		before = leaf->states[idx];
+	else if (start > 0)
+		before = runmap_get(rm, start - 1, start, NULL);
+	else
+		before = -1;
+
+	/* state of the blocks from end onwards */
+	if (next > end) {
+		after = leaf->states[idx];
+	} else {
+		idx = rm_lookup(rm, end, &path);
+		after = ((struct rm_leaf *)path.node[0])->states[idx];
+	}
+
+	/* remove all run boundaries in the range, including one at end */
+	for (;;) {
+		idx = rm_lookup(rm, start, &path);
+		leaf = path.node[0];
+		if (idx < 0 || leaf->keys[idx] < start) {
+			if (!rm_next_key(rm, &path, &next))
+				break;
+		} else {
+			next = leaf->keys[idx];
+		}
+		if (next > end)
+			break;
+		rm_delete(rm, next);
+	}
+
+	if (before != state)
+		rm_insert(rm, start, state);
+	if (after != state)
+		rm_insert(rm, end, after);
+}
+
+unsigned long
+runmap_nodes(
+	struct runmap		*rm)
+{
+	return rm->nodes;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _RUNMAP_H
+#define _RUNMAP_H
+
+/*
+ * A run map records a small state value for every block of a 32 bit block
+ * number space as a sequence of runs.  Each run is stored as just its first
+ * block and its state, the run ends where the next one starts.
+ */
+struct runmap;
+
+void
+runmap_init(
+	struct runmap		**rmp,
+	__uint32_t		agno);
+
+void
+runmap_destroy(
+	struct runmap		*rm);
+
+void
+runmap_clear(
+	struct runmap		*rm);
+
+void
+runmap_append(
+	struct runmap		*rm,
+	__uint32_t		start,
+	int			state);
+
+void
+runmap_set(
+	struct runmap		*rm,
+	__uint32_t		start,
+	__uint32_t		len,
+	int			state);
+
+int
+runmap_get(
+	struct runmap		*rm,
+	__uint32_t		bno,
+	__uint32_t		maxbno,
+	__uint32_t		*len);
+
+unsigned long
+runmap_nodes(
+	struct runmap		*rm);
+
+#endif /* _RUNMAP_H */
@@ -23,10 +23,14 @@
 #include "protos.h"
 #include "err_protos.h"
 
-#define BSIZE	(1024 * 1024)
-
 #define XFS_AG_BYTES(bblog)	((long long)BBSIZE << (bblog))
 #define	XFS_AG_MIN_BYTES	((XFS_AG_BYTES(15)))	/* 16 MB */
+#define	XFS_AG_MAX_BYTES	((XFS_AG_BYTES(31)) - 1)	/* 1 TB */
+
+#define SB_PROBE_AGS		2	/* AGs after the first to look at */
+#define SB_PROBE_MAX		32	/* 8 block sizes, 2 ways, 2 AGs */
+#define SB_SCAN_IOSIZE		(8 * 1024 * 1024)
+#define SB_SCAN_THREADS		8	/* reads in flight */
 
 /*
  * copy the fields of a superblock that are present in primary and
@@ -85,88 +89,249 @@ copy_sb(xfs_sb_t *source, xfs_sb_t *dest)
 }
 
 /*
- * find a secondary superblock, copy it into the sb buffer
+ * Is the sector at buf a plausible secondary superblock?  If so, it's
+ * unpacked into sb.
  */
-int
-find_secondary_sb(xfs_sb_t *rsb)
+static int
+sb_candidate(
+	char		*buf,
+	xfs_sb_t	*sb)
+{
+	if (((xfs_dsb_t *)buf)->sb_magicnum != cpu_to_be32(XFS_SB_MAGIC))
+		return 0;
+	memset(sb, 0, sizeof(xfs_sb_t));
+	libxfs_sb_from_disk(sb, (xfs_dsb_t *)buf);
+	libxfs_sb_quota_from_disk(sb);
+	return verify_sb(buf, sb, 0) == XR_OK;
+}
+
+/*
+ * found one.  now verify it by looking for other secondaries, and if
+ * they agree, copy it into rsb.  returns 1 if the candidate checked out.
+ */
+static int
+check_secondary_sb(
+	xfs_sb_t	*sb,
+	xfs_sb_t	*rsb)
+{
+	int		dirty = 0;
+
+	do_warn(_("found candidate secondary superblock...\n"));
+
+	memmove(rsb, sb, sizeof(xfs_sb_t));
+	rsb->sb_inprogress = 0;
+	copied_sunit = 1;
+
+	if (verify_set_primary_sb(rsb, 0, &dirty) == XR_OK)  {
+		do_warn(_("verified secondary superblock...\n"));
+		return 1;
+	}
+	do_warn(_("unable to verify superblock, continuing...\n"));
+	return 0;
+}
+
+/*
+ * The AG size in bytes mkfs would have picked for a filesystem with this
+ * block size filling the dbytes long device, following the rules of
+ * calc_default_ag_geometry().
+ */
+static __uint64_t
+guess_agsize(
+	__uint64_t	dbytes,
+	int		blocklog,
+	int		multidisk)
 {
+	__uint64_t	dblocks = dbytes >> blocklog;
+	__uint64_t	maxblocks = XFS_AG_MAX_BYTES >> blocklog;
+	__uint64_t	blocks;
+	int		shift;
+
+	if (dbytes >= (32ULL << 40) || (!multidisk && dbytes >= (4ULL << 40)))
+		return maxblocks << blocklog;
+
+	if (!multidisk && dbytes >= (128ULL << 20))
+		shift = 2;
+	else if (dbytes > (512ULL << 30))
+		shift = 5;
+	else if (dbytes > (8ULL << 30))
+		shift = 4;
+	else if (dbytes >= (128ULL << 20))
+		shift = 3;
+	else if (dbytes >= (64ULL << 20))
+		shift = 2;
+	else if (dbytes >= (32ULL << 20))
+		shift = 1;
+	else
+		shift = 0;
+
+	blocks = dblocks >> shift;
+	if ((dblocks & ((1ULL << shift) - 1)) && blocks < maxblocks)
+		blocks++;
+	return blocks << blocklog;
+}
+
+/*
+ * Most filesystems were made with mkfs's default AG size for the whole
+ * device, so before scanning the lot look where the second and third AGs
+ * would start for each block size, single disk or striped.
+ */
+static int
+probe_secondary_sb(
+	xfs_sb_t	*rsb,
+	char		*buf,
+	__uint64_t	dbytes)
+{
+	static const int blocklogs[] = { 12, 13, 14, 15, 16, 11, 10, 9 };
+	xfs_off_t	offs[SB_PROBE_MAX];
 	xfs_off_t	off;
-	xfs_sb_t	*sb;
 	xfs_sb_t	bufsb;
-	char		*c_bufsb;
+	__uint64_t	agbytes;
+	int		noffs = 0;
+	int		b, i, j, k;
+
+	for (b = 0; b < ARRAY_SIZE(blocklogs); b++) {
+		for (i = 0; i < 2; i++) {
+			agbytes = guess_agsize(dbytes, blocklogs[b], i);
+			for (k = 1; k <= SB_PROBE_AGS; k++) {
+				off = agbytes * k;
+				if (off < XFS_AG_MIN_BYTES ||
+				    off + XFS_MAX_SECTORSIZE > dbytes)
+					break;
+				for (j = 0; j < noffs && offs[j] != off; j++)
+					;
+				if (j == noffs && noffs < SB_PROBE_MAX)
+					offs[noffs++] = off;
+			}
+		}
+	}
+
+	for (i = 0; i < noffs; i++) {
+		if (libxfs_device_pread(x.dfd, buf, XFS_MAX_SECTORSIZE,
+					offs[i]) != XFS_MAX_SECTORSIZE)
+			continue;
+		libxfs_iostats_add(0, XFS_MAX_SECTORSIZE);
+		if (sb_candidate(buf, &bufsb) &&
+		    check_secondary_sb(&bufsb, rsb))
+			return 1;
+	}
+	return 0;
+}
+
+struct sb_scan {
+	pthread_mutex_t	lock;
+	xfs_off_t	next;		/* next offset to read */
 	int		done;
-	int		i;
-	int		dirty;
-	int		retval;
-	int		bsize;
+	int		found;
+	xfs_sb_t	*rsb;
+};
 
-	do_warn(_("\nattempting to find secondary superblock...\n"));
+/*
+ * Read the device SB_SCAN_IOSIZE bytes at a time, taking the next piece
+ * that nobody has read yet each time, and check it 512 bytes at a time
+ * since we don't know how big the sectors really are.  Candidates are
+ * verified one at a time under the lock, and the first one to check out
+ * stops everybody.
+ */
+static void *
+scan_secondary_sb(
+	void		*arg)
+{
+	struct sb_scan	*scan = arg;
+	xfs_sb_t	bufsb;
+	xfs_off_t	off;
+	char		*buf;
+	ssize_t		bsize;
+	int		i;
 
-	sb = (xfs_sb_t *)memalign(libxfs_device_alignment(), BSIZE);
-	if (!sb) {
+	buf = memalign(libxfs_device_alignment(), SB_SCAN_IOSIZE);
+	if (!buf)
 		do_error(
 	_("error finding secondary superblock -- failed to memalign buffer\n"));
-		exit(1);
-	}
 
-	memset(&bufsb, 0, sizeof(xfs_sb_t));
-	retval = 0;
-	dirty = 0;
-	bsize = 0;
-
-	/*
-	 * skip first sector since we know that's bad
-	 */
-	for (done = 0, off = XFS_AG_MIN_BYTES; !done ; off += bsize)  {
-		/*
-		 * read disk 1 MByte at a time.
-		 */
-		if (lseek64(x.dfd, off, SEEK_SET) != off)  {
-			done = 1;
-		}
-
-		if (!done && (bsize = read(x.dfd, sb, BSIZE)) <= 0)  {
-			done = 1;
+	for (;;) {
+		pthread_mutex_lock(&scan->lock);
+		off = scan->next;
+		scan->next += SB_SCAN_IOSIZE;
+		i = scan->done;
+		pthread_mutex_unlock(&scan->lock);
+		if (i)
+			break;
+
+		bsize = libxfs_device_pread(x.dfd, buf, SB_SCAN_IOSIZE, off);
+		if (bsize <= 0) {
+			/* the end of the device, or a read error */
+			pthread_mutex_lock(&scan->lock);
+			scan->done = 1;
+			pthread_mutex_unlock(&scan->lock);
+			break;
 		}
+		libxfs_iostats_add(0, bsize);
 
 		do_warn(".");
 
-		/*
-		 * check the buffer 512 bytes at a time since
-		 * we don't know how big the sectors really are.
-		 */
-		for (i = 0; !done && i < bsize; i += BBSIZE)  {
-			c_bufsb = (char *)sb + i;
-			libxfs_sb_from_disk(&bufsb, (xfs_dsb_t *)c_bufsb);
-			libxfs_sb_quota_from_disk(&bufsb);
-
-			if (verify_sb(c_bufsb, &bufsb, 0) != XR_OK)
+		for (i = 0; i < bsize; i += BBSIZE)  {
+			if (!sb_candidate(buf + i, &bufsb))
 				continue;
+			pthread_mutex_lock(&scan->lock);
+			if (!scan->done && check_secondary_sb(&bufsb,
+							       scan->rsb)) {
+				scan->done = 1;
+				scan->found = 1;
+			}
+			pthread_mutex_unlock(&scan->lock);
+		}
+	}
 
-			do_warn(_("found candidate secondary superblock...\n"));
+	free(buf);
+	return NULL;
+}
 
-			/*
-			 * found one.  now verify it by looking
-			 * for other secondaries.
-			 */
-			memmove(rsb, &bufsb, sizeof(xfs_sb_t));
-			rsb->sb_inprogress = 0;
-			copied_sunit = 1;
+/*
+ * find a secondary superblock, copy it into the sb buffer
+ */
+int
+find_secondary_sb(xfs_sb_t *rsb)
+{
+	struct sb_scan	scan;
+	pthread_t	tids[SB_SCAN_THREADS];
+	char		*buf;
+	int		nthreads;
+	int		i;
 
-			if (verify_set_primary_sb(rsb, 0, &dirty) == XR_OK)  {
-				do_warn(
-			_("verified secondary superblock...\n"));
-				done = 1;
-				retval = 1;
-			} else  {
-				do_warn(
-			_("unable to verify superblock, continuing...\n"));
-			}
-		}
+	do_warn(_("\nattempting to find secondary superblock...\n"));
+
+	buf = memalign(libxfs_device_alignment(), XFS_MAX_SECTORSIZE);
+	if (!buf) {
+		do_error(
+	_("error finding secondary superblock -- failed to memalign buffer\n"));
+		exit(1);
+	}
+	i = probe_secondary_sb(rsb, buf, (__uint64_t)x.dsize << BBSHIFT);
+	free(buf);
+	if (i)
+		return 1;
+
+	/*
+	 * No luck, so scan the whole device with several reads in flight,
+	 * skipping the first AG's worth since we know that's bad.
+	 */
+	memset(&scan, 0, sizeof(scan));
+	pthread_mutex_init(&scan.lock, NULL);
+	scan.next = XFS_AG_MIN_BYTES;
+	scan.rsb = rsb;
+
+	for (nthreads = 0; nthreads < SB_SCAN_THREADS; nthreads++) {
+		if (pthread_create(&tids[nthreads], NULL, scan_secondary_sb,
+				   &scan))
+			break;
 	}
+	if (!nthreads)
+		scan_secondary_sb(&scan);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&scan.lock);
 
-	free(sb);
-	return(retval);
+	return scan.found;
 }
 
 /*
@@ -459,6 +624,7 @@ write_primary_sb(xfs_sb_t *sbp, int size)
 		free(buf);
 		do_error(_("primary superblock write failed!\n"));
 	}
+	libxfs_iostats_add(1, size);
 
 	free(buf);
 }
@@ -484,21 +650,14 @@ get_sb(xfs_sb_t *sbp, xfs_off_t off, int size, xfs_agnumber_t agno)
 
 	/* try and read it first */
 
-	if (lseek64(x.dfd, off, SEEK_SET) != off)  {
-		do_warn(
-	_("error reading superblock %u -- seek to offset %" PRId64 " failed\n"),
-			agno, off);
-		free(buf);
-		return(XR_EOF);
-	}
-
-	if ((rval = read(x.dfd, buf, size)) != size)  {
+	if ((rval = libxfs_device_pread(x.dfd, buf, size, off)) != size)  {
 		error = errno;
 		do_warn(
 	_("superblock read failed, offset %" PRId64 ", size %d, ag %u, rval %d\n"),
 			off, size, agno, rval);
 		do_error("%s\n", strerror(error));
 	}
+	libxfs_iostats_add(0, size);
 	libxfs_sb_from_disk(sbp, buf);
 	libxfs_sb_quota_from_disk(sbp);
 
@@ -600,6 +759,47 @@ get_sb_geometry(fs_geometry_t *geo, xfs_sb_t *sbp)
 	geo->sb_fully_zeroed = 1;
 }
 
+struct sb_verify {
+	xfs_sb_t	*rsb;
+	int		size;
+	atomic_t	next;		/* next AG to read */
+	atomic_t	eof;		/* first AG that hit XR_EOF */
+	int		*status;	/* per AG, from get_sb */
+	fs_geometry_t	*geo;		/* per AG, if status is XR_OK */
+};
+
+/*
+ * Read the secondary superblocks, each thread taking the next AG nobody
+ * has read yet, and record each one's geometry for verify_set_primary_sb
+ * to count up in AG order.  Nothing past an AG that hit the end of the
+ * device is needed.
+ */
+static void *
+read_secondary_sbs(
+	void		*arg)
+{
+	struct sb_verify *sv = arg;
+	xfs_sb_t	*sb;
+	xfs_off_t	off;
+	xfs_agnumber_t	agno;
+
+	sb = (xfs_sb_t *)alloc_ag_buf(sv->size);
+	while ((agno = atomic_inc_return(&sv->next) - 1) <
+						sv->rsb->sb_agcount) {
+		if (agno > atomic_read(&sv->eof))
+			break;
+		off = (xfs_off_t)agno * sv->rsb->sb_agblocks <<
+						sv->rsb->sb_blocklog;
+		sv->status[agno] = get_sb(sb, off, sv->size, agno);
+		if (sv->status[agno] == XR_EOF)
+			atomic_min(&sv->eof, agno);
+		else if (sv->status[agno] == XR_OK)
+			get_sb_geometry(&sv->geo[agno], sb);
+	}
+	free(sb);
+	return NULL;
+}
+
 /*
  * the way to verify that a primary sb is consistent with the
  * filesystem is find the secondaries given the info in the
@@ -618,11 +818,15 @@ verify_set_primary_sb(xfs_sb_t		*rsb,
 	xfs_sb_t	*sb;
 	fs_geo_list_t	*list;
 	fs_geo_list_t	*current;
+	struct sb_verify sv;
+	pthread_t	tids[SB_SCAN_THREADS];
 	xfs_agnumber_t	agno;
+	int		nthreads;
 	int		num_sbs;
 	int		size;
 	int		num_ok;
 	int		retval;
+	int		i;
 
 	/*
 	 * We haven't been able to validate the sector size yet properly
@@ -645,13 +849,32 @@ verify_set_primary_sb(xfs_sb_t		*rsb,
 	list = add_geo(list, &geo, sb_index);
 
 	/*
-	 * scan the secondaries and check them off as we get them so we only
-	 * process each one once
+	 * read the secondaries with several reads in flight, then check
+	 * them off in AG order so we only process each one once
 	 */
-	for (agno = 1; agno < rsb->sb_agcount; agno++) {
-		off = (xfs_off_t)agno * rsb->sb_agblocks << rsb->sb_blocklog;
+	memset(&sv, 0, sizeof(sv));
+	sv.rsb = rsb;
+	sv.size = size;
+	atomic_set(&sv.next, 1);
+	atomic_set(&sv.eof, rsb->sb_agcount);
+	sv.status = calloc(rsb->sb_agcount, sizeof(int));
+	sv.geo = calloc(rsb->sb_agcount, sizeof(fs_geometry_t));
+	if (!sv.status || !sv.geo)
+		do_error(_("couldn't allocate superblock geometry list\n"));
+
+	for (nthreads = 0; nthreads < SB_SCAN_THREADS &&
+			   nthreads < rsb->sb_agcount - 1; nthreads++) {
+		if (pthread_create(&tids[nthreads], NULL, read_secondary_sbs,
+				   &sv))
+			break;
+	}
+	if (!nthreads)
+		read_secondary_sbs(&sv);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
 
-		retval = get_sb(sb, off, size, agno);
+	for (agno = 1; agno < rsb->sb_agcount; agno++) {
+		retval = sv.status[agno];
 		if (retval == XR_EOF)
 			goto out_free_list;
 
@@ -663,8 +886,7 @@ verify_set_primary_sb(xfs_sb_t		*rsb,
 			 * but not consistent with the rest of the filesystem is
 			 * really really low.
 			 */
-			get_sb_geometry(&geo, sb);
-			list = add_geo(list, &geo, agno);
+			list = add_geo(list, &sv.geo[agno], agno);
 			num_ok++;
 		}
 	}
@@ -760,6 +982,8 @@ verify_set_primary_sb(xfs_sb_t		*rsb,
 
 out_free_list:
 	free_geo(list);
+	free(sv.status);
+	free(sv.geo);
 	free(sb);
 	return retval;
 }
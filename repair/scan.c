@@ -306,12 +306,14 @@ _("bad back (left) sibling pointer (saw %llu should be NULL (0))\n"
 		agbno = XFS_FSB_TO_AGBNO(mp, bno);
 
 		pthread_mutex_lock(&ag_locks[agno].lock);
+		wait_for_ag_scan_locked(agno);
 		state = get_bmap(agno, agbno);
 		switch (state) {
 		case XR_E_UNKNOWN:
 		case XR_E_FREE1:
 		case XR_E_FREE:
 			set_bmap(agno, agbno, XR_E_INUSE);
+			chunk_digest_add(agno, agbno, 1);
 			break;
 		case XR_E_FS_MAP:
 		case XR_E_INUSE:
@@ -1587,6 +1589,34 @@ validate_agi(
 	}
 }
 
+static xfs_agnumber_t	scan_ra_ags;	/* AGs of headers read ahead */
+
+/*
+ * Start reading the superblock, AGF, AGFL and AGI of an AG, so that they
+ * are in the cache by the time a scan thread gets to it.  The readahead
+ * threads issue them in batches rather than one sector at a time.
+ */
+static void
+scan_ag_readahead(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno)
+{
+	if (agno >= mp->m_sb.sb_agcount)
+		return;
+	libxfs_buf_readahead(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+			XFS_FSS_TO_BB(mp, 1), &xfs_sb_buf_ops);
+	libxfs_buf_readahead(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), &xfs_agf_buf_ops);
+	libxfs_buf_readahead(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), &xfs_agfl_buf_ops);
+	libxfs_buf_readahead(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), &xfs_agi_buf_ops);
+}
+
 /*
  * Scan an AG for obvious corruption.
  */
@@ -1609,6 +1639,9 @@ scan_ag(
 	int		status;
 	char		*objname = NULL;
 
+	/* AGs are queued in order, keep the headers ahead of the scans */
+	scan_ag_readahead(mp, agno + scan_ra_ags);
+
 	sb = (struct xfs_sb *)calloc(BBTOB(XFS_FSS_TO_BB(mp, 1)), 1);
 	if (!sb) {
 		do_error(_("can't allocate memory for superblock\n"));
@@ -1728,7 +1761,8 @@ scan_ag(
 	} else
 		libxfs_putbuf(sbbuf);
 	free(sb);
-	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	if (!scan_overlap)
+		PROG_RPT_INC(prog_rpt_done[agno], 1);
 
 #ifdef XR_INODE_TRACE
 	print_inode_list(i);
@@ -1750,31 +1784,73 @@ out_free_sb:
 
 #define SCAN_THREADS 32
 
+static work_queue_t	scan_wq;
+static struct aghdr_cnts *scan_agcnts;
+static void		(*scan_done_func)(struct xfs_mount *, xfs_agnumber_t);
+
+static void
+scan_ag_overlap(
+	work_queue_t	*wq,
+	xfs_agnumber_t	agno,
+	void		*arg)
+{
+	scan_ag(wq, agno, arg);
+	scan_done_func(wq->mp, agno);
+	ag_scan_done(agno);
+}
+
+/*
+ * Queue the scans of all AGs.  If done_func is given, it is called for each
+ * AG as soon as that AG has been scanned, and then anybody waiting for the
+ * AG in wait_for_ag_scan() is woken up.
+ */
 void
-scan_ags(
+scan_ags_start(
 	struct xfs_mount	*mp,
-	int			scan_threads)
+	int			scan_threads,
+	void			(*done_func)(struct xfs_mount *,
+					     xfs_agnumber_t))
 {
-	struct aghdr_cnts *agcnts;
-	__uint64_t	fdblocks = 0;
-	__uint64_t	icount = 0;
-	__uint64_t	ifreecount = 0;
 	xfs_agnumber_t	i;
-	work_queue_t	wq;
 
-	agcnts = malloc(mp->m_sb.sb_agcount * sizeof(*agcnts));
-	if (!agcnts) {
+	scan_agcnts = calloc(mp->m_sb.sb_agcount, sizeof(*scan_agcnts));
+	if (!scan_agcnts) {
 		do_abort(_("no memory for ag header counts\n"));
 		return;
 	}
-	memset(agcnts, 0, mp->m_sb.sb_agcount * sizeof(*agcnts));
+	scan_done_func = done_func;
+
+	create_work_queue(&scan_wq, mp, scan_threads);
 
-	create_work_queue(&wq, mp, scan_threads);
+	scan_ra_ags = 2 * max(scan_threads, 1);
+	for (i = 0; i < scan_ra_ags; i++)
+		scan_ag_readahead(mp, i);
+
+	/* mark them all busy before anyone can look, see wait_for_ag_scan */
+	for (i = 0; done_func && i < mp->m_sb.sb_agcount; i++)
+		ag_locks[i].scanning = 1;
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, scan_ag, i, &agcnts[i]);
+		queue_work(&scan_wq, done_func ? scan_ag_overlap : scan_ag,
+			   i, &scan_agcnts[i]);
+}
+
+/*
+ * Wait for all the AG scans and check the summary counters against the
+ * superblock.
+ */
+void
+scan_ags_finish(
+	struct xfs_mount	*mp)
+{
+	struct aghdr_cnts *agcnts = scan_agcnts;
+	__uint64_t	fdblocks = 0;
+	__uint64_t	icount = 0;
+	__uint64_t	ifreecount = 0;
+	xfs_agnumber_t	i;
 
-	destroy_work_queue(&wq);
+	destroy_work_queue(&scan_wq);
+	scan_agcnts = NULL;
 
 	/* tally up the counts */
 	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
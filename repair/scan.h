@@ -20,6 +20,8 @@
 
 struct blkmap;
 
+void set_mp(xfs_mount_t *mpp);
+
 int scan_lbtree(
 	xfs_fsblock_t	root,
 	int		nlevels,
@@ -66,8 +68,14 @@ int scan_bmapbt(
 	__uint64_t		magic);
 
 void
-scan_ags(
+scan_ags_start(
 	struct xfs_mount	*mp,
-	int			scan_threads);
+	int			scan_threads,
+	void			(*done_func)(struct xfs_mount *,
+					     xfs_agnumber_t));
+
+void
+scan_ags_finish(
+	struct xfs_mount	*mp);
 
 #endif /* _XR_SCAN_H */
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include <sys/mman.h>
+#include "globals.h"
+#include "scratch.h"
+#include "err_protos.h"
+
+/*
+ * The scratch file is mapped shared in regions of SCRATCH_REGION_SIZE
+ * bytes, and each region is handed out to the AG arenas in chunks of
+ * SCRATCH_CHUNK_SIZE bytes.  A chunk only holds objects of one size class
+ * and starts with a small header naming the arena that owns it, so freeing
+ * an object only needs its size.  Space in the file is allocated up front
+ * for each region so running out of it is an error rather than a SIGBUS.
+ *
+ * Dirty pages of a shared file mapping can be written back and reclaimed
+ * like any other page cache, and once an AG has been processed its arena
+ * is unmapped from our address space with scratch_release() so that only
+ * the AGs being worked on stay resident.
+ */
+#define SCRATCH_CHUNK_SHIFT	16
+#define SCRATCH_CHUNK_SIZE	(1UL << SCRATCH_CHUNK_SHIFT)
+#define SCRATCH_REGION_SIZE	(64UL << 20)
+
+#define SCRATCH_OBJ_SHIFT	4
+#define SCRATCH_MAX_OBJ		512
+#define SCRATCH_NR_CLASSES	(SCRATCH_MAX_OBJ >> SCRATCH_OBJ_SHIFT)
+
+struct scratch_chunk {
+	struct scratch_chunk	*next;		/* arena chunk list */
+	xfs_agnumber_t		agno;		/* owning arena */
+};
+
+struct scratch_class {
+	void			*free;		/* freed objects */
+	char			*next;		/* next unused object */
+	char			*end;		/* end of current chunk */
+};
+
+struct scratch_arena {
+	pthread_mutex_t		lock;
+	struct scratch_chunk	*chunks;
+	struct scratch_class	classes[SCRATCH_NR_CLASSES];
+};
+
+int			scratch_active;
+
+static pthread_mutex_t	scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		scratch_fd = -1;
+static off_t		scratch_size;		/* bytes of file mapped */
+static char		*scratch_next;		/* unused chunks of last region */
+static char		*scratch_end;
+static struct scratch_arena *scratch_arenas;
+static xfs_agnumber_t	scratch_agcount;
+
+static inline struct scratch_chunk *
+scratch_chunk_of(
+	void			*ptr)
+{
+	return (struct scratch_chunk *)
+		((uintptr_t)ptr & ~(SCRATCH_CHUNK_SIZE - 1));
+}
+
+static inline int
+scratch_class(
+	size_t			size)
+{
+	return (size + (1 << SCRATCH_OBJ_SHIFT) - 1) >> SCRATCH_OBJ_SHIFT;
+}
+
+/*
+ * Grow the file by a region and map it at a chunk aligned address.
+ * Called with scratch_lock held.
+ */
+static void
+scratch_map_region(void)
+{
+	size_t			len = SCRATCH_REGION_SIZE;
+	char			*resv;
+	char			*addr;
+	int			error;
+
+	error = posix_fallocate(scratch_fd, scratch_size, len);
+	if (error)
+		do_error(_("couldn't grow scratch file to %lld bytes: %s\n"),
+			(long long)(scratch_size + len), strerror(error));
+
+	/*
+	 * Reserve enough address space to align the region to a chunk,
+	 * then map the file over the aligned part and drop the rest.
+	 */
+	resv = mmap(NULL, len + SCRATCH_CHUNK_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (resv == MAP_FAILED)
+		do_error(_("couldn't reserve scratch file mapping: %s\n"),
+			strerror(errno));
+	addr = (char *)roundup((uintptr_t)resv, SCRATCH_CHUNK_SIZE);
+	if (mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			scratch_fd, scratch_size) == MAP_FAILED)
+		do_error(_("couldn't map scratch file: %s\n"), strerror(errno));
+	if (addr > resv)
+		munmap(resv, addr - resv);
+	munmap(addr + len, resv + SCRATCH_CHUNK_SIZE - addr);
+
+	scratch_size += len;
+	scratch_next = addr;
+	scratch_end = addr + len;
+}
+
+static struct scratch_chunk *
+scratch_chunk_alloc(
+	struct scratch_arena	*arena,
+	xfs_agnumber_t		agno)
+{
+	struct scratch_chunk	*chunk;
+
+	pthread_mutex_lock(&scratch_lock);
+	if (scratch_next == scratch_end)
+		scratch_map_region();
+	chunk = (struct scratch_chunk *)scratch_next;
+	scratch_next += SCRATCH_CHUNK_SIZE;
+	pthread_mutex_unlock(&scratch_lock);
+
+	chunk->agno = agno;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk;
+}
+
+void
+scratch_init(
+	char			*dir,
+	xfs_agnumber_t		agcount)
+{
+	char			*path;
+	xfs_agnumber_t		agno;
+
+	path = malloc(strlen(dir) + sizeof("/xfs_repair.XXXXXX"));
+	if (!path)
+		do_error(_("couldn't allocate scratch file name\n"));
+	sprintf(path, "%s/xfs_repair.XXXXXX", dir);
+	scratch_fd = mkstemp(path);
+	if (scratch_fd < 0)
+		do_error(_("couldn't create scratch file in %s: %s\n"),
+			dir, strerror(errno));
+	/* nobody else needs to see it, and it goes away when we exit */
+	unlink(path);
+	free(path);
+
+	scratch_arenas = calloc(agcount, sizeof(struct scratch_arena));
+	if (!scratch_arenas)
+		do_error(_("couldn't allocate scratch arenas\n"));
+	for (agno = 0; agno < agcount; agno++)
+		pthread_mutex_init(&scratch_arenas[agno].lock, NULL);
+	scratch_agcount = agcount;
+	scratch_active = 1;
+
+	if (verbose)
+		do_log(_("        - using scratch file in %s\n"), dir);
+}
+
+void *
+scratch_alloc(
+	xfs_agnumber_t		agno,
+	size_t			size)
+{
+	struct scratch_arena	*arena;
+	struct scratch_class	*class;
+	size_t			osize;
+	char			*ptr;
+
+	if (!scratch_active || size > SCRATCH_MAX_OBJ)
+		return calloc(1, size);
+
+	ASSERT(agno < scratch_agcount);
+	arena = &scratch_arenas[agno];
+	class = &arena->classes[scratch_class(size) - 1];
+	osize = scratch_class(size) << SCRATCH_OBJ_SHIFT;
+
+	pthread_mutex_lock(&arena->lock);
+	if (class->free) {
+		ptr = class->free;
+		class->free = *(void **)ptr;
+	} else {
+		if (!class->next || class->next + osize > class->end) {
+			class->next = (char *)scratch_chunk_alloc(arena, agno);
+			class->end = class->next + SCRATCH_CHUNK_SIZE;
+			class->next += roundup(sizeof(struct scratch_chunk),
+						osize);
+		}
+		ptr = class->next;
+		class->next += osize;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	memset(ptr, 0, osize);
+	return ptr;
+}
+
+/*
+ * Allocate from the same arena as an object allocated earlier, e.g. for
+ * the arrays hanging off an inode record.
+ */
+void *
+scratch_alloc_near(
+	void			*obj,
+	size_t			size)
+{
+	if (!scratch_active)
+		return calloc(1, size);
+	return scratch_alloc(scratch_chunk_of(obj)->agno, size);
+}
+
+void
+scratch_free(
+	void			*ptr,
+	size_t			size)
+{
+	struct scratch_arena	*arena;
+	struct scratch_class	*class;
+
+	if (!scratch_active || size > SCRATCH_MAX_OBJ) {
+		free(ptr);
+		return;
+	}
+	if (!ptr)
+		return;
+
+	arena = &scratch_arenas[scratch_chunk_of(ptr)->agno];
+	class = &arena->classes[scratch_class(size) - 1];
+
+	pthread_mutex_lock(&arena->lock);
+	*(void **)ptr = class->free;
+	class->free = ptr;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * We're done with this AG for now, so let its pages go.  The contents stay
+ * in the file and are faulted back in when the AG is next looked at.
+ */
+void
+scratch_release(
+	xfs_agnumber_t		agno)
+{
+	struct scratch_arena	*arena;
+	struct scratch_chunk	*chunk;
+
+	if (!scratch_active)
+		return;
+
+	arena = &scratch_arenas[agno];
+	pthread_mutex_lock(&arena->lock);
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		madvise(chunk, SCRATCH_CHUNK_SIZE, MADV_DONTNEED);
+	pthread_mutex_unlock(&arena->lock);
+}
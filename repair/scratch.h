@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Red Hat, Inc.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _SCRATCH_H
+#define _SCRATCH_H
+
+/*
+ * Scratch file backed memory for the per-AG incore state.  When a scratch
+ * directory is given, inode records and block map nodes are allocated from
+ * a file mapping instead of the heap, one arena per AG, so the kernel can
+ * write them back to the file and drop them instead of running out of
+ * memory.  Without a scratch directory these fall back to the heap.
+ */
+extern int	scratch_active;
+
+void
+scratch_init(
+	char			*dir,
+	xfs_agnumber_t		agcount);
+
+void *
+scratch_alloc(
+	xfs_agnumber_t		agno,
+	size_t			size);
+
+void *
+scratch_alloc_near(
+	void			*obj,
+	size_t			size);
+
+void
+scratch_free(
+	void			*ptr,
+	size_t			size);
+
+void
+scratch_release(
+	xfs_agnumber_t		agno);
+
+#endif /* _SCRATCH_H */
@@ -5,46 +5,240 @@
 #include "err_protos.h"
 #include "protos.h"
 #include "globals.h"
+#include "metrics.h"
+
+static pthread_key_t	worker_key;
+static pthread_key_t	numa_key;	/* node the thread is bound to, + 1 */
+static pthread_once_t	worker_key_once = PTHREAD_ONCE_INIT;
+
+int			numa_nodes;
+static xfs_agnumber_t	numa_agcount;
+static pthread_mutex_t	numa_lock = PTHREAD_MUTEX_INITIALIZER;
+static __uint64_t	numa_items_run;
+static __uint64_t	numa_items_remote;
+
+static void
+worker_key_init(void)
+{
+	pthread_key_create(&worker_key, NULL);
+	pthread_key_create(&numa_key, NULL);
+}
+
+void
+numa_init(
+	xfs_agnumber_t	agcount)
+{
+	int		nodes;
+
+	pthread_once(&worker_key_once, worker_key_init);
+	nodes = platform_numa_nodes();
+	if (nodes < 2) {
+		do_warn(_("only one NUMA node found, ignoring -o numa\n"));
+		return;
+	}
+	numa_nodes = nodes;
+	numa_agcount = agcount;
+	if (verbose)
+		do_log(_("        - placing AGs on %d NUMA nodes\n"), nodes);
+}
+
+int
+numa_ag_node(
+	xfs_agnumber_t	agno)
+{
+	if (!numa_nodes)
+		return 0;
+	return (__uint64_t)agno * numa_nodes / numa_agcount;
+}
+
+static void
+numa_bind_node(
+	int		node)
+{
+	intptr_t	cur;
+
+	cur = (intptr_t)pthread_getspecific(numa_key) - 1;
+	if (cur == node)
+		return;
+	if (platform_numa_bind(node) == 0)
+		pthread_setspecific(numa_key, (void *)(intptr_t)(node + 1));
+}
+
+/*
+ * Run the calling thread on the node of the AG it is about to work on, so
+ * that the AG's incore state and buffers are allocated there.
+ */
+void
+numa_bind_ag(
+	xfs_agnumber_t	agno)
+{
+	if (numa_nodes)
+		numa_bind_node(numa_ag_node(agno));
+}
+
+void
+numa_report(void)
+{
+	if (!numa_nodes)
+		return;
+	do_log(
+_("        - numa: %" PRIu64 " work items, %" PRIu64 " stolen across nodes\n"),
+		numa_items_run, numa_items_remote);
+}
+
+/*
+ * The owner of a deque takes work from the head, in the order it was
+ * queued, and thieves take it from the tail so they stay out of its way.
+ */
+static void
+deque_push(
+	work_deque_t	*dq,
+	work_item_t	*wi)
+{
+	pthread_mutex_lock(&dq->lock);
+	wi->next = NULL;
+	wi->prev = dq->tail;
+	if (dq->tail)
+		dq->tail->next = wi;
+	else
+		dq->head = wi;
+	dq->tail = wi;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static work_item_t *
+deque_pop(
+	work_deque_t	*dq)
+{
+	work_item_t	*wi;
+
+	pthread_mutex_lock(&dq->lock);
+	wi = dq->head;
+	if (wi) {
+		dq->head = wi->next;
+		if (dq->head)
+			dq->head->prev = NULL;
+		else
+			dq->tail = NULL;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return wi;
+}
+
+static work_item_t *
+deque_steal(
+	work_deque_t	*dq)
+{
+	work_item_t	*wi;
+
+	pthread_mutex_lock(&dq->lock);
+	wi = dq->tail;
+	if (wi) {
+		dq->tail = wi->prev;
+		if (dq->tail)
+			dq->tail->next = NULL;
+		else
+			dq->head = NULL;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return wi;
+}
+
+/*
+ * Take work from our own deque, or failing that steal it, from workers on
+ * the same node first.
+ */
+static work_item_t *
+get_work(
+	work_deque_t	*dq,
+	int		*remote)
+{
+	work_queue_t	*wq = dq->queue;
+	int		self = dq - wq->deques;
+	work_deque_t	*victim;
+	work_item_t	*wi;
+	int		pass;
+	int		i;
+
+	*remote = 0;
+	wi = deque_pop(dq);
+	for (pass = 0; wi == NULL && pass < 2; pass++) {
+		for (i = 1; wi == NULL && i < wq->thread_count; i++) {
+			victim = &wq->deques[(self + i) % wq->thread_count];
+			if ((victim->node == dq->node) == pass)
+				continue;
+			wi = deque_steal(victim);
+			if (wi && pass)
+				*remote = 1;
+		}
+	}
+	return wi;
+}
 
 static void *
 worker_thread(void *arg)
 {
+	work_deque_t	*dq;
 	work_queue_t	*wq;
 	work_item_t	*wi;
+	int		remote;
+	double		start;
 
-	wq = (work_queue_t*)arg;
+	dq = (work_deque_t *)arg;
+	wq = dq->queue;
+	pthread_setspecific(worker_key, dq);
+	if (numa_nodes)
+		numa_bind_node(dq->node);
 
 	/*
-	 * Loop pulling work from the passed in work queue.
-	 * Check for notification to exit after every chunk of work.
+	 * Loop pulling work from our own deque, or stealing it from the
+	 * other workers.  Check for notification to exit whenever there is
+	 * no work left anywhere.
 	 */
 	while (1) {
+		wi = get_work(dq, &remote);
+
 		pthread_mutex_lock(&wq->lock);
+		if (wi) {
+			ASSERT(wq->item_count > 0);
+			wq->item_count--;
+			wq->active_count++;
+			wq->items_run++;
+			wq->items_remote += remote;
+			pthread_mutex_unlock(&wq->lock);
+
+			numa_bind_ag(wi->agno);
+			if (metrics_active) {
+				start = metrics_now();
+				(wi->function)(wi->queue, wi->agno, wi->arg);
+				dq->busy += metrics_now() - start;
+			} else
+				(wi->function)(wi->queue, wi->agno, wi->arg);
+			free(wi);
+
+			pthread_mutex_lock(&wq->lock);
+			wq->active_count--;
+			if (wq->terminate && wq->active_count == 0 &&
+			    wq->item_count == 0)
+				pthread_cond_broadcast(&wq->wakeup);
+			pthread_mutex_unlock(&wq->lock);
+			continue;
+		}
 
 		/*
-		 * Wait for work.
+		 * Wait for work.  Items being worked on may still queue
+		 * more, so we can only exit once they have finished too.
+		 * If there is work we didn't find it has just been taken
+		 * by someone else, so go and look again.
 		 */
-		while (wq->next_item == NULL && !wq->terminate) {
-			ASSERT(wq->item_count == 0);
+		while (wq->item_count == 0 &&
+		       !(wq->terminate && wq->active_count == 0))
 			pthread_cond_wait(&wq->wakeup, &wq->lock);
-		}
-		if (wq->next_item == NULL && wq->terminate) {
+		if (wq->item_count == 0) {
 			pthread_mutex_unlock(&wq->lock);
 			break;
 		}
-
-		/*
-		 *  Dequeue work from the head of the list.
-		 */
-		ASSERT(wq->item_count > 0);
-		wi = wq->next_item;
-		wq->next_item = wi->next;
-		wq->item_count--;
-
 		pthread_mutex_unlock(&wq->lock);
-
-		(wi->function)(wi->queue, wi->agno, wi->arg);
-		free(wi);
 	}
 
 	return NULL;
@@ -76,16 +270,27 @@ create_work_queue(
 
 	memset(wq, 0, sizeof(work_queue_t));
 
+	pthread_once(&worker_key_once, worker_key_init);
 	pthread_cond_init(&wq->wakeup, NULL);
 	pthread_mutex_init(&wq->lock, NULL);
 
 	wq->mp = mp;
 	wq->thread_count = nworkers;
 	wq->threads = malloc(nworkers * sizeof(pthread_t));
+	wq->deques = calloc(nworkers, sizeof(work_deque_t));
+	if (!wq->threads || !wq->deques)
+		do_error(_("cannot allocate worker threads\n"));
 	wq->terminate = 0;
 
 	for (i = 0; i < nworkers; i++) {
-		err = pthread_create(&wq->threads[i], NULL, worker_thread, wq);
+		wq->deques[i].queue = wq;
+		wq->deques[i].node = numa_nodes ? i % numa_nodes : 0;
+		pthread_mutex_init(&wq->deques[i].lock, NULL);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		err = pthread_create(&wq->threads[i], NULL, worker_thread,
+				&wq->deques[i]);
 		if (err != 0) {
 			do_error(_("cannot create worker threads, error = [%d] %s\n"),
 				err, strerror(err));
@@ -94,6 +299,31 @@ create_work_queue(
 
 }
 
+/*
+ * Pick the deque for work queued from outside the queue: round robin over
+ * the workers, skipping to the next one on the AG's node if there is one.
+ * Called with the queue lock held.
+ */
+static work_deque_t *
+pick_deque(
+	work_queue_t	*wq,
+	xfs_agnumber_t	agno)
+{
+	int		node = numa_ag_node(agno);
+	int		i;
+	int		n;
+
+	n = wq->next_deque;
+	for (i = 0; numa_nodes && i < wq->thread_count; i++) {
+		if (wq->deques[(n + i) % wq->thread_count].node == node) {
+			n = (n + i) % wq->thread_count;
+			break;
+		}
+	}
+	wq->next_deque = (n + 1) % wq->thread_count;
+	return &wq->deques[n];
+}
+
 void
 queue_work(
 	work_queue_t	*wq,
@@ -102,6 +332,7 @@ queue_work(
 	void		*arg)
 {
 	work_item_t	*wi;
+	work_deque_t	*dq;
 
 	wi = (work_item_t *)malloc(sizeof(work_item_t));
 	if (wi == NULL)
@@ -112,21 +343,18 @@ queue_work(
 	wi->agno = agno;
 	wi->arg = arg;
 	wi->queue = wq;
-	wi->next = NULL;
 
 	/*
-	 *  Now queue the new work structure to the work queue.
+	 *  Now queue the new work structure to the work queue, on the
+	 *  caller's own deque if it is one of our workers.
 	 */
+	dq = pthread_getspecific(worker_key);
 	pthread_mutex_lock(&wq->lock);
-	if (wq->next_item == NULL) {
-		wq->next_item = wi;
-		ASSERT(wq->item_count == 0);
-		pthread_cond_signal(&wq->wakeup);
-	} else {
-		wq->last_item->next = wi;
-	}
-	wq->last_item = wi;
+	if (dq == NULL || dq->queue != wq)
+		dq = pick_deque(wq, agno);
 	wq->item_count++;
+	deque_push(dq, wi);
+	pthread_cond_signal(&wq->wakeup);
 	pthread_mutex_unlock(&wq->lock);
 }
 
@@ -145,6 +373,17 @@ destroy_work_queue(
 	for (i = 0; i < wq->thread_count; i++)
 		pthread_join(wq->threads[i], NULL);
 
+	pthread_mutex_lock(&numa_lock);
+	numa_items_run += wq->items_run;
+	numa_items_remote += wq->items_remote;
+	pthread_mutex_unlock(&numa_lock);
+
+	for (i = 0; i < wq->thread_count; i++)
+		metrics_thread_busy(wq->deques[i].busy);
+
+	for (i = 0; i < wq->thread_count; i++)
+		pthread_mutex_destroy(&wq->deques[i].lock);
+	free(wq->deques);
 	free(wq->threads);
 	pthread_mutex_destroy(&wq->lock);
 	pthread_cond_destroy(&wq->wakeup);
@@ -3,22 +3,54 @@
 
 void	thread_init(void);
 
+/*
+ * With -o numa the AGs are split into contiguous groups, one per NUMA
+ * node, and work on an AG runs on its group's node.  Workers are spread
+ * over the nodes and prefer stealing work from workers on their own node.
+ */
+extern int	numa_nodes;		/* 0 unless NUMA placement is on */
+
+void	numa_init(xfs_agnumber_t agcount);
+int	numa_ag_node(xfs_agnumber_t agno);
+void	numa_bind_ag(xfs_agnumber_t agno);
+void	numa_report(void);
+
 struct  work_queue;
 
 typedef void work_func_t(struct work_queue *, xfs_agnumber_t, void *);
 
 typedef struct work_item {
 	struct work_item	*next;
+	struct work_item	*prev;
 	work_func_t		*function;
 	struct work_queue	*queue;
 	xfs_agnumber_t		agno;
 	void			*arg;
 } work_item_t;
 
+/*
+ * Each worker takes items from the head of its own deque, and when that is
+ * empty steals from the tail of another worker's deque.  Work queued
+ * from outside the queue is spread over the deques round robin; work
+ * queued by a worker, e.g. to split up a large AG, goes on the worker's
+ * own deque so that idle workers steal the pieces it doesn't get to.
+ */
+typedef struct work_deque {
+	work_item_t		*head;
+	work_item_t		*tail;
+	struct work_queue	*queue;
+	int			node;		/* home NUMA node of worker */
+	double			busy;		/* seconds spent in work items */
+	pthread_mutex_t		lock;
+} work_deque_t;
+
 typedef struct  work_queue {
-	work_item_t		*next_item;
-	work_item_t		*last_item;
-	int			item_count;
+	work_deque_t		*deques;	/* one per worker */
+	int			next_deque;	/* round robin for outsiders */
+	int			item_count;	/* queued items */
+	int			active_count;	/* items being worked on */
+	__uint64_t		items_run;	/* total items worked on */
+	__uint64_t		items_remote;	/* stolen across NUMA nodes */
 	int			thread_count;
 	pthread_t		*threads;
 	xfs_mount_t		*mp;
@@ -30,6 +30,11 @@
 #include "prefetch.h"
 #include "threads.h"
 #include "progress.h"
+#include "scratch.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "mem.h"
+#include "scan.h"
 #include "dinode.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
@@ -58,6 +63,30 @@ static char *o_opts[] = {
 	"force_geometry",
 #define PHASE2_THREADS	6
 	"phase2_threads",
+#define IO_DEPTH	7
+	"iodepth",
+#define BCACHE_POLICY	8
+	"bcache_policy",
+#define PF_ADAPTIVE	9
+	"pf_adaptive",
+#define SCRATCH_DIR	10
+	"scratch_dir",
+#define NUMA_PLACEMENT	11
+	"numa",
+#define SCAN_OVERLAP	12
+	"scan_overlap",
+#define CHECKPOINT	13
+	"checkpoint",
+#define METRICS		14
+	"metrics",
+#define PF_VERIFY	15
+	"pf_verify",
+#define HEALTH_CHECK	16
+	"health_check",
+#define HUGEPAGES	17
+	"hugepages",
+#define PROGRESS_FD	18
+	"progress_fd",
 	NULL
 };
 
@@ -72,8 +101,13 @@ static char *c_opts[] = {
 
 
 static int	bhash_option_used;
+static char	*scratch_dir;
+static int	numa_placement;
+static char	*checkpoint_file;
+static char	*metrics_file;
 static long	max_mem_specified;	/* in megabytes */
-static int	phase2_threads = 32;
+static int	phase2_threads;		/* 0 = pick in autotune() */
+static int	io_depth;		/* 0 = synchronous reads */
 
 static void
 usage(void)
@@ -206,9 +240,11 @@ process_args(int argc, char **argv)
 	fs_has_extflgbit_allowed = 1;
 	pre_65_beta = 0;
 	fs_shared_allowed = 1;
+	libxfs_ihash_size = LIBXFS_IHASHSIZE(NULL);
 	ag_stride = 0;
 	thread_count = 1;
 	report_interval = PROG_RPT_DEFAULT;
+	progress_fd = -1;
 
 	/*
 	 * XXX have to add suboption processing here
@@ -241,8 +277,10 @@ process_args(int argc, char **argv)
 					pre_65_beta = 1;
 					break;
 				case IHASH_SIZE:
-					do_warn(
-		_("-o ihash option has been removed and will be ignored\n"));
+					if (!val)
+						do_abort(
+		_("-o ihash requires a parameter\n"));
+					libxfs_ihash_size = (int)strtol(val, NULL, 0);
 					break;
 				case BHASH_SIZE:
 					if (max_mem_specified)
@@ -264,6 +302,103 @@ process_args(int argc, char **argv)
 				case PHASE2_THREADS:
 					phase2_threads = (int)strtol(val, NULL, 0);
 					break;
+				case IO_DEPTH:
+					if (!val)
+						do_abort(
+		_("-o iodepth requires a parameter\n"));
+					io_depth = (int)strtol(val, NULL, 0);
+					break;
+				case BCACHE_POLICY:
+					if (!val)
+						do_abort(
+		_("-o bcache_policy requires a parameter\n"));
+					if (strcmp(val, "clock") == 0)
+						bcache_flags |= CACHE_POLICY_CLOCK;
+					else if (strcmp(val, "mru") == 0)
+						bcache_flags &= ~CACHE_POLICY_CLOCK;
+					else
+						do_abort(
+		_("-o bcache_policy must be \"mru\" or \"clock\"\n"));
+					break;
+				case PF_ADAPTIVE:
+					if (val)
+						noval('o', o_opts, PF_ADAPTIVE);
+					if (pf_adaptive)
+						respec('o', o_opts, PF_ADAPTIVE);
+					pf_adaptive = 1;
+					break;
+				case SCRATCH_DIR:
+					if (!val)
+						do_abort(
+		_("-o scratch_dir requires a parameter\n"));
+					if (scratch_dir)
+						respec('o', o_opts, SCRATCH_DIR);
+					scratch_dir = val;
+					break;
+				case NUMA_PLACEMENT:
+					if (val)
+						noval('o', o_opts, NUMA_PLACEMENT);
+					if (numa_placement)
+						respec('o', o_opts, NUMA_PLACEMENT);
+					numa_placement = 1;
+					break;
+				case SCAN_OVERLAP:
+					if (val)
+						noval('o', o_opts, SCAN_OVERLAP);
+					if (scan_overlap)
+						respec('o', o_opts, SCAN_OVERLAP);
+					scan_overlap = 1;
+					break;
+				case CHECKPOINT:
+					if (!val)
+						do_abort(
+		_("-o checkpoint requires a parameter\n"));
+					if (checkpoint_file)
+						respec('o', o_opts, CHECKPOINT);
+					checkpoint_file = val;
+					break;
+				case METRICS:
+					if (!val)
+						do_abort(
+		_("-o metrics requires a parameter\n"));
+					if (metrics_file)
+						respec('o', o_opts, METRICS);
+					metrics_file = val;
+					break;
+				case PF_VERIFY:
+					if (val)
+						noval('o', o_opts, PF_VERIFY);
+					if (pf_verify)
+						respec('o', o_opts, PF_VERIFY);
+					pf_verify = 1;
+					break;
+				case HEALTH_CHECK:
+					if (val)
+						noval('o', o_opts, HEALTH_CHECK);
+					if (health_check)
+						respec('o', o_opts, HEALTH_CHECK);
+					health_check = 1;
+					break;
+				case HUGEPAGES:
+					if (val)
+						noval('o', o_opts, HUGEPAGES);
+					if (libxfs_buf_hugepages)
+						respec('o', o_opts, HUGEPAGES);
+					libxfs_buf_hugepages = 1;
+					break;
+				case PROGRESS_FD:
+					if (!val)
+						do_abort(
+		_("-o progress_fd requires a parameter\n"));
+					if (progress_fd >= 0)
+						respec('o', o_opts, PROGRESS_FD);
+					progress_fd = (int)strtol(val, NULL, 0);
+					if (progress_fd < 0 ||
+					    fcntl(progress_fd, F_GETFD) < 0)
+						do_abort(
+		_("-o progress_fd: %s is not an open file descriptor\n"),
+							val);
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -329,6 +464,9 @@ process_args(int argc, char **argv)
 		}
 	}
 
+	if (health_check && !no_modify)
+		do_abort(_("-o health_check can only be used with -n\n"));
+
 	if (argc - optind != 1)
 		usage();
 
@@ -366,18 +504,27 @@ do_abort(char const *msg, ...)
 	exit(1);
 }
 
+static __thread unsigned long	warn_count;
+
 void
 do_warn(char const *msg, ...)
 {
 	va_list args;
 
 	fs_is_dirty = 1;
+	warn_count++;
 
 	va_start(args, msg);
 	vfprintf(stderr, msg, args);
 	va_end(args);
 }
 
+unsigned long
+do_warn_count(void)
+{
+	return warn_count;
+}
+
 /* no formatting */
 
 void
@@ -531,6 +678,92 @@ _("sb realtime summary inode %" PRIu64 " %sinconsistent with calculated value %u
 
 }
 
+/*
+ * Work out how many AGs to process at once, how many prefetch I/O threads
+ * each of them gets and how many threads scan the AG headers in phase 2,
+ * for whatever of those wasn't given on the command line.
+ *
+ * Spinning disks can't do much more than a couple of streams each before
+ * seeking between them costs more than the extra streams bring, so it's
+ * two AGs at a time for each disk the device is built from, each with few
+ * I/O threads.  Solid state storage has I/O to spare and the CPUs become
+ * the limit, so it's an AG per CPU with the usual number of I/O threads.
+ * If we can't tell, more AGs suggest either a large filesystem or storage
+ * that can take more I/O parallelism, and a stride of 15 is chosen to get
+ * at least 2 AGs being scanned at once on a 16 AG "multidisk" mkfs.
+ *
+ * Every AG in flight holds its prefetched buffers, so there are no more of
+ * them than the memory repair may use allows for.  We also limit to 8
+ * threads/CPU, which is enough to saturate a CPU on fast devices, yet few
+ * enough not to overload slow devices.
+ */
+#define AUTOTUNE_AG_KB		(64 * 1024)	/* memory per AG in flight */
+
+static void
+autotune(
+	struct xfs_mount	*mp)
+{
+	int			ncpus = libxfs_nproc();
+	int			max_threads = ncpus * 8;
+	int			rotational;
+	int			ndevs;
+	int			want = 0;
+	unsigned long		mem_kb;
+
+	if (platform_device_topology(
+			libxfs_device_to_fd(mp->m_ddev_targp->dev),
+			&rotational, &ndevs) < 0) {
+		rotational = -1;
+		ndevs = 1;
+	}
+	mem_kb = max_mem_specified ? max_mem_specified * 1024 :
+				     libxfs_physmem() * 3 / 4;
+	max_threads = min(max_threads, (int)max(mem_kb / AUTOTUNE_AG_KB, 1UL));
+
+	if (!ag_stride && do_prefetch) {
+		if (rotational == 1) {
+			want = 2 * ndevs;
+			pf_io_threads = min(2 * ndevs, PF_THREAD_MAX);
+		} else if (rotational == 0) {
+			want = ncpus;
+		} else if (glob_agcount >= 16) {
+			ag_stride = 15;
+		}
+		want = min(want, max_threads);
+		if (want > 1)
+			ag_stride = howmany(glob_agcount, want);
+	}
+
+	if (ag_stride) {
+		thread_count = howmany(glob_agcount, ag_stride);
+		while (thread_count > max_threads) {
+			ag_stride *= 2;
+			thread_count = howmany(glob_agcount, ag_stride);
+		}
+		if (thread_count > 0)
+			thread_init();
+		else {
+			thread_count = 1;
+			ag_stride = 0;
+		}
+	}
+
+	if (!phase2_threads) {
+		if (rotational == 1)
+			phase2_threads = min(32, 4 * ndevs);
+		else
+			phase2_threads = 32;
+	}
+
+	if (verbose)
+		do_log(
+	_("        - %s storage, %d device(s), %d CPUs: ag_stride %d (%d threads), %d prefetch I/O threads, %d scan threads\n"),
+			rotational == 1 ? _("rotational") :
+			rotational == 0 ? _("solid state") : _("unknown"),
+			ndevs, ncpus, ag_stride, thread_count, pf_io_threads,
+			phase2_threads);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -542,6 +775,7 @@ main(int argc, char **argv)
 	char		*msgbuf;
 	struct xfs_sb	psb;
 	int		rval;
+	int		resume_phase;
 
 	progname = basename(argv[0]);
 	setlocale(LC_ALL, "");
@@ -557,6 +791,8 @@ main(int argc, char **argv)
 
 	msgbuf = malloc(DURATION_BUF_SIZE);
 
+	if (metrics_file)
+		metrics_init(metrics_file);
 	timestamp(PHASE_START, 0, NULL);
 	timestamp(PHASE_END, 0, NULL);
 
@@ -631,6 +867,21 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+	/*
+	 * Queue metadata reads with asynchronous I/O if asked to, so that
+	 * prefetch can keep many reads in flight on fast devices.
+	 */
+	if (io_depth > 0) {
+		if (libxfs_buftarg_set_ioengine(mp->m_ddev_targp,
+				LIBXFS_IOENGINE_AIO, io_depth))
+			do_warn(
+	_("couldn't set up asynchronous I/O, using synchronous reads\n"));
+		else if (verbose && libxfs_buftarg_queued_io(mp->m_ddev_targp))
+			do_log(_("        - using %s I/O, queue depth %d\n"),
+				libxfs_ioengine_name(mp->m_ddev_targp),
+				mp->m_ddev_targp->bt_ioengine->ie_depth);
+	}
+
 	/*
 	 * set XFS-independent status vars from the mount/sb structure
 	 */
@@ -642,47 +893,17 @@ main(int argc, char **argv)
 			mp->m_inode_cluster_size >> mp->m_sb.sb_inodelog);
 
 	/*
-	 * Automatic striding for high agcount filesystems.
-	 *
-	 * More AGs indicates that the filesystem is either large or can handle
-	 * more IO parallelism. Either way, we should try to process multiple
-	 * AGs at a time in such a configuration to try to saturate the
-	 * underlying storage and speed the repair process. Only do this if
-	 * prefetching is enabled.
-	 *
-	 * Given mkfs defaults for 16AGs for "multidisk" configurations, we want
-	 * to target these for an increase in thread count. Hence a stride value
-	 * of 15 is chosen to ensure we get at least 2 AGs being scanned at once
-	 * on such filesystems.
-	 *
-	 * Limit the maximum thread count based on the available CPU power that
-	 * is available. If we use too many threads, we might run out of memory
-	 * and CPU power before we run out of IO concurrency. We limit to 8
-	 * threads/CPU as this is enough threads to saturate a CPU on fast
-	 * devices, yet few enough that it will saturate but won't overload slow
-	 * devices.
+	 * Progress is reported on filesystems big enough to have been
+	 * strided by default before autotune() strided small ones too, or
+	 * when asked for.
 	 */
-	if (!ag_stride && glob_agcount >= 16 && do_prefetch)
-		ag_stride = 15;
+	progress_rpt = report_interval &&
+		(ag_stride || (glob_agcount >= 16 && do_prefetch) ||
+		 progress_fd >= 0);
 
-	if (ag_stride) {
-		int max_threads = platform_nproc() * 8;
+	autotune(mp);
 
-		thread_count = (glob_agcount + ag_stride - 1) / ag_stride;
-		while (thread_count > max_threads) {
-			ag_stride *= 2;
-			thread_count = (glob_agcount + ag_stride - 1) /
-								ag_stride;
-		}
-		if (thread_count > 0)
-			thread_init();
-		else {
-			thread_count = 1;
-			ag_stride = 0;
-		}
-	}
-
-	if (ag_stride && report_interval) {
+	if (progress_rpt) {
 		init_progress_rpt();
 		if (msgbuf) {
 			do_log(_("        - reporting progress in intervals of %s\n"),
@@ -702,20 +923,25 @@ main(int argc, char **argv)
 	 *
 	 * We assume most blocks will be inode clusters.
 	 *
+	 * With a scratch directory the inode tree and block usage map
+	 * live in the scratch file instead, so they don't count.
+	 *
 	 * Calculations are done in kilobyte units.
 	 */
 
 	if (!bhash_option_used || max_mem_specified) {
 		unsigned long 	mem_used;
 		unsigned long	max_mem;
+		unsigned long	budget;
 		struct rlimit	rlim;
 
 		libxfs_bcache_purge();
 		cache_destroy(libxfs_bcache);
 
-		mem_used = (mp->m_sb.sb_icount >> (10 - 2)) +
-					(mp->m_sb.sb_dblocks >> (10 + 1)) +
-					50000;	/* rough estimate of 50MB overhead */
+		mem_used = 50000;	/* rough estimate of 50MB overhead */
+		if (!scratch_dir)
+			mem_used += (mp->m_sb.sb_icount >> (10 - 2)) +
+					(mp->m_sb.sb_dblocks >> (10 + 1));
 		max_mem = max_mem_specified ? max_mem_specified * 1024 :
 						libxfs_physmem() * 3 / 4;
 
@@ -759,6 +985,7 @@ main(int argc, char **argv)
 			max_mem = mem_used;
 		}
 
+		budget = max_mem - 50000;
 		max_mem -= mem_used;
 		if (max_mem >= (1 << 30))
 			max_mem = 1 << 30;
@@ -771,8 +998,14 @@ main(int argc, char **argv)
 			do_log(_("        - block cache size set to %d entries\n"),
 				libxfs_bhash_size * HASH_CACHE_RATIO);
 
-		libxfs_bcache = cache_init(0, libxfs_bhash_size,
+		libxfs_bcache = cache_init(bcache_flags, libxfs_bhash_size,
 						&libxfs_bcache_operations);
+
+		/*
+		 * The estimate above is only a guess; count what the incore
+		 * structures really use and shrink the cache to make room.
+		 */
+		mem_init(budget, mp->m_inode_cluster_size);
 	}
 
 	/*
@@ -780,6 +1013,11 @@ main(int argc, char **argv)
 	 */
 	calc_mkfs(mp);
 
+	if (numa_placement)
+		numa_init(mp->m_sb.sb_agcount);
+	if (scratch_dir)
+		scratch_init(scratch_dir, mp->m_sb.sb_agcount);
+
 	/*
 	 * initialize block alloc map
 	 */
@@ -796,32 +1034,55 @@ main(int argc, char **argv)
 		return(1);
 	}
 
+	checkpoint_init(checkpoint_file);
+	resume_phase = checkpoint_resume(mp);
+
 	/* make sure the per-ag freespace maps are ok so we can mount the fs */
-	phase2(mp, phase2_threads);
-	timestamp(PHASE_END, 2, NULL);
+	if (resume_phase < 3) {
+		phase2(mp, phase2_threads);
+		timestamp(PHASE_END, 2, NULL);
+	} else
+		set_mp(mp);
 
 	if (do_prefetch)
 		init_prefetch(mp);
 
-	phase3(mp);
-	timestamp(PHASE_END, 3, NULL);
+	if (resume_phase < 3) {
+		phase3(mp);
+		timestamp(PHASE_END, 3, NULL);
+		checkpoint_write(mp, 3);
+	}
 
-	phase4(mp);
-	timestamp(PHASE_END, 4, NULL);
+	if (resume_phase < 4) {
+		phase4(mp);
+		timestamp(PHASE_END, 4, NULL);
+		checkpoint_write(mp, 4);
+	}
 
-	if (no_modify)
-		printf(_("No modify flag set, skipping phase 5\n"));
-	else {
-		phase5(mp);
+	if (resume_phase < 5) {
+		if (no_modify)
+			printf(_("No modify flag set, skipping phase 5\n"));
+		else {
+			phase5(mp);
+		}
+		timestamp(PHASE_END, 5, NULL);
+		checkpoint_write(mp, 5);
 	}
-	timestamp(PHASE_END, 5, NULL);
 
 	/*
 	 * Done with the block usage maps, toss them...
 	 */
 	free_bmaps(mp);
 
-	if (!bad_ino_btree)  {
+	if (health_check)  {
+		do_log(
+_("Health check mode, skipping phases 6 and 7\n"));
+	} else if (!bad_ino_btree)  {
+		/*
+		 * Phases 3 and 4 fix inodes directly in their buffers, make
+		 * sure phase 6 doesn't see an older in-core copy.
+		 */
+		libxfs_icache_purge();
 		phase6(mp);
 		timestamp(PHASE_END, 6, NULL);
 
@@ -886,14 +1147,19 @@ _("Warning:  project quota information would be cleared.\n"
 		}
 	}
 
-	if (ag_stride && report_interval)
+	if (progress_rpt)
 		stop_progress_rpt();
 
 	if (no_modify)  {
 		do_log(
 	_("No modify flag set, skipping filesystem flush and exiting.\n"));
-		if (verbose)
+		if (verbose) {
 			summary_report();
+			numa_report();
+			mem_report();
+		}
+		checkpoint_remove();
+		metrics_finish();
 		if (fs_is_dirty)
 			return(1);
 
@@ -936,8 +1202,13 @@ _("Note - stripe unit (%d) and width (%d) were copied from a backup superblock.\
 		libxfs_device_close(x.logdev);
 	libxfs_device_close(x.ddev);
 
-	if (verbose)
+	checkpoint_remove();
+	metrics_finish();
+	if (verbose) {
 		summary_report();
+		numa_report();
+		mem_report();
+	}
 	do_log(_("done\n"));
 
 	if (dangerously && !no_modify)
@@ -17,37 +17,99 @@
  */
 
 #include "libxfs.h"
+#include <pthread.h>
 
 int rtcp(char *, char *, int);
 int xfsrtextsize(char *path);
 
+#define	RTCP_BUFSIZE	(1024 * 1024)
+#define	RTCP_NBUFS	4		/* read ahead of the writes */
+#define	RTCP_MAXJOBS	64
+
 int pflag;
+int bufsize = RTCP_BUFSIZE;
 char *progname;
 
 void
 usage(void)
 {
-	fprintf(stderr, _("%s [-e extsize] [-p] [-V] source target\n"), progname);
+	fprintf(stderr, _("%s [-e extsize] [-b bufsize] [-j jobs] [-p] [-V] "
+			  "source target\n"), progname);
 	exit(2);
 }
 
+/*
+ * With -j, several files are copied at once, each thread taking the next
+ * source not yet started.
+ */
+struct rtcp_jobs {
+	pthread_mutex_t	lock;
+	char		**argv;
+	int		nsrc;
+	int		next;
+	int		extsize;
+	int		errors;
+};
+
+static void *
+rtcp_thread(void *arg)
+{
+	struct rtcp_jobs *jobs = arg;
+	int		i, r;
+
+	for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		if (i >= jobs->nsrc)
+			break;
+		r = rtcp(jobs->argv[i], jobs->argv[jobs->nsrc], jobs->extsize);
+		if (r) {
+			pthread_mutex_lock(&jobs->lock);
+			jobs->errors++;
+			pthread_mutex_unlock(&jobs->lock);
+		}
+	}
+	return NULL;
+}
+
 int
 main(int argc, char **argv)
 {
 	int	c, i, r, errflg = 0;
 	struct stat64	s2;
 	int		extsize = - 1;
+	int		njobs = 1;
+	struct rtcp_jobs jobs;
+	pthread_t	tids[RTCP_MAXJOBS];
 
 	progname = basename(argv[0]);
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "pe:V")) != EOF) {
+	while ((c = getopt(argc, argv, "b:e:j:pV")) != EOF) {
 		switch (c) {
+		case 'b':
+			bufsize = atoi(optarg);
+			if (bufsize <= 0) {
+				fprintf(stderr, _("%s: bad buffer size %s\n"),
+					progname, optarg);
+				errflg++;
+			}
+			break;
 		case 'e':
 			extsize = atoi(optarg);
 			break;
+		case 'j':
+			njobs = atoi(optarg);
+			if (njobs <= 0 || njobs > RTCP_MAXJOBS) {
+				fprintf(stderr,
+					_("%s: jobs must be 1 to %d\n"),
+					progname, RTCP_MAXJOBS);
+				errflg++;
+			}
+			break;
 		case 'p':
 			pflag = 1;
 			break;
@@ -99,8 +161,26 @@ main(int argc, char **argv)
 	 * multiple invocations of rtcp().
 	 */
 	r = 0;
-	for (i = 0; i < argc-1; i++)
-		r += rtcp(argv[i], argv[argc-1], extsize);
+	njobs = min(njobs, argc - 1);
+	if (njobs == 1) {
+		for (i = 0; i < argc-1; i++)
+			r += rtcp(argv[i], argv[argc-1], extsize);
+	} else {
+		memset(&jobs, 0, sizeof(jobs));
+		pthread_mutex_init(&jobs.lock, NULL);
+		jobs.argv = argv;
+		jobs.nsrc = argc - 1;
+		jobs.extsize = extsize;
+		for (i = 0; i < njobs; i++)
+			if (pthread_create(&tids[i], NULL, rtcp_thread, &jobs))
+				break;
+		njobs = i;
+		if (!njobs)
+			rtcp_thread(&jobs);
+		for (i = 0; i < njobs; i++)
+			pthread_join(tids[i], NULL);
+		r = jobs.errors;
+	}
 
 	/*
 	 * Show errors by nonzero exit code.
@@ -108,12 +188,160 @@ main(int argc, char **argv)
 	exit(r?2:0);
 }
 
+/*
+ * The source is read by a separate thread into a ring of buffers, so
+ * that the next reads are already under way while a buffer is written.
+ */
+struct rtcp_buf {
+	char		*data;
+	ssize_t		len;		/* read, 0 at EOF, -1 on error */
+	int		full;
+};
+
+struct rtcp_pipe {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		fromfd;
+	int		iosz;
+	int		stop;		/* the writer gave up */
+	int		error;		/* errno of a failed read */
+	struct rtcp_buf	bufs[RTCP_NBUFS];
+};
+
+static void *
+rtcp_reader(void *arg)
+{
+	struct rtcp_pipe *pp = arg;
+	struct rtcp_buf	*b;
+	ssize_t		len;
+	int		i, stop;
+
+	for (i = 0; ; i = (i + 1) % RTCP_NBUFS) {
+		b = &pp->bufs[i];
+		pthread_mutex_lock(&pp->lock);
+		while (b->full && !pp->stop)
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		stop = pp->stop;
+		pthread_mutex_unlock(&pp->lock);
+		if (stop)
+			break;
+
+		len = read(pp->fromfd, b->data, pp->iosz);
+
+		pthread_mutex_lock(&pp->lock);
+		b->len = len;
+		if (len < 0)
+			pp->error = errno;
+		b->full = 1;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		if (len <= 0)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Copy fromfd to tofd in iosz pieces, padding the last one out to a
+ * multiple of miniosz.
+ */
+static int
+rtcp_copy(
+	int		fromfd,
+	int		tofd,
+	int		iosz,
+	int		miniosz,
+	int		memalign_sz)
+{
+	struct rtcp_pipe pp;
+	struct rtcp_buf	*b;
+	pthread_t	reader;
+	ssize_t		len, writect;
+	int		i, error = 0;
+
+	memset(&pp, 0, sizeof(pp));
+	pthread_mutex_init(&pp.lock, NULL);
+	pthread_cond_init(&pp.cond, NULL);
+	pp.fromfd = fromfd;
+	pp.iosz = iosz;
+	for (i = 0; i < RTCP_NBUFS; i++) {
+		pp.bufs[i].data = memalign(memalign_sz, iosz);
+		if (!pp.bufs[i].data) {
+			fprintf(stderr, _("%s: cannot allocate buffers: %s\n"),
+				progname, strerror(errno));
+			error = -1;
+			goto out_free;
+		}
+	}
+	if (pthread_create(&reader, NULL, rtcp_reader, &pp)) {
+		fprintf(stderr, _("%s: cannot start reader thread\n"),
+			progname);
+		error = -1;
+		goto out_free;
+	}
+
+	for (i = 0; ; i = (i + 1) % RTCP_NBUFS) {
+		b = &pp.bufs[i];
+		pthread_mutex_lock(&pp.lock);
+		while (!b->full)
+			pthread_cond_wait(&pp.cond, &pp.lock);
+		pthread_mutex_unlock(&pp.lock);
+
+		len = b->len;
+		if (len < 0) {
+			fprintf(stderr, _("%s: read error: %s\n"),
+				progname, strerror(pp.error));
+			error = -1;
+			break;
+		}
+		if (len == 0)
+			break;
+
+		/*
+		 * if there is a short read, pad to a block boundary
+		 */
+		if (len % miniosz) {
+			writect = ((len / miniosz) + 1) * miniosz;
+			memset(b->data + len, 0, writect - len);
+			len = writect;
+		}
+
+		/*
+		 * write to target file
+		 */
+		writect = write(tofd, b->data, len);
+		if (writect != len) {
+			fprintf(stderr, _("%s: write error: %s\n"),
+				progname, strerror(errno));
+			error = -1;
+			break;
+		}
+
+		pthread_mutex_lock(&pp.lock);
+		b->full = 0;
+		pthread_cond_broadcast(&pp.cond);
+		pthread_mutex_unlock(&pp.lock);
+	}
+
+	pthread_mutex_lock(&pp.lock);
+	pp.stop = 1;
+	pthread_cond_broadcast(&pp.cond);
+	pthread_mutex_unlock(&pp.lock);
+	pthread_join(reader, NULL);
+out_free:
+	for (i = 0; i < RTCP_NBUFS; i++)
+		free(pp.bufs[i].data);
+	pthread_cond_destroy(&pp.cond);
+	pthread_mutex_destroy(&pp.lock);
+	return error;
+}
+
 int
 rtcp( char *source, char *target, int fextsize)
 {
-	int		fromfd, tofd, readct, writect, iosz, reopen;
+	int		fromfd, tofd, iosz, reopen, error;
 	int		remove = 0, rtextsize;
-	char		*sp, *fbuf, *ptr;
+	char		*sp, *ptr;
 	char		tbuf[ PATH_MAX ];
 	struct stat64	s1, s2;
 	struct fsxattr	fsxattr;
@@ -326,52 +554,18 @@ rtcp( char *source, char *target, int fextsize)
 		}
 	}
 
-	iosz =  dioattr.d_miniosz;
-	fbuf = memalign( dioattr.d_mem, iosz);
-	memset(fbuf, 0, iosz);
-
 	/*
-	 * read the entire source file
+	 * copy in large pieces, a multiple of the minimum direct I/O size
 	 */
-	while ( ( readct = read( fromfd, fbuf, iosz) ) != 0 ) {
-		/*
-		 * if there is a read error - break
-		 */
-		if (readct < 0 ) {
-			break;
-		}
-
-		/*
-		 * if there is a short read, pad to a block boundary
-		 */
-		if ( readct != iosz ) {
-			if ( (readct % dioattr.d_miniosz)  != 0 )  {
-				readct = ( (readct/dioattr.d_miniosz) + 1 ) *
-					 dioattr.d_miniosz;
-			}
-		}
+	iosz = min(bufsize, dioattr.d_maxiosz);
+	iosz = max(iosz - iosz % (int)dioattr.d_miniosz, (int)dioattr.d_miniosz);
 
-		/*
-		 * write to target file
-		 */
-		writect = write( tofd, fbuf, readct);
-
-		if ( writect != readct ) {
-			fprintf(stderr, _("%s: write error: %s\n"),
-				progname, strerror(errno));
-			close(fromfd);
-			close(tofd);
-			free( fbuf );
-			return( -1 );
-		}
-
-		memset( fbuf, 0, iosz);
-	}
+	error = rtcp_copy(fromfd, tofd, iosz, dioattr.d_miniosz,
+			  dioattr.d_mem);
 
 	close(fromfd);
 	close(tofd);
-	free( fbuf );
-	return( 0 );
+	return error;
 }
 
 /*